@@ -0,0 +1,249 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Benchmarks of OpenCL stages. They all operate on a single bucket of
+ * @ref Bench::Context::cells cells on a side containing splats on a sphere,
+ * as used for autotuning.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS 1
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <vector>
+#include <algorithm>
+#include <boost/scoped_ptr.hpp>
+#include "benchutil.h"
+#include "../src/tr1_cstdint.h"
+#include "../src/splat_tree_cl.h"
+#include "../src/mls.h"
+#include "../src/marching.h"
+#include "../src/mesh.h"
+#include "../src/clh.h"
+#include "../src/misc.h"
+
+namespace
+{
+
+/// Octree levels, as for the default of @c --levels
+const unsigned int levels = 6;
+
+/// Marching output functor that discards the mesh
+void discardMesh(const cl::CommandQueue &queue, const DeviceKeyMesh &mesh,
+                 const std::vector<cl::Event> *events, cl::Event *event)
+{
+    (void) mesh;
+    if (event != NULL)
+        CLH::enqueueMarkerWithWaitList(queue, events, event);
+}
+
+} // anonymous namespace
+
+/**
+ * Common setup: uploads the splats of one bucket and creates an octree
+ * for them.
+ */
+class BenchBucket : public Bench::Benchmark
+{
+protected:
+    cl::CommandQueue queue;
+    cl::Buffer splats;
+    std::size_t numSplats;
+    Grid::size_type block;           ///< Vertices along each side of the bucket
+    Grid::size_type expandedSize[3]; ///< @ref block rounded up to the MLS alignment
+    unsigned int subsampling;
+    boost::scoped_ptr<SplatTreeCL> tree;
+
+    /// Build the octree and wait for it to complete
+    void build();
+
+public:
+    virtual bool needsCL() const { return true; }
+    virtual void setUp(const Bench::Context &context);
+    virtual void tearDown();
+};
+
+void BenchBucket::setUp(const Bench::Context &context)
+{
+    queue = context.queue;
+    block = context.cells + 1;
+    subsampling = MlsFunctor::subsamplingMin;
+    while ((Grid::size_type(1) << (levels + subsampling - 1)) <= context.cells)
+        subsampling++;
+    for (unsigned int i = 0; i < 3; i++)
+        expandedSize[i] = roundUp(block, MlsFunctor::wgs[i]);
+
+    std::vector<Splat> hSplats = Bench::makeSphereSplats(context.cells, context.splats);
+    numSplats = hSplats.size();
+    std::vector<char> deviceSplats(numSplats * splatDeviceSize(SPLAT_LAYOUT_FULL));
+    storeSplats(SPLAT_LAYOUT_FULL, &hSplats[0], numSplats, &deviceSplats[0]);
+    splats = cl::Buffer(context.context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        deviceSplats.size(), &deviceSplats[0]);
+    tree.reset(new SplatTreeCL(context.context, context.device, levels, numSplats));
+}
+
+void BenchBucket::build()
+{
+    const Grid::difference_type offset[3] = { 0, 0, 0 };
+    tree->enqueueBuild(queue, splats, 0, numSplats, expandedSize, offset, subsampling);
+    queue.finish();
+}
+
+void BenchBucket::tearDown()
+{
+    tree.reset();
+    splats = NULL;
+    queue = NULL;
+}
+
+/// Octree construction by @ref SplatTreeCL::enqueueBuild
+class BenchSplatTreeBuild : public BenchBucket
+{
+public:
+    virtual void run() { build(); }
+    virtual std::tr1::uint64_t items() const { return numSplats; }
+    virtual std::string unit() const { return "splats"; }
+};
+BENCH_REGISTER(BenchSplatTreeBuild, "splattree.build");
+
+/**
+ * Evaluation of the signed distance function by @ref MlsFunctor::enqueue,
+ * for as many slices of the bucket as fit in one image.
+ */
+class BenchMlsEnqueue : public BenchBucket
+{
+private:
+    boost::scoped_ptr<MlsFunctor> input;
+    cl::Image2D distance;
+    Marching::Swathe swathe;
+
+public:
+    virtual void setUp(const Bench::Context &context);
+    virtual void run();
+    virtual void tearDown();
+    virtual std::tr1::uint64_t items() const
+    {
+        return std::tr1::uint64_t(swathe.width) * swathe.height * (swathe.zLast - swathe.zFirst + 1);
+    }
+    virtual std::string unit() const { return "vertices"; }
+};
+BENCH_REGISTER(BenchMlsEnqueue, "mls.enqueue");
+
+void BenchMlsEnqueue::setUp(const Bench::Context &context)
+{
+    BenchBucket::setUp(context);
+    build();
+
+    const Grid::difference_type offset[3] = { 0, 0, 0 };
+    input.reset(new MlsFunctor(context.context, MLS_SHAPE_SPHERE));
+    input->set(offset, *tree, subsampling);
+
+    // Limit the number of slices to keep within the minimum image height
+    const Grid::size_type maxHeight = 8192;
+    const Grid::size_type zAlign = input->alignment()[2];
+    swathe.width = block;
+    swathe.height = block;
+    swathe.zStride = roundUp(block, input->alignment()[1]);
+    swathe.zBias = 0;
+    swathe.rowPitch = 0;
+    swathe.zFirst = 0;
+    Grid::size_type slices = std::max(zAlign, maxHeight / swathe.zStride / zAlign * zAlign);
+    slices = std::min(slices, roundUp(block, zAlign));
+    swathe.zLast = std::min(block, slices) - 1;
+    distance = cl::Image2D(context.context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT),
+                           roundUp(block, input->alignment()[0]), slices * swathe.zStride);
+}
+
+void BenchMlsEnqueue::run()
+{
+    input->enqueue(queue, distance, swathe, NULL, NULL);
+    queue.finish();
+}
+
+void BenchMlsEnqueue::tearDown()
+{
+    distance = cl::Image2D();
+    input.reset();
+    BenchBucket::tearDown();
+}
+
+/**
+ * Isosurface extraction by @ref Marching::generate, including the
+ * evaluation of the signed distance function. The mesh is discarded.
+ */
+class BenchMarchingGenerate : public BenchBucket
+{
+private:
+    boost::scoped_ptr<MlsFunctor> input;
+    boost::scoped_ptr<Marching> marching;
+    std::tr1::uint64_t cells;
+
+public:
+    virtual void setUp(const Bench::Context &context);
+    virtual void run();
+    virtual void tearDown();
+    virtual std::tr1::uint64_t items() const { return cells; }
+    virtual std::string unit() const { return "cells"; }
+};
+BENCH_REGISTER(BenchMarchingGenerate, "marching.generate");
+
+void BenchMarchingGenerate::setUp(const Bench::Context &context)
+{
+    BenchBucket::setUp(context);
+    build();
+
+    const Grid::difference_type offset[3] = { 0, 0, 0 };
+    input.reset(new MlsFunctor(context.context, MLS_SHAPE_SPHERE));
+    input->set(offset, *tree, subsampling);
+
+    // Largest swathe whose slices fit within the minimum image height
+    const Grid::size_type maxHeight = 8192;
+    const Grid::size_type zAlign = input->alignment()[2];
+    const Grid::size_type y = roundUp(block, input->alignment()[1]);
+    Grid::size_type maxSwathe = zAlign;
+    if (maxHeight >= y)
+        maxSwathe = std::max(Grid::size_type(1), (maxHeight - y) / (y * zAlign)) * zAlign;
+
+    const std::size_t meshMemory = std::size_t(context.cells) * context.cells * 2 * Marching::MAX_CELL_BYTES;
+    marching.reset(new Marching(context.context, context.device, block, block, block,
+                                maxSwathe, meshMemory, input->alignment()));
+    cells = std::tr1::uint64_t(context.cells) * context.cells * context.cells;
+}
+
+void BenchMarchingGenerate::run()
+{
+    const Grid::size_type size[3] = { block, block, block };
+    const cl_uint3 keyOffset = {{ 0, 0, 0 }};
+    marching->generate(queue, *input, discardMesh, size, keyOffset);
+    queue.finish();
+}
+
+void BenchMarchingGenerate::tearDown()
+{
+    marching.reset();
+    input.reset();
+    BenchBucket::tearDown();
+}
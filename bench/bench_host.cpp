@@ -0,0 +1,365 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Benchmarks of host-side stages.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS 1
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <boost/array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "benchutil.h"
+#include "../src/tr1_cstdint.h"
+#include "../src/fast_ply.h"
+#include "../src/splat_set.h"
+#include "../src/splat_set_impl.h"
+#include "../src/mesher.h"
+#include "../src/mesh.h"
+#include "../src/misc.h"
+#include "../src/timeplot.h"
+
+/**
+ * Decoding of raw vertices by @ref FastPly::Reader. A PLY file of splats is
+ * written to a temporary file and read into memory during setup, so only
+ * the decoding is timed.
+ */
+class BenchFastPlyDecode : public Bench::Benchmark
+{
+private:
+    boost::filesystem::path path;
+    boost::scoped_ptr<FastPly::Reader> reader;
+    std::vector<char> raw;
+    std::vector<Splat> out;
+
+public:
+    virtual void setUp(const Bench::Context &context);
+    virtual void run();
+    virtual void tearDown();
+    virtual std::tr1::uint64_t items() const { return out.size(); }
+    virtual std::string unit() const { return "splats"; }
+};
+BENCH_REGISTER(BenchFastPlyDecode, "fastply.decode");
+
+void BenchFastPlyDecode::setUp(const Bench::Context &context)
+{
+    const std::vector<Splat> splats = Bench::makeSphereSplats(context.cells, context.splats);
+    {
+        boost::filesystem::ofstream f;
+        createTmpFile(path, f);
+        f << "ply\n"
+            "format binary_little_endian 1.0\n"
+            "element vertex " << splats.size() << "\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property float nx\n"
+            "property float ny\n"
+            "property float nz\n"
+            "property float radius\n"
+            "end_header\n";
+        for (std::size_t i = 0; i < splats.size(); i++)
+        {
+            f.write(reinterpret_cast<const char *>(splats[i].position), 3 * sizeof(float));
+            f.write(reinterpret_cast<const char *>(splats[i].normal), 3 * sizeof(float));
+            f.write(reinterpret_cast<const char *>(&splats[i].radius), sizeof(float));
+        }
+    }
+
+    reader.reset(new FastPly::Reader(SYSCALL_READER, path, 1.0f, std::numeric_limits<float>::infinity()));
+    raw.resize(reader->size() * reader->getVertexSize());
+    FastPly::Reader::Handle handle(*reader);
+    handle.readRaw(0, reader->size(), &raw[0]);
+    out.resize(reader->size());
+}
+
+void BenchFastPlyDecode::run()
+{
+    const std::size_t block = 65536;
+    for (std::size_t first = 0; first < out.size(); first += block)
+    {
+        const std::size_t count = std::min(block, out.size() - first);
+        reader->decode(&raw[0], first, count, &out[first]);
+    }
+}
+
+void BenchFastPlyDecode::tearDown()
+{
+    reader.reset();
+    boost::filesystem::remove(path);
+}
+
+/**
+ * Computation of bucket ranges by @ref SplatSet::detail::SplatToBuckets,
+ * using the batched form as the blob set does.
+ */
+class BenchSplatToBuckets : public Bench::Benchmark
+{
+private:
+    std::vector<Splat> splats;
+    std::vector<boost::array<Grid::difference_type, 3> > lower, upper;
+    boost::scoped_ptr<SplatSet::detail::SplatToBuckets> toBuckets;
+
+public:
+    virtual void setUp(const Bench::Context &context);
+    virtual void run();
+    virtual std::tr1::uint64_t items() const { return splats.size(); }
+    virtual std::string unit() const { return "splats"; }
+};
+BENCH_REGISTER(BenchSplatToBuckets, "splat_to_buckets");
+
+void BenchSplatToBuckets::setUp(const Bench::Context &context)
+{
+    // Spread the splats over many buckets
+    splats = Bench::makeSphereSplats(16 * context.cells, context.splats);
+    lower.resize(splats.size());
+    upper.resize(splats.size());
+    toBuckets.reset(new SplatSet::detail::SplatToBuckets(1.0f, context.cells));
+}
+
+void BenchSplatToBuckets::run()
+{
+    (*toBuckets)(&splats[0], splats.size(), &lower[0], &upper[0]);
+}
+
+/**
+ * Writing of intermediate vertices and triangles by @ref
+ * OOCMesher::TmpWriterWorkerGroup. The time includes waiting for the writes
+ * to be issued, but not for the data to reach the disk.
+ */
+class BenchTmpWriter : public Bench::Benchmark
+{
+private:
+    typedef OOCMesher::vertex_type vertex_type;
+    typedef OOCMesher::triangle_type triangle_type;
+
+    /// Vertices per item (with twice as many triangles)
+    static const std::size_t itemVertices = 65536;
+
+    std::size_t numItems;
+    std::vector<vertex_type> vertices;
+    std::vector<triangle_type> triangles;
+    boost::scoped_ptr<OOCMesher::TmpWriterWorkerGroup> group;
+
+    /// Delete the files from the last run, if any
+    void removeFiles();
+
+public:
+    virtual void setUp(const Bench::Context &context);
+    virtual void prepare() { removeFiles(); }
+    virtual void run();
+    virtual void tearDown();
+    virtual std::tr1::uint64_t items() const
+    {
+        return std::tr1::uint64_t(numItems)
+            * (vertices.size() * sizeof(vertex_type) + triangles.size() * sizeof(triangle_type));
+    }
+    virtual std::string unit() const { return "bytes"; }
+};
+BENCH_REGISTER(BenchTmpWriter, "mesher.tmpwriter");
+
+void BenchTmpWriter::setUp(const Bench::Context &context)
+{
+    numItems = std::max(std::size_t(1), context.splats / itemVertices);
+    vertices.resize(itemVertices);
+    triangles.resize(2 * itemVertices);
+    for (std::size_t i = 0; i < vertices.size(); i++)
+        for (int j = 0; j < 3; j++)
+            vertices[i][j] = float(i + j);
+    for (std::size_t i = 0; i < triangles.size(); i++)
+        for (int j = 0; j < 3; j++)
+            triangles[i][j] = (i + j) % itemVertices;
+    // One slot more than the workers, as OOCMesher has by default
+    group.reset(new OOCMesher::TmpWriterWorkerGroup(
+        OOCMesher::tmpWriterWorkers, OOCMesher::tmpWriterWorkers + 1));
+}
+
+void BenchTmpWriter::run()
+{
+    Timeplot::Worker tworker("bench");
+    group->start();
+    for (std::size_t i = 0; i < numItems; i++)
+    {
+        boost::shared_ptr<OOCMesher::TmpWriterItem> item = group->get(tworker, 1);
+        item->vertices.assign(vertices.begin(), vertices.end());
+        item->triangles.assign(triangles.begin(), triangles.end());
+        item->vertexRanges.push_back(std::make_pair(std::size_t(0), vertices.size()));
+        item->triangleRanges.push_back(std::make_pair(std::size_t(0), triangles.size()));
+        group->push(tworker, item);
+    }
+    group->stop();
+}
+
+void BenchTmpWriter::removeFiles()
+{
+    if (!group->getVerticesPath().empty())
+        boost::filesystem::remove(group->getVerticesPath());
+    if (!group->getTrianglesPath().empty())
+        boost::filesystem::remove(group->getTrianglesPath());
+    if (!group->getClumpsPath().empty())
+        boost::filesystem::remove(group->getClumpsPath());
+}
+
+void BenchTmpWriter::tearDown()
+{
+    removeFiles();
+    group.reset();
+}
+
+/**
+ * Component labelling and buffering of mesh blocks by @ref OOCMesher::add.
+ * The blocks are patches of a flat grid, with the vertices on the edges of
+ * each patch shared with its neighbours as external vertices.
+ */
+class BenchOOCMesherAdd : public Bench::Benchmark
+{
+private:
+    /// Mesh data in a block
+    struct Block
+    {
+        MeshSizes sizes;
+        std::vector<cl_ulong> pristine;   ///< Mesh data, as generated
+        std::vector<cl_ulong> work;       ///< Copy of @ref pristine passed to the mesher
+    };
+
+    std::vector<Block> blocks;
+    std::tr1::uint64_t totalTriangles;
+    boost::scoped_ptr<FastPly::Writer> writer;
+    boost::scoped_ptr<OOCMesher> mesher;
+    MesherBase::InputFunctor functor;
+
+    /**
+     * Generate a block covering quads [@a x0, @a x0 + @a m) x [@a y0, @a y0 + @a m).
+     */
+    void makeBlock(Block &block, cl_uint x0, cl_uint y0, cl_uint m);
+
+public:
+    virtual void setUp(const Bench::Context &context);
+    virtual void prepare();
+    virtual void run();
+    virtual void tearDown();
+    virtual std::tr1::uint64_t items() const { return totalTriangles; }
+    virtual std::string unit() const { return "triangles"; }
+};
+BENCH_REGISTER(BenchOOCMesherAdd, "mesher.add");
+
+void BenchOOCMesherAdd::makeBlock(Block &block, cl_uint x0, cl_uint y0, cl_uint m)
+{
+    const std::size_t numInternal = (m - 1) * (m - 1);
+    const std::size_t numVertices = (m + 1) * (m + 1);
+    const std::size_t numTriangles = 2 * m * m;
+    block.sizes = MeshSizes(numVertices, numTriangles, numInternal);
+    block.pristine.resize((block.sizes.getHostBytes() + sizeof(cl_ulong) - 1) / sizeof(cl_ulong));
+    HostKeyMesh mesh(&block.pristine[0], block.sizes);
+
+    // Internal vertices come first, then the external ones on the border
+    std::vector<cl_uint> index((m + 1) * (m + 1));
+    std::size_t nextInternal = 0, nextExternal = numInternal;
+    for (cl_uint y = 0; y <= m; y++)
+        for (cl_uint x = 0; x <= m; x++)
+        {
+            const bool external = x == 0 || y == 0 || x == m || y == m;
+            const std::size_t id = external ? nextExternal++ : nextInternal++;
+            index[y * (m + 1) + x] = id;
+            mesh.vertices[id][0] = x0 + x;
+            mesh.vertices[id][1] = y0 + y;
+            mesh.vertices[id][2] = 0.0f;
+            if (external)
+                mesh.vertexKeys[id - numInternal] = (cl_ulong(x0 + x) << 32) | (y0 + y);
+        }
+
+    std::size_t t = 0;
+    for (cl_uint y = 0; y < m; y++)
+        for (cl_uint x = 0; x < m; x++)
+        {
+            const cl_uint a = index[y * (m + 1) + x];
+            const cl_uint b = index[y * (m + 1) + x + 1];
+            const cl_uint c = index[(y + 1) * (m + 1) + x];
+            const cl_uint d = index[(y + 1) * (m + 1) + x + 1];
+            const boost::array<cl_uint, 3> t0 = {{ a, b, d }};
+            const boost::array<cl_uint, 3> t1 = {{ a, d, c }};
+            mesh.triangles[t++] = t0;
+            mesh.triangles[t++] = t1;
+        }
+}
+
+void BenchOOCMesherAdd::setUp(const Bench::Context &context)
+{
+    const cl_uint m = std::max(Grid::size_type(2), context.cells);
+    const std::size_t perBlock = (m + 1) * (m + 1);
+    const std::size_t numBlocks = std::max(std::size_t(1), context.splats / perBlock);
+    const std::size_t side = std::max(std::size_t(1), std::size_t(std::sqrt(double(numBlocks))));
+
+    blocks.resize(numBlocks);
+    totalTriangles = 0;
+    for (std::size_t i = 0; i < numBlocks; i++)
+    {
+        makeBlock(blocks[i], (i % side) * m, (i / side) * m, m);
+        blocks[i].work.resize(blocks[i].pristine.size());
+        totalTriangles += blocks[i].sizes.numTriangles();
+    }
+    writer.reset(new FastPly::Writer(SYSCALL_WRITER));
+}
+
+void BenchOOCMesherAdd::prepare()
+{
+    mesher.reset();
+    mesher.reset(new OOCMesher(*writer, TrivialNamer("bench.ply")));
+    mesher->setPruneThreshold(0.0);
+    functor = mesher->functor(0);
+    for (std::size_t i = 0; i < blocks.size(); i++)
+        std::copy(blocks[i].pristine.begin(), blocks[i].pristine.end(), blocks[i].work.begin());
+}
+
+void BenchOOCMesherAdd::run()
+{
+    Timeplot::Worker tworker("bench");
+    for (std::size_t i = 0; i < blocks.size(); i++)
+    {
+        MesherWork work;
+        work.mesh = HostKeyMesh(&blocks[i].work[0], blocks[i].sizes);
+        work.hasEvents = false;
+        functor(work, tworker);
+    }
+}
+
+void BenchOOCMesherAdd::tearDown()
+{
+    functor.clear();
+    mesher.reset();
+    writer.reset();
+}
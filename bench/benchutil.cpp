@@ -0,0 +1,284 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Benchmark runner.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS 1
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <cstdlib>
+#include <locale>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/foreach.hpp>
+#include <boost/math/constants/constants.hpp>
+#include <CL/cl.hpp>
+#include "benchutil.h"
+#include "../src/clh.h"
+#include "../src/logging.h"
+#include "../src/timer.h"
+
+namespace po = boost::program_options;
+
+namespace Bench
+{
+
+namespace
+{
+
+/// Global list of benchmarks, keyed by name
+std::map<std::string, Factory> &registry()
+{
+    static std::map<std::string, Factory> benchmarks;
+    return benchmarks;
+}
+
+po::variables_map processOptions(int argc, const char **argv)
+{
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help",                                      "Show help");
+
+    po::options_description bench("Benchmark options");
+    bench.add_options()
+        ("bench", po::value<std::vector<std::string> >()->composing(),
+                                                      "Run benchmarks whose names contain this string (repeatable)")
+        ("list",                                      "List all benchmarks")
+        ("repeat", po::value<int>()->default_value(5), "Timed repetitions of each benchmark")
+        ("splats", po::value<std::size_t>()->default_value(1000000), "Splats in splat-based benchmarks")
+        ("cells", po::value<int>()->default_value(127), "Cells along each side of a bucket")
+        ("output,o", po::value<std::string>(),        "Write results to this file instead of stdout");
+    desc.add(bench);
+
+    po::options_description cl("OpenCL options");
+    CLH::addOptions(cl);
+    desc.add(cl);
+
+    try
+    {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv)
+                  .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+                  .options(desc)
+                  .run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help"))
+        {
+            std::cout << desc << '\n';
+            std::exit(0);
+        }
+        if (vm["repeat"].as<int>() < 1)
+            throw po::invalid_option_value("--repeat must be positive");
+        if (vm["cells"].as<int>() < 1)
+            throw po::invalid_option_value("--cells must be positive");
+        if (vm["splats"].as<std::size_t>() < 1)
+            throw po::invalid_option_value("--splats must be positive");
+        return vm;
+    }
+    catch (po::error &e)
+    {
+        std::cerr << e.what() << "\n\n" << desc << '\n';
+        std::exit(1);
+    }
+}
+
+/// Whether the benchmark called @a name was selected on the command line
+bool selected(const po::variables_map &vm, const std::string &name)
+{
+    if (!vm.count("bench"))
+        return true;
+    BOOST_FOREACH(const std::string &pattern, vm["bench"].as<std::vector<std::string> >())
+    {
+        if (name.find(pattern) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+/// Time a benchmark and write a row of results
+void runOne(const std::string &name, Benchmark &bench, const Context &context, int repeat, std::ostream &out)
+{
+    bench.setUp(context);
+
+    // Warm-up run, to compile kernels, populate caches and so on
+    bench.prepare();
+    bench.run();
+
+    std::vector<double> times;
+    for (int i = 0; i < repeat; i++)
+    {
+        bench.prepare();
+        Timer timer;
+        bench.run();
+        times.push_back(timer.getElapsed());
+    }
+    bench.tearDown();
+
+    std::sort(times.begin(), times.end());
+    const double median = times.size() % 2
+        ? times[times.size() / 2]
+        : 0.5 * (times[times.size() / 2 - 1] + times[times.size() / 2]);
+    const double mean = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+    out << name << ','
+        << bench.items() << ','
+        << bench.unit() << ','
+        << times.size() << ','
+        << times.front() << ','
+        << median << ','
+        << mean << ','
+        << times.back() << ','
+        << bench.items() / median << '\n';
+    out.flush();
+}
+
+} // anonymous namespace
+
+void registerBenchmark(const std::string &name, Factory factory)
+{
+    registry()[name] = factory;
+}
+
+int runBenchmarks(int argc, const char **argv)
+{
+    Context context;
+    context.vm = processOptions(argc, argv);
+    const po::variables_map &vm = context.vm;
+    context.splats = vm["splats"].as<std::size_t>();
+    context.cells = vm["cells"].as<int>();
+    context.haveCL = false;
+
+    typedef std::pair<std::string, Factory> entry;
+    if (vm.count("list"))
+    {
+        BOOST_FOREACH(const entry &e, registry())
+            std::cout << e.first << '\n';
+        return 0;
+    }
+
+    std::vector<entry> chosen;
+    bool needCL = false;
+    BOOST_FOREACH(const entry &e, registry())
+    {
+        if (selected(vm, e.first))
+        {
+            chosen.push_back(e);
+            boost::scoped_ptr<Benchmark> bench(e.second());
+            needCL = needCL || bench->needsCL();
+        }
+    }
+
+    if (needCL)
+    {
+        std::vector<cl::Device> devices = CLH::findDevices(vm);
+        if (devices.empty())
+            Log::log[Log::warn] << "No suitable OpenCL device found, skipping OpenCL benchmarks\n";
+        else
+        {
+            context.device = devices[0];
+            context.context = CLH::makeContext(context.device);
+            context.queue = cl::CommandQueue(context.context, context.device);
+            context.haveCL = true;
+            Log::log[Log::info] << "Using device " << context.device.getInfo<CL_DEVICE_NAME>() << '\n';
+        }
+    }
+
+    std::ofstream outFile;
+    std::ostream *out = &std::cout;
+    if (vm.count("output"))
+    {
+        outFile.open(vm["output"].as<std::string>().c_str());
+        if (!outFile)
+        {
+            std::cerr << "Could not open " << vm["output"].as<std::string>() << '\n';
+            return 1;
+        }
+        out = &outFile;
+    }
+    out->imbue(std::locale::classic());
+    out->precision(6);
+    *out << "benchmark,items,unit,repeats,min_s,median_s,mean_s,max_s,items_per_s\n";
+
+    int status = 0;
+    BOOST_FOREACH(const entry &e, chosen)
+    {
+        boost::scoped_ptr<Benchmark> bench(e.second());
+        if (bench->needsCL() && !context.haveCL)
+            continue;
+        Log::log[Log::info] << "Running " << e.first << '\n';
+        try
+        {
+            runOne(e.first, *bench, context, vm["repeat"].as<int>(), *out);
+        }
+        catch (std::exception &ex)
+        {
+            Log::log[Log::error] << e.first << " failed: " << ex.what() << '\n';
+            status = 1;
+        }
+    }
+    return status;
+}
+
+std::vector<Splat> makeSphereSplats(Grid::size_type size, std::size_t numSplats)
+{
+    const float pi = boost::math::constants::pi<float>();
+    const float center = size * 0.5f;
+    const float r = size * 0.35f;
+    const float area = 4.0f * pi * r * r;
+    const std::size_t n = std::max(std::size_t(1), numSplats);
+    const float spacing = std::sqrt(area / n);
+    const float golden = pi * (3.0f - std::sqrt(5.0f));
+
+    std::vector<Splat> splats(n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        // Fibonacci sphere, which gives a roughly even distribution
+        const float z = 1.0f - (2.0f * i + 1.0f) / n;
+        const float rxy = std::sqrt(1.0f - z * z);
+        const float theta = golden * i;
+        Splat &s = splats[i];
+        s.normal[0] = rxy * std::cos(theta);
+        s.normal[1] = rxy * std::sin(theta);
+        s.normal[2] = z;
+        for (int j = 0; j < 3; j++)
+            s.position[j] = center + r * s.normal[j];
+        s.radius = 2.0f * spacing;
+        s.quality = 1.0f;
+    }
+    return splats;
+}
+
+} // namespace Bench
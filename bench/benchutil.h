@@ -0,0 +1,141 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Framework for micro-benchmarks of individual stages of the pipeline.
+ *
+ * Each benchmark is a subclass of @ref Bench::Benchmark, registered with
+ * @ref BENCH_REGISTER. The runner sets it up once, then times @ref
+ * Bench::Benchmark::run for a number of repetitions after a warm-up run,
+ * calling @ref Bench::Benchmark::prepare (untimed) before each one. Results
+ * are written as CSV, one row per benchmark.
+ */
+
+#ifndef BENCHUTIL_H
+#define BENCHUTIL_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <boost/program_options.hpp>
+#include <CL/cl.hpp>
+#include "../src/tr1_cstdint.h"
+#include "../src/grid.h"
+#include "../src/splat.h"
+
+namespace Bench
+{
+
+/// Shared state and parameters passed to every benchmark
+struct Context
+{
+    /// Command-line options
+    boost::program_options::variables_map vm;
+    /// Number of splats to use in splat-based benchmarks
+    std::size_t splats;
+    /// Cells along each side of a bucket
+    Grid::size_type cells;
+
+    bool haveCL;                 ///< False if no OpenCL device was found
+    cl::Context context;         ///< OpenCL context (if @ref haveCL)
+    cl::Device device;           ///< OpenCL device (if @ref haveCL)
+    cl::CommandQueue queue;      ///< OpenCL command queue (if @ref haveCL)
+};
+
+/// Base class for benchmarks
+class Benchmark : public boost::noncopyable
+{
+public:
+    virtual ~Benchmark() {}
+
+    /// Whether the benchmark needs an OpenCL device
+    virtual bool needsCL() const { return false; }
+
+    /// Allocate resources and generate inputs. Not timed.
+    virtual void setUp(const Context &context) = 0;
+
+    /// Reset state before each call to @ref run. Not timed.
+    virtual void prepare() {}
+
+    /// The operation to time
+    virtual void run() = 0;
+
+    /// Free resources
+    virtual void tearDown() {}
+
+    /**
+     * The number of items processed by one call to @ref run, used to report
+     * a rate. The unit depends on the benchmark and is returned by @ref unit.
+     */
+    virtual std::tr1::uint64_t items() const = 0;
+
+    /// Unit of @ref items, e.g. "splats"
+    virtual std::string unit() const = 0;
+};
+
+/// Function that creates a benchmark
+typedef Benchmark *(*Factory)();
+
+/// Add a benchmark to the global list. Use @ref BENCH_REGISTER rather than calling directly.
+void registerBenchmark(const std::string &name, Factory factory);
+
+/// Helper for @ref BENCH_REGISTER
+template<typename T>
+class Registrar
+{
+public:
+    explicit Registrar(const std::string &name) { registerBenchmark(name, &create); }
+
+private:
+    static Benchmark *create() { return new T; }
+};
+
+/**
+ * Parse the command line and run the selected benchmarks.
+ *
+ * @return The exit code for the program.
+ */
+int runBenchmarks(int argc, const char **argv);
+
+/**
+ * Generate splats on a sphere that fills most of a cube with @a size cells
+ * on a side, in grid coordinates. This is the same distribution as used for
+ * autotuning.
+ */
+std::vector<Splat> makeSphereSplats(Grid::size_type size, std::size_t numSplats);
+
+} // namespace Bench
+
+/**
+ * Register a benchmark class. This must be used at namespace scope in a
+ * source file.
+ *
+ * @param Class   Subclass of @ref Bench::Benchmark with a default constructor
+ * @param name    Name used to select the benchmark and in the output
+ */
+#define BENCH_REGISTER(Class, name) \
+    static const Bench::Registrar<Class> benchRegistrar_ ## Class(name)
+
+#endif /* !BENCHUTIL_H */
@@ -0,0 +1,586 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Scaling benchmark for the MPI scatter, gather and progress protocols.
+ *
+ * Rank 0 plays the part of the root: it scatters batches of synthetic bins
+ * to the slaves with the same credit scheme as @c mlsgpu-mpi, and receives
+ * the meshes with @ref ReceiverGatherNonBlocking. Every other rank is a
+ * slave, whose device workers sleep for a fixed time per bucket instead of
+ * using a GPU, and then send back a mesh of a fixed size through a
+ * @ref WorkerGroupGather. Progress is reported with @ref ProgressMPI.
+ *
+ * The run is repeated on the first 2, 4, 8, ... ranks and finally on all
+ * of them, and one CSV row is written by rank 0 for each size. The columns
+ * are:
+ *  - @c ranks, @c slaves: the size of the run;
+ *  - @c buckets, @c wall_s: the work done and the time it took;
+ *  - @c efficiency: the ideal time (from the bucket time and the number of
+ *    device workers) divided by @c wall_s;
+ *  - @c scatter_busy, @c gather_busy: the fraction of the wall time that the
+ *    root spent sending bins and receiving meshes, i.e. how close the root
+ *    is to saturation;
+ *  - @c scatter_msgs_per_s, @c gather_msgs_per_s: message rates at the root;
+ *  - @c gather_MBps: mesh data received by the root per second;
+ *  - @c progress_msgs_per_s: progress updates received by the root per second.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <mpi.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <locale>
+#include <cstdlib>
+#include <boost/program_options.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/smart_ptr/make_shared.hpp>
+#include <boost/ref.hpp>
+#include "../../src/tags.h"
+#include "../../src/timer.h"
+#include "../../src/timeplot.h"
+#include "../../src/statistics.h"
+#include "../../src/serialize.h"
+#include "../../src/bucket_collector.h"
+#include "../../src/worker_group.h"
+#include "../../src/worker_group_mpi.h"
+#include "../../src/progress.h"
+#include "../../src/progress_mpi.h"
+
+namespace po = boost::program_options;
+
+namespace
+{
+
+/// Parameters of a run, taken from the command line
+struct Params
+{
+    std::size_t buckets;       ///< Total buckets to process
+    double bucketTime;         ///< Seconds of simulated device time per bucket
+    std::size_t batchBins;     ///< Bins per scatter batch
+    std::size_t ranges;        ///< Splat ranges per bin
+    std::size_t meshBytes;     ///< Bytes of mesh sent back per bucket
+    int credits;               ///< Batches each slave requests ahead
+    int devices;               ///< Simulated devices per slave
+};
+
+/// Synthetic mesh sent from a slave to the root
+class MeshItem
+{
+public:
+    std::vector<char> data;
+
+    std::size_t size() const { return data.size(); }
+
+    void send(MPI_Comm comm, int dest) const
+    {
+        MPI_Send(const_cast<char *>(&data[0]), data.size(), MPI_BYTE, dest, MLSGPU_TAG_WORK, comm);
+    }
+
+    void recv(MPI_Comm comm, int source)
+    {
+        MPI_Recv(&data[0], data.size(), MPI_BYTE, source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+    }
+
+    int irecv(MPI_Comm comm, int source, std::size_t size, MPI_Request *requests)
+    {
+        MPI_Irecv(&data[0], size, MPI_BYTE, source, MLSGPU_TAG_WORK, comm, &requests[0]);
+        return 1;
+    }
+
+    void irecvComplete() {}
+};
+
+/// Allocates a mesh of the requested size, for either end of the gather
+static boost::shared_ptr<MeshItem> makeMesh(std::size_t size)
+{
+    boost::shared_ptr<MeshItem> item = boost::make_shared<MeshItem>();
+    item->data.resize(std::max(size, std::size_t(1)));
+    return item;
+}
+
+/// Sends meshes to the root
+class MeshGatherGroup : public WorkerGroupGather<MeshItem, MeshGatherGroup>
+{
+public:
+    MeshGatherGroup(MPI_Comm comm, int root)
+        : WorkerGroupGather<MeshItem, MeshGatherGroup>("bench.gather", comm, root)
+    {
+    }
+
+    boost::shared_ptr<MeshItem> get(Timeplot::Worker &, std::size_t size)
+    {
+        return makeMesh(size);
+    }
+};
+
+/// Discards meshes on the root, counting the bytes
+class SinkWorker : public WorkerBase
+{
+private:
+    std::tr1::uint64_t &bytes;
+
+public:
+    explicit SinkWorker(std::tr1::uint64_t &bytes) : WorkerBase("bench.sink", 0), bytes(bytes) {}
+
+    void operator()(MeshItem &item)
+    {
+        bytes += item.size();
+    }
+};
+
+class SinkGroup : public WorkerGroup<MeshItem, SinkWorker, SinkGroup>
+{
+public:
+    explicit SinkGroup(std::tr1::uint64_t &bytes)
+        : WorkerGroup<MeshItem, SinkWorker, SinkGroup>("bench.sink", 1)
+    {
+        addWorker(new SinkWorker(bytes));
+    }
+
+    boost::shared_ptr<MeshItem> get(Timeplot::Worker &, std::size_t size)
+    {
+        return makeMesh(size);
+    }
+};
+
+/// Progress meter on the root that just counts the updates received
+class ProgressCounter : public ProgressMeter
+{
+public:
+    size_type updates;
+
+    ProgressCounter() : updates(0) {}
+    virtual void operator+=(size_type) { updates++; }
+};
+
+/**
+ * Count of buckets queued on a slave's devices but not yet finished, so that
+ * the slave can hold back its next work request as the real loader does.
+ */
+class Backlog
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::size_t pending;
+
+public:
+    Backlog() : pending(0) {}
+
+    void add(std::size_t n)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        pending += n;
+    }
+
+    void done()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        pending--;
+        cond.notify_all();
+    }
+
+    /// Wait until at most @a limit buckets are pending
+    void waitBelow(std::size_t limit)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (pending > limit)
+            cond.wait(lock);
+    }
+};
+
+/// Simulated device: sleeps for each bucket, then emits a mesh
+class DeviceWorker : public WorkerBase
+{
+private:
+    const Params &params;
+    MeshGatherGroup &gather;
+    ProgressMPI &progress;
+    Backlog &backlog;
+
+public:
+    DeviceWorker(int idx, const Params &params, MeshGatherGroup &gather,
+                 ProgressMPI &progress, Backlog &backlog)
+        : WorkerBase("bench.device", idx), params(params), gather(gather),
+        progress(progress), backlog(backlog)
+    {
+    }
+
+    void operator()(BucketCollector::Bin &bin)
+    {
+        (void) bin;
+        boost::this_thread::sleep(boost::posix_time::microseconds(
+                static_cast<long>(params.bucketTime * 1e6)));
+        boost::shared_ptr<MeshItem> mesh = gather.get(getTimeplotWorker(), params.meshBytes);
+        gather.push(getTimeplotWorker(), mesh);
+        ++progress;
+        backlog.done();
+    }
+};
+
+class DeviceGroup : public WorkerGroup<BucketCollector::Bin, DeviceWorker, DeviceGroup>
+{
+public:
+    DeviceGroup(const Params &params, MeshGatherGroup &gather, ProgressMPI &progress, Backlog &backlog)
+        : WorkerGroup<BucketCollector::Bin, DeviceWorker, DeviceGroup>("bench.device", params.devices)
+    {
+        for (int i = 0; i < params.devices; i++)
+            addWorker(new DeviceWorker(i, params, gather, progress, backlog));
+    }
+};
+
+/// Build a batch of bins similar in shape to those produced by bucketing
+static Statistics::Container::vector<BucketCollector::Bin> makeBatch(
+    const Params &params, std::size_t first, std::size_t count)
+{
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    Statistics::Container::vector<BucketCollector::Bin> bins("mem.bench.bins", count);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        const SplatSet::splat_id base = SplatSet::splat_id(first + i) << 20;
+        for (std::size_t j = 0; j < params.ranges; j++)
+            bins[i].ranges.addRange(base + 1000 * j, base + 1000 * j + 500);
+        bins[i].ranges.flush();
+        bins[i].chunkId.gen = first + i;
+        bins[i].grid = Grid(ref, 1.0f, 0, 128, 0, 128, 0, 128);
+    }
+    return bins;
+}
+
+/// Root side of the scatter, following the protocol of @c Scatter in @c mlsgpu-mpi
+class RootScatter
+{
+private:
+    MPI_Comm comm;
+    std::map<int, int> credits;
+    std::size_t messages;
+    double busy;
+
+    void receiveRequest()
+    {
+        MPI_Status status;
+        int needsWork;
+        MPI_Recv(&needsWork, 1, MPI_INT, MPI_ANY_SOURCE, MLSGPU_TAG_SCATTER_NEED_WORK, comm, &status);
+        credits[status.MPI_SOURCE] += needsWork;
+        messages++;
+    }
+
+    int waitForCredit()
+    {
+        while (true)
+        {
+            int flag;
+            MPI_Iprobe(MPI_ANY_SOURCE, MLSGPU_TAG_SCATTER_NEED_WORK, comm, &flag, MPI_STATUS_IGNORE);
+            if (!flag)
+                break;
+            receiveRequest();
+        }
+        while (true)
+        {
+            for (std::map<int, int>::const_iterator i = credits.begin(); i != credits.end(); ++i)
+                if (i->second > 0)
+                    return i->first;
+            receiveRequest();
+        }
+    }
+
+public:
+    explicit RootScatter(MPI_Comm comm) : comm(comm), messages(0), busy(0.0) {}
+
+    void send(const Statistics::Container::vector<BucketCollector::Bin> &bins)
+    {
+        int dest = waitForCredit();
+        Timer timer;
+        credits[dest]--;
+        std::size_t workSize = bins.size();
+        MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(),
+                 dest, MLSGPU_TAG_SCATTER_HAS_WORK, comm);
+        if (workSize > 0)
+        {
+            Serialize::send(&bins[0], bins.size(), comm, dest);
+            messages++;
+        }
+        messages++;
+        busy += timer.getElapsed();
+    }
+
+    /// Answer all outstanding requests with zero, once each slave has @a credits outstanding
+    void stop(std::size_t slaves, int slaveCredits)
+    {
+        const Statistics::Container::vector<BucketCollector::Bin> none("mem.bench.bins");
+        for (std::size_t i = 0; i < slaves * slaveCredits; i++)
+            send(none);
+    }
+
+    std::size_t getMessages() const { return messages; }
+    double getBusy() const { return busy; }
+};
+
+/// Slave side of one run
+static void runSlave(const Params &params, MPI_Comm scatterComm, MPI_Comm gatherComm,
+                     MPI_Comm progressComm)
+{
+    Timeplot::Worker tworker("bench.slave");
+    MeshGatherGroup gather(gatherComm, 0);
+    ProgressMPI progress(NULL, params.buckets, progressComm, 0);
+    Backlog backlog;
+    DeviceGroup devices(params, gather, progress, backlog);
+    gather.start();
+    devices.start();
+
+    int credits = params.credits;
+    MPI_Send(&credits, 1, MPI_INT, 0, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+    std::size_t batches = 0;
+    for (std::size_t answers = 0; answers < std::size_t(credits) + batches; answers++)
+    {
+        std::size_t workSize;
+        MPI_Recv(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), 0,
+                 MLSGPU_TAG_SCATTER_HAS_WORK, scatterComm, MPI_STATUS_IGNORE);
+        if (workSize == 0)
+            continue;
+        Statistics::Container::vector<BucketCollector::Bin> bins("mem.bench.bins", workSize);
+        Serialize::recv(&bins[0], bins.size(), scatterComm, 0);
+
+        // Like the loader, only start on a batch once the devices are nearly idle
+        backlog.waitBelow(params.devices);
+        int needWork = 1;
+        MPI_Send(&needWork, 1, MPI_INT, 0, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+        batches++;
+
+        backlog.add(bins.size());
+        for (std::size_t i = 0; i < bins.size(); i++)
+        {
+            boost::shared_ptr<BucketCollector::Bin> item = devices.get(tworker, 1);
+            *item = bins[i];
+            devices.push(tworker, item);
+        }
+    }
+
+    devices.stop();
+    gather.stop();
+    progress.sync();
+}
+
+/// Sum of the samples of a statistic
+static double statSum(const std::string &name)
+{
+    const Statistics::Variable &stat = Statistics::getStatistic<Statistics::Variable>(name);
+    return stat.getNumSamples() ? stat.getMean() * stat.getNumSamples() : 0.0;
+}
+
+/// Root side of one run, which writes the CSV row
+static void runRoot(const Params &params, MPI_Comm scatterComm, MPI_Comm gatherComm,
+                    MPI_Comm progressComm, int ranks, std::ostream &out)
+{
+    const std::size_t slaves = ranks - 1;
+    std::tr1::uint64_t bytes = 0;
+    SinkGroup sink(bytes);
+    ReceiverGatherNonBlocking<MeshItem, SinkGroup> receiver("bench.receiver", sink, gatherComm, slaves);
+    ProgressCounter counter;
+    ProgressMPI progress(&counter, params.buckets, progressComm, 0);
+    RootScatter scatter(scatterComm);
+
+    const double recvBefore = statSum("ReceiverGather.recv");
+    const double countBefore = Statistics::getStatistic<Statistics::Variable>("ReceiverGather.recv").getNumSamples();
+    Timer timer;
+    sink.start();
+    boost::thread receiverThread(boost::ref(receiver));
+    boost::thread progressThread(boost::ref(progress));
+
+    for (std::size_t first = 0; first < params.buckets; first += params.batchBins)
+    {
+        std::size_t count = std::min(params.batchBins, params.buckets - first);
+        scatter.send(makeBatch(params, first, count));
+    }
+    scatter.stop(slaves, params.credits);
+
+    receiverThread.join();
+    sink.stop();
+    const double wall = timer.getElapsed();
+    progressThread.join();
+
+    const double recv = statSum("ReceiverGather.recv") - recvBefore;
+    const double meshes = Statistics::getStatistic<Statistics::Variable>("ReceiverGather.recv").getNumSamples()
+        - countBefore;
+    const double ideal = params.buckets * params.bucketTime / (double(slaves) * params.devices);
+    out << ranks << ','
+        << slaves << ','
+        << params.buckets << ','
+        << wall << ','
+        << ideal / wall << ','
+        << scatter.getBusy() / wall << ','
+        << recv / wall << ','
+        << scatter.getMessages() / wall << ','
+        << 2.0 * meshes / wall << ','     // an announcement and the data per mesh
+        << bytes / wall * 1e-6 << ','
+        << counter.updates / wall << '\n';
+    out.flush();
+}
+
+static po::variables_map processOptions(int argc, char **argv, bool isRoot)
+{
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help",                                                        "Show help")
+        ("buckets", po::value<std::size_t>()->default_value(2000),      "Buckets processed in each run")
+        ("bucket-time", po::value<double>()->default_value(0.005),      "Simulated device seconds per bucket")
+        ("batch-bins", po::value<std::size_t>()->default_value(8),      "Bins per scatter batch")
+        ("ranges", po::value<std::size_t>()->default_value(16),         "Splat ranges per bin")
+        ("mesh-bytes", po::value<std::size_t>()->default_value(65536),  "Bytes of mesh returned per bucket")
+        ("credits", po::value<int>()->default_value(2),                 "Batches each slave requests ahead")
+        ("devices", po::value<int>()->default_value(1),                 "Simulated devices per slave")
+        ("output,o", po::value<std::string>(),                          "Write results to this file instead of stdout");
+
+    try
+    {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv)
+                  .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+                  .options(desc)
+                  .run(), vm);
+        po::notify(vm);
+
+        if (vm.count("help"))
+        {
+            if (isRoot)
+                std::cout << desc << '\n';
+            MPI_Finalize();
+            std::exit(0);
+        }
+        if (vm["buckets"].as<std::size_t>() < 1)
+            throw po::invalid_option_value("--buckets must be positive");
+        if (vm["bucket-time"].as<double>() < 0.0)
+            throw po::invalid_option_value("--bucket-time must be non-negative");
+        if (vm["batch-bins"].as<std::size_t>() < 1)
+            throw po::invalid_option_value("--batch-bins must be positive");
+        if (vm["credits"].as<int>() < 1)
+            throw po::invalid_option_value("--credits must be positive");
+        if (vm["devices"].as<int>() < 1)
+            throw po::invalid_option_value("--devices must be positive");
+        return vm;
+    }
+    catch (po::error &e)
+    {
+        if (isRoot)
+            std::cerr << e.what() << "\n\n" << desc << '\n';
+        MPI_Finalize();
+        std::exit(1);
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv)
+{
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    if (provided < MPI_THREAD_MULTIPLE)
+    {
+        std::cerr << "MPI implementation does not provide the required level of thread support\n";
+        MPI_Finalize();
+        return 1;
+    }
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (size < 2)
+    {
+        std::cerr << "Must use at least two processes\n";
+        MPI_Finalize();
+        return 1;
+    }
+    Serialize::init();
+
+    po::variables_map vm = processOptions(argc, argv, rank == 0);
+    Params params;
+    params.buckets = vm["buckets"].as<std::size_t>();
+    params.bucketTime = vm["bucket-time"].as<double>();
+    params.batchBins = vm["batch-bins"].as<std::size_t>();
+    params.ranges = vm["ranges"].as<std::size_t>();
+    params.meshBytes = vm["mesh-bytes"].as<std::size_t>();
+    params.credits = vm["credits"].as<int>();
+    params.devices = vm["devices"].as<int>();
+
+    std::ofstream outFile;
+    std::ostream *out = &std::cout;
+    if (rank == 0)
+    {
+        if (vm.count("output"))
+        {
+            outFile.open(vm["output"].as<std::string>().c_str());
+            if (!outFile)
+            {
+                std::cerr << "Could not open " << vm["output"].as<std::string>() << '\n';
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+            out = &outFile;
+        }
+        out->imbue(std::locale::classic());
+        out->precision(6);
+        *out << "ranks,slaves,buckets,wall_s,efficiency,scatter_busy,gather_busy,"
+            << "scatter_msgs_per_s,gather_msgs_per_s,gather_MBps,progress_msgs_per_s\n";
+    }
+
+    std::vector<int> sizes;
+    for (int s = 2; s < size; s *= 2)
+        sizes.push_back(s);
+    sizes.push_back(size);
+
+    for (std::size_t i = 0; i < sizes.size(); i++)
+    {
+        const int ranks = sizes[i];
+        MPI_Comm comm;
+        MPI_Comm_split(MPI_COMM_WORLD, rank < ranks ? 0 : MPI_UNDEFINED, rank, &comm);
+        if (comm != MPI_COMM_NULL)
+        {
+            // Separate communicators keep the protocols apart, as in mlsgpu-mpi
+            MPI_Comm scatterComm, gatherComm, progressComm;
+            MPI_Comm_dup(comm, &scatterComm);
+            MPI_Comm_dup(comm, &gatherComm);
+            MPI_Comm_dup(comm, &progressComm);
+            MPI_Barrier(comm);
+            if (rank == 0)
+                runRoot(params, scatterComm, gatherComm, progressComm, ranks, *out);
+            else
+                runSlave(params, scatterComm, gatherComm, progressComm);
+            MPI_Comm_free(&progressComm);
+            MPI_Comm_free(&gatherComm);
+            MPI_Comm_free(&scatterComm);
+            MPI_Comm_free(&comm);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+
+    MPI_Finalize();
+    return 0;
+}
@@ -4,8 +4,8 @@
  * Helper functions for reading and writing binary files to/from streams.
  */
 
-#ifndef BINARY_IO_H
-#define BINARY_IO_H
+#ifndef EXTRAS_BINARY_IO_H
+#define EXTRAS_BINARY_IO_H
 
 #include "../src/tr1_cstdint.h"
 #include <istream>
@@ -207,4 +207,4 @@ static void writeBinary(std::ostream &out, const T &in, const boost::integral_co
     detail::writeBinaryImpl(out, in, endian, boost::is_signed<T>(), boost::is_integral<T>());
 }
 
-#endif /* !BINARY_IO_H */
+#endif /* !EXTRAS_BINARY_IO_H */
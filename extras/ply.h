@@ -464,6 +464,12 @@ public:
      */
     void readHeader();
 
+    /**
+     * The file format given in the header.
+     * @pre @ref readHeader has been called.
+     */
+    FileFormat getFormat() const { return format; }
+
     /**
      * Skip all elements until the specified one, and return the element
      * range reader for it.
@@ -13,9 +13,17 @@
 #include <string>
 #include <algorithm>
 #include <iterator>
+#include <limits>
+#include <cstring>
 #include <boost/array.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/smart_ptr/scoped_array.hpp>
+#include <boost/foreach.hpp>
+#include <boost/exception_ptr.hpp>
 #include "../test/manifold.h"
 #include "../src/logging.h"
+#include "../src/binary_io.h"
+#include "../src/tr1_cstdint.h"
 #include "ply.h"
 
 using namespace std;
@@ -149,6 +157,235 @@ static void validateVertices(Iterator first, Iterator last)
     }
 }
 
+/**
+ * Layout of a binary mesh that can be read directly into memory, without
+ * going through the per-property decoding of @ref PLY::Reader. This is the
+ * layout written by @ref FastPly::Writer: little-endian, the vertices
+ * followed by the faces, each face a UINT8 count of 3 and three 32-bit
+ * indices.
+ */
+struct FastLayout
+{
+    std::tr1::uint64_t numVertices;
+    std::tr1::uint64_t numTriangles;
+    BinaryReader::offset_type vertexStart;  ///< File offset of the first vertex
+    std::size_t vertexSize;                 ///< Bytes per vertex
+    /// Offsets of x, y, z within a vertex, or -1 for integer coordinates that cannot be non-finite
+    int xyzOffset[3];
+    bool signedIndices;                     ///< Whether the vertex indices are INT32
+};
+
+/// Size of a scalar PLY field in binary files
+static std::size_t fieldSize(PLY::FieldType type)
+{
+    switch (type)
+    {
+    case PLY::INT8:
+    case PLY::UINT8:   return 1;
+    case PLY::INT16:
+    case PLY::UINT16:  return 2;
+    case PLY::INT32:
+    case PLY::UINT32:
+    case PLY::FLOAT32: return 4;
+    case PLY::FLOAT64: return 8;
+    }
+    std::abort();
+}
+
+/**
+ * Determine whether the file described by a header can be read with the fast
+ * path, and if so describe its layout.
+ *
+ * @param reader      Reader on which @c readHeader has been called.
+ * @param headerSize  Bytes in the header.
+ * @param[out] layout The layout, if the return value is true.
+ */
+static bool getFastLayout(PLY::Reader &reader, BinaryReader::offset_type headerSize, FastLayout &layout)
+{
+    const std::tr1::uint32_t one = 1;
+    if (reader.getFormat() != PLY::FILE_FORMAT_LITTLE_ENDIAN
+        || *reinterpret_cast<const unsigned char *>(&one) != 1)
+        return false;
+
+    PLY::Reader::iterator e = reader.begin();
+    if (e == reader.end() || e->getName() != "vertex")
+        return false;
+    layout.numVertices = e->getNumber();
+    layout.vertexStart = headerSize;
+    layout.vertexSize = 0;
+    for (unsigned int i = 0; i < 3; i++)
+        layout.xyzOffset[i] = -2;
+    BOOST_FOREACH(const PLY::PropertyType &p, e->getProperties())
+    {
+        if (p.isList)
+            return false;
+        if (p.name == "x" || p.name == "y" || p.name == "z")
+        {
+            if (p.valueType == PLY::FLOAT32)
+                layout.xyzOffset[p.name[0] - 'x'] = layout.vertexSize;
+            else if (p.valueType == PLY::FLOAT64)
+                return false;
+            else
+                layout.xyzOffset[p.name[0] - 'x'] = -1;
+        }
+        layout.vertexSize += fieldSize(p.valueType);
+    }
+    for (unsigned int i = 0; i < 3; i++)
+        if (layout.xyzOffset[i] == -2)
+            return false; // missing property: let the generic path report it
+
+    ++e;
+    if (e == reader.end() || e->getName() != "face" || e->getProperties().size() != 1)
+        return false;
+    const PLY::PropertyType &p = *e->getProperties().begin();
+    if (p.name != "vertex_indices" || !p.isList
+        || (p.lengthType != PLY::UINT8 && p.lengthType != PLY::INT8)
+        || (p.valueType != PLY::UINT32 && p.valueType != PLY::INT32))
+        return false;
+    layout.numTriangles = e->getNumber();
+    layout.signedIndices = p.valueType == PLY::INT32;
+
+    return layout.numVertices <= std::numeric_limits<std::tr1::uint32_t>::max();
+}
+
+/// Read exactly @a size bytes at @a offset, failing on a short read
+static void readExact(const BinaryReader &in, char *buffer, std::size_t size, BinaryReader::offset_type offset)
+{
+    if (in.read(buffer, size, offset) != size)
+        throw PLY::FormatError("Unexpected end of file");
+}
+
+/**
+ * Check the vertices and read the triangles of a file with a fast layout.
+ * The file is read in blocks, several at a time. Errors are reported in
+ * the same way as the generic path.
+ */
+static void readFast(const BinaryReader &in, const FastLayout &layout, std::vector<Manifold::Triangle> &triangles)
+{
+    typedef std::tr1::int64_t signed_type;
+    const std::size_t blockElements = 65536;
+    const std::size_t faceSize = 1 + 3 * sizeof(std::tr1::uint32_t);
+
+    boost::exception_ptr error;
+    signed_type badVertex = layout.numVertices;
+    const signed_type vertexBlocks = (layout.numVertices + blockElements - 1) / blockElements;
+#pragma omp parallel
+    {
+        boost::scoped_array<char> buffer(new char[blockElements * std::max(layout.vertexSize, faceSize)]);
+        signed_type localBad = layout.numVertices;
+#pragma omp for schedule(dynamic, 1)
+        for (signed_type b = 0; b < vertexBlocks; b++)
+        {
+            try
+            {
+                const std::tr1::uint64_t first = b * blockElements;
+                const std::size_t n = std::min(std::tr1::uint64_t(blockElements), layout.numVertices - first);
+                readExact(in, buffer.get(), n * layout.vertexSize, layout.vertexStart + first * layout.vertexSize);
+                for (std::size_t i = 0; i < n && signed_type(first + i) < localBad; i++)
+                    for (unsigned int j = 0; j < 3; j++)
+                    {
+                        if (layout.xyzOffset[j] < 0)
+                            continue;
+                        float v;
+                        std::memcpy(&v, buffer.get() + i * layout.vertexSize + layout.xyzOffset[j], sizeof(v));
+                        if (!std::tr1::isfinite(v))
+                            localBad = first + i;
+                    }
+            }
+            catch (...)
+            {
+#pragma omp critical
+                error = boost::current_exception();
+            }
+        }
+#pragma omp critical
+        badVertex = std::min(badVertex, localBad);
+    }
+    if (error)
+        boost::rethrow_exception(error);
+    if (badVertex < signed_type(layout.numVertices))
+    {
+        cout << "Vertex " << badVertex << " has non-finite value\n";
+        exit(1);
+    }
+
+    triangles.resize(layout.numTriangles);
+    const BinaryReader::offset_type faceStart = layout.vertexStart + layout.numVertices * layout.vertexSize;
+    const signed_type faceBlocks = (layout.numTriangles + blockElements - 1) / blockElements;
+    signed_type badFace = layout.numTriangles;
+    bool badCount = false;
+#pragma omp parallel
+    {
+        boost::scoped_array<char> buffer(new char[blockElements * faceSize]);
+        signed_type localBad = layout.numTriangles;
+        bool localBadCount = false;
+#pragma omp for schedule(dynamic, 1)
+        for (signed_type b = 0; b < faceBlocks; b++)
+        {
+            try
+            {
+                const std::tr1::uint64_t first = b * blockElements;
+                const std::size_t n = std::min(std::tr1::uint64_t(blockElements), layout.numTriangles - first);
+                readExact(in, buffer.get(), n * faceSize, faceStart + first * faceSize);
+                for (std::size_t i = 0; i < n && signed_type(first + i) < localBad; i++)
+                {
+                    const char *rec = buffer.get() + i * faceSize;
+                    Manifold::Triangle &t = triangles[first + i];
+                    std::memcpy(&t[0], rec + 1, 3 * sizeof(std::tr1::uint32_t));
+                    if ((unsigned char) rec[0] != 3)
+                    {
+                        localBad = first + i;
+                        localBadCount = true;
+                    }
+                    else if (layout.signedIndices
+                             && ((t[0] | t[1] | t[2]) & UINT32_C(0x80000000)))
+                    {
+                        localBad = first + i;
+                        localBadCount = false;
+                    }
+                }
+            }
+            catch (...)
+            {
+#pragma omp critical
+                error = boost::current_exception();
+            }
+        }
+#pragma omp critical
+        if (localBad < badFace)
+        {
+            badFace = localBad;
+            badCount = localBadCount;
+        }
+    }
+    if (error)
+        boost::rethrow_exception(error);
+    if (badFace < signed_type(layout.numTriangles))
+        throw PLY::FormatError(badCount ? "Face does not contain 3 vertices" : "Negative or out-of-range index");
+}
+
+/**
+ * Print the result of a manifold check.
+ * @return The exit code
+ */
+static int report(const string &reason, const Manifold::Metadata &metadata)
+{
+    if (reason != "")
+    {
+        cout << "Mesh is not manifold: " << reason << "\n";
+        return 1;
+    }
+    else
+    {
+        cout << "Mesh is manifold."
+            << "\nVertices: " << metadata.numVertices
+            << "\nTriangles: " << metadata.numTriangles
+            << "\nComponents: " << metadata.numComponents
+            << "\nBoundaries: " << metadata.numBoundaries << endl;
+        return 0;
+    }
+}
+
 int main(int argc, const char **argv)
 {
     if (argc != 2)
@@ -171,25 +408,29 @@ int main(int argc, const char **argv)
         reader.addBuilder("vertex", VertexBuilder());
         reader.addBuilder("face", TriangleBuilder());
         reader.readHeader();
+
+        FastLayout layout;
+        const streampos headerSize = in.pubseekoff(0, ios::cur, ios::in);
+        if (headerSize >= 0 && getFastLayout(reader, headerSize, layout))
+        {
+            boost::scoped_ptr<BinaryReader> binary(createReader(SYSCALL_READER));
+            binary->open(filename);
+            std::vector<Manifold::Triangle> triangles;
+            readFast(*binary, layout, triangles);
+            binary->close();
+
+            Manifold::Metadata metadata;
+            string reason = Manifold::isManifoldParallel(layout.numVertices, triangles, &metadata);
+            return report(reason, metadata);
+        }
+
         PLY::ElementRangeReader<VertexBuilder> &vertexReader = reader.skipTo<VertexBuilder>("vertex");
         size_t numVertices = vertexReader.getNumber();
         validateVertices(vertexReader.begin(), vertexReader.end());
         PLY::ElementRangeReader<TriangleBuilder> &triangleReader = reader.skipTo<TriangleBuilder>("face");
         Manifold::Metadata metadata;
         string reason = Manifold::isManifold(numVertices, triangleReader.begin(), triangleReader.end(), &metadata);
-        if (reason != "")
-        {
-            cout << "Mesh is not manifold: " << reason << "\n";
-            return 1;
-        }
-        else
-        {
-            cout << "Mesh is manifold."
-                << "\nVertices: " << metadata.numVertices
-                << "\nTriangles: " << metadata.numTriangles
-                << "\nComponents: " << metadata.numComponents
-                << "\nBoundaries: " << metadata.numBoundaries << endl;
-        }
+        return report(reason, metadata);
     }
     catch (ios::failure &e)
     {
@@ -0,0 +1,655 @@
+/**
+ * @file
+ *
+ * Sort point clouds into Morton order, out of core.
+ *
+ * Scanners write points in acquisition order, so the splats of one bucket
+ * are usually spread over the whole input and @ref BucketLoader has to make
+ * many small, scattered reads to load it. This tool rewrites the inputs as a
+ * single file in which the splats follow a Morton (Z-order) curve through
+ * cells of the bounding box. Since buckets are boxes, the splats of a bucket
+ * then form a few long runs.
+ *
+ * The sort is an external merge sort. The input is read in runs that fit in
+ * the memory budget. The keys of each run are computed and sorted in
+ * parallel, and the run is appended to a temporary file. The runs are then
+ * merged into the output, with intermediate passes if there are too many to
+ * merge at once. The output is binary PLY or the splat cache format.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <queue>
+#include <limits>
+#include <functional>
+#include <utility>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <locale>
+#include <memory>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/exception/all.hpp>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+#include "src/fast_ply.h"
+#include "src/binary_io.h"
+#include "src/options.h"
+#include "src/progress.h"
+#include "src/misc.h"
+#include "src/tr1_cstdint.h"
+#include "src/splat.h"
+#include "src/splat_set.h"
+
+namespace po = boost::program_options;
+
+/// Bits of each coordinate in a Morton key
+static const unsigned int keyBits = 21;
+/// Splats read from the input at a time
+static const std::size_t blockSize = 1 << 18;
+/// Records buffered for each run during a merge
+static const std::size_t mergeBufferSize = 1 << 14;
+/// Largest number of runs merged at once
+static const std::size_t maxFanIn = 128;
+
+enum OutputFormat
+{
+    OUTPUT_PLY,
+    OUTPUT_CACHE
+};
+
+/// Wrapper around @ref OutputFormat for use with @ref Choice.
+class OutputFormatWrapper
+{
+public:
+    typedef OutputFormat type;
+    static std::map<std::string, OutputFormat> getNameMap()
+    {
+        std::map<std::string, OutputFormat> ans;
+        ans["ply"] = OUTPUT_PLY;
+        ans["cache"] = OUTPUT_CACHE;
+        return ans;
+    }
+};
+
+/// A splat and its sort key, as stored in the temporary files
+struct Record
+{
+    std::tr1::uint64_t key;
+    Splat splat;
+};
+
+/// Orders records by key only
+struct RecordLess
+{
+    bool operator()(const Record &a, const Record &b) const
+    {
+        return a.key < b.key;
+    }
+};
+
+/// Range of records in a temporary file, sorted by key
+struct Run
+{
+    std::tr1::uint64_t first, last;
+};
+
+/// Spread the low @ref keyBits bits of @a x so that there are two zero bits between each
+static std::tr1::uint64_t spreadBits(std::tr1::uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x1f00000000ffffULL;
+    x = (x | (x << 16)) & 0x1f0000ff0000ffULL;
+    x = (x | (x << 8)) & 0x100f00f00f00f00fULL;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3ULL;
+    x = (x | (x << 2)) & 0x1249249249249249ULL;
+    return x;
+}
+
+/// Maps splat positions to Morton keys of cells
+class KeyMaker
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param lower     Minimum corner of the bounding box of the splats
+     * @param spacing   Side length of the cells
+     */
+    KeyMaker(const float lower[3], double spacing) : spacing(spacing)
+    {
+        std::copy(lower, lower + 3, this->lower);
+    }
+
+    std::tr1::uint64_t operator()(const Splat &splat) const
+    {
+        const double maxCoord = double((std::tr1::uint64_t(1) << keyBits) - 1);
+        std::tr1::uint64_t key = 0;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            const double c = std::floor((splat.position[i] - lower[i]) / spacing);
+            const std::tr1::uint64_t coord = c <= 0.0 ? 0 : std::tr1::uint64_t(std::min(c, maxCoord));
+            key |= spreadBits(coord) << i;
+        }
+        return key;
+    }
+
+private:
+    float lower[3];
+    double spacing;
+};
+
+/// Destination for splats in sorted order
+class Output
+{
+public:
+    virtual ~Output() {}
+    virtual void write(std::tr1::uint64_t first, std::size_t count, const Splat *splats) = 0;
+    virtual void close() = 0;
+};
+
+/// Binary PLY with x, y, z, nx, ny, nz, radius, as read by @ref FastPly::Reader
+class PlyOutput : public Output
+{
+public:
+    PlyOutput(WriterType writerType, const std::string &filename, std::tr1::uint64_t numSplats)
+        : handle(createWriter(writerType))
+    {
+        std::ostringstream header;
+        header.imbue(std::locale::classic());
+        header <<
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "comment sorted by plymorton\n"
+            "element vertex " << numSplats << "\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property float nx\n"
+            "property float ny\n"
+            "property float nz\n"
+            "property float radius\n"
+            "end_header\n";
+        const std::string h = header.str();
+        headerSize = h.size();
+
+        handle->open(filename);
+        handle->resize(headerSize + numSplats * vertexSize);
+        handle->write(h.data(), h.size(), 0);
+    }
+
+    virtual void write(std::tr1::uint64_t first, std::size_t count, const Splat *splats)
+    {
+        buffer.resize(count * vertexSize);
+        char *out = buffer.empty() ? NULL : &buffer[0];
+        for (std::size_t i = 0; i < count; i++)
+        {
+            std::memcpy(out, splats[i].position, 3 * sizeof(float));
+            std::memcpy(out + 3 * sizeof(float), splats[i].normal, 3 * sizeof(float));
+            std::memcpy(out + 6 * sizeof(float), &splats[i].radius, sizeof(float));
+            out += vertexSize;
+        }
+        if (count > 0)
+            handle->write(&buffer[0], buffer.size(), headerSize + first * vertexSize);
+    }
+
+    virtual void close()
+    {
+        handle->close();
+    }
+
+private:
+    static const std::size_t vertexSize = 7 * sizeof(float);
+
+    boost::scoped_ptr<BinaryWriter> handle;
+    std::tr1::uint64_t headerSize;
+    std::vector<char> buffer;
+};
+
+/// Splat cache format, written by @ref FastPly::SplatCacheWriter
+class CacheOutput : public Output
+{
+public:
+    CacheOutput(WriterType writerType, const std::string &filename, std::tr1::uint64_t numSplats)
+        : writer(writerType, filename, numSplats) {}
+
+    virtual void write(std::tr1::uint64_t first, std::size_t count, const Splat *splats)
+    {
+        writer.write(first, count, splats);
+    }
+
+    virtual void close()
+    {
+        writer.close();
+    }
+
+private:
+    FastPly::SplatCacheWriter writer;
+};
+
+/// Receives merged records in order
+class RecordSink
+{
+public:
+    virtual ~RecordSink() {}
+    virtual void write(const Record *records, std::size_t count) = 0;
+};
+
+/// Appends records to a temporary file, as a new run
+class RunSink : public RecordSink
+{
+public:
+    RunSink(const BinaryWriter &writer, std::tr1::uint64_t first) : writer(writer), next(first) {}
+
+    virtual void write(const Record *records, std::size_t count)
+    {
+        writer.write(records, count * sizeof(Record), next * sizeof(Record));
+        next += count;
+    }
+
+private:
+    const BinaryWriter &writer;
+    std::tr1::uint64_t next;
+};
+
+/// Passes the splats of records to an @ref Output
+class SplatSink : public RecordSink
+{
+public:
+    SplatSink(Output &output, ProgressMeter *progress) : output(output), progress(progress), next(0) {}
+
+    virtual void write(const Record *records, std::size_t count)
+    {
+        splats.resize(count);
+        for (std::size_t i = 0; i < count; i++)
+            splats[i] = records[i].splat;
+        output.write(next, count, &splats[0]);
+        next += count;
+        if (progress != NULL)
+            *progress += count;
+    }
+
+private:
+    Output &output;
+    ProgressMeter *progress;
+    std::tr1::uint64_t next;
+    std::vector<Splat> splats;
+};
+
+/// Read all of @a count records at record index @a first
+static void readRecords(const BinaryReader &reader, std::tr1::uint64_t first, std::size_t count, Record *out)
+{
+    const std::size_t bytes = count * sizeof(Record);
+    if (reader.read(out, bytes, first * sizeof(Record)) != bytes)
+        throw boost::enable_error_info(std::ios::failure("Temporary file is truncated"))
+            << boost::errinfo_file_name(reader.filename());
+}
+
+/**
+ * Sort @a n records in memory. Slices are sorted in parallel, then merged
+ * pairwise, also in parallel.
+ */
+static void sortRecords(Record *records, std::size_t n)
+{
+#ifdef _OPENMP
+    const long pieces = std::max(1, omp_get_max_threads());
+#else
+    const long pieces = 1;
+#endif
+    std::vector<std::size_t> bounds(pieces + 1);
+    for (long i = 0; i <= pieces; i++)
+        bounds[i] = std::tr1::uint64_t(n) * i / pieces;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (long i = 0; i < pieces; i++)
+        std::sort(records + bounds[i], records + bounds[i + 1], RecordLess());
+
+    for (long width = 1; width < pieces; width *= 2)
+    {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (long i = 0; i < pieces; i += 2 * width)
+        {
+            if (i + width < pieces)
+                std::inplace_merge(records + bounds[i], records + bounds[i + width],
+                                   records + bounds[std::min(i + 2 * width, pieces)], RecordLess());
+        }
+    }
+}
+
+/**
+ * Merge the runs in [@a first, @a last) of a temporary file into @a sink.
+ */
+static void mergeRuns(const BinaryReader &reader,
+                      std::vector<Run>::const_iterator first, std::vector<Run>::const_iterator last,
+                      RecordSink &sink)
+{
+    const std::size_t n = last - first;
+    std::vector<std::vector<Record> > buffers(n);
+    std::vector<std::size_t> pos(n, 0);
+    std::vector<std::tr1::uint64_t> next(n);
+    std::vector<Record> out;
+    out.reserve(mergeBufferSize);
+
+    // Ties go to the earlier run, so that equal keys keep their input order
+    typedef std::pair<std::tr1::uint64_t, std::size_t> entry;
+    std::priority_queue<entry, std::vector<entry>, std::greater<entry> > heap;
+
+    for (std::size_t i = 0; i < n; i++)
+    {
+        const Run &run = first[i];
+        next[i] = run.first;
+        const std::size_t count = std::min(std::tr1::uint64_t(mergeBufferSize), run.last - next[i]);
+        buffers[i].resize(count);
+        if (count > 0)
+        {
+            readRecords(reader, next[i], count, &buffers[i][0]);
+            next[i] += count;
+            heap.push(entry(buffers[i][0].key, i));
+        }
+    }
+
+    while (!heap.empty())
+    {
+        const std::size_t i = heap.top().second;
+        heap.pop();
+        out.push_back(buffers[i][pos[i]]);
+        if (out.size() == mergeBufferSize)
+        {
+            sink.write(&out[0], out.size());
+            out.clear();
+        }
+
+        pos[i]++;
+        if (pos[i] == buffers[i].size())
+        {
+            const std::size_t count = std::min(std::tr1::uint64_t(mergeBufferSize), first[i].last - next[i]);
+            buffers[i].resize(count);
+            pos[i] = 0;
+            if (count > 0)
+            {
+                readRecords(reader, next[i], count, &buffers[i][0]);
+                next[i] += count;
+            }
+        }
+        if (pos[i] < buffers[i].size())
+            heap.push(entry(buffers[i][pos[i]].key, i));
+    }
+    if (!out.empty())
+        sink.write(&out[0], out.size());
+}
+
+/// Temporary files holding runs, which are removed on destruction
+class TmpFiles : public boost::noncopyable
+{
+public:
+    ~TmpFiles()
+    {
+        for (std::size_t i = 0; i < paths.size(); i++)
+            remove(i);
+    }
+
+    /// Create a new empty file and return its path
+    const boost::filesystem::path &create()
+    {
+        boost::filesystem::path path;
+        boost::filesystem::ofstream out;
+        createTmpFile(path, out);
+        out.close();
+        paths.push_back(path);
+        return paths.back();
+    }
+
+    /// Remove the file returned by the @a idx-th call to @ref create
+    void remove(std::size_t idx)
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(paths[idx], ec);
+    }
+
+    std::size_t size() const { return paths.size(); }
+    const boost::filesystem::path &operator[](std::size_t idx) const { return paths[idx]; }
+    const boost::filesystem::path &back() const { return paths.back(); }
+
+private:
+    std::vector<boost::filesystem::path> paths;
+};
+
+static po::variables_map processOptions(int argc, char **argv)
+{
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help",                                                         "Show help")
+        ("spacing", po::value<double>(),                                 "Side of the cells ordered along the curve [bounding box / 2^21]")
+        ("memory", po::value<Capacity>()->default_value(1024 * 1024 * 1024), "Memory for sorting each run")
+        ("format", po::value<Choice<OutputFormatWrapper> >()->default_value(OUTPUT_PLY),
+                                                                         "Output format (ply | cache)")
+        ("writer", po::value<Choice<WriterTypeWrapper> >()->default_value(SYSCALL_WRITER),
+                                                                         "File writer class (syscall | stream | mmap | uring | zstd)")
+        ("tmp-dir", po::value<std::string>(),                            "Directory to store the sorted runs")
+        ("quiet,q",                                                      "Do not show progress");
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("output", po::value<std::string>()->required(), "output file")
+        ("input", po::value<std::vector<std::string> >()->composing()->required(), "input files");
+
+    po::options_description all;
+    all.add(desc);
+    all.add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("output", 1);
+    positional.add("input", -1);
+
+    const char *usage = "Usage: plymorton [options] output.ply input1.ply [input2.ply ...]\n\n";
+    try
+    {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv)
+                  .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+                  .options(all)
+                  .positional(positional)
+                  .run(), vm);
+        if (vm.count("help"))
+        {
+            std::cout << usage << desc << '\n';
+            std::exit(0);
+        }
+        po::notify(vm);
+
+        if (vm.count("spacing") && !(vm["spacing"].as<double>() > 0.0))
+            throw po::invalid_option_value("--spacing must be positive");
+        if (vm["memory"].as<Capacity>() < 16 * sizeof(Record))
+            throw po::invalid_option_value("--memory is too small");
+        return vm;
+    }
+    catch (po::error &e)
+    {
+        std::cerr << e.what() << "\n\n" << usage << desc << '\n';
+        std::exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::ios::sync_with_stdio(false);
+    const po::variables_map vm = processOptions(argc, argv);
+
+    const std::string filename = vm["output"].as<std::string>();
+    const std::vector<std::string> &inputs = vm["input"].as<std::vector<std::string> >();
+    const bool quiet = vm.count("quiet");
+    // Half the budget is left for the scratch space of the merges in sortRecords
+    const std::size_t runSize = std::max(std::size_t(1), std::size_t(vm["memory"].as<Capacity>() / (2 * sizeof(Record))));
+    if (vm.count("tmp-dir"))
+        setTmpFileDir(vm["tmp-dir"].as<std::string>());
+
+    TmpFiles tmpPaths;
+    try
+    {
+        SplatSet::FileSet files;
+        for (std::size_t i = 0; i < inputs.size(); i++)
+        {
+            std::auto_ptr<FastPly::Reader> reader(new FastPly::Reader(
+                    SYSCALL_READER, inputs[i], 1.0f, std::numeric_limits<float>::infinity()));
+            files.addFile(reader.get());
+            reader.release();
+        }
+
+        std::vector<Splat> buffer(blockSize);
+        std::vector<SplatSet::splat_id> ids(blockSize);
+
+        // First count the splats that survive filtering, and find their bounding box
+        float lower[3], upper[3];
+        std::fill(lower, lower + 3, std::numeric_limits<float>::infinity());
+        std::fill(upper, upper + 3, -std::numeric_limits<float>::infinity());
+        std::auto_ptr<SplatSet::SplatStream> stream(files.makeSplatStream());
+        std::tr1::uint64_t numSplats = 0;
+        std::size_t numRead;
+        do
+        {
+            numRead = stream->read(&buffer[0], &ids[0], blockSize);
+            for (std::size_t i = 0; i < numRead; i++)
+                for (unsigned int j = 0; j < 3; j++)
+                {
+                    lower[j] = std::min(lower[j], buffer[i].position[j]);
+                    upper[j] = std::max(upper[j], buffer[i].position[j]);
+                }
+            numSplats += numRead;
+        } while (numRead == blockSize);
+
+        double spacing;
+        if (vm.count("spacing"))
+            spacing = vm["spacing"].as<double>();
+        else
+        {
+            double extent = 0.0;
+            for (unsigned int j = 0; numSplats > 0 && j < 3; j++)
+                extent = std::max(extent, double(upper[j]) - lower[j]);
+            spacing = extent > 0.0 ? extent / (std::tr1::uint64_t(1) << keyBits) : 1.0;
+        }
+        const KeyMaker keyMaker(lower, spacing);
+
+        // Write sorted runs
+        boost::scoped_ptr<ProgressDisplay> progress;
+        if (!quiet)
+        {
+            std::cerr << "Sorting runs\n";
+            progress.reset(new ProgressDisplay(numSplats, std::cerr));
+        }
+        tmpPaths.create();
+        std::vector<Run> runs;
+        {
+            boost::scoped_ptr<BinaryWriter> tmp(createWriter(SYSCALL_WRITER));
+            tmp->open(tmpPaths.back());
+            std::vector<Record> records(std::min(std::tr1::uint64_t(runSize), numSplats));
+            stream.reset(files.makeSplatStream());
+            std::tr1::uint64_t done = 0;
+            while (done < numSplats)
+            {
+                std::size_t n = 0;
+                do
+                {
+                    const std::size_t want = std::min(blockSize, records.size() - n);
+                    numRead = stream->read(&buffer[0], &ids[0], want);
+                    const long count = numRead;
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+                    for (long i = 0; i < count; i++)
+                    {
+                        records[n + i].key = keyMaker(buffer[i]);
+                        records[n + i].splat = buffer[i];
+                    }
+                    n += numRead;
+                    if (numRead < want)
+                        break;
+                } while (n < records.size());
+                if (n == 0)
+                    break;
+
+                sortRecords(&records[0], n);
+                tmp->write(&records[0], n * sizeof(Record), done * sizeof(Record));
+                Run run;
+                run.first = done;
+                run.last = done + n;
+                runs.push_back(run);
+                done += n;
+                if (progress)
+                    *progress += n;
+            }
+            tmp->close();
+            numSplats = done;
+        }
+
+        // Merge until few enough runs remain to merge straight into the output
+        while (runs.size() > maxFanIn)
+        {
+            if (!quiet)
+                std::cerr << "Merging " << runs.size() << " runs\n";
+            tmpPaths.create();
+            boost::scoped_ptr<BinaryReader> in(createReader(SYSCALL_READER));
+            boost::scoped_ptr<BinaryWriter> out(createWriter(SYSCALL_WRITER));
+            in->open(tmpPaths[tmpPaths.size() - 2]);
+            out->open(tmpPaths.back());
+            std::vector<Run> merged;
+            for (std::size_t i = 0; i < runs.size(); i += maxFanIn)
+            {
+                const std::size_t last = std::min(i + maxFanIn, runs.size());
+                RunSink sink(*out, runs[i].first);
+                mergeRuns(*in, runs.begin() + i, runs.begin() + last, sink);
+                Run run;
+                run.first = runs[i].first;
+                run.last = runs[last - 1].last;
+                merged.push_back(run);
+            }
+            out->close();
+            in->close();
+            tmpPaths.remove(tmpPaths.size() - 2);
+            runs.swap(merged);
+        }
+
+        if (!quiet)
+        {
+            std::cerr << "Writing " << filename << '\n';
+            progress.reset(new ProgressDisplay(numSplats, std::cerr));
+        }
+        const WriterType writerType = vm["writer"].as<Choice<WriterTypeWrapper> >();
+        boost::scoped_ptr<Output> output;
+        if ((OutputFormat) vm["format"].as<Choice<OutputFormatWrapper> >() == OUTPUT_CACHE)
+            output.reset(new CacheOutput(writerType, filename, numSplats));
+        else
+            output.reset(new PlyOutput(writerType, filename, numSplats));
+        {
+            boost::scoped_ptr<BinaryReader> in(createReader(SYSCALL_READER));
+            in->open(tmpPaths.back());
+            SplatSink sink(*output, progress.get());
+            mergeRuns(*in, runs.begin(), runs.end(), sink);
+            in->close();
+        }
+        output->close();
+    }
+    catch (std::ios::failure &e)
+    {
+        const std::string *file = boost::get_error_info<boost::errinfo_file_name>(e);
+        std::cerr << (file != NULL ? *file : filename) << ": " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
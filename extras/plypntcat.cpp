@@ -2,6 +2,13 @@
  * @file
  *
  * Concatenate several PLY files containing points.
+ *
+ * When every input stores x, y, z, nx, ny, nz, radius as consecutive floats
+ * (the output layout, possibly with other properties around it), vertices
+ * are copied as bytes rather than decoded and re-encoded. Blocks are read
+ * and filtered in parallel and written in order. If the output is seekable
+ * the data is only read once, and the vertex count in the header is
+ * patched at the end.
  */
 
 #if HAVE_CONFIG_H
@@ -10,9 +17,20 @@
 
 #include <memory>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <limits>
 #include <vector>
+#include <cstring>
+#include <algorithm>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/exception_ptr.hpp>
+#if HAVE_OPEN
+# include <fcntl.h>
+#endif
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 #include "src/fast_ply.h"
 #include "src/logging.h"
 #include "src/tr1_cstdint.h"
@@ -26,6 +44,201 @@ struct OutSplat
     float radius;
 };
 
+/**
+ * Write the output header.
+ *
+ * @param out         Output stream
+ * @param numSplats   Number of vertices
+ * @param padding     If non-negative, a comment line with this many trailing
+ *                    spaces is added, so that the header can later be
+ *                    rewritten in place with a shorter vertex count.
+ */
+static void writeHeader(std::ostream &out, SplatSet::splat_id numSplats, int padding = -1)
+{
+    out <<
+        "ply\n"
+        "format binary_little_endian 1.0\n";
+    if (padding >= 0)
+        out << "comment" << std::string(padding, ' ') << '\n';
+    out <<
+        "element vertex " << numSplats << "\n" <<
+        "property float x\n"
+        "property float y\n"
+        "property float z\n"
+        "property float nx\n"
+        "property float ny\n"
+        "property float nz\n"
+        "property float radius\n"
+        "end_header\n";
+}
+
+/// Number of decimal digits in @a x
+static int numDigits(SplatSet::splat_id x)
+{
+    std::ostringstream s;
+    s << x;
+    return s.str().size();
+}
+
+/**
+ * Whether a vertex in the output layout survives the non-finite filter
+ * applied by @ref SplatSet::FileSet. The quality is computed in the same way
+ * as @ref FastPly::Reader::decode so that the same vertices are dropped.
+ */
+static bool keepVertex(const char *data)
+{
+    OutSplat s;
+    std::memcpy(&s, data, sizeof(s));
+    float quality = 1.0 / (s.radius * s.radius);
+    for (unsigned int i = 0; i < 3; i++)
+        if (!(std::tr1::isfinite)(s.position[i]) || !(std::tr1::isfinite)(s.normal[i]))
+            return false;
+    return (std::tr1::isfinite)(s.radius) && (std::tr1::isfinite)(quality);
+}
+
+/// Range of vertices in one file, processed as a unit
+struct Block
+{
+    std::size_t file;
+    FastPly::Reader::size_type first, last;
+};
+
+/// Buffers for one block
+struct BlockBuffer
+{
+    std::vector<char> raw;       ///< Vertices as stored in the file
+    std::vector<char> packed;    ///< Kept vertices in the output layout
+    const char *data;            ///< Either @ref raw or @ref packed
+    std::size_t size;            ///< Number of kept vertices at @ref data
+};
+
+/**
+ * Read a block and select the kept vertices in the output layout. If the
+ * file is already in the output layout and has no vertices to drop, the raw
+ * data is used directly.
+ */
+static void loadBlock(
+    const FastPly::Reader &reader, const FastPly::Reader::Handle &handle,
+    const Block &block, BlockBuffer &buffer)
+{
+    const std::size_t vertexSize = reader.getVertexSize();
+    const std::size_t offset = reader.getStandardOffset();
+    const std::size_t n = block.last - block.first;
+    buffer.raw.resize(n * vertexSize);
+    handle.readRaw(block.first, block.last, &buffer.raw[0]);
+
+    std::size_t i = 0;
+    if (vertexSize == sizeof(OutSplat))
+    {
+        while (i < n && keepVertex(&buffer.raw[i * vertexSize]))
+            i++;
+        if (i == n)
+        {
+            buffer.data = &buffer.raw[0];
+            buffer.size = n;
+            return;
+        }
+    }
+
+    buffer.packed.resize(n * sizeof(OutSplat));
+    if (i > 0)
+        std::memcpy(&buffer.packed[0], &buffer.raw[0], i * sizeof(OutSplat));
+    std::size_t kept = i;
+    for (; i < n; i++)
+    {
+        const char *v = &buffer.raw[i * vertexSize + offset];
+        if (keepVertex(v))
+        {
+            std::memcpy(&buffer.packed[kept * sizeof(OutSplat)], v, sizeof(OutSplat));
+            kept++;
+        }
+    }
+    buffer.data = &buffer.packed[0];
+    buffer.size = kept;
+}
+
+/**
+ * Copy the kept vertices of all the files to @a out, or just count them if
+ * @a out is @c NULL. Several blocks are loaded in parallel, then written
+ * in order.
+ *
+ * @return The number of vertices kept.
+ */
+static SplatSet::splat_id copyFast(const boost::ptr_vector<FastPly::Reader> &readers, std::ostream *out)
+{
+    const FastPly::Reader::size_type blockVertices = 1 << 16;
+#ifdef _OPENMP
+    const std::size_t batchBlocks = 4 * omp_get_max_threads();
+#else
+    const std::size_t batchBlocks = 1;
+#endif
+
+    boost::ptr_vector<FastPly::Reader::Handle> handles;
+    std::vector<Block> blocks;
+    for (std::size_t i = 0; i < readers.size(); i++)
+    {
+        handles.push_back(new FastPly::Reader::Handle(readers[i]));
+        for (FastPly::Reader::size_type first = 0; first < readers[i].size(); first += blockVertices)
+        {
+            Block block;
+            block.file = i;
+            block.first = first;
+            block.last = std::min(first + blockVertices, readers[i].size());
+            blocks.push_back(block);
+        }
+    }
+
+    std::vector<BlockBuffer> buffers(batchBlocks);
+    SplatSet::splat_id numSplats = 0;
+    for (std::size_t start = 0; start < blocks.size(); start += batchBlocks)
+    {
+        const long n = std::min(batchBlocks, blocks.size() - start);
+        boost::exception_ptr error;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+        for (long i = 0; i < n; i++)
+        {
+            try
+            {
+                const Block &block = blocks[start + i];
+                loadBlock(readers[block.file], handles[block.file], block, buffers[i]);
+            }
+            catch (...)
+            {
+#ifdef _OPENMP
+#pragma omp critical
+#endif
+                error = boost::current_exception();
+            }
+        }
+        if (error)
+            boost::rethrow_exception(error);
+
+        for (long i = 0; i < n; i++)
+        {
+            if (out != NULL && buffers[i].size > 0)
+                out->write(buffers[i].data, buffers[i].size * sizeof(OutSplat));
+            numSplats += buffers[i].size;
+        }
+    }
+    return numSplats;
+}
+
+/**
+ * Whether the standard output can be rewound to patch the header. Streams
+ * opened for appending are excluded because writes ignore the position.
+ */
+static bool outputSeekable()
+{
+#if HAVE_OPEN
+    int flags = fcntl(1, F_GETFL);
+    if (flags == -1 || (flags & O_APPEND))
+        return false;
+#endif
+    return std::cout.tellp() != std::streampos(-1);
+}
+
 int main(int argc, char **argv)
 {
     std::ios::sync_with_stdio(false);
@@ -36,15 +249,40 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    SplatSet::FileSet files;
+    boost::ptr_vector<FastPly::Reader> readers;
+    bool fast = true;
+    SplatSet::splat_id maxSplats = 0;
     for (int i = 1; i < argc; i++)
     {
         std::string filename(argv[i]);
-        std::auto_ptr<FastPly::Reader> reader(new FastPly::Reader(SYSCALL_READER, filename, 1.0f, std::numeric_limits<float>::infinity()));
-        files.addFile(reader.get());
-        reader.release();
+        readers.push_back(new FastPly::Reader(SYSCALL_READER, filename, 1.0f, std::numeric_limits<float>::infinity()));
+        fast = fast && readers.back().isStandardLayout();
+        maxSplats += readers.back().size();
+    }
+
+    if (fast)
+    {
+        if (outputSeekable())
+        {
+            const std::streampos start = std::cout.tellp();
+            writeHeader(std::cout, maxSplats, 0);
+            SplatSet::splat_id numSplats = copyFast(readers, &std::cout);
+            std::cout.seekp(start);
+            writeHeader(std::cout, numSplats, numDigits(maxSplats) - numDigits(numSplats));
+        }
+        else
+        {
+            writeHeader(std::cout, copyFast(readers, NULL));
+            copyFast(readers, &std::cout);
+        }
+        std::cout.flush();
+        return std::cout ? 0 : 1;
     }
 
+    SplatSet::FileSet files;
+    while (!readers.empty())
+        files.addFile(readers.release(readers.begin()).release());
+
     const std::size_t bufferSize = 1 << 20;
     std::vector<Splat> buffer(bufferSize);
     std::vector<SplatSet::splat_id> ids(bufferSize);
@@ -61,18 +299,7 @@ int main(int argc, char **argv)
     } while (numRead == bufferSize);
 
     // Now write the splats
-    std::cout <<
-        "ply\n"
-        "format binary_little_endian 1.0\n"
-        "element vertex " << numSplats << "\n" <<
-        "property float x\n"
-        "property float y\n"
-        "property float z\n"
-        "property float nx\n"
-        "property float ny\n"
-        "property float nz\n"
-        "property float radius\n"
-        "end_header\n";
+    writeHeader(std::cout, numSplats);
     stream.reset(files.makeSplatStream());
     do
     {
@@ -0,0 +1,86 @@
+/**
+ * @file
+ *
+ * Convert one or more PLY files to the compact splat cache format, which
+ * stores the normal packed into 32 bits (see @ref FastPly::SplatCacheWriter).
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <memory>
+#include <iostream>
+#include <limits>
+#include <vector>
+#include <string>
+#include <exception>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/exception/all.hpp>
+#include "src/fast_ply.h"
+#include "src/binary_io.h"
+#include "src/splat.h"
+#include "src/splat_set.h"
+
+int main(int argc, char **argv)
+{
+    std::ios::sync_with_stdio(false);
+
+    if (argc <= 2)
+    {
+        std::cerr << "Usage: plysplatcache output.ply file1.ply [file2.ply ... ]\n";
+        return 1;
+    }
+
+    try
+    {
+        SplatSet::FileSet files;
+        for (int i = 2; i < argc; i++)
+        {
+            std::string filename(argv[i]);
+            std::auto_ptr<FastPly::Reader> reader(new FastPly::Reader(SYSCALL_READER, filename, 1.0f, std::numeric_limits<float>::infinity()));
+            files.addFile(reader.get());
+            reader.release();
+        }
+
+        const std::size_t bufferSize = 1 << 20;
+        std::vector<Splat> buffer(bufferSize);
+        std::vector<SplatSet::splat_id> ids(bufferSize);
+
+        // First count the actual number of splats
+        std::auto_ptr<SplatSet::SplatStream> stream(files.makeSplatStream());
+        SplatSet::splat_id numSplats = 0;
+        std::size_t numRead;
+        do
+        {
+            numRead = stream->read(&buffer[0], &ids[0], bufferSize);
+            numSplats += numRead;
+        } while (numRead == bufferSize);
+
+        // Now write the splats
+        FastPly::SplatCacheWriter writer(SYSCALL_WRITER, argv[1], numSplats);
+        SplatSet::splat_id pos = 0;
+        stream.reset(files.makeSplatStream());
+        do
+        {
+            numRead = stream->read(&buffer[0], &ids[0], bufferSize);
+            writer.write(pos, numRead, &buffer[0]);
+            pos += numRead;
+        } while (numRead == bufferSize);
+        writer.close();
+    }
+    catch (std::ios::failure &e)
+    {
+        const std::string *file = boost::get_error_info<boost::errinfo_file_name>(e);
+        if (file != NULL)
+            std::cerr << *file << ": ";
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file
+ *
+ * Weld the meshes of tiles that were reconstructed in separate runs.
+ *
+ * Each run with @c --tile records the output vertices on the faces of its
+ * region (see @ref TileBoundary). This tool matches those records, without
+ * reading the meshes, and writes a list of welds. Each line names two output
+ * vertices that are the same point, as the file name, byte offset of the PLY
+ * header in the file (non-zero for @c --split-container) and vertex index,
+ * separated by tabs. Applying every weld joins the tiles into a single
+ * mesh.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <locale>
+#include <stdexcept>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/exception/all.hpp>
+#include "src/tile_boundary.h"
+
+namespace po = boost::program_options;
+
+static po::variables_map processOptions(int argc, char **argv)
+{
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help",                                                         "Show help")
+        ("quiet,q",                                                      "Do not show a summary");
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("output", po::value<std::string>()->required(), "output file")
+        ("input", po::value<std::vector<std::string> >()->composing()->required(), "input files");
+
+    po::options_description all;
+    all.add(desc);
+    all.add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("output", 1);
+    positional.add("input", -1);
+
+    const char *usage = "Usage: plystitch [options] welds.txt tile1.boundary tile2.boundary [...]\n\n";
+    try
+    {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv)
+                  .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+                  .options(all)
+                  .positional(positional)
+                  .run(), vm);
+        if (vm.count("help"))
+        {
+            std::cout << usage << desc << '\n';
+            std::exit(0);
+        }
+        po::notify(vm);
+        return vm;
+    }
+    catch (po::error &e)
+    {
+        std::cerr << e.what() << "\n\n" << usage << desc << '\n';
+        std::exit(1);
+    }
+}
+
+/// Write one side of a weld
+static void writeVertex(std::ostream &out, const TileBoundary::Record &tile, const TileBoundary::Vertex &v)
+{
+    const TileBoundary::OutputFile &file = tile.files[v.file];
+    out << file.filename << '\t' << file.offset << '\t' << v.index;
+}
+
+int main(int argc, char **argv)
+{
+    std::ios::sync_with_stdio(false);
+    const po::variables_map vm = processOptions(argc, argv);
+
+    const std::string filename = vm["output"].as<std::string>();
+    const std::vector<std::string> &inputs = vm["input"].as<std::vector<std::string> >();
+    try
+    {
+        std::vector<TileBoundary::Record> tiles(inputs.size());
+        for (std::size_t i = 0; i < inputs.size(); i++)
+            tiles[i].load(inputs[i]);
+
+        const std::vector<TileBoundary::Weld> welds = TileBoundary::stitch(tiles);
+
+        boost::filesystem::ofstream out(filename);
+        out.imbue(std::locale::classic());
+        for (std::size_t i = 0; i < welds.size(); i++)
+        {
+            const TileBoundary::Weld &w = welds[i];
+            writeVertex(out, tiles[w.tile[0]], w.vertex[0]);
+            out << '\t';
+            writeVertex(out, tiles[w.tile[1]], w.vertex[1]);
+            out << '\n';
+        }
+        out.close();
+        if (!out)
+            throw boost::enable_error_info(std::ios::failure("Could not write file"))
+                << boost::errinfo_file_name(filename);
+
+        if (!vm.count("quiet"))
+            std::cerr << welds.size() << " welds between " << tiles.size() << " tiles\n";
+    }
+    catch (std::ios::failure &e)
+    {
+        const std::string *file = boost::get_error_info<boost::errinfo_file_name>(e);
+        std::cerr << (file != NULL ? *file : filename) << ": " << e.what() << '\n';
+        return 1;
+    }
+    catch (std::runtime_error &e)
+    {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
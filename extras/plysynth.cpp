@@ -0,0 +1,600 @@
+/**
+ * @file
+ *
+ * Generate synthetic point clouds of arbitrary size for scaling experiments.
+ *
+ * Points are sampled from a procedural surface (a sphere, a height-field
+ * terrain or a grid of city blocks) and written straight to binary PLY or
+ * to the splat cache format. The output is generated in fixed-size blocks,
+ * each with its own random number stream derived from the seed, so the
+ * result depends only on the options and not on the number of threads.
+ *
+ * The local density can be modulated so that some parts of the surface are
+ * more densely sampled than others, and radii can be drawn from a
+ * log-normal distribution around a multiple of the local sample spacing.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <locale>
+#include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/math/constants/constants.hpp>
+#include <boost/tr1/random.hpp>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+#include "src/fast_ply.h"
+#include "src/binary_io.h"
+#include "src/options.h"
+#include "src/progress.h"
+#include "src/tr1_cstdint.h"
+#include "src/splat.h"
+
+namespace po = boost::program_options;
+
+typedef std::tr1::mt19937 Engine;
+
+/// Number of splats generated from each random number stream
+static const std::size_t blockSize = 1 << 18;
+
+enum ShapeType
+{
+    SHAPE_SPHERE,
+    SHAPE_TERRAIN,
+    SHAPE_CITY
+};
+
+/// Wrapper around @ref ShapeType for use with @ref Choice.
+class ShapeTypeWrapper
+{
+public:
+    typedef ShapeType type;
+    static std::map<std::string, ShapeType> getNameMap()
+    {
+        std::map<std::string, ShapeType> ans;
+        ans["sphere"] = SHAPE_SPHERE;
+        ans["terrain"] = SHAPE_TERRAIN;
+        ans["city"] = SHAPE_CITY;
+        return ans;
+    }
+};
+
+enum OutputFormat
+{
+    OUTPUT_PLY,
+    OUTPUT_CACHE
+};
+
+/// Wrapper around @ref OutputFormat for use with @ref Choice.
+class OutputFormatWrapper
+{
+public:
+    typedef OutputFormat type;
+    static std::map<std::string, OutputFormat> getNameMap()
+    {
+        std::map<std::string, OutputFormat> ans;
+        ans["ply"] = OUTPUT_PLY;
+        ans["cache"] = OUTPUT_CACHE;
+        return ans;
+    }
+};
+
+/**
+ * Uniform random number in [0, 1). This is used rather than the TR1
+ * distributions so that the output does not depend on the library version.
+ */
+static inline float uniform(Engine &engine)
+{
+    return (engine() >> 8) * (1.0f / 16777216.0f);
+}
+
+/// Standard normal random number, using the Box-Muller transform
+static inline float gaussian(Engine &engine)
+{
+    const float pi = boost::math::constants::pi<float>();
+    const float u = 1.0f - uniform(engine);   // in (0, 1]
+    const float v = uniform(engine);
+    return std::sqrt(-2.0f * std::log(u)) * std::cos(2.0f * pi * v);
+}
+
+static void normalize(float v[3])
+{
+    const float len = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    for (unsigned int i = 0; i < 3; i++)
+        v[i] /= len;
+}
+
+/**
+ * A procedural surface. Implementations must be safe to sample from several
+ * threads at once.
+ */
+class Shape
+{
+public:
+    virtual ~Shape() {}
+
+    /// Surface area, used to determine the mean sample spacing
+    virtual double area() const = 0;
+
+    /// Draw a random point on the surface, with its unit normal
+    virtual void sample(Engine &engine, float position[3], float normal[3]) const = 0;
+};
+
+/// Sphere inscribed in the cube [0, size]^3, sampled uniformly
+class SphereShape : public Shape
+{
+public:
+    explicit SphereShape(float size) : r(size * 0.5f) {}
+
+    virtual double area() const
+    {
+        return 4.0 * boost::math::constants::pi<double>() * r * r;
+    }
+
+    virtual void sample(Engine &engine, float position[3], float normal[3]) const
+    {
+        const float pi = boost::math::constants::pi<float>();
+        const float z = 2.0f * uniform(engine) - 1.0f;
+        const float theta = 2.0f * pi * uniform(engine);
+        const float rxy = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        normal[0] = rxy * std::cos(theta);
+        normal[1] = rxy * std::sin(theta);
+        normal[2] = z;
+        for (unsigned int i = 0; i < 3; i++)
+            position[i] = r + r * normal[i];
+    }
+
+private:
+    float r;
+};
+
+/**
+ * Height field over [0, size]^2 made up of a few octaves of sinusoids.
+ * Points are uniform in x and y, so steep regions are slightly more sparsely
+ * sampled than flat ones.
+ */
+class TerrainShape : public Shape
+{
+public:
+    explicit TerrainShape(float size) : size(size), amplitude(size * 0.05f)
+    {
+        // Integrate the surface area numerically
+        const int steps = 256;
+        const float step = size / steps;
+        double total = 0.0;
+        for (int i = 0; i < steps; i++)
+            for (int j = 0; j < steps; j++)
+            {
+                float n[3];
+                gradient((i + 0.5f) * step, (j + 0.5f) * step, n);
+                total += std::sqrt(1.0 + n[0] * n[0] + n[1] * n[1]);
+            }
+        surfaceArea = total * step * step;
+    }
+
+    virtual double area() const { return surfaceArea; }
+
+    virtual void sample(Engine &engine, float position[3], float normal[3]) const
+    {
+        const float x = uniform(engine) * size;
+        const float y = uniform(engine) * size;
+        float grad[3];
+        position[0] = x;
+        position[1] = y;
+        position[2] = gradient(x, y, grad);
+        normal[0] = -grad[0];
+        normal[1] = -grad[1];
+        normal[2] = 1.0f;
+        normalize(normal);
+    }
+
+private:
+    static const int octaves = 5;
+
+    float size;
+    float amplitude;
+    double surfaceArea;
+
+    /// Returns the height at (x, y), and stores dh/dx and dh/dy in @a grad
+    float gradient(float x, float y, float grad[3]) const
+    {
+        const float pi = boost::math::constants::pi<float>();
+        float h = 0.0f;
+        grad[0] = grad[1] = 0.0f;
+        for (int k = 0; k < octaves; k++)
+        {
+            const float f = 2.0f * pi * 3.0f * (1 << k) / size;
+            const float a = amplitude / (1 << k);
+            const float sx = std::sin(f * x + k), cx = std::cos(f * x + k);
+            const float sy = std::sin(f * y + 2 * k), cy = std::cos(f * y + 2 * k);
+            h += a * sx * cy;
+            grad[0] += a * f * cx * cy;
+            grad[1] -= a * f * sx * sy;
+        }
+        return h + amplitude * 2.0f;
+    }
+};
+
+/**
+ * A square grid of blocks over [0, size]^2, each containing one box-shaped
+ * building surrounded by street. Only the visible faces are sampled: the
+ * street, the walls and the roofs.
+ */
+class CityShape : public Shape
+{
+public:
+    CityShape(float size, unsigned long seed) : total(0.0)
+    {
+        const int blocks = 16;
+        const float pitch = size / blocks;
+        const float margin = pitch * 0.2f;
+        Engine engine(seed ^ 0x5bd1e995UL);
+        for (int i = 0; i < blocks; i++)
+            for (int j = 0; j < blocks; j++)
+            {
+                const float x0 = i * pitch, y0 = j * pitch;
+                const float x1 = x0 + margin, y1 = y0 + margin;
+                const float x2 = x0 + pitch - margin, y2 = y0 + pitch - margin;
+                const float h = pitch * (0.5f + 3.0f * uniform(engine));
+                const float w = x2 - x1;
+
+                // Street around the building
+                addFace(x0, y0, 0, margin, 0, 0, 0, pitch, 0, 0, 0, 1);
+                addFace(x2, y0, 0, margin, 0, 0, 0, pitch, 0, 0, 0, 1);
+                addFace(x1, y0, 0, w, 0, 0, 0, margin, 0, 0, 0, 1);
+                addFace(x1, y2, 0, w, 0, 0, 0, margin, 0, 0, 0, 1);
+                // Walls
+                addFace(x1, y1, 0, w, 0, 0, 0, 0, h, 0, -1, 0);
+                addFace(x1, y2, 0, w, 0, 0, 0, 0, h, 0, 1, 0);
+                addFace(x1, y1, 0, 0, w, 0, 0, 0, h, -1, 0, 0);
+                addFace(x2, y1, 0, 0, w, 0, 0, 0, h, 1, 0, 0);
+                // Roof
+                addFace(x1, y1, h, w, 0, 0, 0, w, 0, 0, 0, 1);
+            }
+    }
+
+    virtual double area() const { return total; }
+
+    virtual void sample(Engine &engine, float position[3], float normal[3]) const
+    {
+        const double pick = uniform(engine) * total;
+        std::size_t idx = std::upper_bound(cumArea.begin(), cumArea.end(), pick) - cumArea.begin();
+        idx = std::min(idx, faces.size() - 1);
+        const Face &f = faces[idx];
+        const float a = uniform(engine);
+        const float b = uniform(engine);
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            position[i] = f.origin[i] + a * f.u[i] + b * f.v[i];
+            normal[i] = f.normal[i];
+        }
+    }
+
+private:
+    /// Axis-aligned rectangle spanned by @a u and @a v
+    struct Face
+    {
+        float origin[3];
+        float u[3];
+        float v[3];
+        float normal[3];
+    };
+
+    std::vector<Face> faces;
+    std::vector<double> cumArea;   ///< Running total of face areas
+    double total;
+
+    void addFace(float ox, float oy, float oz,
+                 float ux, float uy, float uz,
+                 float vx, float vy, float vz,
+                 float nx, float ny, float nz)
+    {
+        const Face f = {{ ox, oy, oz }, { ux, uy, uz }, { vx, vy, vz }, { nx, ny, nz }};
+        faces.push_back(f);
+        total += std::sqrt(ux * ux + uy * uy + uz * uz) * std::sqrt(vx * vx + vy * vy + vz * vz);
+        cumArea.push_back(total);
+    }
+};
+
+/// Parameters that control how splats are generated from a @ref Shape
+struct Params
+{
+    unsigned long seed;
+    float spacing;          ///< Mean distance between samples
+    float radius;           ///< Median radius as a multiple of the local spacing
+    float radiusSpread;     ///< Standard deviation of log(radius)
+    float noise;            ///< Standard deviation of normal displacement, relative to spacing
+    float densityVariation; ///< Fraction of samples rejected in the sparsest regions
+    float densityScale;     ///< Wavelength of the density modulation
+};
+
+/**
+ * Generate the splats for one block. The random number stream is derived
+ * only from the seed and the block index.
+ */
+static void generateBlock(const Shape &shape, const Params &params,
+                          std::tr1::uint64_t block, std::size_t count,
+                          std::vector<Splat> &out)
+{
+    const float pi = boost::math::constants::pi<float>();
+    const std::tr1::uint32_t mixed = std::tr1::uint32_t(params.seed) * 2654435761U
+        ^ (std::tr1::uint32_t(block) * 2246822519U + 374761393U);
+    Engine engine(mixed);
+    out.resize(count);
+    std::size_t n = 0;
+    while (n < count)
+    {
+        Splat &s = out[n];
+        shape.sample(engine, s.position, s.normal);
+
+        // Thin out the samples with a smooth periodic acceptance probability
+        float keep = 1.0f;
+        if (params.densityVariation > 0.0f)
+        {
+            const float k = 2.0f * pi / params.densityScale;
+            const float fx = 0.5f + 0.5f * std::sin(k * s.position[0]);
+            const float fy = 0.5f + 0.5f * std::sin(k * s.position[1] + 1.0f);
+            const float fz = 0.5f + 0.5f * std::sin(k * s.position[2] + 2.0f);
+            keep = 1.0f - params.densityVariation * fx * fy * fz;
+            if (uniform(engine) >= keep)
+                continue;
+        }
+
+        const float local = params.spacing / std::sqrt(keep);
+        s.radius = params.radius * local;
+        if (params.radiusSpread > 0.0f)
+            s.radius *= std::exp(params.radiusSpread * gaussian(engine));
+        if (params.noise > 0.0f)
+        {
+            const float d = params.noise * params.spacing * gaussian(engine);
+            for (unsigned int i = 0; i < 3; i++)
+                s.position[i] += d * s.normal[i];
+        }
+        s.quality = 1.0f;
+        n++;
+    }
+}
+
+/// Destination for generated splats
+class Output
+{
+public:
+    virtual ~Output() {}
+    virtual void write(std::tr1::uint64_t first, std::size_t count, const Splat *splats) = 0;
+    virtual void close() = 0;
+};
+
+/// Binary PLY with x, y, z, nx, ny, nz, radius, as read by @ref FastPly::Reader
+class PlyOutput : public Output
+{
+public:
+    PlyOutput(WriterType writerType, const std::string &filename, std::tr1::uint64_t numSplats)
+        : handle(createWriter(writerType))
+    {
+        std::ostringstream header;
+        header.imbue(std::locale::classic());
+        header <<
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "comment generated by plysynth\n"
+            "element vertex " << numSplats << "\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property float nx\n"
+            "property float ny\n"
+            "property float nz\n"
+            "property float radius\n"
+            "end_header\n";
+        const std::string h = header.str();
+        headerSize = h.size();
+
+        handle->open(filename);
+        handle->resize(headerSize + numSplats * vertexSize);
+        handle->write(h.data(), h.size(), 0);
+    }
+
+    virtual void write(std::tr1::uint64_t first, std::size_t count, const Splat *splats)
+    {
+        buffer.resize(count * vertexSize);
+        char *out = buffer.empty() ? NULL : &buffer[0];
+        for (std::size_t i = 0; i < count; i++)
+        {
+            std::memcpy(out, splats[i].position, 3 * sizeof(float));
+            std::memcpy(out + 3 * sizeof(float), splats[i].normal, 3 * sizeof(float));
+            std::memcpy(out + 6 * sizeof(float), &splats[i].radius, sizeof(float));
+            out += vertexSize;
+        }
+        if (count > 0)
+            handle->write(&buffer[0], buffer.size(), headerSize + first * vertexSize);
+    }
+
+    virtual void close()
+    {
+        handle->close();
+    }
+
+private:
+    static const std::size_t vertexSize = 7 * sizeof(float);
+
+    boost::scoped_ptr<BinaryWriter> handle;
+    std::tr1::uint64_t headerSize;
+    std::vector<char> buffer;
+};
+
+/// Splat cache format, written by @ref FastPly::SplatCacheWriter
+class CacheOutput : public Output
+{
+public:
+    CacheOutput(WriterType writerType, const std::string &filename, std::tr1::uint64_t numSplats)
+        : writer(writerType, filename, numSplats) {}
+
+    virtual void write(std::tr1::uint64_t first, std::size_t count, const Splat *splats)
+    {
+        writer.write(first, count, splats);
+    }
+
+    virtual void close()
+    {
+        writer.close();
+    }
+
+private:
+    FastPly::SplatCacheWriter writer;
+};
+
+static po::variables_map processOptions(int argc, char **argv)
+{
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help",                                                         "Show help")
+        ("shape", po::value<Choice<ShapeTypeWrapper> >()->default_value(SHAPE_SPHERE),
+                                                                         "Surface to sample (sphere | terrain | city)")
+        ("splats", po::value<std::tr1::uint64_t>()->default_value(1000000), "Number of splats to generate")
+        ("size", po::value<float>()->default_value(1000.0f),             "Extent of the surface in world units")
+        ("seed", po::value<unsigned long>()->default_value(1),           "Random seed")
+        ("radius", po::value<float>()->default_value(2.0f),              "Median radius as a multiple of the sample spacing")
+        ("radius-spread", po::value<float>()->default_value(0.0f),       "Standard deviation of log(radius)")
+        ("noise", po::value<float>()->default_value(0.0f),               "Standard deviation of displacement along the normal, relative to the sample spacing")
+        ("density-variation", po::value<float>()->default_value(0.0f),   "Fraction of samples dropped in the sparsest regions (0 to 0.99)")
+        ("density-scale", po::value<float>(),                            "Wavelength of the density variation [size / 4]")
+        ("format", po::value<Choice<OutputFormatWrapper> >()->default_value(OUTPUT_PLY),
+                                                                         "Output format (ply | cache)")
+        ("writer", po::value<Choice<WriterTypeWrapper> >()->default_value(SYSCALL_WRITER),
+                                                                         "File writer class (syscall | stream | uring | zstd)")
+        ("quiet,q",                                                      "Do not show progress");
+
+    po::options_description hidden;
+    hidden.add_options()
+        ("output", po::value<std::string>()->required(), "output file");
+
+    po::options_description all;
+    all.add(desc);
+    all.add(hidden);
+
+    po::positional_options_description positional;
+    positional.add("output", 1);
+
+    try
+    {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv)
+                  .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+                  .options(all)
+                  .positional(positional)
+                  .run(), vm);
+        if (vm.count("help"))
+        {
+            std::cout << "Usage: plysynth [options] output.ply\n\n" << desc << '\n';
+            std::exit(0);
+        }
+        po::notify(vm);
+
+        if (vm["splats"].as<std::tr1::uint64_t>() < 1)
+            throw po::invalid_option_value("--splats must be positive");
+        if (!(vm["size"].as<float>() > 0.0f))
+            throw po::invalid_option_value("--size must be positive");
+        if (!(vm["radius"].as<float>() > 0.0f))
+            throw po::invalid_option_value("--radius must be positive");
+        if (vm["radius-spread"].as<float>() < 0.0f || vm["noise"].as<float>() < 0.0f)
+            throw po::invalid_option_value("--radius-spread and --noise must be non-negative");
+        const float dv = vm["density-variation"].as<float>();
+        if (!(dv >= 0.0f && dv <= 0.99f))
+            throw po::invalid_option_value("--density-variation must be in [0, 0.99]");
+        if (vm.count("density-scale") && !(vm["density-scale"].as<float>() > 0.0f))
+            throw po::invalid_option_value("--density-scale must be positive");
+        return vm;
+    }
+    catch (po::error &e)
+    {
+        std::cerr << e.what() << "\n\nUsage: plysynth [options] output.ply\n\n" << desc << '\n';
+        std::exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::ios::sync_with_stdio(false);
+    const po::variables_map vm = processOptions(argc, argv);
+
+    const std::string filename = vm["output"].as<std::string>();
+    const std::tr1::uint64_t numSplats = vm["splats"].as<std::tr1::uint64_t>();
+    const float size = vm["size"].as<float>();
+
+    Params params;
+    params.seed = vm["seed"].as<unsigned long>();
+    params.radius = vm["radius"].as<float>();
+    params.radiusSpread = vm["radius-spread"].as<float>();
+    params.noise = vm["noise"].as<float>();
+    params.densityVariation = vm["density-variation"].as<float>();
+    params.densityScale = vm.count("density-scale") ? vm["density-scale"].as<float>() : size * 0.25f;
+
+    boost::scoped_ptr<Shape> shape;
+    switch ((ShapeType) vm["shape"].as<Choice<ShapeTypeWrapper> >())
+    {
+    case SHAPE_SPHERE:  shape.reset(new SphereShape(size)); break;
+    case SHAPE_TERRAIN: shape.reset(new TerrainShape(size)); break;
+    case SHAPE_CITY:    shape.reset(new CityShape(size, params.seed)); break;
+    }
+    params.spacing = std::sqrt(shape->area() / numSplats);
+
+    try
+    {
+        const WriterType writerType = vm["writer"].as<Choice<WriterTypeWrapper> >();
+        boost::scoped_ptr<Output> output;
+        if ((OutputFormat) vm["format"].as<Choice<OutputFormatWrapper> >() == OUTPUT_CACHE)
+            output.reset(new CacheOutput(writerType, filename, numSplats));
+        else
+            output.reset(new PlyOutput(writerType, filename, numSplats));
+
+        boost::scoped_ptr<ProgressDisplay> progress;
+        if (!vm.count("quiet"))
+            progress.reset(new ProgressDisplay(numSplats, std::cerr));
+
+        // Blocks are generated a batch at a time in parallel and then written in order
+        const std::tr1::uint64_t numBlocks = (numSplats + blockSize - 1) / blockSize;
+#ifdef _OPENMP
+        const std::size_t batch = omp_get_max_threads();
+#else
+        const std::size_t batch = 1;
+#endif
+        std::vector<std::vector<Splat> > buffers(batch);
+        for (std::tr1::uint64_t start = 0; start < numBlocks; start += batch)
+        {
+            const int n = std::min(std::tr1::uint64_t(batch), numBlocks - start);
+#pragma omp parallel for schedule(dynamic, 1)
+            for (int i = 0; i < n; i++)
+            {
+                const std::tr1::uint64_t block = start + i;
+                const std::size_t count = std::min(std::tr1::uint64_t(blockSize), numSplats - block * blockSize);
+                generateBlock(*shape, params, block, count, buffers[i]);
+            }
+            for (int i = 0; i < n; i++)
+            {
+                output->write((start + i) * blockSize, buffers[i].size(), &buffers[i][0]);
+                if (progress)
+                    *progress += buffers[i].size();
+            }
+        }
+        output->close();
+    }
+    catch (std::ios::failure &e)
+    {
+        std::cerr << filename << ": " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
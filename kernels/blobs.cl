@@ -0,0 +1,166 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Blob computation for @ref BlobComputerCL. The bucket ranges must match
+ * those computed by @c SplatSet::detail::SplatToBuckets bit for bit, so
+ * contraction of the arithmetic is disabled.
+ */
+
+#pragma OPENCL FP_CONTRACT OFF
+
+/**
+ * Divide @a x by the bucket size, rounding down, using the parameters of
+ * a @c DownDivider (negAdd, posAdd, inverse, shift).
+ */
+inline int divideDown(int x, int4 divider)
+{
+    long xl = x;
+    if (x < divider.s0 || x > divider.s1)
+        xl++;
+    return (int) ((xl * divider.s2) >> divider.s3);
+}
+
+/**
+ * Compute the range of buckets touched by a splat, given as position and
+ * radius.
+ */
+inline void splatToBuckets(float4 splat, float invSpacing, int4 divider, int3 *lower, int3 *upper)
+{
+    const float3 loWorld = splat.xyz - splat.w;
+    const float3 hiWorld = splat.xyz + splat.w;
+    const int3 loCell = convert_int3_rtn(loWorld * invSpacing);
+    const int3 hiCell = convert_int3_rtn(hiWorld * invSpacing);
+    *lower = (int3) (divideDown(loCell.x, divider), divideDown(loCell.y, divider), divideDown(loCell.z, divider));
+    *upper = (int3) (divideDown(hiCell.x, divider), divideDown(hiCell.y, divider), divideDown(hiCell.z, divider));
+}
+
+/**
+ * Flag the splats that start a new blob, and reduce the bounding box and
+ * incidence over each work-group. A splat continues the blob of its
+ * predecessor if their IDs are consecutive and they touch the same buckets.
+ *
+ * @param heads           1 for each splat that starts a blob, 0 otherwise,
+ *                        and 0 in position @a n.
+ * @param groupBounds     Minimum (xyz) and maximum (xyz) of the splat bounding
+ *                        boxes in each work-group.
+ * @param groupIncidence  Total number of buckets touched by the splats in each work-group.
+ * @param splats          Splats, with the position and radius in the first half.
+ * @param ids             Splat IDs.
+ * @param n               Number of splats.
+ * @param invSpacing      Reciprocal of the grid spacing.
+ * @param divider         Parameters for @ref divideDown.
+ */
+__kernel void findBlobHeads(
+    __global uint * restrict heads,
+    __global float * restrict groupBounds,
+    __global ulong * restrict groupIncidence,
+    __global const float4 * restrict splats,
+    __global const ulong * restrict ids,
+    uint n,
+    float invSpacing,
+    int4 divider)
+{
+    __local float4 lMin[WGS];
+    __local float4 lMax[WGS];
+    __local ulong lIncidence[WGS];
+
+    const uint gid = get_global_id(0);
+    const uint lid = get_local_id(0);
+    float4 bMin = (float4) (INFINITY);
+    float4 bMax = (float4) (-INFINITY);
+    ulong incidence = 0;
+
+    if (gid < n)
+    {
+        const float4 splat = splats[2 * gid];
+        int3 lower, upper;
+        splatToBuckets(splat, invSpacing, divider, &lower, &upper);
+        bMin.xyz = splat.xyz - splat.w;
+        bMax.xyz = splat.xyz + splat.w;
+        incidence = (ulong) (upper.x - lower.x + 1) * (upper.y - lower.y + 1) * (upper.z - lower.z + 1);
+
+        uint head = 1;
+        if (gid > 0 && ids[gid - 1] + 1 == ids[gid])
+        {
+            int3 prevLower, prevUpper;
+            splatToBuckets(splats[2 * (gid - 1)], invSpacing, divider, &prevLower, &prevUpper);
+            if (all(lower == prevLower) && all(upper == prevUpper))
+                head = 0;
+        }
+        heads[gid] = head;
+    }
+    else if (gid == n)
+        heads[gid] = 0;
+
+    lMin[lid] = bMin;
+    lMax[lid] = bMax;
+    lIncidence[lid] = incidence;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint stride = WGS / 2; stride > 0; stride >>= 1)
+    {
+        if (lid < stride)
+        {
+            lMin[lid] = fmin(lMin[lid], lMin[lid + stride]);
+            lMax[lid] = fmax(lMax[lid], lMax[lid + stride]);
+            lIncidence[lid] += lIncidence[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0)
+    {
+        const uint group = get_group_id(0);
+        vstore3(lMin[0].xyz, 2 * group, groupBounds);
+        vstore3(lMax[0].xyz, 2 * group + 1, groupBounds);
+        groupIncidence[group] = lIncidence[0];
+    }
+}
+
+/**
+ * Write out the blobs, using the scan of the flags from @ref findBlobHeads
+ * as the output positions.
+ *
+ * @param blobs           Inclusive lower and upper bucket coordinates and the
+ *                        index of the first splat of each blob.
+ * @param positions       Exclusive scan of the flags, with @a n + 1 elements.
+ * @param splats, n, invSpacing, divider   As for @ref findBlobHeads.
+ */
+__kernel void compactBlobs(
+    __global int8 * restrict blobs,
+    __global const uint * restrict positions,
+    __global const float4 * restrict splats,
+    uint n,
+    float invSpacing,
+    int4 divider)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= n)
+        return;
+    const uint pos = positions[gid];
+    if (pos != positions[gid + 1])
+    {
+        int3 lower, upper;
+        splatToBuckets(splats[2 * gid], invSpacing, divider, &lower, &upper);
+        blobs[pos] = (int8) (lower, upper, (int) gid, 0);
+    }
+}
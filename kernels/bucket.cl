@@ -0,0 +1,125 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Counting pass of the bucketing, for @ref BucketCounterCL. The updates are
+ * the same as those made by @c BucketState::countSplats on the host.
+ */
+
+/**
+ * Add @a delta to a 64-bit counter stored as low and high 32-bit words.
+ * A carry out of the low word is added to the high word separately, which
+ * gives the exact total once all the updates have completed since the
+ * additions commute.
+ */
+inline void addCounter(volatile __global uint *counter, long delta)
+{
+    const uint lo = (uint) delta;
+    uint hi = (uint) (delta >> 32);
+    const uint old = atomic_add(counter, lo);
+    if (old + lo < old)
+        hi++;
+    if (hi != 0)
+        atomic_add(counter + 1, hi);
+}
+
+/**
+ * Add @a delta to the nodes (@a x, @a y, z) of one level, for z in
+ * [@a zLo, @a zHi].
+ */
+inline void addCountRow(volatile __global uint *level, uint3 size,
+                        uint x, uint y, uint zLo, uint zHi, long delta)
+{
+    const size_t row = ((size_t) x * size.y + y) * size.z;
+    for (uint z = zLo; z <= zHi; z++)
+        addCounter(level + 2 * (row + z), delta);
+}
+
+/**
+ * Enter one blob per work-item into the trees of counters.
+ *
+ * @param counters    Low and high words of the counters of all the trees.
+ * @param trees       For each tree, the dimensions of the finest level (xyz)
+ *                    and the index of its first counter (w).
+ * @param blobs       Eight words per blob: inclusive lower and upper
+ *                    microblock coordinates, number of splats and tree index.
+ * @param levels      Number of levels in each tree.
+ */
+__kernel void countBlobs(
+    volatile __global uint *counters,
+    __global const uint4 * restrict trees,
+    __global const uint * restrict blobs,
+    uint numBlobs,
+    uint levels)
+{
+    const uint gid = get_global_id(0);
+    if (gid >= numBlobs)
+        return;
+
+    const uint8 blob = vload8(gid, blobs);
+    uint3 lo = blob.s012;
+    uint3 hi = blob.s345;
+    const long numSplats = blob.s6;
+    const uint4 tree = trees[blob.s7];
+    uint3 size = tree.xyz;
+    volatile __global uint *level = counters + 2 * (size_t) tree.w;
+
+    for (uint x = lo.x; x <= hi.x; x++)
+        for (uint y = lo.y; y <= hi.y; y++)
+            addCountRow(level, size, x, y, lo.z, hi.z, numSplats);
+
+    for (uint l = 1; l < levels && any(lo < hi); l++)
+    {
+        level += 2 * ((size_t) size.x * size.y * size.z);
+        size = (size + 1) >> 1;
+
+        /* See BucketState::countSplats for the derivation */
+        const uint zLo = lo.z >> 1;
+        const uint zHi = hi.z >> 1;
+        uint zLo2 = zHi + 1, zHi2 = zHi;
+        if (lo.z < hi.z)
+        {
+            zLo2 = (lo.z + 1) >> 1;
+            zHi2 = (hi.z - 1) >> 1;
+        }
+        for (uint x = lo.x >> 1; x <= (hi.x >> 1); x++)
+            for (uint y = lo.y >> 1; y <= (hi.y >> 1); y++)
+            {
+                long hits = 1;
+                if (lo.x <= 2 * x && 2 * x < hi.x)
+                    hits *= 2;
+                if (lo.y <= 2 * y && 2 * y < hi.y)
+                    hits *= 2;
+                if (hits > 1)
+                {
+                    if (zLo < zLo2)
+                        addCountRow(level, size, x, y, zLo, zLo2 - 1, -(hits - 1) * numSplats);
+                    if (zHi2 < zHi)
+                        addCountRow(level, size, x, y, zHi2 + 1, zHi, -(hits - 1) * numSplats);
+                }
+                if (zLo2 <= zHi2)
+                    addCountRow(level, size, x, y, zLo2, zHi2, -(2 * hits - 1) * numSplats);
+            }
+        lo >>= 1;
+        hi >>= 1;
+    }
+}
@@ -0,0 +1,197 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Decimation of meshes by clustering internal vertices that fall into the
+ * same cube. External vertices are never moved or merged, so that the mesh
+ * still welds with its neighbours.
+ */
+
+/**
+ * Compute the cluster code for each internal vertex, and initialize the
+ * vertex IDs to be sorted along with them. There is one work-item per
+ * internal vertex.
+ *
+ * @param[out] codes       Cluster code for each vertex.
+ * @param[out] ids         Index of each vertex.
+ * @param      vertices    Vertices as packed xyz triplets.
+ * @param      origin      Minimum corner of the region, in the units of @a vertices.
+ * @param      invCellSize Inverse of the edge length of the clustering cubes.
+ * @param      maxCell     Largest valid cube coordinate on each axis.
+ * @param      axisBits    Number of bits per axis in the codes.
+ */
+__kernel void decimateCodes(
+    __global ulong * restrict codes,
+    __global uint * restrict ids,
+    __global const float * restrict vertices,
+    float3 origin,
+    float invCellSize,
+    uint3 maxCell,
+    uint axisBits)
+{
+    const uint gid = get_global_id(0);
+    const float3 v = vload3(gid, vertices);
+    const uint3 cell = min(convert_uint3_sat_rtn((v - origin) * invCellSize), maxCell);
+    codes[gid] = ((ulong) cell.z << (2 * axisBits)) | ((ulong) cell.y << axisBits) | cell.x;
+    ids[gid] = gid;
+}
+
+/**
+ * Flag the first vertex of each cluster after sorting by code. There is one
+ * work-item per internal vertex, plus one to write a zero sentinel.
+ *
+ * @param[out] heads     1 for the first vertex of each run of equal codes, 0 otherwise.
+ * @param      codes     Sorted cluster codes.
+ * @param      n         Number of internal vertices.
+ */
+__kernel void decimateHeads(
+    __global uint * restrict heads,
+    __global const ulong * restrict codes,
+    uint n)
+{
+    const uint gid = get_global_id(0);
+    heads[gid] = gid < n && (gid == 0 || codes[gid] != codes[gid - 1]);
+}
+
+/**
+ * Emit one vertex per cluster, at the centroid of the vertices in it, and
+ * record the cluster of every internal vertex. There is one work-item per
+ * internal vertex.
+ *
+ * @param[out] outVertices  Cluster vertices, as packed xyz triplets.
+ * @param[out] vertexMap    Maps original vertex indices to output indices.
+ * @param      inVertices   Original vertices.
+ * @param      codes        Sorted cluster codes.
+ * @param      ids          Original vertex indices, sorted with @a codes.
+ * @param      clusters     Exclusive scan of the flags from @ref decimateHeads.
+ * @param      n            Number of internal vertices.
+ */
+__kernel void decimateClusters(
+    __global float * restrict outVertices,
+    __global uint * restrict vertexMap,
+    __global const float * restrict inVertices,
+    __global const ulong * restrict codes,
+    __global const uint * restrict ids,
+    __global const uint * restrict clusters,
+    uint n)
+{
+    const uint gid = get_global_id(0);
+    const ulong code = codes[gid];
+    const bool head = gid == 0 || code != codes[gid - 1];
+    const uint cluster = head ? clusters[gid] : clusters[gid] - 1;
+    vertexMap[ids[gid]] = cluster;
+    if (head)
+    {
+        float3 sum = (float3) (0.0f, 0.0f, 0.0f);
+        uint count = 0;
+        for (uint i = gid; i < n && codes[i] == code; i++)
+        {
+            sum += vload3(ids[i], inVertices);
+            count++;
+        }
+        vstore3(sum / (float) count, cluster, outVertices);
+    }
+}
+
+/**
+ * Copy the external vertices and their keys after the clusters. There is one
+ * work-item per external vertex.
+ *
+ * @param[out] outVertices   Output vertices, as packed xyz triplets.
+ * @param[out] outKeys       Output vertex keys.
+ * @param[out] vertexMap     Maps original vertex indices to output indices.
+ * @param      inVertices    Original vertices.
+ * @param      inKeys        Original vertex keys.
+ * @param      clusters      Exclusive scan from @ref decimateClusters, whose last
+ *                           element is the number of clusters.
+ * @param      n             Number of internal vertices.
+ */
+__kernel void decimateExternal(
+    __global float * restrict outVertices,
+    __global ulong * restrict outKeys,
+    __global uint * restrict vertexMap,
+    __global const float * restrict inVertices,
+    __global const ulong * restrict inKeys,
+    __global const uint * restrict clusters,
+    uint n)
+{
+    const uint gid = get_global_id(0);
+    const uint in = n + gid;
+    const uint out = clusters[n] + gid;
+    vstore3(vload3(in, inVertices), out, outVertices);
+    outKeys[out] = inKeys[in];
+    vertexMap[in] = out;
+}
+
+/**
+ * Flag the triangles that are not degenerate after clustering. There is one
+ * work-item per triangle, plus one to write a zero sentinel.
+ *
+ * @param[out] keep          1 for triangles with three distinct vertices, 0 otherwise.
+ * @param      triangles     Original triangles, as triplets of indices.
+ * @param      vertexMap     Maps original vertex indices to output indices.
+ * @param      numTriangles  Number of triangles.
+ */
+__kernel void decimateMarkTriangles(
+    __global uint * restrict keep,
+    __global const uint * restrict triangles,
+    __global const uint * restrict vertexMap,
+    uint numTriangles)
+{
+    const uint gid = get_global_id(0);
+    uint flag = 0;
+    if (gid < numTriangles)
+    {
+        const uint a = vertexMap[triangles[3 * gid]];
+        const uint b = vertexMap[triangles[3 * gid + 1]];
+        const uint c = vertexMap[triangles[3 * gid + 2]];
+        flag = a != b && b != c && a != c;
+    }
+    keep[gid] = flag;
+}
+
+/**
+ * Write the surviving triangles with their vertices remapped. There is one
+ * work-item per original triangle.
+ *
+ * @param[out] outTriangles  Output triangles.
+ * @param      inTriangles   Original triangles.
+ * @param      vertexMap     Maps original vertex indices to output indices.
+ * @param      positions     Exclusive scan of the flags from @ref decimateMarkTriangles.
+ */
+__kernel void decimateTriangles(
+    __global uint * restrict outTriangles,
+    __global const uint * restrict inTriangles,
+    __global const uint * restrict vertexMap,
+    __global const uint * restrict positions)
+{
+    const uint gid = get_global_id(0);
+    const uint pos = positions[gid];
+    if (positions[gid + 1] != pos)
+    {
+        const uint3 t = (uint3) (
+            vertexMap[inTriangles[3 * gid]],
+            vertexMap[inTriangles[3 * gid + 1]],
+            vertexMap[inTriangles[3 * gid + 2]]);
+        vstore3(t, pos, outTriangles);
+    }
+}
@@ -22,18 +22,122 @@
  * @file
  *
  * Implementation of marching tetrahedra.
+ *
+ * Required defines (see @ref Marching::addTableDefines):
+ * - COUNT_TABLE, START_TABLE, DATA_TABLE, KEY_TABLE: initializers for
+ *   @ref countTable, @ref startTable, @ref dataTable and @ref keyTable.
+ * - OWNED_EDGE_MASK: bit @a d is set if the tables use the edge from
+ *   corner 0 to corner @a d.
+ *
+ * Optional defines:
+ * - LOCAL_KEY_AXIS_BITS: bits per axis in the vertex keys used for welding
+ *   (default @ref KEY_AXIS_BITS). Keys use a 32-bit type if they fit.
+ * - DISTANCE_BUFFER: 0 (default) to read the signed distances from an image,
+ *   or 1 to read them from a buffer (see @ref Marching::DistanceStorage).
+ * - DISTANCE_HALF: 0 (default) or 1 if the buffer holds halves rather than
+ *   floats. It has no effect on images, which convert on read.
+ * - SPEC_Z_STRIDE, SPEC_ROW_PITCH: constants replacing the @a zStride and
+ *   @a rowPitch kernel arguments (both or neither), so that the compiler can
+ *   fold them (see @ref CLH::setSpecializeKernels). The arguments must still
+ *   be passed.
+ * - OWNED_EDGES: 0 (default) or 1 to emit each vertex from the cell that
+ *   owns its edge (see @ref Marching::setOwnedEdges).
  */
 
 /// Number of edges in a cell
 #define NUM_EDGES 19
 
+/**
+ * Pairs of uchar values, indexed by cube code. The two elements are the
+ * number of vertices and indices generated by the cell.
+ */
+__constant uchar countTable[] = COUNT_TABLE;
+
+/**
+ * Pairs of ushort values, indexed by cube code. The two elements are the
+ * positions of the vertex array and index array in @ref dataTable. It has
+ * one extra pair at the end so that the range for the last cube code can
+ * be found.
+ */
+__constant ushort startTable[] = START_TABLE;
+
+/**
+ * Values which are either indices to be emitted (after biasing), or
+ * vertices represented as an edge ID. The range of vertices or indices for
+ * a particular cube code is determined by two adjacent pairs of
+ * @ref startTable.
+ */
+__constant uchar dataTable[] = DATA_TABLE;
+
+/**
+ * Offsets added to the cell key to get a vertex key for each vertex
+ * generated in a cell, in ranges indexed by @ref startTable. The cell key
+ * is the key for the vertex at the minimum-x/y/z corner. Each offset is 0,
+ * 1 or 2 (in .1 fixed-point format) per axis, packed into 2 bits per axis
+ * with x in the lowest bits.
+ */
+__constant uchar keyTable[] = KEY_TABLE;
+
+/// Width and height in cells of the tiles classified by @ref genTiles
+#define OCCUPANCY_TILE 16
+
 /// Number of bits in fixed-point xyz fields in a vertex key (including fractional bits)
 #define KEY_AXIS_BITS 21
 #define KEY_AXIS_MASK ((1U << KEY_AXIS_BITS) - 1)
-#define KEY_EXTERNAL_FLAG (1UL << 63)
+
+#ifndef LOCAL_KEY_AXIS_BITS
+# define LOCAL_KEY_AXIS_BITS KEY_AXIS_BITS
+#endif
+#if LOCAL_KEY_AXIS_BITS * 3 + 1 <= 32
+typedef uint key_t;
+# define KEY_MAX UINT_MAX
+#else
+typedef ulong key_t;
+# define KEY_MAX ULONG_MAX
+#endif
+#define LOCAL_KEY_AXIS_MASK ((1U << LOCAL_KEY_AXIS_BITS) - 1)
+/// Flag bit in local keys, just above the coordinates
+#define KEY_EXTERNAL_FLAG ((key_t) 1 << (3 * LOCAL_KEY_AXIS_BITS))
+
+#ifndef DISTANCE_BUFFER
+# define DISTANCE_BUFFER 0
+#endif
+#ifndef DISTANCE_HALF
+# define DISTANCE_HALF 0
+#endif
+
+#ifndef OWNED_EDGES
+# define OWNED_EDGES 0
+#endif
+
+#ifdef SPEC_Z_STRIDE
+# define SPECIALIZE_IMAGE_PARAMS() (zStride = SPEC_Z_STRIDE, rowPitch = SPEC_ROW_PITCH)
+#else
+# define SPECIALIZE_IMAGE_PARAMS() ((void) 0)
+#endif
 
 __constant sampler_t nearest = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
+/**
+ * @def DISTANCE_ARG
+ * Type of the kernel parameter holding the signed distances.
+ *
+ * @def READ_DISTANCE
+ * Reads the signed distance at image coordinates (@a x, @a y). For a buffer,
+ * rows are @a rowPitch elements apart with x varying fastest, so that
+ * adjacent work-items read adjacent addresses.
+ */
+#if !DISTANCE_BUFFER
+# define DISTANCE_ARG __read_only image2d_t
+# define READ_DISTANCE(distance, rowPitch, x, y) (read_imagef((distance), nearest, (int2) ((x), (y))).x)
+#elif DISTANCE_HALF
+# define DISTANCE_ARG __global const half * restrict
+# define READ_DISTANCE(distance, rowPitch, x, y) vload_half((size_t) (y) * (rowPitch) + (x), (distance))
+#else
+# define DISTANCE_ARG __global const float * restrict
+# define READ_DISTANCE(distance, rowPitch, x, y) ((distance)[(size_t) (y) * (rowPitch) + (x)])
+#endif
+
 /**
  * Computes a cell code from 8 isovalues. Non-negative (outside) values are
  * given 1 bits, negative (inside) and NaNs are given 0 bits.
@@ -62,6 +166,161 @@ inline bool isValid(const float iso[8])
         && isfinite(iso[7]);
 }
 
+#if OWNED_EDGES
+
+/**
+ * Corners at the ends of each edge, in the order of @ref Marching::edgeIndices.
+ * The corners a < b of every edge satisfy (a & b) == a, so the edge is the edge
+ * from corner 0 to corner b - a of the cell at offset a. That cell is said
+ * to own it.
+ */
+__constant uchar edgeCorners[2 * NUM_EDGES] =
+{
+    0, 1, 0, 2, 0, 3, 1, 3, 2, 3,
+    0, 4, 0, 5, 1, 5, 4, 5,
+    0, 6, 2, 6, 4, 6,
+    0, 7, 1, 7, 2, 7, 3, 7, 4, 7, 5, 7, 6, 7
+};
+
+/// Index into the samples read by @ref readBlock
+#define BLOCK_INDEX(x, y, z) ((z) * 9 + (y) * 3 + (x))
+
+/// Offset in a block from the origin of a cell to its corner @a c
+#define BLOCK_CORNER(c) BLOCK_INDEX((c) & 1, ((c) >> 1) & 1, (c) >> 2)
+
+/**
+ * Reads the 3x3x3 samples at the corners of the cell @a cell and the 7
+ * cells that own its edges. Samples outside the @a size.x x @a size.y x
+ * (@a zEnd + 1) grid are NaN, so that a cell that is not classified in the
+ * same pass is treated as invalid.
+ */
+inline void readBlock(
+    float block[27], uint3 cell,
+    DISTANCE_ARG isoImage, uint zStride, int zBias, uint rowPitch,
+    uint2 size, uint zEnd)
+{
+    for (uint z = 0; z < 3; z++)
+        for (uint y = 0; y < 3; y++)
+            for (uint x = 0; x < 3; x++)
+            {
+                uint3 p = cell + (uint3) (x, y, z);
+                block[BLOCK_INDEX(x, y, z)] = (p.x < size.x && p.y < size.y && p.z <= zEnd)
+                    ? READ_DISTANCE(isoImage, rowPitch, p.x, p.z * zStride + zBias + p.y)
+                    : NAN;
+            }
+}
+
+/**
+ * Returns a mask with bit @a a set if the cell at offset @a a (1 to 7)
+ * from the origin of @a block is valid, and hence is occupied whenever one
+ * of its edges crosses the surface.
+ */
+inline uint validOwners(const float block[27])
+{
+    uint mask = 0;
+    for (uint a = 1; a < 8; a++)
+    {
+        const uint base = BLOCK_CORNER(a);
+        bool valid = true;
+        for (uint c = 0; c < 8; c++)
+            valid = valid && isfinite(block[base + BLOCK_CORNER(c)]);
+        if (valid)
+            mask |= 1U << a;
+    }
+    return mask;
+}
+
+/**
+ * Returns the position of the vertex on the edge from corner 0 to corner @a d
+ * among the vertices emitted by the cell at offset @a a in @a block. Cells emit
+ * the vertices on the edges they own first, in the order of @ref dataTable.
+ */
+inline uint ownedRank(const float block[27], uint a, uint d)
+{
+    const uint base = BLOCK_CORNER(a);
+    const bool sign = block[base] >= 0.0f;
+    uint rank = 0;
+    for (uint k = 1; k < d; k++)
+        if (((OWNED_EDGE_MASK >> k) & 1) && (block[base + BLOCK_CORNER(k)] >= 0.0f) != sign)
+            rank++;
+    return rank;
+}
+
+/**
+ * Index of a cell in the @a cellSlots array of @ref genOccupied.
+ */
+inline uint cellSlotIndex(uint3 cell, uint2 size, uint2 zRange)
+{
+    return ((cell.z - zRange.x) * (size.y - 1) + cell.y) * (size.x - 1) + cell.x;
+}
+
+#endif /* OWNED_EDGES */
+
+/**
+ * Classifies one cell, and if it might produce triangles, appends it to the
+ * output of @ref genOccupied. See @ref genOccupied for the parameters.
+ */
+inline void classifyCell(
+    uint3 gid,
+    __global uint3 * restrict occupied,
+    __global uint2 * restrict viCount,
+    volatile __global uint * restrict N,
+    volatile __global uint * restrict viHistogram,
+    DISTANCE_ARG isoImage,
+    uint zStride,
+    int zBias,
+    uint rowPitch,
+    __global uint * restrict cellSlots,
+    uint2 size,
+    uint2 zRange)
+{
+    uint y0 = gid.y + zStride * gid.z + zBias;
+    uint y1 = y0 + zStride;
+
+    float iso[8];
+    iso[0] = READ_DISTANCE(isoImage, rowPitch, gid.x, y0);
+    /* Regions with no splats are filled with NaN by the generator. Such a
+     * cell cannot produce triangles, so skip the remaining image reads.
+     */
+    if (isnan(iso[0]))
+        return;
+    iso[1] = READ_DISTANCE(isoImage, rowPitch, gid.x + 1, y0);
+    iso[2] = READ_DISTANCE(isoImage, rowPitch, gid.x, y0 + 1);
+    iso[3] = READ_DISTANCE(isoImage, rowPitch, gid.x + 1, y0 + 1);
+    iso[4] = READ_DISTANCE(isoImage, rowPitch, gid.x, y1);
+    iso[5] = READ_DISTANCE(isoImage, rowPitch, gid.x + 1, y1);
+    iso[6] = READ_DISTANCE(isoImage, rowPitch, gid.x, y1 + 1);
+    iso[7] = READ_DISTANCE(isoImage, rowPitch, gid.x + 1, y1 + 1);
+
+    uint code = makeCode(iso);
+    bool valid = isValid(iso);
+
+    if (valid && code != 0 && code != 255)
+    {
+        uint pos = atomic_inc(N);
+        occupied[pos] = gid;
+        uint2 vi = convert_uint2(vload2(code, countTable));
+#if OWNED_EDGES
+        // Vertices on edges owned by another occupied cell are emitted by that cell
+        float block[27];
+        readBlock(block, gid, isoImage, zStride, zBias, rowPitch, size, zRange.y);
+        const uint owners = validOwners(block);
+        const ushort2 start = vload2(code, startTable);
+        vi.x = 0;
+        for (uint i = start.x; i < start.x + countTable[2 * code]; i++)
+        {
+            const uint a = edgeCorners[2 * dataTable[i]];
+            if (!((owners >> a) & 1))
+                vi.x++;
+        }
+        cellSlots[cellSlotIndex(gid, size, zRange)] = pos;
+#endif
+        viCount[pos] = vi;
+        atomic_add(&viHistogram[2 * gid.z], vi.x);
+        atomic_add(&viHistogram[2 * gid.z + 1], vi.y);
+    }
+}
+
 /**
  * For each cell which might produce triangles, appends the coordinates of the
  * cell to a buffer and the count of vertices and triangles to another. It also
@@ -73,50 +332,116 @@ inline bool isValid(const float iso[8])
  * @param[out] viCount       Number of triangles+indices per cell.
  * @param[in,out] N          Number of occupied cells, incremented atomically
  * @param[in,out] viHistogram Per-slice histogram of vertex and index counts (actually a uint2)
- * @param      isoImage      Image holding samples.
+ * @param      isoImage      Samples of the signed distance.
  * @param      zStride, zBias See @ref Marching::ImageParams.
- * @param      countTable    Lookup table of counts per cube code.
+ * @param      rowPitch      See @ref Marching::ImageParams.
+ * @param[out] cellSlots     Position in @a occupied of each occupied cell, indexed
+ *                           by @ref cellSlotIndex (only written if @c OWNED_EDGES).
+ * @param      size          Number of corners in x and y.
+ * @param      zRange        First and past-the-end layers of cells being classified.
  *
  * @todo
  * - Explore Morton order, which will have better texture cache hits.
- * - Consider storing the count table in an image
  */
 __kernel void genOccupied(
     __global uint3 * restrict occupied,
     __global uint2 * restrict viCount,
     volatile __global uint * restrict N,
     volatile __global uint * restrict viHistogram,
-    __read_only image2d_t isoImage,
+    DISTANCE_ARG isoImage,
     uint zStride,
     int zBias,
-    __constant uchar2 * restrict countTable)
+    uint rowPitch,
+    __global uint * restrict cellSlots,
+    uint2 size,
+    uint2 zRange)
 {
+    SPECIALIZE_IMAGE_PARAMS();
     uint3 gid = (uint3) (get_global_id(0), get_global_id(1), get_global_id(2));
-    uint y0 = gid.y + zStride * gid.z + zBias;
-    uint y1 = y0 + zStride;
+    classifyCell(gid, occupied, viCount, N, viHistogram, isoImage, zStride, zBias, rowPitch,
+                 cellSlots, size, zRange);
+}
 
-    float iso[8];
-    iso[0] = read_imagef(isoImage, nearest, (int2) (gid.x    , y0)).x;
-    iso[1] = read_imagef(isoImage, nearest, (int2) (gid.x + 1, y0)).x;
-    iso[2] = read_imagef(isoImage, nearest, (int2) (gid.x,     y0 + 1)).x;
-    iso[3] = read_imagef(isoImage, nearest, (int2) (gid.x + 1, y0 + 1)).x;
-    iso[4] = read_imagef(isoImage, nearest, (int2) (gid.x    , y1)).x;
-    iso[5] = read_imagef(isoImage, nearest, (int2) (gid.x + 1, y1)).x;
-    iso[6] = read_imagef(isoImage, nearest, (int2) (gid.x,     y1 + 1)).x;
-    iso[7] = read_imagef(isoImage, nearest, (int2) (gid.x + 1, y1 + 1)).x;
+/**
+ * Coarse pass of the tiled variant of @ref genOccupied. Each work-item
+ * considers a tile of @ref OCCUPANCY_TILE x @ref OCCUPANCY_TILE cells in
+ * one layer, and appends its origin to @a tiles if the finite samples at its
+ * corners include both signs. Other tiles cannot contain an occupied cell.
+ *
+ * There is one work-item per tile, arranged in a 3D NDRange whose z offset
+ * is the first layer of the swathe.
+ *
+ * @param[out] tiles         Cell coordinates of the first cell in each tile that may be occupied.
+ * @param[in,out] numTiles   Number of tiles in @a tiles, incremented atomically.
+ * @param      isoImage      Samples of the signed distance.
+ * @param      zStride, zBias See @ref Marching::ImageParams.
+ * @param      size          Number of corners in x and y.
+ * @param      rowPitch      See @ref Marching::ImageParams.
+ */
+__kernel void genTiles(
+    __global uint3 * restrict tiles,
+    volatile __global uint * restrict numTiles,
+    DISTANCE_ARG isoImage,
+    uint zStride,
+    int zBias,
+    uint2 size,
+    uint rowPitch)
+{
+    SPECIALIZE_IMAGE_PARAMS();
+    uint3 tile = (uint3) (get_global_id(0), get_global_id(1), get_global_id(2));
+    uint3 base = (uint3) (tile.xy * OCCUPANCY_TILE, tile.z);
+    uint xEnd = min(base.x + OCCUPANCY_TILE, size.x - 1);
+    uint yEnd = min(base.y + OCCUPANCY_TILE, size.y - 1);
+    uint y0 = zStride * base.z + zBias;
 
-    uint code = makeCode(iso);
-    bool valid = isValid(iso);
+    bool nonneg = false, neg = false;
+    for (uint dz = 0; dz < 2; dz++)
+        for (uint y = base.y; y <= yEnd; y++)
+            for (uint x = base.x; x <= xEnd; x++)
+            {
+                float iso = READ_DISTANCE(isoImage, rowPitch, x, y0 + dz * zStride + y);
+                nonneg |= iso >= 0.0f;
+                neg |= iso < 0.0f;
+                if (nonneg && neg)
+                {
+                    uint pos = atomic_inc(numTiles);
+                    tiles[pos] = base;
+                    return;
+                }
+            }
+}
 
-    if (valid && code != 0 && code != 255)
-    {
-        uint pos = atomic_inc(N);
-        occupied[pos] = gid;
-        uint2 vi = convert_uint2(countTable[code]);
-        viCount[pos] = vi;
-        atomic_add(&viHistogram[2 * gid.z], vi.x);
-        atomic_add(&viHistogram[2 * gid.z + 1], vi.y);
-    }
+/**
+ * Fine pass of the tiled variant of @ref genOccupied. Each work-group
+ * processes one tile found by @ref genTiles, with one work-item per cell.
+ *
+ * @param      tiles         Tiles found by @ref genTiles.
+ * @param      size          Number of corners in x and y.
+ *
+ * The other parameters are as for @ref genOccupied.
+ */
+__kernel __attribute__((reqd_work_group_size(OCCUPANCY_TILE, OCCUPANCY_TILE, 1)))
+void genOccupiedTiles(
+    __global uint3 * restrict occupied,
+    __global uint2 * restrict viCount,
+    volatile __global uint * restrict N,
+    volatile __global uint * restrict viHistogram,
+    DISTANCE_ARG isoImage,
+    uint zStride,
+    int zBias,
+    __global const uint3 * restrict tiles,
+    uint2 size,
+    uint rowPitch,
+    __global uint * restrict cellSlots,
+    uint2 zRange)
+{
+    SPECIALIZE_IMAGE_PARAMS();
+    uint3 gid = tiles[get_group_id(0)];
+    gid.x += get_local_id(0);
+    gid.y += get_local_id(1);
+    if (gid.x < size.x - 1 && gid.y < size.y - 1)
+        classifyCell(gid, occupied, viCount, N, viHistogram, isoImage, zStride, zBias, rowPitch,
+                     cellSlots, size, zRange);
 }
 
 /**
@@ -145,14 +470,47 @@ inline float3 interp(float iso0, float iso1, uint3 cell, uint3 offset0, uint3 of
  * @param coords           Coordinates in .1 fixed-point format.
  * @param top              Coordinates that indicate an external vertices in .1 fixed-point format.
  */
-ulong computeKey(uint3 coords, uint3 top)
+key_t computeKey(uint3 coords, uint3 top)
 {
-    ulong key = ((ulong) coords.z << (2 * KEY_AXIS_BITS)) | ((ulong) coords.y << (KEY_AXIS_BITS)) | ((ulong) coords.x);
+    key_t key = ((key_t) coords.z << (2 * LOCAL_KEY_AXIS_BITS))
+        | ((key_t) coords.y << LOCAL_KEY_AXIS_BITS)
+        | ((key_t) coords.x);
     if (any(coords.xy == 0U) || any(coords == top))
         key |= KEY_EXTERNAL_FLAG;
     return key;
 }
 
+/**
+ * Converts a local key produced by @ref computeKey to the global layout with
+ * @ref KEY_AXIS_BITS bits per axis, with the external flag stripped off.
+ * Each axis is additionally shifted left by @a shift, which converts keys
+ * from a grid that is coarser by a factor of 2<sup>@a shift</sup> into
+ * keys of the finest grid. Each field wraps modulo 2<sup>@ref KEY_AXIS_BITS</sup>.
+ */
+inline ulong widenKey(key_t key, uint shift)
+{
+    ulong x = key & LOCAL_KEY_AXIS_MASK;
+    ulong y = (key >> LOCAL_KEY_AXIS_BITS) & LOCAL_KEY_AXIS_MASK;
+    ulong z = (key >> (2 * LOCAL_KEY_AXIS_BITS)) & LOCAL_KEY_AXIS_MASK;
+    x = (x << shift) & KEY_AXIS_MASK;
+    y = (y << shift) & KEY_AXIS_MASK;
+    z = (z << shift) & KEY_AXIS_MASK;
+    return (z << (2 * KEY_AXIS_BITS)) | (y << KEY_AXIS_BITS) | x;
+}
+
+/**
+ * Adds two global keys field by field, with each field wrapping modulo
+ * 2<sup>@ref KEY_AXIS_BITS</sup> rather than carrying into the next one.
+ * This keeps keys well-defined for grids too large for a field to hold
+ * (see @ref Marching::KEY_AXIS_BITS).
+ */
+inline ulong addKeys(ulong a, ulong b)
+{
+    const ulong fieldTop = ((ulong) 1 << (KEY_AXIS_BITS - 1))
+        * (1 + ((ulong) 1 << KEY_AXIS_BITS) + ((ulong) 1 << (2 * KEY_AXIS_BITS)));
+    return ((a & ~fieldTop) + (b & ~fieldTop)) ^ ((a ^ b) & fieldTop);
+}
+
 /**
  * Generate vertices and indices for a slice.
  * There is one work-item per compacted cell.
@@ -172,31 +530,38 @@ ulong computeKey(uint3 coords, uint3 top)
  * @param[out] indices         Indices into @a vertices.
  * @param      viStart         Position to start writing vertices/indices for each cell.
  * @param      cells           List of compacted cells written by @ref genOccupied.
- * @param      isoImage        Image holding samples.
- * @param      startTable      Lookup table indicating where to find vertices/indices in @a dataTable.
- * @param      dataTable       Lookup table of vertex and index indices.
- * @param      keyTable        Lookup table for cell-relative vertex keys.
+ * @param      isoImage        Samples of the signed distance.
  * @param      zStride, zBias  See @ref Marching::ImageParams
  * @param      gridOffset      Transformation from grid-local to grid-global coordinates.
  * @param      top             See above.
  * @param      lvertices       Scratch space of @ref NUM_EDGES elements per work item.
+ * @param      rowPitch        See @ref Marching::ImageParams
+ * @param      cellSlots, size, zRange As for @ref genOccupied (only used if @c OWNED_EDGES).
+ *
+ * If @c OWNED_EDGES is set, a cell only emits the vertices on the edges it
+ * owns, followed by those on edges whose owner was not classified as occupied
+ * in the same pass (at the edges of the grid and swathe, or next to invalid
+ * cells). Indices for the remaining vertices refer to those emitted by the
+ * owner, so that only the latter need to be welded.
  */
 __kernel void generateElements(
     __global float4 *vertices,
-    __global ulong *vertexKeys,
+    __global key_t *vertexKeys,
     __global uint *indices,
     __global const uint2 * restrict viStart,
     __global const uint3 * restrict cells,
-    __read_only image2d_t isoImage,
-    __global const ushort2 * restrict startTable,
-    __global const uchar * restrict dataTable,
-    __global const uint3 * restrict keyTable,
+    DISTANCE_ARG isoImage,
     uint zStride,
     int zBias,
     uint3 gridOffset,
     uint3 top,
-    __local float3 *lvertices)
+    __local float3 *lvertices,
+    uint rowPitch,
+    __global const uint * restrict cellSlots,
+    uint2 size,
+    uint2 zRange)
 {
+    SPECIALIZE_IMAGE_PARAMS();
     const uint gid = get_global_id(0);
     const uint lid = get_local_id(0);
     uint3 cell = cells[gid];
@@ -206,14 +571,14 @@ __kernel void generateElements(
     __local float3 *lverts = lvertices + NUM_EDGES * lid;
 
     float iso[8];
-    iso[0] = read_imagef(isoImage, nearest, (int2) (cell.x    , y0)).x;
-    iso[1] = read_imagef(isoImage, nearest, (int2) (cell.x + 1, y0)).x;
-    iso[2] = read_imagef(isoImage, nearest, (int2) (cell.x,     y0 + 1)).x;
-    iso[3] = read_imagef(isoImage, nearest, (int2) (cell.x + 1, y0 + 1)).x;
-    iso[4] = read_imagef(isoImage, nearest, (int2) (cell.x    , y1)).x;
-    iso[5] = read_imagef(isoImage, nearest, (int2) (cell.x + 1, y1)).x;
-    iso[6] = read_imagef(isoImage, nearest, (int2) (cell.x,     y1 + 1)).x;
-    iso[7] = read_imagef(isoImage, nearest, (int2) (cell.x + 1, y1 + 1)).x;
+    iso[0] = READ_DISTANCE(isoImage, rowPitch, cell.x, y0);
+    iso[1] = READ_DISTANCE(isoImage, rowPitch, cell.x + 1, y0);
+    iso[2] = READ_DISTANCE(isoImage, rowPitch, cell.x, y0 + 1);
+    iso[3] = READ_DISTANCE(isoImage, rowPitch, cell.x + 1, y0 + 1);
+    iso[4] = READ_DISTANCE(isoImage, rowPitch, cell.x, y1);
+    iso[5] = READ_DISTANCE(isoImage, rowPitch, cell.x + 1, y1);
+    iso[6] = READ_DISTANCE(isoImage, rowPitch, cell.x, y1 + 1);
+    iso[7] = READ_DISTANCE(isoImage, rowPitch, cell.x + 1, y1 + 1);
 
     lverts[0] = INTERP(0, 1);
     lverts[1] = INTERP(0, 2);
@@ -240,21 +605,65 @@ __kernel void generateElements(
     uint vNext = viNext.s0;
     uint iNext = viNext.s1;
 
-    ushort2 start = startTable[code];
-    ushort2 end = startTable[code + 1];
+    ushort2 start = vload2(code, startTable);
+    ushort2 end = vload2(code + 1, startTable);
+
+#if OWNED_EDGES
+    float block[27];
+    readBlock(block, cell, isoImage, zStride, zBias, rowPitch, size, zRange.y);
+    const uint owners = validOwners(block);
+    uint nextOwned = vNext;
+    uint nextLocal = vNext;
+    for (uint i = start.x; i < end.x; i++)
+        if (edgeCorners[2 * dataTable[i]] == 0)
+            nextLocal++;
 
+    uint vmap[NUM_EDGES];
+    for (uint i = 0; i < end.x - start.x; i++)
+    {
+        const uint edge = dataTable[start.x + i];
+        const uint a = edgeCorners[2 * edge];
+        const uint b = edgeCorners[2 * edge + 1];
+        uint v;
+        if ((owners >> a) & 1)
+        {
+            const uint3 owner = cell + (uint3) (a & 1, (a >> 1) & 1, a >> 2);
+            const uint slot = cellSlots[cellSlotIndex(owner, size, zRange)];
+            v = viStart[slot].s0 + ownedRank(block, a, b - a);
+        }
+        else
+        {
+            v = a == 0 ? nextOwned++ : nextLocal++;
+            float4 vertex;
+            vertex.xyz = lverts[edge];
+            vertex.w = as_float(v);
+            vertices[v] = vertex;
+            uint packed = keyTable[start.x + i];
+            uint3 keyOffset = (uint3) (packed & 3, (packed >> 2) & 3, packed >> 4);
+            vertexKeys[v] = computeKey(2 * cell + keyOffset, top);
+        }
+        vmap[i] = v;
+    }
+    for (uint i = 0; i < end.y - start.y; i++)
+    {
+        indices[iNext + i] = vmap[dataTable[start.y + i]];
+    }
+#else
     for (uint i = 0; i < end.x - start.x; i++)
     {
         float4 vertex;
         vertex.xyz = lverts[dataTable[start.x + i]];
         vertex.w = as_float(vNext + i);
         vertices[vNext + i] = vertex;
-        vertexKeys[vNext + i] = computeKey(2 * cell + keyTable[start.x + i], top);
+        uint packed = keyTable[start.x + i];
+        uint3 keyOffset = (uint3) (packed & 3, (packed >> 2) & 3, packed >> 4);
+        vertexKeys[vNext + i] = computeKey(2 * cell + keyOffset, top);
     }
     for (uint i = 0; i < end.y - start.y; i++)
     {
         indices[iNext + i] = vNext + dataTable[start.y + i];
     }
+#endif
 }
 
 /**
@@ -269,11 +678,11 @@ __kernel void generateElements(
  * @todo Investigate using @c __local to avoid two key reads (might not matter with a cache).
  */
 __kernel void countUniqueVertices(__global uint * restrict vertexUnique,
-                                  __global const ulong * restrict vertexKeys)
+                                  __global const key_t * restrict vertexKeys)
 {
     const uint gid = get_global_id(0);
-    const ulong key = vertexKeys[gid];
-    const ulong nextKey = vertexKeys[gid + 1];
+    const key_t key = vertexKeys[gid];
+    const key_t nextKey = vertexKeys[gid + 1];
     bool last = key != nextKey;
     vertexUnique[gid] = last ? 1 : 0;
 }
@@ -283,14 +692,16 @@ __kernel void countUniqueVertices(__global uint * restrict vertexUnique,
  * There is one work-item per input vertex.
  *
  * @param[out] outVertices     Output vertices, written as packed x,y,z triplets.
- * @param[out] outKeys         Vertex keys corresponding to @a outVertices, only written for external vertices, and with the high bit stripped off.
+ * @param[out] outKeys         Global vertex keys corresponding to @a outVertices, only written for external vertices (see @ref widenKey).
  * @param[out] indexRemap      Table mapping original (pre-sorting) indices to output indices.
  * @param[out] firstExternal   The first output position that contains an external vertex.
  * @param      vertexUnique    Scan of the table emitted by @ref countUniqueVertices.
  * @param      inVertices      Sorted vertices, with original ID stored in @c w.
- * @param      inKeys          Vertex keys corresponding to @a inVertices (plus a sentinel @c ULONG_MAX).
+ * @param      inKeys          Vertex keys corresponding to @a inVertices (plus a sentinel @c KEY_MAX).
  * @param      minExternalKey  Vertex keys >= @a minExternalKey are considered to be external vertices.
- * @param      keyOffset       Value added to keys on output (after comparison with @a minExternalKey).
+ * @param      keyOffset       Value added to keys on output (after comparison with @a minExternalKey), using @ref addKeys.
+ * @param      keyShift        Shift passed to @ref widenKey.
+ * @param      scaleBias       Output vertices are scaled by @a scaleBias.w then biased by @a scaleBias.xyz.
  */
 __kernel void compactVertices(
     __global float * restrict outVertices,
@@ -299,22 +710,24 @@ __kernel void compactVertices(
     __global uint * firstExternal,
     __global const uint * restrict vertexUnique,
     __global const float4 * restrict inVertices,
-    __global const ulong * restrict inKeys,
+    __global const key_t * restrict inKeys,
     ulong minExternalKey,
-    ulong keyOffset)
+    ulong keyOffset,
+    uint keyShift,
+    float4 scaleBias)
 {
     const uint gid = get_global_id(0);
     const uint u = vertexUnique[gid];
     const float4 v = inVertices[gid];
-    const ulong key = inKeys[gid];
-    const ulong nextKey = inKeys[gid + 1];
+    const key_t key = inKeys[gid];
+    const key_t nextKey = inKeys[gid + 1];
     bool ext = key >= minExternalKey;
     if (key != nextKey)
     {
-        vstore3(v.xyz, u, outVertices);
+        vstore3(fma(v.xyz, scaleBias.w, scaleBias.xyz), u, outVertices);
         if (ext)
         {
-            outKeys[u] = (key & (KEY_EXTERNAL_FLAG - 1)) + keyOffset;
+            outKeys[u] = addKeys(widenKey(key, keyShift), keyOffset);
             if (u == 0)
                 *firstExternal = 0;
         }
@@ -339,6 +752,147 @@ __kernel void reindex(
     indices[gid] = indexRemap[indices[gid]];
 }
 
+/// Value of an unused slot in the welding hash table
+#define HASH_EMPTY UINT_MAX
+
+/**
+ * Hash function for vertex keys, giving a slot in a table of 2<sup>@a hashBits</sup> entries.
+ */
+inline uint hashKey(ulong key, uint hashBits)
+{
+    return (uint) ((key * 0x9E3779B97F4A7C15UL) >> (64 - hashBits));
+}
+
+/**
+ * Sets every slot of the welding hash table to @ref HASH_EMPTY. There is
+ * one work-item per slot.
+ */
+__kernel void hashClear(__global uint *table)
+{
+    table[get_global_id(0)] = HASH_EMPTY;
+}
+
+/**
+ * Inserts vertex keys into an open-addressing hash table, as an alternative
+ * to sorting them. Each slot holds the index of a vertex with the
+ * corresponding key, and after all insertions it holds the smallest such
+ * index, regardless of the order in which work-items run. There is one
+ * work-item per vertex.
+ *
+ * @param[out] vertexSlot  The slot assigned to each vertex.
+ * @param[in,out] table    Hash table, initialised by @ref hashClear.
+ * @param      vertexKeys  Vertex keys.
+ * @param      hashBits    Log base 2 of the table size.
+ *
+ * @pre The table must have at least one empty slot left after the
+ * insertions, otherwise this will not terminate.
+ */
+__kernel void hashInsert(
+    __global uint * restrict vertexSlot,
+    volatile __global uint *table,
+    __global const key_t * restrict vertexKeys,
+    uint hashBits)
+{
+    const uint gid = get_global_id(0);
+    const key_t key = vertexKeys[gid];
+    const uint mask = (1U << hashBits) - 1;
+    uint slot = hashKey(key, hashBits);
+    while (true)
+    {
+        /* A slot only ever changes from empty to a vertex with some key, and
+         * then to smaller vertices with the same key, so it is safe to
+         * compare against the key of whatever vertex is found.
+         */
+        uint old = atomic_cmpxchg(&table[slot], HASH_EMPTY, gid);
+        if (old == HASH_EMPTY || vertexKeys[old] == key)
+            break;
+        slot = (slot + 1) & mask;
+    }
+    atomic_min(&table[slot], gid);
+    vertexSlot[gid] = slot;
+}
+
+/**
+ * Marks the vertices chosen by @ref hashInsert to represent their keys.
+ * There is one work-item per vertex, plus one to write a zero sentinel.
+ *
+ * @param[out] vertexFlags    (1, 0) for representative internal vertices,
+ *                            (0, 1) for representative external vertices, and
+ *                            (0, 0) for the rest.
+ * @param      vertexSlot     Slots written by @ref hashInsert.
+ * @param      table          Hash table built by @ref hashInsert.
+ * @param      vertexKeys     Vertex keys.
+ * @param      numVertices    Number of vertices.
+ * @param      minExternalKey Vertex keys >= @a minExternalKey are considered to be external vertices.
+ */
+__kernel void hashMark(
+    __global uint2 * restrict vertexFlags,
+    __global const uint * restrict vertexSlot,
+    __global const uint * restrict table,
+    __global const key_t * restrict vertexKeys,
+    uint numVertices,
+    ulong minExternalKey)
+{
+    const uint gid = get_global_id(0);
+    uint2 flags = (uint2) (0U, 0U);
+    if (gid < numVertices && table[vertexSlot[gid]] == gid)
+    {
+        if (vertexKeys[gid] >= minExternalKey)
+            flags.y = 1;
+        else
+            flags.x = 1;
+    }
+    vertexFlags[gid] = flags;
+}
+
+/**
+ * Equivalent of @ref compactVertices for the hash-based welding. Internal
+ * vertices are output first and then external vertices, each in the order
+ * in which they were generated. There is one work-item per input vertex.
+ *
+ * @param[out] outVertices     Output vertices, written as packed x,y,z triplets.
+ * @param[out] outKeys         Global vertex keys corresponding to @a outVertices, only written for external vertices (see @ref widenKey).
+ * @param[out] indexRemap      Table mapping original indices to output indices.
+ * @param      vertexIds       Exclusive scan of the flags emitted by @ref hashMark (@a numVertices + 1 elements).
+ * @param      vertexSlot      Slots written by @ref hashInsert.
+ * @param      table           Hash table built by @ref hashInsert.
+ * @param      inVertices      Vertices in the order they were generated.
+ * @param      inKeys          Vertex keys corresponding to @a inVertices.
+ * @param      numVertices     Number of vertices.
+ * @param      minExternalKey  Vertex keys >= @a minExternalKey are considered to be external vertices.
+ * @param      keyOffset       Value added to keys on output (after comparison with @a minExternalKey), using @ref addKeys.
+ * @param      keyShift        Shift passed to @ref widenKey.
+ * @param      scaleBias       As for @ref compactVertices.
+ */
+__kernel void hashCompactVertices(
+    __global float * restrict outVertices,
+    __global ulong * restrict outKeys,
+    __global uint * restrict indexRemap,
+    __global const uint2 * restrict vertexIds,
+    __global const uint * restrict vertexSlot,
+    __global const uint * restrict table,
+    __global const float4 * restrict inVertices,
+    __global const key_t * restrict inKeys,
+    uint numVertices,
+    ulong minExternalKey,
+    ulong keyOffset,
+    uint keyShift,
+    float4 scaleBias)
+{
+    const uint gid = get_global_id(0);
+    const uint rep = table[vertexSlot[gid]];
+    const key_t key = inKeys[gid];
+    const bool ext = key >= minExternalKey;
+    const uint id = ext ? vertexIds[numVertices].x + vertexIds[rep].y : vertexIds[rep].x;
+    if (rep == gid)
+    {
+        vstore3(fma(inVertices[gid].xyz, scaleBias.w, scaleBias.xyz), id, outVertices);
+        if (ext)
+            outKeys[id] = addKeys(widenKey(key, keyShift), keyOffset);
+    }
+    indexRemap[gid] = id;
+}
+
 /**
  * Kernel implementing limited subset of @c clEnqueueCopyImage.
  * This is to work around bugs in the AMD APP SDK v2.8 (and earlier, and maybe
@@ -346,6 +900,7 @@ __kernel void reindex(
  *
  * @see @ref Marching::copySlice.
  */
+#if !DISTANCE_BUFFER
 __kernel void copySlice(
     __read_only image2d_t srcImage,
     __write_only image2d_t trgImage,
@@ -356,6 +911,7 @@ __kernel void copySlice(
     int2 trgAddr = srcAddr + trgOffset;
     write_imagef(trgImage, trgAddr, value);
 }
+#endif
 
 /*******************************************************************************
  * Test code only below here.
@@ -25,6 +25,24 @@
  * - WGS_X, WGS_Y, WGS_Z
  * - FIT_SPHERE (0 or 1)
  * - FIT_PLANE (0 or 1)
+ *
+ * Optional defines:
+ * - PACKED_SPLATS: 0 (default) or 1, to use the compact splat layout.
+ * - SPARSE_START: 0 (default) or 1, to look up cells in a sparse start table
+ *   (see @ref SplatTreeCL) rather than indexing a dense one.
+ * - DISTANCE_BUFFER: 0 (default) to write the signed distances to an image,
+ *   or 1 to write them to a buffer (see @ref Marching::DistanceStorage).
+ * - DISTANCE_HALF: 0 (default) or 1 if the buffer holds halves rather than
+ *   floats. It has no effect on images, which convert on write.
+ * - BOUNDARY_NEAREST: 0 (default) for the moment-based boundary test, or 1
+ *   to reject corners whose nearest splat is too far away (see @ref fitDistance).
+ *
+ * Optional defines, which replace the kernel arguments of the same role by
+ * constants so that the compiler can fold them (see @ref
+ * CLH::setSpecializeKernels). The arguments must still be passed.
+ * - SPEC_START_SHIFT: @a startShift.
+ * - SPEC_BOUNDARY_FACTOR: @a boundaryFactor.
+ * - SPEC_Z_STRIDE, SPEC_ROW_PITCH: @a zStride and @a rowPitch (both or neither).
  */
 
 /**
@@ -33,6 +51,22 @@
  */
 #define KERNEL(xsize, ysize, zsize) __kernel __attribute__((reqd_work_group_size(xsize, ysize, zsize)))
 
+#ifdef SPEC_START_SHIFT
+# define SPECIALIZE_START_SHIFT() (startShift = SPEC_START_SHIFT)
+#else
+# define SPECIALIZE_START_SHIFT() ((void) 0)
+#endif
+#ifdef SPEC_BOUNDARY_FACTOR
+# define SPECIALIZE_BOUNDARY_FACTOR() (boundaryFactor = SPEC_BOUNDARY_FACTOR)
+#else
+# define SPECIALIZE_BOUNDARY_FACTOR() ((void) 0)
+#endif
+#ifdef SPEC_Z_STRIDE
+# define SPECIALIZE_IMAGE_PARAMS() (zStride = SPEC_Z_STRIDE, rowPitch = SPEC_ROW_PITCH)
+#else
+# define SPECIALIZE_IMAGE_PARAMS() ((void) 0)
+#endif
+
 #define RADIUS_CUTOFF 0.99f
 #define HITS_CUTOFF 4
 
@@ -48,6 +82,56 @@
 #if FIT_PLANE + FIT_SPHERE != 1
 # error "Exactly one of FIT_PLANE and FIT_SPHERE must be defined"
 #endif
+#ifndef PACKED_SPLATS
+# define PACKED_SPLATS 0
+#endif
+#ifndef SPARSE_START
+# define SPARSE_START 0
+#endif
+#ifndef DISTANCE_BUFFER
+# define DISTANCE_BUFFER 0
+#endif
+#ifndef DISTANCE_HALF
+# define DISTANCE_HALF 0
+#endif
+#ifndef USE_SUBGROUPS
+# define USE_SUBGROUPS 0
+#endif
+#ifndef BOUNDARY_NEAREST
+# define BOUNDARY_NEAREST 0
+#endif
+
+/* The subgroup variant of processCorners is only used if the compiler
+ * actually exposes one of the extensions; otherwise it silently falls back.
+ */
+#if USE_SUBGROUPS && defined(cl_khr_subgroups)
+# pragma OPENCL EXTENSION cl_khr_subgroups : enable
+# define SUBGROUPS 1
+#elif USE_SUBGROUPS && defined(cl_intel_subgroups)
+# pragma OPENCL EXTENSION cl_intel_subgroups : enable
+# define SUBGROUPS 1
+#else
+# define SUBGROUPS 0
+#endif
+
+/**
+ * @def DISTANCE_ARG
+ * Type of the kernel parameter receiving the signed distances.
+ *
+ * @def WRITE_DISTANCE
+ * Writes a signed distance at image coordinates (@a x, @a y). For a buffer,
+ * rows are @a rowPitch elements apart with x varying fastest.
+ */
+#if !DISTANCE_BUFFER
+# define DISTANCE_ARG __write_only image2d_t
+# define WRITE_DISTANCE(distance, rowPitch, x, y, value) write_imagef((distance), (int2) ((x), (y)), (value))
+#elif DISTANCE_HALF
+# define DISTANCE_ARG __global half * restrict
+# define WRITE_DISTANCE(distance, rowPitch, x, y, value) vstore_half((value), (size_t) (y) * (rowPitch) + (x), (distance))
+#else
+# define DISTANCE_ARG __global float * restrict
+# define WRITE_DISTANCE(distance, rowPitch, x, y, value) ((distance)[(size_t) (y) * (rowPitch) + (x)] = (value))
+#endif
 
 /**
  * The number of workitems that cooperate to load splat IDs.
@@ -60,12 +144,40 @@
 
 typedef int command_type;
 
+#if PACKED_SPLATS
+typedef struct
+{
+    float positionRadius[4]; // position in xyz, inverse-squared radius in w
+    ushort normalQuality[4]; // half-precision normal in xyz, quality metric in w
+} Splat;
+
+inline float4 getPositionRadius(__global const Splat *splat)
+{
+    return vload4(0, splat->positionRadius);
+}
+
+inline float4 getNormalQuality(__global const Splat *splat)
+{
+    return vload_half4(0, (__global const half *) splat->normalQuality);
+}
+#else
 typedef struct
 {
     float4 positionRadius;   // position in xyz, inverse-squared radius in w
     float4 normalQuality;    // normal in xyz, quality metric in w
 } Splat;
 
+inline float4 getPositionRadius(__global const Splat *splat)
+{
+    return splat->positionRadius;
+}
+
+inline float4 getNormalQuality(__global const Splat *splat)
+{
+    return splat->normalQuality;
+}
+#endif
+
 typedef struct
 {
     float sumWpp;
@@ -74,15 +186,23 @@ typedef struct
     float3 sumWn;
     float sumW;
     uint hits;
+#if BOUNDARY_NEAREST
+    float minD;    // smallest normalised squared tangential distance to a splat
+#endif
 } SphereFit;
 
 typedef struct
 {
+#if !BOUNDARY_NEAREST
     float sumWpp;  // needed for boundary testing
+#endif
     float sumW;
     float3 sumWn;
     float3 sumWp;
     uint hits;
+#if BOUNDARY_NEAREST
+    float minD;    // smallest normalised squared tangential distance to a splat
+#endif
 } PlaneFit;
 
 typedef struct
@@ -115,15 +235,23 @@ inline void sphereFitInit(SphereFit *sf)
     sf->sumWn = (float3) (0.0f, 0.0f, 0.0f);
     sf->sumW = 0.0f;
     sf->hits = 0;
+#if BOUNDARY_NEAREST
+    sf->minD = RADIUS_CUTOFF;
+#endif
 }
 
 inline void planeFitInit(PlaneFit *pf)
 {
+#if !BOUNDARY_NEAREST
     pf->sumWpp = 0.0f;
+#endif
     pf->sumW = 0.0f;
     pf->sumWp = (float3) (0.0f, 0.0f, 0.0f);
     pf->sumWn = (float3) (0.0f, 0.0f, 0.0f);
     pf->hits = 0;
+#if BOUNDARY_NEAREST
+    pf->minD = RADIUS_CUTOFF;
+#endif
 }
 
 inline void sphereFitAdd(SphereFit *sf, float w, float3 p, float pp, float3 n)
@@ -140,7 +268,9 @@ inline void sphereFitAdd(SphereFit *sf, float w, float3 p, float pp, float3 n)
 
 inline void planeFitAdd(PlaneFit *pf, float w, float3 p, float pp, float3 n)
 {
+#if !BOUNDARY_NEAREST
     pf->sumWpp += w * pp;
+#endif
     pf->sumW += w;
     pf->sumWp += w * p;
     pf->sumWn += w * n;
@@ -151,20 +281,22 @@ inline void planeFitAdd(PlaneFit *pf, float w, float3 p, float pp, float3 n)
  * Turn cell coordinates into a cell code.
  *
  * A code consists of the bits of the (shifted) coordinates interleaved (z
- * major).
+ * major). It is computed at 64 bits, since the full-resolution code of a
+ * large region does not fit in 32 bits (even when the shifted code used to
+ * index the start array does). It is only computed once per work-group.
  *
  * @todo Investigate preloading this (per axis) to shared memory from a table
  * instead.
  */
-inline uint makeCode(int3 xyz)
+inline ulong makeCode(int3 xyz)
 {
-    uint ans = 0;
-    uint scale = 1;
+    ulong ans = 0;
+    ulong scale = 1;
     xyz.y <<= 1;  // pre-shift these to avoid shifts inside the loop
     xyz.z <<= 2;
     while (any(xyz != 0))
     {
-        uint bits = (xyz.x & 1) | (xyz.y & 2) | (xyz.z & 4);
+        ulong bits = (xyz.x & 1) | (xyz.y & 2) | (xyz.z & 4);
         ans += bits * scale;
         scale <<= 3;
         xyz >>= 1;
@@ -172,6 +304,56 @@ inline uint makeCode(int3 xyz)
     return ans;
 }
 
+#if SPARSE_START
+/**
+ * Find a key in a sorted array of distinct keys.
+ *
+ * @return The index of @a key in @a keys, or -1 if it is not present.
+ */
+inline int findCell(__global const ulong * restrict keys, uint n, ulong key)
+{
+    uint lo = 0;
+    uint hi = n;
+    while (lo < hi)
+    {
+        uint mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < n && keys[lo] == key) ? (int) lo : -1;
+}
+
+/**
+ * Look up the start of the command list for a cell of the finest level in a
+ * sparse start table. This must match @ref sparseStart in octree.cl, but
+ * only needs to start from the finest level.
+ *
+ * @param cellKeys, start, numCells The sparse start table.
+ * @param code            Code of the cell in the finest level.
+ * @param levels          Number of levels in the octree.
+ * @param rootOffset      Key of the first cell of the root.
+ */
+inline command_type sparseStart(
+    __global const ulong * restrict cellKeys,
+    __global const command_type * restrict start,
+    uint numCells,
+    ulong code, uint levels, ulong rootOffset)
+{
+    ulong levelOffset = rootOffset;
+    for (uint l = 0; l < levels; l++)
+    {
+        int idx = findCell(cellKeys, numCells, levelOffset + code);
+        if (idx >= 0)
+            return start[idx];
+        levelOffset += 1UL << (3 * (levels - 1 - l));
+        code >>= 3;
+    }
+    return -1;
+}
+#endif
+
 /**
  * Turns an index along a 3D space-filling curve into coordinates.
  *
@@ -195,6 +377,20 @@ inline int3 decode(uint code)
     return ans;
 }
 
+/**
+ * Position of a work-item within its block. For images this is @ref decode,
+ * whose Z-order suits the texture cache. Buffers are written with x varying
+ * fastest instead, so that adjacent work-items store to adjacent addresses.
+ */
+inline int3 cornerOffset(uint lid)
+{
+#if DISTANCE_BUFFER
+    return (int3) (lid % WGS_X, (lid / WGS_X) % WGS_Y, lid / (WGS_X * WGS_Y));
+#else
+    return decode(lid);
+#endif
+}
+
 inline void fitPlane(const PlaneFit * restrict pf, Plane * restrict out)
 {
     out->mean = pf->sumWp / pf->sumW;
@@ -279,6 +475,207 @@ inline float3 projectOriginPlane(const Plane * restrict plane)
     return plane->normal * -plane->dist;
 }
 
+/**
+ * Packs the coordinates of a block (in units of blocks) into a uint. The x
+ * and y coordinates get 11 bits each and the z coordinate 10 bits.
+ */
+inline uint packBlock(uint3 bid)
+{
+    return bid.x | (bid.y << 11) | (bid.z << 22);
+}
+
+/**
+ * Inverse of @ref packBlock, returning the coordinates of the lowest corner of
+ * the block in region coordinates.
+ */
+inline int3 unpackBlock(uint packed)
+{
+    int3 wid;
+    wid.x = (packed & 0x7FF) * WGS_X;
+    wid.y = ((packed >> 11) & 0x7FF) * WGS_Y;
+    wid.z = (packed >> 22) * WGS_Z;
+    return wid;
+}
+
+/**
+ * Classifies the WGS_X x WGS_Y x WGS_Z blocks of a swathe by whether the
+ * octree has any splats for them. The packed coordinates (see @ref packBlock)
+ * of occupied blocks are written from the front of @a blocks, and those of
+ * empty blocks from the back, so that @ref processCorners only needs to be
+ * launched for the occupied ones.
+ *
+ * @param[out] blocks      Classified blocks (@a numBlocks elements).
+ * @param[in,out] counts   Number of occupied and empty blocks found (must be initially zero).
+ * @param      start, startShift As for @ref processCorners.
+ * @param      numBlocks   Total number of blocks in the swathe.
+ * @param      cellKeys, numCells, levels, rootOffset As for @ref processCorners.
+ *
+ * There is one work-item per block, with the global ID giving its coordinates
+ * in units of blocks. The global offset in z selects the first block of the
+ * swathe.
+ */
+__kernel void compactBlocks(
+    __global uint * restrict blocks,
+    volatile __global uint * restrict counts,
+    __global const command_type * restrict start,
+    uint startShift,
+    uint numBlocks
+#if SPARSE_START
+    , __global const ulong * restrict cellKeys,
+    __global const uint * restrict numCells,
+    uint levels,
+    ulong rootOffset
+#endif
+    )
+{
+    SPECIALIZE_START_SHIFT();
+    uint3 bid = (uint3) ((uint) get_global_id(0), (uint) get_global_id(1), (uint) get_global_id(2));
+    uint packed = packBlock(bid);
+    ulong code = makeCode(unpackBlock(packed)) >> startShift;
+#if SPARSE_START
+    command_type pos = sparseStart(cellKeys, start, *numCells, code, levels, rootOffset);
+#else
+    command_type pos = start[code];
+#endif
+    if (pos >= 0)
+        blocks[atomic_inc(&counts[0])] = packed;
+    else
+        blocks[numBlocks - 1 - atomic_inc(&counts[1])] = packed;
+}
+
+/**
+ * Writes NaN to all the corners of empty blocks, which are known not to
+ * intersect the octree so do not need the full @ref processCorners.
+ *
+ * @param[out] corners     The isovalues from a slice.
+ * @param      blocks      Packed block coordinates produced by @ref compactBlocks.
+ * @param      firstBlock  Index of the first empty block in @a blocks.
+ * @param      zStride, zBias, rowPitch See @ref Marching::ImageParams
+ */
+KERNEL(WGS_X * WGS_Y * WGS_Z, 1, 1)
+void clearBlocks(
+    DISTANCE_ARG corners,
+    __global const uint * restrict blocks,
+    uint firstBlock,
+    uint zStride,
+    int zBias,
+    uint rowPitch)
+{
+    SPECIALIZE_IMAGE_PARAMS();
+    int3 outCoord = unpackBlock(blocks[firstBlock + get_group_id(0)]) + cornerOffset(get_local_id(0));
+    outCoord.y += outCoord.z * zStride + zBias;
+    WRITE_DISTANCE(corners, rowPitch, outCoord.x, outCoord.y, nan(0U));
+}
+
+#if FIT_SPHERE
+typedef SphereFit Fit;
+#elif FIT_PLANE
+typedef PlaneFit Fit;
+#else
+#error "Expected FIT_SPHERE or FIT_PLANE"
+#endif
+
+/**
+ * Add the contribution of one splat to the fit for a grid corner.
+ *
+ * @param[in,out] fit          Fit being accumulated.
+ * @param      coord           Position of the corner, in global grid coordinates.
+ * @param      positionRadius  Position and inverse squared radius of the splat.
+ * @param      splat           The splat, from which the normal and quality are loaded if needed.
+ */
+inline void fitAddSplat(Fit *fit, float3 coord, float4 positionRadius, __global const Splat *splat)
+{
+    float3 p = positionRadius.xyz - coord;
+    float pp = dot3(p, p);
+    float d = pp * positionRadius.w; // .w is the inverse squared radius
+    if (d < RADIUS_CUTOFF)
+    {
+        float4 normalQuality = getNormalQuality(splat);
+        float w = 1.0f - d;
+        w *= w; // raise to the 4th power
+        w *= w;
+        w *= normalQuality.w;
+
+#if FIT_SPHERE
+        sphereFitAdd(fit, w, p, pp, normalQuality.xyz);
+#else
+        planeFitAdd(fit, w, p, pp, normalQuality.xyz);
+#endif
+#if BOUNDARY_NEAREST
+        // Only the offset in the tangent plane counts, so that corners off the surface are kept
+        float pn = dot3(p, normalQuality.xyz);
+        fit->minD = min(fit->minD, (pp - pn * pn) * positionRadius.w);
+#endif
+    }
+}
+
+/**
+ * Turn an accumulated fit into the signed distance of its corner, which is
+ * at the origin of the fit. The result is NaN if there are too few hits, if
+ * the surface is too far away, or if the corner lies beyond the boundary.
+ *
+ * The default boundary test compares the distance from the projected point
+ * to the weighted centroid against the spread of the splats, which needs
+ * the second moment @c sumWpp. With @c BOUNDARY_NEAREST, a corner is instead
+ * beyond the boundary if, measured in the tangent plane of each splat, no
+ * splat centre lies within a fraction of that splat's radius. This is known
+ * before solving the fit, so corners beside holes are rejected without
+ * fitting.
+ *
+ * @param fit              The accumulated fit.
+ * @param boundaryFactor   See @ref processCorners.
+ */
+inline float fitDistance(const Fit *fit, float boundaryFactor)
+{
+    float f = nan(0U);
+#if BOUNDARY_NEAREST
+    if (fit->hits >= HITS_CUTOFF && fit->minD < boundaryFactor)
+#else
+    if (fit->hits >= HITS_CUTOFF)
+#endif
+    {
+#if FIT_SPHERE
+        Sphere sphere;
+        fitSphere(fit, &sphere);
+        float3 a = projectOriginSphere(&sphere);
+        float aa = dot3(a, a);
+        if (aa < 3.0f)
+        {
+#if BOUNDARY_NEAREST
+            f = -dot3(sphere.b, a) * half_rsqrt(sphere.b2);
+#else
+            float rhs = (fit->sumWpp - 2 * dot3(fit->sumWp, a) + fit->sumW * aa);
+            if (sphere.qDen > boundaryFactor * rhs)
+            {
+                f = -dot3(sphere.b, a) * half_rsqrt(sphere.b2);
+            }
+#endif
+        }
+#elif FIT_PLANE
+        Plane plane;
+        fitPlane(fit, &plane);
+        float3 a = projectOriginPlane(&plane);
+        float aa = dot3(a, a);
+        if (aa < 3.0f)
+        {
+#if BOUNDARY_NEAREST
+            f = projectDistOriginPlane(&plane);
+#else
+            float qDen = fit->sumWpp - dot3(plane.mean, fit->sumWp);
+            float rhs = (fit->sumWpp - 2 * dot3(fit->sumWp, a) + fit->sumW * aa);
+            if (qDen > boundaryFactor * rhs)
+            {
+                f = projectDistOriginPlane(&plane);
+            }
+#endif
+        }
+#else
+#error "Expected FIT_SPHERE or FIT_PLANE"
+#endif
+    }
+    return f;
+}
+
 /**
  * Compute isovalues for all grid corners in a slice. Those with no defined
  * isovalue are assigned a value of NaN.
@@ -291,14 +688,35 @@ inline float3 projectOriginPlane(const Plane * restrict plane)
  * @param      zStride, zBias See @ref Marching::ImageParams
  * @param      boundaryFactor Value of \f$1 - \gamma^2\f$ where \f$\gamma\f$ is the maximum
  *                         normalised distance between the projection point and the weighted
- *                         center of the region.
+ *                         center of the region. With @c BOUNDARY_NEAREST it is instead
+ *                         \f$\gamma^2\f$, the largest normalised squared tangential
+ *                         distance to the nearest splat (see @ref MlsFunctor::boundaryFactor).
+ *
+ * @param      blocks      Packed block coordinates produced by @ref compactBlocks.
+ * @param[in,out] sliceSigns Per-slice flags, which must be zeroed beforehand. Bit 0 of
+ *                         element @a i is set if slice @a zFirst + @a i has a
+ *                         corner with a value of at least zero, and bit 1 if it
+ *                         has a negative one. Padding corners are included, which
+ *                         can only add bits; NaN adds none.
+ * @param      zFirst      First slice of the swathe, in region coordinates.
+ * @param      rowPitch    See @ref Marching::ImageParams
+ * @param      cellKeys, numCells Keys and count of occupied cells, when @a start is a
+ *                         sparse table (only present if @c SPARSE_START).
+ * @param      levels      Number of levels in the octree (only present if @c SPARSE_START).
+ * @param      rootOffset  Key of the first cell of the root (only present if @c SPARSE_START).
+ *
+ * The local ID is a one-dimension encoding of a 3D local ID (see @ref cornerOffset).
+ * The group ID is an index into @a blocks, specifying which of the 3D blocks
+ * we are processing. Only blocks that intersect the octree are processed.
  *
- * The local ID is a one-dimension encoding of a 3D local ID (see @ref decode).
- * The group ID specifies which of these 3D blocks we are processing.
+ * When subgroups are available, each subgroup walks the command list on its
+ * own: every lane loads one splat and the lanes broadcast them to each other
+ * in turn. This needs neither local memory nor barriers. Otherwise the whole
+ * work-group stages up to @ref MAX_BUCKET splats at a time in local memory.
  */
 KERNEL(WGS_X * WGS_Y * WGS_Z, 1, 1)
 void processCorners(
-    __write_only image2d_t corners,
+    DISTANCE_ARG corners,
     __global const Splat * restrict splats,
     __global const command_type * restrict commands,
     __global const command_type * restrict start,
@@ -306,17 +724,37 @@ void processCorners(
     int3 offset,
     uint zStride,
     int zBias,
-    float boundaryFactor)
+    float boundaryFactor,
+    __global const uint * restrict blocks,
+    __global uint *sliceSigns,
+    uint zFirst,
+    uint rowPitch
+#if SPARSE_START
+    , __global const ulong * restrict cellKeys,
+    __global const uint * restrict numCells,
+    uint levels,
+    ulong rootOffset
+#endif
+    )
 {
+#if !SUBGROUPS
     __local command_type lSplatIds[MAX_BUCKET];
     __local float4 lPositionRadius[MAX_BUCKET];
+#endif
+    __local uint lSigns[WGS_Z];
 
-    int3 wid;  // position of one corner of the workgroup in region coordinates
-    wid.x = get_group_id(0) * WGS_X;
-    wid.y = get_group_id(1) * WGS_Y;
-    wid.z = get_group_id(2) * WGS_Z + get_global_offset(2);
-    uint code = makeCode(wid) >> startShift;
+    SPECIALIZE_START_SHIFT();
+    SPECIALIZE_BOUNDARY_FACTOR();
+    SPECIALIZE_IMAGE_PARAMS();
+
+    // position of one corner of the workgroup in region coordinates
+    int3 wid = unpackBlock(blocks[get_group_id(0)]);
+    ulong code = makeCode(wid) >> startShift;
+#if SPARSE_START
+    command_type pos = sparseStart(cellKeys, start, *numCells, code, levels, rootOffset);
+#else
     command_type pos = start[code];
+#endif
 
     uint lid = get_local_id(0);
 
@@ -324,19 +762,56 @@ void processCorners(
 
     if (pos >= 0)
     {
-        float3 coord = convert_float3(wid + decode(lid) + offset);
+        float3 coord = convert_float3(wid + cornerOffset(lid) + offset);
 
+        Fit fit;
 #if FIT_SPHERE
-        SphereFit fit;
         sphereFitInit(&fit);
-#elif FIT_PLANE
-        PlaneFit fit;
-        planeFitInit(&fit);
 #else
-#error "Expected FIT_SPHERE or FIT_PLANE"
+        planeFitInit(&fit);
 #endif
 
         command_type end = commands[pos++];
+#if SUBGROUPS
+        const command_type sgSize = get_sub_group_size();
+        const command_type sgLid = get_sub_group_local_id();
+        while (pos < end)
+        {
+            /* The loop bounds depend only on the commands, so they are
+             * uniform across the subgroup as the broadcasts require.
+             */
+            const command_type count = min(sgSize, end - pos);
+            command_type mine = -1;
+            float4 minePositionRadius = (float4) (0.0f, 0.0f, 0.0f, 0.0f);
+            if (sgLid < count)
+            {
+                mine = commands[pos + sgLid];
+                if (mine >= 0)
+                    minePositionRadius = getPositionRadius(&splats[mine]);
+            }
+
+            pos += count;
+            if (pos >= end)
+            {
+                pos = commands[end];
+                end = (pos >= 0) ? commands[pos++] : INT_MIN;
+            }
+
+            for (command_type i = 0; i < count; i++)
+            {
+                command_type splatId = sub_group_broadcast(mine, i);
+                if (splatId < 0)
+                    break;
+
+                float4 positionRadius;
+                positionRadius.x = sub_group_broadcast(minePositionRadius.x, i);
+                positionRadius.y = sub_group_broadcast(minePositionRadius.y, i);
+                positionRadius.z = sub_group_broadcast(minePositionRadius.z, i);
+                positionRadius.w = sub_group_broadcast(minePositionRadius.w, i);
+                fitAddSplat(&fit, coord, positionRadius, &splats[splatId]);
+            }
+        }
+#else
         while (pos < end)
         {
             if (lid < MAX_BUCKET)
@@ -346,7 +821,7 @@ void processCorners(
                 lSplatIds[lid] = mine;
                 if (mine >= 0)
                 {
-                    lPositionRadius[lid] = splats[mine].positionRadius;
+                    lPositionRadius[lid] = getPositionRadius(&splats[mine]);
                 }
             }
 
@@ -367,69 +842,225 @@ void processCorners(
                     break;
                 }
 
-                float4 positionRadius = lPositionRadius[i];
-                float3 p = positionRadius.xyz - coord;
-                float pp = dot3(p, p);
-                float d = pp * positionRadius.w; // .w is the inverse squared radius
-                if (d < RADIUS_CUTOFF)
-                {
-                    __global const Splat *splat = &splats[splatId];
-                    float w = 1.0f - d;
-                    w *= w; // raise to the 4th power
-                    w *= w;
-                    w *= splat->normalQuality.w;
-
-#if FIT_SPHERE
-                    sphereFitAdd(&fit, w, p, pp, splat->normalQuality.xyz);
-#elif FIT_PLANE
-                    planeFitAdd(&fit, w, p, pp, splat->normalQuality.xyz);
-#else
-#error "Expected FIT_SPHERE or FIT_PLANE"
-#endif
-                }
+                fitAddSplat(&fit, coord, lPositionRadius[i], &splats[splatId]);
             }
             barrier(CLK_LOCAL_MEM_FENCE);
         }
+#endif
 
-        if (fit.hits >= HITS_CUTOFF)
+        f = fitDistance(&fit, boundaryFactor);
+    }
+
+    int3 lid3 = cornerOffset(lid);
+    int3 outCoord = wid + lid3;
+    outCoord.y += outCoord.z * zStride + zBias;
+    WRITE_DISTANCE(corners, rowPitch, outCoord.x, outCoord.y, f);
+
+    /* Reduce the signs within each slice of the block in local memory, so
+     * that only one global atomic per slice is needed.
+     */
+    if (lid < WGS_Z)
+        lSigns[lid] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint sign = (f >= 0.0f ? 1U : 0U) | (f < 0.0f ? 2U : 0U);
+    if (sign != 0)
+        atomic_or(&lSigns[lid3.z], sign);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid < WGS_Z && lSigns[lid] != 0)
+        atomic_or(&sliceSigns[wid.z + lid - zFirst], lSigns[lid]);
+}
+
+/**
+ * Find the corners of a swathe that may lie within the support of a splat,
+ * as a box of region coordinates. It is conservative, since @ref fitAddSplat
+ * discards the corners beyond @ref RADIUS_CUTOFF.
+ *
+ * @param positionRadius  Position (global grid coordinates) and inverse squared radius.
+ * @param offset          As for @ref processCorners.
+ * @param size            Corners in x and y (padded to the alignment).
+ * @param zFirst, zLast   Slices of the swathe, in region coordinates.
+ * @param[out] lo, hi     Inclusive bounds of the box.
+ * @return Whether the box is non-empty.
+ */
+inline bool scatterBox(float4 positionRadius, int3 offset, uint2 size, uint zFirst, uint zLast,
+                       int3 *lo, int3 *hi)
+{
+    if (!(positionRadius.w > 0.0f))
+        return false;
+    const float r = sqrt(1.0f / positionRadius.w);
+    const float3 p = positionRadius.xyz - convert_float3(offset);
+    const float3 fmin = (float3) (-1.0f, -1.0f, (float) zFirst - 1.0f);
+    const float3 fmax = (float3) ((float) size.x, (float) size.y, (float) zLast + 1.0f);
+    // Clamp before converting so that huge or infinite radii cannot overflow
+    const int3 l = convert_int3(clamp(ceil(p - r), fmin, fmax));
+    const int3 h = convert_int3(clamp(floor(p + r), fmin, fmax));
+    *lo = max(l, (int3) (0, 0, (int) zFirst));
+    *hi = min(h, (int3) ((int) size.x - 1, (int) size.y - 1, (int) zLast));
+    return all(*lo <= *hi);
+}
+
+/**
+ * First pass of the scatter formulation (see @ref ScatterMlsFunctor). Counts
+ * the corners of the swathe that each splat may affect. There is one
+ * work-item per splat, plus one that writes a zero to terminate the counts,
+ * so that an exclusive scan leaves the total at the end.
+ *
+ * @param[out] counts     Corner count for each splat (@a numSplats + 1 elements).
+ * @param      splats     Input splats, as for @ref processCorners.
+ * @param      firstSplat Index of the first splat in @a splats to use.
+ * @param      numSplats  Number of splats in @a splats to use.
+ * @param      offset     As for @ref processCorners.
+ * @param      size, zFirst, zLast As for @ref scatterBox.
+ * @param      limit      Counts are clamped to this, so that the scan cannot overflow.
+ */
+__kernel void scatterCount(
+    __global uint * restrict counts,
+    __global const Splat * restrict splats,
+    uint firstSplat,
+    uint numSplats,
+    int3 offset,
+    uint2 size,
+    uint zFirst,
+    uint zLast,
+    uint limit)
+{
+    const uint gid = get_global_id(0);
+    uint count = 0;
+    int3 lo, hi;
+    if (gid < numSplats
+        && scatterBox(getPositionRadius(&splats[firstSplat + gid]), offset, size, zFirst, zLast, &lo, &hi))
+    {
+        const int3 extent = hi - lo + 1;
+        count = (uint) min((ulong) extent.x * extent.y * extent.z, (ulong) limit);
+    }
+    counts[gid] = count;
+}
+
+/**
+ * Second pass of the scatter formulation. Writes a (corner, splat) pair for
+ * each corner counted by @ref scatterCount. The corner is encoded as
+ * <code>((z - zFirst) * size.y + y) * size.x + x</code>.
+ *
+ * @param[out] keys       Encoded corners.
+ * @param[out] values     Splat indices in @a splats.
+ * @param      starts     Exclusive scan of the output of @ref scatterCount.
+ *
+ * The other parameters are as for @ref scatterCount, with one work-item per
+ * splat. No count may have been clamped.
+ */
+__kernel void scatterWrite(
+    __global uint * restrict keys,
+    __global uint * restrict values,
+    __global const uint * restrict starts,
+    __global const Splat * restrict splats,
+    uint firstSplat,
+    int3 offset,
+    uint2 size,
+    uint zFirst,
+    uint zLast)
+{
+    const uint gid = get_global_id(0);
+    const uint splatId = firstSplat + gid;
+    int3 lo, hi;
+    if (!scatterBox(getPositionRadius(&splats[splatId]), offset, size, zFirst, zLast, &lo, &hi))
+        return;
+    uint pos = starts[gid];
+    for (int z = lo.z; z <= hi.z; z++)
+        for (int y = lo.y; y <= hi.y; y++)
         {
-#if FIT_SPHERE
-            Sphere sphere;
-            fitSphere(&fit, &sphere);
-            float3 a = projectOriginSphere(&sphere);
-            float aa = dot3(a, a);
-            if (aa < 3.0f)
+            const uint row = ((z - zFirst) * size.y + y) * size.x;
+            for (int x = lo.x; x <= hi.x; x++)
             {
-                float rhs = (fit.sumWpp - 2 * dot3(fit.sumWp, a) + fit.sumW * aa);
-                if (sphere.qDen > boundaryFactor * rhs)
-                {
-                    f = -dot3(sphere.b, a) * half_rsqrt(sphere.b2);
-                }
-            }
-#elif FIT_PLANE
-            Plane plane;
-            fitPlane(&fit, &plane);
-            float3 a = projectOriginPlane(&plane);
-            float aa = dot3(a, a);
-            if (aa < 3.0f)
-            {
-                float qDen = fit.sumWpp - dot3(plane.mean, fit.sumWp);
-                float rhs = (fit.sumWpp - 2 * dot3(fit.sumWp, a) + fit.sumW * aa);
-                if (qDen > boundaryFactor * rhs)
-                {
-                    f = projectDistOriginPlane(&plane);
-                }
+                keys[pos] = row + x;
+                values[pos] = splatId;
+                pos++;
             }
+        }
+}
+
+/**
+ * Writes NaN to every corner of a swathe, before @ref scatterCorners fills
+ * in those that have splats. There is one work-item per corner, with the
+ * global ID giving its region coordinates relative to slice @a zFirst.
+ *
+ * @param[out] corners    The isovalues.
+ * @param      zFirst     First slice of the swathe.
+ * @param      zStride, zBias, rowPitch See @ref Marching::ImageParams
+ */
+__kernel void scatterClear(
+    DISTANCE_ARG corners,
+    uint zFirst,
+    uint zStride,
+    int zBias,
+    uint rowPitch)
+{
+    SPECIALIZE_IMAGE_PARAMS();
+    const uint x = get_global_id(0);
+    const uint y = get_global_id(1) + (get_global_id(2) + zFirst) * zStride + zBias;
+    WRITE_DISTANCE(corners, rowPitch, x, y, nan(0U));
+}
+
+/**
+ * Final pass of the scatter formulation. The pairs written by @ref
+ * scatterWrite have been sorted by corner, with a stable sort so that the
+ * splats of each corner are in index order. There is one work-item per pair,
+ * and the first pair of each corner accumulates the fit over all the pairs
+ * of that corner and writes the distance.
+ *
+ * @param[out] corners     The isovalues.
+ * @param      keys, values Sorted pairs.
+ * @param      numPairs    Number of pairs.
+ * @param      splats, offset As for @ref processCorners.
+ * @param      size, zFirst As for @ref scatterWrite.
+ * @param      zStride, zBias, rowPitch, boundaryFactor As for @ref processCorners.
+ * @param[in,out] sliceSigns As for @ref processCorners.
+ */
+__kernel void scatterCorners(
+    DISTANCE_ARG corners,
+    __global const uint * restrict keys,
+    __global const uint * restrict values,
+    uint numPairs,
+    __global const Splat * restrict splats,
+    int3 offset,
+    uint2 size,
+    uint zFirst,
+    uint zStride,
+    int zBias,
+    uint rowPitch,
+    float boundaryFactor,
+    __global uint *sliceSigns)
+{
+    SPECIALIZE_BOUNDARY_FACTOR();
+    SPECIALIZE_IMAGE_PARAMS();
+    const uint gid = get_global_id(0);
+    if (gid >= numPairs)
+        return;
+    const uint key = keys[gid];
+    if (gid > 0 && keys[gid - 1] == key)
+        return;
+
+    const uint x = key % size.x;
+    const uint y = (key / size.x) % size.y;
+    const uint z = key / size.x / size.y + zFirst;
+    const float3 coord = convert_float3((int3) ((int) x, (int) y, (int) z) + offset);
+
+    Fit fit;
+#if FIT_SPHERE
+    sphereFitInit(&fit);
 #else
-#error "Expected FIT_SPHERE or FIT_PLANE"
+    planeFitInit(&fit);
 #endif
-        }
+    for (uint i = gid; i < numPairs && keys[i] == key; i++)
+    {
+        const uint splatId = values[i];
+        fitAddSplat(&fit, coord, getPositionRadius(&splats[splatId]), &splats[splatId]);
     }
+    const float f = fitDistance(&fit, boundaryFactor);
+    WRITE_DISTANCE(corners, rowPitch, x, y + z * zStride + zBias, f);
 
-    int3 lid3 = decode(lid);
-    int3 outCoord = wid + lid3;
-    outCoord.y += outCoord.z * zStride + zBias;
-    write_imagef(corners, outCoord.xy, f);
+    const uint sign = (f >= 0.0f ? 1U : 0U) | (f < 0.0f ? 2U : 0U);
+    if (sign != 0)
+        atomic_or(&sliceSigns[z - zFirst], sign);
 }
 
 /*******************************************************************************
@@ -455,9 +1086,9 @@ __kernel void testFitSphere(__global float *out, __global const Splat *in, uint
     sphereFitInit(&sf);
     for (uint i = 0; i < nsplats; i++)
     {
-        const float3 p = in[i].positionRadius.xyz;
-        const float3 n = in[i].normalQuality.xyz;
-        sphereFitAdd(&sf, in[i].normalQuality.w, p, dot3(p, p), n);
+        const float3 p = getPositionRadius(&in[i]).xyz;
+        const float4 nq = getNormalQuality(&in[i]);
+        sphereFitAdd(&sf, nq.w, p, dot3(p, p), nq.xyz);
     }
     Sphere sphere;
     fitSphere(&sf, &sphere);
@@ -470,7 +1101,7 @@ __kernel void testFitSphere(__global float *out, __global const Splat *in, uint
 
 __kernel void testMakeCode(__global uint *out, int3 xyz)
 {
-    *out = makeCode(xyz);
+    *out = (uint) makeCode(xyz);
 }
 
 __kernel void testDecode(__global int3 *out, uint code)
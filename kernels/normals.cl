@@ -0,0 +1,290 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Estimation of splat normals and radii from nearest neighbours, using an
+ * octree built by octree.cl to find the candidates.
+ *
+ * Required defines:
+ * - NEIGHBOURS: number of nearest neighbours used for each estimate.
+ *
+ * Optional defines:
+ * - PACKED_SPLATS: 0 (default) or 1, to use the compact splat layout.
+ */
+
+#ifndef NEIGHBOURS
+# error "NEIGHBOURS must be defined"
+#endif
+#ifndef PACKED_SPLATS
+# define PACKED_SPLATS 0
+#endif
+
+typedef int command_type;
+
+#if PACKED_SPLATS
+typedef struct
+{
+    float positionRadius[4]; // position in xyz, radius (or inverse-squared radius) in w
+    ushort normalQuality[4]; // half-precision normal in xyz, quality metric in w
+} Splat;
+
+inline float4 getPositionRadius(__global const Splat *splat)
+{
+    return vload4(0, splat->positionRadius);
+}
+
+inline float4 getNormalQuality(__global const Splat *splat)
+{
+    return vload_half4(0, (__global const half *) splat->normalQuality);
+}
+
+inline void setRadiusNormalQuality(__global Splat *splat, float radius, float4 normalQuality)
+{
+    splat->positionRadius[3] = radius;
+    vstore_half4_rte(normalQuality, 0, (__global half *) splat->normalQuality);
+}
+#else
+typedef struct
+{
+    float4 positionRadius;   // position in xyz, radius (or inverse-squared radius) in w
+    float4 normalQuality;    // normal in xyz, quality metric in w
+} Splat;
+
+inline float4 getPositionRadius(__global const Splat *splat)
+{
+    return splat->positionRadius;
+}
+
+inline float4 getNormalQuality(__global const Splat *splat)
+{
+    return splat->normalQuality;
+}
+
+inline void setRadiusNormalQuality(__global Splat *splat, float radius, float4 normalQuality)
+{
+    splat->positionRadius.w = radius;
+    splat->normalQuality = normalQuality;
+}
+#endif
+
+/**
+ * Turn cell coordinates into a cell code. This must match the function of
+ * the same name in octree.cl.
+ */
+inline ulong makeCode(int3 xyz)
+{
+    ulong ans = 0;
+    ulong scale = 1;
+    xyz.y <<= 1;  // pre-shift these to avoid shifts inside the loop
+    xyz.z <<= 2;
+    while (any(xyz != 0))
+    {
+        ulong bits = (xyz.x & 1) | (xyz.y & 2) | (xyz.z & 4);
+        ans += bits * scale;
+        scale <<= 3;
+        xyz >>= 1;
+    }
+    return ans;
+}
+
+/**
+ * Find the eigenvector of a symmetric 3x3 matrix with the smallest
+ * eigenvalue. The eigenvalues are found in closed form, and the eigenvector
+ * is the longest cross product of two rows of the shifted matrix.
+ *
+ * @param a00,a01,a02,a11,a12,a22  Upper triangle of the matrix.
+ * @param[out] out                 Unit eigenvector.
+ * @return Whether the eigenvector is well-defined.
+ */
+bool smallestEigenvector(
+    float a00, float a01, float a02, float a11, float a12, float a22,
+    float3 *out)
+{
+    float q = (a00 + a11 + a22) * (1.0f / 3.0f);
+    float b00 = a00 - q, b11 = a11 - q, b22 = a22 - q;
+    float p1 = a01 * a01 + a02 * a02 + a12 * a12;
+    float p2 = b00 * b00 + b11 * b11 + b22 * b22 + 2.0f * p1;
+    float p = sqrt(p2 * (1.0f / 6.0f));
+    if (!(p > 0.0f))
+        return false;   // isotropic, so any direction will do
+
+    float inv = 1.0f / p;
+    float det = b00 * (b11 * b22 - a12 * a12)
+        - a01 * (a01 * b22 - a12 * a02)
+        + a02 * (a01 * a12 - b11 * a02);
+    float r = clamp(0.5f * det * inv * inv * inv, -1.0f, 1.0f);
+    float phi = acos(r) * (1.0f / 3.0f);
+    float lambda = q + 2.0f * p * cos(phi + M_PI_F * (2.0f / 3.0f));
+
+    float3 r0 = (float3) (a00 - lambda, a01, a02);
+    float3 r1 = (float3) (a01, a11 - lambda, a12);
+    float3 r2 = (float3) (a02, a12, a22 - lambda);
+    float3 c0 = cross(r0, r1);
+    float3 c1 = cross(r0, r2);
+    float3 c2 = cross(r1, r2);
+    float l0 = dot(c0, c0), l1 = dot(c1, c1), l2 = dot(c2, c2);
+    float3 best = c0;
+    float bestLen = l0;
+    if (l1 > bestLen)
+    {
+        best = c1;
+        bestLen = l1;
+    }
+    if (l2 > bestLen)
+    {
+        best = c2;
+        bestLen = l2;
+    }
+    if (!(bestLen > 0.0f))
+        return false;
+    *out = best * rsqrt(bestLen);
+    return true;
+}
+
+/**
+ * Estimate normals and radii for splats whose normal is zero, and restore
+ * the radius of the rest.
+ *
+ * The octree must have been built from the splats, so on entry each w
+ * component holds the inverse-squared radius. For splats read without a
+ * normal this is the search radius. The @ref NEIGHBOURS nearest splats
+ * within it are found, and the normal is the direction of least variance
+ * of them and the splat itself, flipped to face @a viewpoint. The radius
+ * becomes @a smooth times the distance to the furthest of them, limited to
+ * the search radius. If there are too few neighbours to define a plane, the
+ * splat is given a quality of zero so that it does not contribute.
+ *
+ * On exit every w component holds the radius again, so that the octree
+ * can be rebuilt.
+ *
+ * There is one work-item per splat, which may be rounded up.
+ *
+ * @param[in,out] splats   Splats in global grid coordinates.
+ * @param commands, start  Encoded octree built from @a splats.
+ * @param startShift       Subsampling shift for octree, times 3.
+ * @param offset           Difference between global grid coordinates and octree coordinates.
+ * @param maxCell          Largest valid octree coordinate in each dimension.
+ * @param viewpoint        Point to face in xyz (global grid coordinates), and +1 to
+ *                         face towards it or -1 to face away from it in w.
+ * @param smooth           Ratio of radius to the distance to the furthest neighbour.
+ * @param spacing          Grid spacing, to compute the quality in world units.
+ * @param firstSplat       Index of the first splat to process.
+ * @param numSplats        Number of splats to process.
+ */
+__kernel void estimateNormals(
+    __global Splat * restrict splats,
+    __global const command_type * restrict commands,
+    __global const command_type * restrict start,
+    uint startShift,
+    int3 offset,
+    int3 maxCell,
+    float4 viewpoint,
+    float smooth,
+    float spacing,
+    uint firstSplat,
+    uint numSplats)
+{
+    uint gid = get_global_id(0);
+    if (gid >= numSplats)
+        return;
+    gid += firstSplat;
+
+    float4 positionRadius = getPositionRadius(&splats[gid]);
+    float4 normalQuality = getNormalQuality(&splats[gid]);
+    float searchRadius = rsqrt(positionRadius.w);
+    if (any(normalQuality.xyz != 0.0f))
+    {
+        setRadiusNormalQuality(&splats[gid], searchRadius, normalQuality);
+        return;
+    }
+
+    float3 centre = positionRadius.xyz;
+    float radius2 = 1.0f / positionRadius.w;
+    float dist2[NEIGHBOURS];
+    float3 rel[NEIGHBOURS];
+    uint found = 0;
+
+    int3 cell = clamp(convert_int3_rtn(centre) - offset, (int3) (0, 0, 0), maxCell);
+    command_type pos = start[makeCode(cell) >> startShift];
+    while (pos >= 0)
+    {
+        command_type end = commands[pos++];
+        for (; pos < end; pos++)
+        {
+            command_type id = commands[pos];
+            if (id == gid)
+                continue;
+            float3 d = getPositionRadius(&splats[id]).xyz - centre;
+            float dd = dot(d, d);
+            if (dd < radius2 && (found < NEIGHBOURS || dd < dist2[NEIGHBOURS - 1]))
+            {
+                // Insertion into the sorted list of nearest neighbours
+                uint i = min(found, (uint) NEIGHBOURS - 1);
+                while (i > 0 && dist2[i - 1] > dd)
+                {
+                    dist2[i] = dist2[i - 1];
+                    rel[i] = rel[i - 1];
+                    i--;
+                }
+                dist2[i] = dd;
+                rel[i] = d;
+                found = min(found + 1, (uint) NEIGHBOURS);
+            }
+        }
+        pos = commands[end];
+    }
+
+    float3 normal = (float3) (0.0f, 0.0f, 1.0f);
+    float radius = searchRadius;
+    float quality = 0.0f;
+    if (found >= 2)
+    {
+        // Covariance of the neighbours and the splat itself (at the origin)
+        float3 mean = (float3) (0.0f, 0.0f, 0.0f);
+        for (uint i = 0; i < found; i++)
+            mean += rel[i];
+        mean /= (float) (found + 1);
+        float a00 = mean.x * mean.x, a01 = mean.x * mean.y, a02 = mean.x * mean.z;
+        float a11 = mean.y * mean.y, a12 = mean.y * mean.z, a22 = mean.z * mean.z;
+        for (uint i = 0; i < found; i++)
+        {
+            float3 d = rel[i] - mean;
+            a00 += d.x * d.x;
+            a01 += d.x * d.y;
+            a02 += d.x * d.z;
+            a11 += d.y * d.y;
+            a12 += d.y * d.z;
+            a22 += d.z * d.z;
+        }
+
+        if (smallestEigenvector(a00, a01, a02, a11, a12, a22, &normal))
+        {
+            if (dot(normal, viewpoint.xyz - centre) * viewpoint.w < 0.0f)
+                normal = -normal;
+            if (found == NEIGHBOURS)
+                radius = min(radius, smooth * sqrt(dist2[NEIGHBOURS - 1]));
+            float worldRadius = radius * spacing;
+            quality = 1.0f / (worldRadius * worldRadius);
+        }
+    }
+    setRadiusNormalQuality(&splats[gid], radius, (float4) (normal, quality));
+}
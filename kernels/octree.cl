@@ -22,19 +22,141 @@
  * @file
  *
  * Construction of an octree containing splats.
+ *
+ * Optional defines:
+ * - CODE_BITS: 32 (default) or 64, the width of cell codes and sort keys.
+ * - PACKED_SPLATS: 0 (default) or 1, to use the compact splat layout.
  */
 
+#ifndef CODE_BITS
+# define CODE_BITS 32
+#endif
+#if CODE_BITS == 64
+typedef ulong code_t;
+# define CODE_MAX ULONG_MAX
+#elif CODE_BITS == 32
+typedef uint code_t;
+# define CODE_MAX UINT_MAX
+#else
+# error "CODE_BITS must be 32 or 64"
+#endif
+#ifndef PACKED_SPLATS
+# define PACKED_SPLATS 0
+#endif
+
 /**
  * GPU representation of a splat.
- * Only the position and radius are used in this file, but the full set of information
- * is there for compatibility with other files.
+ * Only the position and radius are used to build the octree, but the full set
+ * of information is there for compatibility with other files. The normal and
+ * quality are only used to merge duplicates (see @ref findDuplicates).
  */
+#if PACKED_SPLATS
+typedef struct
+{
+    float positionRadius[4]; // position in xyz, radius in w
+    ushort normalQuality[4]; // half-precision normal in xyz, quality metric in w
+} Splat;
+
+inline float4 getPositionRadius(__global const Splat *splat)
+{
+    return vload4(0, splat->positionRadius);
+}
+
+inline void setRadius(__global Splat *splat, float radius)
+{
+    splat->positionRadius[3] = radius;
+}
+
+inline float3 getNormal(__global const Splat *splat)
+{
+    return vload_half4(0, (__global const half *) splat->normalQuality).xyz;
+}
+
+inline float getQuality(__global const Splat *splat)
+{
+    return vload_half(3, (__global const half *) splat->normalQuality);
+}
+
+inline void setQuality(__global Splat *splat, float quality)
+{
+    vstore_half(quality, 3, (__global half *) splat->normalQuality);
+}
+
+/**
+ * Atomically add to the quality of a splat. The quality shares a 32-bit word
+ * with the z component of the normal, so the whole word is swapped.
+ */
+inline void addQuality(__global Splat *splat, float add)
+{
+    volatile __global uint *word = ((volatile __global uint *) splat->normalQuality) + 1;
+#ifdef __ENDIAN_LITTLE__
+    const uint qshift = 16;
+#else
+    const uint qshift = 0;
+#endif
+    uint old = *word;
+    uint prev;
+    do
+    {
+        prev = old;
+        ushort bits = (ushort) (prev >> qshift);
+        float q = vload_half(0, (const half *) &bits) + add;
+        vstore_half(q, 0, (half *) &bits);
+        uint next = (prev & ~(0xFFFFU << qshift)) | ((uint) bits << qshift);
+        old = atomic_cmpxchg(word, prev, next);
+    } while (old != prev);
+}
+#else
 typedef struct
 {
     float4 positionRadius;   // position in xyz, radius in w
     float4 normalQuality;    // normal in xyz, quality metric in w
 } Splat;
 
+inline float4 getPositionRadius(__global const Splat *splat)
+{
+    return splat->positionRadius;
+}
+
+inline void setRadius(__global Splat *splat, float radius)
+{
+    splat->positionRadius.w = radius;
+}
+
+inline float3 getNormal(__global const Splat *splat)
+{
+    return splat->normalQuality.xyz;
+}
+
+inline float getQuality(__global const Splat *splat)
+{
+    return splat->normalQuality.w;
+}
+
+inline void setQuality(__global Splat *splat, float quality)
+{
+    splat->normalQuality.w = quality;
+}
+
+/// Atomically add to the quality of a splat.
+inline void addQuality(__global Splat *splat, float add)
+{
+    volatile __global uint *word = ((volatile __global uint *) &splat->normalQuality) + 3;
+    uint old = *word;
+    uint prev;
+    do
+    {
+        prev = old;
+        old = atomic_cmpxchg(word, prev, as_uint(as_float(prev) + add));
+    } while (old != prev);
+}
+#endif
+
+/// Number of neighbouring entries on each side examined by @ref findDuplicates
+#define MERGE_WINDOW 8
+/// Smallest cosine of the angle between normals of splats that are merged
+#define MERGE_MIN_COS 0.9f
+
 /**
  * Determine the octree level to use for a box of a given size.  When entered
  * into the resulting level, the box is guaranteed to intersect no more than a
@@ -118,15 +240,15 @@ inline bool goodEntry(
  * @todo Investigate preloading this (per axis) to shared memory from a table
  * instead.
  */
-inline uint makeCode(int3 xyz)
+inline code_t makeCode(int3 xyz)
 {
-    uint ans = 0;
-    uint scale = 1;
+    code_t ans = 0;
+    code_t scale = 1;
     xyz.y <<= 1;  // pre-shift these to avoid shifts inside the loop
     xyz.z <<= 2;
     while (any(xyz != 0))
     {
-        uint bits = (xyz.x & 1) | (xyz.y & 2) | (xyz.z & 4);
+        code_t bits = (xyz.x & 1) | (xyz.y & 2) | (xyz.z & 4);
         ans += bits * scale;
         scale <<= 3;
         xyz >>= 1;
@@ -139,7 +261,7 @@ inline uint makeCode(int3 xyz)
  *
  * Each splat produces up to 8 "entries", consisting of a cell key/splat ID
  * pair. In fact, each splat must produce exactly 8 entries, and for unwanted
- * slots, it must write a cell code of UINT_MAX.
+ * slots, it must write a cell code of CODE_MAX.
  *
  * The output arrays are slot-major i.e. of layout [8][numsplats] and splat i
  * writes to slots [j][i] for j in 0..7. The number of splats is given by
@@ -155,22 +277,26 @@ inline uint makeCode(int3 xyz)
  * @param minShift         Minimum bit shift (determines subsampling of grid to give finest level).
  * @param maxShift         Maximum bit shift (determines base level).
  * @param firstSplat       Index of first splat to process within @a splats
+ * @param firstEntry       Index of first entry to write within @a keys and @a values
+ * @param rootOffset       Value added to valid keys to place them in the start array of one root
  */
 __kernel void writeEntries(
-    __global uint *keys,
+    __global code_t *keys,
     __global uint *values,
     __global Splat *splats,
     int3 bias,
-    __local uint *levelOffsets,
+    __local code_t *levelOffsets,
     uint minShift,
     uint maxShift,
-    uint firstSplat)
+    uint firstSplat,
+    uint firstEntry,
+    code_t rootOffset)
 {
     if (get_local_id(0) == 0)
     {
         // TODO: compute in parallel, as long as splats array is big enough
-        uint pos = 0;
-        uint add = 1U << (3 * (maxShift - minShift));
+        code_t pos = 0;
+        code_t add = (code_t) 1 << (3 * (maxShift - minShift));
         for (uint i = minShift; i <= maxShift; i++)
         {
             levelOffsets[i] = pos;
@@ -181,31 +307,31 @@ __kernel void writeEntries(
     barrier(CLK_LOCAL_MEM_FENCE);
 
     uint gid = get_global_id(0);
-    uint pos = gid * 8;
+    uint pos = gid * 8 + firstEntry;
     gid += firstSplat;
 
-    float4 positionRadius = splats[gid].positionRadius;
+    float4 positionRadius = getPositionRadius(&splats[gid]);
     int3 ilo;
     int shift;
     prepare(&ilo, &shift, minShift, maxShift, positionRadius, bias);
 
     float radius2 = positionRadius.w * positionRadius.w;
-    splats[gid].positionRadius.w = 1.0f / radius2; // replace with form used in mls.cl
+    setRadius(&splats[gid], 1.0f / radius2); // replace with form used in mls.cl
     radius2 *= 1.00001f;   // be conservative in deciding intersections
     int3 ofs;
-    uint levelOffset = levelOffsets[shift];
+    code_t levelOffset = levelOffsets[shift] + rootOffset;
     int bound = 1 << (maxShift - shift);
     for (ofs.z = 0; ofs.z < 2; ofs.z++)
         for (ofs.y = 0; ofs.y < 2; ofs.y++)
             for (ofs.x = 0; ofs.x < 2; ofs.x++)
             {
                 int3 addr = ilo + ofs;
-                uint key = makeCode(addr) + levelOffset;
+                code_t key = makeCode(addr) + levelOffset;
                 bool isect = goodEntry(addr, shift, positionRadius.xyz, radius2, bias);
                 // Avoid going outside the octree bounds. ilo was already clamped to >= 0 in
                 // prepare so we don't need to worry about the lower bound
                 isect &= all(addr < bound);
-                key = isect ? key : UINT_MAX;
+                key = isect ? key : CODE_MAX;
 
                 values[pos] = gid;
                 keys[pos] = key;
@@ -213,6 +339,127 @@ __kernel void writeEntries(
             }
 }
 
+/**
+ * Prepare the merge targets for @ref findDuplicates by pointing each splat
+ * at itself. There is one work-item per splat of a root.
+ *
+ * @param[out] target      Merge target of each splat, indexed by splat ID.
+ * @param      firstSplat  Index of the first splat of the root.
+ */
+__kernel void initMerge(__global uint *target, uint firstSplat)
+{
+    uint id = get_global_id(0) + firstSplat;
+    target[id] = id;
+}
+
+/**
+ * Whether two splats are close enough to be merged. The radii are stored as
+ * inverse squares by @ref writeEntries.
+ */
+inline bool isDuplicate(__global const Splat *a, __global const Splat *b, float tolerance)
+{
+    float4 pa = getPositionRadius(a);
+    float4 pb = getPositionRadius(b);
+    float3 d = pa.xyz - pb.xyz;
+    if (dot(d, d) > tolerance * tolerance)
+        return false;
+    if (fabs(rsqrt(pa.w) - rsqrt(pb.w)) > tolerance)
+        return false;
+    float3 na = getNormal(a);
+    float3 nb = getNormal(b);
+    return dot(na, nb) >= MERGE_MIN_COS * sqrt(dot(na, na) * dot(nb, nb));
+}
+
+/**
+ * Find splats that duplicate others. Splats that are nearly identical have
+ * entries for the same cells, so after sorting they are found close together
+ * in the entries for a cell. Each entry is compared against up to
+ * @ref MERGE_WINDOW entries on either side with the same key, and the splat is
+ * retargeted to the lowest-numbered duplicate found. Since targets only ever
+ * decrease, following them always ends at a splat that is kept.
+ *
+ * There is one work-item per entry.
+ *
+ * @param[in,out] target     Merge targets, initialized by @ref initMerge.
+ * @param         keys       Sorted keys written by @ref writeEntries.
+ * @param         splatIds   The splat IDs written by @ref writeEntries (and sorted).
+ * @param         splats     The splats, as modified by @ref writeEntries.
+ * @param         tolerance  Largest difference in position or radius between duplicates.
+ */
+__kernel void findDuplicates(
+    volatile __global uint *target,
+    __global const code_t *keys,
+    __global const uint *splatIds,
+    __global const Splat *splats,
+    float tolerance)
+{
+    uint pos = get_global_id(0);
+    code_t key = keys[pos];
+    if (key == CODE_MAX)
+        return;
+
+    uint id = splatIds[pos];
+    uint lo = pos > MERGE_WINDOW ? pos - MERGE_WINDOW : 0;
+    uint hi = min(pos + MERGE_WINDOW, (uint) get_global_size(0) - 1);
+    uint best = id;
+    for (uint p = lo; p <= hi; p++)
+    {
+        uint other = splatIds[p];
+        if (other < best && keys[p] == key && isDuplicate(&splats[id], &splats[other], tolerance))
+            best = other;
+    }
+    if (best != id)
+        atomic_min(target + id, best);
+}
+
+/**
+ * Fold each duplicate splat into the splat that is kept in its place. The
+ * weight of a splat in the fit is scaled by its quality, so the kept splat
+ * takes the sum of the qualities and the duplicate's quality is zeroed. This
+ * also makes merging idempotent if the octree is built again. There is one
+ * work-item per splat of a root.
+ *
+ * @param[in,out] splats      The splats.
+ * @param         target      Merge targets, as written by @ref findDuplicates.
+ * @param         firstSplat  Index of the first splat of the root.
+ */
+__kernel void mergeSplats(
+    __global Splat *splats,
+    __global const uint *target,
+    uint firstSplat)
+{
+    uint id = get_global_id(0) + firstSplat;
+    uint keep = target[id];
+    if (keep == id)
+        return;
+    while (target[keep] != keep)
+        keep = target[keep];
+
+    addQuality(&splats[keep], getQuality(&splats[id]));
+    setQuality(&splats[id], 0.0f);
+}
+
+/**
+ * Remove the entries of duplicate splats by replacing their keys with
+ * @c CODE_MAX. The entries must then be sorted again.
+ *
+ * There is one work-item per entry.
+ *
+ * @param[in,out] keys       Sorted keys written by @ref writeEntries.
+ * @param         splatIds   The splat IDs written by @ref writeEntries (and sorted).
+ * @param         target     Merge targets, as written by @ref findDuplicates.
+ */
+__kernel void dropMerged(
+    __global code_t *keys,
+    __global const uint *splatIds,
+    __global const uint *target)
+{
+    uint pos = get_global_id(0);
+    uint id = splatIds[pos];
+    if (target[id] != id)
+        keys[pos] = CODE_MAX;
+}
+
 /**
  * Generate an indicator function over the entries that is 3 for the last
  * entry of each key and 1 elsewhere. This is later scanned to determine the
@@ -229,11 +476,11 @@ __kernel void writeEntries(
  */
 __kernel void countCommands(
     __global uint *indicator,
-    __global const uint *keys)
+    __global const code_t *keys)
 {
     uint pos = get_global_id(0);
-    uint curKey = keys[pos];
-    uint nextKey = keys[pos + 1];
+    code_t curKey = keys[pos];
+    code_t nextKey = keys[pos + 1];
     bool end = curKey != nextKey;
     indicator[pos] = end ? 3 : 1;
 }
@@ -258,19 +505,19 @@ __kernel void writeSplatIds(
     __global int *start,
     __global int *jumpPos,
     __global const uint *commandMap,
-    __global const uint *keys,
+    __global const code_t *keys,
     __global const uint *splatIds)
 {
     uint pos = get_global_id(0);
-    uint curKey = keys[pos];
+    code_t curKey = keys[pos];
 
-    if (curKey != UINT_MAX)
+    if (curKey != CODE_MAX)
     {
         uint cpos = commandMap[pos];
         commands[cpos] = splatIds[pos];
 
-        uint prevKey = pos > 0 ? keys[pos - 1] : UINT_MAX;
-        uint nextKey = (pos < get_global_size(0) - 1) ? keys[pos + 1] : UINT_MAX;
+        code_t prevKey = pos > 0 ? keys[pos - 1] : CODE_MAX;
+        code_t nextKey = (pos < get_global_size(0) - 1) ? keys[pos + 1] : CODE_MAX;
         if (prevKey != curKey)
             start[curKey] = cpos - 1;
         if (curKey != nextKey)
@@ -279,13 +526,17 @@ __kernel void writeSplatIds(
 }
 
 /**
- * Writes the start array, endpoints and jump commands for one level.
+ * Writes the start array, endpoints and jump commands for one level. The
+ * level is processed for every root at once: work-item @c i handles code
+ * <code>i & ((1 << levelBits) - 1)</code> in root <code>i >> levelBits</code>.
  *
  * @param[in,out]  start           Start array for previous and current level.
  * @param[out]     commands        Command array in which to write endpoints and jump commands.
  * @param          jumpPos         Jump positions in command array, as written by @ref writeSplatIds.
  * @param          curOffset       Offset added to code to get position in start array on current level.
  * @param          prevOffset      Offset added to parent code to get position in parent start array.
+ * @param          levelBits       Base-2 logarithm of the number of codes in the level.
+ * @param          rootStride      Distance between the start arrays of consecutive roots.
  *
  * @todo Investigate copying prev to local memory using subset of threads.
  */
@@ -293,13 +544,17 @@ __kernel void writeStart(
     __global int *start,
     __global int *commands,
     __global const uint *jumpPos,
-    uint curOffset,
-    uint prevOffset)
+    code_t curOffset,
+    code_t prevOffset,
+    uint levelBits,
+    code_t rootStride)
 {
-    uint code = get_global_id(0);
-    uint pos = code + curOffset;
+    code_t gid = get_global_id(0);
+    code_t root = (gid >> levelBits) * rootStride;
+    code_t code = gid & (((code_t) 1 << levelBits) - 1);
+    code_t pos = root + code + curOffset;
     int jp = jumpPos[pos];
-    int prev = start[prevOffset + (code >> 3)];
+    int prev = start[root + prevOffset + (code >> 3)];
     if (jp >= 0)
     {
         commands[jp] = prev;
@@ -319,15 +574,20 @@ __kernel void writeStart(
  * @param[out]     commands        Command array in which to write jump commands.
  * @param          jumpPos         Jump positions in command array, as written by @ref writeSplatIds.
  * @param          curOffset       Offset added to code to get position in start array on current level.
+ * @param          levelBits, rootStride As for @ref writeStart.
  */
 __kernel void writeStartTop(
     __global int *start,
     __global int *commands,
     __global const uint *jumpPos,
-    uint curOffset)
+    code_t curOffset,
+    uint levelBits,
+    code_t rootStride)
 {
-    uint code = get_global_id(0);
-    uint pos = code + curOffset;
+    code_t gid = get_global_id(0);
+    code_t root = (gid >> levelBits) * rootStride;
+    code_t code = gid & (((code_t) 1 << levelBits) - 1);
+    code_t pos = root + code + curOffset;
     int jp = jumpPos[pos];
     if (jp >= 0)
     {
@@ -340,6 +600,177 @@ __kernel void writeStartTop(
     }
 }
 
+/**
+ * Generate an indicator function over the entries that is 1 for the first
+ * entry of each valid key and 0 elsewhere. This is later scanned to give the
+ * position of each occupied cell in the sparse start table. There is one
+ * work-item per entry plus one extra, which writes a zero so that the scan
+ * also produces the number of occupied cells.
+ *
+ * @param[out] indicator       Indicator function.
+ * @param      keys            The sorted cell keys for the entries.
+ */
+__kernel void countCells(
+    __global uint *indicator,
+    __global const code_t *keys)
+{
+    uint pos = get_global_id(0);
+    bool first = false;
+    if (pos < get_global_size(0) - 1)
+    {
+        code_t curKey = keys[pos];
+        code_t prevKey = pos > 0 ? keys[pos - 1] : CODE_MAX;
+        first = curKey != CODE_MAX && curKey != prevKey;
+    }
+    indicator[pos] = first ? 1 : 0;
+}
+
+/**
+ * Variant of @ref writeSplatIds for a sparse start table. Instead of
+ * indexing @a start and @a jumpPos by key, each occupied cell is given the
+ * slot computed by @ref countCells, and its key is recorded in @a cellKeys.
+ *
+ * @param[out]  commands       The command array (see @ref SplatTree).
+ * @param[out]  start          First command for each occupied cell.
+ * @param[out]  jumpPos        Position in command array of the jump command for each occupied cell.
+ * @param[out]  cellKeys       Key of each occupied cell, in increasing order.
+ * @param       commandMap     Mapping from entry to command position.
+ * @param       cellIndex      Scan of the indicator written by @ref countCells.
+ * @param       keys           Sorted keys written by @ref writeEntries.
+ * @param       splatIds       The splat IDs written by @ref writeEntries (and sorted).
+ */
+__kernel void writeSplatIdsSparse(
+    __global int *commands,
+    __global int *start,
+    __global int *jumpPos,
+    __global ulong *cellKeys,
+    __global const uint *commandMap,
+    __global const uint *cellIndex,
+    __global const code_t *keys,
+    __global const uint *splatIds)
+{
+    uint pos = get_global_id(0);
+    code_t curKey = keys[pos];
+
+    if (curKey != CODE_MAX)
+    {
+        uint cpos = commandMap[pos];
+        uint cell = cellIndex[pos + 1] - 1;
+        commands[cpos] = splatIds[pos];
+
+        code_t prevKey = pos > 0 ? keys[pos - 1] : CODE_MAX;
+        code_t nextKey = (pos < get_global_size(0) - 1) ? keys[pos + 1] : CODE_MAX;
+        if (prevKey != curKey)
+        {
+            start[cell] = cpos - 1;
+            cellKeys[cell] = curKey;
+        }
+        if (curKey != nextKey)
+            jumpPos[cell] = cpos + 1;
+    }
+}
+
+/**
+ * Find a key in a sorted array of distinct keys.
+ *
+ * @return The index of @a key in @a keys, or -1 if it is not present.
+ */
+inline int findCell(__global const ulong *keys, uint n, ulong key)
+{
+    uint lo = 0;
+    uint hi = n;
+    while (lo < hi)
+    {
+        uint mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < n && keys[lo] == key) ? (int) lo : -1;
+}
+
+/**
+ * Look up the start of the command list for a cell in a sparse start table.
+ * This is the start of the finest occupied cell that contains it (possibly
+ * itself), or -1 if there is none.
+ *
+ * @param cellKeys, start, numCells The sparse start table.
+ * @param code            Code of the cell within its level.
+ * @param level           Level of the cell, counting up from 0 for the finest.
+ * @param levels          Number of levels in the octree.
+ * @param rootOffset      Key of the first cell of the root.
+ */
+inline int sparseStart(
+    __global const ulong *cellKeys,
+    __global const int *start,
+    uint numCells,
+    ulong code, uint level, uint levels, ulong rootOffset)
+{
+    ulong levelOffset = rootOffset;
+    for (uint l = 0; l < level; l++)
+        levelOffset += 1UL << (3 * (levels - 1 - l));
+    for (uint l = level; l < levels; l++)
+    {
+        int idx = findCell(cellKeys, numCells, levelOffset + code);
+        if (idx >= 0)
+            return start[idx];
+        levelOffset += 1UL << (3 * (levels - 1 - l));
+        code >>= 3;
+    }
+    return -1;
+}
+
+/**
+ * Variant of @ref writeStart and @ref writeStartTop for a sparse start
+ * table. Since unoccupied cells have no entries to fill in, all levels are
+ * handled in a single pass: each occupied cell chains to the finest
+ * occupied cell strictly containing it, found with @ref sparseStart.
+ *
+ * There is one work-item per entry, which is an upper bound on the number
+ * of occupied cells.
+ *
+ * @param[out]     commands        Command array in which to write endpoints and jump commands.
+ * @param          start, jumpPos  As written by @ref writeSplatIdsSparse.
+ * @param          cellKeys        As written by @ref writeSplatIdsSparse.
+ * @param          numCells        Number of occupied cells (in element 0).
+ * @param          levels          Number of levels in the octree.
+ * @param          rootStride      Distance between the keys of the first cells of consecutive roots.
+ */
+__kernel void writeStartSparse(
+    __global int *commands,
+    __global const int *start,
+    __global const int *jumpPos,
+    __global const ulong *cellKeys,
+    __global const uint *numCells,
+    uint levels,
+    ulong rootStride)
+{
+    uint gid = get_global_id(0);
+    uint n = *numCells;
+    if (gid >= n)
+        return;
+
+    ulong key = cellKeys[gid];
+    ulong rootOffset = key / rootStride * rootStride;
+    ulong code = key - rootOffset;
+    uint level = 0;
+    ulong size = 1UL << (3 * (levels - 1));
+    while (code >= size)
+    {
+        code -= size;
+        size >>= 3;
+        level++;
+    }
+
+    int prev = -1;
+    if (level + 1 < levels)
+        prev = sparseStart(cellKeys, start, n, code >> 3, level + 1, levels, rootOffset);
+    int jp = jumpPos[gid];
+    commands[jp] = prev;
+    commands[start[gid]] = jp;
+}
+
 /**
  * Fill a buffer with a constant value.
  */
@@ -364,7 +795,7 @@ __kernel void testPointBoxDist2(__global float *out, float3 pos, float3 lo, floa
     *out = pointBoxDist2(pos, lo, hi);
 }
 
-__kernel void testMakeCode(__global uint *out, int3 xyz)
+__kernel void testMakeCode(__global code_t *out, int3 xyz)
 {
     *out = makeCode(xyz);
 }
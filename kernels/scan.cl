@@ -0,0 +1,208 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Single-pass exclusive scan with decoupled look-back.
+ *
+ * Required defines:
+ * - SCAN_COMPONENTS: 1 to scan @c uint, 2 to scan @c uint2.
+ * - SCAN_ITEMS: number of elements handled by each work-item.
+ */
+
+#if SCAN_COMPONENTS == 1
+typedef uint scan_t;
+#elif SCAN_COMPONENTS == 2
+typedef uint2 scan_t;
+#else
+# error "SCAN_COMPONENTS must be 1 or 2"
+#endif
+
+/// Flag state: the aggregate of the tile alone is available
+#define STATUS_AGGREGATE 1
+/// Flag state: the inclusive prefix up to the end of the tile is available
+#define STATUS_PREFIX 2
+
+/**
+ * Store a value so that other work-groups can see it. Atomics are used
+ * because OpenCL 1.x makes no other guarantee of coherence between
+ * work-groups.
+ */
+inline void storeShared(volatile __global uint *ptr, scan_t value)
+{
+#if SCAN_COMPONENTS == 1
+    atomic_xchg(ptr, value);
+#else
+    atomic_xchg(ptr, value.x);
+    atomic_xchg(ptr + 1, value.y);
+#endif
+}
+
+/// Load a value stored by @ref storeShared.
+inline scan_t loadShared(volatile __global uint *ptr)
+{
+#if SCAN_COMPONENTS == 1
+    return atomic_or(ptr, 0U);
+#else
+    return (uint2) (atomic_or(ptr, 0U), atomic_or(ptr + 1, 0U));
+#endif
+}
+
+/**
+ * Make a value available to later work-groups. The value is written before
+ * the flag, so a reader that sees the flag will see the value.
+ */
+inline void publish(
+    volatile __global uint *flags, volatile __global uint *values,
+    uint group, uint epoch, uint state, scan_t value)
+{
+    storeShared(values + group * SCAN_COMPONENTS, value);
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    atomic_xchg(flags + group, (epoch << 2) | state);
+}
+
+/**
+ * Replace each element by @a offset plus the sum of the preceding elements.
+ *
+ * Each work-group handles a tile of <code>get_local_size(0) * SCAN_ITEMS</code>
+ * consecutive elements. Tiles are assigned in the order in which work-groups
+ * start (using a ticket in @a status) rather than by group ID, so that a
+ * work-group only ever waits for work-groups that are already running. After
+ * reducing its tile, a work-group publishes the aggregate, then walks back
+ * over its predecessors adding their aggregates until it finds one that has
+ * published an inclusive prefix.
+ *
+ * The @a status buffer holds a ticket counter followed by @a capacity flags,
+ * @a capacity aggregates and @a capacity prefixes. Flags hold
+ * <code>(epoch << 2) | state</code>, so that flags left behind by a previous
+ * call (with a different epoch) are ignored and the buffer never needs to be
+ * cleared. The last work-group to take a ticket resets the counter.
+ *
+ * @param data          Values to scan in place.
+ * @param elements      Number of elements in @a data.
+ * @param offset        Value added to every output.
+ * @param status        Look-back state, as described above.
+ * @param capacity      Number of tiles for which @a status has room.
+ * @param epoch         Non-zero identifier for this call, less than 2^30.
+ * @param ltile         Local storage for one tile.
+ * @param lsums         Local storage for one value per work-item.
+ */
+__kernel void scanSinglePass(
+    __global scan_t *data,
+    uint elements,
+    scan_t offset,
+    volatile __global uint *status,
+    uint capacity,
+    uint epoch,
+    __local scan_t *ltile,
+    __local scan_t *lsums)
+{
+    volatile __global uint *ticket = status;
+    volatile __global uint *flags = status + 1;
+    volatile __global uint *aggregates = flags + capacity;
+    volatile __global uint *prefixes = aggregates + capacity * SCAN_COMPONENTS;
+
+    __local uint lgroup;
+    __local scan_t lprefix;
+
+    const uint lid = get_local_id(0);
+    const uint lsize = get_local_size(0);
+
+    if (lid == 0)
+    {
+        uint g = atomic_inc(ticket);
+        if (g == get_num_groups(0) - 1)
+            atomic_xchg(ticket, 0U); // every work-group has its ticket
+        lgroup = g;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    const uint group = lgroup;
+    const uint base = group * lsize * SCAN_ITEMS;
+
+    // Load the tile with coalesced reads
+    for (uint i = 0; i < SCAN_ITEMS; i++)
+    {
+        uint idx = i * lsize + lid;
+        ltile[idx] = base + idx < elements ? data[base + idx] : (scan_t) (0);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Each work-item reduces consecutive elements, then the sums are scanned
+    scan_t sum = (scan_t) (0);
+    for (uint i = 0; i < SCAN_ITEMS; i++)
+        sum += ltile[lid * SCAN_ITEMS + i];
+    lsums[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (uint s = 1; s < lsize; s <<= 1)
+    {
+        scan_t add = lid >= s ? lsums[lid - s] : (scan_t) (0);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        lsums[lid] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0)
+    {
+        const scan_t aggregate = lsums[lsize - 1];
+        scan_t exclusive = offset;
+        if (group == 0)
+            publish(flags, prefixes, 0, epoch, STATUS_PREFIX, offset + aggregate);
+        else
+        {
+            publish(flags, aggregates, group, epoch, STATUS_AGGREGATE, aggregate);
+            exclusive = (scan_t) (0);
+            uint pred = group - 1;
+            for (;;)
+            {
+                uint flag = atomic_or(flags + pred, 0U);
+                if ((flag >> 2) != epoch)
+                    continue; // not yet published by this call
+                mem_fence(CLK_GLOBAL_MEM_FENCE);
+                if ((flag & 3U) == STATUS_PREFIX)
+                {
+                    exclusive += loadShared(prefixes + pred * SCAN_COMPONENTS);
+                    break;
+                }
+                exclusive += loadShared(aggregates + pred * SCAN_COMPONENTS);
+                pred--;
+            }
+            publish(flags, prefixes, group, epoch, STATUS_PREFIX, exclusive + aggregate);
+        }
+        lprefix = exclusive;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    scan_t running = lprefix + lsums[lid] - sum;
+    for (uint i = 0; i < SCAN_ITEMS; i++)
+    {
+        scan_t value = ltile[lid * SCAN_ITEMS + i];
+        ltile[lid * SCAN_ITEMS + i] = running;
+        running += value;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint i = 0; i < SCAN_ITEMS; i++)
+    {
+        uint idx = i * lsize + lid;
+        if (base + idx < elements)
+            data[base + idx] = ltile[idx];
+    }
+}
@@ -41,10 +41,18 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/smart_ptr/make_shared.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/exception/all.hpp>
 #include "src/tr1_unordered_map.h"
 #include <iostream>
 #include <map>
+#include <set>
+#include <string>
 #include <vector>
+#include <stdexcept>
 #include <algorithm>
 #include <numeric>
 #include <mpi.h>
@@ -62,6 +70,7 @@
 #include "src/mesher_mpi.h"
 #include "src/options.h"
 #include "src/splat_set_mpi.h"
+#include "src/file_stripe_mpi.h"
 #include "src/bucket.h"
 #include "src/provenance.h"
 #include "src/statistics.h"
@@ -73,11 +82,14 @@
 #include "src/progress_mpi.h"
 #include "src/mesh_filter.h"
 #include "src/timeplot.h"
+#include "src/bucket_trace.h"
+#include "src/metrics.h"
 #include "src/bucket_loader.h"
 #include "src/bucket_collector.h"
 #include "src/worker_group_mpi.h"
 #include "src/serialize.h"
 #include "src/mlsgpu_core.h"
+#include "src/thread_name.h"
 
 namespace po = boost::program_options;
 using namespace std;
@@ -97,7 +109,20 @@ void recvItem(MesherGroup::WorkItem &item, MPI_Comm comm, int dest)
 template<>
 std::size_t sizeItem(const MesherGroup::WorkItem &item)
 {
-    return item.work.mesh.getHostBytes();
+    return Serialize::irecvBytes(item.work);
+}
+
+template<>
+int irecvItem(MesherGroup::WorkItem &item, MPI_Comm comm, int source, std::size_t size, MPI_Request *requests)
+{
+    Serialize::irecv(item.work, item.alloc.get(), size, comm, source, requests);
+    return 1;
+}
+
+template<>
+void irecvItemComplete(MesherGroup::WorkItem &item)
+{
+    Serialize::irecvComplete(item.work, item.alloc.get());
 }
 
 typedef SplatSet::FastBlobSetMPI<SplatSet::FileSet> Splats;
@@ -107,7 +132,8 @@ namespace
 
 /**
  * Function object for doing the GPU work. There is one slave launched
- * on each node that has GPUs.
+ * on each node that has GPUs. If an @a owner is given, each mesh is sent to
+ * the rank that owns its chunk instead of to the gather root.
  */
 class Slave
 {
@@ -121,6 +147,26 @@ private:
     int gatherRoot;
     MPI_Comm progressComm;
     int progressRoot;
+    MPI_Win progressWin;
+    const ChunkOwner *owner;
+
+    typedef boost::shared_ptr<Statistics::Container::vector<BucketCollector::Bin> > bins_ptr;
+    /// A batch of bins, and whether a replacement request should be sent when it is loaded
+    typedef std::pair<bins_ptr, bool> batch_type;
+
+    /**
+     * Receives batches of bins from the scatter root and queues them for
+     * loading, until the root has answered every work request. A null pointer
+     * is queued at the end.
+     *
+     * If @ref Option::leaveFile is given and the file exists when a batch
+     * arrives, the slave leaves the scatter: it tells the root, and none of
+     * the batches from then on are replaced.
+     *
+     * @param credits     Number of work requests sent initially.
+     * @param queue       Queue to receive the bins.
+     */
+    void receiveBins(int credits, WorkQueue<batch_type> &queue) const;
 
 public:
     Slave(const std::vector<std::pair<cl::Context, cl::Device> > &devices,
@@ -128,39 +174,124 @@ public:
           Splats &splats,
           MPI_Comm scatterComm, int scatterRoot,
           MPI_Comm gatherComm, int gatherRoot,
-          MPI_Comm progressComm, int progressRoot)
+          MPI_Comm progressComm, int progressRoot, MPI_Win progressWin,
+          const ChunkOwner *owner = NULL)
         : devices(devices), vm(vm), splats(splats),
         scatterComm(scatterComm), scatterRoot(scatterRoot),
         gatherComm(gatherComm), gatherRoot(gatherRoot),
-        progressComm(progressComm), progressRoot(progressRoot)
+        progressComm(progressComm), progressRoot(progressRoot), progressWin(progressWin),
+        owner(owner)
     {
     }
 
     void operator()() const;
 };
 
+/**
+ * Value sent by a slave in place of a work request to leave the scatter
+ * (see @ref Scatter).
+ */
+static const int SCATTER_LEAVE = -1;
+
 /**
  * Receives collections of bins from @ref BucketCollector and passes them over MPI.
+ *
+ * Each slave starts by sending a request for some number of batches (its
+ * credits), and then requests more batches as it starts loading them. Every
+ * request is eventually answered with a work size, which is zero once the
+ * scatter is stopped. Thus a slave normally has batches queued or in flight
+ * while it loads the current one, rather than waiting for a round trip.
+ * Slaves need not all use the same number of credits (see @ref NodeRelay).
+ *
+ * A slave may leave by sending @ref SCATTER_LEAVE in place of a request.
+ * Its outstanding requests, and any replacement requests that follow, are
+ * answered at once with zero, so that it finishes the batches it already
+ * holds and then takes no more work.
+ *
+ * Batches arrive in bucketing order, so consecutive batches are spatially
+ * adjacent and read overlapping input. With locality enabled, consecutive
+ * batches keep going to the same slave for as long as it has requests
+ * outstanding, so that its page cache and readahead can be reused. The run
+ * is broken as soon as any other slave has nothing queued, so idle slaves
+ * still take over the remaining work.
+ *
+ * When snapshots are enabled, @ref stop only drains the slaves: each one
+ * finishes its batches, flushes its meshes and then waits for @ref restart
+ * to say whether another round of requests follows.
  */
 class Scatter
 {
 private:
     MPI_Comm comm;
     Timeplot::Worker &tworker;
+    /// Number of slaves in @ref comm
+    std::size_t numSlaves;
+    /// Number of requests each slave sent before its first batch
+    std::map<int, int> initialCredits;
+    /// Requests received from each slave that have not yet been answered
+    std::map<int, int> credits;
+    /// Slaves that have left the scatter
+    std::set<int> departed;
+    /// Slaves drained by the last @ref stop, and whether each had left
+    std::map<int, bool> stopped;
+    /// Whether to keep consecutive batches on the same slave
+    bool locality;
+    /// Slave that received the previous batch, or -1
+    int lastDest;
 
     Statistics::Variable &waitStat;
     Statistics::Variable &sendStat;
+    Statistics::Variable &localityStat;
+
+    /// Answer a request from @a dest with no work
+    void sendZero(int dest);
+
+    /**
+     * Receive a work request and add it to @ref credits. A request from a
+     * slave that has left is answered immediately.
+     *
+     * @param block  If false, return immediately if no request is waiting.
+     * @return Whether a request was received.
+     */
+    bool receiveRequest(bool block);
+
+    /**
+     * Find the slave with the most unanswered requests, after receiving
+     * any requests that have arrived. If there are none, wait for one. In
+     * locality mode, @ref lastDest is preferred as described for the class.
+     *
+     * @throw std::runtime_error if every slave has left.
+     */
+    int waitForCredit();
+
 public:
     typedef void result_type;
 
-    /// Constructor
-    Scatter(MPI_Comm comm, Timeplot::Worker &tworker);
+    /**
+     * Constructor.
+     *
+     * @param comm           Communicator shared with the slaves.
+     * @param tworker        Timeplot worker for the calling thread.
+     * @param numSlaves      Number of slaves in @a comm.
+     * @param locality       Whether to keep consecutive batches on the same slave.
+     */
+    Scatter(MPI_Comm comm, Timeplot::Worker &tworker, std::size_t numSlaves, bool locality = false);
 
     /// Send the bins to a slave
-    void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins) const;
+    void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins);
 
     /// Shuts down the slaves
-    void stop(std::size_t numSlaves) const;
+    void stop();
+
+    /**
+     * Tell the slaves drained by @ref stop whether to start another round
+     * (@a more) or to finish. Slaves that left are always told to finish,
+     * and are not expected in later rounds. This is only valid if the slaves
+     * were started with snapshots enabled.
+     *
+     * @return The number of slaves that will take part in the next round.
+     */
+    std::size_t restart(bool more);
 };
 
 class GatherGroup : public WorkerGroupGather<MesherGroup::WorkItem, GatherGroup>
@@ -168,9 +299,20 @@ class GatherGroup : public WorkerGroupGather<MesherGroup::WorkItem, GatherGroup>
 public:
     typedef MesherGroup::WorkItem WorkItem;
 
-    GatherGroup(MPI_Comm comm, int root, std::size_t bufferSize)
+    /**
+     * Constructor. If @a memory is given, it is used to hold the meshes
+     * (see @ref LockFreeCircularBuffer::LockFreeCircularBuffer).
+     */
+    GatherGroup(MPI_Comm comm, int root, std::size_t bufferSize, char *memory = NULL)
         : WorkerGroupGather<WorkItem, GatherGroup>("gather", comm, root),
-        meshBuffer("mem.GatherGroup.mesh", bufferSize)
+        meshBuffer("mem.GatherGroup.mesh", bufferSize, 256, true, memory)
+    {
+    }
+
+    /// Constructor that sends each item to the rank that owns its chunk
+    GatherGroup(MPI_Comm comm, const ChunkOwner &owner, std::size_t bufferSize, char *memory = NULL)
+        : WorkerGroupGather<WorkItem, GatherGroup>("gather", comm, boost::bind(&GatherGroup::route, boost::cref(owner), _1)),
+        meshBuffer("mem.GatherGroup.mesh", bufferSize, 256, true, memory)
     {
     }
 
@@ -188,61 +330,472 @@ public:
     }
 
 private:
-    CircularBuffer meshBuffer;
+    /// Filled by the device workers (hence multiple producers)
+    LockFreeCircularBuffer meshBuffer;
+
+    static int route(const ChunkOwner &owner, const WorkItem &item)
+    {
+        return owner(item.work.chunkId);
+    }
+};
+
+/**
+ * Aggregates the scatter and gather traffic of the slaves on one node, in
+ * hierarchical mode. Towards the root, the relay looks like a single slave
+ * holding the credits of all the local slaves. Batches received from the
+ * root are passed on with a @ref Scatter over the node communicator, and
+ * meshes from the local slaves are received over the node communicator and
+ * forwarded to the root by a single @ref GatherGroup.
+ *
+ * Replacement requests from the local slaves are combined, and sent to the
+ * root once there is one per local slave. The relay therefore still has at
+ * least one request outstanding at the root.
+ */
+class NodeRelay
+{
+private:
+    const po::variables_map &vm;
+    MPI_Comm scatterComm;
+    MPI_Comm gatherComm;
+    int root;
+    MPI_Comm nodeScatterComm;
+    MPI_Comm nodeGatherComm;
+    int localSlaves;
+
+public:
+    /**
+     * Constructor.
+     *
+     * @param vm              Command-line options.
+     * @param scatterComm     Communicator for the scatter with the root.
+     * @param gatherComm      Communicator for the gather with the root.
+     * @param root            Root within @a scatterComm and @a gatherComm.
+     * @param nodeScatterComm Communicator for the scatter with the local slaves, with the relay as rank 0.
+     * @param nodeGatherComm  Communicator for the gather with the local slaves, with the relay as rank 0.
+     * @param localSlaves     Number of slaves in the node communicators.
+     */
+    NodeRelay(const po::variables_map &vm,
+              MPI_Comm scatterComm, MPI_Comm gatherComm, int root,
+              MPI_Comm nodeScatterComm, MPI_Comm nodeGatherComm, int localSlaves)
+        : vm(vm), scatterComm(scatterComm), gatherComm(gatherComm), root(root),
+        nodeScatterComm(nodeScatterComm), nodeGatherComm(nodeGatherComm), localSlaves(localSlaves)
+    {
+    }
+
+    void operator()() const;
+};
+
+/**
+ * Callback for @ref BucketCollector on the root that passes batches to a
+ * @ref Scatter and periodically snapshots the mesher (see
+ * @ref MesherBase::snapshot). It also owns the thread that receives the
+ * meshes. As in the single-process version, a snapshot is only consistent
+ * once every batch sent so far has been meshed. The scatter is therefore
+ * drained, which makes every slave finish its batches and flush its
+ * meshes. The mesher is snapshotted, and the slaves are then restarted.
+ */
+class ScatterSnapshotter : public boost::noncopyable
+{
+public:
+    typedef void result_type;
+    typedef ReceiverGatherNonBlocking<MesherGroup::WorkItem, MesherGroup> Receiver;
+
+    /**
+     * Constructor.
+     *
+     * @param tworker       Timeplot worker for the thread running the collector.
+     * @param mesher        Mesher to snapshot.
+     * @param mesherGroup   Group fed by the receiver.
+     * @param scatter       Scatter to the slaves.
+     * @param gatherComm    Communicator on which meshes are gathered.
+     * @param senders       Number of ranks sending meshes.
+     * @param path          Snapshot file, or empty to disable snapshots. It
+     *                      must be given if and only if the slaves were
+     *                      started with snapshots enabled.
+     * @param interval      Minimum seconds between snapshots.
+     */
+    ScatterSnapshotter(Timeplot::Worker &tworker, MesherBase &mesher, MesherGroup &mesherGroup,
+                       Scatter &scatter, MPI_Comm gatherComm, std::size_t senders,
+                       const boost::filesystem::path &path, double interval)
+        : tworker(tworker), mesher(mesher), mesherGroup(mesherGroup), scatter(scatter),
+        gatherComm(gatherComm), senders(senders), path(path), interval(interval),
+        doneBins(0), lastSnapshot(Timer::currentTime())
+    {
+    }
+
+    /// Start receiving meshes into the mesher group
+    void startReceiver()
+    {
+        receiver.reset(new Receiver("receiver", mesherGroup, gatherComm, senders));
+        receiverThread.reset(new boost::thread(boost::ref(*receiver)));
+    }
+
+    /**
+     * Set the number of bins already processed by an earlier run, at the
+     * start of a pass.
+     */
+    void setPass(std::tr1::uint64_t doneBins)
+    {
+        this->doneBins = doneBins;
+        lastSnapshot = Timer::currentTime();
+    }
+
+    void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins)
+    {
+        scatter(bins);
+        doneBins += bins.size();
+        if (!path.empty()
+            && Timer::getElapsed(lastSnapshot, Timer::currentTime()) >= interval)
+            snapshot();
+    }
+
+    /**
+     * Shut down the slaves and wait for the last of their meshes to be
+     * received. The mesher group must be stopped afterwards.
+     */
+    void stop()
+    {
+        scatter.stop();
+        if (!path.empty())
+            senders = scatter.restart(false);
+        receiverThread->join();
+        receiverThread.reset();
+        receiver.reset();
+    }
+
+private:
+    Timeplot::Worker &tworker;
+    MesherBase &mesher;
+    MesherGroup &mesherGroup;
+    Scatter &scatter;
+    const MPI_Comm gatherComm;
+    std::size_t senders;
+    const boost::filesystem::path path;
+    const double interval;
+
+    boost::scoped_ptr<Receiver> receiver;
+    boost::scoped_ptr<boost::thread> receiverThread;
+    std::tr1::uint64_t doneBins;      ///< Bins passed to the scatter, including skipped ones
+    Timer::timestamp lastSnapshot;
+
+    void snapshot()
+    {
+        Timeplot::Action timer("snapshot", tworker, "snapshot.time");
+
+        scatter.stop();
+        receiverThread->join();
+        mesherGroup.stop();
+
+        try
+        {
+            mesher.snapshot(tworker, path, doneBins);
+        }
+        catch (...)
+        {
+            // Restart so that the caller can shut down normally
+            mesherGroup.start();
+            senders = scatter.restart(true);
+            startReceiver();
+            throw;
+        }
+        mesherGroup.start();
+        senders = scatter.restart(true);
+        startReceiver();
+        lastSnapshot = Timer::currentTime();
+    }
 };
 
-Scatter::Scatter(MPI_Comm comm, Timeplot::Worker &tworker) :
+Scatter::Scatter(MPI_Comm comm, Timeplot::Worker &tworker, std::size_t numSlaves, bool locality) :
     comm(comm),
     tworker(tworker),
+    numSlaves(numSlaves),
+    locality(locality),
+    lastDest(-1),
     waitStat(Statistics::getStatistic<Statistics::Variable>("scatter.get")),
-    sendStat(Statistics::getStatistic<Statistics::Variable>("scatter.push"))
+    sendStat(Statistics::getStatistic<Statistics::Variable>("scatter.push")),
+    localityStat(Statistics::getStatistic<Statistics::Variable>("scatter.locality"))
+{
+}
+
+bool Scatter::receiveRequest(bool block)
+{
+    MPI_Status status;
+    int source = MPI_ANY_SOURCE;
+    if (!block)
+    {
+        int flag;
+        MPI_Iprobe(MPI_ANY_SOURCE, MLSGPU_TAG_SCATTER_NEED_WORK, comm, &flag, &status);
+        if (!flag)
+            return false;
+        source = status.MPI_SOURCE;
+    }
+
+    int needsWork;
+    MPI_Recv(&needsWork, 1, MPI_INT, source, MLSGPU_TAG_SCATTER_NEED_WORK, comm, &status);
+    source = status.MPI_SOURCE;
+    if (needsWork == SCATTER_LEAVE)
+    {
+        departed.insert(source);
+        Log::log[Log::info] << "Slave " << source << " has left" << std::endl;
+        needsWork = credits[source];
+        credits[source] = 0;
+        for (int i = 0; i < needsWork; i++)
+            sendZero(source);
+    }
+    else if (departed.count(source))
+    {
+        for (int i = 0; i < needsWork; i++)
+            sendZero(source);
+    }
+    else
+    {
+        // The first request from each slave carries its initial credits
+        if (!initialCredits.count(source))
+            initialCredits[source] = needsWork;
+        credits[source] += needsWork;
+    }
+    return true;
+}
+
+void Scatter::sendZero(int dest)
+{
+    std::size_t workSize = 0;
+    MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(),
+             dest, MLSGPU_TAG_SCATTER_HAS_WORK, comm);
+}
+
+int Scatter::waitForCredit()
 {
+    while (receiveRequest(false))
+    {
+    }
+
+    while (true)
+    {
+        int best = -1;
+        int bestCredits = 0;
+        bool otherIdle = false;
+        for (std::map<int, int>::const_iterator i = credits.begin(); i != credits.end(); ++i)
+        {
+            if (i->second > bestCredits)
+            {
+                best = i->first;
+                bestCredits = i->second;
+            }
+            if (i->first != lastDest && i->second >= initialCredits[i->first])
+                otherIdle = true;
+        }
+        if (best >= 0)
+        {
+            if (locality && lastDest >= 0 && !otherIdle && credits[lastDest] > 0)
+                best = lastDest;
+            return best;
+        }
+        if (initialCredits.size() >= numSlaves && departed.size() == initialCredits.size())
+            throw std::runtime_error("All slaves have left, but there is still work to do");
+        receiveRequest(true);
+    }
 }
 
-void Scatter::operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins) const
+void Scatter::operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins)
 {
     if (bins.empty())
         return;
 
-    int needsWork;
-    MPI_Status status;
+    int dest;
     {
         Timeplot::Action timer("wait", tworker, waitStat);
-        MPI_Recv(&needsWork, 1, MPI_INT, MPI_ANY_SOURCE, MLSGPU_TAG_SCATTER_NEED_WORK, comm, &status);
+        dest = waitForCredit();
     }
 
+    if (locality)
+        localityStat.add(dest == lastDest ? 1.0 : 0.0);
+    lastDest = dest;
+
     {
         Timeplot::Action timer("send", tworker, sendStat);
-        int dest = status.MPI_SOURCE;
+        credits[dest]--;
         std::size_t workSize = bins.size();
         MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(),
                  dest, MLSGPU_TAG_SCATTER_HAS_WORK, comm);
-        for (std::size_t i = 0; i < bins.size(); i++)
-        {
-            Serialize::send(bins[i], comm, dest);
-        }
+        Serialize::send(&bins[0], bins.size(), comm, dest);
     }
 }
 
-void Scatter::stop(std::size_t numSlaves) const
+void Scatter::stop()
 {
-    for (std::size_t i = 0; i < numSlaves; i++)
+    /* Each slave sends one more request for every batch it received, so
+     * apart from those it expects exactly its initial credits as answers of
+     * zero. A slave that has not been heard from yet is waited for, while
+     * one that has left has already been answered.
+     */
+    std::size_t zeros = 0;
+    while (true)
     {
-        int needsWork;
-        MPI_Status status;
+        while (receiveRequest(false))
+        {
+        }
+        std::size_t total = 0;
+        for (std::map<int, int>::const_iterator i = initialCredits.begin(); i != initialCredits.end(); ++i)
+            if (!departed.count(i->first))
+                total += i->second;
+        if (initialCredits.size() >= numSlaves && zeros >= total)
+            break;
+
+        int dest;
         {
             Timeplot::Action timer("wait", tworker, waitStat);
-            MPI_Recv(&needsWork, 1, MPI_INT, MPI_ANY_SOURCE, MLSGPU_TAG_SCATTER_NEED_WORK, comm, &status);
+            dest = waitForCredit();
         }
 
         {
             Timeplot::Action timer("send", tworker, sendStat);
-            int dest = status.MPI_SOURCE;
-            std::size_t workSize = 0; // signals shutdown
-            MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(),
-                     dest, MLSGPU_TAG_SCATTER_HAS_WORK, comm);
+            credits[dest]--;
+            sendZero(dest); // signals shutdown
+        }
+        zeros++;
+    }
+    stopped.clear();
+    for (std::map<int, int>::const_iterator i = initialCredits.begin(); i != initialCredits.end(); ++i)
+        stopped[i->first] = departed.count(i->first) > 0;
+    credits.clear();
+    initialCredits.clear();
+    departed.clear();
+    lastDest = -1;
+}
+
+std::size_t Scatter::restart(bool more)
+{
+    for (std::map<int, bool>::const_iterator i = stopped.begin(); i != stopped.end(); ++i)
+    {
+        int go = (more && !i->second) ? 1 : 0;
+        MPI_Send(&go, 1, MPI_INT, i->first, MLSGPU_TAG_SCATTER_RESTART, comm);
+        if (!go)
+            numSlaves--;
+    }
+    stopped.clear();
+    return more ? numSlaves : 0;
+}
+
+void NodeRelay::operator()() const
+{
+    thread_set_name("relay");
+    Timeplot::Worker tworker("relay");
+    Statistics::Variable &recvStat = Statistics::getStatistic<Statistics::Variable>("relay.recv");
+    Statistics::Variable &combinedStat = Statistics::getStatistic<Statistics::Variable>("relay.requests");
+
+    const bool snapshots = vm.count(Option::snapshot);
+    GatherGroup gatherGroup(gatherComm, root, vm[Option::memGather].as<Capacity>());
+    Scatter scatter(nodeScatterComm, tworker, localSlaves, vm.count(Option::scatterLocality));
+
+    /* With snapshots there is one round per snapshot, each ending when the
+     * root drains the scatter. Local slaves that left in one round do not
+     * take part in the next.
+     */
+    std::size_t activeSlaves = localSlaves;
+    while (true)
+    {
+        ReceiverGatherNonBlocking<GatherGroup::WorkItem, GatherGroup> receiver(
+            "relay.gather", gatherGroup, nodeGatherComm, activeSlaves);
+        gatherGroup.start();
+        boost::thread receiverThread(boost::ref(receiver));
+
+        const int credits = activeSlaves * vm[Option::scatterCredits].as<int>();
+        MPI_Send(const_cast<int *>(&credits), 1, MPI_INT, root, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+
+        /* As for Slave::receiveBins, every request is answered. The root only
+         * sends zeros once it has no more work, and it expects one request per
+         * batch before it can finish, so any combined requests still held back
+         * are sent on the first zero.
+         */
+        std::size_t batches = 0;
+        int unsent = 0;
+        for (std::size_t answers = 0; answers < std::size_t(credits) + batches; answers++)
+        {
+            std::size_t workSize;
+            MPI_Recv(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), root, MLSGPU_TAG_SCATTER_HAS_WORK,
+                     scatterComm, MPI_STATUS_IGNORE);
+            if (workSize == 0)
+            {
+                if (unsent > 0)
+                {
+                    MPI_Send(&unsent, 1, MPI_INT, root, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+                    unsent = 0;
+                }
+                continue;
+            }
+
+            Statistics::Container::vector<BucketCollector::Bin> bins("mem.BucketCollector.bins", workSize);
+            {
+                Timeplot::Action timer("recv", tworker, recvStat);
+                Serialize::recv(&bins[0], bins.size(), scatterComm, root);
+            }
+            // Waits until a local slave has requested it
+            scatter(bins);
+            batches++;
+
+            if (++unsent >= int(activeSlaves))
+            {
+                combinedStat.add(unsent);
+                MPI_Send(&unsent, 1, MPI_INT, root, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+                unsent = 0;
+            }
+        }
+        scatter.stop();
+
+        receiverThread.join();
+        gatherGroup.stop();
+
+        if (!snapshots)
+            break;
+        int more;
+        MPI_Recv(&more, 1, MPI_INT, root, MLSGPU_TAG_SCATTER_RESTART, scatterComm, MPI_STATUS_IGNORE);
+        activeSlaves = scatter.restart(more != 0);
+        if (!more)
+            break;
+    }
+}
+
+void Slave::receiveBins(int credits, WorkQueue<batch_type> &queue) const
+{
+    thread_set_name("scatter.recv");
+    Timeplot::Worker tworker("scatter.recv");
+    Statistics::Variable &recvStat = Statistics::getStatistic<Statistics::Variable>("slave.recv");
+    const std::string leaveFile = vm[Option::leaveFile].as<std::string>();
+    bool left = false;
+
+    /* Every request is answered, and one request is sent per batch received
+     * before leaving.
+     */
+    std::size_t batches = 0;
+    for (std::size_t answers = 0; answers < std::size_t(credits) + batches; answers++)
+    {
+        std::size_t workSize;
+        MPI_Recv(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), scatterRoot, MLSGPU_TAG_SCATTER_HAS_WORK,
+                 scatterComm, MPI_STATUS_IGNORE);
+        if (workSize == 0)
+            continue;
+
+        bins_ptr bins = boost::make_shared<Statistics::Container::vector<BucketCollector::Bin> >(
+            "mem.BucketCollector.bins", workSize);
+        {
+            Timeplot::Action timer("recv", tworker, recvStat);
+            Serialize::recv(&(*bins)[0], bins->size(), scatterComm, scatterRoot);
+        }
+        if (!left && !leaveFile.empty() && boost::filesystem::exists(leaveFile))
+        {
+            int rank;
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+            Log::log[Log::info] << "Rank " << rank << " found " << leaveFile << ", taking no more work" << std::endl;
+            int leave = SCATTER_LEAVE;
+            MPI_Send(&leave, 1, MPI_INT, scatterRoot, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+            left = true;
         }
+        queue.push(batch_type(bins, !left));
+        if (!left)
+            batches++;
     }
+    queue.push(batch_type());
 }
 
 void Slave::operator()() const
@@ -250,48 +803,81 @@ void Slave::operator()() const
     Timeplot::Worker tworker("slave");
     Statistics::Variable &firstPopStat = Statistics::getStatistic<Statistics::Variable>("slave.pop.first");
     Statistics::Variable &popStat = Statistics::getStatistic<Statistics::Variable>("slave.pop");
-    Statistics::Variable &recvStat = Statistics::getStatistic<Statistics::Variable>("slave.recv");
 
     const std::size_t memGather = vm[Option::memGather].as<Capacity>();
 
-    GatherGroup gatherGroup(gatherComm, gatherRoot, memGather);
+    /* With pinned memory, meshes are read back from the device by DMA
+     * straight into the buffer they are sent from, and the buffer stays
+     * registered with the interconnect for the whole run, instead of being
+     * staged through driver and MPI bounce buffers.
+     */
+    boost::scoped_ptr<CLH::PinnedMemory<char> > gatherMemory;
+    if (vm.count(Option::pinnedGather))
+        gatherMemory.reset(new CLH::PinnedMemory<char>(
+                "mem.GatherGroup.pinned", devices[0].first, devices[0].second, memGather));
+    char *gatherPtr = gatherMemory ? gatherMemory->get() : NULL;
+
+    boost::scoped_ptr<GatherGroup> gatherGroupPtr(owner != NULL
+        ? new GatherGroup(gatherComm, *owner, memGather, gatherPtr)
+        : new GatherGroup(gatherComm, gatherRoot, memGather, gatherPtr));
+    GatherGroup &gatherGroup = *gatherGroupPtr;
     SlaveWorkers slaveWorkers(tworker, vm, devices, makeOutputGenerator(gatherGroup));
 
     /* NB: this does not yet support multi-pass algorithms. Currently there
      * are none, however.
      */
 
-    ProgressMPI progress(NULL, splats.numSplats(), progressComm, progressRoot);
-    slaveWorkers.start(splats, splats.getBoundingGrid(), &progress);
-    gatherGroup.start();
-
+    ProgressMPI progress(NULL, splats.numSplats(), progressComm, progressRoot, progressWin);
+    const bool snapshots = vm.count(Option::snapshot);
     bool first = true;
+
+    /* With snapshots, the root drains the scatter before each snapshot (see
+     * Scatter::restart). The workers are stopped so that every mesh has been
+     * gathered, and are restarted if the root has more work.
+     */
     while (true)
     {
-        int needWork = 1;
-        std::size_t workSize;
-        {
-            Timeplot::Action timer("pop", tworker, first ? firstPopStat : popStat);
-            MPI_Sendrecv(&needWork, 1, MPI_INT, scatterRoot, MLSGPU_TAG_SCATTER_NEED_WORK,
-                         &workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), scatterRoot, MLSGPU_TAG_SCATTER_HAS_WORK,
-                         scatterComm, MPI_STATUS_IGNORE);
-            if (workSize == 0)
-                break;
-        }
+        slaveWorkers.start(splats, splats.getBoundingGrid(), &progress);
+        gatherGroup.start();
 
-        Statistics::Container::vector<BucketCollector::Bin> bins("mem.BucketCollector.bins", workSize);
+        int credits = vm[Option::scatterCredits].as<int>();
+        WorkQueue<batch_type> binQueue;
+        MPI_Send(&credits, 1, MPI_INT, scatterRoot, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+        boost::thread receiverThread(boost::bind(&Slave::receiveBins, this, credits, boost::ref(binQueue)));
+
+        while (true)
         {
-            Timeplot::Action timer("recv", tworker, recvStat);
-            for (std::size_t i = 0; i < bins.size(); i++)
-                Serialize::recv(bins[i], scatterComm, scatterRoot);
+            batch_type batch;
+            {
+                Timeplot::Action timer("pop", tworker, first ? firstPopStat : popStat);
+                batch = binQueue.pop();
+                first = false;
+                if (!batch.first)
+                    break;
+            }
+
+            if (batch.second)
+            {
+                // Replace the request that this batch answered
+                int needWork = 1;
+                MPI_Send(&needWork, 1, MPI_INT, scatterRoot, MLSGPU_TAG_SCATTER_NEED_WORK, scatterComm);
+            }
+            (*slaveWorkers.loader)(*batch.first);
         }
-        (*slaveWorkers.loader)(bins);
+        receiverThread.join();
+
+        slaveWorkers.stop();
+        gatherGroup.stop();
+        progress.sync();
+
+        if (!snapshots)
+            break;
+        int more;
+        MPI_Recv(&more, 1, MPI_INT, scatterRoot, MLSGPU_TAG_SCATTER_RESTART, scatterComm, MPI_STATUS_IGNORE);
+        if (!more)
+            break;
     }
 
-    slaveWorkers.stop();
-    gatherGroup.stop();
-    progress.sync();
-
     Statistics::finalizeEventTimes();
 }
 
@@ -339,36 +925,44 @@ static void doStatistics(const po::variables_map &vm, MPI_Comm comm, int root)
 }
 
 /**
- * Execution in @c --resume mode
+ * Determine which ranks share a node, by comparing processor names. This is a
+ * collective operation on @a comm.
  *
- * @param comm            Communicator indicating the group to run on
- * @param out             Output filename or basename
- * @param vm              Command-line options
- * @return Number of output files written
+ * @return The lowest rank on the same node as each rank.
  */
-static std::size_t runResume(
-    MPI_Comm comm, const std::string &out, const po::variables_map &vm)
+static std::vector<int> nodeLeaders(MPI_Comm comm)
 {
-    const int root = 0;
-    int rank;
-    MPI_Comm_rank(comm, &rank);
-    std::size_t ret = 0;
-
-    {
-        Timeplot::Worker mainWorker("main");
-        Statistics::Timer grandTotalTimer("run.time");
+    int size;
+    MPI_Comm_size(comm, &size);
 
-        boost::scoped_ptr<FastPly::WriterMPI> writer(new FastPly::WriterMPI);
-        setWriterComments(vm, *writer);
-        boost::scoped_ptr<MesherBase> mesher(new OOCMesherMPI(*writer, getNamer(vm, out), comm, root));
-        setMesherOptions(vm, *mesher);
+    char name[MPI_MAX_PROCESSOR_NAME] = {};
+    int length;
+    MPI_Get_processor_name(name, &length);
+    std::vector<char> names(std::size_t(size) * MPI_MAX_PROCESSOR_NAME);
+    MPI_Allgather(name, MPI_MAX_PROCESSOR_NAME, MPI_CHAR,
+                  &names[0], MPI_MAX_PROCESSOR_NAME, MPI_CHAR, comm);
 
-        boost::filesystem::path path(vm[Option::resume].as<std::string>());
-        ret = mesher->resume(mainWorker, path, &Log::log[Log::info]);
+    std::map<std::string, int> first;
+    std::vector<int> leaders(size);
+    for (int i = 0; i < size; i++)
+    {
+        std::string key(&names[std::size_t(i) * MPI_MAX_PROCESSOR_NAME]);
+        leaders[i] = first.insert(std::make_pair(key, i)).first->second;
     }
+    return leaders;
+}
 
-    doStatistics(vm, comm, root);
-    return ret;
+/**
+ * Pass the MPI-IO options to the writer for the output files.
+ */
+static void setWriterHints(const po::variables_map &vm, FastPly::WriterMPI &writer)
+{
+    BinaryWriterMPI::Hints hints;
+    hints.aggregators = vm[Option::mpiioAggregators].as<int>();
+    hints.bufferSize = vm[Option::mpiioBuffer].as<Capacity>();
+    hints.stripeCount = vm[Option::stripeCount].as<int>();
+    hints.stripeSize = vm[Option::stripeSize].as<Capacity>();
+    writer.setHints(hints);
 }
 
 /**
@@ -397,53 +991,167 @@ static std::size_t run(
     MPI_Comm_dup(comm, &scatterComm);
     MPI_Comm_dup(comm, &gatherComm);
     MPI_Comm_dup(comm, &progressComm);
+    boost::scoped_ptr<ProgressMPI::Window> progressWindow;
+    if (vm.count(Option::progressRMA))
+        progressWindow.reset(new ProgressMPI::Window(progressComm, root));
+    const MPI_Win progressWin = progressWindow ? progressWindow->get() : MPI_WIN_NULL;
 
     Timeplot::Worker mainWorker("main");
     boost::scoped_ptr<Statistics::Timer> grandTotalTimer;
     if (rank == root)
         grandTotalTimer.reset(new Statistics::Timer("run.time"));
 
-    /* Work out how many slaves there will be */
+    const bool distributed = vm.count(Option::distributedMesher);
+    boost::scoped_ptr<FastPly::WriterMPI> writer(new FastPly::WriterMPI);
+    setWriterComments(vm, *writer);
+    setWriterHints(vm, *writer);
+    boost::scoped_ptr<MesherBase> mesher(new OOCMesherMPI(*writer, getNamer(vm, out), comm, root, distributed));
+    setMesherOptions(vm, *mesher);
+
+    /* A checkpoint only has to be written out, and every rank loads it as
+     * before. A snapshot continues with the bins after those it covers. Only
+     * the root meshes, so only the root loads it.
+     */
+    std::tr1::uint64_t skipBins = 0;
+    if (vm.count(Option::resume))
+    {
+        const boost::filesystem::path path(vm[Option::resume].as<std::string>());
+        int resumeInput = 0;
+        if (rank == root)
+            resumeInput = mesher->restore(mainWorker, path, skipBins);
+        MPI_Bcast(&resumeInput, 1, MPI_INT, root, comm);
+        if (!resumeInput)
+        {
+            if (rank != root)
+                mesher->restore(mainWorker, path, skipBins);
+            std::size_t ret = mesher->write(mainWorker, &Log::log[Log::info]);
+            grandTotalTimer.reset();
+            doStatistics(vm, comm, root);
+            return ret;
+        }
+        if (distributed)
+            throw boost::enable_error_info(std::runtime_error(
+                    std::string("Snapshots cannot be resumed with --") + Option::distributedMesher))
+                << boost::errinfo_file_name(path.string());
+        if (rank == root)
+            Log::log[Log::info] << "Continuing from snapshot after " << skipBins << " buckets\n";
+    }
+
+    /* Work out how many slaves there will be. In distributed mode every
+     * rank receives meshes, so every rank needs to know.
+     */
     int isSlave = devices.empty() ? 0 : 1;
     vector<int> slaveMask(size);
-    MPI_Gather(&isSlave, 1, MPI_INT, &slaveMask[0], 1, MPI_INT, root, comm);
+    MPI_Allgather(&isSlave, 1, MPI_INT, &slaveMask[0], 1, MPI_INT, comm);
+    const int numSlaves = accumulate(slaveMask.begin(), slaveMask.end(), 0);
+
+    /* In hierarchical mode, slaves that are not on the root's node talk to
+     * the lowest rank on their node, which relays for them. The root then
+     * sees one sender per relay rather than per slave.
+     */
+    const bool hierarchical = vm.count(Option::hierarchical);
+    int numSenders = numSlaves;
+    int localSlaves = 0;
+    bool relayed = false;
+    MPI_Comm nodeScatterComm = MPI_COMM_NULL;
+    MPI_Comm nodeGatherComm = MPI_COMM_NULL;
+    if (hierarchical)
+    {
+        const vector<int> leaders = nodeLeaders(comm);
+        std::set<int> relays;
+        numSenders = 0;
+        for (int i = 0; i < size; i++)
+            if (slaveMask[i])
+            {
+                if (leaders[i] == leaders[root])
+                    numSenders++;
+                else
+                    relays.insert(leaders[i]);
+                if (leaders[i] == leaders[rank])
+                    localSlaves++;
+            }
+        numSenders += relays.size();
+        relayed = leaders[rank] != leaders[root];
+
+        MPI_Comm nodeComm;
+        MPI_Comm_split(comm, leaders[rank], rank, &nodeComm);
+        MPI_Comm_dup(nodeComm, &nodeScatterComm);
+        MPI_Comm_dup(nodeComm, &nodeGatherComm);
+        MPI_Comm_free(&nodeComm);
+    }
 
+    const bool striped = vm.count(Option::stripeInputs);
     Splats splats;
     doComputeBlobs(mainWorker, vm, splats,
                    boost::bind(&SplatSet::FastBlobSetMPI<SplatSet::FileSet>::computeBlobs,
-                               &splats, comm, root, _1, _2, &Log::log[Log::info], true));
+                               &splats, comm, root, _1, _2, &Log::log[Log::info], true, striped));
+    // Only the root reads the blobs, when bucketing
+    if (rank == root)
+        splats.cacheBlobs(vm[Option::memBlobs].as<Capacity>());
+
+    /* When striping, each rank serves its own files to the others for the
+     * remaining passes.
+     */
+    boost::scoped_ptr<SplatSet::FileStripeMPI> stripe;
+    boost::scoped_ptr<boost::thread> stripeThread;
+    if (striped)
+    {
+        stripe.reset(new SplatSet::FileStripeMPI(splats, comm));
+        splats.setRemoteReader(stripe.get());
+        stripeThread.reset(new boost::thread(boost::ref(*stripe)));
+    }
+
+    const Grid grid = cropGrid(vm, splats.getBoundingGrid(), splats.getBucketSize());
+    unsigned int chunkCells = 0;
+    if (rank == root)
+        chunkCells = postprocessGrid(vm, grid, false);
+    MPI_Bcast(&chunkCells, 1, MPI_UNSIGNED, root, comm);
+    const ChunkOwner owner(grid, chunkCells, size);
 
     boost::scoped_ptr<boost::thread> slaveThread;
     if (!devices.empty())
     {
         slaveThread.reset(new boost::thread(Slave(
                     devices, vm, splats,
-                    scatterComm, root, gatherComm, root,
-                    progressComm, root)));
+                    relayed ? nodeScatterComm : scatterComm, relayed ? 0 : root,
+                    relayed ? nodeGatherComm : gatherComm, relayed ? 0 : root,
+                    progressComm, root, progressWin,
+                    distributed ? &owner : NULL)));
     }
 
-    boost::scoped_ptr<FastPly::WriterMPI> writer(new FastPly::WriterMPI);
-    setWriterComments(vm, *writer);
-    boost::scoped_ptr<MesherBase> mesher(new OOCMesherMPI(*writer, getNamer(vm, out), comm, root));
-    setMesherOptions(vm, *mesher);
+    // The node's relay is rank 0 of the node communicators
+    boost::scoped_ptr<boost::thread> relayThread;
+    if (relayed && localSlaves > 0)
+    {
+        int nodeRank;
+        MPI_Comm_rank(nodeScatterComm, &nodeRank);
+        if (nodeRank == 0)
+            relayThread.reset(new boost::thread(NodeRelay(
+                        vm, scatterComm, gatherComm, root,
+                        nodeScatterComm, nodeGatherComm, localSlaves)));
+    }
 
     if (rank == root)
     {
-        const int numSlaves = accumulate(slaveMask.begin(), slaveMask.end(), 0);
         const std::size_t maxLoadSplats = getMaxLoadSplats(vm);
         const std::size_t memMesh = vm[Option::memMesh].as<Capacity>();
 
-        const Grid grid = splats.getBoundingGrid();
-        const unsigned int chunkCells = postprocessGrid(vm, grid);
+        mesher->setChunkGrid(grid, chunkCells, splats.getBoundingGrid());
 
         {
             // Open a scope so that objects will be released before finalization
             boost::scoped_ptr<Timeplot::Action> initTimer(new Timeplot::Action("init", mainWorker, "init.time"));
 
-            MesherGroup mesherGroup(memMesh);
-            ReceiverGather<MesherGroup::WorkItem, MesherGroup> receiver("receiver", mesherGroup, gatherComm, numSlaves);
-            Scatter scatter(scatterComm, mainWorker);
-            BucketCollector collector(maxLoadSplats, scatter);
+            MesherGroup mesherGroup(memMesh,
+                                    mesher->concurrentInput() ? vm[Option::mesherThreads].as<int>() : 1);
+            Scatter scatter(scatterComm, mainWorker, numSenders, vm.count(Option::scatterLocality));
+            const boost::filesystem::path snapshotPath =
+                vm.count(Option::snapshot) ? vm[Option::snapshot].as<std::string>() : std::string();
+            ScatterSnapshotter snapshotter(mainWorker, *mesher, mesherGroup, scatter, gatherComm, numSenders,
+                                           snapshotPath, vm[Option::snapshotInterval].as<double>());
+            BucketCollector collector(maxLoadSplats, boost::ref(snapshotter));
+            collector.setLongestFirst(vm.count(Option::longestFirst),
+                                      vm[Option::bucketCellWeight].as<double>());
 
             initTimer.reset();
 
@@ -455,14 +1163,16 @@ static std::size_t run(
                 Statistics::Timer timer(passName.str());
 
                 ProgressDisplay progress(splats.numSplats(), Log::log[Log::info]);
-                ProgressMPI progressMPI(&progress, splats.numSplats(), progressComm, 0);
+                ProgressMPI progressMPI(&progress, splats.numSplats(), progressComm, 0, progressWin);
 
                 mesherGroup.setInputFunctor(mesher->functor(pass));
 
                 // Start threads
-                boost::thread receiverThread(boost::ref(receiver));
+                snapshotter.startReceiver();
                 mesherGroup.start();
                 boost::thread progressThread(boost::ref(progressMPI));
+                snapshotter.setPass(skipBins);
+                collector.setSkip(skipBins, &progressMPI);
 
                 try
                 {
@@ -473,8 +1183,7 @@ static std::size_t run(
                     // This can't be handled using unwinding, because that would operate in
                     // the wrong order
                     collector.flush();
-                    scatter.stop(numSlaves);
-                    receiverThread.join();
+                    snapshotter.stop();
                     mesherGroup.stop();
                     progressMPI.sync();
                     progressThread.interrupt();
@@ -487,16 +1196,42 @@ static std::size_t run(
                  * are terminated.
                  */
                 collector.flush();
-                scatter.stop(numSlaves);
-                receiverThread.join();
+                snapshotter.stop();
                 mesherGroup.stop();
                 progressMPI.sync();
                 progressThread.join();
             }
         }
     }
+    else if (distributed)
+    {
+        // Receive and weld the meshes for the chunks owned by this rank
+        const std::size_t memMesh = vm[Option::memMesh].as<Capacity>();
+        mesher->setChunkGrid(grid, chunkCells, splats.getBoundingGrid());
+
+        MesherGroup mesherGroup(memMesh,
+                                mesher->concurrentInput() ? vm[Option::mesherThreads].as<int>() : 1);
+        ReceiverGatherNonBlocking<MesherGroup::WorkItem, MesherGroup> receiver("receiver", mesherGroup, gatherComm, numSlaves);
+        for (unsigned int pass = 0; pass < mesher->numPasses(); pass++)
+        {
+            mesherGroup.setInputFunctor(mesher->functor(pass));
+            boost::thread receiverThread(boost::ref(receiver));
+            mesherGroup.start();
+            receiverThread.join();
+            mesherGroup.stop();
+        }
+    }
     if (slaveThread)
         slaveThread->join();
+    if (relayThread)
+        relayThread->join();
+    if (stripe)
+    {
+        stripe->stop();
+        stripeThread->join();
+        splats.setRemoteReader(NULL);
+        stripe.reset();
+    }
 
     std::size_t ret = mesher->write(mainWorker, &Log::log[Log::info]);
 
@@ -523,6 +1258,10 @@ int main(int argc, char **argv)
     Log::log.setLevel(Log::info);
     po::variables_map vm = processOptions(argc, argv, true);
     setLogLevel(vm);
+    setMemoryPolicy(vm);
+    if (vm.count(CLH::Option::programCache))
+        CLH::setProgramCacheDir(vm[CLH::Option::programCache].as<std::string>());
+    CLH::setSpecializeKernels(vm.count(CLH::Option::specialize));
 
     int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
@@ -533,6 +1272,31 @@ int main(int argc, char **argv)
     int totalDevices;
     MPI_Reduce(&numDevices, &totalDevices, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 
+    if (vm.count(Option::memAuto))
+    {
+        /* Every rank must use the same plan, since the bucket size is chosen
+         * on the root but used on the slaves. Plan for the most constrained.
+         */
+        const std::vector<int> leaders = nodeLeaders(MPI_COMM_WORLD);
+        MemoryLimits limits = getMemoryLimits(
+            devices, std::count(leaders.begin(), leaders.end(), leaders[rank]));
+        unsigned long long values[3] = { limits.hostMemory, limits.deviceMemory, limits.deviceMaxAlloc };
+        MPI_Allreduce(MPI_IN_PLACE, values, 3, MPI_UNSIGNED_LONG_LONG, MPI_MIN, MPI_COMM_WORLD);
+        limits.hostMemory = values[0];
+        limits.deviceMemory = values[1];
+        limits.deviceMaxAlloc = values[2];
+        try
+        {
+            planMemory(vm, limits, true, rank == 0 ? &Log::log[Log::info] : NULL);
+        }
+        catch (invalid_option &e)
+        {
+            if (rank == 0)
+                cerr << e.what() << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
     if (rank == 0)
     {
         if (totalDevices == 0)
@@ -551,11 +1315,6 @@ int main(int argc, char **argv)
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
     }
-    CLH::ResourceUsage totalUsage = resourceUsage(vm);
-
-    if (rank == 0)
-        Log::log[Log::info] << "About " << totalUsage.getTotalMemory() / (1024 * 1024) << "MiB of device memory will be used per device.\n";
-
     /* Give each node a turn to validate things. Doing it serially prevents
      * the output from becoming interleaved.
      */
@@ -565,16 +1324,20 @@ int main(int argc, char **argv)
         {
             BOOST_FOREACH(const cl::Device &device, devices)
             {
+                const unsigned int threads = getDeviceThreads(vm, device);
+                const CLH::ResourceUsage totalUsage = resourceUsage(vm, device, threads);
                 try
                 {
-                    validateDevice(device, totalUsage);
+                    validateDevice(vm, device, totalUsage);
                 }
                 catch (CLH::invalid_device &e)
                 {
                     cerr << e.what() << endl;
                     MPI_Abort(MPI_COMM_WORLD, 1);
                 }
-                Log::log[Log::info] << "Using device " << device.getInfo<CL_DEVICE_NAME>() << "\n";
+                Log::log[Log::info] << "Using device " << device.getInfo<CL_DEVICE_NAME>()
+                    << " with " << threads << " thread(s) and about "
+                    << totalUsage.getTotalMemory() / (1024 * 1024) << "MiB of device memory.\n";
             }
         }
         MPI_Barrier(MPI_COMM_WORLD);
@@ -593,14 +1356,24 @@ int main(int argc, char **argv)
         {
             ostringstream name;
             name << vm[Option::timeplot].as<string>() << "." << rank;
-            Timeplot::init(name.str());
+            Timeplot::init(name.str(), getTimeplotFormat(vm));
+        }
+        if (vm.count(Option::bucketTrace))
+        {
+            ostringstream name;
+            name << vm[Option::bucketTrace].as<string>() << "." << rank;
+            BucketTrace::init(name.str());
+        }
+        boost::scoped_ptr<Metrics::Exporter> metrics;
+        if (vm.count(Option::metricsFile))
+        {
+            ostringstream name;
+            name << vm[Option::metricsFile].as<string>() << "." << rank;
+            metrics.reset(new Metrics::Exporter(name.str(), vm[Option::metricsInterval].as<double>()));
+            metrics->start();
         }
 
-        std::size_t filesWritten;
-        if (vm.count(Option::resume))
-            filesWritten = runResume(MPI_COMM_WORLD, vm[Option::outputFile].as<string>(), vm);
-        else
-            filesWritten = run(MPI_COMM_WORLD, cd, vm[Option::outputFile].as<string>(), vm);
+        const std::size_t filesWritten = run(MPI_COMM_WORLD, cd, vm[Option::outputFile].as<string>(), vm);
 
         if (rank == 0)
         {
@@ -611,6 +1384,8 @@ int main(int argc, char **argv)
             else
                 Log::log[Log::info] << filesWritten << " output files written.\n";
         }
+        if (metrics)
+            metrics->stop();
     }
     catch (cl::Error &e)
     {
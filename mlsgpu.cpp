@@ -32,163 +32,285 @@
 
 #include <boost/program_options.hpp>
 #include <boost/foreach.hpp>
-#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
-#include <boost/thread/thread.hpp>
-#include <boost/progress.hpp>
-#include <boost/ref.hpp>
-#include "src/tr1_unordered_map.h"
+#include <boost/filesystem.hpp>
 #include <iostream>
-#include <map>
-#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iterator>
 #include <algorithm>
-#include <limits>
-#include "src/misc.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <cerrno>
+#include <cstring>
+#if HAVE_SYS_UN_H
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <unistd.h>
+#endif
 #include "src/clh.h"
 #include "src/logging.h"
-#include "src/timer.h"
-#include "src/fast_ply.h"
-#include "src/splat.h"
-#include "src/grid.h"
-#include "src/splat_tree_cl.h"
-#include "src/marching.h"
-#include "src/mls.h"
-#include "src/mesher.h"
 #include "src/options.h"
-#include "src/splat_set.h"
-#include "src/bucket.h"
-#include "src/provenance.h"
-#include "src/statistics.h"
-#include "src/statistics_cl.h"
-#include "src/work_queue.h"
-#include "src/workers.h"
-#include "src/progress.h"
-#include "src/mesh_filter.h"
+#include "src/errors.h"
 #include "src/timeplot.h"
-#include "src/bucket_collector.h"
-#include "src/bucket_loader.h"
+#include "src/bucket_trace.h"
+#include "src/metrics.h"
 #include "src/mlsgpu_core.h"
+#include "src/reconstruct.h"
 
 namespace po = boost::program_options;
 using namespace std;
 
 /**
- * Main execution.
+ * Plan memory for a job and check that the options and devices suit it.
+ *
+ * @param vm              Options for the job, updated by @ref planMemory
+ * @param devices         Devices that will run the job
+ * @throw invalid_option if the options are invalid.
+ * @throw CLH::invalid_device if a device is unusable.
+ */
+static void prepareJob(po::variables_map &vm, const std::vector<cl::Device> &devices)
+{
+    planMemory(vm, getMemoryLimits(devices), false, &Log::log[Log::info]);
+    validateOptions(vm, false);
+
+    /* Devices may come from different platforms and differ in size, so
+     * each is checked with the number of threads it will actually run.
+     */
+    BOOST_FOREACH(const cl::Device &device, devices)
+    {
+        const unsigned int threads = getDeviceThreads(vm, device);
+        const CLH::ResourceUsage totalUsage = resourceUsage(vm, device, threads);
+        validateDevice(vm, device, totalUsage);
+        Log::log[Log::info] << "Using device " << device.getInfo<CL_DEVICE_NAME>()
+            << " with " << threads << " thread(s) and about "
+            << totalUsage.getTotalMemory() / (1024 * 1024) << "MiB of device memory.\n";
+    }
+}
+
+/// Log the number of output files written by a job.
+static void reportFilesWritten(std::size_t filesWritten)
+{
+    if (filesWritten == 0)
+        Log::log[Log::warn] << "Warning: no output files written!\n";
+    else if (filesWritten == 1)
+        Log::log[Log::info] << "1 output file written.\n";
+    else
+        Log::log[Log::info] << filesWritten << " output files written.\n";
+}
+
+/**
+ * Run a job given as command-line arguments (without the program name),
+ * using devices and contexts that are already set up.
  *
- * @param devices         List of OpenCL devices to use
- * @param out             Output filename or basename
- * @param vm              Command-line options
  * @return Number of output files written
  */
-static std::size_t run(const std::vector<std::pair<cl::Context, cl::Device> > &devices,
-                       const std::string &out,
-                       const po::variables_map &vm)
+static std::size_t runJob(const std::vector<std::string> &args,
+                          const std::vector<std::pair<cl::Context, cl::Device> > &cd,
+                          const std::vector<cl::Device> &devices)
 {
-    typedef SplatSet::FastBlobSet<SplatSet::FileSet> Splats;
+    po::variables_map vm = parseOptions(args, false);
+    if (vm.count(Option::serve) || vm.count(Option::batch) || vm.count(Option::planOnly)
+        || vm.count(Option::autotuneHost) || vm.count(Option::help))
+        throw invalid_option(std::string("--") + Option::serve + ", --" + Option::batch
+                             + ", --" + Option::planOnly + ", --" + Option::autotuneHost
+                             + " and --" + Option::help + " cannot be used in a job");
+    prepareJob(vm, devices);
+    std::size_t filesWritten = reconstruct(cd, vm[Option::outputFile].as<string>(), vm);
+    reportFilesWritten(filesWritten);
+    return filesWritten;
+}
 
-    const std::size_t maxLoadSplats = getMaxLoadSplats(vm);
-    const std::size_t memMesh = vm[Option::memMesh].as<Capacity>();
-    std::size_t ret = 0;
+/**
+ * Run each job in a manifest file, one after another, with the same
+ * contexts. Each non-empty line that does not start with @c # holds the
+ * command-line arguments for one job, separated by whitespace. A job that
+ * fails is reported and the rest still run.
+ *
+ * @return The number of jobs that failed
+ */
+static std::size_t runBatch(const std::string &path,
+                            const std::vector<std::pair<cl::Context, cl::Device> > &cd,
+                            const std::vector<cl::Device> &devices)
+{
+    std::ifstream in(path.c_str());
+    if (!in)
+        throw std::runtime_error("Could not open `" + path + "'");
+    std::vector<std::vector<std::string> > jobs;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream tokens(line);
+        std::vector<std::string> args;
+        std::copy(std::istream_iterator<std::string>(tokens),
+                  std::istream_iterator<std::string>(), std::back_inserter(args));
+        if (!args.empty() && args[0][0] != '#')
+            jobs.push_back(args);
+    }
+    if (in.bad())
+        throw std::runtime_error("Error while reading from `" + path + "'");
 
-    Timeplot::Worker mainWorker("main");
+    CLH::setProgramReuse(true);
+    std::size_t failed = 0;
+    for (std::size_t i = 0; i < jobs.size(); i++)
+    {
+        Log::log[Log::info] << "\nJob " << i + 1 << "/" << jobs.size() << '\n';
+        try
+        {
+            runJob(jobs[i], cd, devices);
+        }
+        catch (cl::Error &e)
+        {
+            cerr << "\nOpenCL error in " << e.what() << " (" << e.err() << ")\n";
+            failed++;
+        }
+        catch (std::exception &e)
+        {
+            reportException(e);
+            failed++;
+        }
+    }
+    if (failed > 0)
+        Log::log[Log::warn] << failed << " of " << jobs.size() << " jobs failed\n";
+    return failed;
+}
+
+#if HAVE_SYS_UN_H
 
+/**
+ * Run one job received by @ref serve. The request is a list of command-line
+ * arguments, one per line, ended by an empty line or by the client shutting
+ * down its side of the connection. The reply is a single line, either
+ * <code>ok</code> and the number of output files, or <code>error:</code>
+ * and a message.
+ */
+static void serveJob(int fd,
+                     const std::vector<std::pair<cl::Context, cl::Device> > &cd,
+                     const std::vector<cl::Device> &devices)
+{
+    std::string request;
+    char buffer[4096];
+    while (request.size() < 2 || request.compare(request.size() - 2, 2, "\n\n") != 0)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        request.append(buffer, n);
+    }
+
+    std::vector<std::string> args;
+    std::istringstream lines(request);
+    std::string line;
+    while (std::getline(lines, line) && !line.empty())
+        args.push_back(line);
+
+    std::ostringstream reply;
+    try
+    {
+        reply << "ok " << runJob(args, cd, devices) << '\n';
+    }
+    catch (cl::Error &e)
     {
-        Statistics::Timer grandTotalTimer("run.time");
+        reply << "error: OpenCL error in " << e.what() << " (" << e.err() << ")\n";
+    }
+    catch (std::exception &e)
+    {
+        reportException(e);
+        reply << "error: " << e.what() << '\n';
+    }
 
-        const WriterType writerType = vm[Option::writer].as<Choice<WriterTypeWrapper> >();
-        boost::scoped_ptr<FastPly::Writer> writer(new FastPly::Writer(writerType));
-        setWriterComments(vm, *writer);
+    const std::string out = reply.str();
+    std::size_t sent = 0;
+    while (sent < out.size())
+    {
+        ssize_t n = send(fd, out.data() + sent, out.size() - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break; // the client has gone away, so there is no one to tell
+        sent += n;
+    }
+}
 
-        boost::scoped_ptr<MesherBase> mesher(new OOCMesher(*writer, getNamer(vm, out)));
-        setMesherOptions(vm, *mesher);
+/**
+ * Accept jobs on a Unix domain socket and run them one at a time, until the
+ * process is killed. The contexts are created once, and programs built for
+ * them are reused (see @ref CLH::setProgramReuse), so each job skips device
+ * discovery and compilation. Statistics accumulate across jobs.
+ */
+static void serve(const std::string &path,
+                  const std::vector<std::pair<cl::Context, cl::Device> > &cd,
+                  const std::vector<cl::Device> &devices)
+{
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Socket path `" + path + "' is too long");
+    std::strcpy(addr.sun_path, path.c_str());
+
+    // Remove a socket left behind by an earlier server, but nothing else
+    boost::system::error_code ec;
+    if (boost::filesystem::status(path, ec).type() == boost::filesystem::socket_file)
+        boost::filesystem::remove(path, ec);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0
+        || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || listen(fd, 16) < 0)
+    {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        throw std::runtime_error("Could not listen on `" + path + "': " + std::strerror(err));
+    }
 
-        if (vm.count(Option::resume))
-        {
-            boost::filesystem::path path(vm[Option::resume].as<std::string>());
-            ret = mesher->resume(mainWorker, path, &Log::log[Log::info]);
-        }
-        else
+    CLH::setProgramReuse(true);
+    Log::log[Log::info] << "Waiting for jobs on " << path << '\n';
+    while (true)
+    {
+        int client = accept(fd, NULL, NULL);
+        if (client < 0)
         {
-            {
-                // Open a scope so that objects will be released before finalization
-
-                boost::scoped_ptr<Timeplot::Action> initTimer(new Timeplot::Action("init", mainWorker, "init.time"));
-
-                Log::log[Log::info] << "Initializing...\n";
-                MesherGroup mesherGroup(memMesh);
-                SlaveWorkers slaveWorkers(
-                    mainWorker, vm, devices,
-                    makeOutputGenerator(mesherGroup));
-                BucketCollector collector(maxLoadSplats, boost::ref(*slaveWorkers.loader));
-
-                Splats splats;
-                doComputeBlobs(mainWorker, vm, splats,
-                               boost::bind(&Splats::computeBlobs, &splats, _1, _2, &Log::log[Log::info], true));
-                Grid grid = splats.getBoundingGrid();
-                unsigned int chunkCells = postprocessGrid(vm, grid);
-
-                initTimer.reset();
-
-                for (unsigned int pass = 0; pass < mesher->numPasses(); pass++)
-                {
-                    Log::log[Log::info] << "\nPass " << pass + 1 << "/" << mesher->numPasses() << endl;
-                    ostringstream passName;
-                    passName << "pass" << pass + 1 << ".time";
-                    Statistics::Timer timer(passName.str());
-
-                    ProgressDisplay progress(splats.numSplats(), Log::log[Log::info]);
-
-                    mesherGroup.setInputFunctor(mesher->functor(pass));
-
-                    // Start threads
-                    slaveWorkers.start(splats, grid, &progress);
-                    mesherGroup.start();
-
-                    try
-                    {
-                        doBucket(mainWorker, vm, splats, grid, chunkCells, collector);
-                    }
-                    catch (...)
-                    {
-                        // This can't be handled using unwinding, because that would operate in
-                        // the wrong order
-                        collector.flush();
-                        slaveWorkers.stop();
-                        mesherGroup.stop();
-                        throw;
-                    }
-
-                    /* Shut down threads. Note that it has to be done in forward order to
-                     * satisfy the requirement that stop() is only called after producers
-                     * are terminated.
-                     */
-                    collector.flush();
-                    slaveWorkers.stop();
-                    mesherGroup.stop();
-                }
-            }
-
-            if (vm.count(Option::checkpoint))
-            {
-                const boost::filesystem::path path(vm[Option::checkpoint].as<std::string>());
-                mesher->checkpoint(mainWorker, path);
-            }
-            else
-                ret = mesher->write(mainWorker, &Log::log[Log::info]);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(std::string("Could not accept a connection: ") + std::strerror(err));
         }
-    } // ends scope for grandTotalTimer
+        serveJob(client, cd, devices);
+        close(client);
+    }
+}
 
-    Statistics::finalizeEventTimes();
-    writeStatistics(vm);
-    return ret;
+#else
+
+static void serve(const std::string &path,
+                  const std::vector<std::pair<cl::Context, cl::Device> > &cd,
+                  const std::vector<cl::Device> &devices)
+{
+    (void) path;
+    (void) cd;
+    (void) devices;
+    throw std::runtime_error(std::string("--") + Option::serve + " is not supported on this platform");
 }
 
+#endif
+
 int main(int argc, char **argv)
 {
     Log::log.setLevel(Log::info);
 
     po::variables_map vm = processOptions(argc, argv, false);
     setLogLevel(vm);
+    setMemoryPolicy(vm);
+    if (vm.count(CLH::Option::programCache))
+        CLH::setProgramCacheDir(vm[CLH::Option::programCache].as<std::string>());
+    CLH::setSpecializeKernels(vm.count(CLH::Option::specialize));
 
     std::vector<cl::Device> devices = CLH::findDevices(vm);
     if (devices.empty())
@@ -197,30 +319,51 @@ int main(int argc, char **argv)
         exit(1);
     }
 
-    try
+    if (vm.count(Option::planOnly))
     {
-        validateOptions(vm, false);
-    }
-    catch (invalid_option &e)
-    {
-        cerr << e.what() << endl;
-        exit(1);
+        /* The devices are only queried for their memory limits, so that
+         * --mem-auto chooses the same values as a real run would.
+         */
+        try
+        {
+            planMemory(vm, getMemoryLimits(devices), false, &Log::log[Log::info]);
+            validateOptions(vm, false);
+            planReconstruction(vm, devices.size(), cout);
+        }
+        catch (invalid_option &e)
+        {
+            cerr << e.what() << endl;
+            return 1;
+        }
+        catch (std::ios::failure &e)
+        {
+            reportException(e);
+            return 1;
+        }
+        catch (std::runtime_error &e)
+        {
+            reportException(e);
+            return 1;
+        }
+        return 0;
     }
 
-    CLH::ResourceUsage totalUsage = resourceUsage(vm);
-    Log::log[Log::info] << "About " << totalUsage.getTotalMemory() / (1024 * 1024) << "MiB of device memory will be used per device.\n";
-    BOOST_FOREACH(const cl::Device &device, devices)
+    if (!vm.count(Option::serve) && !vm.count(Option::batch))
     {
         try
         {
-            validateDevice(device, totalUsage);
+            prepareJob(vm, devices);
+        }
+        catch (invalid_option &e)
+        {
+            cerr << e.what() << endl;
+            exit(1);
         }
         catch (CLH::invalid_device &e)
         {
             cerr << e.what() << endl;
             exit(1);
         }
-        Log::log[Log::info] << "Using device " << device.getInfo<CL_DEVICE_NAME>() << "\n";
     }
 
     std::vector<std::pair<cl::Context, cl::Device> > cd;
@@ -230,18 +373,34 @@ int main(int argc, char **argv)
         cd.push_back(std::make_pair(CLH::makeContext(devices[i]), devices[i]));
     }
 
+    int status = 0;
     try
     {
         if (vm.count(Option::timeplot))
-            Timeplot::init(vm[Option::timeplot].as<string>());
+            Timeplot::init(vm[Option::timeplot].as<string>(), getTimeplotFormat(vm));
+        if (vm.count(Option::bucketTrace))
+            BucketTrace::init(vm[Option::bucketTrace].as<string>());
+        boost::scoped_ptr<Metrics::Exporter> metrics;
+        if (vm.count(Option::metricsFile))
+        {
+            metrics.reset(new Metrics::Exporter(vm[Option::metricsFile].as<string>(),
+                                                vm[Option::metricsInterval].as<double>()));
+            metrics->start();
+        }
 
-        std::size_t filesWritten = run(cd, vm[Option::outputFile].as<string>(), vm);
-        if (filesWritten == 0)
-            Log::log[Log::warn] << "Warning: no output files written!\n";
-        else if (filesWritten == 1)
-            Log::log[Log::info] << "1 output file written.\n";
+        if (vm.count(Option::serve))
+            serve(vm[Option::serve].as<string>(), cd, devices);
+        else if (vm.count(Option::batch))
+        {
+            if (runBatch(vm[Option::batch].as<string>(), cd, devices) > 0)
+                status = 1;
+        }
+        else if (vm.count(Option::autotuneHost))
+            autotuneHost(cd, vm[Option::outputFile].as<string>(), vm);
         else
-            Log::log[Log::info] << filesWritten << " output files written.\n";
+            reportFilesWritten(reconstruct(cd, vm[Option::outputFile].as<string>(), vm));
+        if (metrics)
+            metrics->stop();
     }
     catch (cl::Error &e)
     {
@@ -259,5 +418,5 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    return 0;
+    return status;
 }
@@ -35,10 +35,18 @@
 #include <vector>
 #include <string>
 #include <list>
+#include <algorithm>
+#include <cstddef>
 #include <boost/multi_array.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include "tr1_unordered_map.h"
 #include "tr1_unordered_set.h"
 #include "pod_buffer.h"
+#include "flat_hash_map.h"
 #include "statistics.h"
 
 class TestAllocator;
@@ -193,6 +201,240 @@ Alloc makeAllocator(const std::string &name)
     return Alloc(&myStat, &allStat);
 }
 
+/**
+ * Memory pool for short-lived scratch data. Allocations are carved
+ * sequentially out of large blocks and are never individually freed;
+ * instead, @ref reset discards all of them at once. The capacity is retained
+ * across a reset (coalesced into a single block if it had grown), so that
+ * repeated use with similar sizes does not touch the heap at all.
+ *
+ * The blocks are obtained through an @ref Allocator, so they are tracked by
+ * a named statistic in the same way as the containers below.
+ *
+ * This class is not thread-safe. Use @ref ArenaPool to share arenas between
+ * threads.
+ */
+class Arena : public boost::noncopyable
+{
+private:
+    /// Allocator for the blocks
+    Allocator<std::allocator<char> > allocator;
+
+    /// A contiguous piece of memory from which allocations are made
+    struct Block
+    {
+        char *data;
+        std::size_t size;
+    };
+
+    /// All blocks; only the last one has free space
+    std::vector<Block> blocks;
+    /// First free byte in the last block
+    std::size_t offset;
+
+    /// Smallest block that will be allocated
+    static const std::size_t MIN_BLOCK = 64 * 1024;
+
+    /// Add a block with room for at least @a bytes
+    void addBlock(std::size_t bytes)
+    {
+        std::size_t size = std::max(bytes, std::size_t(MIN_BLOCK));
+        if (!blocks.empty())
+            size = std::max(size, 2 * blocks.back().size);
+        Block block;
+        block.data = allocator.allocate(size);
+        block.size = size;
+        blocks.push_back(block);
+        offset = 0;
+    }
+
+    /// Return all blocks to the allocator
+    void releaseBlocks()
+    {
+        for (std::size_t i = 0; i < blocks.size(); i++)
+            allocator.deallocate(blocks[i].data, blocks[i].size);
+        blocks.clear();
+        offset = 0;
+    }
+
+public:
+    /**
+     * Constructor. No memory is allocated until first use.
+     *
+     * @param allocName  Name of the statistic that tracks the memory held.
+     */
+    explicit Arena(const std::string &allocName)
+        : allocator(makeAllocator<Allocator<std::allocator<char> > >(allocName)), offset(0)
+    {
+    }
+
+    ~Arena()
+    {
+        releaseBlocks();
+    }
+
+    /**
+     * Allocate @a bytes bytes aligned to @a alignment, which must be a power
+     * of 2 no larger than the alignment guaranteed by @c operator new.
+     */
+    void *allocate(std::size_t bytes, std::size_t alignment)
+    {
+        if (!blocks.empty())
+        {
+            std::size_t start = (offset + alignment - 1) & ~(alignment - 1);
+            if (start <= blocks.back().size && blocks.back().size - start >= bytes)
+            {
+                offset = start + bytes;
+                return blocks.back().data + start;
+            }
+        }
+        addBlock(bytes);
+        offset = bytes;
+        return blocks.back().data;
+    }
+
+    /**
+     * Discard all allocations. Memory previously returned by @ref allocate
+     * must no longer be used.
+     */
+    void reset()
+    {
+        if (blocks.size() > 1)
+        {
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < blocks.size(); i++)
+                total += blocks[i].size;
+            releaseBlocks();
+            addBlock(total);
+        }
+        offset = 0;
+    }
+
+    /// Total bytes held in blocks
+    std::size_t capacity() const
+    {
+        std::size_t total = 0;
+        for (std::size_t i = 0; i < blocks.size(); i++)
+            total += blocks[i].size;
+        return total;
+    }
+};
+
+/**
+ * STL-compatible allocator that takes memory from an @ref Arena. Deallocation
+ * does nothing; the memory is reclaimed when the arena is reset. It is thus
+ * suited to containers that live no longer than one use of the arena.
+ */
+template<typename T>
+class ArenaAllocator : public std::allocator<T>
+{
+    template<typename U> friend class ArenaAllocator;
+private:
+    Arena *arena;
+
+public:
+    typedef std::allocator<T> base_type;
+    typedef typename base_type::pointer pointer;
+    typedef typename base_type::size_type size_type;
+
+    explicit ArenaAllocator(Arena &arena) throw() : arena(&arena) {}
+
+    ArenaAllocator(const ArenaAllocator &b) throw() : std::allocator<T>(), arena(b.arena) {}
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &b) throw() : std::allocator<T>(), arena(b.arena) {}
+
+    /// Interface requirement
+    template<typename U> struct rebind
+    {
+        typedef ArenaAllocator<U> other;
+    };
+
+    pointer allocate(size_type n, std::allocator<void>::const_pointer hint = 0)
+    {
+        (void) hint;
+        return static_cast<pointer>(arena->allocate(n * sizeof(T), boost::alignment_of<T>::value));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        (void) p;
+        (void) n;
+    }
+
+    template<typename A, typename B>
+    friend bool operator==(const ArenaAllocator<A> &a, const ArenaAllocator<B> &b);
+};
+
+template<typename A, typename B>
+bool operator==(const ArenaAllocator<A> &a, const ArenaAllocator<B> &b)
+{
+    return a.arena == b.arena;
+}
+
+template<typename A, typename B>
+bool operator!=(const ArenaAllocator<A> &a, const ArenaAllocator<B> &b)
+{
+    return !(a == b);
+}
+
+/**
+ * Thread-safe collection of @ref Arena objects. A thread takes one out by
+ * constructing a @ref Lease, which resets the arena and returns it to the
+ * pool when it is destroyed. The pool grows to the maximum number of
+ * simultaneous leases.
+ */
+class ArenaPool : public boost::noncopyable
+{
+public:
+    class Lease;
+    friend class Lease;
+
+private:
+    const std::string allocName;
+    boost::mutex mutex;
+    boost::ptr_vector<Arena> available;  ///< Arenas not currently leased
+
+public:
+    /// Exclusive use of an arena from the pool for the lifetime of the object
+    class Lease : public boost::noncopyable
+    {
+    private:
+        ArenaPool &owner;
+        Arena *arena;
+
+    public:
+        explicit Lease(ArenaPool &owner) : owner(owner), arena(NULL)
+        {
+            boost::lock_guard<boost::mutex> lock(owner.mutex);
+            if (owner.available.empty())
+                arena = new Arena(owner.allocName);
+            else
+                arena = owner.available.pop_back().release();
+        }
+
+        ~Lease()
+        {
+            arena->reset();
+            boost::lock_guard<boost::mutex> lock(owner.mutex);
+            owner.available.push_back(arena);
+        }
+
+        Arena &get() const { return *arena; }
+
+        /// Allocator drawing from the leased arena
+        template<typename T>
+        ArenaAllocator<T> allocator() const { return ArenaAllocator<T>(*arena); }
+    };
+
+    /**
+     * Constructor.
+     *
+     * @param allocName   Name of the statistic that tracks memory held by all the arenas.
+     */
+    explicit ArenaPool(const std::string &allocName) : allocName(allocName) {}
+};
+
 /**
  * Wrappers around standard container types which use @ref Statistics::Allocator instead
  * of @c std::allocator. Each wrapper provides forwarding constructors that take an extra
@@ -327,6 +569,23 @@ public:
         : BaseType(f, l, n, hf, eql, makeAllocator<Alloc>(allocName)) {}
 };
 
+/**
+ * Wrapper around @ref ::FlatHashMap that uses @ref Statistics::Allocator.
+ * @see @ref Statistics::Container
+ */
+template<
+    typename Key,
+    typename T,
+    typename Alloc = Allocator<std::allocator<std::pair<Key, T> > > >
+class flat_hash_map : public ::FlatHashMap<Key, T, Alloc>
+{
+private:
+    typedef ::FlatHashMap<Key, T, Alloc> BaseType;
+public:
+    explicit flat_hash_map(const std::string &allocName)
+        : BaseType(makeAllocator<Alloc>(allocName)) {}
+};
+
 template<
     typename ValueType,
     std::size_t NumDims,
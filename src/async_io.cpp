@@ -28,8 +28,11 @@
 # include <config.h>
 #endif
 #include <cstddef>
+#include <vector>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/foreach.hpp>
 #include "binary_io.h"
 #include "work_queue.h"
 #include "worker_group.h"
@@ -42,8 +45,7 @@ namespace detail
 
 void AsyncWriterWorker::operator()(AsyncWriterItem &item)
 {
-    Timeplot::Action timer("write", getTimeplotWorker(), owner.getComputeStat());
-    item.out->write(item.get(), item.count, item.offset);
+    owner.write(getTimeplotWorker(), item);
 }
 
 AsyncWriterWorker::AsyncWriterWorker(AsyncWriter &owner)
@@ -57,7 +59,15 @@ boost::shared_ptr<AsyncWriterItem> AsyncWriter::get(
     Timeplot::Worker &tworker, std::size_t bytes)
 {
     boost::shared_ptr<AsyncWriterItem> item = Base::get(tworker, bytes);
-    item->alloc = buffer.allocate(tworker, bytes, &getStat);
+    if (!buffer.tryAllocate(bytes, item->alloc))
+    {
+        // Held-back items may be what is using up the buffer
+        {
+            boost::lock_guard<boost::mutex> lock(pendingMutex);
+            flushPending();
+        }
+        item->alloc = buffer.allocate(tworker, bytes, &getStat);
+    }
     item->count = bytes;
     return item;
 }
@@ -73,18 +83,123 @@ void AsyncWriter::push(
     item->count = count;
     item->out = out;
     item->offset = offset;
-    Base::push(tworker, item);
+    item->merged.clear();
+
+    Timeplot::recordEvent("push", tworker);
+    boost::lock_guard<boost::mutex> lock(pendingMutex);
+    if (pending && (pending->out != out || pending->offset + pendingBytes != offset))
+        flushPending();
+    if (!pending)
+    {
+        pending = item;
+        pendingBytes = count;
+    }
+    else
+    {
+        pending->merged.push_back(item);
+        pendingBytes += count;
+    }
+    if (pendingBytes >= coalesceBytes)
+        flushPending();
+}
+
+void AsyncWriter::flushPending()
+{
+    if (pending)
+    {
+        pending->ticket = nextTicket++;
+        getWorkQueue().push(pending);
+        pending.reset();
+        pendingBytes = 0;
+    }
+}
+
+std::tr1::uint64_t AsyncWriter::flush(Timeplot::Worker &tworker)
+{
+    (void) tworker;
+    boost::lock_guard<boost::mutex> lock(pendingMutex);
+    flushPending();
+    return nextTicket;
+}
+
+void AsyncWriter::waitFor(Timeplot::Worker &tworker, std::tr1::uint64_t ticket)
+{
+    Timeplot::Action timer("wait", tworker);
+    boost::unique_lock<boost::mutex> lock(completedMutex);
+    while (completed < ticket)
+        completedCondition.wait(lock);
+}
+
+void AsyncWriter::stop()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(pendingMutex);
+        flushPending();
+    }
+    Base::stop();
+}
+
+void AsyncWriter::write(Timeplot::Worker &tworker, AsyncWriterItem &item)
+{
+    if (ordered)
+    {
+        boost::unique_lock<boost::mutex> lock(completedMutex);
+        while (completed != item.ticket)
+            completedCondition.wait(lock);
+    }
+
+    {
+        Timeplot::Action timer("write", tworker, getComputeStat());
+        if (item.merged.empty())
+            item.out->write(item.get(), item.count, item.offset);
+        else
+        {
+            std::vector<BinaryWriter::ConstBuffer> bufs;
+            bufs.reserve(item.merged.size() + 1);
+            BinaryWriter::ConstBuffer first = { item.get(), item.count };
+            bufs.push_back(first);
+            BOOST_FOREACH(const boost::shared_ptr<AsyncWriterItem> &m, item.merged)
+            {
+                BinaryWriter::ConstBuffer next = { m->get(), m->count };
+                bufs.push_back(next);
+            }
+            item.out->writev(&bufs[0], bufs.size(), item.offset);
+        }
+    }
+
+    boost::lock_guard<boost::mutex> lock(completedMutex);
+    if (item.ticket == completed)
+    {
+        completed++;
+        while (!completedOutOfOrder.empty() && *completedOutOfOrder.begin() == completed)
+        {
+            completedOutOfOrder.erase(completedOutOfOrder.begin());
+            completed++;
+        }
+    }
+    else
+        completedOutOfOrder.insert(item.ticket);
+    completedCondition.notify_all();
 }
 
 void AsyncWriter::freeItem(boost::shared_ptr<AsyncWriterItem> item)
 {
     buffer.free(item->alloc);
+    BOOST_FOREACH(const boost::shared_ptr<AsyncWriterItem> &m, item->merged)
+    {
+        buffer.free(m->alloc);
+        m->out.reset();
+    }
+    item->merged.clear();
     item->out.reset(); // to release the reference
 }
 
-AsyncWriter::AsyncWriter(std::size_t numWorkers, std::size_t bufferSize)
+AsyncWriter::AsyncWriter(std::size_t numWorkers, std::size_t bufferSize,
+                         std::size_t coalesceBytes, bool ordered)
     : Base("asyncwriter", numWorkers),
-    buffer("mem.asyncwriter.buffer", bufferSize)
+    buffer("mem.asyncwriter.buffer", bufferSize, 256, true),
+    coalesceBytes(coalesceBytes), ordered(ordered),
+    pendingBytes(0), nextTicket(0), completed(0)
 {
     for (std::size_t i = 0; i < numWorkers; i++)
         addWorker(new detail::AsyncWriterWorker(*this));
@@ -31,7 +31,12 @@
 # include <config.h>
 #endif
 #include <cstddef>
+#include <vector>
+#include <set>
 #include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "tr1_cstdint.h"
 #include "binary_io.h"
 #include "work_queue.h"
 #include "worker_group.h"
@@ -49,7 +54,7 @@ class AsyncWriterItem
     friend class AsyncWriter;
     friend class detail::AsyncWriterWorker;
 private:
-    CircularBuffer::Allocation alloc; ///< Memory allocation from the buffer
+    LockFreeCircularBuffer::Allocation alloc; ///< Memory allocation from the buffer
     /// Output file for writing (only defined after @ref AsyncWriter::push)
     boost::shared_ptr<BinaryWriter> out;
     /**
@@ -60,6 +65,13 @@ private:
     std::size_t count;
     /// Position in the file to write (only defined after @ref AsyncWriter::push)
     BinaryWriter::offset_type offset;
+    /**
+     * Items coalesced onto this one, which follow it contiguously in the
+     * same file (see @ref AsyncWriter::AsyncWriter).
+     */
+    std::vector<boost::shared_ptr<AsyncWriterItem> > merged;
+    /// Position of this item in the order in which batches were queued
+    std::tr1::uint64_t ticket;
 public:
     /**
      * Retrieve pointer to the raw data.
@@ -89,6 +101,16 @@ public:
  * @ref get to allocate from the buffer, followed by @ref push once the data
  * have been placed in the buffer.
  *
+ * Items pushed for consecutive ranges of the same file can be coalesced, and
+ * are then written with a single @ref BinaryWriter::writev. Coalesced items
+ * are held back until enough data has accumulated, a non-adjacent item is
+ * pushed, or @ref flush or @ref stop is called.
+ *
+ * Each batch of items sent to the workers is given a ticket, in order. A
+ * thread that needs to read back the data can use @ref flush to obtain a
+ * ticket and @ref waitFor to wait until it and all earlier batches are
+ * written.
+ *
  * File handles are passed as shared pointers to facilitate automatic closing
  * of the file after it is no longer referenced.
  */
@@ -128,21 +150,86 @@ public:
         std::size_t count,
         BinaryWriter::offset_type offset);
 
+    /**
+     * Send any coalesced items that are being held back to the workers.
+     *
+     * @param tworker      Unused.
+     * @return A ticket that can be passed to @ref waitFor to wait for all data
+     *         pushed so far.
+     */
+    std::tr1::uint64_t flush(Timeplot::Worker &tworker);
+
+    /**
+     * Wait until every batch queued before @a ticket was issued has been
+     * written.
+     *
+     * @param tworker      Worker to which waiting time is accounted.
+     * @param ticket       Value returned by @ref flush.
+     */
+    void waitFor(Timeplot::Worker &tworker, std::tr1::uint64_t ticket);
+
+    /**
+     * Flush held-back items, then shut down the worker threads.
+     *
+     * @see WorkerGroup::stop
+     */
+    void stop();
+
     /// Return the data to the circular buffer
     void freeItem(boost::shared_ptr<AsyncWriterItem> item);
 
     /**
      * Constructor.
      *
-     * @param numWorkers   Number of workers in the pool.
-     * @param bufferSize   Bytes to allocate in the buffer.
+     * @param numWorkers    Number of workers in the pool.
+     * @param bufferSize    Bytes to allocate in the buffer.
+     * @param coalesceBytes Adjacent items are coalesced until there are at least this
+     *                      many bytes. If zero, every item is written separately.
+     * @param ordered       If true, batches are written strictly in the order they
+     *                      were queued, even with several workers. This is needed for
+     *                      writers that only accept sequential writes.
      */
-    explicit AsyncWriter(std::size_t numWorkers, std::size_t bufferSize);
+    explicit AsyncWriter(std::size_t numWorkers, std::size_t bufferSize,
+                         std::size_t coalesceBytes = 0, bool ordered = false);
 
 private:
     typedef WorkerGroup<AsyncWriterItem, detail::AsyncWriterWorker, AsyncWriter> Base;
+    friend class detail::AsyncWriterWorker;
 
-    CircularBuffer buffer;
+    LockFreeCircularBuffer buffer;
+
+    const std::size_t coalesceBytes;   ///< See @ref AsyncWriter::AsyncWriter
+    const bool ordered;                ///< See @ref AsyncWriter::AsyncWriter
+
+    /// Protects @ref pending, @ref pendingBytes and @ref nextTicket
+    boost::mutex pendingMutex;
+    /// First item of a run being coalesced, or null
+    boost::shared_ptr<AsyncWriterItem> pending;
+    /// Total bytes in @ref pending and the items merged onto it
+    std::size_t pendingBytes;
+    /// Ticket for the next batch to be queued
+    std::tr1::uint64_t nextTicket;
+
+    /// Protects @ref completed and @ref completedOutOfOrder
+    boost::mutex completedMutex;
+    /// Signalled when @ref completed changes
+    boost::condition_variable completedCondition;
+    /// Number of batches that have been written with no gaps before them
+    std::tr1::uint64_t completed;
+    /// Tickets of written batches that are not yet included in @ref completed
+    std::set<std::tr1::uint64_t> completedOutOfOrder;
+
+    /**
+     * Send @ref pending to the workers, if there is one.
+     * @pre @ref pendingMutex is held.
+     */
+    void flushPending();
+
+    /**
+     * Called by the workers to write a batch. In ordered mode, this first
+     * waits until all earlier batches have been written.
+     */
+    void write(Timeplot::Worker &tworker, AsyncWriterItem &item);
 };
 
 #endif /* !ASYNC_IO */
@@ -31,8 +31,12 @@
 #if (HAVE_PREAD || HAVE_PWRITE) && !defined(_POSIX_C_SOURCE)
 # define _POSIX_C_SOURCE 200809L
 #endif
+#if (HAVE_O_DIRECT || HAVE_PWRITEV) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1
+#endif
 #include <cstddef>
 #include <limits>
+#include <algorithm>
 #include <string>
 #include <stdexcept>
 #include <fstream>
@@ -48,6 +52,9 @@
 #include <boost/thread/mutex.hpp>
 #include "errors.h"
 #include "binary_io.h"
+#include "pod_buffer.h"
+#include "statistics.h"
+#include "timer.h"
 
 #if HAVE_OPEN && HAVE_CLOSE && HAVE_PREAD && HAVE_PWRITE
 # define SYSCALL_IO_POSIX 1
@@ -62,12 +69,67 @@
 # include <sys/types.h>
 # include <sys/stat.h>
 #endif
+#if SYSCALL_IO_POSIX && HAVE_PWRITEV
+# include <vector>
+# include <algorithm>
+# include <sys/uio.h>
+#endif
 
 #if SYSCALL_IO_WIN32
 # include <windows.h>
 #endif
 
-BinaryIO::BinaryIO() : isOpen_(false)
+#if HAVE_MADVISE
+# include <sys/mman.h>
+#endif
+#if HAVE_MADVISE && HAVE_SYSCONF
+# include <unistd.h>
+#endif
+
+#if SYSCALL_IO_POSIX && HAVE_MMAP && HAVE_MSYNC
+# define MMAP_IO 1
+# include <cstring>
+# include <sys/mman.h>
+#endif
+
+#if SYSCALL_IO_POSIX && HAVE_LINUX_IO_URING_H
+# define URING_IO 1
+# include <algorithm>
+# include <cstring>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+# include <linux/io_uring.h>
+#endif
+
+#if SYSCALL_IO_POSIX && HAVE_O_DIRECT
+# define DIRECT_IO 1
+# include <algorithm>
+# include <cstring>
+#endif
+
+#if HAVE_ZSTD_H
+# define ZSTD_IO 1
+# include <algorithm>
+# include <vector>
+# include <boost/thread/thread.hpp>
+# include <zstd.h>
+#endif
+
+#if HAVE_CURL_CURL_H
+# define HTTP_IO 1
+# include <algorithm>
+# include <cstring>
+# include <vector>
+# include <list>
+# include <sstream>
+# include <boost/shared_ptr.hpp>
+# include <boost/thread/once.hpp>
+# include <curl/curl.h>
+#endif
+
+BinaryIO::BinaryIO() : isOpen_(false), throughput(NULL)
 {
 }
 
@@ -91,6 +153,7 @@ void BinaryIO::open(const boost::filesystem::path &filename)
     }
     isOpen_ = true;
     filename_ = filenameStr;
+    throughput = &Statistics::getStatistic<Statistics::Throughput>(throughputPrefix() + filenameStr);
 }
 
 void BinaryIO::close()
@@ -119,12 +182,20 @@ const std::string &BinaryIO::filename() const
     return filename_;
 }
 
+const char *BinaryReader::throughputPrefix() const
+{
+    return "io.read.";
+}
+
 std::size_t BinaryReader::read(void *buf, std::size_t count, offset_type offset) const
 {
     MLSGPU_ASSERT(isOpen(), state_error);
     try
     {
-        return readImpl(buf, count, offset);
+        Timer timer;
+        std::size_t ans = readImpl(buf, count, offset);
+        getThroughput().add(ans, timer.getElapsed());
+        return ans;
     }
     catch (boost::exception &e)
     {
@@ -147,12 +218,53 @@ BinaryIO::offset_type BinaryReader::size() const
     }
 }
 
+void BinaryReader::prefetch(offset_type offset, offset_type count) const
+{
+    MLSGPU_ASSERT(isOpen(), state_error);
+    prefetchImpl(offset, count);
+}
+
+void BinaryReader::prefetchImpl(offset_type offset, offset_type count) const
+{
+    (void) offset;
+    (void) count;
+}
+
+const char *BinaryReader::data() const
+{
+    MLSGPU_ASSERT(isOpen(), state_error);
+    return dataImpl();
+}
+
+const char *BinaryReader::dataImpl() const
+{
+    return NULL;
+}
+
+BinaryWriter::BinaryWriter() : truncate(true)
+{
+}
+
+void BinaryWriter::setTruncate(bool truncate)
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    this->truncate = truncate;
+}
+
+const char *BinaryWriter::throughputPrefix() const
+{
+    return "io.write.";
+}
+
 std::size_t BinaryWriter::write(const void *buf, std::size_t count, offset_type offset) const
 {
     MLSGPU_ASSERT(isOpen(), state_error);
     try
     {
-        return writeImpl(buf, count, offset);
+        Timer timer;
+        std::size_t ans = writeImpl(buf, count, offset);
+        getThroughput().add(ans, timer.getElapsed());
+        return ans;
     }
     catch (boost::exception &e)
     {
@@ -161,6 +273,31 @@ std::size_t BinaryWriter::write(const void *buf, std::size_t count, offset_type
     }
 }
 
+std::size_t BinaryWriter::writev(const ConstBuffer *bufs, std::size_t n, offset_type offset) const
+{
+    MLSGPU_ASSERT(isOpen(), state_error);
+    try
+    {
+        Timer timer;
+        std::size_t ans = writevImpl(bufs, n, offset);
+        getThroughput().add(ans, timer.getElapsed());
+        return ans;
+    }
+    catch (boost::exception &e)
+    {
+        e << boost::errinfo_file_name(filename());
+        throw;
+    }
+}
+
+std::size_t BinaryWriter::writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const
+{
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < n; i++)
+        total += writeImpl(bufs[i].buf, bufs[i].count, offset + total);
+    return total;
+}
+
 void BinaryWriter::resize(offset_type size) const
 {
     MLSGPU_ASSERT(isOpen(), state_error);
@@ -224,7 +361,15 @@ void StreamReader::openImpl(const boost::filesystem::path &path)
 
 void StreamWriter::openImpl(const boost::filesystem::path &path)
 {
-    if (!fb.open(path, std::ios::out | std::ios::binary | std::ios::trunc))
+    std::ios::openmode mode = std::ios::out | std::ios::binary | std::ios::trunc;
+    if (!getTruncate())
+    {
+        // in|out does not truncate, but also does not create the file
+        boost::filesystem::ofstream create(path, std::ios::binary | std::ios::app);
+        create.close();
+        mode = std::ios::in | std::ios::out | std::ios::binary;
+    }
+    if (!fb.open(path, mode))
     {
         throw boost::enable_error_info(std::ios::failure("Open failed"))
             << boost::errinfo_errno(errno);
@@ -305,6 +450,8 @@ private:
     virtual void closeImpl();
     virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
     virtual offset_type sizeImpl() const;
+    virtual void prefetchImpl(offset_type offset, offset_type count) const;
+    virtual const char *dataImpl() const;
 };
 
 void MmapReader::openImpl(const boost::filesystem::path &path)
@@ -338,13 +485,39 @@ BinaryIO::offset_type MmapReader::sizeImpl() const
     return mapping.size();
 }
 
+void MmapReader::prefetchImpl(offset_type offset, offset_type count) const
+{
+#if HAVE_MADVISE
+    if (offset >= mapping.size())
+        return;
+    count = std::min(count, offset_type(mapping.size()) - offset);
+# if HAVE_SYSCONF
+    const offset_type pageSize = sysconf(_SC_PAGESIZE);
+# else
+    const offset_type pageSize = 4096;
+# endif
+    // madvise requires a page-aligned start; the mapping itself is page-aligned
+    const offset_type start = offset - offset % pageSize;
+    // Errors are deliberately ignored, since this is only a hint
+    (void) madvise(const_cast<char *>(mapping.data()) + start, count + (offset - start), MADV_WILLNEED);
+#else
+    (void) offset;
+    (void) count;
+#endif
+}
+
+const char *MmapReader::dataImpl() const
+{
+    return mapping.data();
+}
+
 /**
  * Implementation of @ref BinaryReader using low-level operating system calls.
  * This makes it unbuffered (unlike @ref StreamReader).
  */
 class SyscallReader : public BinaryReader
 {
-private:
+protected:
 #if SYSCALL_IO_POSIX
     int fd;
 #endif
@@ -356,6 +529,7 @@ private:
     virtual void closeImpl();
     virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
     virtual offset_type sizeImpl() const;
+    virtual void prefetchImpl(offset_type offset, offset_type count) const;
 
 public:
     virtual ~SyscallReader();
@@ -367,7 +541,7 @@ public:
  */
 class SyscallWriter : public BinaryWriter
 {
-private:
+protected:
 #if SYSCALL_IO_POSIX
     int fd;
 #endif
@@ -378,6 +552,9 @@ private:
     virtual void openImpl(const boost::filesystem::path &path);
     virtual void closeImpl();
     virtual std::size_t writeImpl(const void *buf, std::size_t count, offset_type offset) const;
+#if SYSCALL_IO_POSIX && HAVE_PWRITEV
+    virtual std::size_t writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const;
+#endif
     virtual void resizeImpl(offset_type type) const;
 
 public:
@@ -410,7 +587,7 @@ void SyscallReader::openImpl(const boost::filesystem::path &path)
 
 void SyscallWriter::openImpl(const boost::filesystem::path &path)
 {
-    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (getTruncate() ? O_TRUNC : 0), 0666);
     if (fd < 0)
     {
         throw boost::enable_error_info(std::ios::failure("Could not open file"))
@@ -468,6 +645,17 @@ std::size_t SyscallReader::readImpl(void *buf, size_t count, offset_type offset)
     return count;
 }
 
+void SyscallReader::prefetchImpl(offset_type offset, offset_type count) const
+{
+#if HAVE_POSIX_FADVISE
+    // Errors are deliberately ignored, since this is only a hint
+    (void) posix_fadvise(fd, offset, count, POSIX_FADV_WILLNEED);
+#else
+    (void) offset;
+    (void) count;
+#endif
+}
+
 std::size_t SyscallWriter::writeImpl(const void *buf, size_t count, offset_type offset) const
 {
     size_t remain = count;
@@ -495,6 +683,61 @@ std::size_t SyscallWriter::writeImpl(const void *buf, size_t count, offset_type
     return count;
 }
 
+#if HAVE_PWRITEV
+std::size_t SyscallWriter::writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const
+{
+    // Linux's IOV_MAX, which is not exposed under _POSIX_C_SOURCE
+    const std::size_t maxIovecs = 1024;
+
+    std::vector<struct iovec> iov(n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        iov[i].iov_base = const_cast<void *>(bufs[i].buf);
+        iov[i].iov_len = bufs[i].count;
+    }
+
+    std::size_t total = 0;
+    std::size_t first = 0;
+    while (true)
+    {
+        while (first < n && iov[first].iov_len == 0)
+            first++;
+        if (first == n)
+            break;
+
+        int cnt = std::min(n - first, maxIovecs);
+        ssize_t bytes = ::pwritev(fd, &iov[first], cnt, offset);
+        if (bytes < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            throw boost::enable_error_info(std::ios::failure("write failed"))
+                << boost::errinfo_errno(errno);
+        }
+        else if (bytes == 0)
+        {
+            throw boost::enable_error_info(std::ios::failure("pwritev did not write any bytes"));
+        }
+
+        offset += bytes;
+        total += bytes;
+        // Skip over what was written, which may end part-way through a buffer
+        std::size_t remain = bytes;
+        while (first < n && remain >= iov[first].iov_len)
+        {
+            remain -= iov[first].iov_len;
+            first++;
+        }
+        if (remain > 0)
+        {
+            iov[first].iov_base = (char *) iov[first].iov_base + remain;
+            iov[first].iov_len -= remain;
+        }
+    }
+    return total;
+}
+#endif
+
 void SyscallWriter::resizeImpl(offset_type size) const
 {
     if (ftruncate(fd, size) != 0)
@@ -528,7 +771,7 @@ void SyscallWriter::openImpl(const boost::filesystem::path &path)
                     GENERIC_WRITE,
                     0,
                     NULL,
-                    CREATE_ALWAYS,
+                    getTruncate() ? CREATE_ALWAYS : OPEN_ALWAYS,
                     FILE_ATTRIBUTE_NORMAL,
                     NULL);
     if (fd == INVALID_HANDLE_VALUE)
@@ -597,6 +840,12 @@ std::size_t SyscallReader::readImpl(void *buf, size_t count, offset_type offset)
     return count;
 }
 
+void SyscallReader::prefetchImpl(offset_type offset, offset_type count) const
+{
+    (void) offset;
+    (void) count;
+}
+
 std::size_t SyscallWriter::writeImpl(const void *buf, size_t count, offset_type offset) const
 {
     std::size_t remain = count;
@@ -650,6 +899,1002 @@ void SyscallWriter::resizeImpl(offset_type size) const
 
 #endif // SYSCALL_IO_WIN32
 
+#if URING_IO
+
+/**
+ * Minimal wrapper around a Linux io_uring instance, driven directly through
+ * the system calls so that no extra library is required. It only supports
+ * the usage pattern needed by @ref UringReader and @ref UringWriter: submit
+ * a batch of vectored reads or writes against a single file and wait for all
+ * of them to complete.
+ *
+ * The class is not thread-safe; callers must serialize access.
+ */
+class Uring : public boost::noncopyable
+{
+public:
+    /// Maximum number of requests in flight at once
+    static const unsigned int depth = 8;
+    /// Size of each individual request
+    static const std::size_t chunkSize = 1024 * 1024;
+
+    Uring();
+    ~Uring();
+
+    /**
+     * Create the ring.
+     *
+     * @return true on success, false if the kernel does not support io_uring
+     * (in which case errno is set).
+     */
+    bool setup();
+
+    /// Tear down the ring, if it was created.
+    void teardown();
+
+    /// Whether the ring has been successfully set up.
+    bool isSetup() const { return ringFd >= 0; }
+
+    /**
+     * Transfer @a count bytes between @a buf and @a fd at @a offset, using up
+     * to @ref depth concurrent requests of at most @ref chunkSize bytes. The
+     * return value is the number of bytes transferred contiguously from the
+     * start of the range; if any request was short, the caller must complete
+     * the remainder itself.
+     *
+     * @throw std::ios::failure if the kernel reports an error.
+     */
+    std::size_t transfer(int fd, int opcode, void *buf, std::size_t count, BinaryIO::offset_type offset);
+
+private:
+    int ringFd;
+
+    /**
+     * Return the ring to an idle state after a failed @ref transfer. The last
+     * @a unsubmitted queued requests, which the kernel has not consumed, are
+     * withdrawn, and @a inFlight completions are waited for and discarded. If
+     * the kernel cannot be waited on, the ring is torn down instead, so that
+     * later requests fall back to plain system calls.
+     */
+    void abandon(unsigned int unsubmitted, unsigned int inFlight);
+
+    void *sqPtr, *cqPtr;
+    std::size_t sqMapSize, cqMapSize;
+    struct io_uring_sqe *sqes;
+    std::size_t sqesMapSize;
+
+    unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+
+    struct iovec iov[depth];
+    std::size_t lengths[depth];
+};
+
+const unsigned int Uring::depth;
+const std::size_t Uring::chunkSize;
+
+Uring::Uring() : ringFd(-1), sqPtr(MAP_FAILED), cqPtr(MAP_FAILED), sqes(NULL)
+{
+}
+
+Uring::~Uring()
+{
+    teardown();
+}
+
+bool Uring::setup()
+{
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0)
+        return false;
+    ringFd = fd;
+
+    sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sqMapSize = cqMapSize = std::max(sqMapSize, cqMapSize);
+
+    sqPtr = mmap(NULL, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 ringFd, IORING_OFF_SQ_RING);
+    if (sqPtr == MAP_FAILED)
+    {
+        teardown();
+        return false;
+    }
+    if (single)
+        cqPtr = sqPtr;
+    else
+    {
+        cqPtr = mmap(NULL, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ringFd, IORING_OFF_CQ_RING);
+        if (cqPtr == MAP_FAILED)
+        {
+            teardown();
+            return false;
+        }
+    }
+    sqesMapSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqesPtr = mmap(NULL, sqesMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ringFd, IORING_OFF_SQES);
+    if (sqesPtr == MAP_FAILED)
+    {
+        teardown();
+        return false;
+    }
+    sqes = (struct io_uring_sqe *) sqesPtr;
+
+    char *sq = (char *) sqPtr;
+    char *cq = (char *) cqPtr;
+    sqHead = (unsigned int *) (sq + p.sq_off.head);
+    sqTail = (unsigned int *) (sq + p.sq_off.tail);
+    sqMask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned int *) (sq + p.sq_off.array);
+    cqHead = (unsigned int *) (cq + p.cq_off.head);
+    cqTail = (unsigned int *) (cq + p.cq_off.tail);
+    cqMask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return true;
+}
+
+void Uring::teardown()
+{
+    int save = errno;
+    if (sqes != NULL)
+        munmap(sqes, sqesMapSize);
+    if (cqPtr != MAP_FAILED && cqPtr != sqPtr)
+        munmap(cqPtr, cqMapSize);
+    if (sqPtr != MAP_FAILED)
+        munmap(sqPtr, sqMapSize);
+    if (ringFd >= 0)
+        ::close(ringFd);
+    sqes = NULL;
+    sqPtr = cqPtr = MAP_FAILED;
+    ringFd = -1;
+    errno = save;
+}
+
+std::size_t Uring::transfer(int fd, int opcode, void *buf, std::size_t count, BinaryIO::offset_type offset)
+{
+    std::size_t done = 0;
+    while (done < count)
+    {
+        // Queue up as many requests as the ring allows
+        unsigned int n = 0;
+        unsigned int tail = *sqTail;
+        while (n < depth && done + n * chunkSize < count)
+        {
+            std::size_t pos = done + n * chunkSize;
+            std::size_t len = std::min(chunkSize, count - pos);
+            iov[n].iov_base = (char *) buf + pos;
+            iov[n].iov_len = len;
+            lengths[n] = len;
+
+            unsigned int idx = tail & *sqMask;
+            struct io_uring_sqe *sqe = &sqes[idx];
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->off = offset + pos;
+            sqe->addr = (unsigned long) &iov[n];
+            sqe->len = 1;
+            sqe->user_data = n;
+            sqArray[idx] = idx;
+            tail++;
+            n++;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+        // Submit and reap, retrying on signal interruption
+        std::size_t results[depth];
+        unsigned int toSubmit = n;
+        unsigned int reaped = 0;
+        while (reaped < n)
+        {
+            int ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN)
+                    continue;
+                int err = errno;
+                abandon(toSubmit, n - toSubmit - reaped);
+                throw boost::enable_error_info(std::ios::failure("io_uring_enter failed"))
+                    << boost::errinfo_errno(err);
+            }
+            toSubmit -= std::min((unsigned int) ret, toSubmit);
+
+            int err = 0;
+            unsigned int head = *cqHead;
+            while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+            {
+                const struct io_uring_cqe *cqe = &cqes[head & *cqMask];
+                if (cqe->res < 0)
+                {
+                    if (err == 0)
+                        err = -cqe->res;
+                }
+                else
+                    results[cqe->user_data] = cqe->res;
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            if (err != 0)
+            {
+                abandon(toSubmit, n - toSubmit - reaped);
+                throw boost::enable_error_info(std::ios::failure("io_uring request failed"))
+                    << boost::errinfo_errno(err);
+            }
+        }
+
+        for (unsigned int i = 0; i < n; i++)
+        {
+            done += results[i];
+            if (results[i] < lengths[i])
+                return done;
+        }
+    }
+    return done;
+}
+
+void Uring::abandon(unsigned int unsubmitted, unsigned int inFlight)
+{
+    // The kernel has not consumed these, so they can simply be withdrawn
+    __atomic_store_n(sqTail, *sqTail - unsubmitted, __ATOMIC_RELEASE);
+
+    unsigned int head = *cqHead;
+    while (inFlight > 0)
+    {
+        if (syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            && errno != EINTR && errno != EAGAIN)
+        {
+            // The completions cannot be waited for, so give up on the ring
+            teardown();
+            return;
+        }
+        while (inFlight > 0 && head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            head++;
+            inFlight--;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Implementation of @ref BinaryReader that uses io_uring to keep several
+ * reads in flight for a single large request. Small requests, and the tail of
+ * a request that came back short, are handled with plain @c pread. If the
+ * kernel does not support io_uring, it silently behaves exactly like
+ * @ref SyscallReader.
+ */
+class UringReader : public SyscallReader
+{
+private:
+    mutable boost::mutex mutex;
+    mutable Uring ring;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
+
+public:
+    virtual ~UringReader();
+};
+
+/**
+ * Implementation of @ref BinaryWriter that uses io_uring to keep several
+ * writes in flight for a single large request. As for @ref UringReader, it
+ * falls back to the behaviour of @ref SyscallWriter if io_uring is not
+ * available.
+ */
+class UringWriter : public SyscallWriter
+{
+private:
+    mutable boost::mutex mutex;
+    mutable Uring ring;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t writeImpl(const void *buf, std::size_t count, offset_type offset) const;
+
+public:
+    virtual ~UringWriter();
+};
+
+UringReader::~UringReader()
+{
+    if (isOpen())
+        close();
+}
+
+UringWriter::~UringWriter()
+{
+    if (isOpen())
+        close();
+}
+
+void UringReader::openImpl(const boost::filesystem::path &path)
+{
+    SyscallReader::openImpl(path);
+    ring.setup();
+}
+
+void UringWriter::openImpl(const boost::filesystem::path &path)
+{
+    SyscallWriter::openImpl(path);
+    ring.setup();
+}
+
+void UringReader::closeImpl()
+{
+    ring.teardown();
+    SyscallReader::closeImpl();
+}
+
+void UringWriter::closeImpl()
+{
+    ring.teardown();
+    SyscallWriter::closeImpl();
+}
+
+std::size_t UringReader::readImpl(void *buf, std::size_t count, offset_type offset) const
+{
+    std::size_t done = 0;
+    if (count > Uring::chunkSize && ring.isSetup())
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        done = ring.transfer(fd, IORING_OP_READV, buf, count, offset);
+    }
+    if (done < count)
+        done += SyscallReader::readImpl((char *) buf + done, count - done, offset + done);
+    return done;
+}
+
+std::size_t UringWriter::writeImpl(const void *buf, std::size_t count, offset_type offset) const
+{
+    std::size_t done = 0;
+    if (count > Uring::chunkSize && ring.isSetup())
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        done = ring.transfer(fd, IORING_OP_WRITEV, const_cast<void *>(buf), count, offset);
+    }
+    if (done < count)
+        done += SyscallWriter::writeImpl((const char *) buf + done, count - done, offset + done);
+    return done;
+}
+
+#endif // URING_IO
+
+#if DIRECT_IO
+
+/**
+ * Implementation of @ref BinaryReader that opens the file with @c O_DIRECT,
+ * so that data is transferred straight from the device and does not pollute
+ * the OS page cache. Since @c O_DIRECT requires the buffer, offset and length
+ * to be aligned to the device block size, unaligned requests are serviced
+ * through an aligned bounce buffer. Requests that are already suitably
+ * aligned are read directly into the caller's buffer.
+ *
+ * If the filesystem does not support @c O_DIRECT, the file is opened
+ * normally and this class behaves like @ref SyscallReader.
+ */
+class DirectReader : public SyscallReader
+{
+public:
+    /// Alignment required for buffers, offsets and lengths
+    static const std::size_t alignment = 4096;
+    /// Size of the bounce buffer
+    static const std::size_t bounceSize = 4 * 1024 * 1024;
+
+    virtual ~DirectReader();
+
+private:
+    mutable boost::mutex mutex;
+    mutable PODBuffer<char, AlignedAllocator<char, alignment> > bounce;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
+    /// Does nothing, since populating the page cache would defeat @c O_DIRECT
+    virtual void prefetchImpl(offset_type offset, offset_type count) const;
+};
+
+const std::size_t DirectReader::alignment;
+const std::size_t DirectReader::bounceSize;
+
+DirectReader::~DirectReader()
+{
+    if (isOpen())
+        close();
+}
+
+void DirectReader::openImpl(const boost::filesystem::path &path)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (fd < 0 && errno == EINVAL)
+        fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw boost::enable_error_info(std::ios::failure("Could not open file"))
+            << boost::errinfo_errno(errno);
+    }
+}
+
+std::size_t DirectReader::readImpl(void *buf, std::size_t count, offset_type offset) const
+{
+    const std::size_t mask = alignment - 1;
+    if ((((std::size_t) buf | count | offset) & mask) == 0)
+        return SyscallReader::readImpl(buf, count, offset);
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    bounce.reserve(bounceSize, false);
+
+    std::size_t done = 0;
+    while (done < count)
+    {
+        const offset_type pos = offset + done;
+        const offset_type alignedPos = pos & ~offset_type(mask);
+        const std::size_t skip = pos - alignedPos;
+        const std::size_t want = std::min(count - done, bounceSize - skip);
+        const std::size_t alignedLen = (skip + want + mask) & ~mask;
+
+        std::size_t got = SyscallReader::readImpl(bounce.data(), alignedLen, alignedPos);
+        if (got <= skip)
+            break;
+        std::size_t useful = std::min(want, got - skip);
+        std::memcpy((char *) buf + done, bounce.data() + skip, useful);
+        done += useful;
+        if (got < alignedLen)
+            break; // end of file
+    }
+    return done;
+}
+
+void DirectReader::prefetchImpl(offset_type offset, offset_type count) const
+{
+    (void) offset;
+    (void) count;
+}
+
+#endif // DIRECT_IO
+
+#if ZSTD_IO
+
+/**
+ * Implementation of @ref BinaryWriter that compresses the file as a single
+ * zstd stream. Since the stream cannot be modified once emitted, writes must
+ * be made in increasing order of offset (as @ref FastPly::Writer does when
+ * the vertices and triangles are written in order). Gaps between writes, and
+ * any space added by @ref resize beyond the last write, are filled with zeros.
+ *
+ * Compression is done on the zstd worker pool if the library supports it,
+ * so that the calling thread is only responsible for feeding it.
+ */
+class ZstdWriter : public SyscallWriter
+{
+private:
+    mutable boost::mutex mutex;
+    mutable ZSTD_CCtx *ctx;
+    mutable std::vector<char> outBuffer;
+    /// Uncompressed bytes consumed so far
+    mutable offset_type next;
+    /// Uncompressed size requested with @ref resize
+    mutable offset_type size;
+    /// Compressed bytes written to the file so far
+    mutable offset_type written;
+
+    /**
+     * Pass data through the compressor and write out whatever it emits.
+     * @pre @ref mutex is held.
+     */
+    void compress(const void *buf, std::size_t count, ZSTD_EndDirective mode) const;
+
+    /**
+     * Feed zeros to the compressor until @a offset is reached.
+     * @pre @ref mutex is held.
+     */
+    void pad(offset_type offset) const;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t writeImpl(const void *buf, std::size_t count, offset_type offset) const;
+    /// Goes through the compressor rather than @ref SyscallWriter's vectored write
+    virtual std::size_t writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const
+    {
+        return BinaryWriter::writevImpl(bufs, n, offset);
+    }
+    virtual void resizeImpl(offset_type size) const;
+
+public:
+    ZstdWriter() : ctx(NULL), next(0), size(0), written(0) {}
+    virtual ~ZstdWriter();
+};
+
+ZstdWriter::~ZstdWriter()
+{
+    if (isOpen())
+        close();
+}
+
+void ZstdWriter::compress(const void *buf, std::size_t count, ZSTD_EndDirective mode) const
+{
+    ZSTD_inBuffer in = { buf, count, 0 };
+    bool done;
+    do
+    {
+        ZSTD_outBuffer out = { &outBuffer[0], outBuffer.size(), 0 };
+        std::size_t remaining = ZSTD_compressStream2(ctx, &out, &in, mode);
+        if (ZSTD_isError(remaining))
+            throw boost::enable_error_info(std::ios::failure(
+                    std::string("zstd compression failed: ") + ZSTD_getErrorName(remaining)));
+        written += SyscallWriter::writeImpl(&outBuffer[0], out.pos, written);
+        done = (mode == ZSTD_e_continue) ? in.pos == in.size : remaining == 0;
+    } while (!done);
+}
+
+void ZstdWriter::pad(offset_type offset) const
+{
+    static const char zeros[65536] = {};
+    while (next < offset)
+    {
+        std::size_t count = std::min(offset - next, offset_type(sizeof(zeros)));
+        compress(zeros, count, ZSTD_e_continue);
+        next += count;
+    }
+}
+
+void ZstdWriter::openImpl(const boost::filesystem::path &path)
+{
+    if (!getTruncate())
+        throw std::invalid_argument("zstd writer cannot append to an existing file");
+    SyscallWriter::openImpl(path);
+    ctx = ZSTD_createCCtx();
+    if (ctx == NULL)
+    {
+        SyscallWriter::closeImpl();
+        throw std::bad_alloc();
+    }
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, ZSTD_CLEVEL_DEFAULT);
+    // Fails harmlessly if the library was built without multithreading
+    ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers, boost::thread::hardware_concurrency());
+    outBuffer.resize(ZSTD_CStreamOutSize());
+    next = 0;
+    size = 0;
+    written = 0;
+}
+
+void ZstdWriter::closeImpl()
+{
+    try
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        pad(size);
+        compress(NULL, 0, ZSTD_e_end);
+    }
+    catch (...)
+    {
+        ZSTD_freeCCtx(ctx);
+        ctx = NULL;
+        SyscallWriter::closeImpl();
+        throw;
+    }
+    ZSTD_freeCCtx(ctx);
+    ctx = NULL;
+    SyscallWriter::closeImpl();
+}
+
+std::size_t ZstdWriter::writeImpl(const void *buf, std::size_t count, offset_type offset) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (count == 0)
+        return 0;
+    if (offset < next)
+        throw boost::enable_error_info(std::ios::failure("Compressed output must be written sequentially"));
+    pad(offset);
+    compress(buf, count, ZSTD_e_continue);
+    next += count;
+    return count;
+}
+
+void ZstdWriter::resizeImpl(offset_type size) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (size < next)
+        throw boost::enable_error_info(std::ios::failure("Compressed output cannot be truncated"));
+    this->size = size;
+}
+
+#endif // ZSTD_IO
+
+#if MMAP_IO
+
+/**
+ * Implementation of @ref BinaryWriter that copies data into a shared mapping
+ * of the file, which saves a system call per write and lets several threads
+ * fill disjoint regions of the file without any coordination. The mapping
+ * covers the file as it was when it was opened or last resized, so callers
+ * should size the file with @ref resize before writing (as @ref
+ * FastPly::Writer does). Writes that extend past the mapping, or any writes
+ * at all if the file could not be mapped, fall back to @c pwrite.
+ *
+ * The space for the file is allocated when it is resized, where the file
+ * system supports it. Otherwise running out of disk space while writing
+ * through the mapping would raise @c SIGBUS rather than an exception, so the
+ * mapping is not used. Data is flushed with @c msync when the file is closed,
+ * so that write errors are reported.
+ */
+class MmapWriter : public SyscallWriter
+{
+private:
+    mutable char *base;              ///< Start of the mapping, or @c NULL if not mapped
+    mutable offset_type mapped;      ///< Bytes covered by the mapping
+
+    /**
+     * Map the first @a size bytes of the file, if possible. Failure is not
+     * an error, since writes can fall back to @c pwrite.
+     * @pre The file is not mapped.
+     */
+    void map(offset_type size) const;
+
+    /**
+     * Remove the mapping, if any. With @a sync, the data is first flushed
+     * to the file so that write errors are reported.
+     */
+    void unmap(bool sync) const;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t writeImpl(const void *buf, std::size_t count, offset_type offset) const;
+    virtual std::size_t writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const;
+    virtual void resizeImpl(offset_type size) const;
+
+public:
+    MmapWriter() : base(NULL), mapped(0) {}
+    virtual ~MmapWriter();
+};
+
+MmapWriter::~MmapWriter()
+{
+    if (isOpen())
+        close();
+}
+
+void MmapWriter::map(offset_type size) const
+{
+    if (size == 0 || size > std::numeric_limits<std::size_t>::max())
+        return;
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr != MAP_FAILED)
+    {
+        base = static_cast<char *>(ptr);
+        mapped = size;
+    }
+}
+
+void MmapWriter::unmap(bool sync) const
+{
+    if (base != NULL)
+    {
+        char *old = base;
+        const std::size_t oldSize = mapped;
+        base = NULL;
+        mapped = 0;
+        const bool synced = !sync || msync(old, oldSize, MS_SYNC) == 0;
+        const int savedErrno = errno;
+        munmap(old, oldSize);
+        if (!synced)
+            throw boost::enable_error_info(std::ios::failure("msync failed"))
+                << boost::errinfo_errno(savedErrno);
+    }
+}
+
+void MmapWriter::openImpl(const boost::filesystem::path &path)
+{
+    // A shared writable mapping needs read access too
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | (getTruncate() ? O_TRUNC : 0), 0666);
+    if (fd < 0)
+    {
+        throw boost::enable_error_info(std::ios::failure("Could not open file"))
+            << boost::errinfo_errno(errno);
+    }
+
+    // An existing file (see setTruncate) is assumed to be allocated already
+    struct stat buf;
+    if (fstat(fd, &buf) == 0)
+        map(buf.st_size);
+}
+
+void MmapWriter::closeImpl()
+{
+    try
+    {
+        unmap(true);
+    }
+    catch (...)
+    {
+        ::close(fd);
+        throw;
+    }
+    SyscallWriter::closeImpl();
+}
+
+std::size_t MmapWriter::writeImpl(const void *buf, std::size_t count, offset_type offset) const
+{
+    if (offset <= mapped && count <= mapped - offset)
+    {
+        std::memcpy(base + offset, buf, count);
+        return count;
+    }
+    return SyscallWriter::writeImpl(buf, count, offset);
+}
+
+std::size_t MmapWriter::writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const
+{
+    offset_type total = 0;
+    for (std::size_t i = 0; i < n; i++)
+        total += bufs[i].count;
+    if (offset <= mapped && total <= mapped - offset)
+    {
+        for (std::size_t i = 0; i < n; i++)
+        {
+            std::memcpy(base + offset, bufs[i].buf, bufs[i].count);
+            offset += bufs[i].count;
+        }
+        return total;
+    }
+#if HAVE_PWRITEV
+    return SyscallWriter::writevImpl(bufs, n, offset);
+#else
+    for (std::size_t i = 0; i < n; i++)
+    {
+        SyscallWriter::writeImpl(bufs[i].buf, bufs[i].count, offset);
+        offset += bufs[i].count;
+    }
+    return total;
+#endif
+}
+
+void MmapWriter::resizeImpl(offset_type size) const
+{
+    // The pages stay in the page cache, so there is no need to flush them here
+    unmap(false);
+    SyscallWriter::resizeImpl(size);
+#if HAVE_POSIX_FALLOCATE
+    // Returns the error rather than setting errno
+    if (size > 0 && posix_fallocate(fd, 0, size) == 0)
+        map(size);
+#endif
+}
+
+#endif // MMAP_IO
+
+#if HTTP_IO
+
+/**
+ * Implementation of @ref BinaryReader that fetches a file from an HTTP(S)
+ * server (such as an object store that serves its objects over HTTP) with
+ * range requests, so that only the parts that are read are transferred. The
+ * path is the URL. Reads are rounded out to whole blocks, the blocks that a
+ * read needs are requested in parallel, and recently used blocks are kept so
+ * that neighbouring small reads (such as header parsing) do not each make a
+ * request.
+ */
+class HttpReader : public BinaryReader
+{
+private:
+    typedef boost::shared_ptr<std::vector<char> > Block;
+
+    /// Bytes per request
+    static const offset_type blockSize = 4 * 1024 * 1024;
+    /// Number of blocks kept after reads complete
+    static const std::size_t cacheBlocks = 16;
+    /// Maximum number of concurrent connections per read
+    static const long maxConnections = 8;
+
+    std::string url;
+    offset_type fileSize;
+
+    mutable boost::mutex mutex;                               ///< Protects @ref cache
+    mutable std::list<std::pair<offset_type, Block> > cache;  ///< Blocks by index, most recent first
+
+    /// Fetch the blocks with indices in @a indices, in parallel
+    std::vector<Block> fetch(const std::vector<offset_type> &indices) const;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
+    virtual offset_type sizeImpl() const;
+
+public:
+    HttpReader() : fileSize(0) {}
+    virtual ~HttpReader();
+};
+
+static boost::once_flag curlInitFlag = BOOST_ONCE_INIT;
+
+static void curlInit()
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static std::size_t curlAppend(char *ptr, std::size_t size, std::size_t nmemb, void *user)
+{
+    std::vector<char> *out = static_cast<std::vector<char> *>(user);
+    out->insert(out->end(), ptr, ptr + size * nmemb);
+    return size * nmemb;
+}
+
+HttpReader::~HttpReader()
+{
+    if (isOpen())
+        close();
+}
+
+void HttpReader::openImpl(const boost::filesystem::path &path)
+{
+    boost::call_once(curlInitFlag, curlInit);
+    url = path.string();
+
+    CURL *handle = curl_easy_init();
+    if (handle == NULL)
+        throw std::bad_alloc();
+    curl_easy_setopt(handle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+    CURLcode code = curl_easy_perform(handle);
+    curl_off_t length = -1;
+    if (code == CURLE_OK)
+        code = curl_easy_getinfo(handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    curl_easy_cleanup(handle);
+    if (code != CURLE_OK)
+        throw boost::enable_error_info(std::ios::failure(
+                std::string("HTTP request failed: ") + curl_easy_strerror(code)));
+    if (length < 0)
+        throw boost::enable_error_info(std::ios::failure("HTTP server did not report the size"));
+    fileSize = length;
+}
+
+void HttpReader::closeImpl()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    cache.clear();
+}
+
+std::vector<HttpReader::Block> HttpReader::fetch(const std::vector<offset_type> &indices) const
+{
+    std::vector<Block> blocks(indices.size());
+    std::vector<CURL *> handles(indices.size(), static_cast<CURL *>(NULL));
+    CURLM *multi = curl_multi_init();
+    if (multi == NULL)
+        throw std::bad_alloc();
+    curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, maxConnections);
+
+    CURLcode code = CURLE_OK;
+    for (std::size_t i = 0; i < indices.size() && code == CURLE_OK; i++)
+    {
+        const offset_type first = indices[i] * blockSize;
+        const offset_type last = std::min(first + blockSize, fileSize) - 1;
+        std::ostringstream range;
+        range << first << '-' << last;
+
+        blocks[i].reset(new std::vector<char>());
+        blocks[i]->reserve(last - first + 1);
+        handles[i] = curl_easy_init();
+        if (handles[i] == NULL)
+        {
+            code = CURLE_OUT_OF_MEMORY;
+            break;
+        }
+        curl_easy_setopt(handles[i], CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handles[i], CURLOPT_RANGE, range.str().c_str());
+        curl_easy_setopt(handles[i], CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, curlAppend);
+        curl_easy_setopt(handles[i], CURLOPT_WRITEDATA, blocks[i].get());
+        curl_multi_add_handle(multi, handles[i]);
+    }
+
+    int running = 1;
+    while (code == CURLE_OK && running > 0)
+    {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+            code = CURLE_RECV_ERROR;
+        else if (running > 0)
+            curl_multi_wait(multi, NULL, 0, 1000, NULL);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL)
+            if (msg->msg == CURLMSG_DONE && msg->data.result != CURLE_OK && code == CURLE_OK)
+                code = msg->data.result;
+    }
+
+    for (std::size_t i = 0; i < handles.size(); i++)
+        if (handles[i] != NULL)
+        {
+            curl_multi_remove_handle(multi, handles[i]);
+            curl_easy_cleanup(handles[i]);
+        }
+    curl_multi_cleanup(multi);
+
+    if (code != CURLE_OK)
+        throw boost::enable_error_info(std::ios::failure(
+                std::string("HTTP request failed: ") + curl_easy_strerror(code)));
+    for (std::size_t i = 0; i < indices.size(); i++)
+    {
+        const offset_type first = indices[i] * blockSize;
+        if (blocks[i]->size() != std::min(blockSize, fileSize - first))
+            throw boost::enable_error_info(std::ios::failure("HTTP server did not honour a range request"));
+    }
+    return blocks;
+}
+
+std::size_t HttpReader::readImpl(void *buf, std::size_t count, offset_type offset) const
+{
+    if (offset >= fileSize)
+        return 0;
+    if (count > fileSize - offset)
+        count = fileSize - offset;
+    if (count == 0)
+        return 0;
+
+    const offset_type firstBlock = offset / blockSize;
+    const offset_type lastBlock = (offset + count - 1) / blockSize;
+    std::vector<Block> blocks(lastBlock - firstBlock + 1);
+    std::vector<offset_type> missing;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        for (offset_type b = firstBlock; b <= lastBlock; b++)
+        {
+            std::list<std::pair<offset_type, Block> >::iterator pos;
+            for (pos = cache.begin(); pos != cache.end() && pos->first != b; ++pos) {}
+            if (pos != cache.end())
+            {
+                blocks[b - firstBlock] = pos->second;
+                cache.splice(cache.begin(), cache, pos);
+            }
+            else
+                missing.push_back(b);
+        }
+    }
+
+    if (!missing.empty())
+    {
+        std::vector<Block> fetched = fetch(missing);
+        boost::lock_guard<boost::mutex> lock(mutex);
+        for (std::size_t i = 0; i < missing.size(); i++)
+        {
+            blocks[missing[i] - firstBlock] = fetched[i];
+            cache.push_front(std::make_pair(missing[i], fetched[i]));
+        }
+        while (cache.size() > cacheBlocks)
+            cache.pop_back();
+    }
+
+    char *out = static_cast<char *>(buf);
+    std::size_t done = 0;
+    for (std::size_t i = 0; i < blocks.size(); i++)
+    {
+        const offset_type start = (firstBlock + i) * blockSize;
+        const offset_type skip = std::max(offset, start) - start;
+        const std::size_t n = std::min(offset_type(count - done), offset_type(blocks[i]->size()) - skip);
+        std::memcpy(out + done, &(*blocks[i])[skip], n);
+        done += n;
+    }
+    return done;
+}
+
+BinaryIO::offset_type HttpReader::sizeImpl() const
+{
+    return fileSize;
+}
+
+#endif // HTTP_IO
+
 } // anonymous namespace
 
 BinaryReaderSource::BinaryReaderSource(const BinaryReader &reader)
@@ -699,6 +1944,15 @@ std::map<std::string, ReaderType> ReaderTypeWrapper::getNameMap()
     ans["stream"] = STREAM_READER;
     ans["mmap"] = MMAP_READER;
     ans["syscall"] = SYSCALL_READER;
+#if URING_IO
+    ans["uring"] = URING_READER;
+#endif
+#if DIRECT_IO
+    ans["direct"] = DIRECT_READER;
+#endif
+#if HTTP_IO
+    ans["http"] = HTTP_READER;
+#endif
     return ans;
 }
 
@@ -707,6 +1961,15 @@ std::map<std::string, WriterType> WriterTypeWrapper::getNameMap()
     std::map<std::string, WriterType> ans;
     ans["stream"] = STREAM_WRITER;
     ans["syscall"] = SYSCALL_WRITER;
+#if MMAP_IO
+    ans["mmap"] = MMAP_WRITER;
+#endif
+#if URING_IO
+    ans["uring"] = URING_WRITER;
+#endif
+#if ZSTD_IO
+    ans["zstd"] = ZSTD_WRITER;
+#endif
     return ans;
 }
 
@@ -717,6 +1980,15 @@ BinaryReader *createReader(ReaderType type)
     case MMAP_READER:    return new MmapReader;
     case STREAM_READER:  return new StreamReader;
     case SYSCALL_READER: return new SyscallReader;
+#if URING_IO
+    case URING_READER:   return new UringReader;
+#endif
+#if DIRECT_IO
+    case DIRECT_READER:  return new DirectReader;
+#endif
+#if HTTP_IO
+    case HTTP_READER:    return new HttpReader;
+#endif
     default:
         MLSGPU_ASSERT(false, std::invalid_argument);
         return NULL;
@@ -729,6 +2001,15 @@ BinaryWriter *createWriter(WriterType type)
     {
     case STREAM_WRITER:  return new StreamWriter;
     case SYSCALL_WRITER: return new SyscallWriter;
+#if MMAP_IO
+    case MMAP_WRITER:    return new MmapWriter;
+#endif
+#if URING_IO
+    case URING_WRITER:   return new UringWriter;
+#endif
+#if ZSTD_IO
+    case ZSTD_WRITER:    return new ZstdWriter;
+#endif
     default:
         MLSGPU_ASSERT(false, std::invalid_argument);
         return NULL;
@@ -39,19 +39,30 @@
 #include <boost/iostreams/categories.hpp>
 #include "tr1_cstdint.h"
 
+namespace Statistics
+{
+    class Throughput;
+}
+
 /// Enumeration of the types of binary reader
 enum ReaderType
 {
     MMAP_READER,
     STREAM_READER,
-    SYSCALL_READER
+    SYSCALL_READER,
+    URING_READER,     ///< Only available on Linux with io_uring headers
+    DIRECT_READER,    ///< Only available where @c O_DIRECT is supported
+    HTTP_READER       ///< Only available with libcurl; the paths are URLs
 };
 
 /// Enumeration of the types of binary writer
 enum WriterType
 {
     STREAM_WRITER,
-    SYSCALL_WRITER
+    SYSCALL_WRITER,
+    MMAP_WRITER,      ///< Only available on POSIX systems with @c mmap and @c msync
+    URING_WRITER,     ///< Only available on Linux with io_uring headers
+    ZSTD_WRITER       ///< Only available with libzstd; only supports sequential writes
 };
 
 /// Wrapper around @ref ReaderType for use with @ref Choice.
@@ -72,6 +83,10 @@ public:
 
 /**
  * Base class that handles both reading and writing.
+ *
+ * The bytes moved by reads and writes, and the time they take, are recorded in
+ * a @ref Statistics::Throughput per file, named <code>io.read.</code><i>filename</i>
+ * or <code>io.write.</code><i>filename</i>.
  */
 class BinaryIO : public boost::noncopyable
 {
@@ -117,9 +132,20 @@ public:
      */
     bool isOpen() const;
 
+protected:
+    /// Statistic for transfers to or from the open file
+    Statistics::Throughput &getThroughput() const { return *throughput; }
+
 private:
     bool isOpen_;            ///< Whether the file is open
     std::string filename_;   ///< Filename for error messages
+    Statistics::Throughput *throughput;  ///< Statistic for the open file
+
+    /**
+     * Prefix for the name of the throughput statistic, to which the filename
+     * is appended.
+     */
+    virtual const char *throughputPrefix() const = 0;
 
     /**
      * Implements @ref open. It does not need to do any state checks, nor
@@ -162,6 +188,26 @@ public:
      */
     offset_type size() const;
 
+    /**
+     * Hint that the byte range [@a offset, @a offset + @a count) will be read
+     * soon, so that the OS can start fetching it in the background. This is
+     * purely advisory: it never fails and may do nothing.
+     *
+     * @pre The file is open.
+     */
+    void prefetch(offset_type offset, offset_type count) const;
+
+    /**
+     * Return a pointer to the contents of the whole file, if the reader holds
+     * it in memory (as @ref MMAP_READER does). This allows callers to consume
+     * the data without copying it. Readers that have no such view return
+     * @c NULL, and the data must then be obtained with @ref read. The pointer
+     * is valid until the file is closed.
+     *
+     * @pre The file is open.
+     */
+    const char *data() const;
+
 private:
     /**
      * Implements @ref read. It does not need to check whether the file is
@@ -174,6 +220,18 @@ private:
      * open or put the filename into exceptions.
      */
     virtual offset_type sizeImpl() const = 0;
+
+    /**
+     * Implements @ref prefetch. The default implementation does nothing.
+     */
+    virtual void prefetchImpl(offset_type offset, offset_type count) const;
+
+    /**
+     * Implements @ref data. The default implementation returns @c NULL.
+     */
+    virtual const char *dataImpl() const;
+
+    virtual const char *throughputPrefix() const;
 };
 
 /**
@@ -182,6 +240,29 @@ private:
 class BinaryWriter : public BinaryIO
 {
 public:
+    /// One piece of the data for @ref writev
+    struct ConstBuffer
+    {
+        const void *buf;      ///< Start of the data
+        std::size_t count;    ///< Number of bytes
+    };
+
+    /// Constructor
+    BinaryWriter();
+
+    /**
+     * Set whether @ref open discards the existing contents of the file. The
+     * default is true. When false, an existing file is opened as is, so that
+     * positional writes can continue where an earlier writer left off. The
+     * @ref ZSTD_WRITER does not support this.
+     *
+     * @pre The file is not open.
+     */
+    void setTruncate(bool truncate);
+
+    /// Retrieve the value set with @ref setTruncate.
+    bool getTruncate() const { return truncate; }
+
     /**
      * Writes up to @a count bytes from the file, starting at @a offset.
      *
@@ -195,6 +276,21 @@ public:
      */
     std::size_t write(const void *buf, std::size_t count, offset_type offset) const;
 
+    /**
+     * Writes several buffers to consecutive positions in the file, starting
+     * at @a offset. Where the platform supports it, this is done with a
+     * single vectored system call.
+     *
+     * @param bufs     Buffers to write, in file order
+     * @param n        Number of elements in @a bufs
+     * @param offset   Position in file of the first byte of @a bufs[0]
+     * @return The total number of bytes written.
+     * @throw boost::exception if there was a low-level I/O error
+     *
+     * @pre The file is open
+     */
+    std::size_t writev(const ConstBuffer *bufs, std::size_t n, offset_type offset) const;
+
     /**
      * Resize the file to the given size. It is not guaranteed to be possible to
      * shrink a file (this depends on the specific subclass). However, creating a new
@@ -205,17 +301,26 @@ public:
     void resize(offset_type size) const;
 
 private:
+    bool truncate;           ///< Flag set by @ref setTruncate
+
     /**
      * Implements @ref write. It does not need to check that the file is open or
      * put the filename into exceptions.
      */
     virtual std::size_t writeImpl(const void *buf, std::size_t count, offset_type offset) const = 0;
 
+    /**
+     * Implements @ref writev. The default calls @ref writeImpl for each buffer.
+     */
+    virtual std::size_t writevImpl(const ConstBuffer *bufs, std::size_t n, offset_type offset) const;
+
     /**
      * Implements @ref resize. It does not need to check that the file is open or
      * put the filename into exceptions.
      */
     virtual void resizeImpl(offset_type size) const = 0;
+
+    virtual const char *throughputPrefix() const;
 };
 
 /**
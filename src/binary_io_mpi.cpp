@@ -28,12 +28,14 @@
 # include <config.h>
 #endif
 #include <cstddef>
+#include <string>
 #include <boost/filesystem/path.hpp>
+#include <boost/lexical_cast.hpp>
 #include <mpi.h>
 #include "binary_io_mpi.h"
 
-BinaryWriterMPI::BinaryWriterMPI(MPI_Comm comm)
-    : comm(comm)
+BinaryWriterMPI::BinaryWriterMPI(MPI_Comm comm, const Hints &hints)
+    : comm(comm), hints(hints)
 {
 }
 
@@ -43,10 +45,33 @@ BinaryWriterMPI::~BinaryWriterMPI()
         close();
 }
 
+/// Set @a key in @a info to @a value if it is non-zero
+template<typename T>
+static void setHint(MPI_Info info, const char *key, T value)
+{
+    if (value != 0)
+    {
+        std::string str = boost::lexical_cast<std::string>(value);
+        MPI_Info_set(info, const_cast<char *>(key), const_cast<char *>(str.c_str()));
+    }
+}
+
 void BinaryWriterMPI::openImpl(const boost::filesystem::path &path)
 {
+    MPI_Info info;
+    MPI_Info_create(&info);
+    setHint(info, "cb_nodes", hints.aggregators);
+    setHint(info, "cb_buffer_size", hints.bufferSize);
+    setHint(info, "striping_factor", hints.stripeCount);
+    setHint(info, "striping_unit", hints.stripeSize);
+    if (hints.aggregators != 0 || hints.bufferSize != 0)
+    {
+        // Asking for aggregators is pointless unless collective buffering is used
+        MPI_Info_set(info, const_cast<char *>("romio_cb_write"), const_cast<char *>("enable"));
+    }
     MPI_File_open(comm, const_cast<char *>(path.string().c_str()),
-                  MPI_MODE_WRONLY | MPI_MODE_CREATE, MPI_INFO_NULL, &handle);
+                  MPI_MODE_WRONLY | MPI_MODE_CREATE, info, &handle);
+    MPI_Info_free(&info);
     MPI_File_set_atomicity(handle, false);
 }
 
@@ -43,11 +43,28 @@
 class BinaryWriterMPI : public BinaryWriter
 {
 public:
-    explicit BinaryWriterMPI(MPI_Comm comm);
+    /**
+     * MPI-IO hints passed when the file is opened. A value of zero leaves the
+     * corresponding hint to the MPI implementation. The striping hints only
+     * take effect when the file is created, and are ignored by filesystems
+     * that do not support them.
+     */
+    struct Hints
+    {
+        int aggregators;          ///< Number of collective buffering nodes (@c cb_nodes)
+        std::size_t bufferSize;   ///< Collective buffer size per aggregator (@c cb_buffer_size)
+        int stripeCount;          ///< Number of storage targets (@c striping_factor)
+        std::size_t stripeSize;   ///< Bytes per stripe (@c striping_unit)
+
+        Hints() : aggregators(0), bufferSize(0), stripeCount(0), stripeSize(0) {}
+    };
+
+    explicit BinaryWriterMPI(MPI_Comm comm, const Hints &hints = Hints());
     virtual ~BinaryWriterMPI();
 
 private:
     MPI_Comm comm;    ///< Communicator that will be used to open the file
+    Hints hints;      ///< Hints used to open the file
     MPI_File handle;  ///< File handle when it is open
 
     virtual void openImpl(const boost::filesystem::path &path);
@@ -0,0 +1,193 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Computation of blobs for @ref SplatSet::FastBlobSet on an OpenCL device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/lexical_cast.hpp>
+#include "tr1_cstdint.h"
+#include "blob_computer_cl.h"
+#include "splat_set.h"
+#include "splat_set_impl.h"
+#include "clh.h"
+#include "errors.h"
+#include "misc.h"
+
+const std::size_t BlobComputerCL::BATCH_SPLATS;
+const std::size_t BlobComputerCL::WORK_GROUP_SIZE;
+
+BlobComputerCL::BlobComputerCL(const cl::Context &context, const cl::Device &device)
+    : context(context), queue(context, device, 0), scan(context, device, 1), first(0), pending(0)
+{
+    std::map<std::string, std::string> defines;
+    defines["WGS"] = boost::lexical_cast<std::string>(WORK_GROUP_SIZE);
+    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device), "kernels/blobs.cl", defines);
+    headsKernel = cl::Kernel(program, "findBlobHeads");
+    compactKernel = cl::Kernel(program, "compactBlobs");
+
+    const std::size_t groups = divUp(BATCH_SPLATS + 1, WORK_GROUP_SIZE);
+    scan.reserve(BATCH_SPLATS + 1);
+    for (unsigned int i = 0; i < MAX_PENDING; i++)
+    {
+        Slot &slot = slots[i];
+        slot.splats = cl::Buffer(context, CL_MEM_READ_ONLY, BATCH_SPLATS * sizeof(Splat));
+        slot.ids = cl::Buffer(context, CL_MEM_READ_ONLY, BATCH_SPLATS * sizeof(cl_ulong));
+        slot.positions = cl::Buffer(context, CL_MEM_READ_WRITE, (BATCH_SPLATS + 1) * sizeof(cl_uint));
+        slot.blobs = cl::Buffer(context, CL_MEM_WRITE_ONLY, BATCH_SPLATS * sizeof(cl_int8));
+        slot.groupBounds = cl::Buffer(context, CL_MEM_WRITE_ONLY, groups * 6 * sizeof(cl_float));
+        slot.groupIncidence = cl::Buffer(context, CL_MEM_WRITE_ONLY, groups * sizeof(cl_ulong));
+        slot.hostIds = NULL;
+        slot.numSplats = 0;
+        slot.numBlobs = 0;
+    }
+}
+
+std::size_t BlobComputerCL::maxSplats() const
+{
+    return BATCH_SPLATS;
+}
+
+void BlobComputerCL::start(float spacing, Grid::size_type bucketSize)
+{
+    MLSGPU_ASSERT(bucketSize > 0, std::invalid_argument);
+
+    // Abandon anything left over from an earlier call
+    queue.finish();
+    first = 0;
+    pending = 0;
+
+    const DownDivider divider(bucketSize);
+    const cl_int4 params = {{
+        divider.getNegAdd(), divider.getPosAdd(), divider.getInverse(), divider.getShift()
+    }};
+    const cl_float invSpacing = 1.0f / spacing;
+    headsKernel.setArg(6, invSpacing);
+    headsKernel.setArg(7, params);
+    compactKernel.setArg(4, invSpacing);
+    compactKernel.setArg(5, params);
+}
+
+void BlobComputerCL::enqueue(const Splat *splats, const SplatSet::splat_id *ids, std::size_t n)
+{
+    MLSGPU_ASSERT(n > 0 && n <= BATCH_SPLATS, std::length_error);
+    MLSGPU_ASSERT(pending < MAX_PENDING, state_error);
+
+    Slot &slot = slots[(first + pending) % MAX_PENDING];
+    slot.hostIds = ids;
+    slot.numSplats = n;
+    const std::size_t groups = divUp(n + 1, WORK_GROUP_SIZE);
+    slot.hostBounds.resize(groups * 6);
+    slot.hostIncidence.resize(groups);
+
+    /* The queue is in-order, so each step waits for the previous one, and
+     * the upload of this batch for the reads of the last batch in the slot.
+     */
+    CLH::enqueueWriteBuffer(queue, slot.splats, CL_FALSE, 0, n * sizeof(Splat), splats);
+    CLH::enqueueWriteBuffer(queue, slot.ids, CL_FALSE, 0, n * sizeof(cl_ulong), ids);
+
+    headsKernel.setArg(0, slot.positions);
+    headsKernel.setArg(1, slot.groupBounds);
+    headsKernel.setArg(2, slot.groupIncidence);
+    headsKernel.setArg(3, slot.splats);
+    headsKernel.setArg(4, slot.ids);
+    headsKernel.setArg(5, cl_uint(n));
+    CLH::enqueueNDRangeKernel(queue, headsKernel,
+                              cl::NullRange,
+                              cl::NDRange(groups * WORK_GROUP_SIZE),
+                              cl::NDRange(WORK_GROUP_SIZE));
+
+    scan.enqueue(queue, slot.positions, n + 1);
+
+    compactKernel.setArg(0, slot.blobs);
+    compactKernel.setArg(1, slot.positions);
+    compactKernel.setArg(2, slot.splats);
+    compactKernel.setArg(3, cl_uint(n));
+    CLH::enqueueNDRangeKernel(queue, compactKernel,
+                              cl::NullRange,
+                              cl::NDRange(roundUp(n, WORK_GROUP_SIZE)),
+                              cl::NDRange(WORK_GROUP_SIZE));
+
+    CLH::enqueueReadBuffer(queue, slot.positions, CL_FALSE, n * sizeof(cl_uint), sizeof(cl_uint),
+                           &slot.numBlobs);
+    CLH::enqueueReadBuffer(queue, slot.groupBounds, CL_FALSE, 0, groups * 6 * sizeof(cl_float),
+                           &slot.hostBounds[0]);
+    CLH::enqueueReadBuffer(queue, slot.groupIncidence, CL_FALSE, 0, groups * sizeof(cl_ulong),
+                           &slot.hostIncidence[0], NULL, &slot.done);
+    queue.flush();
+    pending++;
+}
+
+void BlobComputerCL::dequeue(
+    std::vector<SplatSet::BlobInfo> &blobs, SplatSet::detail::Bbox &bbox,
+    std::tr1::uint64_t &incidence)
+{
+    MLSGPU_ASSERT(pending > 0, state_error);
+    Slot &slot = slots[first];
+    slot.done.wait();
+
+    std::vector<cl_int8> heads(slot.numBlobs);
+    CLH::enqueueReadBuffer(queue, slot.blobs, CL_TRUE, 0, heads.size() * sizeof(cl_int8),
+                           heads.empty() ? NULL : &heads[0]);
+
+    blobs.resize(heads.size());
+    for (std::size_t i = 0; i < heads.size(); i++)
+    {
+        SplatSet::BlobInfo &blob = blobs[i];
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            blob.lower[j] = heads[i].s[j];
+            blob.upper[j] = heads[i].s[j + 3];
+        }
+        // Splats in a blob have consecutive IDs, so only the ends are needed
+        const std::size_t start = heads[i].s[6];
+        const std::size_t end = i + 1 < heads.size() ? std::size_t(heads[i + 1].s[6]) : slot.numSplats;
+        blob.firstSplat = slot.hostIds[start];
+        blob.lastSplat = slot.hostIds[end - 1] + 1;
+    }
+
+    bbox = SplatSet::detail::Bbox();
+    incidence = 0;
+    for (std::size_t g = 0; g < slot.hostIncidence.size(); g++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            bbox.bboxMin[j] = std::min(bbox.bboxMin[j], slot.hostBounds[g * 6 + j]);
+            bbox.bboxMax[j] = std::max(bbox.bboxMax[j], slot.hostBounds[g * 6 + 3 + j]);
+        }
+        incidence += slot.hostIncidence[g];
+    }
+
+    first = (first + 1) % MAX_PENDING;
+    pending--;
+}
@@ -0,0 +1,109 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Computation of blobs for @ref SplatSet::FastBlobSet on an OpenCL device.
+ */
+
+#ifndef BLOB_COMPUTER_CL_H
+#define BLOB_COMPUTER_CL_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "tr1_cstdint.h"
+#include "splat_set.h"
+#include "scan_cl.h"
+
+/**
+ * Implementation of @ref SplatSet::BlobComputer using an OpenCL device. Each
+ * batch is uploaded asynchronously and processed in three steps:
+ *  -# Each work-item computes the bucket range of one splat and of its
+ *     predecessor, and flags the splat if it starts a new blob. The bounding
+ *     box and incidence are reduced within each work-group.
+ *  -# The flags are scanned with @ref ScanCL to give each blob its position.
+ *  -# The first splat of each blob writes the blob's range and index to its
+ *     position, giving a compacted list of blobs.
+ * Only the blob list and the per-work-group reductions are read back.
+ *
+ * The bucket ranges are computed with the same single-precision operations
+ * and integer division as @c SplatSet::detail::SplatToBuckets, so the
+ * results are identical to the CPU implementation.
+ */
+class BlobComputerCL : public SplatSet::BlobComputer, public boost::noncopyable
+{
+public:
+    /// Number of splats in each batch
+    static const std::size_t BATCH_SPLATS = 256 * 1024;
+    /// Work-group size for the reductions
+    static const std::size_t WORK_GROUP_SIZE = 256;
+
+    /**
+     * Constructor. It compiles the kernels, so it can throw a compilation error.
+     *
+     * @param context      Context in which the computation will run.
+     * @param device       Device on which the computation will run.
+     */
+    BlobComputerCL(const cl::Context &context, const cl::Device &device);
+
+    virtual std::size_t maxSplats() const;
+    virtual void start(float spacing, Grid::size_type bucketSize);
+    virtual void enqueue(const Splat *splats, const SplatSet::splat_id *ids, std::size_t n);
+    virtual void dequeue(std::vector<SplatSet::BlobInfo> &blobs, SplatSet::detail::Bbox &bbox,
+                         std::tr1::uint64_t &incidence);
+
+private:
+    /// Buffers and results for one batch in flight
+    struct Slot
+    {
+        cl::Buffer splats;            ///< Uploaded splats
+        cl::Buffer ids;               ///< Uploaded splat IDs
+        cl::Buffer positions;         ///< Blob head flags, then their scan
+        cl::Buffer blobs;             ///< Compacted blobs
+        cl::Buffer groupBounds;       ///< Bounding box of each work-group
+        cl::Buffer groupIncidence;    ///< Incidence of each work-group
+
+        const SplatSet::splat_id *hostIds;  ///< IDs passed to @ref enqueue
+        std::size_t numSplats;        ///< Splats in the batch
+        cl_uint numBlobs;             ///< Read back from the end of @ref positions
+        std::vector<cl_float> hostBounds;
+        std::vector<cl_ulong> hostIncidence;
+        cl::Event done;               ///< Completion of the reads of the counts and reductions
+    };
+
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Kernel headsKernel;
+    cl::Kernel compactKernel;
+    ScanCL scan;
+
+    Slot slots[MAX_PENDING];
+    unsigned int first;               ///< Oldest pending slot
+    unsigned int pending;             ///< Number of pending slots
+};
+
+#endif /* !BLOB_COMPUTER_CL_H */
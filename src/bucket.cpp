@@ -55,6 +55,19 @@
 namespace Bucket
 {
 
+std::size_t DeviceCounter::treeCounters(const boost::array<std::tr1::uint32_t, 3> &dims, unsigned int levels)
+{
+    std::size_t total = 0;
+    for (unsigned int level = 0; level < levels; level++)
+    {
+        std::size_t nodes = 1;
+        for (unsigned int i = 0; i < 3; i++)
+            nodes = mulSat(nodes, std::size_t(divUp(std::tr1::uint64_t(dims[i]), std::tr1::uint64_t(1) << level)));
+        total = std::min(total, std::numeric_limits<std::size_t>::max() - nodes) + nodes;
+    }
+    return total;
+}
+
 namespace detail
 {
 
@@ -128,7 +141,160 @@ bool Node::operator==(const Node &b) const
     return coords == b.coords && level == b.level;
 }
 
-const std::size_t BucketState::BAD_REGION = (std::size_t) -1;
+const std::size_t NodeCountLevel::BAD_REGION = (std::size_t) -1;
+
+NodeCountLevel::NodeCountLevel(const boost::array<Node::size_type, 3> &dims)
+    : dims(dims),
+    counts("mem.BucketState::nodeCounts"),
+    regions("mem.BucketState::nodeCounts"),
+    hash("mem.BucketState::nodeCounts")
+{
+    std::size_t nodes = 1;
+    for (unsigned int i = 0; i < 3; i++)
+        nodes = mulSat(nodes, std::size_t(dims[i]));
+    dense = nodes <= MAX_DENSE_NODES;
+    if (dense)
+    {
+        counts.resize(nodes, 0);
+        regions.resize(nodes, BAD_REGION);
+    }
+}
+
+std::tr1::int64_t NodeCountLevel::getCount(const coord_type &coords) const
+{
+    if (dense)
+        return counts[index(coords[0], coords[1], coords[2])];
+    hash_type::const_iterator pos = hash.find(coords);
+    if (pos == hash.end())
+        return 0;
+    else
+        return pos->second.numSplats;
+}
+
+void NodeCountLevel::addCountRow(
+    Node::size_type x, Node::size_type y,
+    Node::size_type zLo, Node::size_type zHi,
+    std::tr1::int64_t delta)
+{
+    if (dense)
+    {
+        std::tr1::int64_t *row = &counts[index(x, y, 0)];
+        for (Node::size_type z = zLo; z <= zHi; z++)
+            row[z] += delta;
+    }
+    else
+    {
+        for (Node::size_type z = zLo; z <= zHi; z++)
+        {
+            const coord_type coords = {{ x, y, z }};
+            hash[coords].numSplats += delta;
+        }
+    }
+}
+
+std::size_t NodeCountLevel::getRegion(const coord_type &coords) const
+{
+    if (dense)
+        return regions[index(coords[0], coords[1], coords[2])];
+    hash_type::const_iterator pos = hash.find(coords);
+    if (pos == hash.end())
+        return BAD_REGION;
+    else
+        return pos->second.subregion;
+}
+
+void NodeCountLevel::setRegion(const coord_type &coords, std::size_t region)
+{
+    if (dense)
+        regions[index(coords[0], coords[1], coords[2])] = region;
+    else
+        hash[coords].subregion = region;
+}
+
+void NodeCountLevel::addToParent(NodeCountLevel &parent) const
+{
+    if (dense)
+    {
+        std::size_t pos = 0;
+        coord_type coords;
+        for (coords[0] = 0; coords[0] < dims[0]; coords[0]++)
+            for (coords[1] = 0; coords[1] < dims[1]; coords[1]++)
+                for (coords[2] = 0; coords[2] < dims[2]; coords[2]++, pos++)
+                {
+                    const coord_type pcoords = {{ coords[0] >> 1, coords[1] >> 1, coords[2] >> 1 }};
+                    parent.addCount(pcoords, counts[pos]);
+                }
+    }
+    else
+    {
+        BOOST_FOREACH(hash_type::const_reference v, hash)
+        {
+            const coord_type pcoords = {{ v.first[0] >> 1, v.first[1] >> 1, v.first[2] >> 1 }};
+            parent.addCount(pcoords, v.second.numSplats);
+        }
+    }
+}
+
+void NodeCountLevel::inheritRegions(const NodeCountLevel &parent)
+{
+    if (dense)
+    {
+        std::size_t pos = 0;
+        coord_type coords;
+        for (coords[0] = 0; coords[0] < dims[0]; coords[0]++)
+            for (coords[1] = 0; coords[1] < dims[1]; coords[1]++)
+                for (coords[2] = 0; coords[2] < dims[2]; coords[2]++, pos++)
+                    if (regions[pos] == BAD_REGION)
+                    {
+                        const coord_type pcoords = {{ coords[0] >> 1, coords[1] >> 1, coords[2] >> 1 }};
+                        regions[pos] = parent.getRegion(pcoords);
+                    }
+    }
+    else
+    {
+        BOOST_FOREACH(hash_type::reference v, hash)
+        {
+            if (v.second.subregion == BAD_REGION)
+            {
+                const coord_type pcoords = {{ v.first[0] >> 1, v.first[1] >> 1, v.first[2] >> 1 }};
+                v.second.subregion = parent.getRegion(pcoords);
+            }
+        }
+    }
+}
+
+void NodeCountLevel::markOccupied(occupancy_type &occupancy) const
+{
+    if (dense)
+    {
+        std::size_t pos = 0;
+        coord_type coords;
+        for (coords[0] = 0; coords[0] < dims[0]; coords[0]++)
+            for (coords[1] = 0; coords[1] < dims[1]; coords[1]++)
+                for (coords[2] = 0; coords[2] < dims[2]; coords[2]++, pos++)
+                    if (counts[pos] > 0)
+                        occupancy[coords] = 1;
+    }
+    else
+    {
+        BOOST_FOREACH(hash_type::const_reference v, hash)
+        {
+            if (v.second.numSplats > 0)
+                occupancy[v.first] = 1;
+        }
+    }
+}
+
+const std::tr1::int64_t *NodeCountLevel::addCounts(const std::tr1::int64_t *counts)
+{
+    coord_type coords;
+    for (coords[0] = 0; coords[0] < dims[0]; coords[0]++)
+        for (coords[1] = 0; coords[1] < dims[1]; coords[1]++)
+            for (coords[2] = 0; coords[2] < dims[2]; coords[2]++, counts++)
+                if (*counts != 0)
+                    addCount(coords, *counts);
+    return counts;
+}
 
 boost::array<Grid::size_type, 3> BucketState::computeDims(const Grid &grid, Grid::size_type microSize)
 {
@@ -159,20 +325,30 @@ BucketState::BucketState(
             s[i] = divUp(dims[i], Grid::size_type(1) << level);
             assert(level != macroLevels - 1 || s[i] == 1);
         }
-        nodeCounts.push_back(new node_count_type("mem.BucketState::nodeCounts"));
+        nodeCounts.push_back(new NodeCountLevel(s));
+        if (params.costModel.enabled())
+            occupancy.push_back(new occupancy_type("mem.BucketState::occupancy"));
     }
 }
 
 void BucketState::upsweepCounts()
 {
     for (int level = 0; level + 1 < macroLevels; level++)
+        nodeCounts[level].addToParent(nodeCounts[level + 1]);
+
+    if (params.costModel.enabled())
     {
-        BOOST_FOREACH(node_count_type::const_reference v, nodeCounts[level])
+        // The leaf counts never hold deltas, so any non-zero leaf is occupied
+        nodeCounts[0].markOccupied(occupancy[0]);
+        for (int level = 0; level + 1 < macroLevels; level++)
         {
-            HashCoord::arg_type parent;
-            for (int i = 0; i < 3; i++)
-                parent[i] = v.first[i] >> 1;
-            nodeCounts[level + 1][parent].numSplats += v.second.numSplats;
+            BOOST_FOREACH(occupancy_type::const_reference v, occupancy[level])
+            {
+                HashCoord::arg_type parent;
+                for (int i = 0; i < 3; i++)
+                    parent[i] = v.first[i] >> 1;
+                occupancy[level + 1][parent] += v.second;
+            }
         }
     }
 }
@@ -201,12 +377,17 @@ bool BucketState::clamp(const boost::array<Grid::difference_type, 3> &lower,
 std::tr1::int64_t BucketState::getNodeCount(const Node &node) const
 {
     assert(node.getLevel() < nodeCounts.size());
-    const node_count_type &nc = nodeCounts[node.getLevel()];
-    node_count_type::const_iterator pos = nc.find(node.getCoords());
-    if (pos == nc.end())
-        return 0;
-    else
-        return pos->second.numSplats;
+    return nodeCounts[node.getLevel()].getCount(node.getCoords());
+}
+
+double BucketState::getNodeCost(const Node &node) const
+{
+    assert(node.getLevel() < occupancy.size());
+    const occupancy_type &oc = occupancy[node.getLevel()];
+    occupancy_type::const_iterator pos = oc.find(node.getCoords());
+    const double occupied = (pos == oc.end()) ? 0.0 : double(pos->second);
+    const double cells = double(microSize) * double(microSize) * occupied;
+    return double(getNodeCount(node)) + params.costModel.cellWeight * cells;
 }
 
 void BucketState::countSplats(const SplatSet::BlobInfo &blob, std::tr1::uint64_t &numUpdates)
@@ -215,33 +396,52 @@ void BucketState::countSplats(const SplatSet::BlobInfo &blob, std::tr1::uint64_t
     boost::array<Node::size_type, 3> lo, hi;
     if (!clamp(blob.lower, blob.upper, lo, hi))
         return;
-    SplatSet::splat_id numSplats = blob.lastSplat - blob.firstSplat;
+    const std::tr1::int64_t numSplats = blob.lastSplat - blob.firstSplat;
     for (Node::size_type x = lo[0]; x <= hi[0]; x++)
         for (Node::size_type y = lo[1]; y <= hi[1]; y++)
-            for (Node::size_type z = lo[2]; z <= hi[2]; z++)
-            {
-                const HashCoord::arg_type coords = {{ x, y, z }};
-                nodeCounts[level][coords].numSplats += numSplats;
-                numUpdates++;
-            }
+        {
+            nodeCounts[level].addCountRow(x, y, lo[2], hi[2], numSplats);
+            numUpdates += hi[2] - lo[2] + 1;
+        }
     while (level + 1 < macroLevels && (lo[0] < hi[0] || lo[1] < hi[1] || lo[2] < hi[2]))
     {
         level++;
+        /* A parent node z is hit by two children in z for z in [zLo2, zHi2]
+         * (empty if zLo2 > zHi2), and by one child otherwise, so each row
+         * splits into at most three runs with the same delta. Nodes hit by
+         * only one child in total need no correction.
+         */
+        const Node::size_type zLo = lo[2] >> 1;
+        const Node::size_type zHi = hi[2] >> 1;
+        Node::size_type zLo2 = zHi + 1, zHi2 = zHi;
+        if (lo[2] < hi[2])
+        {
+            zLo2 = (lo[2] + 1) >> 1;
+            zHi2 = (hi[2] - 1) >> 1;
+        }
         for (Node::size_type x = lo[0] >> 1; x <= (hi[0] >> 1); x++)
             for (Node::size_type y = lo[1] >> 1; y <= (hi[1] >> 1); y++)
-                for (Node::size_type z = lo[2] >> 1; z <= (hi[2] >> 1); z++)
+            {
+                std::tr1::int64_t hits = 1;
+                if (lo[0] <= 2 * x && 2 * x < hi[0])
+                    hits *= 2;
+                if (lo[1] <= 2 * y && 2 * y < hi[1])
+                    hits *= 2;
+                NodeCountLevel &nc = nodeCounts[level];
+                if (hits > 1)
                 {
-                    unsigned int hits = 1;
-                    if (lo[0] <= 2 * x && 2 * x < hi[0])
-                        hits *= 2;
-                    if (lo[1] <= 2 * y && 2 * y < hi[1])
-                        hits *= 2;
-                    if (lo[2] <= 2 * z && 2 * z < hi[2])
-                        hits *= 2;
-                    const HashCoord::arg_type coords = {{ x, y, z }};
-                    nodeCounts[level][coords].numSplats -= (hits - 1) * numSplats;
-                    numUpdates++;
+                    if (zLo < zLo2)
+                        nc.addCountRow(x, y, zLo, zLo2 - 1, -(hits - 1) * numSplats);
+                    if (zHi2 < zHi)
+                        nc.addCountRow(x, y, zHi2 + 1, zHi, -(hits - 1) * numSplats);
+                    numUpdates += (zLo2 - zLo) + (zHi - zHi2);
                 }
+                if (zLo2 <= zHi2)
+                {
+                    nc.addCountRow(x, y, zLo2, zHi2, -(2 * hits - 1) * numSplats);
+                    numUpdates += zHi2 - zLo2 + 1;
+                }
+            }
         for (unsigned int i = 0; i < 3; i++)
         {
             lo[i] >>= 1;
@@ -250,6 +450,46 @@ void BucketState::countSplats(const SplatSet::BlobInfo &blob, std::tr1::uint64_t
     }
 }
 
+void BucketState::clipSplats(const SplatSet::BlobInfo &blob, std::tr1::uint32_t tree,
+                             std::vector<DeviceCounter::Blob> &out)
+{
+    boost::array<Node::size_type, 3> lo, hi;
+    if (!clamp(blob.lower, blob.upper, lo, hi))
+        return;
+    DeviceCounter::Blob b;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        b.lower[i] = lo[i];
+        b.upper[i] = hi[i];
+    }
+    b.tree = tree;
+    // The counter takes 32-bit counts, so very large blobs are entered in parts
+    const std::tr1::uint64_t maxPart = std::numeric_limits<std::tr1::uint32_t>::max();
+    std::tr1::uint64_t remaining = blob.lastSplat - blob.firstSplat;
+    while (remaining > 0)
+    {
+        const std::tr1::uint64_t part = std::min(remaining, maxPart);
+        b.numSplats = part;
+        out.push_back(b);
+        remaining -= part;
+    }
+}
+
+const std::tr1::int64_t *BucketState::addCounts(const std::tr1::int64_t *counts)
+{
+    for (int level = 0; level < macroLevels; level++)
+        counts = nodeCounts[level].addCounts(counts);
+    return counts;
+}
+
+boost::array<std::tr1::uint32_t, 3> BucketState::getCounterDims() const
+{
+    boost::array<std::tr1::uint32_t, 3> ans;
+    for (unsigned int i = 0; i < 3; i++)
+        ans[i] = dims[i];
+    return ans;
+}
+
 void BucketState::pickNodes()
 {
     /* Select cells to bucket splats into */
@@ -258,18 +498,7 @@ void BucketState::pickNodes()
     /* Compute subregion for descendants of the cut */
     for (int lvl = macroLevels - 2; lvl >= 0; lvl--)
     {
-        BOOST_FOREACH(node_count_type::reference n, nodeCounts[lvl])
-        {
-            if (n.second.subregion == BAD_REGION)
-            {
-                HashCoord::arg_type pcoord;
-                for (int i = 0; i < 3; i++)
-                    pcoord[i] = n.first[i] >> 1;
-                node_count_type::iterator parent = nodeCounts[lvl + 1].find(pcoord);
-                if (parent != nodeCounts[lvl + 1].end())
-                    n.second.subregion = parent->second.subregion;
-            }
-        }
+        nodeCounts[lvl].inheritRegions(nodeCounts[lvl + 1]);
     }
 }
 
@@ -284,9 +513,7 @@ void BucketState::bucketSplats(const SplatSet::BlobInfo &blob)
             for (Node::size_type z = lo[2]; z <= hi[2]; z++)
             {
                 const HashCoord::arg_type coord = {{ x, y, z }};
-                node_count_type::iterator pos = nodeCounts[0].find(coord);
-                assert(pos != nodeCounts[0].end());
-                std::size_t regionId = pos->second.subregion;
+                std::size_t regionId = nodeCounts[0].getRegion(coord);
                 assert(regionId < subregions.size());
                 BucketState::Subregion &region = subregions[regionId];
 
@@ -332,6 +559,77 @@ BucketStateSet::BucketStateSet(
             }
 }
 
+namespace
+{
+
+/**
+ * Functor for @ref BucketStateSet::processBlob that clips blobs for a
+ * @ref DeviceCounter. The trees are numbered in the storage order of the
+ * set.
+ */
+class ClipSplats
+{
+private:
+    const BucketStateSet &states;
+    std::vector<DeviceCounter::Blob> &out;
+
+public:
+    typedef void result_type;
+
+    ClipSplats(const BucketStateSet &states, std::vector<DeviceCounter::Blob> &out)
+        : states(states), out(out) {}
+
+    void operator()(const boost::shared_ptr<BucketState> &self, const SplatSet::BlobInfo &blob) const
+    {
+        // processBlob passes the element of the set itself, so its address gives the index
+        self->clipSplats(blob, &self - states.data(), out);
+    }
+};
+
+} // anonymous namespace
+
+bool BucketStateSet::countSplats(DeviceCounter &counter, SplatSet::BlobStream &blobs)
+{
+    const std::size_t numTrees = num_elements();
+    std::vector<boost::array<std::tr1::uint32_t, 3> > dims;
+    dims.reserve(numTrees);
+    std::size_t numCounters = 0;
+    for (std::size_t i = 0; i < numTrees; i++)
+    {
+        const BucketState &state = *data()[i];
+        for (unsigned int j = 0; j < 3; j++)
+            if (state.getDims()[j] > std::numeric_limits<std::tr1::uint32_t>::max())
+                return false;
+        dims.push_back(state.getCounterDims());
+        const std::size_t treeCounters = DeviceCounter::treeCounters(dims.back(), state.macroLevels);
+        if (treeCounters > counter.maxCounters() - numCounters)
+            return false;
+        numCounters += treeCounters;
+    }
+
+    const int macroLevels = data()[0]->macroLevels;
+    counter.start(dims, macroLevels);
+    std::vector<DeviceCounter::Blob> clipped;
+    SplatSet::BlobInfo batch[READ_BLOBS];
+    std::size_t n;
+    while ((n = blobs.read(batch, READ_BLOBS)) > 0)
+    {
+        clipped.clear();
+        for (std::size_t i = 0; i < n; i++)
+            processBlob(batch[i], ClipSplats(*this, clipped));
+        if (!clipped.empty())
+            counter.add(&clipped[0], clipped.size());
+    }
+
+    std::vector<std::tr1::int64_t> counts;
+    counter.finish(counts);
+    MLSGPU_ASSERT(counts.size() == numCounters, std::length_error);
+    const std::tr1::int64_t *ptr = numCounters > 0 ? &counts[0] : NULL;
+    for (std::size_t i = 0; i < numTrees; i++)
+        ptr = data()[i]->addCounts(ptr);
+    return true;
+}
+
 bool PickNodes::operator()(const Node &node) const
 {
     std::tr1::uint64_t count = state.getNodeCount(node);
@@ -339,13 +637,25 @@ bool PickNodes::operator()(const Node &node) const
     if (count == 0)
         return false;  // skip empty space
 
+    const CostModel &costModel = state.params.costModel;
+    bool costChecked = true;
+    double cost = 0.0;
+    if (costModel.enabled())
+    {
+        cost = state.getNodeCost(node);
+        costChecked = cost <= costModel.maxCost;
+    }
+
     if (node.getLevel() == 0
         || ((state.microSize * node.size() <= state.params.maxCells)
-            && count <= state.params.maxSplats))
+            && count <= state.params.maxSplats
+            && costChecked))
     {
         std::size_t id = state.subregions.size();
-        state.nodeCounts[node.getLevel()][node.getCoords()].subregion = id;
-        state.subregions.push_back(BucketState::Subregion(node));
+        state.nodeCounts[node.getLevel()].setRegion(node.getCoords(), id);
+        state.subregions.push_back(BucketState::Subregion(node, costChecked));
+        if (costModel.enabled() && costChecked && count <= state.params.maxSplats)
+            Statistics::getStatistic<Statistics::Variable>("bucket.cost").add(cost);
         return false; // no more recursion required
     }
     else
@@ -88,6 +88,76 @@ struct Recursion
     }
 };
 
+/**
+ * Optional model of the cost of processing a bucket, used to split the
+ * regions into buckets of similar cost rather than just satisfying the
+ * limits. The cost of a bucket is estimated as its number of splats plus
+ * @a cellWeight times the number of surface cells, which is approximated as
+ * the square of the microblock size for each occupied microblock. Buckets
+ * whose estimated cost exceeds @a maxCost are split further, down to single
+ * cells.
+ */
+struct CostModel
+{
+    double cellWeight;               ///< Cost of a surface cell relative to a splat
+    double maxCost;                  ///< Target cost per bucket, or 0 to disable the model
+
+    CostModel() : cellWeight(0.0), maxCost(0.0) {}
+    CostModel(double cellWeight, double maxCost) : cellWeight(cellWeight), maxCost(maxCost) {}
+
+    /// Whether the model is in use
+    bool enabled() const { return maxCost > 0.0; }
+};
+
+/**
+ * Interface for offloading the counting pass at the top level of @ref bucket
+ * (see @ref BucketCounterCL). The CPU still streams the blobs, clips them to
+ * the chunks and chooses the subregions from the counts; only the updates to
+ * the octrees of counters are done elsewhere.
+ *
+ * The counters of all the octrees are held in one array of delta-encoded
+ * counts, with the same meaning as in the CPU implementation. The trees are
+ * stored one after the other, each tree level by level from the finest, and
+ * each level with z varying fastest. Level @a l of a tree with dimensions
+ * @a dims has <code>divUp(dims[i], 1 << l)</code> nodes in dimension @a i.
+ */
+class DeviceCounter
+{
+public:
+    /// A blob clipped to the microblocks of one tree
+    struct Blob
+    {
+        std::tr1::uint32_t lower[3];      ///< First microblock covered, inclusive
+        std::tr1::uint32_t upper[3];      ///< Last microblock covered, inclusive
+        std::tr1::uint32_t numSplats;     ///< Number of splats in the blob
+        std::tr1::uint32_t tree;          ///< Index of the tree, as passed to @ref start
+    };
+
+    /// Number of counters needed for a tree with @a levels levels covering @a dims microblocks
+    static std::size_t treeCounters(const boost::array<std::tr1::uint32_t, 3> &dims, unsigned int levels);
+
+    /// The largest number of counters (over all trees) that @ref start accepts.
+    virtual std::size_t maxCounters() const = 0;
+
+    /**
+     * Begin a new count, with all counters zero.
+     *
+     * @param dims     Number of microblocks covered by each tree.
+     * @param levels   Number of levels in every tree.
+     * @pre The trees need at most @ref maxCounters counters in total.
+     */
+    virtual void start(const std::vector<boost::array<std::tr1::uint32_t, 3> > &dims,
+                       unsigned int levels) = 0;
+
+    /// Enter a batch of blobs. The array may be reused as soon as the call returns.
+    virtual void add(const Blob *blobs, std::size_t numBlobs) = 0;
+
+    /// Wait for the count to complete, and return all the counters.
+    virtual void finish(std::vector<std::tr1::int64_t> &counters) = 0;
+
+    virtual ~DeviceCounter() {}
+};
+
 /**
  * Type-class for callback function called by @ref bucket. The parameters are:
  *  -# The splat collection.
@@ -132,9 +202,25 @@ public:
  * @param recursionState Optional parameter indicating recursion statistics
  *                   on entry. This is intended for use when the processing
  *                   callback calls this function again.
+ * @param costModel  Optional cost model for balancing the buckets.
+ * @param threads    Number of threads used to recursively process the
+ *                   subregions chosen at the top level. The processing
+ *                   function is always called from the calling thread, in
+ *                   the same order as for a single thread, but with more
+ *                   threads the buckets are found sooner.
+ * @param thin       If true, a single grid cell that conservatively intersects
+ *                   more than @a maxSplats splats is passed to @a process with
+ *                   only @a maxSplats of them, spread evenly through its
+ *                   splat IDs, rather than throwing @ref DensityError. The
+ *                   statistics @c bucket.thin.cells and @c bucket.thin.dropped
+ *                   record how often this happened.
+ * @param counter    If non-@c NULL, the counting pass for the top-level
+ *                   region is done by @a counter, provided that the octrees
+ *                   fit in @ref DeviceCounter::maxCounters. Deeper levels of
+ *                   recursion always count on the CPU.
  *
  * @throw DensityError If any single grid cell conservatively intersects more
- *                     than @a maxSplats splats.
+ *                     than @a maxSplats splats, and @a thin is false.
  *
  * @note If any splat falls completely outside of @a region, it is undefined
  * whether it will be passed to the processing function at all.
@@ -162,6 +248,8 @@ public:
  * to @a maxSplit), but not smaller than determined by @a maxCells unless
  * the region is already that small. Of course, if on entry to the
  * recursion the region is suitable for processing this is done immediately.
+ * With a cost model, the cost of a region is only known once it has been
+ * counted, so the top-level region is always subdivided at least once.
  *
  * The microblocks are arranged in an implicit, dense octree. The splats
  * are then processed in several passes:
@@ -170,8 +258,10 @@ public:
  *     only require one modification to the data structure, instead of one per
  *     level.
  *  -# The octree is walked top-down to identify subregions.  A node is chosen
- *     as a subregion if it satisfies @a maxCells and @a maxSplats, or if it is a
- *     microblock. Otherwise it is subdivided.
+ *     as a subregion if it satisfies @a maxCells and @a maxSplats (and the
+ *     cost model, if any), or if it is a microblock. Otherwise it is
+ *     subdivided. The number of occupied microblocks under each node is
+ *     counted for the cost model.
  *  -# The splats are processed again to enter them into per-subregion buckets.
  *     A single splat can be placed into multiple buckets if it straddles
  *     subregion borders.
@@ -186,7 +276,11 @@ void bucket(const Splats &splats,
             Grid::size_type microCells,
             std::size_t maxSplit,
             const typename ProcessorType<Splats>::type &process,
-            const Recursion &recursionState = Recursion());
+            const Recursion &recursionState = Recursion(),
+            const CostModel &costModel = CostModel(),
+            std::size_t threads = 1,
+            bool thin = false,
+            DeviceCounter *counter = NULL);
 
 } // namespace Bucket
 
@@ -0,0 +1,265 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Content-addressed cache of the meshes generated for buckets.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <cstring>
+#include <cstddef>
+#include <ios>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/foreach.hpp>
+#include <CL/cl.hpp>
+#include "bucket_cache.h"
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "mesh.h"
+#include "splat.h"
+#include "statistics.h"
+#include "logging.h"
+
+namespace
+{
+
+const char magic[8] = { 'M', 'L', 'S', 'G', 'P', 'U', 'B', 'C' };
+const std::tr1::uint32_t version = 1;
+
+/**
+ * Incremental computation of a @ref BucketCache::Key. Two independent 64-bit
+ * lanes consume the data a word at a time, and are combined with the length
+ * and avalanched at the end.
+ */
+class Hasher
+{
+public:
+    Hasher() : length(0)
+    {
+        h[0] = 0x243f6a8885a308d3ULL;
+        h[1] = 0x13198a2e03707344ULL;
+    }
+
+    void update(const void *data, std::size_t bytes)
+    {
+        const char *p = static_cast<const char *>(data);
+        length += bytes;
+        while (bytes >= sizeof(std::tr1::uint64_t))
+        {
+            std::tr1::uint64_t w;
+            std::memcpy(&w, p, sizeof(w));
+            word(w);
+            p += sizeof(w);
+            bytes -= sizeof(w);
+        }
+        if (bytes > 0)
+        {
+            std::tr1::uint64_t w = 0;
+            std::memcpy(&w, p, bytes);
+            word(w);
+        }
+    }
+
+    template<typename T>
+    void update(const T &value)
+    {
+        update(&value, sizeof(value));
+    }
+
+    BucketCache::Key finish() const
+    {
+        BucketCache::Key key;
+        key.hash[0] = mix(h[0] ^ length);
+        key.hash[1] = mix(h[1] ^ key.hash[0]);
+        return key;
+    }
+
+private:
+    std::tr1::uint64_t h[2];
+    std::tr1::uint64_t length;
+
+    /// Finalizer of splitmix64, which is a bijection with good avalanche
+    static std::tr1::uint64_t mix(std::tr1::uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    void word(std::tr1::uint64_t w)
+    {
+        h[0] = mix(h[0] ^ w);
+        h[1] = ((h[1] + w) << 23 | (h[1] + w) >> 41) * 0x9e3779b97f4a7c15ULL;
+    }
+};
+
+void hashGrid(Hasher &hasher, const Grid &grid)
+{
+    hasher.update(grid.getSpacing());
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        hasher.update(grid.getReference()[i]);
+        hasher.update(std::tr1::int64_t(grid.getExtent(i).first));
+        hasher.update(std::tr1::int64_t(grid.getExtent(i).second));
+    }
+}
+
+} // anonymous namespace
+
+std::string BucketCache::Key::str() const
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string ans(32, '0');
+    for (unsigned int i = 0; i < 2; i++)
+        for (unsigned int j = 0; j < 16; j++)
+            ans[i * 16 + j] = digits[(hash[i] >> (60 - 4 * j)) & 15];
+    return ans;
+}
+
+BucketCache::Mesh::Mesh(const MeshSizes &sizes)
+    : MeshSizes(sizes),
+    data((sizes.getHostBytes() + sizeof(cl_ulong) - 1) / sizeof(cl_ulong))
+{
+}
+
+HostKeyMesh BucketCache::Mesh::getHostMesh()
+{
+    return HostKeyMesh(data.empty() ? NULL : &data[0], *this);
+}
+
+BucketCache::BucketCache(const boost::filesystem::path &dir, const std::string &params)
+    : dir(dir), params(params),
+    hitStat(Statistics::getStatistic<Statistics::Counter>("bucketcache.hits")),
+    missStat(Statistics::getStatistic<Statistics::Counter>("bucketcache.misses"))
+{
+    boost::filesystem::create_directories(dir);
+}
+
+void BucketCache::setFullGrid(const Grid &fullGrid)
+{
+    this->fullGrid = fullGrid;
+}
+
+BucketCache::Key BucketCache::makeKey(
+    const Splat *splats, std::size_t numSplats, const Grid &grid, unsigned int level) const
+{
+    Hasher hasher;
+    hasher.update(params.data(), params.size());
+    hashGrid(hasher, fullGrid);
+    hashGrid(hasher, grid);
+    hasher.update(std::tr1::uint32_t(level));
+    hasher.update(std::tr1::uint64_t(numSplats));
+    hasher.update(splats, numSplats * sizeof(Splat));
+    return hasher.finish();
+}
+
+boost::filesystem::path BucketCache::entryPath(const Key &key) const
+{
+    return dir / (key.str() + ".mesh");
+}
+
+bool BucketCache::load(const Key &key, boost::ptr_vector<Mesh> &meshes)
+{
+    meshes.clear();
+    boost::filesystem::ifstream in(entryPath(key), std::ios::binary);
+    if (!in)
+    {
+        missStat.add(1);
+        return false;
+    }
+
+    char fileMagic[sizeof(magic)];
+    std::tr1::uint32_t fileVersion, count;
+    Key fileKey;
+    in.read(fileMagic, sizeof(fileMagic));
+    in.read((char *) &fileVersion, sizeof(fileVersion));
+    in.read((char *) fileKey.hash, sizeof(fileKey.hash));
+    in.read((char *) &count, sizeof(count));
+    bool good = in
+        && std::memcmp(fileMagic, magic, sizeof(magic)) == 0
+        && fileVersion == version
+        && fileKey.hash[0] == key.hash[0] && fileKey.hash[1] == key.hash[1];
+    for (std::tr1::uint32_t i = 0; good && i < count; i++)
+    {
+        std::tr1::uint64_t sizes[3];
+        in.read((char *) sizes, sizeof(sizes));
+        if (!in || sizes[2] > sizes[0])
+        {
+            good = false;
+            break;
+        }
+        meshes.push_back(new Mesh(MeshSizes(sizes[0], sizes[1], sizes[2])));
+        HostKeyMesh mesh = meshes.back().getHostMesh();
+        in.read((char *) mesh.vertexKeys, meshes.back().getHostBytes());
+        good = in;
+    }
+
+    if (!good)
+    {
+        Log::log[Log::warn] << "Warning: ignoring corrupt bucket cache entry "
+            << entryPath(key).string() << '\n';
+        meshes.clear();
+        missStat.add(1);
+        return false;
+    }
+    hitStat.add(1);
+    return true;
+}
+
+void BucketCache::store(const Key &key, const boost::ptr_vector<Mesh> &meshes)
+{
+    const boost::filesystem::path path = entryPath(key);
+    const boost::filesystem::path tmpPath =
+        path.string() + ".tmp." + boost::filesystem::unique_path().string();
+
+    boost::filesystem::ofstream out(tmpPath, std::ios::binary);
+    const std::tr1::uint32_t count = meshes.size();
+    out.write(magic, sizeof(magic));
+    out.write((const char *) &version, sizeof(version));
+    out.write((const char *) key.hash, sizeof(key.hash));
+    out.write((const char *) &count, sizeof(count));
+    BOOST_FOREACH(const Mesh &m, meshes)
+    {
+        const std::tr1::uint64_t sizes[3] = { m.numVertices(), m.numTriangles(), m.numInternalVertices() };
+        out.write((const char *) sizes, sizeof(sizes));
+        HostKeyMesh mesh = const_cast<Mesh &>(m).getHostMesh();
+        out.write((const char *) mesh.vertexKeys, m.getHostBytes());
+    }
+    out.close();
+
+    boost::system::error_code ec;
+    if (out)
+        rename(tmpPath, path, ec);
+    if (!out || ec)
+    {
+        Log::log[Log::warn] << "Warning: could not write bucket cache entry "
+            << path.string() << '\n';
+        remove(tmpPath, ec);
+    }
+}
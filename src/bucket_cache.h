@@ -0,0 +1,147 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Content-addressed cache of the meshes generated for buckets.
+ */
+
+#ifndef MLSGPU_BUCKET_CACHE_H
+#define MLSGPU_BUCKET_CACHE_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <CL/cl.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "mesh.h"
+#include "splat.h"
+#include "statistics.h"
+
+/**
+ * Cache of the meshes output for buckets, stored as one file per bucket in
+ * a directory. A bucket is identified by a hash of its splats, its grid and
+ * coarsening level, the full grid, and a string describing the fitting
+ * parameters, so that re-running with the same parameters after changing
+ * some of the input only recomputes the buckets whose splats changed.
+ *
+ * The hash is 128 bits but is not cryptographic. It guards against
+ * accidental changes, not against an adversary who can write the inputs.
+ *
+ * The meshes are stored after all device-side filtering, exactly as they
+ * would be passed to the mesher. Each file has the 8-byte magic
+ * @c MLSGPUBC, a 32-bit version (currently 1), the two 64-bit words of the
+ * key, a 32-bit count of meshes, and then for each mesh the vertex, triangle
+ * and internal vertex counts as 64-bit values followed by the data in the
+ * layout of @ref HostKeyMesh. Files are written to a temporary name and
+ * renamed, so concurrent or interrupted runs never see partial entries.
+ *
+ * Loading and storing are thread-safe, but @ref setFullGrid must be called
+ * before any keys are made.
+ */
+class BucketCache : public boost::noncopyable
+{
+public:
+    /// Identifies the contents of a bucket
+    struct Key
+    {
+        std::tr1::uint64_t hash[2];
+
+        Key() { hash[0] = hash[1] = 0; }
+
+        /// Hexadecimal representation, used as the file name
+        std::string str() const;
+    };
+
+    /// A mesh held in host memory, with storage for a @ref HostKeyMesh
+    class Mesh : public MeshSizes
+    {
+    private:
+        /// Backing store (of @c cl_ulong so that it is suitably aligned)
+        std::vector<cl_ulong> data;
+
+    public:
+        /// Allocate space for a mesh of the given size
+        explicit Mesh(const MeshSizes &sizes);
+
+        /// Mesh pointing at the backing store
+        HostKeyMesh getHostMesh();
+    };
+
+    /**
+     * Constructor. The directory is created if it does not exist.
+     *
+     * @param dir      Directory holding the cache files.
+     * @param params   Description of every option that affects the output
+     *                 for a bucket, other than the grids.
+     * @throw boost::filesystem::filesystem_error if the directory could not be created.
+     */
+    BucketCache(const boost::filesystem::path &dir, const std::string &params);
+
+    /// Set the grid to which the output is transformed (see @ref ScaleBiasFilter).
+    void setFullGrid(const Grid &fullGrid);
+
+    /**
+     * Compute the key for a bucket.
+     *
+     * @param splats      The splats of the bucket.
+     * @param numSplats   Number of splats in @a splats.
+     * @param grid        The grid of the bucket.
+     * @param level       Coarsening level of the bucket.
+     */
+    Key makeKey(const Splat *splats, std::size_t numSplats, const Grid &grid, unsigned int level) const;
+
+    /**
+     * Retrieve the meshes for a bucket. Any error in reading the entry is
+     * treated as a miss.
+     *
+     * @param key         Key returned by @ref makeKey.
+     * @param[out] meshes The meshes, in the order they were stored (cleared on a miss).
+     * @return Whether the entry was found.
+     */
+    bool load(const Key &key, boost::ptr_vector<Mesh> &meshes);
+
+    /**
+     * Save the meshes for a bucket. Errors are logged, but otherwise
+     * ignored, since the cache is only an optimization.
+     */
+    void store(const Key &key, const boost::ptr_vector<Mesh> &meshes);
+
+private:
+    const boost::filesystem::path dir;
+    const std::string params;
+    Grid fullGrid;
+
+    Statistics::Counter &hitStat;      ///< Buckets found in the cache
+    Statistics::Counter &missStat;     ///< Buckets not found in the cache
+
+    /// Path of the file holding the entry for @a key
+    boost::filesystem::path entryPath(const Key &key) const;
+};
+
+#endif /* !MLSGPU_BUCKET_CACHE_H */
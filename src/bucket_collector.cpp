@@ -27,8 +27,13 @@
 #if HAVE_CONFIG_H
 # include <config.h>
 #endif
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 #include <boost/function.hpp>
 #include <boost/ref.hpp>
+#include <boost/foreach.hpp>
 #include "splat_set.h"
 #include "statistics.h"
 #include "allocator.h"
@@ -40,6 +45,10 @@
 BucketCollector::BucketCollector(SplatSet::splat_id maxSplats, Functor functor)
     : maxSplats(maxSplats), functor(functor),
     bins("mem.BucketCollector.bins"), numSplats(0),
+    skipBins(0), skipProgress(NULL),
+    limitBins(std::numeric_limits<std::tr1::uint64_t>::max()), limitProgress(NULL),
+    filterProgress(NULL),
+    longestFirst(false), cellWeight(1.0),
     binsStat(Statistics::getStatistic<Statistics::Variable>("bucket.collector.bins")),
     splatsStat(Statistics::getStatistic<Statistics::Variable>("bucket.collector.splats"))
 {
@@ -50,25 +59,132 @@ void BucketCollector::operator()(
     const Grid &grid,
     const Bucket::Recursion &recursionState)
 {
-    if (numSplats + splats.numSplats() > maxSplats)
-        flush();
-
     if (recursionState.chunk != curChunkId.coords)
     {
+        resolvePending();
         curChunkId.gen++;
         curChunkId.coords = recursionState.chunk;
     }
 
-    bins.push_back(Bin());
-    Bin &bin = bins.back();
+    // When sorting, bins are skipped in sorted order by resolvePending
+    if (skipBins > 0 && !longestFirst)
+    {
+        skipBins--;
+        if (skipProgress != NULL)
+            *skipProgress += splats.numSplats();
+        return;
+    }
+
+    Bin bin;
     bin.ranges = splats;
     bin.grid = grid;
     bin.chunkId = curChunkId;
+    if (chunkFilter.empty() && !longestFirst)
+        addBin(bin);
+    else
+        pending.push_back(bin);
+}
+
+class BucketCollector::CostCompare
+{
+public:
+    typedef bool result_type;
+
+    explicit CostCompare(const BucketCollector &owner) : owner(owner) {}
+
+    bool operator()(const Bin &a, const Bin &b) const
+    {
+        return owner.binCost(a) > owner.binCost(b);
+    }
+
+private:
+    const BucketCollector &owner;
+};
+
+double BucketCollector::binCost(const Bin &bin) const
+{
+    return bin.ranges.numSplats() + cellWeight * std::pow(double(bin.grid.numCells()), 2.0 / 3.0);
+}
+
+void BucketCollector::addBin(const Bin &bin)
+{
+    if (limitBins == 0)
+    {
+        if (limitProgress != NULL)
+            *limitProgress += bin.ranges.numSplats();
+        return;
+    }
+    if (limitBins != std::numeric_limits<std::tr1::uint64_t>::max())
+        limitBins--;
+
+    if (numSplats + bin.ranges.numSplats() > maxSplats)
+        flushBins();
+
+    bins.push_back(bin);
+    numSplats += bin.ranges.numSplats();
+}
+
+void BucketCollector::resolvePending()
+{
+    if (pending.empty())
+        return;
+
+    if (longestFirst)
+    {
+        std::stable_sort(pending.begin(), pending.end(), CostCompare(*this));
+        std::size_t skipped = 0;
+        while (skipped < pending.size() && skipBins > 0)
+        {
+            skipBins--;
+            if (skipProgress != NULL)
+                *skipProgress += pending[skipped].ranges.numSplats();
+            skipped++;
+        }
+        pending.erase(pending.begin(), pending.begin() + skipped);
+        if (chunkFilter.empty())
+        {
+            BOOST_FOREACH(const Bin &bin, pending)
+            {
+                addBin(bin);
+            }
+            pending.clear();
+            return;
+        }
+        if (pending.empty())
+            return;
+    }
+
+    std::vector<Grid> grids;
+    grids.reserve(pending.size());
+    BOOST_FOREACH(const Bin &bin, pending)
+    {
+        grids.push_back(bin.grid);
+    }
 
-    numSplats += splats.numSplats();
+    if (chunkFilter(pending.front().chunkId, grids))
+    {
+        BOOST_FOREACH(const Bin &bin, pending)
+        {
+            addBin(bin);
+        }
+    }
+    else if (filterProgress != NULL)
+    {
+        BOOST_FOREACH(const Bin &bin, pending)
+        {
+            *filterProgress += bin.ranges.numSplats();
+        }
+    }
+    pending.clear();
 }
 
 void BucketCollector::flush()
+{
+    resolvePending();
+    flushBins();
+}
+
+void BucketCollector::flushBins()
 {
     if (bins.empty())
         return;
@@ -81,3 +197,27 @@ void BucketCollector::flush()
     bins.clear();
     numSplats = 0;
 }
+
+void BucketCollector::setSkip(std::tr1::uint64_t bins, ProgressMeter *progress)
+{
+    skipBins = bins;
+    skipProgress = progress;
+}
+
+void BucketCollector::setLimit(std::tr1::uint64_t bins, ProgressMeter *progress)
+{
+    limitBins = bins;
+    limitProgress = progress;
+}
+
+void BucketCollector::setChunkFilter(const ChunkFilter &filter, ProgressMeter *progress)
+{
+    chunkFilter = filter;
+    filterProgress = progress;
+}
+
+void BucketCollector::setLongestFirst(bool longestFirst, double cellWeight)
+{
+    this->longestFirst = longestFirst;
+    this->cellWeight = cellWeight;
+}
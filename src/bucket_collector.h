@@ -30,6 +30,7 @@
 #if HAVE_CONFIG_H
 # include <config.h>
 #endif
+#include <vector>
 #include <boost/function.hpp>
 #include "splat_set.h"
 #include "statistics.h"
@@ -37,6 +38,8 @@
 #include "timeplot.h"
 #include "chunk_id.h"
 #include "bucket.h"
+#include "progress.h"
+#include "tr1_cstdint.h"
 
 /**
  * Receives multiple buckets from @ref Bucket::bucket and accumulates
@@ -57,6 +60,12 @@ public:
 
     typedef boost::function<void(const Statistics::Container::vector<Bin> &bins)> Functor;
 
+    /**
+     * Decides whether a chunk is processed. It is called once per chunk,
+     * after all its bins have been seen, with the grids of those bins.
+     */
+    typedef boost::function<bool(const ChunkId &chunkId, const std::vector<Grid> &grids)> ChunkFilter;
+
     void operator()(
         const SplatSet::SubsetBase &splats,
         const Grid &grid,
@@ -72,12 +81,77 @@ public:
 
     void flush(); ///< Flush any partial bins to the output
 
+    /**
+     * Discard the next @a bins bins instead of passing them to the functor,
+     * because an earlier run already processed them. Chunk IDs are still
+     * assigned as if they had been collected. If @a progress is non-NULL,
+     * the splats in the discarded bins are added to it.
+     */
+    void setSkip(std::tr1::uint64_t bins, ProgressMeter *progress = NULL);
+
+    /**
+     * Pass at most @a bins further bins to the functor and discard the rest,
+     * so that a run can be cut short after a sample of the input. Bins
+     * discarded by @ref setSkip or by the chunk filter do not count. If @a
+     * progress is non-NULL, the splats in the discarded bins are added to it.
+     */
+    void setLimit(std::tr1::uint64_t bins, ProgressMeter *progress = NULL);
+
+    /**
+     * Only pass bins to the functor if their chunk is accepted by @a filter.
+     * The bins of each chunk are held back until the chunk is complete. If
+     * @a progress is non-NULL, the splats in rejected chunks are added to
+     * it. Bins discarded by @ref setSkip are not seen by the filter.
+     */
+    void setChunkFilter(const ChunkFilter &filter, ProgressMeter *progress = NULL);
+
+    /**
+     * Pass the bins of each chunk to the functor in decreasing order of
+     * estimated cost, rather than in the order they are bucketed. Issuing
+     * the most expensive bins first (longest processing time first) stops
+     * a large bin from being started last and leaving the devices idle
+     * while it finishes. The bins of each chunk are held back until the
+     * chunk is complete, and chunks are still passed on in order, so the
+     * mesher sees the same sequence of chunk generations.
+     *
+     * The cost of a bin is its number of splats plus @a cellWeight times an
+     * estimate of the surface cells in it, taken as the two-thirds power of
+     * the number of cells (see also @ref Bucket::CostModel). Ties keep the
+     * bucketing order, so the order is deterministic. When enabled, @ref
+     * setSkip counts bins in the sorted order.
+     */
+    void setLongestFirst(bool longestFirst, double cellWeight = 1.0);
+
 private:
     ChunkId curChunkId;           ///< Last-seen chunk ID
     SplatSet::splat_id maxSplats; ///< Limit on splats to pass to @ref functor
     Functor functor;              ///< Callback function
     Statistics::Container::vector<Bin> bins;  ///< Buffer of splat ranges
     SplatSet::splat_id numSplats; ///< Splats collected in @ref bins
+    std::tr1::uint64_t skipBins;  ///< Bins still to discard (see @ref setSkip)
+    ProgressMeter *skipProgress;  ///< Progress meter for discarded bins
+    std::tr1::uint64_t limitBins; ///< Bins still to pass on (see @ref setLimit)
+    ProgressMeter *limitProgress; ///< Progress meter for bins beyond the limit
+    ChunkFilter chunkFilter;      ///< Filter set by @ref setChunkFilter
+    ProgressMeter *filterProgress; ///< Progress meter for rejected chunks
+    std::vector<Bin> pending;     ///< Bins of the current chunk, if filtering or sorting
+    bool longestFirst;            ///< Whether to sort bins by cost (see @ref setLongestFirst)
+    double cellWeight;            ///< Weight of surface cells in the cost (see @ref setLongestFirst)
+
+    /// Estimated cost of processing a bin (see @ref setLongestFirst)
+    double binCost(const Bin &bin) const;
+
+    /// Comparison for sorting bins by decreasing cost
+    class CostCompare;
+
+    /// Add a bin to @ref bins, flushing first if it would be too full
+    void addBin(const Bin &bin);
+
+    /// Pass the bins in @ref pending through the @ref chunkFilter
+    void resolvePending();
+
+    /// Pass the collected bins to the functor
+    void flushBins();
 
     Statistics::Variable &binsStat;   ///< Number of bins per flush
     Statistics::Variable &splatsStat; ///< Number of splats per flush
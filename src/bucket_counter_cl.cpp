@@ -0,0 +1,148 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Counting pass of the bucketing on an OpenCL device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/array.hpp>
+#include "tr1_cstdint.h"
+#include "bucket_counter_cl.h"
+#include "clh.h"
+#include "errors.h"
+
+const std::size_t BucketCounterCL::BATCH_BLOBS;
+const std::size_t BucketCounterCL::MAX_COUNTER_BYTES;
+
+BucketCounterCL::BucketCounterCL(const cl::Context &context, const cl::Device &device)
+    : context(context), queue(context, device, 0), numCounters(0), current(0)
+{
+    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device), "kernels/bucket.cl");
+    kernel = cl::Kernel(program, "countBlobs");
+
+    const std::size_t maxBytes = std::min(
+        std::size_t(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()), MAX_COUNTER_BYTES);
+    counterLimit = maxBytes / (2 * sizeof(cl_uint));
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        staging[i].reserve(BATCH_BLOBS);
+        blobBuffers[i] = cl::Buffer(context, CL_MEM_READ_ONLY, BATCH_BLOBS * sizeof(Blob));
+    }
+}
+
+std::size_t BucketCounterCL::maxCounters() const
+{
+    return counterLimit;
+}
+
+void BucketCounterCL::start(const std::vector<boost::array<std::tr1::uint32_t, 3> > &dims,
+                            unsigned int levels)
+{
+    MLSGPU_ASSERT(!dims.empty(), std::invalid_argument);
+    MLSGPU_ASSERT(levels >= 1, std::invalid_argument);
+
+    std::vector<cl_uint4> treeInfo(dims.size());
+    numCounters = 0;
+    for (std::size_t i = 0; i < dims.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+            treeInfo[i].s[j] = dims[i][j];
+        treeInfo[i].s[3] = numCounters;
+        numCounters += treeCounters(dims[i], levels);
+        MLSGPU_ASSERT(numCounters <= counterLimit, std::length_error);
+    }
+
+    const std::vector<cl_uint> zeros(2 * numCounters, 0);
+    counters = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                          zeros.size() * sizeof(cl_uint), const_cast<cl_uint *>(&zeros[0]));
+    trees = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                       treeInfo.size() * sizeof(cl_uint4), &treeInfo[0]);
+    kernel.setArg(0, counters);
+    kernel.setArg(1, trees);
+    kernel.setArg(4, cl_uint(levels));
+}
+
+void BucketCounterCL::add(const Blob *blobs, std::size_t numBlobs)
+{
+    while (numBlobs > 0)
+    {
+        const std::size_t n = std::min(numBlobs, BATCH_BLOBS - staging[current].size());
+        staging[current].insert(staging[current].end(), blobs, blobs + n);
+        blobs += n;
+        numBlobs -= n;
+        if (staging[current].size() == BATCH_BLOBS)
+            flush();
+    }
+}
+
+void BucketCounterCL::flush()
+{
+    std::vector<Blob> &batch = staging[current];
+    if (batch.empty())
+        return;
+
+    CLH::enqueueWriteBuffer(queue, blobBuffers[current], CL_FALSE, 0,
+                            batch.size() * sizeof(Blob), &batch[0], NULL, &uploaded[current]);
+    kernel.setArg(2, blobBuffers[current]);
+    kernel.setArg(3, cl_uint(batch.size()));
+    CLH::enqueueNDRangeKernel(queue, kernel, cl::NullRange, cl::NDRange(batch.size()), cl::NullRange);
+    queue.flush();
+
+    // The other staging area can only be refilled once its upload has read it
+    current ^= 1;
+    if (uploaded[current]())
+    {
+        uploaded[current].wait();
+        uploaded[current] = cl::Event();
+    }
+    staging[current].clear();
+}
+
+void BucketCounterCL::finish(std::vector<std::tr1::int64_t> &out)
+{
+    flush();
+    std::vector<cl_uint> words(2 * numCounters);
+    CLH::enqueueReadBuffer(queue, counters, CL_TRUE, 0, words.size() * sizeof(cl_uint), &words[0]);
+    for (unsigned int i = 0; i < 2; i++)
+    {
+        uploaded[i] = cl::Event();
+        staging[i].clear();
+    }
+
+    out.resize(numCounters);
+    for (std::size_t i = 0; i < numCounters; i++)
+        out[i] = std::tr1::int64_t(std::tr1::uint64_t(words[2 * i]) | (std::tr1::uint64_t(words[2 * i + 1]) << 32));
+
+    // Release the device memory until the next count
+    counters = cl::Buffer();
+    trees = cl::Buffer();
+    numCounters = 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Counting pass of the bucketing on an OpenCL device.
+ */
+
+#ifndef BUCKET_COUNTER_CL_H
+#define BUCKET_COUNTER_CL_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/noncopyable.hpp>
+#include "tr1_cstdint.h"
+#include "bucket.h"
+
+/**
+ * Implementation of @ref Bucket::DeviceCounter using an OpenCL device. Each
+ * blob is handled by one work-item, which applies the same delta-encoded
+ * updates as @c BucketState::countSplats to a dense copy of all the trees.
+ * The 64-bit counters are updated with 32-bit atomics, so no extensions
+ * are required.
+ *
+ * Blobs are gathered into batches on the host. Each batch is uploaded
+ * asynchronously from one of two staging areas, so that the CPU can clip
+ * the next batch while the device counts the previous one. The counters
+ * are only allocated between @ref start and @ref finish.
+ */
+class BucketCounterCL : public Bucket::DeviceCounter, public boost::noncopyable
+{
+public:
+    /// Number of blobs uploaded per kernel launch
+    static const std::size_t BATCH_BLOBS = 65536;
+    /// Upper bound on the device memory used for the counters
+    static const std::size_t MAX_COUNTER_BYTES = 64 * 1024 * 1024;
+
+    /**
+     * Constructor. It compiles the kernel, so it can throw a compilation error.
+     *
+     * @param context      Context in which the counting will run.
+     * @param device       Device on which the counting will run.
+     */
+    BucketCounterCL(const cl::Context &context, const cl::Device &device);
+
+    virtual std::size_t maxCounters() const;
+    virtual void start(const std::vector<boost::array<std::tr1::uint32_t, 3> > &dims,
+                       unsigned int levels);
+    virtual void add(const Blob *blobs, std::size_t numBlobs);
+    virtual void finish(std::vector<std::tr1::int64_t> &counters);
+
+private:
+    cl::Context context;
+    cl::CommandQueue queue;
+    cl::Kernel kernel;
+
+    std::size_t counterLimit;       ///< Value returned by @ref maxCounters
+    std::size_t numCounters;        ///< Counters in the current count
+    cl::Buffer counters;            ///< Low and high words of each counter
+    cl::Buffer trees;               ///< Dimensions and first counter of each tree
+
+    /// Blobs waiting to be uploaded, in the current staging area
+    std::vector<Blob> staging[2];
+    cl::Buffer blobBuffers[2];      ///< Device copies of the staging areas
+    cl::Event uploaded[2];          ///< Completion of the last upload from each staging area
+    unsigned int current;           ///< Staging area being filled
+
+    /// Upload and count the blobs in the current staging area, and switch to the other one
+    void flush();
+};
+
+#endif /* !BUCKET_COUNTER_CL_H */
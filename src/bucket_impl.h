@@ -37,14 +37,25 @@
 #include <boost/numeric/conversion/converter.hpp>
 #include <boost/mem_fn.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
 #include <ostream>
 #include <limits>
+#include <vector>
+#include <iterator>
+#include <algorithm>
 #include "bucket.h"
 #include "bucket_internal.h"
 #include "statistics.h"
 #include "misc.h"
 #include "logging.h"
 #include "allocator.h"
+#include "thread_name.h"
 
 namespace Bucket
 {
@@ -52,6 +63,9 @@ namespace Bucket
 namespace detail
 {
 
+/// Number of blobs read from a blob stream at a time
+static const std::size_t READ_BLOBS = 256;
+
 class HashCoord
 {
 public:
@@ -64,6 +78,103 @@ public:
     }
 };
 
+/**
+ * One level of the octree of counters in @ref BucketState. Each node holds a
+ * splat count and the ID of the subregion it belongs to.
+ *
+ * Levels with few nodes (which includes the coarse levels) are stored as
+ * dense arrays, indexed with z varying fastest, so that a run of nodes along
+ * z is updated with a simple loop over contiguous memory. Larger levels are
+ * expected to be sparsely touched by the splats, and are hashed so that
+ * only the touched nodes use memory.
+ */
+class NodeCountLevel
+{
+public:
+    typedef HashCoord::arg_type coord_type;
+    typedef Statistics::Container::unordered_map<coord_type, std::tr1::uint64_t, HashCoord> occupancy_type;
+
+    /// Subregion ID for nodes that are not in any subregion
+    static const std::size_t BAD_REGION;
+    /// Maximum number of nodes in a level for it to be stored densely
+    static const std::size_t MAX_DENSE_NODES = 4096;
+
+    /// Constructor for a level covering @a dims nodes.
+    explicit NodeCountLevel(const boost::array<Node::size_type, 3> &dims);
+
+    /// Whether the level is stored densely
+    bool isDense() const { return dense; }
+
+    /// The count for a node (zero if it has never been touched)
+    std::tr1::int64_t getCount(const coord_type &coords) const;
+
+    /// Add @a delta to the count for a node
+    void addCount(const coord_type &coords, std::tr1::int64_t delta)
+    {
+        if (dense)
+            counts[index(coords[0], coords[1], coords[2])] += delta;
+        else
+            hash[coords].numSplats += delta;
+    }
+
+    /// Add @a delta to the counts for the nodes (@a x, @a y, z) for z in [@a zLo, @a zHi].
+    void addCountRow(Node::size_type x, Node::size_type y,
+                     Node::size_type zLo, Node::size_type zHi,
+                     std::tr1::int64_t delta);
+
+    /// The subregion for a node, or @ref BAD_REGION if none
+    std::size_t getRegion(const coord_type &coords) const;
+
+    /// Set the subregion for a node
+    void setRegion(const coord_type &coords, std::size_t region);
+
+    /// Add the count of every node into its parent in @a parent.
+    void addToParent(NodeCountLevel &parent) const;
+
+    /**
+     * Assign each node that has no subregion to the subregion of its parent
+     * in @a parent, if any.
+     */
+    void inheritRegions(const NodeCountLevel &parent);
+
+    /// Set @a occupancy to 1 for each node with a positive count.
+    void markOccupied(occupancy_type &occupancy) const;
+
+    /**
+     * Add counts for every node, in the layout used by @ref DeviceCounter.
+     * Zero counts are skipped, so that sparse levels only store the nodes
+     * that were touched.
+     *
+     * @return A pointer just past the counts for this level.
+     */
+    const std::tr1::int64_t *addCounts(const std::tr1::int64_t *counts);
+
+private:
+    struct HashEntry
+    {
+        std::tr1::int64_t numSplats;  ///< Differential encoding
+        std::size_t subregion;        ///< ID of subregion, or BAD_REGION if not known
+
+        HashEntry() : numSplats(0), subregion(BAD_REGION) {}
+    };
+    typedef Statistics::Container::unordered_map<coord_type, HashEntry, HashCoord> hash_type;
+
+    boost::array<Node::size_type, 3> dims;
+    bool dense;
+
+    /// Counts for a dense level
+    Statistics::Container::vector<std::tr1::int64_t> counts;
+    /// Subregion IDs for a dense level
+    Statistics::Container::vector<std::size_t> regions;
+    /// Nodes for a sparse level
+    hash_type hash;
+
+    std::size_t index(Node::size_type x, Node::size_type y, Node::size_type z) const
+    {
+        return (std::size_t(x) * dims[1] + y) * dims[2] + z;
+    }
+};
+
 /**
  * Implementation detail of @ref forEachNode. Do not call this directly.
  *
@@ -113,12 +224,36 @@ struct BucketParameters
     std::tr1::uint64_t maxSplats;       ///< Maximum splats permitted for processing
     Grid::size_type maxCells;           ///< Maximum cells along any dimension
     std::size_t maxSplit;               ///< Maximum fan-out for recursion
+    CostModel costModel;                ///< Model for balancing buckets
+    std::size_t threads;                ///< Threads for processing top-level subregions
+    bool thin;                          ///< Thin overdense cells instead of throwing @ref DensityError
+    DeviceCounter *counter;             ///< Counter for the top-level pass, or @c NULL
 
     BucketParameters(std::tr1::uint64_t maxSplats,
                      Grid::size_type maxCells,
-                     std::size_t maxSplit)
+                     std::size_t maxSplit,
+                     const CostModel &costModel = CostModel(),
+                     std::size_t threads = 1,
+                     bool thin = false,
+                     DeviceCounter *counter = NULL)
         : maxSplats(maxSplats), maxCells(maxCells),
-        maxSplit(maxSplit) {}
+        maxSplit(maxSplit), costModel(costModel), threads(threads), thin(thin),
+        counter(counter) {}
+};
+
+/**
+ * A subregion chosen by one level of recursion, ready to be processed by
+ * a recursive call to @ref bucketRecurse.
+ */
+template<typename Splats>
+struct ChildRegion
+{
+    typedef typename SplatSet::Traits<Splats>::subset_type subset_type;
+
+    boost::shared_ptr<subset_type> subset;  ///< Splats in the subregion
+    Grid grid;                              ///< Grid covering the subregion
+    Recursion recursionState;               ///< Recursion state for the child call
+    bool costChecked;                       ///< Whether the subregion satisfies the cost model
 };
 
 /**
@@ -164,7 +299,31 @@ public:
     };
 
     /**
-     * Convert @ref nodeCounts from a delta encoding to plain counts.
+     * Clip a blob to the microblocks of this state, for entering it into a
+     * @ref DeviceCounter instead of calling @ref countSplats.
+     *
+     * @param blob         The blob to clip
+     * @param tree         The index of this state's tree in the counter
+     * @param[out] out     Blobs for the counter, to which zero or more are appended
+     */
+    void clipSplats(const SplatSet::BlobInfo &blob, std::tr1::uint32_t tree,
+                    std::vector<DeviceCounter::Blob> &out);
+
+    /**
+     * Add the delta-encoded counts computed by a @ref DeviceCounter for this
+     * state's tree into @ref nodeCounts. This takes the place of the calls to
+     * @ref countSplats.
+     *
+     * @return A pointer just past the counts for this tree.
+     */
+    const std::tr1::int64_t *addCounts(const std::tr1::int64_t *counts);
+
+    /// Dimensions of the tree, in the form used by @ref DeviceCounter
+    boost::array<std::tr1::uint32_t, 3> getCounterDims() const;
+
+    /**
+     * Convert @ref nodeCounts from a delta encoding to plain counts, and
+     * compute @ref occupancy if there is a cost model.
      * This should be called after all calls to @ref countSplats are complete,
      * and before calling @ref getNodeCount.
      */
@@ -189,12 +348,16 @@ public:
         }
     };
 
-    /// Make callbacks to the child regions
+    /**
+     * Move the child regions into @a children, in the order in which they
+     * are to be processed. After this call the subregions no longer hold
+     * their ranges.
+     */
     template<typename Splats>
-    void doCallbacks(const Splats &splats,
-                     const typename ProcessorType<Splats>::type &process,
-                     const Recursion &recursionState,
-                     const boost::array<Grid::difference_type, 3> &chunkOffset);
+    void makeChildren(const Splats &splats,
+                      const Recursion &recursionState,
+                      const boost::array<Grid::difference_type, 3> &chunkOffset,
+                      std::vector<ChildRegion<Splats> > &children);
 
     /**
      * The number of splats that land in a given node.
@@ -202,14 +365,19 @@ public:
      */
     std::tr1::int64_t getNodeCount(const Node &node) const;
 
+    /**
+     * The estimated cost of processing a node as a bucket, under the cost
+     * model in @ref params.
+     * @pre There is a cost model, and @ref upsweepCounts has been called.
+     */
+    double getNodeCost(const Node &node) const;
+
     /// Size in microblocks of the region being processed.
     const Grid::size_type *getDims() const { return &dims[0]; }
 
 private:
     friend class PickNodes;
 
-    static const std::size_t BAD_REGION;
-
     /**
      * A child region. It is stored in a vector, so needs a valid copy
      * constructor.  Copying the ranges to grow the vector would be expensive,
@@ -220,24 +388,16 @@ private:
     {
         Node node;
         SplatSet::SubsetBase subset;   ///< Just the blob ranges - later put in a full subset object
+        bool costChecked;              ///< Whether the node is known to satisfy the cost model
 
-        Subregion() {}
-        Subregion(const Node &node)
-            : node(node) {}
-    };
-
-    struct HashEntry
-    {
-        std::tr1::int64_t numSplats;  ///< Differential encoding
-        std::size_t subregion;        ///< ID of subregion, or BAD_REGION if not known
-
-        HashEntry() : numSplats(0), subregion(BAD_REGION) {}
+        Subregion() : costChecked(true) {}
+        Subregion(const Node &node, bool costChecked = true)
+            : node(node), costChecked(costChecked) {}
     };
 
     /// Size in microblocks of the region being processed.
     boost::array<Grid::size_type, 3> dims;
 
-    typedef Statistics::Container::unordered_map<HashCoord::arg_type, HashEntry, HashCoord> node_count_type;
     /**
      * Octree of splat counts. Each element of the vector is one level of the
      * octree.  Element zero contains the finest level, higher elements the
@@ -248,7 +408,14 @@ private:
      * will thus typically be negative. @ref upsweepCounts applies the
      * summation up the tree.
      */
-    boost::ptr_vector<node_count_type> nodeCounts;
+    boost::ptr_vector<NodeCountLevel> nodeCounts;
+
+    typedef NodeCountLevel::occupancy_type occupancy_type;
+    /**
+     * Number of occupied microblocks under each node, with the same layout
+     * as @ref nodeCounts. This is only computed if there is a cost model.
+     */
+    boost::ptr_vector<occupancy_type> occupancy;
 
     /**
      * The nodes and ranges for the next level of the hierarchy.
@@ -277,40 +444,41 @@ private:
 };
 
 template<typename Splats>
-void BucketState::doCallbacks(
+void BucketState::makeChildren(
     const Splats &splats,
-    const typename ProcessorType<Splats>::type &process,
     const Recursion &recursionState,
-    const boost::array<Grid::difference_type, 3> &chunkOffset)
+    const boost::array<Grid::difference_type, 3> &chunkOffset,
+    std::vector<ChildRegion<Splats> > &children)
 {
+    typedef typename SplatSet::Traits<Splats>::subset_type subset_type;
+
     std::size_t numRanges = 0;
     BOOST_FOREACH(Subregion &region, subregions)
     {
         numRanges += region.subset.numRanges();
     }
+    children.reserve(children.size() + subregions.size());
     BOOST_FOREACH(Subregion &region, subregions)
     {
+        ChildRegion<Splats> child;
+
         // Clip the region to the grid
         Grid::size_type lower[3], upper[3];
         region.node.toCells(microSize, lower, upper, grid);
-        Grid childGrid = grid.subGrid(
+        child.grid = grid.subGrid(
             lower[0], upper[0], lower[1], upper[1], lower[2], upper[2]);
 
-        Recursion childRecursion = recursionState;
-        childRecursion.depth++;
-        childRecursion.totalRanges += numRanges;
+        child.recursionState = recursionState;
+        child.recursionState.depth++;
+        child.recursionState.totalRanges += numRanges;
         for (unsigned int i = 0; i < 3; i++)
-            childRecursion.chunk[i] += chunkOffset[i];
+            child.recursionState.chunk[i] += chunkOffset[i];
 
         region.subset.flush();
-        typename SplatSet::Traits<Splats>::subset_type subset(splats);
-        subset.swap(region.subset);
-        bucketRecurse(subset,
-                      childGrid,
-                      params,
-                      0, 0,
-                      process,
-                      childRecursion);
+        child.subset.reset(new subset_type(splats));
+        child.subset->swap(region.subset);
+        child.costChecked = region.costChecked;
+        children.push_back(child);
     }
 }
 
@@ -328,6 +496,15 @@ public:
     template<typename F>
     void processBlob(const SplatSet::BlobInfo &blob, const F &func);
 
+    /**
+     * Enter all the blobs from @a blobs into the trees with @a counter,
+     * instead of calling @ref BucketState::countSplats for each blob.
+     *
+     * @return @c false, without reading any blobs, if the trees do not fit
+     * in the counter.
+     */
+    bool countSplats(DeviceCounter &counter, SplatSet::BlobStream &blobs);
+
 private:
     /// Ratio between blob buckets and chunks
     const Grid::size_type chunkRatio;
@@ -365,8 +542,8 @@ void BucketStateSet::processBlob(const SplatSet::BlobInfo &blob, const F &func)
 /**
  * Functor for @ref Bucket::detail::forEachNode that chooses which
  * nodes to turn into regions. A node is chosen if it contains few enough
- * splats and is small enough, or if it is a microblock. Otherwise it is
- * split.
+ * splats, is small enough and is cheap enough under the cost model, or if
+ * it is a microblock. Otherwise it is split.
  */
 class PickNodes
 {
@@ -422,6 +599,224 @@ bool bucketCallback(const Splats &splats, const Grid &grid,
     return true;
 }
 
+/**
+ * Pass a single cell with too many splats to the processing function,
+ * keeping only @a maxSplats of them. The splats that are kept are spread
+ * evenly through the subset, so that the sample is not biased towards any
+ * one input file. Returns @c false if @a splats is not a subset, in which
+ * case it cannot be thinned.
+ */
+template<typename Splats>
+bool thinCallback(const Splats &, const Grid &, std::tr1::uint64_t,
+                  const typename ProcessorType<Splats>::type &,
+                  const Recursion &,
+                  boost::false_type)
+{
+    return false;
+}
+
+template<typename Splats>
+bool thinCallback(const Splats &splats, const Grid &grid, std::tr1::uint64_t maxSplats,
+                  const typename ProcessorType<Splats>::type &process,
+                  const Recursion &recursionState,
+                  boost::true_type)
+{
+    const std::tr1::uint64_t total = splats.numSplats();
+    Splats thinned(splats);
+    std::tr1::uint64_t pos = 0;
+    for (typename Splats::const_iterator i = splats.begin(); i != splats.end(); ++i)
+    {
+        for (SplatSet::splat_id id = i->first; id < i->second; id++, pos++)
+        {
+            // Keep the splat if it takes the kept count past an integer
+            if ((pos + 1) * maxSplats / total > pos * maxSplats / total)
+                thinned.addRange(id, id + 1);
+        }
+    }
+    thinned.flush();
+
+    Statistics::getStatistic<Statistics::Counter>("bucket.thin.cells").add(1);
+    Statistics::getStatistic<Statistics::Counter>("bucket.thin.dropped").add(total - thinned.numSplats());
+    process(thinned, grid, recursionState);
+    Statistics::getStatistic<Statistics::Counter>("bucket.bins").add(1);
+    return true;
+}
+
+template<typename Splats>
+void bucketRecurse(
+    const Splats &splats,
+    const Grid &grid,
+    const BucketParameters &params,
+    Grid::size_type chunkCells,
+    Grid::size_type microCells,
+    const typename ProcessorType<Splats>::type &process,
+    const Recursion &recursionState,
+    bool costChecked = false);
+
+/**
+ * Processing function that stores the buckets it is given, so that they can
+ * be passed on to the real processing function later. It takes a copy of the
+ * ranges, since the subset passed to the callback does not outlive it.
+ */
+template<typename Subset>
+class BucketRecorder
+{
+public:
+    typedef void result_type;
+
+    void operator()(const Subset &subset, const Grid &grid, const Recursion &recursionState)
+    {
+        Entry entry;
+        entry.subset.reset(new Subset(subset));
+        std::copy(subset.begin(), subset.end(), std::back_inserter(*entry.subset));
+        entry.subset->flush();
+        entry.grid = grid;
+        entry.recursionState = recursionState;
+        entries.push_back(entry);
+    }
+
+    /// Pass all recorded buckets to @a process, in the order they were recorded
+    void replay(const typename ProcessorType<Subset>::type &process) const
+    {
+        BOOST_FOREACH(const Entry &entry, entries)
+        {
+            process(*entry.subset, entry.grid, entry.recursionState);
+        }
+    }
+
+    /// Discard the recorded buckets
+    void clear() { entries.clear(); }
+
+private:
+    struct Entry
+    {
+        boost::shared_ptr<Subset> subset;
+        Grid grid;
+        Recursion recursionState;
+    };
+
+    std::vector<Entry> entries;
+};
+
+/**
+ * Processes a list of child regions with a pool of threads. Each child is
+ * recursively bucketed into a @ref BucketRecorder, and the recorded buckets
+ * are passed to the real processing function on the calling thread in the
+ * original order. The output is thus identical to serial processing and the
+ * processing function need not be thread-safe, but the first buckets become
+ * available as soon as the first children are done.
+ *
+ * To bound the memory held by recorded buckets, a child is only started if
+ * it is within a fixed window of the next one to be passed on.
+ */
+template<typename Splats>
+class ParallelRecursion
+{
+public:
+    typedef typename SplatSet::Traits<Splats>::subset_type subset_type;
+
+    ParallelRecursion(std::vector<ChildRegion<Splats> > &children,
+                      const BucketParameters &params)
+        : children(children), params(params),
+        recorders(children.size()), errors(children.size()), done(children.size(), false),
+        window(2 * params.threads), nextChild(0), replayed(0), aborted(false)
+    {
+    }
+
+    /// Process all the children, passing the buckets to @a process.
+    void operator()(const typename ProcessorType<Splats>::type &process);
+
+private:
+    std::vector<ChildRegion<Splats> > &children;
+    const BucketParameters &params;
+
+    std::vector<BucketRecorder<subset_type> > recorders;
+    std::vector<boost::exception_ptr> errors;
+    std::vector<bool> done;                 ///< Children whose recursion is finished
+    const std::size_t window;               ///< Maximum children processed ahead of the replay
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::size_t nextChild;                  ///< Next child to hand to a worker
+    std::size_t replayed;                   ///< Number of children already replayed
+    bool aborted;                           ///< Set if the replay failed
+
+    /// Thread function for the pool
+    void worker();
+};
+
+template<typename Splats>
+void ParallelRecursion<Splats>::worker()
+{
+    thread_set_name("bucket");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (true)
+    {
+        while (!aborted && nextChild < children.size() && nextChild >= replayed + window)
+            cond.wait(lock);
+        if (aborted || nextChild >= children.size())
+            break;
+        std::size_t idx = nextChild++;
+        lock.unlock();
+
+        ChildRegion<Splats> &child = children[idx];
+        try
+        {
+            bucketRecurse(*child.subset, child.grid, params, 0, 0,
+                          boost::ref(recorders[idx]),
+                          child.recursionState, child.costChecked);
+        }
+        catch (...)
+        {
+            errors[idx] = boost::current_exception();
+        }
+        child.subset.reset();
+
+        lock.lock();
+        done[idx] = true;
+        cond.notify_all();
+    }
+}
+
+template<typename Splats>
+void ParallelRecursion<Splats>::operator()(const typename ProcessorType<Splats>::type &process)
+{
+    boost::thread_group threads;
+    for (std::size_t i = 0; i < params.threads; i++)
+        threads.create_thread(boost::bind(&ParallelRecursion<Splats>::worker, this));
+
+    try
+    {
+        for (std::size_t i = 0; i < children.size(); i++)
+        {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!done[i])
+                    cond.wait(lock);
+            }
+            if (errors[i])
+                boost::rethrow_exception(errors[i]);
+            recorders[i].replay(process);
+            recorders[i].clear();
+
+            boost::lock_guard<boost::mutex> lock(mutex);
+            replayed++;
+            cond.notify_all();
+        }
+    }
+    catch (...)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            aborted = true;
+            cond.notify_all();
+        }
+        threads.join_all();
+        throw;
+    }
+    threads.join_all();
+}
+
 /**
  * Recursive implementation of @ref bucket.
  *
@@ -434,6 +829,7 @@ bool bucketCallback(const Splats &splats, const Grid &grid,
  *                        is disabled (this is always done below the top level).
  * @param microCells      Requested microblock size.
  * @param recursionState  Statistics about what is already held on the stack.
+ * @param costChecked     Whether the region is known to satisfy the cost model.
  */
 template<typename Splats>
 void bucketRecurse(
@@ -443,7 +839,8 @@ void bucketRecurse(
     Grid::size_type chunkCells,
     Grid::size_type microCells,
     const typename ProcessorType<Splats>::type &process,
-    const Recursion &recursionState)
+    const Recursion &recursionState,
+    bool costChecked)
 {
     Statistics::getStatistic<Statistics::Peak>("bucket.depth.peak") = recursionState.depth;
     Statistics::getStatistic<Statistics::Peak>("bucket.totalRanges.peak") = recursionState.totalRanges;
@@ -453,9 +850,12 @@ void bucketRecurse(
         cellDims[i] = grid.numCells(i);
     Grid::size_type maxCellDim = std::max(std::max(cellDims[0], cellDims[1]), cellDims[2]);
 
+    // A single cell cannot be split any further to reduce the cost
+    const bool costOk = costChecked || maxCellDim == 1 || !params.costModel.enabled();
     if (splats.maxSplats() <= params.maxSplats
         && (maxCellDim <= params.maxCells)
         && (chunkCells == 0 || chunkCells >= maxCellDim)
+        && costOk
         && bucketCallback(splats, grid, process, recursionState,
                           typename SplatSet::Traits<Splats>::is_subset()))
     {
@@ -463,7 +863,11 @@ void bucketRecurse(
     }
     else if (maxCellDim == 1)
     {
-        throw DensityError(splats.maxSplats()); // can't subdivide a 1x1x1 cell
+        // can't subdivide a 1x1x1 cell
+        if (!params.thin
+            || !thinCallback(splats, grid, params.maxSplats, process, recursionState,
+                             typename SplatSet::Traits<Splats>::is_subset()))
+            throw DensityError(splats.maxSplats());
     }
     else
     {
@@ -521,15 +925,23 @@ void bucketRecurse(
 
         /* Create histogram */
         boost::scoped_ptr<SplatSet::BlobStream> blobs(splats.makeBlobStream(grid, microSize));
-        std::tr1::uint64_t numUpdates = 0;
-        while (!blobs->empty())
+        if (recursionState.depth == 0 && params.counter != NULL
+            && states.countSplats(*params.counter, *blobs))
         {
-            states.processBlob(**blobs, BucketState::CountSplats(numUpdates));
-            ++*blobs;
+            Statistics::getStatistic<Statistics::Counter>("bucket.countSplats.device").add(1);
+        }
+        else
+        {
+            std::tr1::uint64_t numUpdates = 0;
+            SplatSet::BlobInfo batch[READ_BLOBS];
+            std::size_t n;
+            while ((n = blobs->read(batch, READ_BLOBS)) > 0)
+                for (std::size_t i = 0; i < n; i++)
+                    states.processBlob(batch[i], BucketState::CountSplats(numUpdates));
+            Statistics::getStatistic<Statistics::Counter>("bucket.countSplats.updates")
+                .add(numUpdates);
         }
         blobs.reset();
-        Statistics::getStatistic<Statistics::Counter>("bucket.countSplats.updates")
-            .add(numUpdates);
 
         boost::array<Grid::difference_type, 3> chunkCoord;
         for (chunkCoord[0] = 0; chunkCoord[0] < chunks[0]; chunkCoord[0]++)
@@ -543,19 +955,46 @@ void bucketRecurse(
 
         /* Do the bucketing. */
         blobs.reset(splats.makeBlobStream(grid, microSize));
-        while (!blobs->empty())
         {
-            states.processBlob(**blobs, BucketState::BucketSplats());
-            ++*blobs;
+            SplatSet::BlobInfo batch[READ_BLOBS];
+            std::size_t n;
+            while ((n = blobs->read(batch, READ_BLOBS)) > 0)
+                for (std::size_t i = 0; i < n; i++)
+                    states.processBlob(batch[i], BucketState::BucketSplats());
         }
 
         /* Make callbacks */
-        for (chunkCoord[0] = 0; chunkCoord[0] < chunks[0]; chunkCoord[0]++)
-            for (chunkCoord[1] = 0; chunkCoord[1] < chunks[1]; chunkCoord[1]++)
-                for (chunkCoord[2] = 0; chunkCoord[2] < chunks[2]; chunkCoord[2]++)
-                {
-                    states(chunkCoord)->doCallbacks(splats, process, recursionState, chunkCoord);
-                }
+        if (params.threads > 1 && recursionState.depth == 0)
+        {
+            /* Independent subregions are recursed in parallel, but
+             * delivered to the callback in the serial order.
+             */
+            std::vector<ChildRegion<Splats> > children;
+            for (chunkCoord[0] = 0; chunkCoord[0] < chunks[0]; chunkCoord[0]++)
+                for (chunkCoord[1] = 0; chunkCoord[1] < chunks[1]; chunkCoord[1]++)
+                    for (chunkCoord[2] = 0; chunkCoord[2] < chunks[2]; chunkCoord[2]++)
+                    {
+                        states(chunkCoord)->makeChildren(splats, recursionState, chunkCoord, children);
+                    }
+            ParallelRecursion<Splats> parallel(children, params);
+            parallel(process);
+        }
+        else
+        {
+            for (chunkCoord[0] = 0; chunkCoord[0] < chunks[0]; chunkCoord[0]++)
+                for (chunkCoord[1] = 0; chunkCoord[1] < chunks[1]; chunkCoord[1]++)
+                    for (chunkCoord[2] = 0; chunkCoord[2] < chunks[2]; chunkCoord[2]++)
+                    {
+                        std::vector<ChildRegion<Splats> > children;
+                        states(chunkCoord)->makeChildren(splats, recursionState, chunkCoord, children);
+                        BOOST_FOREACH(ChildRegion<Splats> &child, children)
+                        {
+                            bucketRecurse(*child.subset, child.grid, params, 0, 0,
+                                          process, child.recursionState, child.costChecked);
+                            child.subset.reset();
+                        }
+                    }
+        }
     }
 }
 
@@ -570,9 +1009,14 @@ void bucket(const Splats &splats,
             Grid::size_type microCells,
             std::size_t maxSplit,
             const typename ProcessorType<Splats>::type &process,
-            const Recursion &recursionState)
+            const Recursion &recursionState,
+            const CostModel &costModel,
+            std::size_t threads,
+            bool thin,
+            DeviceCounter *counter)
 {
-    detail::BucketParameters params(maxSplats, maxCells, maxSplit);
+    MLSGPU_ASSERT(threads >= 1, std::invalid_argument);
+    detail::BucketParameters params(maxSplats, maxCells, maxSplit, costModel, threads, thin, counter);
     detail::bucketRecurse(splats, region, params, chunkCells, microCells, process, recursionState);
 }
 
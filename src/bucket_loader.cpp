@@ -30,13 +30,24 @@
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/smart_ptr/make_shared.hpp>
+#include <algorithm>
+#include <utility>
+#include <vector>
 #include <cassert>
+#include <stdexcept>
 #include "workers.h"
 #include "grid.h"
 #include "statistics.h"
 #include "splat_set.h"
 #include "timeplot.h"
 #include "bucket_loader.h"
+#include "chunk_tracker.h"
+#include "memory_governor.h"
+#include "splat_tree.h"
+#include "thread_name.h"
+#include "errors.h"
 
 BucketLoader::BucketLoader(
     std::size_t maxItemSplats, CopyGroup &outGroup, Timeplot::Worker &tworker)
@@ -45,10 +56,25 @@ BucketLoader::BucketLoader(
     outGroup(outGroup),
     tworker(tworker),
     super(NULL),
+    maxLevel(0),
+    minRadius(0.0f),
+    sortSplats(false),
+    coalesceGap(0),
+    lodLevels(0),
+    previewLevel(0),
+    splitSplats(0),
+    splitSlabs(1),
+    chunkTracker(NULL),
+    governor(NULL),
+    haveLastGen(false),
+    lastGen(0),
     splatBuffer("mem.BucketLoader.splatBuffer"),
+    idBuffer("mem.BucketLoader.idBuffer"),
     computeStat(Statistics::getStatistic<Statistics::Variable>("bucket.loader.compute")),
     loadStat(Statistics::getStatistic<Statistics::Variable>("bucket.loader.load")),
-    writeStat(Statistics::getStatistic<Statistics::Variable>("bucket.loader.write"))
+    writeStat(Statistics::getStatistic<Statistics::Variable>("bucket.loader.write")),
+    levelStat(Statistics::getStatistic<Statistics::Variable>("bucket.loader.level")),
+    splitStat(Statistics::getStatistic<Statistics::Counter>("bucket.loader.split"))
 {
     splatBuffer.reserve(maxItemSplats);
 }
@@ -73,9 +99,36 @@ void BucketLoader::operator()(const Statistics::Container::vector<BucketCollecto
 
     {
         Timeplot::Action timer("load", tworker, loadStat);
-        boost::scoped_ptr<SplatSet::SplatStream> splatStream(super->makeSplatStream(ranges.begin(), ranges.end()));
+        std::size_t numRead;
+        if (coalesceGap > 0)
+        {
+            Statistics::Container::vector<range_type> reads("mem.BucketLoader.ranges");
+            coalesce(ranges, reads);
+            boost::scoped_ptr<SplatSet::SplatStream> splatStream(super->makeSplatStream(reads.begin(), reads.end()));
+            std::size_t numLoaded = splatStream->read(&splatBuffer[0], &idBuffer[0], maxItemSplats);
+
+            /* Discard the splats from the gaps, leaving the same layout as
+             * reading the ranges directly.
+             */
+            numRead = 0;
+            Statistics::Container::vector<range_type>::const_iterator p = ranges.begin();
+            for (std::size_t i = 0; i < numLoaded; i++)
+            {
+                const SplatSet::splat_id id = idBuffer[i];
+                while (p != ranges.end() && p->second <= id)
+                    ++p;
+                if (p != ranges.end() && p->first <= id)
+                    splatBuffer[numRead++] = splatBuffer[i];
+            }
+            Statistics::getStatistic<Statistics::Counter>("bucket.loader.gap.splats").add(numLoaded - numRead);
+        }
+        else
+        {
+            boost::scoped_ptr<SplatSet::SplatStream> splatStream(super->makeSplatStream(ranges.begin(), ranges.end()));
+            numRead = splatStream->read(&splatBuffer[0], NULL, maxItemSplats);
+        }
+
         float invSpacing = 1.0f / fullGrid.getSpacing();
-        std::size_t numRead = splatStream->read(&splatBuffer[0], NULL, maxItemSplats);
         for (std::size_t i = 0; i < numRead; i++)
         {
             Splat &splat = splatBuffer[i];
@@ -86,8 +139,17 @@ void BucketLoader::operator()(const Statistics::Container::vector<BucketCollecto
     }
 
     // Now process each bin, copying the relevant subset to the device
+    std::vector<LodItem> items;
     BOOST_FOREACH(const BucketCollector::Bin &bin, bins)
     {
+        if (chunkTracker != NULL)
+        {
+            if (haveLastGen && bin.chunkId.gen != lastGen)
+                chunkTracker->close(lastGen);
+            haveLastGen = true;
+            lastGen = bin.chunkId.gen;
+        }
+
         /* We transformed splats from world space into fullGrid space, so we need to
          * construct a new grid for this coordinate system.
          */
@@ -101,34 +163,397 @@ void BucketLoader::operator()(const Statistics::Container::vector<BucketCollecto
             subGrid.setExtent(i, low, high);
         }
 
-        boost::shared_ptr<CopyGroup::WorkItem> item = outGroup.get(tworker, bin.ranges.numSplats());
-        item->chunkId = bin.chunkId;
-        item->grid = subGrid;
+        /* Each item is filled from splatBuffer independently, so that only
+         * one is held at a time.
+         */
+        lodItems(subGrid, lodLevels, previewLevel, items);
+        BOOST_FOREACH(const LodItem &lodItem, items)
+        {
+            const unsigned int lod = lodItem.level;
+            const Grid &lodGrid = lodItem.grid;
 
-        Timeplot::Action timer("write", tworker, writeStat);
-        timer.setValue(bin.ranges.numSplats() * sizeof(Splat));
+            /* A large bucket is split along Z into slabs (see setSplit),
+             * each of which is loaded and pushed as a bucket of its own.
+             */
+            const Grid::extent_type zExtent = lodGrid.getExtent(2);
+            Grid::difference_type numSlabs = 1;
+            if (lod == 0 && maxLevel == 0 && splitSplats > 0 && splitSlabs > 1
+                && bin.ranges.numSplats() >= splitSplats)
+                numSlabs = std::min(Grid::difference_type(splitSlabs), zExtent.second - zExtent.first);
+            if (numSlabs > 1)
+                splitStat.add(1);
 
-        Statistics::Container::vector<range_type>::const_iterator p = ranges.begin();
-        std::size_t pos = 0;
-        Splat *splatPtr = (Splat *) item->getSplats();
-        for (SplatSet::SubsetBase::const_iterator q = bin.ranges.begin(); q != bin.ranges.end(); ++q)
-        {
-            while (p->second < q->second)
+            for (Grid::difference_type slabIdx = 0; slabIdx < numSlabs; slabIdx++)
             {
-                pos += p->second - p->first;
-                ++p;
+                const Grid::difference_type depth = zExtent.second - zExtent.first;
+                const Grid::extent_type slab(
+                    zExtent.first + depth * slabIdx / numSlabs,
+                    zExtent.first + depth * (slabIdx + 1) / numSlabs);
+                const Grid::extent_type *slabPtr = numSlabs > 1 ? &slab : NULL;
+                const std::size_t numSplats = slabPtr != NULL
+                    ? copyBin(bin, ranges, slabPtr, NULL) : bin.ranges.numSplats();
+                if (slabPtr != NULL && numSplats == 0)
+                    continue; // nothing to triangulate
+
+                if (governor != NULL)
+                    governor->wait(tworker);
+                boost::shared_ptr<CopyGroup::WorkItem> item = outGroup.get(tworker, numSplats);
+                item->chunkId = bin.chunkId;
+                item->grid = lodGrid;
+                item->grid.setExtent(2, slab.first, slab.second);
+                item->lod = lodItem.lod;
+                item->split = slabPtr != NULL;
+
+                Timeplot::Action timer("write", tworker, writeStat);
+                timer.setValue(numSplats * sizeof(Splat));
+                copyBin(bin, ranges, slabPtr, item->getSplats());
+
+                item->level = lod > 0 ? lod : chooseLevel(item->getSplats(), item->numSplats, subGrid);
+                if (item->level > 0)
+                {
+                    const float scale = 1.0f / (1U << item->level);
+                    Splat *splats = item->getSplats();
+                    for (std::size_t i = 0; i < item->numSplats; i++)
+                    {
+                        for (unsigned int j = 0; j < 3; j++)
+                            splats[i].position[j] *= scale;
+                        splats[i].radius *= scale;
+                    }
+                    if (lod == 0)
+                    {
+                        for (unsigned int i = 0; i < 3; i++)
+                        {
+                            const Grid::extent_type &extent = subGrid.getExtent(i);
+                            item->grid.setExtent(i, extent.first >> item->level, extent.second >> item->level);
+                        }
+                    }
+                }
+                if (sortSplats)
+                    sortMorton(item->getSplats(), item->numSplats, item->grid);
+                if (lod == 0)
+                    levelStat.add(item->level);
+                if (chunkTracker != NULL)
+                    chunkTracker->add(bin.chunkId.gen);
+                outGroup.push(tworker, item);
             }
-            assert(p->first <= q->first && p->second >= q->second);
-            std::memcpy(splatPtr, &splatBuffer[pos + (q->first - p->first)],
-                   (q->second - q->first) * sizeof(Splat));
-            splatPtr += q->second - q->first;
         }
-        outGroup.push(tworker, item);
     }
 }
 
+std::size_t BucketLoader::copyBin(
+    const BucketCollector::Bin &bin,
+    const Statistics::Container::vector<range_type> &ranges,
+    const Grid::extent_type *slab, Splat *out) const
+{
+    Statistics::Container::vector<range_type>::const_iterator p = ranges.begin();
+    std::size_t pos = 0;
+    std::size_t copied = 0;
+    for (SplatSet::SubsetBase::const_iterator q = bin.ranges.begin(); q != bin.ranges.end(); ++q)
+    {
+        while (p->second < q->second)
+        {
+            pos += p->second - p->first;
+            ++p;
+        }
+        assert(p->first <= q->first && p->second >= q->second);
+        const Splat *in = &splatBuffer[pos + (q->first - p->first)];
+        const std::size_t n = q->second - q->first;
+        if (slab == NULL)
+        {
+            std::memcpy(out + copied, in, n * sizeof(Splat));
+            copied += n;
+        }
+        else
+        {
+            /* The vertices of the slab run from slab->first to slab->second
+             * inclusive. A cell of margin either side keeps this a
+             * conservative superset, like the bucketing itself.
+             */
+            const float zLow = slab->first - 1.0f;
+            const float zHigh = slab->second + 1.0f;
+            for (std::size_t i = 0; i < n; i++)
+                if (in[i].position[2] + in[i].radius >= zLow
+                    && in[i].position[2] - in[i].radius <= zHigh)
+                {
+                    if (out != NULL)
+                        out[copied] = in[i];
+                    copied++;
+                }
+        }
+    }
+    return copied;
+}
+
 void BucketLoader::start(const Splats &super, const Grid &fullGrid)
 {
     this->fullGrid = fullGrid;
     this->super = &super;
 }
+
+void BucketLoader::setAdaptive(unsigned int maxLevel, float minRadius)
+{
+    this->maxLevel = maxLevel;
+    this->minRadius = minRadius;
+}
+
+void BucketLoader::setSortSplats(bool sortSplats)
+{
+    this->sortSplats = sortSplats;
+}
+
+void BucketLoader::setCoalesceGap(std::size_t gapBytes)
+{
+    coalesceGap = gapBytes;
+    if (gapBytes > 0)
+        idBuffer.reserve(maxItemSplats);
+}
+
+void BucketLoader::coalesce(
+    const Statistics::Container::vector<range_type> &ranges,
+    Statistics::Container::vector<range_type> &out) const
+{
+    SplatSet::splat_id total = 0;
+    BOOST_FOREACH(const range_type &range, ranges)
+        total += range.second - range.first;
+
+    out.clear();
+    BOOST_FOREACH(const range_type &range, ranges)
+    {
+        if (!out.empty())
+        {
+            range_type &prev = out.back();
+            const std::size_t fileId = range.first >> Splats::scanIdShift;
+            if ((prev.second >> Splats::scanIdShift) == fileId
+                && (prev.first >> Splats::scanIdShift) == fileId)
+            {
+                const SplatSet::splat_id gap = range.first - prev.second;
+                if (gap * super->getFile(fileId).getVertexSize() <= coalesceGap
+                    && total + gap <= maxItemSplats)
+                {
+                    // Read through the gap, as long as the batch still fits
+                    total += gap;
+                    prev.second = range.second;
+                    continue;
+                }
+            }
+        }
+        out.push_back(range);
+    }
+    Statistics::getStatistic<Statistics::Variable>("bucket.loader.reads").add(out.size());
+}
+
+void BucketLoader::setChunkTracker(ChunkTracker *chunkTracker)
+{
+    this->chunkTracker = chunkTracker;
+}
+
+void BucketLoader::setMemoryGovernor(MemoryGovernor *governor)
+{
+    this->governor = governor;
+}
+
+void BucketLoader::setLodLevels(unsigned int lodLevels)
+{
+    MLSGPU_ASSERT(lodLevels <= maxAdaptiveLevel, std::invalid_argument);
+    this->lodLevels = lodLevels;
+}
+
+void BucketLoader::setPreview(unsigned int level)
+{
+    MLSGPU_ASSERT(level <= maxAdaptiveLevel, std::invalid_argument);
+    previewLevel = level;
+}
+
+void BucketLoader::setSplit(std::size_t minSplats, unsigned int slabs)
+{
+    MLSGPU_ASSERT(slabs >= 1, std::invalid_argument);
+    splitSplats = minSplats;
+    splitSlabs = slabs;
+}
+
+void BucketLoader::sortMorton(Splat *splats, std::size_t numSplats, const Grid &grid)
+{
+    typedef SplatTree::code_type code_type;
+    // Buckets span far fewer cells than this; anything beyond is clamped
+    const code_type maxCoord = (code_type(1) << 10) - 1;
+
+    Statistics::Container::vector<std::pair<code_type, std::size_t> > order("mem.BucketLoader.order");
+    order.reserve(numSplats);
+    for (std::size_t i = 0; i < numSplats; i++)
+    {
+        code_type coords[3];
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            const float rel = splats[i].position[j] - grid.getExtent(j).first;
+            coords[j] = rel <= 0.0f ? 0 : std::min(code_type(rel), maxCoord);
+        }
+        order.push_back(std::make_pair(SplatTree::makeCode(coords[0], coords[1], coords[2]), i));
+    }
+    std::sort(order.begin(), order.end());
+
+    Statistics::Container::vector<Splat> sorted("mem.BucketLoader.sorted");
+    sorted.reserve(numSplats);
+    for (std::size_t i = 0; i < numSplats; i++)
+        sorted.push_back(splats[order[i].second]);
+    std::copy(sorted.begin(), sorted.end(), splats);
+}
+
+void BucketLoader::lodItems(const Grid &grid, unsigned int lodLevels, unsigned int previewLevel,
+                            std::vector<LodItem> &out)
+{
+    out.clear();
+    /* The full-resolution item is followed by one for each coarser level
+     * of detail. A preview has only its own level.
+     */
+    const unsigned int firstLod = previewLevel > 0 ? previewLevel : 0;
+    const unsigned int lastLod = previewLevel > 0 ? previewLevel : lodLevels;
+    for (unsigned int lod = firstLod; lod <= lastLod; lod++)
+    {
+        LodItem item;
+        item.level = lod;
+        item.lod = previewLevel > 0 ? 1 : lod;
+        item.grid = grid;
+        if (lod > 0)
+        {
+            /* Each coarse cell belongs to the bucket holding its lower
+             * corner, so that the coarse cells of adjacent buckets tile
+             * without overlap even when the buckets are not aligned.
+             */
+            const Grid::difference_type mask = (Grid::difference_type(1) << lod) - 1;
+            bool empty = false;
+            for (unsigned int i = 0; i < 3 && !empty; i++)
+            {
+                const Grid::extent_type &extent = grid.getExtent(i);
+                const Grid::difference_type low = (extent.first + mask) >> lod;
+                const Grid::difference_type high = (extent.second + mask) >> lod;
+                if (low >= high)
+                    empty = true;
+                else
+                    item.grid.setExtent(i, low, high);
+            }
+            if (empty)
+                continue;
+        }
+        out.push_back(item);
+    }
+}
+
+unsigned int BucketLoader::chooseLevel(const Splat *splats, std::size_t numSplats, const Grid &grid) const
+{
+    if (maxLevel == 0 || numSplats == 0)
+        return 0;
+
+    /* A low percentile rather than the minimum, so that a few small splats
+     * do not force a dense bucket to the fine grid.
+     */
+    Statistics::Container::vector<float> radii("mem.BucketLoader.radii");
+    radii.reserve(numSplats);
+    for (std::size_t i = 0; i < numSplats; i++)
+        radii.push_back(splats[i].radius);
+    Statistics::Container::vector<float>::iterator nth = radii.begin() + numSplats / 10;
+    std::nth_element(radii.begin(), nth, radii.end());
+
+    unsigned int level = 0;
+    float radius = *nth;
+    while (level < maxLevel && radius >= 2.0f * minRadius)
+    {
+        radius *= 0.5f;
+        level++;
+    }
+
+    // Coarse cells must tile the bucket exactly, so that neighbours at the same level share keys
+    for (; level > 0; level--)
+    {
+        const Grid::difference_type mask = (Grid::difference_type(1) << level) - 1;
+        bool aligned = true;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            const Grid::extent_type &extent = grid.getExtent(i);
+            if ((extent.first & mask) || (extent.second & mask))
+                aligned = false;
+        }
+        if (aligned)
+            break;
+    }
+    return level;
+}
+
+BucketLoaderQueue::BucketLoaderQueue(
+    BucketLoader &loader, std::size_t capacity, Timeplot::Worker &tworker)
+    : loader(loader), capacity(capacity), tworker(tworker),
+    pushStat(Statistics::getStatistic<Statistics::Variable>("bucket.loader.queue.push"))
+{
+    if (capacity > 0)
+        queue.reset(new BoundedWorkQueue<bins_ptr>(capacity));
+}
+
+void BucketLoaderQueue::start()
+{
+    if (capacity > 0)
+    {
+        error = boost::exception_ptr();
+        queue->start();
+        thread.reset(new boost::thread(boost::bind(&BucketLoaderQueue::run, this)));
+    }
+}
+
+void BucketLoaderQueue::checkError()
+{
+    boost::lock_guard<boost::mutex> lock(errorMutex);
+    if (error)
+        boost::rethrow_exception(error);
+}
+
+void BucketLoaderQueue::operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins)
+{
+    if (capacity == 0)
+    {
+        loader(bins);
+        return;
+    }
+
+    checkError();
+    bins_ptr copy = boost::make_shared<Statistics::Container::vector<BucketCollector::Bin> >(
+        "mem.BucketCollector.bins", bins.begin(), bins.end());
+    Timeplot::Action timer("push", tworker, pushStat);
+    queue->push(copy);
+}
+
+void BucketLoaderQueue::stop()
+{
+    if (capacity == 0)
+        return;
+
+    queue->stop();
+    thread->join();
+    thread.reset();
+    checkError();
+}
+
+void BucketLoaderQueue::run()
+{
+    thread_set_name("loader");
+    while (true)
+    {
+        bins_ptr bins = queue->pop();
+        if (!bins)
+            break;
+        {
+            /* After a failure, keep draining the queue so that the producer
+             * does not block before it sees the error.
+             */
+            boost::lock_guard<boost::mutex> lock(errorMutex);
+            if (error)
+                continue;
+        }
+        try
+        {
+            loader(*bins);
+        }
+        catch (...)
+        {
+            boost::lock_guard<boost::mutex> lock(errorMutex);
+            error = boost::current_exception();
+        }
+    }
+}
@@ -31,16 +31,28 @@
 # include <config.h>
 #endif
 #include <boost/noncopyable.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/exception_ptr.hpp>
 #include <utility>
+#include <vector>
 #include <cstring>
 #include <cstddef>
 #include "grid.h"
 #include "bucket_collector.h"
 #include "allocator.h"
+#include "work_queue.h"
+#include "timeplot.h"
+#include "large_pages.h"
+#include "chunk_id.h"
 
 class CopyGroup;
+class ChunkTracker;
+class MemoryGovernor;
 namespace SplatSet { class FileSet; }
-namespace Statistics { class Variable; }
+namespace Statistics { class Variable; class Counter; }
 namespace Timeplot { class Worker; }
 
 /**
@@ -56,13 +68,135 @@ private:
 public:
     typedef void result_type;
 
+    /// Largest level accepted by @ref setAdaptive
+    static const unsigned int maxAdaptiveLevel = 8;
+
     BucketLoader(std::size_t maxItemSplats, CopyGroup &outGroup, Timeplot::Worker &tworker);
 
     /// Prepares for a pass
     void start(const Splats &super, const Grid &fullGrid);
 
+    /**
+     * Enable coarsening of the grid for sparse buckets. Each bucket is
+     * processed on a grid whose spacing is 2<sup>L</sup> times the base
+     * spacing, where L is the largest level (at most @a maxLevel) for which
+     * the 10th percentile of the splat radii is still at least @a minRadius
+     * coarse cells. The splats are scaled into the coarse grid, and the level
+     * is recorded in the work item.
+     *
+     * @param maxLevel     Maximum coarsening level (0 to disable), at most @ref maxAdaptiveLevel.
+     * @param minRadius    Minimum radius, in coarse cells, of the small splats.
+     */
+    void setAdaptive(unsigned int maxLevel, float minRadius);
+
+    /**
+     * Enable reordering of the splats of each bucket along a Morton curve
+     * through the cells of its grid. Splats that are close in space are then
+     * close in memory, which improves cache locality when the device gathers
+     * the splats for neighbouring cells. It does not change which splats are
+     * in a bucket.
+     */
+    void setSortSplats(bool sortSplats);
+
+    /**
+     * Read through small gaps between the ranges of a batch. Ranges from the
+     * same file that are separated by at most @a gapBytes of file data are
+     * merged into one read, as long as the batch still fits in the buffer,
+     * and the splats from the gaps are discarded once loaded. This trades
+     * some extra bandwidth for fewer, larger reads.
+     *
+     * @param gapBytes    Largest gap to read through, in bytes of file data (0 to disable).
+     */
+    void setCoalesceGap(std::size_t gapBytes);
+
+    /**
+     * Also produce coarser levels of detail. After the work item for each
+     * bucket, one is pushed for each level L from 1 to @a lodLevels, with
+     * the same splats processed on a grid whose spacing is 2<sup>L</sup> times
+     * the base spacing (as for @ref setAdaptive), and with @c lod set to L.
+     * The splats are thus only loaded once for all the levels.
+     *
+     * Coarse cells that straddle a bucket boundary are assigned to the
+     * bucket containing their lower corner, so they may miss some splats
+     * from the neighbouring bucket.
+     *
+     * @param lodLevels    Number of coarse levels, at most @ref maxAdaptiveLevel.
+     */
+    void setLodLevels(unsigned int lodLevels);
+
+    /**
+     * Produce only a coarse preview of the output. While @a level is
+     * non-zero, each bucket yields just the item at that level of
+     * coarsening (as for @ref setLodLevels), with @c lod set to 1 so that
+     * it goes to the first level-of-detail output, and @ref setLodLevels
+     * and @ref setSplit are ignored. Setting it back to 0 restores normal
+     * operation for the next pass.
+     *
+     * @param level    Coarsening level of the preview, at most @ref maxAdaptiveLevel.
+     */
+    void setPreview(unsigned int level);
+
+    /**
+     * Split large buckets along Z so that several devices can share them.
+     * A bucket with at least @a minSplats splats is divided into up to @a
+     * slabs slabs of roughly equal depth, each of which becomes a separate
+     * work item holding the splats that can influence it. The slabs meet
+     * on a shared plane of vertices, so the mesher welds them through the
+     * external vertices as for any other pair of adjacent buckets. Each
+     * slab is sent to the devices on its own (see @ref
+     * CopyGroup::WorkItem::split).
+     *
+     * This is used for buckets that cannot be subdivided further by the
+     * bucketing (see @ref DensityError), which would otherwise keep one
+     * device busy while the others sit idle at the end of a pass. Only the
+     * full-resolution item is split, and splitting is skipped when
+     * coarsening is enabled (see @ref setAdaptive), since the slabs could
+     * then be coarsened differently.
+     *
+     * @param minSplats   Smallest bucket to split (0 to disable).
+     * @param slabs       Maximum number of slabs per bucket.
+     */
+    void setSplit(std::size_t minSplats, unsigned int slabs);
+
+    /**
+     * Set a tracker to be told about each work item pushed to the output
+     * group. Chunks are closed (see @ref ChunkTracker::close) when the
+     * first bin of a later chunk is seen, since the collector emits chunks in
+     * order. The last chunk is never closed. It may be @c NULL.
+     */
+    void setChunkTracker(ChunkTracker *chunkTracker);
+
+    /**
+     * Set a governor to wait on (see @ref MemoryGovernor::wait) before
+     * producing each work item. It may be @c NULL.
+     */
+    void setMemoryGovernor(MemoryGovernor *governor);
+
     /// Callback for @ref BucketCollector
     void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins);
+
+    /// A work item to produce for a bucket (see @ref lodItems)
+    struct LodItem
+    {
+        unsigned int level;     ///< Coarsening level of @ref grid, or 0 for full resolution
+        unsigned int lod;       ///< Value for @ref CopyGroup::WorkItem::lod
+        Grid grid;              ///< Bucket in cells of 2<sup>level</sup> base cells
+    };
+
+    /**
+     * Determine the work items produced for a bucket covering @a grid (in
+     * base cells, with unit spacing), in the order they are pushed, given
+     * the settings of @ref setLodLevels and @ref setPreview. Coarse levels
+     * that leave no cells in the bucket are omitted. Splitting (see @ref
+     * setSplit) is not accounted for.
+     *
+     * @param grid          Bucket in base cells.
+     * @param lodLevels     Number of coarse levels of detail.
+     * @param previewLevel  Coarsening level of the preview, or 0.
+     * @param[out] out      The items to produce (replacing any previous contents).
+     */
+    static void lodItems(const Grid &grid, unsigned int lodLevels, unsigned int previewLevel,
+                         std::vector<LodItem> &out);
 private:
     const std::size_t maxItemSplats;
     CopyGroup &outGroup;
@@ -70,12 +204,121 @@ private:
     Timeplot::Worker &tworker;
 
     const Splats *super;
+    unsigned int maxLevel;          ///< Maximum coarsening level (see @ref setAdaptive)
+    float minRadius;                ///< Minimum coarse radius (see @ref setAdaptive)
+    bool sortSplats;                ///< Whether to sort splats (see @ref setSortSplats)
+    std::size_t coalesceGap;        ///< Largest gap to read through, in bytes (see @ref setCoalesceGap)
+    unsigned int lodLevels;         ///< Number of coarse levels of detail (see @ref setLodLevels)
+    unsigned int previewLevel;      ///< Coarsening level of the preview, or 0 (see @ref setPreview)
+    std::size_t splitSplats;        ///< Smallest bucket to split, or 0 (see @ref setSplit)
+    unsigned int splitSlabs;        ///< Maximum slabs per split bucket (see @ref setSplit)
+    ChunkTracker *chunkTracker;     ///< Tracker set by @ref setChunkTracker
+    MemoryGovernor *governor;       ///< Governor set by @ref setMemoryGovernor
+    bool haveLastGen;               ///< Whether @ref lastGen is valid
+    ChunkId::gen_type lastGen;      ///< Generation of the last bin seen
+
+    /**
+     * Chooses the coarsening level for a bucket. Only levels that divide
+     * the extents of @a grid are considered.
+     */
+    unsigned int chooseLevel(const Splat *splats, std::size_t numSplats, const Grid &grid) const;
+
+    /// Reorder splats along a Morton curve through the cells of @a grid
+    void sortMorton(Splat *splats, std::size_t numSplats, const Grid &grid);
+
+    /**
+     * Copy the splats of @a bin to @a out from @ref splatBuffer, which is
+     * laid out according to @a ranges. If @a slab is not @c NULL, only
+     * splats that may influence the vertices of that range of cells in Z
+     * are copied, and if @a out is @c NULL they are only counted.
+     *
+     * @return The number of splats copied.
+     */
+    std::size_t copyBin(const BucketCollector::Bin &bin,
+                        const Statistics::Container::vector<range_type> &ranges,
+                        const Grid::extent_type *slab, Splat *out) const;
+
+    /**
+     * Merge ranges of @a ranges that are separated by small gaps (see
+     * @ref setCoalesceGap), writing the result to @a out.
+     */
+    void coalesce(const Statistics::Container::vector<range_type> &ranges,
+                  Statistics::Container::vector<range_type> &out) const;
+
     /// Temporary storage for loading combined ranges before turning back into individual buckets
-    Statistics::Container::PODBuffer<Splat> splatBuffer;
+    Statistics::Container::PODBuffer<Splat, Statistics::Allocator<LargePageAllocator<Splat> > > splatBuffer;
+    /// Splat IDs matching @ref splatBuffer, used to discard the gaps (see @ref setCoalesceGap)
+    Statistics::Container::PODBuffer<SplatSet::splat_id> idBuffer;
 
     Statistics::Variable &computeStat;
     Statistics::Variable &loadStat;
     Statistics::Variable &writeStat;
+    Statistics::Variable &levelStat;
+    Statistics::Counter &splitStat;     ///< Number of buckets split by @ref setSplit
+};
+
+/**
+ * Decouples a @ref BucketLoader from the @ref BucketCollector that feeds
+ * it, so that bucketing can continue while the loader is waiting for the
+ * disk or for the @ref CopyGroup. Batches of bins are copied into a bounded
+ * queue and loaded by a separate thread, in order.
+ *
+ * The loader must have been constructed with a Timeplot worker that is not
+ * used by the bucketing thread, since it will be used from the loader
+ * thread.
+ *
+ * If the capacity is zero, no thread is used and batches are loaded
+ * synchronously by the caller.
+ */
+class BucketLoaderQueue : public boost::noncopyable
+{
+public:
+    typedef void result_type;
+
+    /**
+     * Constructor.
+     *
+     * @param loader       Loader for the batches.
+     * @param capacity     Maximum number of batches waiting to be loaded, or 0 to load synchronously.
+     * @param tworker      Timeplot worker for the thread feeding the queue.
+     */
+    BucketLoaderQueue(BucketLoader &loader, std::size_t capacity, Timeplot::Worker &tworker);
+
+    /// Starts the loader thread. Call this after starting the loader.
+    void start();
+
+    /**
+     * Callback for @ref BucketCollector. This blocks if the queue is full.
+     * If the loader thread has failed, its exception is rethrown here.
+     */
+    void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins);
+
+    /**
+     * Waits for all queued batches to be loaded and stops the thread. If
+     * loading failed, the exception is rethrown after the thread is stopped.
+     */
+    void stop();
+
+private:
+    typedef boost::shared_ptr<Statistics::Container::vector<BucketCollector::Bin> > bins_ptr;
+
+    BucketLoader &loader;
+    const std::size_t capacity;
+    Timeplot::Worker &tworker;
+
+    boost::scoped_ptr<BoundedWorkQueue<bins_ptr> > queue;
+    boost::scoped_ptr<boost::thread> thread;
+
+    boost::mutex errorMutex;
+    boost::exception_ptr error;     ///< Exception thrown by the loader, if any
+
+    Statistics::Variable &pushStat;
+
+    /// Rethrow @ref error if it is set
+    void checkError();
+
+    /// Thread function
+    void run();
 };
 
 #endif /* !COARSE_BUCKET_H */
@@ -0,0 +1,211 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Saving and replaying the buckets produced by @ref Bucket::bucket.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <cstring>
+#include <ios>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/exception/all.hpp>
+#include "bucket_plan.h"
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "splat_set.h"
+#include "bucket.h"
+#include "logging.h"
+
+namespace BucketPlan
+{
+
+namespace
+{
+
+const char magic[8] = { 'M', 'L', 'S', 'G', 'P', 'U', 'B', 'P' };
+const std::tr1::uint32_t version = 1;
+
+/// Fixed-size part of a bucket record, after the range count
+struct BucketHeader
+{
+    std::tr1::uint32_t chunk[3];
+    float reference[3];
+    float spacing;
+    std::tr1::int32_t extents[6];
+};
+
+} // anonymous namespace
+
+Recorder::Recorder(const boost::filesystem::path &path, const std::string &key, const Processor &process)
+    : path(path), tmpPath(path.string() + ".tmp." + boost::filesystem::unique_path().string()),
+    out(tmpPath, std::ios::binary), process(process), buckets(0), committed(false)
+{
+    const std::tr1::uint32_t keyLength = key.size();
+    out.write(magic, sizeof(magic));
+    out.write((const char *) &version, sizeof(version));
+    out.write((const char *) &keyLength, sizeof(keyLength));
+    out.write(key.data(), keyLength);
+}
+
+Recorder::~Recorder()
+{
+    if (!committed)
+    {
+        boost::system::error_code ec;
+        out.close();
+        remove(tmpPath, ec);
+    }
+}
+
+void Recorder::operator()(
+    const Subset &splats, const Grid &grid, const Bucket::Recursion &recursionState)
+{
+    if (out)
+    {
+        const std::tr1::uint64_t numRanges = splats.numRanges();
+        BucketHeader header;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            header.chunk[i] = recursionState.chunk[i];
+            header.reference[i] = grid.getReference()[i];
+            header.extents[2 * i] = grid.getExtent(i).first;
+            header.extents[2 * i + 1] = grid.getExtent(i).second;
+        }
+        header.spacing = grid.getSpacing();
+        out.write((const char *) &numRanges, sizeof(numRanges));
+        out.write((const char *) &header, sizeof(header));
+        for (SplatSet::SubsetBase::const_iterator i = splats.begin(); i != splats.end(); ++i)
+        {
+            const std::tr1::uint64_t range[2] = { i->first, i->second };
+            out.write((const char *) range, sizeof(range));
+        }
+        buckets++;
+    }
+    process(splats, grid, recursionState);
+}
+
+void Recorder::commit()
+{
+    const std::tr1::uint64_t end = 0;
+    out.write((const char *) &end, sizeof(end));
+    out.write((const char *) &buckets, sizeof(buckets));
+    out.close();
+
+    boost::system::error_code ec;
+    if (out)
+        rename(tmpPath, path, ec);
+    if (!out || ec)
+    {
+        Log::log[Log::warn] << "Warning: could not write bucket plan " << path.string() << '\n';
+        remove(tmpPath, ec);
+    }
+    committed = true;
+}
+
+bool replay(const boost::filesystem::path &path, const std::string &key,
+            const Splats &splats, const Processor &process)
+{
+    boost::filesystem::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+
+    char fileMagic[sizeof(magic)];
+    std::tr1::uint32_t fileVersion, keyLength;
+    in.read(fileMagic, sizeof(fileMagic));
+    in.read((char *) &fileVersion, sizeof(fileVersion));
+    in.read((char *) &keyLength, sizeof(keyLength));
+    if (!in
+        || std::memcmp(fileMagic, magic, sizeof(magic)) != 0
+        || fileVersion != version
+        || keyLength != key.size())
+        return false;
+    std::string fileKey(keyLength, '\0');
+    in.read(&fileKey[0], keyLength);
+    if (!in || fileKey != key)
+        return false;
+
+    // Check that the file is complete before passing anything on
+    const std::streampos start = in.tellg();
+    std::tr1::uint64_t trailer[2];
+    in.seekg(-std::streamoff(sizeof(trailer)), std::ios::end);
+    in.read((char *) trailer, sizeof(trailer));
+    if (!in || in.tellg() - start < std::streamoff(sizeof(trailer)) || trailer[0] != 0)
+        return false;
+    in.seekg(start);
+
+    std::tr1::uint64_t buckets = 0;
+    while (true)
+    {
+        std::tr1::uint64_t numRanges;
+        in.read((char *) &numRanges, sizeof(numRanges));
+        if (!in)
+            break;
+        if (numRanges == 0)
+        {
+            std::tr1::uint64_t count;
+            in.read((char *) &count, sizeof(count));
+            if (!in || count != buckets)
+                break;
+            return true;
+        }
+
+        BucketHeader header;
+        in.read((char *) &header, sizeof(header));
+        Bucket::Recursion recursionState;
+        for (unsigned int i = 0; i < 3; i++)
+            recursionState.chunk[i] = header.chunk[i];
+        const Grid grid(header.reference, header.spacing,
+                        header.extents[0], header.extents[1],
+                        header.extents[2], header.extents[3],
+                        header.extents[4], header.extents[5]);
+
+        Subset subset(splats);
+        SplatSet::splat_id prev = 0;
+        for (std::tr1::uint64_t i = 0; i < numRanges && in; i++)
+        {
+            std::tr1::uint64_t range[2];
+            in.read((char *) range, sizeof(range));
+            if (range[0] < prev || range[0] >= range[1])
+                in.setstate(std::ios::failbit);
+            else
+            {
+                subset.addRange(range[0], range[1]);
+                prev = range[1];
+            }
+        }
+        subset.flush();
+        if (!in)
+            break;
+        process(subset, grid, recursionState);
+        buckets++;
+    }
+    throw boost::enable_error_info(std::runtime_error("Bucket plan is corrupt"))
+        << boost::errinfo_file_name(path.string());
+}
+
+} // namespace BucketPlan
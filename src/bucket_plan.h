@@ -0,0 +1,124 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Saving and replaying the buckets produced by @ref Bucket::bucket.
+ */
+
+#ifndef MLSGPU_BUCKET_PLAN_H
+#define MLSGPU_BUCKET_PLAN_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "splat_set.h"
+#include "bucket.h"
+
+/**
+ * The buckets produced by @ref Bucket::bucket depend only on the splats,
+ * the grid and the bucketing options. A plan records them in a file, so
+ * that later runs that only change other options (such as the fitting
+ * shape) can pass them on without repeating the recursion.
+ *
+ * The file has the 8-byte magic @c MLSGPUBP, a 32-bit version (currently
+ * 1), and a 32-bit length followed by the bytes of a key string describing
+ * everything the buckets depend on. Each bucket then has a 64-bit count of
+ * ranges, the three 32-bit chunk coordinates, the grid reference point and
+ * spacing as floats, its six 32-bit extents, and the ranges as pairs of
+ * 64-bit splat IDs. A zero range count marks the end, and is followed by a
+ * 64-bit count of buckets. All values are in host byte order.
+ */
+namespace BucketPlan
+{
+
+/// Type of splat set that is bucketed
+typedef SplatSet::FastBlobSet<SplatSet::FileSet> Splats;
+/// Type of subsets passed to the processor
+typedef SplatSet::Traits<Splats>::subset_type Subset;
+/// Type of the processor
+typedef Bucket::ProcessorType<Splats>::type Processor;
+
+/**
+ * Processor for @ref Bucket::bucket that writes each bucket to a plan file
+ * before passing it on to another processor. The file is written under a
+ * temporary name and only renamed into place by @ref commit, so a run that
+ * fails part-way through does not leave behind a truncated plan.
+ */
+class Recorder : public boost::noncopyable
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param path      File to write.
+     * @param key       Description of everything that the buckets depend on.
+     * @param process   Processor to which each bucket is passed on.
+     */
+    Recorder(const boost::filesystem::path &path, const std::string &key, const Processor &process);
+
+    /// Removes the temporary file if @ref commit was not called.
+    ~Recorder();
+
+    /// Record a bucket and pass it on
+    void operator()(const Subset &splats, const Grid &grid, const Bucket::Recursion &recursionState);
+
+    /**
+     * Finish the file and rename it into place. Errors are logged, but
+     * otherwise ignored, since the plan is only an optimization.
+     */
+    void commit();
+
+private:
+    const boost::filesystem::path path;
+    const boost::filesystem::path tmpPath;
+    boost::filesystem::ofstream out;
+    Processor process;
+    std::tr1::uint64_t buckets;    ///< Buckets written so far
+    bool committed;
+};
+
+/**
+ * Pass the buckets saved by a @ref Recorder to @a process, in the order
+ * they were originally produced. Only @ref Bucket::Recursion::chunk is
+ * restored in the recursion state.
+ *
+ * @param path      File written by @ref Recorder.
+ * @param key       Key that the file must have been written with.
+ * @param splats    The splats that were bucketed.
+ * @param process   Processor to receive the buckets.
+ * @return @c false if the file does not exist, is not a complete plan, or
+ * has a different key, in which case @a process is not called.
+ * @throw std::runtime_error if the file could not be read after the first
+ * bucket was passed on.
+ */
+bool replay(const boost::filesystem::path &path, const std::string &key,
+            const Splats &splats, const Processor &process);
+
+} // namespace BucketPlan
+
+#endif /* !MLSGPU_BUCKET_PLAN_H */
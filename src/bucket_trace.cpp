@@ -0,0 +1,110 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Record the size and cost of each bucket processed on a device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string>
+#include <fstream>
+#include <cerrno>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/exception/all.hpp>
+#include "bucket_trace.h"
+#include "errors.h"
+
+namespace BucketTrace
+{
+
+static bool hasFile = false;
+static boost::mutex outputMutex;
+static std::ofstream trace;
+
+Record::Record(const ChunkId &chunkId, const Grid &grid, unsigned int level, std::size_t numSplats)
+    : chunkId(chunkId), level(level), numSplats(numSplats),
+    buildTime(0.0), mlsTime(0.0), readbackTime(0.0),
+    occupiedCells(0), vertices(0), triangles(0), worker(0)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        first[i] = grid.getExtent(i).first;
+        cells[i] = grid.numCells(i);
+    }
+}
+
+void init(const std::string &filename)
+{
+    MLSGPU_ASSERT(!hasFile, state_error);
+    try
+    {
+        trace.open(filename.c_str());
+        if (!trace)
+            throw std::ios::failure("Could not open bucket trace file");
+        trace.precision(9);
+        trace << "gen,chunk_x,chunk_y,chunk_z,x,y,z,cells_x,cells_y,cells_z,level,splats,"
+            << "build,mls,readback,occupied,vertices,triangles,device,worker\n";
+        hasFile = true;
+    }
+    catch (std::ios::failure &e)
+    {
+        throw boost::enable_error_info(e)
+            << boost::errinfo_file_name(filename)
+            << boost::errinfo_errno(errno);
+    }
+}
+
+bool enabled()
+{
+    return hasFile;
+}
+
+void write(const Record &record)
+{
+    MLSGPU_ASSERT(hasFile, state_error);
+
+    // Device names are free text, so quote them in the CSV way
+    std::string device = "\"";
+    for (std::string::const_iterator i = record.device.begin(); i != record.device.end(); ++i)
+    {
+        if (*i == '"')
+            device += '"';
+        device += *i;
+    }
+    device += '"';
+
+    boost::lock_guard<boost::mutex> lock(outputMutex);
+    trace << record.chunkId.gen << ','
+        << record.chunkId.coords[0] << ',' << record.chunkId.coords[1] << ',' << record.chunkId.coords[2] << ','
+        << record.first[0] << ',' << record.first[1] << ',' << record.first[2] << ','
+        << record.cells[0] << ',' << record.cells[1] << ',' << record.cells[2] << ','
+        << record.level << ',' << record.numSplats << ','
+        << record.buildTime << ',' << record.mlsTime << ',' << record.readbackTime << ','
+        << record.occupiedCells << ',' << record.vertices << ',' << record.triangles << ','
+        << device << ',' << record.worker << '\n';
+}
+
+} // namespace BucketTrace
@@ -0,0 +1,108 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Record the size and cost of each bucket processed on a device.
+ */
+
+#ifndef BUCKET_TRACE_H
+#define BUCKET_TRACE_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <cstddef>
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "chunk_id.h"
+
+/**
+ * Per-bucket trace of the device work, intended for fitting models of bucket
+ * cost. Each bucket meshed on a device produces one line of a CSV file, with
+ * a header line naming the columns:
+ *  - @c gen, @c chunk_x, @c chunk_y, @c chunk_z: the @ref ChunkId;
+ *  - @c x, @c y, @c z: the first cell of the bucket;
+ *  - @c cells_x, @c cells_y, @c cells_z: the number of cells on each axis;
+ *  - @c level: the coarsening level (see @ref BucketLoader::setAdaptive),
+ *    in whose units the previous six columns are given;
+ *  - @c splats: the number of splats;
+ *  - @c build, @c mls, @c readback: seconds spent building the octree
+ *    (and estimating normals, if enabled), fitting and extracting the
+ *    surface, and reading the mesh back;
+ *  - @c occupied, @c vertices, @c triangles: see @ref Marching::Counts;
+ *  - @c device, @c worker: the device name and the index of the worker
+ *    thread within its group.
+ *
+ * The times are measured on the host by waiting for each stage, so tracing
+ * removes some of the overlap between stages and the run is a little slower.
+ * When several buckets share an octree (see @ref DeviceWorkerGroup::setBatchTrees),
+ * its build time is charged to the first of them. Buckets found in the
+ * @ref BucketCache are not recorded.
+ */
+namespace BucketTrace
+{
+
+/// Data for one line of the trace
+struct Record
+{
+    ChunkId chunkId;
+    Grid::difference_type first[3];  ///< First cell on each axis
+    Grid::size_type cells[3];        ///< Number of cells on each axis
+    unsigned int level;              ///< Coarsening level
+    std::size_t numSplats;
+    double buildTime;                ///< Seconds to build the octree
+    double mlsTime;                  ///< Seconds to fit and extract the surface
+    double readbackTime;             ///< Seconds to read back the mesh
+    std::tr1::uint64_t occupiedCells;
+    std::tr1::uint64_t vertices;
+    std::tr1::uint64_t triangles;
+    std::string device;
+    unsigned int worker;
+
+    /// Fill in the fields that describe a bucket, and zero the rest
+    Record(const ChunkId &chunkId, const Grid &grid, unsigned int level, std::size_t numSplats);
+};
+
+/**
+ * Start writing the trace. This function is optional; if it is not called,
+ * @ref enabled returns false and nothing is recorded.
+ *
+ * @param filename          File to which the trace is written.
+ * @throw std::ios::failure if the file could not be opened.
+ * @pre @ref init has not already been called.
+ */
+void init(const std::string &filename);
+
+/// Whether @ref init has been called, so that records should be gathered
+bool enabled();
+
+/**
+ * Append a record to the trace. This is thread-safe.
+ *
+ * @pre @ref init has been called.
+ */
+void write(const Record &record);
+
+} // namespace BucketTrace
+
+#endif /* !BUCKET_TRACE_H */
@@ -33,6 +33,7 @@
 #include <boost/array.hpp>
 #include <boost/serialization/serialization.hpp>
 #include "tr1_cstdint.h"
+#include "grid.h"
 
 /**
  * Base struct for @ref ChunkId. It contains all the data fields but is POD
@@ -0,0 +1,81 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Detection of output chunks that have been completely processed.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <map>
+#include <cassert>
+#include <boost/thread/locks.hpp>
+#include "chunk_tracker.h"
+
+ChunkTracker::ChunkTracker(const Callback &callback)
+    : callback(callback)
+{
+}
+
+bool ChunkTracker::checkComplete(std::map<gen_type, State>::iterator pos)
+{
+    if (pos->second.closed && pos->second.pending == 0)
+    {
+        chunks.erase(pos);
+        return true;
+    }
+    return false;
+}
+
+void ChunkTracker::add(gen_type gen, unsigned int n)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    chunks[gen].pending += n;
+}
+
+void ChunkTracker::done(gen_type gen)
+{
+    bool complete;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::map<gen_type, State>::iterator pos = chunks.find(gen);
+        assert(pos != chunks.end() && pos->second.pending > 0);
+        pos->second.pending--;
+        complete = checkComplete(pos);
+    }
+    if (complete)
+        callback(gen);
+}
+
+void ChunkTracker::close(gen_type gen)
+{
+    bool complete;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::map<gen_type, State>::iterator pos = chunks.insert(std::make_pair(gen, State())).first;
+        pos->second.closed = true;
+        complete = checkComplete(pos);
+    }
+    if (complete)
+        callback(gen);
+}
@@ -0,0 +1,93 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Detection of output chunks that have been completely processed.
+ */
+
+#ifndef CHUNK_TRACKER_H
+#define CHUNK_TRACKER_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <map>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include "chunk_id.h"
+
+/**
+ * Counts the work in flight for each output chunk, and reports when a chunk
+ * has no work left and will receive no more. Each stage of the pipeline
+ * calls @ref add for every piece of work it hands on, and @ref done when it
+ * has finished with a piece it received, so a chunk's count only drops to
+ * zero once everything downstream has also finished. The stage at the head
+ * of the pipeline calls @ref close once it has handed on all the work for a
+ * chunk.
+ *
+ * All the functions are thread-safe. The callback is made without holding
+ * the internal lock, from whichever thread finished the last piece of work.
+ */
+class ChunkTracker : public boost::noncopyable
+{
+public:
+    typedef ChunkId::gen_type gen_type;
+    typedef boost::function<void(gen_type)> Callback;
+
+    /// Constructor.
+    explicit ChunkTracker(const Callback &callback);
+
+    /// Record @a n new pieces of work for chunk @a gen.
+    void add(gen_type gen, unsigned int n = 1);
+
+    /**
+     * Record that a piece of work for chunk @a gen has finished.
+     *
+     * @pre There is outstanding work for the chunk.
+     */
+    void done(gen_type gen);
+
+    /**
+     * Record that no more work will be added for chunk @a gen, except by
+     * stages finishing existing work.
+     */
+    void close(gen_type gen);
+
+private:
+    struct State
+    {
+        unsigned int pending;     ///< Pieces of work not yet finished
+        bool closed;              ///< Whether @ref close has been called
+
+        State() : pending(0), closed(false) {}
+    };
+
+    Callback callback;
+    boost::mutex mutex;
+    std::map<gen_type, State> chunks;   ///< Chunks that are still open or have work
+
+    /// Remove the chunk and return true if it is complete. The caller must hold @ref mutex.
+    bool checkComplete(std::map<gen_type, State>::iterator pos);
+};
+
+#endif /* !CHUNK_TRACKER_H */
@@ -37,10 +37,12 @@
 #include <list>
 #include <boost/noncopyable.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/bind.hpp>
 #include "statistics.h"
 #include "allocator.h"
 #include "errors.h"
 #include "timeplot.h"
+#include "metrics.h"
 #include "circular_buffer.h"
 
 std::size_t CircularBufferBase::Allocation::get() const
@@ -60,7 +62,8 @@ CircularBufferBase::Allocation::Allocation()
 }
 
 CircularBufferBase::CircularBufferBase(const std::string &name, std::size_t size)
-    : bufferSize(size), firstFree(0), allocPoints(name)
+    : bufferSize(size), firstFree(0), allocPoints(name),
+    usedGauge(name + ".used", boost::bind(&CircularBufferBase::used, this))
 {
     MLSGPU_ASSERT(size > 0, std::invalid_argument);
 }
@@ -124,6 +127,18 @@ std::size_t CircularBufferBase::size() const
 }
 
 std::size_t CircularBufferBase::unallocated()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return unallocatedUnlocked();
+}
+
+std::size_t CircularBufferBase::used()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return bufferSize - unallocatedUnlocked();
+}
+
+std::size_t CircularBufferBase::unallocatedUnlocked() const
 {
     if (allocPoints.empty())
         return bufferSize;
@@ -166,7 +181,7 @@ void CircularBuffer::free(const Allocation &alloc)
 CircularBuffer::CircularBuffer(const std::string &name, std::size_t size)
     :
     CircularBufferBase(name, size),
-    allocator(Statistics::makeAllocator<Statistics::Allocator<std::allocator<char> > >(name)),
+    allocator(Statistics::makeAllocator<Statistics::Allocator<LargePageAllocator<char> > >(name)),
     buffer(NULL)
 {
     buffer = allocator.allocate(size);
@@ -176,3 +191,224 @@ CircularBuffer::~CircularBuffer()
 {
     allocator.deallocate(buffer, size());
 }
+
+std::size_t LockFreeCircularBufferBase::Allocation::get() const
+{
+    return start;
+}
+
+LockFreeCircularBufferBase::Allocation::Allocation(std::size_t seq, std::size_t start)
+    : seq(seq), start(start)
+{
+}
+
+LockFreeCircularBufferBase::Allocation::Allocation()
+    : seq(0), start(0)
+{
+}
+
+LockFreeCircularBufferBase::LockFreeCircularBufferBase(
+    const std::string &name, std::size_t size,
+    std::size_t maxAllocations, bool multiProducer)
+    : multiProducer(multiProducer), waiting(0),
+    bufferSize(size), firstFree(0), head(0), tail(0),
+    usedGauge(name + ".used", boost::bind(&LockFreeCircularBufferBase::used, this))
+{
+    MLSGPU_ASSERT(size > 0, std::invalid_argument);
+    MLSGPU_ASSERT(maxAllocations > 0, std::invalid_argument);
+    std::size_t ringSize = 1;
+    while (ringSize < maxAllocations)
+        ringSize *= 2;
+    Record blank = {0, 0};
+    records.resize(ringSize, blank);
+}
+
+std::size_t LockFreeCircularBufferBase::findSpace(std::size_t n, std::size_t oldest) const
+{
+    if (oldest == head)
+        return 0;
+
+    std::size_t end = records[oldest & (records.size() - 1)].start;
+    if (firstFree <= end)
+    {
+        if (end - firstFree >= n)
+            return firstFree;
+    }
+    else
+    {
+        if (bufferSize - firstFree >= n)
+            return firstFree;
+        else if (end >= n)
+            return 0;
+    }
+    return bufferSize;
+}
+
+LockFreeCircularBufferBase::Allocation LockFreeCircularBufferBase::allocate(
+    Timeplot::Worker &tworker, std::size_t n,
+    Statistics::Variable *stat)
+{
+    MLSGPU_ASSERT(n > 0, std::invalid_argument);
+    MLSGPU_ASSERT(n <= bufferSize, std::out_of_range);
+
+    Timeplot::Action action("get", tworker, stat);
+    action.setValue(n);
+
+    boost::unique_lock<boost::mutex> allocLock(allocMutex, boost::defer_lock);
+    if (multiProducer)
+        allocLock.lock();
+
+    Allocation ans;
+    std::size_t oldest;
+    while (!claim(n, oldest, ans))
+    {
+        /* Announce that we are about to sleep, then check again: either
+         * we see a reclamation made after the first check, or the consumer
+         * that made it sees the flag and wakes us.
+         */
+        boost::unique_lock<boost::mutex> lock(waitMutex);
+        __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&tail, __ATOMIC_SEQ_CST) == oldest)
+            spaceCondition.wait(lock);
+        __atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+    }
+    return ans;
+}
+
+bool LockFreeCircularBufferBase::tryAllocate(std::size_t n, Allocation &alloc)
+{
+    MLSGPU_ASSERT(n > 0, std::invalid_argument);
+    MLSGPU_ASSERT(n <= bufferSize, std::out_of_range);
+
+    boost::unique_lock<boost::mutex> allocLock(allocMutex, boost::defer_lock);
+    if (multiProducer)
+        allocLock.lock();
+    std::size_t oldest;
+    return claim(n, oldest, alloc);
+}
+
+bool LockFreeCircularBufferBase::claim(std::size_t n, std::size_t &oldest, Allocation &alloc)
+{
+    const std::size_t mask = records.size() - 1;
+    oldest = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (head - oldest > mask)
+        return false;
+    std::size_t pos = findSpace(n, oldest);
+    if (pos == bufferSize)
+        return false;
+
+    Record &record = records[head & mask];
+    __atomic_store_n(&record.start, pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&record.freed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&firstFree, pos + n, __ATOMIC_RELAXED);
+    alloc = Allocation(head, pos);
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void LockFreeCircularBufferBase::free(const Allocation &alloc)
+{
+    const std::size_t mask = records.size() - 1;
+    __atomic_store_n(&records[alloc.seq & mask].freed, 1, __ATOMIC_SEQ_CST);
+
+    /* Advance the tail past every freed record. Whichever thread moves the
+     * tail onto a record checks it afterwards, so a free that races with
+     * the advance is not missed.
+     */
+    bool advanced = false;
+    std::size_t t = __atomic_load_n(&tail, __ATOMIC_SEQ_CST);
+    while (t != __atomic_load_n(&head, __ATOMIC_ACQUIRE)
+           && __atomic_load_n(&records[t & mask].freed, __ATOMIC_SEQ_CST))
+    {
+        if (__atomic_compare_exchange_n(&tail, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            t++;
+            advanced = true;
+        }
+    }
+
+    if (advanced && __atomic_load_n(&waiting, __ATOMIC_SEQ_CST))
+    {
+        boost::lock_guard<boost::mutex> lock(waitMutex);
+        spaceCondition.notify_one();
+    }
+}
+
+std::size_t LockFreeCircularBufferBase::size() const
+{
+    return bufferSize;
+}
+
+std::size_t LockFreeCircularBufferBase::unallocated()
+{
+    const std::size_t oldest = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if (oldest == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+        return bufferSize;
+    const std::size_t end = __atomic_load_n(&records[oldest & (records.size() - 1)].start, __ATOMIC_RELAXED);
+    const std::size_t first = __atomic_load_n(&firstFree, __ATOMIC_RELAXED);
+    if (end >= first)
+        return end - first;
+    else
+        return bufferSize - first + end;
+}
+
+std::size_t LockFreeCircularBufferBase::used()
+{
+    return bufferSize - unallocated();
+}
+
+void *LockFreeCircularBuffer::Allocation::get() const
+{
+    return ptr;
+}
+
+LockFreeCircularBuffer::Allocation LockFreeCircularBuffer::allocate(
+    Timeplot::Worker &tworker, std::size_t bytes,
+    Statistics::Variable *stat)
+{
+    Allocation ans;
+    ans.base = LockFreeCircularBufferBase::allocate(tworker, bytes, stat);
+    ans.ptr = buffer + ans.base.get();
+    return ans;
+}
+
+LockFreeCircularBuffer::Allocation LockFreeCircularBuffer::allocate(
+    Timeplot::Worker &tworker,
+    std::size_t elementSize, std::size_t elements,
+    Statistics::Variable *stat)
+{
+    MLSGPU_ASSERT(elementSize > 0, std::invalid_argument);
+    MLSGPU_ASSERT(elements <= size() / elementSize, std::out_of_range);
+    return allocate(tworker, elementSize * elements, stat);
+}
+
+bool LockFreeCircularBuffer::tryAllocate(std::size_t bytes, Allocation &alloc)
+{
+    if (!LockFreeCircularBufferBase::tryAllocate(bytes, alloc.base))
+        return false;
+    alloc.ptr = buffer + alloc.base.get();
+    return true;
+}
+
+void LockFreeCircularBuffer::free(const Allocation &alloc)
+{
+    LockFreeCircularBufferBase::free(alloc.base);
+}
+
+LockFreeCircularBuffer::LockFreeCircularBuffer(
+    const std::string &name, std::size_t size,
+    std::size_t maxAllocations, bool multiProducer, char *memory)
+    :
+    LockFreeCircularBufferBase(name, size, maxAllocations, multiProducer),
+    allocator(Statistics::makeAllocator<Statistics::Allocator<LargePageAllocator<char> > >(name)),
+    buffer(memory), ownsBuffer(memory == NULL)
+{
+    if (ownsBuffer)
+        buffer = allocator.allocate(size);
+}
+
+LockFreeCircularBuffer::~LockFreeCircularBuffer()
+{
+    if (ownsBuffer)
+        allocator.deallocate(buffer, size());
+}
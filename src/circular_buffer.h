@@ -35,6 +35,7 @@
 #include <utility>
 #include <string>
 #include <list>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
@@ -42,6 +43,8 @@
 #include "statistics.h"
 #include "allocator.h"
 #include "timeplot.h"
+#include "metrics.h"
+#include "large_pages.h"
 
 /**
  * Thread-safe circular buffer manager. It does not actually handle
@@ -85,6 +88,15 @@ private:
     /// Start positions of all live allocations.
     Statistics::Container::list<std::size_t> allocPoints;
 
+    /// Reports the number of elements that are not available for allocation
+    Metrics::Gauge usedGauge;
+
+    /// Implementation of @ref unallocated, with the caller holding @ref mutex
+    std::size_t unallocatedUnlocked() const;
+
+    /// Number of elements not available for allocation, for @ref usedGauge
+    std::size_t used();
+
 public:
     /**
      * Metadata about an allocation. This contains both public information
@@ -114,7 +126,8 @@ public:
     /**
      * Constructor.
      *
-     * @param name       Name for allocator used for internal metadata.
+     * @param name       Name for allocator used for internal metadata, and
+     *                   prefix for the gauge reporting the fill level.
      * @param size       Number of elements in the buffer.
      *
      * @pre @a size &gt; 0
@@ -164,7 +177,7 @@ class CircularBuffer : protected CircularBufferBase
 {
 private:
     /// Allocator used to allocate and free @ref buffer
-    Statistics::Allocator<std::allocator<char> > allocator;
+    Statistics::Allocator<LargePageAllocator<char> > allocator;
     /// Memory backing the buffer
     char *buffer;
 public:
@@ -245,4 +258,220 @@ public:
     ~CircularBuffer();
 };
 
+/**
+ * Circular buffer manager with the same interface as @ref CircularBufferBase,
+ * but which does not take a lock on the common path. Live allocations are
+ * recorded in a fixed ring rather than a list, with head and tail sequence
+ * numbers that are updated atomically. A thread only sleeps when the buffer
+ * (or the ring of records) is full.
+ *
+ * By default there must be a single producer, i.e. only one thread may call
+ * @ref allocate at a time. If @a multiProducer is passed to the constructor,
+ * producers are serialized by a mutex, which consumers never take. Any number
+ * of threads may call @ref free, in any order, although as for @ref
+ * CircularBufferBase space is only reclaimed once the oldest allocation has
+ * been freed.
+ */
+class LockFreeCircularBufferBase : public boost::noncopyable
+{
+public:
+    class Allocation;
+
+private:
+    /// Bookkeeping for one allocation
+    struct Record
+    {
+        std::size_t start;   ///< First element, set by the producer
+        int freed;           ///< Non-zero once @ref free has been called (atomic)
+    };
+
+    /// Whether @ref allocate takes @ref allocMutex
+    const bool multiProducer;
+
+    /// Serializes producers if @ref multiProducer is set
+    boost::mutex allocMutex;
+
+    /// Mutex used only to sleep on @ref spaceCondition
+    boost::mutex waitMutex;
+
+    /// Condition signalled when the oldest allocation is reclaimed and @ref waiting is set
+    boost::condition_variable spaceCondition;
+
+    /// Non-zero while a producer is (about to be) sleeping on @ref spaceCondition (atomic)
+    int waiting;
+
+    /// Total number of elements
+    std::size_t bufferSize;
+
+    /**
+     * First free position, in the range [0, @ref bufferSize]. It is only
+     * written by the producer, but is read by @ref unallocated.
+     */
+    std::size_t firstFree;
+
+    /// Ring of allocation records, indexed by sequence number modulo its (power of two) size
+    std::vector<Record> records;
+
+    /// Sequence number of the next allocation (written by the producer)
+    std::size_t head;
+
+    /// Sequence number of the oldest live allocation (advanced by consumers)
+    std::size_t tail;
+
+    /// Reports the number of elements that are not available for allocation
+    Metrics::Gauge usedGauge;
+
+    /**
+     * Find space for @a n elements given a snapshot of @ref tail. Returns
+     * @ref bufferSize if there is no space.
+     */
+    std::size_t findSpace(std::size_t n, std::size_t oldest) const;
+
+    /**
+     * Make an allocation if possible without waiting. The caller must be
+     * the (or hold @ref allocMutex for a) producer.
+     *
+     * @param n           Number of elements to allocate.
+     * @param[out] oldest Snapshot of @ref tail that was used.
+     * @param[out] alloc  The allocation, if successful.
+     * @return Whether the allocation was made.
+     */
+    bool claim(std::size_t n, std::size_t &oldest, Allocation &alloc);
+
+    /// Number of elements not available for allocation, for @ref usedGauge
+    std::size_t used();
+
+public:
+    /**
+     * Metadata about an allocation. It can be freely copied.
+     */
+    class Allocation
+    {
+        friend class LockFreeCircularBufferBase;
+    private:
+        std::size_t seq;      ///< Sequence number of the record
+        std::size_t start;    ///< Position of the allocation
+
+        /// Constructor used by @ref LockFreeCircularBufferBase::allocate
+        Allocation(std::size_t seq, std::size_t start);
+    public:
+        /// Creates an invalid allocation
+        Allocation();
+
+        /// Obtain the position of the allocation
+        std::size_t get() const;
+    };
+
+    /**
+     * Constructor.
+     *
+     * @param name           Prefix for the gauge reporting the fill level.
+     * @param size           Number of elements in the buffer.
+     * @param maxAllocations Number of allocations that may be live at once. It is
+     *                       rounded up to a power of two. If it is reached,
+     *                       @ref allocate blocks just as for a full buffer.
+     * @param multiProducer  Whether @ref allocate may be called from several threads at once.
+     *
+     * @pre @a size &gt; 0 and @a maxAllocations &gt; 0
+     */
+    LockFreeCircularBufferBase(const std::string &name, std::size_t size,
+                               std::size_t maxAllocations = 256, bool multiProducer = false);
+
+    /// Return number of elements in the buffer
+    std::size_t size() const;
+
+    /**
+     * Return number of unallocated elements in the buffer. This is computed
+     * without synchronization, so it is only an estimate.
+     */
+    std::size_t unallocated();
+
+    /// @copydoc CircularBufferBase::allocate
+    Allocation allocate(Timeplot::Worker &tworker, std::size_t n, Statistics::Variable *stat = NULL);
+
+    /**
+     * Variant of @ref allocate that never blocks.
+     *
+     * @param n              Number of items to allocate.
+     * @param[out] alloc     The allocation, if successful.
+     * @return Whether the allocation was made.
+     *
+     * @pre 0 &lt; @a n &lt;= @ref size().
+     */
+    bool tryAllocate(std::size_t n, Allocation &alloc);
+
+    /// @copydoc CircularBufferBase::free
+    void free(const Allocation &alloc);
+};
+
+/**
+ * Memory-backed version of @ref LockFreeCircularBufferBase, with the same
+ * interface as @ref CircularBuffer.
+ */
+class LockFreeCircularBuffer : protected LockFreeCircularBufferBase
+{
+private:
+    /// Allocator used to allocate and free @ref buffer
+    Statistics::Allocator<LargePageAllocator<char> > allocator;
+    /// Memory backing the buffer
+    char *buffer;
+    /// Whether @ref buffer was allocated by @ref allocator (rather than supplied)
+    bool ownsBuffer;
+public:
+    /**
+     * Information about an allocation from @ref allocate
+     */
+    class Allocation
+    {
+        friend class LockFreeCircularBuffer;
+    private:
+        LockFreeCircularBufferBase::Allocation base;
+        void *ptr;            ///< Pointer to the allocated memory
+
+    public:
+        void *get() const;    ///< Obtain the data pointer
+    };
+
+    using LockFreeCircularBufferBase::size;
+    using LockFreeCircularBufferBase::unallocated;
+
+    /// @copydoc CircularBuffer::allocate(Timeplot::Worker &, std::size_t, std::size_t, Statistics::Variable *)
+    Allocation allocate(Timeplot::Worker &tworker,
+                        std::size_t elementSize, std::size_t elements,
+                        Statistics::Variable *stat = NULL);
+
+    /// @copydoc CircularBuffer::allocate(Timeplot::Worker &, std::size_t, Statistics::Variable *)
+    Allocation allocate(Timeplot::Worker &tworker, std::size_t bytes,
+                        Statistics::Variable *stat = NULL);
+
+    /**
+     * Variant of @ref allocate(Timeplot::Worker &, std::size_t, Statistics::Variable *)
+     * that returns @c false instead of blocking.
+     */
+    bool tryAllocate(std::size_t bytes, Allocation &alloc);
+
+    /// @copydoc CircularBuffer::free
+    void free(const Allocation &alloc);
+
+    /**
+     * Constructor.
+     *
+     * @param name           Buffer name used for memory statistic.
+     * @param size           Bytes of storage to reserve.
+     * @param maxAllocations, multiProducer See @ref LockFreeCircularBufferBase::LockFreeCircularBufferBase.
+     * @param memory         If non-@c NULL, storage of at least @a size bytes to use
+     *                       instead of allocating it, such as pinned memory that
+     *                       devices and the network can transfer to directly. It is
+     *                       not freed, and is not accounted in the memory statistic.
+     *
+     * @pre @a size &gt; 0
+     */
+    LockFreeCircularBuffer(const std::string &name, std::size_t size,
+                           std::size_t maxAllocations = 256, bool multiProducer = false,
+                           char *memory = NULL);
+
+    /// Destructor
+    ~LockFreeCircularBuffer();
+};
+
 #endif /* !CIRCULAR_BUFFER_H */
@@ -33,10 +33,17 @@
 #include <boost/foreach.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/next_prior.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <CL/cl.hpp>
 #include <vector>
 #include <string>
 #include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <ios>
 #include <utility>
 #include <stdexcept>
 #include <algorithm>
@@ -173,7 +180,10 @@ void addOptions(boost::program_options::options_description &desc)
         (Option::device, boost::program_options::value<std::vector<std::string> >()->composing(),
                          "OpenCL device name")
         (Option::cpu,    "Use all CPU devices")
-        (Option::gpu,    "Use all GPU devices");
+        (Option::gpu,    "Use all GPU devices")
+        (Option::programCache, boost::program_options::value<std::string>(),
+                         "Directory for caching compiled OpenCL programs")
+        (Option::specialize, "Compile OpenCL kernels specialized for recurring parameters");
 }
 
 /**
@@ -301,22 +311,148 @@ cl::Context makeContext(const cl::Device &device)
     return cl::Context(devices, props, contextCallback);
 }
 
-cl::Program build(const cl::Context &context, const std::vector<cl::Device> &devices,
-                  const std::string &filename, const std::map<std::string, std::string> &defines,
-                  const std::string &options)
+bool hasExtension(const cl::Device &device, const std::string &name)
 {
-    const std::map<std::string, std::string> &sourceMap = detail::getSourceMap();
-    if (!sourceMap.count(filename))
-        throw std::invalid_argument("No such program " + filename);
-    const std::string &source = sourceMap.find(filename)->second;
+    std::istringstream extensions(device.getInfo<CL_DEVICE_EXTENSIONS>());
+    std::string ext;
+    while (extensions >> ext)
+        if (ext == name)
+            return true;
+    return false;
+}
 
-    std::ostringstream s;
-    for (std::map<std::string, std::string>::const_iterator i = defines.begin(); i != defines.end(); i++)
+namespace
+{
+
+/// Directory set by @ref setProgramCacheDir (empty if disabled)
+std::string programCacheDir;
+
+/// Flag set by @ref setSpecializeKernels
+bool specializeKernels = false;
+
+/// Flag set by @ref setProgramReuse
+bool programReuse = false;
+
+/// Number of live @ref ProgramSharing instances
+unsigned int programSharing = 0;
+
+/// Mutex protecting @ref builtPrograms, @ref programReuse and @ref programSharing
+boost::mutex builtProgramsMutex;
+
+/**
+ * Programs kept by @ref setProgramReuse or @ref ProgramSharing, keyed by the context, devices and
+ * everything passed to the compiler. Since the programs hold references to
+ * their contexts, a context handle in a key cannot be recycled.
+ */
+std::map<std::string, cl::Program> builtPrograms;
+
+/// First line of a program cache entry, identifying the format
+const char * const programCacheMagic = "mlsgpu-clbin 1";
+
+/**
+ * Produces a string that identifies everything that can affect the binary
+ * produced for a device.
+ */
+std::string programCacheKey(
+    const cl::Device &device, const std::string &header, const std::string &source,
+    const std::string &options)
+{
+    const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << platform.getInfo<CL_PLATFORM_NAME>() << '\n'
+        << platform.getInfo<CL_PLATFORM_VERSION>() << '\n'
+        << device.getInfo<CL_DEVICE_NAME>() << '\n'
+        << device.getInfo<CL_DEVICE_VENDOR>() << '\n'
+        << device.getInfo<CL_DEVICE_VERSION>() << '\n'
+        << device.getInfo<CL_DRIVER_VERSION>() << '\n'
+        << options << '\n'
+        << header << source;
+    return key.str();
+}
+
+/// 64-bit FNV-1a hash, used to name cache entries
+std::tr1::uint64_t programCacheHash(const std::string &key)
+{
+    std::tr1::uint64_t hash = 14695981039346656037ULL;
+    for (std::size_t i = 0; i < key.size(); i++)
     {
-        s << "#define " << i->first << " " << i->second << "\n";
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
     }
-    s << "#line 1 \"" << filename << "\"\n";
-    const std::string header = s.str();
+    return hash;
+}
+
+std::string programCachePath(const std::string &key)
+{
+    return getCachePath(key, ".clbin");
+}
+
+/**
+ * Look up the binary for a key in the cache. Returns an empty vector if it
+ * is not present. The full key is stored in the entry, so hash collisions
+ * are detected.
+ */
+std::vector<unsigned char> loadProgramBinary(const std::string &key)
+{
+    std::vector<unsigned char> binary;
+    std::ifstream in(programCachePath(key).c_str(), std::ios::binary);
+    if (!in)
+        return binary;
+
+    std::string magic;
+    std::size_t keySize = 0, binarySize = 0;
+    std::getline(in, magic);
+    in >> keySize;
+    in.get();
+    if (!in || magic != programCacheMagic || keySize != key.size())
+        return binary;
+    std::string storedKey(keySize, '\0');
+    in.read(&storedKey[0], keySize);
+    in >> binarySize;
+    in.get();
+    if (!in || storedKey != key || binarySize == 0)
+        return binary;
+    binary.resize(binarySize);
+    in.read(reinterpret_cast<char *>(&binary[0]), binarySize);
+    if (!in)
+        binary.clear();
+    return binary;
+}
+
+/// Store a binary in the cache.
+void saveProgramBinary(const std::string &key, const std::vector<unsigned char> &binary)
+{
+    std::ostringstream out;
+    out << programCacheMagic << '\n' << key.size() << '\n';
+    out.write(key.data(), key.size());
+    out << binary.size() << '\n';
+    out.write(reinterpret_cast<const char *>(&binary[0]), binary.size());
+    writeCacheEntry(programCachePath(key), out.str());
+}
+
+/// Extract the binary for a single-device program
+std::vector<unsigned char> getProgramBinary(const cl::Program &program)
+{
+    std::size_t size = 0;
+    cl_int status = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+    if (status != CL_SUCCESS)
+        throw cl::Error(status, "clGetProgramInfo");
+    std::vector<unsigned char> binary(size);
+    if (size > 0)
+    {
+        unsigned char *ptr = &binary[0];
+        status = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(ptr), &ptr, NULL);
+        if (status != CL_SUCCESS)
+            throw cl::Error(status, "clGetProgramInfo");
+    }
+    return binary;
+}
+
+/// Build a program from source, logging any errors
+cl::Program buildFromSource(
+    const cl::Context &context, const std::vector<cl::Device> &devices,
+    const std::string &header, const std::string &source, const std::string &options)
+{
     cl::Program::Sources sources(2);
     sources[0] = std::make_pair(header.data(), header.length());
     sources[1] = std::make_pair(source.data(), source.length());
@@ -340,7 +476,174 @@ cl::Program build(const cl::Context &context, const std::vector<cl::Device> &dev
         }
         throw;
     }
+    return program;
+}
+
+/**
+ * Build a program for a single device, using the program cache. If there is
+ * a problem with the cache, a warning is logged and the program is built
+ * from source.
+ */
+cl::Program buildCached(
+    const cl::Context &context, const cl::Device &device,
+    const std::string &header, const std::string &source, const std::string &options)
+{
+    Statistics::Counter &hits = Statistics::getStatistic<Statistics::Counter>("cl.cache.hits");
+    Statistics::Counter &misses = Statistics::getStatistic<Statistics::Counter>("cl.cache.misses");
+    const std::vector<cl::Device> devices(1, device);
+    const std::string key = programCacheKey(device, header, source, options);
+
+    try
+    {
+        std::vector<unsigned char> binary = loadProgramBinary(key);
+        if (!binary.empty())
+        {
+            cl::Program::Binaries binaries(1, std::make_pair((const void *) &binary[0], binary.size()));
+            cl::Program program(context, devices, binaries);
+            program.build(devices, options.c_str());
+            hits.add(1);
+            return program;
+        }
+    }
+    catch (std::exception &e)
+    {
+        // Includes cl::Error, e.g. for a binary rejected by the driver
+        Log::log[Log::warn] << "Could not use cached program binary: " << e.what() << '\n';
+    }
 
+    misses.add(1);
+    cl::Program program = buildFromSource(context, devices, header, source, options);
+    try
+    {
+        saveProgramBinary(key, getProgramBinary(program));
+    }
+    catch (std::exception &e)
+    {
+        Log::log[Log::warn] << "Could not save program binary to cache: " << e.what() << '\n';
+    }
+    return program;
+}
+
+} // anonymous namespace
+
+std::string getCachePath(const std::string &key, const std::string &extension)
+{
+    if (programCacheDir.empty())
+        return std::string();
+    std::ostringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << programCacheHash(key) << extension;
+    return (boost::filesystem::path(programCacheDir) / name.str()).string();
+}
+
+void writeCacheEntry(const std::string &path, const std::string &data)
+{
+    boost::filesystem::path tmpPath = path;
+    tmpPath.replace_extension(boost::filesystem::unique_path(".%%%%-%%%%-%%%%.tmp"));
+    {
+        std::ofstream out(tmpPath.string().c_str(), std::ios::binary);
+        out.write(data.data(), data.size());
+        out.close();
+        if (!out)
+        {
+            boost::system::error_code ec;
+            boost::filesystem::remove(tmpPath, ec);
+            throw boost::enable_error_info(std::ios::failure("Could not write cache entry"))
+                << boost::errinfo_file_name(tmpPath.string());
+        }
+    }
+    boost::filesystem::rename(tmpPath, path);
+}
+
+void setProgramCacheDir(const std::string &dir)
+{
+    if (!dir.empty())
+        boost::filesystem::create_directories(dir);
+    programCacheDir = dir;
+}
+
+void setSpecializeKernels(bool specialize)
+{
+    specializeKernels = specialize;
+}
+
+bool getSpecializeKernels()
+{
+    return specializeKernels;
+}
+
+void setProgramReuse(bool reuse)
+{
+    boost::lock_guard<boost::mutex> lock(builtProgramsMutex);
+    programReuse = reuse;
+    if (!reuse && programSharing == 0)
+        builtPrograms.clear();
+}
+
+ProgramSharing::ProgramSharing()
+{
+    boost::lock_guard<boost::mutex> lock(builtProgramsMutex);
+    programSharing++;
+}
+
+ProgramSharing::~ProgramSharing()
+{
+    boost::lock_guard<boost::mutex> lock(builtProgramsMutex);
+    programSharing--;
+    if (programSharing == 0 && !programReuse)
+        builtPrograms.clear();
+}
+
+cl::Program build(const cl::Context &context, const std::vector<cl::Device> &devices,
+                  const std::string &filename, const std::map<std::string, std::string> &defines,
+                  const std::string &options)
+{
+    const std::map<std::string, std::string> &sourceMap = detail::getSourceMap();
+    if (!sourceMap.count(filename))
+        throw std::invalid_argument("No such program " + filename);
+    const std::string &source = sourceMap.find(filename)->second;
+
+    std::ostringstream s;
+    for (std::map<std::string, std::string>::const_iterator i = defines.begin(); i != defines.end(); i++)
+    {
+        s << "#define " << i->first << " " << i->second << "\n";
+    }
+    s << "#line 1 \"" << filename << "\"\n";
+    const std::string header = s.str();
+
+    std::string reuseKey;
+    {
+        boost::lock_guard<boost::mutex> lock(builtProgramsMutex);
+        if (programReuse || programSharing > 0)
+        {
+            std::ostringstream key;
+            key << context() << '\n';
+            BOOST_FOREACH(const cl::Device &device, devices)
+                key << device() << '\n';
+            key << options << '\n' << header;
+            reuseKey = key.str();
+            std::map<std::string, cl::Program>::const_iterator pos = builtPrograms.find(reuseKey);
+            if (pos != builtPrograms.end())
+            {
+                Statistics::getStatistic<Statistics::Counter>("cl.reuse.hits").add(1);
+                return pos->second;
+            }
+        }
+    }
+
+    /* Binaries are cached per device, so the cache is only used for single-device
+     * programs, which is how all the programs are built in practice.
+     */
+    cl::Program program;
+    if (!programCacheDir.empty() && devices.size() == 1)
+        program = buildCached(context, devices[0], header, source, options);
+    else
+        program = buildFromSource(context, devices, header, source, options);
+
+    if (!reuseKey.empty())
+    {
+        boost::lock_guard<boost::mutex> lock(builtProgramsMutex);
+        builtPrograms[reuseKey] = program;
+    }
     return program;
 }
 
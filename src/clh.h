@@ -309,6 +309,8 @@ namespace Option
 const char * const device = "cl-device";
 const char * const gpu = "cl-gpu";
 const char * const cpu = "cl-cpu";
+const char * const programCache = "cl-cache";
+const char * const specialize = "cl-specialize";
 } // namespace Option
 
 /**
@@ -338,10 +340,90 @@ std::vector<cl::Device> findDevices(const boost::program_options::variables_map
  */
 cl::Context makeContext(const cl::Device &device);
 
+/**
+ * Determine whether @a device advertises the extension @a name.
+ */
+bool hasExtension(const cl::Device &device, const std::string &name);
+
+/**
+ * Set a directory in which to cache compiled program binaries. When this is
+ * set, @ref build looks for a binary matching the device, platform, driver
+ * version, build options and source before compiling, and stores the binary
+ * after compiling. Any problem with the cache is reported as a warning and
+ * the program is compiled from source. An empty string disables the cache,
+ * which is the initial state.
+ *
+ * The directory is created if it does not exist. Entries are written
+ * atomically, so one directory may be shared by concurrent processes.
+ *
+ * This is not thread-safe, and should be called before any programs are built.
+ */
+void setProgramCacheDir(const std::string &dir);
+
+/**
+ * Set whether kernels are compiled with values that recur across calls (such
+ * as the subsampling shift, image strides and boundary factor) baked in as
+ * preprocessor defines, rather than passed as arguments. This lets the
+ * compiler fold and unroll, at the cost of compiling a variant for each
+ * combination that is seen. The variants are cached like any other program
+ * (see @ref setProgramCacheDir). It affects objects constructed afterwards.
+ * The default is false.
+ *
+ * This is not thread-safe, and should be called before any programs are built.
+ */
+void setSpecializeKernels(bool specialize);
+
+/// Retrieve the value set with @ref setSpecializeKernels.
+bool getSpecializeKernels();
+
+/**
+ * Set whether @ref build keeps the programs it builds and returns the same
+ * program when asked to build it again for the same context and devices.
+ * This avoids recompiling in long-running processes that repeatedly set up
+ * the same work with one set of contexts. Turning it off releases the kept
+ * programs. This function is thread-safe.
+ */
+void setProgramReuse(bool reuse);
+
+/**
+ * While an instance exists, @ref build shares programs between callers that
+ * build the same program for the same context and devices, as if @ref
+ * setProgramReuse were enabled. This is intended to cover setup, when each
+ * worker of a device builds the same programs. When the last instance is
+ * destroyed, programs kept only for sharing are released; the callers keep
+ * their own references. Instances may be created and destroyed from several
+ * threads.
+ */
+class ProgramSharing : public boost::noncopyable
+{
+public:
+    ProgramSharing();
+    ~ProgramSharing();
+};
+
+/**
+ * Returns the path of the file in the cache directory (see @ref
+ * setProgramCacheDir) for the entry identified by @a key, or an empty string
+ * if the cache is disabled. The file name is a hash of @a key followed by
+ * @a extension, so the entry should store @a key to detect collisions.
+ */
+std::string getCachePath(const std::string &key, const std::string &extension);
+
+/**
+ * Writes a cache entry. It is written to a temporary file and then renamed,
+ * so that readers never see a partial entry.
+ *
+ * @throw std::ios::failure if the entry could not be written.
+ */
+void writeCacheEntry(const std::string &path, const std::string &data);
+
 /**
  * Build a program for potentially multiple devices.
  *
  * If compilation fails, the build log will be emitted to the error log.
+ * If a cache directory has been set with @ref setProgramCacheDir and @a
+ * devices holds a single device, its binary is looked up in and saved to the
+ * cache. Builds for several devices always compile from source.
  *
  * @param context         Context to use for building.
  * @param devices         Devices to build for.
@@ -0,0 +1,63 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Limit on the number of CPU-bound work items processed at once across
+ * several worker groups.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cassert>
+#include <stdexcept>
+#include <boost/thread/locks.hpp>
+#include "cpu_budget.h"
+#include "errors.h"
+
+CpuBudget::CpuBudget(std::size_t slots)
+    : slots(slots), used(0)
+{
+    MLSGPU_ASSERT(slots > 0, std::invalid_argument);
+}
+
+void CpuBudget::acquire(Timeplot::Worker &tworker)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    if (used >= slots)
+    {
+        Timeplot::Action timer("budget", tworker, "cpu.budget.wait");
+        while (used >= slots)
+            cond.wait(lock);
+    }
+    used++;
+}
+
+void CpuBudget::release()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        assert(used > 0);
+        used--;
+    }
+    cond.notify_one();
+}
@@ -0,0 +1,104 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Limit on the number of CPU-bound work items processed at once across
+ * several worker groups.
+ */
+
+#ifndef CPU_BUDGET_H
+#define CPU_BUDGET_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "timeplot.h"
+
+/**
+ * A pool of CPU slots shared by several worker groups (see @ref
+ * WorkerGroup::setCpuBudget). Each group keeps its own threads, whose number
+ * is the concurrency limit for that stage, but a thread only processes an
+ * item while holding a slot. Groups can thus be given more threads than
+ * their fair share of the cores: a stage that is idle leaves its slots to
+ * whichever stage has work, and the total never oversubscribes the CPU.
+ *
+ * A thread holds its slot for the whole of an item, including any time it
+ * is blocked. To avoid deadlock, a group using the budget must never wait
+ * for another group that also uses it (for example, by obtaining an output
+ * item from it).
+ *
+ * All the functions are thread-safe.
+ */
+class CpuBudget : public boost::noncopyable
+{
+public:
+    /**
+     * Holds a slot for the lifetime of the object.
+     */
+    class Slot : public boost::noncopyable
+    {
+    public:
+        /// Acquire a slot from @a budget, blocking until one is free
+        Slot(CpuBudget &budget, Timeplot::Worker &tworker) : budget(budget) { budget.acquire(tworker); }
+        ~Slot() { budget.release(); }
+
+    private:
+        CpuBudget &budget;
+    };
+
+    /**
+     * Constructor.
+     *
+     * @param slots   Number of items that may be processed at once.
+     * @pre @a slots &gt; 0.
+     */
+    explicit CpuBudget(std::size_t slots);
+
+    /**
+     * Block until a slot is free and take it. The time spent blocked is
+     * recorded in @c cpu.budget.wait.
+     */
+    void acquire(Timeplot::Worker &tworker);
+
+    /**
+     * Return a slot taken by @ref acquire.
+     *
+     * @pre A slot is held.
+     */
+    void release();
+
+    /// Returns the number of slots passed to the constructor.
+    std::size_t getSlots() const { return slots; }
+
+private:
+    const std::size_t slots;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::size_t used;                  ///< Slots currently held
+};
+
+#endif /* !CPU_BUDGET_H */
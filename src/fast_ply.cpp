@@ -47,6 +47,7 @@
 #include <cerrno>
 #include <memory>
 #include <locale>
+#include <cmath>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
@@ -54,6 +55,7 @@
 #include <boost/exception/all.hpp>
 #include <boost/bind.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/thread/locks.hpp>
 #include "fast_ply.h"
 #include "splat.h"
 #include "errors.h"
@@ -188,6 +190,8 @@ void Reader::readHeader(std::istream &in)
         };
 
         vertexSize = 0;
+        packedNormals = false;
+        packedNormalOffset = 0;
         size_type elements = 0;
         bool haveProperty[numProperties] = {};
 
@@ -294,6 +298,15 @@ void Reader::readHeader(std::istream &in)
                     /* Vertex element - match it up to the expected fields */
                     if (isList)
                         throw boost::enable_error_info(FormatError("Lists in a vertex are not supported"));
+                    if (name == "normal_oct")
+                    {
+                        if (packedNormals)
+                            throw boost::enable_error_info(FormatError("Duplicate property " + name));
+                        if (valueType != UINT32)
+                            throw boost::enable_error_info(FormatError("Property " + name + " must be UINT32"));
+                        packedNormals = true;
+                        packedNormalOffset = vertexSize;
+                    }
                     for (unsigned int i = 0; i < numProperties; i++)
                     {
                         if (name == propertyNames[i])
@@ -318,11 +331,196 @@ void Reader::readHeader(std::istream &in)
         if (elements < 1)
             throw boost::enable_error_info(FormatError("No elements found"));
 
+        if (packedNormals)
+        {
+            if (haveProperty[NX] || haveProperty[NY] || haveProperty[NZ])
+                throw boost::enable_error_info(FormatError("Both normal_oct and nx/ny/nz found"));
+            haveProperty[NX] = haveProperty[NY] = haveProperty[NZ] = true;
+        }
+        haveNormals = haveProperty[NX] || haveProperty[NY] || haveProperty[NZ];
+        haveRadius = haveProperty[RADIUS];
+        if (pointRadius > 0.0f)
+        {
+            // Raw point clouds: normals (all or none) and radii may be absent
+            if (!haveNormals)
+                haveProperty[NX] = haveProperty[NY] = haveProperty[NZ] = true;
+            haveProperty[RADIUS] = true;
+        }
         for (unsigned int i = 0; i < numProperties; i++)
             if (!haveProperty[i])
                 throw boost::enable_error_info(FormatError(std::string("Property ") + propertyNames[i] + " not found"));
 
         headerSize = in.tellg();
+
+        standardLayout = !packedNormals && haveNormals && haveRadius;
+        for (unsigned int i = Y; i < numProperties; i++)
+            standardLayout = standardLayout && offsets[i] == offsets[X] + i * sizeof(float);
+        if (!standardLayout)
+            decoder = &Reader::decodeGeneric;
+        else if (vertexSize == numProperties * sizeof(float))
+            decoder = &Reader::decodeStandard<numProperties * sizeof(float)>;
+        else if (vertexSize == (numProperties + 1) * sizeof(float))
+            decoder = &Reader::decodeStandard<(numProperties + 1) * sizeof(float)>;
+        else
+            decoder = &Reader::decodeStandard<0>;
+    }
+    catch (boost::exception &e)
+    {
+        e << boost::errinfo_file_name(path.string());
+        throw;
+    }
+}
+
+/// Read a little-endian value from a LAS header
+template<typename T>
+static T getLas(const std::vector<char> &data, std::size_t offset)
+{
+    T ans;
+    std::memcpy(&ans, &data[offset], sizeof(T));
+    return ans;
+}
+
+void Reader::readHeaders()
+{
+    boost::scoped_ptr<BinaryReader> reader(readerFactory());
+    reader->open(path);
+    char signature[4] = {};
+    if (reader->size() >= sizeof(signature))
+        reader->read(signature, sizeof(signature), 0);
+    if (std::memcmp(signature, "LASF", sizeof(signature)) == 0)
+        readLasHeader(*reader);
+    else
+    {
+        boost::iostreams::stream<BinaryReaderSource> in(*reader);
+        readHeader(in);
+    }
+}
+
+void Reader::readLasHeader(const BinaryReader &in)
+{
+    /* Sizes of the standard part of each point data record format, before
+     * any extra bytes.
+     */
+    static const size_type lasRecordSizes[] = { 20, 28, 26, 34, 57, 63, 30, 36, 38, 59, 67 };
+    /* Sizes of the extra bytes data types (LAS 1.4, table 24). Type 0 takes
+     * its size from the options field, and the deprecated array types are
+     * not supported.
+     */
+    static const size_type lasExtraSizes[] = { 0, 1, 1, 2, 2, 4, 4, 8, 8, 4, 8 };
+    static const char * const propertyNames[numProperties] =
+    {
+        "x", "y", "z", "nx", "ny", "nz", "radius"
+    };
+
+    try
+    {
+        if (!cpuLittleEndian())
+            throw boost::enable_error_info(FormatError("LAS format not supported on this CPU"));
+
+        const size_type fileSize = in.size();
+        std::vector<char> header(std::min(fileSize, size_type(375)));
+        if (header.size() < 227)
+            throw boost::enable_error_info(FormatError("LAS header is truncated"));
+        in.read(&header[0], header.size(), 0);
+
+        const std::tr1::uint8_t versionMinor = getLas<std::tr1::uint8_t>(header, 25);
+        const std::tr1::uint16_t headerBytes = getLas<std::tr1::uint16_t>(header, 94);
+        const std::tr1::uint32_t pointOffset = getLas<std::tr1::uint32_t>(header, 96);
+        const std::tr1::uint32_t numVLRs = getLas<std::tr1::uint32_t>(header, 100);
+        const std::tr1::uint8_t format = getLas<std::tr1::uint8_t>(header, 104);
+        const std::tr1::uint16_t recordSize = getLas<std::tr1::uint16_t>(header, 105);
+        std::tr1::uint64_t count = getLas<std::tr1::uint32_t>(header, 107);
+        if (versionMinor >= 4 && header.size() >= 255)
+        {
+            const std::tr1::uint64_t count14 = getLas<std::tr1::uint64_t>(header, 247);
+            if (count14 != 0)
+                count = count14;
+        }
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            lasScale[i] = getLas<double>(header, 131 + 8 * i);
+            lasOffset[i] = getLas<double>(header, 155 + 8 * i);
+        }
+
+        if (format & 0x80)
+            throw boost::enable_error_info(FormatError("LAZ compressed files are not supported"));
+        if (format >= sizeof(lasRecordSizes) / sizeof(lasRecordSizes[0]))
+            throw boost::enable_error_info(FormatError("Unknown LAS point data format"));
+        if (recordSize < lasRecordSizes[format])
+            throw boost::enable_error_info(FormatError("LAS point records are too small for their format"));
+
+        vertexSize = recordSize;
+        vertexCount = count;
+        headerSize = pointOffset;
+        packedNormals = false;
+        packedNormalOffset = 0;
+        las = true;
+        bool haveProperty[numProperties] = { true, true, true, false, false, false, false };
+        offsets[X] = 0;
+        offsets[Y] = 4;
+        offsets[Z] = 8;
+
+        // Look for the extra bytes description among the variable length records
+        size_type pos = headerBytes;
+        for (std::tr1::uint32_t i = 0; i < numVLRs; i++)
+        {
+            char vlr[54];
+            if (pos + sizeof(vlr) > pointOffset || in.read(vlr, sizeof(vlr), pos) != sizeof(vlr))
+                throw boost::enable_error_info(FormatError("LAS variable length record is truncated"));
+            std::tr1::uint16_t recordId, length;
+            std::memcpy(&recordId, vlr + 18, sizeof(recordId));
+            std::memcpy(&length, vlr + 20, sizeof(length));
+            pos += sizeof(vlr);
+            const std::string userId(vlr + 2, strnlen(vlr + 2, 16));
+            if (userId == "LASF_Spec" && recordId == 4)
+            {
+                std::vector<char> extra(length);
+                if (pos + length > pointOffset
+                    || (length > 0 && in.read(&extra[0], length, pos) != length))
+                    throw boost::enable_error_info(FormatError("LAS extra bytes record is truncated"));
+                size_type extraOffset = lasRecordSizes[format];
+                for (std::size_t d = 0; d + 192 <= extra.size(); d += 192)
+                {
+                    const std::tr1::uint8_t type = extra[d + 2];
+                    const std::tr1::uint8_t options = extra[d + 3];
+                    const std::string name(&extra[d + 4], strnlen(&extra[d + 4], 32));
+                    if (type >= sizeof(lasExtraSizes) / sizeof(lasExtraSizes[0]))
+                        throw boost::enable_error_info(FormatError("Unsupported LAS extra bytes type"));
+                    const size_type size = type == 0 ? options : lasExtraSizes[type];
+                    for (unsigned int p = NX; p < numProperties; p++)
+                    {
+                        if (name == propertyNames[p])
+                        {
+                            if (haveProperty[p])
+                                throw boost::enable_error_info(FormatError("Duplicate property " + name));
+                            if (type != 9)
+                                throw boost::enable_error_info(FormatError("Property " + name + " must be float"));
+                            haveProperty[p] = true;
+                            offsets[p] = extraOffset;
+                        }
+                    }
+                    extraOffset += size;
+                }
+                if (extraOffset > recordSize)
+                    throw boost::enable_error_info(FormatError("LAS extra bytes do not fit in the point records"));
+            }
+            pos += length;
+        }
+
+        haveNormals = haveProperty[NX] || haveProperty[NY] || haveProperty[NZ];
+        haveRadius = haveProperty[RADIUS];
+        if (pointRadius > 0.0f)
+        {
+            if (!haveNormals)
+                haveProperty[NX] = haveProperty[NY] = haveProperty[NZ] = true;
+            haveProperty[RADIUS] = true;
+        }
+        for (unsigned int i = 0; i < numProperties; i++)
+            if (!haveProperty[i])
+                throw boost::enable_error_info(FormatError(std::string("Property ") + propertyNames[i] + " not found"));
+
+        standardLayout = false;
+        decoder = &Reader::decodeGeneric;
     }
     catch (boost::exception &e)
     {
@@ -336,50 +534,196 @@ Splat Reader::decode(const char *buffer, std::size_t offset) const
     buffer += offset * getVertexSize();
 
     Splat ans;
-    std::memcpy(&ans.position[0], buffer + offsets[X], sizeof(float));
-    std::memcpy(&ans.position[1], buffer + offsets[Y], sizeof(float));
-    std::memcpy(&ans.position[2], buffer + offsets[Z], sizeof(float));
-    std::memcpy(&ans.radius,      buffer + offsets[RADIUS], sizeof(float));
-    std::memcpy(&ans.normal[0],   buffer + offsets[NX], sizeof(float));
-    std::memcpy(&ans.normal[1],   buffer + offsets[NY], sizeof(float));
-    std::memcpy(&ans.normal[2],   buffer + offsets[NZ], sizeof(float));
-    ans.radius = std::min(ans.radius, maxRadius);
-    ans.radius *= smooth;
+    if (las)
+    {
+        std::tr1::int32_t p[3];
+        std::memcpy(p, buffer, sizeof(p));
+        for (unsigned int i = 0; i < 3; i++)
+            ans.position[i] = p[i] * lasScale[i] + lasOffset[i];
+    }
+    else
+    {
+        std::memcpy(&ans.position[0], buffer + offsets[X], sizeof(float));
+        std::memcpy(&ans.position[1], buffer + offsets[Y], sizeof(float));
+        std::memcpy(&ans.position[2], buffer + offsets[Z], sizeof(float));
+    }
+    if (!haveNormals)
+        ans.normal[0] = ans.normal[1] = ans.normal[2] = 0.0f;
+    else if (packedNormals)
+    {
+        std::tr1::uint32_t packed;
+        std::memcpy(&packed, buffer + packedNormalOffset, sizeof(packed));
+        unpackNormal(packed, ans.normal);
+    }
+    else
+    {
+        std::memcpy(&ans.normal[0],   buffer + offsets[NX], sizeof(float));
+        std::memcpy(&ans.normal[1],   buffer + offsets[NY], sizeof(float));
+        std::memcpy(&ans.normal[2],   buffer + offsets[NZ], sizeof(float));
+    }
+    if (haveRadius)
+    {
+        std::memcpy(&ans.radius, buffer + offsets[RADIUS], sizeof(float));
+        ans.radius = std::min(ans.radius, maxRadius);
+        ans.radius *= smooth;
+    }
+    else
+        ans.radius = pointRadius;
     ans.quality = 1.0 / (ans.radius * ans.radius);
     return ans;
 }
 
+void Reader::decodeGeneric(const Reader &owner, const char *buffer, std::size_t count, Splat *out)
+{
+    for (std::size_t i = 0; i < count; i++)
+        out[i] = owner.decode(buffer, i);
+}
+
+template<std::size_t Stride>
+void Reader::decodeStandard(const Reader &owner, const char *buffer, std::size_t count, Splat *out)
+{
+    const std::size_t stride = Stride ? Stride : owner.vertexSize;
+    const float maxRadius = owner.maxRadius;
+    const float smooth = owner.smooth;
+    buffer += owner.offsets[X];
+    for (std::size_t i = 0; i < count; i++, buffer += stride)
+    {
+        float v[numProperties];
+        std::memcpy(v, buffer, sizeof(v));
+        Splat &s = out[i];
+        s.position[0] = v[X];
+        s.position[1] = v[Y];
+        s.position[2] = v[Z];
+        s.normal[0] = v[NX];
+        s.normal[1] = v[NY];
+        s.normal[2] = v[NZ];
+        // Same arithmetic as decode, so that the results are identical
+        s.radius = std::min(v[RADIUS], maxRadius);
+        s.radius *= smooth;
+        s.quality = 1.0 / (s.radius * s.radius);
+    }
+}
+
 Reader::Reader(
     ReaderType readerType,
     const boost::filesystem::path &path,
-    float smooth, float maxRadius)
-    : readerFactory(boost::bind(createReader, readerType)), path(path), smooth(smooth), maxRadius(maxRadius)
+    float smooth, float maxRadius, float pointRadius)
+    : readerFactory(boost::bind(createReader, readerType)), path(path),
+    smooth(smooth), maxRadius(maxRadius), pointRadius(pointRadius), cache(NULL), las(false)
 {
-    boost::scoped_ptr<BinaryReader> reader(readerFactory());
-    reader->open(path);
-    boost::iostreams::stream<BinaryReaderSource> in(*reader);
-    readHeader(in);
+    readHeaders();
 }
 
 Reader::Reader(
     boost::function<BinaryReader *()> readerFactory,
     const boost::filesystem::path &path,
-    float smooth, float maxRadius)
-    : readerFactory(readerFactory), path(path), smooth(smooth), maxRadius(maxRadius)
+    float smooth, float maxRadius, float pointRadius)
+    : readerFactory(readerFactory), path(path),
+    smooth(smooth), maxRadius(maxRadius), pointRadius(pointRadius), cache(NULL), las(false)
+{
+    readHeaders();
+}
+
+Reader::Reader(
+    std::istream &in,
+    const boost::filesystem::path &path,
+    float smooth, float maxRadius, float pointRadius)
+    : path(path),
+    smooth(smooth), maxRadius(maxRadius), pointRadius(pointRadius), cache(NULL), las(false)
 {
-    boost::scoped_ptr<BinaryReader> reader(readerFactory());
-    reader->open(path);
-    boost::iostreams::stream<BinaryReaderSource> in(*reader);
     readHeader(in);
 }
 
+ReaderCache::ReaderCache(std::size_t capacity)
+    : capacity(capacity),
+    hitStat(Statistics::getStatistic<Statistics::Counter>("files.cache.hits")),
+    missStat(Statistics::getStatistic<Statistics::Counter>("files.cache.misses"))
+{
+}
+
+ReaderCache::~ReaderCache()
+{
+    for (lru_type::iterator i = lru.begin(); i != lru.end(); ++i)
+        delete i->second;
+}
+
+BinaryReader *ReaderCache::acquire(
+    const boost::filesystem::path &path, const boost::function<BinaryReader *()> &factory)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::multimap<std::string, lru_type::iterator>::iterator pos = index.find(path.string());
+        if (pos != index.end())
+        {
+            BinaryReader *reader = pos->second->second;
+            lru.erase(pos->second);
+            index.erase(pos);
+            hitStat.add(1);
+            return reader;
+        }
+        missStat.add(1);
+    }
+
+    // Open outside the lock, since it may be slow
+    std::auto_ptr<BinaryReader> reader(factory());
+    reader->open(path);
+    return reader.release();
+}
+
+void ReaderCache::release(const boost::filesystem::path &path, BinaryReader *reader)
+{
+    BinaryReader *evicted = NULL;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        lru.push_front(std::make_pair(path.string(), reader));
+        index.insert(std::make_pair(path.string(), lru.begin()));
+        if (lru.size() > capacity)
+        {
+            lru_type::iterator last = --lru.end();
+            std::multimap<std::string, lru_type::iterator>::iterator pos = index.find(last->first);
+            while (pos->second != last)
+                ++pos;
+            index.erase(pos);
+            evicted = last->second;
+            lru.pop_back();
+        }
+    }
+    // Close outside the lock, since it may be slow
+    delete evicted;
+}
+
 Reader::Handle::Handle(const Reader &owner)
-    : owner(owner), reader(owner.readerFactory())
+    : owner(owner), reader(NULL)
 {
-    reader->open(owner.path);
-    if ((reader->size() - owner.getHeaderSize()) / owner.getVertexSize() < owner.size())
-        throw boost::enable_error_info(std::ios::failure("File is too small to contain all its vertices"))
-            << boost::errinfo_file_name(owner.path.string());
+    MLSGPU_ASSERT(!owner.readerFactory.empty(), state_error);
+    if (owner.cache != NULL)
+        reader = owner.cache->acquire(owner.path, owner.readerFactory);
+    else
+    {
+        std::auto_ptr<BinaryReader> fresh(owner.readerFactory());
+        fresh->open(owner.path);
+        reader = fresh.release();
+    }
+
+    try
+    {
+        if ((reader->size() - owner.getHeaderSize()) / owner.getVertexSize() < owner.size())
+            throw boost::enable_error_info(std::ios::failure("File is too small to contain all its vertices"))
+                << boost::errinfo_file_name(owner.path.string());
+    }
+    catch (...)
+    {
+        delete reader;
+        throw;
+    }
+}
+
+Reader::Handle::~Handle()
+{
+    if (owner.cache != NULL)
+        owner.cache->release(owner.path, reader);
+    else
+        delete reader;
 }
 
 void Reader::Handle::readRaw(size_type first, size_type last, char *buffer) const
@@ -390,6 +734,138 @@ void Reader::Handle::readRaw(size_type first, size_type last, char *buffer) cons
     reader->read(buffer, (last - first) * vertexSize, owner.getHeaderSize() + first * vertexSize);
 }
 
+void Reader::Handle::prefetchRaw(size_type first, size_type last) const
+{
+    MLSGPU_ASSERT(first <= last, std::invalid_argument);
+    const std::size_t vertexSize = owner.getVertexSize();
+    reader->prefetch(owner.getHeaderSize() + first * vertexSize, (last - first) * vertexSize);
+}
+
+
+/// Convert a value in [-1, 1] to a 16-bit signed normalized value
+static std::tr1::uint32_t packSnorm16(float x)
+{
+    x = std::max(-1.0f, std::min(1.0f, x));
+    std::tr1::int32_t v = (std::tr1::int32_t) std::floor(x * 32767.0f + 0.5f);
+    return std::tr1::uint32_t(v) & 0xFFFFu;
+}
+
+/// Inverse of @ref packSnorm16
+static float unpackSnorm16(std::tr1::uint32_t v)
+{
+    std::tr1::int32_t s = std::tr1::int16_t(v & 0xFFFFu);
+    return std::max(-1.0f, s / 32767.0f);
+}
+
+static inline float signNotZero(float x)
+{
+    return x >= 0.0f ? 1.0f : -1.0f;
+}
+
+std::tr1::uint32_t packNormal(const float normal[3])
+{
+    float l1 = std::abs(normal[0]) + std::abs(normal[1]) + std::abs(normal[2]);
+    float u = 0.0f, v = 0.0f;
+    if (l1 > 0.0f)
+    {
+        u = normal[0] / l1;
+        v = normal[1] / l1;
+        if (normal[2] < 0.0f)
+        {
+            float pu = (1.0f - std::abs(v)) * signNotZero(u);
+            float pv = (1.0f - std::abs(u)) * signNotZero(v);
+            u = pu;
+            v = pv;
+        }
+    }
+    return packSnorm16(u) | (packSnorm16(v) << 16);
+}
+
+void unpackNormal(std::tr1::uint32_t packed, float normal[3])
+{
+    float u = unpackSnorm16(packed);
+    float v = unpackSnorm16(packed >> 16);
+    float z = 1.0f - std::abs(u) - std::abs(v);
+    if (z < 0.0f)
+    {
+        float pu = (1.0f - std::abs(v)) * signNotZero(u);
+        float pv = (1.0f - std::abs(u)) * signNotZero(v);
+        u = pu;
+        v = pv;
+    }
+    float l = std::sqrt(u * u + v * v + z * z);
+    normal[0] = u / l;
+    normal[1] = v / l;
+    normal[2] = z / l;
+}
+
+const std::size_t SplatCacheWriter::vertexSize;
+
+SplatCacheWriter::SplatCacheWriter(WriterType writerType, const std::string &filename, size_type numSplats)
+    : handle(createWriter(writerType)), numSplats(numSplats)
+{
+    std::ostringstream header;
+    header.imbue(std::locale::classic());
+    header << "ply\n"
+        << (cpuLittleEndian() ? "format binary_little_endian 1.0\n" : "format binary_big_endian 1.0\n")
+        << "comment mlsgpu splat cache\n"
+        << "element vertex " << numSplats << "\n"
+        << "property float32 x\n"
+        << "property float32 y\n"
+        << "property float32 z\n"
+        << "property float32 radius\n"
+        << "property uint32 normal_oct\n"
+        << "end_header\n";
+    const std::string h = header.str();
+
+    handle->open(filename);
+    handle->resize(h.size() + numSplats * vertexSize);
+    handle->write(h.data(), h.size(), 0);
+    headerSize = h.size();
+}
+
+void SplatCacheWriter::write(size_type first, size_type count, const Splat *splats)
+{
+    MLSGPU_ASSERT(first <= numSplats && numSplats - first >= count, std::out_of_range);
+    buffer.resize(count * vertexSize);
+    char *out = buffer.empty() ? NULL : &buffer[0];
+    for (size_type i = 0; i < count; i++)
+    {
+        std::tr1::uint32_t packed = packNormal(splats[i].normal);
+        std::memcpy(out, splats[i].position, 3 * sizeof(float));
+        std::memcpy(out + 3 * sizeof(float), &splats[i].radius, sizeof(float));
+        std::memcpy(out + 4 * sizeof(float), &packed, sizeof(packed));
+        out += vertexSize;
+    }
+    if (count > 0)
+        handle->write(&buffer[0], buffer.size(), headerSize + first * vertexSize);
+}
+
+void SplatCacheWriter::close()
+{
+    handle->close();
+}
+
+std::map<std::string, VertexFormat> VertexFormatWrapper::getNameMap()
+{
+    std::map<std::string, VertexFormat> ans;
+    ans["float32"] = VERTEX_FORMAT_FLOAT32;
+    ans["uint16"] = VERTEX_FORMAT_UINT16;
+    ans["uint32"] = VERTEX_FORMAT_UINT32;
+    return ans;
+}
+
+std::size_t vertexFormatSize(VertexFormat format)
+{
+    switch (format)
+    {
+    case VERTEX_FORMAT_FLOAT32: return 3 * sizeof(float);
+    case VERTEX_FORMAT_UINT16:  return 3 * sizeof(std::tr1::uint16_t);
+    case VERTEX_FORMAT_UINT32:  return 3 * sizeof(std::tr1::uint32_t);
+    }
+    assert(false);
+    return 0;
+}
 
 bool Writer::isOpen() const
 {
@@ -414,20 +890,43 @@ void Writer::setNumTriangles(size_type numTriangles)
     this->numTriangles = numTriangles;
 }
 
+void Writer::setVertexFormat(VertexFormat format)
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    vertexFormat = format;
+}
+
+void Writer::setVertexNormals(bool normals)
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    vertexNormals = normals;
+}
+
+void Writer::setVertexTransform(double scale, const double bias[3])
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    vertexScale = scale;
+    std::copy(bias, bias + 3, vertexBias);
+}
+
 Writer::Writer(WriterType writerType) :
     writeVerticesTime(Statistics::getStatistic<Statistics::Variable>("writer.writeVertices.time")),
     writeTrianglesTime(Statistics::getStatistic<Statistics::Variable>("writer.writeTriangles.time")),
     handleFactory(InternalFactory(writerType)),
-    comments(), numVertices(0), numTriangles(0)
+    comments(), numVertices(0), numTriangles(0),
+    vertexFormat(VERTEX_FORMAT_FLOAT32), vertexNormals(false), vertexScale(1.0)
 {
+    std::fill(vertexBias, vertexBias + 3, 0.0);
 }
 
 Writer::Writer(boost::function<boost::shared_ptr<BinaryWriter>()> handleFactory) : 
     writeVerticesTime(Statistics::getStatistic<Statistics::Variable>("writer.writeVertices.time")),
     writeTrianglesTime(Statistics::getStatistic<Statistics::Variable>("writer.writeTriangles.time")),
     handleFactory(handleFactory),
-    comments(), numVertices(0), numTriangles(0)
+    comments(), numVertices(0), numTriangles(0),
+    vertexFormat(VERTEX_FORMAT_FLOAT32), vertexNormals(false), vertexScale(1.0)
 {
+    std::fill(vertexBias, vertexBias + 3, 0.0);
 }
 
 Writer::size_type Writer::getNumVertices() const
@@ -440,6 +939,21 @@ Writer::size_type Writer::getNumTriangles() const
     return numTriangles;
 }
 
+VertexFormat Writer::getVertexFormat() const
+{
+    return vertexFormat;
+}
+
+bool Writer::getVertexNormals() const
+{
+    return vertexNormals;
+}
+
+Writer::size_type Writer::getVertexSize() const
+{
+    return vertexFormatSize(vertexFormat) + (vertexNormals ? 3 * sizeof(float) : 0);
+}
+
 std::string Writer::makeHeader()
 {
     std::ostringstream out;
@@ -458,11 +972,33 @@ std::string Writer::makeHeader()
         out << "comment " << s << '\n';
     }
 
+    if (vertexFormat != VERTEX_FORMAT_FLOAT32)
+    {
+        // Enough digits for the double to round-trip
+        out.precision(17);
+        out << "comment vertex_scale " << vertexScale << '\n'
+            << "comment vertex_bias "
+            << vertexBias[0] << ' ' << vertexBias[1] << ' ' << vertexBias[2] << '\n';
+    }
+
+    const char *type = "float32";
+    switch (vertexFormat)
+    {
+    case VERTEX_FORMAT_FLOAT32: type = "float32"; break;
+    case VERTEX_FORMAT_UINT16:  type = "uint16"; break;
+    case VERTEX_FORMAT_UINT32:  type = "uint32"; break;
+    }
     out << "element vertex " << numVertices << '\n'
-        << "property float32 x\n"
-        << "property float32 y\n"
-        << "property float32 z\n"
-        << "element face " << numTriangles << '\n'
+        << "property " << type << " x\n"
+        << "property " << type << " y\n"
+        << "property " << type << " z\n";
+    if (vertexNormals)
+    {
+        out << "property float32 nx\n"
+            << "property float32 ny\n"
+            << "property float32 nz\n";
+    }
+    out << "element face " << numTriangles << '\n'
         << "property list uint8 uint32 vertex_indices\n"
         << "comment padding:";
     /* Use a comment to pad the header to a multiple of 4 bytes, so that the
@@ -487,12 +1023,41 @@ void Writer::open(const std::string &filename)
     handle->open(filename);
 
     std::string header = makeHeader();
+    const size_type vertexSize = getVertexSize();
     handle->resize(header.size() + getNumVertices() * vertexSize + getNumTriangles() * triangleSize);
     handle->write(header.data(), header.size(), 0);
     vertexStart = header.size();
     triangleStart = vertexStart + getNumVertices() * vertexSize;
 }
 
+void Writer::open(const std::string &filename, size_type offset)
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    handle = handleFactory();
+    handle->setTruncate(false);
+    handle->open(filename);
+
+    std::string header = makeHeader();
+    handle->write(header.data(), header.size(), offset);
+    vertexStart = offset + header.size();
+    triangleStart = vertexStart + getNumVertices() * getVertexSize();
+}
+
+void Writer::createContainer(const std::string &filename, size_type size)
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    boost::shared_ptr<BinaryWriter> container = handleFactory();
+    container->open(filename);
+    container->resize(size);
+    container->close();
+}
+
+Writer::size_type Writer::getFileSize()
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    return makeHeader().size() + getNumVertices() * getVertexSize() + getNumTriangles() * triangleSize;
+}
+
 void Writer::close()
 {
     MLSGPU_ASSERT(isOpen(), state_error);
@@ -503,8 +1068,10 @@ void Writer::close()
 void Writer::writeVertices(size_type first, size_type count, const float *data)
 {
     MLSGPU_ASSERT(isOpen(), state_error);
+    MLSGPU_ASSERT(vertexFormat == VERTEX_FORMAT_FLOAT32, state_error);
     MLSGPU_ASSERT(first + count <= getNumVertices() && first <= std::numeric_limits<size_type>::max() - count, std::out_of_range);
     Statistics::Timer timer(writeVerticesTime);
+    const size_type vertexSize = getVertexSize();
     handle->write(data, count * vertexSize, vertexStart + first * vertexSize);
 }
 
@@ -516,6 +1083,7 @@ void Writer::writeVertices(
 {
     MLSGPU_ASSERT(isOpen(), state_error);
     MLSGPU_ASSERT(first + count <= getNumVertices() && first <= std::numeric_limits<size_type>::max() - count, std::out_of_range);
+    const size_type vertexSize = getVertexSize();
     async.push(tworker, data, handle, count * vertexSize, vertexStart + first * vertexSize);
 }
 
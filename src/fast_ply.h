@@ -39,6 +39,7 @@
 #include <fstream>
 #include <ostream>
 #include <map>
+#include <list>
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -52,6 +53,7 @@
 #include <boost/type_traits/is_pointer.hpp>
 #include <boost/ref.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
 #include "splat.h"
 #include "errors.h"
 #include "allocator.h"
@@ -79,6 +81,58 @@ public:
     FormatError(const std::string &msg) : std::runtime_error(msg) {}
 };
 
+/**
+ * Bounded pool of open files, shared between all the @ref Reader::Handle
+ * objects of the readers that use it. A handle takes an open file out of
+ * the pool for its lifetime, so a file is never used by two handles at
+ * once. When the handle is destroyed the file is returned, and the least
+ * recently returned files are closed once more than the capacity are idle.
+ * This avoids reopening files when reads move back and forth between many
+ * inputs, while keeping the number of open files bounded by the capacity
+ * plus the number of live handles.
+ *
+ * All the functions are thread-safe. The pool must outlive every handle
+ * that uses it.
+ */
+class ReaderCache : public boost::noncopyable
+{
+public:
+    /// Constructor. A @a capacity of zero closes files as soon as they are returned.
+    explicit ReaderCache(std::size_t capacity);
+
+    /// Closes all the idle files.
+    ~ReaderCache();
+
+    /**
+     * Take an open file for @a path out of the pool, or open a new one
+     * made by @a factory if there is none. The caller owns the result
+     * until it is passed to @ref release.
+     *
+     * @throw boost::exception if the file could not be opened.
+     */
+    BinaryReader *acquire(const boost::filesystem::path &path,
+                          const boost::function<BinaryReader *()> &factory);
+
+    /// Return a file obtained from @ref acquire for @a path to the pool.
+    void release(const boost::filesystem::path &path, BinaryReader *reader);
+
+    /// Maximum number of idle files held open
+    std::size_t getCapacity() const { return capacity; }
+
+private:
+    typedef std::list<std::pair<std::string, BinaryReader *> > lru_type;
+
+    const std::size_t capacity;
+    boost::mutex mutex;
+    /// Idle files, most recently returned first
+    lru_type lru;
+    /// Index into @ref lru by path
+    std::multimap<std::string, lru_type::iterator> index;
+
+    Statistics::Counter &hitStat;      ///< Files taken from the pool
+    Statistics::Counter &missStat;     ///< Files that had to be opened
+};
+
 /**
  * Base class for quickly reading a subset of PLY files.
  * It only supports the following:
@@ -86,8 +140,19 @@ public:
  * - Only the "vertex" element is loaded.
  * - The "vertex" element must be the first element in the file.
  * - The x, y, z, nx, ny, nz, radius elements must all be present and FLOAT32.
+ *   Alternatively, nx, ny and nz may be replaced by a single UINT32
+ *   property called @c normal_oct, holding a normal packed with
+ *   @ref packNormal. This is the layout written by the splat cache
+ *   converter (see @ref SplatCacheWriter).
  * - The vertex element must not contain any lists.
  *
+ * Uncompressed LAS files (any version and point format) are also accepted,
+ * and are recognised by their signature. Positions are taken from the
+ * scaled integer coordinates. Normals and radii are taken from extra bytes
+ * dimensions called @c nx, @c ny, @c nz and @c radius, which must be
+ * floats. As for PLY files, they may be absent if a point radius is given,
+ * so that they can be estimated. LAZ (compressed LAS) is rejected.
+ *
  * An instance of this class just holds the metadata, but no OS resources or
  * buffers. To actually read the data, one creates a @ref Handle,
  * at which point the file is opened.
@@ -110,13 +175,16 @@ public:
     protected:
         /// The reader whose file we're reading
         const Reader &owner;
-        /// Low-level handle
-        boost::scoped_ptr<BinaryReader> reader;
+        /// Low-level handle, owned by this object or taken from @ref Reader::setCache
+        BinaryReader *reader;
 
     public:
         /// Constructor
         Handle(const Reader &owner);
 
+        /// Destructor, which closes the file or returns it to the cache
+        ~Handle();
+
         /**
          * Low-level read access. The vertices are copied to @a buffer, in
          * exactly the form they exist in the file i.e. just a byte-level copy
@@ -131,6 +199,14 @@ public:
          */
         void readRaw(size_type first, size_type last, char *buffer) const;
 
+        /**
+         * Hint that the vertices in [@a first, @a last) will be read soon.
+         * This is advisory only.
+         *
+         * @pre @a first &lt;= @a last &lt;= @ref size().
+         */
+        void prefetchRaw(size_type first, size_type last) const;
+
         /**
          * Convenience wrapper around @ref Reader::decode.
          *
@@ -141,6 +217,12 @@ public:
             return owner.decode(buffer, offset);
         }
 
+        /// Convenience wrapper around the block form of @ref Reader::decode.
+        void decode(const char *buffer, std::size_t first, std::size_t count, Splat *out) const
+        {
+            owner.decode(buffer, first, count, out);
+        }
+
         /**
          * Copy out a contiguous selection of the vertices.
          *
@@ -167,12 +249,44 @@ public:
      */
     Splat decode(const char *buffer, std::size_t offset) const;
 
+    /**
+     * Extract a contiguous range of splats from the raw buffer
+     * representation. This gives the same results as calling the single-splat
+     * @ref decode for each, but uses a decoder specialised for the vertex
+     * layout when the file has the common x, y, z, nx, ny, nz, radius layout.
+     *
+     * @param buffer     A buffer returned by @ref Handle::readRaw
+     * @param first      The number of the first splat within the buffer
+     * @param count      Number of splats to decode
+     * @param out        Output array of @a count splats
+     */
+    void decode(const char *buffer, std::size_t first, std::size_t count, Splat *out) const
+    {
+        decoder(*this, buffer + first * vertexSize, count, out);
+    }
+
     /// Number of vertices in the file
     size_type size() const { return vertexCount; }
 
     /// Number of bytes per vertex
     size_type getVertexSize() const { return vertexSize; }
 
+    /**
+     * Whether each vertex holds x, y, z, nx, ny, nz, radius as consecutive
+     * floats, starting at byte @ref getStandardOffset within the vertex.
+     */
+    bool isStandardLayout() const { return standardLayout; }
+
+    /// Byte offset of x within a vertex
+    size_type getStandardOffset() const { return offsets[X]; }
+
+    /**
+     * Have handles take open files from @a cache instead of opening the
+     * file themselves. Passing @c NULL (the default) disables this. This
+     * must not be called while handles exist.
+     */
+    void setCache(ReaderCache *cache) { this->cache = cache; }
+
     /**
      * Construct from a file.
      *
@@ -184,13 +298,17 @@ public:
      * @param path             File to open.
      * @param smooth           Scale factor applied to radii as they're read.
      * @param maxRadius        Cap for radius (prior to scaling by @a smooth).
+     * @param pointRadius      If positive, files are allowed to lack normals and
+     *                         radii. Missing normals are read as zero and missing
+     *                         radii as @a pointRadius (without @a smooth or
+     *                         @a maxRadius), for later estimation.
      * @throw FormatError if the header is malformed.
      * @throw std::ios::failure if there was an I/O error.
      */
     Reader(
         ReaderType readerType,
         const boost::filesystem::path &path,
-        float smooth, float maxRadius);
+        float smooth, float maxRadius, float pointRadius = 0.0f);
 
     /**
      * Construct from a filename, using a custom factory to generate the
@@ -199,7 +317,25 @@ public:
     Reader(
         boost::function<BinaryReader *()> readerFactory,
         const boost::filesystem::path &path,
-        float smooth, float maxRadius);
+        float smooth, float maxRadius, float pointRadius = 0.0f);
+
+    /**
+     * Construct from a PLY header read from a stream, for inputs that cannot
+     * be reopened (such as pipes). The header is consumed up to and
+     * including the @c end_header line, after which the caller reads the
+     * vertices itself and converts them with @ref decode. No handles may be
+     * created from such a reader, and LAS files are not supported.
+     *
+     * @param in               Stream positioned at the start of the header.
+     * @param path             Name of the input, used only in error messages.
+     * @param smooth, maxRadius, pointRadius As for the other constructors.
+     * @throw FormatError if the header is malformed.
+     * @throw std::ios::failure if there was an I/O error.
+     */
+    Reader(
+        std::istream &in,
+        const boost::filesystem::path &path,
+        float smooth, float maxRadius, float pointRadius = 0.0f);
 
 private:
     /// Factory to generate file handles for low-level file access
@@ -214,6 +350,12 @@ private:
     /// Radius limit
     float maxRadius;
 
+    /// Radius for vertices without one, or 0 if radii are required
+    float pointRadius;
+
+    /// Pool of open files for handles (see @ref setCache)
+    ReaderCache *cache;
+
     /// The properties found in the file.
     enum Property
     {
@@ -226,6 +368,29 @@ private:
     size_type vertexSize;              ///< Bytes per vertex
     size_type vertexCount;             ///< Number of vertices
     size_type offsets[numProperties];  ///< Byte offsets of each property within a vertex
+    bool packedNormals;                ///< True if normals are stored as @c normal_oct
+    size_type packedNormalOffset;      ///< Byte offset of @c normal_oct, if @ref packedNormals
+    bool standardLayout;               ///< Value for @ref isStandardLayout
+    bool haveNormals;                  ///< False if normals are absent and read as zero
+    bool haveRadius;                   ///< False if radii are absent and read as @ref pointRadius
+    bool las;                          ///< True for a LAS file, with integer positions
+    double lasScale[3];                ///< Scale applied to LAS integer positions
+    double lasOffset[3];               ///< Offset added to scaled LAS positions
+
+    /// Function that decodes @a count consecutive vertices starting at @a buffer
+    typedef void (*Decoder)(const Reader &owner, const char *buffer, std::size_t count, Splat *out);
+    Decoder decoder;                   ///< Chosen by @ref readHeader to suit the layout
+
+    /// Decoder for any layout, using @ref decode for each vertex
+    static void decodeGeneric(const Reader &owner, const char *buffer, std::size_t count, Splat *out);
+
+    /**
+     * Decoder for vertices that hold x, y, z, nx, ny, nz, radius as
+     * consecutive floats. If @a Stride is non-zero it must equal the vertex
+     * size, allowing the compiler to unroll for it.
+     */
+    template<std::size_t Stride>
+    static void decodeStandard(const Reader &owner, const char *buffer, std::size_t count, Splat *out);
 
     /**
      * Does the heavy lifting of parsing the header. This is called by
@@ -234,15 +399,112 @@ private:
      */
     void readHeader(std::istream &in);
 
+    /**
+     * Parse the header of a LAS file, as an alternative to @ref readHeader.
+     * The file is recognised by @ref readHeaders.
+     */
+    void readLasHeader(const BinaryReader &in);
+
+    /**
+     * Open the file with @ref readerFactory, and call either @ref
+     * readHeader or @ref readLasHeader depending on its signature.
+     */
+    void readHeaders();
+
     /// Return the number of bytes from the beginning of the file to the first vertex
     size_type getHeaderSize() const { return headerSize; }
 };
 
+/**
+ * Pack a normal into 32 bits using an octahedral mapping, with 16 bits per
+ * coordinate. The normal is normalized in the process, so only its
+ * direction is preserved. A zero normal is packed as (0, 0, 1).
+ */
+std::tr1::uint32_t packNormal(const float normal[3]);
+
+/**
+ * Inverse of @ref packNormal. The result has unit length.
+ */
+void unpackNormal(std::tr1::uint32_t packed, float normal[3]);
+
+/**
+ * Writes a compact PLY file holding only the fields that mlsgpu needs. Each
+ * vertex holds the position and radius as FLOAT32 and the normal as a single
+ * UINT32 (see @ref packNormal), which gives 20 bytes per splat. Scanner
+ * output usually has at least seven floats plus extra properties such as
+ * colours and confidences. Because the result is still a PLY file that
+ * @ref Reader understands, it can be substituted for the original inputs
+ * without any other changes.
+ *
+ * The splats are written unmodified, so the cache should be generated with
+ * a smoothing factor of 1 and no radius limit; these are then applied when
+ * reading the cache.
+ */
+class SplatCacheWriter
+{
+public:
+    /// Size capable of holding maximum supported file size
+    typedef BinaryWriter::offset_type size_type;
+
+    /// Bytes per vertex in the output
+    static const std::size_t vertexSize = 5 * sizeof(float);
+
+    /**
+     * Open the file and write the header.
+     *
+     * @param writerType    Low-level writer type
+     * @param filename      Output file
+     * @param numSplats     Number of splats that will be written
+     */
+    SplatCacheWriter(WriterType writerType, const std::string &filename, size_type numSplats);
+
+    /**
+     * Write splats starting at splat index @a first.
+     * @pre @a first + @a count is at most the number of splats given to the constructor.
+     */
+    void write(size_type first, size_type count, const Splat *splats);
+
+    /// Close the file
+    void close();
+
+private:
+    boost::scoped_ptr<BinaryWriter> handle;
+    size_type numSplats;
+    size_type headerSize;
+    std::vector<char> buffer;
+};
+
+/**
+ * Encoding of vertex positions written by @ref Writer. The fixed-point
+ * formats store unsigned integers that are mapped to world space as
+ * <code>q * scale + bias</code>, with the scale and bias given by
+ * @ref Writer::setVertexTransform.
+ */
+enum VertexFormat
+{
+    VERTEX_FORMAT_FLOAT32,   ///< 32-bit floating-point world coordinates
+    VERTEX_FORMAT_UINT16,    ///< 16-bit fixed-point coordinates
+    VERTEX_FORMAT_UINT32     ///< 32-bit fixed-point coordinates
+};
+
+/// Wrapper around @ref VertexFormat for use with @ref Choice.
+class VertexFormatWrapper
+{
+public:
+    typedef VertexFormat type;
+    static std::map<std::string, VertexFormat> getNameMap();
+};
+
+/// Bytes used to store one vertex in the given format
+std::size_t vertexFormatSize(VertexFormat format);
+
 /**
  * PLY file writer that only supports one format.
  * The supported format has:
  *  - Binary format with host endianness;
- *  - Vertices with x, y, z as 32-bit floats (no normals);
+ *  - Vertices with x, y, z as 32-bit floats, or as 16- or 32-bit unsigned
+ *    fixed-point values (see @ref VertexFormat), optionally followed by
+ *    nx, ny, nz as 32-bit floats (see @ref setVertexNormals);
  *  - Faces with 32-bit unsigned integer indices;
  *  - 3 indices per face;
  *  - Arbitrary user-provided comments.
@@ -290,12 +552,59 @@ public:
      */
     void setNumTriangles(size_type numTriangles);
 
+    /**
+     * Set the encoding of vertex positions. This must match the data passed
+     * to the vertex write functions.
+     * @pre @ref open has not yet been successfully called.
+     */
+    void setVertexFormat(VertexFormat format);
+
+    /**
+     * Set whether each vertex is followed by a normal, stored as three
+     * 32-bit floats after the position. The data passed to the vertex
+     * write functions must then include the normals.
+     * @pre @ref open has not yet been successfully called.
+     */
+    void setVertexNormals(bool normals);
+
+    /**
+     * Set the mapping from fixed-point vertex coordinates to world space, which
+     * is recorded in the header as <code>comment vertex_scale</code> and
+     * <code>comment vertex_bias</code>. It is ignored for
+     * @ref VERTEX_FORMAT_FLOAT32.
+     * @pre @ref open has not yet been successfully called.
+     */
+    void setVertexTransform(double scale, const double bias[3]);
+
     /**
      * Create the file and write the header.
      * @pre @ref open has not yet been successfully called.
      */
     void open(const std::string &filename);
 
+    /**
+     * Write the file into part of an existing container, starting at byte
+     * @a offset, instead of creating a new file. The container is not
+     * resized, so it must already be large enough (see @ref
+     * createContainer). Writers may write disjoint ranges of the same
+     * container concurrently.
+     * @pre @ref open has not yet been successfully called.
+     */
+    void open(const std::string &filename, size_type offset);
+
+    /**
+     * Create a file of @a size bytes to be filled in by the two-argument form
+     * of @ref open.
+     * @pre @ref open has not yet been successfully called.
+     */
+    void createContainer(const std::string &filename, size_type size);
+
+    /**
+     * Size of the file that @ref open would write, including the header.
+     * @pre @ref open has not yet been successfully called.
+     */
+    size_type getFileSize();
+
     /**
      * Prepare to write another file. This will usually cause the old file
      * to be closed, but if it has been used with the asynchronous write
@@ -307,8 +616,10 @@ public:
      * Write a range of vertices.
      * @param first          Index of first vertex to write.
      * @param count          Number of vertices to write.
-     * @param data           Array of <code>float[3]</code> values.
+     * @param data           Array of <code>float[3]</code> values (<code>float[6]</code>
+     *                       with normals).
      * @pre @a first + @a count <= @a numVertices.
+     * @pre The vertex format is @ref VERTEX_FORMAT_FLOAT32.
      */
     void writeVertices(size_type first, size_type count, const float *data);
 
@@ -318,7 +629,7 @@ public:
      * @param tworker        Worker for accounting the time (possibly unused?)
      * @param first          Index of first vertex to write.
      * @param count          Number of vertices to write.
-     * @param data           Array of <code>float[3]</code> values.
+     * @param data           Vertices already encoded in the vertex format.
      * @param async          Asynchronous writer that will do the writing.
      * @pre @a first + @a count <= @a numVertices.
      */
@@ -368,9 +679,10 @@ public:
 
     size_type getNumVertices() const;  ///< Return the number of vertices
     size_type getNumTriangles() const; ///< Return the number of triangles
+    VertexFormat getVertexFormat() const; ///< Return the vertex format
+    bool getVertexNormals() const;     ///< Return whether vertices have normals
+    size_type getVertexSize() const;   ///< Bytes per vertex in the vertex format
 
-    /// Bytes per vertex
-    static const size_type vertexSize = 3 * sizeof(float);
     /// Bytes per triangle
     static const size_type triangleSize = 1 + 3 * sizeof(std::tr1::uint32_t);
 
@@ -407,6 +719,10 @@ private:
     std::vector<std::string> comments;
     size_type numVertices;              ///< Number of vertices (defaults to zero)
     size_type numTriangles;             ///< Number of triangles (defaults to zero)
+    VertexFormat vertexFormat;          ///< Vertex encoding (defaults to float)
+    bool vertexNormals;                 ///< Whether vertices have normals (defaults to false)
+    double vertexScale;                 ///< Scale for fixed-point vertices
+    double vertexBias[3];               ///< Bias for fixed-point vertices
 
 protected:
     /// File handle (non-NULL if the file is open)
@@ -434,9 +750,12 @@ OutputIterator Reader::Handle::read(size_type first, size_type last, OutputItera
     {
         size_type blockEnd = std::min(last, i + blockSize);
         readRaw(i, blockEnd, buffer.get());
-        for (size_type j = i; j < blockEnd; j++)
+        Splat splats[4096 / sizeof(Splat)];
+        for (size_type j = i; j < blockEnd; j += sizeof(splats) / sizeof(splats[0]))
         {
-            *out++ = decode(buffer.get(), j - i);
+            const std::size_t n = std::min(blockEnd - j, size_type(sizeof(splats) / sizeof(splats[0])));
+            decode(buffer.get(), j - i, n, splats);
+            out = std::copy(splats, splats + n, out);
         }
     }
     return out;
@@ -41,15 +41,21 @@
 namespace FastPly
 {
 
-static boost::shared_ptr<BinaryWriter> makeHandle()
+boost::shared_ptr<BinaryWriter> WriterMPI::makeHandle() const
 {
-    return boost::make_shared<BinaryWriterMPI>(MPI_COMM_SELF);
+    return boost::make_shared<BinaryWriterMPI>(MPI_COMM_SELF, hints);
 }
 
-WriterMPI::WriterMPI() : Writer(makeHandle)
+WriterMPI::WriterMPI() : Writer(boost::bind(&WriterMPI::makeHandle, this))
 {
 }
 
+void WriterMPI::setHints(const BinaryWriterMPI::Hints &hints)
+{
+    MLSGPU_ASSERT(!isOpen(), state_error);
+    this->hints = hints;
+}
+
 void WriterMPI::open(const std::string &filename, MPI_Comm comm, int root)
 {
     MLSGPU_ASSERT(!isOpen(), state_error);
@@ -69,8 +75,9 @@ void WriterMPI::open(const std::string &filename, MPI_Comm comm, int root)
     setNumVertices(sizes[1]);
     setNumTriangles(sizes[2]);
 
-    handle = boost::make_shared<BinaryWriterMPI>(comm);
+    handle = boost::make_shared<BinaryWriterMPI>(comm, hints);
     handle->open(filename);
+    const size_type vertexSize = getVertexSize();
     handle->resize(sizes[0] + getNumVertices() * vertexSize + getNumTriangles() * triangleSize);
     if (rank == root)
         handle->write(header.data(), header.size(), 0);
@@ -34,6 +34,7 @@
 #include <string>
 #include <mpi.h>
 #include "fast_ply.h"
+#include "binary_io_mpi.h"
 
 namespace FastPly
 {
@@ -62,6 +63,17 @@ public:
      * @param root            Rank that will write the file header.
      */
     void open(const std::string &filename, MPI_Comm comm, int root);
+
+    /**
+     * Set the MPI-IO hints used for files opened subsequently.
+     */
+    void setHints(const BinaryWriterMPI::Hints &hints);
+
+private:
+    BinaryWriterMPI::Hints hints;
+
+    /// Handle factory for the base class, that opens on @c MPI_COMM_SELF
+    boost::shared_ptr<BinaryWriter> makeHandle() const;
 };
 
 } // namespace FastPly
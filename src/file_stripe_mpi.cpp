@@ -0,0 +1,154 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Serving input files to other MPI ranks.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <mpi.h>
+#include <vector>
+#include <limits>
+#include <iostream>
+#include <exception>
+#include <tr1/cstdint>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+#include "file_stripe_mpi.h"
+#include "splat_set.h"
+#include "fast_ply.h"
+#include "serialize.h"
+#include "errors.h"
+#include "tags.h"
+
+namespace SplatSet
+{
+
+namespace
+{
+
+/// Number of distinct tags used for replies, starting at @ref MLSGPU_TAG_READ_REPLY
+static const unsigned int replyTags = 16384;
+
+/// File ID in a request that indicates that the sender has stopped
+static const std::tr1::uint64_t stopFileId = std::numeric_limits<std::tr1::uint64_t>::max();
+
+} // anonymous namespace
+
+FileStripeMPI::FileStripeMPI(const FileSet &files, MPI_Comm comm)
+    : files(files), nextReply(0)
+{
+    MPI_Comm_dup(comm, &this->comm);
+    MPI_Comm_rank(this->comm, &rank);
+    MPI_Comm_size(this->comm, &size);
+    owners.resize(files.numFiles());
+    for (int i = 0; i < size; i++)
+    {
+        std::pair<std::size_t, std::size_t> range = files.partitionFiles(i, size);
+        for (std::size_t j = range.first; j < range.second; j++)
+            owners[j] = i;
+    }
+}
+
+FileStripeMPI::~FileStripeMPI()
+{
+    MPI_Comm_free(&comm);
+}
+
+bool FileStripeMPI::isLocal(std::size_t fileId) const
+{
+    MLSGPU_ASSERT(fileId < owners.size(), std::out_of_range);
+    return owners[fileId] == rank;
+}
+
+void FileStripeMPI::readRaw(
+    std::size_t fileId,
+    FastPly::Reader::size_type first, FastPly::Reader::size_type last,
+    char *buffer)
+{
+    MLSGPU_ASSERT(fileId < owners.size(), std::out_of_range);
+    MLSGPU_ASSERT(first <= last && last <= files.getFile(fileId).size(), std::out_of_range);
+
+    const unsigned int reply = __atomic_fetch_add(&nextReply, 1, __ATOMIC_RELAXED) % replyTags;
+    std::tr1::uint64_t request[4] = { fileId, first, last, reply };
+    const std::size_t bytes = (last - first) * files.getFile(fileId).getVertexSize();
+    MPI_Send(request, 4, Serialize::mpi_type_traits<std::tr1::uint64_t>::type(),
+             owners[fileId], MLSGPU_TAG_READ_REQUEST, comm);
+    MPI_Recv(buffer, bytes, MPI_BYTE, owners[fileId], MLSGPU_TAG_READ_REPLY + reply,
+             comm, MPI_STATUS_IGNORE);
+}
+
+void FileStripeMPI::operator()() const
+{
+    boost::scoped_ptr<FastPly::Reader::Handle> handle;
+    std::size_t handleId = 0;
+    std::vector<char> buffer;
+    int running = size;
+    while (running > 0)
+    {
+        std::tr1::uint64_t request[4];
+        MPI_Status status;
+        MPI_Recv(request, 4, Serialize::mpi_type_traits<std::tr1::uint64_t>::type(),
+                 MPI_ANY_SOURCE, MLSGPU_TAG_READ_REQUEST, comm, &status);
+        if (request[0] == stopFileId)
+        {
+            running--;
+            continue;
+        }
+
+        const std::size_t fileId = request[0];
+        const FastPly::Reader &file = files.getFile(fileId);
+        const std::size_t bytes = (request[2] - request[1]) * file.getVertexSize();
+        try
+        {
+            if (!handle || handleId != fileId)
+            {
+                handle.reset(); // close the old handle
+                handle.reset(new FastPly::Reader::Handle(file));
+                handleId = fileId;
+            }
+            buffer.resize(bytes);
+            handle->readRaw(request[1], request[2], &buffer[0]);
+        }
+        catch (std::exception &e)
+        {
+            /* There is no way to report the error to the requester, and it
+             * would otherwise wait forever.
+             */
+            std::cerr << "Failed to serve read request: " << e.what() << std::endl;
+            MPI_Abort(comm, 1);
+        }
+        MPI_Send(bytes > 0 ? &buffer[0] : NULL, bytes, MPI_BYTE, status.MPI_SOURCE,
+                 MLSGPU_TAG_READ_REPLY + int(request[3]), comm);
+    }
+}
+
+void FileStripeMPI::stop()
+{
+    std::tr1::uint64_t request[4] = { stopFileId, 0, 0, 0 };
+    for (int i = 0; i < size; i++)
+        MPI_Send(request, 4, Serialize::mpi_type_traits<std::tr1::uint64_t>::type(),
+                 i, MLSGPU_TAG_READ_REQUEST, comm);
+}
+
+} // namespace SplatSet
@@ -0,0 +1,97 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Serving input files to other MPI ranks.
+ */
+
+#ifndef FILE_STRIPE_MPI_H
+#define FILE_STRIPE_MPI_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <mpi.h>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "splat_set.h"
+#include "fast_ply.h"
+
+namespace SplatSet
+{
+
+/**
+ * Remote reader for a @ref FileSet whose files are striped across the ranks
+ * of a communicator. Each rank opens only the files assigned to it by
+ * @ref FileSet::partitionFiles, and requests the vertex data for other files
+ * from the rank that owns them.
+ *
+ * Every rank must run @c operator() (typically in a separate thread) to serve
+ * requests, and must then call @ref stop once it will make no further
+ * requests. The server returns once every rank has called @ref stop.
+ *
+ * Requires @c MPI_THREAD_MULTIPLE, since requests may be made from several
+ * threads at once and at the same time as the server runs.
+ */
+class FileStripeMPI : public FileSet::RemoteReader, public boost::noncopyable
+{
+public:
+    /**
+     * Constructor. This is a collective operation on @a comm, which is
+     * duplicated so that the traffic does not interfere with other messages.
+     *
+     * @pre The file set is identical on all ranks in @a comm.
+     */
+    FileStripeMPI(const FileSet &files, MPI_Comm comm);
+
+    /// Destructor. This is a collective operation on the communicator.
+    virtual ~FileStripeMPI();
+
+    virtual bool isLocal(std::size_t fileId) const;
+
+    virtual void readRaw(
+        std::size_t fileId,
+        FastPly::Reader::size_type first, FastPly::Reader::size_type last,
+        char *buffer);
+
+    /// Run the server. This returns once all ranks have called @ref stop.
+    void operator()() const;
+
+    /// Notify all servers that this rank will make no further requests.
+    void stop();
+
+private:
+    const FileSet &files;
+    MPI_Comm comm;
+    int rank;
+    int size;
+
+    /// Rank that owns each file
+    std::vector<int> owners;
+
+    /// Counter used to generate reply tags (accessed atomically)
+    unsigned int nextReply;
+};
+
+} // namespace SplatSet
+
+#endif /* !FILE_STRIPE_MPI_H */
@@ -0,0 +1,228 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Open-addressing hash map for integer keys.
+ */
+
+#ifndef FLAT_HASH_MAP_H
+#define FLAT_HASH_MAP_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <memory>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <cstddef>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_integral.hpp>
+#include "tr1_cstdint.h"
+
+/**
+ * Hash map from integer keys to small values, stored in a single array with
+ * linear probing. Compared to @c std::tr1::unordered_map there is no per-element
+ * allocation and lookups touch just one or two cache lines, which matters when
+ * there are billions of elements.
+ *
+ * Only the operations needed by the mesher are provided: elements cannot be
+ * erased, and only constant forward iteration is supported (in no particular
+ * order). Pointers returned by @ref insert and @ref find, and iterators, are
+ * invalidated by any subsequent insertion.
+ *
+ * @param Key     An unsigned integral type.
+ * @param T       The mapped type. It must be copyable and default-constructible.
+ * @param Alloc   Allocator for the internal slots.
+ */
+template<typename Key, typename T, typename Alloc = std::allocator<std::pair<Key, T> > >
+class FlatHashMap
+{
+    BOOST_STATIC_ASSERT(boost::is_integral<Key>::value);
+public:
+    typedef Key key_type;
+    typedef T mapped_type;
+    typedef std::pair<Key, T> value_type;
+    typedef std::size_t size_type;
+
+private:
+    struct Slot
+    {
+        value_type value;
+        bool used;
+
+        Slot() : value(), used(false) {}
+    };
+
+    typedef typename Alloc::template rebind<Slot>::other slot_allocator;
+
+    /// Slots, whose number is zero or a power of two
+    std::vector<Slot, slot_allocator> slots;
+    /// Number of used slots
+    size_type size_;
+
+    /// Position in @ref slots at which to start probing for @a key
+    size_type bucket(Key key) const
+    {
+        /* Keys are frequently packed coordinates, which would cluster badly
+         * if used directly. Fibonacci hashing spreads them out.
+         */
+        std::tr1::uint64_t h = std::tr1::uint64_t(key) * 0x9E3779B97F4A7C15ULL;
+        return size_type(h ^ (h >> 32)) & (slots.size() - 1);
+    }
+
+    /**
+     * Find the slot holding @a key, or the empty slot where it would be
+     * inserted. There must be at least one empty slot.
+     */
+    size_type probe(Key key) const
+    {
+        const size_type mask = slots.size() - 1;
+        size_type pos = bucket(key);
+        while (slots[pos].used && slots[pos].value.first != key)
+            pos = (pos + 1) & mask;
+        return pos;
+    }
+
+    /// Reallocate to @a newCapacity slots (a power of two) and reinsert all elements
+    void rehash(size_type newCapacity)
+    {
+        std::vector<Slot, slot_allocator> old(newCapacity, Slot(), slots.get_allocator());
+        old.swap(slots);
+        for (typename std::vector<Slot, slot_allocator>::const_iterator i = old.begin(); i != old.end(); ++i)
+            if (i->used)
+                slots[probe(i->value.first)] = *i;
+    }
+
+public:
+    /// Forward iterator over the elements
+    class const_iterator : public std::iterator<std::forward_iterator_tag, const value_type>
+    {
+        friend class FlatHashMap;
+    private:
+        const Slot *pos;    ///< Current slot
+        const Slot *last;   ///< One past the last slot
+
+        const_iterator(const Slot *pos, const Slot *last) : pos(pos), last(last)
+        {
+            skip();
+        }
+
+        /// Advance to the next used slot, if @ref pos is not already one
+        void skip()
+        {
+            while (pos != last && !pos->used)
+                ++pos;
+        }
+
+    public:
+        const_iterator() : pos(NULL), last(NULL) {}
+
+        const value_type &operator*() const { return pos->value; }
+        const value_type *operator->() const { return &pos->value; }
+
+        const_iterator &operator++()
+        {
+            ++pos;
+            skip();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const const_iterator &other) const { return pos == other.pos; }
+        bool operator!=(const const_iterator &other) const { return pos != other.pos; }
+    };
+
+    explicit FlatHashMap(const Alloc &alloc = Alloc())
+        : slots(slot_allocator(alloc)), size_(0) {}
+
+    size_type size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /// Number of elements that can be held before the next reallocation
+    size_type capacity() const { return slots.size() - slots.size() / 4; }
+
+    /**
+     * Insert @a value if its key is not already present.
+     *
+     * @return A pointer to the element with the key, and a flag indicating whether
+     * an insertion took place (as for @c std::map::insert).
+     */
+    std::pair<value_type *, bool> insert(const value_type &value)
+    {
+        // Keep the load factor at most 3/4
+        if (size_ >= capacity())
+            rehash(slots.empty() ? 16 : slots.size() * 2);
+        Slot &slot = slots[probe(value.first)];
+        if (slot.used)
+            return std::make_pair(&slot.value, false);
+        slot.value = value;
+        slot.used = true;
+        size_++;
+        return std::make_pair(&slot.value, true);
+    }
+
+    /// Return the element with key @a key, or @c NULL if there is none
+    value_type *find(Key key)
+    {
+        if (slots.empty())
+            return NULL;
+        Slot &slot = slots[probe(key)];
+        return slot.used ? &slot.value : NULL;
+    }
+
+    /// @copydoc find(Key)
+    const value_type *find(Key key) const
+    {
+        if (slots.empty())
+            return NULL;
+        const Slot &slot = slots[probe(key)];
+        return slot.used ? &slot.value : NULL;
+    }
+
+    const_iterator begin() const
+    {
+        const Slot *first = slots.empty() ? NULL : &slots[0];
+        return const_iterator(first, first + slots.size());
+    }
+
+    const_iterator end() const
+    {
+        const Slot *last = slots.empty() ? NULL : &slots[0] + slots.size();
+        return const_iterator(last, last);
+    }
+
+    /// Remove all elements and release the storage
+    void clear()
+    {
+        std::vector<Slot, slot_allocator>(slots.get_allocator()).swap(slots);
+        size_ = 0;
+    }
+};
+
+#endif /* !FLAT_HASH_MAP_H */
@@ -0,0 +1,175 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Marching tetrahedra on the host, without an OpenCL device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <CL/cl.hpp>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <boost/tr1/cmath.hpp>
+#include "host_marching.h"
+#include "marching.h"
+#include "mesh.h"
+#include "grid.h"
+#include "errors.h"
+
+const cl_ulong HostMarching::externalFlag;
+
+HostMarching::HostMarching()
+{
+    Marching::makeHostTables(tables);
+}
+
+void HostMarching::setMarchingCubes(bool cubes)
+{
+    Marching::makeHostTables(tables, cubes);
+}
+
+HostKeyMesh HostMarching::generate(
+    const std::vector<float> &field,
+    const Grid::size_type size[3],
+    const cl_uint3 &keyOffset,
+    unsigned int keyShift)
+{
+    MLSGPU_ASSERT(field.size() == size[0] * size[1] * size[2], std::invalid_argument);
+    for (int i = 0; i < 3; i++)
+        MLSGPU_ASSERT(size[i] <= Marching::MAX_DIMENSION, std::length_error);
+
+    vertices.clear();
+    localKeys.clear();
+    indices.clear();
+
+    const cl_uint top[3] = { 2 * (size[0] - 1), 2 * (size[1] - 1), 2 * (size[2] - 1) };
+    const std::size_t rowStride = size[0];
+    const std::size_t sliceStride = size[0] * size[1];
+    for (Grid::size_type z = 0; z + 1 < size[2]; z++)
+        for (Grid::size_type y = 0; y + 1 < size[1]; y++)
+            for (Grid::size_type x = 0; x + 1 < size[0]; x++)
+            {
+                const cl_uint cell[3] = { x, y, z };
+                const std::size_t base = z * sliceStride + y * rowStride + x;
+                float iso[8];
+                unsigned int code = 0;
+                bool valid = true;
+                for (unsigned int i = 0; i < 8; i++)
+                {
+                    iso[i] = field[base + (i & 1) + ((i >> 1) & 1) * rowStride + ((i >> 2) & 1) * sliceStride];
+                    valid = valid && (std::tr1::isfinite)(iso[i]);
+                    if (iso[i] >= 0.0f)
+                        code |= 1U << i;
+                }
+                if (!valid || code == 0 || code == Marching::NUM_CUBES - 1)
+                    continue;
+
+                const cl_ushort2 start = tables.start[code];
+                const cl_ushort2 end = tables.start[code + 1];
+                const cl_uint firstVertex = vertices.size();
+                for (cl_uint v = start.s[0]; v < end.s[0]; v++)
+                {
+                    const unsigned int edge = tables.data[v];
+                    const unsigned int a = Marching::edgeIndices[edge][0];
+                    const unsigned int b = Marching::edgeIndices[edge][1];
+                    /* This matches the arithmetic of the interp function in
+                     * marching.cl, so that vertices are bit-identical.
+                     */
+                    const float t = iso[a] * (1.0f / (iso[a] - iso[b]));
+                    boost::array<cl_float, 3> vertex;
+                    cl_uint coords[3];
+                    bool external = false;
+                    for (unsigned int axis = 0; axis < 3; axis++)
+                    {
+                        const cl_uint offset0 = (a >> axis) & 1;
+                        const cl_uint offset1 = (b >> axis) & 1;
+                        vertex[axis] = t * float(offset1 - offset0) + float(cell[axis] + keyOffset.s[axis] + offset0);
+                        coords[axis] = 2 * cell[axis] + tables.keys[v].s[axis];
+                        external = external || coords[axis] == 0 || coords[axis] == top[axis];
+                    }
+                    vertices.push_back(vertex);
+                    localKeys.push_back(
+                        (cl_ulong(coords[2]) << (2 * Marching::KEY_AXIS_BITS))
+                        | (cl_ulong(coords[1]) << Marching::KEY_AXIS_BITS)
+                        | cl_ulong(coords[0])
+                        | (external ? externalFlag : 0));
+                }
+                for (cl_uint i = start.s[1]; i < end.s[1]; i++)
+                    indices.push_back(firstVertex + tables.data[i]);
+            }
+
+    /* Weld by sorting the keys. The external flag is the most significant
+     * bit, so internal vertices come first.
+     */
+    order.resize(vertices.size());
+    for (std::size_t i = 0; i < vertices.size(); i++)
+        order[i] = std::make_pair(localKeys[i], cl_uint(i));
+    std::sort(order.begin(), order.end());
+    remap.resize(vertices.size());
+    std::size_t numWelded = 0;
+    std::size_t numInternal = 0;
+    for (std::size_t i = 0; i < order.size(); i++)
+    {
+        if (i > 0 && order[i].first != order[i - 1].first)
+            numWelded++;
+        remap[order[i].second] = numWelded;
+        if (!(order[i].first & externalFlag))
+            numInternal = numWelded + 1;
+    }
+    if (!order.empty())
+        numWelded++;
+
+    const MeshSizes sizes(numWelded, indices.size() / 3, numInternal);
+    meshStore.resize((sizes.getHostBytes() + sizeof(cl_ulong) - 1) / sizeof(cl_ulong));
+    HostKeyMesh mesh(meshStore.empty() ? NULL : &meshStore[0], sizes);
+
+    const cl_ulong axisMask = (cl_ulong(1) << Marching::KEY_AXIS_BITS) - 1;
+    const cl_ulong keyOffsetL = Marching::packKeyOffset(keyOffset, keyShift);
+    for (std::size_t i = 0; i < order.size(); i++)
+    {
+        const cl_uint out = remap[order[i].second];
+        mesh.vertices[out] = vertices[order[i].second];
+        if (out >= numInternal)
+        {
+            const cl_ulong key = order[i].first;
+            const cl_ulong x = ((key & axisMask) << keyShift) & axisMask;
+            const cl_ulong y = (((key >> Marching::KEY_AXIS_BITS) & axisMask) << keyShift) & axisMask;
+            const cl_ulong z = (((key >> (2 * Marching::KEY_AXIS_BITS)) & axisMask) << keyShift) & axisMask;
+            mesh.vertexKeys[out - numInternal] = Marching::addKeys(
+                (z << (2 * Marching::KEY_AXIS_BITS)) | (y << Marching::KEY_AXIS_BITS) | x,
+                keyOffsetL);
+        }
+    }
+    for (std::size_t i = 0; i < sizes.numTriangles(); i++)
+        for (unsigned int j = 0; j < 3; j++)
+            mesh.triangles[i][j] = remap[indices[3 * i + j]];
+    return mesh;
+}
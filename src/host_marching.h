@@ -0,0 +1,92 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Marching tetrahedra on the host, without an OpenCL device.
+ */
+
+#ifndef HOST_MARCHING_H
+#define HOST_MARCHING_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <utility>
+#include <boost/array.hpp>
+#include "grid.h"
+#include "marching.h"
+#include "mesh.h"
+
+/**
+ * Extracts an isosurface from signed distances held in host memory. It uses
+ * the same tables as @ref Marching, and produces the same mesh as
+ * @ref Marching::generate does when the whole region is shipped out at once:
+ * vertices are welded, internal vertices come first, and the external
+ * vertices have keys in the global layout.
+ *
+ * An instance is not thread-safe, but separate instances can be used
+ * concurrently.
+ */
+class HostMarching
+{
+public:
+    HostMarching();
+
+    /// Triangulate whole cubes instead of tetrahedra (see @ref Marching::setMarchingCubes).
+    void setMarchingCubes(bool cubes);
+
+    /**
+     * Extract the isosurface.
+     *
+     * @param field      Signed distances (see @ref HostMls::evaluate). Vertices
+     *                   with non-finite values are treated as missing.
+     * @param size       Number of vertices in each dimension.
+     * @param keyOffset  Global grid coordinates of the first vertex.
+     * @param keyShift   Coarsening level of the grid (see @ref Marching::generate).
+     * @return The mesh, in global grid coordinates. It is held in storage owned
+     *         by this object, which is valid until the next call.
+     */
+    HostKeyMesh generate(const std::vector<float> &field,
+                         const Grid::size_type size[3],
+                         const cl_uint3 &keyOffset,
+                         unsigned int keyShift);
+
+private:
+    /// Flag set in local keys of external vertices, so that they sort last
+    static const cl_ulong externalFlag = cl_ulong(1) << 63;
+
+    Marching::HostTables tables;
+
+    std::vector<boost::array<cl_float, 3> > vertices;  ///< Unwelded vertices
+    std::vector<cl_ulong> localKeys;   ///< Local keys of @ref vertices, with @ref externalFlag
+    std::vector<cl_uint> indices;      ///< Triangle indices into @ref vertices
+    std::vector<std::pair<cl_ulong, cl_uint> > order;  ///< Keys sorted for welding
+    std::vector<cl_uint> remap;        ///< Maps elements of @ref vertices to welded indices
+    std::vector<cl_ulong> meshStore;   ///< Backing store for the returned mesh
+};
+
+#endif /* !HOST_MARCHING_H */
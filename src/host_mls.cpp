@@ -0,0 +1,414 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Moving least squares fitting on the host, without an OpenCL device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#if HAVE_XMMINTRIN_H
+# include <xmmintrin.h>
+# define HOST_MLS_USE_SSE 1
+#else
+# define HOST_MLS_USE_SSE 0
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cfloat>
+#include <boost/tr1/cmath.hpp>
+#include "host_mls.h"
+#include "splat_tree.h"
+#include "splat.h"
+#include "grid.h"
+#include "mls.h"
+#include "errors.h"
+
+namespace
+{
+
+/// Must match RADIUS_CUTOFF in mls.cl
+const float radiusCutoff = 0.99f;
+/// Must match HITS_CUTOFF in mls.cl
+const unsigned int hitsCutoff = 4;
+
+inline float dot3(const float a[3], const float b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+} // anonymous namespace
+
+SplatTreeHost::SplatTreeHost(const std::vector<Splat> &splats,
+                             const Grid::size_type size[3],
+                             const Grid::difference_type offset[3])
+    : SplatTree(splats, size, offset)
+{
+    initialize();
+}
+
+SplatTree::command_type *SplatTreeHost::allocateCommands(std::size_t size)
+{
+    commands.resize(size);
+    return &commands[0];
+}
+
+SplatTree::command_type *SplatTreeHost::allocateStart(std::size_t size)
+{
+    start.resize(size);
+    return &start[0];
+}
+
+void SplatTreeHost::findSplats(code_type x, code_type y, code_type z, std::vector<command_type> &ids) const
+{
+    command_type pos = start[makeCode(x, y, z)];
+    while (pos >= 0)
+    {
+        command_type end = commands[pos];
+        ids.insert(ids.end(), commands.begin() + (pos + 1), commands.begin() + end);
+        pos = commands[end];
+    }
+}
+
+HostMls::HostMls(MlsShape shape, float boundaryLimit, unsigned int subsampling,
+                 MlsBoundary boundary)
+    : shape(shape),
+    boundary(boundary),
+    boundaryFactor(MlsFunctor::boundaryFactor(boundaryLimit, boundary)),
+    subsampling(subsampling)
+{
+}
+
+void HostMls::gather(const std::vector<Splat> &splats)
+{
+    const std::size_t n = (ids.size() + 3) & ~std::size_t(3);
+    /* Padding splats are far from every vertex, so they fail the radius
+     * test. They have zero normals and quality so that every product with
+     * them is finite.
+     */
+    px.assign(n, 1e18f);
+    py.assign(n, 1e18f);
+    pz.assign(n, 1e18f);
+    invR2.assign(n, 1.0f);
+    nx.assign(n, 0.0f);
+    ny.assign(n, 0.0f);
+    nz.assign(n, 0.0f);
+    quality.assign(n, 0.0f);
+    for (std::size_t i = 0; i < ids.size(); i++)
+    {
+        const Splat &s = splats[ids[i]];
+        px[i] = s.position[0];
+        py[i] = s.position[1];
+        pz[i] = s.position[2];
+        invR2[i] = 1.0f / (s.radius * s.radius);
+        nx[i] = s.normal[0];
+        ny[i] = s.normal[1];
+        nz[i] = s.normal[2];
+        quality[i] = s.quality;
+    }
+}
+
+#if HOST_MLS_USE_SSE
+
+namespace
+{
+
+/// Sum of the four elements of @a v
+inline float hsum(__m128 v)
+{
+    float e[4];
+    _mm_storeu_ps(e, v);
+    return (e[0] + e[1]) + (e[2] + e[3]);
+}
+
+/// Smallest of the four elements of @a v
+inline float hmin(__m128 v)
+{
+    float e[4];
+    _mm_storeu_ps(e, v);
+    return std::min(std::min(e[0], e[1]), std::min(e[2], e[3]));
+}
+
+} // anonymous namespace
+
+void HostMls::accumulate(const float coord[3], Sums &sums) const
+{
+    // Number of bits set in a 4-bit mask
+    static const unsigned char popCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+    const __m128 cx = _mm_set1_ps(coord[0]);
+    const __m128 cy = _mm_set1_ps(coord[1]);
+    const __m128 cz = _mm_set1_ps(coord[2]);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 cutoff = _mm_set1_ps(radiusCutoff);
+    __m128 sumW = _mm_setzero_ps();
+    __m128 sumWpx = _mm_setzero_ps(), sumWpy = _mm_setzero_ps(), sumWpz = _mm_setzero_ps();
+    __m128 sumWnx = _mm_setzero_ps(), sumWny = _mm_setzero_ps(), sumWnz = _mm_setzero_ps();
+    __m128 sumWpp = _mm_setzero_ps(), sumWpn = _mm_setzero_ps();
+    __m128 minD = cutoff;
+    const bool nearest = boundary == MLS_BOUNDARY_NEAREST;
+    unsigned int hits = 0;
+
+    for (std::size_t i = 0; i < px.size(); i += 4)
+    {
+        const __m128 x = _mm_sub_ps(_mm_loadu_ps(&px[i]), cx);
+        const __m128 y = _mm_sub_ps(_mm_loadu_ps(&py[i]), cy);
+        const __m128 z = _mm_sub_ps(_mm_loadu_ps(&pz[i]), cz);
+        const __m128 pp = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+        const __m128 d = _mm_mul_ps(pp, _mm_loadu_ps(&invR2[i]));
+        const __m128 mask = _mm_cmplt_ps(d, cutoff);
+        const int bits = _mm_movemask_ps(mask);
+        if (bits == 0)
+            continue;
+        hits += popCount[bits];
+
+        __m128 w = _mm_sub_ps(one, d);
+        w = _mm_mul_ps(w, w); // raise to the 4th power
+        w = _mm_mul_ps(w, w);
+        w = _mm_and_ps(mask, _mm_mul_ps(w, _mm_loadu_ps(&quality[i])));
+
+        const __m128 wnx = _mm_mul_ps(w, _mm_loadu_ps(&nx[i]));
+        const __m128 wny = _mm_mul_ps(w, _mm_loadu_ps(&ny[i]));
+        const __m128 wnz = _mm_mul_ps(w, _mm_loadu_ps(&nz[i]));
+        if (nearest)
+        {
+            const __m128 pn = _mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(_mm_loadu_ps(&nx[i]), x), _mm_mul_ps(_mm_loadu_ps(&ny[i]), y)),
+                _mm_mul_ps(_mm_loadu_ps(&nz[i]), z));
+            const __m128 t = _mm_mul_ps(_mm_sub_ps(pp, _mm_mul_ps(pn, pn)), _mm_loadu_ps(&invR2[i]));
+            // Lanes that missed keep the cutoff, which never lowers the minimum
+            minD = _mm_min_ps(minD, _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, cutoff)));
+        }
+        sumW = _mm_add_ps(sumW, w);
+        sumWpx = _mm_add_ps(sumWpx, _mm_mul_ps(w, x));
+        sumWpy = _mm_add_ps(sumWpy, _mm_mul_ps(w, y));
+        sumWpz = _mm_add_ps(sumWpz, _mm_mul_ps(w, z));
+        sumWnx = _mm_add_ps(sumWnx, wnx);
+        sumWny = _mm_add_ps(sumWny, wny);
+        sumWnz = _mm_add_ps(sumWnz, wnz);
+        sumWpp = _mm_add_ps(sumWpp, _mm_mul_ps(w, pp));
+        sumWpn = _mm_add_ps(sumWpn, _mm_add_ps(
+                _mm_add_ps(_mm_mul_ps(wnx, x), _mm_mul_ps(wny, y)), _mm_mul_ps(wnz, z)));
+    }
+
+    sums.sumW = hsum(sumW);
+    sums.sumWp[0] = hsum(sumWpx);
+    sums.sumWp[1] = hsum(sumWpy);
+    sums.sumWp[2] = hsum(sumWpz);
+    sums.sumWn[0] = hsum(sumWnx);
+    sums.sumWn[1] = hsum(sumWny);
+    sums.sumWn[2] = hsum(sumWnz);
+    sums.sumWpp = hsum(sumWpp);
+    sums.sumWpn = hsum(sumWpn);
+    sums.hits = hits;
+    sums.minD = hmin(minD);
+}
+
+#else // !HOST_MLS_USE_SSE
+
+void HostMls::accumulate(const float coord[3], Sums &sums) const
+{
+    sums.sumW = 0.0f;
+    sums.sumWpp = 0.0f;
+    sums.sumWpn = 0.0f;
+    for (int j = 0; j < 3; j++)
+        sums.sumWp[j] = sums.sumWn[j] = 0.0f;
+    sums.hits = 0;
+    sums.minD = radiusCutoff;
+
+    for (std::size_t i = 0; i < px.size(); i++)
+    {
+        const float p[3] = { px[i] - coord[0], py[i] - coord[1], pz[i] - coord[2] };
+        const float pp = dot3(p, p);
+        const float d = pp * invR2[i];
+        if (d < radiusCutoff)
+        {
+            float w = 1.0f - d;
+            w *= w; // raise to the 4th power
+            w *= w;
+            w *= quality[i];
+            const float wn[3] = { w * nx[i], w * ny[i], w * nz[i] };
+            sums.sumW += w;
+            for (int j = 0; j < 3; j++)
+            {
+                sums.sumWp[j] += w * p[j];
+                sums.sumWn[j] += wn[j];
+            }
+            sums.sumWpp += w * pp;
+            sums.sumWpn += dot3(wn, p);
+            sums.hits++;
+            if (boundary == MLS_BOUNDARY_NEAREST)
+            {
+                const float n[3] = { nx[i], ny[i], nz[i] };
+                const float pn = dot3(p, n);
+                sums.minD = std::min(sums.minD, (pp - pn * pn) * invR2[i]);
+            }
+        }
+    }
+}
+
+#endif // !HOST_MLS_USE_SSE
+
+float HostMls::solveQuadratic(float a, float b, float c)
+{
+    const float bdet = b + std::sqrt(b * b - 4.0f * a * c);
+    float x = -2.0f * c / bdet;
+    if (!(std::tr1::isfinite)(x))
+    {
+        // happens if either b = 0 and ac = 0, or if the quadratic
+        // has no real solutions
+        x = bdet / (-2.0f * a);
+    }
+    return (std::tr1::isfinite)(x) ? x : std::numeric_limits<float>::quiet_NaN();
+}
+
+float HostMls::solve(const Sums &sums) const
+{
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    if (sums.hits < hitsCutoff)
+        return nan;
+    if (boundary == MLS_BOUNDARY_NEAREST && !(sums.minD < boundaryFactor))
+        return nan; // no splat close enough, so there is no need to fit
+
+    const float invSumW = 1.0f / sums.sumW;
+    float a[3];         // projection of the origin onto the surface
+    float qDen;
+    float f;
+    if (shape == MLS_SHAPE_SPHERE)
+    {
+        float m[3];
+        for (int i = 0; i < 3; i++)
+            m[i] = sums.sumWp[i] * invSumW;
+        const float qNum = sums.sumWpn - dot3(m, sums.sumWn);
+        qDen = sums.sumWpp - dot3(m, sums.sumWp);
+        float q = qNum / qDen;
+        if (std::fabs(qDen) < (4 * FLT_EPSILON) * sums.hits * std::fabs(sums.sumWpp)
+            || !(std::tr1::isfinite)(q))
+            q = 0.0f; // numeric instability
+
+        const float sa = 0.5f * q;
+        float b[3];
+        for (int i = 0; i < 3; i++)
+            b[i] = (sums.sumWn[i] - q * sums.sumWp[i]) * invSumW;
+        const float c = (-sa * sums.sumWpp - dot3(b, sums.sumWp)) * invSumW;
+        const float b2 = dot3(b, b);
+        const float l = solveQuadratic(sa * b2, b2, c);
+        for (int i = 0; i < 3; i++)
+            a[i] = l * b[i];
+        f = -dot3(b, a) / std::sqrt(b2);
+    }
+    else
+    {
+        float mean[3], normal[3];
+        const float invLen = 1.0f / std::sqrt(dot3(sums.sumWn, sums.sumWn));
+        for (int i = 0; i < 3; i++)
+        {
+            mean[i] = sums.sumWp[i] * invSumW;
+            normal[i] = sums.sumWn[i] * invLen;
+        }
+        const float dist = -dot3(normal, mean);
+        for (int i = 0; i < 3; i++)
+            a[i] = normal[i] * -dist;
+        qDen = sums.sumWpp - dot3(mean, sums.sumWp);
+        f = dist;
+    }
+
+    const float aa = dot3(a, a);
+    if (aa < 3.0f)
+    {
+        if (boundary == MLS_BOUNDARY_NEAREST)
+            return f;
+        const float rhs = sums.sumWpp - 2 * dot3(sums.sumWp, a) + sums.sumW * aa;
+        if (qDen > boundaryFactor * rhs)
+            return f;
+    }
+    return nan;
+}
+
+void HostMls::evaluate(
+    const std::vector<Splat> &splats,
+    const Grid::size_type size[3],
+    const Grid::difference_type offset[3],
+    std::vector<float> &field)
+{
+    field.assign(size[0] * size[1] * size[2], std::numeric_limits<float>::quiet_NaN());
+
+    /* The octree is built on splats scaled to units of leaves, relative to
+     * the first vertex. Scaling by a power of 2 is exact, and each leaf
+     * (closed) contains all the vertices assigned to it, so every splat
+     * influencing a vertex is listed for its leaf.
+     */
+    const float scale = 1.0f / (1U << subsampling);
+    leafSplats.resize(splats.size());
+    for (std::size_t i = 0; i < splats.size(); i++)
+    {
+        leafSplats[i] = splats[i];
+        for (int j = 0; j < 3; j++)
+            leafSplats[i].position[j] = (splats[i].position[j] - offset[j]) * scale;
+        leafSplats[i].radius = splats[i].radius * scale;
+    }
+    Grid::size_type leaves[3];
+    for (int i = 0; i < 3; i++)
+        leaves[i] = ((size[i] - 1) >> subsampling) + 1;
+    const Grid::difference_type treeOffset[3] = { 0, 0, 0 };
+    SplatTreeHost tree(leafSplats, leaves, treeOffset);
+
+    for (Grid::size_type lz = 0; lz < leaves[2]; lz++)
+        for (Grid::size_type ly = 0; ly < leaves[1]; ly++)
+            for (Grid::size_type lx = 0; lx < leaves[0]; lx++)
+            {
+                ids.clear();
+                tree.findSplats(lx, ly, lz, ids);
+                if (ids.empty())
+                    continue;
+                gather(splats);
+
+                const Grid::size_type lo[3] = { lx << subsampling, ly << subsampling, lz << subsampling };
+                Grid::size_type hi[3];
+                for (int i = 0; i < 3; i++)
+                    hi[i] = std::min(size[i], lo[i] + (Grid::size_type(1) << subsampling));
+                for (Grid::size_type z = lo[2]; z < hi[2]; z++)
+                    for (Grid::size_type y = lo[1]; y < hi[1]; y++)
+                        for (Grid::size_type x = lo[0]; x < hi[0]; x++)
+                        {
+                            const float coord[3] =
+                            {
+                                float(Grid::difference_type(x) + offset[0]),
+                                float(Grid::difference_type(y) + offset[1]),
+                                float(Grid::difference_type(z) + offset[2])
+                            };
+                            Sums sums;
+                            accumulate(coord, sums);
+                            field[(z * size[1] + y) * size[0] + x] = solve(sums);
+                        }
+            }
+}
@@ -0,0 +1,163 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Moving least squares fitting on the host, without an OpenCL device.
+ */
+
+#ifndef HOST_MLS_H
+#define HOST_MLS_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cstddef>
+#include <vector>
+#include "grid.h"
+#include "splat.h"
+#include "splat_tree.h"
+#include "mls.h"
+
+class TestHostMls;
+
+/**
+ * Concrete implementation of @ref SplatTree that stores the data in host
+ * memory. The octree is built by the constructor.
+ */
+class SplatTreeHost : public SplatTree
+{
+private:
+    std::vector<command_type> commands;
+    std::vector<command_type> start;
+
+protected:
+    virtual command_type *allocateCommands(std::size_t size);
+    virtual command_type *allocateStart(std::size_t size);
+
+public:
+    /**
+     * Constructor. The arguments have the same meaning as for @ref
+     * SplatTree::SplatTree, and the same preconditions apply.
+     */
+    SplatTreeHost(const std::vector<Splat> &splats,
+                  const Grid::size_type size[3],
+                  const Grid::difference_type offset[3]);
+
+    /**
+     * Append the indices of the splats that may intersect a leaf to @a ids.
+     * Every splat that intersects the leaf is listed, but some others may be
+     * too.
+     */
+    void findSplats(code_type x, code_type y, code_type z, std::vector<command_type> &ids) const;
+};
+
+/**
+ * Computes the same signed distance function as @ref MlsFunctor, but on the
+ * host. The splats are placed in a @ref SplatTreeHost whose leaves are
+ * 2<sup>subsampling</sup> cells on a side, and every vertex in a leaf is
+ * fit using the splats listed for that leaf. The splats are processed four
+ * at a time with SSE where it is available.
+ *
+ * The results are not bit-for-bit identical to those of @ref MlsFunctor,
+ * because the sums are accumulated in a different order.
+ *
+ * An instance is not thread-safe, but separate instances can be used
+ * concurrently.
+ */
+class HostMls
+{
+    friend class TestHostMls;
+public:
+    /**
+     * Constructor.
+     *
+     * @param shape          Shape to fit.
+     * @param boundaryLimit  Tuning factor for boundary clipping (see @ref MlsFunctor::setBoundaryLimit).
+     * @param subsampling    Log base 2 of the size of the octree leaves, in cells.
+     * @param boundary       Test used to clip the surface at the boundary.
+     */
+    HostMls(MlsShape shape, float boundaryLimit, unsigned int subsampling,
+            MlsBoundary boundary = MLS_BOUNDARY_MOMENTS);
+
+    /**
+     * Compute the signed distance at every vertex of a region.
+     *
+     * @param splats      Splats, in global grid coordinates.
+     * @param size        Number of vertices in each dimension.
+     * @param offset      Global grid coordinates of the first vertex.
+     * @param[out] field  Signed distances, with x varying fastest and z slowest.
+     *                    Vertices with no defined value are set to NaN.
+     *
+     * @pre The number of octree leaves in each dimension is less than 1024.
+     */
+    void evaluate(const std::vector<Splat> &splats,
+                  const Grid::size_type size[3],
+                  const Grid::difference_type offset[3],
+                  std::vector<float> &field);
+
+private:
+    /// Sums accumulated over the splats influencing a vertex
+    struct Sums
+    {
+        float sumW;
+        float sumWp[3];
+        float sumWn[3];
+        float sumWpp;
+        float sumWpn;    ///< Sum of w(n . p), only needed for spheres
+        unsigned int hits;
+        float minD;      ///< Smallest normalised squared tangential distance, for @ref MLS_BOUNDARY_NEAREST
+    };
+
+    const MlsShape shape;
+    const MlsBoundary boundary;
+    const float boundaryFactor;      ///< See @ref MlsFunctor::boundaryFactor
+    const unsigned int subsampling;
+
+    std::vector<Splat> leafSplats;   ///< Splats in units of octree leaves, for building the octree
+    std::vector<SplatTree::command_type> ids;  ///< Splats found for the current leaf
+
+    /**
+     * Attributes of the splats in @ref ids, as separate arrays so that
+     * they can be loaded four at a time. Each is padded to a multiple of
+     * four elements with splats that do not influence any vertex.
+     */
+    std::vector<float> px, py, pz, invR2, nx, ny, nz, quality;
+
+    /// Copy the splats listed in @ref ids to the attribute arrays
+    void gather(const std::vector<Splat> &splats);
+
+    /// Accumulate the contributions of the gathered splats for a vertex at @a coord
+    void accumulate(const float coord[3], Sums &sums) const;
+
+    /// Compute the signed distance from the sums, or NaN if it is not defined
+    float solve(const Sums &sums) const;
+
+    /**
+     * Returns the root of ax^2 + bx + c which is larger (a > 0) or smaller
+     * (a < 0), or NaN if there are none or infinitely many.
+     */
+    static float solveQuadratic(float a, float b, float c);
+};
+
+#endif /* !HOST_MLS_H */
@@ -0,0 +1,268 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Bookkeeping for re-meshing only the output chunks affected by changed
+ * input files.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <locale>
+#include <ios>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/foreach.hpp>
+#include "incremental.h"
+#include "grid.h"
+#include "chunk_id.h"
+
+namespace Incremental
+{
+
+Box Box::fromGrid(const Grid &grid)
+{
+    Box ans;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        ans.lower[i] = grid.getExtent(i).first;
+        ans.upper[i] = grid.getExtent(i).second;
+    }
+    return ans;
+}
+
+bool Box::intersects(const Box &b) const
+{
+    for (unsigned int i = 0; i < 3; i++)
+        if (lower[i] > b.upper[i] || b.lower[i] > upper[i])
+            return false;
+    return true;
+}
+
+Box &Box::operator+=(const Box &b)
+{
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        lower[i] = std::min(lower[i], b.lower[i]);
+        upper[i] = std::max(upper[i], b.upper[i]);
+    }
+    return *this;
+}
+
+static std::ostream &operator<<(std::ostream &o, const Box &box)
+{
+    for (unsigned int i = 0; i < 3; i++)
+        o << ' ' << box.lower[i] << ' ' << box.upper[i];
+    return o;
+}
+
+static std::istream &operator>>(std::istream &in, Box &box)
+{
+    for (unsigned int i = 0; i < 3; i++)
+        in >> box.lower[i] >> box.upper[i];
+    return in;
+}
+
+/// Write a string prefixed by its length, so that it may contain whitespace
+static void writeString(std::ostream &out, const std::string &s)
+{
+    out << s.size() << '\n' << s << '\n';
+}
+
+/// Read a string written by @ref writeString
+static bool readString(std::istream &in, std::string &s)
+{
+    std::size_t size;
+    if (!(in >> size) || in.get() != '\n')
+        return false;
+    s.assign(size, '\0');
+    if (size > 0 && !in.read(&s[0], size))
+        return false;
+    return in.get() == '\n';
+}
+
+void State::save(const boost::filesystem::path &path) const
+{
+    const boost::filesystem::path tmpPath = path.string() + ".tmp";
+    boost::filesystem::ofstream out(tmpPath);
+    out.imbue(std::locale::classic());
+    out << "mlsgpu-incremental 1\n";
+    writeString(out, key);
+    out << files.size() << '\n';
+    BOOST_FOREACH(const FileRecord &f, files)
+    {
+        writeString(out, f.path);
+        out << f.size << ' ' << f.mtime << ' ' << f.hasBox << f.box << '\n';
+    }
+    out << chunks.size() << '\n';
+    for (std::map<ChunkCoords, Box>::const_iterator i = chunks.begin(); i != chunks.end(); ++i)
+        out << i->first[0] << ' ' << i->first[1] << ' ' << i->first[2] << i->second << '\n';
+    out.close();
+    if (!out)
+        throw boost::enable_error_info(std::ios::failure("Could not write incremental state"))
+            << boost::errinfo_file_name(tmpPath.string());
+
+    boost::system::error_code ec;
+    rename(tmpPath, path, ec);
+    if (ec)
+        throw boost::enable_error_info(std::ios::failure("Could not write incremental state: " + ec.message()))
+            << boost::errinfo_file_name(path.string());
+}
+
+bool State::load(const boost::filesystem::path &path)
+{
+    boost::filesystem::ifstream in(path);
+    if (!in)
+        return false;
+    in.imbue(std::locale::classic());
+
+    std::string magic;
+    int version;
+    if (!(in >> magic >> version) || magic != "mlsgpu-incremental" || version != 1
+        || in.get() != '\n')
+        return false;
+
+    State s;
+    std::size_t nFiles, nChunks;
+    if (!readString(in, s.key) || !(in >> nFiles))
+        return false;
+    s.files.resize(nFiles);
+    BOOST_FOREACH(FileRecord &f, s.files)
+    {
+        if (!readString(in, f.path) || !(in >> f.size >> f.mtime >> f.hasBox >> f.box))
+            return false;
+    }
+    if (!(in >> nChunks))
+        return false;
+    for (std::size_t i = 0; i < nChunks; i++)
+    {
+        ChunkCoords coords;
+        Box box;
+        if (!(in >> coords[0] >> coords[1] >> coords[2] >> box))
+            return false;
+        s.chunks[coords] = box;
+    }
+
+    std::swap(*this, s);
+    return true;
+}
+
+Planner::Planner(const State *previous, const State &current)
+    : full(previous == NULL || previous->key != current.key),
+    changedFiles(0), reusedChunks(0)
+{
+    if (full)
+    {
+        // The old chunk numbering may not match, so none of it can be kept
+        if (previous != NULL)
+        {
+            for (std::map<ChunkCoords, Box>::const_iterator i = previous->chunks.begin();
+                 i != previous->chunks.end(); ++i)
+                previousStale.insert(i->first);
+        }
+        return;
+    }
+
+    // Merge the two file lists, which are both sorted by path
+    std::vector<FileRecord>::const_iterator p = previous->files.begin();
+    std::vector<FileRecord>::const_iterator c = current.files.begin();
+    while (p != previous->files.end() || c != current.files.end())
+    {
+        const FileRecord *oldFile = NULL, *newFile = NULL;
+        if (c == current.files.end() || (p != previous->files.end() && p->path < c->path))
+            oldFile = &*p++;
+        else if (p == previous->files.end() || c->path < p->path)
+            newFile = &*c++;
+        else
+        {
+            oldFile = &*p++;
+            newFile = &*c++;
+            if (oldFile->sameContents(*newFile))
+                continue;
+        }
+
+        changedFiles++;
+        if (oldFile != NULL && oldFile->hasBox)
+            dirty.push_back(oldFile->box);
+        if (newFile != NULL && newFile->hasBox)
+            dirty.push_back(newFile->box);
+    }
+
+    for (std::map<ChunkCoords, Box>::const_iterator i = previous->chunks.begin();
+         i != previous->chunks.end(); ++i)
+    {
+        if (isDirty(i->second))
+            previousStale.insert(i->first);
+    }
+}
+
+bool Planner::isDirty(const Box &box) const
+{
+    BOOST_FOREACH(const Box &d, dirty)
+    {
+        if (box.intersects(d))
+            return true;
+    }
+    return false;
+}
+
+bool Planner::operator()(const ChunkId &chunkId, const std::vector<Grid> &grids)
+{
+    if (grids.empty())
+        return false;
+
+    Box box = Box::fromGrid(grids[0]);
+    for (std::size_t i = 1; i < grids.size(); i++)
+        box += Box::fromGrid(grids[i]);
+
+    /* The new region is also checked, because a chunk can grow into a
+     * region that was previously empty. Merging with any earlier record is
+     * not needed: a chunk that changed shape must overlap a dirty region.
+     */
+    chunks[chunkId.coords] = box;
+    if (full || previousStale.count(chunkId.coords) || isDirty(box))
+    {
+        accepted.insert(chunkId.coords);
+        return true;
+    }
+    else
+    {
+        reusedChunks++;
+        return false;
+    }
+}
+
+std::vector<ChunkCoords> Planner::staleChunks() const
+{
+    std::set<ChunkCoords> ans = accepted;
+    ans.insert(previousStale.begin(), previousStale.end());
+    return std::vector<ChunkCoords>(ans.begin(), ans.end());
+}
+
+} // namespace Incremental
@@ -0,0 +1,197 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Bookkeeping for re-meshing only the output chunks affected by changed
+ * input files.
+ *
+ * A run with @c --split records, for each input file, its size, modification
+ * time and the region of the grid touched by its splats, and for each output
+ * chunk the region covered by its buckets. A later run over the same
+ * inputs compares the files against this record. Regions of files that were
+ * added, removed or modified are @em dirty, and only chunks whose buckets
+ * (in either run) overlap a dirty region are reconstructed. The files for
+ * the other chunks are left in place from the earlier run.
+ */
+
+#ifndef MLSGPU_INCREMENTAL_H
+#define MLSGPU_INCREMENTAL_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <ctime>
+#include <boost/array.hpp>
+#include <boost/filesystem/path.hpp>
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "chunk_id.h"
+
+namespace Incremental
+{
+
+/**
+ * Axis-aligned box of grid vertices. The coordinates are absolute vertex
+ * indices relative to the grid reference point, and both bounds are
+ * inclusive.
+ */
+struct Box
+{
+    boost::array<Grid::difference_type, 3> lower, upper;
+
+    /// Box covering the vertices of a grid
+    static Box fromGrid(const Grid &grid);
+
+    /// Whether the two boxes share at least one vertex
+    bool intersects(const Box &b) const;
+
+    /// Grow the box to contain @a b
+    Box &operator+=(const Box &b);
+
+    bool operator==(const Box &b) const
+    {
+        return lower == b.lower && upper == b.upper;
+    }
+};
+
+/// Information about one input file
+struct FileRecord
+{
+    std::string path;            ///< Absolute path
+    std::tr1::uint64_t size;     ///< Size in bytes
+    std::time_t mtime;           ///< Last modification time
+    bool hasBox;                 ///< False if the file has no finite splats
+    Box box;                     ///< Vertices touched by the splats (if @ref hasBox)
+
+    FileRecord() : size(0), mtime(0), hasBox(false) {}
+
+    /// Whether the file contents are assumed to be unchanged
+    bool sameContents(const FileRecord &b) const
+    {
+        return size == b.size && mtime == b.mtime;
+    }
+};
+
+/// Chunk coordinates, as in @ref ChunkId::coords
+typedef boost::array<Grid::size_type, 3> ChunkCoords;
+
+/**
+ * Description of a run, saved at the end of the run and compared against
+ * by the next one.
+ */
+struct State
+{
+    /**
+     * Arbitrary string describing the options and grid. If it differs
+     * between runs, chunks cannot be reused.
+     */
+    std::string key;
+    /// Input files, sorted by path
+    std::vector<FileRecord> files;
+    /// Region covered by the buckets of each chunk
+    std::map<ChunkCoords, Box> chunks;
+
+    /**
+     * Write the state to @a path. The data is written to a temporary file
+     * which is then renamed, so that an interrupted save leaves the previous
+     * state intact.
+     *
+     * @throw std::ios::failure on I/O errors.
+     */
+    void save(const boost::filesystem::path &path) const;
+
+    /**
+     * Replace the state with one saved by @ref save.
+     *
+     * @return @c true on success, or @c false if the file does not exist or
+     * could not be parsed. In the latter case the object is left unchanged.
+     */
+    bool load(const boost::filesystem::path &path);
+};
+
+/**
+ * Decides which chunks need to be reconstructed, and accumulates the chunk
+ * regions for the next @ref State. It is a model of @ref
+ * BucketCollector::ChunkFilter.
+ */
+class Planner
+{
+public:
+    /**
+     * Constructor. If @a previous is @c NULL or has a different key to
+     * @a current, every chunk is reconstructed.
+     *
+     * @param previous    State recorded by an earlier run, or @c NULL
+     * @param current     State of this run, with @ref State::chunks unused
+     */
+    Planner(const State *previous, const State &current);
+
+    /**
+     * Record the region of a chunk and determine whether it must be
+     * reconstructed.
+     *
+     * @param chunkId     The chunk
+     * @param grids       Grids of the buckets in the chunk
+     */
+    bool operator()(const ChunkId &chunkId, const std::vector<Grid> &grids);
+
+    /// Whether all chunks are reconstructed regardless of the inputs
+    bool isFull() const { return full; }
+
+    /// Number of files that were added, removed or modified
+    std::size_t numChangedFiles() const { return changedFiles; }
+
+    /// Number of chunks passed to @ref operator()() that were rejected
+    std::size_t numReusedChunks() const { return reusedChunks; }
+
+    /**
+     * Chunks whose output from the earlier run is out of date. This
+     * includes the chunks accepted by @ref operator()() and also chunks of
+     * the earlier run whose region was dirty and that no longer exist, so
+     * that any output files for them can be removed before new ones are
+     * written. It is only complete once bucketing is finished.
+     */
+    std::vector<ChunkCoords> staleChunks() const;
+
+    /// Chunk regions seen by @ref operator()(), to be stored in the next @ref State
+    const std::map<ChunkCoords, Box> &getChunks() const { return chunks; }
+
+private:
+    bool full;                          ///< Reconstruct every chunk
+    std::size_t changedFiles;           ///< Files with different contents
+    std::size_t reusedChunks;           ///< Chunks that were skipped
+    std::vector<Box> dirty;             ///< Regions touched by changed files
+    std::set<ChunkCoords> previousStale;   ///< Stale chunks of the earlier run
+    std::set<ChunkCoords> accepted;     ///< Chunks accepted by @ref operator()()
+    std::map<ChunkCoords, Box> chunks;  ///< Chunk regions seen in this run
+
+    /// Whether @a box intersects one of the @ref dirty boxes
+    bool isDirty(const Box &box) const;
+};
+
+} // namespace Incremental
+
+#endif /* !MLSGPU_INCREMENTAL_H */
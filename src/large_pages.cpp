@@ -0,0 +1,213 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Allocation of large buffers, optionally backed by huge pages.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#if (HAVE_HUGE_PAGES || HAVE_SYS_MBIND) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1
+#endif
+#include <new>
+#include <map>
+#include <string>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include "large_pages.h"
+#include "logging.h"
+
+#if HAVE_HUGE_PAGES
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+#if HAVE_HUGE_PAGES && HAVE_SYS_MBIND
+# include <sys/syscall.h>
+#endif
+
+std::map<std::string, HugePageMode> HugePageModeWrapper::getNameMap()
+{
+    std::map<std::string, HugePageMode> ans;
+    ans["none"] = HUGE_PAGES_NONE;
+#if HAVE_HUGE_PAGES
+    ans["transparent"] = HUGE_PAGES_TRANSPARENT;
+    ans["2M"] = HUGE_PAGES_2M;
+    ans["1G"] = HUGE_PAGES_1G;
+#endif
+    return ans;
+}
+
+namespace LargePages
+{
+
+namespace
+{
+
+HugePageMode mode = HUGE_PAGES_NONE;
+int numaNode = -1;
+/// Node set by @ref setThreadNode, overriding @ref numaNode
+__thread int threadNode = -1;
+
+#if HAVE_HUGE_PAGES
+
+/// Protects @ref mappings and @ref warned
+boost::mutex mutex;
+/// Length of each region obtained from @c mmap, keyed by address
+std::map<void *, std::size_t> mappings;
+/// Whether the fallback from explicit huge pages has been reported
+bool warned = false;
+
+std::size_t roundUp(std::size_t bytes, std::size_t granularity)
+{
+    return (bytes + granularity - 1) / granularity * granularity;
+}
+
+/// Try to map explicit huge pages, returning @c MAP_FAILED on failure
+void *mapExplicit(std::size_t bytes, std::size_t &length)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+    std::size_t pageSize = std::size_t(2) << 20;
+#ifdef MAP_HUGE_SHIFT
+    if (mode == HUGE_PAGES_1G)
+    {
+        flags |= 30 << MAP_HUGE_SHIFT;
+        pageSize = std::size_t(1) << 30;
+    }
+    else
+        flags |= 21 << MAP_HUGE_SHIFT;
+#else
+    if (mode == HUGE_PAGES_1G)
+        return MAP_FAILED;
+#endif
+    length = roundUp(bytes, pageSize);
+    return mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+}
+
+/// Request that pages be placed on @a node
+void bindNode(void *ptr, std::size_t length, int node)
+{
+#if HAVE_SYS_MBIND
+    const int MPOL_PREFERRED_ = 1; // from <linux/mempolicy.h>
+    const int bitsPerLong = 8 * sizeof(unsigned long);
+    unsigned long mask[64 / sizeof(unsigned long)] = {};
+    if (node >= int(8 * sizeof(mask)))
+        return;
+    mask[node / bitsPerLong] = 1UL << (node % bitsPerLong);
+    if (syscall(SYS_mbind, ptr, length, MPOL_PREFERRED_, mask, 8 * sizeof(mask), 0) != 0)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        Log::log[Log::debug] << "mbind to node " << node << " failed: " << std::strerror(errno) << '\n';
+    }
+#else
+    (void) ptr;
+    (void) length;
+    (void) node;
+#endif
+}
+
+#endif // HAVE_HUGE_PAGES
+
+} // anonymous namespace
+
+void setPolicy(HugePageMode mode, int numaNode)
+{
+    LargePages::mode = mode;
+    LargePages::numaNode = numaNode;
+}
+
+void setThreadNode(int node)
+{
+    threadNode = node;
+}
+
+int getThreadNode()
+{
+    return threadNode;
+}
+
+void *allocate(std::size_t bytes)
+{
+#if HAVE_HUGE_PAGES
+    const int node = threadNode >= 0 ? threadNode : numaNode;
+    if (mode == HUGE_PAGES_NONE && node < 0)
+        return ::operator new(bytes);
+
+    std::size_t length = 0;
+    void *ptr = MAP_FAILED;
+    if (mode == HUGE_PAGES_2M || mode == HUGE_PAGES_1G)
+    {
+        ptr = mapExplicit(bytes, length);
+        if (ptr == MAP_FAILED)
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (!warned)
+            {
+                Log::log[Log::warn] << "Could not allocate explicit huge pages ("
+                    << std::strerror(errno) << "); using transparent huge pages\n";
+                warned = true;
+            }
+        }
+    }
+    if (ptr == MAP_FAILED)
+    {
+        length = roundUp(bytes == 0 ? 1 : bytes, sysconf(_SC_PAGESIZE));
+        ptr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+            throw std::bad_alloc();
+        if (mode != HUGE_PAGES_NONE)
+            madvise(ptr, length, MADV_HUGEPAGE); // only a hint, so errors are ignored
+    }
+    if (node >= 0)
+        bindNode(ptr, length, node);
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    mappings[ptr] = length;
+    return ptr;
+#else
+    return ::operator new(bytes);
+#endif
+}
+
+void deallocate(void *ptr, std::size_t bytes)
+{
+    (void) bytes;
+#if HAVE_HUGE_PAGES
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::map<void *, std::size_t>::iterator pos = mappings.find(ptr);
+        if (pos != mappings.end())
+        {
+            munmap(ptr, pos->second);
+            mappings.erase(pos);
+            return;
+        }
+    }
+#endif
+    ::operator delete(ptr);
+}
+
+} // namespace LargePages
@@ -0,0 +1,132 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Allocation of large, long-lived buffers directly from the operating system,
+ * optionally backed by huge pages and bound to a NUMA node.
+ */
+
+#ifndef LARGE_PAGES_H
+#define LARGE_PAGES_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <memory>
+#include <map>
+#include <string>
+#include <cstddef>
+
+/// Backing to use for buffers allocated with @ref LargePageAllocator
+enum HugePageMode
+{
+    HUGE_PAGES_NONE,         ///< Ordinary heap allocation
+    HUGE_PAGES_TRANSPARENT,  ///< Anonymous mapping with a transparent huge page hint
+    HUGE_PAGES_2M,           ///< Explicit 2 MiB huge pages, falling back to transparent
+    HUGE_PAGES_1G            ///< Explicit 1 GiB huge pages, falling back to transparent
+};
+
+/// Wrapper around @ref HugePageMode for use with @ref Choice.
+class HugePageModeWrapper
+{
+public:
+    typedef HugePageMode type;
+    static std::map<std::string, HugePageMode> getNameMap();
+};
+
+namespace LargePages
+{
+
+/**
+ * Set the policy used by subsequent calls to @ref allocate. It does not affect
+ * memory that is already allocated. It is not thread-safe, and should be
+ * called during startup.
+ *
+ * @param mode       Backing for the memory.
+ * @param numaNode   NUMA node on which to prefer placing the memory, or -1 for
+ *                   the default placement.
+ */
+void setPolicy(HugePageMode mode, int numaNode = -1);
+
+/**
+ * Override the NUMA node passed to @ref setPolicy for allocations made by the
+ * calling thread. Passing -1 removes the override.
+ *
+ * @see @ref Numa::ScopedBind.
+ */
+void setThreadNode(int node);
+
+/// Return the override set by @ref setThreadNode, or -1 if there is none
+int getThreadNode();
+
+/**
+ * Allocate @a bytes bytes according to the current policy. If explicit huge
+ * pages cannot be obtained, a warning is logged (once) and transparent huge
+ * pages are used instead.
+ *
+ * @throw std::bad_alloc if the memory could not be allocated.
+ */
+void *allocate(std::size_t bytes);
+
+/**
+ * Free memory returned by @ref allocate.
+ */
+void deallocate(void *ptr, std::size_t bytes);
+
+} // namespace LargePages
+
+/**
+ * STL-compatible allocator that uses @ref LargePages::allocate. It is intended
+ * for large buffers that are allocated once and streamed through, such as
+ * @ref CircularBuffer. It is stateless, so it can be wrapped in a
+ * @ref Statistics::Allocator.
+ */
+template<typename T>
+class LargePageAllocator : public std::allocator<T>
+{
+public:
+    typedef typename std::allocator<T>::pointer pointer;
+    typedef typename std::allocator<T>::size_type size_type;
+
+    template<typename U> struct rebind
+    {
+        typedef LargePageAllocator<U> other;
+    };
+
+    LargePageAllocator() throw() {}
+    LargePageAllocator(const LargePageAllocator &) throw() : std::allocator<T>() {}
+    template<typename U>
+    LargePageAllocator(const LargePageAllocator<U> &) throw() {}
+
+    pointer allocate(size_type n, std::allocator<void>::const_pointer hint = 0)
+    {
+        (void) hint;
+        return static_cast<pointer>(LargePages::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(pointer p, size_type n)
+    {
+        LargePages::deallocate(p, n * sizeof(T));
+    }
+};
+
+#endif /* LARGE_PAGES_H */
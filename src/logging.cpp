@@ -26,10 +26,24 @@
 
 #include <ostream>
 #include <iostream>
+#include <streambuf>
+#include <string>
+#include <deque>
+#include <set>
+#include <cstdio>
+#include <cstdlib>
 #include <cassert>
 #include <boost/iostreams/device/null.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
 #include "logging.h"
+#include "thread_name.h"
+#include "timer.h"
 
 using namespace std;
 
@@ -39,16 +53,320 @@ namespace Log
 namespace detail
 {
 
+/**
+ * Background writer for @ref startAsync. Text arrives in pieces that each
+ * either complete a line or were flushed early, and is written out by a
+ * dedicated thread.
+ */
+class AsyncWriter
+{
+public:
+    AsyncWriter(ostream &out, unsigned int maxRepeats);
+
+    /// Wait for all pending text to be written, then stop the thread
+    ~AsyncWriter();
+
+    /**
+     * Queue text for writing.
+     *
+     * @param thread     Name of the thread that logged it.
+     * @param lineStart  Whether @a text starts a new line, and so needs a prefix.
+     * @param text       The text, which ends with a newline unless it was flushed early.
+     */
+    void push(const string &thread, bool lineStart, const string &text);
+
+private:
+    struct Item
+    {
+        double time;
+        string thread;
+        bool lineStart;
+        string text;
+    };
+
+    ostream &out;
+    const unsigned int maxRepeats;
+    const Timer::timestamp start;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    deque<Item> items;
+    bool stopping;
+
+    // Only accessed by the writer thread
+    string lastLine;              ///< Last complete line written, for detecting repeats
+    unsigned int repeats;         ///< Copies of @ref lastLine after the first
+    double lastTime;              ///< Time of the most recent copy of @ref lastLine
+    string lastThread;            ///< Thread of the most recent copy of @ref lastLine
+
+    boost::thread thread;
+
+    void writePrefix(double time, const string &thread);
+    /// Report copies of @ref lastLine that were dropped
+    void flushRepeats();
+    void write(const Item &item);
+    void run();
+};
+
+AsyncWriter::AsyncWriter(ostream &out, unsigned int maxRepeats)
+    : out(out), maxRepeats(maxRepeats), start(Timer::currentTime()),
+    stopping(false), repeats(0), lastTime(0.0)
+{
+    thread = boost::thread(&AsyncWriter::run, this);
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    cond.notify_one();
+    thread.join();
+}
+
+void AsyncWriter::push(const string &thread, bool lineStart, const string &text)
+{
+    Item item;
+    item.time = Timer::getElapsed(start, Timer::currentTime());
+    item.thread = thread;
+    item.lineStart = lineStart;
+    item.text = text;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        items.push_back(item);
+    }
+    cond.notify_one();
+}
+
+void AsyncWriter::writePrefix(double time, const string &thread)
+{
+    char stamp[32];
+    std::snprintf(stamp, sizeof(stamp), "[%10.3f ", time);
+    out << stamp << (thread.empty() ? "main" : thread) << "] ";
+}
+
+void AsyncWriter::flushRepeats()
+{
+    if (repeats > maxRepeats)
+    {
+        writePrefix(lastTime, lastThread);
+        out << "(last message repeated " << repeats - maxRepeats << " more times)\n";
+    }
+    repeats = 0;
+    lastLine.clear();
+}
+
+void AsyncWriter::write(const Item &item)
+{
+    const bool completeLine = item.lineStart && !item.text.empty()
+        && item.text[item.text.size() - 1] == '\n';
+    if (completeLine && item.text == lastLine)
+    {
+        repeats++;
+        lastTime = item.time;
+        lastThread = item.thread;
+        if (repeats > maxRepeats)
+            return;
+    }
+    else
+    {
+        flushRepeats();
+        if (completeLine)
+            lastLine = item.text;
+    }
+    if (item.lineStart)
+        writePrefix(item.time, item.thread);
+    out << item.text;
+}
+
+void AsyncWriter::run()
+{
+    thread_set_name("log");
+    deque<Item> batch;
+    while (true)
+    {
+        bool done;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (items.empty() && !stopping)
+                cond.wait(lock);
+            batch.swap(items);
+            done = stopping && batch.empty();
+        }
+        if (done)
+            break;
+        for (deque<Item>::const_iterator i = batch.begin(); i != batch.end(); ++i)
+            write(*i);
+        batch.clear();
+        out.flush();
+    }
+    flushRepeats();
+    out.flush();
+}
+
+class LineBuffer;
+
+/**
+ * Protects @ref lineBuffers. When it is needed together with @ref asyncMutex,
+ * @ref asyncMutex must be locked first.
+ */
+static boost::mutex lineBuffersMutex;
+/// All live @ref LineBuffer objects, so that @ref stopAsync can detach them
+static std::set<LineBuffer *> lineBuffers;
+
+/**
+ * Per-thread buffer used while the asynchronous writer is running. It
+ * collects text until the end of a line or a flush, and then passes it to
+ * the writer. Once @ref detach has been called (by @ref stopAsync), the text
+ * goes to @c std::cerr instead.
+ */
+class LineBuffer : public streambuf
+{
+public:
+    explicit LineBuffer(AsyncWriter *writer) : writer(writer), lineStart(true)
+    {
+        boost::lock_guard<boost::mutex> lock(lineBuffersMutex);
+        lineBuffers.insert(this);
+    }
+
+    /**
+     * Pass any unfinished line to the writer. This is done while still
+     * registered, so that @ref stopAsync cannot destroy the writer meanwhile.
+     */
+    virtual ~LineBuffer()
+    {
+        boost::lock_guard<boost::mutex> lock(lineBuffersMutex);
+        detach();
+        lineBuffers.erase(this);
+    }
+
+    /**
+     * Pass any unfinished line to the writer, terminating it, and stop using
+     * the writer.
+     */
+    void detach()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (writer != NULL && (!pending.empty() || !lineStart))
+        {
+            pending += '\n';
+            emit();
+            lineStart = true;
+        }
+        writer = NULL;
+    }
+
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            append(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+    virtual streamsize xsputn(const char *s, streamsize n)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        for (streamsize i = 0; i < n; i++)
+            append(s[i]);
+        return n;
+    }
+
+    virtual int sync()
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (!pending.empty())
+        {
+            emit();
+            lineStart = false;
+        }
+        return 0;
+    }
+
+private:
+    AsyncWriter *writer;      ///< Destination, or @c NULL once detached
+    /**
+     * Protects the buffer. It is normally used by just one thread, but a
+     * stream obtained on one thread may be kept and written from another
+     * (for example, by a @ref ProgressDisplay).
+     */
+    boost::mutex mutex;
+    string pending;           ///< Text not yet passed to the writer
+    bool lineStart;           ///< Whether @ref pending starts a new line
+
+    /// Pass @ref pending to the writer (or @c std::cerr) and clear it
+    void emit()
+    {
+        if (writer != NULL)
+            writer->push(thread_get_name(), lineStart, pending);
+        else
+            cerr << pending << flush;
+        pending.clear();
+    }
+
+    void append(char c)
+    {
+        pending += c;
+        if (c == '\n')
+        {
+            emit();
+            lineStart = true;
+        }
+    }
+};
+
+/// Stream over a @ref LineBuffer
+class ThreadStream : public ostream
+{
+public:
+    explicit ThreadStream(AsyncWriter *writer) : ostream(NULL), buffer(writer)
+    {
+        rdbuf(&buffer);
+    }
+
+private:
+    LineBuffer buffer;
+};
+
+static boost::mutex asyncMutex;
+static boost::scoped_ptr<AsyncWriter> asyncWriter;
+/**
+ * Incremented each time the writer is started, so that streams left over
+ * from an earlier writer are replaced.
+ */
+static unsigned int asyncGeneration = 0;
+
+/// Stream of the calling thread, and the value of @ref asyncGeneration when it was made
+struct ThreadState
+{
+    unsigned int generation;
+    ThreadStream stream;
+
+    ThreadState(unsigned int generation, AsyncWriter *writer)
+        : generation(generation), stream(writer) {}
+};
+
+static boost::thread_specific_ptr<ThreadState> threadState;
+
 LogArray::LogArray(Level minLevel) : minLevel(minLevel) {}
 
 ostream &LogArray::operator[](Level level)
 {
     static boost::iostreams::null_sink nullSink;
     static boost::iostreams::stream<boost::iostreams::null_sink> nullStream(nullSink);
-    if (level >= minLevel)
-        return cerr;
-    else
+    if (level < minLevel)
         return nullStream;
+
+    boost::lock_guard<boost::mutex> lock(asyncMutex);
+    if (!asyncWriter)
+        return cerr;
+    if (threadState.get() == NULL || threadState->generation != asyncGeneration)
+        threadState.reset(new ThreadState(asyncGeneration, asyncWriter.get()));
+    return threadState->stream;
 }
 
 void LogArray::setLevel(Level minLevel)
@@ -60,4 +378,36 @@ void LogArray::setLevel(Level minLevel)
 
 detail::LogArray log;
 
+void startAsync(std::ostream &out, unsigned int maxRepeats)
+{
+    static bool registered = false;
+    boost::lock_guard<boost::mutex> lock(detail::asyncMutex);
+    assert(!detail::asyncWriter);
+    detail::asyncWriter.reset(new detail::AsyncWriter(out, maxRepeats));
+    detail::asyncGeneration++;
+    if (!registered)
+    {
+        std::atexit(stopAsync);
+        registered = true;
+    }
+}
+
+void stopAsync()
+{
+    /* The writer is detached under the lock, so that no new streams pick it
+     * up, and every existing stream is pointed away from it before it is
+     * destroyed. It is destroyed outside the lock so that threads still
+     * logging are not blocked while the queue drains.
+     */
+    boost::scoped_ptr<detail::AsyncWriter> writer;
+    {
+        boost::lock_guard<boost::mutex> lock(detail::asyncMutex);
+        detail::asyncWriter.swap(writer);
+        boost::lock_guard<boost::mutex> buffersLock(detail::lineBuffersMutex);
+        for (std::set<detail::LineBuffer *>::const_iterator i = detail::lineBuffers.begin();
+             i != detail::lineBuffers.end(); ++i)
+            (*i)->detach();
+    }
+}
+
 } // namespace Log
@@ -57,6 +57,31 @@ public:
 
 extern detail::LogArray log;
 
+/**
+ * Send log messages to a background thread that writes them to @a out,
+ * instead of writing them to @c std::cerr from the calling thread. Each
+ * thread accumulates text in its own buffer until it completes a line (or
+ * flushes the stream), so a slow terminal or file only delays the writer.
+ * Each line is prefixed by the seconds since this call and the name given to
+ * the thread by @ref thread_set_name. When the same line is logged more than
+ * @a maxRepeats times in a row, the extra copies are replaced by a count.
+ *
+ * The writer is stopped by @ref stopAsync, which is also registered to run
+ * at exit.
+ *
+ * @pre The asynchronous writer is not already running.
+ */
+void startAsync(std::ostream &out, unsigned int maxRepeats = 10);
+
+/**
+ * Write out all pending messages, stop the writer started by @ref
+ * startAsync and return to writing directly to @c std::cerr. It does nothing
+ * if the writer is not running. Text that a thread has not yet completed is
+ * written out as a line of its own. Streams obtained from @ref log while the
+ * writer was running remain usable, but write to @c std::cerr from then on.
+ */
+void stopAsync();
+
 } // namespace Log
 
 #endif /* MINIMLS_LOGGING_H */
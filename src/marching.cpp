@@ -21,7 +21,7 @@
 /**
  * @file
  *
- * Marching tetrahedra algorithms.
+ * Marching tetrahedra and marching cubes algorithms.
  */
 
 #if HAVE_CONFIG_H
@@ -33,11 +33,15 @@
 #endif
 
 #include <vector>
+#include <map>
+#include <string>
+#include <sstream>
 #include <utility>
 #include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <limits>
+#include <boost/lexical_cast.hpp>
 #include "tr1_cstdint.h"
 #include "clh.h"
 #include "marching.h"
@@ -80,6 +84,16 @@ const unsigned char Marching::tetrahedronIndices[NUM_TETRAHEDRA][4] =
     { 0, 7, 5, 1 }
 };
 
+const unsigned char Marching::faceIndices[NUM_FACES][4] =
+{
+    { 0, 4, 6, 2 },
+    { 1, 3, 7, 5 },
+    { 0, 1, 5, 4 },
+    { 2, 6, 7, 3 },
+    { 0, 2, 3, 1 },
+    { 4, 5, 7, 6 }
+};
+
 unsigned int Marching::findEdgeByVertexIds(unsigned int v0, unsigned int v1)
 {
     if (v0 > v1) std::swap(v0, v1);
@@ -106,95 +120,158 @@ unsigned int Marching::permutationParity(Iterator first, Iterator last)
     return parity;
 }
 
-void Marching::makeTables(const cl::Context &context)
+void Marching::tetrahedraTriangles(unsigned int code, std::vector<cl_uchar> &triangles)
 {
-    std::vector<cl_uchar> hVertexTable, hIndexTable;
-    std::vector<cl_uint3> hKeyTable;
-    std::vector<cl_uchar2> hCountTable(NUM_CUBES);
-    std::vector<cl_ushort2> hStartTable(NUM_CUBES + 1);
-    for (unsigned int i = 0; i < NUM_CUBES; i++)
+    for (unsigned int j = 0; j < NUM_TETRAHEDRA; j++)
     {
-        hStartTable[i].s[0] = hVertexTable.size();
-        hStartTable[i].s[1] = hIndexTable.size();
+        // Holds a vertex index together with the inside/outside flag
+        typedef std::pair<unsigned char, bool> tvtx;
+        tvtx tvtxs[4];
+        unsigned int outside = 0;
+        // Copy the vertices to tvtxs, and count vertices that are external
+        for (unsigned int k = 0; k < 4; k++)
+        {
+            unsigned int v = tetrahedronIndices[j][k];
+            bool o = (code & (1 << v));
+            outside += o;
+            tvtxs[k] = tvtx(v, o);
+        }
+        unsigned int baseParity = permutationParity(tvtxs, tvtxs + 4);
 
-        /* Find triangles. For now we record triangle indices
-         * as edge numbers, which we will compact later.
-         */
-        std::vector<cl_uchar> triangles;
-        for (unsigned int j = 0; j < NUM_TETRAHEDRA; j++)
+        // Reduce number of cases to handle by flipping inside/outside to
+        // ensure that outside <= 2.
+        if (outside > 2)
         {
-            // Holds a vertex index together with the inside/outside flag
-            typedef std::pair<unsigned char, bool> tvtx;
-            tvtx tvtxs[4];
-            unsigned int outside = 0;
-            // Copy the vertices to tvtxs, and count vertices that are external
+            // Causes triangle winding to flip as well - otherwise
+            // the triangle will be inside out.
+            baseParity ^= 1;
             for (unsigned int k = 0; k < 4; k++)
+                tvtxs[k].second = !tvtxs[k].second;
+        }
+
+        /* To reduce the number of cases to handle, the tetrahedron is
+         * rotated to match one of the canonical configurations (all
+         * inside, v0 outside, (v0, v1) outside). There are 24 permutations
+         * of the vertices, half of which are rotations and half of which are
+         * reflections. Not all of them need to be tried, but this code isn't
+         * performance critical.
+         */
+        sort(tvtxs, tvtxs + 4);
+        do
+        {
+            // Check that it is a rotation rather than a reflection
+            if (permutationParity(tvtxs, tvtxs + 4) == baseParity)
             {
-                unsigned int v = tetrahedronIndices[j][k];
-                bool o = (i & (1 << v));
-                outside += o;
-                tvtxs[k] = tvtx(v, o);
+                const unsigned int t0 = tvtxs[0].first;
+                const unsigned int t1 = tvtxs[1].first;
+                const unsigned int t2 = tvtxs[2].first;
+                const unsigned int t3 = tvtxs[3].first;
+                unsigned int mask = 0;
+                for (unsigned int k = 0; k < 4; k++)
+                    mask |= tvtxs[k].second << k;
+                if (mask == 0)
+                {
+                    break; // no outside vertices, so no triangles needed
+                }
+                else if (mask == 1)
+                {
+                    // One outside vertex, one triangle needed
+                    triangles.push_back(findEdgeByVertexIds(t0, t1));
+                    triangles.push_back(findEdgeByVertexIds(t0, t3));
+                    triangles.push_back(findEdgeByVertexIds(t0, t2));
+                    break;
+                }
+                else if (mask == 3)
+                {
+                    // Two outside vertices, two triangles needed to tile a quad
+                    triangles.push_back(findEdgeByVertexIds(t0, t2));
+                    triangles.push_back(findEdgeByVertexIds(t1, t2));
+                    triangles.push_back(findEdgeByVertexIds(t1, t3));
+
+                    triangles.push_back(findEdgeByVertexIds(t1, t3));
+                    triangles.push_back(findEdgeByVertexIds(t0, t3));
+                    triangles.push_back(findEdgeByVertexIds(t0, t2));
+                    break;
+                }
             }
-            unsigned int baseParity = permutationParity(tvtxs, tvtxs + 4);
+        } while (next_permutation(tvtxs, tvtxs + 4));
+    }
+}
 
-            // Reduce number of cases to handle by flipping inside/outside to
-            // ensure that outside <= 2.
-            if (outside > 2)
+void Marching::cubeTriangles(unsigned int code, std::vector<cl_uchar> &triangles)
+{
+    /* next[e] is the edge that follows edge e around the boundary of the
+     * surface in the cell, or NUM_EDGES if e is not crossed.
+     */
+    unsigned int next[NUM_EDGES];
+    std::fill(next, next + NUM_EDGES, (unsigned int) NUM_EDGES);
+    for (unsigned int f = 0; f < NUM_FACES; f++)
+    {
+        const unsigned char *corners = faceIndices[f];
+        bool outside[4];
+        for (unsigned int k = 0; k < 4; k++)
+            outside[k] = code & (1 << corners[k]);
+
+        // Each counter-clockwise run of outside corners is cut off by one segment
+        for (unsigned int k = 0; k < 4; k++)
+            if (outside[k] && !outside[(k + 3) % 4])
             {
-                // Causes triangle winding to flip as well - otherwise
-                // the triangle will be inside out.
-                baseParity ^= 1;
-                for (unsigned int k = 0; k < 4; k++)
-                    tvtxs[k].second = !tvtxs[k].second;
+                unsigned int j = k;
+                while (outside[(j + 1) % 4])
+                    j = (j + 1) % 4;
+                const unsigned int in = findEdgeByVertexIds(corners[(k + 3) % 4], corners[k]);
+                const unsigned int out = findEdgeByVertexIds(corners[j], corners[(j + 1) % 4]);
+                assert(next[out] == NUM_EDGES);
+                next[out] = in;
             }
+    }
 
-            /* To reduce the number of cases to handle, the tetrahedron is
-             * rotated to match one of the canonical configurations (all
-             * inside, v0 outside, (v0, v1) outside). There are 24 permutations
-             * of the vertices, half of which are rotations and half of which are
-             * reflections. Not all of them need to be tried, but this code isn't
-             * performance critical.
-             */
-            sort(tvtxs, tvtxs + 4);
-            do
+    // Triangulate each loop as a fan around its lowest-numbered edge
+    for (unsigned int first = 0; first < NUM_EDGES; first++)
+    {
+        if (next[first] == NUM_EDGES)
+            continue;
+        unsigned int cur = next[first];
+        next[first] = NUM_EDGES;
+        while (cur != first)
+        {
+            const unsigned int succ = next[cur];
+            next[cur] = NUM_EDGES;
+            if (succ != first)
             {
-                // Check that it is a rotation rather than a reflection
-                if (permutationParity(tvtxs, tvtxs + 4) == baseParity)
-                {
-                    const unsigned int t0 = tvtxs[0].first;
-                    const unsigned int t1 = tvtxs[1].first;
-                    const unsigned int t2 = tvtxs[2].first;
-                    const unsigned int t3 = tvtxs[3].first;
-                    unsigned int mask = 0;
-                    for (unsigned int k = 0; k < 4; k++)
-                        mask |= tvtxs[k].second << k;
-                    if (mask == 0)
-                    {
-                        break; // no outside vertices, so no triangles needed
-                    }
-                    else if (mask == 1)
-                    {
-                        // One outside vertex, one triangle needed
-                        triangles.push_back(findEdgeByVertexIds(t0, t1));
-                        triangles.push_back(findEdgeByVertexIds(t0, t3));
-                        triangles.push_back(findEdgeByVertexIds(t0, t2));
-                        break;
-                    }
-                    else if (mask == 3)
-                    {
-                        // Two outside vertices, two triangles needed to tile a quad
-                        triangles.push_back(findEdgeByVertexIds(t0, t2));
-                        triangles.push_back(findEdgeByVertexIds(t1, t2));
-                        triangles.push_back(findEdgeByVertexIds(t1, t3));
-
-                        triangles.push_back(findEdgeByVertexIds(t1, t3));
-                        triangles.push_back(findEdgeByVertexIds(t0, t3));
-                        triangles.push_back(findEdgeByVertexIds(t0, t2));
-                        break;
-                    }
-                }
-            } while (next_permutation(tvtxs, tvtxs + 4));
+                triangles.push_back(first);
+                triangles.push_back(cur);
+                triangles.push_back(succ);
+            }
+            cur = succ;
         }
+    }
+}
+
+void Marching::makeHostTables(HostTables &tables, bool marchingCubes)
+{
+    std::vector<cl_uchar> &hVertexTable = tables.data;
+    std::vector<cl_uchar> hIndexTable;
+    std::vector<cl_uint3> &hKeyTable = tables.keys;
+    std::vector<cl_uchar2> &hCountTable = tables.count;
+    std::vector<cl_ushort2> &hStartTable = tables.start;
+    hVertexTable.clear();
+    hKeyTable.clear();
+    hCountTable.resize(NUM_CUBES);
+    hStartTable.resize(NUM_CUBES + 1);
+    for (unsigned int i = 0; i < NUM_CUBES; i++)
+    {
+        hStartTable[i].s[0] = hVertexTable.size();
+        hStartTable[i].s[1] = hIndexTable.size();
+
+        /* Find triangles. For now we record triangle indices
+         * as edge numbers, which we will compact later.
+         */
+        std::vector<cl_uchar> triangles;
+        if (marchingCubes)
+            cubeTriangles(i, triangles);
+        else
+            tetrahedraTriangles(i, triangles);
 
         // Determine which edges are in use, and assign indices
         int edgeCompact[NUM_EDGES];
@@ -236,39 +313,173 @@ void Marching::makeTables(const cl::Context &context)
     }
     // Concatenate the two tables into one
     hVertexTable.insert(hVertexTable.end(), hIndexTable.begin(), hIndexTable.end());
+}
 
-    countTable = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                            hCountTable.size() * sizeof(hCountTable[0]), &hCountTable[0]);
-    startTable = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                            hStartTable.size() * sizeof(hStartTable[0]), &hStartTable[0]);
-    dataTable =  cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                            hVertexTable.size() * sizeof(hVertexTable[0]), &hVertexTable[0]);
-    keyTable =   cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                            hKeyTable.size() * sizeof(hKeyTable[0]), &hKeyTable[0]);
-    assert(countTable.getInfo<CL_MEM_SIZE>() == COUNT_TABLE_BYTES);
-    assert(startTable.getInfo<CL_MEM_SIZE>() == START_TABLE_BYTES);
-    assert(dataTable.getInfo<CL_MEM_SIZE>() == DATA_TABLE_BYTES);
-    assert(keyTable.getInfo<CL_MEM_SIZE>() == KEY_TABLE_BYTES);
+/// Format @a values as a brace-enclosed OpenCL C array initializer
+static std::string tableInitializer(const std::vector<unsigned int> &values)
+{
+    std::ostringstream out;
+    out << '{';
+    for (std::size_t i = 0; i < values.size(); i++)
+    {
+        if (i > 0)
+            out << ',';
+        out << values[i];
+    }
+    out << '}';
+    return out.str();
 }
 
-void Marching::validateDevice(const cl::Device &device)
+void Marching::addTableDefines(std::map<std::string, std::string> &defines, bool marchingCubes)
 {
-    if (!device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
+    HostTables tables;
+    makeHostTables(tables, marchingCubes);
+
+    // Vector elements are flattened, and are reassembled with vload2
+    std::vector<unsigned int> count, start, data, keys;
+    for (std::size_t i = 0; i < tables.count.size(); i++)
+    {
+        count.push_back(tables.count[i].s[0]);
+        count.push_back(tables.count[i].s[1]);
+    }
+    for (std::size_t i = 0; i < tables.start.size(); i++)
+    {
+        start.push_back(tables.start[i].s[0]);
+        start.push_back(tables.start[i].s[1]);
+    }
+    data.assign(tables.data.begin(), tables.data.end());
+    // Each key offset is 0, 1 or 2 per axis, so 2 bits per axis suffice
+    for (std::size_t i = 0; i < tables.keys.size(); i++)
+    {
+        const cl_uint3 &key = tables.keys[i];
+        assert(key.s[0] <= 2 && key.s[1] <= 2 && key.s[2] <= 2);
+        keys.push_back(key.s[0] | (key.s[1] << 2) | (key.s[2] << 4));
+    }
+    assert(count.size() * sizeof(cl_uchar) == COUNT_TABLE_BYTES);
+    assert(start.size() * sizeof(cl_ushort) == START_TABLE_BYTES);
+    assert(data.size() * sizeof(cl_uchar) <= DATA_TABLE_BYTES);
+    assert(keys.size() * sizeof(cl_uchar) <= KEY_TABLE_BYTES);
+
+    defines["COUNT_TABLE"] = tableInitializer(count);
+    defines["START_TABLE"] = tableInitializer(start);
+    defines["DATA_TABLE"] = tableInitializer(data);
+    defines["KEY_TABLE"] = tableInitializer(keys);
+
+    // Edges from corner 0 to corner d that are used by some cell
+    unsigned int ownedMask = 0;
+    for (std::size_t i = 0; i < tables.start[NUM_CUBES].s[0]; i++)
+        if (edgeIndices[data[i]][0] == 0)
+            ownedMask |= 1U << edgeIndices[data[i]][1];
+    defines["OWNED_EDGE_MASK"] = boost::lexical_cast<std::string>(ownedMask) + "U";
+}
+
+void Marching::setScaleBias(const cl_float4 &scaleBias)
+{
+    this->scaleBias = scaleBias;
+    compactVerticesKernel.setArg(10, scaleBias);
+    if (hashWeld)
+        hashCompactVerticesKernel.setArg(12, scaleBias);
+}
+
+void Marching::setMarchingCubes(bool cubes)
+{
+    if (cubes == marchingCubes)
+        return;
+    marchingCubes = cubes;
+    buildKernels(cells.getInfo<CL_MEM_CONTEXT>());
+}
+
+void Marching::setOwnedEdges(bool owned)
+{
+    if (owned == ownedEdges)
+        return;
+    ownedEdges = owned;
+    buildKernels(cells.getInfo<CL_MEM_CONTEXT>());
+}
+
+void Marching::validateDevice(const cl::Device &device, DistanceStorage storage)
+{
+    if (storage == DISTANCE_IMAGE && !device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
         throw CLH::invalid_device(device, "images are not supported");
 }
 
+Marching::DistanceStorage Marching::preferredDistanceStorage(const cl::Device &device)
+{
+    if (!device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
+        return DISTANCE_BUFFER;
+    if (device.getInfo<CL_DEVICE_TYPE>() & (CL_DEVICE_TYPE_CPU | CL_DEVICE_TYPE_ACCELERATOR))
+        return DISTANCE_BUFFER;
+    return DISTANCE_IMAGE;
+}
+
+unsigned int Marching::localKeyAxisBits(Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth)
+{
+    // Corner coordinates run up to 2 * (size - 1) in .1 fixed-point
+    const Grid::size_type maxCoord = 2 * (std::max(std::max(maxWidth, maxHeight), maxDepth) - 1);
+    unsigned int bits = 1;
+    while ((Grid::size_type(1) << bits) <= maxCoord)
+        bits++;
+    return bits;
+}
+
+std::size_t Marching::localKeySize(unsigned int axisBits)
+{
+    return 3 * axisBits + 1 <= 32 ? sizeof(cl_uint) : sizeof(cl_ulong);
+}
+
+std::size_t Marching::sliceTiles(Grid::size_type width, Grid::size_type height)
+{
+    return divUp(width - 1, OCCUPANCY_TILE) * divUp(height - 1, OCCUPANCY_TILE);
+}
+
+bool Marching::distanceTypeSupported(const cl::Context &context, cl_channel_type distanceType,
+                                     DistanceStorage storage)
+{
+    if (distanceType == CL_FLOAT)
+        return true; // always supported for CL_R
+    else if (distanceType != CL_HALF_FLOAT)
+        return false;
+    else if (storage == DISTANCE_BUFFER)
+        return true; // vload_half and vstore_half are core functions
+
+    std::vector<cl::ImageFormat> formats;
+    context.getSupportedImageFormats(CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, &formats);
+    for (std::size_t i = 0; i < formats.size(); i++)
+        if (formats[i].image_channel_order == CL_R && formats[i].image_channel_data_type == CL_HALF_FLOAT)
+            return true;
+    return false;
+}
+
+/**
+ * Log base 2 of the size of the welding hash table for up to @a numVertices
+ * vertices. The table has at least twice as many slots as vertices, to keep
+ * probe sequences short.
+ */
+static unsigned int hashTableBits(std::tr1::uint64_t numVertices)
+{
+    unsigned int bits = 1;
+    while ((std::tr1::uint64_t(1) << bits) < 2 * numVertices)
+        bits++;
+    return bits;
+}
+
 CLH::ResourceUsage Marching::resourceUsage(
     const cl::Device &device,
     Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
     Grid::size_type maxSwathe,
     std::size_t meshMemory,
-    const Grid::size_type alignment[3])
+    const Grid::size_type alignment[3],
+    cl_channel_type distanceType,
+    bool hashWeld,
+    bool includeScratch,
+    DistanceStorage storage)
 {
     MLSGPU_ASSERT(2 <= maxWidth && maxWidth <= MAX_DIMENSION, std::invalid_argument);
     MLSGPU_ASSERT(2 <= maxHeight && maxHeight <= MAX_DIMENSION, std::invalid_argument);
     MLSGPU_ASSERT(2 <= maxDepth && maxDepth <= MAX_DIMENSION, std::invalid_argument);
     MLSGPU_ASSERT(alignment[2] <= maxSwathe, std::invalid_argument);
     MLSGPU_ASSERT(meshMemory >= (maxWidth - 1) * (maxHeight - 1) * MAX_CELL_BYTES, std::invalid_argument);
+    MLSGPU_ASSERT(distanceType == CL_FLOAT || distanceType == CL_HALF_FLOAT, std::invalid_argument);
     (void) device; // not currently used, but should be used to determine usage of clogs
 
     Grid::size_type imageWidth = roundUp(maxWidth, alignment[0]);
@@ -278,15 +489,22 @@ CLH::ResourceUsage Marching::resourceUsage(
     // The asserts above guarantee that these will not overflow
     const std::tr1::uint64_t sliceCells = (maxWidth - 1) * (maxHeight - 1);
     const std::tr1::uint64_t swatheCells = sliceCells * maxSwathe;
-    const std::tr1::uint64_t meshCells = meshMemory / MAX_CELL_BYTES;
-    const std::tr1::uint64_t vertexSpace = meshCells * MAX_CELL_VERTICES;
-    const std::tr1::uint64_t indexSpace = meshCells * MAX_CELL_INDICES;
+    const std::tr1::uint64_t swatheTiles = sliceTiles(maxWidth, maxHeight) * maxSwathe;
 
     CLH::ResourceUsage ans;
     // Keep this in sync with the actual allocations below
 
-    // image = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT), imageWidth, imageHeight * (maxSwathe + 1));
-    ans.addImage("distances", imageWidth, imageHeight * (maxSwathe + 1), sizeof(cl_float));
+    const std::size_t distanceBytes = distanceType == CL_HALF_FLOAT ? sizeof(cl_half) : sizeof(cl_float);
+    if (storage == DISTANCE_BUFFER)
+    {
+        // distanceBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, imageWidth * imageHeight * (maxSwathe + 1) * distanceBytes);
+        ans.addBuffer("distances", std::tr1::uint64_t(imageWidth) * imageHeight * (maxSwathe + 1) * distanceBytes);
+    }
+    else
+    {
+        // image = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, distanceType), imageWidth, imageHeight * (maxSwathe + 1));
+        ans.addImage("distances", imageWidth, imageHeight * (maxSwathe + 1), distanceBytes);
+    }
 
     // cells = cl::Buffer(context, CL_MEM_READ_WRITE, swatheCells * sizeof(cl_uint3));
     ans.addBuffer("cells", swatheCells * sizeof(cl_uint3));
@@ -294,12 +512,51 @@ CLH::ResourceUsage Marching::resourceUsage(
     // numOccupied = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
     ans.addBuffer("numOccupied", sizeof(cl_uint));
 
+    // tiles = cl::Buffer(context, CL_MEM_READ_WRITE, swatheTiles * sizeof(cl_uint3));
+    ans.addBuffer("tiles", swatheTiles * sizeof(cl_uint3));
+
+    // numTiles = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    ans.addBuffer("numTiles", sizeof(cl_uint));
+
+    // cellSlots = cl::Buffer(context, CL_MEM_READ_WRITE, swatheCells * sizeof(cl_uint));
+    ans.addBuffer("cellSlots", swatheCells * sizeof(cl_uint));
+
     // viHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, maxDepth * sizeof(cl_uint2));
     ans.addBuffer("viHistogram", maxDepth * sizeof(cl_uint2));
 
     // viCount = cl::Buffer(context, CL_MEM_READ_WRITE, swatheCells * sizeof(cl_uint2));
     ans.addBuffer("viCount", swatheCells * sizeof(cl_uint2));
 
+    // firstExternal = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    ans.addBuffer("firstExternal", sizeof(cl_uint));
+
+    if (includeScratch)
+        ans += scratchResourceUsage(maxWidth, maxHeight, maxDepth, meshMemory, hashWeld);
+
+    {
+        const std::tr1::uint64_t meshCells = meshMemory / MAX_CELL_BYTES;
+        const std::tr1::uint64_t vertexSpace = meshCells * MAX_CELL_VERTICES;
+        ans += ScanCL::resourceUsage(vertexSpace + 1, 1);
+        ans += ScanCL::resourceUsage(std::max(swatheCells, vertexSpace + 1), 2);
+    }
+    // TODO: temporaries for the sorter
+
+    return ans;
+}
+
+CLH::ResourceUsage Marching::scratchResourceUsage(
+    Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
+    std::size_t meshMemory,
+    bool hashWeld)
+{
+    const std::tr1::uint64_t meshCells = meshMemory / MAX_CELL_BYTES;
+    const std::tr1::uint64_t vertexSpace = meshCells * MAX_CELL_VERTICES;
+    const std::tr1::uint64_t indexSpace = meshCells * MAX_CELL_INDICES;
+    const std::size_t keySize = localKeySize(localKeyAxisBits(maxWidth, maxHeight, maxDepth));
+
+    CLH::ResourceUsage ans;
+    // Keep this in sync with makeScratch
+
     // vertexUnique = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_uint));
     ans.addBuffer("vertexUnique", (vertexSpace + 1) * sizeof(cl_uint));
 
@@ -307,9 +564,9 @@ CLH::ResourceUsage Marching::resourceUsage(
     ans.addBuffer("indexRemap", vertexSpace * sizeof(cl_uint));
 
     // unweldedVertices = cl::Buffer(context, CL_MEM_READ_WRITE, vertexSpace * sizeof(cl_float4));
-    // unweldedVertexKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_ulong));
+    // unweldedVertexKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * keySize);
     ans.addBuffer("unweldedVertices", vertexSpace * sizeof(cl_float4));
-    ans.addBuffer("unweldedVertexKeys", (vertexSpace + 1) * sizeof(cl_ulong));
+    ans.addBuffer("unweldedVertexKeys", (vertexSpace + 1) * keySize);
 
     // weldedVertices = cl::Buffer(context, CL_MEM_WRITE_ONLY, vertexSpace * sizeof(cl_float4));
     // weldedVertexKeys = cl::Buffer(context, CL_MEM_WRITE_ONLY, vertexSpace * sizeof(cl_ulong));
@@ -319,16 +576,13 @@ CLH::ResourceUsage Marching::resourceUsage(
     // indices = cl::Buffer(context, CL_MEM_READ_WRITE, indexSpace * sizeof(cl_uint));
     ans.addBuffer("indices", indexSpace * sizeof(cl_uint));
 
-    // firstExternal = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
-    ans.addBuffer("firstExternal", sizeof(cl_uint));
-
-    // Lookup tables
-    ans.addBuffer("table.count", COUNT_TABLE_BYTES);
-    ans.addBuffer("table.start", START_TABLE_BYTES);
-    ans.addBuffer("table.data", DATA_TABLE_BYTES);
-    ans.addBuffer("table.key", KEY_TABLE_BYTES);
-    // TODO: temporaries for the sorter and scanners
-
+    if (hashWeld)
+    {
+        // hashTable = cl::Buffer(context, CL_MEM_READ_WRITE, (std::size_t(1) << hashTableBits(vertexSpace)) * sizeof(cl_uint));
+        // hashVertexIds = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_uint2));
+        ans.addBuffer("hashTable", (std::tr1::uint64_t(1) << hashTableBits(vertexSpace)) * sizeof(cl_uint));
+        ans.addBuffer("hashVertexIds", (vertexSpace + 1) * sizeof(cl_uint2));
+    }
     return ans;
 }
 
@@ -336,23 +590,49 @@ Marching::Marching(const cl::Context &context, const cl::Device &device,
                    Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
                    Grid::size_type maxSwathe,
                    std::size_t meshMemory,
-                   const Grid::size_type alignment[3])
+                   const Grid::size_type alignment[3],
+                   cl_channel_type distanceType,
+                   bool hashWeld,
+                   bool allocateScratch,
+                   DistanceStorage storage)
 :
     maxWidth(maxWidth), maxHeight(maxHeight), maxDepth(maxDepth),
+    hashWeld(hashWeld),
+    tiledOccupancy(false),
+    carrySlices(false),
+    marchingCubes(false),
+    ownedEdges(false),
+    carryValid(false),
+    carryShift(0),
+    keyAxisBits(localKeyAxisBits(maxWidth, maxHeight, maxDepth)),
+    storage(storage),
+    distanceBytes(distanceType == CL_HALF_FLOAT ? sizeof(cl_half) : sizeof(cl_float)),
+    device(device),
     genOccupiedKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.genOccupied.time")),
+    genTilesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.genTiles.time")),
+    genOccupiedTilesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.genOccupiedTiles.time")),
     generateElementsKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.generateElements.time")),
     countUniqueVerticesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.countUniqueVertices.time")),
     compactVerticesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.compactVertices.time")),
     reindexKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.reindex.time")),
+    hashClearKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.hashClear.time")),
+    hashInsertKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.hashInsert.time")),
+    hashMarkKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.hashMark.time")),
+    hashCompactVerticesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.hashCompactVertices.time")),
     copySliceTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.copySlice.time")),
     zeroTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.zero.time")),
     readbackTime(Statistics::getStatistic<Statistics::Variable>("kernel.marching.readback.time")),
     overflowStat(Statistics::getStatistic<Statistics::Counter>("marching.overflow")),
     nonemptyStat(Statistics::getStatistic<Statistics::Variable>("marching.slices.nonempty")),
+    activeStat(Statistics::getStatistic<Statistics::Variable>("marching.slices.active")),
+    tilesStat(Statistics::getStatistic<Statistics::Variable>("marching.tiles.occupied")),
+    carriedStat(Statistics::getStatistic<Statistics::Counter>("marching.slices.carried")),
     shipoutsStat(Statistics::getStatistic<Statistics::Variable>("marching.shipouts")),
-    scanUint(context, device, clogs::TYPE_UINT),
-    scanElements(context, device, clogs::Type(clogs::TYPE_UINT, 2)),
-    sortVertices(context, device, clogs::TYPE_ULONG, clogs::Type(clogs::TYPE_FLOAT, 4)),
+    scanUint(context, device, 1),
+    scanElements(context, device, 2),
+    sortVertices(context, device,
+                 localKeySize(keyAxisBits) == sizeof(cl_uint) ? clogs::TYPE_UINT : clogs::TYPE_ULONG,
+                 clogs::Type(clogs::TYPE_FLOAT, 4)),
     readback("mem.Marching.readback", context, device),
     viReadback("mem.Marching.viReadback", context, device, maxDepth)
 {
@@ -361,6 +641,7 @@ Marching::Marching(const cl::Context &context, const cl::Device &device,
     MLSGPU_ASSERT(2 <= maxDepth && maxDepth <= MAX_DIMENSION, std::invalid_argument);
     MLSGPU_ASSERT(alignment[2] <= maxSwathe, std::invalid_argument);
     MLSGPU_ASSERT(meshMemory >= (maxWidth - 1) * (maxHeight - 1) * MAX_CELL_BYTES, std::invalid_argument);
+    MLSGPU_ASSERT(distanceTypeSupported(context, distanceType, storage), std::invalid_argument);
 
     Grid::size_type imageWidth = roundUp(maxWidth, alignment[0]);
     Grid::size_type imageHeight = roundUp(maxHeight, alignment[1]);
@@ -376,13 +657,23 @@ Marching::Marching(const cl::Context &context, const cl::Device &device,
         &Statistics::timeEventCallback,
         &Statistics::getStatistic<Statistics::Variable>("kernel.marching.sortVertices.time"));
 
-    makeTables(context);
-    image = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT),
-                        imageWidth, imageHeight * (maxSwathe + 1));
+    if (storage == DISTANCE_BUFFER)
+    {
+        distanceBuffer = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                    std::size_t(imageWidth) * imageHeight * (maxSwathe + 1) * distanceBytes);
+        rowPitch = imageWidth;
+    }
+    else
+    {
+        image = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, distanceType),
+                            imageWidth, imageHeight * (maxSwathe + 1));
+        rowPitch = 0;
+    }
     zStride = imageHeight;
 
     const std::size_t sliceCells = (maxWidth - 1) * (maxHeight - 1);
     const std::size_t swatheCells = sliceCells * maxSwathe;
+    const std::size_t swatheTiles = sliceTiles(maxWidth, maxHeight) * maxSwathe;
     const std::size_t meshCells = meshMemory / MAX_CELL_BYTES;
     vertexSpace = meshCells * MAX_CELL_VERTICES;
     indexSpace = meshCells * MAX_CELL_INDICES;
@@ -390,44 +681,132 @@ Marching::Marching(const cl::Context &context, const cl::Device &device,
     // If these are updated, also update deviceMemory
     cells = cl::Buffer(context, CL_MEM_READ_WRITE, swatheCells * sizeof(cl_uint3));
     numOccupied = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    tiles = cl::Buffer(context, CL_MEM_READ_WRITE, swatheTiles * sizeof(cl_uint3));
+    numTiles = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    cellSlots = cl::Buffer(context, CL_MEM_READ_WRITE, swatheCells * sizeof(cl_uint));
     viHistogram = cl::Buffer(context, CL_MEM_READ_WRITE, maxDepth * sizeof(cl_uint2));
     viCount = cl::Buffer(context, CL_MEM_READ_WRITE, swatheCells * sizeof(cl_uint2));
-    vertexUnique = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_uint));
-    indexRemap = cl::Buffer(context, CL_MEM_READ_WRITE, vertexSpace * sizeof(cl_uint));
-    unweldedVertices = cl::Buffer(context, CL_MEM_READ_WRITE, vertexSpace * sizeof(cl_float4));
-    unweldedVertexKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_ulong));
-    // weldedVertices holds packed float3s, but because it's also used as the
-    // temporary buffer for sorting it needs to be able to hold float4s.
-    weldedVertices = cl::Buffer(context, CL_MEM_WRITE_ONLY, vertexSpace * sizeof(cl_float4));
-    weldedVertexKeys = cl::Buffer(context, CL_MEM_WRITE_ONLY, vertexSpace * sizeof(cl_ulong));
-    indices = cl::Buffer(context, CL_MEM_READ_WRITE, indexSpace * sizeof(cl_uint));
     firstExternal = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
-    sortVertices.setTemporaryBuffers(weldedVertices, weldedVertexKeys);
+    scanUint.reserve(vertexSpace + 1);
+    scanElements.reserve(std::max(swatheCells, vertexSpace + 1));
 
-    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device), "kernels/marching.cl");
+    const cl_float4 identity = {{ 0.0f, 0.0f, 0.0f, 1.0f }};
+    scaleBias = identity;
+    buildKernels(context);
+
+    if (allocateScratch)
+        setScratch(makeScratch(context));
+}
+
+void Marching::buildKernels(const cl::Context &context)
+{
+    std::map<std::string, std::string> defines;
+    defines["LOCAL_KEY_AXIS_BITS"] = boost::lexical_cast<std::string>(keyAxisBits);
+    defines["DISTANCE_BUFFER"] = storage == DISTANCE_BUFFER ? "1" : "0";
+    defines["DISTANCE_HALF"] = distanceBytes == sizeof(cl_half) ? "1" : "0";
+    if (CLH::getSpecializeKernels())
+    {
+        // These are fixed for the lifetime of the object
+        defines["SPEC_Z_STRIDE"] = boost::lexical_cast<std::string>(zStride) + "U";
+        defines["SPEC_ROW_PITCH"] = boost::lexical_cast<std::string>(rowPitch) + "U";
+    }
+    defines["OWNED_EDGES"] = ownedEdges ? "1" : "0";
+    addTableDefines(defines, marchingCubes);
+    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device), "kernels/marching.cl", defines);
     genOccupiedKernel = cl::Kernel(program, "genOccupied");
+    genTilesKernel = cl::Kernel(program, "genTiles");
+    genOccupiedTilesKernel = cl::Kernel(program, "genOccupiedTiles");
     generateElementsKernel = cl::Kernel(program, "generateElements");
     countUniqueVerticesKernel = cl::Kernel(program, "countUniqueVertices");
     compactVerticesKernel = cl::Kernel(program, "compactVertices");
     reindexKernel = cl::Kernel(program, "reindex");
-    copySliceKernel = cl::Kernel(program, "copySlice");
+    if (storage == DISTANCE_IMAGE)
+        copySliceKernel = cl::Kernel(program, "copySlice");
+    if (hashWeld)
+    {
+        hashClearKernel = cl::Kernel(program, "hashClear");
+        hashInsertKernel = cl::Kernel(program, "hashInsert");
+        hashMarkKernel = cl::Kernel(program, "hashMark");
+        hashCompactVerticesKernel = cl::Kernel(program, "hashCompactVertices");
+    }
 
-    // Set up kernel arguments that never change.
+    // Set up kernel arguments that are not set per call.
     genOccupiedKernel.setArg(0, cells);
     genOccupiedKernel.setArg(1, viCount);
     genOccupiedKernel.setArg(2, numOccupied);
     genOccupiedKernel.setArg(3, viHistogram);
-    genOccupiedKernel.setArg(7, countTable);
+    genOccupiedKernel.setArg(7, cl_uint(rowPitch));
+    genOccupiedKernel.setArg(8, cellSlots);
+
+    genTilesKernel.setArg(0, tiles);
+    genTilesKernel.setArg(1, numTiles);
+    genTilesKernel.setArg(6, cl_uint(rowPitch));
+
+    genOccupiedTilesKernel.setArg(0, cells);
+    genOccupiedTilesKernel.setArg(1, viCount);
+    genOccupiedTilesKernel.setArg(2, numOccupied);
+    genOccupiedTilesKernel.setArg(3, viHistogram);
+    genOccupiedTilesKernel.setArg(7, tiles);
+    genOccupiedTilesKernel.setArg(9, cl_uint(rowPitch));
+    genOccupiedTilesKernel.setArg(10, cellSlots);
 
+    generateElementsKernel.setArg(3, viCount);
+    generateElementsKernel.setArg(4, cells);
+    generateElementsKernel.setArg(5, distances());
+    generateElementsKernel.setArg(11, cl_uint(rowPitch));
+    generateElementsKernel.setArg(12, cellSlots);
+
+    compactVerticesKernel.setArg(3, firstExternal);
+
+    if (indices())
+        setScratchArgs();
+    setScaleBias(scaleBias);
+}
+
+Marching::Scratch Marching::makeScratch(const cl::Context &context) const
+{
+    // If these are updated, also update scratchResourceUsage
+    Scratch scratch;
+    scratch.vertexUnique = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_uint));
+    scratch.indexRemap = cl::Buffer(context, CL_MEM_READ_WRITE, vertexSpace * sizeof(cl_uint));
+    scratch.unweldedVertices = cl::Buffer(context, CL_MEM_READ_WRITE, vertexSpace * sizeof(cl_float4));
+    scratch.unweldedVertexKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * localKeySize(keyAxisBits));
+    // weldedVertices holds packed float3s, but because it's also used as the
+    // temporary buffer for sorting it needs to be able to hold float4s.
+    scratch.weldedVertices = cl::Buffer(context, CL_MEM_WRITE_ONLY, vertexSpace * sizeof(cl_float4));
+    scratch.weldedVertexKeys = cl::Buffer(context, CL_MEM_WRITE_ONLY, vertexSpace * sizeof(cl_ulong));
+    scratch.indices = cl::Buffer(context, CL_MEM_READ_WRITE, indexSpace * sizeof(cl_uint));
+    if (hashWeld)
+    {
+        scratch.hashTable = cl::Buffer(context, CL_MEM_READ_WRITE, (std::size_t(1) << hashTableBits(vertexSpace)) * sizeof(cl_uint));
+        scratch.hashVertexIds = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexSpace + 1) * sizeof(cl_uint2));
+    }
+    return scratch;
+}
+
+void Marching::setScratch(const Scratch &scratch)
+{
+    if (scratch.indices() == indices())
+        return;
+
+    unweldedVertices = scratch.unweldedVertices;
+    unweldedVertexKeys = scratch.unweldedVertexKeys;
+    weldedVertices = scratch.weldedVertices;
+    weldedVertexKeys = scratch.weldedVertexKeys;
+    indices = scratch.indices;
+    vertexUnique = scratch.vertexUnique;
+    indexRemap = scratch.indexRemap;
+    hashTable = scratch.hashTable;
+    hashVertexIds = scratch.hashVertexIds;
+    sortVertices.setTemporaryBuffers(weldedVertices, weldedVertexKeys);
+    setScratchArgs();
+}
+
+void Marching::setScratchArgs()
+{
     generateElementsKernel.setArg(0, unweldedVertices);
     generateElementsKernel.setArg(1, unweldedVertexKeys);
     generateElementsKernel.setArg(2, indices);
-    generateElementsKernel.setArg(3, viCount);
-    generateElementsKernel.setArg(4, cells);
-    generateElementsKernel.setArg(5, image);
-    generateElementsKernel.setArg(6, startTable);
-    generateElementsKernel.setArg(7, dataTable);
-    generateElementsKernel.setArg(8, keyTable);
 
     countUniqueVerticesKernel.setArg(0, vertexUnique);
     countUniqueVerticesKernel.setArg(1, unweldedVertexKeys);
@@ -435,13 +814,36 @@ Marching::Marching(const cl::Context &context, const cl::Device &device,
     compactVerticesKernel.setArg(0, weldedVertices);
     compactVerticesKernel.setArg(1, weldedVertexKeys);
     compactVerticesKernel.setArg(2, indexRemap);
-    compactVerticesKernel.setArg(3, firstExternal);
     compactVerticesKernel.setArg(4, vertexUnique);
     compactVerticesKernel.setArg(5, unweldedVertices);
     compactVerticesKernel.setArg(6, unweldedVertexKeys);
 
     reindexKernel.setArg(0, indices);
     reindexKernel.setArg(1, indexRemap);
+
+    if (hashWeld)
+    {
+        // vertexUnique holds the hash table slot of each vertex
+        hashClearKernel.setArg(0, hashTable);
+
+        hashInsertKernel.setArg(0, vertexUnique);
+        hashInsertKernel.setArg(1, hashTable);
+        hashInsertKernel.setArg(2, unweldedVertexKeys);
+
+        hashMarkKernel.setArg(0, hashVertexIds);
+        hashMarkKernel.setArg(1, vertexUnique);
+        hashMarkKernel.setArg(2, hashTable);
+        hashMarkKernel.setArg(3, unweldedVertexKeys);
+
+        hashCompactVerticesKernel.setArg(0, weldedVertices);
+        hashCompactVerticesKernel.setArg(1, weldedVertexKeys);
+        hashCompactVerticesKernel.setArg(2, indexRemap);
+        hashCompactVerticesKernel.setArg(3, hashVertexIds);
+        hashCompactVerticesKernel.setArg(4, vertexUnique);
+        hashCompactVerticesKernel.setArg(5, hashTable);
+        hashCompactVerticesKernel.setArg(6, unweldedVertices);
+        hashCompactVerticesKernel.setArg(7, unweldedVertexKeys);
+    }
 }
 
 void Marching::copySlice(
@@ -497,6 +899,47 @@ void Marching::copySlice(
     }
 }
 
+void Marching::copySlice(
+    const cl::CommandQueue &queue,
+    const cl::Buffer &buffer,
+    std::size_t elementBytes,
+    Grid::size_type src,
+    Grid::size_type trg,
+    const ImageParams &params,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    const std::size_t sliceBytes = std::size_t(params.rowPitch) * params.height * elementBytes;
+    const std::size_t stride = std::size_t(params.rowPitch) * params.zStride * elementBytes;
+    cl::Event last;
+    queue.enqueueCopyBuffer(buffer, buffer, src * stride, trg * stride, sliceBytes, events, &last);
+    Statistics::timeEvent(last, copySliceTime);
+    if (event != NULL)
+        *event = last;
+}
+
+void Marching::copyDistanceSlice(
+    const cl::CommandQueue &queue,
+    Grid::size_type src,
+    Grid::size_type trg,
+    const ImageParams &params,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    if (storage == DISTANCE_BUFFER)
+        copySlice(queue, distanceBuffer, distanceBytes, src, trg, params, events, event);
+    else
+        copySlice(queue, image, src, trg, params, events, event);
+}
+
+const cl::Memory &Marching::distances() const
+{
+    if (storage == DISTANCE_BUFFER)
+        return distanceBuffer;
+    else
+        return image;
+}
+
 std::size_t Marching::generateCells(
     const cl::CommandQueue &queue,
     const Swathe &swathe,
@@ -521,19 +964,66 @@ std::size_t Marching::generateCells(
     wait[0] = last;
     wait[1] = last2;
 
-    genOccupiedKernel.setArg(4, image);
-    genOccupiedKernel.setArg(5, swathe.zStride);
-    genOccupiedKernel.setArg(6, swathe.zBias);
-    // TODO: round image size up to multiple of local work group size,
-    // to avoid extra splits; will only work if combined with NaN padding
-    // though, and also requires the generator to respect the padding.
-    CLH::enqueueNDRangeKernelSplit(
-        queue,
-        genOccupiedKernel,
-        cl::NDRange(0, 0, swathe.zFirst),
-        cl::NDRange(swathe.width - 1, swathe.height - 1, swathe.zLast - swathe.zFirst),
-        cl::NDRange(16, 16, 1),
-        &wait, &last, &genOccupiedKernelTime);
+    const cl_uint2 size = {{ cl_uint(swathe.width), cl_uint(swathe.height) }};
+    const cl_uint2 zRange = {{ cl_uint(swathe.zFirst), cl_uint(swathe.zLast) }};
+    if (tiledOccupancy)
+    {
+        const std::size_t tilesX = divUp(swathe.width - 1, OCCUPANCY_TILE);
+        const std::size_t tilesY = divUp(swathe.height - 1, OCCUPANCY_TILE);
+
+        readback->tiles = 0;
+        queue.enqueueWriteBuffer(numTiles, CL_FALSE, 0, sizeof(cl_uint),
+                                 &readback->tiles, events, &last);
+        Statistics::timeEvent(last, zeroTime);
+        wait.push_back(last);
+
+        genTilesKernel.setArg(2, distances());
+        genTilesKernel.setArg(3, swathe.zStride);
+        genTilesKernel.setArg(4, swathe.zBias);
+        genTilesKernel.setArg(5, size);
+        CLH::enqueueNDRangeKernel(
+            queue,
+            genTilesKernel,
+            cl::NDRange(0, 0, swathe.zFirst),
+            cl::NDRange(tilesX, tilesY, swathe.zLast - swathe.zFirst),
+            cl::NullRange,
+            &wait, &last, &genTilesKernelTime);
+        wait.assign(1, last);
+        queue.enqueueReadBuffer(numTiles, CL_TRUE, 0, sizeof(cl_uint), &readback->tiles, &wait);
+        if (swathe.zLast > swathe.zFirst)
+            tilesStat.add(double(readback->tiles) / (tilesX * tilesY * (swathe.zLast - swathe.zFirst)));
+
+        genOccupiedTilesKernel.setArg(4, distances());
+        genOccupiedTilesKernel.setArg(5, swathe.zStride);
+        genOccupiedTilesKernel.setArg(6, swathe.zBias);
+        genOccupiedTilesKernel.setArg(8, size);
+        genOccupiedTilesKernel.setArg(11, zRange);
+        CLH::enqueueNDRangeKernel(
+            queue,
+            genOccupiedTilesKernel,
+            cl::NullRange,
+            cl::NDRange(readback->tiles * OCCUPANCY_TILE, OCCUPANCY_TILE),
+            cl::NDRange(OCCUPANCY_TILE, OCCUPANCY_TILE),
+            &wait, &last, &genOccupiedTilesKernelTime);
+    }
+    else
+    {
+        genOccupiedKernel.setArg(4, distances());
+        genOccupiedKernel.setArg(5, swathe.zStride);
+        genOccupiedKernel.setArg(6, swathe.zBias);
+        genOccupiedKernel.setArg(9, size);
+        genOccupiedKernel.setArg(10, zRange);
+        // TODO: round image size up to multiple of local work group size,
+        // to avoid extra splits; will only work if combined with NaN padding
+        // though, and also requires the generator to respect the padding.
+        CLH::enqueueNDRangeKernelSplit(
+            queue,
+            genOccupiedKernel,
+            cl::NDRange(0, 0, swathe.zFirst),
+            cl::NDRange(swathe.width - 1, swathe.height - 1, swathe.zLast - swathe.zFirst),
+            cl::NDRange(16, 16, 1),
+            &wait, &last, &genOccupiedKernelTime);
+    }
 
     wait.resize(1);
     wait[0] = last;
@@ -550,63 +1040,159 @@ std::size_t Marching::generateCells(
     return readback->compacted;
 }
 
-void Marching::shipOut(const cl::CommandQueue &queue,
-                       const cl_uint3 &keyOffset,
-                       const cl_uint2 &sizes,
-                       cl_uint zMax,
-                       const OutputFunctor &output,
-                       const std::vector<cl::Event> *events,
-                       cl::Event *event)
+void Marching::sortWeldVertices(
+    const cl::CommandQueue &queue,
+    cl_uint numVertices,
+    cl_ulong minExternalKey,
+    cl_ulong keyOffset,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
 {
     std::vector<cl::Event> wait(1);
     cl::Event last;
 
-    // Write a sentinel key after the real vertex keys
+    // Write a sentinel key after the real vertex keys. All bits are set, so
+    // it does not matter whether the key is 32 or 64 bits.
+    const std::size_t keySize = localKeySize(keyAxisBits);
     cl_ulong key = CL_ULONG_MAX;
-    queue.enqueueWriteBuffer(unweldedVertexKeys, CL_FALSE, sizes.s[0] * sizeof(cl_ulong), sizeof(cl_ulong), &key,
+    queue.enqueueWriteBuffer(unweldedVertexKeys, CL_FALSE, numVertices * keySize, keySize, &key,
                              events, &last);
     wait[0] = last;
 
-    // TODO: figure out how many actual bits there are
     // TODO: revisit the dependency tracking
-    sortVertices.enqueue(queue, unweldedVertexKeys, unweldedVertices, sizes.s[0], 0, &wait, &last);
+    sortVertices.enqueue(queue, unweldedVertexKeys, unweldedVertices, numVertices, 3 * keyAxisBits + 1, &wait, &last);
     wait[0] = last;
 
     CLH::enqueueNDRangeKernel(queue,
                               countUniqueVerticesKernel,
                               cl::NullRange,
-                              cl::NDRange(sizes.s[0]),
+                              cl::NDRange(numVertices),
                               cl::NullRange,
                               &wait, &last, &countUniqueVerticesKernelTime);
     wait[0] = last;
 
-    scanUint.enqueue(queue, vertexUnique, sizes.s[0] + 1, NULL, &wait, &last);
+    scanUint.enqueue(queue, vertexUnique, numVertices + 1, NULL, &wait, &last);
     wait[0] = last;
 
     // Start this readback - but we don't immediately need the result.
-    queue.enqueueReadBuffer(vertexUnique, CL_FALSE, sizes.s[0] * sizeof(cl_uint), sizeof(cl_uint),
+    queue.enqueueReadBuffer(vertexUnique, CL_FALSE, numVertices * sizeof(cl_uint), sizeof(cl_uint),
                             &readback->numWelded, &wait, NULL);
 
     // TODO: should we be sorting key/value pairs? The values are going to end up moving
     // twice, and most of them will be eliminated entirely! However, sorting them does
     // give later passes better spatial locality and fewer indirections.
-    cl_ulong minExternalKey = cl_ulong(zMax) << (2 * KEY_AXIS_BITS + 1);
-    cl_ulong keyOffsetL =
-        (cl_ulong(keyOffset.s[2]) << (2 * KEY_AXIS_BITS + 1))
-        | (cl_ulong(keyOffset.s[1]) << (KEY_AXIS_BITS + 1))
-        | (cl_ulong(keyOffset.s[0]) << 1);
     compactVerticesKernel.setArg(7, minExternalKey);
-    compactVerticesKernel.setArg(8, keyOffsetL);
+    compactVerticesKernel.setArg(8, keyOffset);
+    compactVerticesKernel.setArg(9, cl_uint(keyShift));
     CLH::enqueueNDRangeKernel(queue,
                               compactVerticesKernel,
                               cl::NullRange,
-                              cl::NDRange(sizes.s[0]),
+                              cl::NDRange(numVertices),
                               cl::NullRange,
                               &wait, &last, &compactVerticesKernelTime);
     wait[0] = last;
 
     queue.enqueueReadBuffer(firstExternal, CL_FALSE, 0, sizeof(cl_uint),
                             &readback->firstExternal, &wait, NULL);
+    if (event != NULL)
+        *event = last;
+}
+
+void Marching::hashWeldVertices(
+    const cl::CommandQueue &queue,
+    cl_uint numVertices,
+    cl_ulong minExternalKey,
+    cl_ulong keyOffset,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    std::vector<cl::Event> wait(1);
+    cl::Event last;
+
+    const unsigned int hashBits = hashTableBits(numVertices);
+    CLH::enqueueNDRangeKernel(queue,
+                              hashClearKernel,
+                              cl::NullRange,
+                              cl::NDRange(std::size_t(1) << hashBits),
+                              cl::NullRange,
+                              events, &last, &hashClearKernelTime);
+    wait[0] = last;
+
+    hashInsertKernel.setArg(3, cl_uint(hashBits));
+    CLH::enqueueNDRangeKernel(queue,
+                              hashInsertKernel,
+                              cl::NullRange,
+                              cl::NDRange(numVertices),
+                              cl::NullRange,
+                              &wait, &last, &hashInsertKernelTime);
+    wait[0] = last;
+
+    hashMarkKernel.setArg(4, numVertices);
+    hashMarkKernel.setArg(5, minExternalKey);
+    CLH::enqueueNDRangeKernel(queue,
+                              hashMarkKernel,
+                              cl::NullRange,
+                              cl::NDRange(numVertices + 1),
+                              cl::NullRange,
+                              &wait, &last, &hashMarkKernelTime);
+    wait[0] = last;
+
+    scanElements.enqueue(queue, hashVertexIds, numVertices + 1, NULL, &wait, &last);
+    wait[0] = last;
+
+    // Start this readback - but we don't immediately need the result.
+    queue.enqueueReadBuffer(hashVertexIds, CL_FALSE, numVertices * sizeof(cl_uint2), sizeof(cl_uint2),
+                            &readback->hashCounts, &wait, NULL);
+
+    hashCompactVerticesKernel.setArg(8, numVertices);
+    hashCompactVerticesKernel.setArg(9, minExternalKey);
+    hashCompactVerticesKernel.setArg(10, keyOffset);
+    hashCompactVerticesKernel.setArg(11, cl_uint(keyShift));
+    CLH::enqueueNDRangeKernel(queue,
+                              hashCompactVerticesKernel,
+                              cl::NullRange,
+                              cl::NDRange(numVertices),
+                              cl::NullRange,
+                              &wait, &last, &hashCompactVerticesKernelTime);
+    if (event != NULL)
+        *event = last;
+}
+
+cl_ulong Marching::addKeys(cl_ulong a, cl_ulong b)
+{
+    const cl_ulong fieldTop = (cl_ulong(1) << (KEY_AXIS_BITS - 1))
+        * (1 + (cl_ulong(1) << KEY_AXIS_BITS) + (cl_ulong(1) << (2 * KEY_AXIS_BITS)));
+    return ((a & ~fieldTop) + (b & ~fieldTop)) ^ ((a ^ b) & fieldTop);
+}
+
+cl_ulong Marching::packKeyOffset(const cl_uint3 &keyOffset, unsigned int keyShift)
+{
+    const cl_ulong axisMask = (cl_ulong(1) << KEY_AXIS_BITS) - 1;
+    cl_ulong ans = 0;
+    for (unsigned int i = 0; i < 3; i++)
+        ans |= ((cl_ulong(keyOffset.s[i]) << (keyShift + 1)) & axisMask) << (i * KEY_AXIS_BITS);
+    return ans;
+}
+
+void Marching::shipOut(const cl::CommandQueue &queue,
+                       const cl_uint3 &keyOffset,
+                       const cl_uint2 &sizes,
+                       cl_uint zMax,
+                       const OutputFunctor &output,
+                       const std::vector<cl::Event> *events,
+                       cl::Event *event)
+{
+    std::vector<cl::Event> wait(1);
+    cl::Event last;
+
+    cl_ulong minExternalKey = cl_ulong(zMax) << (2 * keyAxisBits + 1);
+    cl_ulong keyOffsetL = packKeyOffset(keyOffset, keyShift);
+
+    if (hashWeld)
+        hashWeldVertices(queue, sizes.s[0], minExternalKey, keyOffsetL, events, &last);
+    else
+        sortWeldVertices(queue, sizes.s[0], minExternalKey, keyOffsetL, events, &last);
+    wait[0] = last;
 
     CLH::enqueueNDRangeKernel(queue,
                               reindexKernel,
@@ -616,12 +1202,23 @@ void Marching::shipOut(const cl::CommandQueue &queue,
                               &wait, &last, &reindexKernelTime);
     queue.finish(); // wait for readback of numWelded and firstExternal (TODO: overkill)
 
+    if (hashWeld)
+    {
+        readback->numWelded = readback->hashCounts.s[0] + readback->hashCounts.s[1];
+        readback->firstExternal = readback->hashCounts.s[0];
+    }
+
     DeviceKeyMesh outputMesh; // TODO: store buffers in this instead of copying references
     outputMesh.vertices = weldedVertices;
     outputMesh.vertexKeys = weldedVertexKeys;
     outputMesh.triangles = indices;
     outputMesh.assign(readback->numWelded, sizes.s[1] / 3, readback->firstExternal);
-    output(queue, outputMesh, NULL, event);
+    lastCounts.vertices += readback->numWelded;
+    lastCounts.triangles += sizes.s[1] / 3;
+    outputEvent = cl::Event();
+    output(outputQueue, outputMesh, NULL, &outputEvent);
+    if (event != NULL)
+        *event = outputEvent;
 }
 
 Grid::size_type Marching::addSlices(
@@ -718,11 +1315,18 @@ Grid::size_type Marching::addSlices(
                 top.s[2] = 2 * swathe.zFirst;
             }
 
-            scanElements.enqueue(queue, viCount, compacted, &offsets, &wait, &last);
+            scanElements.enqueue(queue, viCount, compacted, offsets.s, &wait, &last);
             wait.resize(1);
             wait[0] = last;
 
-            generateElementsKernel.setArg(12, top);
+            // The output from an earlier call to generate may still be using the buffers
+            if (outputEvent())
+                wait.push_back(outputEvent);
+            const cl_uint2 size = {{ cl_uint(swathe.width), cl_uint(swathe.height) }};
+            const cl_uint2 zRange = {{ cl_uint(swathe.zFirst), cl_uint(swathe.zLast) }};
+            generateElementsKernel.setArg(9, top);
+            generateElementsKernel.setArg(13, size);
+            generateElementsKernel.setArg(14, zRange);
             CLH::enqueueNDRangeKernelSplit(queue,
                                            generateElementsKernel,
                                            cl::NullRange,
@@ -734,6 +1338,7 @@ Grid::size_type Marching::addSlices(
 
             offsets.s[0] += counts.s[0];
             offsets.s[1] += counts.s[1];
+            lastCounts.occupiedCells += compacted;
         }
     }
     nonemptyStat.add(compacted > 0);
@@ -748,8 +1353,13 @@ void Marching::generate(
     const OutputFunctor &output,
     const Grid::size_type size[3],
     const cl_uint3 &keyOffset,
-    const std::vector<cl::Event> *events)
+    const std::vector<cl::Event> *events,
+    const cl::CommandQueue *outputQueue,
+    unsigned int keyShift)
 {
+    this->outputQueue = outputQueue != NULL ? *outputQueue : queue;
+    this->keyShift = keyShift;
+    lastCounts = Counts();
     std::size_t localSize = queue.getInfo<CL_QUEUE_DEVICE>().getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
     // Work group size for kernels that operate on compacted cells.
     // We make it the largest sane size that will fit into local mem
@@ -761,11 +1371,13 @@ void Marching::generate(
     swathe.width = size[0];
     swathe.height = size[1];
     swathe.zStride = zStride;
+    swathe.rowPitch = rowPitch;
 
     const Grid::size_type depth = size[2];
     MLSGPU_ASSERT(1U <= swathe.width && swathe.width <= maxWidth, std::length_error);
     MLSGPU_ASSERT(1U <= swathe.height && swathe.height <= maxHeight, std::length_error);
     MLSGPU_ASSERT(1U <= depth && depth <= maxDepth, std::length_error);
+    MLSGPU_ASSERT(indices() != NULL, std::logic_error); // see setScratch
 
     std::vector<cl::Event> wait;
     cl::Event last, readEvent;
@@ -775,40 +1387,100 @@ void Marching::generate(
     if (events != NULL)
         wait = *events;
 
-    generateElementsKernel.setArg(9, swathe.zStride);
-    generateElementsKernel.setArg(11, keyOffset);
-    generateElementsKernel.setArg(13, CLH_LOCAL(NUM_EDGES * wgsCompacted * sizeof(cl_float3)));
+    generateElementsKernel.setArg(6, swathe.zStride);
+    generateElementsKernel.setArg(8, keyOffset);
+    generateElementsKernel.setArg(10, CLH_LOCAL(NUM_EDGES * wgsCompacted * sizeof(cl_float3)));
+
+    /* The first swathe places slice z at image slice z + 1, so a slice
+     * carried over from the previous call survives in image slice 0.
+     */
+    const bool carried = carrySlices && carryValid
+        && carryShift == keyShift
+        && carrySize[0] == size[0] && carrySize[1] == size[1]
+        && carryOffset.s[0] == keyOffset.s[0] && carryOffset.s[1] == keyOffset.s[1]
+        && carryOffset.s[2] + carrySize[2] - 1 == keyOffset.s[2];
+    carryValid = false;
+    if (carried)
+        carriedStat.add(1);
 
     Grid::size_type shipOuts = 0;
+    cl_uint prevSigns = 3; // signs of the slice copied from the previous swathe
     for (Grid::size_type z = 0; z < depth; z += maxSwathe)
     {
         swathe.zFirst = z;
         swathe.zLast = std::min(depth, z + maxSwathe) - 1;
         swathe.zBias = (1 - cl_int(z)) * cl_int(swathe.zStride);
-        generateElementsKernel.setArg(10, swathe.zBias);
+        generateElementsKernel.setArg(7, swathe.zBias);
 
         if (z != 0)
         {
             // Copy end of previous range to start of current one
-            copySlice(queue, image, maxSwathe, 0, swathe, &wait, &last);
+            copyDistanceSlice(queue, maxSwathe, 0, swathe, &wait, &last);
             wait.resize(1);
             wait[0] = last;
         }
-        generator.enqueue(queue, image, swathe, &wait, &last);
+        generator.enqueue(queue, distances(), swathe, &wait, &last);
         wait.resize(1);
         wait[0] = last;
 
+        if (z == 0 && carried)
+        {
+            copyDistanceSlice(queue, 0, 1, swathe, &wait, &last);
+            wait.resize(1);
+            wait[0] = last;
+        }
+
         if (z > 0)
             swathe.zFirst--; // Use the copied previous slice as well
 
-        shipOuts += addSlices(
-            queue, output,
-            swathe, keyOffset,
-            wgsCompacted,
-            offsets, zTop,
-            &wait, &last);
-        wait.resize(1);
-        wait[0] = last;
+        /* A cell layer can only contain the surface if its two slices have
+         * both signs between them. Restrict the swathe to the range of such
+         * layers, in the same way that addSlices subdivides it.
+         */
+        Swathe active = swathe;
+        const cl_uint *signs = generator.sliceSigns();
+        if (signs != NULL)
+        {
+            last.wait();
+            Grid::size_type first = swathe.zLast;
+            Grid::size_type end = swathe.zFirst;
+            // The carried slice may differ slightly from the one that was flagged
+            cl_uint below = z > 0 ? prevSigns : (carried ? 3 : signs[0]);
+            for (Grid::size_type l = swathe.zFirst; l < swathe.zLast; l++)
+            {
+                const cl_uint above = signs[l + 1 - z];
+                if ((below | above) == 3)
+                {
+                    first = std::min(first, l);
+                    end = l + 1;
+                }
+                below = above;
+            }
+            prevSigns = signs[swathe.zLast - z];
+            if (first < end)
+            {
+                active.zFirst = first;
+                active.zLast = end;
+            }
+            else
+                active.zLast = active.zFirst;
+            if (swathe.zLast > swathe.zFirst)
+                activeStat.add(double(active.zLast - active.zFirst) / (swathe.zLast - swathe.zFirst));
+        }
+        else
+            prevSigns = 3;
+
+        if (active.zFirst < active.zLast)
+        {
+            shipOuts += addSlices(
+                queue, output,
+                active, keyOffset,
+                wgsCompacted,
+                offsets, zTop,
+                &wait, &last);
+            wait.resize(1);
+            wait[0] = last;
+        }
     }
 
     if (offsets.s[0] > 0)
@@ -820,5 +1492,19 @@ void Marching::generate(
     }
     if (shipOuts > 0)
         shipoutsStat.add(shipOuts);
+
+    if (carrySlices)
+    {
+        // Keep the last slice where the next call will find it
+        const Grid::size_type lastZ = (depth - 1) / maxSwathe * maxSwathe;
+        copyDistanceSlice(queue, depth - lastZ, 0, swathe, &wait, &last);
+        wait.resize(1);
+        wait[0] = last;
+        carryValid = true;
+        for (int i = 0; i < 3; i++)
+            carrySize[i] = size[i];
+        carryOffset = keyOffset;
+        carryShift = keyShift;
+    }
     queue.finish(); // will normally be finished already, but there may be corner cases
 }
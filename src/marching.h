@@ -33,18 +33,27 @@
 #include <CL/cl.hpp>
 #include <cstddef>
 #include <vector>
+#include <map>
+#include <string>
 #include <utility>
 #include "tr1_cstdint.h"
 #include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
 #include <clogs/clogs.h>
 #include "grid.h"
 #include "mesh.h"
 #include "clh.h"
+#include "scan_cl.h"
 
 class TestMarching;
+class HostMarching;
 
 /**
- * Marching tetrahedra algorithm implemented in OpenCL.
+ * Marching tetrahedra algorithm implemented in OpenCL, with an optional
+ * marching cubes mode (see @ref setMarchingCubes).
  * An instance of this class contains buffers to hold intermediate state,
  * and is specialized for a specific OpenCL context and device. An instance
  * also currently specialized to the dimensions of the sampling grid, although
@@ -82,6 +91,7 @@ class TestMarching;
 class Marching
 {
     friend class TestMarching;
+    friend class HostMarching;
 public:
     enum
     {
@@ -91,6 +101,16 @@ public:
     {
         MAX_CELL_INDICES = 36  ///< Maximum triangles generated per cell
     };
+
+    /// Sizes of the work done by one call to @ref generate
+    struct Counts
+    {
+        std::tr1::uint64_t occupiedCells;   ///< Cells that produced geometry
+        std::tr1::uint64_t vertices;        ///< Welded vertices passed to the output
+        std::tr1::uint64_t triangles;       ///< Triangles passed to the output
+
+        Counts() : occupiedCells(0), vertices(0), triangles(0) {}
+    };
     enum
     {
         /// Bytes of storage required for all internal data for a worst-case cell
@@ -110,6 +130,14 @@ public:
         NUM_TETRAHEDRA = 6     ///< Number of tetrahedra in each cube
     };
     enum
+    {
+        NUM_FACES = 6          ///< Number of faces of each cube
+    };
+    enum
+    {
+        OCCUPANCY_TILE = 16    ///< Width and height in cells of tiles for @ref setTiledOccupancy
+    };
+    enum
     {
         /// Number of bits in fixed-point xyz fields in a vertex key (including fractional bits)
         KEY_AXIS_BITS = 21
@@ -143,31 +171,46 @@ public:
     enum
     {
         /**
-         * Maximum size that is legal for global coordinates (after biasing
-         * with an offset).
+         * Maximum size of global coordinates (after biasing with an offset)
+         * for which global vertex keys are unique. Each field of a key wraps
+         * around modulo 2<sup>@ref KEY_AXIS_BITS</sup> (see @ref addKeys), so
+         * larger grids are possible provided that the consumer of the keys
+         * can tell which period a key falls in (see @ref OOCMesher).
          */
         MAX_GLOBAL_DIMENSION = (1U << MAX_GLOBAL_DIMENSION_LOG2) - 1
     };
 
     enum
     {
-        /// Total bytes held in @ref countTable.
+        /// Upper bound on bytes held in @ref countTable (reached by marching tetrahedra).
         COUNT_TABLE_BYTES = 256 * sizeof(cl_uchar2)
     };
     enum
     {
-        /// Total bytes held in @ref startTable.
+        /// Upper bound on bytes held in @ref startTable (reached by marching tetrahedra).
         START_TABLE_BYTES = 257 * sizeof(cl_ushort2)
     };
     enum
     {
-        /// Total bytes held in @ref dataTable.
+        /// Upper bound on bytes held in @ref dataTable (reached by marching tetrahedra).
         DATA_TABLE_BYTES = 8192 * sizeof(cl_uchar)
     };
     enum
     {
-        /// Total bytes held in @ref keyTable.
-        KEY_TABLE_BYTES = 2432 * sizeof(cl_uint3)
+        /// Upper bound on bytes held in @ref keyTable, which packs each key into a byte (reached by marching tetrahedra).
+        KEY_TABLE_BYTES = 2432 * sizeof(cl_uchar)
+    };
+
+    /**
+     * Device storage for the signed distance field. Images are read through
+     * the texture path, but on some devices image writes are emulated and
+     * slow, and the image height limits the swathe size. Buffers avoid
+     * both, at the cost of the texture cache.
+     */
+    enum DistanceStorage
+    {
+        DISTANCE_IMAGE,     ///< A 2D image with a single channel
+        DISTANCE_BUFFER     ///< A buffer, row by row with x varying fastest
     };
 
     /**
@@ -177,6 +220,9 @@ public:
      * A point at coordinates (@a x, @a y, @a z) in the volume is stored
      * at location (@a x, @a z * @c zStride + @c zBias). Note that in
      * most cases @a zBias will be negative.
+     *
+     * When the storage is a buffer, location (@a x, @a y') is element
+     * @a y' * @c rowPitch + @a x of the buffer.
      */
     struct ImageParams
     {
@@ -184,6 +230,7 @@ public:
         Grid::size_type height;
         cl_uint zStride;
         cl_int zBias;
+        cl_uint rowPitch;   ///< Elements per row of a buffer (0 for an image)
     };
 
     /**
@@ -225,7 +272,8 @@ public:
          * execution of the CL commands.
          *
          * @param queue                 The command queue to use.
-         * @param distance              Output storage for the signed distance function
+         * @param distance              Output storage for the signed distance function,
+         *                              either an image or a buffer (see @ref DistanceStorage)
          * @param swathe                Swathe of values to produce
          * @param events                Events to wait for (may be @c NULL).
          * @param[out] event            Event signaled on completion (may be @c NULL).
@@ -233,8 +281,9 @@ public:
          * @pre
          * - @a swathe.width and @a swathe.height are positive.
          * - @a swathe.zFirst &lt;= @a swathe.zLast
-         * - The X size of @a distance is at least <code>roundUp</code>(@a swathe.width, #alignment (0)).
-         * - The Y size of @a distance is at least
+         * - The X size of @a distance (or @a swathe.rowPitch for a buffer) is at least
+         *   <code>roundUp</code>(@a swathe.width, #alignment (0)).
+         * - The Y size of @a distance (in rows, for a buffer) is at least
          *   @a swathe.zStride * roundUp(@a zLast + 1, #alignment (2)) + @a zBias
          * - @a swathe.zStride is at least <code>roundUp</code>(@a swathe.height, #alignment (1))
          * - @a swathe.zFirst is a multiple of #alignment (2).
@@ -246,10 +295,25 @@ public:
          */
         virtual void enqueue(
             const cl::CommandQueue &queue,
-            const cl::Image2D &distance,
+            const cl::Memory &distance,
             const Swathe &swathe,
             const std::vector<cl::Event> *events,
             cl::Event *event) = 0;
+
+        /**
+         * Report which signs occur in each slice produced by the most recent
+         * call to @ref enqueue, so that slices that cannot contain the
+         * isosurface are skipped. Element @a i describes slice
+         * <code>swathe.zFirst + i</code>: bit 0 is set if it may contain a
+         * value that is at least zero, and bit 1 if it may contain a negative
+         * value. NaN contributes neither. Setting extra bits is always safe.
+         *
+         * The values need only be valid once the event returned by
+         * @ref enqueue has completed.
+         *
+         * @return The flags, or @c NULL if they are not known (the default).
+         */
+        virtual const cl_uint *sliceSigns() const { return NULL; }
     };
 
 private:
@@ -261,9 +325,11 @@ private:
     struct Readback
     {
         cl_uint compacted;
+        cl_uint tiles;           ///< Tiles found by @ref genTiles
         cl_uint2 elementCounts;
         cl_uint numWelded;
         cl_uint firstExternal;
+        cl_uint2 hashCounts;     ///< Internal and external vertex counts from hash welding
     };
 
     /**
@@ -279,6 +345,12 @@ private:
      */
     static const unsigned char tetrahedronIndices[NUM_TETRAHEDRA][4];
 
+    /**
+     * The vertices of each face of a cube, counter-clockwise when viewed from
+     * outside the cube in a right-handed coordinate system.
+     */
+    static const unsigned char faceIndices[NUM_FACES][4];
+
     /**
      * The maximum number of cell corners (not cells) in the grid, excluding
      * alignment padding.
@@ -295,35 +367,39 @@ private:
      */
     std::size_t vertexSpace, indexSpace;
 
+    /// Whether vertices are welded with a hash table rather than by sorting
+    bool hashWeld;
+
+    /// Whether cells are classified coarse-to-fine (see @ref setTiledOccupancy)
+    bool tiledOccupancy;
+
+    /// Whether the last slice is carried between calls (see @ref setCarrySlices)
+    bool carrySlices;
+
+    /// Whether cells are triangulated as whole cubes (see @ref setMarchingCubes)
+    bool marchingCubes;
+
+    /// Whether each vertex is emitted only by the cell owning its edge (see @ref setOwnedEdges)
+    bool ownedEdges;
+
     /**
-     * Buffer of uchar2 values, indexed by cube code. The two elements are
-     * the number of vertices and indices generated by the cell.
-     */
-    cl::Buffer countTable;
-    /**
-     * Buffer of ushort2 values, indexed by cube code. The two elements are
-     * the positions of the index array and vertex array in @ref dataTable.
-     * It has one extra element at the end so that the element range for
-     * the last cube code can be found.
-     */
-    cl::Buffer startTable;
-    /**
-     * Buffer of uchar values, which are either indices to be emitted
-     * (after biasing), or vertices represented as an edge ID. The range
-     * of vertices or indices for a particular cube code is determined by
-     * two adjacent elements of @ref countTable.
+     * @name
+     * @{
+     * Region of the previous call to @ref generate, whose last slice is
+     * held in slice 0 of @ref image if @ref carryValid is set.
      */
-    cl::Buffer dataTable;
+    bool carryValid;
+    Grid::size_type carrySize[3];
+    cl_uint3 carryOffset;
+    unsigned int carryShift;
+    /** @} */
+
     /**
-     * Buffer of cl_uint3 values, in ranges indexed by startTable. It
-     * contains offsets added to the 3 parts of the cell key to get a vertex
-     * key for each vertex generated in a cell (prior to computing the three
-     * fields into a single ulong). The cell key is simply the vertex
-     * key for the vertex at minimum-x/y/z corner.
-     *
-     * Each value is in .1 fixed-point format.
+     * Bits per axis in the block-local vertex keys used for welding (see
+     * @ref localKeyAxisBits). External vertex keys are widened to
+     * @ref KEY_AXIS_BITS per axis when they are output.
      */
-    cl::Buffer keyTable;
+    unsigned int keyAxisBits;
 
     /**
      * Buffer of uint2 values, indexed by compacted cell ID. Initially they are
@@ -346,6 +422,23 @@ private:
      */
     cl::Buffer numOccupied;
 
+    /**
+     * Buffer of uint3 values, the first cell of each tile that may contain
+     * occupied cells, written by @ref genTiles. Only used if
+     * @ref tiledOccupancy is set.
+     */
+    cl::Buffer tiles;
+
+    /// Buffer containing 1 uint, the number of elements written to @ref tiles.
+    cl::Buffer numTiles;
+
+    /**
+     * Buffer of uint values, the position in @ref cells of each occupied cell
+     * in the swathe, indexed by grid position. Only used if @ref ownedEdges
+     * is set.
+     */
+    cl::Buffer cellSlots;
+
     /**
      * Number of vertices and indices produced for each slice. Each element
      * is a uint2, and is indexed relative to the local volume.
@@ -372,9 +465,11 @@ private:
     cl::Buffer indices;
 
     /**
-     * Sort keys corresponding to @ref unweldedVertices.
+     * Block-local sort keys corresponding to @ref unweldedVertices. These
+     * are 32-bit if @ref keyAxisBits is small enough, otherwise 64-bit
+     * (see @ref localKeySize).
      *
-     * There is an additional sentinel at the end with value @c ULONG_MAX.
+     * There is an additional sentinel at the end with all bits set.
      */
     cl::Buffer unweldedVertexKeys;
 
@@ -404,15 +499,51 @@ private:
     cl::Buffer firstExternal;
 
     /**
-     * The image holding slices of the signed distance function.
+     * Open-addressing hash table mapping vertex keys to the first unwelded
+     * vertex with that key. Only allocated when @ref hashWeld is set, in which
+     * case @ref vertexUnique holds the slot of each unwelded vertex.
+     */
+    cl::Buffer hashTable;
+
+    /**
+     * Scanned counts of internal and external representative vertices
+     * (@c cl_uint2), with one extra element for the totals. Only allocated
+     * when @ref hashWeld is set.
+     */
+    cl::Buffer hashVertexIds;
+
+    /// How the signed distance function is stored
+    DistanceStorage storage;
+
+    /**
+     * The image holding slices of the signed distance function, if
+     * @ref storage is @ref DISTANCE_IMAGE.
      */
     cl::Image2D image;
 
+    /**
+     * The buffer holding slices of the signed distance function, if
+     * @ref storage is @ref DISTANCE_BUFFER.
+     */
+    cl::Buffer distanceBuffer;
+
+    /// Bytes per element of @ref distanceBuffer
+    std::size_t distanceBytes;
+
+    /// Device for which the program is built (see @ref buildKernels)
+    cl::Device device;
+
+    /// Current transformation of the output vertices (see @ref setScaleBias)
+    cl_float4 scaleBias;
+
     /**
      * The number of y steps between slices in the backing image.
      */
     Grid::size_type zStride;
 
+    /// Elements per row of @ref distanceBuffer (0 for an image)
+    Grid::size_type rowPitch;
+
     /**
      * @name
      * @{
@@ -422,11 +553,17 @@ private:
     /** @} */
 
     cl::Kernel genOccupiedKernel;           ///< Kernel compiled from @ref genOccupied.
+    cl::Kernel genTilesKernel;              ///< Kernel compiled from @ref genTiles.
+    cl::Kernel genOccupiedTilesKernel;      ///< Kernel compiled from @ref genOccupiedTiles.
     cl::Kernel generateElementsKernel;      ///< Kernel compiled from @ref generateElements.
     cl::Kernel countUniqueVerticesKernel;   ///< Kernel compiled from @ref countUniqueVertices.
     cl::Kernel compactVerticesKernel;       ///< Kernel compiled from @ref compactVerticesKernel.
     cl::Kernel reindexKernel;               ///< Kernel compiled from @ref reindexKernel.
     cl::Kernel copySliceKernel;             ///< Kernel compiled from @ref copySliceKernel (for driver bug workaround).
+    cl::Kernel hashClearKernel;             ///< Kernel compiled from @ref hashClear.
+    cl::Kernel hashInsertKernel;            ///< Kernel compiled from @ref hashInsert.
+    cl::Kernel hashMarkKernel;              ///< Kernel compiled from @ref hashMark.
+    cl::Kernel hashCompactVerticesKernel;   ///< Kernel compiled from @ref hashCompactVertices.
 
     /**
      * @name
@@ -434,10 +571,16 @@ private:
      * Statistics measuring time spent in kernels with corresponding names.
      */
     Statistics::Variable &genOccupiedKernelTime;
+    Statistics::Variable &genTilesKernelTime;
+    Statistics::Variable &genOccupiedTilesKernelTime;
     Statistics::Variable &generateElementsKernelTime;
     Statistics::Variable &countUniqueVerticesKernelTime;
     Statistics::Variable &compactVerticesKernelTime;
     Statistics::Variable &reindexKernelTime;
+    Statistics::Variable &hashClearKernelTime;
+    Statistics::Variable &hashInsertKernelTime;
+    Statistics::Variable &hashMarkKernelTime;
+    Statistics::Variable &hashCompactVerticesKernelTime;
     Statistics::Variable &copySliceTime;    ///< Time for slice copy, either with kernel or with @c clEnqueueCopyImage
     Statistics::Variable &zeroTime;         ///< Time to zero out buffers
     Statistics::Variable &readbackTime;     ///< Time to read back metadata
@@ -446,10 +589,13 @@ private:
 
     Statistics::Counter &overflowStat;      ///< Number of swathe splits
     Statistics::Variable &nonemptyStat;     ///< Number of @ref addSlices calls that add geometry
+    Statistics::Variable &activeStat;       ///< Fraction of cell layers not skipped using @ref Generator::sliceSigns
+    Statistics::Variable &tilesStat;        ///< Fraction of tiles found by @ref genTiles
+    Statistics::Counter &carriedStat;       ///< Number of @ref generate calls that reuse the previous last slice
     Statistics::Variable &shipoutsStat;     ///< Number of calls to @ref shipOut per bin
 
-    clogs::Scan scanUint;                   ///< Scanner to scan @c cl_uint values.
-    clogs::Scan scanElements;               ///< Scanner to scan @ref viCount.
+    ScanCL scanUint;                        ///< Scanner to scan @c cl_uint values.
+    ScanCL scanElements;                    ///< Scanner to scan @ref viCount and @ref hashVertexIds.
     clogs::Radixsort sortVertices;          ///< Sorts vertices by keys for welding.
 
     /// Pinned memory for doing readbacks
@@ -458,6 +604,22 @@ private:
     /// Pinned memory for reading back @ref viHistogram
     CLH::PinnedMemory<cl_uint2> viReadback;
 
+    /// Queue on which the output functor is called (only valid during @ref generate)
+    cl::CommandQueue outputQueue;
+
+    /// Shift applied to each axis of external keys (only valid during @ref generate)
+    unsigned int keyShift;
+
+    /// Counts for the most recent call to @ref generate (see @ref getLastCounts)
+    Counts lastCounts;
+
+    /**
+     * Event returned by the output functor in the most recent @ref shipOut.
+     * Until it completes, the output may still be reading @ref weldedVertices,
+     * @ref weldedVertexKeys and @ref indices, so they must not be overwritten.
+     */
+    cl::Event outputEvent;
+
     /**
      * Finds the edge incident on vertices v0 and v1.
      *
@@ -480,18 +642,112 @@ private:
     static unsigned int permutationParity(Iterator first, Iterator last);
 
     /**
-     * Populate the static tables describing how to slice up cells.
+     * Append the triangles for one cube code of marching tetrahedra to
+     * @a triangles, as triples of edge numbers.
+     */
+    static void tetrahedraTriangles(unsigned int code, std::vector<cl_uchar> &triangles);
+
+    /**
+     * Append the triangles for one cube code of marching cubes to
+     * @a triangles, as triples of edge numbers.
+     *
+     * The intersection of the surface with each face is found from the
+     * signs at the corners of that face alone. Where two diagonally
+     * opposite corners are outside, they are cut off separately. Since
+     * the cells on either side of a face agree on its segments, the
+     * surface is free of cracks. The segments are chained into loops,
+     * which are triangulated as fans.
+     */
+    static void cubeTriangles(unsigned int code, std::vector<cl_uchar> &triangles);
+
+    /**
+     * Build the program with the tables for the current value of
+     * @ref marchingCubes compiled in, and set up all the kernel arguments
+     * that are not set per call (including those for the current scratch
+     * buffers and scale and bias).
      */
-    void makeTables(const cl::Context &context);
+    void buildKernels(const cl::Context &context);
+
+    /// Set the kernel arguments that refer to the current scratch buffers
+    void setScratchArgs();
 
 public:
+    /**
+     * Host copies of the tables describing how to slice up cells (see
+     * @ref countTable, @ref startTable, @ref dataTable and @ref keyTable in
+     * the kernel source).
+     */
+    struct HostTables
+    {
+        std::vector<cl_uchar2> count;
+        std::vector<cl_ushort2> start;
+        std::vector<cl_uchar> data;
+        std::vector<cl_uint3> keys;
+    };
+
+    /**
+     * Compute the tables describing how to slice up cells in host memory.
+     * They are the tables used by the kernels, and are also used to run
+     * the same algorithm on the host.
+     *
+     * @param[out] tables      The tables.
+     * @param marchingCubes    If true, triangulate whole cubes (see
+     *                         @ref setMarchingCubes) rather than tetrahedra.
+     */
+    static void makeHostTables(HostTables &tables, bool marchingCubes = false);
+
+    /**
+     * Add the defines that compile the tables from @ref makeHostTables into
+     * @c marching.cl as constant arrays. They must be present whenever that
+     * file is built.
+     *
+     * @param[in,out] defines  Program defines to which the tables are added.
+     * @param marchingCubes    As for @ref makeHostTables.
+     */
+    static void addTableDefines(std::map<std::string, std::string> &defines, bool marchingCubes = false);
+
     /**
      * Checks whether a device is suitable for use with this class. At the time
-     * of writing, the only requirement is that images are supported.
+     * of writing, the only requirement is that images are supported if they
+     * are used to store the distances.
      *
      * @throw CLH::invalid_device if the device cannot be used.
      */
-    static void validateDevice(const cl::Device &device);
+    static void validateDevice(const cl::Device &device, DistanceStorage storage = DISTANCE_IMAGE);
+
+    /**
+     * Choose the storage for the distances on a device. Buffers are used on
+     * devices without image support, and on CPUs and accelerators, where
+     * images are typically emulated in software.
+     */
+    static DistanceStorage preferredDistanceStorage(const cl::Device &device);
+
+    /**
+     * The number of bits per axis needed for block-local vertex keys, which
+     * hold coordinates in .1 fixed-point format.
+     */
+    static unsigned int localKeyAxisBits(Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth);
+
+    /**
+     * Size of a block-local vertex key with @a axisBits bits per axis. The
+     * three coordinates and an external flag are packed into a @c cl_uint
+     * if they fit, otherwise a @c cl_ulong.
+     */
+    static std::size_t localKeySize(unsigned int axisBits);
+
+    /**
+     * Number of tiles of @ref OCCUPANCY_TILE x @ref OCCUPANCY_TILE cells
+     * needed to cover a slice with the given number of corners.
+     */
+    static std::size_t sliceTiles(Grid::size_type width, Grid::size_type height);
+
+    /**
+     * Checks whether the signed distances can be stored with a particular
+     * channel type, which must be either @c CL_FLOAT or @c CL_HALF_FLOAT.
+     * Buffers support both, since halves are converted with @c vload_half.
+     */
+    static bool distanceTypeSupported(const cl::Context &context, cl_channel_type distanceType,
+                                      DistanceStorage storage = DISTANCE_IMAGE);
 
     /**
      * Estimates the device memory required for particular values of the
@@ -499,7 +755,7 @@ public:
      * memory allocated in buffers and images, but excludes all overheads for
      * fragmentation, alignment, parameters, programs, command buffers etc.
      *
-     * @param device, maxWidth, maxHeight, maxDepth, maxSwathe, meshMemory, alignment  Parameters that would be passed to the constructor.
+     * @param device, maxWidth, maxHeight, maxDepth, maxSwathe, meshMemory, alignment, distanceType, hashWeld, storage  Parameters that would be passed to the constructor.
      *
      * @return The required resources.
      *
@@ -510,7 +766,106 @@ public:
         Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
         Grid::size_type maxSwathe,
         std::size_t meshMemory,
-        const Grid::size_type alignment[3]);
+        const Grid::size_type alignment[3],
+        cl_channel_type distanceType = CL_FLOAT,
+        bool hashWeld = false,
+        bool includeScratch = true,
+        DistanceStorage storage = DISTANCE_IMAGE);
+
+    /**
+     * Estimates the device memory held by one @ref Scratch set, for the
+     * same constructor arguments. This is the part of @ref resourceUsage
+     * that is excluded when @a includeScratch is false.
+     */
+    static CLH::ResourceUsage scratchResourceUsage(
+        Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
+        std::size_t meshMemory,
+        bool hashWeld = false);
+
+    /**
+     * The buffers whose size is proportional to the mesh memory, holding
+     * the vertices and indices of a mesh between generation and output.
+     * They dominate the memory of an instance, but are only in use during
+     * @ref generate, so several instances on the same device can take turns
+     * with fewer sets than instances (see @ref ScratchPool).
+     */
+    struct Scratch
+    {
+        cl::Buffer unweldedVertices;    ///< See the member of the same name
+        cl::Buffer unweldedVertexKeys;  ///< See the member of the same name
+        cl::Buffer weldedVertices;      ///< See the member of the same name
+        cl::Buffer weldedVertexKeys;    ///< See the member of the same name
+        cl::Buffer indices;             ///< See the member of the same name
+        cl::Buffer vertexUnique;        ///< See the member of the same name
+        cl::Buffer indexRemap;          ///< See the member of the same name
+        cl::Buffer hashTable;           ///< See the member of the same name
+        cl::Buffer hashVertexIds;       ///< See the member of the same name
+    };
+
+    /**
+     * Thread-safe collection of @ref Scratch sets, shared by instances that
+     * were constructed with the same arguments on the same context. A
+     * thread takes a set out by constructing a @ref Lease, which blocks
+     * until one is available, and returns it when it is destroyed.
+     */
+    class ScratchPool : public boost::noncopyable
+    {
+    public:
+        class Lease;
+        friend class Lease;
+
+    private:
+        boost::mutex mutex;
+        boost::condition_variable availableCondition;
+        std::vector<Scratch> available;   ///< Sets not currently leased
+        std::size_t total;                ///< Sets added with @ref add
+
+    public:
+        /// Exclusive use of a set from the pool for the lifetime of the object
+        class Lease : public boost::noncopyable
+        {
+        private:
+            ScratchPool &owner;
+            Scratch scratch;
+
+        public:
+            explicit Lease(ScratchPool &owner) : owner(owner)
+            {
+                boost::unique_lock<boost::mutex> lock(owner.mutex);
+                while (owner.available.empty())
+                    owner.availableCondition.wait(lock);
+                scratch = owner.available.back();
+                owner.available.pop_back();
+            }
+
+            ~Lease()
+            {
+                boost::lock_guard<boost::mutex> lock(owner.mutex);
+                owner.available.push_back(scratch);
+                owner.availableCondition.notify_one();
+            }
+
+            const Scratch &get() const { return scratch; }
+        };
+
+        ScratchPool() : total(0) {}
+
+        /// Add a set, typically made by @ref Marching::makeScratch.
+        void add(const Scratch &scratch)
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            available.push_back(scratch);
+            total++;
+            availableCondition.notify_one();
+        }
+
+        /// Number of sets added to the pool, whether leased or not
+        std::size_t size()
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            return total;
+        }
+    };
 
     /**
      * The function type to pass to @ref generate for receiving output data.
@@ -546,8 +901,9 @@ public:
                                  cl::Event *event)> OutputFunctor;
 
     /**
-     * Constructor. Note that it must be possible to allocate an OpenCL 2D image of
-     * dimensions @a width by @a height, so they should be constrained appropriately.
+     * Constructor. Note that when @a storage is @ref DISTANCE_IMAGE, it must be
+     * possible to allocate an OpenCL 2D image of dimensions @a width by
+     * @a height, so they should be constrained appropriately.
      *
      * @param context        OpenCL context used to allocate buffers.
      * @param device         Device for which kernels are to be compiled.
@@ -555,17 +911,111 @@ public:
      * @param maxSwathe      Maximum number of slices to process in one go (in cells)
      * @param meshMemory     Bytes of memory to allocate for mesh data (including internal data)
      * @param alignment      Alignment values that would be returned by @ref Generator::alignment.
+     * @param distanceType   Channel type for storing the signed distances. Using
+     *                       @c CL_HALF_FLOAT halves the size of the distance image,
+     *                       at the cost of precision in the vertex positions.
+     * @param hashWeld       Weld vertices by inserting their keys into a hash table,
+     *                       instead of sorting them. This avoids the radix sort of
+     *                       64-bit keys, at the cost of a table of up to four
+     *                       entries per vertex. The geometry is the same, but
+     *                       vertices are output in the order they are generated
+     *                       (internal then external), rather than by key.
+     * @param allocateScratch If false, the @ref Scratch buffers are not
+     *                       allocated, and @ref setScratch must be called
+     *                       before each use of @ref generate.
+     * @param storage        Whether the distances are held in an image or a buffer.
+     *                       The generator must write them in the same way (see
+     *                       @ref MlsFunctor::MlsFunctor).
      *
      * @pre
      * - @a maxWidth, @a maxHeight, @a maxDepth are between 2 and @ref MAX_DIMENSION.
      * - @a maxSwathe is at least @a alignment[2]
      * - @a meshMemory &gt;= (@a maxWidth - 1) * (@a maxHeight - 1) * @ref MAX_CELL_BYTES
+     * - @a distanceType satisfies @ref distanceTypeSupported for @a storage.
      */
     Marching(const cl::Context &context, const cl::Device &device,
              Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
              Grid::size_type maxSwathe,
              std::size_t meshMemory,
-             const Grid::size_type alignment[3]);
+             const Grid::size_type alignment[3],
+             cl_channel_type distanceType = CL_FLOAT,
+             bool hashWeld = false,
+             bool allocateScratch = true,
+             DistanceStorage storage = DISTANCE_IMAGE);
+
+    /**
+     * Allocate a @ref Scratch set sized for this instance. It can be used by
+     * any instance constructed with the same arguments.
+     */
+    Scratch makeScratch(const cl::Context &context) const;
+
+    /**
+     * Use a different set of @ref Scratch buffers from the next call to @ref
+     * generate. The caller must ensure that the output of any previous call
+     * has completed (see @ref OutputFunctor), since it may still be reading
+     * the buffers being replaced.
+     */
+    void setScratch(const Scratch &scratch);
+
+    /**
+     * Select coarse-to-fine classification of cells. When enabled, each layer
+     * of cells is first divided into tiles of @ref OCCUPANCY_TILE x
+     * @ref OCCUPANCY_TILE cells, and only the tiles whose corners have both
+     * signs are classified cell by cell. This adds a readback per swathe, but
+     * the fine classification then scales with the area of the surface rather
+     * than the volume, which pays off for fine grids. The output is the same
+     * either way. It is disabled by default.
+     */
+    void setTiledOccupancy(bool tiled) { tiledOccupancy = tiled; }
+
+    /**
+     * Carry the last slice of samples from one call to @ref generate to the
+     * next. If the next region continues the previous one along Z (same X
+     * and Y extents and key shift, and its first slice is the previous last
+     * slice), the carried samples replace those just produced by the
+     * generator for the shared slice. Both regions then triangulate exactly
+     * the same values on their common face, so that the boundary vertices
+     * on either side are identical and weld together exactly.
+     *
+     * The generator is still asked for the full region, since it works in
+     * blocks of slices. It is disabled by default.
+     */
+    void setCarrySlices(bool carry) { carrySlices = carry; carryValid = false; }
+
+    /**
+     * Triangulate each cell as a whole cube, instead of splitting it into
+     * @ref NUM_TETRAHEDRA tetrahedra. Vertices then only lie on the 12 edges
+     * of the cube, and a cell produces at most 5 triangles rather than 12,
+     * so the output has roughly 2.5 times fewer triangles. Vertex keys are
+     * formed in the same way, so external vertices still weld between
+     * calls, provided that all of them use the same setting. It is disabled
+     * by default.
+     */
+    void setMarchingCubes(bool cubes);
+
+    /**
+     * Emit each vertex once, from the cell that owns its edge, rather than
+     * from every cell that uses it. A cell owns the edges that start at its
+     * minimum corner, and the other cells look up the vertices emitted by
+     * the owner. This cuts the number of unwelded vertices by a factor of
+     * about 2.5 for tetrahedra and 3.5 for cubes, which makes welding cheaper. Cells whose owner is not classified
+     * in the same pass (at the boundaries of the grid and swathe, and next
+     * to non-finite samples) still emit their own copy, so welding is still
+     * needed, and the output is the same either way. It costs some extra
+     * samples to be read per occupied cell. It is disabled by default.
+     */
+    void setOwnedEdges(bool owned);
+
+    /**
+     * Transform the output vertices from grid coordinates, as they are
+     * compacted. Each vertex @a v becomes @a v * @a scaleBias.w +
+     * @a scaleBias.xyz. This is equivalent to following @ref generate with
+     * a @ref ScaleBiasFilter, but saves a pass over the vertices. The default
+     * is the identity (scale of 1 and bias of 0).
+     *
+     * @param scaleBias     Scale in w, bias in xyz.
+     */
+    void setScaleBias(const cl_float4 &scaleBias);
 
     /**
      * Generate an isosurface.
@@ -589,8 +1039,25 @@ public:
      * @param size           Number of vertices in each dimension to process.
      * @param keyOffset      XYZ values to add to vertex keys of external vertices.
      * @param events         Previous events to wait for (can be @c NULL).
+     * @param outputQueue    Command queue on which to call @a output, or @c NULL to use @a queue.
+     * @param keyShift       Number of levels by which the grid is coarser than the grid
+     *                       used for keys (see below).
+     *
+     * If @a outputQueue is given, work enqueued by @a output (such as the readback of
+     * the mesh) can overlap with subsequent work on @a queue, including work from later
+     * calls to this function. The mesh buffers are protected by events so that they are
+     * not overwritten until the output has finished with them. This function returns
+     * once @a queue is idle, but @a outputQueue may still be busy.
      *
-     * @note @a keyOffset is specified in integer units, not fixed-point.
+     * @note @a keyOffset is specified in integer units, not fixed-point. It is
+     * added to each field of the keys with @ref addKeys, so fields wrap
+     * around rather than overflowing into their neighbours.
+     *
+     * If @a keyShift is non-zero, the region is sampled on a grid whose spacing
+     * is 2<sup>@a keyShift</sup> times that of the key grid, and @a keyOffset is
+     * in units of the coarse grid. External keys are scaled up to the key grid,
+     * so that vertices on a shared coarse edge weld with neighbours at the same
+     * level, and keys from different levels never collide.
      *
      * @note @a size is in units of corners, which is one more than the number of cells.
      *
@@ -605,7 +1072,31 @@ public:
                   const OutputFunctor &output,
                   const Grid::size_type size[3],
                   const cl_uint3 &keyOffset,
-                  const std::vector<cl::Event> *events = NULL);
+                  const std::vector<cl::Event> *events = NULL,
+                  const cl::CommandQueue *outputQueue = NULL,
+                  unsigned int keyShift = 0);
+
+    /**
+     * Return the number of occupied cells, vertices and triangles produced by
+     * the most recent call to @ref generate. Vertices on the boundary between
+     * two calls to the output functor are counted in both.
+     */
+    const Counts &getLastCounts() const { return lastCounts; }
+
+    /**
+     * Adds two global vertex keys field by field, with each field wrapping
+     * modulo 2<sup>@ref KEY_AXIS_BITS</sup>. This matches the way the
+     * kernels apply the key offset.
+     */
+    static cl_ulong addKeys(cl_ulong a, cl_ulong b);
+
+    /**
+     * Packs a key offset into the global key layout, for use with @ref addKeys.
+     *
+     * @param keyOffset  Offset in integer units of the coarse grid (see @ref generate).
+     * @param keyShift   Coarsening level of the grid (see @ref generate).
+     */
+    static cl_ulong packKeyOffset(const cl_uint3 &keyOffset, unsigned int keyShift);
 
 private:
     /**
@@ -631,6 +1122,33 @@ private:
         const std::vector<cl::Event> *events,
         cl::Event *event);
 
+    /**
+     * Variant of @ref copySlice for distances stored in a buffer with
+     * elements of @a elementBytes bytes. Whole rows of @a params.rowPitch
+     * elements are copied.
+     */
+    void copySlice(
+        const cl::CommandQueue &queue,
+        const cl::Buffer &buffer,
+        std::size_t elementBytes,
+        Grid::size_type zSrc,
+        Grid::size_type zTrg,
+        const ImageParams &params,
+        const std::vector<cl::Event> *events,
+        cl::Event *event);
+
+    /// Copy a slice of the distances held by this object, in whichever @ref storage is used
+    void copyDistanceSlice(
+        const cl::CommandQueue &queue,
+        Grid::size_type zSrc,
+        Grid::size_type zTrg,
+        const ImageParams &params,
+        const std::vector<cl::Event> *events,
+        cl::Event *event);
+
+    /// The image or buffer holding the distances
+    const cl::Memory &distances() const;
+
     /**
      * Determine which cells in a slice need to be processed further,
      * and produce per-cell counts of vertices and indices.
@@ -655,6 +1173,42 @@ private:
         const Swathe &swathe,
         const std::vector<cl::Event> *events);
 
+    /**
+     * Weld vertices by sorting them by key, for @ref shipOut. The welded
+     * vertices are written to @ref weldedVertices and @ref weldedVertexKeys,
+     * the remapping to @ref indexRemap, and the vertex counts are read back
+     * to @ref readback (asynchronously).
+     *
+     * @param queue           Command queue to use for enqueuing work.
+     * @param numVertices     Number of unwelded vertices.
+     * @param minExternalKey  Vertex keys >= @a minExternalKey are external vertices.
+     * @param keyOffset       Value added to external keys on output.
+     * @param events          Events to wait for before starting (may be @c NULL).
+     * @param[out] event      Event signalled once @ref indexRemap is ready (may be @c NULL).
+     */
+    void sortWeldVertices(
+        const cl::CommandQueue &queue,
+        cl_uint numVertices,
+        cl_ulong minExternalKey,
+        cl_ulong keyOffset,
+        const std::vector<cl::Event> *events,
+        cl::Event *event);
+
+    /**
+     * Weld vertices with a hash table, for @ref shipOut. This has the same
+     * outputs as @ref sortWeldVertices, except that the vertex counts are
+     * read back to @ref Readback::hashCounts.
+     *
+     * @see @ref sortWeldVertices for the parameters.
+     */
+    void hashWeldVertices(
+        const cl::CommandQueue &queue,
+        cl_uint numVertices,
+        cl_ulong minExternalKey,
+        cl_ulong keyOffset,
+        const std::vector<cl::Event> *events,
+        cl::Event *event);
+
     /**
      * Post-process a batch of geometry and send it to the output functor.
      * This function operates asynchronously, with an event returned to
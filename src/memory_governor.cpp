@@ -0,0 +1,71 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Backpressure on the upstream stages when tracked memory exceeds a limit.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cassert>
+#include <boost/thread/locks.hpp>
+#include "memory_governor.h"
+
+MemoryGovernor::MemoryGovernor(std::size_t limit, const Statistics::Peak &usage)
+    : limit(limit), usage(usage), pending(0)
+{
+}
+
+bool MemoryGovernor::over() const
+{
+    return limit > 0 && usage.get() >= Statistics::Peak::value_type(limit);
+}
+
+void MemoryGovernor::add()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    pending++;
+}
+
+void MemoryGovernor::done()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        assert(pending > 0);
+        pending--;
+    }
+    cond.notify_all();
+}
+
+void MemoryGovernor::wait(Timeplot::Worker &tworker)
+{
+    if (!over())
+        return;
+
+    Timeplot::Action timer("governor", tworker, "mem.governor.wait");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (pending > 0 && over())
+        cond.wait(lock);
+    if (over())
+        Statistics::getStatistic<Statistics::Counter>("mem.governor.overrun").add(1);
+}
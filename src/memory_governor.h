@@ -0,0 +1,104 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Backpressure on the upstream stages when tracked memory exceeds a limit.
+ */
+
+#ifndef MEMORY_GOVERNOR_H
+#define MEMORY_GOVERNOR_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "statistics.h"
+#include "timeplot.h"
+
+/**
+ * Holds back the upstream stages of the pipeline while the tracked memory
+ * usage is over a limit. Usage is read from a @ref Statistics::Peak, by
+ * default @c mem.all, which every @ref Statistics::Allocator (and hence
+ * every @ref CircularBuffer backing store) reports to.
+ *
+ * Memory is mostly released by the meshers, so the governor counts the
+ * mesher work in flight: the mesher group calls @ref add for each item it
+ * enqueues and @ref done once the item has been consumed. An upstream stage
+ * calls @ref wait before producing more work, which blocks while the usage is
+ * over the limit and some mesher work is still in flight. If nothing is in
+ * flight then waiting would not free anything (the memory is held by
+ * permanent state such as the mesher's own tables), so @ref wait returns
+ * immediately and the overrun is counted in @c mem.governor.overrun.
+ * The meshers themselves are never held back, so this cannot deadlock.
+ *
+ * All the functions are thread-safe.
+ */
+class MemoryGovernor : public boost::noncopyable
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param limit   Usage (in bytes) above which upstream stages are held back,
+     *                or 0 for no limit.
+     * @param usage   Statistic holding the current usage.
+     */
+    explicit MemoryGovernor(
+        std::size_t limit,
+        const Statistics::Peak &usage = Statistics::getStatistic<Statistics::Peak>("mem.all"));
+
+    /// Record a new piece of mesher work.
+    void add();
+
+    /**
+     * Record that a piece of mesher work has been consumed, and wake up any
+     * waiting stages to check the usage again.
+     *
+     * @pre There is outstanding work.
+     */
+    void done();
+
+    /**
+     * Block until the usage is below the limit or there is no mesher work in
+     * flight. The time spent blocked is recorded in @c mem.governor.wait.
+     */
+    void wait(Timeplot::Worker &tworker);
+
+    /// Returns the limit passed to the constructor.
+    std::size_t getLimit() const { return limit; }
+
+private:
+    const std::size_t limit;
+    const Statistics::Peak &usage;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::size_t pending;               ///< Mesher work added but not done
+
+    /// Whether the usage is currently at or over the limit
+    bool over() const;
+};
+
+#endif /* !MEMORY_GOVERNOR_H */
@@ -0,0 +1,184 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Binary readers and writers that exchange data with the calling program
+ * rather than with files, for running a reconstruction in-process.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <locale>
+#include <algorithm>
+#include "tr1_cstdint.h"
+#include "memory_io.h"
+
+SplatArrayReader::SplatArrayReader(const Splat *splats, std::size_t numSplats)
+    : splats(reinterpret_cast<const char *>(splats)),
+    splatBytes(numSplats * sizeof(Splat)),
+    header(makeHeader(numSplats))
+{
+}
+
+SplatArrayReader::~SplatArrayReader()
+{
+    if (isOpen())
+        close();
+}
+
+std::string SplatArrayReader::makeHeader(std::size_t numSplats)
+{
+    std::tr1::uint32_t x = 1;
+    unsigned char y;
+    std::memcpy(&y, &x, 1);
+
+    std::ostringstream h;
+    h.imbue(std::locale::classic());
+    h << "ply\n"
+        << (y == 1 ? "format binary_little_endian 1.0\n" : "format binary_big_endian 1.0\n")
+        << "element vertex " << numSplats << "\n"
+        << "property float32 x\n"
+        << "property float32 y\n"
+        << "property float32 z\n"
+        << "property float32 radius\n"
+        << "property float32 nx\n"
+        << "property float32 ny\n"
+        << "property float32 nz\n"
+        << "property float32 quality\n"
+        << "end_header\n";
+    return h.str();
+}
+
+void SplatArrayReader::openImpl(const boost::filesystem::path &path)
+{
+    (void) path;
+    // No action required
+}
+
+void SplatArrayReader::closeImpl()
+{
+    // No action required
+}
+
+std::size_t SplatArrayReader::readImpl(void *buf, std::size_t count, offset_type offset) const
+{
+    char *out = static_cast<char *>(buf);
+    std::size_t done = 0;
+    if (offset < header.size())
+    {
+        std::size_t n = std::min(count, std::size_t(header.size() - offset));
+        std::memcpy(out, header.data() + offset, n);
+        done += n;
+        offset += n;
+    }
+    if (done < count && offset - header.size() < splatBytes)
+    {
+        const offset_type pos = offset - header.size();
+        std::size_t n = std::min(count - done, std::size_t(splatBytes - pos));
+        std::memcpy(out + done, splats + pos, n);
+        done += n;
+    }
+    return done;
+}
+
+BinaryReader::offset_type SplatArrayReader::sizeImpl() const
+{
+    return header.size() + splatBytes;
+}
+
+ByteArrayReader::ByteArrayReader(const char *bytes, std::size_t numBytes)
+    : bytes(bytes), numBytes(numBytes)
+{
+}
+
+ByteArrayReader::~ByteArrayReader()
+{
+    if (isOpen())
+        close();
+}
+
+void ByteArrayReader::openImpl(const boost::filesystem::path &path)
+{
+    (void) path;
+    // No action required
+}
+
+void ByteArrayReader::closeImpl()
+{
+    // No action required
+}
+
+std::size_t ByteArrayReader::readImpl(void *buf, std::size_t count, offset_type offset) const
+{
+    if (offset >= numBytes)
+        return 0;
+    std::size_t n = std::min(count, std::size_t(numBytes - offset));
+    std::memcpy(buf, bytes + offset, n);
+    return n;
+}
+
+BinaryReader::offset_type ByteArrayReader::sizeImpl() const
+{
+    return numBytes;
+}
+
+const char *ByteArrayReader::dataImpl() const
+{
+    return bytes;
+}
+
+CallbackWriter::CallbackWriter(const Callback &callback) : callback(callback)
+{
+}
+
+CallbackWriter::~CallbackWriter()
+{
+    if (isOpen())
+        close();
+}
+
+void CallbackWriter::openImpl(const boost::filesystem::path &path)
+{
+    (void) path;
+    // No action required
+}
+
+void CallbackWriter::closeImpl()
+{
+    // No action required
+}
+
+std::size_t CallbackWriter::writeImpl(const void *buf, std::size_t count, offset_type offset) const
+{
+    callback(filename(), buf, count, offset);
+    return count;
+}
+
+void CallbackWriter::resizeImpl(offset_type size) const
+{
+    callback(filename(), NULL, 0, size);
+}
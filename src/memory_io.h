@@ -0,0 +1,187 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Binary readers and writers that exchange data with the calling program
+ * rather than with files, for running a reconstruction in-process.
+ */
+
+#ifndef MEMORY_IO_H
+#define MEMORY_IO_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <string>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/filesystem/path.hpp>
+#include "binary_io.h"
+#include "splat.h"
+
+/**
+ * A reader that presents an array of splats owned by the caller as a binary
+ * PLY file, so that it can be wrapped in a @ref FastPly::Reader. A header is
+ * synthesized that describes the vertices with exactly the layout of @ref
+ * Splat, so the vertex data is read straight out of the array. The radius is
+ * subject to the usual smoothing and clamping by the @ref FastPly::Reader,
+ * and the quality is recomputed from it.
+ *
+ * The array is not copied, and must not be modified or freed while any
+ * reader refers to it.
+ */
+class SplatArrayReader : public BinaryReader
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param splats     Start of the splat array.
+     * @param numSplats  Number of elements in @a splats.
+     */
+    SplatArrayReader(const Splat *splats, std::size_t numSplats);
+
+    virtual ~SplatArrayReader();
+
+    /// Return the PLY header that describes an array of @a numSplats splats.
+    static std::string makeHeader(std::size_t numSplats);
+
+private:
+    const char *splats;
+    std::size_t splatBytes;
+    std::string header;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
+    virtual offset_type sizeImpl() const;
+};
+
+/**
+ * Satisfies the requirements for a reader factory in @ref FastPly::Reader,
+ * producing a @ref SplatArrayReader for a fixed array.
+ */
+class SplatArrayReaderFactory
+{
+public:
+    typedef BinaryReader *result_type;
+
+    SplatArrayReaderFactory(const Splat *splats, std::size_t numSplats)
+        : splats(splats), numSplats(numSplats) {}
+
+    BinaryReader *operator()() const
+    {
+        return new SplatArrayReader(splats, numSplats);
+    }
+
+private:
+    const Splat *splats;
+    std::size_t numSplats;
+};
+
+/**
+ * A reader that presents a range of bytes owned by the caller as a file.
+ * The bytes are also exposed through @ref BinaryReader::data, so consumers
+ * that handle memory-mapped files read them in place.
+ *
+ * The range is not copied, and must not be modified or freed while the
+ * reader refers to it.
+ */
+class ByteArrayReader : public BinaryReader
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param bytes      Start of the range (may be @c NULL if @a numBytes is zero).
+     * @param numBytes   Number of bytes in the range.
+     */
+    ByteArrayReader(const char *bytes, std::size_t numBytes);
+
+    virtual ~ByteArrayReader();
+
+private:
+    const char *bytes;
+    std::size_t numBytes;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const;
+    virtual offset_type sizeImpl() const;
+    virtual const char *dataImpl() const;
+};
+
+/**
+ * A writer that hands everything written to it to a callback instead of
+ * storing it. The callback receives the name the file was opened with, so a
+ * single callback can tell apart the output files of a split mesh. Writes
+ * to one file may arrive out of order and from several threads at once, but
+ * never overlap; the callback must be thread-safe.
+ *
+ * Resizing is reported as a write of zero bytes at the new size, so that
+ * the receiver can allocate space or detect truncation.
+ */
+class CallbackWriter : public BinaryWriter
+{
+public:
+    /**
+     * Type of the callback. The arguments are the filename, the data, the
+     * number of bytes, and the offset of the data within the file.
+     */
+    typedef boost::function<void(const std::string &, const void *, std::size_t, offset_type)> Callback;
+
+    explicit CallbackWriter(const Callback &callback);
+
+    virtual ~CallbackWriter();
+
+private:
+    Callback callback;
+
+    virtual void openImpl(const boost::filesystem::path &path);
+    virtual void closeImpl();
+    virtual std::size_t writeImpl(const void *buf, std::size_t count, offset_type offset) const;
+    virtual void resizeImpl(offset_type size) const;
+};
+
+/**
+ * Satisfies the requirements for a handle factory in @ref FastPly::Writer,
+ * producing a @ref CallbackWriter for a fixed callback.
+ */
+class CallbackWriterFactory
+{
+public:
+    typedef boost::shared_ptr<BinaryWriter> result_type;
+
+    explicit CallbackWriterFactory(const CallbackWriter::Callback &callback)
+        : callback(callback) {}
+
+    result_type operator()() const
+    {
+        return result_type(new CallbackWriter(callback));
+    }
+
+private:
+    CallbackWriter::Callback callback;
+};
+
+#endif /* !MEMORY_IO_H */
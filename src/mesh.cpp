@@ -37,6 +37,8 @@
 #include "mesh.h"
 #include "clh.h"
 #include "errors.h"
+#include "statistics.h"
+#include "statistics_cl.h"
 #include "tr1_cstdint.h"
 
 DeviceKeyMesh::DeviceKeyMesh(
@@ -69,6 +71,10 @@ void enqueueReadMesh(const cl::CommandQueue &queue,
     MLSGPU_ASSERT(dMesh.numInternalVertices() <= dMesh.numVertices(), std::invalid_argument);
     MLSGPU_ASSERT(static_cast<const MeshSizes &>(dMesh) == hMesh, std::invalid_argument);
 
+    Statistics::Throughput *downloadStat = NULL;
+    if (Statistics::isEventTimingEnabled())
+        downloadStat = &Statistics::getDeviceThroughput("download", queue.getInfo<CL_QUEUE_DEVICE>());
+
     if (trianglesEvent != NULL)
     {
         CLH::enqueueReadBuffer(queue,
@@ -77,6 +83,8 @@ void enqueueReadMesh(const cl::CommandQueue &queue,
                                hMesh.triangles,
                                events, trianglesEvent);
         queue.flush();
+        if (downloadStat != NULL)
+            Statistics::timeTransfer(*trianglesEvent, dMesh.numTriangles() * (3 * sizeof(cl_uint)), *downloadStat);
     }
 
     if (vertexKeysEvent != NULL)
@@ -88,6 +96,8 @@ void enqueueReadMesh(const cl::CommandQueue &queue,
                                hMesh.vertexKeys,
                                events, vertexKeysEvent);
         queue.flush();
+        if (downloadStat != NULL)
+            Statistics::timeTransfer(*vertexKeysEvent, dMesh.numExternalVertices() * sizeof(cl_ulong), *downloadStat);
     }
 
     if (verticesEvent != NULL)
@@ -98,5 +108,7 @@ void enqueueReadMesh(const cl::CommandQueue &queue,
                                hMesh.vertices,
                                events, verticesEvent);
         queue.flush();
+        if (downloadStat != NULL)
+            Statistics::timeTransfer(*verticesEvent, dMesh.numVertices() * (3 * sizeof(cl_float)), *downloadStat);
     }
 }
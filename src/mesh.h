@@ -110,7 +110,9 @@ struct DeviceKeyMesh : public MeshSizes
      */
     cl::Buffer triangles;
     /**
-     * Buffer containing vertex keys, which are @c cl_ulong values.
+     * Buffer containing vertex keys, which are @c cl_ulong values. Only the
+     * keys of external vertices (from @ref numInternalVertices onwards) need
+     * to be defined, and only those are transferred by @ref enqueueReadMesh.
      */
     cl::Buffer vertexKeys;                 ///< Vertex keys
 
@@ -35,12 +35,19 @@
 #include <CL/cl.hpp>
 #include <vector>
 #include <algorithm>
+#include <cmath>
+#include <stdexcept>
 #include <boost/function.hpp>
 #include <boost/foreach.hpp>
 #include "mesh_filter.h"
+#include "clh.h"
+#include "errors.h"
+#include "statistics.h"
+#include "statistics_cl.h"
 #include "errors.h"
 #include "grid.h"
 #include "clh.h"
+#include "misc.h"
 
 void MeshFilterChain::operator()(
     const cl::CommandQueue &queue,
@@ -65,6 +72,37 @@ void MeshFilterChain::operator()(
     output(queue, *inMesh, events, event);
 }
 
+const ScaleBiasFilter *MeshFilterChain::fusableScaleBias() const
+{
+    // target() also sees through boost::ref and boost::cref
+    if (filters.size() == 1)
+        return filters[0].target<ScaleBiasFilter>();
+    else
+        return NULL;
+}
+
+void MeshFilterChain::generate(
+    Marching &marching,
+    const cl::CommandQueue &queue,
+    Marching::Generator &generator,
+    const Grid::size_type size[3],
+    const cl_uint3 &keyOffset,
+    const std::vector<cl::Event> *events,
+    const cl::CommandQueue *outputQueue,
+    unsigned int keyShift) const
+{
+    const ScaleBiasFilter *scaleBias = fusableScaleBias();
+    if (scaleBias != NULL)
+    {
+        const cl_float4 identity = {{ 0.0f, 0.0f, 0.0f, 1.0f }};
+        marching.setScaleBias(scaleBias->getScaleBias());
+        marching.generate(queue, generator, output, size, keyOffset, events, outputQueue, keyShift);
+        marching.setScaleBias(identity);
+    }
+    else
+        marching.generate(queue, generator, *this, size, keyOffset, events, outputQueue, keyShift);
+}
+
 ScaleBiasFilter::ScaleBiasFilter(const cl::Context &context)
     : kernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.scaleBias.time"))
 {
@@ -82,10 +120,10 @@ void ScaleBiasFilter::setScaleBias(float scale, float x, float y, float z)
     kernel.setArg(1, scaleBias);
 }
 
-void ScaleBiasFilter::setScaleBias(const Grid &grid)
+void ScaleBiasFilter::setScaleBias(const Grid &grid, unsigned int level)
 {
     grid.getVertex(0, 0, 0, scaleBias.s);
-    scaleBias.s[3] = grid.getSpacing();
+    scaleBias.s[3] = grid.getSpacing() * (1U << level);
     kernel.setArg(1, scaleBias);
 }
 
@@ -111,3 +149,169 @@ void ScaleBiasFilter::operator()(
                                    events, event, &kernelTime);
     outMesh = inMesh;
 }
+
+DecimateFilter::DecimateFilter(const cl::Context &context, const cl::Device &device, float cellSize)
+    : sortCodes(context, device, clogs::TYPE_ULONG, clogs::TYPE_UINT),
+    scanUint(context, device, clogs::TYPE_UINT),
+    context(context),
+    cellSize(cellSize),
+    axisBits(1),
+    vertexCapacity(0),
+    triangleCapacity(0),
+    kernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.decimate.time")),
+    vertexRatio(Statistics::getStatistic<Statistics::Variable>("decimate.vertices.ratio")),
+    triangleRatio(Statistics::getStatistic<Statistics::Variable>("decimate.triangles.ratio"))
+{
+    MLSGPU_ASSERT(cellSize > 0.0f, std::invalid_argument);
+    cl::Program program = CLH::build(context, "kernels/decimate.cl");
+    codesKernel = cl::Kernel(program, "decimateCodes");
+    headsKernel = cl::Kernel(program, "decimateHeads");
+    clustersKernel = cl::Kernel(program, "decimateClusters");
+    externalKernel = cl::Kernel(program, "decimateExternal");
+    markTrianglesKernel = cl::Kernel(program, "decimateMarkTriangles");
+    trianglesKernel = cl::Kernel(program, "decimateTriangles");
+
+    sortCodes.setEventCallback(&Statistics::timeEventCallback, &kernelTime);
+    scanUint.setEventCallback(&Statistics::timeEventCallback, &kernelTime);
+}
+
+void DecimateFilter::setRegion(const cl_uint3 &offset, const Grid::size_type size[3], unsigned int level)
+{
+    const float scale = (1U << level) / cellSize;
+    cl_float3 origin;
+    cl_uint3 maxCell;
+    axisBits = 1;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        origin.s[i] = offset.s[i];
+        maxCell.s[i] = (cl_uint) std::ceil(size[i] * scale);
+        while ((cl_ulong(1) << axisBits) <= maxCell.s[i])
+            axisBits++;
+    }
+    codesKernel.setArg(3, origin);
+    codesKernel.setArg(4, scale);
+    codesKernel.setArg(5, maxCell);
+    codesKernel.setArg(6, axisBits);
+}
+
+void DecimateFilter::reserve(std::size_t numVertices, std::size_t numTriangles) const
+{
+    if (numVertices > vertexCapacity)
+    {
+        vertexCapacity = std::max(numVertices, vertexCapacity * 2);
+        codes = cl::Buffer(context, CL_MEM_READ_WRITE, vertexCapacity * sizeof(cl_ulong));
+        ids = cl::Buffer(context, CL_MEM_READ_WRITE, vertexCapacity * sizeof(cl_uint));
+        clusters = cl::Buffer(context, CL_MEM_READ_WRITE, (vertexCapacity + 1) * sizeof(cl_uint));
+        vertexMap = cl::Buffer(context, CL_MEM_READ_WRITE, vertexCapacity * sizeof(cl_uint));
+        outVertices = cl::Buffer(context, CL_MEM_READ_WRITE, vertexCapacity * (3 * sizeof(cl_float)));
+        outKeys = cl::Buffer(context, CL_MEM_READ_WRITE, vertexCapacity * sizeof(cl_ulong));
+    }
+    if (numTriangles > triangleCapacity)
+    {
+        triangleCapacity = std::max(numTriangles, triangleCapacity * 2);
+        keep = cl::Buffer(context, CL_MEM_READ_WRITE, (triangleCapacity + 1) * sizeof(cl_uint));
+        outTriangles = cl::Buffer(context, CL_MEM_READ_WRITE, triangleCapacity * (3 * sizeof(cl_uint)));
+    }
+}
+
+void DecimateFilter::operator()(
+    const cl::CommandQueue &queue,
+    const DeviceKeyMesh &inMesh,
+    const std::vector<cl::Event> *events,
+    cl::Event *event,
+    DeviceKeyMesh &outMesh) const
+{
+    const cl_uint numInternal = inMesh.numInternalVertices();
+    const cl_uint numExternal = inMesh.numVertices() - numInternal;
+    const cl_uint numTriangles = inMesh.numTriangles();
+    if (numInternal == 0 || numTriangles == 0)
+    {
+        // Nothing that may be clustered
+        CLH::enqueueMarkerWithWaitList(queue, events, event);
+        outMesh = inMesh;
+        return;
+    }
+    reserve(inMesh.numVertices(), numTriangles);
+
+    std::vector<cl::Event> wait(1);
+    cl::Event last;
+
+    codesKernel.setArg(0, codes);
+    codesKernel.setArg(1, ids);
+    codesKernel.setArg(2, inMesh.vertices);
+    CLH::enqueueNDRangeKernel(queue, codesKernel, cl::NullRange, cl::NDRange(numInternal), cl::NullRange,
+                              events, &last, &kernelTime);
+    wait[0] = last;
+
+    sortCodes.enqueue(queue, codes, ids, numInternal, 3 * axisBits, &wait, &last);
+    wait[0] = last;
+
+    headsKernel.setArg(0, clusters);
+    headsKernel.setArg(1, codes);
+    headsKernel.setArg(2, numInternal);
+    CLH::enqueueNDRangeKernel(queue, headsKernel, cl::NullRange, cl::NDRange(numInternal + 1), cl::NullRange,
+                              &wait, &last, &kernelTime);
+    wait[0] = last;
+
+    scanUint.enqueue(queue, clusters, numInternal + 1, NULL, &wait, &last);
+    wait[0] = last;
+
+    clustersKernel.setArg(0, outVertices);
+    clustersKernel.setArg(1, vertexMap);
+    clustersKernel.setArg(2, inMesh.vertices);
+    clustersKernel.setArg(3, codes);
+    clustersKernel.setArg(4, ids);
+    clustersKernel.setArg(5, clusters);
+    clustersKernel.setArg(6, numInternal);
+    CLH::enqueueNDRangeKernel(queue, clustersKernel, cl::NullRange, cl::NDRange(numInternal), cl::NullRange,
+                              &wait, &last, &kernelTime);
+    wait[0] = last;
+
+    externalKernel.setArg(0, outVertices);
+    externalKernel.setArg(1, outKeys);
+    externalKernel.setArg(2, vertexMap);
+    externalKernel.setArg(3, inMesh.vertices);
+    externalKernel.setArg(4, inMesh.vertexKeys);
+    externalKernel.setArg(5, clusters);
+    externalKernel.setArg(6, numInternal);
+    CLH::enqueueNDRangeKernel(queue, externalKernel, cl::NullRange, cl::NDRange(numExternal), cl::NullRange,
+                              &wait, &last, &kernelTime);
+    wait[0] = last;
+
+    markTrianglesKernel.setArg(0, keep);
+    markTrianglesKernel.setArg(1, inMesh.triangles);
+    markTrianglesKernel.setArg(2, vertexMap);
+    markTrianglesKernel.setArg(3, numTriangles);
+    CLH::enqueueNDRangeKernel(queue, markTrianglesKernel, cl::NullRange, cl::NDRange(numTriangles + 1), cl::NullRange,
+                              &wait, &last, &kernelTime);
+    wait[0] = last;
+
+    scanUint.enqueue(queue, keep, numTriangles + 1, NULL, &wait, &last);
+    wait[0] = last;
+
+    trianglesKernel.setArg(0, outTriangles);
+    trianglesKernel.setArg(1, inMesh.triangles);
+    trianglesKernel.setArg(2, vertexMap);
+    trianglesKernel.setArg(3, keep);
+    CLH::enqueueNDRangeKernel(queue, trianglesKernel, cl::NullRange, cl::NDRange(numTriangles), cl::NullRange,
+                              &wait, &last, &kernelTime);
+
+    // The output sizes are needed to describe the output mesh
+    cl_uint numClusters, numKept;
+    std::vector<cl::Event> reads(2);
+    queue.enqueueReadBuffer(clusters, CL_FALSE, numInternal * sizeof(cl_uint), sizeof(cl_uint),
+                            &numClusters, &wait, &reads[0]);
+    queue.enqueueReadBuffer(keep, CL_FALSE, numTriangles * sizeof(cl_uint), sizeof(cl_uint),
+                            &numKept, &wait, &reads[1]);
+    cl::Event::waitForEvents(reads);
+
+    vertexRatio.add(double(numClusters) / numInternal);
+    triangleRatio.add(double(numKept) / numTriangles);
+
+    outMesh.vertices = outVertices;
+    outMesh.vertexKeys = outKeys;
+    outMesh.triangles = outTriangles;
+    outMesh.assign(numClusters + numExternal, numKept, numClusters);
+    if (event != NULL)
+        *event = last;
+}
@@ -40,6 +40,7 @@
 #include "statistics.h"
 
 class Grid;
+class ScaleBiasFilter;
 
 /**
  * Function for accepting a mesh and transforming it in some way (on the
@@ -72,6 +73,9 @@ private:
     std::vector<MeshFilter> filters;
     Marching::OutputFunctor output;
 
+    /// The only filter, if it is a @ref ScaleBiasFilter, otherwise @c NULL
+    const ScaleBiasFilter *fusableScaleBias() const;
+
 public:
     typedef void result_type;
 
@@ -119,6 +123,28 @@ public:
         const DeviceKeyMesh &mesh,
         const std::vector<cl::Event> *events,
         cl::Event *event) const;
+
+    /**
+     * Generate an isosurface with @a marching and pass it through the chain.
+     * The other parameters are as for @ref Marching::generate.
+     *
+     * If the only filter is a @ref ScaleBiasFilter, it is applied by @a
+     * marching as it compacts the vertices (see @ref Marching::setScaleBias),
+     * rather than as a separate pass over the vertices. Otherwise this is
+     * equivalent to passing the chain as the output functor.
+     *
+     * @pre
+     * - The output functor has been set.
+     */
+    void generate(
+        Marching &marching,
+        const cl::CommandQueue &queue,
+        Marching::Generator &generator,
+        const Grid::size_type size[3],
+        const cl_uint3 &keyOffset,
+        const std::vector<cl::Event> *events = NULL,
+        const cl::CommandQueue *outputQueue = NULL,
+        unsigned int keyShift = 0) const;
 };
 
 /**
@@ -152,11 +178,107 @@ public:
     /// Set the scale and bias.
     void setScaleBias(float scale, float x, float y, float z);
 
+    /// Get the scale (in w) and bias (in xyz).
+    const cl_float4 &getScaleBias() const { return scaleBias; }
+
     /**
      * Set the scale and bias from a grid. The scale and bias are set such that
-     * grid coordinates are transformed to world coordinates.
+     * grid coordinates are transformed to world coordinates. If @a level is
+     * non-zero, the input coordinates are instead those of a grid with the same
+     * origin whose spacing is 2<sup>@a level</sup> times larger.
+     */
+    void setScaleBias(const Grid &grid, unsigned int level = 0);
+
+    /// Filter operation (see @ref MeshFilter).
+    void operator()(
+        const cl::CommandQueue &queue,
+        const DeviceKeyMesh &inMesh,
+        const std::vector<cl::Event> *events,
+        cl::Event *event,
+        DeviceKeyMesh &outMesh) const;
+};
+
+/**
+ * Mesh filter that decimates the mesh by vertex clustering. Space is divided
+ * into cubes, and the internal vertices in each cube are replaced by a single
+ * vertex at their centroid. Triangles that become degenerate are removed.
+ * External vertices and their keys are passed through unchanged, so that the
+ * output still welds with neighbouring blocks.
+ *
+ * The output is not guaranteed to be manifold, and a cluster whose triangles
+ * all collapse leaves an isolated vertex. Because the output sizes depend on
+ * the data, @c operator() waits for the filter to finish before returning.
+ *
+ * This class is not reentrant. The output mesh references internal buffers,
+ * which are reused by the next call. They are grown as needed.
+ */
+class DecimateFilter
+{
+private:
+    /**
+     * @name
+     * @{
+     * Kernels from decimate.cl. They are mutable so that the arguments can be set.
+     */
+    mutable cl::Kernel codesKernel;
+    mutable cl::Kernel headsKernel;
+    mutable cl::Kernel clustersKernel;
+    mutable cl::Kernel externalKernel;
+    mutable cl::Kernel markTrianglesKernel;
+    mutable cl::Kernel trianglesKernel;
+    /** @} */
+
+    mutable clogs::Radixsort sortCodes;   ///< Sorts vertices by cluster code
+    mutable clogs::Scan scanUint;         ///< Scans the cluster and triangle flags
+
+    const cl::Context context;
+    const float cellSize;                 ///< Edge length of the clustering cubes, in grid cells
+    cl_uint axisBits;                     ///< Bits per axis in the cluster codes (see @ref setRegion)
+
+    /**
+     * @name
+     * @{
+     * Intermediate and output storage, grown by @ref reserve.
+     */
+    mutable cl::Buffer codes;             ///< Cluster code per internal vertex
+    mutable cl::Buffer ids;               ///< Original index per internal vertex, sorted with @ref codes
+    mutable cl::Buffer clusters;          ///< Scan of cluster heads (one extra element)
+    mutable cl::Buffer vertexMap;         ///< Output index per input vertex
+    mutable cl::Buffer keep;              ///< Scan of surviving triangles (one extra element)
+    mutable cl::Buffer outVertices;
+    mutable cl::Buffer outKeys;
+    mutable cl::Buffer outTriangles;
+    mutable std::size_t vertexCapacity;
+    mutable std::size_t triangleCapacity;
+    /** @} */
+
+    Statistics::Variable &kernelTime;     ///< Time spent in the kernels
+    Statistics::Variable &vertexRatio;    ///< Fraction of vertices retained
+    Statistics::Variable &triangleRatio;  ///< Fraction of triangles retained
+
+    /// Ensure that the buffers can hold a mesh of the given size.
+    void reserve(std::size_t numVertices, std::size_t numTriangles) const;
+
+public:
+    /**
+     * Constructor.
+     *
+     * @param context, device    Where the filter will be run.
+     * @param cellSize           Edge length of the clustering cubes, in units of
+     *                           the input vertices (normally grid cells).
+     */
+    DecimateFilter(const cl::Context &context, const cl::Device &device, float cellSize);
+
+    /**
+     * Set the region containing the vertices, which must be called before
+     * each block. The cubes are aligned to @a offset.
+     *
+     * @param offset     Minimum corner of the region, in the units of the vertices.
+     * @param size       Number of vertices along each axis.
+     * @param level      If non-zero, the vertices are on a grid that is coarser by a
+     *                   factor of 2<sup>@a level</sup>, and the cubes are shrunk to match.
      */
-    void setScaleBias(const Grid &grid);
+    void setRegion(const cl_uint3 &offset, const Grid::size_type size[3], unsigned int level = 0);
 
     /// Filter operation (see @ref MeshFilter).
     void operator()(
@@ -43,6 +43,7 @@
 #include <boost/ref.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/smart_ptr/scoped_array.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
@@ -51,6 +52,7 @@
 #include <boost/foreach.hpp>
 #include <boost/type_traits/make_unsigned.hpp>
 #include <boost/exception/all.hpp>
+#include <boost/exception_ptr.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/system/error_code.hpp>
 #include <boost/iostreams/positioning.hpp>
@@ -64,8 +66,15 @@
 #include <map>
 #include <string>
 #include <ostream>
+#include <sstream>
 #include <iomanip>
 #include <cerrno>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include <memory>
 #include "mesher.h"
 #include "fast_ply.h"
 #include "logging.h"
@@ -77,6 +86,10 @@
 #include "misc.h"
 #include "circular_buffer.h"
 #include "binary_io.h"
+#include "memory_io.h"
+#include "thread_name.h"
+#include "vertex_cache.h"
+#include "triangle_codec.h"
 
 std::map<std::string, MesherType> MesherTypeWrapper::getNameMap()
 {
@@ -95,124 +108,691 @@ std::string ChunkNamer::operator()(const ChunkId &chunkId) const
     return nameStream.str();
 }
 
+/// Largest value representable in a fixed-point vertex format
+static double vertexFormatMax(FastPly::VertexFormat format)
+{
+    switch (format)
+    {
+    case FastPly::VERTEX_FORMAT_UINT16: return std::numeric_limits<std::tr1::uint16_t>::max();
+    case FastPly::VERTEX_FORMAT_UINT32: return std::numeric_limits<std::tr1::uint32_t>::max();
+    default: return 1.0;
+    }
+}
+
+/**
+ * Implementation of @ref VertexQuantizer::operator() for the fixed-point
+ * formats, with @a T being the type of each coordinate.
+ */
+template<typename T>
+static void quantizeVertices(
+    const boost::array<float, 3> *in, std::size_t n,
+    double scale, const double bias[3], char *out)
+{
+    const double maxValue = std::numeric_limits<T>::max();
+    const double invScale = 1.0 / scale;
+    for (std::size_t i = 0; i < n; i++)
+    {
+        T q[3];
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            double v = std::floor((in[i][j] - bias[j]) * invScale + 0.5);
+            v = std::min(std::max(v, 0.0), maxValue);
+            q[j] = T(v);
+        }
+        // out is not necessarily aligned for T
+        std::memcpy(out + i * sizeof(q), q, sizeof(q));
+    }
+}
+
+/**
+ * Implementation of @ref VertexQuantizer::decode for the fixed-point
+ * formats, with @a T being the type of each coordinate.
+ */
+template<typename T>
+static void dequantizeVertices(
+    const char *in, std::size_t n,
+    double scale, const double bias[3], boost::array<float, 3> *out)
+{
+    for (std::size_t i = 0; i < n; i++)
+    {
+        T q[3];
+        std::memcpy(q, in + i * sizeof(q), sizeof(q));
+        for (unsigned int j = 0; j < 3; j++)
+            out[i][j] = q[j] * scale + bias[j];
+    }
+}
+
+VertexQuantizer::VertexQuantizer() : format(FastPly::VERTEX_FORMAT_FLOAT32), scale(1.0)
+{
+    std::fill(bias, bias + 3, 0.0);
+}
+
+VertexQuantizer::VertexQuantizer(
+    FastPly::VertexFormat format, const Grid &grid,
+    const Grid::size_type lower[3], const Grid::size_type upper[3])
+    : format(format), scale(1.0)
+{
+    Grid::size_type cells = 1;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        MLSGPU_ASSERT(lower[i] <= upper[i], std::invalid_argument);
+        cells = std::max(cells, upper[i] - lower[i]);
+        bias[i] = double(grid.getReference()[i])
+            + double(grid.getSpacing()) * (double(lower[i]) + grid.getExtent(i).first);
+    }
+    if (format != FastPly::VERTEX_FORMAT_FLOAT32)
+        scale = double(grid.getSpacing()) * cells / vertexFormatMax(format);
+}
+
+void VertexQuantizer::operator()(const boost::array<float, 3> *in, std::size_t n, char *out) const
+{
+    switch (format)
+    {
+    case FastPly::VERTEX_FORMAT_FLOAT32:
+        std::memcpy(out, in, n * sizeof(in[0]));
+        break;
+    case FastPly::VERTEX_FORMAT_UINT16:
+        quantizeVertices<std::tr1::uint16_t>(in, n, scale, bias, out);
+        break;
+    case FastPly::VERTEX_FORMAT_UINT32:
+        quantizeVertices<std::tr1::uint32_t>(in, n, scale, bias, out);
+        break;
+    }
+}
+
+void VertexQuantizer::decode(const char *in, std::size_t n, boost::array<float, 3> *out) const
+{
+    switch (format)
+    {
+    case FastPly::VERTEX_FORMAT_FLOAT32:
+        std::memcpy(out, in, n * sizeof(out[0]));
+        break;
+    case FastPly::VERTEX_FORMAT_UINT16:
+        dequantizeVertices<std::tr1::uint16_t>(in, n, scale, bias, out);
+        break;
+    case FastPly::VERTEX_FORMAT_UINT32:
+        dequantizeVertices<std::tr1::uint32_t>(in, n, scale, bias, out);
+        break;
+    }
+}
+
+bool chunkMortonLess(const ChunkId &a, const ChunkId &b)
+{
+    /* The order is decided by the axis whose coordinates first differ
+     * in the most significant bit, which avoids forming the codes.
+     */
+    unsigned int axis = 0;
+    Grid::size_type diff = 0;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        const Grid::size_type d = a.coords[i] ^ b.coords[i];
+        if (diff < d && diff < (d ^ diff))
+        {
+            axis = i;
+            diff = d;
+        }
+    }
+    return a.coords[axis] < b.coords[axis];
+}
+
+/// Write @a s as a JSON string literal
+static void writeJsonString(std::ostream &out, const std::string &s)
+{
+    out << '"';
+    for (std::string::const_iterator i = s.begin(); i != s.end(); ++i)
+    {
+        const unsigned char c = *i;
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c)
+                << std::dec << std::setfill(' ');
+        else
+            out << c;
+    }
+    out << '"';
+}
+
+/// Orders (chunk ID, index) pairs by @ref chunkMortonLess on the IDs
+static bool chunkOrderLess(const std::pair<ChunkId, std::size_t> &a, const std::pair<ChunkId, std::size_t> &b)
+{
+    return chunkMortonLess(a.first, b.first);
+}
+
+/// Orders index entries by @ref chunkMortonLess
+static bool chunkIndexEntryLess(const ChunkIndexEntry &a, const ChunkIndexEntry &b)
+{
+    return chunkMortonLess(a.chunkId, b.chunkId);
+}
+
+VertexQuantizer MesherBase::getVertexQuantizer(const ChunkId &id) const
+{
+    const FastPly::VertexFormat format = getVertexFormat();
+    if (format == FastPly::VERTEX_FORMAT_FLOAT32)
+        return VertexQuantizer();
+
+    Grid::size_type lower[3], upper[3];
+    getChunkCells(id, lower, upper);
+    return VertexQuantizer(format, grid, lower, upper);
+}
+
+void MesherBase::getChunkCells(const ChunkId &id, Grid::size_type lower[3], Grid::size_type upper[3]) const
+{
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        const Grid::size_type cells = grid.numCells(i);
+        if (chunkCells == 0)
+        {
+            lower[i] = 0;
+            upper[i] = cells;
+        }
+        else
+        {
+            const std::tr1::uint64_t start = std::tr1::uint64_t(id.coords[i]) * chunkCells;
+            lower[i] = std::min(start, std::tr1::uint64_t(cells));
+            upper[i] = std::min(start + chunkCells, std::tr1::uint64_t(cells));
+        }
+    }
+}
+
+void MesherBase::getChunkKeyBase(const ChunkId &id, cl_ulong base[3]) const
+{
+    /* Blocks at a coarser level can stick out slightly beyond a chunk, so
+     * leave a quarter of the key period below it. A single chunk covers a
+     * grid that fits in the period and starts at the edge of the grid.
+     */
+    const cl_ulong margin = chunkCells == 0 ? 0 : cl_ulong(1) << (Marching::KEY_AXIS_BITS - 2);
+    Grid::size_type lower[3], upper[3];
+    getChunkCells(id, lower, upper);
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        const cl_ulong start = 2 * (cl_ulong(lower[i]) + keyCellOffset[i]);
+        base[i] = start > margin ? start - margin : 0;
+    }
+}
+
+bool MesherBase::getTileKey(const cl_ulong base[3], const cl_uint local[3], TileBoundary::Key &key) const
+{
+    bool onFace = false;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        const std::tr1::int64_t low = grid.getExtent(i).first;
+        const std::tr1::int64_t high = grid.getExtent(i).second;
+        // Key fields count from the low extent of the key grid
+        const std::tr1::int64_t keyLow = low - std::tr1::int64_t(keyCellOffset[i]);
+        key[i] = 2 * keyLow + std::tr1::int64_t(base[i]) + local[i];
+        if (key[i] == 2 * low || key[i] == 2 * high)
+            onFace = true;
+    }
+    return onFace;
+}
+
+ChunkIndexEntry MesherBase::makeChunkIndexEntry(
+    const ChunkId &id, const std::string &filename,
+    std::tr1::uint64_t offset, std::tr1::uint64_t size,
+    std::tr1::uint64_t vertices, std::tr1::uint64_t triangles) const
+{
+    ChunkIndexEntry entry;
+    entry.chunkId = id;
+    entry.filename = filename;
+    entry.offset = offset;
+    entry.size = size;
+    entry.vertices = vertices;
+    entry.triangles = triangles;
+
+    Grid::size_type lower[3], upper[3];
+    getChunkCells(id, lower, upper);
+    float lowerWorld[3], upperWorld[3];
+    grid.getVertex(lower[0], lower[1], lower[2], lowerWorld);
+    grid.getVertex(upper[0], upper[1], upper[2], upperWorld);
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        entry.lower[i] = lowerWorld[i];
+        entry.upper[i] = upperWorld[i];
+    }
+    return entry;
+}
+
+void MesherBase::writeChunkIndex(std::vector<ChunkIndexEntry> entries) const
+{
+    std::ostringstream out;
+    out.imbue(std::locale::classic());
+    out.precision(9);
+    out << "{\n  \"version\": 1,\n  \"chunks\": [";
+    std::stable_sort(entries.begin(), entries.end(), chunkIndexEntryLess);
+    for (std::size_t pos = 0; pos < entries.size(); pos++)
+    {
+        const ChunkIndexEntry &e = entries[pos];
+        out << (pos == 0 ? "\n" : ",\n")
+            << "    { \"coords\": ["
+            << e.chunkId.coords[0] << ", " << e.chunkId.coords[1] << ", " << e.chunkId.coords[2] << "]"
+            << ", \"file\": ";
+        writeJsonString(out, e.filename);
+        out << ", \"offset\": " << e.offset
+            << ", \"size\": " << e.size
+            << ", \"vertices\": " << e.vertices
+            << ", \"triangles\": " << e.triangles
+            << ", \"lower\": [" << e.lower[0] << ", " << e.lower[1] << ", " << e.lower[2] << "]"
+            << ", \"upper\": [" << e.upper[0] << ", " << e.upper[1] << ", " << e.upper[2] << "] }";
+    }
+    out << "\n  ]\n}\n";
+
+    const std::string &path = getChunkIndex();
+    try
+    {
+        boost::filesystem::ofstream file(path);
+        if (!file)
+            throw std::ios::failure("Could not open file");
+        file.exceptions(std::ios::failbit | std::ios::badbit);
+        file << out.str();
+        file.close();
+    }
+    catch (std::ios::failure &e)
+    {
+        throw boost::enable_error_info(e)
+            << boost::errinfo_errno(errno)
+            << boost::errinfo_file_name(path);
+    }
+}
 
 OOCMesher::TmpWriterItem::TmpWriterItem()
     : vertices("mem.OOCMesher::TmpWriterItem::vertices"),
+    packedVertices("mem.OOCMesher::TmpWriterItem::packedVertices"),
     triangles("mem.OOCMesher::TmpWriterItem::triangles"),
     vertexRanges("mem.OOCMesher::TmpWriterItem::vertexRanges"),
-    triangleRanges("mem.OOCMesher::TmpWriterItem::triangleRanges")
+    triangleRanges("mem.OOCMesher::TmpWriterItem::triangleRanges"),
+    clumps("mem.OOCMesher::TmpWriterItem::clumps"),
+    verticesOffset(0), trianglesOffset(0), clumpsOffset(0), bytes(0)
+{
+}
+
+std::size_t OOCMesher::TmpWriterItem::dataBytes() const
 {
+    return vertices.size() * sizeof(vertex_type)
+        + packedVertices.size()
+        + triangles.size() * sizeof(triangle_type)
+        + clumps.size() * sizeof(Chunk::Clump);
 }
 
+namespace
+{
+
+/// Writes all of @a bufs at @a offset, or terminates the program
+void writeTmp(const BinaryWriter &file, const std::vector<BinaryWriter::ConstBuffer> &bufs,
+              BinaryWriter::offset_type offset)
+{
+    if (bufs.empty())
+        return;
+    std::size_t expected = 0;
+    BOOST_FOREACH(const BinaryWriter::ConstBuffer &b, bufs)
+        expected += b.count;
+    try
+    {
+        if (file.writev(&bufs[0], bufs.size(), offset) != expected)
+            throw boost::enable_error_info(std::ios::failure("Short write"))
+                << boost::errinfo_file_name(file.filename());
+    }
+    catch (std::exception &e)
+    {
+        Log::log[Log::error] << "Failed while writing temporary files: "
+            << e.what() << std::endl;
+        std::exit(1);
+    }
+}
+
+} // anonymous namespace
+
 void OOCMesher::TmpWriterWorker::operator()(TmpWriterItem &item)
 {
     Timeplot::Action timer("compute", getTimeplotWorker(), owner.getComputeStat());
     typedef std::pair<std::size_t, std::size_t> range;
+    BinaryWriter::ConstBuffer buf;
+
+    bufs.clear();
+    if (!item.packedVertices.empty())
+    {
+        buf.buf = &item.packedVertices[0];
+        buf.count = item.packedVertices.size();
+        bufs.push_back(buf);
+    }
     BOOST_FOREACH(const range &r, item.vertexRanges)
     {
-        verticesFile.write(reinterpret_cast<char *>(&item.vertices[r.first]),
-                           (r.second - r.first) * sizeof(vertex_type));
+        if (r.second > r.first)
+        {
+            buf.buf = &item.vertices[r.first];
+            buf.count = (r.second - r.first) * sizeof(vertex_type);
+            bufs.push_back(buf);
+        }
+    }
+    writeTmp(*owner.verticesFile, bufs, item.verticesOffset);
+
+    if (owner.compressTriangles)
+        writeEncodedTriangles(item);
+    else
+    {
+        bufs.clear();
+        BOOST_FOREACH(const range &r, item.triangleRanges)
+        {
+            if (r.second > r.first)
+            {
+                buf.buf = &item.triangles[r.first];
+                buf.count = (r.second - r.first) * sizeof(triangle_type);
+                bufs.push_back(buf);
+            }
+        }
+        writeTmp(*owner.trianglesFile, bufs, item.trianglesOffset);
     }
+
+    bufs.clear();
+    if (!item.clumps.empty())
+    {
+        buf.buf = &item.clumps[0];
+        buf.count = item.clumps.size() * sizeof(Chunk::Clump);
+        bufs.push_back(buf);
+    }
+    writeTmp(*owner.clumpsFile, bufs, item.clumpsOffset);
+}
+
+void OOCMesher::TmpWriterWorker::writeEncodedTriangles(TmpWriterItem &item)
+{
+    typedef std::pair<std::size_t, std::size_t> range;
+
+    std::size_t numTriangles = 0;
     BOOST_FOREACH(const range &r, item.triangleRanges)
     {
-        trianglesFile.write(reinterpret_cast<char *>(&item.triangles[r.first]),
-                            (r.second - r.first) * sizeof(triangle_type));
+        if (r.second > r.first)
+            numTriangles += r.second - r.first;
     }
-    if (!verticesFile || !trianglesFile)
+    if (numTriangles == 0)
+        return;
+
+    encoded.resize(TriangleCodec::maxEncodedSize(numTriangles * 3));
+    blocks.clear();
+    std::tr1::uint64_t firstTriangle = item.trianglesOffset / sizeof(triangle_type);
+    std::size_t pos = 0;
+    BOOST_FOREACH(const range &r, item.triangleRanges)
     {
-        Log::log[Log::error] << "Failed while writing temporary files: "
-            << boost::system::errc::make_error_code((boost::system::errc::errc_t) errno).message() << std::endl;
-        std::exit(1);
+        if (r.second > r.first)
+        {
+            TriangleBlock block;
+            block.firstTriangle = firstTriangle;
+            block.offset = pos;
+            block.bytes = TriangleCodec::encode(
+                (r.second - r.first) * 3,
+                reinterpret_cast<const std::tr1::uint32_t *>(&item.triangles[r.first]),
+                &encoded[pos]);
+            blocks.push_back(block);
+            pos += block.bytes;
+            firstTriangle += r.second - r.first;
+        }
+    }
+
+    BinaryWriter::ConstBuffer buf;
+    buf.buf = &encoded[0];
+    buf.count = pos;
+    bufs.clear();
+    bufs.push_back(buf);
+    writeTmp(*owner.trianglesFile, bufs, owner.addTriangleBlocks(blocks, pos));
+    Statistics::getStatistic<Statistics::Counter>("mesher.tmp.triangles.raw").add(numTriangles * sizeof(triangle_type));
+    Statistics::getStatistic<Statistics::Counter>("mesher.tmp.triangles.encoded").add(pos);
+}
+
+OOCMesher::TmpWriterWorkerGroup::TmpWriterWorkerGroup(std::size_t numWorkers, std::size_t slots)
+    : WorkerGroup<TmpWriterItem, TmpWriterWorker, TmpWriterWorkerGroup>("tmpwriter", numWorkers),
+    minWorkers(numWorkers),
+    writerType(SYSCALL_WRITER),
+    compressTriangles(false),
+    triangleBlocks("mem.OOCMesher::TmpWriterWorkerGroup::triangleBlocks"),
+    trianglesBytes(0),
+    pendingBytes(0)
+{
+    MLSGPU_ASSERT(numWorkers > 0, std::invalid_argument);
+    for (std::size_t i = 0; i < numWorkers; i++)
+        addWorker(new TmpWriterWorker(*this, i));
+    setSlots(slots);
+}
+
+void OOCMesher::TmpWriterWorkerGroup::setSlots(std::size_t slots)
+{
+    MLSGPU_ASSERT(!running(), state_error);
+    MLSGPU_ASSERT(numWorkers() < slots, std::invalid_argument);
+    if (itemAllocator && itemAllocator->size() == slots)
+        return;
+    itemAllocator.reset(new CircularBufferBase("mem.OOCMesher::TmpWriterWorkerGroup::itemAllocator", slots));
+    itemPool.resize(slots);
+    for (std::size_t i = 0; i < slots; i++)
+        if (!itemPool[i])
+            itemPool[i] = boost::make_shared<TmpWriterItem>();
+}
+
+void OOCMesher::TmpWriterWorkerGroup::setMaxWorkers(std::size_t maxWorkers)
+{
+    MLSGPU_ASSERT(!running(), state_error);
+    if (maxWorkers <= numWorkers())
+        return;
+    while (numWorkers() < maxWorkers)
+        addWorker(new TmpWriterWorker(*this, numWorkers()));
+    setElastic(minWorkers);
+}
+
+std::size_t OOCMesher::TmpWriterWorkerGroup::getPendingBytes() const
+{
+    boost::lock_guard<boost::mutex> lock(pendingMutex);
+    return pendingBytes;
+}
+
+void OOCMesher::TmpWriterWorkerGroup::setWriterType(WriterType type)
+{
+    writerType = (type == ZSTD_WRITER) ? SYSCALL_WRITER : type;
+}
+
+std::tr1::uint64_t OOCMesher::TmpWriterWorkerGroup::addTriangleBlocks(
+    const std::vector<TriangleBlock> &blocks, std::tr1::uint64_t bytes)
+{
+    boost::lock_guard<boost::mutex> lock(triangleBlocksMutex);
+    const std::tr1::uint64_t offset = trianglesBytes;
+    BOOST_FOREACH(TriangleBlock block, blocks)
+    {
+        block.offset += offset;
+        triangleBlocks.push_back(block);
     }
+    trianglesBytes += bytes;
+    return offset;
+}
+
+const OOCMesher::TriangleBlock &OOCMesher::TmpWriterWorkerGroup::findTriangles(
+    std::tr1::uint64_t firstTriangle) const
+{
+    TriangleBlock key;
+    key.firstTriangle = firstTriangle;
+    Statistics::Container::vector<TriangleBlock>::const_iterator pos
+        = std::lower_bound(triangleBlocks.begin(), triangleBlocks.end(), key);
+    MLSGPU_ASSERT(pos != triangleBlocks.end() && pos->firstTriangle == firstTriangle, std::out_of_range);
+    return *pos;
 }
 
-OOCMesher::TmpWriterWorkerGroup::TmpWriterWorkerGroup(std::size_t slots)
-    : WorkerGroup<TmpWriterItem, TmpWriterWorker, TmpWriterWorkerGroup>("tmpwriter", 1),
-    itemAllocator("mem.OOCMesher::TmpWriterWorkerGroup::itemAllocator", slots)
+void OOCMesher::TmpWriterWorkerGroup::openFiles(bool truncate)
 {
-    addWorker(new TmpWriterWorker(*this, verticesFile, trianglesFile));
-    for (std::size_t i = 0; i < itemAllocator.size(); i++)
-        itemPool.push_back(boost::make_shared<TmpWriterItem>());
+    verticesFile.reset(createWriter(writerType));
+    verticesFile->setTruncate(truncate);
+    verticesFile->open(verticesPath);
+    trianglesFile.reset(createWriter(writerType));
+    trianglesFile->setTruncate(truncate);
+    trianglesFile->open(trianglesPath);
+    clumpsFile.reset(createWriter(writerType));
+    clumpsFile->setTruncate(truncate);
+    clumpsFile->open(clumpsPath);
 }
 
 void OOCMesher::TmpWriterWorkerGroup::start()
 {
-    createTmpFile(verticesPath, verticesFile);
-    createTmpFile(trianglesPath, trianglesFile);
+    boost::filesystem::ofstream dummy;
+    createTmpFile(verticesPath, dummy);
+    dummy.close();
+    createTmpFile(trianglesPath, dummy);
+    dummy.close();
+    createTmpFile(clumpsPath, dummy);
+    dummy.close();
+    triangleBlocks.clear();
+    trianglesBytes = 0;
+    openFiles(true);
+    WorkerGroup<TmpWriterItem, TmpWriterWorker, TmpWriterWorkerGroup>::start();
+}
+
+void OOCMesher::TmpWriterWorkerGroup::start(
+    std::tr1::uint64_t verticesSize, std::tr1::uint64_t trianglesSize, std::tr1::uint64_t clumpsSize)
+{
+    MLSGPU_ASSERT(!verticesPath.empty() && !trianglesPath.empty(), state_error);
+    boost::filesystem::resize_file(verticesPath, verticesSize);
+    boost::filesystem::resize_file(trianglesPath, trianglesSize);
+    if (clumpsPath.empty())
+    {
+        // Snapshot from before clump records were spilled
+        MLSGPU_ASSERT(clumpsSize == 0, state_error);
+        boost::filesystem::ofstream dummy;
+        createTmpFile(clumpsPath, dummy);
+        dummy.close();
+    }
+    else
+        boost::filesystem::resize_file(clumpsPath, clumpsSize);
+    if (compressTriangles)
+        trianglesBytes = trianglesSize;
+    openFiles(false);
     WorkerGroup<TmpWriterItem, TmpWriterWorker, TmpWriterWorkerGroup>::start();
 }
 
 void OOCMesher::TmpWriterWorkerGroup::stopPostJoin()
 {
-    verticesFile.close();
-    trianglesFile.close();
-    if (!verticesFile || !trianglesFile)
+    try
+    {
+        verticesFile->close();
+        trianglesFile->close();
+        clumpsFile->close();
+    }
+    catch (std::exception &e)
     {
         Log::log[Log::error] << "Failed while writing temporary files: "
-            << boost::system::errc::make_error_code((boost::system::errc::errc_t) errno).message() << std::endl;
+            << e.what() << std::endl;
         std::exit(1);
     }
+    verticesFile.reset();
+    trianglesFile.reset();
+    clumpsFile.reset();
+    // Items may finish out of order
+    std::sort(triangleBlocks.begin(), triangleBlocks.end());
 }
 
 boost::shared_ptr<OOCMesher::TmpWriterItem> OOCMesher::TmpWriterWorkerGroup::get(Timeplot::Worker &tworker, std::size_t size)
 {
     (void) size;
-    CircularBufferBase::Allocation alloc = itemAllocator.allocate(tworker, 1, &getStat);
+    CircularBufferBase::Allocation alloc = itemAllocator->allocate(tworker, 1, &getStat);
     boost::shared_ptr<TmpWriterItem> item = itemPool[alloc.get()];
     item->alloc = alloc;
     return item;
 }
 
+void OOCMesher::TmpWriterWorkerGroup::push(Timeplot::Worker &tworker, boost::shared_ptr<TmpWriterItem> item)
+{
+    item->bytes = item->dataBytes();
+    {
+        boost::lock_guard<boost::mutex> lock(pendingMutex);
+        pendingBytes += item->bytes;
+    }
+    WorkerGroup<TmpWriterItem, TmpWriterWorker, TmpWriterWorkerGroup>::push(tworker, item);
+}
+
 void OOCMesher::TmpWriterWorkerGroup::freeItem(boost::shared_ptr<TmpWriterItem> item)
 {
+    {
+        boost::lock_guard<boost::mutex> lock(pendingMutex);
+        pendingBytes -= item->bytes;
+    }
+    item->bytes = 0;
     item->vertices.clear();
+    item->packedVertices.clear();
     item->triangles.clear();
     item->vertexRanges.clear();
     item->triangleRanges.clear();
-    itemAllocator.free(item->alloc);
+    item->clumps.clear();
+    itemAllocator->free(item->alloc);
 }
 
-const int OOCMesher::reorderSlots = 3;
+const int OOCMesher::tmpWriterWorkers = 2;
 
 OOCMesher::OOCMesher(FastPly::Writer &writer, const Namer &namer)
     : MesherBase(writer, namer),
-    tmpNodes("mem.OOCMesher::tmpNodes"),
-    tmpClumpId("mem.OOCMesher::tmpClumpId"),
     tmpVertexLabel("mem.OOCMesher::tmpVertexLabel"),
     tmpFirstVertex("mem.OOCMesher::tmpFirstVertex"),
     tmpNextVertex("mem.OOCMesher::tmpNextVertex"),
     tmpFirstTriangle("mem.OOCMesher::tmpFirstTriangle"),
     tmpNextTriangle("mem.OOCMesher::tmpNextTriangle"),
+    scratchPool("mem.OOCMesher::scratch"),
+    partial(false),
+    progress(0),
+    snapshotted(false),
+    retainFiles(false),
+    tmpWriter(std::max(std::size_t(tmpWriterWorkers), getTmpFileDirCount()),
+              std::max(std::size_t(tmpWriterWorkers), getTmpFileDirCount()) + 1),
+    chunks("mem.OOCMesher::chunks"),
     clumps("mem.OOCMesher::clumps"),
+    streamedFiles(0)
+{
+}
+
+OOCMesher::KeyTile::KeyTile(cl_ulong id)
+    : id(id),
     clumpIdMap("mem.OOCMesher::clumpIdMap"),
-    retainFiles(false),
-    tmpWriter(reorderSlots),
-    chunks("mem.OOCMesher::chunks")
+    sharedKeys("mem.OOCMesher::sharedKeys")
+{
+}
+
+OOCMesher::KeyTile &OOCMesher::getKeyTile(cl_ulong id)
+{
+    std::pair<std::map<cl_ulong, std::size_t>::iterator, bool> added
+        = keyTileIndex.insert(std::make_pair(id, keyTiles.size()));
+    if (added.second)
+        keyTiles.push_back(new KeyTile(id));
+    return keyTiles[added.first->second];
+}
+
+cl_ulong OOCMesher::keyTileId(cl_ulong key, const cl_ulong base[3], cl_uint *local)
 {
+    const unsigned int bits = Marching::KEY_AXIS_BITS;
+    const cl_ulong mask = (cl_ulong(1) << bits) - 1;
+    cl_ulong id = 0;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        const cl_ulong rel = ((key >> (i * bits)) - base[i]) & mask;
+        id |= ((base[i] + rel) >> bits) << (i * bits);
+        if (local != NULL)
+            local[i] = rel;
+    }
+    return id;
 }
 
 OOCMesher::~OOCMesher()
 {
+    stopStreaming();
     if (tmpWriter.running())
         tmpWriter.stop();
 
     if (!retainFiles)
     {
-        boost::filesystem::path verticesTmpPath = tmpWriter.getVerticesPath();
-        boost::filesystem::path trianglesTmpPath = tmpWriter.getTrianglesPath();
-        if (!verticesTmpPath.empty())
+        const boost::filesystem::path tmpPaths[3] =
         {
-            boost::system::error_code ec;
-            remove(verticesTmpPath, ec);
-            if (ec)
-                Log::log[Log::warn] << "Could not delete " << verticesTmpPath.string() << ": " << ec.message() << std::endl;
-        }
-        if (!trianglesTmpPath.empty())
+            tmpWriter.getVerticesPath(),
+            tmpWriter.getTrianglesPath(),
+            tmpWriter.getClumpsPath()
+        };
+        for (unsigned int i = 0; i < 3; i++)
         {
-            boost::system::error_code ec;
-            remove(trianglesTmpPath, ec);
-            if (ec)
-                Log::log[Log::warn] << "Could not delete " << trianglesTmpPath.string() << ": " << ec.message() << std::endl;
+            if (!tmpPaths[i].empty())
+            {
+                boost::system::error_code ec;
+                remove(tmpPaths[i], ec);
+                if (ec)
+                    Log::log[Log::warn] << "Could not delete " << tmpPaths[i].string() << ": " << ec.message() << std::endl;
+            }
         }
     }
 }
@@ -221,7 +801,7 @@ void OOCMesher::computeLocalComponents(
     std::size_t numVertices,
     std::size_t numTriangles,
     const triangle_type *triangles,
-    Statistics::Container::vector<UnionFind::Node<std::tr1::int32_t> > &nodes)
+    LocalNodes &nodes)
 {
     nodes.clear();
     nodes.resize(numVertices);
@@ -234,31 +814,24 @@ void OOCMesher::computeLocalComponents(
     }
 }
 
-void OOCMesher::updateGlobalClumps(
+void OOCMesher::computeLocalClumps(
     std::size_t numTriangles,
-    const Statistics::Container::vector<UnionFind::Node<std::tr1::int32_t> > &nodes,
+    const LocalNodes &nodes,
     const triangle_type *triangles,
-    Statistics::Container::PODBuffer<clump_id> &clumpId)
+    LocalClumpIds &clumpId,
+    LocalClumps &localClumps)
 {
     std::size_t numVertices = nodes.size();
 
     // Allocate clumps for the local components
     clumpId.reserve(numVertices, false);
+    localClumps.clear();
     for (std::size_t i = 0; i < numVertices; i++)
     {
         if (nodes[i].isRoot())
         {
-            if (clumps.size() >= boost::make_unsigned<clump_id>::type(std::numeric_limits<clump_id>::max()))
-            {
-                /* Ideally this would throw, but it's called from a worker
-                 * thread and there is no easy way to immediately notify the
-                 * master thread that it should shut everything down.
-                 */
-                std::cerr << "There were too many connected components.\n";
-                std::exit(1);
-            }
-            clumpId[i] = clumps.size();
-            clumps.push_back(Clump(nodes[i].size()));
+            clumpId[i] = localClumps.size();
+            localClumps.push_back(Clump(nodes[i].size()));
         }
     }
 
@@ -272,30 +845,110 @@ void OOCMesher::updateGlobalClumps(
     // Compute triangle counts for the clumps
     for (std::size_t i = 0; i < numTriangles; i++)
     {
-        Clump &clump = clumps[clumpId[triangles[i][0]]];
+        Clump &clump = localClumps[clumpId[triangles[i][0]]];
         clump.triangles++;
     }
 }
 
+std::size_t OOCMesher::discardLocalClumps(
+    std::tr1::uint64_t minVertices,
+    HostKeyMesh &mesh,
+    LocalClumpIds &clumpId,
+    LocalClumps &localClumps,
+    LocalClumpIds &clumpRemap,
+    LocalClumpIds &vertexRemap)
+{
+    const std::size_t numClumps = localClumps.size();
+    const std::size_t numVertices = mesh.numVertices();
+    const std::size_t numInternalVertices = mesh.numInternalVertices();
+    const std::size_t numExternalVertices = mesh.numExternalVertices();
+
+    // Mark the clumps that reach the block boundary, since they may continue elsewhere
+    clumpRemap.reserve(numClumps, false);
+    std::fill(clumpRemap.data(), clumpRemap.data() + numClumps, 0);
+    for (std::size_t i = numInternalVertices; i < numVertices; i++)
+        clumpRemap[clumpId[i]] = 1;
+
+    clump_id kept = 0;
+    for (std::size_t i = 0; i < numClumps; i++)
+    {
+        if (clumpRemap[i] || localClumps[i].vertices >= minVertices)
+        {
+            clumpRemap[i] = kept;
+            localClumps[kept] = localClumps[i];
+            kept++;
+        }
+        else
+            clumpRemap[i] = -1;
+    }
+    const std::size_t discarded = numClumps - kept;
+    if (discarded == 0)
+        return 0;
+    localClumps.erase(localClumps.begin() + kept, localClumps.end());
+
+    /* Compact the vertices in place. The external vertices all survive, so
+     * they stay at the end and the keys still line up with them.
+     */
+    vertexRemap.reserve(numVertices, false);
+    std::size_t outVertices = 0;
+    for (std::size_t i = 0; i < numVertices; i++)
+    {
+        const clump_id cid = clumpRemap[clumpId[i]];
+        if (cid >= 0)
+        {
+            vertexRemap[i] = outVertices;
+            mesh.vertices[outVertices] = mesh.vertices[i];
+            clumpId[outVertices] = cid;
+            outVertices++;
+        }
+        else
+            vertexRemap[i] = -1;
+    }
+
+    std::size_t outTriangles = 0;
+    for (std::size_t i = 0; i < mesh.numTriangles(); i++)
+    {
+        if (vertexRemap[mesh.triangles[i][0]] >= 0)
+        {
+            for (unsigned int j = 0; j < 3; j++)
+                mesh.triangles[outTriangles][j] = vertexRemap[mesh.triangles[i][j]];
+            outTriangles++;
+        }
+    }
+
+    mesh.assign(outVertices, outTriangles, outVertices - numExternalVertices);
+    return discarded;
+}
+
 void OOCMesher::updateClumpKeyMap(
+    const cl_ulong base[3],
     std::size_t numVertices,
     std::size_t numExternalVertices,
     const cl_ulong *keys,
-    const Statistics::Container::PODBuffer<clump_id> &clumpId)
+    const LocalClumpIds &clumpId,
+    clump_id clumpIdFirst)
 {
     const std::size_t numInternalVertices = numVertices - numExternalVertices;
 
+    // A block almost always falls in a single tile, so remember the last one
+    KeyTile *tile = NULL;
     for (std::size_t i = 0; i < numExternalVertices; i++)
     {
         cl_ulong key = keys[i];
-        clump_id cid = clumpId[i + numInternalVertices];
+        clump_id cid = clumpIdFirst + clumpId[i + numInternalVertices];
+
+        const cl_ulong tileId = keyTileId(key, base);
+        if (tile == NULL || tile->id != tileId)
+            tile = &getKeyTile(tileId);
 
-        std::pair<Statistics::Container::unordered_map<cl_ulong, clump_id>::const_iterator, bool> added;
-        added = clumpIdMap.insert(std::make_pair(key, cid));
+        std::pair<clump_id_map_type::value_type *, bool> added;
+        added = tile->clumpIdMap.insert(std::make_pair(key, cid));
         if (!added.second)
         {
             // Unified two external vertices. Also need to unify their clumps.
             clump_id cid2 = added.first->second;
+            if (getStitchSeams())
+                tile->sharedKeys.insert(std::make_pair(key, true));
             UnionFind::merge(clumps, cid, cid2);
             // They will both have counted the common vertex, so we need to
             // subtract it.
@@ -310,22 +963,42 @@ void OOCMesher::flushBuffer(Timeplot::Worker &tworker)
     if (!reorderBuffer)
         return;
     Statistics::Timer flushTimer("mesher.flush");
+    const bool packed = getVertexFormat() != FastPly::VERTEX_FORMAT_FLOAT32;
+    const std::size_t vertexSize = FastPly::vertexFormatSize(getVertexFormat());
+    reorderBuffer->verticesOffset = writtenVerticesTmp * (packed ? vertexSize : sizeof(vertex_type));
+    reorderBuffer->trianglesOffset = writtenTrianglesTmp * sizeof(triangle_type);
+    reorderBuffer->clumpsOffset = writtenClumpsTmp * sizeof(Chunk::Clump);
     BOOST_FOREACH(Chunk &chunk, chunks)
     {
         if (!chunk.bufferedClumps.empty())
         {
+            // The records for this chunk are contiguous within the item
+            chunk.clumpExtents.push_back(Chunk::clump_extent_type(
+                    writtenClumpsTmp, chunk.bufferedClumps.size()));
+            writtenClumpsTmp += chunk.bufferedClumps.size();
             BOOST_FOREACH(const Chunk::Clump &clump, chunk.bufferedClumps)
             {
                 const std::size_t numVertices = clump.numInternalVertices + clump.numExternalVertices;
                 const std::tr1::uint64_t firstVertex = writtenVerticesTmp;
                 const std::tr1::uint64_t firstTriangle = writtenTrianglesTmp;
-                reorderBuffer->vertexRanges.push_back(std::make_pair(
-                        clump.firstVertex, clump.firstVertex + numVertices));
+                if (packed)
+                {
+                    Statistics::Container::vector<char> &out = reorderBuffer->packedVertices;
+                    const std::size_t pos = out.size();
+                    out.resize(pos + numVertices * vertexSize);
+                    if (numVertices > 0)
+                        chunk.quantizer(&reorderBuffer->vertices[clump.firstVertex], numVertices, &out[pos]);
+                }
+                else
+                {
+                    reorderBuffer->vertexRanges.push_back(std::make_pair(
+                            clump.firstVertex, clump.firstVertex + numVertices));
+                }
                 reorderBuffer->triangleRanges.push_back(std::make_pair(
                         clump.firstTriangle, clump.firstTriangle + clump.numTriangles));
                 writtenVerticesTmp += numVertices;
                 writtenTrianglesTmp += clump.numTriangles;
-                chunk.clumps.push_back(Chunk::Clump(
+                reorderBuffer->clumps.push_back(Chunk::Clump(
                     firstVertex,
                     clump.numInternalVertices,
                     clump.numExternalVertices,
@@ -342,7 +1015,7 @@ void OOCMesher::flushBuffer(Timeplot::Worker &tworker)
 
 void OOCMesher::updateLocalClumps(
     Chunk &chunk,
-    const Statistics::Container::PODBuffer<clump_id> &globalClumpId,
+    const LocalClumpIds &clumpId,
     clump_id clumpIdFirst,
     clump_id clumpIdLast,
     HostKeyMesh &mesh,
@@ -361,14 +1034,14 @@ void OOCMesher::updateLocalClumps(
 
     for (std::tr1::int32_t i = (std::tr1::int32_t) numVertices - 1; i >= 0; i--)
     {
-        clump_id cid = globalClumpId[i] - clumpIdFirst;
+        clump_id cid = clumpId[i];
         tmpNextVertex[i] = tmpFirstVertex[cid];
         tmpFirstVertex[cid] = i;
     }
 
     for (std::tr1::int32_t i = (std::tr1::int32_t) mesh.numTriangles() - 1; i >= 0; i--)
     {
-        clump_id cid = globalClumpId[mesh.triangles[i][0]] - clumpIdFirst;
+        clump_id cid = clumpId[mesh.triangles[i][0]];
         tmpNextTriangle[i] = tmpFirstTriangle[cid];
         tmpFirstTriangle[cid] = i;
     }
@@ -377,9 +1050,18 @@ void OOCMesher::updateLocalClumps(
 
     if (reorderBuffer)
     {
-        if ((numVertices + reorderBuffer->vertices.size()) * sizeof(vertex_type)
-            + (mesh.numTriangles() + reorderBuffer->triangles.size()) * sizeof(triangle_type)
-            > getReorderCapacity() / reorderSlots)
+        /* The capacity is shared between the buffer being filled and the
+         * items still being written, so the buffer may grow into whatever
+         * the writers are not holding. If the writers have run dry, a
+         * buffer of a slot's share is flushed early to keep them busy.
+         */
+        const std::size_t buffered = reorderBuffer->dataBytes();
+        const std::size_t incoming = numVertices * sizeof(vertex_type)
+            + mesh.numTriangles() * sizeof(triangle_type);
+        const std::size_t pending = tmpWriter.getPendingBytes();
+        const std::size_t available = getReorderCapacity() > pending ? getReorderCapacity() - pending : 0;
+        if (buffered + incoming > available
+            || (pending == 0 && buffered >= getReorderCapacity() / tmpWriter.numSlots()))
             flushBuffer(tworker);
     }
     if (!reorderBuffer)
@@ -400,7 +1082,7 @@ void OOCMesher::updateLocalClumps(
             if (std::size_t(vid) >= numInternalVertices)
             {
                 // external vertex
-                std::pair<Chunk::vertex_id_map_type::iterator, bool> added;
+                std::pair<Chunk::vertex_id_map_type::value_type *, bool> added;
                 added = chunk.vertexIdMap.insert(
                     std::make_pair(mesh.vertexKeys[vid - numInternalVertices],
                                    (std::tr1::uint32_t) ~chunk.numExternalVertices));
@@ -446,26 +1128,60 @@ void OOCMesher::updateLocalClumps(
 
 void OOCMesher::add(MesherWork &work, Timeplot::Worker &tworker)
 {
-    if (work.chunkId.gen >= chunks.size())
-        chunks.resize(work.chunkId.gen + 1);
-    Chunk &chunk = chunks[work.chunkId.gen];
-    chunk.chunkId = work.chunkId;
-
     HostKeyMesh &mesh = work.mesh;
 
+    /* Local component labelling only depends on this block, so it is done
+     * before taking the lock. The buffers are per-call so that concurrent
+     * calls do not share them, and come from an arena so that they do not
+     * go through the heap for every block.
+     */
+    Statistics::ArenaPool::Lease scratch(scratchPool);
+    LocalNodes nodes(scratch.allocator<UnionFind::Node<std::tr1::int32_t> >());
+    LocalClumpIds clumpId(scratch.allocator<clump_id>());
+    LocalClumps localClumps(scratch.allocator<Clump>());
+
     if (work.hasEvents)
         work.trianglesEvent.wait();
-    clump_id oldClumps = clumps.size();
-    computeLocalComponents(mesh.numVertices(), mesh.numTriangles(), mesh.triangles, tmpNodes);
-    updateGlobalClumps(mesh.numTriangles(), tmpNodes, mesh.triangles, tmpClumpId);
-
+    computeLocalComponents(mesh.numVertices(), mesh.numTriangles(), mesh.triangles, nodes);
+    computeLocalClumps(mesh.numTriangles(), nodes, mesh.triangles, clumpId, localClumps);
     if (work.hasEvents)
+    {
         work.vertexKeysEvent.wait();
-    updateClumpKeyMap(mesh.numVertices(), mesh.numExternalVertices(), mesh.vertexKeys, tmpClumpId);
-
-    if (work.hasEvents)
         work.verticesEvent.wait();
-    updateLocalClumps(chunk, tmpClumpId, oldClumps, clumps.size(), mesh, tworker);
+    }
+    if (getPruneMinVertices() > 0)
+    {
+        LocalClumpIds clumpRemap(scratch.allocator<clump_id>());
+        LocalClumpIds vertexRemap(scratch.allocator<clump_id>());
+        const std::size_t discarded = discardLocalClumps(
+            getPruneMinVertices(), mesh, clumpId, localClumps, clumpRemap, vertexRemap);
+        if (discarded > 0)
+            Statistics::getStatistic<Statistics::Counter>("mesher.discarded.components").add(discarded);
+    }
+
+    boost::lock_guard<boost::mutex> lock(addMutex);
+    if (work.chunkId.gen >= chunks.size())
+        chunks.resize(work.chunkId.gen + 1);
+    Chunk &chunk = chunks[work.chunkId.gen];
+    chunk.chunkId = work.chunkId;
+    chunk.quantizer = getVertexQuantizer(work.chunkId);
+
+    const clump_id oldClumps = clumps.size();
+    if (localClumps.size() > boost::make_unsigned<clump_id>::type(std::numeric_limits<clump_id>::max() - oldClumps))
+    {
+        /* Ideally this would throw, but it's called from a worker
+         * thread and there is no easy way to immediately notify the
+         * master thread that it should shut everything down.
+         */
+        std::cerr << "There were too many connected components.\n";
+        std::exit(1);
+    }
+    clumps.insert(clumps.end(), localClumps.begin(), localClumps.end());
+
+    cl_ulong base[3];
+    getChunkKeyBase(work.chunkId, base);
+    updateClumpKeyMap(base, mesh.numVertices(), mesh.numExternalVertices(), mesh.vertexKeys, clumpId, oldClumps);
+    updateLocalClumps(chunk, clumpId, oldClumps, clumps.size(), mesh, tworker);
 }
 
 MesherBase::InputFunctor OOCMesher::functor(unsigned int pass)
@@ -474,18 +1190,450 @@ MesherBase::InputFunctor OOCMesher::functor(unsigned int pass)
     (void) pass;
     assert(pass == 0);
 
-    writtenVerticesTmp = 0;
-    writtenTrianglesTmp = 0;
-    tmpWriter.start();
+    if (partial)
+    {
+        // Continuing from a snapshot
+        restartTmpWriter();
+    }
+    else
+    {
+        writtenVerticesTmp = 0;
+        writtenTrianglesTmp = 0;
+        writtenClumpsTmp = 0;
+        tmpWriter.setWriterType(getTmpWriterType());
+        tmpWriter.setCompressTriangles(getTmpCompress());
+        tmpWriter.setMaxWorkers(getTmpWriterMaxThreads());
+        tmpWriter.setSlots(std::max(std::size_t(getReorderSlots()), tmpWriter.numWorkers() + 1));
+        tmpWriter.start();
+    }
+    if (getStreamChunks() && !streamThread)
+        streamThread.reset(new boost::thread(boost::bind(&OOCMesher::streamWorker, this)));
 
     return boost::bind(&OOCMesher::add, this, _1, _2);
 }
 
+void OOCMesher::releaseChunk(ChunkId::gen_type gen)
+{
+    boost::lock_guard<boost::mutex> lock(addMutex);
+    /* The welding map is only needed to weld later blocks of the same chunk,
+     * except that seam stitching in finalize also reads it.
+     */
+    if (gen < chunks.size() && !getStitchSeams())
+    {
+        collectTileBoundary(chunks[gen]);
+        chunks[gen].vertexIdMap.clear();
+        Statistics::getStatistic<Statistics::Counter>("mesher.chunks.released").add(1);
+        if (streamThread)
+        {
+            Chunk &chunk = chunks[gen];
+            if (getStreamDirect() && chunk.clumps.empty() && chunk.clumpExtents.empty())
+            {
+                boost::shared_ptr<DirectChunk> direct = boost::make_shared<DirectChunk>();
+                takeBufferedChunk(chunk, *direct);
+                directChunks[gen] = direct;
+            }
+            streamQueue.push(gen);
+        }
+    }
+}
+
+void OOCMesher::takeBufferedChunk(Chunk &chunk, DirectChunk &out)
+{
+    MLSGPU_ASSERT(chunk.clumps.empty() && chunk.clumpExtents.empty(), state_error);
+    const bool packed = getVertexFormat() != FastPly::VERTEX_FORMAT_FLOAT32;
+    const std::size_t vertexSize = packed ? FastPly::vertexFormatSize(getVertexFormat()) : sizeof(vertex_type);
+
+    out.chunk = chunk;
+    out.chunk.bufferedClumps.clear();
+    out.chunk.clumps.reserve(chunk.bufferedClumps.size());
+    BOOST_FOREACH(const Chunk::Clump &clump, chunk.bufferedClumps)
+    {
+        const std::size_t numVertices = clump.numInternalVertices + clump.numExternalVertices;
+        const std::size_t firstVertex = out.vertices.size() / vertexSize;
+        const std::size_t firstTriangle = out.triangles.size();
+        if (numVertices > 0)
+        {
+            // Encoded as flushBuffer would for the temporary file
+            out.vertices.resize((firstVertex + numVertices) * vertexSize);
+            const vertex_type *in = &reorderBuffer->vertices[clump.firstVertex];
+            char *dst = &out.vertices[firstVertex * vertexSize];
+            if (packed)
+                chunk.quantizer(in, numVertices, dst);
+            else
+                std::memcpy(dst, in, numVertices * vertexSize);
+        }
+        out.triangles.insert(out.triangles.end(),
+                             reorderBuffer->triangles.begin() + clump.firstTriangle,
+                             reorderBuffer->triangles.begin() + (clump.firstTriangle + clump.numTriangles));
+        out.chunk.clumps.push_back(Chunk::Clump(
+                firstVertex,
+                clump.numInternalVertices,
+                clump.numExternalVertices,
+                firstTriangle,
+                clump.numTriangles,
+                clump.globalId));
+    }
+    // flushBuffer only writes the buffered clumps, so their data is now skipped
+    chunk.bufferedClumps.clear();
+    Statistics::getStatistic<Statistics::Counter>("mesher.chunks.direct").add(1);
+}
+
+void OOCMesher::streamWorker()
+{
+    thread_set_name("stream");
+    Timeplot::Worker tworker("stream");
+    while (true)
+    {
+        boost::optional<ChunkId::gen_type> gen = streamQueue.pop();
+        if (!gen)
+            break;
+        std::vector<ChunkId::gen_type> gens(1, *gen);
+        while (streamQueue.tryPop(gen))
+            gens.push_back(*gen);
+        if (streamError)
+            continue;  // keep draining, so that finalize can report the error
+        try
+        {
+            writeStreamed(tworker, gens);
+        }
+        catch (...)
+        {
+            streamError = boost::current_exception();
+        }
+    }
+}
+
+void OOCMesher::writeStreamed(Timeplot::Worker &tworker, const std::vector<ChunkId::gen_type> &gens)
+{
+    Timeplot::Action action("stream", tworker, "mesher.stream.time");
+
+    /* Copies are taken since add may grow the chunk list while they are
+     * written. Released chunks receive no more data, and have already
+     * dropped their welding maps, so the copies are small.
+     */
+    Statistics::Container::vector<Chunk> batch("mem.OOCMesher::streamBatch");
+    std::vector<boost::shared_ptr<DirectChunk> > direct;
+    kept_clumps_type kept("mem.OOCMesher::streamKept");
+    {
+        boost::lock_guard<boost::mutex> lock(addMutex);
+        batch.reserve(gens.size());
+        BOOST_FOREACH(ChunkId::gen_type gen, gens)
+        {
+            std::map<ChunkId::gen_type, boost::shared_ptr<DirectChunk> >::iterator pos = directChunks.find(gen);
+            if (pos != directChunks.end())
+            {
+                direct.push_back(pos->second);
+                directChunks.erase(pos);
+            }
+            else
+                batch.push_back(chunks[gen]);
+        }
+        if (!batch.empty())
+        {
+            flushBuffer(tworker);
+            tmpWriter.stop();
+            restartTmpWriter();
+        }
+        // The threshold does not depend on the total when streaming
+        getKeptClumps(getPruneThresholdVertices(0), kept);
+    }
+
+    if (!batch.empty())
+    {
+        boost::scoped_ptr<BinaryReader> verticesTmpRead(openTmpReader(tmpWriter.getVerticesPath()));
+        boost::scoped_ptr<BinaryReader> trianglesTmpRead(openTmpReader(tmpWriter.getTrianglesPath()));
+        boost::scoped_ptr<BinaryReader> clumpsTmpRead(createReader(SYSCALL_READER));
+        clumpsTmpRead->open(tmpWriter.getClumpsPath());
+        writeStreamedBatch(tworker, batch, kept,
+                           verticesTmpRead.get(), trianglesTmpRead.get(), clumpsTmpRead.get());
+    }
+
+    BOOST_FOREACH(const boost::shared_ptr<DirectChunk> &d, direct)
+    {
+        ByteArrayReader verticesRead(d->vertices.empty() ? NULL : &d->vertices[0], d->vertices.size());
+        ByteArrayReader trianglesRead(
+            d->triangles.empty() ? NULL : reinterpret_cast<const char *>(&d->triangles[0]),
+            d->triangles.size() * sizeof(triangle_type));
+        verticesRead.open("vertices");
+        trianglesRead.open("triangles");
+        Statistics::Container::vector<Chunk> one("mem.OOCMesher::streamBatch");
+        one.push_back(d->chunk);
+        writeStreamedBatch(tworker, one, kept, &verticesRead, &trianglesRead, NULL);
+    }
+
+    boost::lock_guard<boost::mutex> lock(addMutex);
+    BOOST_FOREACH(ChunkId::gen_type gen, gens)
+        chunks[gen].streamed = true;
+    Statistics::getStatistic<Statistics::Counter>("mesher.chunks.streamed").add(gens.size());
+}
+
+void OOCMesher::writeStreamedBatch(
+    Timeplot::Worker &tworker,
+    const Statistics::Container::vector<Chunk> &batch,
+    const kept_clumps_type &kept,
+    BinaryReader *verticesRead, BinaryReader *trianglesRead, BinaryReader *clumpsRead)
+{
+    WriteState state;
+    state.verticesTmpRead = verticesRead;
+    state.trianglesTmpRead = trianglesRead;
+    state.clumpsTmpRead = clumpsRead;
+    state.chunks = &batch;
+    state.kept = &kept;
+    state.asyncMem = getAsyncMem(batch, kept, clumpsRead);
+    state.progress = NULL;
+    state.clumpThreads = 1;
+    state.nextChunk = 0;
+    state.lastChunk = batch.size();
+    for (std::size_t i = 0; i < batch.size(); i++)
+        state.order.push_back(i);
+    streamedFiles += writeChunks(tworker, getWriter(), state);
+    streamedIndex.insert(streamedIndex.end(), state.index.begin(), state.index.end());
+}
+
+void OOCMesher::stopStreaming()
+{
+    if (streamThread)
+    {
+        streamQueue.stop();
+        streamThread->join();
+        streamThread.reset();
+    }
+}
+
+void OOCMesher::restartTmpWriter()
+{
+    const bool packed = getVertexFormat() != FastPly::VERTEX_FORMAT_FLOAT32;
+    const std::size_t vertexSize = packed ? FastPly::vertexFormatSize(getVertexFormat()) : sizeof(vertex_type);
+    tmpWriter.setWriterType(getTmpWriterType());
+    tmpWriter.setMaxWorkers(getTmpWriterMaxThreads());
+    tmpWriter.setSlots(std::max(std::size_t(getReorderSlots()), tmpWriter.numWorkers() + 1));
+    const std::tr1::uint64_t trianglesSize = tmpWriter.getCompressTriangles()
+        ? tmpWriter.getTrianglesBytes() : writtenTrianglesTmp * sizeof(triangle_type);
+    tmpWriter.start(writtenVerticesTmp * vertexSize, trianglesSize,
+                    writtenClumpsTmp * sizeof(Chunk::Clump));
+}
+
+namespace
+{
+
+/// Bits per axis in a global vertex key
+const unsigned int keyAxisBits = Marching::KEY_AXIS_BITS;
+
+/// Field of @a key for one axis, which is twice the coordinate in the finest grid
+inline cl_uint keyField(cl_ulong key, unsigned int axis)
+{
+    return (key >> (axis * keyAxisBits)) & ((cl_ulong(1) << keyAxisBits) - 1);
+}
+
+/**
+ * Coarsening level of the grid that produced a vertex key. The field for the
+ * axis of the edge holding the vertex is odd in the grid that produced it,
+ * and is scaled up by 2<sup>level</sup> (see @ref Marching::generate), while
+ * the other fields are even multiples of the same power of two.
+ */
+inline unsigned int keyLevel(cl_ulong key)
+{
+    const cl_uint bits = keyField(key, 0) | keyField(key, 1) | keyField(key, 2);
+    unsigned int level = 0;
+    while (level < keyAxisBits && !((bits >> level) & 1))
+        level++;
+    return level;
+}
+
+/// Candidate vertex for @ref OOCMesher::stitchChunkSeams
+struct SeamVertex
+{
+    cl_ulong key;
+    cl_ulong tile;              ///< Key tile (see @ref OOCMesher::keyTileId)
+    cl_uint local[3];           ///< Key fields unwrapped relative to the chunk
+    std::tr1::uint32_t index;   ///< Index among the external vertices of the chunk
+    unsigned int level;         ///< Value of @ref keyLevel
+    cl_ulong cell;              ///< Packed coordinates of the search cell containing the vertex
+
+    bool operator<(const SeamVertex &other) const { return cell < other.cell; }
+};
+
+/// Orders indices into a vector of @ref SeamVertex from coarsest to finest
+class CoarserFirst
+{
+private:
+    const std::vector<SeamVertex> &vertices;
+public:
+    explicit CoarserFirst(const std::vector<SeamVertex> &vertices) : vertices(vertices) {}
+
+    bool operator()(std::size_t a, std::size_t b) const
+    {
+        return vertices[a].level > vertices[b].level;
+    }
+};
+
+} // anonymous namespace
+
+void OOCMesher::stitchChunkSeams(Chunk &chunk)
+{
+    /* Keys are compared using fields unwrapped relative to the chunk, so
+     * that a seam that crosses a key tile boundary is still found.
+     */
+    cl_ulong base[3];
+    getChunkKeyBase(chunk.chunkId, base);
+
+    std::vector<SeamVertex> candidates;
+    unsigned int maxLevel = 0;
+    for (Chunk::vertex_id_map_type::const_iterator i = chunk.vertexIdMap.begin();
+         i != chunk.vertexIdMap.end(); ++i)
+    {
+        SeamVertex v;
+        v.tile = keyTileId(i->first, base, v.local);
+        if (getKeyTile(v.tile).sharedKeys.find(i->first) != NULL)
+            continue;
+        v.key = i->first;
+        v.index = ~i->second;
+        v.level = keyLevel(v.key);
+        maxLevel = std::max(maxLevel, v.level);
+        candidates.push_back(v);
+    }
+    chunk.vertexIdMap.clear();
+    if (maxLevel == 0)
+        return; // everything is at the finest level, so there are no seams
+
+    /* Search cells span two of the coarsest cells, so matches are always in
+     * the same or an adjacent search cell.
+     */
+    const unsigned int cellShift = maxLevel + 2;
+    for (std::size_t i = 0; i < candidates.size(); i++)
+    {
+        SeamVertex &v = candidates[i];
+        v.cell = 0;
+        for (unsigned int j = 0; j < 3; j++)
+            v.cell |= cl_ulong(v.local[j] >> cellShift) << (j * keyAxisBits);
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    /* Process coarser vertices first, so that the target of a snap has
+     * already been resolved if it was itself snapped to an even coarser one.
+     */
+    std::vector<std::size_t> order(candidates.size());
+    for (std::size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), CoarserFirst(candidates));
+
+    std::tr1::uint64_t snapped = 0;
+    BOOST_FOREACH(std::size_t ai, order)
+    {
+        const SeamVertex &a = candidates[ai];
+        const cl_uint *fa = a.local;
+
+        const SeamVertex *best = NULL;
+        std::tr1::uint64_t bestDist = 0;
+        for (int dz = -1; dz <= 1; dz++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    const int d[3] = {dx, dy, dz};
+                    SeamVertex probe;
+                    probe.cell = 0;
+                    bool valid = true;
+                    for (unsigned int j = 0; j < 3; j++)
+                    {
+                        cl_long c = cl_long(fa[j] >> cellShift) + d[j];
+                        if (c < 0)
+                            valid = false;
+                        probe.cell |= cl_ulong(c) << (j * keyAxisBits);
+                    }
+                    if (!valid)
+                        continue;
+
+                    std::pair<std::vector<SeamVertex>::const_iterator,
+                              std::vector<SeamVertex>::const_iterator> range
+                        = std::equal_range(candidates.begin(), candidates.end(), probe);
+                    for (std::vector<SeamVertex>::const_iterator b = range.first; b != range.second; ++b)
+                    {
+                        if (b->level <= a.level)
+                            continue;
+                        const cl_uint coarseCell = cl_uint(2) << b->level;
+                        bool onPlane = false;
+                        bool near = true;
+                        std::tr1::uint64_t dist = 0;
+                        for (unsigned int j = 0; j < 3; j++)
+                        {
+                            const cl_uint fb = b->local[j];
+                            // Wrapping preserves the alignment of the fields
+                            if (fa[j] == fb && (keyField(b->key, j) & (coarseCell - 1)) == 0)
+                                onPlane = true;
+                            const cl_uint delta = fa[j] > fb ? fa[j] - fb : fb - fa[j];
+                            if (delta > coarseCell)
+                                near = false;
+                            dist += std::tr1::uint64_t(delta) * delta;
+                        }
+                        if (onPlane && near && (best == NULL || dist < bestDist))
+                        {
+                            best = &*b;
+                            bestDist = dist;
+                        }
+                    }
+                }
+
+        if (best != NULL)
+        {
+            const Chunk::seam_map_type::value_type *target = chunk.seams.find(best->index);
+            chunk.seams.insert(std::make_pair(a.index, target != NULL ? target->second : best->index));
+            clump_id ca = getKeyTile(a.tile).clumpIdMap.find(a.key)->second;
+            clump_id cb = getKeyTile(best->tile).clumpIdMap.find(best->key)->second;
+            UnionFind::merge(clumps, ca, cb);
+            snapped++;
+        }
+    }
+    Statistics::getStatistic<Statistics::Variable>("mesher.seams.snapped").add(snapped);
+}
+
+void OOCMesher::collectTileBoundary(Chunk &chunk)
+{
+    if (getTileBoundary().empty())
+        return;
+
+    cl_ulong base[3];
+    getChunkKeyBase(chunk.chunkId, base);
+    for (Chunk::vertex_id_map_type::const_iterator i = chunk.vertexIdMap.begin();
+         i != chunk.vertexIdMap.end(); ++i)
+    {
+        cl_uint local[3];
+        keyTileId(i->first, base, local);
+        TileBoundary::Vertex v;
+        if (getTileKey(base, local, v.key))
+        {
+            v.file = 0;
+            v.index = ~i->second;
+            chunk.boundary.push_back(v);
+        }
+    }
+}
+
 void OOCMesher::finalize(Timeplot::Worker &tworker)
 {
+    stopStreaming();
+    if (streamError)
+        boost::rethrow_exception(streamError);
     flushBuffer(tworker);
     if (tmpWriter.running())
         tmpWriter.stop();
+    if (!getTileBoundary().empty())
+    {
+        // Chunks released by releaseChunk have already been collected
+        BOOST_FOREACH(Chunk &chunk, chunks)
+        {
+            collectTileBoundary(chunk);
+            if (!getStitchSeams())
+                chunk.vertexIdMap.clear();
+        }
+    }
+    if (getStitchSeams())
+    {
+        Statistics::Timer timer("mesher.seams.time");
+        BOOST_FOREACH(Chunk &chunk, chunks)
+            stitchChunkSeams(chunk);
+        BOOST_FOREACH(KeyTile &tile, keyTiles)
+            tile.sharedKeys.clear();
+    }
 }
 
 void OOCMesher::getStatistics(
@@ -508,7 +1656,7 @@ void OOCMesher::getStatistics(
             totalVertices += clump.vertices;
         }
     }
-    thresholdVertices = std::tr1::uint64_t(totalVertices * getPruneThreshold());
+    thresholdVertices = getPruneThresholdVertices(totalVertices);
 
     BOOST_FOREACH(const Clump &clump, clumps)
     {
@@ -533,13 +1681,51 @@ void OOCMesher::getStatistics(
         registry.getStatistic<Statistics::Variable>("components.triangles.kept").add(keptTriangles);
         registry.getStatistic<Statistics::Variable>("components.total").add(totalComponents);
         registry.getStatistic<Statistics::Variable>("components.kept").add(keptComponents);
-        registry.getStatistic<Statistics::Variable>("externalvertices").add(clumpIdMap.size());
+        std::tr1::uint64_t externalVertices = 0;
+        BOOST_FOREACH(const KeyTile &tile, keyTiles)
+            externalVertices += tile.clumpIdMap.size();
+        registry.getStatistic<Statistics::Variable>("externalvertices").add(externalVertices);
+        registry.getStatistic<Statistics::Variable>("externalvertices.tiles").add(keyTiles.size());
+    }
+}
+
+void OOCMesher::getKeptClumps(std::tr1::uint64_t thresholdVertices, kept_clumps_type &kept) const
+{
+    kept.assign(clumps.size(), false);
+    for (std::size_t i = 0; i < clumps.size(); i++)
+    {
+        clump_id cid = UnionFind::findRoot(clumps, clump_id(i));
+        kept[i] = clumps[cid].vertices >= thresholdVertices;
     }
 }
 
+const OOCMesher::Chunk::clump_list_type &OOCMesher::loadChunkClumps(
+    BinaryReader *clumpsTmpRead,
+    const Chunk &chunk,
+    Chunk::clump_list_type &buffer) const
+{
+    if (chunk.clumpExtents.empty())
+        return chunk.clumps;
+
+    Statistics::Timer timer("finalize.loadClumps.time");
+    MLSGPU_ASSERT(clumpsTmpRead != NULL, state_error);
+    buffer.clear();
+    buffer.reserve(chunk.numClumps());
+    buffer.insert(buffer.end(), chunk.clumps.begin(), chunk.clumps.end());
+    BOOST_FOREACH(const Chunk::clump_extent_type &extent, chunk.clumpExtents)
+    {
+        const std::size_t pos = buffer.size();
+        buffer.resize(pos + extent.second, Chunk::Clump(0, 0, 0, 0, 0, 0));
+        clumpsTmpRead->read(&buffer[pos], extent.second * sizeof(Chunk::Clump),
+                            extent.first * sizeof(Chunk::Clump));
+    }
+    return buffer;
+}
+
 void OOCMesher::getChunkStatistics(
-    std::tr1::uint64_t thresholdVertices,
+    const kept_clumps_type &kept,
     const Chunk &chunk,
+    const Chunk::clump_list_type &chunkClumps,
     std::tr1::uint64_t &keptVertices,
     std::tr1::uint64_t &keptTriangles,
     std::tr1::uint64_t &totalExternal) const
@@ -547,11 +1733,10 @@ void OOCMesher::getChunkStatistics(
     keptVertices = 0;
     keptTriangles = 0;
     totalExternal = 0;
-    for (std::size_t j = 0; j < chunk.clumps.size(); j++)
+    for (std::size_t j = 0; j < chunkClumps.size(); j++)
     {
-        const Chunk::Clump &cc = chunk.clumps[j];
-        clump_id cid = UnionFind::findRoot(clumps, cc.globalId);
-        if (clumps[cid].vertices >= thresholdVertices)
+        const Chunk::Clump &cc = chunkClumps[j];
+        if (kept[cc.globalId])
         {
             keptVertices += cc.numInternalVertices + cc.numExternalVertices;
             keptTriangles += cc.numTriangles;
@@ -566,21 +1751,24 @@ void OOCMesher::getChunkStatistics(
     }
 }
 
-std::size_t OOCMesher::getAsyncMem(std::tr1::uint64_t thresholdVertices) const
+std::size_t OOCMesher::getAsyncMem(
+    const Statistics::Container::vector<Chunk> &source,
+    const kept_clumps_type &kept, BinaryReader *clumpsTmpRead) const
 {
+    Chunk::clump_list_type buffer("mem.OOCMesher::clumpBuffer");
+
     // Compute how much space is needed in the buffer for the async writer
     std::size_t asyncMem = 1;
-    for (std::size_t i = 0; i < chunks.size(); i++)
+    for (std::size_t i = 0; i < source.size(); i++)
     {
-        const Chunk &chunk = chunks[i];
-        for (std::size_t j = 0; j < chunk.clumps.size(); j++)
+        const Chunk::clump_list_type &chunkClumps = loadChunkClumps(clumpsTmpRead, source[i], buffer);
+        for (std::size_t j = 0; j < chunkClumps.size(); j++)
         {
-            const Chunk::Clump &cc = chunk.clumps[j];
-            clump_id cid = UnionFind::findRoot(clumps, cc.globalId);
-            if (clumps[cid].vertices >= thresholdVertices)
+            const Chunk::Clump &cc = chunkClumps[j];
+            if (kept[cc.globalId])
             {
                 const std::size_t vertices = cc.numInternalVertices + cc.numExternalVertices;
-                asyncMem = std::max(asyncMem, vertices * FastPly::Writer::vertexSize);
+                asyncMem = std::max(asyncMem, vertices * getWriter().getVertexSize());
                 asyncMem = std::max(asyncMem, cc.numTriangles * FastPly::Writer::triangleSize);
             }
         }
@@ -588,6 +1776,12 @@ std::size_t OOCMesher::getAsyncMem(std::tr1::uint64_t thresholdVertices) const
     return asyncMem;
 }
 
+void OOCMesher::checkVertexFormat(const Chunk &chunk) const
+{
+    if (chunk.quantizer.getFormat() != getVertexFormat())
+        throw std::runtime_error("Vertex format does not match the format used for the temporary files");
+}
+
 void OOCMesher::rewriteTriangles(
     std::size_t numTriangles,
     std::tr1::uint32_t externalBoundary,
@@ -623,7 +1817,8 @@ void OOCMesher::rewriteTriangles(
 
 void OOCMesher::writeChunkPrepare(
     const Chunk &chunk,
-    std::tr1::uint64_t thresholdVertices,
+    const Chunk::clump_list_type &chunkClumps,
+    const kept_clumps_type &kept,
     std::size_t chunkExternal,
     Statistics::Container::PODBuffer<std::tr1::uint32_t> &startVertex,
     Statistics::Container::PODBuffer<FastPly::Writer::size_type> &startTriangle,
@@ -633,20 +1828,19 @@ void OOCMesher::writeChunkPrepare(
 
     Statistics::Timer timer("finalize.prepare.time");
 
-    startVertex.reserve(chunk.clumps.size(), false);
-    startTriangle.reserve(chunk.clumps.size(), false);
+    startVertex.reserve(chunkClumps.size(), false);
+    startTriangle.reserve(chunkClumps.size(), false);
     externalRemap.reserve(chunkExternal, false);
 
     chunkExternal = 0; // used as a counter
     FastPly::Writer::size_type writtenVertices = 0;
     FastPly::Writer::size_type writtenTriangles = 0;
-    for (std::size_t j = 0; j < chunk.clumps.size(); j++)
+    for (std::size_t j = 0; j < chunkClumps.size(); j++)
     {
-        const Chunk::Clump &cc = chunk.clumps[j];
-        clump_id cid = UnionFind::findRoot(clumps, cc.globalId);
+        const Chunk::Clump &cc = chunkClumps[j];
         startVertex[j] = writtenVertices;
         startTriangle[j] = writtenTriangles;
-        if (clumps[cid].vertices >= thresholdVertices)
+        if (kept[cc.globalId])
         {
             writtenVertices += cc.numInternalVertices;
             writtenTriangles += cc.numTriangles;
@@ -662,28 +1856,143 @@ void OOCMesher::writeChunkPrepare(
         }
         chunkExternal += cc.numExternalVertices;
     }
+
+    // Vertices on resolution seams are replaced by the coarser vertex
+    for (Chunk::seam_map_type::const_iterator i = chunk.seams.begin(); i != chunk.seams.end(); ++i)
+        externalRemap[i->first] = externalRemap[i->second];
+}
+
+namespace
+{
+
+/// Bytes of each temporary file to hint to the reader ahead of the clump being copied
+const std::tr1::uint64_t tmpReadAhead = 16 * 1024 * 1024;
+
+/**
+ * Copy vertices from their temporary file encoding of @a inSize bytes each
+ * to the output encoding, appending a normal to each.
+ */
+void appendNormals(
+    const char *in, std::size_t n, std::size_t inSize,
+    const OOCMesher::vertex_type *normals, char *out)
+{
+    const std::size_t outSize = inSize + sizeof(normals[0]);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        std::memcpy(out + i * outSize, in + i * inSize, inSize);
+        std::memcpy(out + i * outSize + inSize, &normals[i], sizeof(normals[i]));
+    }
+}
+
+} // anonymous namespace
+
+BinaryReader *OOCMesher::openTmpReader(const boost::filesystem::path &path) const
+{
+    const bool mmap = getTmpMmap() && boost::filesystem::file_size(path) > 0;
+    std::auto_ptr<BinaryReader> reader(createReader(mmap ? MMAP_READER : SYSCALL_READER));
+    reader->open(path);
+    return reader.release();
+}
+
+void OOCMesher::findTmpTriangles(
+    const Chunk::Clump &cc, std::tr1::uint64_t &offset, std::tr1::uint64_t &bytes) const
+{
+    if (tmpWriter.getCompressTriangles() && cc.numTriangles > 0)
+    {
+        const TriangleBlock &block = tmpWriter.findTriangles(cc.firstTriangle);
+        offset = block.offset;
+        bytes = block.bytes;
+    }
+    else
+    {
+        offset = cc.firstTriangle * sizeof(triangle_type);
+        bytes = std::tr1::uint64_t(cc.numTriangles) * sizeof(triangle_type);
+    }
+}
+
+const OOCMesher::triangle_type *OOCMesher::readTmpTriangles(
+    BinaryReader &trianglesTmpRead, const Chunk::Clump &cc,
+    Statistics::Container::PODBuffer<triangle_type> &triangles,
+    Statistics::Container::PODBuffer<std::tr1::uint8_t> &encoded) const
+{
+    Statistics::Variable &readTrianglesStat = Statistics::getStatistic<Statistics::Variable>("write.readTriangles.time");
+    const char *mapped = trianglesTmpRead.data();
+
+    if (!tmpWriter.getCompressTriangles())
+    {
+        if (mapped != NULL)
+            return reinterpret_cast<const triangle_type *>(mapped + cc.firstTriangle * sizeof(triangle_type));
+        Statistics::Timer timer(readTrianglesStat);
+        triangles.reserve(cc.numTriangles, false);
+        trianglesTmpRead.read(
+            triangles.data(),
+            cc.numTriangles * sizeof(triangle_type),
+            cc.firstTriangle * sizeof(triangle_type));
+        return triangles.data();
+    }
+
+    triangles.reserve(cc.numTriangles, false);
+    if (cc.numTriangles == 0)
+        return triangles.data();
+    std::tr1::uint64_t offset, bytes;
+    findTmpTriangles(cc, offset, bytes);
+    const std::tr1::uint8_t *in;
+    if (mapped != NULL)
+        in = reinterpret_cast<const std::tr1::uint8_t *>(mapped + offset);
+    else
+    {
+        Statistics::Timer timer(readTrianglesStat);
+        encoded.reserve(bytes, false);
+        trianglesTmpRead.read(encoded.data(), bytes, offset);
+        in = encoded.data();
+    }
+    TriangleCodec::decode(
+        std::size_t(cc.numTriangles) * 3, in, bytes,
+        reinterpret_cast<std::tr1::uint32_t *>(triangles.data()));
+    return triangles.data();
 }
 
 void OOCMesher::writeChunkVertices(
     Timeplot::Worker &tworker,
     BinaryReader &verticesTmpRead,
     AsyncWriter &asyncWriter,
-    const Chunk &chunk,
-    std::tr1::uint64_t thresholdVertices,
+    FastPly::Writer &writer,
+    const Chunk::clump_list_type &chunkClumps,
+    const kept_clumps_type &kept,
     const std::tr1::uint32_t *startVertex,
+    const vertex_type *normals,
     ProgressMeter *progress,
     std::size_t firstClump, std::size_t lastClump)
 {
     Statistics::Timer timer("finalize.vertices.time");
     Statistics::Variable &readVerticesStat = Statistics::getStatistic<Statistics::Variable>("write.readVertices.time");
-
+    // The temporary file is already in the output encoding, apart from any normals
+    const std::size_t vertexSize = FastPly::vertexFormatSize(writer.getVertexFormat());
+    const std::size_t outVertexSize = writer.getVertexSize();
+    const char *mapped = verticesTmpRead.data();
+    Statistics::Container::PODBuffer<char> vertices("mem.OOCMesher::vertices");
+
+    // Clumps up to ahead have been hinted, totalling hinted bytes of which consumed have been read
+    std::size_t ahead = firstClump;
+    std::tr1::uint64_t hinted = 0, consumed = 0;
     for (std::size_t j = firstClump; j < lastClump; j++)
     {
-        const Chunk::Clump &cc = chunk.clumps[j];
-        clump_id cid = UnionFind::findRoot(clumps, cc.globalId);
-        if (clumps[cid].vertices >= thresholdVertices)
+        for (; ahead < lastClump && hinted < consumed + tmpReadAhead; ahead++)
+        {
+            const Chunk::Clump &ac = chunkClumps[ahead];
+            if (kept[ac.globalId])
+            {
+                const std::tr1::uint64_t bytes = std::tr1::uint64_t(ac.numInternalVertices + ac.numExternalVertices) * vertexSize;
+                verticesTmpRead.prefetch(ac.firstVertex * vertexSize, bytes);
+                hinted += bytes;
+            }
+        }
+
+        const Chunk::Clump &cc = chunkClumps[j];
+        if (kept[cc.globalId])
         {
             std::size_t numVertices = cc.numInternalVertices + cc.numExternalVertices;
+            consumed += numVertices * vertexSize;
             /* This test catches a corner case where a clump
              * contains only triangles built from previously emitted
              * external vertices.
@@ -691,15 +2000,35 @@ void OOCMesher::writeChunkVertices(
             if (numVertices > 0)
             {
                 boost::shared_ptr<AsyncWriterItem> item = asyncWriter.get(
-                    tworker, numVertices * sizeof(vertex_type));
+                    tworker, numVertices * outVertexSize);
+                if (normals != NULL)
+                {
+                    const char *in;
+                    if (mapped != NULL)
+                        in = mapped + cc.firstVertex * vertexSize;
+                    else
+                    {
+                        Statistics::Timer timer(readVerticesStat);
+                        vertices.reserve(numVertices * vertexSize, false);
+                        verticesTmpRead.read(vertices.data(), numVertices * vertexSize, cc.firstVertex * vertexSize);
+                        in = vertices.data();
+                    }
+                    appendNormals(in, numVertices, vertexSize, normals + startVertex[j],
+                                  reinterpret_cast<char *>(item->get()));
+                }
+                else
                 {
                     Statistics::Timer timer(readVerticesStat);
-                    verticesTmpRead.read(
-                        item->get(),
-                        numVertices * sizeof(vertex_type),
-                        cc.firstVertex * sizeof(vertex_type));
+                    if (mapped != NULL)
+                        std::memcpy(item->get(), mapped + cc.firstVertex * vertexSize,
+                                    numVertices * vertexSize);
+                    else
+                        verticesTmpRead.read(
+                            item->get(),
+                            numVertices * vertexSize,
+                            cc.firstVertex * vertexSize);
                 }
-                getWriter().writeVertices(tworker, startVertex[j], numVertices, item, asyncWriter);
+                writer.writeVertices(tworker, startVertex[j], numVertices, item, asyncWriter);
             }
             // Yes, numTriangles. That's easier to make add up to the total
             // than vertices (which share), and still a good indicator
@@ -714,8 +2043,9 @@ void OOCMesher::writeChunkTriangles(
     Timeplot::Worker &tworker,
     BinaryReader &trianglesTmpRead,
     AsyncWriter &asyncWriter,
-    const Chunk &chunk,
-    std::tr1::uint64_t thresholdVertices,
+    FastPly::Writer &writer,
+    const Chunk::clump_list_type &chunkClumps,
+    const kept_clumps_type &kept,
     std::size_t chunkExternal,
     const std::tr1::uint32_t *startVertex,
     const FastPly::Writer::size_type *startTriangle,
@@ -725,69 +2055,288 @@ void OOCMesher::writeChunkTriangles(
     std::size_t firstClump, std::size_t lastClump)
 {
     Statistics::Timer trianglesTimer("finalize.triangles.time");
-    Statistics::Variable &readTrianglesStat = Statistics::getStatistic<Statistics::Variable>("write.readTriangles.time");
     std::tr1::uint32_t externalBoundary = ~chunkExternal;
+    Statistics::Container::PODBuffer<std::tr1::uint8_t> encoded("mem.OOCMesher::encodedTriangles");
+
+    // Clumps up to ahead have been hinted, totalling hinted bytes of which consumed have been read
+    std::size_t ahead = firstClump;
+    std::tr1::uint64_t hinted = 0, consumed = 0;
 
     // Now write out the triangles
     for (std::size_t j = firstClump; j < lastClump; j++)
     {
-        const Chunk::Clump &cc = chunk.clumps[j];
-        clump_id cid = UnionFind::findRoot(clumps, cc.globalId);
-        if (clumps[cid].vertices >= thresholdVertices)
+        for (; ahead < lastClump && hinted < consumed + tmpReadAhead; ahead++)
         {
-            triangles.reserve(cc.numTriangles, false);
+            const Chunk::Clump &ac = chunkClumps[ahead];
+            if (kept[ac.globalId])
+            {
+                std::tr1::uint64_t offset, bytes;
+                findTmpTriangles(ac, offset, bytes);
+                trianglesTmpRead.prefetch(offset, bytes);
+                hinted += bytes;
+            }
+        }
+
+        const Chunk::Clump &cc = chunkClumps[j];
+        if (kept[cc.globalId])
+        {
+            std::tr1::uint64_t offset, bytes;
+            findTmpTriangles(cc, offset, bytes);
+            consumed += bytes;
+            const triangle_type *in = readTmpTriangles(trianglesTmpRead, cc, triangles, encoded);
             boost::shared_ptr<AsyncWriterItem> item = asyncWriter.get(
                 tworker, cc.numTriangles * FastPly::Writer::triangleSize);
             std::tr1::uint8_t *raw = reinterpret_cast<std::tr1::uint8_t *>(item->get());
-            {
-                Statistics::Timer timer(readTrianglesStat);
-                trianglesTmpRead.read(
-                    triangles.data(),
-                    cc.numTriangles * sizeof(triangle_type),
-                    cc.firstTriangle * sizeof(triangle_type));
-            }
 
             rewriteTriangles(
                 cc.numTriangles,
                 externalBoundary, externalRemap,
                 startVertex[j],
-                triangles.data(), raw);
+                in, raw);
 
-            getWriter().writeTrianglesRaw(tworker, startTriangle[j], cc.numTriangles, item, asyncWriter);
+            writer.writeTrianglesRaw(tworker, startTriangle[j], cc.numTriangles, item, asyncWriter);
             if (progress != NULL)
                 *progress += cc.numTriangles;
         }
     }
 }
 
-std::size_t OOCMesher::write(Timeplot::Worker &tworker, std::ostream *progressStream)
+void OOCMesher::writeChunkReordered(
+    Timeplot::Worker &tworker,
+    BinaryReader &verticesTmpRead,
+    BinaryReader &trianglesTmpRead,
+    AsyncWriter &asyncWriter,
+    FastPly::Writer &writer,
+    const Chunk::clump_list_type &chunkClumps,
+    const kept_clumps_type &kept,
+    std::size_t chunkExternal,
+    const std::tr1::uint32_t *startVertex,
+    const FastPly::Writer::size_type *startTriangle,
+    const std::tr1::uint32_t *externalRemap,
+    const vertex_type *normals,
+    Statistics::Container::PODBuffer<triangle_type> &triangles,
+    ProgressMeter *progress,
+    std::size_t firstClump, std::size_t lastClump)
 {
-    std::size_t outputFiles = 0;
+    Statistics::Timer timer("finalize.reorder.time");
+    const std::size_t vertexSize = FastPly::vertexFormatSize(writer.getVertexFormat());
+    const std::size_t outVertexSize = writer.getVertexSize();
+    const std::tr1::uint32_t externalBoundary = ~chunkExternal;
+    const char *mappedVertices = verticesTmpRead.data();
+    Statistics::Container::PODBuffer<std::tr1::uint8_t> encoded("mem.OOCMesher::encodedTriangles");
+    Statistics::Container::PODBuffer<std::tr1::uint32_t> newIndex("mem.OOCMesher::newIndex");
+    Statistics::Container::PODBuffer<char> vertices("mem.OOCMesher::vertices");
 
-    Timeplot::Action writeAction("write", tworker, "finalize.time");
-    FastPly::Writer &writer = getWriter();
+    for (std::size_t j = firstClump; j < lastClump; j++)
+    {
+        const Chunk::Clump &cc = chunkClumps[j];
+        if (!kept[cc.globalId])
+            continue;
 
-    finalize(tworker);
+        // The triangles are modified, so they are always copied
+        const triangle_type *tmpTriangles = readTmpTriangles(trianglesTmpRead, cc, triangles, encoded);
+        if (tmpTriangles != triangles.data())
+        {
+            triangles.reserve(cc.numTriangles, false);
+            std::memcpy(triangles.data(), tmpTriangles, cc.numTriangles * sizeof(triangle_type));
+        }
+        std::tr1::uint32_t *indices = reinterpret_cast<std::tr1::uint32_t *>(triangles.data());
+        VertexCache::tipsify(cc.numTriangles, indices);
+        newIndex.reserve(cc.numInternalVertices, false);
+        VertexCache::renumberVertices(cc.numTriangles, indices, 0, cc.numInternalVertices, newIndex.data());
 
-    boost::scoped_ptr<BinaryReader> verticesTmpRead(createReader(SYSCALL_READER));
-    verticesTmpRead->open(tmpWriter.getVerticesPath());
-    boost::scoped_ptr<BinaryReader> trianglesTmpRead(createReader(SYSCALL_READER));
-    trianglesTmpRead->open(tmpWriter.getTrianglesPath());
+        const std::size_t numVertices = cc.numInternalVertices + cc.numExternalVertices;
+        if (numVertices > 0)
+        {
+            const char *in;
+            if (mappedVertices != NULL)
+                in = mappedVertices + cc.firstVertex * vertexSize;
+            else
+            {
+                vertices.reserve(numVertices * vertexSize, false);
+                verticesTmpRead.read(vertices.data(), numVertices * vertexSize, cc.firstVertex * vertexSize);
+                in = vertices.data();
+            }
 
-    std::tr1::uint64_t thresholdVertices;
-    clump_id keptComponents;
-    std::tr1::uint64_t keptVertices, keptTriangles;
-    getStatistics(thresholdVertices, keptComponents, keptVertices, keptTriangles);
+            boost::shared_ptr<AsyncWriterItem> item = asyncWriter.get(
+                tworker, numVertices * outVertexSize);
+            char *out = reinterpret_cast<char *>(item->get());
+            if (normals != NULL)
+            {
+                const vertex_type *clumpNormals = normals + startVertex[j];
+                for (std::tr1::uint32_t v = 0; v < cc.numInternalVertices; v++)
+                    appendNormals(in + v * vertexSize, 1, vertexSize, clumpNormals + v,
+                                  out + newIndex.data()[v] * outVertexSize);
+                appendNormals(in + cc.numInternalVertices * vertexSize,
+                              cc.numExternalVertices, vertexSize,
+                              clumpNormals + cc.numInternalVertices,
+                              out + cc.numInternalVertices * outVertexSize);
+            }
+            else
+            {
+                for (std::tr1::uint32_t v = 0; v < cc.numInternalVertices; v++)
+                    std::memcpy(out + newIndex.data()[v] * vertexSize, in + v * vertexSize, vertexSize);
+                std::memcpy(out + cc.numInternalVertices * vertexSize,
+                            in + cc.numInternalVertices * vertexSize,
+                            cc.numExternalVertices * vertexSize);
+            }
+            writer.writeVertices(tworker, startVertex[j], numVertices, item, asyncWriter);
+        }
 
-    std::size_t asyncMem = getAsyncMem(thresholdVertices);
+        boost::shared_ptr<AsyncWriterItem> item = asyncWriter.get(
+            tworker, cc.numTriangles * FastPly::Writer::triangleSize);
+        rewriteTriangles(
+            cc.numTriangles,
+            externalBoundary, externalRemap,
+            startVertex[j],
+            triangles.data(), reinterpret_cast<std::tr1::uint8_t *>(item->get()));
+        writer.writeTrianglesRaw(tworker, startTriangle[j], cc.numTriangles, item, asyncWriter);
+
+        // Counts both passes of the unordered path
+        if (progress != NULL)
+            *progress += 2 * cc.numTriangles;
+    }
+}
 
-    boost::scoped_ptr<ProgressDisplay> progress;
-    if (progressStream != NULL)
+void OOCMesher::writeChunkNormals(
+    BinaryReader &verticesTmpRead,
+    BinaryReader &trianglesTmpRead,
+    const Chunk &chunk,
+    const Chunk::clump_list_type &chunkClumps,
+    const kept_clumps_type &kept,
+    std::size_t chunkVertices,
+    std::size_t chunkExternal,
+    const std::tr1::uint32_t *startVertex,
+    const std::tr1::uint32_t *externalRemap,
+    Statistics::Container::PODBuffer<triangle_type> &triangles,
+    Statistics::Container::PODBuffer<vertex_type> &normals)
+{
+    Statistics::Timer timer("finalize.normals.time");
+    const std::size_t vertexSize = FastPly::vertexFormatSize(chunk.quantizer.getFormat());
+    const std::tr1::uint32_t externalBoundary = ~chunkExternal;
+    const char *mappedVertices = verticesTmpRead.data();
+    Statistics::Container::PODBuffer<std::tr1::uint8_t> encoded("mem.OOCMesher::encodedTriangles");
+    Statistics::Container::PODBuffer<char> vertices("mem.OOCMesher::vertices");
+    Statistics::Container::PODBuffer<vertex_type> positions("mem.OOCMesher::positions");
+
+    positions.reserve(chunkVertices, false);
+    normals.reserve(chunkVertices, false);
+    vertex_type zero;
+    zero.assign(0.0f);
+    std::fill(normals.data(), normals.data() + chunkVertices, zero);
+
+    for (std::size_t j = 0; j < chunkClumps.size(); j++)
     {
-        *progressStream << "\nWriting file(s)\n";
-        progress.reset(new ProgressDisplay(2 * keptTriangles, *progressStream));
+        const Chunk::Clump &cc = chunkClumps[j];
+        const std::size_t numVertices = cc.numInternalVertices + cc.numExternalVertices;
+        if (!kept[cc.globalId] || numVertices == 0)
+            continue;
+        const char *in;
+        if (mappedVertices != NULL)
+            in = mappedVertices + cc.firstVertex * vertexSize;
+        else
+        {
+            vertices.reserve(numVertices * vertexSize, false);
+            verticesTmpRead.read(vertices.data(), numVertices * vertexSize, cc.firstVertex * vertexSize);
+            in = vertices.data();
+        }
+        chunk.quantizer.decode(in, numVertices, positions.data() + startVertex[j]);
+    }
+
+    for (std::size_t j = 0; j < chunkClumps.size(); j++)
+    {
+        const Chunk::Clump &cc = chunkClumps[j];
+        if (!kept[cc.globalId])
+            continue;
+        const triangle_type *in = readTmpTriangles(trianglesTmpRead, cc, triangles, encoded);
+        for (std::size_t i = 0; i < cc.numTriangles; i++)
+        {
+            std::tr1::uint32_t idx[3];
+            for (int k = 0; k < 3; k++)
+            {
+                const std::tr1::uint32_t t = in[i][k];
+                idx[k] = t > externalBoundary ? externalRemap[~t] : t + startVertex[j];
+            }
+            const vertex_type &p0 = positions[idx[0]];
+            const vertex_type &p1 = positions[idx[1]];
+            const vertex_type &p2 = positions[idx[2]];
+            float e1[3], e2[3];
+            for (int a = 0; a < 3; a++)
+            {
+                e1[a] = p1[a] - p0[a];
+                e2[a] = p2[a] - p0[a];
+            }
+            // The cross product has twice the area as its length
+            const float n[3] =
+            {
+                e1[1] * e2[2] - e1[2] * e2[1],
+                e1[2] * e2[0] - e1[0] * e2[2],
+                e1[0] * e2[1] - e1[1] * e2[0]
+            };
+            for (int k = 0; k < 3; k++)
+                for (int a = 0; a < 3; a++)
+                    normals[idx[k]][a] += n[a];
+        }
     }
 
+    for (std::size_t i = 0; i < chunkVertices; i++)
+    {
+        vertex_type &n = normals[i];
+        const float len = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (len > 0.0f)
+            for (int a = 0; a < 3; a++)
+                n[a] /= len;
+    }
+}
+
+bool OOCMesher::WriteState::popChunk(std::size_t &index)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (nextChunk >= lastChunk)
+        return false;
+    index = order[nextChunk++];
+    return true;
+}
+
+void OOCMesher::WriteState::addIndexEntry(const ChunkIndexEntry &entry)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    index.push_back(entry);
+}
+
+void OOCMesher::WriteState::addBoundary(
+    const TileBoundary::OutputFile &file,
+    const Statistics::Container::vector<TileBoundary::Vertex> &vertices,
+    const std::tr1::uint32_t *externalRemap)
+{
+    const std::tr1::uint32_t badIndex = std::numeric_limits<std::tr1::uint32_t>::max();
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    const std::tr1::uint32_t fileIndex = boundary.files.size();
+    boundary.files.push_back(file);
+    for (std::size_t i = 0; i < vertices.size(); i++)
+    {
+        const std::tr1::uint32_t index = externalRemap[vertices[i].index];
+        if (index != badIndex)
+        {
+            TileBoundary::Vertex v = vertices[i];
+            v.file = fileIndex;
+            v.index = index;
+            boundary.vertices.push_back(v);
+        }
+    }
+}
+
+void OOCMesher::WriteState::stop()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    nextChunk = lastChunk;
+}
+
+std::size_t OOCMesher::writeChunks(Timeplot::Worker &tworker, FastPly::Writer &writer, WriteState &state)
+{
+    std::size_t outputFiles = 0;
+
     /* Maps from an linear enumeration of all external vertices of a chunk to
      * the final index in the file. It is badIndex for dropped vertices,
      * although that is not actually used and could be skipped. This is declared
@@ -799,42 +2348,118 @@ std::size_t OOCMesher::write(Timeplot::Worker &tworker, std::ostream *progressSt
     // Offset to first triangle of each clump in output file
     Statistics::Container::PODBuffer<FastPly::Writer::size_type> startTriangle("mem.OOCMesher::startTriangle");
     Statistics::Container::PODBuffer<triangle_type> triangles("mem.OOCMesher::triangles");
-
-    AsyncWriter asyncWriter(1, asyncMem * 2); // * 2 to allow overlapping
+    // Normal of each vertex in the output file, if requested
+    Statistics::Container::PODBuffer<vertex_type> normals("mem.OOCMesher::normals");
+    // Clump records of the current chunk, when read from the temporary file
+    Chunk::clump_list_type clumpBuffer("mem.OOCMesher::clumpBuffer");
+    const kept_clumps_type &kept = *state.kept;
+
+    AsyncWriter asyncWriter(1, state.asyncMem * 2, // * 2 to allow overlapping
+                            getAsyncCoalesce(state.asyncMem));
     asyncWriter.start();
 
-    for (std::size_t i = 0; i < chunks.size(); i++)
+    std::size_t i;
+    while (state.popChunk(i))
     {
-        const Chunk &chunk = chunks[i];
+        const Chunk &chunk = (*state.chunks)[i];
+        const Chunk::clump_list_type &chunkClumps = loadChunkClumps(state.clumpsTmpRead, chunk, clumpBuffer);
         std::tr1::uint64_t chunkVertices, chunkTriangles, chunkExternal;
         // Note: chunkExternal includes discarded clumps, the others exclude them
-        getChunkStatistics(thresholdVertices, chunk, chunkVertices, chunkTriangles, chunkExternal);
+        getChunkStatistics(kept, chunk, chunkClumps, chunkVertices, chunkTriangles, chunkExternal);
 
         if (chunkTriangles > 0)
         {
-            const std::string filename = getOutputName(chunk.chunkId);
+            const bool container = !state.containerOffset.empty();
+            const std::string filename = container ? getChunkContainer() : getOutputName(chunk.chunkId);
+            ChunkIndexEntry entry;
             try
             {
+                checkVertexFormat(chunk);
                 writer.setNumVertices(chunkVertices);
                 writer.setNumTriangles(chunkTriangles);
-                writer.open(filename);
+                writer.setVertexTransform(chunk.quantizer.getScale(), chunk.quantizer.getBias());
+                const FastPly::Writer::size_type offset = container ? state.containerOffset[i] : 0;
+                if (!getChunkIndex().empty() || getChunkCallback())
+                {
+                    entry = makeChunkIndexEntry(
+                        chunk.chunkId, filename, offset, writer.getFileSize(),
+                        chunkVertices, chunkTriangles);
+                }
+                if (!getChunkIndex().empty())
+                    state.addIndexEntry(entry);
+                if (container)
+                    writer.open(filename, offset);
+                else
+                    writer.open(filename);
                 outputFiles++;
 
                 writeChunkPrepare(
-                    chunk, thresholdVertices, chunkExternal,
+                    chunk, chunkClumps, kept, chunkExternal,
                     startVertex, startTriangle, externalRemap);
+                if (!getTileBoundary().empty())
+                    state.addBoundary(TileBoundary::OutputFile(filename, offset), chunk.boundary, externalRemap.data());
 
-                writeChunkVertices(
-                    tworker, *verticesTmpRead, asyncWriter, chunk,
-                    thresholdVertices, startVertex.data(), progress.get(),
-                    0, chunk.clumps.size());
+                const vertex_type *chunkNormals = NULL;
+                if (writer.getVertexNormals())
+                {
+                    writeChunkNormals(
+                        *state.verticesTmpRead, *state.trianglesTmpRead,
+                        chunk, chunkClumps, kept, chunkVertices, chunkExternal,
+                        startVertex.data(), externalRemap.data(),
+                        triangles, normals);
+                    chunkNormals = normals.data();
+                }
 
-                writeChunkTriangles(
-                    tworker, *trianglesTmpRead, asyncWriter, chunk,
-                    thresholdVertices, chunkExternal,
-                    startVertex.data(), startTriangle.data(), externalRemap.data(),
-                    triangles, progress.get(),
-                    0, chunk.clumps.size());
+                if (state.clumpThreads > 1)
+                {
+                    // The positions are all known, so the clumps can be written in any order
+                    const ChunkLayout layout =
+                    {
+                        &chunkClumps, chunkExternal,
+                        startVertex.data(), startTriangle.data(), externalRemap.data(),
+                        chunkNormals
+                    };
+                    std::vector<boost::exception_ptr> errors(state.clumpThreads);
+                    boost::thread_group threads;
+                    for (std::size_t t = 0; t < state.clumpThreads; t++)
+                    {
+                        threads.create_thread(boost::bind(
+                                &OOCMesher::writeClumpsWorker, this,
+                                (unsigned int) t, boost::ref(writer), boost::cref(state),
+                                boost::cref(layout),
+                                mulDiv(chunkClumps.size(), t, state.clumpThreads),
+                                mulDiv(chunkClumps.size(), t + 1, state.clumpThreads),
+                                boost::ref(errors[t])));
+                    }
+                    threads.join_all();
+                    for (std::size_t t = 0; t < state.clumpThreads; t++)
+                        if (errors[t])
+                            boost::rethrow_exception(errors[t]);
+                }
+                else if (getReorderTriangles())
+                {
+                    writeChunkReordered(
+                        tworker, *state.verticesTmpRead, *state.trianglesTmpRead,
+                        asyncWriter, writer, chunkClumps,
+                        kept, chunkExternal,
+                        startVertex.data(), startTriangle.data(), externalRemap.data(),
+                        chunkNormals, triangles, state.progress,
+                        0, chunkClumps.size());
+                }
+                else
+                {
+                    writeChunkVertices(
+                        tworker, *state.verticesTmpRead, asyncWriter, writer, chunkClumps,
+                        kept, startVertex.data(), chunkNormals, state.progress,
+                        0, chunkClumps.size());
+
+                    writeChunkTriangles(
+                        tworker, *state.trianglesTmpRead, asyncWriter, writer, chunkClumps,
+                        kept, chunkExternal,
+                        startVertex.data(), startTriangle.data(), externalRemap.data(),
+                        triangles, state.progress,
+                        0, chunkClumps.size());
+                }
 
                 writer.close();
             }
@@ -844,10 +2469,230 @@ std::size_t OOCMesher::write(Timeplot::Worker &tworker, std::ostream *progressSt
                     << boost::errinfo_file_name(filename)
                     << boost::errinfo_errno(errno);
             }
+            if (getChunkCallback())
+                getChunkCallback()(entry);
         }
     }
     asyncWriter.stop();
+    return outputFiles;
+}
+
+void OOCMesher::writeChunksWorker(
+    unsigned int idx, FastPly::Writer &writer, WriteState &state,
+    std::size_t &outputFiles, boost::exception_ptr &error)
+{
+    thread_set_name("writer");
+    Timeplot::Worker tworker("writer", idx);
+    try
+    {
+        outputFiles = writeChunks(tworker, writer, state);
+    }
+    catch (...)
+    {
+        error = boost::current_exception();
+        state.stop();
+    }
+}
+
+void OOCMesher::writeClumpsWorker(
+    unsigned int idx, FastPly::Writer &writer, const WriteState &state,
+    const ChunkLayout &layout, std::size_t firstClump, std::size_t lastClump,
+    boost::exception_ptr &error)
+{
+    thread_set_name("writer");
+    Timeplot::Worker tworker("writer", idx);
+    try
+    {
+        Statistics::Container::PODBuffer<triangle_type> triangles("mem.OOCMesher::triangles");
+        AsyncWriter asyncWriter(1, state.asyncMem * 2, getAsyncCoalesce(state.asyncMem));
+        asyncWriter.start();
+        if (getReorderTriangles())
+        {
+            writeChunkReordered(
+                tworker, *state.verticesTmpRead, *state.trianglesTmpRead,
+                asyncWriter, writer, *layout.chunkClumps,
+                *state.kept, layout.chunkExternal,
+                layout.startVertex, layout.startTriangle, layout.externalRemap,
+                layout.normals, triangles, state.progress,
+                firstClump, lastClump);
+        }
+        else
+        {
+            writeChunkVertices(
+                tworker, *state.verticesTmpRead, asyncWriter, writer, *layout.chunkClumps,
+                *state.kept, layout.startVertex, layout.normals, state.progress,
+                firstClump, lastClump);
+
+            writeChunkTriangles(
+                tworker, *state.trianglesTmpRead, asyncWriter, writer, *layout.chunkClumps,
+                *state.kept, layout.chunkExternal,
+                layout.startVertex, layout.startTriangle, layout.externalRemap,
+                triangles, state.progress,
+                firstClump, lastClump);
+        }
+        asyncWriter.stop();
+    }
+    catch (...)
+    {
+        error = boost::current_exception();
+    }
+}
+
+std::size_t OOCMesher::write(Timeplot::Worker &tworker, std::ostream *progressStream)
+{
+    std::size_t outputFiles = 0;
+
+    Timeplot::Action writeAction("write", tworker, "finalize.time");
+
+    finalize(tworker);
+
+    boost::scoped_ptr<BinaryReader> verticesTmpRead(openTmpReader(tmpWriter.getVerticesPath()));
+    boost::scoped_ptr<BinaryReader> trianglesTmpRead(openTmpReader(tmpWriter.getTrianglesPath()));
+    // The records are read sequentially, so there is no benefit to mapping them
+    boost::scoped_ptr<BinaryReader> clumpsTmpRead;
+    if (!tmpWriter.getClumpsPath().empty())
+    {
+        clumpsTmpRead.reset(createReader(SYSCALL_READER));
+        clumpsTmpRead->open(tmpWriter.getClumpsPath());
+    }
+
+    std::tr1::uint64_t thresholdVertices;
+    clump_id keptComponents;
+    std::tr1::uint64_t keptVertices, keptTriangles;
+    getStatistics(thresholdVertices, keptComponents, keptVertices, keptTriangles);
+
+    /* The union-find tree is no longer needed once flattened, which makes
+     * room for the write buffers.
+     */
+    kept_clumps_type kept("mem.OOCMesher::kept");
+    getKeptClumps(thresholdVertices, kept);
+    Statistics::Container::vector<Clump>("mem.OOCMesher::clumps").swap(clumps);
+
+    std::size_t asyncMem = getAsyncMem(chunks, kept, clumpsTmpRead.get());
+
+    boost::scoped_ptr<ProgressDisplay> progress;
+    if (progressStream != NULL)
+    {
+        *progressStream << "\nWriting file(s)\n";
+        progress.reset(new ProgressDisplay(2 * keptTriangles, *progressStream));
+    }
+
+    WriteState state;
+    state.verticesTmpRead = verticesTmpRead.get();
+    state.trianglesTmpRead = trianglesTmpRead.get();
+    state.clumpsTmpRead = clumpsTmpRead.get();
+    state.chunks = &chunks;
+    state.kept = &kept;
+    state.asyncMem = asyncMem;
+    state.progress = progress.get();
+    state.clumpThreads = 1;
+    state.index = streamedIndex;
+    std::copy(getChunkGrid().getReference(), getChunkGrid().getReference() + 3, state.boundary.reference);
+    state.boundary.spacing = getChunkGrid().getSpacing();
+
+    /* Hand out the chunks along a Morton curve, so that the files written
+     * close together in time (and in the container) are close in space.
+     * Chunks that were streamed are already written.
+     */
+    std::vector<std::pair<ChunkId, std::size_t> > order;
+    order.reserve(chunks.size());
+    for (std::size_t i = 0; i < chunks.size(); i++)
+        if (!chunks[i].streamed)
+            order.push_back(std::make_pair(chunks[i].chunkId, i));
+    std::stable_sort(order.begin(), order.end(), chunkOrderLess);
+    state.order.reserve(order.size());
+    for (std::size_t i = 0; i < order.size(); i++)
+        state.order.push_back(order[i].second);
+    state.nextChunk = 0;
+    state.lastChunk = state.order.size();
+
+    if (!getChunkContainer().empty())
+    {
+        // The header sizes depend on the counts, so lay out all the chunks up front
+        FastPly::Writer &writer = getWriter();
+        FastPly::Writer::size_type containerSize = 0;
+        Chunk::clump_list_type clumpBuffer("mem.OOCMesher::clumpBuffer");
+        state.containerOffset.resize(chunks.size(), 0);
+        for (std::size_t i = 0; i < state.order.size(); i++)
+        {
+            const Chunk &chunk = chunks[state.order[i]];
+            const Chunk::clump_list_type &chunkClumps = loadChunkClumps(clumpsTmpRead.get(), chunk, clumpBuffer);
+            std::tr1::uint64_t chunkVertices, chunkTriangles, chunkExternal;
+            getChunkStatistics(kept, chunk, chunkClumps, chunkVertices, chunkTriangles, chunkExternal);
+            if (chunkTriangles > 0)
+            {
+                writer.setNumVertices(chunkVertices);
+                writer.setNumTriangles(chunkTriangles);
+                writer.setVertexTransform(chunk.quantizer.getScale(), chunk.quantizer.getBias());
+                state.containerOffset[state.order[i]] = containerSize;
+                containerSize += writer.getFileSize();
+            }
+        }
+        try
+        {
+            writer.createContainer(getChunkContainer(), containerSize);
+        }
+        catch (std::ios::failure &e)
+        {
+            throw boost::enable_error_info(e)
+                << boost::errinfo_file_name(getChunkContainer())
+                << boost::errinfo_errno(errno);
+        }
+    }
+
+    /* Each thread has its own asynchronous writer. The reorder buffer is no
+     * longer needed at this point, so its budget bounds the total.
+     */
+    std::size_t numThreads = std::min(std::size_t(getWriteThreads()), state.order.size());
+    numThreads = std::min(numThreads, getReorderCapacity() / (2 * asyncMem));
+    if (numThreads <= 1 && getParallelWrite())
+    {
+        /* Too few files to go around, so the clumps of each file are shared
+         * out instead. The thread that opens the file keeps its own buffer.
+         */
+        const std::size_t budget = getReorderCapacity() / (2 * asyncMem);
+        if (budget > 1)
+            state.clumpThreads = std::min(std::size_t(getWriteThreads()), budget - 1);
+    }
+    if (numThreads <= 1)
+        outputFiles = writeChunks(tworker, getWriter(), state);
+    else
+    {
+        // Each thread needs its own writer, since a writer holds one open file
+        std::vector<boost::shared_ptr<FastPly::Writer> > writers;
+        for (std::size_t i = 0; i < numThreads; i++)
+            writers.push_back(boost::make_shared<FastPly::Writer>(getWriter()));
+
+        std::vector<std::size_t> threadFiles(numThreads, 0);
+        std::vector<boost::exception_ptr> errors(numThreads);
+        boost::thread_group threads;
+        for (std::size_t i = 0; i < numThreads; i++)
+        {
+            threads.create_thread(boost::bind(
+                    &OOCMesher::writeChunksWorker, this,
+                    (unsigned int) i, boost::ref(*writers[i]), boost::ref(state),
+                    boost::ref(threadFiles[i]), boost::ref(errors[i])));
+        }
+        threads.join_all();
+
+        for (std::size_t i = 0; i < numThreads; i++)
+            if (errors[i])
+                boost::rethrow_exception(errors[i]);
+        for (std::size_t i = 0; i < numThreads; i++)
+            outputFiles += threadFiles[i];
+    }
+
+    outputFiles += streamedFiles;
+
+    if (!getChunkIndex().empty())
+        writeChunkIndex(state.index);
+    if (!getTileBoundary().empty())
+        state.boundary.save(getTileBoundary());
+
     Statistics::getStatistic<Statistics::Counter>("output.files").add(outputFiles);
+    // Any snapshot is now obsolete, so its temporary files need not be kept
+    if (snapshotted)
+        retainFiles = false;
     return outputFiles;
 }
 
@@ -855,6 +2700,7 @@ void OOCMesher::checkpoint(Timeplot::Worker &tworker, const boost::filesystem::p
 {
     retainFiles = true;
     finalize(tworker);
+    partial = false;
 
     try
     {
@@ -878,6 +2724,60 @@ std::size_t OOCMesher::resume(
     const boost::filesystem::path &path,
     std::ostream *progressStream)
 {
+    std::tr1::uint64_t snapshotProgress;
+    if (restore(tworker, path, snapshotProgress))
+        throw boost::enable_error_info(std::runtime_error("Snapshot needs the original input to continue"))
+            << boost::errinfo_file_name(path.string());
+    return write(tworker, progressStream);
+}
+
+void OOCMesher::snapshot(
+    Timeplot::Worker &tworker,
+    const boost::filesystem::path &path,
+    std::tr1::uint64_t progress)
+{
+    Statistics::Timer timer("mesher.snapshot");
+
+    /* Push out the reorder buffer and wait for the writer to drain, so that
+     * the temporary files hold exactly what the clumps refer to.
+     */
+    flushBuffer(tworker);
+    tmpWriter.stop();
+    retainFiles = true;
+    snapshotted = true;
+    partial = true;
+    this->progress = progress;
+
+    // Write to a separate file first, so that a crash never leaves a partial snapshot
+    const boost::filesystem::path tmpPath = path.string() + ".tmp";
+    try
+    {
+        boost::filesystem::ofstream dump(tmpPath);
+        if (!dump)
+            throw std::ios::failure("Could not open file");
+        boost::archive::text_oarchive archive(dump);
+        archive << *this;
+        dump.close();
+        if (!dump)
+            throw std::ios::failure("Could not write file");
+    }
+    catch (std::ios::failure &e)
+    {
+        restartTmpWriter();
+        throw boost::enable_error_info(e)
+            << boost::errinfo_errno(errno)
+            << boost::errinfo_file_name(tmpPath.string());
+    }
+    restartTmpWriter();
+    boost::filesystem::rename(tmpPath, path);
+}
+
+bool OOCMesher::restore(
+    Timeplot::Worker &tworker,
+    const boost::filesystem::path &path,
+    std::tr1::uint64_t &progress)
+{
+    (void) tworker;
     retainFiles = true; // to allow resume to be re-run
     try
     {
@@ -894,7 +2794,9 @@ std::size_t OOCMesher::resume(
             << boost::errinfo_errno(errno)
             << boost::errinfo_file_name(path.string());
     }
-    return write(tworker, progressStream);
+    snapshotted = partial;
+    progress = this->progress;
+    return partial;
 }
 
 namespace
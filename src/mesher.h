@@ -41,13 +41,16 @@
 #include <string>
 #include <iosfwd>
 #include <utility>
+#include <algorithm>
 #include <boost/array.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/optional.hpp>
+#include <boost/exception_ptr.hpp>
 #include <boost/foreach.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/archive/text_oarchive.hpp>
@@ -56,6 +59,8 @@
 #include <boost/serialization/base_object.hpp>
 #include <boost/serialization/split_free.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/utility.hpp>
+#include <boost/serialization/version.hpp>
 #include "tr1_unordered_map.h"
 #include "tr1_unordered_set.h"
 #include "marching.h"
@@ -68,9 +73,12 @@
 #include "timeplot.h"
 #include "circular_buffer.h"
 #include "chunk_id.h"
+#include "tile_boundary.h"
+#include "grid.h"
 #include "progress.h"
 
 class TestTmpWriterWorkerGroup;
+class BenchTmpWriter;
 
 namespace boost
 {
@@ -103,6 +111,40 @@ inline void serialize(Archive &ar, boost::filesystem::path &path, const unsigned
     boost::serialization::split_free(ar, path, version);
 }
 
+template<typename Archive, typename Key, typename T, typename Alloc>
+inline void save(Archive &ar, const Statistics::Container::flat_hash_map<Key, T, Alloc> &m, const unsigned int)
+{
+    typedef typename Statistics::Container::flat_hash_map<Key, T, Alloc>::const_iterator const_iterator;
+    const std::tr1::uint64_t size = m.size();
+    ar << size;
+    for (const_iterator i = m.begin(); i != m.end(); ++i)
+    {
+        ar << i->first;
+        ar << i->second;
+    }
+}
+
+template<typename Archive, typename Key, typename T, typename Alloc>
+inline void load(Archive &ar, Statistics::Container::flat_hash_map<Key, T, Alloc> &m, const unsigned int)
+{
+    std::tr1::uint64_t size;
+    ar >> size;
+    m.clear();
+    for (std::tr1::uint64_t i = 0; i < size; i++)
+    {
+        std::pair<Key, T> value;
+        ar >> value.first;
+        ar >> value.second;
+        m.insert(value);
+    }
+}
+
+template<typename Archive, typename Key, typename T, typename Alloc>
+inline void serialize(Archive &ar, Statistics::Container::flat_hash_map<Key, T, Alloc> &m, const unsigned int version)
+{
+    boost::serialization::split_free(ar, m, version);
+}
+
 } // namespace serialization
 } // namespace boost
 
@@ -124,6 +166,64 @@ public:
     static std::map<std::string, MesherType> getNameMap();
 };
 
+/**
+ * Encodes world-space vertex positions in the format chosen with
+ * @ref MesherBase::setVertexFormat. For the fixed-point formats, the full
+ * integer range spans the longest side of the bounding box of one output
+ * chunk, so the same box is used on all three axes.
+ */
+class VertexQuantizer
+{
+public:
+    /// Constructs a quantizer for @ref FastPly::VERTEX_FORMAT_FLOAT32, which leaves vertices unchanged
+    VertexQuantizer();
+
+    /**
+     * Constructs a quantizer covering a box of grid vertices.
+     * @param format    Fixed-point or floating-point format.
+     * @param grid      Grid containing all vertices.
+     * @param lower     Lowest vertex coordinates of the box, relative to @a grid.
+     * @param upper     Highest vertex coordinates of the box, relative to @a grid.
+     */
+    VertexQuantizer(FastPly::VertexFormat format, const Grid &grid,
+                    const Grid::size_type lower[3], const Grid::size_type upper[3]);
+
+    FastPly::VertexFormat getFormat() const { return format; }  ///< Return the vertex format
+    double getScale() const { return scale; }                   ///< Return the world size of one step
+    const double *getBias() const { return bias; }              ///< Return the world position of zero
+
+    /**
+     * Encode vertices. Positions outside the box are clamped to it.
+     * @param in     Vertices to encode
+     * @param n      Number of vertices
+     * @param out    Output, with space for @a n times @ref FastPly::vertexFormatSize bytes
+     */
+    void operator()(const boost::array<float, 3> *in, std::size_t n, char *out) const;
+
+    /**
+     * Decode vertices encoded by @ref operator().
+     * @param in     Encoded vertices
+     * @param n      Number of vertices
+     * @param out    Output world-space positions
+     */
+    void decode(const char *in, std::size_t n, boost::array<float, 3> *out) const;
+
+private:
+    friend class boost::serialization::access;
+
+    FastPly::VertexFormat format;
+    double scale;
+    double bias[3];
+
+    template<typename Archive>
+    void serialize(Archive &ar, const unsigned int)
+    {
+        ar & format;
+        ar & scale;
+        ar & bias;
+    }
+};
+
 /**
  * Data about a mesh passed in to a @ref MesherBase::InputFunctor. It contains
  * host mesh data that may still be being read asynchronously from a device,
@@ -178,6 +278,29 @@ public:
     ChunkNamer(const std::string &baseName) : baseName(baseName) {}
 };
 
+/**
+ * Description of one output chunk, as recorded in the index written by
+ * @ref MesherBase::writeChunkIndex.
+ */
+struct ChunkIndexEntry
+{
+    ChunkId chunkId;                  ///< Chunk that was written
+    std::string filename;             ///< File holding the chunk
+    std::tr1::uint64_t offset;        ///< Byte offset of the chunk's PLY header in @ref filename
+    std::tr1::uint64_t size;          ///< Bytes occupied by the chunk, including the header
+    std::tr1::uint64_t vertices;      ///< Number of vertices in the chunk
+    std::tr1::uint64_t triangles;     ///< Number of triangles in the chunk
+    double lower[3];                  ///< World-space lower corner of the region covered by the chunk
+    double upper[3];                  ///< World-space upper corner of the region covered by the chunk
+};
+
+/**
+ * Compare chunk IDs by the position of their coordinates along a Morton
+ * (Z-order) curve, so that chunks that are close in space tend to be close
+ * in the order.
+ */
+bool chunkMortonLess(const ChunkId &a, const ChunkId &b);
+
 /**
  * Abstract base class for output collectors for @ref Marching. This class
  * only captures the host side of the process. It needs to be wrapped in
@@ -197,7 +320,8 @@ public:
  * -# Call @ref write.
  *
  * @warning The functor is @em not required to be thread-safe. The caller must
- * serialize calls if necessary (@ref MesherGroup only uses one thread).
+ * serialize calls if necessary, unless @ref concurrentInput returns true
+ * (@ref MesherGroup only uses multiple threads in that case).
  */
 class MesherBase
 {
@@ -214,6 +338,12 @@ public:
      */
     typedef boost::function<std::string(const ChunkId &chunkId)> Namer;
 
+    /**
+     * Type of the callback set with @ref setChunkCallback. The argument
+     * describes an output file that has been completely written.
+     */
+    typedef boost::function<void(const ChunkIndexEntry &entry)> ChunkCallback;
+
     /**
      * Constructor. The mesher object retains a reference to @a writer and so it
      * must persist until the mesher is destroyed. The @a namer is copied and so
@@ -227,7 +357,11 @@ public:
      * @param namer          Callback function to assign names to output files.
      */
     MesherBase(FastPly::Writer &writer, const Namer &namer)
-        : pruneThreshold(0.0), reorderCapacity(4 * 1024 * 1024), writer(writer), namer(namer) {}
+        : pruneThreshold(0.0), pruneMinVertices(0), reorderCapacity(4 * 1024 * 1024), reorderSlots(3), writeThreads(1), stitchSeams(false), chunkCells(0),
+        tmpWriterType(SYSCALL_WRITER), tmpWriterMaxThreads(0), tmpMmap(false), tmpCompress(false), reorderTriangles(false), parallelWrite(false), streamChunks(false), streamDirect(false), writer(writer), namer(namer)
+    {
+        std::fill(keyCellOffset, keyCellOffset + 3, Grid::size_type(0));
+    }
 
     /// Virtual destructor to allow destruction via base class pointer
     virtual ~MesherBase() {}
@@ -235,6 +369,13 @@ public:
     /// Number of passes required.
     virtual unsigned int numPasses() const = 0;
 
+    /**
+     * Whether the functors returned by @ref functor may be called from several
+     * threads at once. In that case the calls also need not be ordered by
+     * chunk. The default is false.
+     */
+    virtual bool concurrentInput() const { return false; }
+
     /**
      * Sets the lower bound on component size. All components that are
      * smaller will be pruned from the output, if supported by the mesher
@@ -245,17 +386,242 @@ public:
      */
     void setPruneThreshold(double threshold) { pruneThreshold = threshold; }
 
+    /**
+     * Sets an absolute lower bound on component size, in vertices. It is
+     * combined with @ref setPruneThreshold by taking the larger of the two.
+     * Unlike the fractional threshold, it is known up front, so a mesher
+     * may discard small components as soon as it can tell that they are
+     * complete, without buffering them. The default is 0.
+     */
+    void setPruneMinVertices(std::tr1::uint64_t vertices) { pruneMinVertices = vertices; }
+
     /**
      * Sets the capacity (in bytes) of the reorder buffer, if there is one.
      */
     void setReorderCapacity(std::size_t bytes) { reorderCapacity = bytes; }
 
+    /**
+     * Sets the number of buffers into which the reorder capacity may be
+     * divided, if there is a reorder buffer. More slots let more writes to
+     * the temporary files be in flight while the mesher fills the next
+     * buffer. The default is 3.
+     */
+    void setReorderSlots(unsigned int slots) { reorderSlots = slots; }
+
+    /// Retrieve the value set with @ref setReorderSlots.
+    unsigned int getReorderSlots() const { return reorderSlots; }
+
     /// Retrieve the value set with @ref setPruneThreshold.
     double getPruneThreshold() const { return pruneThreshold; }
 
+    /// Retrieve the value set with @ref setPruneMinVertices.
+    std::tr1::uint64_t getPruneMinVertices() const { return pruneMinVertices; }
+
+    /**
+     * Sets the maximum number of output files to write concurrently, if
+     * supported by the mesher type. The default is 1.
+     */
+    void setWriteThreads(unsigned int threads) { writeThreads = threads; }
+
     /// Retrieve the value set with @ref setReorderCapacity.
     std::size_t getReorderCapacity() const { return reorderCapacity; }
 
+    /// Retrieve the value set with @ref setWriteThreads.
+    unsigned int getWriteThreads() const { return writeThreads; }
+
+    /**
+     * Sets the low-level writer for temporary files, if the mesher type uses
+     * any. The default is @ref SYSCALL_WRITER.
+     */
+    void setTmpWriterType(WriterType type) { tmpWriterType = type; }
+
+    /// Retrieve the value set with @ref setTmpWriterType.
+    WriterType getTmpWriterType() const { return tmpWriterType; }
+
+    /**
+     * Allow the threads writing temporary files, if the mesher type uses
+     * any, to grow to @a threads while their queue is backed up (see @ref
+     * WorkerGroup::setElastic). If this is no more than the fixed number of
+     * threads (the default is zero), the number stays fixed.
+     */
+    void setTmpWriterMaxThreads(unsigned int threads) { tmpWriterMaxThreads = threads; }
+
+    /// Retrieve the value set with @ref setTmpWriterMaxThreads.
+    unsigned int getTmpWriterMaxThreads() const { return tmpWriterMaxThreads; }
+
+    /**
+     * Sets whether temporary files are memory-mapped when they are read
+     * back, if the mesher type uses any. The default is false.
+     */
+    void setTmpMmap(bool mmap) { tmpMmap = mmap; }
+
+    /// Retrieve the value set with @ref setTmpMmap.
+    bool getTmpMmap() const { return tmpMmap; }
+
+    /**
+     * Sets whether triangles in the temporary files are compressed, if the
+     * mesher type uses any. This reduces the temporary I/O at some cost in
+     * CPU time. The default is false.
+     */
+    void setTmpCompress(bool compress) { tmpCompress = compress; }
+
+    /// Retrieve the value set with @ref setTmpCompress.
+    bool getTmpCompress() const { return tmpCompress; }
+
+    /**
+     * Sets whether the triangles of each clump are reordered for vertex
+     * cache locality (see @ref VertexCache::tipsify), with the internal
+     * vertices of the clump renumbered in order of first use. This is
+     * supported by @ref OOCMesher only. The default is false.
+     */
+    void setReorderTriangles(bool reorder) { reorderTriangles = reorder; }
+
+    /// Retrieve the value set with @ref setReorderTriangles.
+    bool getReorderTriangles() const { return reorderTriangles; }
+
+    /**
+     * Sets whether the clumps of an output file may be written by several
+     * threads at once (up to @ref setWriteThreads), when there are not enough
+     * output files to keep the threads busy. Each thread writes at offsets
+     * computed before any data is written, so the low-level writer must
+     * support writes in any order (which excludes @ref ZSTD_WRITER). This
+     * is supported by @ref OOCMesher only. The default is false.
+     */
+    void setParallelWrite(bool parallel) { parallelWrite = parallel; }
+
+    /// Retrieve the value set with @ref setParallelWrite.
+    bool getParallelWrite() const { return parallelWrite; }
+
+    /**
+     * Sets a file to which @ref write records an index of the output chunks
+     * (see @ref writeChunkIndex), so that consumers can find the chunk
+     * covering a region without opening every file. The default is empty,
+     * meaning that no index is written.
+     */
+    void setChunkIndex(const std::string &path) { chunkIndex = path; }
+
+    /// Retrieve the value set with @ref setChunkIndex.
+    const std::string &getChunkIndex() const { return chunkIndex; }
+
+    /**
+     * Sets a single file into which all the output chunks are written, one
+     * after another in Morton order, instead of to separate files named by
+     * the namer. Each chunk is still a complete PLY file, and the byte ranges
+     * are given by the index, which must also be enabled with
+     * @ref setChunkIndex. This is supported by @ref OOCMesher only. The
+     * default is empty, meaning that chunks go to separate files.
+     */
+    void setChunkContainer(const std::string &path) { chunkContainer = path; }
+
+    /// Retrieve the value set with @ref setChunkContainer.
+    const std::string &getChunkContainer() const { return chunkContainer; }
+
+    /**
+     * Sets a file to which @ref write records the output vertices that lie
+     * on a face of the grid given to @ref setChunkGrid (see
+     * @ref TileBoundary::Record), so that meshes of adjacent tiles can be
+     * welded afterwards. This is supported by @ref OOCMesher only, and not
+     * across a checkpoint. The default is empty, meaning that no record is
+     * written.
+     */
+    void setTileBoundary(const std::string &path) { tileBoundary = path; }
+
+    /// Retrieve the value set with @ref setTileBoundary.
+    const std::string &getTileBoundary() const { return tileBoundary; }
+
+    /**
+     * Sets whether each output chunk is pruned, reordered and written as
+     * soon as @ref releaseChunk is called for it, rather than all at once
+     * by @ref write. Since the total vertex count is not yet known, only
+     * @ref setPruneMinVertices is used to prune and the fractional
+     * threshold is ignored; and a component is judged by its size at the
+     * time, so one that straddles chunks may be pruned from a chunk written
+     * early yet kept in its neighbours. This is supported by @ref OOCMesher
+     * only, and not with a chunk container, a tile boundary, seam stitching,
+     * compressed temporary files or checkpoints. The default is false.
+     */
+    void setStreamChunks(bool stream) { streamChunks = stream; }
+
+    /// Retrieve the value set with @ref setStreamChunks.
+    bool getStreamChunks() const { return streamChunks; }
+
+    /**
+     * Sets whether, with @ref setStreamChunks, a chunk whose data is all
+     * still in memory when @ref releaseChunk is called for it is written
+     * straight from memory rather than through the temporary files. Only
+     * data that has been spilled before its chunk is complete then goes
+     * through the temporary files. Each such chunk is held in memory until
+     * it is written, in addition to the reorder buffer. This is supported by
+     * @ref OOCMesher only. The default is false.
+     */
+    void setStreamDirect(bool direct) { streamDirect = direct; }
+
+    /// Retrieve the value set with @ref setStreamDirect.
+    bool getStreamDirect() const { return streamDirect; }
+
+    /**
+     * Sets a function to call each time an output file has been written,
+     * so that consumers can start on it before the whole output is done
+     * (see @ref setStreamChunks). It may be called from several threads at
+     * once. The default is empty, meaning that there is no callback.
+     */
+    void setChunkCallback(const ChunkCallback &callback) { chunkCallback = callback; }
+
+    /// Retrieve the value set with @ref setChunkCallback.
+    const ChunkCallback &getChunkCallback() const { return chunkCallback; }
+
+    /**
+     * Sets whether to stitch the seams between blocks that were meshed at
+     * different grid resolutions (see @ref BucketLoader::setAdaptive), if
+     * supported by the mesher type. The default is false.
+     */
+    void setStitchSeams(bool stitch) { stitchSeams = stitch; }
+
+    /// Retrieve the value set with @ref setStitchSeams.
+    bool getStitchSeams() const { return stitchSeams; }
+
+    /**
+     * Sets the encoding of vertex positions in the output files and the
+     * temporary files. The default is @ref FastPly::VERTEX_FORMAT_FLOAT32.
+     * The fixed-point formats also require @ref setChunkGrid. This must be
+     * called before any data is passed to the mesher, and with the same value
+     * when resuming from a checkpoint.
+     */
+    void setVertexFormat(FastPly::VertexFormat format) { writer.setVertexFormat(format); }
+
+    /**
+     * Sets the layout of the output chunks, which is used to position the
+     * fixed-point vertex coordinates (see @ref VertexQuantizer). It is
+     * not needed when resuming from a checkpoint.
+     *
+     * @param grid        Bounding grid for the whole output.
+     * @param chunkCells  Cells per chunk along each axis, or 0 for a single chunk.
+     * @param keyGrid     Grid relative to which vertex keys are computed (see
+     *                    @ref SlaveWorkers::start). Its lower extents must not
+     *                    exceed those of @a grid.
+     */
+    void setChunkGrid(const Grid &grid, Grid::size_type chunkCells, const Grid &keyGrid)
+    {
+        this->grid = grid;
+        this->chunkCells = chunkCells;
+        for (unsigned int i = 0; i < 3; i++)
+            keyCellOffset[i] = grid.getExtent(i).first - keyGrid.getExtent(i).first;
+    }
+
+    /// Retrieve the format set with @ref setVertexFormat.
+    FastPly::VertexFormat getVertexFormat() const { return writer.getVertexFormat(); }
+
+    /**
+     * Sets whether to write a normal with each output vertex. The normals
+     * are computed when the output files are written, by summing the
+     * (area-weighted) normals of the triangles around each vertex, so they
+     * do not affect the temporary files. The default is false.
+     */
+    void setVertexNormals(bool normals) { writer.setVertexNormals(normals); }
+
+    /// Retrieve the value set with @ref setVertexNormals.
+    bool getVertexNormals() const { return writer.getVertexNormals(); }
+
     /**
      * Retrieves a functor that will accept data in a specific pass.
      * Multi-pass classes may do finalization on a previous pass before
@@ -272,6 +638,15 @@ public:
      */
     virtual InputFunctor functor(unsigned int pass) = 0;
 
+    /**
+     * Notify the mesher that no more input will arrive for the chunk with
+     * generation @a gen, so that it may release state that is only needed
+     * while the chunk is being assembled. It may be called from any thread,
+     * concurrently with the functor for other chunks, but not during
+     * @ref snapshot. The default does nothing.
+     */
+    virtual void releaseChunk(ChunkId::gen_type gen) { (void) gen; }
+
     /**
      * Instead of calling @ref write, one may instead call this function. It will
      * serialize the state necessary to complete the writing into @a path. Later
@@ -293,6 +668,38 @@ public:
     virtual std::size_t resume(Timeplot::Worker &tworker, const boost::filesystem::path &path,
                                std::ostream *progressStream = NULL) = 0;
 
+    /**
+     * Save the state accumulated so far while input is still arriving, so
+     * that a later run can continue from this point instead of starting over
+     * (see @ref restore). Unlike @ref checkpoint, the mesher remains usable
+     * and further input may follow. No calls to the functor may be in
+     * progress or be made while this runs.
+     *
+     * @param tworker         Timeplot worker for the current thread.
+     * @param path            File to write. It is replaced atomically.
+     * @param progress        Opaque measure of the input already delivered,
+     *                        which is returned by @ref restore.
+     * @throw std::ios::failure if the file could not be written.
+     */
+    virtual void snapshot(Timeplot::Worker &tworker, const boost::filesystem::path &path,
+                          std::tr1::uint64_t progress) = 0;
+
+    /**
+     * Load a file written by either @ref checkpoint or @ref snapshot. After a
+     * checkpoint, call @ref write to complete the job. After a snapshot, the
+     * caller must again call @ref functor and deliver the input that follows
+     * @a progress, with the same inputs and options as the original run;
+     * what was delivered before the snapshot must not be repeated.
+     *
+     * @param tworker         Timeplot worker for the current thread.
+     * @param path            File to read.
+     * @param[out] progress   The progress passed to @ref snapshot.
+     * @return Whether @a path was written by @ref snapshot.
+     * @throw std::ios::failure if the file could not be read.
+     */
+    virtual bool restore(Timeplot::Worker &tworker, const boost::filesystem::path &path,
+                         std::tr1::uint64_t &progress) = 0;
+
     /**
      * Performs any final file I/O.
      *
@@ -307,13 +714,112 @@ public:
 
 protected:
     FastPly::Writer &getWriter() const { return writer; }
+
+    /**
+     * Minimum number of vertices for a component to be kept, given the
+     * total number of vertices before pruning. This combines
+     * @ref setPruneThreshold and @ref setPruneMinVertices, except that only
+     * the latter applies when streaming (see @ref setStreamChunks).
+     */
+    std::tr1::uint64_t getPruneThresholdVertices(std::tr1::uint64_t totalVertices) const
+    {
+        if (streamChunks)
+            return pruneMinVertices;
+        return std::max(std::tr1::uint64_t(totalVertices * pruneThreshold), pruneMinVertices);
+    }
     std::string getOutputName(const ChunkId &id) const { return namer(id); }
 
+    /// Quantizer for the vertices of one output chunk, from @ref setVertexFormat and @ref setChunkGrid
+    VertexQuantizer getVertexQuantizer(const ChunkId &id) const;
+
+    /// Range of grid cells covered by one output chunk, from @ref setChunkGrid
+    void getChunkCells(const ChunkId &id, Grid::size_type lower[3], Grid::size_type upper[3]) const;
+
+    /**
+     * Reference point for unwrapping the vertex keys of one output chunk
+     * (see @ref Marching::MAX_GLOBAL_DIMENSION). It is in the fixed-point
+     * units of the key fields, but is not itself wrapped. Every vertex of
+     * the chunk lies within 2<sup>@ref Marching::KEY_AXIS_BITS</sup> units
+     * above it, provided that chunks are at most half of
+     * @ref Marching::MAX_GLOBAL_DIMENSION across.
+     */
+    void getChunkKeyBase(const ChunkId &id, cl_ulong base[3]) const;
+
+    /**
+     * Convert a vertex key to be relative to the grid reference point, for
+     * @ref setTileBoundary.
+     *
+     * @param base      Value from @ref getChunkKeyBase.
+     * @param local     Key fields unwrapped relative to @a base.
+     * @param[out] key  The key relative to the reference point.
+     * @return Whether the vertex lies on a face of the grid.
+     */
+    bool getTileKey(const cl_ulong base[3], const cl_uint local[3], TileBoundary::Key &key) const;
+
+    /// Grid set by @ref setChunkGrid
+    const Grid &getChunkGrid() const { return grid; }
+
+    /**
+     * Make an index entry for an output chunk, filling in the region it
+     * covers from @ref getChunkCells.
+     */
+    ChunkIndexEntry makeChunkIndexEntry(
+        const ChunkId &id, const std::string &filename,
+        std::tr1::uint64_t offset, std::tr1::uint64_t size,
+        std::tr1::uint64_t vertices, std::tr1::uint64_t triangles) const;
+
+    /**
+     * Write the index set with @ref setChunkIndex as JSON. The entries are
+     * listed in Morton order of the chunk coordinates (see @ref
+     * chunkMortonLess), regardless of their order in @a entries.
+     *
+     * @throw std::ios::failure if the file could not be written.
+     */
+    void writeChunkIndex(std::vector<ChunkIndexEntry> entries) const;
+
 private:
     /// Threshold set by @ref setPruneThreshold
     double pruneThreshold;
+    /// Threshold set by @ref setPruneMinVertices
+    std::tr1::uint64_t pruneMinVertices;
     /// Capacity set by @ref setReorderCapacity
     std::size_t reorderCapacity;
+    /// Slots set by @ref setReorderSlots
+    unsigned int reorderSlots;
+    /// Thread count set by @ref setWriteThreads
+    unsigned int writeThreads;
+    /// Flag set by @ref setStitchSeams
+    bool stitchSeams;
+    /// Grid set by @ref setChunkGrid
+    Grid grid;
+    /// Chunk size set by @ref setChunkGrid
+    Grid::size_type chunkCells;
+    /// Cells from the key grid to @ref grid, set by @ref setChunkGrid
+    Grid::size_type keyCellOffset[3];
+    /// Writer type set by @ref setTmpWriterType
+    WriterType tmpWriterType;
+    /// Thread count set by @ref setTmpWriterMaxThreads
+    unsigned int tmpWriterMaxThreads;
+    /// Flag set by @ref setTmpMmap
+    bool tmpMmap;
+    /// Flag set by @ref setTmpCompress
+    bool tmpCompress;
+    /// Flag set by @ref setReorderTriangles
+    bool reorderTriangles;
+    /// Flag set by @ref setParallelWrite
+    bool parallelWrite;
+    /// Path set by @ref setChunkIndex
+    std::string chunkIndex;
+    /// Path set by @ref setChunkContainer
+    std::string chunkContainer;
+    /// Path set by @ref setTileBoundary
+    std::string tileBoundary;
+    /// Flag set by @ref setStreamChunks
+    bool streamChunks;
+    /// Flag set by @ref setStreamDirect
+    bool streamDirect;
+    /// Callback set by @ref setChunkCallback
+    ChunkCallback chunkCallback;
 
     FastPly::Writer &writer;       ///< Writer for output files
     const Namer namer;             ///< Output file namer
@@ -326,6 +832,22 @@ private:
  * smaller because it doesn't need a vertex count per polygon, but perhaps larger
  * because it keeps components that are later discarded).
  *
+ * By default, components go through the temporary files even when they are
+ * already closed (have no open external vertices). The pruning threshold is
+ * a fraction of the total vertex count, which is only known once the last
+ * block has arrived, and each output file needs its final vertex and
+ * triangle counts in its header before any data is written.
+ *
+ * With @ref setStreamChunks, each chunk is instead written as soon as it is
+ * released, pruning only by the absolute @ref setPruneMinVertices. Its data
+ * still passes through the temporary files, but the output files no longer
+ * wait for the last block. With @ref setStreamDirect as well, a released
+ * chunk that has not been spilled yet is moved out of the reorder buffer
+ * and written from memory, so that only the clumps of chunks that are still
+ * open when the buffer fills go through the temporary files. When chunks
+ * arrive in sweep order and the buffer holds a few chunks, this avoids most
+ * of the temporary file traffic.
+ *
  * Component identification is implemented with a two-level approach. Within each
  * block, a union-find is performed to identify local components. These
  * components are referred to as @em clumps. Each vertex is given a <em>clump
@@ -349,17 +871,26 @@ private:
  * External vertices are entered into a hash table that maps their keys to
  * their (global) chunk ID, and a chunk-local hash table that maps it to the
  * triangle index used to encode it.
+ *
+ * The local union-find for a block does not depend on any other block, so
+ * several threads may call the functor at once. Only the welding and
+ * reordering steps are serialized.
  */
 class OOCMesher : public MesherBase
 {
     friend class ::TestTmpWriterWorkerGroup;
+    friend class ::BenchTmpWriter;
     friend class boost::serialization::access;
 public:
     typedef boost::array<float, 3> vertex_type;
     typedef boost::array<cl_uint, 3> triangle_type;
 
 protected:
-    static const int reorderSlots;
+    /**
+     * Minimum number of threads writing the temporary files. There is at
+     * least one per temporary directory (see @ref getTmpFileDirCount).
+     */
+    static const int tmpWriterWorkers;
 
     typedef std::tr1::int32_t clump_id;
 
@@ -430,26 +961,70 @@ protected:
             }
         };
 
-        typedef Statistics::Container::unordered_map<cl_ulong, std::tr1::uint32_t> vertex_id_map_type;
+        typedef Statistics::Container::flat_hash_map<cl_ulong, std::tr1::uint32_t> vertex_id_map_type;
+        typedef Statistics::Container::flat_hash_map<std::tr1::uint32_t, std::tr1::uint32_t> seam_map_type;
+        typedef Statistics::Container::vector<Clump> clump_list_type;
+        /// Range of records in the clumps temporary file, as (first record, number of records)
+        typedef std::pair<std::tr1::uint64_t, std::tr1::uint64_t> clump_extent_type;
 
         /// ID for this chunk, used to generate the filename
         ChunkId chunkId;
-        /// All written clumps in this chunk, in the order they are recorded in the output vectors
-        Statistics::Container::vector<Clump> clumps;
+        /**
+         * Written clumps held in memory. These are only present when
+         * restored from a checkpoint that predates @ref clumpExtents, and
+         * precede the clumps in the extents.
+         */
+        clump_list_type clumps;
+        /**
+         * Extents of the clumps temporary file holding the records for the
+         * written clumps of this chunk, in the order they are recorded in
+         * the output vectors. Each flush of the reorder buffer appends one
+         * extent per chunk, so there are few of them.
+         */
+        Statistics::Container::vector<clump_extent_type> clumpExtents;
         /// Clumps that are still in the reorder buffer
         Statistics::Container::vector<Clump> bufferedClumps;
         /// Maps an external vertex key to the number of preceeding external vertices
         vertex_id_map_type vertexIdMap;
         /// Number of distinct external vertices in this chunk
         std::size_t numExternalVertices;
+        /**
+         * Maps the index of an external vertex on a resolution seam to the
+         * index of the coarser external vertex that replaces it in triangles
+         * (see @ref stitchChunkSeams).
+         */
+        seam_map_type seams;
+        /// Encoding for the vertices of this chunk
+        VertexQuantizer quantizer;
+        /**
+         * External vertices on a face of the grid, recorded by
+         * @ref collectTileBoundary. @ref TileBoundary::Vertex::index is the
+         * index among the external vertices of the chunk.
+         */
+        Statistics::Container::vector<TileBoundary::Vertex> boundary;
+        /// Whether the chunk has already been written (see @ref setStreamChunks)
+        bool streamed;
 
         /// Constructor
         explicit Chunk(const ChunkId chunkId = ChunkId())
             : chunkId(chunkId),
             clumps("mem.mesher.chunk.clumps"),
+            clumpExtents("mem.mesher.chunk.clumpExtents"),
             bufferedClumps("mem.mesher.chunk.bufferedClumps"),
             vertexIdMap("mem.mesher.vertexIdMap"),
-            numExternalVertices(0) {}
+            numExternalVertices(0),
+            seams("mem.mesher.chunk.seams"),
+            boundary("mem.mesher.chunk.boundary"),
+            streamed(false) {}
+
+        /// Total number of written clumps, in memory and in the temporary file
+        std::tr1::uint64_t numClumps() const
+        {
+            std::tr1::uint64_t total = clumps.size();
+            for (std::size_t i = 0; i < clumpExtents.size(); i++)
+                total += clumpExtents[i].second;
+            return total;
+        }
 
         template<typename Archive>
         void serialize(Archive &ar, const unsigned int)
@@ -457,7 +1032,11 @@ protected:
             ar & chunkId;
             ar & clumps;
             ar & numExternalVertices;
-            // bufferedClumps and vertexIdMap are not needed
+            ar & quantizer;
+            /* bufferedClumps and vertexIdMap are not needed, seams and
+             * clumpExtents are versioned by OOCMesher, and streaming does
+             * not support checkpoints.
+             */
         }
     };
 
@@ -510,11 +1089,21 @@ protected:
      * similar to @c writev: @ref vertexRanges references ranges within @ref vertices
      * that must be written consecutively to the vertices temp file, and similarly for
      * @ref triangleRanges and @ref triangles.
+     *
+     * When the vertex format is fixed-point, the vertices are instead encoded
+     * into @ref packedVertices and @ref vertexRanges is empty. The
+     * per-chunk records for the clumps are written contiguously from
+     * @ref clumps.
+     *
+     * Each item is written at the offsets it carries rather than at the end
+     * of the file, so items need not be written in order.
      */
     struct TmpWriterItem
     {
         /// Backing store for vertices
         Statistics::Container::vector<vertex_type> vertices;
+        /// Vertices encoded in the vertex format, in temp file order
+        Statistics::Container::vector<char> packedVertices;
         /// Backing store for triangles
         Statistics::Container::vector<triangle_type> triangles;
         /**
@@ -525,29 +1114,79 @@ protected:
          * Ranges of @ref triangles to write. Each range is of [first, last) form.
          */
         Statistics::Container::vector<std::pair<std::size_t, std::size_t> > triangleRanges;
+        /// Clump records to write to the clumps temp file
+        Chunk::clump_list_type clumps;
+
+        /// Byte offset in the vertices temp file of the first vertex to write
+        std::tr1::uint64_t verticesOffset;
+        /// Byte offset in the triangles temp file of the first triangle to write
+        std::tr1::uint64_t trianglesOffset;
+        /// Byte offset in the clumps temp file of the first clump record to write
+        std::tr1::uint64_t clumpsOffset;
 
         /// Allocation from the circular buffer for this item
         CircularBufferBase::Allocation alloc;
+        /// Bytes held by the item while it is queued or being written
+        std::size_t bytes;
+
+        /// Bytes of memory used by the vertices, triangles and clumps
+        std::size_t dataBytes() const;
 
         TmpWriterItem();
     };
 
+    /**
+     * Location in the triangles temporary file of the triangles written from
+     * one range of a @ref TmpWriterItem, when they are compressed with @ref
+     * TriangleCodec. Each range is one clump, so these serve as an index from
+     * a clump to its encoded triangles.
+     */
+    struct TriangleBlock
+    {
+        /// Index of the first triangle, as for @ref Chunk::Clump::firstTriangle
+        std::tr1::uint64_t firstTriangle;
+        /// Byte offset in the triangles temporary file of the encoded data
+        std::tr1::uint64_t offset;
+        /// Number of bytes of encoded data
+        std::tr1::uint64_t bytes;
+
+        bool operator<(const TriangleBlock &other) const
+        {
+            return firstTriangle < other.firstTriangle;
+        }
+
+        template<typename Archive>
+        void serialize(Archive &ar, const unsigned int)
+        {
+            ar & firstTriangle;
+            ar & offset;
+            ar & bytes;
+        }
+    };
+
     class TmpWriterWorkerGroup;
 
     /**
-     * Worker for asynchronous writes to the temporary files. These is only ever one of
-     * these workers, so there are no race conditions.
+     * Worker for asynchronous writes to the temporary files. There may be
+     * several of these, each writing whole items to disjoint parts of the
+     * files.
      */
     class TmpWriterWorker : public WorkerBase
     {
     private:
         TmpWriterWorkerGroup &owner;   ///< Owning worker group
-        std::ostream &verticesFile;    ///< File for temporary vertices
-        std::ostream &trianglesFile;   ///< File for temporary triangles
+        /// Scratch space for the buffers passed to @ref BinaryWriter::writev
+        std::vector<BinaryWriter::ConstBuffer> bufs;
+        /// Scratch space for encoded triangles
+        std::vector<std::tr1::uint8_t> encoded;
+        /// Scratch space for the index entries of encoded triangles
+        std::vector<TriangleBlock> blocks;
+
+        /// Encode the triangles of @a item and write them to the end of the file
+        void writeEncodedTriangles(TmpWriterItem &item);
     public:
-        TmpWriterWorker(TmpWriterWorkerGroup &owner, std::ostream &verticesFile, std::ostream &trianglesFile)
-            : WorkerBase("tmpwriter", 0),
-            owner(owner), verticesFile(verticesFile), trianglesFile(trianglesFile) {}
+        TmpWriterWorker(TmpWriterWorkerGroup &owner, int idx)
+            : WorkerBase("tmpwriter", idx), owner(owner) {}
         void operator()(TmpWriterItem &item);
     };
 
@@ -557,26 +1196,60 @@ protected:
      * handle their removal once no longer needed. It does, however, close the
      * files when the group is stopped.
      *
+     * The files are written through a @ref BinaryWriter of the type set with
+     * @ref setWriterType, so several workers can write at once.
+     *
+     * If @ref setCompressTriangles is enabled, the triangles of each range
+     * are encoded with @ref TriangleCodec and appended to the triangles file
+     * in the order the items are written, rather than placed at the offset
+     * given in the item. The index of their locations is available from
+     * @ref findTriangles once the group is stopped.
+     *
      * Errors while writing the temporary files immediately terminate the program.
      */
     class TmpWriterWorkerGroup : public WorkerGroup<TmpWriterItem, TmpWriterWorker, TmpWriterWorkerGroup>
     {
         friend class ::TestTmpWriterWorkerGroup;
         friend class boost::serialization::access;
+        friend class TmpWriterWorker;
+        friend class OOCMesher;
     private:
-        /// File to which vertices are written
-        boost::filesystem::ofstream verticesFile;
-        /// File to which triangles are written
-        boost::filesystem::ofstream trianglesFile;
+        /// Number of workers passed to the constructor
+        const std::size_t minWorkers;
+        /// Writer type set by @ref setWriterType
+        WriterType writerType;
+        /// Flag set by @ref setCompressTriangles
+        bool compressTriangles;
+        /// Locations of encoded triangles, sorted when the group stops
+        Statistics::Container::vector<TriangleBlock> triangleBlocks;
+        /// Bytes of encoded triangles written so far
+        std::tr1::uint64_t trianglesBytes;
+        /// Mutex protecting @ref triangleBlocks and @ref trianglesBytes
+        boost::mutex triangleBlocksMutex;
+        /// File to which vertices are written, while running
+        boost::scoped_ptr<BinaryWriter> verticesFile;
+        /// File to which triangles are written, while running
+        boost::scoped_ptr<BinaryWriter> trianglesFile;
+        /// File to which clump records are written, while running
+        boost::scoped_ptr<BinaryWriter> clumpsFile;
         /// Filename for @ref verticesFile
         boost::filesystem::path verticesPath;
         /// Filename for @ref trianglesFile
         boost::filesystem::path trianglesPath;
+        /**
+         * Filename for @ref clumpsFile. It is serialized by @ref OOCMesher,
+         * since older checkpoints do not have it.
+         */
+        boost::filesystem::path clumpsPath;
 
         /// Allocator for items
-        CircularBufferBase itemAllocator;
+        boost::scoped_ptr<CircularBufferBase> itemAllocator;
         /// Backing store of items
         std::vector<boost::shared_ptr<TmpWriterItem> > itemPool;
+        /// Total @ref TmpWriterItem::bytes of items pushed but not yet freed
+        std::size_t pendingBytes;
+        /// Mutex protecting @ref pendingBytes
+        mutable boost::mutex pendingMutex;
 
         template<typename Archive>
         void serialize(Archive &ar, const unsigned int)
@@ -584,11 +1257,68 @@ protected:
             ar & verticesPath;
             ar & trianglesPath;
         }
+
+        /// Open the writers on the paths, optionally truncating the files
+        void openFiles(bool truncate);
+
+        /**
+         * Reserve @a bytes at the end of the triangles file and record the
+         * locations of @a blocks, whose offsets are relative to the start of
+         * the reservation.
+         *
+         * @return The offset of the reservation in the file.
+         */
+        std::tr1::uint64_t addTriangleBlocks(const std::vector<TriangleBlock> &blocks, std::tr1::uint64_t bytes);
     public:
         /**
          * Constructor.
+         *
+         * @param numWorkers  Number of threads writing to the files.
+         * @param slots       Number of items, which should exceed @a numWorkers.
+         */
+        TmpWriterWorkerGroup(std::size_t numWorkers, std::size_t slots);
+
+        /**
+         * Set the low-level writer for the temporary files. It takes effect
+         * at the next @ref start. The files are read back at arbitrary
+         * offsets, so @ref ZSTD_WRITER is replaced by @ref SYSCALL_WRITER.
          */
-        explicit TmpWriterWorkerGroup(std::size_t slots);
+        void setWriterType(WriterType type);
+
+        /**
+         * Add workers until there are at least @a maxWorkers, and make the
+         * group elastic between the number given to the constructor and the
+         * new total (see @ref WorkerGroup::setElastic). Workers are never
+         * removed, so a smaller value leaves the group as it is.
+         *
+         * @pre The group is not running.
+         */
+        void setMaxWorkers(std::size_t maxWorkers);
+
+        /**
+         * Set whether triangles are compressed with @ref TriangleCodec. It
+         * takes effect at the next @ref start that creates new files;
+         * starting again after a snapshot keeps the existing encoding.
+         */
+        void setCompressTriangles(bool compress) { compressTriangles = compress; }
+
+        /// Retrieve the value set with @ref setCompressTriangles.
+        bool getCompressTriangles() const { return compressTriangles; }
+
+        /**
+         * Find the encoded triangles of the range starting at triangle @a
+         * firstTriangle.
+         *
+         * @pre @ref getCompressTriangles() is true, the group is stopped, and
+         * a non-empty range started at @a firstTriangle.
+         */
+        const TriangleBlock &findTriangles(std::tr1::uint64_t firstTriangle) const;
+
+        /**
+         * Size of the triangles file, in bytes. This differs from the number
+         * of triangles times their size if they are compressed.
+         */
+        std::tr1::uint64_t getTrianglesBytes() const { return trianglesBytes; }
 
         /**
          * @copydoc WorkerGroup::start
@@ -598,15 +1328,46 @@ protected:
         void start();
 
         /**
-         * Close the temporary files. This should not be called directly (it is called
-         * by @ref WorkerGroup).
+         * Start again after a snapshot, appending to the existing temporary
+         * files. Anything beyond the given sizes was written after the
+         * snapshot and is discarded. If the snapshot predates the clumps
+         * file, a new one is created. If the triangles are compressed, @a
+         * trianglesSize is in encoded bytes (see @ref getTrianglesBytes).
+         *
+         * @pre The paths have been set by a previous @ref start or by serialization.
+         */
+        void start(std::tr1::uint64_t verticesSize, std::tr1::uint64_t trianglesSize,
+                   std::tr1::uint64_t clumpsSize);
+
+        /**
+         * Close the temporary files and sort the index of encoded triangles.
+         * This should not be called directly (it is called by @ref WorkerGroup).
          */
         void stopPostJoin();
 
         boost::shared_ptr<TmpWriterItem> get(Timeplot::Worker &tworker, std::size_t size);
 
+        /// Enqueue an item to be written, adding its size to @ref getPendingBytes.
+        void push(Timeplot::Worker &tworker, boost::shared_ptr<TmpWriterItem> item);
+
         void freeItem(boost::shared_ptr<TmpWriterItem> item);
 
+        /**
+         * Change the number of items that can be in flight at once.
+         *
+         * @pre The group is not running and @a slots exceeds @ref numWorkers.
+         */
+        void setSlots(std::size_t slots);
+
+        /// Number of items that can be in flight at once
+        std::size_t numSlots() const { return itemAllocator->size(); }
+
+        /**
+         * Bytes of data in items that have been pushed but not yet written.
+         * This is memory that the caller cannot yet reuse.
+         */
+        std::size_t getPendingBytes() const;
+
         /**
          * Get the path to the temporary file for vertices. If @ref start has
          * not been called this will return an empty path.
@@ -617,6 +1378,11 @@ protected:
          * not been called this will return an empty path.
          */
         const boost::filesystem::path &getTrianglesPath() const { return trianglesPath; }
+        /**
+         * Get the path to the temporary file for clump records. If @ref start
+         * has not been called this will return an empty path.
+         */
+        const boost::filesystem::path &getClumpsPath() const { return clumpsPath; }
     };
 
     // Needed to enable the curiously recursive template pattern
@@ -628,10 +1394,9 @@ private:
      * @{
      * Temporary buffers.
      * These are stored in the object so that memory can be recycled if
-     * possible, rather than thrashing the allocator.
+     * possible, rather than thrashing the allocator. They are only used while
+     * holding @ref addMutex.
      */
-    Statistics::Container::vector<UnionFind::Node<std::tr1::int32_t> > tmpNodes;
-    Statistics::Container::PODBuffer<clump_id> tmpClumpId;
     Statistics::Container::PODBuffer<std::tr1::uint32_t> tmpVertexLabel;
     Statistics::Container::PODBuffer<std::tr1::int32_t> tmpFirstVertex;
     Statistics::Container::PODBuffer<std::tr1::int32_t> tmpNextVertex;
@@ -643,6 +1408,8 @@ private:
     std::tr1::uint64_t writtenVerticesTmp;
     /// Total number of triangles written to temporary file
     std::tr1::uint64_t writtenTrianglesTmp;
+    /// Total number of clump records written to temporary file
+    std::tr1::uint64_t writtenClumpsTmp;
 
     /**
      * Reorder buffer. Initially only the vertices and triangles are placed
@@ -655,11 +1422,27 @@ private:
      */
     boost::shared_ptr<TmpWriterItem> reorderBuffer;
 
-    Statistics::Container::vector<Clump> clumps;  ///< All clumps seen so far
+    /**
+     * Serializes the part of @ref add that updates the global state. The
+     * labelling of local components happens outside it, so that several
+     * threads can process blocks concurrently.
+     */
+    boost::mutex addMutex;
+
+    /**
+     * Arenas for the per-block scratch data in @ref add, which would otherwise
+     * be allocated and freed for every block. Each concurrent call leases its
+     * own arena, and everything is released in bulk when the call ends.
+     */
+    Statistics::ArenaPool scratchPool;
 
-    typedef Statistics::Container::unordered_map<cl_ulong, clump_id> clump_id_map_type;
-    /// Maps external vertex keys to global clump IDs
-    clump_id_map_type clumpIdMap;
+    /// Union-find tree over the vertices of one block
+    typedef std::vector<UnionFind::Node<std::tr1::int32_t>,
+                        Statistics::ArenaAllocator<UnionFind::Node<std::tr1::int32_t> > > LocalNodes;
+    /// Local clump ID for each vertex of one block
+    typedef PODBuffer<clump_id, Statistics::ArenaAllocator<clump_id> > LocalClumpIds;
+    /// Clumps found in one block
+    typedef std::vector<Clump, Statistics::ArenaAllocator<Clump> > LocalClumps;
 
     /**
      * Identifies components with a local set of triangles, and
@@ -675,55 +1458,89 @@ private:
         std::size_t numVertices,
         std::size_t numTriangles,
         const triangle_type *triangles,
-        Statistics::Container::vector<UnionFind::Node<std::tr1::int32_t> > &nodes);
+        LocalNodes &nodes);
 
     /**
-     * Create global clumps from local union-find tree. The clumps are populated
-     * with the appropriate vertex and triangle counts, but are not merged together
+     * Remove the components of one block that have no external vertices
+     * and fewer than @a minVertices vertices. Such components are already
+     * complete, so they can be discarded before they are buffered or written
+     * (see @ref setPruneMinVertices). The surviving vertices keep their
+     * order, so internal vertices still precede external ones and the
+     * vertex keys are unaffected.
+     *
+     * @param minVertices    Components smaller than this may be discarded.
+     * @param[in,out] mesh   The block. Its sizes are updated.
+     * @param[in,out] clumpId Local clump IDs from @ref computeLocalClumps, renumbered to match.
+     * @param[in,out] localClumps Local clumps from @ref computeLocalClumps, with the discarded ones removed.
+     * @param clumpRemap     Scratch space, one element per local clump.
+     * @param vertexRemap    Scratch space, one element per vertex.
+     * @return The number of components discarded.
+     */
+    static std::size_t discardLocalClumps(
+        std::tr1::uint64_t minVertices,
+        HostKeyMesh &mesh,
+        LocalClumpIds &clumpId,
+        LocalClumps &localClumps,
+        LocalClumpIds &clumpRemap,
+        LocalClumpIds &vertexRemap);
+
+    /**
+     * Create clumps from a local union-find tree. The clumps are populated
+     * with the appropriate vertex and triangle counts, and are numbered from
+     * zero. They are later appended to @ref clumps, but are not merged together
      * using shared external vertices.
      *
+     * This does not touch any global state, and so may be called without
+     * holding @ref addMutex.
+     *
      * @param numTriangles   Number of triangles in @a triangles.
      * @param nodes          Union-find tree over the block vertices (see @ref computeLocalComponents).
      * @param triangles      Triangles in the block.
-     * @param[out] clumpId   Clump IDs, one per vertex passed in.
+     * @param[out] clumpId   Local clump IDs, one per vertex passed in.
+     * @param[out] localClumps The clumps, indexed by local clump ID.
      */
-    void updateGlobalClumps(
+    static void computeLocalClumps(
         std::size_t numTriangles,
-        const Statistics::Container::vector<UnionFind::Node<std::tr1::int32_t> > &nodes,
+        const LocalNodes &nodes,
         const triangle_type *triangles,
-        Statistics::Container::PODBuffer<clump_id> &clumpId);
+        LocalClumpIds &clumpId,
+        LocalClumps &localClumps);
 
     /**
-     * Update @ref clumpIdMap and merge global clumps that share external vertices.
+     * Update @ref KeyTile::clumpIdMap and merge global clumps that share external vertices.
      *
+     * @param base           Reference point for the chunk, from @ref getChunkKeyBase.
      * @param numVertices    Total number of vertices in @a clumpId
      * @param numExternalVertices Number of external vertices in @a keys
      * @param keys           Vertex keys in the mesh.
-     * @param clumpId        Vertex clump IDs computed by @ref updateGlobalClumps.
+     * @param clumpId        Local clump IDs computed by @ref computeLocalClumps.
+     * @param clumpIdFirst   Global clump ID corresponding to local clump 0.
      *
      * Note that the internal vertices in @a clumpId are ignored, but must still be present.
      */
     void updateClumpKeyMap(
+        const cl_ulong base[3],
         std::size_t numVertices,
         std::size_t numExternalVertices,
         const cl_ulong *keys,
-        const Statistics::Container::PODBuffer<clump_id> &clumpId);
+        const LocalClumpIds &clumpId,
+        clump_id clumpIdFirst);
 
     /**
      * Populate the per-chunk clump data and write the geometry to external
      * memory. This also does chunk-level welding to update @ref Chunk::vertexIdMap.
      *
      * @param chunk          The chunk to update.
-     * @param globalClumpId  The clump IDs generated by @ref updateGlobalClumps
-     * @param clumpIdFirst   Smallest value in @a globalClumpId
-     * @param clumpIdLast    One greater than largest value in @a globalClumpId
+     * @param clumpId        The local clump IDs generated by @ref computeLocalClumps
+     * @param clumpIdFirst   Global clump ID corresponding to local clump 0
+     * @param clumpIdLast    One greater than the global ID of the last local clump
      * @param mesh           The original data. All fields (vertices, triangles and keys)
      *                       must have finished loading.
      * @param tworker        Timeplot worker for recording interactions with the writer worker group
      */
     void updateLocalClumps(
         Chunk &chunk,
-        const Statistics::Container::PODBuffer<clump_id> &globalClumpId,
+        const LocalClumpIds &clumpId,
         clump_id clumpIdFirst,
         clump_id clumpIdLast,
         HostKeyMesh &mesh,
@@ -738,16 +1555,92 @@ private:
     void add(MesherWork &work, Timeplot::Worker &worker);
 
     /**
-     * Serialize just enough data that @ref write can be run on the reconstituted structure
+     * Start @ref tmpWriter again after a snapshot, truncating the temporary
+     * files to the data accounted for by @ref writtenVerticesTmp,
+     * @ref writtenTrianglesTmp and @ref writtenClumpsTmp.
+     */
+    void restartTmpWriter();
+
+    /**
+     * Serialize just enough data that @ref write can be run on the reconstituted structure.
+     * For a snapshot, this also includes the welding state needed to accept more input.
      */
     template<typename Archive>
-    void serialize(Archive &ar, const unsigned int)
+    void serialize(Archive &ar, const unsigned int version)
     {
         ar & tmpWriter;
         ar & chunks;
         ar & clumps;
+        if (version >= 4)
+        {
+            ar & tmpWriter.clumpsPath;
+            BOOST_FOREACH(Chunk &chunk, chunks)
+                ar & chunk.clumpExtents;
+        }
+        else
+            tmpWriter.clumpsPath = boost::filesystem::path();
+        if (version >= 1)
+            ar & partial;
+        else
+            partial = false;
+        if (partial)
+        {
+            ar & progress;
+            ar & writtenVerticesTmp;
+            ar & writtenTrianglesTmp;
+            if (version >= 4)
+                ar & writtenClumpsTmp;
+            else
+                writtenClumpsTmp = 0;
+            if (version >= 3)
+                serializeKeyTiles(ar);
+            else
+            {
+                // Older versions only had a single tile
+                keyTiles.clear();
+                keyTileIndex.clear();
+                ar & getKeyTile(0).clumpIdMap;
+            }
+            BOOST_FOREACH(Chunk &chunk, chunks)
+                ar & chunk.vertexIdMap;
+            if (version == 2)
+                ar & getKeyTile(0).sharedKeys;
+        }
+        if (version >= 2)
+        {
+            BOOST_FOREACH(Chunk &chunk, chunks)
+                ar & chunk.seams;
+        }
+        if (version >= 5)
+        {
+            ar & tmpWriter.compressTriangles;
+            ar & tmpWriter.trianglesBytes;
+            ar & tmpWriter.triangleBlocks;
+        }
+        else
+        {
+            tmpWriter.compressTriangles = false;
+            tmpWriter.trianglesBytes = 0;
+            tmpWriter.triangleBlocks.clear();
+        }
     }
 
+    /**
+     * Whether the serialized state is a snapshot taken while input was still
+     * arriving. After @ref restore, this indicates that @ref functor must
+     * append to the existing temporary files.
+     */
+    bool partial;
+
+    /// Progress passed to @ref snapshot
+    std::tr1::uint64_t progress;
+
+    /**
+     * Whether a snapshot refers to the temporary files. They are then
+     * retained until the output has been written.
+     */
+    bool snapshotted;
+
 protected:
     /// If set to true, will not delete the temporary files
     bool retainFiles;
@@ -762,6 +1655,93 @@ protected:
      */
     Statistics::Container::vector<Chunk> chunks;
 
+    Statistics::Container::vector<Clump> clumps;  ///< All clumps seen so far
+
+    typedef Statistics::Container::flat_hash_map<cl_ulong, clump_id> clump_id_map_type;
+    typedef Statistics::Container::flat_hash_map<cl_ulong, bool> key_set_type;
+
+    /**
+     * Global welding state for the external vertices in one key tile. Vertex
+     * keys wrap around every 2<sup>@ref Marching::KEY_AXIS_BITS</sup> units
+     * along each axis (see @ref Marching::MAX_GLOBAL_DIMENSION), so a key
+     * only identifies a vertex together with the period it falls in along
+     * each axis. That triple, packed like the key fields, is the tile ID.
+     * Grids within @ref Marching::MAX_GLOBAL_DIMENSION have the single tile 0.
+     */
+    struct KeyTile
+    {
+        cl_ulong id;                  ///< Packed tile coordinates
+
+        /// Maps external vertex keys to global clump IDs
+        clump_id_map_type clumpIdMap;
+
+        /**
+         * External vertex keys produced by more than one block. This is only
+         * tracked if @ref setStitchSeams is enabled.
+         */
+        key_set_type sharedKeys;
+
+        explicit KeyTile(cl_ulong id = 0);
+    };
+
+    /// Key tiles seen so far, in order of creation
+    boost::ptr_vector<KeyTile> keyTiles;
+    /// Maps tile IDs to positions in @ref keyTiles
+    std::map<cl_ulong, std::size_t> keyTileIndex;
+
+    /// Find the key tile with ID @a id, creating it if necessary
+    KeyTile &getKeyTile(cl_ulong id);
+
+    /**
+     * Determine the key tile of an external vertex key produced for a chunk.
+     *
+     * @param key         Vertex key as produced by @ref Marching.
+     * @param base        Reference point from @ref getChunkKeyBase.
+     * @param[out] local  If non-NULL, the key fields unwrapped relative to @a base.
+     * @return The tile ID.
+     */
+    static cl_ulong keyTileId(cl_ulong key, const cl_ulong base[3], cl_uint *local = NULL);
+
+    /// Serialize @ref keyTiles, rebuilding @ref keyTileIndex when loading
+    template<typename Archive>
+    void serializeKeyTiles(Archive &ar)
+    {
+        std::size_t numTiles = keyTiles.size();
+        ar & numTiles;
+        if (Archive::is_loading::value)
+        {
+            keyTiles.clear();
+            keyTileIndex.clear();
+        }
+        for (std::size_t i = 0; i < numTiles; i++)
+        {
+            cl_ulong id = Archive::is_loading::value ? 0 : keyTiles[i].id;
+            ar & id;
+            KeyTile &tile = getKeyTile(id);
+            ar & tile.clumpIdMap;
+            ar & tile.sharedKeys;
+        }
+    }
+
+    /**
+     * Find external vertices of @a chunk that lie on a seam between blocks
+     * of different resolution, and record in @ref Chunk::seams which coarser
+     * vertex each is replaced by. Their clumps are merged. The chunk's
+     * @ref Chunk::vertexIdMap is released afterwards.
+     *
+     * A candidate is an external vertex that no other block produced. Each
+     * candidate is snapped to the nearest candidate from a coarser level that
+     * lies on a common plane of the coarser grid and within one coarse cell.
+     */
+    void stitchChunkSeams(Chunk &chunk);
+
+    /**
+     * Record in @ref Chunk::boundary the external vertices of @a chunk that
+     * lie on a face of the grid, if @ref setTileBoundary is in use. This must
+     * be done before @ref Chunk::vertexIdMap is released.
+     */
+    void collectTileBoundary(Chunk &chunk);
+
     /**
      * Flush out any temporary data to the temporary file writer then shut it down
      */
@@ -788,12 +1768,47 @@ protected:
         std::tr1::uint64_t &keptTriangles,
         bool record = true) const;
 
+    /**
+     * Flags indexed by global clump ID, indicating whether the component
+     * containing the clump is retained. Once all the geometry has been
+     * received, this replaces lookups in the union-find tree over
+     * @ref clumps, at one bit per clump.
+     */
+    typedef Statistics::Container::vector<bool> kept_clumps_type;
+
+    /**
+     * Flatten the union-find tree into flags for retained components. This is
+     * only called after all the geometry has been received.
+     *
+     * @param thresholdVertices Threshold for retaining components (see @ref getStatistics)
+     * @param[out] kept         Flags for each clump in @ref clumps
+     */
+    void getKeptClumps(std::tr1::uint64_t thresholdVertices, kept_clumps_type &kept) const;
+
+    /**
+     * Retrieve the clump records of a chunk, in the order they are recorded in
+     * the output vectors. The records in the temporary file are read
+     * sequentially into @a buffer. A chunk restored from an older checkpoint,
+     * with all its records in memory, is returned directly.
+     *
+     * @param clumpsTmpRead     Reader for the clumps temporary file (may be
+     *                          @c NULL if the chunk has no extents)
+     * @param chunk             The chunk whose records to load
+     * @param buffer            Storage for records read from the file
+     * @return Either @a buffer or the records held by @a chunk.
+     */
+    const Chunk::clump_list_type &loadChunkClumps(
+        BinaryReader *clumpsTmpRead,
+        const Chunk &chunk,
+        Chunk::clump_list_type &buffer) const;
+
     /**
      * Compute the number of vertices and triangles retained for a chunk. This
      * is only called after all the geometry has been received.
      *
-     * @param thresholdVertices Threshold for retaining components (see @ref getStatistics)
+     * @param kept              Retained clumps (see @ref getKeptClumps)
      * @param chunk             The chunk to evaluate
+     * @param chunkClumps       Clump records of @a chunk (see @ref loadChunkClumps)
      * @param[out] keptVertices, keptTriangles Number of vertices/triangles that
      *                          will be in the output file
      * @param[out] totalExternal Total number of external vertices in the chunk,
@@ -801,19 +1816,43 @@ protected:
      *                          due to the threshold.
      */
     void getChunkStatistics(
-        std::tr1::uint64_t thresholdVertices,
+        const kept_clumps_type &kept,
         const Chunk &chunk,
+        const Chunk::clump_list_type &chunkClumps,
         std::tr1::uint64_t &keptVertices,
         std::tr1::uint64_t &keptTriangles,
         std::tr1::uint64_t &totalExternal) const;
 
     /**
      * Compute minimum number of bytes needed for the async writer. This is
-     * only called after all the geometry has been received.
+     * only called once the geometry of @a source has all been received.
      *
-     * @param thresholdVertices Threshold for retaining components (see @ref getStatistics)
+     * @param source            Chunks that will be written
+     * @param kept              Retained clumps (see @ref getKeptClumps)
+     * @param clumpsTmpRead     Reader for the clumps temporary file (see @ref loadChunkClumps)
+     */
+    std::size_t getAsyncMem(
+        const Statistics::Container::vector<Chunk> &source,
+        const kept_clumps_type &kept, BinaryReader *clumpsTmpRead) const;
+
+    /**
+     * Size to which the async writer coalesces adjacent clumps, given the
+     * result of @ref getAsyncMem. Small clumps written one at a time are
+     * very slow on parallel filesystems.
+     */
+    static std::size_t getAsyncCoalesce(std::size_t asyncMem)
+    {
+        return std::min(asyncMem, std::size_t(4 * 1024 * 1024));
+    }
+
+    /**
+     * Check that the temporary vertices of a chunk are in the vertex format
+     * of the writer.
+     *
+     * @throw std::runtime_error if the formats differ, which can happen when
+     * resuming from a checkpoint with a different vertex format.
      */
-    std::size_t getAsyncMem(std::tr1::uint64_t thresholdVertices) const;
+    void checkVertexFormat(const Chunk &chunk) const;
 
     /**
      * Transform triangles from their temporary file form to their output form.
@@ -837,10 +1876,12 @@ protected:
         std::tr1::uint8_t *outTriangles);
 
     /**
-     * Compute write positions and remapping table for one output chunk.
+     * Compute write positions and remapping table for one output chunk, in a
+     * single sequential pass over its clump records.
      *
      * @param chunk             Fully-defined output chunk
-     * @param thresholdVertices Threshold for retaining components (see @ref getStatistics)
+     * @param chunkClumps       Clump records of @a chunk (see @ref loadChunkClumps)
+     * @param kept              Retained clumps (see @ref getKeptClumps)
      * @param chunkExternal     Total number of external vertices in the chunk (see @ref getChunkStatistics)
      * @param[out] startVertex  Position in output file for vertices in each clump, as a vertex count (undefined for dropped clumps)
      * @param[out] startTriangle Position in output file for triangles each clump, as a triangle count (undefined for dropped clumps)
@@ -848,21 +1889,94 @@ protected:
      */
     void writeChunkPrepare(
         const Chunk &chunk,
-        std::tr1::uint64_t thresholdVertices,
+        const Chunk::clump_list_type &chunkClumps,
+        const kept_clumps_type &kept,
         std::size_t chunkExternal,
         Statistics::Container::PODBuffer<std::tr1::uint32_t> &startVertex,
         Statistics::Container::PODBuffer<FastPly::Writer::size_type> &startTriangle,
         Statistics::Container::PODBuffer<std::tr1::uint32_t> &externalRemap);
 
+    /**
+     * Compute the vertex normals of one output chunk (see @ref
+     * setVertexNormals). The positions of the retained vertices are decoded
+     * from the vertices temporary file, then the normal of each triangle,
+     * weighted by its area, is added to its three vertices. Each clump
+     * record only holds part of a component, but its triangles reach the
+     * external vertices of other records through @a externalRemap, so the
+     * sums cover every triangle around each vertex.
+     *
+     * @param verticesTmpRead   Reader for the vertices temporary file
+     * @param trianglesTmpRead  Reader for the triangles temporary file
+     * @param chunk             Fully-defined output chunk
+     * @param chunkClumps       Clump records of @a chunk (see @ref loadChunkClumps)
+     * @param kept              Retained clumps (see @ref getKeptClumps)
+     * @param chunkVertices     Number of vertices in the output file
+     * @param chunkExternal     Total number of external vertices for the chunk (see @ref getChunkStatistics)
+     * @param startVertex       Position (in vertices) of each clump (see @ref writeChunkPrepare)
+     * @param externalRemap     Maps external vertex indices to final indices
+     * @param[in,out] triangles Temporary buffer the callee may use to hold data
+     * @param[out] normals      Unit normals indexed by output vertex, or zero
+     *                          for vertices without triangles.
+     */
+    void writeChunkNormals(
+        BinaryReader &verticesTmpRead,
+        BinaryReader &trianglesTmpRead,
+        const Chunk &chunk,
+        const Chunk::clump_list_type &chunkClumps,
+        const kept_clumps_type &kept,
+        std::size_t chunkVertices,
+        std::size_t chunkExternal,
+        const std::tr1::uint32_t *startVertex,
+        const std::tr1::uint32_t *externalRemap,
+        Statistics::Container::PODBuffer<triangle_type> &triangles,
+        Statistics::Container::PODBuffer<vertex_type> &normals);
+
+    /**
+     * Open a temporary file for reading back. It is mapped if requested with
+     * @ref setTmpMmap, unless it is empty (which cannot be mapped).
+     */
+    BinaryReader *openTmpReader(const boost::filesystem::path &path) const;
+
+    /**
+     * Find the part of the triangles temporary file that holds the triangles
+     * of a clump, which depends on whether they are compressed.
+     *
+     * @param cc           The clump to find
+     * @param[out] offset  Byte offset of the triangles in the file
+     * @param[out] bytes   Number of bytes holding the triangles
+     */
+    void findTmpTriangles(const Chunk::Clump &cc, std::tr1::uint64_t &offset, std::tr1::uint64_t &bytes) const;
+
+    /**
+     * Obtain the triangles of a clump from the triangles temporary file,
+     * decoding them if they are compressed. If the reader maps the file and
+     * the triangles are not compressed, this points into the mapping;
+     * otherwise the triangles are placed in @a triangles.
+     *
+     * @param trianglesTmpRead  Reader for the triangles temporary file
+     * @param cc                The clump to read
+     * @param[in,out] triangles Buffer to hold the triangles if needed
+     * @param[in,out] encoded   Buffer to hold encoded triangles if needed
+     * @return Pointer to the triangles of the clump.
+     */
+    const triangle_type *readTmpTriangles(
+        BinaryReader &trianglesTmpRead, const Chunk::Clump &cc,
+        Statistics::Container::PODBuffer<triangle_type> &triangles,
+        Statistics::Container::PODBuffer<std::tr1::uint8_t> &encoded) const;
+
     /**
      * Transfer clumps from the vertices temporary file to the output file.
+     * The ranges are hinted to the reader ahead of use, and if it maps the
+     * file they are copied straight from the mapping.
      *
      * @param tworker           Worker to pass to @ref AsyncWriter::get
      * @param verticesTmpRead   Reader for the vertices temporary file
      * @param asyncWriter       Asynchronous writer to schedule through
-     * @param chunk             Output chunk to write
-     * @param thresholdVertices Threshold for retaining components (see @ref getStatistics)
+     * @param writer            Writer for the output file, already open
+     * @param chunkClumps       Clump records of the chunk to write (see @ref loadChunkClumps)
+     * @param kept              Retained clumps (see @ref getKeptClumps)
      * @param startVertex       Position (in vertices) to start writing each clump (see @ref writeChunkPrepare)
+     * @param normals           Normals to append to the vertices (see @ref writeChunkNormals), or @c NULL
      * @param progress          If non-NULL, updated with the number of triangles processed
      * @param firstClump, lastClump Range of clumps from the chunk to process.
      *
@@ -875,20 +1989,25 @@ protected:
         Timeplot::Worker &tworker,
         BinaryReader &verticesTmpRead,
         AsyncWriter &asyncWriter,
-        const Chunk &chunk,
-        std::tr1::uint64_t thresholdVertices,
+        FastPly::Writer &writer,
+        const Chunk::clump_list_type &chunkClumps,
+        const kept_clumps_type &kept,
         const std::tr1::uint32_t *startVertex,
+        const vertex_type *normals,
         ProgressMeter *progress,
         std::size_t firstClump, std::size_t lastClump);
 
     /**
      * Transfer clumps from the triangles temporary file to the output file.
+     * If the reader maps the file, the triangles are rewritten straight from
+     * the mapping, bypassing @a triangles.
      *
      * @param tworker           Worker to pass to @ref AsyncWriter::get
      * @param trianglesTmpRead  Reader for the triangles temporary file
      * @param asyncWriter       Asynchronous writer to schedule through
-     * @param chunk             Output chunk to write
-     * @param thresholdVertices Threshold for retaining components (see @ref getStatistics)
+     * @param writer            Writer for the output file, already open
+     * @param chunkClumps       Clump records of the chunk to write (see @ref loadChunkClumps)
+     * @param kept              Retained clumps (see @ref getKeptClumps)
      * @param chunkExternal     Total number of external vertices for the chunk (see @ref getChunkStatistics)
      * @param startVertex       Position (in vertices) to start writing each
      *                          clump (see @ref writeChunkPrepare). This is
@@ -906,16 +2025,226 @@ protected:
         Timeplot::Worker &tworker,
         BinaryReader &trianglesTmpRead,
         AsyncWriter &asyncWriter,
-        const Chunk &chunk,
-        std::tr1::uint64_t thresholdVertices,
+        FastPly::Writer &writer,
+        const Chunk::clump_list_type &chunkClumps,
+        const kept_clumps_type &kept,
+        std::size_t chunkExternal,
+        const std::tr1::uint32_t *startVertex,
+        const FastPly::Writer::size_type *startTriangle,
+        const std::tr1::uint32_t *externalRemap,
+        Statistics::Container::PODBuffer<triangle_type> &triangles,
+        ProgressMeter *progress,
+        std::size_t firstClump, std::size_t lastClump);
+
+    /**
+     * Alternative to @ref writeChunkVertices and @ref writeChunkTriangles,
+     * used if @ref setReorderTriangles is set. Each clump is handled in one
+     * step: its triangles are reordered with @ref VertexCache::tipsify, its
+     * internal vertices are renumbered in order of first use, and both are
+     * written. External vertices keep their positions, since they are
+     * shared with other clumps.
+     *
+     * The parameters are as for @ref writeChunkVertices and @ref writeChunkTriangles.
+     * The @a normals are indexed by the vertex positions before renumbering.
+     *
+     * @pre @ref finalize has been called
+     */
+    void writeChunkReordered(
+        Timeplot::Worker &tworker,
+        BinaryReader &verticesTmpRead,
+        BinaryReader &trianglesTmpRead,
+        AsyncWriter &asyncWriter,
+        FastPly::Writer &writer,
+        const Chunk::clump_list_type &chunkClumps,
+        const kept_clumps_type &kept,
         std::size_t chunkExternal,
         const std::tr1::uint32_t *startVertex,
         const FastPly::Writer::size_type *startTriangle,
         const std::tr1::uint32_t *externalRemap,
+        const vertex_type *normals,
         Statistics::Container::PODBuffer<triangle_type> &triangles,
         ProgressMeter *progress,
         std::size_t firstClump, std::size_t lastClump);
 
+    /**
+     * State shared by the threads that write output files in @ref write.
+     * Chunks are handed out in order by @ref popChunk.
+     */
+    struct WriteState
+    {
+        BinaryReader *verticesTmpRead;         ///< Reader for the vertices temporary file
+        BinaryReader *trianglesTmpRead;        ///< Reader for the triangles temporary file
+        BinaryReader *clumpsTmpRead;           ///< Reader for the clumps temporary file (may be @c NULL)
+        /// Chunks to write, indexed by the entries of @ref order
+        const Statistics::Container::vector<Chunk> *chunks;
+        const kept_clumps_type *kept;          ///< Retained clumps
+        std::size_t asyncMem;                  ///< Result of @ref getAsyncMem
+        ProgressMeter *progress;               ///< Progress meter (may be @c NULL)
+        /// Threads sharing each output file (see @ref setParallelWrite)
+        std::size_t clumpThreads;
+        /// Indices of the chunks in the order they are handed out
+        std::vector<std::size_t> order;
+        /// Offset of each chunk in the container (empty if not writing a container)
+        std::vector<FastPly::Writer::size_type> containerOffset;
+
+        boost::mutex mutex;                    ///< Protects @ref nextChunk, @ref index and @ref boundary
+        std::size_t nextChunk;                 ///< Next position in @ref order to hand out
+        std::size_t lastChunk;                 ///< One past the last position in @ref order to hand out
+        std::vector<ChunkIndexEntry> index;    ///< Index entries for the chunks written so far
+        /// Boundary vertices of the chunks written so far (see @ref setTileBoundary)
+        TileBoundary::Record boundary;
+
+        /**
+         * Retrieve the index of the next chunk to write.
+         * @return @c false if there are no chunks left
+         */
+        bool popChunk(std::size_t &index);
+
+        /// Record an entry for the chunk index
+        void addIndexEntry(const ChunkIndexEntry &entry);
+
+        /**
+         * Record the boundary vertices of a chunk, given the final index of
+         * each external vertex. Vertices that were pruned are skipped.
+         */
+        void addBoundary(const TileBoundary::OutputFile &file,
+                         const Statistics::Container::vector<TileBoundary::Vertex> &vertices,
+                         const std::tr1::uint32_t *externalRemap);
+
+        /// Stop handing out chunks, after an error
+        void stop();
+    };
+
+    /**
+     * Write the output files for chunks taken from @a state, until there
+     * are none left. Each call has its own buffers and @ref AsyncWriter, so
+     * several calls can run concurrently provided they use different writers.
+     *
+     * @param tworker           Timeplot worker for the current thread
+     * @param writer            Writer for the output files (not open)
+     * @param state             Shared state
+     * @return The number of output files written
+     *
+     * @pre @ref finalize has been called, or the chunks have been released
+     * and their data flushed to the temporary files (see @ref writeStreamed).
+     */
+    std::size_t writeChunks(Timeplot::Worker &tworker, FastPly::Writer &writer, WriteState &state);
+
+    /**
+     * Thread body for @ref write when several output files are written
+     * at once. Exceptions are captured in @a error.
+     */
+    void writeChunksWorker(
+        unsigned int idx, FastPly::Writer &writer, WriteState &state,
+        std::size_t &outputFiles, boost::exception_ptr &error);
+
+    /**
+     * Layout of one open output file, as computed by @ref writeChunkPrepare.
+     */
+    struct ChunkLayout
+    {
+        const Chunk::clump_list_type *chunkClumps;       ///< Clump records of the chunk
+        std::size_t chunkExternal;                       ///< See @ref getChunkStatistics
+        const std::tr1::uint32_t *startVertex;           ///< See @ref writeChunkPrepare
+        const FastPly::Writer::size_type *startTriangle; ///< See @ref writeChunkPrepare
+        const std::tr1::uint32_t *externalRemap;         ///< See @ref writeChunkPrepare
+        const vertex_type *normals;                      ///< See @ref writeChunkNormals (may be @c NULL)
+    };
+
+    /**
+     * Write the vertices and triangles of the clumps in [@a firstClump,
+     * @a lastClump) of an open output file, with its own buffers and @ref
+     * AsyncWriter. Since the position of every clump in the file is fixed by
+     * @a layout, several calls with disjoint ranges can run concurrently on
+     * the same writer. Exceptions are captured in @a error.
+     */
+    void writeClumpsWorker(
+        unsigned int idx, FastPly::Writer &writer, const WriteState &state,
+        const ChunkLayout &layout, std::size_t firstClump, std::size_t lastClump,
+        boost::exception_ptr &error);
+
+    /**
+     * @name
+     * @{
+     * Streaming of released chunks (see @ref setStreamChunks).
+     * @ref releaseChunk queues the generation number of each chunk, and a
+     * separate thread running @ref streamWorker writes them.
+     */
+    WorkQueue<boost::optional<ChunkId::gen_type> > streamQueue;
+    boost::scoped_ptr<boost::thread> streamThread;
+    boost::exception_ptr streamError;     ///< First error in @ref streamThread
+    std::size_t streamedFiles;            ///< Output files written by @ref streamThread
+    std::vector<ChunkIndexEntry> streamedIndex; ///< Index entries for the files in @ref streamedFiles
+    /** @} */
+
+    /**
+     * A released chunk taken out of the reorder buffer to be written from
+     * memory (see @ref setStreamDirect). The vertices and triangles are laid
+     * out as in the temporary files, and the clump records in
+     * <code>chunk.clumps</code> index them.
+     */
+    struct DirectChunk
+    {
+        Chunk chunk;                                            ///< Chunk with its clumps in memory
+        Statistics::Container::vector<char> vertices;           ///< Vertices in the temporary file encoding
+        Statistics::Container::vector<triangle_type> triangles; ///< Triangles in the temporary file encoding
+
+        DirectChunk()
+            : vertices("mem.OOCMesher::directVertices"),
+            triangles("mem.OOCMesher::directTriangles") {}
+    };
+
+    /**
+     * Chunks released with all their data in the reorder buffer, waiting
+     * for @ref streamThread (see @ref setStreamDirect). Protected by
+     * @ref addMutex.
+     */
+    std::map<ChunkId::gen_type, boost::shared_ptr<DirectChunk> > directChunks;
+
+    /**
+     * Move the buffered clumps of @a chunk out of the reorder buffer into
+     * @a out, so that they are not written to the temporary files. The
+     * chunk must have no clumps in the temporary files. This must be
+     * called with @ref addMutex held.
+     */
+    void takeBufferedChunk(Chunk &chunk, DirectChunk &out);
+
+    /**
+     * Write the output files for @a batch, reading the clumps through the
+     * given readers, and record them in @ref streamedFiles and @ref
+     * streamedIndex.
+     */
+    void writeStreamedBatch(
+        Timeplot::Worker &tworker,
+        const Statistics::Container::vector<Chunk> &batch,
+        const kept_clumps_type &kept,
+        BinaryReader *verticesRead, BinaryReader *trianglesRead, BinaryReader *clumpsRead);
+
+    /**
+     * Thread body for @ref streamThread. It takes every chunk that has been
+     * queued, so that the temporary files are only drained once for a batch
+     * of chunks released close together. Exceptions are captured in
+     * @ref streamError, after which queued chunks are ignored.
+     */
+    void streamWorker();
+
+    /**
+     * Write the output files for a batch of released chunks. Unless all of
+     * them were taken out of the reorder buffer at release (see @ref
+     * directChunks), the reorder buffer is flushed and @ref tmpWriter is
+     * drained while holding @ref addMutex. The retained clumps are computed
+     * from the component sizes at that time. The writing itself happens
+     * without the lock, on copies of the chunks, so that input continues to
+     * arrive.
+     */
+    void writeStreamed(Timeplot::Worker &tworker, const std::vector<ChunkId::gen_type> &gens);
+
+    /**
+     * Wait for @ref streamThread to write everything queued so far and shut
+     * it down. It is safe to call this if it was never started.
+     */
+    void stopStreaming();
+
 public:
     /**
      * @copydoc MesherBase::MesherBase
@@ -925,13 +2254,24 @@ public:
     ~OOCMesher();
 
     virtual unsigned int numPasses() const { return 1; }
+    virtual bool concurrentInput() const { return true; }
     virtual InputFunctor functor(unsigned int pass);
+    virtual void releaseChunk(ChunkId::gen_type gen);
     virtual std::size_t write(Timeplot::Worker &tworker, std::ostream *progressStream = NULL);
     virtual void checkpoint(Timeplot::Worker &tworker, const boost::filesystem::path &path);
     virtual std::size_t resume(Timeplot::Worker &tworker, const boost::filesystem::path &path,
                                std::ostream *progressStream = NULL);
+    virtual void snapshot(Timeplot::Worker &tworker, const boost::filesystem::path &path,
+                          std::tr1::uint64_t progress);
+    virtual bool restore(Timeplot::Worker &tworker, const boost::filesystem::path &path,
+                         std::tr1::uint64_t &progress);
 };
 
+/* Version 1 adds snapshots, version 2 adds resolution seams, version 3 adds key tiles,
+ * version 4 adds the clumps temporary file, version 5 adds compressed triangles
+ */
+BOOST_CLASS_VERSION(OOCMesher, 5)
+
 /**
  * Creates an adapter between @ref MesherBase::InputFunctor and @ref Marching::OutputFunctor
  * that reads the mesh from the device to the host synchronously.
@@ -33,27 +33,286 @@
 #endif
 
 #include <mpi.h>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <boost/array.hpp>
+#include <boost/foreach.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/smart_ptr/scoped_array.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/thread/thread.hpp>
 #include "statistics.h"
 #include "allocator.h"
+#include "errors.h"
+#include "misc.h"
+#include "union_find.h"
 #include "mesher.h"
 #include "mesher_mpi.h"
 #include "progress_mpi.h"
 #include "fast_ply_mpi.h"
 #include "serialize.h"
 
+ChunkOwner::ChunkOwner(const Grid &grid, Grid::size_type chunkCells, int parts)
+    : parts(parts)
+{
+    MLSGPU_ASSERT(parts > 0, std::invalid_argument);
+    for (int i = 0; i < 3; i++)
+        chunks[i] = chunkCells == 0 ? 1 : std::max(divUp(grid.numCells(i), chunkCells), Grid::size_type(1));
+}
+
+int ChunkOwner::operator()(const ChunkId &chunkId) const
+{
+    const std::tr1::uint64_t total = chunks[0] * chunks[1] * chunks[2];
+    std::tr1::uint64_t linear = 0;
+    for (int i = 2; i >= 0; i--)
+        linear = linear * chunks[i] + std::min(std::tr1::uint64_t(chunkId.coords[i]), chunks[i] - 1);
+    return int(linear * parts / total);
+}
+
 OOCMesherMPI::OOCMesherMPI(
     FastPly::WriterMPI &writer, const Namer &namer,
-    MPI_Comm comm, int root)
-    : OOCMesher(writer, namer), comm(comm), root(root)
+    MPI_Comm comm, int root, bool distributed)
+    : OOCMesher(writer, namer), comm(comm), root(root), distributed(distributed)
 {
-    if (rank != root)
-        retainFiles = true; // Only the master deletes files
     MPI_Comm_rank(comm, &rank);
     MPI_Comm_size(comm, &size);
+    if (rank != root && !distributed)
+        retainFiles = true; // Only the master deletes files
+}
+
+namespace
+{
+
+/// Record used to exchange pairs of values in @ref OOCMesherMPI::mergeShards
+typedef boost::array<std::tr1::uint64_t, 2> MergeRecord;
+
+/// Rank to which an external vertex key is sent to find matches
+static int keyOwner(cl_ulong key, int size)
+{
+    std::tr1::uint64_t h = std::tr1::uint64_t(key) * 0x9E3779B97F4A7C15ULL;
+    return int((h >> 32) % size);
+}
+
+/// Pointer to the records in a vector, or @c NULL if it is empty
+static MergeRecord *recordData(Statistics::Container::vector<MergeRecord> &v)
+{
+    return v.empty() ? NULL : &v[0];
+}
+
+/**
+ * Compute displacements from counts for a variable-length collective.
+ *
+ * @throw std::overflow_error if the total does not fit in an @c int.
+ */
+static std::vector<int> countOffsets(const std::vector<int> &counts)
+{
+    std::vector<int> offsets(counts.size() + 1, 0);
+    for (std::size_t i = 0; i < counts.size(); i++)
+    {
+        if (counts[i] > std::numeric_limits<int>::max() - offsets[i])
+            throw std::overflow_error("Too much connectivity data to exchange");
+        offsets[i + 1] = offsets[i] + counts[i];
+    }
+    return offsets;
+}
+
+} // anonymous namespace
+
+void OOCMesherMPI::mergeShards(
+    std::tr1::uint64_t &thresholdVertices,
+    clump_id &keptComponents,
+    std::tr1::uint64_t &keptVertices,
+    std::tr1::uint64_t &keptTriangles)
+{
+    Statistics::Timer timer("mesher.merge");
+    MPI_Datatype recordType;
+    MPI_Type_contiguous(2, Serialize::mpi_type_traits<std::tr1::uint64_t>::type(), &recordType);
+    MPI_Type_commit(&recordType);
+
+    /* Number the local components. A component is identified globally by its
+     * local number plus the number of components on lower ranks.
+     */
+    Statistics::Container::vector<clump_id> rootIndex("mem.OOCMesherMPI::rootIndex", clumps.size(), -1);
+    Statistics::Container::vector<MergeRecord> components("mem.OOCMesherMPI::components");
+    for (std::size_t i = 0; i < clumps.size(); i++)
+        if (clumps[i].isRoot())
+        {
+            rootIndex[i] = components.size();
+            MergeRecord r = {{ clumps[i].vertices, clumps[i].triangles }};
+            components.push_back(r);
+        }
+
+    int localComponents = components.size();
+    std::vector<int> numComponents(size);
+    MPI_Allgather(&localComponents, 1, MPI_INT, &numComponents[0], 1, MPI_INT, comm);
+    const std::vector<int> componentOffsets = countOffsets(numComponents);
+    if (componentOffsets[size] > std::numeric_limits<clump_id>::max())
+        throw std::overflow_error("There were too many connected components");
+
+    /* Send each external vertex key with the global ID of its component to
+     * the rank chosen by keyOwner. The grid is limited to a single key tile
+     * (see postprocessGrid), so the keys alone identify the vertices.
+     */
+    MLSGPU_ASSERT(keyTiles.size() <= 1, std::logic_error);
+    if (keyTiles.empty())
+        getKeyTile(0);
+    const clump_id_map_type &clumpIdMap = keyTiles[0].clumpIdMap;
+    if (clumpIdMap.size() > std::size_t(std::numeric_limits<int>::max()))
+        throw std::overflow_error("Too many external vertices to exchange");
+    std::vector<int> sendCounts(size, 0);
+    for (clump_id_map_type::const_iterator i = clumpIdMap.begin(); i != clumpIdMap.end(); ++i)
+        sendCounts[keyOwner(i->first, size)]++;
+    const std::vector<int> sendOffsets = countOffsets(sendCounts);
+
+    Statistics::Container::vector<MergeRecord> sendKeys("mem.OOCMesherMPI::sendKeys", clumpIdMap.size());
+    {
+        std::vector<int> pos(sendOffsets.begin(), sendOffsets.end() - 1);
+        for (clump_id_map_type::const_iterator i = clumpIdMap.begin(); i != clumpIdMap.end(); ++i)
+        {
+            const clump_id cid = UnionFind::findRoot(clumps, i->second);
+            MergeRecord r = {{ i->first, std::tr1::uint64_t(componentOffsets[rank] + rootIndex[cid]) }};
+            sendKeys[pos[keyOwner(i->first, size)]++] = r;
+        }
+    }
+
+    std::vector<int> recvCounts(size);
+    MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, comm);
+    const std::vector<int> recvOffsets = countOffsets(recvCounts);
+    Statistics::Container::vector<MergeRecord> recvKeys("mem.OOCMesherMPI::recvKeys", recvOffsets[size]);
+    MPI_Alltoallv(recordData(sendKeys), &sendCounts[0], &sendOffsets[0], recordType,
+                  recordData(recvKeys), &recvCounts[0], &recvOffsets[0], recordType, comm);
+    Statistics::Container::vector<MergeRecord>("mem.OOCMesherMPI::sendKeys").swap(sendKeys);
+
+    /* A key received from several ranks joins their components. Each rank
+     * has a given key at most once, and each counted the vertex.
+     */
+    std::sort(recvKeys.begin(), recvKeys.end());
+    Statistics::Container::vector<MergeRecord> edges("mem.OOCMesherMPI::edges");
+    std::tr1::uint64_t uniqueKeys = 0;
+    for (std::size_t i = 0; i < recvKeys.size(); i++)
+    {
+        if (i > 0 && recvKeys[i][0] == recvKeys[i - 1][0])
+        {
+            MergeRecord e = {{ recvKeys[i - 1][1], recvKeys[i][1] }};
+            edges.push_back(e);
+        }
+        else
+            uniqueKeys++;
+    }
+    Statistics::Container::vector<MergeRecord>("mem.OOCMesherMPI::recvKeys").swap(recvKeys);
+
+    std::tr1::uint64_t totalKeys = 0;
+    MPI_Reduce(&uniqueKeys, &totalKeys, 1, Serialize::mpi_type_traits<std::tr1::uint64_t>::type(),
+               MPI_SUM, root, comm);
+
+    // Collect the components and the edges between them on the root
+    if (edges.size() > std::size_t(std::numeric_limits<int>::max()))
+        throw std::overflow_error("Too much connectivity data to exchange");
+    int localEdges = edges.size();
+    std::vector<int> numEdges(size);
+    MPI_Gather(&localEdges, 1, MPI_INT, &numEdges[0], 1, MPI_INT, root, comm);
+    Statistics::Container::vector<MergeRecord> allEdges("mem.OOCMesherMPI::allEdges");
+    Statistics::Container::vector<MergeRecord> allComponents("mem.OOCMesherMPI::allComponents");
+    std::vector<int> edgeOffsets;
+    if (rank == root)
+    {
+        edgeOffsets = countOffsets(numEdges);
+        allEdges.resize(edgeOffsets[size]);
+        allComponents.resize(componentOffsets[size]);
+    }
+    MPI_Gatherv(recordData(edges), localEdges, recordType,
+                recordData(allEdges), &numEdges[0], rank == root ? &edgeOffsets[0] : NULL, recordType,
+                root, comm);
+    MPI_Gatherv(recordData(components), localComponents, recordType,
+                recordData(allComponents), &numComponents[0], &componentOffsets[0], recordType,
+                root, comm);
+
+    boost::array<std::tr1::uint64_t, 4> totals;
+    if (rank == root)
+    {
+        Statistics::Container::vector<Clump> merged("mem.OOCMesherMPI::merged");
+        merged.reserve(allComponents.size());
+        for (std::size_t i = 0; i < allComponents.size(); i++)
+        {
+            merged.push_back(Clump(allComponents[i][0]));
+            merged.back().triangles = allComponents[i][1];
+        }
+        for (std::size_t i = 0; i < allEdges.size(); i++)
+        {
+            // As in updateClumpKeyMap, the shared vertex was counted twice
+            clump_id a = allEdges[i][0];
+            clump_id b = allEdges[i][1];
+            UnionFind::merge(merged, a, b);
+            merged[UnionFind::findRoot(merged, a)].vertices--;
+        }
+
+        std::tr1::uint64_t totalVertices = 0;
+        clump_id totalComponents = 0;
+        BOOST_FOREACH(const Clump &clump, merged)
+        {
+            if (clump.isRoot())
+                totalVertices += clump.vertices;
+        }
+        thresholdVertices = getPruneThresholdVertices(totalVertices);
+
+        keptComponents = 0;
+        keptVertices = 0;
+        keptTriangles = 0;
+        BOOST_FOREACH(const Clump &clump, merged)
+        {
+            if (clump.isRoot())
+            {
+                totalComponents++;
+                if (clump.vertices >= thresholdVertices)
+                {
+                    keptComponents++;
+                    keptVertices += clump.vertices;
+                    keptTriangles += clump.triangles;
+                }
+            }
+        }
+
+        Statistics::Registry &registry = Statistics::Registry::getInstance();
+        registry.getStatistic<Statistics::Variable>("components.vertices.threshold").add(thresholdVertices);
+        registry.getStatistic<Statistics::Variable>("components.vertices.total").add(totalVertices);
+        registry.getStatistic<Statistics::Variable>("components.vertices.kept").add(keptVertices);
+        registry.getStatistic<Statistics::Variable>("components.triangles.kept").add(keptTriangles);
+        registry.getStatistic<Statistics::Variable>("components.total").add(totalComponents);
+        registry.getStatistic<Statistics::Variable>("components.kept").add(keptComponents);
+        registry.getStatistic<Statistics::Variable>("externalvertices").add(totalKeys);
+        registry.getStatistic<Statistics::Variable>("mesher.merge.edges").add(allEdges.size());
+
+        for (std::size_t i = 0; i < allComponents.size(); i++)
+        {
+            const Clump &r = merged[UnionFind::findRoot(merged, clump_id(i))];
+            allComponents[i][0] = r.vertices;
+            allComponents[i][1] = r.triangles;
+        }
+        totals[0] = thresholdVertices;
+        totals[1] = keptComponents;
+        totals[2] = keptVertices;
+        totals[3] = keptTriangles;
+    }
+
+    // Return the sizes of the global components to the ranks that hold them
+    MPI_Scatterv(recordData(allComponents), &numComponents[0], &componentOffsets[0], recordType,
+                 recordData(components), localComponents, recordType, root, comm);
+    MPI_Bcast(totals.data(), totals.size(), Serialize::mpi_type_traits<std::tr1::uint64_t>::type(), root, comm);
+    thresholdVertices = totals[0];
+    keptComponents = totals[1];
+    keptVertices = totals[2];
+    keptTriangles = totals[3];
+
+    for (std::size_t i = 0; i < clumps.size(); i++)
+        if (clumps[i].isRoot())
+        {
+            clumps[i].vertices = components[rootIndex[i]][0];
+            clumps[i].triangles = components[rootIndex[i]][1];
+        }
+
+    MPI_Type_free(&recordType);
 }
 
 std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progressStream)
@@ -63,7 +322,11 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
     std::size_t outputFiles = 0;
 
     finalize(tworker);
-    if (rank == root)
+    if (distributed)
+    {
+        // Each rank already holds the data for its own chunks
+    }
+    else if (rank == root)
     {
         std::ostringstream dump;
         boost::archive::text_oarchive archive(dump);
@@ -85,13 +348,24 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
     verticesTmpRead->open(tmpWriter.getVerticesPath());
     boost::scoped_ptr<BinaryReader> trianglesTmpRead(createReader(SYSCALL_READER));
     trianglesTmpRead->open(tmpWriter.getTrianglesPath());
+    boost::scoped_ptr<BinaryReader> clumpsTmpRead;
+    if (!tmpWriter.getClumpsPath().empty())
+    {
+        clumpsTmpRead.reset(createReader(SYSCALL_READER));
+        clumpsTmpRead->open(tmpWriter.getClumpsPath());
+    }
 
     std::tr1::uint64_t thresholdVertices;
     clump_id keptComponents;
     std::tr1::uint64_t keptVertices, keptTriangles;
-    getStatistics(thresholdVertices, keptComponents, keptVertices, keptTriangles, rank == root);
+    if (distributed)
+        mergeShards(thresholdVertices, keptComponents, keptVertices, keptTriangles);
+    else
+        getStatistics(thresholdVertices, keptComponents, keptVertices, keptTriangles, rank == root);
 
-    std::size_t asyncMem = getAsyncMem(thresholdVertices);
+    kept_clumps_type kept("mem.OOCMesher::kept");
+    getKeptClumps(thresholdVertices, kept);
+    std::size_t asyncMem = getAsyncMem(chunks, kept, clumpsTmpRead.get());
 
     boost::scoped_ptr<ProgressDisplay> progressDisplay;
     boost::scoped_ptr<ProgressMPI> progress;
@@ -119,8 +393,12 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
     // Offset to first triangle of each clump in output file
     Statistics::Container::PODBuffer<FastPly::Writer::size_type> startTriangle("mem.OOCMesher::startTriangle");
     Statistics::Container::PODBuffer<triangle_type> triangles("mem.OOCMesher::triangles");
+    Statistics::Container::PODBuffer<vertex_type> normals("mem.OOCMesher::normals");
+    // Clump records of the current chunk, when read from the temporary file
+    Chunk::clump_list_type clumpBuffer("mem.OOCMesher::clumpBuffer");
 
-    AsyncWriter asyncWriter(1, asyncMem * 2); // * 2 to allow overlapping
+    AsyncWriter asyncWriter(1, asyncMem * 2, // * 2 to allow overlapping
+                            getAsyncCoalesce(asyncMem));
 
     /* When there are many chunks, we can simplify partition over chunks, and avoid worrying
      * about interference between output files. When there aren't enough chunks we have to
@@ -131,10 +409,24 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
      * to be complex logic to create a communicator for each subset of processes that share
      * access to a file, and to sequence the operations to avoid stalls.
      */
-    bool perChunk = (chunks.size() >= (std::size_t) size);
+    bool perChunk = distributed || (chunks.size() >= (std::size_t) size);
     std::size_t firstChunk, lastChunk;
 
-    if (perChunk)
+    /* Index data for the chunks written by this rank: the coordinates, file
+     * size, vertex count and triangle count of each. Only the root records
+     * chunks that are written collectively.
+     */
+    const bool recordIndex = !getChunkIndex().empty() && (perChunk || rank == root);
+    std::vector<std::tr1::uint64_t> indexRecords;
+
+    if (distributed)
+    {
+        // Chunks owned by other ranks are empty here
+        asyncWriter.start();
+        firstChunk = 0;
+        lastChunk = chunks.size();
+    }
+    else if (perChunk)
     {
         asyncWriter.start();
         firstChunk = mulDiv(chunks.size(), rank, size);
@@ -149,9 +441,10 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
     for (std::size_t i = firstChunk; i < lastChunk; i++)
     {
         const Chunk &chunk = chunks[i];
+        const Chunk::clump_list_type &chunkClumps = loadChunkClumps(clumpsTmpRead.get(), chunk, clumpBuffer);
         std::tr1::uint64_t chunkVertices, chunkTriangles, chunkExternal;
         // Note: chunkExternal includes discarded clumps, the others exclude them
-        getChunkStatistics(thresholdVertices, chunk, chunkVertices, chunkTriangles, chunkExternal);
+        getChunkStatistics(kept, chunk, chunkClumps, chunkVertices, chunkTriangles, chunkExternal);
 
         if (chunkTriangles > 0)
         {
@@ -160,8 +453,18 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
             {
                 if (!perChunk)
                     asyncWriter.start();
+                checkVertexFormat(chunk);
                 writer.setNumVertices(chunkVertices);
                 writer.setNumTriangles(chunkTriangles);
+                writer.setVertexTransform(chunk.quantizer.getScale(), chunk.quantizer.getBias());
+                if (recordIndex)
+                {
+                    for (unsigned int j = 0; j < 3; j++)
+                        indexRecords.push_back(chunk.chunkId.coords[j]);
+                    indexRecords.push_back(writer.getFileSize());
+                    indexRecords.push_back(chunkVertices);
+                    indexRecords.push_back(chunkTriangles);
+                }
                 if (perChunk)
                     writer.open(filename);
                 else
@@ -169,29 +472,43 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
                 outputFiles++;
 
                 writeChunkPrepare(
-                    chunk, thresholdVertices, chunkExternal,
+                    chunk, chunkClumps, kept, chunkExternal,
                     startVertex, startTriangle, externalRemap);
 
                 std::size_t first, last;
                 if (perChunk)
                 {
                     first = 0;
-                    last = chunk.clumps.size();
+                    last = chunkClumps.size();
                 }
                 else
                 {
-                    first = mulDiv(chunk.clumps.size(), rank, size);
-                    last = mulDiv(chunk.clumps.size(), rank + 1, size);
+                    first = mulDiv(chunkClumps.size(), rank, size);
+                    last = mulDiv(chunkClumps.size(), rank + 1, size);
+                }
+
+                /* The normals need every triangle of the chunk, so each
+                 * rank computes all of them even if it writes only some.
+                 */
+                const vertex_type *chunkNormals = NULL;
+                if (writer.getVertexNormals())
+                {
+                    writeChunkNormals(
+                        *verticesTmpRead, *trianglesTmpRead,
+                        chunk, chunkClumps, kept, chunkVertices, chunkExternal,
+                        startVertex.data(), externalRemap.data(),
+                        triangles, normals);
+                    chunkNormals = normals.data();
                 }
 
                 writeChunkVertices(
-                    tworker, *verticesTmpRead, asyncWriter, chunk,
-                    thresholdVertices, startVertex.data(), progress.get(),
+                    tworker, *verticesTmpRead, asyncWriter, writer, chunkClumps,
+                    kept, startVertex.data(), chunkNormals, progress.get(),
                     first, last);
 
                 writeChunkTriangles(
-                    tworker, *trianglesTmpRead, asyncWriter, chunk,
-                    thresholdVertices, chunkExternal,
+                    tworker, *trianglesTmpRead, asyncWriter, writer, chunkClumps,
+                    kept, chunkExternal,
                     startVertex.data(), startTriangle.data(), externalRemap.data(),
                     triangles, progress.get(),
                     first, last);
@@ -222,6 +539,41 @@ std::size_t OOCMesherMPI::write(Timeplot::Worker &tworker, std::ostream *progres
                    MPI_SUM, root, comm);
         outputFiles = totalOutputFiles;
     }
+    if (!getChunkIndex().empty())
+    {
+        if (indexRecords.size() > std::size_t(std::numeric_limits<int>::max()))
+            throw std::overflow_error("Too much index data to exchange");
+        int localRecords = indexRecords.size();
+        std::vector<int> numRecords(size);
+        MPI_Gather(&localRecords, 1, MPI_INT, &numRecords[0], 1, MPI_INT, root, comm);
+        std::vector<int> recordOffsets;
+        std::vector<std::tr1::uint64_t> allRecords;
+        if (rank == root)
+        {
+            recordOffsets = countOffsets(numRecords);
+            allRecords.resize(recordOffsets[size]);
+        }
+        const MPI_Datatype type = Serialize::mpi_type_traits<std::tr1::uint64_t>::type();
+        MPI_Gatherv(indexRecords.empty() ? NULL : &indexRecords[0], localRecords, type,
+                    allRecords.empty() ? NULL : &allRecords[0], &numRecords[0],
+                    rank == root ? &recordOffsets[0] : NULL, type,
+                    root, comm);
+        if (rank == root)
+        {
+            std::vector<ChunkIndexEntry> entries;
+            for (std::size_t i = 0; i + 6 <= allRecords.size(); i += 6)
+            {
+                ChunkId chunkId;
+                for (unsigned int j = 0; j < 3; j++)
+                    chunkId.coords[j] = allRecords[i + j];
+                entries.push_back(makeChunkIndexEntry(
+                        chunkId, getOutputName(chunkId), 0, allRecords[i + 3],
+                        allRecords[i + 4], allRecords[i + 5]));
+            }
+            writeChunkIndex(entries);
+        }
+    }
+
     if (rank == root)
     {
         progressThread->join();
@@ -31,13 +31,57 @@
 # include <config.h>
 #endif
 #include <mpi.h>
+#include <boost/array.hpp>
+#include "tr1_cstdint.h"
+#include "grid.h"
+#include "chunk_id.h"
 #include "fast_ply_mpi.h"
 #include "mesher.h"
 
+/**
+ * Assigns output chunks to ranks for @ref OOCMesherMPI in distributed mode.
+ * Chunks are enumerated in raster order (x fastest) and split into contiguous
+ * ranges, so that each rank owns a slab of space and most external vertices
+ * are shared only by chunks of the same rank.
+ *
+ * The number of chunks along each axis is estimated from the requested chunk
+ * size. The bucketing code may round the chunk size up, in which case there are
+ * fewer chunks than estimated and the last ranks receive less work, but the
+ * assignment is still consistent.
+ */
+class ChunkOwner
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param grid           The bounding grid of the whole reconstruction.
+     * @param chunkCells     Requested chunk size in cells, or 0 for a single chunk.
+     * @param parts          Number of ranks to share out the chunks.
+     */
+    ChunkOwner(const Grid &grid, Grid::size_type chunkCells, int parts);
+
+    /// Rank that owns a chunk
+    int operator()(const ChunkId &chunkId) const;
+
+private:
+    boost::array<std::tr1::uint64_t, 3> chunks;  ///< Estimated number of chunks along each axis
+    int parts;                                 ///< Number of ranks
+};
+
 /**
  * Mesher that uses MPI to parallelise the final writeback. Only one rank should
  * actually collect data, but @ref write is a collective operation that
  * distributes the writing process across all ranks.
+ *
+ * In distributed mode, every rank instead collects the data for the chunks
+ * that it owns (see @ref ChunkOwner), so that the welding and reordering is
+ * spread across the ranks. Each rank has its own temporary files. When writing,
+ * the clump connectivity is merged across ranks: every external vertex key is
+ * sent to a rank chosen by hashing, which finds keys seen by more than one rank
+ * and reports the implied merges to the root. The root then runs the
+ * union-find over the per-rank components (not the individual clumps) and
+ * returns the component sizes, after which every rank writes its own chunks.
  */
 class OOCMesherMPI : public OOCMesher
 {
@@ -48,9 +92,12 @@ public:
      * @param writer         Writer that will be used to emit output files.
      * @param namer          Callback function to assign names to output files.
      * @param comm           Intracommunicator for the collective group.
-     * @param root           Rank which contains the data to write.
+     * @param root           Rank which contains the data to write, or which
+     *                       merges connectivity in distributed mode.
+     * @param distributed    If true, every rank collects the data for its own chunks.
      */
-    OOCMesherMPI(FastPly::WriterMPI &writer, const Namer &namer, MPI_Comm comm, int root);
+    OOCMesherMPI(FastPly::WriterMPI &writer, const Namer &namer, MPI_Comm comm, int root,
+                 bool distributed = false);
 
     /**
      * @copydoc OOCMesher::write
@@ -64,6 +111,20 @@ private:
     int root;       ///< Rank which contains the data to write
     int rank;       ///< Self rank
     int size;       ///< Size of the communicator
+    bool distributed; ///< Whether each rank collects its own chunks
+
+    /**
+     * Combine the connectivity of the components on all ranks, in distributed
+     * mode. On return, every root in @ref clumps holds the vertex and triangle
+     * counts of the global component that contains it, and the outputs have
+     * the same meaning as for @ref getStatistics (on all ranks). Statistics are
+     * recorded on the root. This is a collective operation.
+     */
+    void mergeShards(
+        std::tr1::uint64_t &thresholdVertices,
+        clump_id &keptComponents,
+        std::tr1::uint64_t &keptVertices,
+        std::tr1::uint64_t &keptTriangles);
 };
 
 #endif /* !MESHER_MPI_H */
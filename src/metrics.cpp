@@ -0,0 +1,261 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Periodic export of statistics and live gauges.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string>
+#include <ostream>
+#include <fstream>
+#include <stdexcept>
+#include <list>
+#include <map>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include "metrics.h"
+#include "statistics.h"
+#include "thread_name.h"
+#include "logging.h"
+#include "errors.h"
+
+namespace Metrics
+{
+
+namespace
+{
+
+/// Mutex protecting @ref gauges. It is held while gauges are sampled.
+boost::mutex &gaugeMutex()
+{
+    static boost::mutex mutex;
+    return mutex;
+}
+
+/// All live gauges, in order of creation
+std::list<const Gauge *> &gauges()
+{
+    static std::list<const Gauge *> list;
+    return list;
+}
+
+/// Convert an internal name into a legal metric name
+std::string metricName(const std::string &name)
+{
+    std::string ans = "mlsgpu_";
+    for (std::string::size_type i = 0; i < name.size(); i++)
+    {
+        char c = name[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')
+            ans += c;
+        else
+            ans += '_';
+    }
+    return ans;
+}
+
+/// Visitor for @ref Statistics::Registry::visit that writes each statistic
+class StatisticWriter
+{
+public:
+    explicit StatisticWriter(std::ostream &o) : o(o) {}
+
+    void operator()(const Statistics::Statistic &stat)
+    {
+        const std::string name = metricName(stat.getName());
+        if (const Statistics::Counter *c = dynamic_cast<const Statistics::Counter *>(&stat))
+        {
+            o << "# TYPE " << name << " counter\n"
+                << name << ' ' << c->getTotal() << '\n';
+        }
+        else if (const Statistics::Histogram *h = dynamic_cast<const Statistics::Histogram *>(&stat))
+        {
+            unsigned long long n = h->getNumSamples();
+            o << "# TYPE " << name << " summary\n";
+            if (n > 0)
+            {
+                static const double quantiles[] = {0.5, 0.9, 0.99};
+                for (unsigned int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+                    o << name << "{quantile=\"" << quantiles[i] << "\"} "
+                        << h->getPercentile(quantiles[i]) << '\n';
+            }
+            o << name << "_sum " << (n > 0 ? h->getMean() * n : 0.0) << '\n'
+                << name << "_count " << n << '\n';
+        }
+        else if (const Statistics::Variable *v = dynamic_cast<const Statistics::Variable *>(&stat))
+        {
+            unsigned long long n = v->getNumSamples();
+            double sum = n > 0 ? v->getMean() * n : 0.0;
+            o << "# TYPE " << name << " summary\n"
+                << name << "_sum " << sum << '\n'
+                << name << "_count " << n << '\n';
+        }
+        else if (const Statistics::Peak *p = dynamic_cast<const Statistics::Peak *>(&stat))
+        {
+            o << "# TYPE " << name << " gauge\n"
+                << name << ' ' << p->get() << '\n'
+                << "# TYPE " << name << "_max gauge\n"
+                << name << "_max " << p->getMax() << '\n';
+        }
+        else if (const Statistics::Throughput *t = dynamic_cast<const Statistics::Throughput *>(&stat))
+        {
+            o << "# TYPE " << name << "_bytes counter\n"
+                << name << "_bytes " << t->getBytes() << '\n'
+                << "# TYPE " << name << "_seconds counter\n"
+                << name << "_seconds " << t->getTime() << '\n';
+        }
+    }
+
+private:
+    std::ostream &o;
+};
+
+} // anonymous namespace
+
+Gauge::Gauge(const std::string &name, const Probe &probe)
+    : name(name), probe(probe)
+{
+    boost::lock_guard<boost::mutex> lock(gaugeMutex());
+    gauges().push_back(this);
+}
+
+Gauge::~Gauge()
+{
+    boost::lock_guard<boost::mutex> lock(gaugeMutex());
+    gauges().remove(this);
+}
+
+void write(std::ostream &o, const Statistics::Registry &registry)
+{
+    StatisticWriter writer(o);
+    registry.visit(writer);
+
+    boost::lock_guard<boost::mutex> lock(gaugeMutex());
+    std::map<std::string, std::list<const Gauge *> > byName;
+    for (std::list<const Gauge *>::const_iterator i = gauges().begin(); i != gauges().end(); ++i)
+        byName[metricName((*i)->getName())].push_back(*i);
+
+    for (std::map<std::string, std::list<const Gauge *> >::const_iterator i = byName.begin();
+         i != byName.end(); ++i)
+    {
+        o << "# TYPE " << i->first << " gauge\n";
+        if (i->second.size() == 1)
+            o << i->first << ' ' << i->second.front()->sample() << '\n';
+        else
+        {
+            int instance = 0;
+            for (std::list<const Gauge *>::const_iterator j = i->second.begin();
+                 j != i->second.end(); ++j, ++instance)
+                o << i->first << "{instance=\"" << instance << "\"} " << (*j)->sample() << '\n';
+        }
+    }
+}
+
+Exporter::Exporter(const std::string &filename, double interval)
+    : filename(filename), interval(interval), stopping(false)
+{
+    MLSGPU_ASSERT(interval > 0.0, std::invalid_argument);
+}
+
+Exporter::~Exporter()
+{
+    if (thread)
+    {
+        try
+        {
+            stop();
+        }
+        catch (std::ios::failure &)
+        {
+            // Destructors must not throw
+        }
+    }
+}
+
+void Exporter::start()
+{
+    MLSGPU_ASSERT(!thread, state_error);
+    update();
+    stopping = false;
+    thread.reset(new boost::thread(boost::bind(&Exporter::run, this)));
+}
+
+void Exporter::stop()
+{
+    MLSGPU_ASSERT(thread, state_error);
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+        stopCondition.notify_all();
+    }
+    thread->join();
+    thread.reset();
+    update();
+}
+
+void Exporter::update()
+{
+    const std::string tmpName = filename + ".tmp";
+    {
+        std::ofstream out(tmpName.c_str());
+        out.exceptions(std::ios::failbit | std::ios::badbit);
+        write(out, Statistics::Registry::getInstance());
+        out.close();
+    }
+    if (std::rename(tmpName.c_str(), filename.c_str()) != 0)
+        throw std::ios::failure("Could not rename " + tmpName + ": " + std::strerror(errno));
+}
+
+void Exporter::run()
+{
+    thread_set_name("metrics");
+    const boost::posix_time::time_duration period =
+        boost::posix_time::microseconds((long long) (interval * 1e6));
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!stopping)
+    {
+        stopCondition.timed_wait(lock, period);
+        if (stopping)
+            break;
+        lock.unlock();
+        try
+        {
+            update();
+        }
+        catch (std::ios::failure &e)
+        {
+            Log::log[Log::warn] << "Failed to write metrics: " << e.what() << '\n';
+        }
+        lock.lock();
+    }
+}
+
+} // namespace Metrics
@@ -0,0 +1,136 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Periodic export of statistics and live gauges while a run is in progress.
+ *
+ * The output uses the Prometheus text exposition format, so the file can be
+ * picked up by the node exporter's textfile collector or simply inspected by
+ * hand. Statistic names are prefixed with @c mlsgpu_ and characters that are
+ * not legal in metric names are replaced by underscores.
+ */
+
+#ifndef MLSGPU_METRICS_H
+#define MLSGPU_METRICS_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <string>
+#include <ostream>
+#include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+
+namespace boost { class thread; }
+
+namespace Statistics { class Registry; }
+
+namespace Metrics
+{
+
+/// Function that samples the current value of a gauge
+typedef boost::function<double()> Probe;
+
+/**
+ * A value that is sampled each time metrics are written, such as the depth of
+ * a queue. The gauge is registered for the lifetime of the object. The probe
+ * is called with an internal lock held, so destroying the gauge waits for any
+ * call in progress, but the probe must not itself create or destroy gauges.
+ *
+ * Several gauges may share a name; they are then distinguished by an
+ * @c instance label in the output.
+ */
+class Gauge : public boost::noncopyable
+{
+public:
+    Gauge(const std::string &name, const Probe &probe);
+    ~Gauge();
+
+    const std::string &getName() const { return name; }
+
+    /// Sample the current value
+    double sample() const { return probe(); }
+
+private:
+    const std::string name;
+    const Probe probe;
+};
+
+/**
+ * Write a snapshot of all the statistics in @a registry and all live gauges.
+ */
+void write(std::ostream &o, const Statistics::Registry &registry);
+
+/**
+ * Background thread that periodically rewrites a file with the output of
+ * @ref write for the default registry. The file is replaced atomically, so a
+ * reader never sees a partial snapshot.
+ */
+class Exporter : public boost::noncopyable
+{
+public:
+    /**
+     * Constructor. This does not start the thread.
+     *
+     * @param filename    File to write.
+     * @param interval    Seconds between updates.
+     *
+     * @pre @a interval &gt; 0.
+     */
+    Exporter(const std::string &filename, double interval);
+
+    /// Destructor. This stops the thread if it is running.
+    ~Exporter();
+
+    /// Start the thread. This also writes an initial snapshot.
+    void start();
+
+    /// Stop the thread and write a final snapshot.
+    void stop();
+
+    /**
+     * Write a snapshot immediately.
+     *
+     * @throw std::ios::failure if the file could not be written.
+     */
+    void update();
+
+private:
+    const std::string filename;
+    const double interval;
+
+    boost::mutex mutex;
+    boost::condition_variable stopCondition;
+    bool stopping;                        ///< Protected by @ref mutex
+    boost::scoped_ptr<boost::thread> thread;
+
+    /// Thread function
+    void run();
+};
+
+} // namespace Metrics
+
+#endif /* !MLSGPU_METRICS_H */
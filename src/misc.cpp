@@ -38,8 +38,15 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/exception/all.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
-static boost::filesystem::path tmpFileDir;
+/// Directories for temporary files, or empty to use the default
+static std::vector<boost::filesystem::path> tmpFileDirs;
+/// Index into @ref tmpFileDirs of the directory for the next temporary file
+static std::size_t tmpFileNext = 0;
+/// Mutex protecting @ref tmpFileDirs and @ref tmpFileNext
+static boost::mutex tmpFileMutex;
 
 DownDivider::DownDivider(std::tr1::uint32_t d)
 {
@@ -75,7 +82,16 @@ DownDivider::DownDivider(std::tr1::uint32_t d)
 
 void createTmpFile(boost::filesystem::path &path, boost::filesystem::ofstream &out)
 {
-    path = tmpFileDir;
+    {
+        boost::lock_guard<boost::mutex> lock(tmpFileMutex);
+        if (!tmpFileDirs.empty())
+        {
+            path = tmpFileDirs[tmpFileNext];
+            tmpFileNext = (tmpFileNext + 1) % tmpFileDirs.size();
+        }
+        else
+            path.clear();
+    }
     if (path.empty())
         path = boost::filesystem::temp_directory_path();
     boost::filesystem::path name = boost::filesystem::unique_path("mlsgpu-tmp-%%%%-%%%%-%%%%-%%%%");
@@ -92,5 +108,21 @@ void createTmpFile(boost::filesystem::path &path, boost::filesystem::ofstream &o
 
 void setTmpFileDir(const boost::filesystem::path &path)
 {
-    tmpFileDir = path;
+    std::vector<boost::filesystem::path> paths;
+    if (!path.empty())
+        paths.push_back(path);
+    setTmpFileDirs(paths);
+}
+
+void setTmpFileDirs(const std::vector<boost::filesystem::path> &paths)
+{
+    boost::lock_guard<boost::mutex> lock(tmpFileMutex);
+    tmpFileDirs = paths;
+    tmpFileNext = 0;
+}
+
+std::size_t getTmpFileDirCount()
+{
+    boost::lock_guard<boost::mutex> lock(tmpFileMutex);
+    return tmpFileDirs.empty() ? 1 : tmpFileDirs.size();
 }
@@ -36,6 +36,8 @@
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <limits>
+#include <vector>
+#include <cstddef>
 #include "tr1_cstdint.h"
 #include <cstring>
 #include <stdexcept>
@@ -193,9 +195,12 @@ static inline std::tr1::uint32_t floatToBits(float x)
 }
 
 /**
- * Create and open a temporary file. If @ref setTmpFileDir has been called, that
- * directory is used, otherwise it uses the @c boost::filesystem default. The
- * file is opened for output in binary mode.
+ * Create and open a temporary file. If @ref setTmpFileDir or @ref
+ * setTmpFileDirs has been called, one of those directories is used, otherwise
+ * it uses the @c boost::filesystem default. When there are several
+ * directories, successive calls cycle through them, so that the temporary
+ * files are striped across the devices holding them. The file is opened for
+ * output in binary mode. It is safe to call this from several threads.
  *
  * @param[out] path      The path to the temporary file.
  * @param[out] out       The open temporary file.
@@ -211,4 +216,16 @@ void createTmpFile(boost::filesystem::path &path, boost::filesystem::ofstream &o
  */
 void setTmpFileDir(const boost::filesystem::path &tmpFileDir);
 
+/**
+ * Set several directories to use for temporary files created by @ref
+ * createTmpFile. An empty list restores the default.
+ */
+void setTmpFileDirs(const std::vector<boost::filesystem::path> &tmpFileDirs);
+
+/**
+ * Return the number of directories over which temporary files are striped.
+ * This is 1 if the default directory is in use.
+ */
+std::size_t getTmpFileDirCount();
+
 #endif /* MLSGPU_MISC_H */
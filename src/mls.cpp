@@ -35,12 +35,19 @@
 #include <CL/cl.hpp>
 #include <stdexcept>
 #include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
+#include <cassert>
+#include <cstring>
 #include <boost/math/constants/constants.hpp>
+#include <boost/lexical_cast.hpp>
 #include "errors.h"
 #include "mls.h"
 #include "clh.h"
 #include "misc.h"
 #include "statistics.h"
+#include "statistics_cl.h"
 
 std::map<std::string, MlsShape> MlsShapeWrapper::getNameMap()
 {
@@ -50,28 +57,161 @@ std::map<std::string, MlsShape> MlsShapeWrapper::getNameMap()
     return ans;
 }
 
+std::map<std::string, MlsBoundary> MlsBoundaryWrapper::getNameMap()
+{
+    std::map<std::string, MlsBoundary> ans;
+    ans["moments"] = MLS_BOUNDARY_MOMENTS;
+    ans["nearest"] = MLS_BOUNDARY_NEAREST;
+    return ans;
+}
+
 const Grid::size_type MlsFunctor::wgs[3] = {8, 8, 8};
 const int MlsFunctor::subsamplingMin = 3; // must be at least log2 of highest wgs
 
-MlsFunctor::MlsFunctor(const cl::Context &context, MlsShape shape)
-    : kernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.processCorners.time"))
+bool MlsFunctor::validGroupSize(const Grid::size_type groupSize[3])
+{
+    // Must match MAX_BUCKET in mls.cl
+    const Grid::size_type maxBucket = 256;
+    for (int i = 0; i < 3; i++)
+    {
+        if (groupSize[i] == 0 || groupSize[i] > wgs[i] || (groupSize[i] & (groupSize[i] - 1)))
+            return false;
+    }
+    return groupSize[0] * groupSize[1] * groupSize[2] >= maxBucket;
+}
+
+MlsFunctor::MlsFunctor(const cl::Context &context, MlsShape shape,
+                       const Grid::size_type *groupSize,
+                       SplatLayout layout, bool sparse,
+                       Marching::DistanceStorage storage, cl_channel_type distanceType,
+                       MlsBoundary boundary)
+    : kernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.processCorners.time")),
+    compactKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.compactBlocks.time")),
+    clearKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.clearBlocks.time")),
+    occupiedStat(Statistics::getStatistic<Statistics::Variable>("mls.blocks.occupied")),
+    layout(layout),
+    sparse(sparse),
+    boundary(boundary),
+    storage(storage),
+    distanceBytes(distanceType == CL_HALF_FLOAT ? sizeof(cl_half) : sizeof(cl_float)),
+    context(context),
+    blocksSize(0),
+    blockCounts(context, CL_MEM_READ_WRITE, 2 * sizeof(cl_uint)),
+    sliceSignsSize(0),
+    specialize(CLH::getSpecializeKernels())
 {
     // These would ideally be static assertions, but C++ doesn't allow that
     MLSGPU_ASSERT((1U << subsamplingMin) >= *std::max_element(wgs, wgs + 3), std::length_error);
+    MLSGPU_ASSERT(groupSize == NULL || validGroupSize(groupSize), std::invalid_argument);
 
-    std::map<std::string, std::string> defines;
-    defines["WGS_X"] = boost::lexical_cast<std::string>(wgs[0]);
-    defines["WGS_Y"] = boost::lexical_cast<std::string>(wgs[1]);
-    defines["WGS_Z"] = boost::lexical_cast<std::string>(wgs[2]);
+    if (groupSize == NULL)
+        groupSize = wgs;
+    std::copy(groupSize, groupSize + 3, this->groupSize);
+
+    defines["WGS_X"] = boost::lexical_cast<std::string>(groupSize[0]);
+    defines["WGS_Y"] = boost::lexical_cast<std::string>(groupSize[1]);
+    defines["WGS_Z"] = boost::lexical_cast<std::string>(groupSize[2]);
     defines["FIT_SPHERE"] = shape == MLS_SHAPE_SPHERE ? "1" : "0";
     defines["FIT_PLANE"] = shape == MLS_SHAPE_PLANE ? "1" : "0";
+    defines["PACKED_SPLATS"] = layout == SPLAT_LAYOUT_PACKED ? "1" : "0";
+    defines["SPARSE_START"] = sparse ? "1" : "0";
+    defines["DISTANCE_BUFFER"] = storage == Marching::DISTANCE_BUFFER ? "1" : "0";
+    defines["DISTANCE_HALF"] = distanceType == CL_HALF_FLOAT ? "1" : "0";
+    defines["BOUNDARY_NEAREST"] = boundary == MLS_BOUNDARY_NEAREST ? "1" : "0";
 
-    cl::Program program = CLH::build(context, "kernels/mls.cl", defines);
-    kernel = cl::Kernel(program, "processCorners");
+    /* Request the subgroup variant of processCorners if every device claims
+     * support. The kernel still falls back if the compiler does not expose
+     * the extension (e.g. cl_khr_subgroups before OpenCL C 2.0).
+     */
+    bool subgroups = true;
+    const std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+    for (std::size_t i = 0; i < devices.size(); i++)
+        subgroups = subgroups
+            && (CLH::hasExtension(devices[i], "cl_khr_subgroups")
+                || CLH::hasExtension(devices[i], "cl_intel_subgroups"));
+    defines["USE_SUBGROUPS"] = subgroups ? "1" : "0";
+
+    Kernels generic = makeKernels(defines);
+    kernel = generic.kernel;
+    compactKernel = generic.compactKernel;
+    clearKernel = generic.clearKernel;
 
     setBoundaryLimit(1.0f);
 }
 
+MlsFunctor::Kernels MlsFunctor::makeKernels(const std::map<std::string, std::string> &defines) const
+{
+    cl::Program program = CLH::build(context, "kernels/mls.cl", defines);
+    Kernels ans;
+    ans.kernel = cl::Kernel(program, "processCorners");
+    ans.compactKernel = cl::Kernel(program, "compactBlocks");
+    ans.clearKernel = cl::Kernel(program, "clearBlocks");
+    ans.compactKernel.setArg(1, blockCounts);
+    return ans;
+}
+
+void MlsFunctor::selectVariant(const Marching::Swathe &swathe)
+{
+    if (!specialize)
+        return;
+
+    // The bit pattern is used so that the constant is exact
+    cl_uint boundaryBits;
+    std::memcpy(&boundaryBits, &params.boundaryFactor, sizeof(boundaryBits));
+    std::map<std::string, std::string> extra;
+    extra["SPEC_START_SHIFT"] = boost::lexical_cast<std::string>(params.startShift) + "U";
+    extra["SPEC_Z_STRIDE"] = boost::lexical_cast<std::string>(swathe.zStride) + "U";
+    extra["SPEC_ROW_PITCH"] = boost::lexical_cast<std::string>(swathe.rowPitch) + "U";
+    extra["SPEC_BOUNDARY_FACTOR"] = "as_float(" + boost::lexical_cast<std::string>(boundaryBits) + "U)";
+    std::string key;
+    for (std::map<std::string, std::string>::const_iterator i = extra.begin(); i != extra.end(); ++i)
+        key += i->first + "=" + i->second + " ";
+    if (key == currentVariant)
+        return;
+
+    std::map<std::string, Kernels>::iterator pos = variants.find(key);
+    if (pos == variants.end())
+    {
+        std::map<std::string, std::string> variantDefines = defines;
+        variantDefines.insert(extra.begin(), extra.end());
+        pos = variants.insert(std::make_pair(key, makeKernels(variantDefines))).first;
+        Statistics::getStatistic<Statistics::Counter>("mls.variants").add(1);
+    }
+    kernel = pos->second.kernel;
+    compactKernel = pos->second.compactKernel;
+    clearKernel = pos->second.clearKernel;
+    currentVariant = key;
+
+    // Transfer the arguments that are not set on every enqueue
+    kernel.setArg(1, params.splats);
+    kernel.setArg(2, params.commands);
+    kernel.setArg(3, params.start);
+    kernel.setArg(4, params.startShift);
+    kernel.setArg(5, params.offset);
+    kernel.setArg(8, params.boundaryFactor);
+    compactKernel.setArg(2, params.start);
+    compactKernel.setArg(3, params.startShift);
+    if (sparse)
+    {
+        kernel.setArg(13, params.cellKeys);
+        kernel.setArg(14, params.numCells);
+        kernel.setArg(15, params.levels);
+        kernel.setArg(16, params.rootOffset);
+        compactKernel.setArg(5, params.cellKeys);
+        compactKernel.setArg(6, params.numCells);
+        compactKernel.setArg(7, params.levels);
+        compactKernel.setArg(8, params.rootOffset);
+    }
+    if (blocksSize > 0)
+    {
+        kernel.setArg(9, blocks);
+        compactKernel.setArg(0, blocks);
+        clearKernel.setArg(1, blocks);
+    }
+    if (sliceSignsSize > 0)
+        kernel.setArg(10, sliceSignsBuffer);
+}
+
 void MlsFunctor::set(const Grid::difference_type offset[3],
                      const cl::Buffer &splats,
                      const cl::Buffer &commands,
@@ -80,65 +220,455 @@ void MlsFunctor::set(const Grid::difference_type offset[3],
 {
     cl_int3 offset3 = {{ offset[0], offset[1], offset[2] }};
 
+    params.splats = splats;
+    params.commands = commands;
+    params.start = start;
+    params.startShift = 3 * subsamplingShift;
+    params.offset = offset3;
     kernel.setArg(1, splats);
     kernel.setArg(2, commands);
     kernel.setArg(3, start);
-    kernel.setArg(4, 3 * subsamplingShift);
+    kernel.setArg(4, params.startShift);
     kernel.setArg(5, offset3);
+    compactKernel.setArg(2, start);
+    compactKernel.setArg(3, params.startShift);
 }
 
 void MlsFunctor::set(const Grid::difference_type offset[3],
-                     const SplatTreeCL &tree, unsigned int subsamplingShift)
+                     const SplatTreeCL &tree, unsigned int subsamplingShift,
+                     std::size_t root)
 {
-    set(offset, tree.getSplats(), tree.getCommands(), tree.getStart(), subsamplingShift);
+    MLSGPU_ASSERT(tree.getLayout() == layout, std::invalid_argument);
+    MLSGPU_ASSERT(tree.isSparse() == sparse, std::invalid_argument);
+    set(offset, tree.getSplats(), tree.getCommands(), tree.getStart(root), subsamplingShift);
+    if (sparse)
+    {
+        const cl_uint levels = tree.getNumStartLevels();
+        const cl_ulong rootOffset = tree.getRootOffset(root);
+        params.cellKeys = tree.getCellKeys();
+        params.numCells = tree.getNumCells();
+        params.levels = levels;
+        params.rootOffset = rootOffset;
+        kernel.setArg(13, tree.getCellKeys());
+        kernel.setArg(14, tree.getNumCells());
+        kernel.setArg(15, levels);
+        kernel.setArg(16, rootOffset);
+        compactKernel.setArg(5, tree.getCellKeys());
+        compactKernel.setArg(6, tree.getNumCells());
+        compactKernel.setArg(7, levels);
+        compactKernel.setArg(8, rootOffset);
+    }
 }
 
 const Grid::size_type *MlsFunctor::alignment() const
 {
-    return wgs;
+    return groupSize;
 }
 
 void MlsFunctor::enqueue(
     const cl::CommandQueue &queue,
-    const cl::Image2D &distance,
+    const cl::Memory &distance,
     const Marching::Swathe &swathe,
     const std::vector<cl::Event> *events,
     cl::Event *event)
 {
-    Grid::size_type width = roundUp(swathe.width, wgs[0]);
-    Grid::size_type height = roundUp(swathe.height, wgs[1]);
+    Grid::size_type width = roundUp(swathe.width, groupSize[0]);
+    Grid::size_type height = roundUp(swathe.height, groupSize[1]);
+
+    selectVariant(swathe);
 
     MLSGPU_ASSERT(swathe.zStride >= height, std::invalid_argument);
     MLSGPU_ASSERT(swathe.zFirst <= swathe.zLast, std::invalid_argument);
-    MLSGPU_ASSERT(swathe.zFirst % wgs[2] == 0, std::invalid_argument);
-    MLSGPU_ASSERT(distance.getImageInfo<CL_IMAGE_WIDTH>() >= width, std::length_error);
-    MLSGPU_ASSERT(distance.getImageInfo<CL_IMAGE_HEIGHT>() >= swathe.zStride * (swathe.zLast + 1) + swathe.zBias, std::length_error);
-
-    kernel.setArg(0, distance);
-    kernel.setArg(6, cl_uint(swathe.zStride));
-    kernel.setArg(7, cl_int(swathe.zBias));
+    MLSGPU_ASSERT(swathe.zFirst % groupSize[2] == 0, std::invalid_argument);
+    const std::size_t rows = swathe.zStride * (swathe.zLast + 1) + swathe.zBias;
+    if (storage == Marching::DISTANCE_BUFFER)
+    {
+        MLSGPU_ASSERT(swathe.rowPitch >= width, std::invalid_argument);
+        MLSGPU_ASSERT(distance.getInfo<CL_MEM_SIZE>() >= rows * swathe.rowPitch * distanceBytes, std::length_error);
+    }
+    else
+    {
+        std::size_t imageWidth, imageHeight;
+        clGetImageInfo(distance(), CL_IMAGE_WIDTH, sizeof(imageWidth), &imageWidth, NULL);
+        clGetImageInfo(distance(), CL_IMAGE_HEIGHT, sizeof(imageHeight), &imageHeight, NULL);
+        MLSGPU_ASSERT(imageWidth >= width, std::length_error);
+        MLSGPU_ASSERT(imageHeight >= rows, std::length_error);
+    }
 
-    const std::size_t wgs3 = wgs[0] * wgs[1] * wgs[2];
-    const std::size_t blocks[3] =
+    const std::size_t wgs3 = groupSize[0] * groupSize[1] * groupSize[2];
+    const std::size_t dims[3] =
     {
-        width / wgs[0],
-        height / wgs[1],
-        divUp(swathe.zLast - swathe.zFirst + 1, wgs[2])
+        width / groupSize[0],
+        height / groupSize[1],
+        divUp(swathe.zLast - swathe.zFirst + 1, groupSize[2])
     };
+    const std::size_t zBlockFirst = swathe.zFirst / groupSize[2];
+    // Limits imposed by packBlock
+    MLSGPU_ASSERT(dims[0] <= 0x800 && dims[1] <= 0x800 && zBlockFirst + dims[2] <= 0x400,
+                  std::length_error);
+    const std::size_t numBlocks = dims[0] * dims[1] * dims[2];
+
+    if (blocksSize < numBlocks)
+    {
+        if (blocksDone())
+            blocksDone.wait();
+        blocks = cl::Buffer(context, CL_MEM_READ_WRITE, numBlocks * sizeof(cl_uint));
+        blocksSize = numBlocks;
+        kernel.setArg(9, blocks);
+        compactKernel.setArg(0, blocks);
+        clearKernel.setArg(1, blocks);
+    }
+
+    const std::size_t numSlices = dims[2] * groupSize[2];
+    if (sliceSignsSize < numSlices)
+    {
+        if (blocksDone())
+            blocksDone.wait();
+        sliceSignsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, numSlices * sizeof(cl_uint));
+        sliceSignsSize = numSlices;
+        hSliceSigns.resize(numSlices);
+        hSliceZeros.resize(numSlices, 0);
+        kernel.setArg(10, sliceSignsBuffer);
+    }
+
+    /* Classify the blocks. The previous swathe may still be using the
+     * block list, so wait for it as well as the caller's events.
+     */
+    std::vector<cl::Event> wait;
+    if (events != NULL)
+        wait = *events;
+    if (blocksDone())
+        wait.push_back(blocksDone);
+
+    static const cl_uint zeros[2] = {0, 0};
+    cl::Event zeroEvent, zeroSignsEvent, compactEvent;
+    queue.enqueueWriteBuffer(sliceSignsBuffer, CL_FALSE, 0, numSlices * sizeof(cl_uint), &hSliceZeros[0],
+                             wait.empty() ? NULL : &wait, &zeroSignsEvent);
+    queue.enqueueWriteBuffer(blockCounts, CL_FALSE, 0, sizeof(zeros), zeros,
+                             wait.empty() ? NULL : &wait, &zeroEvent);
+    wait.assign(1, zeroEvent);
+    compactKernel.setArg(4, cl_uint(numBlocks));
+    CLH::enqueueNDRangeKernel(queue,
+                              compactKernel,
+                              cl::NDRange(0, 0, zBlockFirst),
+                              cl::NDRange(dims[0], dims[1], dims[2]),
+                              cl::NullRange,
+                              &wait, &compactEvent, &compactKernelTime);
+    wait.assign(1, compactEvent);
+    queue.enqueueReadBuffer(blockCounts, CL_TRUE, 0, sizeof(hBlockCounts), hBlockCounts, &wait);
+    const std::size_t numOccupied = hBlockCounts[0];
+    assert(numOccupied + hBlockCounts[1] == numBlocks);
+    occupiedStat.add(double(numOccupied) / numBlocks);
 
+    cl::Event clearEvent;
+    clearKernel.setArg(0, distance);
+    clearKernel.setArg(2, cl_uint(numOccupied));
+    clearKernel.setArg(3, cl_uint(swathe.zStride));
+    clearKernel.setArg(4, cl_int(swathe.zBias));
+    clearKernel.setArg(5, cl_uint(swathe.rowPitch));
+    CLH::enqueueNDRangeKernel(queue,
+                              clearKernel,
+                              cl::NullRange,
+                              cl::NDRange(wgs3 * (numBlocks - numOccupied)),
+                              cl::NDRange(wgs3),
+                              &wait, &clearEvent, &clearKernelTime);
+
+    kernel.setArg(0, distance);
+    kernel.setArg(6, cl_uint(swathe.zStride));
+    kernel.setArg(7, cl_int(swathe.zBias));
+    kernel.setArg(11, cl_uint(swathe.zFirst));
+    kernel.setArg(12, cl_uint(swathe.rowPitch));
+    wait.assign(1, clearEvent);
+    wait.push_back(zeroSignsEvent);
+    cl::Event kernelEvent;
     CLH::enqueueNDRangeKernel(queue,
                               kernel,
-                              cl::NDRange(0, 0, swathe.zFirst),
-                              cl::NDRange(wgs3 * blocks[0], blocks[1], blocks[2]),
-                              cl::NDRange(wgs3, 1, 1),
-                              events, event, &kernelTime);
+                              cl::NullRange,
+                              cl::NDRange(wgs3 * numOccupied),
+                              cl::NDRange(wgs3),
+                              &wait, &kernelEvent, &kernelTime);
+
+    /* The caller waits for the flags before using the image, so the readback
+     * takes the place of the kernel event.
+     */
+    wait.assign(1, kernelEvent);
+    queue.enqueueReadBuffer(sliceSignsBuffer, CL_FALSE, 0, numSlices * sizeof(cl_uint), &hSliceSigns[0],
+                            &wait, &blocksDone);
+    if (event != NULL)
+        *event = blocksDone;
 }
 
-void MlsFunctor::setBoundaryLimit(float limit)
+const cl_uint *MlsFunctor::sliceSigns() const
+{
+    return hSliceSigns.empty() ? NULL : &hSliceSigns[0];
+}
+
+float MlsFunctor::boundaryFactor(float limit, MlsBoundary boundary)
 {
     // This is computed theoretically based on the weight function, and assuming a
     // uniform distribution of samples and a straight boundary
     const float boundaryScale = (sqrt(6.0f) * 512) / (693 * boost::math::constants::pi<float>());
     const float gamma = boundaryScale * limit;
-    kernel.setArg(8, 1.0f - gamma * gamma);
+    if (boundary == MLS_BOUNDARY_NEAREST)
+        return gamma * gamma;
+    return 1.0f - gamma * gamma;
+}
+
+void MlsFunctor::setBoundaryLimit(float limit)
+{
+    params.boundaryFactor = boundaryFactor(limit, boundary);
+    kernel.setArg(8, params.boundaryFactor);
+}
+
+ScatterMlsFunctor::ScatterMlsFunctor(
+    const cl::Context &context, const cl::Device &device, MlsShape shape,
+    const Grid::size_type *groupSize, SplatLayout layout,
+    Marching::DistanceStorage storage, cl_channel_type distanceType,
+    std::size_t maxPairs, MlsBoundary boundary)
+    : countKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.scatterCount.time")),
+    writeKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.scatterWrite.time")),
+    clearKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.scatterClear.time")),
+    cornersKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.mls.scatterCorners.time")),
+    scatteredStat(Statistics::getStatistic<Statistics::Counter>("mls.scatter.swathes")),
+    fallbackStat(Statistics::getStatistic<Statistics::Counter>("mls.scatter.fallback")),
+    context(context),
+    maxPairs(maxPairs),
+    countsSize(0),
+    scan(context, device, 1),
+    sort(context, device, clogs::TYPE_UINT, clogs::TYPE_UINT),
+    keys(context, CL_MEM_READ_WRITE, maxPairs * sizeof(cl_uint)),
+    values(context, CL_MEM_READ_WRITE, maxPairs * sizeof(cl_uint)),
+    tmpKeys(context, CL_MEM_READ_WRITE, maxPairs * sizeof(cl_uint)),
+    tmpValues(context, CL_MEM_READ_WRITE, maxPairs * sizeof(cl_uint)),
+    sliceSignsSize(0),
+    firstSplat(0), numSplats(0),
+    fallback(NULL),
+    usedFallback(false),
+    boundary(boundary)
+{
+    MLSGPU_ASSERT(maxPairs > 0 && maxPairs < 0xFFFFFFFFu, std::length_error);
+    MLSGPU_ASSERT(groupSize == NULL || MlsFunctor::validGroupSize(groupSize), std::invalid_argument);
+    if (groupSize == NULL)
+        groupSize = MlsFunctor::wgs;
+    std::copy(groupSize, groupSize + 3, this->groupSize);
+
+    std::map<std::string, std::string> defines;
+    defines["WGS_X"] = boost::lexical_cast<std::string>(groupSize[0]);
+    defines["WGS_Y"] = boost::lexical_cast<std::string>(groupSize[1]);
+    defines["WGS_Z"] = boost::lexical_cast<std::string>(groupSize[2]);
+    defines["FIT_SPHERE"] = shape == MLS_SHAPE_SPHERE ? "1" : "0";
+    defines["FIT_PLANE"] = shape == MLS_SHAPE_PLANE ? "1" : "0";
+    defines["PACKED_SPLATS"] = layout == SPLAT_LAYOUT_PACKED ? "1" : "0";
+    defines["SPARSE_START"] = "0";
+    defines["DISTANCE_BUFFER"] = storage == Marching::DISTANCE_BUFFER ? "1" : "0";
+    defines["DISTANCE_HALF"] = distanceType == CL_HALF_FLOAT ? "1" : "0";
+    defines["USE_SUBGROUPS"] = "0";
+    defines["BOUNDARY_NEAREST"] = boundary == MLS_BOUNDARY_NEAREST ? "1" : "0";
+    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device), "kernels/mls.cl", defines);
+    countKernel = cl::Kernel(program, "scatterCount");
+    writeKernel = cl::Kernel(program, "scatterWrite");
+    clearKernel = cl::Kernel(program, "scatterClear");
+    cornersKernel = cl::Kernel(program, "scatterCorners");
+
+    sort.setEventCallback(
+        &Statistics::timeEventCallback,
+        &Statistics::getStatistic<Statistics::Variable>("kernel.mls.scatterSort.time"));
+    sort.setTemporaryBuffers(tmpKeys, tmpValues);
+    scan.setEventCallback(
+        &Statistics::timeEventCallback,
+        &Statistics::getStatistic<Statistics::Variable>("kernel.mls.scatterScan.time"));
+
+    writeKernel.setArg(0, keys);
+    writeKernel.setArg(1, values);
+    cornersKernel.setArg(1, keys);
+    cornersKernel.setArg(2, values);
+    countKernel.setArg(8, cl_uint(maxPairs + 1));
+    setBoundaryLimit(1.0f);
+}
+
+std::size_t ScatterMlsFunctor::maxSplats(std::size_t maxPairs)
+{
+    // Every count is at most maxPairs + 1, and the scan must not overflow
+    return 0xFFFFFFFFu / (maxPairs + 1) - 1;
+}
+
+void ScatterMlsFunctor::set(
+    const Grid::difference_type offset[3], const cl::Buffer &splats,
+    std::size_t firstSplat, std::size_t numSplats, MlsFunctor &fallback)
+{
+    MLSGPU_ASSERT(std::equal(groupSize, groupSize + 3, fallback.alignment()), std::invalid_argument);
+    this->splats = splats;
+    this->firstSplat = firstSplat;
+    this->numSplats = numSplats;
+    this->offset.s[0] = offset[0];
+    this->offset.s[1] = offset[1];
+    this->offset.s[2] = offset[2];
+    this->fallback = &fallback;
+
+    countKernel.setArg(1, splats);
+    countKernel.setArg(2, cl_uint(firstSplat));
+    countKernel.setArg(3, cl_uint(numSplats));
+    countKernel.setArg(4, this->offset);
+    writeKernel.setArg(3, splats);
+    writeKernel.setArg(4, cl_uint(firstSplat));
+    writeKernel.setArg(5, this->offset);
+    cornersKernel.setArg(4, splats);
+    cornersKernel.setArg(5, this->offset);
+}
+
+void ScatterMlsFunctor::setBoundaryLimit(float limit)
+{
+    cornersKernel.setArg(11, MlsFunctor::boundaryFactor(limit, boundary));
+}
+
+const Grid::size_type *ScatterMlsFunctor::alignment() const
+{
+    return groupSize;
+}
+
+void ScatterMlsFunctor::enqueue(
+    const cl::CommandQueue &queue,
+    const cl::Memory &distance,
+    const Marching::Swathe &swathe,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    MLSGPU_ASSERT(fallback != NULL, state_error);
+    MLSGPU_ASSERT(swathe.zFirst <= swathe.zLast, std::invalid_argument);
+
+    usedFallback = false;
+    if (numSplats > maxSplats(maxPairs))
+    {
+        usedFallback = true;
+        fallbackStat.add(1);
+        fallback->enqueue(queue, distance, swathe, events, event);
+        return;
+    }
+
+    const Grid::size_type width = roundUp(swathe.width, groupSize[0]);
+    const Grid::size_type height = roundUp(swathe.height, groupSize[1]);
+    const std::size_t numSlices = swathe.zLast - swathe.zFirst + 1;
+    const std::tr1::uint64_t numCorners = std::tr1::uint64_t(width) * height * numSlices;
+    MLSGPU_ASSERT(numCorners <= 0xFFFFFFFFu, std::length_error);
+    cl_uint2 size = {{ cl_uint(width), cl_uint(height) }};
+
+    std::vector<cl::Event> wait;
+    if (events != NULL)
+        wait = *events;
+    if (done())
+        wait.push_back(done);
+
+    if (countsSize < numSplats + 1)
+    {
+        if (done())
+            done.wait();
+        counts = cl::Buffer(context, CL_MEM_READ_WRITE, (numSplats + 1) * sizeof(cl_uint));
+        countsSize = numSplats + 1;
+        scan.reserve(countsSize);
+        countKernel.setArg(0, counts);
+        writeKernel.setArg(2, counts);
+    }
+    if (sliceSignsSize < numSlices)
+    {
+        if (done())
+            done.wait();
+        sliceSignsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, numSlices * sizeof(cl_uint));
+        sliceSignsSize = numSlices;
+        hSliceSigns.resize(numSlices);
+        hSliceZeros.resize(numSlices, 0);
+        cornersKernel.setArg(12, sliceSignsBuffer);
+    }
+
+    // Count the pairs, and read back the total to see whether they fit
+    cl::Event countEvent, scanEvent;
+    countKernel.setArg(5, size);
+    countKernel.setArg(6, cl_uint(swathe.zFirst));
+    countKernel.setArg(7, cl_uint(swathe.zLast));
+    CLH::enqueueNDRangeKernel(queue, countKernel,
+                              cl::NullRange, cl::NDRange(numSplats + 1), cl::NullRange,
+                              wait.empty() ? NULL : &wait, &countEvent, &countKernelTime);
+    std::vector<cl::Event> countWait(1, countEvent);
+    scan.enqueue(queue, counts, numSplats + 1, NULL, &countWait, &scanEvent);
+    countWait.assign(1, scanEvent);
+    cl_uint numPairs;
+    queue.enqueueReadBuffer(counts, CL_TRUE, numSplats * sizeof(cl_uint), sizeof(cl_uint), &numPairs, &countWait);
+    if (numPairs > maxPairs)
+    {
+        usedFallback = true;
+        fallbackStat.add(1);
+        fallback->enqueue(queue, distance, swathe, events, event);
+        return;
+    }
+    scatteredStat.add(1);
+
+    // Corners with no pairs are left as NaN
+    cl::Event clearEvent, zeroSignsEvent;
+    clearKernel.setArg(0, distance);
+    clearKernel.setArg(1, cl_uint(swathe.zFirst));
+    clearKernel.setArg(2, cl_uint(swathe.zStride));
+    clearKernel.setArg(3, cl_int(swathe.zBias));
+    clearKernel.setArg(4, cl_uint(swathe.rowPitch));
+    CLH::enqueueNDRangeKernel(queue, clearKernel,
+                              cl::NullRange, cl::NDRange(width, height, numSlices), cl::NullRange,
+                              wait.empty() ? NULL : &wait, &clearEvent, &clearKernelTime);
+    queue.enqueueWriteBuffer(sliceSignsBuffer, CL_FALSE, 0, numSlices * sizeof(cl_uint), &hSliceZeros[0],
+                             wait.empty() ? NULL : &wait, &zeroSignsEvent);
+    wait.assign(1, clearEvent);
+    wait.push_back(zeroSignsEvent);
+
+    if (numPairs > 0)
+    {
+        cl::Event writeEvent, sortEvent, cornersEvent;
+        writeKernel.setArg(6, size);
+        writeKernel.setArg(7, cl_uint(swathe.zFirst));
+        writeKernel.setArg(8, cl_uint(swathe.zLast));
+        CLH::enqueueNDRangeKernel(queue, writeKernel,
+                                  cl::NullRange, cl::NDRange(numSplats), cl::NullRange,
+                                  &countWait, &writeEvent, &writeKernelTime);
+
+        unsigned int keyBits = 1;
+        while (keyBits < 32 && (std::tr1::uint64_t(1) << keyBits) < numCorners)
+            keyBits++;
+        std::vector<cl::Event> sortWait(1, writeEvent);
+        sort.enqueue(queue, keys, values, numPairs, keyBits, &sortWait, &sortEvent);
+
+        const std::size_t cornersGroup = 64;
+        cornersKernel.setArg(0, distance);
+        cornersKernel.setArg(3, numPairs);
+        cornersKernel.setArg(6, size);
+        cornersKernel.setArg(7, cl_uint(swathe.zFirst));
+        cornersKernel.setArg(8, cl_uint(swathe.zStride));
+        cornersKernel.setArg(9, cl_int(swathe.zBias));
+        cornersKernel.setArg(10, cl_uint(swathe.rowPitch));
+        wait.push_back(sortEvent);
+        CLH::enqueueNDRangeKernel(queue, cornersKernel,
+                                  cl::NullRange, cl::NDRange(roundUp(std::size_t(numPairs), cornersGroup)),
+                                  cl::NDRange(cornersGroup),
+                                  &wait, &cornersEvent, &cornersKernelTime);
+        wait.assign(1, cornersEvent);
+    }
+
+    queue.enqueueReadBuffer(sliceSignsBuffer, CL_FALSE, 0, numSlices * sizeof(cl_uint), &hSliceSigns[0],
+                            &wait, &done);
+    if (event != NULL)
+        *event = done;
+}
+
+const cl_uint *ScatterMlsFunctor::sliceSigns() const
+{
+    if (usedFallback)
+        return fallback->sliceSigns();
+    return hSliceSigns.empty() ? NULL : &hSliceSigns[0];
+}
+
+CLH::ResourceUsage ScatterMlsFunctor::resourceUsage(std::size_t maxSplats, std::size_t maxPairs)
+{
+    CLH::ResourceUsage ans;
+    ans.addBuffer("scatterCounts", (maxSplats + 1) * sizeof(cl_uint));
+    ans += ScanCL::resourceUsage(maxSplats + 1, 1);
+    ans.addBuffer("scatterKeys", maxPairs * sizeof(cl_uint));
+    ans.addBuffer("scatterValues", maxPairs * sizeof(cl_uint));
+    ans.addBuffer("scatterTmpKeys", maxPairs * sizeof(cl_uint));
+    ans.addBuffer("scatterTmpValues", maxPairs * sizeof(cl_uint));
+    return ans;
 }
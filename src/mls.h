@@ -32,12 +32,15 @@
 #endif
 
 #include <CL/cl.hpp>
+#include <clogs/clogs.h>
 #include <cstddef>
 #include <map>
 #include <string>
+#include <vector>
 #include "grid.h"
 #include "splat_tree_cl.h"
 #include "marching.h"
+#include "scan_cl.h"
 #include "clh.h"
 #include "statistics.h"
 
@@ -62,6 +65,34 @@ public:
     static std::map<std::string, MlsShape> getNameMap();
 };
 
+/**
+ * Test used to clip the surface at the boundary of the data.
+ */
+enum MlsBoundary
+{
+    /**
+     * Reject corners whose projection onto the surface lies too far from
+     * the weighted centroid of the splats, relative to their spread.
+     */
+    MLS_BOUNDARY_MOMENTS,
+    /**
+     * Reject corners that are not within a fraction of the radius of any
+     * splat, measured in the tangent plane of the splat. It needs no
+     * second moment, and rejects corners before solving the fit.
+     */
+    MLS_BOUNDARY_NEAREST
+};
+
+/**
+ * Wrapper around @ref MlsBoundary for use with @ref Choice.
+ */
+class MlsBoundaryWrapper
+{
+public:
+    typedef MlsBoundary type;
+    static std::map<std::string, MlsBoundary> getNameMap();
+};
+
 /**
  * Generates the signed distance from an MLS surface for a single slice.
  * It is designed to be usable with @ref Marching.
@@ -71,10 +102,20 @@ public:
  * is more efficient than creating a new object (since it avoids recompiling
  * the code).
  *
+ * Each swathe is first classified into occupied and empty blocks of @ref
+ * wgs cells, so that the full fitting kernel is only launched for blocks that
+ * intersect the octree. This requires reading back the number of occupied
+ * blocks, so @ref enqueue blocks until the events it is given have completed.
+ *
+ * If @ref CLH::setSpecializeKernels was enabled when the object was
+ * constructed, the kernels are instead compiled for each combination of
+ * subsampling shift, image strides and boundary factor that is used, with
+ * those values baked in. The variants are kept for the lifetime of the object.
+ *
  * This object is @em not thread-safe. Two calls to the () operator cannot be
  * made at the same time, as they will clobber the kernel arguments. However,
- * it is safe for back-to-back calls to the operator() without synchronization
- * i.e. there is no internal device state.
+ * it is safe for back-to-back calls to the operator() without synchronization,
+ * since internal device state is protected by events.
  */
 class MlsFunctor : public Marching::Generator
 {
@@ -86,11 +127,98 @@ private:
      */
     cl::Kernel kernel;
 
+    /// Kernels generated from @ref compactBlocks and @ref clearBlocks
+    cl::Kernel compactKernel, clearKernel;
+
     /**
      * Measures device time spent in @ref kernel.
      */
     Statistics::Variable &kernelTime;
 
+    /// Measures device time spent in @ref compactKernel and @ref clearKernel
+    Statistics::Variable &compactKernelTime, &clearKernelTime;
+
+    /// Fraction of blocks that are occupied, and hence processed by @ref kernel
+    Statistics::Variable &occupiedStat;
+
+    /// Work group size used by this instance (see @ref wgs)
+    Grid::size_type groupSize[3];
+
+    /// Layout of the splats in the octree passed to @ref set
+    SplatLayout layout;
+
+    /// Whether the octree passed to @ref set has a sparse start array
+    bool sparse;
+
+    /// Boundary test compiled into the kernel
+    MlsBoundary boundary;
+
+    /// Storage of the distances passed to @ref enqueue
+    Marching::DistanceStorage storage;
+
+    /// Bytes per distance, if @ref storage is @ref Marching::DISTANCE_BUFFER
+    std::size_t distanceBytes;
+
+    const cl::Context context;
+
+    /**
+     * Blocks of the current swathe, classified by @ref compactBlocks. It is
+     * grown as needed.
+     */
+    cl::Buffer blocks;
+    std::size_t blocksSize;     ///< Elements allocated in @ref blocks
+    cl::Buffer blockCounts;     ///< Counts of occupied and empty blocks
+    cl_uint hBlockCounts[2];    ///< Host copy of @ref blockCounts
+    /// Event signaled when the previous @ref enqueue no longer uses @ref blocks
+    cl::Event blocksDone;
+
+    /**
+     * Per-slice sign flags of the current swathe (see
+     * @ref Marching::Generator::sliceSigns). It is grown as needed.
+     */
+    cl::Buffer sliceSignsBuffer;
+    std::size_t sliceSignsSize;             ///< Elements allocated in @ref sliceSignsBuffer
+    std::vector<cl_uint> hSliceSigns;       ///< Host copy of @ref sliceSignsBuffer
+    std::vector<cl_uint> hSliceZeros;       ///< Source for clearing @ref sliceSignsBuffer
+
+    /// The three kernels built from one variant of the program
+    struct Kernels
+    {
+        cl::Kernel kernel, compactKernel, clearKernel;
+    };
+
+    /// Arguments given to @ref set and @ref setBoundaryLimit
+    struct Params
+    {
+        cl::Buffer splats, commands, start;
+        cl_uint startShift;
+        cl_int3 offset;
+        float boundaryFactor;
+        cl::Buffer cellKeys, numCells;      ///< Only used if @ref sparse
+        cl_uint levels;                     ///< Only used if @ref sparse
+        cl_ulong rootOffset;                ///< Only used if @ref sparse
+    };
+
+    /// Whether specialized variants are used (see @ref CLH::setSpecializeKernels)
+    bool specialize;
+    /// Defines shared by all variants of the program
+    std::map<std::string, std::string> defines;
+    /// Specialized variants built so far, keyed by their extra defines
+    std::map<std::string, Kernels> variants;
+    /// Key in @ref variants of the current kernels (empty for the generic ones)
+    std::string currentVariant;
+    /// Arguments to transfer to the kernels when changing variant
+    Params params;
+
+    /// Build the program with @a defines and create the kernels
+    Kernels makeKernels(const std::map<std::string, std::string> &defines) const;
+
+    /**
+     * If specializing, make the current kernels those of the variant for @a
+     * swathe and the current parameters, building it if necessary.
+     */
+    void selectVariant(const Marching::Swathe &swathe);
+
     /**
      * Specify the parameters. This is a private variant that
      * does not require the buffers to be stored in a @ref SplatTreeCL, and
@@ -103,10 +231,20 @@ private:
              unsigned int subsamplingShift);
 public:
     /**
-     * Work group size for @ref kernel.
+     * Default work group size for @ref kernel. It is also the largest
+     * supported in each dimension, so can be used for resource estimates
+     * regardless of the work group size given to the constructor.
      */
     static const Grid::size_type wgs[3];
 
+    /**
+     * Checks whether a work group size can be passed to the constructor. Each
+     * dimension must be a power of 2 no larger than the corresponding element
+     * of @ref wgs, with at least as many work items as the kernel loads splats
+     * per pass.
+     */
+    static bool validGroupSize(const Grid::size_type groupSize[3]);
+
     /**
      * Minimum subsampling for corresponding octree.
      */
@@ -116,8 +254,24 @@ public:
      * Constructor. It compiles the kernel, so it can throw a compilation error.
      * @param context   The context in which the function operates.
      * @param shape     The shape to fit to the data.
+     * @param groupSize Work group size for the kernel, or @c NULL to use @ref wgs.
+     * @param layout    Layout of the splats in the octrees passed to @ref set.
+     * @param sparse    Whether the octrees passed to @ref set are sparse (see @ref SplatTreeCL).
+     * @param storage   Storage of the distances passed to @ref enqueue, which must
+     *                  match that of the @ref Marching instance.
+     * @param distanceType Channel type of the distances. It only matters for
+     *                  buffers, since images convert on write.
+     * @param boundary  Test used to clip the surface at the boundary.
+     *
+     * @pre @a groupSize is @c NULL or satisfies @ref validGroupSize.
      */
-    MlsFunctor(const cl::Context &context, MlsShape shape);
+    MlsFunctor(const cl::Context &context, MlsShape shape,
+               const Grid::size_type *groupSize = NULL,
+               SplatLayout layout = SPLAT_LAYOUT_FULL,
+               bool sparse = false,
+               Marching::DistanceStorage storage = Marching::DISTANCE_IMAGE,
+               cl_channel_type distanceType = CL_FLOAT,
+               MlsBoundary boundary = MLS_BOUNDARY_MOMENTS);
 
     /**
      * Specify the parameters. This must be called before using this object as a functor.
@@ -129,26 +283,31 @@ public:
      * @param offset           Offset between world coordinates and region-relative coordinates.
      * @param tree             Octree containing input splats.
      * @param subsamplingShift Subsampling shift passed when building @a tree.
+     * @param root             Root of @a tree to use, if it was built with several.
      *
      * @pre
      * - @a tree was constructed with the same @a offset and @a subsamplingShift.
+     * - @a tree was constructed with the same @a layout and @a sparse as this object.
      */
     void set(const Grid::difference_type offset[3],
-             const SplatTreeCL &tree, unsigned int subsamplingShift);
+             const SplatTreeCL &tree, unsigned int subsamplingShift,
+             std::size_t root = 0);
 
     virtual const Grid::size_type *alignment() const;
 
     /**
      * @pre The tree passed to @ref set was constructed with dimensions at least
-     * equal to @a size rounded up to multiples of @ref wgs.
+     * equal to @a size rounded up to multiples of @ref alignment.
      */
     virtual void enqueue(
         const cl::CommandQueue &queue,
-        const cl::Image2D &distance,
+        const cl::Memory &distance,
         const Marching::Swathe &swathe,
         const std::vector<cl::Event> *events,
         cl::Event *event);
 
+    virtual const cl_uint *sliceSigns() const;
+
     /**
      * Function object callback for use with @ref Marching.
      *
@@ -167,6 +326,141 @@ public:
      * reality tends to cause holes to open.
      */
     void setBoundaryLimit(float limit);
+
+    /**
+     * The value passed to the kernel for boundary clipping, given the limit
+     * passed to @ref setBoundaryLimit. For @ref MLS_BOUNDARY_MOMENTS it is
+     * \f$1 - \gamma^2\f$, and for @ref MLS_BOUNDARY_NEAREST it is
+     * \f$\gamma^2\f$, the largest normalised squared tangential distance
+     * from a corner to its nearest splat.
+     */
+    static float boundaryFactor(float limit, MlsBoundary boundary = MLS_BOUNDARY_MOMENTS);
+};
+
+/**
+ * Alternative to @ref MlsFunctor that scatters splats to corners rather than
+ * gathering splats for each corner. It suits sparse buckets of a few large
+ * splats, where the corner-centric walk of the octree visits many commands
+ * per corner for little result.
+ *
+ * Each swathe is processed in three steps:
+ * -# Every splat writes a (corner, splat) pair for each corner of the swathe
+ *    within the bounding box of its support (see @ref scatterCount and
+ *    @ref scatterWrite).
+ * -# The pairs are sorted by corner, with a stable sort.
+ * -# The first pair of each corner accumulates the fit over the splats of
+ *    that corner and writes the distance (see @ref scatterCorners). Corners
+ *    with no pairs are NaN.
+ *
+ * The result is the same as that of @ref MlsFunctor, except that each fit
+ * is accumulated in splat order rather than octree order, which may change
+ * the rounding. If a swathe would produce more pairs than were allocated
+ * by the constructor, or there are too many splats for the counts to be
+ * scanned safely, it is passed to a fallback @ref MlsFunctor instead.
+ *
+ * This object is @em not thread-safe, for the same reasons as @ref MlsFunctor.
+ */
+class ScatterMlsFunctor : public Marching::Generator
+{
+private:
+    /// Kernels generated from @ref scatterCount, @ref scatterWrite, @ref scatterClear and @ref scatterCorners
+    cl::Kernel countKernel, writeKernel, clearKernel, cornersKernel;
+
+    /// Measure device time spent in the kernels
+    Statistics::Variable &countKernelTime, &writeKernelTime, &clearKernelTime, &cornersKernelTime;
+    /// Swathes handled by scattering and by the fallback
+    Statistics::Counter &scatteredStat, &fallbackStat;
+
+    Grid::size_type groupSize[3];   ///< Alignment, which must match the fallback
+    const cl::Context context;
+    std::size_t maxPairs;           ///< Capacity of @ref keys and @ref values
+
+    cl::Buffer counts;              ///< Per-splat counts, scanned in place
+    std::size_t countsSize;         ///< Elements allocated in @ref counts
+    ScanCL scan;                    ///< Scans @ref counts
+    clogs::Radixsort sort;          ///< Sorts the pairs by corner
+    cl::Buffer keys, values;        ///< (corner, splat) pairs
+    cl::Buffer tmpKeys, tmpValues;  ///< Temporary space for @ref sort
+
+    /// Per-slice sign flags (see @ref Marching::Generator::sliceSigns). It is grown as needed.
+    cl::Buffer sliceSignsBuffer;
+    std::size_t sliceSignsSize;             ///< Elements allocated in @ref sliceSignsBuffer
+    std::vector<cl_uint> hSliceSigns;       ///< Host copy of @ref sliceSignsBuffer
+    std::vector<cl_uint> hSliceZeros;       ///< Source for clearing @ref sliceSignsBuffer
+    /// Event signaled when the previous @ref enqueue no longer uses the buffers
+    cl::Event done;
+
+    /**
+     * @name Parameters set by @ref set
+     * @{
+     */
+    cl::Buffer splats;
+    std::size_t firstSplat, numSplats;
+    cl_int3 offset;
+    MlsFunctor *fallback;
+    /** @} */
+
+    /// Whether the most recent @ref enqueue went to @ref fallback
+    bool usedFallback;
+
+    /// Boundary test compiled into the kernels
+    MlsBoundary boundary;
+
+public:
+    /**
+     * Constructor. It compiles the kernels, so it can throw a compilation error.
+     *
+     * @param context   The context in which the function operates.
+     * @param device    The device on which the function operates.
+     * @param shape     The shape to fit to the data.
+     * @param groupSize As for @ref MlsFunctor. It determines the alignment.
+     * @param layout    Layout of the splats passed to @ref set.
+     * @param storage, distanceType, boundary As for @ref MlsFunctor.
+     * @param maxPairs  Number of (corner, splat) pairs to allocate space for.
+     */
+    ScatterMlsFunctor(const cl::Context &context, const cl::Device &device, MlsShape shape,
+                      const Grid::size_type *groupSize, SplatLayout layout,
+                      Marching::DistanceStorage storage, cl_channel_type distanceType,
+                      std::size_t maxPairs, MlsBoundary boundary = MLS_BOUNDARY_MOMENTS);
+
+    /**
+     * The largest number of splats passed to @ref set that can be scattered,
+     * given the number of pairs allocated. Beyond this every swathe goes to
+     * the fallback.
+     */
+    static std::size_t maxSplats(std::size_t maxPairs);
+
+    /**
+     * Specify the parameters. This must be called before using this object
+     * as a generator.
+     *
+     * @param offset     As for @ref MlsFunctor::set.
+     * @param splats     Splats, as passed to @ref SplatTreeCL::enqueueBuild.
+     * @param firstSplat Index of the first splat to use.
+     * @param numSplats  Number of splats to use.
+     * @param fallback   Generator for swathes that cannot be scattered. It
+     *                   must have been set up for the same splats, and have
+     *                   the same alignment and boundary limit.
+     */
+    void set(const Grid::difference_type offset[3], const cl::Buffer &splats,
+             std::size_t firstSplat, std::size_t numSplats, MlsFunctor &fallback);
+
+    /// Sets the tuning factor for boundary clipping (see @ref MlsFunctor::setBoundaryLimit).
+    void setBoundaryLimit(float limit);
+
+    virtual const Grid::size_type *alignment() const;
+
+    virtual void enqueue(
+        const cl::CommandQueue &queue,
+        const cl::Memory &distance,
+        const Marching::Swathe &swathe,
+        const std::vector<cl::Event> *events,
+        cl::Event *event);
+
+    virtual const cl_uint *sliceSigns() const;
+
+    /// Device memory used by an instance with @a maxSplats splats and @a maxPairs pairs.
+    static CLH::ResourceUsage resourceUsage(std::size_t maxSplats, std::size_t maxPairs);
 };
 
 #endif /* !MLS_H */
@@ -39,7 +39,12 @@
 #include <boost/system/error_code.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/ref.hpp>
+#include <boost/bind.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/exception_ptr.hpp>
 #include <memory>
 #include <string>
 #include <iterator>
@@ -48,9 +53,13 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <locale>
 #include <cstdlib>
 #include <cassert>
 #include <limits>
+#include <cmath>
+#include <cerrno>
 #include "mlsgpu_core.h"
 #include "options.h"
 #include "mls.h"
@@ -67,6 +76,17 @@
 #include "bucket.h"
 #include "splat_set.h"
 #include "decache.h"
+#include "staging.h"
+#include "large_pages.h"
+#include "numa.h"
+#include "thread_name.h"
+#include "errors.h"
+#include "bucket_cache.h"
+#include "bucket_plan.h"
+
+#if HAVE_SYSCONF
+# include <unistd.h>
+#endif
 
 namespace po = boost::program_options;
 
@@ -76,8 +96,9 @@ static void addCommonOptions(po::options_description &opts)
         ("help,h",                "Show help")
         ("quiet,q",               "Do not show informational messages")
         (Option::debug,           "Show debug messages")
+        (Option::logAsync,        "Write messages from a background thread, with timestamps and thread names")
         (Option::responseFile,    po::value<std::string>(), "Read options from file")
-        (Option::tmpDir,          po::value<std::string>(), "Directory to store temporary files");
+        (Option::tmpDir,          po::value<std::vector<std::string> >()->composing(), "Directory to store temporary files (repeat to stripe across several)");
 }
 
 static void addFitOptions(po::options_description &opts)
@@ -87,9 +108,72 @@ static void addFitOptions(po::options_description &opts)
         (Option::maxRadius,       po::value<double>(),                      "Limit influence radii")
         (Option::fitGrid,         po::value<double>()->default_value(0.01), "Spacing of grid cells")
         (Option::fitPrune,        po::value<double>()->default_value(0.02), "Minimum fraction of vertices per component")
+        (Option::fitPruneMinVertices, po::value<int>()->default_value(0),  "Minimum vertices per component, discarding small closed pieces early")
         (Option::fitBoundaryLimit, po::value<double>()->default_value(1.0), "Tuning factor for boundary detection")
         (Option::fitShape,        po::value<Choice<MlsShapeWrapper> >()->default_value(MLS_SHAPE_SPHERE),
-                                                                            "Model shape (sphere | plane)");
+                                                                            "Model shape (sphere | plane)")
+        (Option::fitBoundary,     po::value<Choice<MlsBoundaryWrapper> >()->default_value(MLS_BOUNDARY_MOMENTS),
+                                                                            "Boundary test (moments | nearest)")
+        (Option::region,          po::value<std::string>(),                 "Only reconstruct the box x0,y0,z0,x1,y1,z1")
+        (Option::tile,                                                      "Treat --region as a tile of a larger job, recording its boundary vertices for plystitch")
+        (Option::estimateNormals, po::value<int>(),                         "Estimate missing normals from this many neighbours")
+        (Option::pointRadius,     po::value<double>(),                      "Radius of inputs without one, and neighbour search radius")
+        (Option::scannerPosition, po::value<std::string>(),                 "Orient estimated normals towards x,y,z")
+        (Option::adaptiveGrid,    po::value<int>(),                         "Coarsen the grid of sparse buckets by up to this many levels")
+        (Option::adaptiveRadius,  po::value<double>()->default_value(4.0),  "Minimum radius of small splats in coarsened cells")
+        (Option::lodLevels,       po::value<int>()->default_value(0),       "Also write this many coarser levels of detail, each at twice the spacing of the previous")
+        (Option::preview,         po::value<int>()->default_value(0),       "First write a quick preview at 2^N times the spacing, to <output-file>_preview");
+}
+
+/**
+ * Parse the value of @ref Option::region.
+ *
+ * @return Whether the string held six comma-separated numbers with each lower
+ * bound strictly less than the corresponding upper bound.
+ */
+static bool parseRegion(const std::string &value, float lower[3], float upper[3])
+{
+    std::istringstream in(value);
+    in.imbue(std::locale::classic());
+    float v[6];
+    for (unsigned int i = 0; i < 6; i++)
+    {
+        if (i > 0 && in.get() != ',')
+            return false;
+        in >> v[i];
+        if (!in)
+            return false;
+    }
+    if (in.peek() != std::istringstream::traits_type::eof())
+        return false;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        lower[i] = v[i];
+        upper[i] = v[i + 3];
+        if (!(lower[i] < upper[i]))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Parse the value of @ref Option::scannerPosition.
+ *
+ * @return Whether the string held three comma-separated numbers.
+ */
+static bool parsePosition(const std::string &value, float position[3])
+{
+    std::istringstream in(value);
+    in.imbue(std::locale::classic());
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        if (i > 0 && in.get() != ',')
+            return false;
+        in >> position[i];
+        if (!in)
+            return false;
+    }
+    return in.peek() == std::istringstream::traits_type::eof();
 }
 
 static void addStatisticsOptions(po::options_description &opts)
@@ -99,7 +183,13 @@ static void addStatisticsOptions(po::options_description &opts)
         (Option::statistics,                          "Print information about internal statistics")
         (Option::statisticsFile, po::value<std::string>(), "Direct statistics to file instead of stdout (implies --statistics)")
         (Option::statisticsCL,                             "Collect timings for OpenCL commands")
-        (Option::timeplot, po::value<std::string>(),       "Write timing data to file");
+        (Option::statisticsCLSample, po::value<unsigned int>()->default_value(1), "Time only one in N OpenCL commands of each kind")
+        (Option::timeplot, po::value<std::string>(),       "Write timing data to file")
+        (Option::timeplotBinary,                           "Write timing data in the compact binary format")
+        (Option::timeplotChrome,                           "Write timing data in the Chrome trace event format")
+        (Option::bucketTrace, po::value<std::string>(),    "Write the size and timings of each bucket meshed on a device to a CSV file")
+        (Option::metricsFile, po::value<std::string>(),    "Periodically write live statistics to file")
+        (Option::metricsInterval, po::value<double>()->default_value(10.0), "Seconds between updates of --metrics-file");
     opts.add(statistics);
 }
 
@@ -111,15 +201,72 @@ static void addAdvancedOptions(po::options_description &opts)
         (Option::subsampling,  po::value<int>()->default_value(3), "Subsampling of octree")
         (Option::maxSplit,     po::value<int>()->default_value(1024 * 1024 * 1024), "Maximum fan-out in partitioning")
         (Option::leafCells,    po::value<int>()->default_value(63), "Leaf size for initial histogram")
-        (Option::deviceThreads, po::value<int>()->default_value(1), "Number of threads per device for submitting OpenCL work")
-        (Option::reader,       po::value<Choice<ReaderTypeWrapper> >()->default_value(SYSCALL_READER), "File reader class (syscall | stream | mmap)")
-        (Option::writer,       po::value<Choice<WriterTypeWrapper> >()->default_value(SYSCALL_WRITER), "File writer class (syscall | stream)")
+        (Option::bucketCost,   po::value<double>()->default_value(0.0), "Target cost per bucket, in splats (0 to disable)")
+        (Option::bucketCellWeight, po::value<double>()->default_value(1.0), "Cost of a surface cell relative to a splat for --bucket-cost")
+        (Option::bucketThreads, po::value<int>()->default_value(1), "Number of threads for bucketing the top-level regions")
+        (Option::bucketDevice, "Count the splats for the top-level bucketing on the first device")
+        (Option::blobsDevice,  "Compute the blobs for the bounding box pass on the first device")
+        (Option::thinDense,    "Drop splats from cells covered by more than --mem-bucket-splats of them, instead of failing")
+        (Option::longestFirst, "Issue the most expensive buckets of each chunk first (see --bucket-cell-weight)")
+        (Option::chunkPriority, "Mesh the buckets of the oldest open chunk first, so that chunks are finished in order (with --split)")
+        (Option::planSplatTime, po::value<double>()->default_value(5e-7), "Device seconds per splat for --plan-only (fit from --bucket-trace)")
+        (Option::planCellTime, po::value<double>()->default_value(2e-9), "Device seconds per bucket cell for --plan-only (fit from --bucket-trace)")
+        (Option::autotuneHostBins, po::value<int>()->default_value(256), "Buckets reconstructed by each calibration run of --autotune-host")
+        (Option::autotuneHostRounds, po::value<int>()->default_value(4), "Maximum number of calibration runs for --autotune-host")
+        (Option::deviceThreads, po::value<int>()->default_value(1), "Number of threads per device for submitting OpenCL work (fewer on devices without the memory for them)")
+        (Option::deviceScratch, po::value<int>()->default_value(0), "Sets of mesh buffers shared by the threads of a device (0 for one per thread)")
+        (Option::hostThreads,  po::value<int>()->default_value(0), "Number of threads fitting buckets on the CPU alongside the devices")
+        (Option::reader,       po::value<Choice<ReaderTypeWrapper> >()->default_value(SYSCALL_READER), "File reader class (syscall | stream | mmap | uring | direct | http)")
+        (Option::readerThreads, po::value<int>()->default_value(1), "Number of threads reading and decoding each input stream")
+        (Option::headerThreads, po::value<int>()->default_value(8), "Number of input headers to parse concurrently at startup")
+        (Option::openFiles,    po::value<int>()->default_value(64), "Number of idle input files to keep open between reads (0 to disable)")
+        (Option::writer,       po::value<Choice<WriterTypeWrapper> >()->default_value(SYSCALL_WRITER), "File writer class (syscall | stream | mmap | uring | zstd)")
 #ifdef _OPENMP
         (Option::ompThreads,   po::value<int>(), "Number of threads for OpenMP")
 #endif
         (Option::decache,      "Try to evict input files from OS cache for benchmarking")
+        (Option::readAhead,    po::value<int>()->default_value(SplatSet::FileSet::DEFAULT_PREFETCH_RANGES), "Number of input ranges to prefetch ahead of use")
+        (Option::readGap,      po::value<Capacity>()->default_value(0), "Largest gap between input ranges to read through (0 to disable)")
+        (Option::stageDir,     po::value<std::string>(), "Copy input blocks to this local directory as they are read and reuse them")
+        (Option::stageSize,    po::value<Capacity>()->default_value(std::tr1::uint64_t(16) * 1024 * 1024 * 1024), "Space to use in --stage-dir")
+        (Option::ingest,       po::value<std::string>(), "Read the input as a stream (- for stdin), spooling it to this splat cache file while computing the bounding box")
+        (Option::blobCache,    po::value<std::string>(), "Save bounding box data to this file and reuse it if the inputs are unchanged")
+        (Option::bucketCache,  po::value<std::string>(), "Save the meshes of buckets in this directory and reuse them if their splats are unchanged")
+        (Option::savePlan,     po::value<std::string>(), "Save the buckets to this file for --load-plan")
+        (Option::loadPlan,     po::value<std::string>(), "Reuse the buckets saved by --save-plan if the inputs and bucketing options are unchanged")
         (Option::checkpoint,   po::value<std::string>(), "Checkpoint state prior to writing output")
-        (Option::resume,       po::value<std::string>(), "Restart from checkpoint");
+        (Option::resume,       po::value<std::string>(), "Restart from checkpoint or snapshot")
+        (Option::snapshot,     po::value<std::string>(), "Periodically save progress to file so that --resume can skip finished buckets")
+        (Option::snapshotInterval, po::value<double>()->default_value(1800.0), "Minimum seconds between snapshots")
+        (Option::autotune,     "Benchmark performance parameters for each device at startup")
+        (Option::halfDistance, "Store the signed distance field at half precision")
+        (Option::distanceStorage, po::value<Choice<DistanceStorageChoiceWrapper> >()->default_value(DISTANCE_STORAGE_AUTO),
+                               "Store the signed distance field in an image or a buffer (auto | image | buffer)")
+        (Option::packedSplats, "Store splat normals at half precision on the device")
+        (Option::copyBuffers,  po::value<int>()->default_value(2), "Number of pinned buffers for staging uploads to the devices")
+        (Option::adaptivePacking, "Queue more work items on devices with memory to spare, and upload large bins on their own")
+        (Option::directUpload, "Write splats into mapped device buffers instead of staging them in host memory")
+        (Option::pinnedMesh,   "Allocate --mem-mesh in pinned memory, so that meshes are read back from the devices directly")
+        (Option::hashWeld,     "Weld vertices with a hash table instead of sorting them")
+        (Option::batchOctree,  "Build one octree for all the buckets copied to a device together")
+        (Option::mergeSplats,  po::value<double>()->default_value(0.0), "Merge splats within this distance of each other, in cells, before fitting (0 to disable)")
+        (Option::scatterDensity, po::value<double>()->default_value(0.0), "Fit buckets with fewer splats per cell than this by scattering splats to corners (0 to disable)")
+        (Option::adaptiveSubsampling, "Use finer octree subsampling than --subsampling for dense buckets")
+        (Option::sparseOctree, "Store only occupied octree cells, so that memory does not grow with --levels")
+        (Option::sortSplats,   "Reorder the splats of each bucket along a Morton curve for device cache locality")
+        (Option::splitSplats,  po::value<int>()->default_value(0), "Split buckets with at least this many splats along Z across the device threads (0 to disable)")
+        (Option::tiledOccupancy, "Only classify cells in tiles that the surface crosses (faster for fine grids)")
+        (Option::carrySlices,  "Reuse the boundary samples of a bucket for the next bucket along Z on the same device")
+        (Option::marchingCubes, "Triangulate cells as cubes rather than tetrahedra, for fewer triangles")
+        (Option::ownedEdges,   "Emit each vertex only from the cell that owns its edge, so that there are fewer vertices to weld")
+        (Option::writeThreads, po::value<int>()->default_value(4), "Maximum number of output files to write concurrently")
+        (Option::tmpWriterThreads, po::value<int>()->default_value(0), "Maximum threads writing temporary files, woken while writes back up (0 for a fixed number)")
+        (Option::tmpMmap,      "Memory-map the temporary files when writing the output")
+        (Option::tmpCompress,  "Compress the triangles in the temporary files")
+        (Option::reorderTriangles, "Order output triangles and vertices for vertex cache locality")
+        (Option::parallelWrite, "Write each output file from several threads when there are fewer files than --write-threads")
+        (Option::mesherThreads, po::value<int>()->default_value(2), "Number of threads for labelling mesh components")
+        (Option::cpuThreads,   po::value<int>()->default_value(0), "Number of cores shared by the mesher threads of all levels of detail (0 for all)");
     opts.add(advanced);
 }
 
@@ -127,15 +274,42 @@ static void addMemoryOptions(po::options_description &opts, bool isMPI)
 {
     po::options_description memory("Advanced memory options");
     memory.add_options()
+        (Option::memAuto,         "Choose memory options that are not given from the available host and device memory")
         (Option::memLoadSplats,   po::value<Capacity>()->default_value(256 * 1024 * 1024), "Memory for bucket merging")
         (Option::memHostSplats,   po::value<Capacity>()->default_value(512 * 1024 * 1024), "Memory for splats on the CPU")
         (Option::memBucketSplats, po::value<Capacity>()->default_value(64 * 1024 * 1024),  "Memory for splats in a single bucket")
         (Option::memMesh,         po::value<Capacity>()->default_value(512 * 1024 * 1024),  "Memory for raw mesh data on the CPU")
-        (Option::memReorder,      po::value<Capacity>()->default_value(2U * 1024 * 1024 * 1024), "Memory for processed mesh data on the CPU");
+        (Option::memReorder,      po::value<Capacity>()->default_value(2U * 1024 * 1024 * 1024), "Memory for processed mesh data on the CPU")
+        (Option::reorderSlots,    po::value<int>()->default_value(3), "Buffers into which --mem-reorder is divided for writing temporary files")
+        (Option::memBlobs,        po::value<Capacity>()->default_value(1024 * 1024 * 1024), "Memory for holding bounding box data instead of rereading it")
+        (Option::hugePages,       po::value<Choice<HugePageModeWrapper> >()->default_value(HUGE_PAGES_NONE), "Huge pages for large CPU buffers (none | transparent | 2M | 1G)")
+        (Option::numaNode,        po::value<int>()->default_value(-1), "NUMA node for large CPU buffers (-1 to place them near the devices)");
+    if (!isMPI)
+        memory.add_options()
+            (Option::loadQueue,   po::value<int>()->default_value(4), "Batches of buckets queued for loading (0 to load synchronously)")
+            (Option::memLimit,    po::value<Capacity>()->default_value(0), "Tracked CPU memory above which loading is held back (0 for no limit)");
     if (isMPI)
         memory.add_options()
             (Option::memGather,   po::value<Capacity>()->default_value(512 * 1024 * 1024),  "Memory for buffering raw mesh data on the slaves");
     opts.add(memory);
+    if (isMPI)
+    {
+        po::options_description mpi("MPI options");
+        mpi.add_options()
+            (Option::scatterCredits, po::value<int>()->default_value(2), "Number of batches of work each slave requests ahead")
+            (Option::scatterLocality, "Send runs of neighbouring batches of work to the same slave")
+            (Option::distributedMesher, "Weld and reorder each output chunk on the rank that owns it (requires --split)")
+            (Option::stripeInputs, "Have each rank read only its share of the input files")
+            (Option::hierarchical, "Relay work and meshes through one rank per node")
+            (Option::pinnedGather, "Buffer meshes on the slaves in pinned memory, so that device readbacks and sends use it directly")
+            (Option::progressRMA, "Report progress to the root with one-sided operations instead of messages")
+            (Option::mpiioAggregators, po::value<int>()->default_value(0), "Number of MPI-IO aggregators for the output (0 for the MPI default)")
+            (Option::mpiioBuffer, po::value<Capacity>()->default_value(0), "MPI-IO collective buffer size per aggregator (0 for the MPI default)")
+            (Option::stripeCount, po::value<int>()->default_value(0), "Number of filesystem stripes for new output files (0 for the filesystem default)")
+            (Option::stripeSize, po::value<Capacity>()->default_value(0), "Filesystem stripe size for new output files (0 for the filesystem default)")
+            (Option::leaveFile, po::value<std::string>()->default_value(""), "A slave that finds this file on its node takes no more work");
+        opts.add(mpi);
+    }
 }
 
 void usage(std::ostream &o, const po::options_description desc)
@@ -144,22 +318,43 @@ void usage(std::ostream &o, const po::options_description desc)
     o << desc;
 }
 
-po::variables_map processOptions(int argc, char **argv, bool isMPI)
+/**
+ * Add the options accepted by @ref parseOptions to @a desc (those shown in
+ * the usage message) and all of them, including hidden ones, to @a all.
+ */
+static void addAllOptions(po::options_description &desc, po::options_description &all, bool isMPI)
 {
-    // TODO: replace cerr with thrown exception
-    po::positional_options_description positional;
-    positional.add(Option::inputFile, -1);
-
-    po::options_description desc("General options");
     addCommonOptions(desc);
     addFitOptions(desc);
     addStatisticsOptions(desc);
     addAdvancedOptions(desc);
     addMemoryOptions(desc, isMPI);
     desc.add_options()
-        ("output-file,o",   po::value<std::string>()->required(), "output file")
+        ("output-file,o",   po::value<std::string>(), "output file")
         (Option::split,     "split output across multiple files")
-        (Option::splitSize, po::value<Capacity>()->default_value(100 * 1024 * 1024), "approximate size of output chunks");
+        (Option::splitSize, po::value<Capacity>()->default_value(100 * 1024 * 1024), "approximate size of output chunks")
+        (Option::splitIndex, "write an index of the output chunks to <output-file>.index.json (requires --split)")
+        (Option::splitContainer, "write all output chunks into the single file <output-file>.plyc, with an index (requires --split)")
+        (Option::streamChunks, "write each output chunk as soon as it is complete, pruning only by --fit-prune-min-vertices (requires --split)")
+        (Option::streamDirect, "write a complete chunk still held in memory straight to its output file, bypassing the temporary files (requires --stream-chunks)")
+        (Option::vertexFormat, po::value<Choice<FastPly::VertexFormatWrapper> >()->default_value(FastPly::VERTEX_FORMAT_FLOAT32),
+                            "encoding of output vertices (float32 | uint16 | uint32)")
+        (Option::vertexNormals, "write a normal with each output vertex")
+        (Option::decimate,  po::value<double>(), "decimate output by merging vertices within cubes of this many grid cells")
+        (Option::incremental, po::value<std::string>(), "only rebuild chunks affected by inputs changed since the run that saved this file (requires --split)");
+
+    if (!isMPI)
+    {
+        desc.add_options()
+            (Option::serve, po::value<std::string>(),
+             "keep the OpenCL devices open and run jobs received on this local socket")
+            (Option::batch, po::value<std::string>(),
+             "run the jobs listed in this file, one command line per line, sharing the OpenCL devices")
+            (Option::planOnly,
+             "bucket the input and report the predicted work and memory, without using the devices")
+            (Option::autotuneHost, po::value<std::string>(),
+             "tune the host memory pools and --device-threads on a sample of the buckets, and write them to this response file");
+    }
 
     po::options_description clopts("OpenCL options");
     CLH::addOptions(clopts);
@@ -169,82 +364,106 @@ po::variables_map processOptions(int argc, char **argv, bool isMPI)
     hidden.add_options()
         (Option::inputFile, po::value<std::vector<std::string> >()->composing(), "input files");
 
-    po::options_description all("All options");
     all.add(desc);
     all.add(hidden);
+}
 
-    try
+po::variables_map parseOptions(const std::vector<std::string> &args, bool isMPI, bool needInputs)
+{
+    po::positional_options_description positional;
+    positional.add(Option::inputFile, -1);
+
+    po::options_description desc("General options");
+    po::options_description all("All options");
+    addAllOptions(desc, all, isMPI);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(args)
+              .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+              .options(all)
+              .positional(positional)
+              .run(), vm);
+    if (vm.count(Option::responseFile))
     {
-        po::variables_map vm;
-        po::store(po::command_line_parser(argc, argv)
-                  .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
-                  .options(all)
-                  .positional(positional)
-                  .run(), vm);
-        if (vm.count(Option::responseFile))
+        const std::string &fname = vm[Option::responseFile].as<std::string>();
+        std::ifstream in(fname.c_str());
+        if (!in)
         {
-            const std::string &fname = vm[Option::responseFile].as<std::string>();
-            std::ifstream in(fname.c_str());
-            if (!in)
-            {
-                Log::log[Log::warn] << "Could not open `" << fname << "', ignoring\n";
-            }
-            else
+            Log::log[Log::warn] << "Could not open `" << fname << "', ignoring\n";
+        }
+        else
+        {
+            std::vector<std::string> fileArgs;
+            std::copy(std::istream_iterator<std::string>(in),
+                      std::istream_iterator<std::string>(), std::back_inserter(fileArgs));
+            if (in.bad())
             {
-                std::vector<std::string> args;
-                std::copy(std::istream_iterator<std::string>(in),
-                          std::istream_iterator<std::string>(), std::back_inserter(args));
-                if (in.bad())
-                {
-                    Log::log[Log::warn] << "Error while reading from `" << fname << "'\n";
-                }
-                in.close();
-                po::store(po::command_line_parser(args)
-                          .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
-                          .options(all)
-                          .positional(positional)
-                          .run(), vm);
+                Log::log[Log::warn] << "Error while reading from `" << fname << "'\n";
             }
+            in.close();
+            po::store(po::command_line_parser(fileArgs)
+                      .style(po::command_line_style::default_style & ~po::command_line_style::allow_guessing)
+                      .options(all)
+                      .positional(positional)
+                      .run(), vm);
         }
+    }
 
-        po::notify(vm);
+    po::notify(vm);
 
-        if (vm.count(Option::help))
-        {
-            usage(std::cout, desc);
-            std::exit(0);
-        }
-        /* Using ->required() on the option gives an unhelpful message */
-        if (!vm.count(Option::inputFile))
-        {
-            std::cerr << "At least one input file must be specified.\n\n";
-            usage(std::cerr, desc);
-            std::exit(1);
-        }
+    if (!vm.count(Option::help) && !vm.count(Option::serve) && !vm.count(Option::batch))
+    {
+        /* These are checked here rather than with ->required() so that
+         * --serve and --batch can be used without them. Using ->required()
+         * on the input files also gives an unhelpful message.
+         */
+        if (!vm.count(Option::outputFile))
+            throw po::required_option(Option::outputFile);
+        if (needInputs && !vm.count(Option::inputFile))
+            throw po::error("At least one input file must be specified.");
+    }
 
-        if (vm.count(Option::statisticsCL))
-        {
-            Statistics::enableEventTiming();
-        }
-        if (vm.count(Option::tmpDir))
-        {
-            setTmpFileDir(vm[Option::tmpDir].as<std::string>());
-        }
+    if (vm.count(Option::statisticsCL))
+    {
+        Statistics::enableEventTiming(true, vm[Option::statisticsCLSample].as<unsigned int>());
+    }
+    if (vm.count(Option::tmpDir))
+    {
+        const std::vector<std::string> &dirs = vm[Option::tmpDir].as<std::vector<std::string> >();
+        setTmpFileDirs(std::vector<boost::filesystem::path>(dirs.begin(), dirs.end()));
+    }
 
 #ifdef _OPENMP
-        int ompThreads;
-        if (vm.count(Option::ompThreads))
-            ompThreads = vm[Option::ompThreads].as<int>();
-        else
-        {
-            // Subtract one to avoid starving reader/writer threads
-            ompThreads = boost::thread::hardware_concurrency() - 1;
-        }
-        if (ompThreads <= 0)
-            ompThreads = 1;
-        omp_set_num_threads(ompThreads);
+    int ompThreads;
+    if (vm.count(Option::ompThreads))
+        ompThreads = vm[Option::ompThreads].as<int>();
+    else
+    {
+        // Subtract one to avoid starving reader/writer threads
+        ompThreads = int(getCpuThreads(vm)) - 1;
+    }
+    if (ompThreads <= 0)
+        ompThreads = 1;
+    omp_set_num_threads(ompThreads);
 #endif
 
+    return vm;
+}
+
+po::variables_map processOptions(int argc, char **argv, bool isMPI, bool needInputs)
+{
+    po::options_description desc("General options");
+    po::options_description all("All options");
+    addAllOptions(desc, all, isMPI);
+
+    try
+    {
+        po::variables_map vm = parseOptions(std::vector<std::string>(argv + 1, argv + argc), isMPI, needInputs);
+        if (vm.count(Option::help))
+        {
+            usage(std::cout, desc);
+            std::exit(0);
+        }
         return vm;
     }
     catch (po::error &e)
@@ -299,8 +518,16 @@ static std::string makeOptions(const po::variables_map &vm)
                 opts << param.as<Choice<WriterTypeWrapper> >();
             else if (value.type() == typeid(Choice<ReaderTypeWrapper>))
                 opts << param.as<Choice<ReaderTypeWrapper> >();
+            else if (value.type() == typeid(Choice<HugePageModeWrapper>))
+                opts << param.as<Choice<HugePageModeWrapper> >();
             else if (value.type() == typeid(Choice<MlsShapeWrapper>))
                 opts << param.as<Choice<MlsShapeWrapper> >();
+            else if (value.type() == typeid(Choice<MlsBoundaryWrapper>))
+                opts << param.as<Choice<MlsBoundaryWrapper> >();
+            else if (value.type() == typeid(Choice<DistanceStorageChoiceWrapper>))
+                opts << param.as<Choice<DistanceStorageChoiceWrapper> >();
+            else if (value.type() == typeid(Choice<FastPly::VertexFormatWrapper>))
+                opts << param.as<Choice<FastPly::VertexFormatWrapper> >();
             else if (value.type() == typeid(Capacity))
                 opts << param.as<Capacity>();
             else
@@ -340,6 +567,7 @@ void writeStatistics(const po::variables_map &vm, bool force)
                 out->precision(15);
                 *out << Statistics::Registry::getInstance();
             }
+            Timeplot::writeBottleneckReport(*out, Statistics::Registry::getInstance());
         }
         catch (std::ios::failure &e)
         {
@@ -389,10 +617,67 @@ std::size_t getMaxLoadSplats(const po::variables_map &vm)
     return mem / sizeof(Splat);
 }
 
+/// Layout for splats in device memory selected by the options
+static SplatLayout getSplatLayout(const po::variables_map &vm)
+{
+    return vm.count(Option::packedSplats) ? SPLAT_LAYOUT_PACKED : SPLAT_LAYOUT_FULL;
+}
+
 static std::size_t getMaxBucketSplats(const po::variables_map &vm)
 {
     std::size_t mem = vm[Option::memBucketSplats].as<Capacity>();
-    return mem / sizeof(Splat);
+    return mem / splatDeviceSize(getSplatLayout(vm));
+}
+
+/// Radius given to input splats without one, or 0 if radii are required
+static float getPointRadius(const po::variables_map &vm)
+{
+    return vm.count(Option::pointRadius) ? vm[Option::pointRadius].as<double>() : 0.0f;
+}
+
+/// Normal estimation parameters selected by the options
+static NormalEstimation getNormalEstimation(const po::variables_map &vm)
+{
+    NormalEstimation ans;
+    if (vm.count(Option::estimateNormals))
+    {
+        ans.neighbours = vm[Option::estimateNormals].as<int>();
+        ans.smooth = vm[Option::fitSmooth].as<double>();
+        if (vm.count(Option::scannerPosition))
+            ans.haveViewpoint = parsePosition(vm[Option::scannerPosition].as<std::string>(), ans.viewpoint);
+    }
+    return ans;
+}
+
+/// Maximum grid coarsening level, or 0 if the grid is not adaptive
+static unsigned int getAdaptiveLevel(const po::variables_map &vm)
+{
+    return vm.count(Option::adaptiveGrid) ? vm[Option::adaptiveGrid].as<int>() : 0;
+}
+
+/// Channel type for the distance field selected by the options
+static cl_channel_type getDistanceType(const po::variables_map &vm)
+{
+    return vm.count(Option::halfDistance) ? CL_HALF_FLOAT : CL_FLOAT;
+}
+
+/// Storage for the distance field selected by the options
+static DistanceStorageChoice getDistanceStorage(const po::variables_map &vm)
+{
+    return vm[Option::distanceStorage].as<Choice<DistanceStorageChoiceWrapper> >();
+}
+
+/**
+ * Throw @ref invalid_option if @a option was given together with any of the
+ * options in @a conflicts.
+ */
+template<std::size_t N>
+static void checkConflicts(const po::variables_map &vm, const char *option,
+                           const char * const (&conflicts)[N])
+{
+    for (std::size_t i = 0; i < N; i++)
+        if (vm.count(conflicts[i]))
+            throw invalid_option(std::string("--") + option + " cannot be combined with --" + conflicts[i]);
 }
 
 void validateOptions(const po::variables_map &vm, bool isMPI)
@@ -433,6 +718,31 @@ void validateOptions(const po::variables_map &vm, bool isMPI)
                              + " must be at least that of --" + Option::memBucketSplats);
     if (maxSplit < 8)
         throw invalid_option(std::string("Value of --") + Option::maxSplit + " must be at least 8");
+    if (!(vm[Option::bucketCost].as<double>() >= 0.0))
+        throw invalid_option(std::string("Value of --") + Option::bucketCost + " must be non-negative");
+    if (!(vm[Option::bucketCellWeight].as<double>() >= 0.0))
+        throw invalid_option(std::string("Value of --") + Option::bucketCellWeight + " must be non-negative");
+    if (!(vm[Option::planSplatTime].as<double>() >= 0.0))
+        throw invalid_option(std::string("Value of --") + Option::planSplatTime + " must be non-negative");
+    if (!(vm[Option::planCellTime].as<double>() >= 0.0))
+        throw invalid_option(std::string("Value of --") + Option::planCellTime + " must be non-negative");
+    if (vm[Option::bucketThreads].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::bucketThreads + " must be at least 1");
+    if (vm[Option::autotuneHostBins].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::autotuneHostBins + " must be at least 1");
+    if (vm[Option::autotuneHostRounds].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::autotuneHostRounds + " must be at least 1");
+    if (vm.count(Option::autotuneHost))
+    {
+        const char * const unsupported[] = { Option::incremental, Option::checkpoint, Option::resume };
+        for (std::size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+            if (vm.count(unsupported[i]))
+                throw invalid_option(std::string("--") + unsupported[i] + " cannot be used with --" + Option::autotuneHost);
+    }
+    if (!(vm[Option::mergeSplats].as<double>() >= 0.0))
+        throw invalid_option(std::string("Value of --") + Option::mergeSplats + " must be non-negative");
+    if (!(vm[Option::scatterDensity].as<double>() >= 0.0))
+        throw invalid_option(std::string("Value of --") + Option::scatterDensity + " must be non-negative");
     if (subsampling > Marching::MAX_DIMENSION_LOG2 + 1 - levels)
         throw invalid_option(std::string("Sum of --") + Option::subsampling
                              + " and --" + Option::levels + " is too large");
@@ -443,19 +753,252 @@ void validateOptions(const po::variables_map &vm, bool isMPI)
 
     if (deviceThreads < 1)
         throw invalid_option(std::string("Value of --") + Option::deviceThreads + " must be at least 1");
+    if (vm[Option::deviceScratch].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::deviceScratch + " must be non-negative");
+    if (vm[Option::splitSplats].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::splitSplats + " must be non-negative");
+    if (vm[Option::copyBuffers].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::copyBuffers + " must be at least 1");
+    if (vm[Option::writeThreads].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::writeThreads + " must be at least 1");
+    if (vm[Option::tmpWriterThreads].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::tmpWriterThreads + " must be non-negative");
+    if (vm[Option::reorderSlots].as<int>() < 2)
+        throw invalid_option(std::string("Value of --") + Option::reorderSlots + " must be at least 2");
+    if (vm[Option::mesherThreads].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::mesherThreads + " must be at least 1");
+    if (vm[Option::cpuThreads].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::cpuThreads + " must be non-negative");
     if (!(pruneThreshold >= 0.0 && pruneThreshold <= 1.0))
         throw invalid_option(std::string("Value of --") + Option::fitPrune + " must be in [0, 1]");
+    if (vm[Option::fitPruneMinVertices].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::fitPruneMinVertices + " must be non-negative");
+    if (vm[Option::numaNode].as<int>() < -1)
+        throw invalid_option(std::string("Value of --") + Option::numaNode + " must be -1 or a node number");
+    if (!(vm[Option::metricsInterval].as<double>() > 0.0))
+        throw invalid_option(std::string("Value of --") + Option::metricsInterval + " must be positive");
+    if (vm.count(Option::timeplotBinary) && vm.count(Option::timeplotChrome))
+        throw invalid_option(std::string("--") + Option::timeplotBinary + " cannot be combined with --" + Option::timeplotChrome);
+    if (vm[Option::statisticsCLSample].as<unsigned int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::statisticsCLSample + " must be at least 1");
+    if (vm.count(Option::region))
+    {
+        float lower[3], upper[3];
+        if (!parseRegion(vm[Option::region].as<std::string>(), lower, upper))
+            throw invalid_option(std::string("Value of --") + Option::region
+                                 + " must be x0,y0,z0,x1,y1,z1 with each low value less than the high value");
+    }
+    if (vm.count(Option::tile))
+    {
+        if (!vm.count(Option::region))
+            throw invalid_option(std::string("--") + Option::tile + " requires --" + Option::region);
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::tile + " is not supported with MPI");
+        const char * const conflicts[] = { Option::checkpoint, Option::resume, Option::snapshot };
+        checkConflicts(vm, Option::tile, conflicts);
+    }
+    if (vm.count(Option::estimateNormals))
+    {
+        const int neighbours = vm[Option::estimateNormals].as<int>();
+        if (neighbours < int(NormalEstimator::minNeighbours) || neighbours > int(NormalEstimator::maxNeighbours))
+        {
+            std::ostringstream msg;
+            msg << "Value of --" << Option::estimateNormals << " must be in ["
+                << NormalEstimator::minNeighbours << ", " << NormalEstimator::maxNeighbours << "]";
+            throw invalid_option(msg.str());
+        }
+        if (!vm.count(Option::pointRadius))
+            throw invalid_option(std::string("--") + Option::estimateNormals + " requires --" + Option::pointRadius);
+        if (vm.count(Option::sparseOctree))
+            throw invalid_option(std::string("--") + Option::estimateNormals + " cannot be combined with --" + Option::sparseOctree);
+    }
+    else if (vm.count(Option::pointRadius))
+        throw invalid_option(std::string("--") + Option::pointRadius + " requires --" + Option::estimateNormals);
+    if (vm.count(Option::pointRadius) && !(vm[Option::pointRadius].as<double>() > 0.0))
+        throw invalid_option(std::string("Value of --") + Option::pointRadius + " must be positive");
+    if (vm.count(Option::scannerPosition))
+    {
+        float position[3];
+        if (!vm.count(Option::estimateNormals))
+            throw invalid_option(std::string("--") + Option::scannerPosition + " requires --" + Option::estimateNormals);
+        if (!parsePosition(vm[Option::scannerPosition].as<std::string>(), position))
+            throw invalid_option(std::string("Value of --") + Option::scannerPosition + " must be x,y,z");
+    }
+    if (vm.count(Option::adaptiveGrid))
+    {
+        const int adaptiveLevel = vm[Option::adaptiveGrid].as<int>();
+        if (adaptiveLevel < 0 || adaptiveLevel > int(BucketLoader::maxAdaptiveLevel))
+        {
+            std::ostringstream msg;
+            msg << "Value of --" << Option::adaptiveGrid << " must be in [0, "
+                << BucketLoader::maxAdaptiveLevel << "]";
+            throw invalid_option(msg.str());
+        }
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::adaptiveGrid + " is not supported with MPI");
+    }
+    const int lodLevels = vm[Option::lodLevels].as<int>();
+    if (lodLevels < 0 || lodLevels > int(BucketLoader::maxAdaptiveLevel))
+    {
+        std::ostringstream msg;
+        msg << "Value of --" << Option::lodLevels << " must be in [0, "
+            << BucketLoader::maxAdaptiveLevel << "]";
+        throw invalid_option(msg.str());
+    }
+    if (lodLevels > 0)
+    {
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::lodLevels + " is not supported with MPI");
+        const char * const conflicts[] = {
+            Option::adaptiveGrid, Option::bucketCache, Option::carrySlices,
+            Option::checkpoint, Option::resume, Option::snapshot, Option::incremental
+        };
+        checkConflicts(vm, Option::lodLevels, conflicts);
+        if (vm[Option::hostThreads].as<int>() > 0)
+            throw invalid_option(std::string("--") + Option::lodLevels + " cannot be combined with --" + Option::hostThreads);
+    }
+    const int previewLevel = vm[Option::preview].as<int>();
+    if (previewLevel < 0 || previewLevel > int(BucketLoader::maxAdaptiveLevel))
+    {
+        std::ostringstream msg;
+        msg << "Value of --" << Option::preview << " must be in [0, "
+            << BucketLoader::maxAdaptiveLevel << "]";
+        throw invalid_option(msg.str());
+    }
+    if (previewLevel > 0)
+    {
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::preview + " is not supported with MPI");
+        // As for --lod-levels, plus a preview for every calibration run
+        const char * const conflicts[] = {
+            Option::adaptiveGrid, Option::bucketCache, Option::carrySlices,
+            Option::checkpoint, Option::resume, Option::snapshot, Option::incremental,
+            Option::autotuneHost
+        };
+        checkConflicts(vm, Option::preview, conflicts);
+        if (vm[Option::hostThreads].as<int>() > 0)
+            throw invalid_option(std::string("--") + Option::preview + " cannot be combined with --" + Option::hostThreads);
+    }
+    if (!(vm[Option::adaptiveRadius].as<double>() > 0.0))
+        throw invalid_option(std::string("Value of --") + Option::adaptiveRadius + " must be positive");
+    if (vm.count(Option::decimate) && !(vm[Option::decimate].as<double>() >= 1.0))
+        throw invalid_option(std::string("Value of --") + Option::decimate + " must be at least 1");
+    if (!(vm[Option::snapshotInterval].as<double>() > 0.0))
+        throw invalid_option(std::string("Value of --") + Option::snapshotInterval + " must be positive");
+    if (isMPI && vm.count(Option::snapshot) && vm.count(Option::distributedMesher))
+        throw invalid_option(std::string("--") + Option::snapshot + " cannot be combined with --" + Option::distributedMesher);
+    if (isMPI && vm.count(Option::bucketCache))
+        throw invalid_option(std::string("--") + Option::bucketCache + " is not supported with MPI");
+    if (vm[Option::readerThreads].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::readerThreads + " must be positive");
+    if (vm[Option::headerThreads].as<int>() < 1)
+        throw invalid_option(std::string("Value of --") + Option::headerThreads + " must be positive");
+    if (vm[Option::openFiles].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::openFiles + " must be non-negative");
+    if (vm[Option::hostThreads].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::hostThreads + " must be non-negative");
+    if (vm[Option::hostThreads].as<int>() > 0)
+    {
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::hostThreads + " is not supported with MPI");
+        const char * const conflicts[] = { Option::estimateNormals, Option::decimate };
+        checkConflicts(vm, Option::hostThreads, conflicts);
+    }
+    if (vm.count(Option::incremental))
+    {
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::incremental + " is not supported with MPI");
+        if (!vm.count(Option::split))
+            throw invalid_option(std::string("--") + Option::incremental + " requires --" + Option::split);
+        const char * const conflicts[] = { Option::checkpoint, Option::resume, Option::snapshot, Option::estimateNormals,
+                                          Option::adaptiveGrid };
+        checkConflicts(vm, Option::incremental, conflicts);
+    }
+    const char * const splitOptions[] = { Option::splitIndex, Option::splitContainer };
+    for (unsigned int i = 0; i < sizeof(splitOptions) / sizeof(splitOptions[0]); i++)
+        if (vm.count(splitOptions[i]))
+        {
+            if (!vm.count(Option::split))
+                throw invalid_option(std::string("--") + splitOptions[i] + " requires --" + Option::split);
+            // Chunks reused from an earlier run would be missing
+            if (vm.count(Option::incremental))
+                throw invalid_option(std::string("--") + splitOptions[i] + " cannot be combined with --" + Option::incremental);
+        }
+    if (vm.count(Option::splitContainer))
+    {
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::splitContainer + " is not supported with MPI");
+        if (vm[Option::writer].as<Choice<WriterTypeWrapper> >() == ZSTD_WRITER)
+            throw invalid_option(std::string("--") + Option::splitContainer + " cannot be used with the zstd writer");
+    }
+    if (vm.count(Option::streamChunks))
+    {
+        if (!vm.count(Option::split))
+            throw invalid_option(std::string("--") + Option::streamChunks + " requires --" + Option::split);
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::streamChunks + " is not supported with MPI");
+        // These all need every chunk to be complete before any is written
+        const char * const conflicts[] = { Option::splitContainer, Option::tile, Option::checkpoint, Option::resume,
+                                          Option::snapshot, Option::tmpCompress, Option::adaptiveGrid };
+        checkConflicts(vm, Option::streamChunks, conflicts);
+    }
+    if (vm.count(Option::streamDirect) && !vm.count(Option::streamChunks))
+        throw invalid_option(std::string("--") + Option::streamDirect + " requires --" + Option::streamChunks);
+    if (vm.count(Option::ingest))
+    {
+        if (isMPI)
+            throw invalid_option(std::string("--") + Option::ingest + " is not supported with MPI");
+        if (vm.count(Option::inputFile) && vm[Option::inputFile].as<std::vector<std::string> >().size() != 1)
+            throw invalid_option(std::string("--") + Option::ingest + " requires exactly one input");
+        // These identify the inputs by their files, or cannot be spooled
+        const char * const conflicts[] = { Option::blobCache, Option::savePlan, Option::loadPlan, Option::incremental,
+                                          Option::stageDir, Option::estimateNormals };
+        checkConflicts(vm, Option::ingest, conflicts);
+    }
+    if (vm.count(Option::parallelWrite)
+        && vm[Option::writer].as<Choice<WriterTypeWrapper> >() == ZSTD_WRITER)
+        throw invalid_option(std::string("--") + Option::parallelWrite + " cannot be used with the zstd writer");
+    if (vm.count(Option::carrySlices))
+    {
+        // The output for a bucket would depend on the bucket processed before it
+        const char * const conflicts[] = { Option::bucketCache, Option::incremental };
+        checkConflicts(vm, Option::carrySlices, conflicts);
+    }
 
     if (memMesh < getMeshHostMemory(vm))
         throw invalid_option(std::string("Value of --") + Option::memMesh + " is too small");
+    if (!isMPI && vm[Option::loadQueue].as<int>() < 0)
+        throw invalid_option(std::string("Value of --") + Option::loadQueue + " must be non-negative");
     if (isMPI)
     {
         const std::size_t memGather = vm[Option::memGather].as<Capacity>();
         if (memGather < getMeshHostMemory(vm))
             throw invalid_option(std::string("Value of --") + Option::memGather + " is too small");
+        if (vm[Option::scatterCredits].as<int>() < 1)
+            throw invalid_option(std::string("Value of --") + Option::scatterCredits + " must be at least 1");
+        if (vm.count(Option::distributedMesher) && !vm.count(Option::split))
+            throw invalid_option(std::string("--") + Option::distributedMesher + " requires --" + Option::split);
+        if (vm.count(Option::hierarchical) && vm.count(Option::distributedMesher))
+            throw invalid_option(std::string("--") + Option::hierarchical + " cannot be combined with --" + Option::distributedMesher);
+        if (vm[Option::mpiioAggregators].as<int>() < 0)
+            throw invalid_option(std::string("Value of --") + Option::mpiioAggregators + " must be non-negative");
+        if (vm[Option::stripeCount].as<int>() < 0)
+            throw invalid_option(std::string("Value of --") + Option::stripeCount + " must be non-negative");
+        if (vm.count(Option::hierarchical) && !vm[Option::leaveFile].as<std::string>().empty())
+            throw invalid_option(std::string("--") + Option::hierarchical + " cannot be combined with --" + Option::leaveFile);
     }
 }
 
+Timeplot::Format getTimeplotFormat(const po::variables_map &vm)
+{
+    if (vm.count(Option::timeplotBinary))
+        return Timeplot::FORMAT_BINARY;
+    else if (vm.count(Option::timeplotChrome))
+        return Timeplot::FORMAT_CHROME;
+    else
+        return Timeplot::FORMAT_TEXT;
+}
+
 void setLogLevel(const po::variables_map &vm)
 {
     if (vm.count(Option::quiet))
@@ -464,29 +1007,87 @@ void setLogLevel(const po::variables_map &vm)
         Log::log.setLevel(Log::debug);
     else
         Log::log.setLevel(Log::info);
+    if (vm.count(Option::logAsync))
+        Log::startAsync(std::cerr);
+}
+
+void setMemoryPolicy(const po::variables_map &vm)
+{
+    LargePages::setPolicy(vm[Option::hugePages].as<Choice<HugePageModeWrapper> >(),
+                          vm[Option::numaNode].as<int>());
+}
+
+unsigned int getCpuThreads(const po::variables_map &vm)
+{
+    const int threads = vm[Option::cpuThreads].as<int>();
+    if (threads > 0)
+        return threads;
+    return std::max(1U, boost::thread::hardware_concurrency());
 }
 
-CLH::ResourceUsage resourceUsage(const po::variables_map &vm)
+CLH::ResourceUsage resourceUsage(const po::variables_map &vm, const cl::Device &device,
+                                 int deviceThreads, int deviceSpare)
 {
     const int levels = vm[Option::levels].as<int>();
     const int subsampling = vm[Option::subsampling].as<int>();
     const std::size_t maxBucketSplats = getMaxBucketSplats(vm);
-    const int deviceThreads = vm[Option::deviceThreads].as<int>();
-    const int deviceSpare = getDeviceWorkerGroupSpare(vm);
+    if (deviceThreads <= 0)
+        deviceThreads = vm[Option::deviceThreads].as<int>();
+    if (deviceSpare <= 0)
+        deviceSpare = getDeviceWorkerGroupSpare(vm);
 
     const Grid::size_type maxCells = (Grid::size_type(1U) << (levels + subsampling - 1)) - 1;
-    // TODO: get rid of device parameter
     CLH::ResourceUsage totalUsage = DeviceWorkerGroup::resourceUsage(
-        deviceThreads, deviceSpare, cl::Device(),
+        deviceThreads, deviceSpare, device,
         maxBucketSplats, maxCells,
-        getMeshMemory(vm), levels);
+        getMeshMemory(vm), levels, getDistanceType(vm), getSplatLayout(vm),
+        vm.count(Option::hashWeld), vm.count(Option::sparseOctree),
+        vm[Option::deviceScratch].as<int>(), getDistanceStorage(vm),
+        vm[Option::scatterDensity].as<double>() > 0.0 && vm[Option::mergeSplats].as<double>() == 0.0);
     return totalUsage;
 }
 
-void validateDevice(const cl::Device &device, const CLH::ResourceUsage &totalUsage)
+unsigned int getDeviceThreads(const po::variables_map &vm, const cl::Device &device)
+{
+    const std::tr1::uint64_t deviceTotalMemory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    const std::tr1::uint64_t deviceMaxMemory = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    int threads = vm[Option::deviceThreads].as<int>();
+    while (threads > 1)
+    {
+        const CLH::ResourceUsage usage = resourceUsage(vm, device, threads);
+        if (usage.getMaxMemory() <= deviceMaxMemory
+            && usage.getTotalMemory() <= deviceTotalMemory * 0.8)
+            break;
+        threads--;
+    }
+    return std::max(threads, 1);
+}
+
+unsigned int getDeviceSpare(const po::variables_map &vm, const cl::Device &device, unsigned int deviceThreads)
+{
+    const unsigned int base = getDeviceWorkerGroupSpare(vm);
+    if (!vm.count(Option::adaptivePacking))
+        return base;
+
+    const std::tr1::uint64_t deviceTotalMemory = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    const std::tr1::uint64_t deviceMaxMemory = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    unsigned int spare = base;
+    while (spare < deviceThreads + base)
+    {
+        const CLH::ResourceUsage usage = resourceUsage(vm, device, deviceThreads, spare + 1);
+        if (usage.getMaxMemory() > deviceMaxMemory
+            || usage.getTotalMemory() > deviceTotalMemory * 0.8)
+            break;
+        spare++;
+    }
+    return spare;
+}
+
+void validateDevice(const po::variables_map &vm, const cl::Device &device,
+                    const CLH::ResourceUsage &totalUsage)
 {
     const std::string deviceName = "OpenCL device `" + device.getInfo<CL_DEVICE_NAME>() + "'";
-    Marching::validateDevice(device);
+    Marching::validateDevice(device, DeviceWorkerGroup::distanceStorageFor(device, getDistanceStorage(vm)));
     SplatTreeCL::validateDevice(device);
 
     /* Check that we have enough memory on the device. This is no guarantee against OOM, but
@@ -517,7 +1118,136 @@ void validateDevice(const cl::Device &device, const CLH::ResourceUsage &totalUsa
     }
 }
 
-void prepareInputs(SplatSet::FileSet &files, const po::variables_map &vm, float smooth, float maxRadius)
+MemoryLimits getMemoryLimits(const std::vector<cl::Device> &devices, unsigned int processesPerHost)
+{
+    MemoryLimits limits;
+    limits.hostMemory = 0;
+#if HAVE_SYSCONF && defined(_SC_PHYS_PAGES)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0)
+        limits.hostMemory = std::tr1::uint64_t(pages) * pageSize / std::max(processesPerHost, 1U);
+#else
+    (void) processesPerHost;
+#endif
+    limits.deviceMemory = std::numeric_limits<std::tr1::uint64_t>::max();
+    limits.deviceMaxAlloc = std::numeric_limits<std::tr1::uint64_t>::max();
+    BOOST_FOREACH(const cl::Device &device, devices)
+    {
+        limits.deviceMemory = std::min(limits.deviceMemory,
+                                       std::tr1::uint64_t(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()));
+        limits.deviceMaxAlloc = std::min(limits.deviceMaxAlloc,
+                                         std::tr1::uint64_t(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()));
+    }
+    return limits;
+}
+
+/// Set a memory option, unless the user gave it explicitly
+static void setDefaultedCapacity(po::variables_map &vm, const char *name, std::tr1::uint64_t value)
+{
+    po::variable_value &v = vm.at(name);
+    if (v.defaulted())
+        v.value() = Capacity(value);
+}
+
+/**
+ * Host memory needed by a plan. The options that are still defaulted are
+ * replaced by the planned values for @a bucketBytes of device splats.
+ */
+static std::tr1::uint64_t planHostMemory(
+    po::variables_map &vm, std::tr1::uint64_t bucketBytes, bool isMPI)
+{
+    // These match the ratios between the default values
+    const unsigned int loadRatio = 4;   // --mem-load-splats relative to the bucket
+    const unsigned int hostRatio = 8;   // --mem-host-splats relative to the bucket
+    const unsigned int meshRatio = 2;   // blocks of raw mesh data that can be buffered
+
+    setDefaultedCapacity(vm, Option::memBucketSplats, bucketBytes);
+    const std::tr1::uint64_t hostBucket = std::tr1::uint64_t(getMaxBucketSplats(vm)) * sizeof(Splat);
+    setDefaultedCapacity(vm, Option::memLoadSplats, loadRatio * hostBucket);
+    setDefaultedCapacity(vm, Option::memHostSplats, hostRatio * hostBucket);
+    setDefaultedCapacity(vm, Option::memMesh, meshRatio * getMeshHostMemory(vm));
+
+    std::tr1::uint64_t total =
+        vm[Option::memLoadSplats].as<Capacity>()
+        + vm[Option::memHostSplats].as<Capacity>()
+        + vm[Option::memMesh].as<Capacity>();
+    if (isMPI)
+    {
+        setDefaultedCapacity(vm, Option::memGather, meshRatio * getMeshHostMemory(vm));
+        total += vm[Option::memGather].as<Capacity>();
+    }
+    return total;
+}
+
+void planMemory(po::variables_map &vm, const MemoryLimits &limits, bool isMPI, std::ostream *log)
+{
+    if (!vm.count(Option::memAuto))
+        return;
+    if (limits.hostMemory == 0)
+        throw invalid_option(std::string("Could not determine the amount of host memory for --")
+                             + Option::memAuto);
+
+    typedef std::tr1::uint64_t uint64;
+    const uint64 MiB = 1024 * 1024;
+    // Leave room for the operating system, the page cache and smaller allocations
+    const uint64 hostBudget = limits.hostMemory / 4 * 3;
+    const uint64 minReorder = 256 * MiB;
+
+    /* Usage grows with the bucket size, so binary search (in MiB) for the
+     * largest bucket that fits both the devices and the host.
+     */
+    po::variables_map trial = vm;
+    const bool userBucket = !vm[Option::memBucketSplats].defaulted();
+    uint64 lo = 0;
+    uint64 hi = std::min(limits.deviceMemory, hostBudget) / MiB;
+    if (userBucket)
+        lo = hi = vm[Option::memBucketSplats].as<Capacity>() / MiB;
+    while (lo < hi)
+    {
+        const uint64 mid = lo + (hi - lo + 1) / 2;
+        const uint64 host = planHostMemory(trial, mid * MiB, isMPI);
+        const CLH::ResourceUsage usage = resourceUsage(trial);
+        if (host + minReorder <= hostBudget
+            && usage.getMaxMemory() <= limits.deviceMaxAlloc
+            && usage.getTotalMemory() <= limits.deviceMemory * 0.8)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    const uint64 bucketBytes = userBucket ? uint64(vm[Option::memBucketSplats].as<Capacity>()) : lo * MiB;
+    if (bucketBytes == 0)
+        throw invalid_option(std::string("Not enough memory for --") + Option::memAuto
+                             + "; reduce --levels or --subsampling, or set the memory options explicitly");
+
+    const uint64 host = planHostMemory(vm, bucketBytes, isMPI);
+    if (host + minReorder > hostBudget && vm[Option::memReorder].defaulted())
+        throw invalid_option(std::string("Not enough host memory for --") + Option::memAuto
+                             + "; set the memory options explicitly");
+    setDefaultedCapacity(vm, Option::memReorder, host < hostBudget ? hostBudget - host : 0);
+    if (vm.count(Option::memLimit))
+        setDefaultedCapacity(vm, Option::memLimit, hostBudget);
+
+    if (log != NULL)
+    {
+        *log << "Memory plan: "
+            << "--" << Option::memBucketSplats << '=' << vm[Option::memBucketSplats].as<Capacity>()
+            << " --" << Option::memLoadSplats << '=' << vm[Option::memLoadSplats].as<Capacity>()
+            << " --" << Option::memHostSplats << '=' << vm[Option::memHostSplats].as<Capacity>()
+            << " --" << Option::memMesh << '=' << vm[Option::memMesh].as<Capacity>();
+        if (isMPI)
+            *log << " --" << Option::memGather << '=' << vm[Option::memGather].as<Capacity>();
+        *log << " --" << Option::memReorder << '=' << vm[Option::memReorder].as<Capacity>();
+        if (vm.count(Option::memLimit))
+            *log << " --" << Option::memLimit << '=' << vm[Option::memLimit].as<Capacity>();
+        *log << '\n';
+    }
+}
+
+/**
+ * Expand the input files and directories given on the command line to a list of files.
+ */
+static std::vector<boost::filesystem::path> getInputPaths(const po::variables_map &vm)
 {
     const std::vector<std::string> &names = vm[Option::inputFile].as<std::vector<std::string> >();
     std::vector<boost::filesystem::path> paths;
@@ -529,7 +1259,8 @@ void prepareInputs(SplatSet::FileSet &files, const po::variables_map &vm, float
             boost::filesystem::directory_iterator it(base);
             while (it != boost::filesystem::directory_iterator())
             {
-                if (it->path().extension() == ".ply" && !is_directory(it->status()))
+                if ((it->path().extension() == ".ply" || it->path().extension() == ".las")
+                    && !is_directory(it->status()))
                     paths.push_back(it->path());
                 ++it;
             }
@@ -537,7 +1268,134 @@ void prepareInputs(SplatSet::FileSet &files, const po::variables_map &vm, float
         else
             paths.push_back(name);
     }
+    return paths;
+}
+
+namespace
+{
+
+/**
+ * Opens input files and parses their headers, sharing the files out between
+ * several threads. Each thread has at most one file open at a time.
+ */
+class HeaderParser
+{
+public:
+    HeaderParser(const std::vector<boost::filesystem::path> &paths,
+                 const boost::function<BinaryReader *()> &readerFactory,
+                 float smooth, float maxRadius, float pointRadius, bool decacheFiles)
+        : paths(paths), readerFactory(readerFactory),
+        smooth(smooth), maxRadius(maxRadius), pointRadius(pointRadius), decacheFiles(decacheFiles),
+        readers(paths.size()), errors(paths.size()), next(0), failed(false)
+    {
+    }
+
+    ~HeaderParser()
+    {
+        BOOST_FOREACH(FastPly::Reader *reader, readers)
+            delete reader;
+    }
+
+    /**
+     * Parse all the headers with up to @a threads threads.
+     *
+     * @throw the exception for the first file in order that could not be
+     * parsed.
+     */
+    void run(std::size_t threads)
+    {
+        threads = std::min(threads, paths.size());
+        if (threads <= 1)
+            worker();
+        else
+        {
+            boost::thread_group pool;
+            for (std::size_t i = 0; i < threads; i++)
+                pool.create_thread(boost::bind(&HeaderParser::worker, this));
+            pool.join_all();
+        }
+        BOOST_FOREACH(const boost::exception_ptr &error, errors)
+        {
+            if (error)
+                boost::rethrow_exception(error);
+        }
+    }
+
+    /// Pass ownership of the reader for file @a idx to the caller.
+    FastPly::Reader *release(std::size_t idx)
+    {
+        FastPly::Reader *reader = readers[idx];
+        readers[idx] = NULL;
+        return reader;
+    }
+
+private:
+    const std::vector<boost::filesystem::path> &paths;
+    const boost::function<BinaryReader *()> readerFactory;
+    const float smooth, maxRadius, pointRadius;
+    const bool decacheFiles;
+
+    std::vector<FastPly::Reader *> readers;     ///< Parsed files, indexed like @ref paths
+    std::vector<boost::exception_ptr> errors;   ///< Failures, indexed like @ref paths
+
+    boost::mutex mutex;         ///< Protects @ref next and @ref failed
+    std::size_t next;           ///< Next file to parse
+    bool failed;                ///< Set once any file fails, to stop the other threads
+
+    void worker()
+    {
+        while (true)
+        {
+            std::size_t idx;
+            {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                if (failed || next == paths.size())
+                    return;
+                idx = next++;
+            }
+
+            try
+            {
+                const boost::filesystem::path &path = paths[idx];
+                if (decacheFiles)
+                    decache(path.string());
+                std::auto_ptr<FastPly::Reader> reader(
+                    new FastPly::Reader(readerFactory, path.string(), smooth, maxRadius, pointRadius));
+                if (reader->size() > SplatSet::FileSet::maxFileSplats)
+                {
+                    std::ostringstream msg;
+                    msg << "Too many samples in " << path << " ("
+                        << reader->size() << " > " << SplatSet::FileSet::maxFileSplats << ")";
+                    throw std::runtime_error(msg.str());
+                }
+                readers[idx] = reader.release();
+            }
+            catch (...)
+            {
+                errors[idx] = boost::current_exception();
+                boost::lock_guard<boost::mutex> lock(mutex);
+                failed = true;
+            }
+        }
+    }
+};
+
+} // anonymous namespace
+
+void prepareInputs(SplatSet::FileSet &files, const po::variables_map &vm, float smooth, float maxRadius,
+                   const InputSource &source)
+{
+    const float pointRadius = getPointRadius(vm);
+    files.setPrefetchRanges(std::max(0, vm[Option::readAhead].as<int>()));
+    files.setReaderThreads(vm[Option::readerThreads].as<int>());
+    files.setOpenFiles(vm[Option::openFiles].as<int>());
+    if (!source.empty())
+    {
+        source(files, smooth, maxRadius, pointRadius);
+        return;
+    }
 
+    const std::vector<boost::filesystem::path> paths = getInputPaths(vm);
     const ReaderType readerType = vm[Option::reader].as<Choice<ReaderTypeWrapper> >();
     if (paths.size() > SplatSet::FileSet::maxFiles)
     {
@@ -545,20 +1403,24 @@ void prepareInputs(SplatSet::FileSet &files, const po::variables_map &vm, float
         msg << "Too many input files (" << paths.size() << " > " << SplatSet::FileSet::maxFiles << ")";
         throw std::runtime_error(msg.str());
     }
+
+    boost::function<BinaryReader *()> readerFactory = boost::bind(createReader, readerType);
+    if (vm.count(Option::stageDir))
+    {
+        StagingCache *cache = new StagingCache(
+            vm[Option::stageDir].as<std::string>(), vm[Option::stageSize].as<Capacity>(), readerType);
+        files.setStagingCache(cache);
+        readerFactory = boost::bind(&StagingCache::createReader, cache);
+    }
+
+    HeaderParser parser(paths, readerFactory, smooth, maxRadius, pointRadius, vm.count(Option::decache));
+    parser.run(vm[Option::headerThreads].as<int>());
+
     std::tr1::uint64_t totalSplats = 0;
     std::tr1::uint64_t totalBytes = 0;
-    BOOST_FOREACH(const boost::filesystem::path &path, paths)
+    for (std::size_t i = 0; i < paths.size(); i++)
     {
-        if (vm.count(Option::decache))
-            decache(path.string());
-        std::auto_ptr<FastPly::Reader> reader(new FastPly::Reader(readerType, path.string(), smooth, maxRadius));
-        if (reader->size() > SplatSet::FileSet::maxFileSplats)
-        {
-            std::ostringstream msg;
-            msg << "Too many samples in " << path << " ("
-                << reader->size() << " > " << SplatSet::FileSet::maxFileSplats << ")";
-            throw std::runtime_error(msg.str());
-        }
+        std::auto_ptr<FastPly::Reader> reader(parser.release(i));
         totalSplats += reader->size();
         totalBytes += reader->size() * reader->getVertexSize();
         files.addFile(reader.get());
@@ -584,11 +1446,37 @@ void reportException(std::exception &e)
         std::cerr << e.what() << std::endl;
 }
 
+/**
+ * Build a string that changes whenever the input files or the parameters
+ * that affect @ref SplatSet::FastBlobSet::computeBlobs change.
+ */
+static std::string makeBlobCacheKey(
+    const std::vector<boost::filesystem::path> &paths,
+    float spacing, unsigned int bucketSize, float smooth, float maxRadius, float pointRadius)
+{
+    std::ostringstream key;
+    key.imbue(std::locale::classic());
+    key << std::setprecision(9)
+        << "spacing=" << spacing << " bucket=" << bucketSize
+        << " smooth=" << smooth << " max-radius=" << maxRadius
+        << " point-radius=" << pointRadius << '\n';
+    BOOST_FOREACH(const boost::filesystem::path &path, paths)
+    {
+        key << boost::filesystem::absolute(path).string() << '\n'
+            << boost::filesystem::file_size(path) << ' '
+            << boost::filesystem::last_write_time(path) << '\n';
+    }
+    return key.str();
+}
+
 void doComputeBlobs(
     Timeplot::Worker &tworker,
     const po::variables_map &vm,
     SplatSet::FileSet &splats,
-    boost::function<void(float, unsigned int)> computeBlobs)
+    boost::function<void(float, unsigned int)> computeBlobs,
+    boost::function<bool(const boost::filesystem::path &, const std::string &)> loadBlobs,
+    boost::function<void(const boost::filesystem::path &, const std::string &)> saveBlobs,
+    const InputSource &source)
 {
     const float spacing = vm[Option::fitGrid].as<double>();
     const float smooth = vm[Option::fitSmooth].as<double>();
@@ -602,7 +1490,29 @@ void doComputeBlobs(
     const unsigned int blockCells = block - 1;
     const unsigned int microCells = std::min(leafCells, blockCells);
 
-    prepareInputs(splats, vm, smooth, maxRadius);
+    prepareInputs(splats, vm, smooth, maxRadius, source);
+
+    boost::filesystem::path cachePath;
+    std::string cacheKey;
+    if (vm.count(Option::blobCache))
+    {
+        if (!source.empty())
+            Log::log[Log::warn] << "--" << Option::blobCache << " is not supported for in-memory inputs, ignoring\n";
+        else if (loadBlobs.empty() || saveBlobs.empty())
+            Log::log[Log::warn] << "--" << Option::blobCache << " is not supported by this program, ignoring\n";
+        else
+        {
+            cachePath = vm[Option::blobCache].as<std::string>();
+            cacheKey = makeBlobCacheKey(getInputPaths(vm), spacing, microCells, smooth, maxRadius,
+                                        getPointRadius(vm));
+            if (loadBlobs(cachePath, cacheKey))
+            {
+                Log::log[Log::info] << "Loaded bounding box from " << cachePath.string() << '\n';
+                return;
+            }
+        }
+    }
+
     try
     {
         Timeplot::Action timer("bbox", tworker, "bbox.time");
@@ -612,21 +1522,170 @@ void doComputeBlobs(
     {
         throw std::runtime_error("At least one input point is required");
     }
+
+    if (!cachePath.empty())
+    {
+        try
+        {
+            saveBlobs(cachePath, cacheKey);
+        }
+        catch (std::ios::failure &e)
+        {
+            Log::log[Log::warn] << "Could not save bounding box to " << cachePath.string() << ": " << e.what() << '\n';
+        }
+    }
+}
+
+void ingestInputs(
+    Timeplot::Worker &tworker,
+    const po::variables_map &vm,
+    SplatSet::FastBlobSet<SplatSet::FileSet> &splats)
+{
+    const float spacing = vm[Option::fitGrid].as<double>();
+    const float smooth = vm[Option::fitSmooth].as<double>();
+    const float maxRadius = vm.count(Option::maxRadius)
+        ? vm[Option::maxRadius].as<double>() : std::numeric_limits<float>::infinity();
+
+    const int subsampling = vm[Option::subsampling].as<int>();
+    const int levels = vm[Option::levels].as<int>();
+    const unsigned int leafCells = vm[Option::leafCells].as<int>();
+    const unsigned int block = 1U << (levels + subsampling - 1);
+    const unsigned int blockCells = block - 1;
+    const unsigned int microCells = std::min(leafCells, blockCells);
+
+    splats.setPrefetchRanges(std::max(0, vm[Option::readAhead].as<int>()));
+    splats.setReaderThreads(vm[Option::readerThreads].as<int>());
+    splats.setOpenFiles(vm[Option::openFiles].as<int>());
+
+    const std::string name = vm[Option::inputFile].as<std::vector<std::string> >()[0];
+    const std::string spool = vm[Option::ingest].as<std::string>();
+    boost::filesystem::ifstream file;
+    std::istream *in = &std::cin;
+    if (name != "-")
+    {
+        file.open(name, std::ios::binary);
+        if (!file)
+            throw boost::enable_error_info(std::ios::failure("Could not open file"))
+                << boost::errinfo_errno(errno)
+                << boost::errinfo_file_name(name);
+        in = &file;
+    }
+
+    Timeplot::Action timer("bbox", tworker, "bbox.time");
+
+    /* The header is parsed twice: the spool holds the splats as read, so
+     * that smoothing is applied when it is read back, while the blobs need
+     * the smoothed radii.
+     */
+    std::string header, line;
+    do
+    {
+        if (!std::getline(*in, line))
+            throw boost::enable_error_info(FastPly::FormatError("End of file in PLY header"))
+                << boost::errinfo_file_name(name);
+        header += line + '\n';
+    } while (line.compare(0, 10, "end_header") != 0);
+    std::istringstream rawHeader(header), fitHeader(header);
+    const FastPly::Reader raw(rawHeader, name, 1.0f, std::numeric_limits<float>::infinity());
+    const FastPly::Reader fit(fitHeader, name, smooth, maxRadius);
+    const FastPly::Reader::size_type total = raw.size();
+    if (total > SplatSet::FileSet::maxFileSplats)
+    {
+        std::ostringstream msg;
+        msg << "Too many samples in " << name << " ("
+            << total << " > " << SplatSet::FileSet::maxFileSplats << ")";
+        throw std::runtime_error(msg.str());
+    }
+
+    Log::log[Log::info] << "Ingesting " << name << " to " << spool << '\n';
+    ProgressDisplay progress(total, Log::log[Log::info]);
+    const std::size_t vertexSize = raw.getVertexSize();
+    const std::size_t batch = std::max(std::size_t(1), std::size_t(SplatSet::FileSet::DEFAULT_BUFFER_SIZE) / 4 / vertexSize);
+    std::vector<char> buffer(batch * vertexSize);
+    std::vector<Splat> rawSplats(batch), fitSplats(batch);
+
+    FastPly::SplatCacheWriter writer(SYSCALL_WRITER, spool, total);
+    splats.startIngest(spacing, microCells);
+    // The spool is the only file, so splat IDs are vertex indices
+    for (FastPly::Reader::size_type pos = 0; pos < total; )
+    {
+        const std::size_t n = std::min(FastPly::Reader::size_type(batch), total - pos);
+        if (!in->read(&buffer[0], n * vertexSize))
+        {
+            if (in->eof())
+                throw boost::enable_error_info(FastPly::FormatError("End of file in PLY data"))
+                    << boost::errinfo_file_name(name);
+            else
+                throw boost::enable_error_info(std::ios::failure("Failed to read PLY data"))
+                    << boost::errinfo_errno(errno)
+                    << boost::errinfo_file_name(name);
+        }
+        raw.decode(&buffer[0], 0, n, &rawSplats[0]);
+        fit.decode(&buffer[0], 0, n, &fitSplats[0]);
+        writer.write(pos, n, &rawSplats[0]);
+        splats.ingest(&fitSplats[0], pos, n);
+        pos += n;
+        progress += n;
+    }
+    writer.close();
+
+    const ReaderType readerType = vm[Option::reader].as<Choice<ReaderTypeWrapper> >();
+    std::auto_ptr<FastPly::Reader> reader(new FastPly::Reader(readerType, spool, smooth, maxRadius));
+    splats.addFile(reader.get());
+    reader.release();
+    splats.finishIngest(true);
+
+    Statistics::getStatistic<Statistics::Counter>("files.scans").add(1);
+    Statistics::getStatistic<Statistics::Counter>("files.splats").add(total);
+    Statistics::getStatistic<Statistics::Counter>("files.bytes").add(total * vertexSize);
 }
 
-unsigned int postprocessGrid(const po::variables_map &vm, const Grid &grid)
+Grid cropGrid(const po::variables_map &vm, const Grid &grid, Grid::size_type align)
 {
+    if (!vm.count(Option::region))
+        return grid;
+
+    float lower[3], upper[3];
+    if (!parseRegion(vm[Option::region].as<std::string>(), lower, upper))
+        throw invalid_option(std::string("Invalid value for --") + Option::region);
+    grid.worldToVertex(lower, lower);
+    grid.worldToVertex(upper, upper);
+
+    Grid ans = grid;
     for (unsigned int i = 0; i < 3; i++)
     {
-        double size = grid.numCells(i) * grid.getSpacing();
-        Statistics::getStatistic<Statistics::Variable>(std::string("bbox") + "XYZ"[i]).add(size);
-        if (grid.numVertices(i) > Marching::MAX_GLOBAL_DIMENSION)
+        // Clamp first, so that the conversions cannot overflow
+        const float cells = grid.numCells(i);
+        const Grid::difference_type base = grid.getExtent(i).first;
+        Grid::difference_type low = base + Grid::difference_type(std::floor(std::max(lower[i], 0.0f)));
+        Grid::difference_type high = base + Grid::difference_type(std::ceil(std::min(upper[i], cells)));
+        if (low >= high)
+            throw std::runtime_error(std::string("The --") + Option::region + " does not overlap the input");
+        // Round down towards negative infinity
+        const Grid::difference_type a = align;
+        low = (low >= 0 ? low / a : -((-low + a - 1) / a)) * a;
+        /* A tile must end where its neighbour starts, so the high end is
+         * rounded in the same way, except at the edge of the input.
+         */
+        if (vm.count(Option::tile) && high < base + Grid::difference_type(grid.numCells(i)))
         {
-            std::ostringstream msg;
-            msg << "The bounding box is too big (" << grid.numVertices(i) << " grid units).\n"
-                << "Perhaps you have used the wrong units for --fit-grid?";
-            throw std::runtime_error(msg.str());
+            high = (high >= 0 ? high / a : -((-high + a - 1) / a)) * a;
+            if (low >= high)
+                throw std::runtime_error(std::string("The --") + Option::region + " is too small for a --" + Option::tile);
         }
+        ans.setExtent(i, low, high);
+    }
+    return ans;
+}
+
+unsigned int postprocessGrid(const po::variables_map &vm, const Grid &grid, bool wideKeys)
+{
+    Grid::size_type maxVertices = 0;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        double size = grid.numCells(i) * grid.getSpacing();
+        Statistics::getStatistic<Statistics::Variable>(std::string("bbox") + "XYZ"[i]).add(size);
+        maxVertices = std::max(maxVertices, grid.numVertices(i));
     }
 
     const bool split = vm.count(Option::split);
@@ -650,6 +1709,23 @@ unsigned int postprocessGrid(const po::variables_map &vm, const Grid &grid)
         chunkCells = (unsigned int) ceil(sqrt(splitSize / 760.0));
         if (chunkCells == 0) chunkCells = 1;
     }
+
+    /* Vertex keys wrap around beyond MAX_GLOBAL_DIMENSION. The mesher
+     * unwraps them relative to the chunk, which must therefore be small.
+     */
+    if (maxVertices > Marching::MAX_GLOBAL_DIMENSION
+        && (!wideKeys || chunkCells == 0 || chunkCells > Marching::MAX_GLOBAL_DIMENSION / 2))
+    {
+        std::ostringstream msg;
+        msg << "The bounding box is too big (" << maxVertices << " grid units).\n";
+        if (wideKeys)
+            msg << "Use --" << Option::split << " with a --" << Option::splitSize
+                << " giving chunks of at most " << Marching::MAX_GLOBAL_DIMENSION / 2 << " cells,\n"
+                << "or check that you have used the right units for --fit-grid.";
+        else
+            msg << "Perhaps you have used the wrong units for --fit-grid?";
+        throw std::runtime_error(msg.str());
+    }
     return chunkCells;
 }
 
@@ -659,7 +1735,8 @@ void doBucket(
     const SplatSet::FastBlobSet<SplatSet::FileSet> &splats,
     const Grid &grid,
     Grid::size_type chunkCells,
-    BucketCollector &collector)
+    BucketCollector &collector,
+    Bucket::DeviceCounter *counter)
 {
     Timeplot::Action bucketTimer("compute", tworker, "bucket.compute");
 
@@ -672,9 +1749,125 @@ void doBucket(
     const unsigned int block = 1U << (levels + subsampling - 1);
     const unsigned int blockCells = block - 1;
     const unsigned int microCells = std::min(leafCells, blockCells);
+    const Bucket::CostModel costModel(vm[Option::bucketCellWeight].as<double>(),
+                                      vm[Option::bucketCost].as<double>());
+    const std::size_t bucketThreads = vm[Option::bucketThreads].as<int>();
+    const bool thin = vm.count(Option::thinDense);
+
+    std::string planKey;
+    if (vm.count(Option::loadPlan) || vm.count(Option::savePlan))
+    {
+        const float maxRadius = vm.count(Option::maxRadius)
+            ? vm[Option::maxRadius].as<double>() : std::numeric_limits<float>::infinity();
+        std::ostringstream key;
+        key.imbue(std::locale::classic());
+        key << makeBlobCacheKey(getInputPaths(vm), grid.getSpacing(), splats.getBucketSize(),
+                                vm[Option::fitSmooth].as<double>(), maxRadius, getPointRadius(vm))
+            << std::setprecision(9)
+            << "splats=" << splats.numSplats()
+            << " max-splats=" << maxBucketSplats << " max-split=" << maxSplit
+            << " block=" << blockCells << " micro=" << microCells << " chunk=" << chunkCells
+            << " cost=" << costModel.maxCost << ' ' << costModel.cellWeight
+            << " thin=" << thin
+            << " reference=" << grid.getReference()[0] << ' ' << grid.getReference()[1]
+            << ' ' << grid.getReference()[2];
+        for (unsigned int i = 0; i < 3; i++)
+            key << ' ' << grid.getExtent(i).first << ' ' << grid.getExtent(i).second;
+        planKey = key.str();
+    }
+
+    if (vm.count(Option::loadPlan))
+    {
+        const boost::filesystem::path path(vm[Option::loadPlan].as<std::string>());
+        if (BucketPlan::replay(path, planKey, splats, boost::ref(collector)))
+            return;
+        Log::log[Log::info] << "No matching bucket plan in " << path.string() << ", bucketing\n";
+    }
+
+    if (vm.count(Option::savePlan))
+    {
+        BucketPlan::Recorder recorder(vm[Option::savePlan].as<std::string>(), planKey, boost::ref(collector));
+        Bucket::bucket(splats, grid, maxBucketSplats, blockCells, chunkCells, microCells, maxSplit,
+                       boost::ref(recorder), Bucket::Recursion(), costModel, bucketThreads, thin, counter);
+        recorder.commit();
+    }
+    else
+    {
+        Bucket::bucket(splats, grid, maxBucketSplats, blockCells, chunkCells, microCells, maxSplit,
+                       boost::ref(collector), Bucket::Recursion(), costModel, bucketThreads, thin, counter);
+    }
+}
+
+Incremental::State makeIncrementalState(
+    const po::variables_map &vm,
+    const SplatSet::FastBlobSet<SplatSet::FileSet> &splats,
+    const Grid &grid,
+    unsigned int chunkCells)
+{
+    Incremental::State state;
+
+    std::ostringstream key;
+    key.imbue(std::locale::classic());
+    key << std::setprecision(9)
+        << "spacing=" << grid.getSpacing()
+        << " smooth=" << vm[Option::fitSmooth].as<double>()
+        << " max-radius=" << (vm.count(Option::maxRadius) ? vm[Option::maxRadius].as<double>() : -1.0)
+        << " boundary-limit=" << vm[Option::fitBoundaryLimit].as<double>()
+        << " shape=" << int(vm[Option::fitShape].as<Choice<MlsShapeWrapper> >())
+        << " boundary=" << int(vm[Option::fitBoundary].as<Choice<MlsBoundaryWrapper> >())
+        << " vertex-format=" << int(vm[Option::vertexFormat].as<Choice<FastPly::VertexFormatWrapper> >())
+        << " decimate=" << (vm.count(Option::decimate) ? vm[Option::decimate].as<double>() : 0.0)
+        << " merge-splats=" << vm[Option::mergeSplats].as<double>()
+        << " marching-cubes=" << vm.count(Option::marchingCubes)
+        << " chunk=" << chunkCells;
+    for (unsigned int i = 0; i < 3; i++)
+        key << ' ' << grid.getExtent(i).first << ' ' << grid.getExtent(i).second;
+    state.key = key.str();
 
-    Bucket::bucket(splats, grid, maxBucketSplats, blockCells, chunkCells, microCells, maxSplit,
-                   boost::ref(collector));
+    const std::vector<boost::filesystem::path> paths = getInputPaths(vm);
+    std::vector<Incremental::FileRecord> files(paths.size());
+    for (std::size_t i = 0; i < paths.size(); i++)
+    {
+        files[i].path = boost::filesystem::absolute(paths[i]).string();
+        files[i].size = boost::filesystem::file_size(paths[i]);
+        files[i].mtime = boost::filesystem::last_write_time(paths[i]);
+    }
+
+    /* Blob bounds are whole buckets in the bounding grid and include the
+     * splat radii, so they cover every vertex that a splat can influence.
+     */
+    const Grid &boundingGrid = splats.getBoundingGrid();
+    const Grid::difference_type bucketSize = splats.getBucketSize();
+    boost::scoped_ptr<SplatSet::BlobStream> blobs(splats.makeBlobStream(boundingGrid, bucketSize));
+    SplatSet::BlobInfo batch[256];
+    std::size_t n;
+    while ((n = blobs->read(batch, sizeof(batch) / sizeof(batch[0]))) > 0)
+    {
+        for (std::size_t j = 0; j < n; j++)
+        {
+            const SplatSet::BlobInfo &blob = batch[j];
+            Incremental::FileRecord &f = files[blob.firstSplat >> SplatSet::FileSet::scanIdShift];
+            Incremental::Box box;
+            for (unsigned int i = 0; i < 3; i++)
+            {
+                const Grid::difference_type base = boundingGrid.getExtent(i).first;
+                box.lower[i] = base + blob.lower[i] * bucketSize;
+                box.upper[i] = base + (blob.upper[i] + 1) * bucketSize;
+            }
+            if (f.hasBox)
+                f.box += box;
+            else
+            {
+                f.box = box;
+                f.hasBox = true;
+            }
+        }
+    }
+
+    std::sort(files.begin(), files.end(), boost::bind(&Incremental::FileRecord::path, _1)
+              < boost::bind(&Incremental::FileRecord::path, _2));
+    state.files.swap(files);
+    return state;
 }
 
 void setWriterComments(const po::variables_map &vm, FastPly::Writer &writer)
@@ -693,24 +1886,189 @@ MesherBase::Namer getNamer(const po::variables_map &vm, const std::string &out)
         return TrivialNamer(out);
 }
 
-void setMesherOptions(const po::variables_map &vm, MesherBase &mesher)
+/// Insert @a suffix before a <code>.ply</code> suffix of @a out, or append it if there is none
+static std::string insertOutputSuffix(const std::string &out, const std::string &suffix)
+{
+    const std::string ext = ".ply";
+    if (out.size() >= ext.size() && out.compare(out.size() - ext.size(), ext.size(), ext) == 0)
+        return out.substr(0, out.size() - ext.size()) + suffix + ext;
+    else
+        return out + suffix;
+}
+
+std::string getLodOutputName(const std::string &out, unsigned int lod)
+{
+    if (lod == 0)
+        return out;
+    std::ostringstream suffix;
+    suffix << "_lod" << lod;
+    return insertOutputSuffix(out, suffix.str());
+}
+
+std::string getPreviewOutputName(const std::string &out)
+{
+    return insertOutputSuffix(out, "_preview");
+}
+
+void setPreviewMesherOptions(const po::variables_map &vm, MesherBase &mesher)
+{
+    mesher.setPruneThreshold(vm[Option::fitPrune].as<double>());
+    mesher.setPruneMinVertices(vm[Option::fitPruneMinVertices].as<int>());
+    mesher.setReorderCapacity(vm[Option::memReorder].as<Capacity>());
+    mesher.setReorderSlots(vm[Option::reorderSlots].as<int>());
+    mesher.setWriteThreads(vm[Option::writeThreads].as<int>());
+    mesher.setTmpWriterType(vm[Option::writer].as<Choice<WriterTypeWrapper> >());
+    mesher.setTmpWriterMaxThreads(vm[Option::tmpWriterThreads].as<int>());
+    mesher.setTmpMmap(vm.count(Option::tmpMmap));
+    mesher.setVertexFormat(vm[Option::vertexFormat].as<Choice<FastPly::VertexFormatWrapper> >());
+    mesher.setVertexNormals(vm.count(Option::vertexNormals));
+}
+
+/// Announce an output file written early by @ref Option::streamChunks
+static void logChunkWritten(const ChunkIndexEntry &entry)
+{
+    Log::log[Log::info] << "Wrote " << entry.filename << " (" << entry.triangles << " triangles)\n";
+}
+
+void setMesherOptions(const po::variables_map &vm, MesherBase &mesher, unsigned int lod)
 {
     const double pruneThreshold = vm[Option::fitPrune].as<double>();
     const std::size_t memReorder = vm[Option::memReorder].as<Capacity>();
     mesher.setPruneThreshold(pruneThreshold);
+    mesher.setPruneMinVertices(vm[Option::fitPruneMinVertices].as<int>());
     mesher.setReorderCapacity(memReorder);
+    mesher.setReorderSlots(vm[Option::reorderSlots].as<int>());
+    mesher.setWriteThreads(vm[Option::writeThreads].as<int>());
+    mesher.setTmpWriterType(vm[Option::writer].as<Choice<WriterTypeWrapper> >());
+    mesher.setTmpWriterMaxThreads(vm[Option::tmpWriterThreads].as<int>());
+    mesher.setTmpMmap(vm.count(Option::tmpMmap));
+    mesher.setTmpCompress(vm.count(Option::tmpCompress));
+    mesher.setReorderTriangles(vm.count(Option::reorderTriangles));
+    mesher.setParallelWrite(vm.count(Option::parallelWrite));
+    if (vm.count(Option::splitIndex) || vm.count(Option::splitContainer))
+    {
+        const std::string out = getLodOutputName(vm[Option::outputFile].as<std::string>(), lod);
+        mesher.setChunkIndex(out + ".index.json");
+        if (vm.count(Option::splitContainer))
+            mesher.setChunkContainer(out + ".plyc");
+    }
+    mesher.setVertexFormat(vm[Option::vertexFormat].as<Choice<FastPly::VertexFormatWrapper> >());
+    mesher.setVertexNormals(vm.count(Option::vertexNormals));
+    mesher.setStitchSeams(getAdaptiveLevel(vm) > 0);
+    if (vm.count(Option::tile) && lod == 0)
+        mesher.setTileBoundary(vm[Option::outputFile].as<std::string>() + ".boundary");
+    if (vm.count(Option::streamChunks))
+    {
+        mesher.setStreamChunks(true);
+        mesher.setStreamDirect(vm.count(Option::streamDirect));
+        mesher.setChunkCallback(logChunkWritten);
+    }
+}
+
+/**
+ * Describe the options that affect the mesh of a bucket, for
+ * @ref Option::bucketCache. The grids and splats are hashed separately.
+ */
+static std::string makeBucketCacheParams(const po::variables_map &vm)
+{
+    const NormalEstimation estimation = getNormalEstimation(vm);
+    std::ostringstream params;
+    params.imbue(std::locale::classic());
+    params << std::setprecision(9)
+        << "smooth=" << vm[Option::fitSmooth].as<double>()
+        << " max-radius=" << (vm.count(Option::maxRadius) ? vm[Option::maxRadius].as<double>() : -1.0)
+        << " boundary-limit=" << vm[Option::fitBoundaryLimit].as<double>()
+        << " shape=" << int(vm[Option::fitShape].as<Choice<MlsShapeWrapper> >())
+        << " boundary=" << int(vm[Option::fitBoundary].as<Choice<MlsBoundaryWrapper> >())
+        << " decimate=" << (vm.count(Option::decimate) ? vm[Option::decimate].as<double>() : 0.0)
+        << " merge-splats=" << vm[Option::mergeSplats].as<double>()
+        << " scatter-density=" << vm[Option::scatterDensity].as<double>()
+        << " half-distance=" << vm.count(Option::halfDistance)
+        << " packed-splats=" << vm.count(Option::packedSplats)
+        << " hash-weld=" << vm.count(Option::hashWeld)
+        << " marching-cubes=" << vm.count(Option::marchingCubes)
+        << " estimate-normals=" << estimation.neighbours;
+    if (estimation.haveViewpoint)
+        params << " viewpoint=" << estimation.viewpoint[0]
+            << ' ' << estimation.viewpoint[1] << ' ' << estimation.viewpoint[2];
+    return params.str();
+}
+
+/**
+ * Creates and configures the worker group for one device. It runs on a thread
+ * of its own, so any exception is returned in @a error rather than thrown.
+ */
+static void makeDeviceWorkerGroup(
+    const po::variables_map &vm,
+    const std::pair<cl::Context, cl::Device> &device,
+    int node,
+    const DeviceWorkerGroup::OutputGenerator &outputGenerator,
+    DeviceWorkerGroup *&out,
+    boost::exception_ptr &error)
+{
+    thread_set_name("device-init");
+    try
+    {
+        const int subsampling = vm[Option::subsampling].as<int>();
+        const int levels = vm[Option::levels].as<int>();
+        const unsigned int block = 1U << (levels + subsampling - 1);
+        const unsigned int blockCells = block - 1;
+        const std::size_t maxBucketSplats = getMaxBucketSplats(vm);
+        const float boundaryLimit = vm[Option::fitBoundaryLimit].as<double>();
+        const MlsShape shape = vm[Option::fitShape].as<Choice<MlsShapeWrapper> >();
+        const MlsBoundary boundary = vm[Option::fitBoundary].as<Choice<MlsBoundaryWrapper> >();
+
+        Numa::ScopedBind bind(node);
+        DeviceTuning tuning;
+        if (vm.count(Option::autotune))
+        {
+            tuning = DeviceWorkerGroup::autotune(
+                device.first, device.second,
+                maxBucketSplats, blockCells,
+                getMeshMemory(vm),
+                levels, subsampling,
+                boundaryLimit, shape, getSplatLayout(vm), getDistanceStorage(vm));
+        }
+        const unsigned int threads = getDeviceThreads(vm, device.second);
+        std::auto_ptr<DeviceWorkerGroup> dwg(new DeviceWorkerGroup(
+            threads, getDeviceSpare(vm, device.second, threads),
+            outputGenerator,
+            device.first, device.second,
+            maxBucketSplats, blockCells,
+            getMeshMemory(vm),
+            levels, subsampling,
+            boundaryLimit, shape, getDistanceType(vm), getSplatLayout(vm),
+            vm.count(Option::hashWeld), tuning, getNormalEstimation(vm),
+            vm.count(Option::decimate) ? vm[Option::decimate].as<double>() : 0.0,
+            vm.count(Option::sparseOctree),
+            vm[Option::deviceScratch].as<int>(), getDistanceStorage(vm), boundary));
+        dwg->setNumaNode(node);
+        dwg->setBatchTrees(vm.count(Option::batchOctree));
+        dwg->setMergeSplats(vm[Option::mergeSplats].as<double>());
+        dwg->setScatterDensity(vm[Option::scatterDensity].as<double>());
+        dwg->setAdaptiveSubsampling(vm.count(Option::adaptiveSubsampling));
+        dwg->setTiledOccupancy(vm.count(Option::tiledOccupancy));
+        dwg->setCarrySlices(vm.count(Option::carrySlices));
+        dwg->setMarchingCubes(vm.count(Option::marchingCubes));
+        dwg->setOwnedEdges(vm.count(Option::ownedEdges));
+        dwg->setChunkPriority(vm.count(Option::chunkPriority));
+        out = dwg.release();
+    }
+    catch (...)
+    {
+        error = boost::current_exception();
+    }
 }
 
 SlaveWorkers::SlaveWorkers(
     Timeplot::Worker &tworker,
     const po::variables_map &vm,
     const std::vector<std::pair<cl::Context, cl::Device> > &devices,
-    const DeviceWorkerGroup::OutputGenerator &outputGenerator)
+    const DeviceWorkerGroup::OutputGenerator &outputGenerator,
+    const DeviceWorkerGroup::HostOutputFunctor &hostOutput)
     : tworker(tworker)
 {
     const int subsampling = vm[Option::subsampling].as<int>();
-    const int levels = vm[Option::levels].as<int>();
-    const unsigned int numDeviceThreads = vm[Option::deviceThreads].as<int>();
     const float boundaryLimit = vm[Option::fitBoundaryLimit].as<double>();
     const MlsShape shape = vm[Option::fitShape].as<Choice<MlsShapeWrapper> >();
     const std::size_t deviceSpare = getDeviceWorkerGroupSpare(vm);
@@ -719,36 +2077,121 @@ SlaveWorkers::SlaveWorkers(
     const std::size_t maxLoadSplats = getMaxLoadSplats(vm);
     const std::size_t maxHostSplats = getMaxHostSplats(vm);
 
-    const unsigned int block = 1U << (levels + subsampling - 1);
-    const unsigned int blockCells = block - 1;
+    /* Unless the user chose a node, each device's threads and host buffers
+     * are placed on the node its PCIe slot is attached to. The copy group
+     * and loader feed all the devices, but stage through the first device's
+     * context, so they follow that device.
+     */
+    const bool detectNodes = vm[Option::numaNode].as<int>() < 0;
+    std::vector<int> nodes(devices.size(), -1);
+    if (detectNodes)
+        for (std::size_t i = 0; i < devices.size(); i++)
+            nodes[i] = Numa::getDeviceNode(devices[i].second);
+
+    /* Devices are set up concurrently, since autotuning and compiling the
+     * programs for one device takes a while and does not depend on the
+     * others. Workers of the same device share the programs they build.
+     */
+    CLH::ProgramSharing sharing;
+    DeviceWorkerGroup::setDirectUpload(vm.count(Option::directUpload));
+    std::vector<DeviceWorkerGroup *> deviceWorkerGroupPtrs(devices.size());
+    std::vector<boost::exception_ptr> errors(devices.size());
+    boost::thread_group threads;
+    for (std::size_t i = 0; i < devices.size(); i++)
+        threads.create_thread(boost::bind(
+                &makeDeviceWorkerGroup, boost::cref(vm), boost::cref(devices[i]), nodes[i],
+                boost::cref(outputGenerator),
+                boost::ref(deviceWorkerGroupPtrs[i]), boost::ref(errors[i])));
+    threads.join_all();
 
-    std::vector<DeviceWorkerGroup *> deviceWorkerGroupPtrs;
     for (std::size_t i = 0; i < devices.size(); i++)
+        if (errors[i])
+        {
+            for (std::size_t j = 0; j < devices.size(); j++)
+                delete deviceWorkerGroupPtrs[j];
+            boost::rethrow_exception(errors[i]);
+        }
+    for (std::size_t i = 0; i < devices.size(); i++)
+        deviceWorkerGroups.push_back(deviceWorkerGroupPtrs[i]);
+
+    Numa::ScopedBind bind(nodes[0]);
+    copyGroup.reset(new CopyGroup(deviceWorkerGroupPtrs, maxHostSplats,
+                                  vm[Option::copyBuffers].as<int>()));
+    copyGroup->setChunkPriority(vm.count(Option::chunkPriority));
+    copyGroup->setAdaptivePacking(vm.count(Option::adaptivePacking));
+    const int numHostThreads = vm[Option::hostThreads].as<int>();
+    if (numHostThreads > 0)
     {
-        DeviceWorkerGroup *dwg = new DeviceWorkerGroup(
-            numDeviceThreads, deviceSpare,
-            outputGenerator,
-            devices[i].first, devices[i].second,
-            maxBucketSplats, blockCells,
-            getMeshMemory(vm),
-            levels, subsampling,
-            boundaryLimit, shape);
-        deviceWorkerGroups.push_back(dwg);
-        deviceWorkerGroupPtrs.push_back(dwg);
+        MLSGPU_ASSERT(hostOutput, std::invalid_argument);
+        hostWorkerGroup.reset(new HostWorkerGroup(
+                numHostThreads, deviceSpare, hostOutput,
+                maxBucketSplats, subsampling, boundaryLimit, shape, getSplatLayout(vm),
+                vm[Option::fitBoundary].as<Choice<MlsBoundaryWrapper> >()));
+        hostWorkerGroup->setMarchingCubes(vm.count(Option::marchingCubes));
+        copyGroup->setHostGroup(hostWorkerGroup.get());
+    }
+    if (vm.count(Option::bucketCache))
+    {
+        MLSGPU_ASSERT(hostOutput, std::invalid_argument);
+        bucketCache.reset(new BucketCache(vm[Option::bucketCache].as<std::string>(),
+                                          makeBucketCacheParams(vm)));
+        copyGroup->setBucketCache(bucketCache.get());
+        for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
+            deviceWorkerGroups[i].setBucketCache(bucketCache.get(), hostOutput);
+        if (hostWorkerGroup)
+            hostWorkerGroup->setBucketCache(bucketCache.get());
     }
-    copyGroup.reset(new CopyGroup(deviceWorkerGroupPtrs, maxHostSplats));
+    copyGroup->setNumaNode(nodes[0]);
     loader.reset(new BucketLoader(maxLoadSplats, *copyGroup, tworker));
+    loader->setAdaptive(getAdaptiveLevel(vm), vm[Option::adaptiveRadius].as<double>());
+    loader->setSortSplats(vm.count(Option::sortSplats));
+    loader->setCoalesceGap(vm[Option::readGap].as<Capacity>());
+    loader->setLodLevels(vm[Option::lodLevels].as<int>());
+    unsigned int totalDeviceThreads = 0;
+    for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
+        totalDeviceThreads += deviceWorkerGroups[i].numWorkers();
+    loader->setSplit(vm[Option::splitSplats].as<int>(), totalDeviceThreads);
+}
+
+void SlaveWorkers::setLodOutputs(const std::vector<DeviceWorkerGroup::OutputGenerator> &lodOutputs)
+{
+    for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
+        deviceWorkerGroups[i].setLodOutputs(lodOutputs);
+}
+
+void SlaveWorkers::setChunkTracker(ChunkTracker *chunkTracker)
+{
+    loader->setChunkTracker(chunkTracker);
+    for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
+        deviceWorkerGroups[i].setChunkTracker(chunkTracker);
+    if (hostWorkerGroup)
+        hostWorkerGroup->setChunkTracker(chunkTracker);
+}
+
+void SlaveWorkers::setMemoryGovernor(MemoryGovernor *governor)
+{
+    loader->setMemoryGovernor(governor);
+    for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
+        deviceWorkerGroups[i].setMemoryGovernor(governor);
+    if (hostWorkerGroup)
+        hostWorkerGroup->setMemoryGovernor(governor);
 }
 
 void SlaveWorkers::start(SplatSet::FileSet &splats, const Grid &grid, ProgressMeter *progress)
 {
     for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
         deviceWorkerGroups[i].setProgress(progress);
+    if (hostWorkerGroup)
+        hostWorkerGroup->setProgress(progress);
+    if (bucketCache)
+        bucketCache->setFullGrid(grid);
 
     loader->start(splats, grid);
     copyGroup->start();
     for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
         deviceWorkerGroups[i].start(grid);
+    if (hostWorkerGroup)
+        hostWorkerGroup->start(grid);
 }
 
 void SlaveWorkers::stop()
@@ -756,4 +2199,6 @@ void SlaveWorkers::stop()
     copyGroup->stop();
     for (std::size_t i = 0; i < deviceWorkerGroups.size(); i++)
         deviceWorkerGroups[i].stop();
+    if (hostWorkerGroup)
+        hostWorkerGroup->stop();
 }
@@ -34,10 +34,13 @@
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/function.hpp>
+#include <boost/filesystem/path.hpp>
 #include <ostream>
+#include <string>
 #include <exception>
 #include <vector>
 #include <utility>
+#include "tr1_cstdint.h"
 #include "splat_set.h"
 #include "workers.h"
 #include "bucket.h"
@@ -46,6 +49,9 @@
 #include "grid.h"
 #include "progress.h"
 #include "timeplot.h"
+#include "incremental.h"
+#include "bucket_cache.h"
+#include "chunk_tracker.h"
 #include <CL/cl.hpp>
 
 namespace CLH
@@ -58,6 +64,7 @@ namespace Option
     const char * const help = "help";
     const char * const quiet = "quiet";
     const char * const debug = "debug";
+    const char * const logAsync = "log-async";
     const char * const responseFile = "response-file";
     const char * const tmpDir = "tmp-dir";
 
@@ -65,37 +72,141 @@ namespace Option
     const char * const maxRadius = "max-radius";
     const char * const fitGrid = "fit-grid";
     const char * const fitPrune = "fit-prune";
+    const char * const fitPruneMinVertices = "fit-prune-min-vertices";
     const char * const fitBoundaryLimit = "fit-boundary-limit";
     const char * const fitShape = "fit-shape";
+    const char * const fitBoundary = "fit-boundary";
+    const char * const region = "region";
+    const char * const tile = "tile";
+    const char * const estimateNormals = "estimate-normals";
+    const char * const pointRadius = "point-radius";
+    const char * const scannerPosition = "scanner-position";
+    const char * const adaptiveGrid = "adaptive-grid";
+    const char * const adaptiveRadius = "adaptive-radius";
+    const char * const lodLevels = "lod-levels";
+    const char * const preview = "preview";
 
     const char * const inputFile = "input-file";
     const char * const outputFile = "output-file";
+    const char * const serve = "serve";
+    const char * const batch = "batch";
+    const char * const planOnly = "plan-only";
+    const char * const autotuneHost = "autotune-host";
     const char * const split = "split";
     const char * const splitSize = "split-size";
+    const char * const splitIndex = "split-index";
+    const char * const splitContainer = "split-container";
+    const char * const streamChunks = "stream-chunks";
+    const char * const streamDirect = "stream-direct";
+    const char * const vertexFormat = "vertex-format";
+    const char * const vertexNormals = "vertex-normals";
+    const char * const decimate = "decimate";
+    const char * const incremental = "incremental";
 
     const char * const statistics = "statistics";
     const char * const statisticsFile = "statistics-file";
     const char * const statisticsCL = "statistics-cl";
+    const char * const statisticsCLSample = "statistics-cl-sample";
     const char * const timeplot = "timeplot";
+    const char * const timeplotBinary = "timeplot-binary";
+    const char * const timeplotChrome = "timeplot-chrome";
+    const char * const bucketTrace = "bucket-trace";
+    const char * const metricsFile = "metrics-file";
+    const char * const metricsInterval = "metrics-interval";
 
     const char * const maxSplit = "max-split";
     const char * const levels = "levels";
     const char * const subsampling = "subsampling";
     const char * const leafCells = "leaf-cells";
+    const char * const bucketCost = "bucket-cost";
+    const char * const bucketCellWeight = "bucket-cell-weight";
+    const char * const bucketThreads = "bucket-threads";
+    const char * const bucketDevice = "bucket-device";
+    const char * const blobsDevice = "blobs-device";
+    const char * const thinDense = "thin-dense";
+    const char * const longestFirst = "longest-first";
+    const char * const chunkPriority = "chunk-priority";
+    const char * const planSplatTime = "plan-splat-time";
+    const char * const planCellTime = "plan-cell-time";
+    const char * const autotuneHostBins = "autotune-host-bins";
+    const char * const autotuneHostRounds = "autotune-host-rounds";
     const char * const deviceThreads = "device-threads";
+    const char * const deviceScratch = "device-scratch";
+    const char * const hostThreads = "host-threads";
     const char * const reader = "reader";
+    const char * const readerThreads = "reader-threads";
+    const char * const headerThreads = "header-threads";
+    const char * const openFiles = "open-files";
     const char * const writer = "writer";
     const char * const ompThreads = "omp-threads";
+    const char * const cpuThreads = "cpu-threads";
     const char * const decache = "decache";
+    const char * const readAhead = "read-ahead";
+    const char * const readGap = "read-gap";
+    const char * const stageDir = "stage-dir";
+    const char * const stageSize = "stage-size";
+    const char * const ingest = "ingest";
+    const char * const blobCache = "blob-cache";
+    const char * const bucketCache = "bucket-cache";
+    const char * const savePlan = "save-plan";
+    const char * const loadPlan = "load-plan";
     const char * const checkpoint = "checkpoint";
     const char * const resume = "resume";
+    const char * const snapshot = "snapshot";
+    const char * const snapshotInterval = "snapshot-interval";
+    const char * const autotune = "autotune";
+    const char * const halfDistance = "half-distance";
+    const char * const distanceStorage = "distance-storage";
+    const char * const packedSplats = "packed-splats";
+    const char * const copyBuffers = "copy-buffers";
+    const char * const adaptivePacking = "adaptive-packing";
+    const char * const hashWeld = "hash-weld";
+    const char * const batchOctree = "batch-octree";
+    const char * const mergeSplats = "merge-splats";
+    const char * const scatterDensity = "scatter-density";
+    const char * const adaptiveSubsampling = "adaptive-subsampling";
+    const char * const sparseOctree = "sparse-octree";
+    const char * const sortSplats = "sort-splats";
+    const char * const splitSplats = "split-splats";
+    const char * const tiledOccupancy = "tiled-occupancy";
+    const char * const carrySlices = "carry-slices";
+    const char * const marchingCubes = "marching-cubes";
+    const char * const ownedEdges = "owned-edges";
+    const char * const writeThreads = "write-threads";
+    const char * const tmpWriterThreads = "tmp-writer-threads";
+    const char * const tmpMmap = "tmp-mmap";
+    const char * const tmpCompress = "tmp-compress";
+    const char * const directUpload = "direct-upload";
+    const char * const pinnedMesh = "pinned-mesh";
+    const char * const reorderTriangles = "reorder-triangles";
+    const char * const parallelWrite = "parallel-write";
+    const char * const mesherThreads = "mesher-threads";
+    const char * const scatterCredits = "scatter-credits";
+    const char * const distributedMesher = "distributed-mesher";
+    const char * const scatterLocality = "scatter-locality";
+    const char * const stripeInputs = "stripe-inputs";
+    const char * const hierarchical = "hierarchical";
+    const char * const pinnedGather = "pinned-gather";
+    const char * const progressRMA = "progress-rma";
+    const char * const mpiioAggregators = "mpiio-aggregators";
+    const char * const mpiioBuffer = "mpiio-buffer";
+    const char * const stripeCount = "stripe-count";
+    const char * const stripeSize = "stripe-size";
+    const char * const leaveFile = "leave-file";
 
+    const char * const memAuto = "mem-auto";
     const char * const memLoadSplats = "mem-load-splats";
+    const char * const loadQueue = "load-queue";
     const char * const memHostSplats = "mem-host-splats";
     const char * const memBucketSplats = "mem-bucket-splats";
     const char * const memMesh = "mem-mesh";
     const char * const memReorder = "mem-reorder";
+    const char * const reorderSlots = "reorder-slots";
+    const char * const memBlobs = "mem-blobs";
+    const char * const hugePages = "huge-pages";
+    const char * const numaNode = "numa-node";
     const char * const memGather = "mem-gather";
+    const char * const memLimit = "mem-limit";
 };
 
 /**
@@ -104,9 +215,22 @@ namespace Option
 void usage(std::ostream &o, const boost::program_options::options_description desc);
 
 /**
- * Process the argv array to produce command-line options.
+ * Parse command-line arguments (not including the program name) into
+ * options, in the same way as @ref processOptions but without printing
+ * usage information or exiting. The input and output files are not required
+ * if @ref Option::help, @ref Option::serve or @ref Option::batch is given.
+ *
+ * @throw boost::program_options::error if the arguments are invalid.
  */
-boost::program_options::variables_map processOptions(int argc, char **argv, bool isMPI);
+boost::program_options::variables_map parseOptions(
+    const std::vector<std::string> &args, bool isMPI, bool needInputs = true);
+
+/**
+ * Process the argv array to produce command-line options. If @a needInputs
+ * is false, it is not an error for no input files to be given, which is
+ * useful for programs that supply an @ref InputSource.
+ */
+boost::program_options::variables_map processOptions(int argc, char **argv, bool isMPI, bool needInputs = true);
 
 /**
  * Write the statistics to the statistics output.
@@ -126,36 +250,158 @@ void writeStatistics(const boost::program_options::variables_map &vm, bool force
 void validateOptions(const boost::program_options::variables_map &vm, bool isMPI);
 
 /**
- * Set the logging level based on the command-line options.
+ * Determine the format for @ref Timeplot::init from the command-line options.
+ */
+Timeplot::Format getTimeplotFormat(const boost::program_options::variables_map &vm);
+
+/**
+ * Set the logging level based on the command-line options, and start
+ * asynchronous logging if requested (see @ref Log::startAsync). It must be
+ * called at most once.
  */
 void setLogLevel(const boost::program_options::variables_map &vm);
 
+/**
+ * Set the huge page and NUMA policy for large buffers based on the
+ * command-line options. This must be called before any such buffers are
+ * allocated.
+ */
+void setMemoryPolicy(const boost::program_options::variables_map &vm);
+
 /**
  * Maximum number of splats to load as a batch.
  */
 std::size_t getMaxLoadSplats(const boost::program_options::variables_map &vm);
 
+/**
+ * Number of CPU-bound work items to process at once, from @ref
+ * Option::cpuThreads or else the hardware concurrency. It sizes the @ref
+ * CpuBudget shared by the mesher groups and the default number of OpenMP
+ * threads.
+ */
+unsigned int getCpuThreads(const boost::program_options::variables_map &vm);
+
 /**
  * Estimate the per-device resource usage based on command-line options.
+ *
+ * @param vm             Command-line options.
+ * @param device         If given, the device-dependent choices (such as the
+ *                       distance storage) are made for this device, otherwise
+ *                       conservatively.
+ * @param deviceThreads  If positive, overrides @ref Option::deviceThreads.
+ * @param deviceSpare    If positive, overrides the number of spare work items
+ *                       per device (see @ref getDeviceSpare).
+ */
+CLH::ResourceUsage resourceUsage(const boost::program_options::variables_map &vm,
+                                 const cl::Device &device = cl::Device(),
+                                 int deviceThreads = 0,
+                                 int deviceSpare = 0);
+
+/**
+ * Number of worker threads to run on @a device. This is the value of
+ * @ref Option::deviceThreads, reduced as far as necessary (but not below
+ * one) for the buffers to fit in 80% of the device's memory. This allows
+ * devices of different sizes, possibly from different vendors, to be used
+ * in one run with the same bucket size.
+ */
+unsigned int getDeviceThreads(const boost::program_options::variables_map &vm, const cl::Device &device);
+
+/**
+ * Number of spare work items (beyond one per thread) to allocate on @a
+ * device, when it runs @a deviceThreads threads. Normally this is one. With
+ * @ref Option::adaptivePacking it is increased, up to one per thread plus
+ * one, as long as the buffers still fit in 80% of the device's memory, so
+ * that devices with memory to spare queue more work.
  */
-CLH::ResourceUsage resourceUsage(const boost::program_options::variables_map &vm);
+unsigned int getDeviceSpare(const boost::program_options::variables_map &vm,
+                            const cl::Device &device, unsigned int deviceThreads);
+
+/**
+ * Memory available to a process, as used by @ref planMemory.
+ */
+struct MemoryLimits
+{
+    std::tr1::uint64_t hostMemory;      ///< Physical host memory available to this process
+    std::tr1::uint64_t deviceMemory;    ///< Smallest @c CL_DEVICE_GLOBAL_MEM_SIZE of the devices
+    std::tr1::uint64_t deviceMaxAlloc;  ///< Smallest @c CL_DEVICE_MAX_MEM_ALLOC_SIZE of the devices
+};
+
+/**
+ * Determine the memory limits for this process. The physical memory of the
+ * host is shared equally between @a processesPerHost processes. If there are
+ * no devices, the device limits are the largest representable value so that
+ * they can be combined with other processes by taking the minimum.
+ */
+MemoryLimits getMemoryLimits(const std::vector<cl::Device> &devices, unsigned int processesPerHost = 1);
+
+/**
+ * If <code>--mem-auto</code> was given, choose values for the memory options
+ * that were not set explicitly. The bucket size is made as large as the
+ * devices allow (see @ref resourceUsage) while the host-side buffers scaled
+ * from it, the mesh buffers and a minimum reorder capacity fit in three
+ * quarters of @a limits.hostMemory. The rest of that memory goes to
+ * <code>--mem-reorder</code>.
+ *
+ * @param vm       Options, which are updated in place.
+ * @param limits   Memory that may be used, which must be the same on all
+ *                 processes of an MPI job.
+ * @param isMPI    Whether the MPI-only options are present.
+ * @param log      If non-NULL, a summary of the chosen values is written here.
+ * @throw invalid_option if there is not enough memory for even the smallest plan.
+ */
+void planMemory(boost::program_options::variables_map &vm, const MemoryLimits &limits,
+                bool isMPI, std::ostream *log = NULL);
 
 /**
  * Check that a CL device can safely be used.
  *
+ * @param vm          Command-line options.
  * @param device      Device to check.
  * @param totalUsage  Resource usage for the device, as returned by @ref resourceUsage.
  * @throw CLH::invalid_device if the device is unusable.
  */
-void validateDevice(const cl::Device &device, const CLH::ResourceUsage &totalUsage);
+void validateDevice(const boost::program_options::variables_map &vm,
+                    const cl::Device &device, const CLH::ResourceUsage &totalUsage);
+
+/**
+ * Callback that puts inputs into a @ref SplatSet::FileSet in place of the
+ * files named by @ref Option::inputFile, for programs that supply the splats
+ * themselves (see @ref SplatArrayReaderFactory). The arguments after the
+ * file set are the smoothing factor, maximum radius and point radius to pass
+ * to each @ref FastPly::Reader.
+ */
+typedef boost::function<void(SplatSet::FileSet &, float, float, float)> InputSource;
 
 /**
- * Put the input files named in @a vm into @a files.
+ * Put the input files named in @a vm into @a files, or the inputs supplied
+ * by @a source if it is not empty.
  *
  * @throw boost::exception   if there was a problem reading the files.
  * @throw std::runtime_error if there are too many files or splats.
  */
-void prepareInputs(SplatSet::FileSet &files, const boost::program_options::variables_map &vm, float smooth, float maxRadius);
+void prepareInputs(SplatSet::FileSet &files, const boost::program_options::variables_map &vm, float smooth, float maxRadius,
+                   const InputSource &source = InputSource());
+
+/**
+ * Read the single input named in @a vm as a stream, for @ref Option::ingest.
+ * The input may be a pipe or @c - for standard input, since it is read only
+ * once. As the vertices arrive they are spooled to the file named by @ref
+ * Option::ingest in the splat cache format (see @ref FastPly::SplatCacheWriter)
+ * and passed to @ref SplatSet::FastBlobSet::ingest, so that the blobs and
+ * bounding box are ready as soon as the input ends. The spooled file then
+ * becomes the only file in @a splats. This replaces @ref doComputeBlobs.
+ *
+ * @param tworker          Worker to attribute time for bounding box calculation
+ * @param vm               Command-line options
+ * @param[out] splats      The input files (must be initially empty)
+ *
+ * @throw boost::exception   if there was a problem reading the input or writing the spool.
+ * @throw std::runtime_error if there are too many splats, or none with finite values.
+ */
+void ingestInputs(
+    Timeplot::Worker &tworker,
+    const boost::program_options::variables_map &vm,
+    SplatSet::FastBlobSet<SplatSet::FileSet> &splats);
 
 /**
  * Dump an error to stderr.
@@ -169,6 +415,14 @@ void reportException(std::exception &e);
  * @param vm               Command-line options
  * @param[out] splats      The input files (must be initially empty)
  * @param computeBlobs     Callback to do the low-level computation
+ * @param loadBlobs        Callback to restore the result of @a computeBlobs from
+ *                         a cache (see @ref SplatSet::FastBlobSet::loadBlobs).
+ *                         If empty, @ref Option::blobCache is not supported.
+ * @param saveBlobs        Callback to save the result of @a computeBlobs to a cache
+ *                         (see @ref SplatSet::FastBlobSet::saveBlobs).
+ * @param source           Inputs to use in place of the input files, or empty
+ *                         (see @ref prepareInputs). @ref Option::blobCache is
+ *                         ignored when this is given.
  *
  * @throw boost::exception   if there was a problem reading the files.
  * @throw std::runtime_error if there are too many or too few files or splats.
@@ -177,18 +431,52 @@ void doComputeBlobs(
     Timeplot::Worker &tworker,
     const boost::program_options::variables_map &vm,
     SplatSet::FileSet &splats,
-    boost::function<void(float, unsigned int)> computeBlobs);
+    boost::function<void(float, unsigned int)> computeBlobs,
+    boost::function<bool(const boost::filesystem::path &, const std::string &)> loadBlobs
+        = boost::function<bool(const boost::filesystem::path &, const std::string &)>(),
+    boost::function<void(const boost::filesystem::path &, const std::string &)> saveBlobs
+        = boost::function<void(const boost::filesystem::path &, const std::string &)>(),
+    const InputSource &source = InputSource());
+
+/**
+ * Restrict the bounding grid to @ref Option::region, if given. The result has
+ * the same reference point and spacing, so vertices on its boundary coincide
+ * with those of a run over the whole grid. Splats outside the region that
+ * influence it are still used, since bucketing selects them by their
+ * bounding boxes. With @ref Option::tile, the high extents are rounded in
+ * the same way (except at the edge of @a grid), so that tiles whose regions
+ * share a face also share a plane of the grid.
+ *
+ * @param vm               Command-line options
+ * @param grid             Bounding box grid from @ref doComputeBlobs
+ * @param align            The low extents are rounded down to a multiple of
+ *                         this (see @ref SplatSet::FastBlobSet::getBucketSize).
+ * @return The cropped grid, or @a grid if there is no region
+ * @throw std::runtime_error if the region does not intersect the grid
+ */
+Grid cropGrid(
+    const boost::program_options::variables_map &vm,
+    const Grid &grid,
+    Grid::size_type align);
 
 /**
  * Validate the grid size and compute the chunk size.
+ *
+ * A grid larger than @ref Marching::MAX_GLOBAL_DIMENSION along an axis is
+ * only accepted if @a wideKeys is true and the output is split into chunks
+ * of at most half that size, so that @ref OOCMesher can tell apart vertex
+ * keys that wrap around.
+ *
  * @param vm               Command-line options
  * @param grid             Bounding box grid
+ * @param wideKeys         Whether the mesher supports grids with wrapped keys
  * @return Chunk size for output, in cells
  * @throw std::runtime_error if the grid is too large
  */
 unsigned int postprocessGrid(
     const boost::program_options::variables_map &vm,
-    const Grid &grid);
+    const Grid &grid,
+    bool wideKeys = true);
 
 /**
  * An all-in-one helper to call @ref Bucket::bucket with appropriate parameters.
@@ -199,6 +487,11 @@ unsigned int postprocessGrid(
  * @param grid             Bounding box grid from @ref doComputeBlobs
  * @param chunkCells       Chunk side length from @ref postprocessGrid
  * @param collector        Bucket processor passed to @ref Bucket::bucket
+ * @param counter          Counter passed to @ref Bucket::bucket, or @c NULL
+ *
+ * If @ref Option::loadPlan names a plan saved with the same inputs and
+ * bucketing options, the buckets are read from it instead of being
+ * computed. Otherwise, they are saved to @ref Option::savePlan if given.
  */
 void doBucket(
     Timeplot::Worker &tworker,
@@ -206,7 +499,25 @@ void doBucket(
     const SplatSet::FastBlobSet<SplatSet::FileSet> &splats,
     const Grid &grid,
     Grid::size_type chunkCells,
-    BucketCollector &collector);
+    BucketCollector &collector,
+    Bucket::DeviceCounter *counter = NULL);
+
+/**
+ * Describe the current run for @ref Option::incremental. The key covers the
+ * options that affect the geometry, the grid and the chunk size, and each
+ * input file is recorded with the region touched by its splats. The chunk
+ * regions are left empty.
+ *
+ * @param vm               Command-line options
+ * @param splats           Splats after @ref doComputeBlobs
+ * @param grid             Grid passed to @ref doBucket
+ * @param chunkCells       Chunk side length from @ref postprocessGrid
+ */
+Incremental::State makeIncrementalState(
+    const boost::program_options::variables_map &vm,
+    const SplatSet::FastBlobSet<SplatSet::FileSet> &splats,
+    const Grid &grid,
+    unsigned int chunkCells);
 
 /**
  * Set comments on the writer showing provenance of the file.
@@ -215,8 +526,34 @@ void setWriterComments(const boost::program_options::variables_map &vm, FastPly:
 
 /**
  * Set mesher options based on command-line options.
+ *
+ * @param vm      Command-line options.
+ * @param mesher  Mesher to configure.
+ * @param lod     Level of detail the mesher writes (see @ref Option::lodLevels),
+ *                which selects the names of the split index and container.
+ */
+void setMesherOptions(const boost::program_options::variables_map &vm, MesherBase &mesher, unsigned int lod = 0);
+
+/**
+ * Set the options of the mesher for the preview (see @ref Option::preview).
+ * These are the options of @ref setMesherOptions that only affect how the
+ * mesh is built, so the preview has no index, container, tile boundary or
+ * streaming of its own.
  */
-void setMesherOptions(const boost::program_options::variables_map &vm, MesherBase &mesher);
+void setPreviewMesherOptions(const boost::program_options::variables_map &vm, MesherBase &mesher);
+
+/**
+ * Name of the output for a level of detail (see @ref Option::lodLevels).
+ * Level 0 is @a out itself; otherwise <code>_lod</code><i>L</i> is inserted
+ * before a <code>.ply</code> suffix, or appended if there is none.
+ */
+std::string getLodOutputName(const std::string &out, unsigned int lod);
+
+/**
+ * Name of the output for the preview (see @ref Option::preview), formed
+ * like @ref getLodOutputName with <code>_preview</code>.
+ */
+std::string getPreviewOutputName(const std::string &out);
 
 /**
  * Generate a file name from command-line options.
@@ -232,14 +569,51 @@ class SlaveWorkers
 public:
     Timeplot::Worker &tworker;
     boost::ptr_vector<DeviceWorkerGroup> deviceWorkerGroups;
+    /// Workers fitting buckets on the CPU (see @ref Option::hostThreads), or @c NULL
+    boost::scoped_ptr<HostWorkerGroup> hostWorkerGroup;
     boost::scoped_ptr<CopyGroup> copyGroup;
     boost::scoped_ptr<BucketLoader> loader;
+    /// Cache of bucket meshes (see @ref Option::bucketCache), or @c NULL
+    boost::scoped_ptr<BucketCache> bucketCache;
 
+    /**
+     * Constructor.
+     *
+     * @param tworker          Timeplot worker for the calling thread.
+     * @param vm               Command-line options.
+     * @param devices          Devices to run on.
+     * @param outputGenerator  Output for the device workers.
+     * @param hostOutput       Output for meshes found in the bucket cache or
+     *                         computed on the CPU. It must be given if
+     *                         @ref Option::bucketCache or @ref Option::hostThreads is set.
+     */
     SlaveWorkers(
         Timeplot::Worker &tworker,
         const boost::program_options::variables_map &vm,
         const std::vector<std::pair<cl::Context, cl::Device> > &devices,
-        const DeviceWorkerGroup::OutputGenerator &outputGenerator);
+        const DeviceWorkerGroup::OutputGenerator &outputGenerator,
+        const DeviceWorkerGroup::HostOutputFunctor &hostOutput = DeviceWorkerGroup::HostOutputFunctor());
+
+    /**
+     * Set the outputs for the coarser levels of detail (see @ref Option::lodLevels).
+     * Element <i>L</i>-1 receives level <i>L</i>. This must be called before
+     * @ref start if any levels were requested.
+     */
+    void setLodOutputs(const std::vector<DeviceWorkerGroup::OutputGenerator> &lodOutputs);
+
+    /**
+     * Set a tracker to be told about the work for each chunk (see
+     * @ref ChunkTracker). The mesher groups fed by the outputs must be given
+     * the same tracker. It may be @c NULL.
+     */
+    void setChunkTracker(ChunkTracker *chunkTracker);
+
+    /**
+     * Set a governor for the loader and the workers to wait on (see
+     * @ref MemoryGovernor). The mesher groups fed by the outputs must be
+     * given the same governor. It may be @c NULL.
+     */
+    void setMemoryGovernor(MemoryGovernor *governor);
 
     void start(SplatSet::FileSet &splats, const Grid &grid, ProgressMeter *progress);
 
@@ -0,0 +1,125 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Estimation of normals and radii for point clouds that lack them.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <CL/cl.hpp>
+#include <stdexcept>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+#include "errors.h"
+#include "normal_estimator.h"
+#include "clh.h"
+#include "misc.h"
+#include "statistics.h"
+
+NormalEstimation::NormalEstimation()
+    : neighbours(0), smooth(1.0f), haveViewpoint(false)
+{
+    viewpoint[0] = viewpoint[1] = viewpoint[2] = 0.0f;
+}
+
+const unsigned int NormalEstimator::minNeighbours = 3;
+const unsigned int NormalEstimator::maxNeighbours = 32;
+
+NormalEstimator::NormalEstimator(
+    const cl::Context &context, const NormalEstimation &params, SplatLayout layout)
+    : kernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.normals.estimateNormals.time")),
+    neighbours(params.neighbours)
+{
+    MLSGPU_ASSERT(params.neighbours >= minNeighbours && params.neighbours <= maxNeighbours,
+                  std::invalid_argument);
+
+    std::map<std::string, std::string> defines;
+    defines["NEIGHBOURS"] = boost::lexical_cast<std::string>(params.neighbours);
+    defines["PACKED_SPLATS"] = layout == SPLAT_LAYOUT_PACKED ? "1" : "0";
+
+    cl::Program program = CLH::build(context, "kernels/normals.cl", defines);
+    kernel = cl::Kernel(program, "estimateNormals");
+    kernel.setArg(7, params.smooth);
+
+    const float origin[3] = {0.0f, 0.0f, 0.0f};
+    setView(origin, false, 1.0f);
+}
+
+void NormalEstimator::setView(const float viewpoint[3], bool towards, float spacing)
+{
+    cl_float4 view = {{ viewpoint[0], viewpoint[1], viewpoint[2], towards ? 1.0f : -1.0f }};
+    kernel.setArg(6, view);
+    kernel.setArg(8, spacing);
+}
+
+void NormalEstimator::enqueue(
+    const cl::CommandQueue &queue,
+    const SplatTreeCL &tree,
+    std::size_t firstSplat, std::size_t numSplats,
+    const Grid::size_type size[3], const Grid::difference_type offset[3],
+    unsigned int subsamplingShift,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    MLSGPU_ASSERT(!tree.isSparse(), std::invalid_argument);
+    if (numSplats == 0)
+    {
+        if (event != NULL)
+            CLH::enqueueMarkerWithWaitList(queue, events, event);
+        return;
+    }
+
+    cl_int3 offset3 = {{ cl_int(offset[0]), cl_int(offset[1]), cl_int(offset[2]) }};
+    /* Cells beyond the finest level of the octree are clamped to the edge,
+     * so that splats lying just outside the region still find a list.
+     */
+    cl_int3 maxCell;
+    for (int i = 0; i < 3; i++)
+        maxCell.s[i] = cl_int(size[i]) - 1;
+    maxCell.s[3] = 0;
+
+    kernel.setArg(0, tree.getSplats());
+    kernel.setArg(1, tree.getCommands());
+    kernel.setArg(2, tree.getStart());
+    kernel.setArg(3, cl_uint(3 * subsamplingShift));
+    kernel.setArg(4, offset3);
+    kernel.setArg(5, maxCell);
+    kernel.setArg(9, cl_uint(firstSplat));
+    kernel.setArg(10, cl_uint(numSplats));
+
+    const std::size_t wgs = 64;
+    CLH::enqueueNDRangeKernel(queue,
+                              kernel,
+                              cl::NullRange,
+                              cl::NDRange(roundUp(numSplats, wgs)),
+                              cl::NDRange(wgs),
+                              events, event, &kernelTime);
+}
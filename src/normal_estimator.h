@@ -0,0 +1,132 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Estimation of normals and radii for point clouds that lack them.
+ */
+
+#ifndef NORMAL_ESTIMATOR_H
+#define NORMAL_ESTIMATOR_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include "grid.h"
+#include "splat_tree_cl.h"
+#include "statistics.h"
+
+/**
+ * Parameters for @ref NormalEstimator.
+ */
+struct NormalEstimation
+{
+    /// Number of nearest neighbours to fit, or 0 to disable estimation
+    unsigned int neighbours;
+    /// Ratio of the estimated radius to the distance to the furthest neighbour
+    float smooth;
+    /// Whether @ref viewpoint is valid
+    bool haveViewpoint;
+    /// Position of the scanner in world coordinates, towards which normals face
+    float viewpoint[3];
+
+    NormalEstimation();
+};
+
+/**
+ * Fills in the normals and radii of splats that were read without normals,
+ * using the octree of the bucket that contains them. Splats are identified
+ * by having a zero normal, and their radius on input is used as the search
+ * radius for neighbours.
+ *
+ * Only splats within the same bucket are visible, so splats close to the
+ * edge of a bucket are estimated from a one-sided neighbourhood.
+ *
+ * Like @ref MlsFunctor, this object is not thread-safe, since the kernel
+ * arguments are stored in the object.
+ */
+class NormalEstimator
+{
+private:
+    cl::Kernel kernel;
+
+    /// Measures device time spent in @ref kernel
+    Statistics::Variable &kernelTime;
+
+    /// Number of nearest neighbours the kernel was compiled for
+    unsigned int neighbours;
+
+public:
+    /// Smallest number of neighbours that defines a plane with the splat itself
+    static const unsigned int minNeighbours;
+    /// Largest number of neighbours supported
+    static const unsigned int maxNeighbours;
+
+    /**
+     * Constructor. It compiles the kernel, so it can throw a compilation error.
+     *
+     * @param context    The context in which the kernel operates.
+     * @param params     Estimation parameters.
+     * @param layout     Layout of the splats in the octrees passed to @ref enqueue.
+     *
+     * @pre @ref minNeighbours <= @a params.neighbours <= @ref maxNeighbours.
+     */
+    NormalEstimator(const cl::Context &context, const NormalEstimation &params,
+                    SplatLayout layout = SPLAT_LAYOUT_FULL);
+
+    /**
+     * Set the orientation and scale. This must be called before @ref enqueue.
+     *
+     * @param viewpoint   Position, in global grid coordinates, for normals to face.
+     * @param towards     If true, normals face towards @a viewpoint, otherwise away from it.
+     * @param spacing     Grid spacing, used to convert radii to world units for the quality.
+     */
+    void setView(const float viewpoint[3], bool towards, float spacing);
+
+    /**
+     * Estimate normals and radii for splats in @a tree. On completion, the
+     * splats once again hold their radii (rather than the inverse-squared
+     * radii written by the octree build), so the octree must be rebuilt
+     * before it is used for fitting.
+     *
+     * @param queue       Command queue for the kernel.
+     * @param tree        Octree built over the splats.
+     * @param firstSplat, numSplats, size, offset, subsamplingShift
+     *                    The parameters passed to @ref SplatTreeCL::enqueueBuild.
+     * @param events      Events to wait for (or @c NULL).
+     * @param[out] event  Event that fires on completion (or @c NULL).
+     *
+     * @pre The layout of @a tree matches the constructor argument.
+     */
+    void enqueue(const cl::CommandQueue &queue,
+                 const SplatTreeCL &tree,
+                 std::size_t firstSplat, std::size_t numSplats,
+                 const Grid::size_type size[3], const Grid::difference_type offset[3],
+                 unsigned int subsamplingShift,
+                 const std::vector<cl::Event> *events,
+                 cl::Event *event);
+};
+
+#endif /* !NORMAL_ESTIMATOR_H */
@@ -0,0 +1,146 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Placement of threads and memory on a NUMA node. The lookup of the node
+ * for an OpenCL device is in numa_cl.cpp.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#if HAVE_PTHREAD_SETAFFINITY_NP && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1
+#endif
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include "numa.h"
+#include "large_pages.h"
+#include "logging.h"
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+namespace Numa
+{
+
+namespace
+{
+
+/// Path to the sysfs directory for @a node
+std::string nodePath(int node)
+{
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << node;
+    return path.str();
+}
+
+#if HAVE_PTHREAD_SETAFFINITY_NP
+
+/**
+ * Parse a sysfs CPU list such as <code>0-7,16-23</code> into @a cpus.
+ *
+ * @return Whether any CPUs were found.
+ */
+bool parseCpuList(const std::string &list, cpu_set_t &cpus)
+{
+    CPU_ZERO(&cpus);
+    bool any = false;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ','))
+    {
+        unsigned int first, last;
+        int fields = std::sscanf(range.c_str(), "%u-%u", &first, &last);
+        if (fields < 1)
+            continue;
+        if (fields == 1)
+            last = first;
+        for (unsigned int i = first; i <= last && i < CPU_SETSIZE; i++)
+        {
+            CPU_SET(i, &cpus);
+            any = true;
+        }
+    }
+    return any;
+}
+
+#endif // HAVE_PTHREAD_SETAFFINITY_NP
+
+} // anonymous namespace
+
+bool bindThread(int node)
+{
+    if (node < 0)
+        return false;
+    LargePages::setThreadNode(node);
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    std::ifstream in((nodePath(node) + "/cpulist").c_str());
+    std::string list;
+    cpu_set_t cpus;
+    if (std::getline(in, list) && parseCpuList(list, cpus)
+        && pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0)
+        return true;
+    Log::log[Log::debug] << "Could not bind thread to NUMA node " << node << '\n';
+#endif
+    return false;
+}
+
+struct ScopedBind::Saved
+{
+    int threadNode;
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    bool haveAffinity;
+    cpu_set_t affinity;
+#endif
+};
+
+ScopedBind::ScopedBind(int node)
+{
+    if (node < 0)
+        return;
+    saved.reset(new Saved);
+    saved->threadNode = LargePages::getThreadNode();
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    saved->haveAffinity = pthread_getaffinity_np(
+        pthread_self(), sizeof(saved->affinity), &saved->affinity) == 0;
+#endif
+    bindThread(node);
+}
+
+ScopedBind::~ScopedBind()
+{
+    if (!saved)
+        return;
+    LargePages::setThreadNode(saved->threadNode);
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    if (saved->haveAffinity)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved->affinity), &saved->affinity);
+#endif
+}
+
+} // namespace Numa
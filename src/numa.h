@@ -0,0 +1,84 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Placement of threads and memory on the NUMA node closest to an OpenCL
+ * device.
+ */
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+
+namespace cl { class Device; }
+
+namespace Numa
+{
+
+/**
+ * Determine the NUMA node to which the PCIe slot of @a device is attached.
+ * The bus address is obtained from @c cl_khr_pci_bus_info, or from the
+ * equivalent AMD or NVIDIA extension, and looked up in sysfs.
+ *
+ * This is implemented in numa_cl.cpp, so that the rest of this module does
+ * not depend on OpenCL.
+ *
+ * @return The node number, or -1 if it could not be determined or if the
+ * system has only one node.
+ */
+int getDeviceNode(const cl::Device &device);
+
+/**
+ * Restrict the calling thread to the CPUs of @a node, and make it the
+ * preferred node for @ref LargePages allocations made by the thread. If @a
+ * node is negative, this does nothing.
+ *
+ * @return Whether the thread was bound.
+ */
+bool bindThread(int node);
+
+/**
+ * Binds the calling thread with @ref bindThread for the lifetime of the object,
+ * then restores the previous binding. This is used while constructing objects
+ * for a device, so that host memory allocated (or first touched) by the
+ * constructors is placed near the device.
+ */
+class ScopedBind : public boost::noncopyable
+{
+public:
+    explicit ScopedBind(int node);
+    ~ScopedBind();
+
+private:
+    struct Saved;
+    boost::scoped_ptr<Saved> saved;   ///< State to restore, or @c NULL if nothing was changed
+};
+
+} // namespace Numa
+
+#endif /* !NUMA_H */
@@ -0,0 +1,169 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/**
+ * @file
+ *
+ * Lookup of the NUMA node closest to an OpenCL device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <CL/cl.hpp>
+#include <boost/filesystem/operations.hpp>
+#include "numa.h"
+#include "logging.h"
+
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+# define CL_DEVICE_PCI_BUS_INFO_KHR 0x410F
+#endif
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+# define CL_DEVICE_TOPOLOGY_AMD 0x4037
+#endif
+#ifndef CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD
+# define CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD 1
+#endif
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+# define CL_DEVICE_PCI_BUS_ID_NV 0x4008
+#endif
+#ifndef CL_DEVICE_PCI_SLOT_ID_NV
+# define CL_DEVICE_PCI_SLOT_ID_NV 0x4009
+#endif
+#ifndef CL_DEVICE_PCI_DOMAIN_ID_NV
+# define CL_DEVICE_PCI_DOMAIN_ID_NV 0x400A
+#endif
+
+namespace Numa
+{
+
+namespace
+{
+
+/// PCI address of a device
+struct PciAddress
+{
+    cl_uint domain, bus, device, function;
+};
+
+/// Layout of @c CL_DEVICE_TOPOLOGY_AMD
+struct TopologyAMD
+{
+    cl_uint type;
+    cl_char unused[17];
+    cl_char bus;
+    cl_char device;
+    cl_char function;
+};
+
+bool hasExtension(const cl::Device &device, const std::string &name)
+{
+    std::istringstream extensions(device.getInfo<CL_DEVICE_EXTENSIONS>());
+    std::string ext;
+    while (extensions >> ext)
+        if (ext == name)
+            return true;
+    return false;
+}
+
+/// Query a fixed-size device property that is not known to the C++ bindings
+template<typename T>
+bool getRawInfo(const cl::Device &device, cl_device_info param, T &value)
+{
+    return clGetDeviceInfo(device(), param, sizeof(T), &value, NULL) == CL_SUCCESS;
+}
+
+/// Determine the PCI address of @a device from vendor extensions
+bool getPciAddress(const cl::Device &device, PciAddress &addr)
+{
+    if (hasExtension(device, "cl_khr_pci_bus_info"))
+    {
+        cl_uint info[4];
+        if (getRawInfo(device, CL_DEVICE_PCI_BUS_INFO_KHR, info))
+        {
+            addr.domain = info[0];
+            addr.bus = info[1];
+            addr.device = info[2];
+            addr.function = info[3];
+            return true;
+        }
+    }
+    if (hasExtension(device, "cl_amd_device_attribute_query"))
+    {
+        TopologyAMD topology;
+        if (getRawInfo(device, CL_DEVICE_TOPOLOGY_AMD, topology)
+            && topology.type == CL_DEVICE_TOPOLOGY_TYPE_PCIE_AMD)
+        {
+            addr.domain = 0;
+            addr.bus = (unsigned char) topology.bus;
+            addr.device = (unsigned char) topology.device;
+            addr.function = (unsigned char) topology.function;
+            return true;
+        }
+    }
+    if (hasExtension(device, "cl_nv_device_attribute_query"))
+    {
+        cl_uint bus, slot;
+        if (getRawInfo(device, CL_DEVICE_PCI_BUS_ID_NV, bus)
+            && getRawInfo(device, CL_DEVICE_PCI_SLOT_ID_NV, slot))
+        {
+            if (!getRawInfo(device, CL_DEVICE_PCI_DOMAIN_ID_NV, addr.domain))
+                addr.domain = 0;
+            addr.bus = bus;
+            addr.device = slot >> 3;
+            addr.function = slot & 7;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+int getDeviceNode(const cl::Device &device)
+{
+    if (!boost::filesystem::exists("/sys/devices/system/node/node1"))
+        return -1;   // not a NUMA system
+
+    PciAddress addr;
+    if (!getPciAddress(device, addr))
+        return -1;
+
+    char path[128];
+    std::snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+                  addr.domain, addr.bus, addr.device, addr.function);
+    std::ifstream in(path);
+    int node = -1;
+    if (!(in >> node))
+        node = -1;
+    Log::log[Log::debug] << "Device " << device.getInfo<CL_DEVICE_NAME>()
+        << " is on NUMA node " << node << '\n';
+    return node;
+}
+
+} // namespace Numa
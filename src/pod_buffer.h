@@ -31,11 +31,69 @@
 # include <config.h>
 #endif
 #include <memory>
+#include <new>
 #include <cstdlib>
+#include <cstring>
 #include <boost/noncopyable.hpp>
 #include <string>
 #include "errors.h"
 
+/**
+ * Allocator that returns storage aligned to @a Alignment bytes, which must
+ * be a power of two and a multiple of <code>sizeof(void *)</code>. This is
+ * intended for buffers that are handed directly to the operating system for
+ * unbuffered I/O, which requires the buffer to be aligned to the device
+ * block size.
+ */
+template<typename T, std::size_t Alignment>
+class AlignedAllocator : public std::allocator<T>
+{
+public:
+    typedef typename std::allocator<T>::pointer pointer;
+    typedef typename std::allocator<T>::size_type size_type;
+
+    template<typename U> struct rebind
+    {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    static const std::size_t alignment = Alignment;
+
+    AlignedAllocator() throw() {}
+    AlignedAllocator(const AlignedAllocator &) throw() : std::allocator<T>() {}
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) throw() {}
+
+    pointer allocate(size_type n, std::allocator<void>::const_pointer hint = 0)
+    {
+        (void) hint;
+        void *ptr;
+        if (n > this->max_size())
+            throw std::bad_alloc();
+#ifdef _WIN32
+        ptr = _aligned_malloc(n * sizeof(T), Alignment);
+        if (ptr == NULL)
+            throw std::bad_alloc();
+#else
+        if (posix_memalign(&ptr, Alignment, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+#endif
+        return static_cast<pointer>(ptr);
+    }
+
+    void deallocate(pointer p, size_type)
+    {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        std::free(p);
+#endif
+    }
+};
+
+template<typename T, std::size_t Alignment>
+const std::size_t AlignedAllocator<T, Alignment>::alignment;
+
 /**
  * Vector-like class that only supports explicit resize, and does not
  * default-initialize. It is only suitable for storing POD types.
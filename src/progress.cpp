@@ -32,6 +32,7 @@
 #include <string>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/bind.hpp>
 #include "progress.h"
 #include "misc.h"
 
@@ -45,7 +46,9 @@ ProgressDisplay::ProgressDisplay(size_type total,
                                  const std::string &s1,
                                  const std::string &s2,
                                  const std::string &s3)
-: os(os), s1(s1), s2(s2), s3(s3)
+: current(0), total(total), os(os), s1(s1), s2(s2), s3(s3),
+    currentGauge("progress.current", boost::bind(&ProgressDisplay::count, this)),
+    totalGauge("progress.total", boost::bind(&ProgressDisplay::expected_count, this))
 {
     restart(total);
 }
@@ -37,6 +37,7 @@
 #include <boost/thread/mutex.hpp>
 #include "tr1_cstdint.h"
 #include <boost/noncopyable.hpp>
+#include "metrics.h"
 
 /**
  * An abstraction of a progress meter. It supports large integral progress values.
@@ -58,7 +59,9 @@ public:
 };
 
 /**
- * A thread-safe progress meter which displays ASCII-art progress.
+ * A thread-safe progress meter which displays ASCII-art progress. The
+ * current and total values are also published as the @c progress.current and
+ * @c progress.total gauges.
  */
 class ProgressDisplay : public ProgressMeter, public boost::noncopyable
 {
@@ -92,6 +95,9 @@ private:
     std::ostream &os;            ///< Output stream
     const std::string s1, s2, s3;
 
+    Metrics::Gauge currentGauge; ///< Reports @ref count
+    Metrics::Gauge totalGauge;   ///< Reports @ref expected_count
+
     enum
     {
         totalTics = 51           ///< Width of the ASCII art
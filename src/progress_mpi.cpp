@@ -34,9 +34,35 @@
 #include "tags.h"
 #include "progress.h"
 #include "progress_mpi.h"
+#include "timer.h"
 
-ProgressMPI::ProgressMPI(ProgressMeter *parent, size_type total, MPI_Comm comm, int root)
-    : parent(parent), comm(comm), root(root), total(total), thresh(total / 1000), unsent(0)
+const double ProgressMPI::minInterval = 0.25;
+
+ProgressMPI::Window::Window(MPI_Comm comm, int root)
+    : win(MPI_WIN_NULL), counter(NULL)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Aint bytes = 0;
+    if (rank == root)
+    {
+        bytes = sizeof(long long);
+        MPI_Alloc_mem(bytes, MPI_INFO_NULL, &counter);
+        *counter = 0;
+    }
+    MPI_Win_create(counter, bytes, sizeof(long long), MPI_INFO_NULL, comm, &win);
+}
+
+ProgressMPI::Window::~Window()
+{
+    MPI_Win_free(&win);
+    if (counter != NULL)
+        MPI_Free_mem(counter);
+}
+
+ProgressMPI::ProgressMPI(ProgressMeter *parent, size_type total, MPI_Comm comm, int root, MPI_Win win)
+    : parent(parent), comm(comm), root(root), win(win), total(total), thresh(total / 1000), unsent(0),
+    lastSend(Timer::currentTime())
 {
 }
 
@@ -44,7 +70,8 @@ void ProgressMPI::operator+=(size_type inc)
 {
     boost::lock_guard<boost::mutex> lock(mutex);
     unsent += inc;
-    if (unsent > thresh)
+    if (unsent > thresh
+        && Timer::getElapsed(lastSend, Timer::currentTime()) >= minInterval)
         syncUnlocked();
 }
 
@@ -53,8 +80,16 @@ void ProgressMPI::syncUnlocked()
     if (unsent != 0)
     {
         long long buf = unsent;
-        MPI_Bsend(&buf, 1, MPI_LONG_LONG, root, MLSGPU_TAG_PROGRESS, comm);
+        if (win != MPI_WIN_NULL)
+        {
+            MPI_Win_lock(MPI_LOCK_SHARED, root, 0, win);
+            MPI_Accumulate(&buf, 1, MPI_LONG_LONG, root, 0, 1, MPI_LONG_LONG, MPI_SUM, win);
+            MPI_Win_unlock(root, win);
+        }
+        else
+            MPI_Bsend(&buf, 1, MPI_LONG_LONG, root, MLSGPU_TAG_PROGRESS, comm);
         unsent = 0;
+        lastSend = Timer::currentTime();
     }
 }
 
@@ -64,10 +99,43 @@ void ProgressMPI::sync()
     syncUnlocked();
 }
 
+long long ProgressMPI::takeWindow() const
+{
+    /* The read and the subtraction are separate epochs, because the result
+     * of the get is only available once its epoch ends. Updates that land
+     * between them are kept for the next call.
+     */
+    long long value;
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, root, 0, win);
+    MPI_Get(&value, 1, MPI_LONG_LONG, root, 0, 1, MPI_LONG_LONG, win);
+    MPI_Win_unlock(root, win);
+    if (value != 0)
+    {
+        long long negated = -value;
+        MPI_Win_lock(MPI_LOCK_SHARED, root, 0, win);
+        MPI_Accumulate(&negated, 1, MPI_LONG_LONG, root, 0, 1, MPI_LONG_LONG, MPI_SUM, win);
+        MPI_Win_unlock(root, win);
+    }
+    return value;
+}
+
 void ProgressMPI::operator()() const
 {
     size_type current = 0;
     const boost::posix_time::time_duration sleepTime = boost::posix_time::milliseconds(500);
+    if (win != MPI_WIN_NULL)
+    {
+        while (current < total)
+        {
+            const long long update = takeWindow();
+            if (update == 0)
+                boost::this_thread::sleep(sleepTime);
+            current += update;
+            *parent += update;
+        }
+        return;
+    }
+
     while (current < total)
     {
         long long update;
@@ -33,6 +33,7 @@
 #include <mpi.h>
 #include <boost/thread/locks.hpp>
 #include "progress.h"
+#include "timer.h"
 
 /**
  * A distributed MPI progress meter. The root process will forward the progress
@@ -42,8 +43,15 @@
  * root. To save bandwidth, updates are sent only when @ref sync is called or
  * when the unsent updates amount to at least 0.1%.
  *
+ * Updates are also rate-limited to one per @ref minInterval seconds, so
+ * that a fast producer does not flood the root with tiny messages.
+ *
  * To reduce CPU load on the root when using a busy-wait implementation of MPI
- * (e.g. OpenMPI), the communicator is polled on an interval.
+ * (e.g. OpenMPI), the communicator is polled on an interval. Alternatively,
+ * if a @ref Window is given, updates are accumulated into a counter on the
+ * root with one-sided operations, and the root only reads and clears the
+ * counter on the polling interval, so that it never posts receives or
+ * matches messages for progress.
  *
  * The root process must also call @c operator() to receive the updates. This
  * will typically be done in a separate thread.
@@ -54,6 +62,28 @@
 class ProgressMPI : public ProgressMeter, public boost::noncopyable
 {
 public:
+    /**
+     * An RMA window holding a progress counter on the root. Construction
+     * and destruction are collective over the communicator, so a window is
+     * normally created once and shared by all the meters that use the
+     * communicator.
+     */
+    class Window : public boost::noncopyable
+    {
+    private:
+        MPI_Win win;
+        long long *counter;   ///< Window memory (root only)
+
+    public:
+        /// Constructor. This is a collective operation.
+        Window(MPI_Comm comm, int root);
+
+        /// Destructor. This is a collective operation.
+        ~Window();
+
+        MPI_Win get() const { return win; }
+    };
+
     /**
      * Constructor. It is legal for @a total to be different to the capacity of
      * the parent meter. The @a total is the total amount that this meter will
@@ -68,8 +98,11 @@ public:
      *                   however, so it is possible to keep things separate as long as all
      *                   receives specify a tag.
      * @param root       Root process in @a comm that will receive and forward updates.
+     * @param win        If not @c MPI_WIN_NULL, a @ref Window created over @a comm
+     *                   with the same root, through which updates are sent.
      */
-    ProgressMPI(ProgressMeter *parent, size_type total, MPI_Comm comm, int root);
+    ProgressMPI(ProgressMeter *parent, size_type total, MPI_Comm comm, int root,
+                MPI_Win win = MPI_WIN_NULL);
 
     virtual void operator+=(size_type inc);
 
@@ -87,14 +120,22 @@ private:
     /// Like @ref sync but the caller locks
     void syncUnlocked();
 
+    /// Read and clear the counter in @ref win (root only)
+    long long takeWindow() const;
+
+    /// Minimum seconds between updates sent by @ref operator+=
+    static const double minInterval;
+
     ProgressMeter * const parent; ///< Parent progress meter (well-defined only on root)
     MPI_Comm comm;
     const int root;
+    const MPI_Win win;            ///< Window for one-sided updates, or @c MPI_WIN_NULL
 
     const size_type total;        ///< Expected total progress
     const size_type thresh;       ///< Minimum progress before sending updates
 
     size_type unsent;             ///< Unsent increment amount (on slaves)
+    Timer::timestamp lastSend;    ///< Time of the last update sent
     boost::mutex mutex;           ///< Mutex protecting @ref unsent
 };
 
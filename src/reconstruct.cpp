@@ -0,0 +1,826 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Top-level driver for a reconstruction on a single node, callable from
+ * other programs as well as from the @c mlsgpu executable.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <boost/program_options.hpp>
+#include <boost/foreach.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/exception/all.hpp>
+#include <iostream>
+#include <cerrno>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "tr1_cstdint.h"
+#include "errors.h"
+#include "logging.h"
+#include "timer.h"
+#include "fast_ply.h"
+#include "grid.h"
+#include "mesher.h"
+#include "options.h"
+#include "splat_set.h"
+#include "statistics.h"
+#include "statistics_cl.h"
+#include "clh.h"
+#include "splat.h"
+#include "workers.h"
+#include "progress.h"
+#include "timeplot.h"
+#include "blob_computer_cl.h"
+#include "bucket_collector.h"
+#include "bucket_counter_cl.h"
+#include "bucket_loader.h"
+#include "chunk_tracker.h"
+#include "memory_governor.h"
+#include "cpu_budget.h"
+#include "incremental.h"
+#include "mlsgpu_core.h"
+#include "reconstruct.h"
+
+namespace po = boost::program_options;
+using namespace std;
+
+namespace
+{
+
+typedef SplatSet::FastBlobSet<SplatSet::FileSet> Splats;
+
+/**
+ * Callback for @ref BucketCollector that passes batches on to the loader and
+ * periodically snapshots the mesher (see @ref MesherBase::snapshot). A
+ * snapshot is only consistent once every batch sent so far has been meshed,
+ * so the worker threads are drained and then restarted around it. The
+ * interval should be long enough to amortize that stall.
+ */
+class Snapshotter : public boost::noncopyable
+{
+public:
+    typedef void result_type;
+
+    /**
+     * Constructor.
+     *
+     * @param tworker       Timeplot worker for the thread running the collector.
+     * @param mesher        Mesher to snapshot.
+     * @param mesherGroup, slaveWorkers, loaderQueue Worker threads to drain.
+     * @param path          Snapshot file, or empty to disable snapshots.
+     * @param interval      Minimum seconds between snapshots.
+     */
+    Snapshotter(Timeplot::Worker &tworker, MesherBase &mesher,
+                MesherGroup &mesherGroup, SlaveWorkers &slaveWorkers, BucketLoaderQueue &loaderQueue,
+                const boost::filesystem::path &path, double interval)
+        : tworker(tworker), mesher(mesher),
+        mesherGroup(mesherGroup), slaveWorkers(slaveWorkers), loaderQueue(loaderQueue),
+        path(path), interval(interval),
+        splats(NULL), grid(NULL), progress(NULL), doneBins(0),
+        lastSnapshot(Timer::currentTime())
+    {
+    }
+
+    /**
+     * Set the arguments needed to restart the slave workers, and the number
+     * of bins already processed by an earlier run.
+     */
+    void setPass(Splats &splats, const Grid &grid, ProgressMeter *progress, std::tr1::uint64_t doneBins)
+    {
+        this->splats = &splats;
+        this->grid = &grid;
+        this->progress = progress;
+        this->doneBins = doneBins;
+        lastSnapshot = Timer::currentTime();
+    }
+
+    void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins)
+    {
+        loaderQueue(bins);
+        doneBins += bins.size();
+        if (!path.empty()
+            && Timer::getElapsed(lastSnapshot, Timer::currentTime()) >= interval)
+            snapshot();
+    }
+
+private:
+    Timeplot::Worker &tworker;
+    MesherBase &mesher;
+    MesherGroup &mesherGroup;
+    SlaveWorkers &slaveWorkers;
+    BucketLoaderQueue &loaderQueue;
+    const boost::filesystem::path path;
+    const double interval;
+
+    Splats *splats;
+    const Grid *grid;
+    ProgressMeter *progress;
+    std::tr1::uint64_t doneBins;      ///< Bins passed to the loader, including skipped ones
+    Timer::timestamp lastSnapshot;
+
+    /// Restart the workers in the same order as at the start of a pass
+    void restart()
+    {
+        slaveWorkers.start(*splats, *grid, progress);
+        loaderQueue.start();
+        mesherGroup.start();
+    }
+
+    void snapshot()
+    {
+        Timeplot::Action timer("snapshot", tworker, "snapshot.time");
+
+        try
+        {
+            loaderQueue.stop();
+        }
+        catch (...)
+        {
+            // Leave the loader running so that the caller can shut down normally
+            loaderQueue.start();
+            throw;
+        }
+        slaveWorkers.stop();
+        mesherGroup.stop();
+        try
+        {
+            mesher.snapshot(tworker, path, doneBins);
+        }
+        catch (...)
+        {
+            restart();
+            throw;
+        }
+        restart();
+        lastSnapshot = Timer::currentTime();
+    }
+};
+
+/**
+ * Callback for @ref ChunkTracker that releases a completed chunk in the
+ * full-resolution mesher and in the mesher for each level of detail.
+ */
+class ChunkReleaser
+{
+public:
+    typedef void result_type;
+
+    ChunkReleaser(MesherBase &mesher, boost::ptr_vector<MesherBase> &lodMeshers)
+        : mesher(mesher), lodMeshers(lodMeshers)
+    {
+    }
+
+    void operator()(ChunkId::gen_type gen) const
+    {
+        mesher.releaseChunk(gen);
+        BOOST_FOREACH(MesherBase &lodMesher, lodMeshers)
+            lodMesher.releaseChunk(gen);
+    }
+
+private:
+    MesherBase &mesher;
+    boost::ptr_vector<MesherBase> &lodMeshers;
+};
+
+/**
+ * Callback for @ref BucketCollector that only tallies the bins, for
+ * @ref planReconstruction.
+ */
+class PlanTally
+{
+public:
+    typedef void result_type;
+
+    std::tr1::uint64_t numBins;
+    std::tr1::uint64_t numBatches;
+    std::tr1::uint64_t binSplats;        ///< Sum of splats over all bins
+    std::tr1::uint64_t binCells;         ///< Sum of cells over all bins
+    std::size_t maxBinSplats;
+    std::size_t maxBatchSplats;
+    std::set<ChunkId::gen_type> chunks;
+
+    PlanTally()
+        : numBins(0), numBatches(0), binSplats(0), binCells(0),
+        maxBinSplats(0), maxBatchSplats(0)
+    {
+    }
+
+    void operator()(const Statistics::Container::vector<BucketCollector::Bin> &bins)
+    {
+        std::size_t batchSplats = 0;
+        BOOST_FOREACH(const BucketCollector::Bin &bin, bins)
+        {
+            const std::size_t splats = bin.ranges.numSplats();
+            numBins++;
+            binSplats += splats;
+            binCells += std::tr1::uint64_t(bin.grid.numCells(0)) * bin.grid.numCells(1) * bin.grid.numCells(2);
+            maxBinSplats = std::max(maxBinSplats, splats);
+            batchSplats += splats;
+            chunks.insert(bin.chunkId.gen);
+        }
+        numBatches++;
+        maxBatchSplats = std::max(maxBatchSplats, batchSplats);
+    }
+};
+
+/// Write one line of the memory report of @ref planReconstruction
+static void reportPool(std::ostream &out, const char *option, std::tr1::uint64_t capacity,
+                       std::tr1::uint64_t predicted)
+{
+    out << "  --" << std::left << std::setw(18) << option << std::right
+        << std::setw(8) << (capacity + 1024 * 1024 - 1) / (1024 * 1024) << " MiB";
+    if (predicted != std::tr1::uint64_t(-1))
+        out << ", peak about " << (std::min(predicted, capacity) + 1024 * 1024 - 1) / (1024 * 1024) << " MiB";
+    out << '\n';
+}
+
+/**
+ * A setting adjusted by @ref autotuneHost, with the pipeline stage whose
+ * workers block on it when it is too small.
+ */
+struct TunedPool
+{
+    const char *option;
+    const char *stage;
+};
+
+const TunedPool tunedPools[] =
+{
+    { Option::memLoadSplats, "reader" },
+    { Option::memHostSplats, "loader" },
+    { Option::memMesh, "device" },
+    { Option::memReorder, "mesher" }
+};
+
+const std::size_t numTunedPools = sizeof(tunedPools) / sizeof(tunedPools[0]);
+
+/// Fraction of its lifetime that a stage must spend blocked before its pool is grown
+const double autotuneBlocked = 0.1;
+/// Busy fraction of the device stage above which another device thread is tried
+const double autotuneDeviceBusy = 0.8;
+/// Largest value of @ref Option::deviceThreads that is tried
+const int autotuneMaxDeviceThreads = 4;
+
+/// Change in the totals of @a stage between @a before and @a after
+Timeplot::StageTotals stageDelta(
+    const std::map<std::string, Timeplot::StageTotals> &before,
+    const std::map<std::string, Timeplot::StageTotals> &after,
+    const std::string &stage)
+{
+    Timeplot::StageTotals ans;
+    std::map<std::string, Timeplot::StageTotals>::const_iterator a = after.find(stage);
+    if (a == after.end())
+        return ans;
+    ans = a->second;
+    std::map<std::string, Timeplot::StageTotals>::const_iterator b = before.find(stage);
+    if (b != before.end())
+    {
+        ans.workers -= b->second.workers;
+        ans.lifetime -= b->second.lifetime;
+        for (int i = 0; i < Timeplot::NUM_ACTION_CATEGORIES; i++)
+            ans.time[i] -= b->second.time[i];
+    }
+    return ans;
+}
+
+} // anonymous namespace
+
+std::size_t reconstruct(
+    const std::vector<std::pair<cl::Context, cl::Device> > &devices,
+    const std::string &out,
+    const po::variables_map &vm,
+    const InputSource &source,
+    const OutputSink &sink)
+{
+    const std::size_t maxLoadSplats = getMaxLoadSplats(vm);
+    const std::size_t memMesh = vm[Option::memMesh].as<Capacity>();
+    const std::size_t loadQueue = vm[Option::loadQueue].as<int>();
+    std::size_t ret = 0;
+
+    if (!source.empty())
+    {
+        const char * const unsupported[] = { Option::incremental, Option::savePlan, Option::loadPlan };
+        for (std::size_t i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+            if (vm.count(unsupported[i]))
+                throw invalid_option(std::string("--") + unsupported[i] + " is not supported for in-memory inputs");
+    }
+
+    Timeplot::Worker mainWorker("main");
+
+    {
+        Statistics::Timer grandTotalTimer("run.time");
+
+        const WriterType writerType = vm[Option::writer].as<Choice<WriterTypeWrapper> >();
+        boost::scoped_ptr<FastPly::Writer> writer(
+            sink.empty() ? new FastPly::Writer(writerType) : new FastPly::Writer(sink));
+        setWriterComments(vm, *writer);
+
+        boost::scoped_ptr<MesherBase> mesher(new OOCMesher(*writer, getNamer(vm, out)));
+        setMesherOptions(vm, *mesher);
+
+        // Coarser levels of detail, each with its own output
+        const unsigned int lodLevels = vm[Option::lodLevels].as<int>();
+        boost::ptr_vector<FastPly::Writer> lodWriters;
+        boost::ptr_vector<MesherBase> lodMeshers;
+        for (unsigned int lod = 1; lod <= lodLevels; lod++)
+        {
+            lodWriters.push_back(sink.empty() ? new FastPly::Writer(writerType) : new FastPly::Writer(sink));
+            setWriterComments(vm, lodWriters.back());
+            lodMeshers.push_back(new OOCMesher(lodWriters.back(), getNamer(vm, getLodOutputName(out, lod))));
+            setMesherOptions(vm, lodMeshers.back(), lod);
+        }
+
+        bool resumeInput = true;
+        std::tr1::uint64_t skipBins = 0;
+        if (vm.count(Option::resume))
+        {
+            boost::filesystem::path path(vm[Option::resume].as<std::string>());
+            resumeInput = mesher->restore(mainWorker, path, skipBins);
+            if (resumeInput)
+                Log::log[Log::info] << "Continuing from snapshot after " << skipBins << " buckets\n";
+            else
+                ret = mesher->write(mainWorker, &Log::log[Log::info]);
+        }
+        if (resumeInput)
+        {
+            Incremental::State incrementalState;
+            boost::scoped_ptr<Incremental::Planner> planner;
+            {
+                // Open a scope so that objects will be released before finalization
+
+                boost::scoped_ptr<Timeplot::Action> initTimer(new Timeplot::Action("init", mainWorker, "init.time"));
+
+                Log::log[Log::info] << "Initializing...\n";
+                // Only used if the loader runs in its own thread
+                Timeplot::Worker loaderWorker("loader");
+                // Lets the meshers free the state of chunks that will get no more input
+                ChunkTracker chunkTracker(ChunkReleaser(*mesher, lodMeshers));
+                // Holds back loading while tracked memory is over --mem-limit
+                MemoryGovernor governor(vm[Option::memLimit].as<Capacity>());
+                // Shared by the mesher groups, so that idle levels leave their cores to busy ones
+                CpuBudget cpuBudget(getCpuThreads(vm));
+                /* With pinned memory, meshes are read back from the device by
+                 * DMA straight into the ring that the meshers consume, instead
+                 * of being staged through a driver buffer. The memory is pinned
+                 * for the context of the first device.
+                 */
+                boost::ptr_vector<CLH::PinnedMemory<char> > pinnedMesh;
+                if (vm.count(Option::pinnedMesh) && !devices.empty())
+                    for (unsigned int i = 0; i <= lodLevels; i++)
+                        pinnedMesh.push_back(new CLH::PinnedMemory<char>(
+                                "mem.MesherGroup.pinned", devices[0].first, devices[0].second, memMesh));
+                MesherGroup mesherGroup(memMesh,
+                                        mesher->concurrentInput() ? vm[Option::mesherThreads].as<int>() : 1,
+                                        pinnedMesh.empty() ? NULL : pinnedMesh[0].get());
+                mesherGroup.setChunkTracker(&chunkTracker);
+                mesherGroup.setMemoryGovernor(&governor);
+                mesherGroup.setCpuBudget(&cpuBudget);
+                SlaveWorkers slaveWorkers(
+                    loadQueue > 0 ? loaderWorker : mainWorker, vm, devices,
+                    makeOutputGenerator(mesherGroup), makeHostOutput(mesherGroup));
+                slaveWorkers.setChunkTracker(&chunkTracker);
+                slaveWorkers.setMemoryGovernor(&governor);
+                boost::ptr_vector<MesherGroup> lodMesherGroups;
+                std::vector<DeviceWorkerGroup::OutputGenerator> lodOutputs;
+                for (unsigned int i = 0; i < lodLevels; i++)
+                {
+                    lodMesherGroups.push_back(new MesherGroup(memMesh,
+                        lodMeshers[i].concurrentInput() ? vm[Option::mesherThreads].as<int>() : 1,
+                        pinnedMesh.empty() ? NULL : pinnedMesh[i + 1].get()));
+                    lodMesherGroups.back().setChunkTracker(&chunkTracker);
+                    lodMesherGroups.back().setMemoryGovernor(&governor);
+                    lodMesherGroups.back().setCpuBudget(&cpuBudget);
+                    lodOutputs.push_back(makeOutputGenerator(lodMesherGroups.back()));
+                }
+                if (lodLevels > 0)
+                    slaveWorkers.setLodOutputs(lodOutputs);
+                BucketLoaderQueue loaderQueue(*slaveWorkers.loader, loadQueue, mainWorker);
+                Snapshotter snapshotter(
+                    mainWorker, *mesher, mesherGroup, slaveWorkers, loaderQueue,
+                    vm.count(Option::snapshot) ? vm[Option::snapshot].as<std::string>() : std::string(),
+                    vm[Option::snapshotInterval].as<double>());
+                BucketCollector collector(maxLoadSplats, boost::ref(snapshotter));
+                collector.setLongestFirst(vm.count(Option::longestFirst),
+                                          vm[Option::bucketCellWeight].as<double>());
+
+                boost::scoped_ptr<BucketCounterCL> bucketCounter;
+                if (vm.count(Option::bucketDevice) && !devices.empty())
+                    bucketCounter.reset(new BucketCounterCL(devices[0].first, devices[0].second));
+
+                boost::scoped_ptr<BlobComputerCL> blobComputer;
+                if (vm.count(Option::blobsDevice) && !devices.empty())
+                    blobComputer.reset(new BlobComputerCL(devices[0].first, devices[0].second));
+
+                Splats splats;
+                splats.setBlobComputer(blobComputer.get());
+                if (vm.count(Option::ingest) && source.empty())
+                    ingestInputs(mainWorker, vm, splats);
+                else
+                    doComputeBlobs(mainWorker, vm, splats,
+                                   boost::bind(&Splats::computeBlobs, &splats, _1, _2, &Log::log[Log::info], true),
+                                   boost::bind(&Splats::loadBlobs, &splats, _1, _2),
+                                   boost::bind(&Splats::saveBlobs, &splats, _1, _2),
+                                   source);
+                splats.cacheBlobs(vm[Option::memBlobs].as<Capacity>());
+                const Grid &fullGrid = splats.getBoundingGrid();
+                Grid grid = cropGrid(vm, fullGrid, splats.getBucketSize());
+                unsigned int chunkCells = postprocessGrid(vm, grid);
+                mesher->setChunkGrid(grid, chunkCells, fullGrid);
+                for (unsigned int i = 0; i < lodLevels; i++)
+                {
+                    // Coarse buckets keep the chunk of their full-resolution bucket
+                    lodMeshers[i].setChunkGrid(grid, chunkCells, fullGrid);
+                }
+
+                if (vm.count(Option::incremental))
+                {
+                    const boost::filesystem::path path(vm[Option::incremental].as<std::string>());
+                    incrementalState = makeIncrementalState(vm, splats, grid, chunkCells);
+                    Incremental::State previous;
+                    const bool havePrevious = previous.load(path);
+                    planner.reset(new Incremental::Planner(havePrevious ? &previous : NULL, incrementalState));
+                    if (planner->isFull())
+                        Log::log[Log::info] << "No matching state in " << path.string() << ", rebuilding all chunks\n";
+                    else
+                        Log::log[Log::info] << planner->numChangedFiles() << " input file(s) changed since the last run\n";
+                }
+
+                initTimer.reset();
+
+                const unsigned int previewLevel = vm[Option::preview].as<int>();
+                if (previewLevel > 0)
+                {
+                    /* A quick pass over the same buckets at a coarse level, so
+                     * that bad inputs show up before the full-resolution pass.
+                     * The coarse items go through the first level-of-detail
+                     * output, and the chunks are not tracked since the preview
+                     * mesher is written in one go at the end of the pass.
+                     */
+                    Log::log[Log::info] << "\nWriting preview" << endl;
+                    Statistics::Timer timer("preview.time");
+
+                    boost::scoped_ptr<FastPly::Writer> previewWriter(
+                        sink.empty() ? new FastPly::Writer(writerType) : new FastPly::Writer(sink));
+                    setWriterComments(vm, *previewWriter);
+                    OOCMesher previewMesher(*previewWriter, getNamer(vm, getPreviewOutputName(out)));
+                    setPreviewMesherOptions(vm, previewMesher);
+                    previewMesher.setChunkGrid(grid, chunkCells, fullGrid);
+                    MesherGroup previewMesherGroup(memMesh,
+                        previewMesher.concurrentInput() ? vm[Option::mesherThreads].as<int>() : 1, NULL);
+                    previewMesherGroup.setMemoryGovernor(&governor);
+                    previewMesherGroup.setCpuBudget(&cpuBudget);
+                    previewMesherGroup.setInputFunctor(previewMesher.functor(0));
+                    BucketCollector previewCollector(maxLoadSplats, boost::ref(loaderQueue));
+
+                    slaveWorkers.setChunkTracker(NULL);
+                    slaveWorkers.setLodOutputs(std::vector<DeviceWorkerGroup::OutputGenerator>(
+                            1, makeOutputGenerator(previewMesherGroup)));
+                    slaveWorkers.loader->setPreview(previewLevel);
+
+                    slaveWorkers.start(splats, fullGrid, NULL);
+                    loaderQueue.start();
+                    previewMesherGroup.start();
+                    try
+                    {
+                        doBucket(mainWorker, vm, splats, grid, chunkCells, previewCollector, bucketCounter.get());
+                    }
+                    catch (...)
+                    {
+                        // See the pass below
+                        try
+                        {
+                            previewCollector.flush();
+                        }
+                        catch (...)
+                        {
+                        }
+                        try
+                        {
+                            loaderQueue.stop();
+                        }
+                        catch (...)
+                        {
+                        }
+                        slaveWorkers.stop();
+                        previewMesherGroup.stop();
+                        throw;
+                    }
+                    previewCollector.flush();
+                    loaderQueue.stop();
+                    slaveWorkers.stop();
+                    previewMesherGroup.stop();
+
+                    slaveWorkers.loader->setPreview(0);
+                    slaveWorkers.setLodOutputs(lodOutputs);
+                    slaveWorkers.setChunkTracker(&chunkTracker);
+                    ret += previewMesher.write(mainWorker, &Log::log[Log::info]);
+                }
+
+                for (unsigned int pass = 0; pass < mesher->numPasses(); pass++)
+                {
+                    Log::log[Log::info] << "\nPass " << pass + 1 << "/" << mesher->numPasses() << endl;
+                    ostringstream passName;
+                    passName << "pass" << pass + 1 << ".time";
+                    Statistics::Timer timer(passName.str());
+
+                    ProgressDisplay progress(splats.numSplats(), Log::log[Log::info]);
+
+                    mesherGroup.setInputFunctor(mesher->functor(pass));
+                    for (unsigned int i = 0; i < lodLevels; i++)
+                        lodMesherGroups[i].setInputFunctor(lodMeshers[i].functor(pass));
+                    snapshotter.setPass(splats, fullGrid, &progress, skipBins);
+                    collector.setSkip(skipBins, &progress);
+                    if (vm.count(Option::autotuneHost))
+                        collector.setLimit(vm[Option::autotuneHostBins].as<int>(), &progress);
+                    if (planner)
+                        collector.setChunkFilter(boost::ref(*planner), &progress);
+
+                    // Start threads
+                    slaveWorkers.start(splats, fullGrid, &progress);
+                    loaderQueue.start();
+                    mesherGroup.start();
+                    for (unsigned int i = 0; i < lodLevels; i++)
+                        lodMesherGroups[i].start();
+
+                    try
+                    {
+                        doBucket(mainWorker, vm, splats, grid, chunkCells, collector, bucketCounter.get());
+                    }
+                    catch (...)
+                    {
+                        // This can't be handled using unwinding, because that would operate in
+                        // the wrong order. Errors from the loader while shutting down are
+                        // discarded in favour of the one already being propagated.
+                        try
+                        {
+                            collector.flush();
+                        }
+                        catch (...)
+                        {
+                        }
+                        try
+                        {
+                            loaderQueue.stop();
+                        }
+                        catch (...)
+                        {
+                        }
+                        slaveWorkers.stop();
+                        mesherGroup.stop();
+                        for (unsigned int i = 0; i < lodLevels; i++)
+                            lodMesherGroups[i].stop();
+                        throw;
+                    }
+
+                    /* Shut down threads. Note that it has to be done in forward order to
+                     * satisfy the requirement that stop() is only called after producers
+                     * are terminated.
+                     */
+                    collector.flush();
+                    loaderQueue.stop();
+                    slaveWorkers.stop();
+                    mesherGroup.stop();
+                    for (unsigned int i = 0; i < lodLevels; i++)
+                        lodMesherGroups[i].stop();
+                }
+            }
+
+            if (vm.count(Option::checkpoint))
+            {
+                const boost::filesystem::path path(vm[Option::checkpoint].as<std::string>());
+                mesher->checkpoint(mainWorker, path);
+            }
+            else
+            {
+                if (planner)
+                {
+                    Log::log[Log::info] << "Reusing " << planner->numReusedChunks() << " unchanged chunk(s)\n";
+                    /* Chunks that are rebuilt may now be empty and so not be
+                     * written, in which case the old file must not survive.
+                     */
+                    const MesherBase::Namer namer = getNamer(vm, out);
+                    BOOST_FOREACH(const Incremental::ChunkCoords &coords, planner->staleChunks())
+                    {
+                        ChunkId chunkId;
+                        chunkId.coords = coords;
+                        boost::system::error_code ec;
+                        boost::filesystem::remove(namer(chunkId), ec);
+                    }
+                }
+                ret += mesher->write(mainWorker, &Log::log[Log::info]);
+                for (unsigned int i = 0; i < lodLevels; i++)
+                {
+                    Log::log[Log::info] << "Writing level of detail " << i + 1 << "\n";
+                    ret += lodMeshers[i].write(mainWorker, &Log::log[Log::info]);
+                }
+                if (planner)
+                {
+                    incrementalState.chunks = planner->getChunks();
+                    incrementalState.save(vm[Option::incremental].as<std::string>());
+                }
+            }
+        }
+    } // ends scope for grandTotalTimer
+
+    Statistics::finalizeEventTimes();
+    writeStatistics(vm);
+    return ret;
+}
+
+void planReconstruction(const po::variables_map &vm, std::size_t numDevices, std::ostream &out)
+{
+    const std::tr1::uint64_t none = std::tr1::uint64_t(-1);
+    Timeplot::Worker mainWorker("main");
+
+    Splats splats;
+    if (vm.count(Option::ingest))
+        ingestInputs(mainWorker, vm, splats);
+    else
+        doComputeBlobs(mainWorker, vm, splats,
+                       boost::bind(&Splats::computeBlobs, &splats, _1, _2, &Log::log[Log::info], true),
+                       boost::bind(&Splats::loadBlobs, &splats, _1, _2),
+                       boost::bind(&Splats::saveBlobs, &splats, _1, _2));
+    splats.cacheBlobs(vm[Option::memBlobs].as<Capacity>());
+    Grid grid = cropGrid(vm, splats.getBoundingGrid(), splats.getBucketSize());
+    unsigned int chunkCells = postprocessGrid(vm, grid);
+
+    PlanTally tally;
+    {
+        BucketCollector collector(getMaxLoadSplats(vm), boost::ref(tally));
+        doBucket(mainWorker, vm, splats, grid, chunkCells, collector);
+        collector.flush();
+    }
+
+    const double splatTime = vm[Option::planSplatTime].as<double>();
+    const double cellTime = vm[Option::planCellTime].as<double>();
+    const double deviceTime = tally.binSplats * splatTime + tally.binCells * cellTime;
+
+    out << "Splats:            " << splats.numSplats() << '\n'
+        << "Bins:              " << tally.numBins << " in " << tally.numBatches << " load batches\n"
+        << "Chunks:            " << tally.chunks.size() << '\n'
+        << "Largest bin:       " << tally.maxBinSplats << " splats\n"
+        << "Read amplification: "
+        << std::fixed << std::setprecision(3)
+        << (splats.numSplats() > 0 ? double(tally.binSplats) / splats.numSplats() : 0.0) << '\n'
+        << "Host memory pools:\n";
+    reportPool(out, Option::memLoadSplats, vm[Option::memLoadSplats].as<Capacity>(),
+               std::tr1::uint64_t(tally.maxBatchSplats) * sizeof(Splat));
+    reportPool(out, Option::memHostSplats, vm[Option::memHostSplats].as<Capacity>(), none);
+    reportPool(out, Option::memBucketSplats, vm[Option::memBucketSplats].as<Capacity>(),
+               std::tr1::uint64_t(tally.maxBinSplats) * sizeof(Splat));
+    reportPool(out, Option::memMesh, vm[Option::memMesh].as<Capacity>(), none);
+    reportPool(out, Option::memReorder, vm[Option::memReorder].as<Capacity>(), none);
+    reportPool(out, Option::memBlobs, vm[Option::memBlobs].as<Capacity>(), none);
+    out << "Device memory:     "
+        << (resourceUsage(vm).getTotalMemory() + 1024 * 1024 - 1) / (1024 * 1024) << " MiB per device\n"
+        << std::setprecision(1)
+        << "Device time:       " << deviceTime << " s";
+    if (numDevices > 1)
+        out << " (" << deviceTime / numDevices << " s over " << numDevices << " devices)";
+    out << '\n';
+    out.unsetf(std::ios::floatfield);
+}
+
+void autotuneHost(
+    const std::vector<std::pair<cl::Context, cl::Device> > &devices,
+    const std::string &out,
+    const po::variables_map &vm)
+{
+    typedef std::tr1::uint64_t uint64;
+    const int rounds = vm[Option::autotuneHostRounds].as<int>();
+
+    std::vector<cl::Device> clDevices;
+    for (std::size_t i = 0; i < devices.size(); i++)
+        clDevices.push_back(devices[i].second);
+    const MemoryLimits limits = getMemoryLimits(clDevices);
+
+    po::variables_map best = vm;
+    uint64 initialTotal = 0;
+    for (std::size_t i = 0; i < numTunedPools; i++)
+        initialTotal += vm[tunedPools[i].option].as<Capacity>();
+    // Same headroom as planMemory, or a doubling if the host memory is unknown
+    const uint64 budget = limits.hostMemory > 0 ? limits.hostMemory / 4 * 3 : 2 * initialTotal;
+
+    const boost::filesystem::path tmpDir = boost::filesystem::temp_directory_path()
+        / boost::filesystem::unique_path("mlsgpu-autotune-%%%%-%%%%-%%%%");
+    boost::filesystem::create_directory(tmpDir);
+    const std::string tmpOut = (tmpDir / boost::filesystem::path(out).filename()).string();
+
+    po::variables_map trial = vm;
+    double bestTime = -1.0;
+    int round;
+    for (round = 0; round < rounds; round++)
+    {
+        Log::log[Log::info] << "\nCalibration run " << round + 1 << "/" << rounds << '\n';
+        validateOptions(trial, false);
+        const std::map<std::string, Timeplot::StageTotals> before =
+            Timeplot::getStageTotals(Statistics::Registry::getInstance());
+        Timer timer;
+        try
+        {
+            reconstruct(devices, tmpOut, trial);
+        }
+        catch (...)
+        {
+            boost::system::error_code ec;
+            boost::filesystem::remove_all(tmpDir, ec);
+            throw;
+        }
+        const double elapsed = timer.getElapsed();
+        const std::map<std::string, Timeplot::StageTotals> after =
+            Timeplot::getStageTotals(Statistics::Registry::getInstance());
+        boost::filesystem::remove_all(tmpDir);
+        boost::filesystem::create_directory(tmpDir);
+
+        Log::log[Log::info] << "Calibration run took " << elapsed << " s\n";
+        if (bestTime >= 0.0 && elapsed >= bestTime)
+            break; // the last change did not help
+        bestTime = elapsed;
+        best = trial;
+
+        bool changed = false;
+        uint64 total = 0;
+        for (std::size_t i = 0; i < numTunedPools; i++)
+            total += trial[tunedPools[i].option].as<Capacity>();
+        for (std::size_t i = 0; i < numTunedPools; i++)
+        {
+            const Timeplot::StageTotals t = stageDelta(before, after, tunedPools[i].stage);
+            const uint64 size = trial[tunedPools[i].option].as<Capacity>();
+            if (t.fraction(Timeplot::ACTION_BLOCKED) >= autotuneBlocked && total + size <= budget)
+            {
+                trial.at(tunedPools[i].option).value() = Capacity(2 * size);
+                total += size;
+                changed = true;
+            }
+        }
+        const Timeplot::StageTotals device = stageDelta(before, after, "device");
+        const int deviceThreads = trial[Option::deviceThreads].as<int>();
+        if (device.fraction(Timeplot::ACTION_BUSY) >= autotuneDeviceBusy
+            && deviceThreads < autotuneMaxDeviceThreads)
+        {
+            trial.at(Option::deviceThreads).value() = deviceThreads + 1;
+            changed = true;
+        }
+        if (!changed)
+            break;
+    }
+    boost::filesystem::remove_all(tmpDir);
+
+    const std::string responseFile = vm[Option::autotuneHost].as<std::string>();
+    try
+    {
+        std::ofstream f;
+        f.exceptions(std::ios::failbit | std::ios::badbit);
+        f.open(responseFile.c_str());
+        for (std::size_t i = 0; i < numTunedPools; i++)
+            f << "--" << tunedPools[i].option << '=' << best[tunedPools[i].option].as<Capacity>() << '\n';
+        f << "--" << Option::deviceThreads << '=' << best[Option::deviceThreads].as<int>() << '\n';
+        f.close();
+    }
+    catch (std::ios::failure &e)
+    {
+        throw boost::enable_error_info(e)
+            << boost::errinfo_file_name(responseFile)
+            << boost::errinfo_errno(errno);
+    }
+    Log::log[Log::info] << "Wrote settings from " << std::min(round + 1, rounds)
+        << " calibration run(s) to " << responseFile << '\n';
+}
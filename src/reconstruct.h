@@ -0,0 +1,131 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Top-level driver for a reconstruction on a single node, callable from
+ * other programs as well as from the @c mlsgpu executable.
+ */
+
+#ifndef RECONSTRUCT_H
+#define RECONSTRUCT_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <utility>
+#include <ostream>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/program_options.hpp>
+#include <CL/cl.hpp>
+#include "binary_io.h"
+#include "mlsgpu_core.h"
+
+/**
+ * Factory for the low-level writers used for the output meshes, in the form
+ * accepted by @ref FastPly::Writer (see @ref CallbackWriterFactory).
+ */
+typedef boost::function<boost::shared_ptr<BinaryWriter>()> OutputSink;
+
+/**
+ * Run a complete reconstruction.
+ *
+ * The options are normally obtained from @ref processOptions (with @a
+ * needInputs false if @a source is given), followed by @ref planMemory and
+ * @ref validateOptions. When @a source is given, options that identify the
+ * input files across runs (@ref Option::incremental, @ref Option::savePlan
+ * and @ref Option::loadPlan) are rejected and @ref Option::blobCache is
+ * ignored. When @a sink is given, the output meshes are written through it
+ * using the names derived from @a out; other outputs, such as the split
+ * index and snapshots, still go to files.
+ *
+ * @param devices         List of OpenCL devices to use
+ * @param out             Output filename or basename
+ * @param vm              Command-line options
+ * @param source          Inputs to use in place of the input files, or empty
+ * @param sink            Writers for the output meshes, or empty to write files
+ * @return Number of output files written
+ * @throw invalid_option if @a source is given with an unsupported option.
+ */
+std::size_t reconstruct(
+    const std::vector<std::pair<cl::Context, cl::Device> > &devices,
+    const std::string &out,
+    const boost::program_options::variables_map &vm,
+    const InputSource &source = InputSource(),
+    const OutputSink &sink = OutputSink());
+
+/**
+ * Predict the cost of a reconstruction without using any devices. The
+ * blobs are computed (or loaded from @ref Option::blobCache) and bucketed
+ * exactly as by @ref reconstruct, and a report is written to @a out giving
+ * the number of bins and chunks, the read amplification (the ratio of
+ * splats loaded over all bins to input splats, which exceeds one because
+ * bins overlap by the splat radius), the size of each memory pool with the
+ * predicted peak use where it is known, and the device time estimated from
+ * @ref Option::planSplatTime and @ref Option::planCellTime.
+ *
+ * The options are prepared as for @ref reconstruct.
+ *
+ * @param vm              Command-line options
+ * @param numDevices      Number of devices that the run would use
+ * @param out             Stream for the report
+ */
+void planReconstruction(
+    const boost::program_options::variables_map &vm,
+    std::size_t numDevices,
+    std::ostream &out);
+
+/**
+ * Tune the host memory pools (@ref Option::memLoadSplats, @ref
+ * Option::memHostSplats, @ref Option::memMesh and @ref Option::memReorder)
+ * and @ref Option::deviceThreads for the input, and write the chosen values
+ * to the response file named by @ref Option::autotuneHost.
+ *
+ * Each calibration run is a @ref reconstruct limited to the first @ref
+ * Option::autotuneHostBins bins, writing to a temporary directory. After
+ * each run, the pool of every pipeline stage that spent a significant
+ * fraction of its time blocked is doubled (keeping the total within the
+ * host memory budget of @ref planMemory), and another device thread is
+ * added if the device stage was mostly busy. Tuning stops after @ref
+ * Option::autotuneHostRounds runs, when nothing is blocked, or when a change
+ * makes the run slower, in which case the previous settings are kept.
+ *
+ * The options are prepared as for @ref reconstruct.
+ *
+ * @param devices         List of OpenCL devices to use
+ * @param out             Output filename or basename, used only for naming temporary files
+ * @param vm              Command-line options
+ * @throw std::ios::failure if the response file could not be written.
+ */
+void autotuneHost(
+    const std::vector<std::pair<cl::Context, cl::Device> > &devices,
+    const std::string &out,
+    const boost::program_options::variables_map &vm);
+
+#endif /* !RECONSTRUCT_H */
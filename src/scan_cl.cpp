@@ -0,0 +1,166 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Single-pass exclusive scan on the device.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <map>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+#include "scan_cl.h"
+#include "clh.h"
+#include "errors.h"
+#include "misc.h"
+
+/// Epochs must fit in the flag word alongside the two state bits
+static const cl_uint MAX_EPOCH = (cl_uint(1) << 30) - 1;
+
+const unsigned int ScanCL::ITEMS_PER_WORK_ITEM;
+const unsigned int ScanCL::MAX_WORK_GROUP_SIZE;
+
+/// Number of @c cl_uint values in the status buffer for @a tiles tiles
+static std::size_t statusWords(std::size_t tiles, unsigned int components)
+{
+    return 1 + tiles + 2 * tiles * components;
+}
+
+ScanCL::ScanCL(const cl::Context &context, const cl::Device &device, unsigned int components)
+    : context(context), components(components), maxElements(0), epoch(0),
+    eventCallback(NULL), eventCallbackUserData(NULL)
+{
+    MLSGPU_ASSERT(components == 1 || components == 2, std::invalid_argument);
+
+    std::map<std::string, std::string> defines;
+    defines["SCAN_COMPONENTS"] = boost::lexical_cast<std::string>(components);
+    defines["SCAN_ITEMS"] = boost::lexical_cast<std::string>(ITEMS_PER_WORK_ITEM);
+    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device), "kernels/scan.cl", defines);
+    kernel = cl::Kernel(program, "scanSinglePass");
+
+    // The Hillis-Steele step works for any size, but powers of two are kinder to the hardware
+    const std::size_t kernelMax = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+    workGroupSize = MAX_WORK_GROUP_SIZE;
+    while (workGroupSize > 1 && workGroupSize > kernelMax)
+        workGroupSize /= 2;
+
+    allocateStatus(tileSize());
+}
+
+std::size_t ScanCL::tileSize() const
+{
+    return workGroupSize * ITEMS_PER_WORK_ITEM;
+}
+
+void ScanCL::allocateStatus(std::size_t elements)
+{
+    const std::size_t tiles = divUp(elements, tileSize());
+    const std::vector<cl_uint> zeros(statusWords(tiles, components), 0);
+    status = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                        zeros.size() * sizeof(cl_uint), const_cast<cl_uint *>(&zeros[0]));
+    maxElements = tiles * tileSize();
+    epoch = 0;
+}
+
+void ScanCL::reserve(std::size_t elements)
+{
+    MLSGPU_ASSERT(elements <= 0xFFFFFFFFu, std::length_error);
+    if (elements > maxElements)
+        allocateStatus(elements);
+}
+
+void ScanCL::setEventCallback(EventCallback callback, void *userData)
+{
+    eventCallback = callback;
+    eventCallbackUserData = userData;
+}
+
+void ScanCL::enqueue(
+    const cl::CommandQueue &queue, const cl::Buffer &buffer,
+    std::size_t elements, const cl_uint *offset,
+    const std::vector<cl::Event> *events, cl::Event *event)
+{
+    MLSGPU_ASSERT(elements <= maxElements, std::length_error);
+    if (elements == 0)
+    {
+        if (event != NULL)
+            CLH::enqueueMarkerWithWaitList(queue, events, event);
+        return;
+    }
+
+    if (epoch == MAX_EPOCH)
+    {
+        // Flags from an old call could now look current, so start afresh
+        allocateStatus(maxElements);
+    }
+    epoch++;
+
+    const std::size_t tiles = divUp(elements, tileSize());
+    const std::size_t capacity = maxElements / tileSize();
+    kernel.setArg(0, buffer);
+    kernel.setArg(1, cl_uint(elements));
+    if (components == 1)
+        kernel.setArg(2, offset != NULL ? offset[0] : cl_uint(0));
+    else
+    {
+        cl_uint2 offset2 = {{ 0, 0 }};
+        if (offset != NULL)
+        {
+            offset2.s[0] = offset[0];
+            offset2.s[1] = offset[1];
+        }
+        kernel.setArg(2, offset2);
+    }
+    kernel.setArg(3, status);
+    kernel.setArg(4, cl_uint(capacity));
+    kernel.setArg(5, epoch);
+    kernel.setArg(6, CLH_LOCAL(tileSize() * components * sizeof(cl_uint)));
+    kernel.setArg(7, CLH_LOCAL(workGroupSize * components * sizeof(cl_uint)));
+
+    cl::Event last;
+    CLH::enqueueNDRangeKernel(queue, kernel,
+                              cl::NullRange,
+                              cl::NDRange(tiles * workGroupSize),
+                              cl::NDRange(workGroupSize),
+                              events, &last);
+    if (eventCallback != NULL)
+        eventCallback(last, eventCallbackUserData);
+    if (event != NULL)
+        *event = last;
+}
+
+CLH::ResourceUsage ScanCL::resourceUsage(std::size_t maxElements, unsigned int components)
+{
+    const std::size_t tiles = divUp(std::max(maxElements, std::size_t(1)),
+                                    std::size_t(MAX_WORK_GROUP_SIZE * ITEMS_PER_WORK_ITEM));
+    CLH::ResourceUsage ans;
+    ans.addBuffer("scanStatus", statusWords(tiles, components) * sizeof(cl_uint));
+    return ans;
+}
@@ -0,0 +1,128 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Single-pass exclusive scan on the device.
+ */
+
+#ifndef SCAN_CL_H
+#define SCAN_CL_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <CL/cl.hpp>
+#include <cstddef>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include "clh.h"
+
+/**
+ * Exclusive scan of @c cl_uint or @c cl_uint2 values in place, in a single
+ * kernel launch. The arrays scanned by @ref Marching and @ref SplatTreeCL are
+ * often small, so the launch overhead of a multi-pass scan dominates; this
+ * class instead has each work-group find its prefix by looking back at the
+ * results published by earlier work-groups (see @ref scanSinglePass).
+ *
+ * The interface mirrors @c clogs::Scan. An instance holds state on the
+ * device between calls, so calls to @ref enqueue on the same instance must
+ * not execute concurrently (e.g. they can be made on a single in-order
+ * queue, or chained by events).
+ */
+class ScanCL : public boost::noncopyable
+{
+public:
+    /// Callback type for @ref setEventCallback
+    typedef void (CL_CALLBACK *EventCallback)(const cl::Event &event, void *userData);
+
+private:
+    cl::Context context;
+    cl::Kernel kernel;
+    unsigned int components;     ///< 1 for @c cl_uint, 2 for @c cl_uint2
+    std::size_t workGroupSize;   ///< Work-items per work-group
+    std::size_t maxElements;     ///< Largest scan supported by @ref status
+
+    /// Ticket counter, flags, aggregates and prefixes (see @ref scanSinglePass)
+    cl::Buffer status;
+    cl_uint epoch;               ///< Identifier for the most recent call
+
+    EventCallback eventCallback;
+    void *eventCallbackUserData;
+
+    /// Elements handled by one work-group
+    std::size_t tileSize() const;
+
+    /// Allocate a zeroed @ref status large enough for @a elements, and reset @ref epoch
+    void allocateStatus(std::size_t elements);
+
+public:
+    /// Number of elements handled by each work-item
+    static const unsigned int ITEMS_PER_WORK_ITEM = 4;
+    /// Work-items per work-group, if the device allows it
+    static const unsigned int MAX_WORK_GROUP_SIZE = 256;
+
+    /**
+     * Constructor. It compiles the kernel, so it can throw a compilation error.
+     *
+     * @param context      Context in which the scans will run.
+     * @param device       Device on which the scans will run.
+     * @param components   1 to scan @c cl_uint, or 2 to scan @c cl_uint2.
+     */
+    ScanCL(const cl::Context &context, const cl::Device &device, unsigned int components);
+
+    /**
+     * Allocate space to scan up to @a elements elements. The default is enough
+     * for a single work-group.
+     */
+    void reserve(std::size_t elements);
+
+    /**
+     * Set a function to be called with the event of each kernel launch, for
+     * profiling. Pass @c NULL to remove it.
+     */
+    void setEventCallback(EventCallback callback, void *userData);
+
+    /**
+     * Enqueue an exclusive scan of @a buffer in place.
+     *
+     * @param queue      Queue on which to enqueue the work.
+     * @param buffer     Values to scan.
+     * @param elements   Number of elements to scan.
+     * @param offset     If non-@c NULL, an array of @a components values added to every output.
+     * @param events     Events to wait for before starting (or @c NULL).
+     * @param[out] event Event that fires on completion (or @c NULL).
+     *
+     * @pre @a elements is at most the capacity requested by @ref reserve.
+     */
+    void enqueue(const cl::CommandQueue &queue, const cl::Buffer &buffer,
+                 std::size_t elements, const cl_uint *offset = NULL,
+                 const std::vector<cl::Event> *events = NULL, cl::Event *event = NULL);
+
+    /**
+     * Device memory needed to @ref reserve space for @a maxElements, assuming
+     * that the device allows the largest work-group size.
+     */
+    static CLH::ResourceUsage resourceUsage(std::size_t maxElements, unsigned int components);
+};
+
+#endif /* !SCAN_CL_H */
@@ -33,12 +33,17 @@
 #endif
 #include <mpi.h>
 #include <cassert>
+#include <cstddef>
+#include <climits>
+#include <stdexcept>
 #include "grid.h"
 #include "bucket.h"
 #include "tags.h"
 #include "serialize.h"
 #include "mesher.h"
 #include "mesh.h"
+#include "errors.h"
+#include "statistics.h"
 
 namespace
 {
@@ -177,11 +182,15 @@ namespace Serialize
 class Access
 {
 public:
-    static void send(const SplatSet::SubsetBase &subset, MPI_Comm comm, int dest);
-    static void recv(SplatSet::SubsetBase &subset, MPI_Comm comm, int source);
+    /// Upper bound on the bytes that @ref pack will use for @a subset
+    static int packSize(const SplatSet::SubsetBase &subset, MPI_Comm comm);
+    /// Append @a subset to a buffer for @c MPI_Pack
+    static void pack(const SplatSet::SubsetBase &subset, char *buffer, int size, int &position, MPI_Comm comm);
+    /// Extract a subset written by @ref pack from a buffer
+    static void unpack(SplatSet::SubsetBase &subset, const char *buffer, int size, int &position, MPI_Comm comm);
 };
 
-void send(const Grid &grid, MPI_Comm comm, int dest)
+static RawGrid toRaw(const Grid &grid)
 {
     RawGrid raw;
     raw.spacing = grid.getSpacing();
@@ -191,7 +200,20 @@ void send(const Grid &grid, MPI_Comm comm, int dest)
         raw.extents[2 * i] = grid.getExtent(i).first;
         raw.extents[2 * i + 1] = grid.getExtent(i).second;
     }
+    return raw;
+}
+
+static Grid fromRaw(const RawGrid &raw)
+{
+    return Grid(raw.reference, raw.spacing,
+                raw.extents[0], raw.extents[1],
+                raw.extents[2], raw.extents[3],
+                raw.extents[4], raw.extents[5]);
+}
 
+void send(const Grid &grid, MPI_Comm comm, int dest)
+{
+    RawGrid raw = toRaw(grid);
     MPI_Send(&raw, 1, gridType, dest, MLSGPU_TAG_WORK, comm);
 }
 
@@ -199,11 +221,7 @@ void recv(Grid &grid, MPI_Comm comm, int source)
 {
     RawGrid raw;
     MPI_Recv(&raw, 1, gridType, source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
-
-    grid = Grid(raw.reference, raw.spacing,
-                raw.extents[0], raw.extents[1],
-                raw.extents[2], raw.extents[3],
-                raw.extents[4], raw.extents[5]);
+    grid = fromRaw(raw);
 }
 
 void send(const ChunkIdPod &chunkId, MPI_Comm comm, int dest)
@@ -216,17 +234,50 @@ void recv(ChunkIdPod &chunkId, MPI_Comm comm, int source)
     MPI_Recv(&chunkId, 1, chunkIdType, source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
 }
 
+/**
+ * Receive a message that was sent as @c MPI_PACKED, whatever its size.
+ *
+ * @param buffer       Storage for the message, resized to fit.
+ * @param comm, source Origin of the message.
+ * @return The number of bytes in the message.
+ */
+static int recvPacked(Statistics::Container::vector<char> &buffer, MPI_Comm comm, int source)
+{
+    MPI_Status status;
+    int size;
+    MPI_Probe(source, MLSGPU_TAG_WORK, comm, &status);
+    MPI_Get_count(&status, MPI_PACKED, &size);
+    buffer.resize(size);
+    MPI_Recv(&buffer[0], size, MPI_PACKED, status.MPI_SOURCE, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+    return size;
+}
+
 void send(const SplatSet::SubsetBase &subset, MPI_Comm comm, int dest)
 {
-    Access::send(subset, comm, dest);
+    int size = Access::packSize(subset, comm);
+    Statistics::Container::vector<char> buffer("mem.Serialize.buffer", size);
+    int position = 0;
+    Access::pack(subset, &buffer[0], size, position, comm);
+    MPI_Send(&buffer[0], position, MPI_PACKED, dest, MLSGPU_TAG_WORK, comm);
 }
 
 void recv(SplatSet::SubsetBase &subset, MPI_Comm comm, int source)
 {
-    Access::recv(subset, comm, source);
+    Statistics::Container::vector<char> buffer("mem.Serialize.buffer");
+    int size = recvPacked(buffer, comm, source);
+    int position = 0;
+    Access::unpack(subset, &buffer[0], size, position, comm);
 }
 
-void Access::send(const SplatSet::SubsetBase &subset, MPI_Comm comm, int dest)
+int Access::packSize(const SplatSet::SubsetBase &subset, MPI_Comm comm)
+{
+    int metadataSize, rangesSize;
+    MPI_Pack_size(1, subsetMetadataType, comm, &metadataSize);
+    MPI_Pack_size(subset.splatRanges.size(), mpi_type_traits<std::tr1::uint32_t>::type(), comm, &rangesSize);
+    return metadataSize + rangesSize;
+}
+
+void Access::pack(const SplatSet::SubsetBase &subset, char *buffer, int size, int &position, MPI_Comm comm)
 {
     SubsetMetadata metadata;
     metadata.size = subset.splatRanges.size();
@@ -235,38 +286,105 @@ void Access::send(const SplatSet::SubsetBase &subset, MPI_Comm comm, int dest)
     metadata.prev = subset.prev;
     metadata.nSplats = subset.nSplats;
     metadata.nRanges = subset.nRanges;
-    MPI_Send(&metadata, 1, subsetMetadataType, dest, MLSGPU_TAG_WORK, comm);
-    MPI_Send(const_cast<std::tr1::uint32_t *>(&subset.splatRanges[0]),
-             subset.splatRanges.size(), mpi_type_traits<std::tr1::uint32_t>::type(),
-             dest, MLSGPU_TAG_WORK, comm);
+    MPI_Pack(&metadata, 1, subsetMetadataType, buffer, size, &position, comm);
+    if (metadata.size > 0)
+        MPI_Pack(const_cast<std::tr1::uint32_t *>(&subset.splatRanges[0]),
+                 metadata.size, mpi_type_traits<std::tr1::uint32_t>::type(),
+                 buffer, size, &position, comm);
 }
 
-void Access::recv(SplatSet::SubsetBase &subset, MPI_Comm comm, int source)
+void Access::unpack(SplatSet::SubsetBase &subset, const char *buffer, int size, int &position, MPI_Comm comm)
 {
     SubsetMetadata metadata;
-    MPI_Recv(&metadata, 1, subsetMetadataType, source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+    char *in = const_cast<char *>(buffer);
+    MPI_Unpack(in, size, &position, &metadata, 1, subsetMetadataType, comm);
     subset.splatRanges.resize(metadata.size);
     subset.first = metadata.first;
     subset.last = metadata.last;
     subset.prev = metadata.prev;
     subset.nSplats = metadata.nSplats;
     subset.nRanges = metadata.nRanges;
-    MPI_Recv(&subset.splatRanges[0], metadata.size, mpi_type_traits<std::tr1::uint32_t>::type(),
-             source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+    if (metadata.size > 0)
+        MPI_Unpack(in, size, &position, &subset.splatRanges[0], metadata.size,
+                   mpi_type_traits<std::tr1::uint32_t>::type(), comm);
 }
 
 void send(const BucketCollector::Bin &bin, MPI_Comm comm, int dest)
 {
-    send(bin.ranges, comm, dest);
-    send(bin.chunkId, comm, dest);
-    send(bin.grid, comm, dest);
+    send(&bin, 1, comm, dest);
 }
 
 void recv(BucketCollector::Bin &bin, MPI_Comm comm, int source)
 {
-    recv(bin.ranges, comm, source);
-    recv(bin.chunkId, comm, source);
-    recv(bin.grid, comm, source);
+    recv(&bin, 1, comm, source);
+}
+
+void send(const BucketCollector::Bin *bins, std::size_t numBins, MPI_Comm comm, int dest)
+{
+    int countSize, chunkIdSize, gridSize;
+    MPI_Pack_size(1, mpi_type_traits<std::size_t>::type(), comm, &countSize);
+    MPI_Pack_size(1, chunkIdType, comm, &chunkIdSize);
+    MPI_Pack_size(1, gridType, comm, &gridSize);
+    int size = countSize;
+    for (std::size_t i = 0; i < numBins; i++)
+        size += Access::packSize(bins[i].ranges, comm) + chunkIdSize + gridSize;
+
+    Statistics::Container::vector<char> buffer("mem.Serialize.buffer", size);
+    int position = 0;
+    MPI_Pack(&numBins, 1, mpi_type_traits<std::size_t>::type(), &buffer[0], size, &position, comm);
+    for (std::size_t i = 0; i < numBins; i++)
+    {
+        RawGrid raw = toRaw(bins[i].grid);
+        Access::pack(bins[i].ranges, &buffer[0], size, position, comm);
+        MPI_Pack(const_cast<ChunkIdPod *>(static_cast<const ChunkIdPod *>(&bins[i].chunkId)),
+                 1, chunkIdType, &buffer[0], size, &position, comm);
+        MPI_Pack(&raw, 1, gridType, &buffer[0], size, &position, comm);
+    }
+    MPI_Send(&buffer[0], position, MPI_PACKED, dest, MLSGPU_TAG_WORK, comm);
+}
+
+void recv(BucketCollector::Bin *bins, std::size_t numBins, MPI_Comm comm, int source)
+{
+    Statistics::Container::vector<char> buffer("mem.Serialize.buffer");
+    int size = recvPacked(buffer, comm, source);
+    int position = 0;
+    std::size_t sent;
+    MPI_Unpack(&buffer[0], size, &position, &sent, 1, mpi_type_traits<std::size_t>::type(), comm);
+    MLSGPU_ASSERT(sent == numBins, std::length_error);
+    for (std::size_t i = 0; i < numBins; i++)
+    {
+        RawGrid raw;
+        ChunkIdPod &chunkId = bins[i].chunkId;
+        Access::unpack(bins[i].ranges, &buffer[0], size, position, comm);
+        MPI_Unpack(&buffer[0], size, &position, &chunkId, 1, chunkIdType, comm);
+        MPI_Unpack(&buffer[0], size, &position, &raw, 1, gridType, comm);
+        bins[i].grid = fromRaw(raw);
+    }
+}
+
+/**
+ * Create a datatype that describes a whole @ref MesherWork message relative
+ * to @c MPI_BOTTOM: the chunk ID, the three mesh sizes and the mesh data.
+ * The caller must free it with @c MPI_Type_free.
+ *
+ * @param chunkId   Location of the chunk ID.
+ * @param sizes     Location of the vertex, triangle and internal vertex counts.
+ * @param data      Location of the mesh data.
+ * @param dataBytes Number of bytes at @a data.
+ */
+static MPI_Datatype makeMesherWorkType(ChunkIdPod *chunkId, std::size_t *sizes, void *data, int dataBytes)
+{
+    int lengths[3] = {1, 3, dataBytes};
+    MPI_Aint displacements[3];
+    MPI_Datatype types[3] = { chunkIdType, mpi_type_traits<std::size_t>::type(), MPI_BYTE };
+    MPI_Get_address(chunkId, &displacements[0]);
+    MPI_Get_address(sizes, &displacements[1]);
+    MPI_Get_address(data, &displacements[2]);
+
+    MPI_Datatype type;
+    MPI_Type_create_struct(3, lengths, displacements, types, &type);
+    MPI_Type_commit(&type);
+    return type;
 }
 
 void send(const MesherWork &work, MPI_Comm comm, int dest)
@@ -278,23 +396,26 @@ void send(const MesherWork &work, MPI_Comm comm, int dest)
         work.mesh.numInternalVertices()
     };
 
-    send(work.chunkId, comm, dest);
-    MPI_Send(&sizes, 3, mpi_type_traits<std::size_t>::type(), dest, MLSGPU_TAG_WORK, comm);
+    /* The arrays are sent as a single block, so they must have the layout
+     * created by HostKeyMesh::HostKeyMesh(void *, const MeshSizes &).
+     */
+    char *base = reinterpret_cast<char *>(work.mesh.vertexKeys);
+    MLSGPU_ASSERT(reinterpret_cast<char *>(work.mesh.vertices)
+                  == base + work.mesh.numExternalVertices() * sizeof(cl_ulong), std::invalid_argument);
+    MLSGPU_ASSERT(reinterpret_cast<char *>(work.mesh.triangles)
+                  == reinterpret_cast<char *>(work.mesh.vertices + work.mesh.numVertices()), std::invalid_argument);
 
     if (work.hasEvents)
+    {
         work.trianglesEvent.wait();
-    MPI_Send(const_cast<cl_uint *>(&work.mesh.triangles[0][0]), 3 * work.mesh.numTriangles(),
-             mpi_type_traits<cl_uint>::type(), dest, MLSGPU_TAG_WORK, comm);
-
-    if (work.hasEvents)
         work.vertexKeysEvent.wait();
-    MPI_Send(const_cast<cl_ulong *>(&work.mesh.vertexKeys[0]), work.mesh.numExternalVertices(),
-             mpi_type_traits<cl_ulong>::type(), dest, MLSGPU_TAG_WORK, comm);
-
-    if (work.hasEvents)
         work.verticesEvent.wait();
-    MPI_Send(const_cast<cl_float *>(&work.mesh.vertices[0][0]), 3 * work.mesh.numVertices(),
-             mpi_type_traits<cl_float>::type(), dest, MLSGPU_TAG_WORK, comm);
+    }
+
+    ChunkIdPod chunkId = work.chunkId;
+    MPI_Datatype type = makeMesherWorkType(&chunkId, sizes, base, work.mesh.getHostBytes());
+    MPI_Send(MPI_BOTTOM, 1, type, dest, MLSGPU_TAG_WORK, comm);
+    MPI_Type_free(&type);
 }
 
 void recv(MesherWork &work, void *ptr, MPI_Comm comm, int source)
@@ -305,18 +426,49 @@ void recv(MesherWork &work, void *ptr, MPI_Comm comm, int source)
     work.trianglesEvent = cl::Event();
     work.vertexKeysEvent = cl::Event();
 
-    recv(work.chunkId, comm, source);
+    /* The size of the mesh is only known once it arrives, so the receive
+     * type allows for any size. Only the bytes actually sent are written.
+     */
     std::size_t sizes[3];
-    MPI_Recv(&sizes, 3, mpi_type_traits<std::size_t>::type(),
-             source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+    ChunkIdPod &chunkId = work.chunkId;
+    MPI_Datatype type = makeMesherWorkType(&chunkId, sizes, ptr, INT_MAX);
+    MPI_Recv(MPI_BOTTOM, 1, type, source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+    MPI_Type_free(&type);
 
     work.mesh = HostKeyMesh(ptr, MeshSizes(sizes[0], sizes[1], sizes[2]));
-    MPI_Recv(&work.mesh.triangles[0][0], 3 * work.mesh.numTriangles(),
-             mpi_type_traits<cl_uint>::type(), source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
-    MPI_Recv(&work.mesh.vertexKeys[0], work.mesh.numExternalVertices(),
-             mpi_type_traits<cl_ulong>::type(), source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
-    MPI_Recv(&work.mesh.vertices[0][0], 3 * work.mesh.numVertices(),
-             mpi_type_traits<cl_float>::type(), source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
+}
+
+/// Bytes at the start of the buffer passed to @ref irecv that hold the mesh sizes
+static const std::size_t irecvHeaderBytes = 3 * sizeof(std::size_t);
+
+std::size_t irecvBytes(const MesherWork &work)
+{
+    return irecvHeaderBytes + work.mesh.getHostBytes();
+}
+
+void irecv(MesherWork &work, void *ptr, std::size_t bytes, MPI_Comm comm, int source, MPI_Request *requests)
+{
+    MLSGPU_ASSERT(bytes >= irecvHeaderBytes, std::invalid_argument);
+
+    work.hasEvents = false;
+    work.verticesEvent = cl::Event();
+    work.trianglesEvent = cl::Event();
+    work.vertexKeysEvent = cl::Event();
+
+    char *base = static_cast<char *>(ptr);
+    ChunkIdPod &chunkId = work.chunkId;
+    MPI_Datatype type = makeMesherWorkType(&chunkId, static_cast<std::size_t *>(ptr),
+                                           base + irecvHeaderBytes, bytes - irecvHeaderBytes);
+    MPI_Irecv(MPI_BOTTOM, 1, type, source, MLSGPU_TAG_WORK, comm, &requests[0]);
+    // The pending receive keeps its own reference to the type
+    MPI_Type_free(&type);
+}
+
+void irecvComplete(MesherWork &work, void *ptr)
+{
+    const std::size_t *sizes = static_cast<const std::size_t *>(ptr);
+    work.mesh = HostKeyMesh(static_cast<char *>(ptr) + irecvHeaderBytes,
+                            MeshSizes(sizes[0], sizes[1], sizes[2]));
 }
 
 void broadcast(std::string &str, MPI_Comm comm, int root)
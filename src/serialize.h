@@ -37,17 +37,20 @@
 class Grid;
 struct ChunkId;
 struct MesherWork;
-struct Splat;
 namespace Bucket { struct Recursion; }
 namespace SplatSet { class SubsetBase; }
 
 /**
  * Transmission of assorted data structures through MPI.
  *
- * Each of the @c send functions sends one object to a single destination,
- * while the @c recv functions can receive from either a named destination or
- * @c MPI_ANY_SOURCE. The sends are all blocking standard-mode. All communications
- * use @ref MLSGPU_TAG_WORK.
+ * Each of the @c send functions sends one object (or an array of them) to a
+ * single destination, while the @c recv functions can receive from either a
+ * named destination or @c MPI_ANY_SOURCE. The sends are all blocking
+ * standard-mode. All communications use @ref MLSGPU_TAG_WORK.
+ *
+ * Composite objects (subsets, bins and mesher work) are each transmitted as a
+ * single message, either packed with @c MPI_Pack or described by a derived
+ * datatype, so that the cost per object is one message latency.
  *
  * Before using any of the @c send or @c recv functions, one must first call
  * @ref init.
@@ -150,23 +153,54 @@ void recv(Grid &grid, MPI_Comm comm, int source);
 void send(const ChunkIdPod &chunkId, MPI_Comm comm, int dest);
 void recv(ChunkIdPod &chunkId, MPI_Comm comm, int source);
 
-void send(const Splat *splats, std::size_t numSplats, MPI_Comm comm, int dest);
-void recv(Splat *splats, std::size_t numSplats, MPI_Comm comm, int source);
-
 void send(const SplatSet::SubsetBase &subset, MPI_Comm comm, int dest);
 void recv(SplatSet::SubsetBase &subset, MPI_Comm comm, int source);
 
 void send(const BucketCollector::Bin &bin, MPI_Comm comm, int dest);
 void recv(BucketCollector::Bin &bin, MPI_Comm comm, int source);
 
+/**
+ * Send an array of bins as a single message.
+ */
+void send(const BucketCollector::Bin *bins, std::size_t numBins, MPI_Comm comm, int dest);
+/**
+ * Receive an array of bins sent with the corresponding @ref send. The
+ * number of bins must have already been communicated.
+ *
+ * @throw std::length_error if the sender sent a different number of bins.
+ */
+void recv(BucketCollector::Bin *bins, std::size_t numBins, MPI_Comm comm, int source);
+
 void send(const MesherWork &work, MPI_Comm comm, int dest);
 /**
  * Receive @ref MesherWork. The number of bytes required must have already
  * been communicated and used to allocate a suitable large buffer to hold
- * the mesh data.
+ * the mesh data. The mesh data is placed at the start of @a ptr.
  */
 void recv(MesherWork &work, void *ptr, MPI_Comm comm, int source);
 
+/**
+ * Number of bytes of storage that @ref irecv needs to receive @a work. This is
+ * slightly more than the mesh itself.
+ */
+std::size_t irecvBytes(const MesherWork &work);
+
+/**
+ * Start a non-blocking receive of @ref MesherWork sent with @ref send. Once
+ * all the requests have completed, @ref irecvComplete must be called before
+ * using @a work.
+ *
+ * @param work         Work item to receive.
+ * @param ptr          Storage for the mesh, which must be aligned for @c cl_ulong.
+ * @param bytes        Size of @a ptr, at least @ref irecvBytes of the sent item.
+ * @param comm, source Origin of the message.
+ * @param[out] requests One request for the receive.
+ */
+void irecv(MesherWork &work, void *ptr, std::size_t bytes, MPI_Comm comm, int source, MPI_Request *requests);
+
+/// Finish a receive started with @ref irecv.
+void irecvComplete(MesherWork &work, void *ptr);
+
 /**
  * Broadcast a string to all ranks (like @c MPI_Bcast).
  */
@@ -31,6 +31,7 @@
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
+#include <boost/bind.hpp>
 #include <algorithm>
 #include <iosfwd>
 #include <utility>
@@ -39,6 +40,7 @@
 #include "errors.h"
 #include "misc.h"
 #include "timeplot.h"
+#include "thread_name.h"
 
 namespace SplatSet
 {
@@ -76,6 +78,12 @@ void splatToBuckets(const Splat &splat,
 SplatToBuckets::SplatToBuckets(float spacing, Grid::size_type bucketSize)
     : invSpacing(1.0f / spacing), divider(bucketSize)
 {
+    params.invSpacing = invSpacing;
+    params.negAdd = divider.getNegAdd();
+    params.posAdd = divider.getPosAdd();
+    params.inverse = divider.getInverse();
+    params.shift = divider.getShift();
+    batch = selectSplatToBucketsBatch();
 }
 
 void SplatToBuckets::operator()(
@@ -95,18 +103,77 @@ void SplatToBuckets::operator()(
 }
 #endif
 
+void SplatToBuckets::operator()(
+    const Splat *splats, std::size_t n,
+    boost::array<Grid::difference_type, 3> *lower,
+    boost::array<Grid::difference_type, 3> *upper) const
+{
+    if (batch != NULL)
+        batch(params, splats, n, lower, upper);
+    else
+    {
+        for (std::size_t i = 0; i < n; i++)
+            (*this)(splats[i], lower[i], upper[i]);
+    }
+}
+
 } // namespace detail
 
-BlobInfo SimpleBlobStream::operator*() const
+std::size_t BlobStream::read(BlobInfo *blobs, std::size_t count)
+{
+    std::size_t n = 0;
+    while (n < count && !empty())
+    {
+        blobs[n++] = **this;
+        ++*this;
+    }
+    return n;
+}
+
+const unsigned int BlobComputer::MAX_PENDING;
+
+const std::size_t SimpleBlobStream::READ_SPLATS;
+
+BlobInfo SimpleBlobStream::makeBlob(const Splat &splat, splat_id id) const
 {
-    MLSGPU_ASSERT(!empty(), state_error);
     BlobInfo ans;
-    ans.firstSplat = currentId;
-    ans.lastSplat = currentId + 1;
-    detail::splatToBuckets(current, grid, bucketSize, ans.lower, ans.upper);
+    ans.firstSplat = id;
+    ans.lastSplat = id + 1;
+    detail::splatToBuckets(splat, grid, bucketSize, ans.lower, ans.upper);
     return ans;
 }
 
+BlobInfo SimpleBlobStream::operator*() const
+{
+    MLSGPU_ASSERT(!empty(), state_error);
+    return makeBlob(current, currentId);
+}
+
+std::size_t SimpleBlobStream::read(BlobInfo *blobs, std::size_t count)
+{
+    if (count == 0 || empty())
+        return 0;
+
+    std::size_t n = 0;
+    blobs[n++] = makeBlob(current, currentId);
+    Splat splats[READ_SPLATS];
+    splat_id ids[READ_SPLATS];
+    while (n < count)
+    {
+        const std::size_t want = std::min(count - n, READ_SPLATS);
+        const std::size_t got = splatStream->read(splats, ids, want);
+        for (std::size_t i = 0; i < got; i++)
+            blobs[n++] = makeBlob(splats[i], ids[i]);
+        if (got < want)
+        {
+            current.radius = -1.0f; // the splat stream is exhausted
+            return n;
+        }
+    }
+    ++*this; // prime the next blob
+    return n;
+}
+
 BlobStream &SimpleBlobStream::operator++()
 {
     std::size_t n = splatStream->read(&current, &currentId, 1);
@@ -127,9 +194,20 @@ const std::size_t FileSet::maxFileSplats = FileSet::splatIdMask;
 void FileSet::addFile(FastPly::Reader *file)
 {
     files.push_back(file);
+    file->setCache(readerCache.get());
     nSplats += file->size();
 }
 
+void FileSet::setOpenFiles(std::size_t openFiles)
+{
+    if (openFiles > 0)
+        readerCache.reset(new FastPly::ReaderCache(openFiles));
+    else
+        readerCache.reset();
+    for (std::size_t i = 0; i < files.size(); i++)
+        files[i].setCache(readerCache.get());
+}
+
 std::pair<splat_id, splat_id> FileSet::partition(int rank, int size) const
 {
     // First determine the rank as indices into the list of splats. There are
@@ -158,12 +236,92 @@ std::pair<splat_id, splat_id> FileSet::partition(int rank, int size) const
     return std::make_pair(ans[0], ans[1]);
 }
 
+std::pair<std::size_t, std::size_t> FileSet::partitionFiles(int rank, int size) const
+{
+    MLSGPU_ASSERT(0 <= rank && rank < size, std::invalid_argument);
+    const splat_id firstPos = mulDiv(nSplats, rank, size);
+    const splat_id lastPos = mulDiv(nSplats, rank + 1, size);
+
+    // Position of the first splat of the current file, as an index
+    splat_id pos = 0;
+    std::size_t first = 0;
+    while (first < files.size() && pos < firstPos)
+        pos += files[first++].size();
+    std::size_t last = first;
+    while (last < files.size() && (pos < lastPos || rank == size - 1))
+        pos += files[last++].size();
+    return std::make_pair(first, last);
+}
+
 FileSet::ReaderThreadBase::ReaderThreadBase(const FileSet &owner) :
     owner(owner), outQueue(), buffer("mem.FileSet.ReaderThread.buffer", owner.bufferSize),
-    tworker("reader")
+    tworker("reader"), nextSeq(0)
 {
 }
 
+void FileSet::ReaderThreadBase::startJobThreads(std::size_t numThreads)
+{
+    for (std::size_t i = 0; i < numThreads; i++)
+        jobThreads.create_thread(boost::bind(&ReaderThreadBase::readJobs, this, int(i)));
+}
+
+void FileSet::ReaderThreadBase::stopJobThreads()
+{
+    jobQueue.stop();
+    jobThreads.join_all();
+}
+
+void FileSet::ReaderThreadBase::readJobs(int idx)
+{
+    thread_set_name("reader");
+    Timeplot::Worker jobWorker("reader", idx);
+    Statistics::Variable &readTimeStat = Statistics::getStatistic<Statistics::Histogram>("files.read.time");
+    Statistics::Variable &readMergedStat = Statistics::getStatistic<Statistics::Variable>("files.read.merged");
+
+    boost::scoped_ptr<FastPly::Reader::Handle> handle;
+    std::size_t handleId = 0;
+    while (true)
+    {
+        boost::shared_ptr<Job> job = jobQueue.pop();
+        if (!job)
+            break;
+        const FastPly::Reader &file = owner.files[job->fileId];
+        {
+            Timeplot::Action readTimer("load", jobWorker, readTimeStat);
+            if (job->local)
+            {
+                if (!handle || handleId != job->fileId)
+                {
+                    handle.reset(); // close the old handle
+                    handle.reset(new FastPly::Reader::Handle(file));
+                    handleId = job->fileId;
+                }
+                handle->readRaw(job->start, job->end, job->raw);
+            }
+            else
+                owner.remoteReader->readRaw(job->fileId, job->start, job->end, job->raw);
+        }
+        readMergedStat.add(job->end - job->start);
+
+        {
+            Timeplot::Action decodeTimer("decode", jobWorker);
+            file.decode(job->raw, 0, job->end - job->start, job->splats);
+        }
+
+        // Hand the items on in the order the jobs were created
+        {
+            Timeplot::Action pushTimer("push", jobWorker);
+            boost::unique_lock<boost::mutex> lock(orderMutex);
+            while (nextSeq != job->seq)
+                orderCond.wait(lock);
+            for (std::size_t i = 0; i < job->items.size(); i++)
+                outQueue.push(job->items[i]);
+            nextSeq++;
+        }
+        orderCond.notify_all();
+    }
+}
+
 void FileSet::ReaderThreadBase::free(const Item &item)
 {
     if (item.alloc)
@@ -205,19 +363,29 @@ std::size_t FileSet::MySplatStream::read(Splat *splats, splat_id *splatIds, std:
         const std::size_t fileId = curItem.first >> scanIdShift;
         const FastPly::Reader &file = owner.files[fileId];
 
-        // Try a parallel load + decode, and fall back if there are non-finites
+        /* Try a parallel load + decode, and fall back if there are non-finites.
+         * Decoding in blocks lets the reader use its layout-specific decoder.
+         */
+        enum { DECODE_BLOCK = 1024 };
         const std::size_t n = std::min(curItem.last - pos, (splat_id) count);
         const std::size_t offset = pos - curItem.first;
         bool nonFinite = false;
 #ifdef _OPENMP
 #pragma omp parallel for schedule(static) if (useOMP && n > 16384) reduction(||:nonFinite) shared(file, splats, splatIds) default(none)
 #endif
-        for (std::size_t i = 0; i < n; i++)
+        for (std::size_t i = 0; i < n; i += DECODE_BLOCK)
         {
-            splats[i] = file.decode(curItem.ptr, offset + i);
-            if (splatIds != NULL)
-                splatIds[i] = pos + i;
-            nonFinite = nonFinite || !splats[i].isFinite();
+            const std::size_t m = std::min(n - i, std::size_t(DECODE_BLOCK));
+            if (curItem.splats != NULL)
+                std::copy(curItem.splats + offset + i, curItem.splats + offset + i + m, splats + i);
+            else
+                file.decode(curItem.ptr, offset + i, m, splats + i);
+            for (std::size_t j = i; j < i + m; j++)
+            {
+                if (splatIds != NULL)
+                    splatIds[j] = pos + j;
+                nonFinite = nonFinite || !splats[j].isFinite();
+            }
         }
 
         std::size_t p;
@@ -270,6 +438,14 @@ void SubsetBase::flush()
             encoded |= std::tr1::uint32_t(1) << 31;
             splatRanges.push_back(encoded);
         }
+        else if (first - prev < (UINT64_C(1) << 28)
+                 && last - first < (1 << 20))
+        {
+            std::tr1::uint32_t gap = first - prev;
+            std::tr1::uint32_t length = last - first;
+            splatRanges.push_back((std::tr1::uint32_t(1) << 31) | (gap >> 12));
+            splatRanges.push_back(((gap & 0xFFF) << 20) | length);
+        }
         else
         {
             splatRanges.push_back(first >> 32);
@@ -322,10 +498,21 @@ void SubsetBase::const_iterator::increment()
 {
     if (*pos & (std::tr1::uint32_t(1) << 31))
     {
-        // Differential
-        prev += (*pos) & 0xFFFF;
-        prev += (*pos >> 16) & 0x7FFF;
-        ++pos;
+        if (*pos & 0x7FFF0000)
+        {
+            // Differential
+            prev += (*pos) & 0xFFFF;
+            prev += (*pos >> 16) & 0x7FFF;
+            ++pos;
+        }
+        else
+        {
+            // Two-word differential
+            prev += splat_id(*pos & 0xFFFF) << 12;
+            ++pos;
+            prev += (*pos >> 20) + (*pos & 0xFFFFF);
+            ++pos;
+        }
     }
     else
     {
@@ -348,9 +535,19 @@ std::pair<splat_id, splat_id> SubsetBase::const_iterator::dereference() const
 {
     if (*pos & (std::tr1::uint32_t(1) << 31))
     {
-        // Differential
-        splat_id offset = *pos & 0xFFFF;
-        splat_id length = (*pos >> 16) & 0x7FFF;
+        splat_id offset, length;
+        if (*pos & 0x7FFF0000)
+        {
+            // Differential
+            offset = *pos & 0xFFFF;
+            length = (*pos >> 16) & 0x7FFF;
+        }
+        else
+        {
+            // Two-word differential
+            offset = (splat_id(*pos & 0xFFFF) << 12) | (pos[1] >> 20);
+            length = pos[1] & 0xFFFFF;
+        }
         splat_id first = prev + offset;
         return std::make_pair(first, first + length);
     }
@@ -48,7 +48,10 @@
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/optional.hpp>
+#include <boost/exception_ptr.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include "grid.h"
@@ -56,6 +59,7 @@
 #include "splat.h"
 #include "errors.h"
 #include "fast_ply.h"
+#include "staging.h"
 #include "statistics.h"
 #include "logging.h"
 #include "work_queue.h"
@@ -172,6 +176,20 @@ public:
      * Determine whether there are any more blobs in the stream.
      */
     virtual bool empty() const = 0;
+
+    /**
+     * Read some number of blobs from the stream, advancing past them. As
+     * for @ref SplatStream::read, the buffer is always filled unless the
+     * stream runs out, so a short return value indicates end-of-stream.
+     *
+     * The default implementation is built on the single-blob functions.
+     * Subclasses override it to avoid a virtual call per blob.
+     *
+     * @param[out] blobs       Buffer to hold output blobs
+     * @param      count       Maximum number of blobs to read
+     * @return The number of blobs actually read.
+     */
+    virtual std::size_t read(BlobInfo *blobs, std::size_t count);
 };
 
 #ifdef DOXYGEN_FAKE_CODE
@@ -239,6 +257,14 @@ public:
      * for them must remain intact and unaltered until the stream is destroyed.
      */
     SplatStream *makeSplatStream(RangeIterator firstRange, RangeIterator lastRange, bool useOMP = false) const;
+
+    /**
+     * Partitions the range of splats into roughly equal-sized subranges.
+     * Calling this function with a fixed @a size and values of @a rank in
+     * [0, @a size) will return a sequence of ranges which together will
+     * cover all the splats, in sequence and without overlaps.
+     */
+    std::pair<splat_id, splat_id> partition(int rank, int size) const;
 };
 
 #endif // DOXYGEN_FAKE_CODE
@@ -270,6 +296,8 @@ public:
 
     virtual BlobStream &operator++();
 
+    virtual std::size_t read(BlobInfo *blobs, std::size_t count);
+
     virtual bool empty() const
     {
         return current.radius < 0.0f;
@@ -293,6 +321,12 @@ private:
     splat_id currentId;
     const Grid grid;
     Grid::size_type bucketSize;
+
+    /// Number of splats pulled from the splat stream at a time by @ref read
+    static const std::size_t READ_SPLATS = 256;
+
+    /// Blob holding just @a splat
+    BlobInfo makeBlob(const Splat &splat, splat_id id) const;
 };
 
 /**
@@ -328,6 +362,11 @@ public:
         return new SimpleBlobStream(makeSplatStream(), grid, bucketSize);
     }
 
+    std::pair<splat_id, splat_id> partition(int rank, int size) const
+    {
+        return std::make_pair(mulDiv(maxSplats(), rank, size), mulDiv(maxSplats(), rank + 1, size));
+    }
+
     SequenceSet()
     {
     }
@@ -464,7 +503,15 @@ public:
          *
          * @see @ref setBufferSize
          */
-        DEFAULT_BUFFER_SIZE = 32 * 1024 * 1024
+        DEFAULT_BUFFER_SIZE = 32 * 1024 * 1024,
+
+        /**
+         * Default number of ranges for which the reader thread issues
+         * read-ahead hints.
+         *
+         * @see @ref setPrefetchRanges
+         */
+        DEFAULT_PREFETCH_RANGES = 16
     };
 
     /// Number of bits used to store the within-file splat ID
@@ -478,6 +525,29 @@ public:
     /// Maximum number of splats per file supported
     static const std::size_t maxFileSplats;
 
+    /**
+     * Source of raw vertex data for files that are not read directly, such
+     * as files owned by another MPI rank. Implementations must be thread-safe,
+     * since several streams may read at once.
+     */
+    class RemoteReader
+    {
+    public:
+        /// Virtual destructor to allow destruction via base class pointer
+        virtual ~RemoteReader() {}
+
+        /// Whether file @a fileId should be opened and read directly
+        virtual bool isLocal(std::size_t fileId) const = 0;
+
+        /**
+         * Read raw vertex data, with the same semantics as @ref FastPly::Reader::Handle::readRaw.
+         */
+        virtual void readRaw(
+            std::size_t fileId,
+            FastPly::Reader::size_type first, FastPly::Reader::size_type last,
+            char *buffer) = 0;
+    };
+
     /**
      * Append a new file to the set. The set takes over ownership of the file.
      * This must not be called while a stream is in progress.
@@ -514,6 +584,30 @@ public:
      */
     std::pair<splat_id, splat_id> partition(int rank, int size) const;
 
+    /**
+     * Partitions the files into contiguous ranges with roughly equal numbers
+     * of splats. A file belongs to the range of @ref partition that contains
+     * its first splat. As for @ref partition, the ranges for all values of
+     * @a rank in [0, @a size) cover all the files in sequence.
+     *
+     * @return The half-open range of file indices for @a rank.
+     */
+    std::pair<std::size_t, std::size_t> partitionFiles(int rank, int size) const;
+
+    /// Number of files in the set
+    std::size_t numFiles() const { return files.size(); }
+
+    /// Access a file in the set
+    const FastPly::Reader &getFile(std::size_t fileId) const { return files[fileId]; }
+
+    /**
+     * Set a source for files that should not be read directly. The remote
+     * reader is not owned by the set, and must persist for as long as streams
+     * might read from it. Passing @c NULL (the default) reads all files
+     * directly. The same thread-safety rules apply as for @ref setBufferSize.
+     */
+    void setRemoteReader(RemoteReader *remoteReader) { this->remoteReader = remoteReader; }
+
     /**
      * Set the buffer size that is used by the reader thread. It is not safe
      * to call this function at the same time as another thread creates a
@@ -525,7 +619,50 @@ public:
      */
     void setBufferSize(std::size_t bufferSize) { this->bufferSize = bufferSize; }
 
-    FileSet() : nSplats(0), bufferSize(DEFAULT_BUFFER_SIZE) {}
+    /**
+     * Set the number of upcoming ranges that the reader thread hints to the
+     * OS ahead of reading them, so that the disk stays busy while earlier
+     * ranges are being copied out. Adjacent ranges are coalesced into a
+     * single hint. A value of zero disables read-ahead. The same thread-safety
+     * rules apply as for @ref setBufferSize.
+     */
+    void setPrefetchRanges(std::size_t prefetchRanges) { this->prefetchRanges = prefetchRanges; }
+
+    /**
+     * Set the number of threads that read and decode the file data for each
+     * stream. With more than one, the ranges are read concurrently and
+     * decoded into splats by the reading threads, and the results are
+     * handed to the stream in order. The decoded splats share the read
+     * buffer, so fewer are in flight for a given buffer size (see
+     * @ref setBufferSize). The same thread-safety rules apply as for
+     * @ref setBufferSize.
+     *
+     * @pre @a readerThreads &gt; 0
+     */
+    void setReaderThreads(std::size_t readerThreads)
+    {
+        MLSGPU_ASSERT(readerThreads > 0, std::invalid_argument);
+        this->readerThreads = readerThreads;
+    }
+
+    /**
+     * Keep up to @a openFiles files open between reads, shared by all the
+     * reader threads of all streams, so that moving between files does not
+     * reopen them each time (see @ref FastPly::ReaderCache). Zero (the
+     * default) opens a file afresh whenever a reader moves to it. This must
+     * not be called while streams exist.
+     */
+    void setOpenFiles(std::size_t openFiles);
+
+    /**
+     * Give the set ownership of a @ref StagingCache, so that it lives as long
+     * as the files that read through it. The files must be added after this.
+     */
+    void setStagingCache(StagingCache *cache) { stagingCache.reset(cache); }
+
+    FileSet()
+        : nSplats(0), bufferSize(DEFAULT_BUFFER_SIZE), prefetchRanges(DEFAULT_PREFETCH_RANGES),
+        readerThreads(1), remoteReader(NULL) {}
 
 private:
     /**
@@ -553,18 +690,41 @@ private:
              */
             char *ptr;
 
+            /**
+             * If non-NULL, the splats already decoded from @ref ptr (see
+             * @ref FileSet::setReaderThreads). Non-finite splats are not
+             * removed.
+             */
+            const Splat *splats;
+
             /**
              * If non-empty, an allocation to free after processing the data.
              */
             boost::optional<CircularBuffer::Allocation> alloc;
 
-            Item() : first(0), last(0), ptr(NULL)
+            Item() : first(0), last(0), ptr(NULL), splats(NULL)
             {
             }
 
             std::size_t numSplats() const { return last - first; }
         };
     protected:
+        /**
+         * A merged read of a contiguous range of one file, together with the
+         * items that are carved out of it. Used when there are several
+         * reader threads.
+         */
+        struct Job
+        {
+            std::size_t seq;                        ///< Position in the sequence of jobs
+            std::size_t fileId;                     ///< File to read
+            FastPly::Reader::size_type start, end;  ///< Vertex range within the file
+            bool local;                             ///< Whether to read the file directly
+            char *raw;                              ///< Destination for the raw data
+            Splat *splats;                          ///< Destination for the decoded splats
+            std::vector<Item> items;                ///< Items to push once read
+        };
+
         const FileSet &owner;   ///< Owning splat stream
         /**
          * Queue of splat ranges as they're read. This will produce a stream of
@@ -575,6 +735,22 @@ private:
         CircularBuffer buffer;
         Timeplot::Worker tworker;
 
+        /// Jobs waiting for a reader thread (only used with several reader threads)
+        WorkQueue<boost::shared_ptr<Job> > jobQueue;
+        boost::thread_group jobThreads;  ///< Threads running @ref readJobs
+        boost::mutex orderMutex;         ///< Protects @ref nextSeq
+        boost::condition_variable orderCond; ///< Signalled when @ref nextSeq changes
+        std::size_t nextSeq;             ///< Sequence number of the next job to push its items
+
+        /// Start the threads that service @ref jobQueue
+        void startJobThreads(std::size_t numThreads);
+
+        /// Wait for all queued jobs to be pushed, and join the threads
+        void stopJobThreads();
+
+        /// Thread function for the threads started by @ref startJobThreads
+        void readJobs(int idx);
+
     public:
         explicit ReaderThreadBase(const FileSet &owner);
 
@@ -640,6 +816,9 @@ private:
         const bool useOMP;              ///< Whether to use OpenMP for acceleration
     };
 
+    /// Cache used by the files, declared first so that it outlives them (see @ref setStagingCache)
+    boost::scoped_ptr<StagingCache> stagingCache;
+
     /// Backing store of files
     boost::ptr_vector<FastPly::Reader> files;
 
@@ -648,6 +827,69 @@ private:
 
     /// Buffer sized used by streams
     std::size_t bufferSize;
+
+    /// Number of ranges to hint ahead of the current read
+    std::size_t prefetchRanges;
+
+    /// Number of threads reading for each stream (see @ref setReaderThreads)
+    std::size_t readerThreads;
+
+    /// Source for files that are not read directly (see @ref setRemoteReader)
+    RemoteReader *remoteReader;
+
+    /// Pool of open files shared by the streams (see @ref setOpenFiles)
+    boost::scoped_ptr<FastPly::ReaderCache> readerCache;
+};
+
+/**
+ * Interface for offloading the per-splat work of @ref FastBlobSet::computeBlobs
+ * to another processor (see @ref BlobComputerCL). For each batch of splats,
+ * it computes the bucket ranges, merges runs of consecutive splats with the
+ * same range into blobs, and reduces the bounding box. The caller only has
+ * to encode and write the blobs.
+ *
+ * Batches are submitted with @ref enqueue and their results collected in
+ * the same order with @ref dequeue, so that the next batch can be read
+ * while the previous one is being processed.
+ */
+class BlobComputer
+{
+public:
+    /// Maximum number of batches that may be enqueued but not yet dequeued
+    static const unsigned int MAX_PENDING = 2;
+
+    /// Largest number of splats accepted by one call to @ref enqueue
+    virtual std::size_t maxSplats() const = 0;
+
+    /**
+     * Set the grid spacing and bucket size for the following batches, and
+     * discard any batches that were not dequeued.
+     */
+    virtual void start(float spacing, Grid::size_type bucketSize) = 0;
+
+    /**
+     * Begin processing a batch of splats. The arrays must not be modified
+     * until the batch has been dequeued.
+     *
+     * @param splats   Splats to process, which must all be finite.
+     * @param ids      The ID of each splat.
+     * @param n        Number of splats (at least one and at most @ref maxSplats).
+     * @pre Fewer than @ref MAX_PENDING batches are pending.
+     */
+    virtual void enqueue(const Splat *splats, const splat_id *ids, std::size_t n) = 0;
+
+    /**
+     * Wait for the oldest pending batch and return its results.
+     *
+     * @param[out] blobs       The blobs of the batch, in splat order.
+     * @param[out] bbox        Bounding box of the splats in the batch.
+     * @param[out] incidence   Sum over the splats of the number of buckets each touches.
+     * @pre At least one batch is pending.
+     */
+    virtual void dequeue(std::vector<BlobInfo> &blobs, detail::Bbox &bbox,
+                         std::tr1::uint64_t &incidence) = 0;
+
+    virtual ~BlobComputer() {}
 };
 
 /**
@@ -732,6 +974,8 @@ public:
             return curBlob.firstSplat > curBlob.lastSplat;
         }
 
+        virtual std::size_t read(BlobInfo *out, std::size_t count);
+
         MyBlobStream(const FastBlobSet<Base> &owner, const Grid &grid,
                      Grid::size_type bucketSize);
 
@@ -747,28 +991,67 @@ public:
          * blob data, in units of @a owner.internalBucketSize.
          */
         Grid::difference_type offset[3];
-        /// Number of blobs still in the iostream
+        /// Number of blobs in the current file that are not yet decoded
         std::tr1::uint64_t remaining;
         /**
          * A blob to return from operator*, but prior to adjustment for @ref
-         * offset and @ref bucketDivider. It is also the base for differential
-         * encoding of the next blob.
+         * offset and @ref bucketDivider.
          *
          * In the special case firstSplat > lastSplat, the stream is empty.
          */
         BlobInfo curBlob;
+
+        /// Convert a decoded blob to the stream grid and bucket size
+        BlobInfo adjust(const BlobInfo &blob) const;
+
+        enum
+        {
+            BUFFER_WORDS = 64 * 1024,   ///< Size of @ref words
+            BLOCK_BLOBS = 4096          ///< Size of @ref blobs
+        };
+
         /**
-         * Input stream over the blob file. This may be a closed stream at
-         * the start and end of the blob stream.
+         * Raw words read from the file. The file is read in large blocks
+         * rather than a record at a time.
+         */
+        Statistics::Container::vector<std::tr1::uint32_t> words;
+        /**
+         * Raw words that are not yet decoded. They point either into
+         * @ref words or into the in-memory copy of the file (see @ref
+         * FastBlobSet::cacheBlobs).
+         */
+        const std::tr1::uint32_t *wordPos, *wordEnd;
+        /// Number of words of the current file not yet read into @ref words
+        std::tr1::uint64_t fileWords;
+
+        /// Blobs decoded in bulk by @ref decodeBlock, of which [@ref blobPos, @ref blobEnd) are still to be returned
+        Statistics::Container::vector<BlobInfo> blobs;
+        std::size_t blobPos, blobEnd;
+        /// Last blob decoded, which is the base for differential encoding of the next one
+        BlobInfo prevBlob;
+        /**
+         * Input stream over the blob file. This is closed at the start and
+         * end of the blob stream, and for files held in memory.
          */
         boost::filesystem::ifstream stream;
         /**
-         * Index corresponding to @ref stream. If @ref stream is closed, this
-         * is the number of the next file to read.
+         * Index of the current file. If @ref fileOpen is false, this is the
+         * number of the next file to read.
          */
         std::size_t curFile;
+        bool fileOpen;          ///< Whether @ref curFile is being decoded
 
         void refill(); ///< Load curBlob from the stream
+
+        /**
+         * Move the undecoded words to the front of @ref words and top it up
+         * from the file. This is only used for files that are not held in
+         * memory.
+         */
+        void loadWords();
+
+        /// Decode the next block of blobs from the current file into @ref blobs
+        void decodeBlock();
     };
 
     BlobStream *makeBlobStream(const Grid &grid, Grid::size_type bucketSize) const;
@@ -776,6 +1059,41 @@ public:
     /// Remove the temporary files holding the blobs, if any
     void eraseBlobFiles();
 
+    /**
+     * Hold the blob data in memory, so that blob streams decode it from
+     * there rather than reading it from the files on every pass. Files are
+     * loaded in order for as long as they fit in @a maxBytes, and the
+     * remainder are still read from disk. The files are kept, so that
+     * @ref saveBlobs still works.
+     *
+     * @pre @ref computeBlobs or @ref loadBlobs has been called.
+     * @throw std::ios::failure on I/O errors.
+     */
+    void cacheBlobs(std::size_t maxBytes);
+
+    enum
+    {
+        /// Upper bound on the number of ranges chosen automatically by @ref computeBlobs
+        MAX_DEFAULT_COMPUTE_THREADS = 8,
+        /// Minimum number of splats per range when the number of ranges is chosen automatically
+        MIN_COMPUTE_RANGE_SPLATS = 1024 * 1024
+    };
+
+    /**
+     * Set the number of input ranges that @ref computeBlobs processes
+     * concurrently, each in its own thread. A value of zero (the default)
+     * chooses a value based on the hardware concurrency and the number of
+     * splats.
+     */
+    void setComputeThreads(unsigned int threads) { computeThreads = threads; }
+
+    /**
+     * Have @ref computeBlobs process the splats with @a computer as a
+     * single range, instead of on the CPU. Pass @c NULL (the default) to
+     * use the CPU. The computer must outlive any calls to @ref computeBlobs.
+     */
+    void setBlobComputer(BlobComputer *computer) { blobComputer = computer; }
+
     FastBlobSet();
     ~FastBlobSet();
 
@@ -786,6 +1104,10 @@ public:
      * modified again. This function must be called before any of the other
      * functions defined in this class.
      *
+     * The input is split into ranges with @c Base::partition, each of which
+     * is processed by a separate thread into its own blob file (see @ref
+     * setComputeThreads).
+     *
      * @param spacing        Grid spacing for grids to be accelerated.
      * @param bucketSize     Common factor for bucket sizes to be accelerated.
      * @param progressStream If non-NULL, will be used to report progress.
@@ -796,6 +1118,44 @@ public:
                       std::ostream *progressStream = NULL,
                       bool warnNonFinite = true);
 
+    /**
+     * Begin generating the blob data incrementally, as an alternative to
+     * @ref computeBlobs for inputs that can only be read once (such as a
+     * pipe). The splats are passed to @ref ingest as they arrive, and must
+     * be placed in the base class (for example, by spooling them to a file)
+     * before calling @ref finishIngest. The blobs are computed in the same
+     * way as by @ref computeBlobs, but always into a single blob file.
+     *
+     * @param spacing        Grid spacing for grids to be accelerated.
+     * @param bucketSize     Common factor for bucket sizes to be accelerated.
+     */
+    void startIngest(float spacing, Grid::size_type bucketSize);
+
+    /**
+     * Add splats to the blob data started by @ref startIngest. Splat @a i
+     * has ID <code>first + i</code>, which must be its ID in the base class
+     * once it is populated. Non-finite splats are skipped, as they are by the
+     * splat streams.
+     *
+     * @pre @ref startIngest has been called, and @a first is greater than
+     * the IDs of the splats already ingested.
+     * @throw std::ios::failure on I/O errors.
+     */
+    void ingest(const Splat *splats, splat_id first, std::size_t count);
+
+    /**
+     * Complete the blob data started by @ref startIngest and compute the
+     * bounding grid. After this, the object is in the same state as after
+     * @ref computeBlobs.
+     *
+     * @param warnNonFinite  If true (the default), a warning will be displayed if
+     *                       non-finite splats were encountered.
+     * @pre The base class holds exactly the splats passed to @ref ingest.
+     * @throw std::ios::failure on I/O errors.
+     * @throw std::runtime_error if there were no finite splats.
+     */
+    void finishIngest(bool warnNonFinite = true);
+
     /**
      * Return the bounding grid generated by @ref computeBlobs. The grid will
      * have an origin at the world origin and the @a spacing passed to @ref
@@ -803,6 +1163,46 @@ public:
      */
     const Grid &getBoundingGrid() const { return boundingGrid; }
 
+    /**
+     * Return the bucket size passed to @ref computeBlobs. Grids whose low
+     * extents are multiples of it can use the blob data directly.
+     */
+    Grid::size_type getBucketSize() const
+    {
+        MLSGPU_ASSERT(internalBucketSize > 0, state_error);
+        return internalBucketSize;
+    }
+
+    /**
+     * Save the results of @ref computeBlobs so that a later run can restore
+     * them with @ref loadBlobs instead of recomputing them. The index is
+     * written to @a index and each blob file is copied alongside it, with
+     * a numeric suffix appended to the name.
+     *
+     * @param index          Path for the index file.
+     * @param key            Arbitrary string describing the inputs and
+     *                       parameters. It must change whenever the blobs
+     *                       would change.
+     *
+     * @pre @ref computeBlobs has been called.
+     * @throw std::ios::failure on I/O errors.
+     */
+    void saveBlobs(const boost::filesystem::path &index, const std::string &key) const;
+
+    /**
+     * Restore state saved by @ref saveBlobs, as an alternative to calling
+     * @ref computeBlobs. The restored blob files are not owned, and so are
+     * not deleted by the destructor.
+     *
+     * @param index          Path for the index file.
+     * @param key            Key describing the current inputs and parameters.
+     *
+     * @return @c true if the index was loaded, or @c false if it does not
+     * exist, is unreadable or was saved with a different key. In the latter
+     * case the object is left unchanged.
+     */
+    bool loadBlobs(const boost::filesystem::path &index, const std::string &key);
+
     /**
      * Return the exact number of splats in the splat stream.
      * @pre @ref computeBlobs has been called.
@@ -827,6 +1227,8 @@ protected:
         boost::filesystem::path path;  ///< Path to the file
         std::tr1::uint64_t nBlobs;     ///< Number of blobs in the file
         bool owner;                    ///< If true, the file will be deleted on destruction
+        /// In-memory copy of the file contents, if any (see @ref cacheBlobs)
+        boost::shared_ptr<const Statistics::Container::vector<BlobData> > data;
 
         BlobFile() : nBlobs(0), owner(true) {}
     };
@@ -850,6 +1252,16 @@ protected:
 
     splat_id nSplats;  ///< Exact splat count computed during blob generation
 
+    /// Number of concurrent ranges for @ref computeBlobs (0 for automatic)
+    unsigned int computeThreads;
+
+    /// Processor for @ref computeBlobs, or @c NULL to use the CPU
+    BlobComputer *blobComputer;
+
+    /// Working state between @ref startIngest and @ref finishIngest
+    struct IngestState;
+    boost::scoped_ptr<IngestState> ingestState;
+
     /// Erase a temporary file, if it is owned
     static void eraseBlobFile(const BlobFile &bf);
 
@@ -885,6 +1297,15 @@ protected:
         detail::Bbox &bbox, BlobFile &bf, splat_id &nSplats,
         ProgressMeter *progress);
 
+    /**
+     * Generate a blob file for all the splats using @ref blobComputer. The
+     * parameters have the same meaning as for @ref computeBlobsRange.
+     */
+    void computeBlobsDevice(
+        float spacing, Grid::size_type bucketSize,
+        detail::Bbox &bbox, BlobFile &bf, splat_id &nSplats,
+        ProgressMeter *progress);
+
 private:
     /**
      * Determines whether the given @a grid and @a bucketSize can use the
@@ -892,6 +1313,21 @@ private:
      */
     bool fastPath(const Grid &grid, Grid::size_type bucketSize) const;
 
+    /// Number of ranges that @ref computeBlobs will split the input into
+    unsigned int numComputeRanges() const;
+
+    /**
+     * Thread body for @ref computeBlobs. It calls @ref computeBlobsRange on
+     * @a range, using at most @a ompThreads OpenMP threads, and stores any
+     * exception in @a error rather than letting it escape the thread.
+     */
+    void computeBlobsWorker(
+        std::pair<splat_id, splat_id> range,
+        const detail::SplatToBuckets &toBuckets,
+        detail::Bbox &bbox, BlobFile &bf, splat_id &nSplats,
+        ProgressMeter *progress, int ompThreads,
+        boost::exception_ptr &error);
+
     /**
      * Append a blob to @a blobData.
      * @param blobData The list of encoded blobs to append to.
@@ -901,6 +1337,29 @@ private:
      * prevBlob is irrelevant.
      */
     static void addBlob(Statistics::Container::vector<BlobData> &blobData, const BlobInfo &prevBlob, const BlobInfo &curBlob);
+
+    /**
+     * Convert a batch of finite splats to blobs and append them to @a out.
+     * The batch is divided between OpenMP threads, each of which starts a
+     * new run of differential encoding.
+     *
+     * @param splats, ids      The splats and their IDs, in increasing order of ID.
+     * @param count            Number of splats in the batch.
+     * @param toBuckets        Functor for converting splats to their blob ranges.
+     * @param lower, upper     Scratch space for @a count bucket ranges.
+     * @param out              Blob file being written.
+     * @param[in,out] bbox     Bounding box, extended by the splats.
+     * @param[in,out] nBlobs   Number of blobs written, incremented.
+     * @param[in,out] incidence Sum of the number of buckets touched by each splat, incremented.
+     * @param[in,out] err      Set to @c errno on the first write error, if zero.
+     */
+    static void appendBlobs(
+        const Splat *splats, const splat_id *ids, std::size_t count,
+        const detail::SplatToBuckets &toBuckets,
+        boost::array<Grid::difference_type, 3> *lower,
+        boost::array<Grid::difference_type, 3> *upper,
+        std::ostream &out, detail::Bbox &bbox, std::tr1::uint64_t &nBlobs,
+        std::tr1::uint64_t &incidence, int &err);
 };
 
 /**
@@ -1025,8 +1484,8 @@ protected:
     friend class Serialize::Access;
     /**
      * Store of splat ID ranges. Each range is a half-open interval of valid
-     * IDs. They are encoded in one of two forms. The full encoding uses 4
-     * 32-bit words:
+     * IDs. They are encoded in one of three forms, and the smallest one that
+     * fits is used. The full encoding uses 4 32-bit words:
      * -# First splat (high)
      * -# First splat (low)
      * -# Last splat (high)
@@ -1037,6 +1496,16 @@ protected:
      * - [0:16]  First splat minus last splat from previous range
      * - [16:31] Length
      * - [31:32] 1
+     *
+     * Since ranges are never empty, a zero length in the differential
+     * encoding marks the two-word differential encoding, which handles the
+     * larger gaps left by sparse subsets. The first word holds:
+     * - [0:16]  Gap to the previous range (bits 12 to 27)
+     * - [16:31] 0
+     * - [31:32] 1
+     * The second word holds:
+     * - [0:20]  Length
+     * - [20:32] Gap to the previous range (bits 0 to 11)
      */
     Statistics::Container::vector<std::tr1::uint32_t> splatRanges;
 
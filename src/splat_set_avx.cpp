@@ -0,0 +1,285 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * AVX2 and AVX-512 batch implementations of @ref SplatSet::detail::SplatToBuckets.
+ *
+ * The functions are compiled with per-function target attributes, so that
+ * the rest of the program does not require these instruction sets, and are
+ * selected at runtime by @ref SplatSet::detail::selectSplatToBucketsBatch.
+ *
+ * Each splat is converted with its lower and upper corners in a single
+ * 8-lane vector (the fourth lane of each half is padding). Unlike the SSE2
+ * version, the division by the bucket size is also vectorized, since AVX2
+ * has a signed 32x32->64 multiply.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include "splat_set_impl.h"
+
+#if HAVE_AVX2_TARGET || HAVE_AVX512F_TARGET
+# include <immintrin.h>
+# include <limits>
+# include <boost/numeric/conversion/cast.hpp>
+# include "tr1_cstdint.h"
+# include "splat.h"
+#endif
+
+namespace SplatSet
+{
+namespace detail
+{
+
+#if HAVE_AVX2_TARGET || HAVE_AVX512F_TARGET
+
+/// Copy the (lower, upper) cell coordinates extracted from a vector to the outputs
+static inline void storeBuckets(
+    const std::tr1::int32_t *v,
+    boost::array<Grid::difference_type, 3> &lower,
+    boost::array<Grid::difference_type, 3> &upper)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        lower[i] = v[i];
+        upper[i] = v[i + 4];
+    }
+}
+
+/**
+ * Compute the lower and upper corners of the bounding box of a splat, in
+ * world coordinates, as the low and high halves of a vector.
+ */
+__attribute__((target("avx2")))
+static inline __m256 splatBoxAVX2(const Splat &splat)
+{
+    __m128 p = _mm_loadu_ps(splat.position); // x, y, z, radius
+    __m128 r = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_sub_ps(p, r)), _mm_add_ps(p, r), 1);
+}
+
+#endif // HAVE_AVX2_TARGET || HAVE_AVX512F_TARGET
+
+#if HAVE_AVX2_TARGET
+
+/**
+ * Vectorized form of @ref DownDivider, operating on cell coordinates produced
+ * by @ref splatBoxAVX2.
+ */
+class DivideAVX2
+{
+private:
+    __m256i negAdd, posAdd, inverse, limit;
+    __m128i shift;        ///< Shift applied to the 64-bit products
+    __m128i highShift;    ///< Shift applied to the high halves when @ref shift exceeds 32
+    bool useHigh;
+
+public:
+    __attribute__((target("avx2")))
+    explicit DivideAVX2(const SplatToBucketsParams &params)
+    {
+        negAdd = _mm256_set1_epi32(params.negAdd);
+        posAdd = _mm256_set1_epi32(params.posAdd);
+        inverse = _mm256_set1_epi32(params.inverse);
+        limit = _mm256_set1_epi32(std::numeric_limits<std::tr1::int32_t>::min() + 2);
+        useHigh = params.shift > 32;
+        shift = _mm_cvtsi32_si128(useHigh ? 32 : params.shift);
+        highShift = _mm_cvtsi32_si128(useHigh ? params.shift - 32 : 0);
+    }
+
+    __attribute__((target("avx2")))
+    __m256i operator()(__m256i in) const
+    {
+        __m256i lt = _mm256_cmpgt_epi32(negAdd, in);
+        __m256i gt = _mm256_cmpgt_epi32(in, posAdd);
+        in = _mm256_sub_epi32(in, lt);  // true is encoded as -1, so subtract to add 1
+        in = _mm256_sub_epi32(in, gt);
+
+        // cvtps writes INT_MIN on overflow, although we may have added one to it.
+        // Lanes 3 and 7 are padding and are ignored.
+        __m256i bad = _mm256_cmpgt_epi32(limit, in);
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(bad)) & 0x77)
+            throw boost::numeric::bad_numeric_cast();
+
+        // mul_epi32 only uses the even lanes, so the odd lanes are done separately
+        __m256i even = _mm256_mul_epi32(in, inverse);
+        __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(in, 32), inverse);
+        even = _mm256_srl_epi64(even, shift);
+        if (useHigh)
+        {
+            // The high halves of the products are already in the odd lanes
+            __m256i high = _mm256_blend_epi32(even, odd, 0xAA);
+            return _mm256_sra_epi32(high, highShift);
+        }
+        else
+        {
+            /* The result fits in 32 bits, so for shifts of up to 32 the low half
+             * of a logical shift matches that of an arithmetic shift.
+             */
+            odd = _mm256_slli_epi64(_mm256_srl_epi64(odd, shift), 32);
+            return _mm256_blend_epi32(even, odd, 0xAA);
+        }
+    }
+};
+
+__attribute__((target("avx2")))
+static void splatToBucketsAVX2(
+    const SplatToBucketsParams &params,
+    const Splat *splats, std::size_t n,
+    boost::array<Grid::difference_type, 3> *lower,
+    boost::array<Grid::difference_type, 3> *upper)
+{
+    const __m256 invSpacing = _mm256_set1_ps(params.invSpacing);
+    const DivideAVX2 divide(params);
+    union
+    {
+        std::tr1::int32_t v[16];
+        __m256i dummy[2];
+    } u;
+
+    std::size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        __m256 a = _mm256_mul_ps(splatBoxAVX2(splats[i]), invSpacing);
+        __m256 b = _mm256_mul_ps(splatBoxAVX2(splats[i + 1]), invSpacing);
+        __m256i aCell = _mm256_cvtps_epi32(_mm256_floor_ps(a));
+        __m256i bCell = _mm256_cvtps_epi32(_mm256_floor_ps(b));
+        _mm256_store_si256(&u.dummy[0], divide(aCell));
+        _mm256_store_si256(&u.dummy[1], divide(bCell));
+        storeBuckets(u.v, lower[i], upper[i]);
+        storeBuckets(u.v + 8, lower[i + 1], upper[i + 1]);
+    }
+    if (i < n)
+    {
+        __m256 a = _mm256_mul_ps(splatBoxAVX2(splats[i]), invSpacing);
+        __m256i aCell = _mm256_cvtps_epi32(_mm256_floor_ps(a));
+        _mm256_store_si256(&u.dummy[0], divide(aCell));
+        storeBuckets(u.v, lower[i], upper[i]);
+    }
+}
+
+#endif // HAVE_AVX2_TARGET
+
+#if HAVE_AVX2_TARGET && HAVE_AVX512F_TARGET
+
+/**
+ * Vectorized form of @ref DownDivider, operating on the cell coordinates of
+ * two splats at once.
+ */
+class DivideAVX512
+{
+private:
+    __m512i negAdd, posAdd, inverse, limit, one;
+    __m128i shift;
+
+public:
+    __attribute__((target("avx512f")))
+    explicit DivideAVX512(const SplatToBucketsParams &params)
+    {
+        negAdd = _mm512_set1_epi32(params.negAdd);
+        posAdd = _mm512_set1_epi32(params.posAdd);
+        inverse = _mm512_set1_epi32(params.inverse);
+        limit = _mm512_set1_epi32(std::numeric_limits<std::tr1::int32_t>::min() + 1);
+        one = _mm512_set1_epi32(1);
+        shift = _mm_cvtsi32_si128(params.shift);
+    }
+
+    __attribute__((target("avx512f")))
+    __m512i operator()(__m512i in) const
+    {
+        __mmask16 adjust = _mm512_cmplt_epi32_mask(in, negAdd) | _mm512_cmpgt_epi32_mask(in, posAdd);
+        in = _mm512_mask_add_epi32(in, adjust, in, one);
+
+        // Lanes 3, 7, 11 and 15 are padding and are ignored.
+        if (_mm512_cmple_epi32_mask(in, limit) & 0x7777)
+            throw boost::numeric::bad_numeric_cast();
+
+        __m512i even = _mm512_mul_epi32(in, inverse);
+        __m512i odd = _mm512_mul_epi32(_mm512_srli_epi64(in, 32), inverse);
+        even = _mm512_sra_epi64(even, shift);
+        odd = _mm512_slli_epi64(_mm512_sra_epi64(odd, shift), 32);
+        return _mm512_mask_blend_epi32(0xAAAA, even, odd);
+    }
+};
+
+/// Combine the bounding boxes of two splats (see @ref splatBoxAVX2) into a single vector
+__attribute__((target("avx512f")))
+static inline __m512 splatBoxAVX512(const Splat *splats)
+{
+    __m512d lo = _mm512_castps_pd(_mm512_castps256_ps512(splatBoxAVX2(splats[0])));
+    __m256d hi = _mm256_castps_pd(splatBoxAVX2(splats[1]));
+    return _mm512_castpd_ps(_mm512_insertf64x4(lo, hi, 1));
+}
+
+__attribute__((target("avx512f")))
+static void splatToBucketsAVX512(
+    const SplatToBucketsParams &params,
+    const Splat *splats, std::size_t n,
+    boost::array<Grid::difference_type, 3> *lower,
+    boost::array<Grid::difference_type, 3> *upper)
+{
+    const __m512 invSpacing = _mm512_set1_ps(params.invSpacing);
+    const DivideAVX512 divide(params);
+    union
+    {
+        std::tr1::int32_t v[32];
+        __m512i dummy[2];
+    } u;
+
+    std::size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m512 a = _mm512_mul_ps(splatBoxAVX512(splats + i), invSpacing);
+        __m512 b = _mm512_mul_ps(splatBoxAVX512(splats + i + 2), invSpacing);
+        __m512i aCell = _mm512_cvt_roundps_epi32(a, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        __m512i bCell = _mm512_cvt_roundps_epi32(b, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        _mm512_store_si512(&u.dummy[0], divide(aCell));
+        _mm512_store_si512(&u.dummy[1], divide(bCell));
+        for (int j = 0; j < 4; j++)
+            storeBuckets(u.v + 8 * j, lower[i + j], upper[i + j]);
+    }
+    // AVX-512F implies AVX2, so use that for the remainder
+    if (i < n)
+        splatToBucketsAVX2(params, splats + i, n - i, lower + i, upper + i);
+}
+
+#endif // HAVE_AVX2_TARGET && HAVE_AVX512F_TARGET
+
+SplatToBucketsBatch selectSplatToBucketsBatch()
+{
+#if HAVE_AVX2_TARGET || HAVE_AVX512F_TARGET
+    __builtin_cpu_init();
+#endif
+#if HAVE_AVX2_TARGET && HAVE_AVX512F_TARGET
+    if (__builtin_cpu_supports("avx512f"))
+        return splatToBucketsAVX512;
+#endif
+#if HAVE_AVX2_TARGET
+    if (__builtin_cpu_supports("avx2"))
+        return splatToBucketsAVX2;
+#endif
+    return NULL;
+}
+
+} // namespace detail
+} // namespace SplatSet
@@ -50,11 +50,19 @@
 #include <iterator>
 #include <utility>
 #include <iostream>
+#include <iomanip>
+#include <locale>
+#include <string>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
 #include <boost/next_prior.hpp>
 #include <boost/exception/all.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/filesystem/operations.hpp>
 #include <cerrno>
 #include "allocator.h"
 #include "errors.h"
@@ -209,39 +217,67 @@ void FileSet::ReaderThread<RangeIterator>::operator()()
 {
     thread_set_name("reader");
 
+    /* With several reader threads, each read also holds its decoded splats
+     * in the buffer, so the reads are made smaller to keep as many in flight.
+     */
+    const bool pooled = owner.readerThreads > 1;
     // Maximum number of bytes to load at one time. This must be less than the buffer
     // size, and should be much less for efficiency.
-    const std::size_t maxChunk = buffer.size() / 8;
-    Statistics::Variable &readTimeStat = Statistics::getStatistic<Statistics::Variable>("files.read.time");
+    const std::size_t maxChunk = buffer.size() / (pooled ? 32 : 8);
+    Statistics::Variable &readTimeStat = Statistics::getStatistic<Statistics::Histogram>("files.read.time");
     Statistics::Variable &readRangeStat = Statistics::getStatistic<Statistics::Variable>("files.read.splats");
     Statistics::Variable &readMergedStat = Statistics::getStatistic<Statistics::Variable>("files.read.merged");
 
+    Statistics::Counter &prefetchHitStat = Statistics::getStatistic<Statistics::Counter>("files.prefetch.hits");
+    Statistics::Counter &prefetchMissStat = Statistics::getStatistic<Statistics::Counter>("files.prefetch.misses");
+    const std::size_t prefetchRanges = owner.prefetchRanges;
+
     boost::scoped_ptr<FastPly::Reader::Handle> handle;
     std::size_t handleId = 0;
     FileRangeIterator<RangeIterator> first(owner, firstRange, lastRange, maxChunk);
     FileRangeIterator<RangeIterator> last(owner, lastRange);
 
+    /* Read-ahead state: the ranges in [cur, ahead) have already been hinted
+     * to the OS, and there are @a hinted of them. Hints are never issued
+     * beyond the file that is currently open.
+     */
+    FileRangeIterator<RangeIterator> ahead = first;
+    std::size_t hinted = 0;
+
+    if (pooled)
+        startJobThreads(owner.readerThreads);
+    std::size_t seq = 0;
+
     Timeplot::Action totalTimer("compute", tworker);
     FileRangeIterator<RangeIterator> cur = first;
     while (cur != last)
     {
         FileRange range = *cur;
         const std::size_t vertexSize = owner.files[range.fileId].getVertexSize();
+        const bool local = owner.remoteReader == NULL || owner.remoteReader->isLocal(range.fileId);
 
-        if (!handle || range.fileId != handleId)
+        if (vertexSize > maxChunk)
+        {
+            // TODO: associate the filename with it? Might be too late.
+            throw std::runtime_error("Far too many bytes per vertex");
+        }
+        if (!local)
+        {
+            // Remote files are neither opened nor hinted
+            handle.reset();
+        }
+        else if (!handle || range.fileId != handleId)
         {
-            if (vertexSize > maxChunk)
-            {
-                // TODO: associate the filename with it? Might be too late.
-                throw std::runtime_error("Far too many bytes per vertex");
-            }
             handle.reset(); // close the old handle
             handle.reset(new FastPly::Reader::Handle(owner.files[range.fileId]));
             handleId = range.fileId;
+            ahead = cur;
+            hinted = 0;
         }
 
         const FastPly::Reader::size_type start = range.start;
         FastPly::Reader::size_type end = range.end;
+        std::size_t groupRanges = 1;
         /* Request merging */
         FileRangeIterator<RangeIterator> next = cur;
         ++next;
@@ -255,13 +291,96 @@ void FileSet::ReaderThread<RangeIterator>::operator()()
                 break;
             end = nextRange.end;
             ++next;
+            groupRanges++;
+        }
+
+        /* Account for the ranges in this group that were hinted previously */
+        if (!local)
+        {
+            ahead = next;
+            hinted = 0;
+        }
+        else if (hinted >= groupRanges)
+        {
+            prefetchHitStat.add(groupRanges);
+            hinted -= groupRanges;
+        }
+        else
+        {
+            prefetchHitStat.add(hinted);
+            prefetchMissStat.add(groupRanges - hinted);
+            ahead = next;
+            hinted = 0;
+        }
+
+        /* Hint the following ranges, coalescing adjacent ones */
+        while (local && hinted < prefetchRanges && ahead != last)
+        {
+            FileRange hint = *ahead;
+            if (hint.fileId != handleId)
+                break;
+            ++ahead;
+            hinted++;
+            while (hinted < prefetchRanges && ahead != last)
+            {
+                const FileRange nextHint = *ahead;
+                if (nextHint.fileId != handleId || nextHint.start != hint.end)
+                    break;
+                hint.end = nextHint.end;
+                ++ahead;
+                hinted++;
+            }
+            handle->prefetchRaw(hint.start, hint.end);
+        }
+
+        if (pooled)
+        {
+            /* Lay out the decoded splats followed by the raw data, keeping
+             * every allocation a multiple of 16 bytes so that the splats
+             * stay aligned.
+             */
+            const std::size_t splatBytes = roundUp((end - start) * sizeof(Splat), std::size_t(16));
+            const std::size_t rawBytes = roundUp((end - start) * vertexSize, std::size_t(16));
+            CircularBuffer::Allocation alloc = buffer.allocate(tworker, splatBytes + rawBytes);
+            char *chunk = (char *) alloc.get();
+
+            boost::shared_ptr<Job> job = boost::make_shared<Job>();
+            job->seq = seq++;
+            job->fileId = range.fileId;
+            job->start = start;
+            job->end = end;
+            job->local = local;
+            job->splats = (Splat *) chunk;
+            job->raw = chunk + splatBytes;
+            job->items.reserve(groupRanges);
+            while (cur != next)
+            {
+                readRangeStat.add(range.end - range.start);
+
+                Item item;
+                item.first = range.start + (splat_id(range.fileId) << scanIdShift);
+                item.last = item.first + (range.end - range.start);
+                item.ptr = job->raw + (range.start - start) * vertexSize;
+                item.splats = job->splats + (range.start - start);
+                ++cur;
+                if (cur != next)
+                    range = *cur;
+                else
+                    item.alloc = alloc;
+                job->items.push_back(item);
+            }
+            jobQueue.push(job);
+            continue;
         }
 
         CircularBuffer::Allocation alloc = buffer.allocate(tworker, vertexSize, end - start);
         char *chunk = (char *) alloc.get();
         {
             Timeplot::Action readTimer("load", tworker, readTimeStat);
-            handle->readRaw(start, end, chunk);
+            if (local)
+                handle->readRaw(start, end, chunk);
+            else
+                owner.remoteReader->readRaw(range.fileId, start, end, chunk);
         }
         readMergedStat.add(end - start);
 
@@ -286,6 +405,8 @@ void FileSet::ReaderThread<RangeIterator>::operator()()
         }
     }
 
+    if (pooled)
+        stopJobThreads();
     // Signal completion
     outQueue.stop();
 }
@@ -339,60 +460,110 @@ BlobStream &FastBlobSet<Base>::MyBlobStream::operator++()
 template<typename Base>
 void FastBlobSet<Base>::MyBlobStream::refill()
 {
-    while (remaining == 0)
+    while (blobPos == blobEnd)
     {
-        if (stream.is_open())
-        {
-            stream.close();
-            curFile++;
-        }
-        if (curFile >= owner.blobFiles.size())
-        {
-            curBlob.firstSplat = 1;
-            curBlob.lastSplat = 0;
-            return;
-        }
-        else
+        while (remaining == 0)
         {
-            stream.open(owner.blobFiles[curFile].path, std::ios::binary);
-            stream.exceptions(std::ios::failbit | std::ios::badbit);
-            remaining = owner.blobFiles[curFile].nBlobs;
+            if (fileOpen)
+            {
+                if (stream.is_open())
+                    stream.close();
+                curFile++;
+                fileOpen = false;
+            }
+            if (curFile >= owner.blobFiles.size())
+            {
+                curBlob.firstSplat = 1;
+                curBlob.lastSplat = 0;
+                return;
+            }
+
+            const BlobFile &bf = owner.blobFiles[curFile];
+            remaining = bf.nBlobs;
+            if (bf.data)
+            {
+                wordPos = bf.data->empty() ? NULL : &(*bf.data)[0];
+                wordEnd = wordPos + bf.data->size();
+                fileWords = 0;
+            }
+            else
+            {
+                stream.open(bf.path, std::ios::binary);
+                stream.exceptions(std::ios::failbit | std::ios::badbit);
+                fileWords = remaining > 0 ? file_size(bf.path) / sizeof(BlobData) : 0;
+                wordPos = wordEnd = &words[0];
+            }
+            fileOpen = true;
         }
+        decodeBlock();
     }
+    curBlob = blobs[blobPos++];
+}
+
+template<typename Base>
+void FastBlobSet<Base>::MyBlobStream::loadWords()
+{
+    const std::size_t left = wordEnd - wordPos;
+    std::copy(wordPos, wordEnd, words.begin());
+    const std::size_t n = std::min(std::tr1::uint64_t(BUFFER_WORDS - left), fileWords);
+    stream.read(reinterpret_cast<char *>(&words[left]), n * sizeof(BlobData));
+    wordPos = &words[0];
+    wordEnd = wordPos + left + n;
+    fileWords -= n;
+}
 
+template<typename Base>
+void FastBlobSet<Base>::MyBlobStream::decodeBlock()
+{
     try
     {
-        std::tr1::uint32_t data;
-        stream.read(reinterpret_cast<char *>(&data), sizeof(data));
-        if (data & UINT32_C(0x80000000))
+        const std::size_t n = std::min(remaining, std::tr1::uint64_t(BLOCK_BLOBS));
+        for (std::size_t j = 0; j < n; j++)
         {
-            // Differential record
-            for (unsigned int i = 0; i < 3; i++)
+            // A full record needs 10 words, so top up before running short
+            if (wordEnd - wordPos < 10 && fileWords > 0)
+                loadWords();
+            if (wordPos == wordEnd)
+                throw std::ios::failure("Blob file is truncated");
+
+            BlobInfo &blob = blobs[j];
+            const std::tr1::uint32_t data = *wordPos;
+            if (data & UINT32_C(0x80000000))
             {
-                curBlob.lower[i] = curBlob.upper[i] + extractSigned(data, i * 4, i * 4 + 3);
-                curBlob.upper[i] = curBlob.lower[i] + extractUnsigned(data, i * 4 + 3, i * 4 + 4);
+                // Differential record
+                for (unsigned int i = 0; i < 3; i++)
+                {
+                    blob.lower[i] = prevBlob.upper[i] + extractSigned(data, i * 4, i * 4 + 3);
+                    blob.upper[i] = blob.lower[i] + extractUnsigned(data, i * 4 + 3, i * 4 + 4);
+                }
+                blob.firstSplat = prevBlob.lastSplat;
+                blob.lastSplat = blob.firstSplat + extractUnsigned(data, 12, 31);
+                wordPos++;
             }
-            curBlob.firstSplat = curBlob.lastSplat;
-            curBlob.lastSplat = curBlob.firstSplat + extractUnsigned(data, 12, 31);
-        }
-        else
-        {
-            // Full record
-            std::tr1::uint32_t buffer[9];
-            stream.read(reinterpret_cast<char *>(&buffer), sizeof(buffer));
-            std::tr1::uint64_t firstHi = data;
-            std::tr1::uint64_t firstLo = buffer[0];
-            std::tr1::uint64_t lastHi = buffer[1];
-            std::tr1::uint64_t lastLo = buffer[2];
-            curBlob.firstSplat = (firstHi << 32) | firstLo;
-            curBlob.lastSplat = (lastHi << 32) | lastLo;
-            for (unsigned int i = 0; i < 3; i++)
+            else
             {
-                curBlob.lower[i] = static_cast<std::tr1::int32_t>(buffer[3 + 2 * i]);
-                curBlob.upper[i] = static_cast<std::tr1::int32_t>(buffer[4 + 2 * i]);
+                // Full record
+                if (wordEnd - wordPos < 10)
+                    throw std::ios::failure("Blob file is truncated");
+                const std::tr1::uint32_t *buffer = wordPos + 1;
+                std::tr1::uint64_t firstHi = data;
+                std::tr1::uint64_t firstLo = buffer[0];
+                std::tr1::uint64_t lastHi = buffer[1];
+                std::tr1::uint64_t lastLo = buffer[2];
+                blob.firstSplat = (firstHi << 32) | firstLo;
+                blob.lastSplat = (lastHi << 32) | lastLo;
+                for (unsigned int i = 0; i < 3; i++)
+                {
+                    blob.lower[i] = static_cast<std::tr1::int32_t>(buffer[3 + 2 * i]);
+                    blob.upper[i] = static_cast<std::tr1::int32_t>(buffer[4 + 2 * i]);
+                }
+                wordPos += 10;
             }
+            prevBlob = blob;
         }
-        remaining--;
+        blobPos = 0;
+        blobEnd = n;
+        remaining -= n;
     }
     catch (std::ios::failure &e)
     {
@@ -403,20 +574,41 @@ void FastBlobSet<Base>::MyBlobStream::refill()
 }
 
 template<typename Base>
-BlobInfo FastBlobSet<Base>::MyBlobStream::operator*() const
+BlobInfo FastBlobSet<Base>::MyBlobStream::adjust(const BlobInfo &blob) const
 {
     BlobInfo ans;
-    MLSGPU_ASSERT(!empty(), std::out_of_range);
-
-    ans.firstSplat = curBlob.firstSplat;
-    ans.lastSplat = curBlob.lastSplat;
+    ans.firstSplat = blob.firstSplat;
+    ans.lastSplat = blob.lastSplat;
     for (unsigned int i = 0; i < 3; i++)
-        ans.lower[i] = bucketDivider(curBlob.lower[i] - offset[i]);
+        ans.lower[i] = bucketDivider(blob.lower[i] - offset[i]);
     for (unsigned int i = 0; i < 3; i++)
-        ans.upper[i] = bucketDivider(curBlob.upper[i] - offset[i]);
+        ans.upper[i] = bucketDivider(blob.upper[i] - offset[i]);
     return ans;
 }
 
+template<typename Base>
+BlobInfo FastBlobSet<Base>::MyBlobStream::operator*() const
+{
+    MLSGPU_ASSERT(!empty(), std::out_of_range);
+    return adjust(curBlob);
+}
+
+template<typename Base>
+std::size_t FastBlobSet<Base>::MyBlobStream::read(BlobInfo *out, std::size_t count)
+{
+    std::size_t n = 0;
+    while (n < count && !empty())
+    {
+        out[n++] = adjust(curBlob);
+        // Take the rest of the decoded block directly, then refill curBlob
+        const std::size_t take = std::min(count - n, blobEnd - blobPos);
+        for (std::size_t i = 0; i < take; i++)
+            out[n++] = adjust(blobs[blobPos++]);
+        refill();
+    }
+    return n;
+}
+
 
 template<typename Base>
 FastBlobSet<Base>::MyBlobStream::MyBlobStream(
@@ -426,7 +618,12 @@ FastBlobSet<Base>::MyBlobStream::MyBlobStream(
     owner(owner),
     bucketDivider(bucketSize / owner.internalBucketSize),
     remaining(0),
-    curFile(0)
+    words("mem.blobStream.words", BUFFER_WORDS),
+    wordPos(NULL), wordEnd(NULL), fileWords(0),
+    blobs("mem.blobStream.blobs", BLOCK_BLOBS),
+    blobPos(0), blobEnd(0),
+    curFile(0),
+    fileOpen(false)
 {
     MLSGPU_ASSERT(bucketSize > 0 && owner.internalBucketSize > 0
                   && bucketSize % owner.internalBucketSize == 0, std::invalid_argument);
@@ -437,7 +634,7 @@ FastBlobSet<Base>::MyBlobStream::MyBlobStream(
 
 template<typename Base>
 FastBlobSet<Base>::FastBlobSet()
-: Base(), internalBucketSize(0), nSplats(0)
+: Base(), internalBucketSize(0), nSplats(0), computeThreads(0), blobComputer(NULL)
 {
 }
 
@@ -463,6 +660,45 @@ void FastBlobSet<Base>::eraseBlobFiles()
     blobFiles.clear();
 }
 
+template<typename Base>
+void FastBlobSet<Base>::cacheBlobs(std::size_t maxBytes)
+{
+    MLSGPU_ASSERT(internalBucketSize > 0, state_error);
+
+    std::tr1::uint64_t used = 0;
+    BOOST_FOREACH(BlobFile &bf, blobFiles)
+    {
+        if (bf.data)
+        {
+            used += bf.data->size() * sizeof(BlobData);
+            continue;
+        }
+        const std::tr1::uint64_t bytes = file_size(bf.path);
+        if (used + bytes > maxBytes)
+            continue;
+
+        boost::shared_ptr<Statistics::Container::vector<BlobData> > data
+            = boost::make_shared<Statistics::Container::vector<BlobData> >(
+                "mem.blobset.data", bytes / sizeof(BlobData));
+        boost::filesystem::ifstream in(bf.path, std::ios::binary);
+        try
+        {
+            in.exceptions(std::ios::failbit | std::ios::badbit);
+            if (!data->empty())
+                in.read(reinterpret_cast<char *>(&(*data)[0]), data->size() * sizeof(BlobData));
+        }
+        catch (std::ios::failure &e)
+        {
+            throw boost::enable_error_info(e)
+                << boost::errinfo_errno(errno)
+                << boost::errinfo_file_name(bf.path.string());
+        }
+        bf.data = data;
+        used += bytes;
+    }
+    Statistics::getStatistic<Statistics::Variable>("blobset.memory").add(used);
+}
+
 template<typename Base>
 FastBlobSet<Base>::~FastBlobSet()
 {
@@ -535,6 +771,37 @@ void splatToBuckets(const Splat &splat,
                     boost::array<Grid::difference_type, 3> &lower,
                     boost::array<Grid::difference_type, 3> &upper);
 
+/**
+ * Scalar form of the parameters of @ref SplatToBuckets, for use by the
+ * vectorized batch implementations.
+ */
+struct SplatToBucketsParams
+{
+    float invSpacing;               ///< Reciprocal of the grid spacing
+    std::tr1::int32_t negAdd;       ///< See @ref DownDivider
+    std::tr1::int32_t posAdd;       ///< See @ref DownDivider
+    std::tr1::int32_t inverse;      ///< See @ref DownDivider
+    int shift;                      ///< See @ref DownDivider
+};
+
+/**
+ * Function that computes the bucket ranges for @a n splats, with the same
+ * results as calling @ref SplatToBuckets::operator() on each in turn.
+ */
+typedef void (*SplatToBucketsBatch)(
+    const SplatToBucketsParams &params,
+    const Splat *splats, std::size_t n,
+    boost::array<Grid::difference_type, 3> *lower,
+    boost::array<Grid::difference_type, 3> *upper);
+
+/**
+ * Select the widest vectorized implementation of @ref SplatToBucketsBatch that
+ * was compiled in and is supported by the CPU (determined with CPUID).
+ *
+ * @return The selected implementation, or @c NULL if none is available.
+ */
+SplatToBucketsBatch selectSplatToBucketsBatch();
+
 /**
  * Computes the range of buckets that will be occupied by a splat's bounding
  * box. See @ref BlobInfo for the definition of buckets. This is a version that
@@ -559,6 +826,8 @@ private:
     float invSpacing;
     DownDivider divider;
 #endif
+    SplatToBucketsParams params;    ///< Parameters for @ref batch
+    SplatToBucketsBatch batch;      ///< Vectorized implementation, or @c NULL
 
 public:
     typedef void result_type;
@@ -576,6 +845,22 @@ public:
         boost::array<Grid::difference_type, 3> &lower,
         boost::array<Grid::difference_type, 3> &upper) const;
 
+    /**
+     * Perform the conversion on an array of splats. This may use wider
+     * vectors than the single-splat version, if the CPU supports them.
+     *
+     * @param      splats        Input splats
+     * @param      n             Number of elements in @a splats
+     * @param[out] lower         Lower bound coordinates (inclusive), one per splat
+     * @param[out] upper         Upper bound coordinates (inclusive), one per splat
+     *
+     * @pre All the splats are finite.
+     */
+    void operator()(
+        const Splat *splats, std::size_t n,
+        boost::array<Grid::difference_type, 3> *lower,
+        boost::array<Grid::difference_type, 3> *upper) const;
+
     /**
      * Constructor.
      * @param      spacing       Grid spacing
@@ -634,6 +919,95 @@ void FastBlobSet<Base>::addBlob(Statistics::Container::vector<BlobData> &blobDat
     }
 }
 
+template<typename Base>
+void FastBlobSet<Base>::appendBlobs(
+    const Splat *splats, const splat_id *ids, std::size_t count,
+    const detail::SplatToBuckets &toBuckets,
+    boost::array<Grid::difference_type, 3> *lower,
+    boost::array<Grid::difference_type, 3> *upper,
+    std::ostream &out, detail::Bbox &bbox, std::tr1::uint64_t &nBlobs,
+    std::tr1::uint64_t &incidence, int &err)
+{
+#ifdef _OPENMP
+#pragma omp parallel shared(splats, ids, count, lower, upper, out, bbox, nBlobs, toBuckets, err, incidence) default(none)
+#endif
+    {
+        const int nThreads = omp_get_num_threads();
+        /* Divide the splats into subblocks, based on an estimate of how many threads
+         * will be involved. We have to manually strip-mine the loop to guarantee that
+         * the distribution is in contiguous chunks.
+         */
+#ifdef _OPENMP
+#pragma omp for schedule(static,1) ordered
+#endif
+        for (int tid = 0; tid < nThreads; tid++)
+        {
+            std::size_t first = tid * count / nThreads;
+            std::size_t last = (tid + 1) * count / nThreads;
+            detail::Bbox threadBbox;
+            Statistics::Container::vector<BlobData> threadBlobData("mem.computeBlobs.threadBlobData");
+            BlobInfo curBlob, prevBlob;
+            bool haveCurBlob = false;
+            std::tr1::uint64_t threadBlobs = 0;
+            std::tr1::uint64_t threadIncidence = 0;
+
+            toBuckets(splats + first, last - first, lower + first, upper + first);
+
+            // Compute the blobs for a single subrange. The first blob will always
+            // be a non-differential encoding, so the encoding depends on the number
+            // of subchunks chosen.
+            for (std::size_t i = first; i < last; i++)
+            {
+                const Splat &splat = splats[i];
+                BlobInfo blob;
+                blob.lower = lower[i];
+                blob.upper = upper[i];
+                blob.firstSplat = ids[i];
+                blob.lastSplat = blob.firstSplat + 1;
+                threadBbox += splat;
+                threadIncidence += std::tr1::uint64_t(blob.upper[0] - blob.lower[0] + 1)
+                    * (blob.upper[1] - blob.lower[1] + 1)
+                    * (blob.upper[2] - blob.lower[2] + 1);
+
+                if (!haveCurBlob)
+                {
+                    curBlob = blob;
+                    haveCurBlob = true;
+                }
+                else if (curBlob.lower == blob.lower
+                         && curBlob.upper == blob.upper
+                         && curBlob.lastSplat == blob.firstSplat)
+                    curBlob.lastSplat++;
+                else
+                {
+                    addBlob(threadBlobData, prevBlob, curBlob);
+                    threadBlobs++;
+                    prevBlob = curBlob;
+                    curBlob = blob;
+                }
+            }
+            if (haveCurBlob)
+            {
+                addBlob(threadBlobData, prevBlob, curBlob);
+                threadBlobs++;
+            }
+
+#ifdef _OPENMP
+#pragma omp ordered
+#endif
+            {
+                // Write the blobs for this subrange out to file
+                bbox += threadBbox;
+                nBlobs += threadBlobs;
+                incidence += threadIncidence;
+                out.write(reinterpret_cast<const char *>(&threadBlobData[0]), threadBlobData.size() * sizeof(threadBlobData[0]));
+                if (!out && err == 0)
+                    err = errno;
+            }
+        }
+    }
+}
+
 template<typename Base>
 void FastBlobSet<Base>::computeBlobsRange(
     splat_id first, splat_id last,
@@ -652,11 +1026,19 @@ void FastBlobSet<Base>::computeBlobsRange(
     createTmpFile(bf.path, out);
 
     int err = 0;
+    /* Number of (splat, microblock) pairs for which the splat's bounding box
+     * touches the microblock. Divided by the number of splats, it gives how
+     * many times an average splat is read by bucketing, i.e. the cost of the
+     * halo around each bucket.
+     */
+    std::tr1::uint64_t incidence = 0;
     try
     {
         static const std::size_t BUFFER_SIZE = 64 * 1024;
         Statistics::Container::vector<Splat> buffer("mem.computeBlobs.buffer", BUFFER_SIZE);
         Statistics::Container::vector<splat_id> bufferIds("mem.computeBlobs.buffer", BUFFER_SIZE);
+        Statistics::Container::vector<boost::array<Grid::difference_type, 3> > bufferLower("mem.computeBlobs.buffer", BUFFER_SIZE);
+        Statistics::Container::vector<boost::array<Grid::difference_type, 3> > bufferUpper("mem.computeBlobs.buffer", BUFFER_SIZE);
 
         boost::scoped_ptr<SplatStream> splats(Base::makeSplatStream(&ranges, &ranges + 1, true));
         while (true)
@@ -665,76 +1047,8 @@ void FastBlobSet<Base>::computeBlobsRange(
             if (nBuffer == 0)
                 break;
 
-#ifdef _OPENMP
-#pragma omp parallel shared(out, buffer, bufferIds, bbox, bf, toBuckets, err) default(none)
-#endif
-            {
-                const int nThreads = omp_get_num_threads();
-                /* Divide the splats into subblocks, based on an estimate of how many threads
-                 * will be involved. We have to manually strip-mine the loop to guarantee that
-                 * the distribution is in contiguous chunks.
-                 */
-#ifdef _OPENMP
-#pragma omp for schedule(static,1) ordered
-#endif
-                for (int tid = 0; tid < nThreads; tid++)
-                {
-                    std::size_t first = tid * nBuffer / nThreads;
-                    std::size_t last = (tid + 1) * nBuffer / nThreads;
-                    detail::Bbox threadBbox;
-                    Statistics::Container::vector<BlobData> threadBlobData("mem.computeBlobs.threadBlobData");
-                    BlobInfo curBlob, prevBlob;
-                    bool haveCurBlob = false;
-                    std::tr1::uint64_t threadBlobs = 0;
-
-                    // Compute the blobs for a single subrange. The first blob will always
-                    // be a non-differential encoding, so the encoding depends on the number
-                    // of subchunks chosen.
-                    for (std::size_t i = first; i < last; i++)
-                    {
-                        const Splat &splat = buffer[i];
-                        BlobInfo blob;
-                        toBuckets(splat, blob.lower, blob.upper);
-                        blob.firstSplat = bufferIds[i];
-                        blob.lastSplat = blob.firstSplat + 1;
-                        threadBbox += splat;
-
-                        if (!haveCurBlob)
-                        {
-                            curBlob = blob;
-                            haveCurBlob = true;
-                        }
-                        else if (curBlob.lower == blob.lower
-                                 && curBlob.upper == blob.upper
-                                 && curBlob.lastSplat == blob.firstSplat)
-                            curBlob.lastSplat++;
-                        else
-                        {
-                            addBlob(threadBlobData, prevBlob, curBlob);
-                            threadBlobs++;
-                            prevBlob = curBlob;
-                            curBlob = blob;
-                        }
-                    }
-                    if (haveCurBlob)
-                    {
-                        addBlob(threadBlobData, prevBlob, curBlob);
-                        threadBlobs++;
-                    }
-
-#ifdef _OPENMP
-#pragma omp ordered
-#endif
-                    {
-                        // Write the blobs for this subrange out to file
-                        bbox += threadBbox;
-                        bf.nBlobs += threadBlobs;
-                        out.write(reinterpret_cast<const char *>(&threadBlobData[0]), threadBlobData.size() * sizeof(threadBlobData[0]));
-                        if (!out && err == 0)
-                            err = errno;
-                    }
-                }
-            }
+            appendBlobs(&buffer[0], &bufferIds[0], nBuffer, toBuckets,
+                        &bufferLower[0], &bufferUpper[0], out, bbox, bf.nBlobs, incidence, err);
 
             if (!out)
                 throw std::ios::failure("");
@@ -763,6 +1077,96 @@ void FastBlobSet<Base>::computeBlobsRange(
     }
 
     registry.getStatistic<Statistics::Variable>("blobset.blobs").add(bf.nBlobs);
+    if (nSplats > 0)
+        registry.getStatistic<Statistics::Variable>("blobset.halo").add(double(incidence) / nSplats);
+    registry.getStatistic<Statistics::Variable>("blobset.blobs.size").add(
+        out.tellp() * sizeof(BlobData));
+}
+
+template<typename Base>
+void FastBlobSet<Base>::computeBlobsDevice(
+    float spacing, Grid::size_type bucketSize,
+    detail::Bbox &bbox, BlobFile &bf, splat_id &nSplats,
+    ProgressMeter *progress)
+{
+    Statistics::Registry &registry = Statistics::Registry::getInstance();
+
+    bbox = detail::Bbox();
+    nSplats = 0;
+    bf.nBlobs = 0;
+    boost::filesystem::ofstream out;
+    createTmpFile(bf.path, out);
+
+    std::tr1::uint64_t incidence = 0;
+    try
+    {
+        const std::size_t batchSize = blobComputer->maxSplats();
+        const unsigned int slots = BlobComputer::MAX_PENDING;
+        Statistics::Container::vector<Splat> buffer("mem.computeBlobs.buffer", slots * batchSize);
+        Statistics::Container::vector<splat_id> bufferIds("mem.computeBlobs.buffer", slots * batchSize);
+        Statistics::Container::vector<BlobData> blobData("mem.computeBlobs.threadBlobData");
+        std::vector<BlobInfo> blobs;
+
+        boost::scoped_ptr<SplatStream> splats(Base::makeSplatStream(&detail::rangeAll, &detail::rangeAll + 1, true));
+        blobComputer->start(spacing, bucketSize);
+        unsigned int pending = 0;
+        unsigned int slot = 0;
+        bool more = true;
+        while (more || pending > 0)
+        {
+            /* The next batch is read from the splat stream while the
+             * previous one is being processed.
+             */
+            if (more)
+            {
+                Splat *batch = &buffer[slot * batchSize];
+                splat_id *batchIds = &bufferIds[slot * batchSize];
+                const std::size_t n = splats->read(batch, batchIds, batchSize);
+                if (n == 0)
+                    more = false;
+                else
+                {
+                    blobComputer->enqueue(batch, batchIds, n);
+                    pending++;
+                    slot = (slot + 1) % slots;
+                    nSplats += n;
+                    if (progress != NULL)
+                        *progress += n;
+                }
+            }
+
+            if (pending == slots || (!more && pending > 0))
+            {
+                detail::Bbox batchBbox;
+                std::tr1::uint64_t batchIncidence;
+                blobComputer->dequeue(blobs, batchBbox, batchIncidence);
+                pending--;
+                bbox += batchBbox;
+                incidence += batchIncidence;
+
+                blobData.clear();
+                for (std::size_t i = 0; i < blobs.size(); i++)
+                    addBlob(blobData, i > 0 ? blobs[i - 1] : blobs[i], blobs[i]);
+                bf.nBlobs += blobs.size();
+                out.write(reinterpret_cast<const char *>(&blobData[0]), blobData.size() * sizeof(blobData[0]));
+                if (!out)
+                    throw std::ios::failure("");
+            }
+        }
+        out.close();
+        if (!out)
+            throw std::ios::failure("");
+    }
+    catch (std::ios::failure &e)
+    {
+        throw boost::enable_error_info(e)
+            << boost::errinfo_errno(errno)
+            << boost::errinfo_file_name(bf.path.string());
+    }
+
+    registry.getStatistic<Statistics::Variable>("blobset.blobs").add(bf.nBlobs);
+    if (nSplats > 0)
+        registry.getStatistic<Statistics::Variable>("blobset.halo").add(double(incidence) / nSplats);
     registry.getStatistic<Statistics::Variable>("blobset.blobs.size").add(
         out.tellp() * sizeof(BlobData));
 }
@@ -821,7 +1225,8 @@ void FastBlobSet<Base>::computeBlobs(
     eraseBlobFiles();
     nSplats = 0;
 
-    blobFiles.push_back(BlobFile());
+    const unsigned int nRanges = blobComputer != NULL ? 1 : numComputeRanges();
+    blobFiles.resize(nRanges);
 
     boost::scoped_ptr<ProgressDisplay> progress;
     if (progressStream != NULL)
@@ -833,11 +1238,49 @@ void FastBlobSet<Base>::computeBlobs(
     detail::Bbox bbox;
 
     const detail::SplatToBuckets toBuckets(spacing, bucketSize);
-    computeBlobsRange(
-        detail::rangeAll.first, detail::rangeAll.second,
-        toBuckets,
-        bbox, blobFiles.back(), nSplats,
-        progress.get());
+    if (blobComputer != NULL)
+    {
+        computeBlobsDevice(spacing, bucketSize, bbox, blobFiles.back(), nSplats, progress.get());
+    }
+    else if (nRanges == 1)
+    {
+        computeBlobsRange(
+            detail::rangeAll.first, detail::rangeAll.second,
+            toBuckets,
+            bbox, blobFiles.back(), nSplats,
+            progress.get());
+    }
+    else
+    {
+        std::vector<detail::Bbox> bboxes(nRanges);
+        std::vector<splat_id> rangeSplats(nRanges, 0);
+        std::vector<boost::exception_ptr> errors(nRanges);
+#ifdef _OPENMP
+        const int ompThreads = std::max(1, int(omp_get_max_threads() / nRanges));
+#else
+        const int ompThreads = 1;
+#endif
+        boost::thread_group threads;
+        for (unsigned int i = 0; i < nRanges; i++)
+        {
+            threads.create_thread(boost::bind(
+                    &FastBlobSet<Base>::computeBlobsWorker, this,
+                    Base::partition(i, nRanges),
+                    boost::cref(toBuckets),
+                    boost::ref(bboxes[i]), boost::ref(blobFiles[i]), boost::ref(rangeSplats[i]),
+                    progress.get(), ompThreads, boost::ref(errors[i])));
+        }
+        threads.join_all();
+
+        for (unsigned int i = 0; i < nRanges; i++)
+            if (errors[i])
+                boost::rethrow_exception(errors[i]);
+        for (unsigned int i = 0; i < nRanges; i++)
+        {
+            bbox += bboxes[i];
+            nSplats += rangeSplats[i];
+        }
+    }
 
     assert(nSplats <= Base::maxSplats());
     splat_id nonFinite = Base::maxSplats() - nSplats;
@@ -853,6 +1296,243 @@ void FastBlobSet<Base>::computeBlobs(
     boundingGrid = makeBoundingGrid(spacing, bucketSize, bbox);
 }
 
+template<typename Base>
+struct FastBlobSet<Base>::IngestState
+{
+    enum
+    {
+        BUFFER_SIZE = 64 * 1024    ///< Number of finite splats converted at a time
+    };
+
+    float spacing;
+    detail::SplatToBuckets toBuckets;
+    boost::filesystem::ofstream out;
+    detail::Bbox bbox;
+    std::tr1::uint64_t incidence;
+    int err;
+
+    Statistics::Container::vector<Splat> buffer;
+    Statistics::Container::vector<splat_id> bufferIds;
+    Statistics::Container::vector<boost::array<Grid::difference_type, 3> > bufferLower;
+    Statistics::Container::vector<boost::array<Grid::difference_type, 3> > bufferUpper;
+
+    IngestState(float spacing, Grid::size_type bucketSize)
+        : spacing(spacing), toBuckets(spacing, bucketSize), incidence(0), err(0),
+        buffer("mem.computeBlobs.buffer", BUFFER_SIZE),
+        bufferIds("mem.computeBlobs.buffer", BUFFER_SIZE),
+        bufferLower("mem.computeBlobs.buffer", BUFFER_SIZE),
+        bufferUpper("mem.computeBlobs.buffer", BUFFER_SIZE)
+    {
+    }
+};
+
+template<typename Base>
+void FastBlobSet<Base>::startIngest(float spacing, Grid::size_type bucketSize)
+{
+    MLSGPU_ASSERT(bucketSize > 0, std::invalid_argument);
+    internalBucketSize = bucketSize;
+    eraseBlobFiles();
+    nSplats = 0;
+    blobFiles.resize(1);
+    ingestState.reset(new IngestState(spacing, bucketSize));
+    createTmpFile(blobFiles[0].path, ingestState->out);
+}
+
+template<typename Base>
+void FastBlobSet<Base>::ingest(const Splat *splats, splat_id first, std::size_t count)
+{
+    MLSGPU_ASSERT(ingestState, state_error);
+    IngestState &state = *ingestState;
+    BlobFile &bf = blobFiles[0];
+
+    std::size_t pos = 0;
+    while (pos < count)
+    {
+        std::size_t n = 0;
+        for (; pos < count && n < IngestState::BUFFER_SIZE; pos++)
+            if (splats[pos].isFinite())
+            {
+                state.buffer[n] = splats[pos];
+                state.bufferIds[n] = first + pos;
+                n++;
+            }
+        if (n == 0)
+            continue;
+
+        appendBlobs(&state.buffer[0], &state.bufferIds[0], n, state.toBuckets,
+                    &state.bufferLower[0], &state.bufferUpper[0],
+                    state.out, state.bbox, bf.nBlobs, state.incidence, state.err);
+        if (!state.out)
+            throw boost::enable_error_info(std::ios::failure(""))
+                << boost::errinfo_errno(state.err)
+                << boost::errinfo_file_name(bf.path.string());
+        nSplats += n;
+    }
+}
+
+template<typename Base>
+void FastBlobSet<Base>::finishIngest(bool warnNonFinite)
+{
+    MLSGPU_ASSERT(ingestState, state_error);
+    Statistics::Registry &registry = Statistics::Registry::getInstance();
+    IngestState &state = *ingestState;
+    const BlobFile &bf = blobFiles[0];
+
+    const std::streamoff size = state.out.tellp();
+    state.out.close();
+    if (!state.out)
+    {
+        if (state.err == 0)
+            state.err = errno;
+        throw boost::enable_error_info(std::ios::failure(""))
+            << boost::errinfo_errno(state.err)
+            << boost::errinfo_file_name(bf.path.string());
+    }
+
+    registry.getStatistic<Statistics::Variable>("blobset.blobs").add(bf.nBlobs);
+    if (nSplats > 0)
+        registry.getStatistic<Statistics::Variable>("blobset.halo").add(double(state.incidence) / nSplats);
+    registry.getStatistic<Statistics::Variable>("blobset.blobs.size").add(size);
+
+    MLSGPU_ASSERT(nSplats <= Base::maxSplats(), state_error);
+    splat_id nonFinite = Base::maxSplats() - nSplats;
+    if (nonFinite > 0 && warnNonFinite)
+        Log::log[Log::warn] << "Input contains " << nonFinite << " splat(s) with non-finite values\n";
+    registry.getStatistic<Statistics::Variable>("blobset.nonfinite").add(nonFinite);
+
+    boundingGrid = makeBoundingGrid(state.spacing, internalBucketSize, state.bbox);
+    ingestState.reset();
+}
+
+template<typename Base>
+void FastBlobSet<Base>::saveBlobs(const boost::filesystem::path &index, const std::string &key) const
+{
+    MLSGPU_ASSERT(internalBucketSize > 0, state_error);
+
+    for (std::size_t i = 0; i < blobFiles.size(); i++)
+    {
+        boost::filesystem::path dst = index.string() + "." + boost::lexical_cast<std::string>(i);
+        try
+        {
+            copy_file(blobFiles[i].path, dst, boost::filesystem::copy_option::overwrite_if_exists);
+        }
+        catch (boost::filesystem::filesystem_error &e)
+        {
+            throw boost::enable_error_info(std::ios::failure(e.what()))
+                << boost::errinfo_file_name(dst.string());
+        }
+    }
+
+    /* The index is written last, so that an interrupted save leaves behind
+     * either a stale index (which fails the key check) or none at all.
+     */
+    boost::filesystem::ofstream out(index);
+    out.imbue(std::locale::classic());
+    out << std::setprecision(9);
+    out << "mlsgpu-blobs 1\n"
+        << key.size() << '\n' << key << '\n'
+        << internalBucketSize << ' ' << nSplats << ' ' << blobFiles.size() << '\n'
+        << boundingGrid.getSpacing();
+    for (unsigned int i = 0; i < 3; i++)
+        out << ' ' << boundingGrid.getReference()[i];
+    for (unsigned int i = 0; i < 3; i++)
+        out << ' ' << boundingGrid.getExtent(i).first << ' ' << boundingGrid.getExtent(i).second;
+    out << '\n';
+    for (std::size_t i = 0; i < blobFiles.size(); i++)
+        out << blobFiles[i].nBlobs << '\n';
+    out.close();
+    if (!out)
+        throw boost::enable_error_info(std::ios::failure("Could not write blob index"))
+            << boost::errinfo_file_name(index.string());
+}
+
+template<typename Base>
+bool FastBlobSet<Base>::loadBlobs(const boost::filesystem::path &index, const std::string &key)
+{
+    boost::filesystem::ifstream in(index);
+    if (!in)
+        return false;
+    in.imbue(std::locale::classic());
+
+    std::string magic;
+    int version;
+    std::size_t keySize;
+    if (!(in >> magic >> version >> keySize) || magic != "mlsgpu-blobs" || version != 1
+        || keySize != key.size() || in.get() != '\n')
+        return false;
+    std::string savedKey(keySize, '\0');
+    if (!in.read(&savedKey[0], keySize) || savedKey != key)
+        return false;
+
+    Grid::size_type savedBucketSize;
+    splat_id savedSplats;
+    std::size_t nFiles;
+    float spacing;
+    float ref[3];
+    Grid::difference_type extents[3][2];
+    if (!(in >> savedBucketSize >> savedSplats >> nFiles >> spacing))
+        return false;
+    for (unsigned int i = 0; i < 3; i++)
+        in >> ref[i];
+    for (unsigned int i = 0; i < 3; i++)
+        in >> extents[i][0] >> extents[i][1];
+    if (!in || savedBucketSize == 0 || nFiles == 0)
+        return false;
+
+    std::vector<BlobFile> files(nFiles);
+    for (std::size_t i = 0; i < nFiles; i++)
+    {
+        files[i].path = index.string() + "." + boost::lexical_cast<std::string>(i);
+        files[i].owner = false;
+        if (!(in >> files[i].nBlobs) || !exists(files[i].path))
+            return false;
+    }
+
+    eraseBlobFiles();
+    blobFiles.swap(files);
+    internalBucketSize = savedBucketSize;
+    nSplats = savedSplats;
+    boundingGrid.setSpacing(spacing);
+    boundingGrid.setReference(ref);
+    for (unsigned int i = 0; i < 3; i++)
+        boundingGrid.setExtent(i, extents[i][0], extents[i][1]);
+    return true;
+}
+
+template<typename Base>
+unsigned int FastBlobSet<Base>::numComputeRanges() const
+{
+    if (computeThreads > 0)
+        return computeThreads;
+    unsigned int n = std::min(boost::thread::hardware_concurrency(), (unsigned int) MAX_DEFAULT_COMPUTE_THREADS);
+    n = std::min(splat_id(n), Base::maxSplats() / MIN_COMPUTE_RANGE_SPLATS);
+    return std::max(n, 1U);
+}
+
+template<typename Base>
+void FastBlobSet<Base>::computeBlobsWorker(
+    std::pair<splat_id, splat_id> range,
+    const detail::SplatToBuckets &toBuckets,
+    detail::Bbox &bbox, BlobFile &bf, splat_id &nSplats,
+    ProgressMeter *progress, int ompThreads,
+    boost::exception_ptr &error)
+{
+    thread_set_name("blobs");
+#ifdef _OPENMP
+    omp_set_num_threads(ompThreads);
+#else
+    (void) ompThreads;
+#endif
+    try
+    {
+        computeBlobsRange(range.first, range.second, toBuckets, bbox, bf, nSplats, progress);
+    }
+    catch (...)
+    {
+        error = boost::current_exception();
+    }
+}
+
 template<typename Base>
 bool FastBlobSet<Base>::fastPath(const Grid &grid, Grid::size_type bucketSize) const
 {
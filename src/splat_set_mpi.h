@@ -34,6 +34,7 @@
 #include <ostream>
 #include <utility>
 #include <memory>
+#include <limits>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/thread/thread.hpp>
@@ -63,10 +64,15 @@ public:
      * @param progressStream If non-NULL, will be used to report collective progress
      * @param warnNonFinite  If true (the default), a warning will be displayed if
      *                       non-finite splats are encountered.
+     * @param striped        If true, each rank processes whole files, as given by
+     *                       @ref FileSet::partitionFiles, instead of an equal
+     *                       share of the splats. This requires @a Base to be
+     *                       @ref FileSet.
      *
      * @pre
      * - The underlying set of splats is identical at all ranks.
-     * - All ranks specify the same value for @a root, @a spacing and @a bucketSize
+     * - All ranks specify the same value for @a root, @a spacing, @a bucketSize
+     *   and @a striped.
      *
      * @note The progress is actually written to the stream on the root, but
      * either ranks must pass NULL for @a progressStream or all ranks must pass
@@ -76,7 +82,8 @@ public:
         MPI_Comm comm, int root,
         float spacing, Grid::size_type bucketSize,
         std::ostream *progressStream = NULL,
-        bool warnNonFinite = true);
+        bool warnNonFinite = true,
+        bool striped = false);
 };
 
 template<typename Base>
@@ -84,7 +91,8 @@ void FastBlobSetMPI<Base>::computeBlobs(
     MPI_Comm comm, int root,
     float spacing, Grid::size_type bucketSize,
     std::ostream *progressStream,
-    bool warnNonFinite)
+    bool warnNonFinite,
+    bool striped)
 {
     int rank, size;
     MPI_Comm_rank(comm, &rank);
@@ -119,7 +127,18 @@ void FastBlobSetMPI<Base>::computeBlobs(
     try
     {
         const detail::SplatToBuckets toBuckets(spacing, bucketSize);
-        std::pair<splat_id, splat_id> range = Base::partition(rank, size);
+        std::pair<splat_id, splat_id> range;
+        if (striped)
+        {
+            std::pair<std::size_t, std::size_t> files = Base::partitionFiles(rank, size);
+            range.first = splat_id(files.first) << Base::scanIdShift;
+            if (files.second >= Base::numFiles())
+                range.second = std::numeric_limits<splat_id>::max();
+            else
+                range.second = splat_id(files.second) << Base::scanIdShift;
+        }
+        else
+            range = Base::partition(rank, size);
         this->computeBlobsRange(
             range.first, range.second,
             toBuckets,
@@ -126,6 +126,13 @@ SplatToBuckets::SplatToBuckets(float spacing, Grid::size_type bucketSize)
     std::tr1::int32_t posAdd1 = divider.getPosAdd();
     negAdd = _mm_set_epi32(negAdd1, negAdd1, negAdd1, negAdd1);
     posAdd = _mm_set_epi32(posAdd1, posAdd1, posAdd1, posAdd1);
+
+    params.invSpacing = invSpacing1;
+    params.negAdd = negAdd1;
+    params.posAdd = posAdd1;
+    params.inverse = divider.getInverse();
+    params.shift = divider.getShift();
+    batch = selectSplatToBucketsBatch();
 }
 
 } // namespace detail
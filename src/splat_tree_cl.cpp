@@ -34,9 +34,11 @@
 #include <CL/cl.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <boost/static_assert.hpp>
+#include <algorithm>
 #include <cstddef>
 #include "tr1_cstdint.h"
 #include <limits>
+#include <stdexcept>
 #include <vector>
 #include "tr1_cstdint.h"
 #include "splat_tree_cl.h"
@@ -47,14 +49,152 @@
 #include "statistics.h"
 #include "statistics_cl.h"
 
+std::size_t splatDeviceSize(SplatLayout layout)
+{
+    // Must match the layout in the kernels
+    BOOST_STATIC_ASSERT(sizeof(PackedSplat) == 24);
+    return layout == SPLAT_LAYOUT_PACKED ? sizeof(PackedSplat) : sizeof(Splat);
+}
+
+cl_half floatToHalf(float x)
+{
+    union
+    {
+        float f;
+        std::tr1::uint32_t u;
+    } v;
+    v.f = x;
+    const std::tr1::uint32_t sign = (v.u >> 16) & 0x8000;
+    const std::tr1::uint32_t bits = v.u & 0x7FFFFFFF;
+    if (bits >= 0x7F800000)
+        return sign | 0x7C00 | (bits > 0x7F800000 ? 0x200 : 0); // infinity or NaN
+    else if (bits >= 0x477FF000)
+        return sign | 0x7C00; // rounds to 65520 or more, which overflows
+    else if (bits < 0x38800000)
+    {
+        // Result is a denormal (or zero), in units of 2^-24
+        const unsigned int shift = 126 - (bits >> 23);
+        if (shift > 24)
+            return sign;
+        const std::tr1::uint32_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+        const std::tr1::uint32_t rem = mantissa & ((1U << shift) - 1);
+        const std::tr1::uint32_t halfway = 1U << (shift - 1);
+        std::tr1::uint32_t h = mantissa >> shift;
+        if (rem > halfway || (rem == halfway && (h & 1)))
+            h++;
+        return sign | h;
+    }
+    else
+    {
+        // Rebias the exponent from 127 to 15. A carry out of the mantissa correctly increments it.
+        std::tr1::uint32_t h = (bits >> 13) - (112 << 10);
+        const std::tr1::uint32_t rem = bits & 0x1FFF;
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+            h++;
+        return sign | h;
+    }
+}
+
+void storeSplats(SplatLayout layout, const Splat *in, std::size_t numSplats, void *out)
+{
+    if (layout == SPLAT_LAYOUT_PACKED)
+    {
+        PackedSplat *packed = static_cast<PackedSplat *>(out);
+        for (std::size_t i = 0; i < numSplats; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                packed[i].positionRadius[j] = in[i].position[j];
+                packed[i].normalQuality[j] = floatToHalf(in[i].normal[j]);
+            }
+            packed[i].positionRadius[3] = in[i].radius;
+            packed[i].normalQuality[3] = floatToHalf(in[i].quality);
+        }
+    }
+    else
+        std::copy(in, in + numSplats, static_cast<Splat *>(out));
+}
+
+float halfToFloat(cl_half h)
+{
+    union
+    {
+        float f;
+        std::tr1::uint32_t u;
+    } v;
+    const std::tr1::uint32_t sign = std::tr1::uint32_t(h & 0x8000) << 16;
+    const std::tr1::uint32_t exponent = (h >> 10) & 0x1F;
+    std::tr1::uint32_t mantissa = h & 0x3FF;
+    if (exponent == 0x1F)
+        v.u = sign | 0x7F800000 | (mantissa << 13); // infinity or NaN
+    else if (exponent != 0)
+        v.u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        v.u = sign;
+    else
+    {
+        // Denormal: normalize it, since it is representable as a normal float
+        std::tr1::uint32_t e = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            e--;
+        }
+        v.u = sign | (e << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    return v.f;
+}
+
+void loadSplats(SplatLayout layout, const void *in, std::size_t numSplats, Splat *out)
+{
+    if (layout == SPLAT_LAYOUT_PACKED)
+    {
+        const PackedSplat *packed = static_cast<const PackedSplat *>(in);
+        for (std::size_t i = 0; i < numSplats; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                out[i].position[j] = packed[i].positionRadius[j];
+                out[i].normal[j] = halfToFloat(packed[i].normalQuality[j]);
+            }
+            out[i].radius = packed[i].positionRadius[3];
+            out[i].quality = halfToFloat(packed[i].normalQuality[3]);
+        }
+    }
+    else
+    {
+        const Splat *full = static_cast<const Splat *>(in);
+        std::copy(full, full + numSplats, out);
+    }
+}
+
 void SplatTreeCL::validateDevice(const cl::Device &device)
 {
     if (!device.getInfo<CL_DEVICE_IMAGE_SUPPORT>())
         throw CLH::invalid_device(device, "image support is required");
 }
 
+bool SplatTreeCL::needWideCodes(std::size_t maxLevels)
+{
+    return maxLevels > MAX_LEVELS_NARROW;
+}
+
+std::size_t SplatTreeCL::codeSize() const
+{
+    return wideCodes ? sizeof(cl_ulong) : sizeof(cl_uint);
+}
+
+void SplatTreeCL::setCodeArg(cl::Kernel &kernel, cl_uint index, code_type value) const
+{
+    if (wideCodes)
+        kernel.setArg(index, (cl_ulong) value);
+    else
+        kernel.setArg(index, (cl_uint) value);
+}
+
 CLH::ResourceUsage SplatTreeCL::resourceUsage(
-    const cl::Device &device, const std::size_t maxLevels, const std::size_t maxSplats)
+    const cl::Device &device, const std::size_t maxLevels, const std::size_t maxSplats,
+    bool forceWide, bool sparse)
 {
     /* Not currently used, although it should be to determine constant overheads in
      * the clogs primitives.
@@ -65,41 +205,73 @@ CLH::ResourceUsage SplatTreeCL::resourceUsage(
     MLSGPU_ASSERT(1 <= maxSplats && maxSplats <= MAX_SPLATS, std::length_error);
     const std::tr1::uint64_t maxStart = (std::tr1::uint64_t(1) << (3 * maxLevels)) / 7;
     const std::size_t maxRanges = std::min(maxStart, std::tr1::uint64_t(8 * maxSplats));
+    const std::size_t startSize = sparse ? maxRanges : maxStart;
+    const bool wide = forceWide || needWideCodes(maxLevels);
+    const std::size_t codeSize = wide ? sizeof(cl_ulong) : sizeof(cl_uint);
 
     CLH::ResourceUsage ans;
 
     // Keep this up to date with the actual allocations below
 
-    // start = cl::Buffer(context, CL_MEM_READ_WRITE, maxStart * sizeof(command_type));
-    ans.addBuffer("start", maxStart * sizeof(command_type));
-    // jumpPos = cl::Buffer(context, CL_MEM_READ_WRITE, maxStart * sizeof(command_type));
-    ans.addBuffer("jumpPos", maxStart * sizeof(command_type));
+    // start = cl::Buffer(context, CL_MEM_READ_WRITE, startSize * sizeof(command_type));
+    ans.addBuffer("start", startSize * sizeof(command_type));
+    // jumpPos = cl::Buffer(context, CL_MEM_READ_WRITE, startSize * sizeof(command_type));
+    ans.addBuffer("jumpPos", startSize * sizeof(command_type));
+    if (sparse)
+    {
+        // cellKeys = cl::Buffer(context, CL_MEM_READ_WRITE, maxRanges * sizeof(cl_ulong));
+        ans.addBuffer("cellKeys", maxRanges * sizeof(cl_ulong));
+        // cellIndex = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8 + 1) * sizeof(cl_uint));
+        ans.addBuffer("cellIndex", (maxSplats * 8 + 1) * sizeof(cl_uint));
+        // numCells = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+        ans.addBuffer("numCells", sizeof(cl_uint));
+    }
     // commands = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8 + maxRanges * 2) * sizeof(command_type));
     ans.addBuffer("commands", (maxSplats * 8 + maxRanges * 2) * sizeof(command_type));
     // commandMap = cl::Buffer(context, CL_MEM_READ_WRITE, maxSplats * 8 * sizeof(command_type));
     ans.addBuffer("commandMap", maxSplats * 8 * sizeof(command_type));
-    // entryKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * sizeof(code_type));
-    ans.addBuffer("entryKeys", (maxSplats * 8) * sizeof(code_type));
+    // entryKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * codeSize());
+    ans.addBuffer("entryKeys", (maxSplats * 8) * codeSize);
     // entryValues = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * sizeof(command_type));
     ans.addBuffer("entryValues", (maxSplats * 8) * sizeof(command_type));
+    if (wide)
+    {
+        // sortKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * codeSize());
+        ans.addBuffer("sortKeys", (maxSplats * 8) * codeSize);
+        // sortValues = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * sizeof(command_type));
+        ans.addBuffer("sortValues", (maxSplats * 8) * sizeof(command_type));
+    }
 
-    // TODO: add in constant overheads for the scan and sort primitives
+    // TODO: add in constant overheads for the sort primitive
+    ans += ScanCL::resourceUsage(maxSplats * 8 + 1, 1);
 
     return ans;
 }
 
 SplatTreeCL::SplatTreeCL(const cl::Context &context, const cl::Device &device,
-                         std::size_t maxLevels, std::size_t maxSplats)
+                         std::size_t maxLevels, std::size_t maxSplats,
+                         bool forceWide, SplatLayout layout, bool sparse)
     :
     writeEntriesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.writeEntries.time")),
     countCommandsKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.countCommands.time")),
     writeSplatIdsKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.writeSplatIds.time")),
     writeStartKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.writeStart.time")),
     writeStartTopKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.writeStartTop.time")),
+    countCellsKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.countCells.time")),
+    writeSplatIdsSparseKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.writeSplatIdsSparse.time")),
+    writeStartSparseKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.writeStartSparse.time")),
+    initMergeKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.initMerge.time")),
+    findDuplicatesKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.findDuplicates.time")),
+    mergeSplatsKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.mergeSplats.time")),
+    dropMergedKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.dropMerged.time")),
     fillKernelTime(Statistics::getStatistic<Statistics::Variable>("kernel.octree.fill.time")),
-    maxSplats(maxSplats), maxLevels(maxLevels), numSplats(0),
-    sort(context, device, clogs::TYPE_UINT, clogs::TYPE_INT),
-    scan(context, device, clogs::TYPE_UINT)
+    maxSplats(maxSplats), maxLevels(maxLevels),
+    startAlign(std::max(std::size_t(1),
+                        device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / (8 * sizeof(command_type)))),
+    wideCodes(forceWide || needWideCodes(maxLevels)), layout(layout), sparse(sparse), mergeTolerance(0.0f), numSplats(0),
+    numStartLevels(0), lastRootStride(0),
+    sort(context, device, wideCodes ? clogs::TYPE_ULONG : clogs::TYPE_UINT, clogs::TYPE_INT),
+    scan(context, device, 1)
 {
     MLSGPU_ASSERT(1 <= maxSplats && maxSplats <= MAX_SPLATS, std::length_error);
     MLSGPU_ASSERT(1 <= maxLevels && maxLevels <= MAX_LEVELS, std::length_error);
@@ -113,23 +285,46 @@ SplatTreeCL::SplatTreeCL(const cl::Context &context, const cl::Device &device,
 
     const std::tr1::uint64_t maxStart = (std::tr1::uint64_t(1) << (3 * maxLevels)) / 7;
     const std::size_t maxRanges = std::min(maxStart, std::tr1::uint64_t(8 * maxSplats));
+    const std::size_t startSize = sparse ? maxRanges : maxStart;
 
     // If this section is modified, remember to update deviceMemory above
-    start = cl::Buffer(context, CL_MEM_READ_WRITE, maxStart * sizeof(command_type));
-    jumpPos = cl::Buffer(context, CL_MEM_READ_WRITE, maxStart * sizeof(command_type));
+    start = cl::Buffer(context, CL_MEM_READ_WRITE, startSize * sizeof(command_type));
+    jumpPos = cl::Buffer(context, CL_MEM_READ_WRITE, startSize * sizeof(command_type));
+    if (sparse)
+    {
+        cellKeys = cl::Buffer(context, CL_MEM_READ_WRITE, maxRanges * sizeof(cl_ulong));
+        cellIndex = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8 + 1) * sizeof(cl_uint));
+        numCells = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+    }
     commands = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8 + maxRanges * 2) * sizeof(command_type));
     commandMap = cl::Buffer(context, CL_MEM_READ_WRITE, maxSplats * 8 * sizeof(command_type));
-    entryKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * sizeof(code_type));
+    entryKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * codeSize());
     entryValues = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * sizeof(command_type));
+    scan.reserve(maxSplats * 8 + 1);
 
-    // Ensure that commands will be big enough to act as a temporary buffer
-    BOOST_STATIC_ASSERT(sizeof(command_type) >= sizeof(code_type));
-    // These buffers are not live during the sort, so we save memory by using them as
-    // temporary buffers for the sort.
-    sort.setTemporaryBuffers(commands, commandMap);
+    if (wideCodes)
+    {
+        /* The commands buffer cannot hold a full set of 64-bit keys (it is
+         * only guaranteed to be as large as the 32-bit keys), so separate
+         * temporaries are needed.
+         */
+        sortKeys = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * codeSize());
+        sortValues = cl::Buffer(context, CL_MEM_READ_WRITE, (maxSplats * 8) * sizeof(command_type));
+        sort.setTemporaryBuffers(sortKeys, sortValues);
+    }
+    else
+    {
+        // Ensure that commands will be big enough to act as a temporary buffer
+        BOOST_STATIC_ASSERT(sizeof(command_type) >= sizeof(cl_uint));
+        // These buffers are not live during the sort, so we save memory by using them as
+        // temporary buffers for the sort.
+        sort.setTemporaryBuffers(commands, commandMap);
+    }
 
     std::map<std::string, std::string> defines;
     defines["MAX_LEVELS"] = boost::lexical_cast<std::string>(maxLevels);
+    defines["CODE_BITS"] = wideCodes ? "64" : "32";
+    defines["PACKED_SPLATS"] = layout == SPLAT_LAYOUT_PACKED ? "1" : "0";
 
     cl::Program program = CLH::build(context, "kernels/octree.cl", defines);
     writeEntriesKernel = cl::Kernel(program, "writeEntries");
@@ -138,6 +333,19 @@ SplatTreeCL::SplatTreeCL(const cl::Context &context, const cl::Device &device,
     fillKernel = cl::Kernel(program, "fill");
     writeStartKernel = cl::Kernel(program, "writeStart");
     writeStartTopKernel = cl::Kernel(program, "writeStartTop");
+    countCellsKernel = cl::Kernel(program, "countCells");
+    writeSplatIdsSparseKernel = cl::Kernel(program, "writeSplatIdsSparse");
+    writeStartSparseKernel = cl::Kernel(program, "writeStartSparse");
+    initMergeKernel = cl::Kernel(program, "initMerge");
+    findDuplicatesKernel = cl::Kernel(program, "findDuplicates");
+    mergeSplatsKernel = cl::Kernel(program, "mergeSplats");
+    dropMergedKernel = cl::Kernel(program, "dropMerged");
+}
+
+void SplatTreeCL::setMergeTolerance(float tolerance)
+{
+    MLSGPU_ASSERT(tolerance >= 0.0f, std::invalid_argument);
+    mergeTolerance = tolerance;
 }
 
 void SplatTreeCL::enqueueWriteEntries(
@@ -147,6 +355,8 @@ void SplatTreeCL::enqueueWriteEntries(
     const cl::Buffer &splats,
     command_type firstSplat,
     command_type numSplats,
+    command_type firstEntry,
+    code_type rootOffset,
     const Grid::difference_type offset[3],
     std::size_t minShift,
     std::size_t maxShift,
@@ -159,10 +369,12 @@ void SplatTreeCL::enqueueWriteEntries(
     writeEntriesKernel.setArg(1, values);
     writeEntriesKernel.setArg(2, splats);
     writeEntriesKernel.setArg(3, offset3);
-    writeEntriesKernel.setArg(4, cl::__local(sizeof(code_type) * (maxShift + 1)));
+    writeEntriesKernel.setArg(4, cl::__local(codeSize() * (maxShift + 1)));
     writeEntriesKernel.setArg(5, (cl_uint) minShift);
     writeEntriesKernel.setArg(6, (cl_uint) maxShift);
     writeEntriesKernel.setArg(7, (cl_uint) firstSplat);
+    writeEntriesKernel.setArg(8, (cl_uint) firstEntry);
+    setCodeArg(writeEntriesKernel, 9, rootOffset);
 
     CLH::enqueueNDRangeKernel(queue,
                               writeEntriesKernel,
@@ -216,6 +428,134 @@ void SplatTreeCL::enqueueWriteSplatIds(
                               events, event, &writeSplatIdsKernelTime);
 }
 
+void SplatTreeCL::enqueueCountCells(
+    const cl::CommandQueue &queue,
+    const cl::Buffer &indicator,
+    const cl::Buffer &keys,
+    command_type numKeys,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    countCellsKernel.setArg(0, indicator);
+    countCellsKernel.setArg(1, keys);
+
+    CLH::enqueueNDRangeKernel(queue,
+                              countCellsKernel,
+                              cl::NullRange,
+                              cl::NDRange(numKeys + 1),
+                              cl::NullRange,
+                              events, event, &countCellsKernelTime);
+}
+
+void SplatTreeCL::enqueueWriteSplatIdsSparse(
+    const cl::CommandQueue &queue,
+    command_type numEntries,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    writeSplatIdsSparseKernel.setArg(0, commands);
+    writeSplatIdsSparseKernel.setArg(1, start);
+    writeSplatIdsSparseKernel.setArg(2, jumpPos);
+    writeSplatIdsSparseKernel.setArg(3, cellKeys);
+    writeSplatIdsSparseKernel.setArg(4, commandMap);
+    writeSplatIdsSparseKernel.setArg(5, cellIndex);
+    writeSplatIdsSparseKernel.setArg(6, entryKeys);
+    writeSplatIdsSparseKernel.setArg(7, entryValues);
+
+    CLH::enqueueNDRangeKernel(queue,
+                              writeSplatIdsSparseKernel,
+                              cl::NullRange, cl::NDRange(numEntries), cl::NullRange,
+                              events, event, &writeSplatIdsSparseKernelTime);
+}
+
+void SplatTreeCL::enqueueWriteStartSparse(
+    const cl::CommandQueue &queue,
+    command_type numEntries,
+    unsigned int levels,
+    code_type stride,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    writeStartSparseKernel.setArg(0, commands);
+    writeStartSparseKernel.setArg(1, start);
+    writeStartSparseKernel.setArg(2, jumpPos);
+    writeStartSparseKernel.setArg(3, cellKeys);
+    writeStartSparseKernel.setArg(4, numCells);
+    writeStartSparseKernel.setArg(5, (cl_uint) levels);
+    writeStartSparseKernel.setArg(6, (cl_ulong) stride);
+
+    CLH::enqueueNDRangeKernel(queue,
+                              writeStartSparseKernel,
+                              cl::NullRange, cl::NDRange(numEntries), cl::NullRange,
+                              events, event, &writeStartSparseKernelTime);
+}
+
+void SplatTreeCL::enqueueMerge(
+    const cl::CommandQueue &queue,
+    const std::vector<Root> &roots,
+    command_type numEntries,
+    unsigned int sortBits,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    std::vector<cl::Event> initEvents;
+    for (std::size_t i = 0; i < roots.size(); i++)
+    {
+        if (roots[i].numSplats == 0)
+            continue;
+        MLSGPU_ASSERT(roots[i].firstSplat + roots[i].numSplats <= 8 * maxSplats, std::length_error);
+        initMergeKernel.setArg(0, commandMap);
+        initMergeKernel.setArg(1, (cl_uint) roots[i].firstSplat);
+        initEvents.push_back(cl::Event());
+        CLH::enqueueNDRangeKernel(queue,
+                                  initMergeKernel,
+                                  cl::NullRange, cl::NDRange(roots[i].numSplats), cl::NullRange,
+                                  events, &initEvents.back(), &initMergeKernelTime);
+    }
+
+    cl::Event findEvent;
+    findDuplicatesKernel.setArg(0, commandMap);
+    findDuplicatesKernel.setArg(1, entryKeys);
+    findDuplicatesKernel.setArg(2, entryValues);
+    findDuplicatesKernel.setArg(3, splats);
+    findDuplicatesKernel.setArg(4, mergeTolerance);
+    CLH::enqueueNDRangeKernel(queue,
+                              findDuplicatesKernel,
+                              cl::NullRange, cl::NDRange(numEntries), cl::NullRange,
+                              &initEvents, &findEvent, &findDuplicatesKernelTime);
+
+    std::vector<cl::Event> wait(1, findEvent);
+    std::vector<cl::Event> mergeEvents;
+    for (std::size_t i = 0; i < roots.size(); i++)
+    {
+        if (roots[i].numSplats == 0)
+            continue;
+        mergeSplatsKernel.setArg(0, splats);
+        mergeSplatsKernel.setArg(1, commandMap);
+        mergeSplatsKernel.setArg(2, (cl_uint) roots[i].firstSplat);
+        mergeEvents.push_back(cl::Event());
+        CLH::enqueueNDRangeKernel(queue,
+                                  mergeSplatsKernel,
+                                  cl::NullRange, cl::NDRange(roots[i].numSplats), cl::NullRange,
+                                  &wait, &mergeEvents.back(), &mergeSplatsKernelTime);
+    }
+
+    /* The sort uses commandMap as a temporary when codes are narrow, so the
+     * targets must all have been consumed before it starts.
+     */
+    cl::Event dropEvent;
+    dropMergedKernel.setArg(0, entryKeys);
+    dropMergedKernel.setArg(1, entryValues);
+    dropMergedKernel.setArg(2, commandMap);
+    CLH::enqueueNDRangeKernel(queue,
+                              dropMergedKernel,
+                              cl::NullRange, cl::NDRange(numEntries), cl::NullRange,
+                              &mergeEvents, &dropEvent, &dropMergedKernelTime);
+
+    wait[0] = dropEvent;
+    sort.enqueue(queue, entryKeys, entryValues, numEntries, sortBits, &wait, event);
+}
+
 void SplatTreeCL::enqueueFill(
     const cl::CommandQueue &queue,
     const cl::Buffer &buffer,
@@ -244,28 +584,90 @@ void SplatTreeCL::enqueueWriteStart(
     code_type curOffset,
     bool havePrev,
     code_type prevOffset,
-    code_type numCodes,
+    unsigned int levelBits,
+    std::size_t numRoots,
+    code_type stride,
     const std::vector<cl::Event> *events,
     cl::Event *event)
 {
     cl::Kernel &kernel = havePrev ? writeStartKernel : writeStartTopKernel;
     Statistics::Variable &time = havePrev ? writeStartKernelTime : writeStartTopKernelTime;
-    kernel.setArg(0, start);
-    kernel.setArg(1, commands);
-    kernel.setArg(2, jumpPos);
-    kernel.setArg(3, curOffset);
+    cl_uint arg = 0;
+    kernel.setArg(arg++, start);
+    kernel.setArg(arg++, commands);
+    kernel.setArg(arg++, jumpPos);
+    setCodeArg(kernel, arg++, curOffset);
     if (havePrev)
-        kernel.setArg(4, prevOffset);
+        setCodeArg(kernel, arg++, prevOffset);
+    kernel.setArg(arg++, (cl_uint) levelBits);
+    setCodeArg(kernel, arg++, stride);
 
     CLH::enqueueNDRangeKernel(queue,
                               kernel,
                               cl::NullRange,
-                              cl::NDRange(numCodes),
+                              cl::NDRange(numRoots << levelBits),
                               cl::NullRange,
                               events, event, &time);
 }
 
 
+std::size_t SplatTreeCL::levelRange(
+    const Grid::size_type size[3], unsigned int subsamplingShift,
+    unsigned int &minShift, unsigned int &maxShift) const
+{
+    /* Only build as many levels as are needed to cover size[]. Buckets
+     * are frequently much smaller than the maximum, particularly in dense
+     * regions, and every level dropped removes three bits from the sort
+     * keys (and hence passes from the radix sort) and shrinks the start
+     * array by a factor of 8.
+     */
+    const unsigned int fullShift = maxLevels + subsamplingShift - 1;
+    const Grid::size_type sizeMax = *std::max_element(size, size + 3);
+    maxShift = subsamplingShift;
+    while (maxShift < fullShift && (Grid::size_type(1U) << maxShift) < sizeMax)
+        maxShift++;
+    minShift = std::min(subsamplingShift, maxShift);
+
+    std::size_t numStart = 0;
+    for (unsigned int i = minShift; i <= maxShift; i++)
+        numStart += std::size_t(1) << (3 * (maxShift - i));
+    return numStart;
+}
+
+std::size_t SplatTreeCL::rootStride(std::size_t numStart) const
+{
+    return (numStart + startAlign - 1) / startAlign * startAlign;
+}
+
+bool SplatTreeCL::canBuild(const std::vector<Root> &roots, unsigned int subsamplingShift) const
+{
+    if (roots.empty())
+        return false;
+    const Grid::size_type maxSize = Grid::size_type(1U) << (maxLevels + subsamplingShift - 1);
+    std::size_t totalSplats = 0;
+    Grid::size_type size[3] = {0, 0, 0};
+    for (std::size_t i = 0; i < roots.size(); i++)
+    {
+        totalSplats += roots[i].numSplats;
+        for (int j = 0; j < 3; j++)
+        {
+            if (roots[i].size[j] > maxSize)
+                return false;
+            size[j] = std::max(size[j], roots[i].size[j]);
+        }
+    }
+    if (totalSplats > maxSplats)
+        return false;
+
+    unsigned int minShift, maxShift;
+    const std::size_t numStart = levelRange(size, subsamplingShift, minShift, maxShift);
+    const std::tr1::uint64_t maxStart = (std::tr1::uint64_t(1) << (3 * maxLevels)) / 7;
+    if (roots.size() == 1)
+        return numStart <= maxStart;
+    else
+        return std::tr1::uint64_t(rootStride(numStart)) * roots.size() <= maxStart;
+}
+
 void SplatTreeCL::enqueueBuild(
     const cl::CommandQueue &queue,
     const cl::Buffer &splats, std::size_t firstSplat, std::size_t numSplats,
@@ -274,16 +676,41 @@ void SplatTreeCL::enqueueBuild(
     const std::vector<cl::Event> *events,
     cl::Event *event)
 {
-    MLSGPU_ASSERT(numSplats <= maxSplats, std::length_error);
-    MLSGPU_ASSERT(firstSplat < CL_UINT_MAX - numSplats, std::length_error);
     Grid::size_type maxSize = Grid::size_type(1U) << (maxLevels + subsamplingShift - 1);
     MLSGPU_ASSERT(size[0] <= maxSize && size[1] <= maxSize && size[2] <= maxSize,
                   std::length_error);
-    unsigned int maxShift = maxLevels + subsamplingShift - 1;
-    unsigned int minShift = std::min(subsamplingShift, maxShift);
-    // TODO: this will always construct a full-size octree, even if size[] only
-    // specifies a much smaller space. At a minimum, it should be possible to make
-    // levelOffsets more compact.
+
+    std::vector<Root> roots(1);
+    roots[0].firstSplat = firstSplat;
+    roots[0].numSplats = numSplats;
+    std::copy(size, size + 3, roots[0].size);
+    std::copy(offset, offset + 3, roots[0].offset);
+    enqueueBuild(queue, splats, roots, subsamplingShift, events, event);
+}
+
+void SplatTreeCL::enqueueBuild(
+    const cl::CommandQueue &queue,
+    const cl::Buffer &splats, const std::vector<Root> &roots,
+    unsigned int subsamplingShift,
+    const std::vector<cl::Event> *events,
+    cl::Event *event)
+{
+    MLSGPU_ASSERT(canBuild(roots, subsamplingShift), std::length_error);
+
+    Grid::size_type size[3] = {0, 0, 0};
+    std::size_t numSplats = 0;
+    for (std::size_t i = 0; i < roots.size(); i++)
+    {
+        MLSGPU_ASSERT(roots[i].firstSplat < CL_UINT_MAX - roots[i].numSplats, std::length_error);
+        numSplats += roots[i].numSplats;
+        for (int j = 0; j < 3; j++)
+            size[j] = std::max(size[j], roots[i].size[j]);
+    }
+
+    unsigned int minShift, maxShift;
+    const std::size_t numStart = levelRange(size, subsamplingShift, minShift, maxShift);
+    const std::size_t stride = roots.size() == 1 ? numStart : rootStride(numStart);
+    const std::size_t totalStart = stride * roots.size();
 
     this->numSplats = numSplats;
     std::size_t pos = 0;
@@ -291,41 +718,111 @@ void SplatTreeCL::enqueueBuild(
     for (std::size_t i = minShift; i <= maxShift; i++)
     {
         levelOffsets[i] = pos;
-        pos += 1U << (3 * (maxShift - i));
+        pos += std::size_t(1) << (3 * (maxShift - i));
     }
-    std::size_t numStart = pos;
+
+    numStartLevels = maxShift - minShift + 1;
+    lastRootStride = stride;
+    rootStarts.clear();
+    rootStarts.reserve(roots.size());
+    rootStarts.push_back(start);
+    for (std::size_t i = 1; i < roots.size(); i++)
+    {
+        if (sparse)
+        {
+            // All roots share the table of occupied cells
+            rootStarts.push_back(start);
+            continue;
+        }
+        cl_buffer_region region;
+        region.origin = i * stride * sizeof(command_type);
+        region.size = numStart * sizeof(command_type);
+        rootStarts.push_back(start.createSubBuffer(
+                CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region));
+    }
+
+    /* Keys from all the roots are sorted together, so the sort must cover
+     * every bit that can be set in a valid key. Invalid keys are CODE_MAX,
+     * whose low bits are all set, so they still sort to the end.
+     */
+    unsigned int sortBits = 1;
+    while ((std::tr1::uint64_t(1) << sortBits) <= totalStart)
+        sortBits++;
 
     std::vector<cl::Event> wait(1);
 
-    cl::Event writeEntriesEvent, sortEvent, countEvent, scanEvent,
-        writeSplatIdsEvent, levelEvent, fillJumpPosEvent;
+    cl::Event sortEvent, countEvent, scanEvent,
+        writeSplatIdsEvent, levelEvent, fillJumpPosEvent,
+        countCellsEvent, scanCellsEvent, copyCellsEvent;
+    std::vector<cl::Event> writeEntriesEvents;
     this->splats = splats;
 
     // TODO: revisit this dependency tracking
     const std::size_t numEntries = numSplats * 8;
-    enqueueWriteEntries(queue, entryKeys, entryValues, this->splats, firstSplat, numSplats, offset, minShift, maxShift, events, &writeEntriesEvent);
-    wait[0] = writeEntriesEvent;
-    sort.enqueue(queue, entryKeys, entryValues, numEntries, 3 * (maxShift - minShift) + 1, &wait, &sortEvent);
+    std::size_t firstEntry = 0;
+    for (std::size_t i = 0; i < roots.size(); i++)
+    {
+        if (roots[i].numSplats == 0)
+            continue;
+        writeEntriesEvents.push_back(cl::Event());
+        enqueueWriteEntries(queue, entryKeys, entryValues, this->splats,
+                            roots[i].firstSplat, roots[i].numSplats,
+                            firstEntry, i * stride,
+                            roots[i].offset, minShift, maxShift,
+                            events, &writeEntriesEvents.back());
+        firstEntry += roots[i].numSplats * 8;
+    }
+    sort.enqueue(queue, entryKeys, entryValues, numEntries, sortBits,
+                 writeEntriesEvents.empty() ? events : &writeEntriesEvents, &sortEvent);
     wait[0] = sortEvent;
+    if (mergeTolerance > 0.0f && numSplats > 0)
+    {
+        cl::Event mergeEvent;
+        enqueueMerge(queue, roots, numEntries, sortBits, &wait, &mergeEvent);
+        wait[0] = mergeEvent;
+    }
     enqueueCountCommands(queue, commandMap, entryKeys, numEntries, &wait, &countEvent);
     wait[0] = countEvent;
-    const command_type scanOffset = 1; // make room for the first end pointer
+    const cl_uint scanOffset = 1; // make room for the first end pointer
     scan.enqueue(queue, commandMap, numEntries, &scanOffset, &wait, &scanEvent);
     wait[0] = scanEvent;
-    enqueueFill(queue, jumpPos, 0, numStart, (command_type) -1, &wait, &fillJumpPosEvent);
+
+    if (sparse)
+    {
+        /* Give each occupied cell a slot in the start array. The extra
+         * element of the scan is the number of occupied cells, which is
+         * copied out for use in lookups.
+         */
+        enqueueCountCells(queue, cellIndex, entryKeys, numEntries, &wait, &countCellsEvent);
+        wait[0] = countCellsEvent;
+        scan.enqueue(queue, cellIndex, numEntries + 1, NULL, &wait, &scanCellsEvent);
+        wait[0] = scanCellsEvent;
+        queue.enqueueCopyBuffer(cellIndex, numCells, numEntries * sizeof(cl_uint), 0, sizeof(cl_uint),
+                                &wait, &copyCellsEvent);
+        wait[0] = copyCellsEvent;
+        enqueueWriteSplatIdsSparse(queue, numEntries, &wait, &writeSplatIdsEvent);
+        wait[0] = writeSplatIdsEvent;
+        enqueueWriteStartSparse(queue, numEntries, numStartLevels, stride, &wait, &levelEvent);
+        wait[0] = levelEvent;
+        if (event != NULL)
+            *event = wait[0];
+        return;
+    }
+
+    enqueueFill(queue, jumpPos, 0, totalStart, (command_type) -1, &wait, &fillJumpPosEvent);
     wait[0] = fillJumpPosEvent;
     enqueueWriteSplatIds(queue, commands, start, jumpPos, commandMap, entryKeys, entryValues, numEntries, &wait, &writeSplatIdsEvent);
     wait[0] = writeSplatIdsEvent;
 
     for (int i = maxShift; i >= int(minShift); i--)
     {
-        std::size_t levelSize = std::size_t(1) << (3 * (maxShift - i));
         bool havePrev = (i != int(maxShift));
         enqueueWriteStart(queue, start, commands, jumpPos,
                           levelOffsets[i],
                           havePrev,
                           havePrev ? levelOffsets[i + 1] : 0,
-                          levelSize,
+                          3 * (maxShift - i),
+                          roots.size(), stride,
                           &wait, &levelEvent);
         wait[0] = levelEvent;
     }
@@ -334,6 +831,18 @@ void SplatTreeCL::enqueueBuild(
         *event = wait[0];
 }
 
+const cl::Buffer &SplatTreeCL::getStart(std::size_t root) const
+{
+    MLSGPU_ASSERT(root < rootStarts.size(), std::out_of_range);
+    return rootStarts[root];
+}
+
+SplatTreeCL::code_type SplatTreeCL::getRootOffset(std::size_t root) const
+{
+    MLSGPU_ASSERT(root < rootStarts.size(), std::out_of_range);
+    return root * lastRootStride;
+}
+
 void SplatTreeCL::clearSplats()
 {
     splats = cl::Buffer();
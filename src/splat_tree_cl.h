@@ -33,14 +33,72 @@
 
 #include <CL/cl.hpp>
 #include <utility>
+#include <vector>
 #include <boost/noncopyable.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
 #include <clogs/clogs.h>
 #include "splat_tree.h"
 #include "clh.h"
+#include "scan_cl.h"
 #include "grid.h"
 #include "statistics.h"
 
+/**
+ * Layout of splats in the device buffers given to @ref SplatTreeCL and
+ * @ref MlsFunctor.
+ */
+enum SplatLayout
+{
+    SPLAT_LAYOUT_FULL,     ///< @ref Splat copied unmodified
+    SPLAT_LAYOUT_PACKED    ///< @ref PackedSplat
+};
+
+/**
+ * Compact device representation of a @ref Splat. The position and radius
+ * determine the octree and the weights so they are kept at full precision,
+ * but the normal and quality are stored at half precision. This reduces a
+ * splat from 32 to 24 bytes.
+ */
+struct PackedSplat
+{
+    cl_float positionRadius[4];   ///< Position in xyz, radius in w
+    cl_half normalQuality[4];     ///< Normal in xyz, quality in w
+};
+
+/// Number of bytes of device memory used by each splat in @a layout
+std::size_t splatDeviceSize(SplatLayout layout);
+
+/**
+ * Convert a float to half precision, rounding to nearest even. Values too
+ * large for half precision become infinities.
+ */
+cl_half floatToHalf(float x);
+
+/**
+ * Write splats in a device layout, ready to be copied to a device buffer.
+ *
+ * @param layout     Layout for the output.
+ * @param in         Input splats.
+ * @param numSplats  Number of splats in @a in.
+ * @param[out] out   Output, with space for @a numSplats splats in @a layout (see @ref splatDeviceSize).
+ */
+void storeSplats(SplatLayout layout, const Splat *in, std::size_t numSplats, void *out);
+
+/// Convert a half-precision value to a float (which is exact).
+float halfToFloat(cl_half h);
+
+/**
+ * Inverse of @ref storeSplats. With @ref SPLAT_LAYOUT_PACKED the normals and
+ * qualities keep the half-precision rounding, so that the result matches
+ * what the device sees.
+ *
+ * @param layout     Layout of the input.
+ * @param in         Input in @a layout, as written by @ref storeSplats.
+ * @param numSplats  Number of splats in @a in.
+ * @param[out] out   Output splats.
+ */
+void loadSplats(SplatLayout layout, const void *in, std::size_t numSplats, Splat *out);
+
 /**
  * Concrete implementation of @ref SplatTree that stores the data
  * in OpenCL buffers. It does not actually derive from @ref SplatTree because
@@ -48,6 +106,15 @@
  *
  * To ease implementation, levels are numbered backwards i.e. level 0 is the
  * largest, finest-grained level, and the last level is 1x1x1.
+ *
+ * By default the start array is dense: it has an element for every cell at
+ * every level, so its size grows by a factor of 8 with each level regardless
+ * of how many cells are occupied. A @em sparse tree instead stores only the
+ * occupied cells, sorted by key, in the start array, with their keys in
+ * @ref getCellKeys. A cell is looked up by binary search at each level from
+ * the finest, until an occupied ancestor is found. This costs a few more
+ * memory accesses per lookup, but memory is proportional to the number of
+ * splats, making deep octrees feasible.
  */
 class SplatTreeCL : public boost::noncopyable
 {
@@ -60,20 +127,39 @@ public:
 
     /**
      * Type used to represent indices into the cells, and also for
-     * sort keys.
+     * sort keys. The device uses either 32-bit or 64-bit codes (see
+     * @ref MAX_LEVELS_NARROW), so this is wide enough to hold either.
      */
-    typedef std::tr1::uint32_t code_type;
+    typedef std::tr1::uint64_t code_type;
+
+    /**
+     * One region of a batched octree (see @ref enqueueBuild).
+     */
+    struct Root
+    {
+        std::size_t firstSplat;          ///< Index of the first splat to use
+        std::size_t numSplats;           ///< Number of splats to use
+        Grid::size_type size[3];         ///< Number of cells to cover
+        Grid::difference_type offset[3]; ///< Offset of the region within the overall grid
+    };
 
     enum
     {
+        /**
+         * The maximum value of @a maxLevels for which 32-bit codes are used.
+         * This is the maximum that will allow the size of the start array to
+         * be represented in a 32-bit integer. Larger trees use 64-bit codes,
+         * which double the size of the sort keys and make the sort slower.
+         */
+        MAX_LEVELS_NARROW = 10,
+
         /**
          * The maximum legal value for @a maxLevels passed to the constructor. This
          * value is the maximum that will allow the size of the start array to be
-         * represented in a 32-bit integer. On a 64-bit system it could probably be
-         * made larger, but only with significant changes to the kernel code to use
-         * 64-bit values for @ref code_type.
+         * represented in a 64-bit integer. In practice, the start array will
+         * exhaust device memory well before this limit is reached.
          */
-        MAX_LEVELS = 10
+        MAX_LEVELS = 21
     };
 
     enum
@@ -96,6 +182,8 @@ private:
      */
     cl::Kernel writeEntriesKernel, countCommandsKernel, writeSplatIdsKernel;
     cl::Kernel writeStartKernel, writeStartTopKernel;
+    cl::Kernel countCellsKernel, writeSplatIdsSparseKernel, writeStartSparseKernel;
+    cl::Kernel initMergeKernel, findDuplicatesKernel, mergeSplatsKernel, dropMergedKernel;
     cl::Kernel fillKernel;
     /** @} */
 
@@ -109,6 +197,13 @@ private:
     Statistics::Variable &writeSplatIdsKernelTime;
     Statistics::Variable &writeStartKernelTime;
     Statistics::Variable &writeStartTopKernelTime;
+    Statistics::Variable &countCellsKernelTime;
+    Statistics::Variable &writeSplatIdsSparseKernelTime;
+    Statistics::Variable &writeStartSparseKernelTime;
+    Statistics::Variable &initMergeKernelTime;
+    Statistics::Variable &findDuplicatesKernelTime;
+    Statistics::Variable &mergeSplatsKernelTime;
+    Statistics::Variable &dropMergedKernelTime;
     Statistics::Variable &fillKernelTime;
     /**
      * @}
@@ -123,8 +218,16 @@ private:
     cl::Buffer splats;
     cl::Buffer start;
     cl::Buffer commands;
+    cl::Buffer cellKeys;     ///< Keys of the occupied cells (only for sparse trees)
+    cl::Buffer numCells;     ///< Number of occupied cells (only for sparse trees)
     /** @} */
 
+    /**
+     * Start arrays of the individual roots built by the last @ref enqueueBuild.
+     * The first is @ref start itself; the others are sub-buffers of it.
+     */
+    std::vector<cl::Buffer> rootStarts;
+
     /**
      * @name
      * @{
@@ -135,18 +238,44 @@ private:
      */
     cl::Buffer commandMap;   ///< Maps sorted entries to positions in the command array
     cl::Buffer jumpPos;      ///< Position in command array of jump command for each key (-1 if not present)
+    cl::Buffer cellIndex;    ///< Maps sorted entries to occupied cells (only for sparse trees)
     cl::Buffer entryKeys;    ///< Sort keys for entries
     cl::Buffer entryValues;  ///< Splat IDs for entries
+    cl::Buffer sortKeys;     ///< Temporary keys for the sort (only with wide codes)
+    cl::Buffer sortValues;   ///< Temporary values for the sort (only with wide codes)
     /** @} */
 
     std::size_t maxSplats;   ///< Maximum splats for which memory has been allocated
     std::size_t maxLevels;   ///< Maximum levels for which memory has been allocated
+    std::size_t startAlign;  ///< Elements of @ref start to which each root is aligned
+    bool wideCodes;          ///< Whether the device uses 64-bit codes
+    SplatLayout layout;      ///< Layout of the splats passed to @ref enqueueBuild
+    bool sparse;             ///< Whether the start array holds only occupied cells
+    float mergeTolerance;    ///< Tolerance for merging duplicate splats (see @ref setMergeTolerance)
 
     std::size_t numSplats;   ///< Number of splats in the octree
     std::vector<std::size_t> levelOffsets; ///< Start of each level in compacted arrays
+    std::size_t numStartLevels;  ///< Number of levels built by the last @ref enqueueBuild
+    code_type lastRootStride;    ///< Key distance between roots in the last @ref enqueueBuild
 
     clogs::Radixsort sort;   ///< Sorter for sorting the entries
-    clogs::Scan scan;        ///< Scanner for computing @ref commandMap
+    ScanCL scan;             ///< Scanner for computing @ref commandMap
+
+    /// Size in bytes of a code on the device
+    std::size_t codeSize() const;
+
+    /// Set a kernel argument of type @c code_t
+    void setCodeArg(cl::Kernel &kernel, cl_uint index, code_type value) const;
+
+    /**
+     * Compute the range of levels needed to cover @a size, and the number of
+     * elements of the start array for one root (before alignment).
+     */
+    std::size_t levelRange(const Grid::size_type size[3], unsigned int subsamplingShift,
+                           unsigned int &minShift, unsigned int &maxShift) const;
+
+    /// Elements of the start array between the starts of consecutive roots
+    std::size_t rootStride(std::size_t numStart) const;
 
     /// Wrapper to call @ref writeEntries
     void enqueueWriteEntries(const cl::CommandQueue &queue,
@@ -155,6 +284,8 @@ private:
                              const cl::Buffer &splats,
                              command_type firstSplat,
                              command_type numSplats,
+                             command_type firstEntry,
+                             code_type rootOffset,
                              const Grid::difference_type offset[3],
                              std::size_t minShift,
                              std::size_t maxShift,
@@ -185,6 +316,7 @@ private:
      * Wrapper to call @ref writeStart or @ref writeStartTop.
      * If @a havePrev is true, it calls @ref writeStart. Otherwise,
      * @a prevOffset is ignored and @ref writeStartTop is called.
+     * The level is processed for all @a numRoots roots at once.
      */
     void enqueueWriteStart(const cl::CommandQueue &queue,
                            const cl::Buffer &start,
@@ -193,10 +325,46 @@ private:
                            code_type curOffset,
                            bool havePrev,
                            code_type prevOffset,
-                           code_type numCodes,
+                           unsigned int levelBits,
+                           std::size_t numRoots,
+                           code_type stride,
                            const std::vector<cl::Event> *events,
                            cl::Event *event);
 
+    /// Wrapper to call @ref countCells
+    void enqueueCountCells(const cl::CommandQueue &queue,
+                           const cl::Buffer &indicator,
+                           const cl::Buffer &keys,
+                           command_type numKeys,
+                           const std::vector<cl::Event> *events,
+                           cl::Event *event);
+
+    /// Wrapper to call @ref writeSplatIdsSparse
+    void enqueueWriteSplatIdsSparse(const cl::CommandQueue &queue,
+                                    command_type numEntries,
+                                    const std::vector<cl::Event> *events,
+                                    cl::Event *event);
+
+    /// Wrapper to call @ref writeStartSparse
+    void enqueueWriteStartSparse(const cl::CommandQueue &queue,
+                                 command_type numEntries,
+                                 unsigned int levels,
+                                 code_type stride,
+                                 const std::vector<cl::Event> *events,
+                                 cl::Event *event);
+
+    /**
+     * Merge duplicate splats and remove their entries, using @ref commandMap
+     * to hold the merge targets. On entry the entries must be sorted, and on
+     * completion of @a event they are sorted again.
+     */
+    void enqueueMerge(const cl::CommandQueue &queue,
+                      const std::vector<Root> &roots,
+                      command_type numEntries,
+                      unsigned int sortBits,
+                      const std::vector<cl::Event> *events,
+                      cl::Event *event);
+
     /// Wrapper to call @ref fill
     void enqueueFill(const cl::CommandQueue &queue,
                      const cl::Buffer &buffer,
@@ -215,6 +383,12 @@ public:
      */
     static void validateDevice(const cl::Device &device);
 
+    /**
+     * Determines whether 64-bit codes are needed for an octree with
+     * @a maxLevels levels.
+     */
+    static bool needWideCodes(std::size_t maxLevels);
+
     /**
      * Estimates the device resources needed, based on the constructor
      * arguments.
@@ -224,7 +398,8 @@ public:
      * - 1 <= @a maxSplats <= @ref MAX_SPLATS.
      */
     static CLH::ResourceUsage resourceUsage(
-        const cl::Device &device, std::size_t maxLevels, std::size_t maxSplats);
+        const cl::Device &device, std::size_t maxLevels, std::size_t maxSplats,
+        bool forceWide = false, bool sparse = false);
 
     /**
      * Constructor. This allocates the maximum supported sizes for all the
@@ -234,16 +409,24 @@ public:
      * @param device    OpenCL device used to specialise kernels.
      * @param maxLevels Maximum number of octree levels (maximum dimension is 2^<sup>@a maxLevels - 1</sup>).
      * @param maxSplats Maximum number of splats supported.
+     * @param forceWide Use 64-bit codes even if @a maxLevels does not require them.
+     * @param layout    Layout of the splats that will be passed to @ref enqueueBuild.
+     * @param sparse    Store only the occupied cells in the start array (see @ref SplatTreeCL).
      *
      * @pre
      * - 1 <= @a maxLevels <= @ref MAX_LEVELS
      * - 1 <= @a maxSplats <= @ref MAX_SPLATS.
      */
     SplatTreeCL(const cl::Context &context, const cl::Device &device,
-                std::size_t maxLevels, std::size_t maxSplats);
+                std::size_t maxLevels, std::size_t maxSplats,
+                bool forceWide = false, SplatLayout layout = SPLAT_LAYOUT_FULL,
+                bool sparse = false);
 
     /**
      * Asynchronously builds the octree, discarding any previous contents.
+     * Only as many levels as are needed to cover @a size are built, so the
+     * cost of the sort depends on the size of the region rather than on
+     * @a maxLevels.
      *
      * This must not be called while either a previous #enqueueBuild is still in
      * progress, or while the octree is being traversed.
@@ -271,6 +454,50 @@ public:
                       const std::vector<cl::Event> *events = NULL,
                       cl::Event *event = NULL);
 
+    /**
+     * Asynchronously builds an octree with several independent roots, which
+     * is equivalent to one octree per root but takes a single sort and a
+     * fixed number of kernel launches per level rather than per root. This
+     * is intended for many small buckets, where the cost of building
+     * separate octrees is dominated by launch overhead. All roots share
+     * the command table and the splats, and use as many levels as the
+     * largest one needs. The start array for each root is retrieved with
+     * @ref getStart(std::size_t) const.
+     *
+     * The same restrictions apply as for the single-root version.
+     *
+     * @pre @ref canBuild(@a roots, @a subsamplingShift).
+     */
+    void enqueueBuild(const cl::CommandQueue &queue,
+                      const cl::Buffer &splats, const std::vector<Root> &roots,
+                      unsigned int subsamplingShift,
+                      const std::vector<cl::Event> *events = NULL,
+                      cl::Event *event = NULL);
+
+    /**
+     * Merge splats that are within @a tolerance of each other in both
+     * position and radius, and whose normals agree, while building the
+     * octree. Duplicates arise where scans overlap, and each one lengthens
+     * the command lists walked by @ref MlsFunctor. The duplicates are found
+     * among the entries sorted by @ref enqueueBuild; one splat of each group is
+     * kept with the sum of the qualities (which weight the fit), and the
+     * others are given zero quality and left out of the octree. This costs a
+     * second sort of the entries.
+     *
+     * The splats passed to @ref enqueueBuild are modified. A value of zero
+     * (the default) disables merging.
+     *
+     * @pre With merging enabled, the splats passed to @ref enqueueBuild
+     * must have indices less than 8 times @a maxSplats.
+     */
+    void setMergeTolerance(float tolerance);
+
+    /**
+     * Whether the roots fit into the memory allocated by the constructor
+     * when built together.
+     */
+    bool canBuild(const std::vector<Root> &roots, unsigned int subsamplingShift) const;
+
     /**
      * @name Getters for the buffers and images needed to use the octree.
      * These can be called at any time, and remain valid across a call to
@@ -282,18 +509,53 @@ public:
     const cl::Buffer &getSplats() const { return splats; }
     const cl::Buffer &getCommands() const { return commands; }
     const cl::Buffer &getStart() const { return start; }
+    const cl::Buffer &getCellKeys() const { return cellKeys; }
+    const cl::Buffer &getNumCells() const { return numCells; }
     /**
      * @}
      */
 
+    /**
+     * Get the start array for one root of the last build. Unlike the other
+     * getters, this is only valid until the next @ref enqueueBuild. For a
+     * sparse tree, all roots share the same start array, and are distinguished
+     * by @ref getRootOffset.
+     *
+     * @pre @a root is less than the number of roots passed to the last @ref enqueueBuild.
+     */
+    const cl::Buffer &getStart(std::size_t root) const;
+
+    /**
+     * Get the key of the first cell of one root of the last build, for looking
+     * up cells of a sparse tree.
+     *
+     * @pre @a root is less than the number of roots passed to the last @ref enqueueBuild.
+     */
+    code_type getRootOffset(std::size_t root) const;
+
     /**
      * Drop the reference to the splats buffer. After calling this,
      * the tree must not be used until @ref enqueueBuild is called again.
      */
     void clearSplats();
 
+    /// Whether the device uses 64-bit codes
+    bool hasWideCodes() const { return wideCodes; }
+
+    /// Layout of the splats in the backing store
+    SplatLayout getLayout() const { return layout; }
+
+    /// Whether the start array holds only the occupied cells
+    bool isSparse() const { return sparse; }
+
     /// Get the number of levels currently in the octree.
     std::size_t getNumLevels() const { return levelOffsets.size(); }
+
+    /**
+     * Get the number of levels actually built by the last @ref enqueueBuild,
+     * excluding those dropped by subsampling.
+     */
+    std::size_t getNumStartLevels() const { return numStartLevels; }
 };
 
 #endif /* !SPLATTREE_CL_H */
@@ -0,0 +1,342 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Local-disk cache of input file blocks, for inputs on slow shared storage.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/locks.hpp>
+#include "staging.h"
+#include "logging.h"
+#include "statistics.h"
+#include "errors.h"
+
+namespace
+{
+
+/**
+ * Reader made by @ref StagingCache::createReader. It holds the underlying
+ * reader open, and passes each read through the cache a block at a time.
+ */
+class StagingReader : public BinaryReader
+{
+public:
+    StagingReader(StagingCache &cache, BinaryReader *source)
+        : cache(cache), source(source), fileSize(0) {}
+
+    virtual ~StagingReader()
+    {
+        if (isOpen())
+            close();
+    }
+
+private:
+    StagingCache &cache;
+    boost::scoped_ptr<BinaryReader> source;
+    std::string path;
+    offset_type fileSize;
+
+    virtual void openImpl(const boost::filesystem::path &path)
+    {
+        source->open(path);
+        this->path = boost::filesystem::absolute(path).string();
+        fileSize = source->size();
+    }
+
+    virtual void closeImpl()
+    {
+        source->close();
+    }
+
+    virtual std::size_t readImpl(void *buf, std::size_t count, offset_type offset) const
+    {
+        if (offset >= fileSize)
+            return 0;
+        count = std::min(offset_type(count), fileSize - offset);
+        char *out = static_cast<char *>(buf);
+        std::size_t done = 0;
+        while (done < count)
+        {
+            const offset_type pos = offset + done;
+            const offset_type block = pos / StagingCache::blockSize;
+            const std::size_t start = pos - block * StagingCache::blockSize;
+            const std::size_t n = std::min(offset_type(count - done), StagingCache::blockSize - start);
+            cache.read(*source, path, fileSize, block, start, n, out + done);
+            done += n;
+        }
+        return done;
+    }
+
+    virtual offset_type sizeImpl() const
+    {
+        return fileSize;
+    }
+
+    virtual void prefetchImpl(offset_type offset, offset_type count) const
+    {
+        if (offset >= fileSize || count == 0)
+            return;
+        count = std::min(count, fileSize - offset);
+        cache.prefetch(path, fileSize, offset / StagingCache::blockSize,
+                       (offset + count - 1) / StagingCache::blockSize);
+    }
+
+    virtual const char *throughputPrefix() const
+    {
+        return "io.stage.";
+    }
+};
+
+} // anonymous namespace
+
+const StagingCache::offset_type StagingCache::blockSize = 4 * 1024 * 1024;
+const std::size_t StagingCache::maxTasks = 256;
+
+StagingCache::StagingCache(const boost::filesystem::path &dir, std::tr1::uint64_t capacity, ReaderType readerType)
+    : dir(dir), capacity(capacity), readerType(readerType),
+    bytes(0), stopping(false), nextFile(0),
+    hitStat(Statistics::getStatistic<Statistics::Counter>("staging.hits")),
+    missStat(Statistics::getStatistic<Statistics::Counter>("staging.misses")),
+    stagedStat(Statistics::getStatistic<Statistics::Counter>("staging.prefetched"))
+{
+    boost::filesystem::create_directories(dir);
+    boost::thread t(boost::bind(&StagingCache::run, this));
+    thread.swap(t);
+}
+
+StagingCache::~StagingCache()
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    taskCondition.notify_all();
+    thread.join();
+
+    for (std::tr1::unordered_map<std::string, Entry>::const_iterator i = entries.begin(); i != entries.end(); ++i)
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(i->second.file, ec);
+    }
+}
+
+BinaryReader *StagingCache::createReader()
+{
+    return new StagingReader(*this, ::createReader(readerType));
+}
+
+std::string StagingCache::makeKey(const std::string &path, offset_type block)
+{
+    std::ostringstream key;
+    key << block << ':' << path;
+    return key.str();
+}
+
+bool StagingCache::readStaged(const std::string &key, std::size_t offset, std::size_t count, char *buf)
+{
+    std::string file;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        std::tr1::unordered_map<std::string, Entry>::iterator pos = entries.find(key);
+        if (pos == entries.end() || offset + count > pos->second.size)
+            return false;
+        lru.splice(lru.begin(), lru, pos->second.lruPos);
+        file = pos->second.file;
+    }
+
+    // The block may be evicted meanwhile, in which case it is read from the source
+    std::ifstream in(file.c_str(), std::ios::binary);
+    in.seekg(offset);
+    in.read(buf, count);
+    return in && std::size_t(in.gcount()) == count;
+}
+
+void StagingCache::store(const std::string &key, const char *data, std::size_t size)
+{
+    boost::filesystem::path file;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        if (entries.count(key))
+            return;
+        std::ostringstream name;
+        name << "block" << nextFile++ << ".stage";
+        file = dir / name.str();
+    }
+
+    try
+    {
+        std::ofstream out(file.c_str(), std::ios::binary);
+        out.write(data, size);
+        out.close();
+        if (!out)
+            throw std::ios::failure("write failed");
+    }
+    catch (std::exception &e)
+    {
+        // Staging is only an optimisation, so the data is still read from the source
+        Log::log[Log::warn] << "Could not stage to " << file.string() << ": " << e.what() << '\n';
+        boost::system::error_code ec;
+        boost::filesystem::remove(file, ec);
+        return;
+    }
+
+    std::vector<std::string> evicted;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        lru.push_front(key);
+        Entry &entry = entries[key];
+        entry.file = file.string();
+        entry.size = size;
+        entry.lruPos = lru.begin();
+        bytes += size;
+        while (bytes > capacity && lru.size() > 1)
+        {
+            std::tr1::unordered_map<std::string, Entry>::iterator victim = entries.find(lru.back());
+            evicted.push_back(victim->second.file);
+            bytes -= victim->second.size;
+            entries.erase(victim);
+            lru.pop_back();
+        }
+    }
+    for (std::size_t i = 0; i < evicted.size(); i++)
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove(evicted[i], ec);
+    }
+}
+
+void StagingCache::read(
+    const BinaryReader &source, const std::string &path, offset_type fileSize,
+    offset_type block, std::size_t offset, std::size_t count, char *buf)
+{
+    const std::string key = makeKey(path, block);
+    if (readStaged(key, offset, count, buf))
+    {
+        hitStat.add(1);
+        return;
+    }
+
+    missStat.add(1);
+    const offset_type start = block * blockSize;
+    const std::size_t size = std::min(blockSize, fileSize - start);
+    std::vector<char> data(size);
+    std::size_t got = source.read(&data[0], size, start);
+    if (got < offset + count)
+        throw boost::enable_error_info(std::ios::failure("Unexpected end of file"));
+    std::copy(data.begin() + offset, data.begin() + offset + count, buf);
+    if (got == size)
+        store(key, &data[0], size);
+}
+
+void StagingCache::prefetch(const std::string &path, offset_type fileSize, offset_type first, offset_type last)
+{
+    Task task;
+    task.path = path;
+    task.fileSize = fileSize;
+    task.first = first;
+    task.last = last;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        // Hints are advisory, so drop them if the thread is falling behind
+        if (tasks.size() >= maxTasks)
+            return;
+        tasks.push_back(task);
+    }
+    taskCondition.notify_one();
+}
+
+void StagingCache::run()
+{
+    while (true)
+    {
+        Task task;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (tasks.empty() && !stopping)
+                taskCondition.wait(lock);
+            if (stopping)
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+
+        try
+        {
+            boost::scoped_ptr<BinaryReader> source;
+            std::vector<char> data;
+            for (offset_type block = task.first; block <= task.last; block++)
+            {
+                const std::string key = makeKey(task.path, block);
+                {
+                    boost::lock_guard<boost::mutex> lock(mutex);
+                    if (stopping)
+                        return;
+                    if (entries.count(key) || pending.count(key))
+                        continue;
+                    pending.insert(key);
+                }
+
+                try
+                {
+                    if (!source)
+                    {
+                        source.reset(::createReader(readerType));
+                        source->open(task.path);
+                    }
+                    const offset_type start = block * blockSize;
+                    const std::size_t size = std::min(blockSize, task.fileSize - start);
+                    data.resize(size);
+                    if (source->read(&data[0], size, start) == size)
+                    {
+                        store(key, &data[0], size);
+                        stagedStat.add(1);
+                    }
+                }
+                catch (...)
+                {
+                    boost::lock_guard<boost::mutex> lock(mutex);
+                    pending.erase(key);
+                    throw;
+                }
+                boost::lock_guard<boost::mutex> lock(mutex);
+                pending.erase(key);
+            }
+        }
+        catch (std::exception &e)
+        {
+            // The foreground read will report any real problem with the file
+            Log::log[Log::debug] << "Background staging of " << task.path << " failed: " << e.what() << '\n';
+        }
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Local-disk cache of input file blocks, for inputs on slow shared storage.
+ */
+
+#ifndef STAGING_H
+#define STAGING_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <string>
+#include <list>
+#include <deque>
+#include <set>
+#include <boost/noncopyable.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include "tr1_unordered_map.h"
+#include "tr1_cstdint.h"
+#include "binary_io.h"
+
+namespace Statistics
+{
+    class Counter;
+}
+
+/**
+ * Copies blocks of input files to a directory on fast local storage (such as
+ * an SSD) as they are read, so that later reads of the same bytes, such as
+ * later passes or the halo regions shared by neighbouring buckets, are served
+ * locally. Hints from @ref BinaryReader::prefetch stage the hinted blocks on
+ * a background thread ahead of the read. The least recently used blocks are
+ * deleted once the cache exceeds its capacity.
+ *
+ * The cache is used through the readers made by @ref createReader, which
+ * wrap a reader of the underlying type. All the functions are thread-safe.
+ * The cache must outlive the readers, and deletes its files when destroyed.
+ */
+class StagingCache : public boost::noncopyable
+{
+public:
+    typedef BinaryReader::offset_type offset_type;
+
+    /// Bytes in each staged block
+    static const offset_type blockSize;
+
+    /**
+     * Constructor.
+     *
+     * @param dir          Directory to hold the staged blocks (created if necessary).
+     * @param capacity     Bytes of staged blocks to keep.
+     * @param readerType   Reader type for the underlying files.
+     */
+    StagingCache(const boost::filesystem::path &dir, std::tr1::uint64_t capacity, ReaderType readerType);
+
+    /// Stops the background thread and deletes the staged blocks.
+    ~StagingCache();
+
+    /**
+     * Create a reader that goes through the cache. This satisfies the
+     * requirements of a reader factory for @ref FastPly::Reader, e.g. via
+     * <code>boost::bind(&StagingCache::createReader, &cache)</code>.
+     */
+    BinaryReader *createReader();
+
+    /**
+     * Copy bytes [@a offset, @a offset + @a count) of block @a block of the
+     * file @a path into @a buf, reading and staging the whole block from
+     * @a source if it is not already staged.
+     *
+     * @param source      Open reader for @a path.
+     * @param path        Name identifying the file.
+     * @param fileSize    Size of the file.
+     * @param block       Index of the block.
+     * @param offset,count Byte range within the block.
+     * @param buf         Output buffer.
+     */
+    void read(const BinaryReader &source, const std::string &path, offset_type fileSize,
+              offset_type block, std::size_t offset, std::size_t count, char *buf);
+
+    /// Queue blocks [@a first, @a last] of @a path to be staged in the background.
+    void prefetch(const std::string &path, offset_type fileSize, offset_type first, offset_type last);
+
+private:
+    struct Entry
+    {
+        std::string file;                          ///< Path of the staged copy
+        std::size_t size;                          ///< Bytes in the block
+        std::list<std::string>::iterator lruPos;   ///< Position in @ref lru
+    };
+
+    struct Task
+    {
+        std::string path;
+        offset_type fileSize;
+        offset_type first, last;
+    };
+
+    /// Maximum number of queued prefetch hints
+    static const std::size_t maxTasks;
+
+    const boost::filesystem::path dir;
+    const std::tr1::uint64_t capacity;
+    const ReaderType readerType;
+
+    boost::mutex mutex;
+    boost::condition_variable taskCondition;
+    std::tr1::unordered_map<std::string, Entry> entries;   ///< Staged blocks by key
+    std::list<std::string> lru;                            ///< Keys, most recently used first
+    std::set<std::string> pending;                         ///< Keys being staged
+    std::tr1::uint64_t bytes;                              ///< Total size of staged blocks
+    std::deque<Task> tasks;
+    bool stopping;
+    std::tr1::uint64_t nextFile;                           ///< For naming staged copies
+    boost::thread thread;
+
+    Statistics::Counter &hitStat;       ///< Block reads served from the cache
+    Statistics::Counter &missStat;      ///< Block reads from the source
+    Statistics::Counter &stagedStat;    ///< Blocks staged in the background
+
+    static std::string makeKey(const std::string &path, offset_type block);
+
+    /**
+     * Look up a staged block and copy part of it out. Returns false if it
+     * is not staged or the copy could not be read.
+     */
+    bool readStaged(const std::string &key, std::size_t offset, std::size_t count, char *buf);
+
+    /// Stage a block, evicting others as needed. Errors are logged and ignored.
+    void store(const std::string &key, const char *data, std::size_t size);
+
+    /// Body of the background thread
+    void run();
+};
+
+#endif /* !STAGING_H */
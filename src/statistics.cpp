@@ -40,15 +40,34 @@
 #include <vector>
 #include <utility>
 #include <queue>
+#include <map>
+#include <algorithm>
 #include <sstream>
 #include <boost/foreach.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/ptr_container/serialize_ptr_map.hpp>
+#include <boost/serialization/map.hpp>
 #include "statistics.h"
+#include "errors.h"
 
 namespace Statistics
 {
 
+namespace detail
+{
+
+unsigned int currentShard()
+{
+    // Zero means not yet assigned; otherwise one more than the shard
+    static __thread unsigned int shard = 0;
+    static unsigned int nextThread = 0;
+    if (shard == 0)
+        shard = __atomic_fetch_add(&nextThread, 1, __ATOMIC_RELAXED) % NUM_SHARDS + 1;
+    return shard - 1;
+}
+
+} // namespace detail
+
 Statistic::Statistic(const std::string &name) : name(name)
 {
 }
@@ -92,29 +111,47 @@ void Statistic::serialize(Archive &ar, const unsigned int)
 }
 
 
-Counter::Counter(const std::string &name) : Statistic(name), total(0)
+Counter::Counter(const std::string &name) : Statistic(name)
 {
+    clear();
+}
+
+void Counter::clear()
+{
+    total = 0;
+    for (unsigned int i = 0; i < detail::NUM_SHARDS; i++)
+        shards[i].value = 0;
+}
+
+void Counter::fold() const
+{
+    for (unsigned int i = 0; i < detail::NUM_SHARDS; i++)
+        total += __atomic_exchange_n(&shards[i].value, 0ULL, __ATOMIC_RELAXED);
 }
 
 void Counter::write(std::ostream &o) const
 {
+    fold();
     o << total;
 }
 
 void Counter::add(unsigned long long incr)
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    total += incr;
+    __atomic_fetch_add(&shards[detail::currentShard()].value, incr, __ATOMIC_RELAXED);
 }
 
 unsigned long long Counter::getTotal() const
 {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    fold();
     return total;
 }
 
 void Counter::merge(const Statistic &other)
 {
     const Counter &stat = dynamic_cast<const Counter &>(other);
+    fold();
+    stat.fold();
     total += stat.total;
 }
 
@@ -122,31 +159,64 @@ template<typename Archive>
 void Counter::serialize(Archive &ar, const unsigned int)
 {
     ar & boost::serialization::base_object<Statistic>(*this);
+    fold();
     ar & total;
 }
 
 
-Variable::Variable(const std::string &name) : Statistic(name), sum(0.0), sum2(0.0), n(0)
+Variable::Variable(const std::string &name) : Statistic(name)
 {
+    clear();
+}
+
+void Variable::clear()
+{
+    sum = 0.0;
+    sum2 = 0.0;
+    n = 0;
+    for (unsigned int i = 0; i < detail::NUM_SHARDS; i++)
+    {
+        shards[i].sum = 0.0;
+        shards[i].sum2 = 0.0;
+        shards[i].n = 0;
+    }
+}
+
+void Variable::fold() const
+{
+    for (unsigned int i = 0; i < detail::NUM_SHARDS; i++)
+    {
+        Shard &shard = shards[i];
+        boost::lock_guard<boost::mutex> lock(shard.mutex);
+        sum += shard.sum;
+        sum2 += shard.sum2;
+        n += shard.n;
+        shard.sum = 0.0;
+        shard.sum2 = 0.0;
+        shard.n = 0;
+    }
 }
 
 void Variable::add(double value)
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    sum += value;
-    sum2 += value * value;
-    n++;
+    Shard &shard = shards[detail::currentShard()];
+    boost::lock_guard<boost::mutex> lock(shard.mutex);
+    shard.sum += value;
+    shard.sum2 += value * value;
+    shard.n++;
 }
 
 unsigned long long Variable::getNumSamples() const
 {
     boost::lock_guard<boost::mutex> lock(mutex);
+    fold();
     return n;
 }
 
 double Variable::getMean() const
 {
     boost::lock_guard<boost::mutex> lock(mutex);
+    fold();
     if (n < 1)
         throw std::length_error("Cannot compute mean without at least 1 sample");
     return sum / n;
@@ -169,11 +239,13 @@ double Variable::getVarianceUnlocked() const
 double Variable::getVariance() const
 {
     boost::lock_guard<boost::mutex> lock(mutex);
+    fold();
     return getVarianceUnlocked();
 }
 
 void Variable::write(std::ostream &o) const
 {
+    fold();
     if (n >= 1)
         o << sum << " : " << sum / n << ' ';
     if (n >= 2)
@@ -184,6 +256,8 @@ void Variable::write(std::ostream &o) const
 void Variable::merge(const Statistic &other)
 {
     const Variable &stat = dynamic_cast<const Variable &>(other);
+    fold();
+    stat.fold();
     sum += stat.sum;
     sum2 += stat.sum2;
     n += stat.n;
@@ -193,60 +267,162 @@ template<typename Archive>
 void Variable::serialize(Archive &ar, const unsigned int)
 {
     ar & boost::serialization::base_object<Statistic>(*this);
+    fold();
     ar & sum;
     ar & sum2;
     ar & n;
 }
 
 
+Histogram::Histogram(const std::string &name)
+    : Variable(name), zeros(0), total(0), maxValue(0.0)
+{
+}
+
+int Histogram::binIndex(double value)
+{
+    return int(std::floor(std::log(value) / std::log(2.0) * BINS_PER_OCTAVE));
+}
+
+double Histogram::binValue(int index)
+{
+    return std::pow(2.0, (index + 0.5) / BINS_PER_OCTAVE);
+}
+
+void Histogram::add(double value)
+{
+    Variable::add(value);
+
+    boost::lock_guard<boost::mutex> lock(binsMutex);
+    if (value > 0.0)
+        bins[binIndex(value)]++;
+    else
+        zeros++;
+    if (total == 0 || value > maxValue)
+        maxValue = value;
+    total++;
+}
+
+double Histogram::getPercentileUnlocked(double p) const
+{
+    MLSGPU_ASSERT(p >= 0.0 && p <= 1.0, std::invalid_argument);
+    if (total == 0)
+        throw std::length_error("Cannot compute percentile without at least 1 sample");
+
+    // Rank of the sample we want, counting from 1
+    const unsigned long long rank = std::max(1ULL, (unsigned long long) std::ceil(p * total));
+    unsigned long long seen = zeros;
+    if (seen >= rank)
+        return std::min(0.0, maxValue);
+    for (std::map<int, unsigned long long>::const_iterator i = bins.begin(); i != bins.end(); ++i)
+    {
+        seen += i->second;
+        if (seen >= rank)
+            return std::min(binValue(i->first), maxValue);
+    }
+    return maxValue; // only reachable through rounding
+}
+
+double Histogram::getPercentile(double p) const
+{
+    boost::lock_guard<boost::mutex> lock(binsMutex);
+    return getPercentileUnlocked(p);
+}
+
+double Histogram::getMax() const
+{
+    boost::lock_guard<boost::mutex> lock(binsMutex);
+    if (total == 0)
+        throw std::length_error("Cannot compute maximum without at least 1 sample");
+    return maxValue;
+}
+
+void Histogram::write(std::ostream &o) const
+{
+    Variable::write(o);
+    boost::lock_guard<boost::mutex> lock(binsMutex);
+    if (total >= 1)
+    {
+        o << " p50 " << getPercentileUnlocked(0.5)
+            << " p90 " << getPercentileUnlocked(0.9)
+            << " p99 " << getPercentileUnlocked(0.99)
+            << " max " << maxValue;
+    }
+}
+
+void Histogram::merge(const Statistic &other)
+{
+    const Histogram &stat = dynamic_cast<const Histogram &>(other);
+    Variable::merge(other);
+
+    boost::lock_guard<boost::mutex> lock(binsMutex);
+    boost::lock_guard<boost::mutex> otherLock(stat.binsMutex);
+    for (std::map<int, unsigned long long>::const_iterator i = stat.bins.begin(); i != stat.bins.end(); ++i)
+        bins[i->first] += i->second;
+    zeros += stat.zeros;
+    if (stat.total > 0 && (total == 0 || stat.maxValue > maxValue))
+        maxValue = stat.maxValue;
+    total += stat.total;
+}
+
+template<typename Archive>
+void Histogram::serialize(Archive &ar, const unsigned int)
+{
+    ar & boost::serialization::base_object<Variable>(*this);
+    ar & bins;
+    ar & zeros;
+    ar & total;
+    ar & maxValue;
+}
+
+
 Peak::Peak(const std::string &name) : Statistic(name), current(0), peak (0)
 {
 }
 
 void Peak::write(std::ostream &o) const
 {
-    o << peak;
+    o << getMax();
 }
 
-void Peak::set(value_type x)
+void Peak::updatePeak(value_type x)
 {
-    current = x;
-    if (peak < current)
-        peak = current;
+    value_type old = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (old < x
+           && !__atomic_compare_exchange_n(&peak, &old, x, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        // old has been updated with the latest value
+    }
 }
 
 Peak &Peak::operator+=(value_type x)
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    set(current + x);
+    updatePeak(__atomic_add_fetch(&current, x, __ATOMIC_RELAXED));
     return *this;
 }
 
 Peak &Peak::operator-=(value_type x)
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    set(current - x);
+    updatePeak(__atomic_sub_fetch(&current, x, __ATOMIC_RELAXED));
     return *this;
 }
 
 Peak &Peak::operator=(value_type x)
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    set(x);
+    __atomic_store_n(&current, x, __ATOMIC_RELAXED);
+    updatePeak(x);
     return *this;
 }
 
 Peak::value_type Peak::get() const
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    return current;
+    return __atomic_load_n(&current, __ATOMIC_RELAXED);
 }
 
 /// Retrieves the highest value that has been set.
 Peak::value_type Peak::getMax() const
 {
-    boost::lock_guard<boost::mutex> lock(mutex);
-    return peak;
+    return __atomic_load_n(&peak, __ATOMIC_RELAXED);
 }
 
 void Peak::merge(const Statistic &other)
@@ -265,6 +441,58 @@ void Peak::serialize(Archive &ar, const unsigned int)
 }
 
 
+Throughput::Throughput(const std::string &name) : Statistic(name), bytes(0), time(0.0)
+{
+}
+
+void Throughput::write(std::ostream &o) const
+{
+    o << bytes << " bytes in " << time << " s";
+    if (time > 0.0)
+        o << " (" << bytes / time * 1e-9 << " GB/s)";
+}
+
+void Throughput::add(unsigned long long bytes, double time)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    this->bytes += bytes;
+    this->time += time;
+}
+
+unsigned long long Throughput::getBytes() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return bytes;
+}
+
+double Throughput::getTime() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return time;
+}
+
+double Throughput::getRate() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return time > 0.0 ? bytes / time : 0.0;
+}
+
+void Throughput::merge(const Statistic &other)
+{
+    const Throughput &stat = dynamic_cast<const Throughput &>(other);
+    bytes += stat.bytes;
+    time += stat.time;
+}
+
+template<typename Archive>
+void Throughput::serialize(Archive &ar, const unsigned int)
+{
+    ar & boost::serialization::base_object<Statistic>(*this);
+    ar & bytes;
+    ar & time;
+}
+
+
 Timer::Timer(const std::string &name)
     : stat(getStatistic<Variable>(name))
 {
@@ -359,8 +587,12 @@ template void Counter::serialize(boost::archive::text_oarchive &ar, const unsign
 template void Counter::serialize(boost::archive::text_iarchive &ar, const unsigned int version);
 template void Variable::serialize(boost::archive::text_oarchive &ar, const unsigned int version);
 template void Variable::serialize(boost::archive::text_iarchive &ar, const unsigned int version);
+template void Histogram::serialize(boost::archive::text_oarchive &ar, const unsigned int version);
+template void Histogram::serialize(boost::archive::text_iarchive &ar, const unsigned int version);
 template void Peak::serialize(boost::archive::text_oarchive &ar, const unsigned int version);
 template void Peak::serialize(boost::archive::text_iarchive &ar, const unsigned int version);
+template void Throughput::serialize(boost::archive::text_oarchive &ar, const unsigned int version);
+template void Throughput::serialize(boost::archive::text_iarchive &ar, const unsigned int version);
 template void Registry::serialize(boost::archive::text_oarchive &ar, const unsigned int version);
 template void Registry::serialize(boost::archive::text_iarchive &ar, const unsigned int version);
 
@@ -369,5 +601,7 @@ template void Registry::serialize(boost::archive::text_iarchive &ar, const unsig
 BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Statistic)
 BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Variable)
 BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Counter)
+BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Histogram)
 BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Peak)
+BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Throughput)
 BOOST_CLASS_EXPORT_IMPLEMENT(Statistics::Registry)
@@ -27,6 +27,7 @@
  *  - Counters, which count the number of times an event occurs
  *  - Variables, which model a random variable and determine mean and standard deviation
  *  - Peaks, which measure the highest value of some variable (useful for e.g. memory allocation)
+ *  - Throughputs, which measure the bandwidth achieved by a transfer (e.g. file or device I/O)
  *
  * It also provides utility classes for interacting with timers.
  */
@@ -41,6 +42,8 @@
 #include <string>
 #include <ostream>
 #include <iterator>
+#include <cstddef>
+#include <map>
 #include <boost/ptr_container/ptr_map.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -59,6 +62,8 @@
 class TestCounter;
 class TestVariable;
 class TestPeak;
+class TestThroughput;
+class TestHistogram;
 
 /**
  * Functions and classes for gathering statistics.
@@ -66,6 +71,24 @@ class TestPeak;
 namespace Statistics
 {
 
+namespace detail
+{
+
+/**
+ * Number of shards used by @ref Counter and @ref Variable. Each thread adds
+ * its samples to one shard, so that threads updating the same statistic
+ * rarely contend for a lock or a cache line.
+ */
+static const unsigned int NUM_SHARDS = 16;
+
+/// Size used to keep shards in separate cache lines
+static const std::size_t CACHE_LINE = 64;
+
+/// Index of the shard used by the calling thread (in [0, @ref NUM_SHARDS))
+unsigned int currentShard();
+
+} // namespace detail
+
 /**
  * Object that holds accumulated data about a statistic. This is a virtual base
  * class that is subclassed to define different types of statistics. All subclasses
@@ -128,15 +151,35 @@ std::ostream &operator <<(std::ostream &o, const Statistic &stat);
 
 /**
  * Statistic subclass that just counts a number of events.
+ *
+ * Increments are made to a per-thread shard with an atomic add, without
+ * taking a lock. The shards are folded into the total when it is read.
  */
 class Counter : public Statistic
 {
     friend class ::TestCounter;
     friend class boost::serialization::access;
 private:
-    unsigned long long total;
+    struct Shard
+    {
+        unsigned long long value;
+        char pad[detail::CACHE_LINE - sizeof(unsigned long long)];
+    };
 
-    Counter() : Statistic("") {} // for serialization
+    mutable unsigned long long total;   ///< Increments already folded in from the shards
+    mutable Shard shards[detail::NUM_SHARDS];
+
+    /**
+     * Moves the values from the shards into @ref total.
+     *
+     * @pre The caller holds the lock, or no other thread is reading the statistic.
+     */
+    void fold() const;
+
+    /// Zero the total and shards
+    void clear();
+
+    Counter() : Statistic("") { clear(); } // for serialization
 
     template<typename Archive>
     void serialize(Archive &ar, const unsigned int);
@@ -158,19 +201,42 @@ public:
 
 /**
  * Statistic subclass that computes mean and standard deviation.
+ *
+ * Samples are added to a per-thread shard, which has its own lock. The
+ * shards are folded into the totals when they are read.
  */
 class Variable : public Statistic
 {
     friend class ::TestVariable;
     friend class boost::serialization::access;
 private:
-    double sum;             ///< sum of samples
-    double sum2;            ///< sum of squares of samples
-    unsigned long long n;   ///< number of samples
+    struct Shard
+    {
+        boost::mutex mutex;
+        double sum;
+        double sum2;
+        unsigned long long n;
+        char pad[detail::CACHE_LINE];   ///< Keeps neighbouring shards apart
+    };
+
+    mutable double sum;             ///< sum of samples
+    mutable double sum2;            ///< sum of squares of samples
+    mutable unsigned long long n;   ///< number of samples
+    mutable Shard shards[detail::NUM_SHARDS];
+
+    /**
+     * Moves the samples from the shards into @ref sum, @ref sum2 and @ref n.
+     *
+     * @pre The caller holds the lock, or no other thread is reading the statistic.
+     */
+    void fold() const;
+
+    /// Zero the totals and shards
+    void clear();
 
     double getVarianceUnlocked() const;  ///< compute variance with the caller taking the lock
 
-    Variable() : Statistic("") {} // for serialization
+    Variable() : Statistic("") { clear(); } // for serialization
 
     template<typename Archive>
     void serialize(Archive &ar, const unsigned int);
@@ -182,7 +248,7 @@ public:
     Variable(const std::string &name);
 
     /// Add a sample of the variable
-    void add(double value);
+    virtual void add(double value);
 
     unsigned long long getNumSamples() const;   ///< Return the number of calls to @ref add
     /**
@@ -204,10 +270,89 @@ public:
     virtual void merge(const Statistic &other);
 };
 
+/**
+ * @ref Variable subclass that additionally keeps a histogram of the samples,
+ * so that tail latencies can be reported as well as the mean. Positive
+ * samples are counted in logarithmically-spaced bins, with @ref BINS_PER_OCTAVE
+ * bins per factor of two, so that a percentile is accurate to within about
+ * 5% regardless of the scale of the samples. Samples that are zero or
+ * negative are counted together as zero. The bins are stored sparsely, so
+ * histograms are cheap to serialize and to merge.
+ *
+ * It can be passed anywhere a @ref Variable is expected (such as @ref
+ * Timeplot::Action), but the statistic must be created as a histogram:
+ * looking it up as a @ref Histogram after it has been created as a plain
+ * @ref Variable throws @c bad_cast.
+ *
+ * Samples are binned under a single lock rather than sharded, since the
+ * timings it is intended for are per bucket or per work item.
+ */
+class Histogram : public Variable
+{
+    friend class ::TestHistogram;
+    friend class boost::serialization::access;
+public:
+    /// Number of bins per doubling of the value
+    static const int BINS_PER_OCTAVE = 8;
+
+private:
+    mutable boost::mutex binsMutex;  ///< Protects the remaining members
+    /// Number of samples in each bin, indexed by @ref binIndex
+    std::map<int, unsigned long long> bins;
+    unsigned long long zeros;        ///< Number of samples that are zero or negative
+    unsigned long long total;        ///< Total number of samples in @ref bins and @ref zeros
+    double maxValue;                 ///< Largest sample (undefined if @ref total is zero)
+
+    /// Bin holding the positive value @a value
+    static int binIndex(double value);
+
+    /// Representative value for samples in bin @a index (its geometric centre)
+    static double binValue(int index);
+
+    /// Implementation of @ref getPercentile with @ref binsMutex held
+    double getPercentileUnlocked(double p) const;
+
+    Histogram() : Variable(""), zeros(0), total(0), maxValue(0.0) {} // for serialization
+
+    template<typename Archive>
+    void serialize(Archive &ar, const unsigned int);
+
+protected:
+    virtual void write(std::ostream &o) const;
+
+public:
+    Histogram(const std::string &name);
+
+    virtual void add(double value);
+
+    /**
+     * Return an estimate of the value below which a fraction @a p of the
+     * samples fall (for example, 0.99 for the 99th percentile). The estimate
+     * is the centre of the bin containing that sample, clamped to the
+     * maximum.
+     *
+     * @pre 0 &lt;= @a p &lt;= 1.
+     * @throw std::length_error if no samples have been added.
+     */
+    double getPercentile(double p) const;
+
+    /**
+     * Return the largest sample.
+     * @throw std::length_error if no samples have been added.
+     */
+    double getMax() const;
+
+    virtual void merge(const Statistic &other);
+};
+
 /**
  * Statistic class that measures the maximum value a variable takes. In the initial
  * state, the current value and the maximum are default-initialized. It is operated
  * on using @c =, @c += and @c -=.
+ *
+ * Unlike @ref Counter and @ref Variable, the peak depends on the combined
+ * current value, so it cannot be sharded. Instead the updates use atomic
+ * operations rather than the lock.
  */
 class Peak : public Statistic
 {
@@ -228,12 +373,8 @@ private:
 protected:
     virtual void write(std::ostream &o) const;
 
-    /**
-     * Replaces the current value.
-     *
-     * @pre The caller must hold the lock.
-     */
-    void set(value_type x);
+    /// Raise the peak to at least @a x.
+    void updatePeak(value_type x);
 
 public:
     /**
@@ -259,6 +400,48 @@ public:
     virtual void merge(const Statistic &other);
 };
 
+/**
+ * Statistic class that measures the bandwidth of transfers. It accumulates
+ * the number of bytes moved and the time taken to move them, and reports the
+ * ratio.
+ *
+ * Samples are added under the lock, since each one accompanies an I/O
+ * operation that is far more expensive.
+ */
+class Throughput : public Statistic
+{
+    friend class ::TestThroughput;
+    friend class boost::serialization::access;
+private:
+    unsigned long long bytes;   ///< Total bytes transferred
+    double time;                ///< Total seconds spent transferring
+
+    Throughput() : Statistic(""), bytes(0), time(0.0) {} // for serialization
+
+    template<typename Archive>
+    void serialize(Archive &ar, const unsigned int);
+
+protected:
+    virtual void write(std::ostream &o) const;
+
+public:
+    Throughput(const std::string &name);
+
+    /// Record a transfer of @a bytes bytes that took @a time seconds
+    void add(unsigned long long bytes, double time);
+
+    unsigned long long getBytes() const;   ///< Return the total bytes transferred
+    double getTime() const;                ///< Return the total time spent transferring
+
+    /**
+     * Return the achieved bandwidth in bytes per second, or zero if no time
+     * has been recorded.
+     */
+    double getRate() const;
+
+    virtual void merge(const Statistic &other);
+};
+
 /**
  * @ref Timer subclass that reports elapsed time to a statistic
  * on destruction.
@@ -379,6 +562,14 @@ public:
      * @}
      */
 
+    /**
+     * Call <code>visitor(stat)</code> for each statistic, in lexicographical
+     * order by name. Unlike the iteration functions, this is thread-safe, but
+     * @a visitor must not add statistics to the registry.
+     */
+    template<typename Visitor>
+    void visit(Visitor &visitor) const;
+
     /**
      * Merge in samples from another registry. Statistics with the same
      * name are matched up. They must then have the same type, or else
@@ -401,6 +592,14 @@ public:
  */
 std::ostream &operator <<(std::ostream &o, const Registry &reg);
 
+template<typename Visitor>
+void Registry::visit(Visitor &visitor) const
+{
+    boost::lock_guard<boost::mutex> _(mutex);
+    for (boost::ptr_map<std::string, Statistic>::const_iterator i = statistics.begin(); i != statistics.end(); ++i)
+        visitor(*i->second);
+}
+
 template<typename T>
 T &Registry::getStatistic(const std::string &name)
 {
@@ -435,7 +634,9 @@ BOOST_SERIALIZATION_ASSUME_ABSTRACT(Statistics::Statistic)
 BOOST_CLASS_EXPORT_KEY(Statistics::Statistic)
 BOOST_CLASS_EXPORT_KEY(Statistics::Counter)
 BOOST_CLASS_EXPORT_KEY(Statistics::Variable)
+BOOST_CLASS_EXPORT_KEY(Statistics::Histogram)
 BOOST_CLASS_EXPORT_KEY(Statistics::Peak)
+BOOST_CLASS_EXPORT_KEY(Statistics::Throughput)
 BOOST_CLASS_EXPORT_KEY(Statistics::Registry)
 
 #endif /* !MLSGPU_STATISTICS_H */
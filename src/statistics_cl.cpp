@@ -33,25 +33,61 @@
 #endif
 
 #include <vector>
-#include <queue>
-#include <utility>
-#include <boost/ref.hpp>
+#include <map>
+#include <string>
+#include <cstddef>
+#include <algorithm>
+#include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <CL/cl.hpp>
 #include "statistics.h"
 #include "statistics_cl.h"
+#include "timeplot.h"
+#include "timer.h"
 #include "logging.h"
 
 namespace Statistics
 {
 
+/**
+ * Events registered by @ref timeEvents or @ref timeTransfer, with where to
+ * record them. It is owned by the event callbacks, and the last of them to
+ * fire records the times and deletes it.
+ */
+struct SavedEvents
+{
+    std::vector<cl::Event> events;
+    Variable *variable;         ///< Statistic for @ref timeEvents, or @c NULL
+    Throughput *throughput;     ///< Statistic for @ref timeTransfer, or @c NULL
+    std::size_t bytes;          ///< Bytes moved, for @ref timeTransfer
+    Timer::timestamp registered; ///< Host time of registration, to place the events on the timeplot
+    std::size_t remaining;      ///< Callbacks still to fire (atomic)
+    bool failed;                ///< Whether any command did not complete (atomic)
+
+    /// Name of the target statistic
+    const std::string &getName() const
+    {
+        return variable != NULL ? variable->getName() : throughput->getName();
+    }
+};
+
 static bool eventsEnabled = false;
-static std::queue<std::pair<std::vector<cl::Event>, boost::reference_wrapper<Variable> > > savedEvents;
-static boost::mutex savedEventsMutex;
+static unsigned int sampleInterval = 1;
+
+/// Events seen for each statistic, modulo @ref sampleInterval
+static std::map<const Statistic *, unsigned int> sampleCounts;
+static boost::mutex sampleCountsMutex;
 
-void enableEventTiming(bool enable)
+/// Number of @ref SavedEvents whose callbacks are outstanding
+static std::size_t pendingEvents = 0;
+static boost::mutex pendingEventsMutex;
+static boost::condition_variable pendingEventsCondition;
+
+void enableEventTiming(bool enable, unsigned int sampleInterval)
 {
     eventsEnabled = enable;
+    Statistics::sampleInterval = sampleInterval;
 }
 
 bool isEventTimingEnabled()
@@ -59,86 +95,171 @@ bool isEventTimingEnabled()
     return eventsEnabled;
 }
 
-static void flushEventTimes(bool finalize)
+/// Decide whether to time the next command for @a stat
+static bool sampleEvent(const Statistic &stat)
 {
-    const cl_profiling_info fields[2] =
+    if (sampleInterval <= 1)
+        return true;
+    boost::lock_guard<boost::mutex> lock(sampleCountsMutex);
+    unsigned int &count = sampleCounts[&stat];
+    const bool ans = count == 0;
+    if (++count == sampleInterval)
+        count = 0;
+    return ans;
+}
+
+/**
+ * Extract the profiling information for a set of completed events, add it
+ * to the statistic and to the timeplot. The commands are placed on the
+ * timeplot relative to the host time at which they were registered, which
+ * is taken to coincide with the earliest queue time.
+ */
+static void recordEventTimes(const SavedEvents &saved)
+{
+    const cl_profiling_info fields[4] =
     {
+        CL_PROFILING_COMMAND_QUEUED,
+        CL_PROFILING_COMMAND_SUBMIT,
         CL_PROFILING_COMMAND_START,
         CL_PROFILING_COMMAND_END
     };
+    const char * const actions[3] = { "queued", "submitted", "execute" };
 
-    while (!savedEvents.empty())
+    const std::vector<cl::Event> &events = saved.events;
+    if (__atomic_load_n(&saved.failed, __ATOMIC_ACQUIRE))
     {
-        const std::vector<cl::Event> &events = savedEvents.front().first;
-        Variable &stat = boost::unwrap_ref(savedEvents.front().second);
-        double total = 0.0;
-        bool good = true;
+        Log::log[Log::warn] << "Warning: Event for " << saved.getName() << " did not complete successfully\n";
+        return;
+    }
 
-        for (std::size_t j = 0; j < events.size() && good; j++)
+    std::vector<cl_ulong> values(4 * events.size());
+    double total = 0.0;
+    for (std::size_t j = 0; j < events.size(); j++)
+    {
+        for (unsigned int i = 0; i < 4; i++)
         {
-            const cl::Event &event = events[j];
-            if (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+            cl_int status = clGetEventProfilingInfo(
+                events[j](), fields[i], sizeof(cl_ulong), &values[4 * j + i], NULL);
+            switch (status)
             {
-                if (finalize)
-                {
-                    Log::log[Log::warn] << "Warning: Event for " << stat.getName() << " did not complete successfully\n";
-                    good = false;
-                    break;
-                }
-                else
-                {
-                    // The front item is not ready to be reaped yet
-                    return;
-                }
+            case CL_PROFILING_INFO_NOT_AVAILABLE:
+                return;
+            case CL_SUCCESS:
+                break;
+            default:
+                Log::log[Log::warn] << "Warning: Could not extract profiling information for " << saved.getName() << '\n';
+                return;
             }
+        }
 
-            cl_int status;
-            cl_ulong values[2];
-            for (unsigned int i = 0; i < 2 && good; i++)
-            {
-                status = clGetEventProfilingInfo(event(), fields[i], sizeof(values[i]), &values[i], NULL);
-                switch (status)
-                {
-                case CL_PROFILING_INFO_NOT_AVAILABLE:
-                    good = false;
-                    break;
-                case CL_SUCCESS:
-                    break;
-                default:
-                    Log::log[Log::warn] << "Warning: Could not extract profiling information for " << stat.getName() << '\n';
-                    good = false;
-                    break;
-                }
-            }
+        double duration = 1e-9 * (cl_long(values[4 * j + 3]) - cl_long(values[4 * j + 2]));
+        if (duration >= 0.0 && duration < 100.0)
+            total += duration;
+        else
+            Log::log[Log::debug] << "Warning: nonsense event times: " << values[4 * j + 3] << " - " << values[4 * j + 2] << " = " << duration << "s\n";
+    }
 
-            if (good)
-            {
-                double duration = 1e-9 * (cl_long(values[1]) - cl_long(values[0]));
-                if (duration >= 0.0 && duration < 100.0)
-                    total += duration;
-                else
-                    Log::log[Log::debug] << "Warning: nonsense event times: " << values[1] << " - " << values[0] << " = " << duration << "s\n";
-            }
-        }
+    if (saved.variable != NULL)
+        saved.variable->add(total);
+    else
+        saved.throughput->add(saved.bytes, total);
 
-        if (good)
-            stat.add(total);
-        savedEvents.pop();
+    cl_ulong base = values[0];
+    for (std::size_t j = 1; j < events.size(); j++)
+        base = std::min(base, values[4 * j]);
+    const std::string worker = "cl." + saved.getName();
+    for (std::size_t j = 0; j < events.size(); j++)
+    {
+        const cl_ulong *v = &values[4 * j];
+        if (!(v[0] <= v[1] && v[1] <= v[2] && v[2] <= v[3]))
+            continue; // some drivers do not fill in the queue and submit times
+        for (unsigned int i = 0; i < 3; i++)
+            Timeplot::recordInterval(worker, actions[i], saved.registered,
+                                     1e-9 * (v[i] - base), 1e-9 * (v[i + 1] - base));
+    }
+}
+
+/**
+ * Account for @a count events of @a saved having completed (or having
+ * failed to register). When none remain, the times are recorded.
+ */
+static void releaseEvents(SavedEvents *saved, std::size_t count)
+{
+    if (__atomic_sub_fetch(&saved->remaining, count, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    try
+    {
+        recordEventTimes(*saved);
         getStatistic<Peak>("events.peak") -= 1;
     }
+    catch (std::exception &e)
+    {
+        // This runs on an OpenCL callback thread, so exceptions cannot propagate
+        Log::log[Log::warn] << "Warning: Could not record event times: " << e.what() << '\n';
+    }
+    delete saved;
+
+    boost::lock_guard<boost::mutex> lock(pendingEventsMutex);
+    if (--pendingEvents == 0)
+        pendingEventsCondition.notify_all();
 }
 
-void timeEvents(const std::vector<cl::Event> &events, Variable &stat)
+static void CL_CALLBACK eventCompleteCallback(cl_event event, cl_int status, void *user_data)
 {
-    if (eventsEnabled && !events.empty())
+    (void) event;
+    SavedEvents *saved = static_cast<SavedEvents *>(user_data);
+    if (status != CL_COMPLETE)
+        __atomic_store_n(&saved->failed, true, __ATOMIC_RELEASE);
+    releaseEvents(saved, 1);
+}
+
+/// Arrange for the times of @a events to be recorded when they complete
+static void saveEvents(const std::vector<cl::Event> &events, Variable *variable,
+                       Throughput *throughput, std::size_t bytes)
+{
+    SavedEvents *saved = new SavedEvents;
+    saved->events = events;
+    saved->variable = variable;
+    saved->throughput = throughput;
+    saved->bytes = bytes;
+    saved->registered = Timer::currentTime();
+    saved->remaining = events.size();
+    saved->failed = false;
+
+    {
+        boost::lock_guard<boost::mutex> lock(pendingEventsMutex);
+        pendingEvents++;
+    }
+    getStatistic<Peak>("events.peak") += 1;
+
+    /* Once the first callback is registered, saved may be freed at any time
+     * by another thread, so only the local copy of the events is used.
+     */
+    for (std::size_t i = 0; i < events.size(); i++)
     {
-        boost::lock_guard<boost::mutex> lock(savedEventsMutex);
-        savedEvents.push(std::make_pair(events, boost::ref(stat)));
-        getStatistic<Peak>("events.peak") += 1;
-        flushEventTimes(false);
+        try
+        {
+            cl::Event(events[i]).setCallback(CL_COMPLETE, eventCompleteCallback, saved);
+        }
+        catch (cl::Error &e)
+        {
+            Log::log[Log::warn] << "Warning: Could not set event callback for "
+                << (variable != NULL ? variable->getName() : throughput->getName())
+                << ": " << e.what() << '\n';
+            __atomic_store_n(&saved->failed, true, __ATOMIC_RELEASE);
+            releaseEvents(saved, events.size() - i);
+            break;
+        }
     }
 }
 
+void timeEvents(const std::vector<cl::Event> &events, Variable &stat)
+{
+    if (eventsEnabled && !events.empty() && sampleEvent(stat))
+        saveEvents(events, &stat, NULL, 0);
+}
+
 void timeEvent(const cl::Event &event, Variable &stat)
 {
     if (eventsEnabled)
@@ -153,10 +274,22 @@ void CL_CALLBACK timeEventCallback(const cl::Event &event, void *stat)
     timeEvent(event, *static_cast<Variable *>(stat));
 }
 
+void timeTransfer(const cl::Event &event, std::size_t bytes, Throughput &stat)
+{
+    if (eventsEnabled && sampleEvent(stat))
+        saveEvents(std::vector<cl::Event>(1, event), NULL, &stat, bytes);
+}
+
+Throughput &getDeviceThroughput(const std::string &direction, const cl::Device &device)
+{
+    return getStatistic<Throughput>("io." + direction + "." + device.getInfo<CL_DEVICE_NAME>());
+}
+
 void finalizeEventTimes()
 {
-    boost::lock_guard<boost::mutex> lock(savedEventsMutex);
-    flushEventTimes(true);
+    boost::unique_lock<boost::mutex> lock(pendingEventsMutex);
+    while (pendingEvents > 0)
+        pendingEventsCondition.wait(lock);
 }
 
 } // namespace Statistics
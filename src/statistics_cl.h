@@ -32,6 +32,8 @@
 #endif
 
 #include <vector>
+#include <string>
+#include <cstddef>
 #include <CL/cl.hpp>
 #include "statistics.h"
 
@@ -39,9 +41,16 @@ namespace Statistics
 {
 
 /**
- * Enables capture of event times
+ * Enables capture of event times.
+ *
+ * Profiling every command perturbs the pipeline, so it is possible to time
+ * only the first of every @a sampleInterval commands registered against
+ * each statistic. The statistics then describe only the sampled commands.
+ *
+ * @param enable          Whether to capture event times.
+ * @param sampleInterval  Time one in this many commands for each statistic (0 and 1 both mean all).
  */
-void enableEventTiming(bool enable = true);
+void enableEventTiming(bool enable = true, unsigned int sampleInterval = 1);
 
 /**
  * Queries whether event timing has been enabled.
@@ -61,6 +70,11 @@ bool isEventTimingEnabled();
  * If the associated command did not complete successfully, a warning is printed
  * to the log and the statistic is not updated.
  *
+ * The times are extracted from a completion callback, so this never waits
+ * for the command. If a timeplot is being written, the queued, submitted and
+ * executing phases of the command are also recorded on a worker named
+ * <code>cl.</code><i>statistic name</i>.
+ *
  * @param event   An enqueued (but not necessarily complete) event
  * @param stat    Statistic to which the time will be added.
  */
@@ -85,11 +99,33 @@ void CL_CALLBACK timeEventCallback(const cl::Event &event, void *stat);
  */
 void timeEvents(const std::vector<cl::Event> &events, Variable &stat);
 
+/**
+ * Similar to @ref timeEvent, but for a transfer between host and device.
+ * The time of the command is added to a throughput statistic along with
+ * @a bytes.
+ *
+ * @param event   An enqueued (but not necessarily complete) transfer command
+ * @param bytes   Number of bytes moved by the command
+ * @param stat    Statistic to which the transfer will be added.
+ */
+void timeTransfer(const cl::Event &event, std::size_t bytes, Throughput &stat);
+
+/**
+ * Retrieve the statistic that records transfers in one direction for a
+ * device. It is named <code>io.</code><i>direction</i><code>.</code><i>device
+ * name</i>, so devices with the same name share a statistic.
+ *
+ * @param direction  Either @c "upload" (host to device) or @c "download" (device to host)
+ * @param device     The device at the other end of the transfers
+ */
+Throughput &getDeviceThroughput(const std::string &direction, const cl::Device &device);
+
 /**
  * Ensure that the events registered using @ref timeEvent have had their
- * times extracted and recorded. This must only be called after the events
- * are guaranteed to have completed (e.g. by calling @c clFinish on the
- * corresponding queues), but before the contexts are destroyed.
+ * times extracted and recorded, by waiting for any outstanding completion
+ * callbacks. This must only be called after the events are guaranteed to
+ * have completed (e.g. by calling @c clFinish on the corresponding queues),
+ * but before the contexts are destroyed.
  */
 void finalizeEventTimes();
 
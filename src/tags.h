@@ -37,7 +37,10 @@ enum
     MLSGPU_TAG_SCATTER_HAS_WORK = 1,    ///< Tells requester to either retrieve work or shut down
     MLSGPU_TAG_GATHER_HAS_WORK = 2,     ///< Tells the receiver to either receive work or decrement refcount
     MLSGPU_TAG_WORK = 3,                ///< Generic tag for transmitting a work item
-    MLSGPU_TAG_PROGRESS = 4             ///< A report of progress
+    MLSGPU_TAG_PROGRESS = 4,            ///< A report of progress
+    MLSGPU_TAG_SCATTER_RESTART = 5,     ///< Tells a drained requester whether to ask for more work
+    MLSGPU_TAG_READ_REQUEST = 6,        ///< Request for raw vertex data from a remote file
+    MLSGPU_TAG_READ_REPLY = 7           ///< First of a range of tags for replies to read requests (must be last)
 };
 
 #endif /* !TAGS_H */
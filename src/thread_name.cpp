@@ -29,8 +29,25 @@
 #endif
 
 #include <string>
+#include <boost/thread/tss.hpp>
 #include "thread_name.h"
 
+/// Name recorded for @ref thread_get_name
+static boost::thread_specific_ptr<std::string> threadName;
+
+static void thread_record_name(const std::string &name)
+{
+    if (threadName.get() == NULL)
+        threadName.reset(new std::string(name));
+    else
+        *threadName = name;
+}
+
+std::string thread_get_name()
+{
+    return threadName.get() != NULL ? *threadName : std::string();
+}
+
 #if HAVE_PTHREAD_SETNAME_NP
 # ifndef _GNU_SOURCE
 #  define _GNU_SOURCE 1
@@ -40,6 +57,7 @@
 
 void thread_set_name(const std::string &name)
 {
+    thread_record_name(name);
     char oldName[1024];
     if (pthread_getname_np(pthread_self(), oldName, sizeof(oldName)) == 0)
     {
@@ -58,7 +76,7 @@ void thread_set_name(const std::string &name)
 
 void thread_set_name(const std::string &name)
 {
-    (void) name;
+    thread_record_name(name);
 }
 
 #endif
@@ -41,4 +41,11 @@
  */
 void thread_set_name(const std::string &name);
 
+/**
+ * Returns the name most recently passed to @ref thread_set_name on this
+ * thread, or an empty string if there is none. Unlike the effects of @ref
+ * thread_set_name, this works on all platforms.
+ */
+std::string thread_get_name();
+
 #endif /* !THREAD_NAME_H */
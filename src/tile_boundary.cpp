@@ -0,0 +1,194 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Boundary vertices of independently meshed tiles, and welding between them.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <locale>
+#include <ios>
+#include <iomanip>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/exception/all.hpp>
+#include "tile_boundary.h"
+
+namespace TileBoundary
+{
+
+namespace
+{
+
+/// Write a string prefixed by its length, so that it may contain whitespace
+void writeString(std::ostream &out, const std::string &s)
+{
+    out << s.size() << '\n' << s << '\n';
+}
+
+/// Read a string written by @ref writeString
+bool readString(std::istream &in, std::string &s)
+{
+    std::size_t size;
+    if (!(in >> size) || in.get() != '\n')
+        return false;
+    s.assign(size, '\0');
+    if (size > 0 && !in.read(&s[0], size))
+        return false;
+    return in.get() == '\n';
+}
+
+/// Occurrence of a key in one of the tiles passed to @ref stitch
+struct Occurrence
+{
+    std::size_t tile;
+    const Vertex *vertex;
+
+    bool operator<(const Occurrence &b) const
+    {
+        if (vertex->key != b.vertex->key)
+            return vertex->key < b.vertex->key;
+        // Keep the tile order, so that the first occurrence is deterministic
+        return tile < b.tile || (tile == b.tile && vertex < b.vertex);
+    }
+};
+
+} // anonymous namespace
+
+Record::Record() : spacing(0.0f)
+{
+    std::fill(reference, reference + 3, 0.0f);
+}
+
+void Record::save(const boost::filesystem::path &path) const
+{
+    boost::filesystem::ofstream out(path);
+    out.imbue(std::locale::classic());
+    out << std::setprecision(9);
+    out << "mlsgpu-tile-boundary 1\n";
+    out << reference[0] << ' ' << reference[1] << ' ' << reference[2] << ' ' << spacing << '\n';
+    out << files.size() << '\n';
+    for (std::size_t i = 0; i < files.size(); i++)
+    {
+        writeString(out, files[i].filename);
+        out << files[i].offset << '\n';
+    }
+    out << vertices.size() << '\n';
+    for (std::size_t i = 0; i < vertices.size(); i++)
+    {
+        const Vertex &v = vertices[i];
+        out << v.key[0] << ' ' << v.key[1] << ' ' << v.key[2] << ' ' << v.file << ' ' << v.index << '\n';
+    }
+    out.close();
+    if (!out)
+        throw boost::enable_error_info(std::ios::failure("Could not write tile boundary"))
+            << boost::errinfo_file_name(path.string());
+}
+
+void Record::load(const boost::filesystem::path &path)
+{
+    boost::filesystem::ifstream in(path);
+    if (!in)
+        throw boost::enable_error_info(std::ios::failure("Could not open file"))
+            << boost::errinfo_file_name(path.string());
+    in.imbue(std::locale::classic());
+
+    Record r;
+    std::string magic;
+    int version;
+    std::size_t nFiles, nVertices;
+    bool ok = (in >> magic >> version) && magic == "mlsgpu-tile-boundary" && version == 1
+        && (in >> r.reference[0] >> r.reference[1] >> r.reference[2] >> r.spacing >> nFiles);
+    if (ok)
+    {
+        r.files.resize(nFiles);
+        for (std::size_t i = 0; ok && i < nFiles; i++)
+            ok = readString(in, r.files[i].filename) && (in >> r.files[i].offset);
+    }
+    ok = ok && (in >> nVertices);
+    if (ok)
+    {
+        r.vertices.resize(nVertices);
+        for (std::size_t i = 0; ok && i < nVertices; i++)
+        {
+            Vertex &v = r.vertices[i];
+            ok = (in >> v.key[0] >> v.key[1] >> v.key[2] >> v.file >> v.index) && v.file < nFiles;
+        }
+    }
+    if (!ok)
+        throw boost::enable_error_info(std::ios::failure("Not a valid tile boundary file"))
+            << boost::errinfo_file_name(path.string());
+
+    std::swap(*this, r);
+}
+
+std::vector<Weld> stitch(const std::vector<Record> &tiles)
+{
+    for (std::size_t i = 1; i < tiles.size(); i++)
+    {
+        if (!std::equal(tiles[i].reference, tiles[i].reference + 3, tiles[0].reference)
+            || tiles[i].spacing != tiles[0].spacing)
+            throw std::runtime_error("Tiles were meshed on different grids");
+    }
+
+    std::vector<Occurrence> occurrences;
+    for (std::size_t i = 0; i < tiles.size(); i++)
+        for (std::size_t j = 0; j < tiles[i].vertices.size(); j++)
+        {
+            Occurrence o;
+            o.tile = i;
+            o.vertex = &tiles[i].vertices[j];
+            occurrences.push_back(o);
+        }
+    std::sort(occurrences.begin(), occurrences.end());
+
+    std::vector<Weld> welds;
+    std::size_t first = 0;
+    while (first < occurrences.size())
+    {
+        std::size_t last = first + 1;
+        while (last < occurrences.size() && occurrences[last].vertex->key == occurrences[first].vertex->key)
+            last++;
+        // Sorted by tile within the key, so the ends differ if any tiles do
+        if (occurrences[last - 1].tile != occurrences[first].tile)
+        {
+            for (std::size_t i = first + 1; i < last; i++)
+            {
+                Weld w;
+                w.tile[0] = occurrences[first].tile;
+                w.vertex[0] = *occurrences[first].vertex;
+                w.tile[1] = occurrences[i].tile;
+                w.vertex[1] = *occurrences[i].vertex;
+                welds.push_back(w);
+            }
+        }
+        first = last;
+    }
+    return welds;
+}
+
+} // namespace TileBoundary
@@ -0,0 +1,120 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Boundary vertices of independently meshed tiles, and welding between them.
+ *
+ * A run over a tile (a @c --region of the full bounding box) records, for
+ * each output vertex on a face of the tile, its vertex key and its position
+ * in the output files. Keys are computed relative to the grid reference
+ * point, so a vertex on a face shared by two tiles has the same key in
+ * both. The tiles can then be welded by matching keys, without reading the
+ * meshes themselves.
+ */
+
+#ifndef MLSGPU_TILE_BOUNDARY_H
+#define MLSGPU_TILE_BOUNDARY_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <string>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/filesystem/path.hpp>
+#include "tr1_cstdint.h"
+
+namespace TileBoundary
+{
+
+/**
+ * Vertex key relative to the grid reference point. Each field is twice the
+ * grid coordinate, so a vertex in the middle of an edge has an odd field
+ * along the axis of the edge (see @ref Marching).
+ */
+typedef boost::array<std::tr1::int64_t, 3> Key;
+
+/// Output vertex on the boundary of a tile
+struct Vertex
+{
+    Key key;                      ///< Vertex key
+    std::tr1::uint32_t file;      ///< Index into @ref Record::files
+    std::tr1::uint32_t index;     ///< Index of the vertex in that file
+};
+
+/// Output file of a tile
+struct OutputFile
+{
+    std::string filename;         ///< File holding the mesh
+    std::tr1::uint64_t offset;    ///< Byte offset of the PLY header in @ref filename
+
+    OutputFile() : offset(0) {}
+    OutputFile(const std::string &filename, std::tr1::uint64_t offset)
+        : filename(filename), offset(offset) {}
+};
+
+/// Boundary vertices of one tile
+struct Record
+{
+    float reference[3];           ///< Grid reference point
+    float spacing;                ///< Grid spacing
+    std::vector<OutputFile> files;
+    std::vector<Vertex> vertices;
+
+    Record();
+
+    /**
+     * Write the record to @a path.
+     *
+     * @throw std::ios::failure on I/O errors.
+     */
+    void save(const boost::filesystem::path &path) const;
+
+    /**
+     * Replace the record with one saved by @ref save.
+     *
+     * @throw std::ios::failure if the file cannot be read or parsed.
+     */
+    void load(const boost::filesystem::path &path);
+};
+
+/// A pair of output vertices in different tiles that are the same vertex
+struct Weld
+{
+    std::size_t tile[2];          ///< Indices of the tiles
+    Vertex vertex[2];             ///< Vertices, with @ref Vertex::file relative to their tiles
+};
+
+/**
+ * Match the boundary vertices of a set of tiles. Where several tiles share
+ * a key, every other occurrence is welded to the first one (in order of
+ * tile, then position in the tile), so that applying all the welds leaves
+ * a single vertex. Keys that appear in only one tile are ignored, even if
+ * they appear in several of its files.
+ *
+ * @throw std::runtime_error if the tiles do not use the same grid.
+ */
+std::vector<Weld> stitch(const std::vector<Record> &tiles);
+
+} // namespace TileBoundary
+
+#endif /* !MLSGPU_TILE_BOUNDARY_H */
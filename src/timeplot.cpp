@@ -31,36 +31,424 @@
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <algorithm>
 #include <cerrno>
 #include <cassert>
+#include <vector>
+#include <map>
+#include <list>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/smart_ptr/make_shared.hpp>
+#include <boost/smart_ptr/scoped_array.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/exception/all.hpp>
+#include <boost/io/ios_state.hpp>
 #include "timeplot.h"
 #include "statistics.h"
 #include "timer.h"
 #include "errors.h"
+#include "thread_name.h"
 
 namespace Timeplot
 {
 
 static bool hasFile = false;
+static bool binary = false;
+static bool chrome = false;
 static boost::mutex outputMutex;
 static Timer::timestamp startTime = Timer::currentTime();
 static std::ofstream log;
 
-void init(const std::string &filename)
+namespace detail
+{
+
+/// Record type for a name in the binary format
+static const std::tr1::uint32_t RECORD_NAME = 1;
+/// Record type for an event in the binary format
+static const std::tr1::uint32_t RECORD_EVENT = 2;
+
+/// Event record in the binary format (apart from the type)
+struct EventRecord
+{
+    std::tr1::uint32_t worker;
+    std::tr1::uint32_t action;
+    std::tr1::uint32_t hasValue;
+    std::tr1::uint32_t pad;
+    double start;
+    double stop;
+    std::tr1::uint64_t value;
+};
+
+/**
+ * Single-producer, single-consumer ring buffer of events for one worker.
+ * The producer is whichever thread is using the worker, and the consumer is
+ * the @ref BinaryWriter thread.
+ */
+class WorkerLog : public boost::noncopyable
+{
+public:
+    /// Number of records that can be buffered (must be a power of 2)
+    static const std::size_t CAPACITY = 4096;
+
+    explicit WorkerLog(std::tr1::uint32_t id);
+
+    /// ID of the worker name
+    const std::tr1::uint32_t id;
+
+    /**
+     * Add a record. If the buffer is full, this waits for the writer to
+     * drain it, unless the writer has stopped, in which case the record is
+     * dropped.
+     */
+    void push(const EventRecord &record);
+
+    /// Consumer side: write any buffered records to @a out
+    void drain(std::ostream &out);
+
+    /// Mark that the worker has been destroyed
+    void close() { __atomic_store_n(&closed, true, __ATOMIC_RELEASE); }
+
+    /// Whether @ref close has been called
+    bool isClosed() const { return __atomic_load_n(&closed, __ATOMIC_ACQUIRE); }
+
+private:
+    boost::scoped_array<EventRecord> records;
+    std::size_t head;      ///< Next position to write (written by the producer)
+    std::size_t tail;      ///< Next position to read (written by the consumer)
+    bool closed;
+};
+
+/**
+ * Owns the binary output: the table of names, the list of worker logs, and
+ * the thread that drains the logs to the file.
+ */
+class BinaryWriter : public boost::noncopyable
+{
+public:
+    BinaryWriter();
+
+    /// Destructor. This stops the thread and writes out all remaining records.
+    ~BinaryWriter();
+
+    /// Start the thread. The file must already be open.
+    void start();
+
+    /// Look up or allocate the ID for a name
+    std::tr1::uint32_t getId(const std::string &name);
+
+    /// Create a log for a new worker
+    boost::shared_ptr<WorkerLog> addWorker(const std::string &name);
+
+    /// Whether the thread is still draining logs
+    bool running() const { return __atomic_load_n(&isRunning, __ATOMIC_ACQUIRE); }
+
+private:
+    /// Interval between drains of the worker logs
+    static const int FLUSH_MS = 10;
+
+    boost::mutex mutex;
+    boost::condition_variable stopCondition;
+    bool stopping;                                   ///< Protected by @ref mutex
+    bool isRunning;
+    std::map<std::string, std::tr1::uint32_t> ids;   ///< Protected by @ref mutex
+    std::vector<std::string> pendingNames;           ///< Names not yet written, by ID offset
+    std::tr1::uint32_t writtenNames;                 ///< Number of names written
+    std::list<boost::shared_ptr<WorkerLog> > logs;   ///< Protected by @ref mutex
+    boost::scoped_ptr<boost::thread> thread;
+
+    /// Write out pending names and buffered records.
+    void flush();
+
+    /// Thread function
+    void run();
+};
+
+WorkerLog::WorkerLog(std::tr1::uint32_t id)
+    : id(id), records(new EventRecord[CAPACITY]), head(0), tail(0), closed(false)
+{
+}
+
+static BinaryWriter binaryWriter;
+
+void WorkerLog::push(const EventRecord &record)
+{
+    while (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= CAPACITY)
+    {
+        if (!binaryWriter.running())
+            return;
+        boost::this_thread::yield();
+    }
+    records[head & (CAPACITY - 1)] = record;
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+void WorkerLog::drain(std::ostream &out)
+{
+    std::size_t end = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    for (std::size_t i = tail; i != end; i++)
+    {
+        out.write((const char *) &RECORD_EVENT, sizeof(RECORD_EVENT));
+        out.write((const char *) &records[i & (CAPACITY - 1)], sizeof(EventRecord));
+    }
+    __atomic_store_n(&tail, end, __ATOMIC_RELEASE);
+}
+
+BinaryWriter::BinaryWriter() : stopping(false), isRunning(false), writtenNames(0)
+{
+}
+
+BinaryWriter::~BinaryWriter()
+{
+    if (thread)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            stopping = true;
+            stopCondition.notify_all();
+        }
+        thread->join();
+        flush();
+        log.flush();
+    }
+}
+
+void BinaryWriter::start()
+{
+    isRunning = true;
+    thread.reset(new boost::thread(boost::bind(&BinaryWriter::run, this)));
+}
+
+std::tr1::uint32_t BinaryWriter::getId(const std::string &name)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<std::string, std::tr1::uint32_t>::const_iterator pos = ids.find(name);
+    if (pos != ids.end())
+        return pos->second;
+    std::tr1::uint32_t id = ids.size();
+    ids[name] = id;
+    pendingNames.push_back(name);
+    return id;
+}
+
+boost::shared_ptr<WorkerLog> BinaryWriter::addWorker(const std::string &name)
+{
+    boost::shared_ptr<WorkerLog> wlog = boost::make_shared<WorkerLog>(getId(name));
+    boost::lock_guard<boost::mutex> lock(mutex);
+    logs.push_back(wlog);
+    return wlog;
+}
+
+void BinaryWriter::flush()
+{
+    std::vector<std::string> names;
+    std::vector<boost::shared_ptr<WorkerLog> > current;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        names.swap(pendingNames);
+        current.assign(logs.begin(), logs.end());
+    }
+
+    for (std::size_t i = 0; i < names.size(); i++)
+    {
+        const std::tr1::uint32_t id = writtenNames++;
+        const std::tr1::uint32_t length = names[i].size();
+        log.write((const char *) &RECORD_NAME, sizeof(RECORD_NAME));
+        log.write((const char *) &id, sizeof(id));
+        log.write((const char *) &length, sizeof(length));
+        log.write(names[i].data(), length);
+    }
+
+    for (std::size_t i = 0; i < current.size(); i++)
+    {
+        // Check before draining, so that no records pushed before closing are lost
+        bool closed = current[i]->isClosed();
+        current[i]->drain(log);
+        if (closed)
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            logs.remove(current[i]);
+        }
+    }
+}
+
+void BinaryWriter::run()
+{
+    thread_set_name("timeplot");
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!stopping)
+    {
+        lock.unlock();
+        flush();
+        lock.lock();
+        if (!stopping)
+            stopCondition.timed_wait(lock, boost::posix_time::milliseconds(FLUSH_MS));
+    }
+    __atomic_store_n(&isRunning, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writer for the Chrome trace event format. Events are written immediately
+ * under @ref outputMutex, and each worker is assigned a thread ID on first
+ * use.
+ */
+class ChromeWriter : public boost::noncopyable
+{
+public:
+    /// Process IDs used to separate host threads from device queues
+    enum Process
+    {
+        PROCESS_HOST = 1,
+        PROCESS_DEVICE = 2
+    };
+
+    ChromeWriter() : nextThread(1), first(true) {}
+
+    /// Destructor. This terminates the JSON array.
+    ~ChromeWriter();
+
+    /// Write the array header and the process names. The file must already be open.
+    void start();
+
+    /**
+     * Write a complete event, or an instant event at @a start if @a instant
+     * is true. Times are in seconds since @ref startTime.
+     *
+     * @pre The caller holds @ref outputMutex.
+     */
+    void event(Process process, const std::string &worker, const std::string &action,
+               double start, double stop, const boost::optional<std::size_t> &value,
+               bool instant = false);
+
+private:
+    std::map<std::string, unsigned int> threads;   ///< Thread ID for each worker
+    unsigned int nextThread;
+    bool first;                                    ///< No records have been written yet
+
+    /// Begin a new array element
+    void separator();
+
+    /// Write @a s as a JSON string literal
+    static void quote(const std::string &s);
+};
+
+static ChromeWriter chromeWriter;
+
+ChromeWriter::~ChromeWriter()
+{
+    if (chrome)
+    {
+        boost::lock_guard<boost::mutex> lock(outputMutex);
+        log << "\n]\n";
+        log.flush();
+    }
+}
+
+void ChromeWriter::separator()
+{
+    if (!first)
+        log << ",\n";
+    first = false;
+}
+
+void ChromeWriter::quote(const std::string &s)
+{
+    log << '"';
+    for (std::string::const_iterator i = s.begin(); i != s.end(); ++i)
+    {
+        if (*i == '"' || *i == '\\')
+            log << '\\' << *i;
+        else if ((unsigned char) *i < 0x20)
+            log << ' ';
+        else
+            log << *i;
+    }
+    log << '"';
+}
+
+void ChromeWriter::start()
+{
+    const char * const names[2] = { "host", "device" };
+    log << "[\n";
+    for (int i = 0; i < 2; i++)
+    {
+        separator();
+        log << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << i + 1
+            << ",\"tid\":0,\"args\":{\"name\":\"" << names[i] << "\"}}";
+    }
+}
+
+void ChromeWriter::event(Process process, const std::string &worker, const std::string &action,
+                         double start, double stop, const boost::optional<std::size_t> &value,
+                         bool instant)
+{
+    unsigned int &tid = threads[worker];
+    if (tid == 0)
+    {
+        tid = nextThread++;
+        separator();
+        log << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << process
+            << ",\"tid\":" << tid << ",\"args\":{\"name\":";
+        quote(worker);
+        log << "}}";
+    }
+
+    separator();
+    log << "{\"name\":";
+    quote(action);
+    log << ",\"pid\":" << process << ",\"tid\":" << tid
+        << ",\"ts\":" << start * 1e6;
+    if (instant)
+        log << ",\"ph\":\"i\",\"s\":\"t\"";
+    else
+        log << ",\"ph\":\"X\",\"dur\":" << (stop - start) * 1e6;
+    if (value)
+        log << ",\"args\":{\"value\":" << *value << "}";
+    log << '}';
+}
+
+} // namespace detail
+
+void init(const std::string &filename, Format format)
 {
     MLSGPU_ASSERT(!hasFile, state_error);
     startTime = Timer::currentTime();
     try
     {
-        log.open(filename.c_str());
+        if (format == FORMAT_BINARY)
+            log.open(filename.c_str(), std::ios::out | std::ios::binary);
+        else
+            log.open(filename.c_str());
         if (!log)
             throw std::ios::failure("Could not open timeplot file");
-        log << std::fixed;
-        log.precision(9);
+        if (format == FORMAT_BINARY)
+        {
+            const std::tr1::uint32_t version = 1;
+            log.write("MLSGPUTP", 8);
+            log.write((const char *) &version, sizeof(version));
+            Timeplot::binary = true;
+            detail::binaryWriter.start();
+        }
+        else if (format == FORMAT_CHROME)
+        {
+            // Microsecond timestamps, to nanosecond precision
+            log << std::fixed;
+            log.precision(3);
+            Timeplot::chrome = true;
+            detail::chromeWriter.start();
+        }
+        else
+        {
+            log << std::fixed;
+            log.precision(9);
+        }
         hasFile = true;
     }
     catch (std::ios::failure &e)
@@ -71,14 +459,149 @@ void init(const std::string &filename)
     }
 }
 
+namespace
+{
+
+/// Suffixes of the per-stage statistics, indexed by @ref ActionCategory
+const char * const categoryNames[NUM_ACTION_CATEGORIES] = { "busy", "starved", "blocked" };
+
+/// Determine the category of an action from its name
+ActionCategory categorize(const std::string &name)
+{
+    if (name == "pop" || name == "wait")
+        return ACTION_STARVED;
+    else if (name == "get" || name == "push")
+        return ACTION_BLOCKED;
+    else
+        return ACTION_BUSY;
+}
+
+/// Worker name with any numeric suffix (as added by the indexed constructor) removed
+std::string stageName(const std::string &name)
+{
+    std::string::size_type dot = name.rfind('.');
+    if (dot == std::string::npos || dot + 1 == name.size())
+        return name;
+    for (std::string::size_type i = dot + 1; i < name.size(); i++)
+        if (name[i] < '0' || name[i] > '9')
+            return name;
+    return name.substr(0, dot);
+}
+
+/// Visitor for @ref Statistics::Registry::visit that gathers @ref StageTotals
+class StageCollector
+{
+public:
+    explicit StageCollector(std::map<std::string, StageTotals> &stages) : stages(stages) {}
+
+    void operator()(const Statistics::Statistic &stat)
+    {
+        static const char prefix[] = "timeplot.";
+        const std::size_t prefixLen = sizeof(prefix) - 1;
+        const std::string &name = stat.getName();
+        std::string::size_type dot = name.rfind('.');
+        if (name.compare(0, prefixLen, prefix) != 0 || dot < prefixLen)
+            return;
+        const Statistics::Variable *var = dynamic_cast<const Statistics::Variable *>(&stat);
+        if (var == NULL)
+            return;
+
+        const std::string stage = name.substr(prefixLen, dot - prefixLen);
+        const std::string field = name.substr(dot + 1);
+        const unsigned long long n = var->getNumSamples();
+        const double sum = n > 0 ? var->getMean() * n : 0.0;
+        if (field == "lifetime")
+        {
+            stages[stage].workers = n;
+            stages[stage].lifetime = sum;
+        }
+        for (int i = 0; i < NUM_ACTION_CATEGORIES; i++)
+            if (field == categoryNames[i])
+                stages[stage].time[i] = sum;
+    }
+
+private:
+    std::map<std::string, StageTotals> &stages;
+};
+
+} // anonymous namespace
+
+StageTotals::StageTotals() : workers(0), lifetime(0.0)
+{
+    std::fill(time, time + NUM_ACTION_CATEGORIES, 0.0);
+}
+
+double StageTotals::fraction(ActionCategory category) const
+{
+    return lifetime > 0.0 ? time[category] / lifetime : 0.0;
+}
+
+std::map<std::string, StageTotals> getStageTotals(const Statistics::Registry &registry)
+{
+    std::map<std::string, StageTotals> stages;
+    StageCollector collector(stages);
+    registry.visit(collector);
+    return stages;
+}
+
+void Worker::init()
+{
+    created = Timer::currentTime();
+    std::fill(categoryTime, categoryTime + NUM_ACTION_CATEGORIES, 0.0);
+}
+
 Worker::Worker(const std::string &name) : name(name), currentAction(NULL)
 {
+    init();
 }
 
 Worker::Worker(const std::string &name, int idx)
     : name(name + "." + boost::lexical_cast<std::string>(idx)),
     currentAction(NULL)
 {
+    init();
+}
+
+Worker::~Worker()
+{
+    if (log)
+        log->close();
+
+    bool active = false;
+    for (int i = 0; i < NUM_ACTION_CATEGORIES; i++)
+        if (categoryTime[i] > 0.0)
+            active = true;
+    if (active)
+    {
+        try
+        {
+            const std::string prefix = "timeplot." + stageName(name) + ".";
+            Statistics::getStatistic<Statistics::Variable>(prefix + "lifetime").add(
+                Timer::getElapsed(created, Timer::currentTime()));
+            for (int i = 0; i < NUM_ACTION_CATEGORIES; i++)
+                Statistics::getStatistic<Statistics::Variable>(prefix + categoryNames[i]).add(categoryTime[i]);
+        }
+        catch (std::exception &)
+        {
+            // Destructors must not throw, and losing the summary is harmless
+        }
+    }
+}
+
+void Worker::record(std::tr1::uint32_t action, Timer::timestamp start, Timer::timestamp stop,
+                    const boost::optional<std::size_t> &value)
+{
+    if (!log)
+        log = detail::binaryWriter.addWorker(name);
+    detail::EventRecord record;
+    record.worker = log->id;
+    record.action = action;
+    record.hasValue = value ? 1 : 0;
+    record.pad = 0;
+    record.start = Timer::getElapsed(startTime, start);
+    record.stop = Timer::getElapsed(startTime, stop);
+    record.value = value ? *value : 0;
+    log->push(record);
 }
 
 Action *Worker::start(Action *current, Timer::timestamp time)
@@ -106,6 +629,10 @@ const std::string &Worker::getName() const
 
 void Action::init()
 {
+    nameId = 0;
+    category = categorize(name);
+    if (hasFile && binary)
+        nameId = detail::binaryWriter.getId(name);
     start = Timer::currentTime();
     running = true;
     elapsed = 0.0;
@@ -135,9 +662,20 @@ void Action::pause(Timer::timestamp time)
 {
     MLSGPU_ASSERT(running, state_error);
     running = false;
-    elapsed += Timer::getElapsed(start, time);
+    double segment = Timer::getElapsed(start, time);
+    elapsed += segment;
+    worker.categoryTime[category] += segment;
 
-    if (hasFile)
+    if (hasFile && binary)
+        worker.record(nameId, start, time, value);
+    else if (hasFile && chrome)
+    {
+        boost::lock_guard<boost::mutex> lock(outputMutex);
+        detail::chromeWriter.event(
+            detail::ChromeWriter::PROCESS_HOST, worker.getName(), name,
+            Timer::getElapsed(startTime, start), Timer::getElapsed(startTime, time), value);
+    }
+    else if (hasFile)
     {
         boost::lock_guard<boost::mutex> lock(outputMutex);
         log << "EVENT " << worker.getName() << ' ' << name << ' '
@@ -172,7 +710,20 @@ Action::~Action()
 
 void recordEvent(const std::string &name, Worker &worker)
 {
-    if (hasFile)
+    if (hasFile && binary)
+    {
+        Timer::timestamp now = Timer::currentTime();
+        worker.record(detail::binaryWriter.getId(name), now, now, boost::optional<std::size_t>());
+    }
+    else if (hasFile && chrome)
+    {
+        boost::lock_guard<boost::mutex> lock(outputMutex);
+        double t = Timer::getElapsed(startTime, Timer::currentTime());
+        detail::chromeWriter.event(
+            detail::ChromeWriter::PROCESS_HOST, worker.getName(), name,
+            t, t, boost::optional<std::size_t>(), true);
+    }
+    else if (hasFile)
     {
         boost::lock_guard<boost::mutex> lock(outputMutex);
         Timer::timestamp now = Timer::currentTime();
@@ -183,4 +734,91 @@ void recordEvent(const std::string &name, Worker &worker)
     }
 }
 
+void recordInterval(const std::string &worker, const std::string &action,
+                    const Timer::timestamp &base, double start, double stop)
+{
+    if (!hasFile)
+        return;
+    std::string name = worker;
+    std::replace(name.begin(), name.end(), ' ', '_');
+    const double offset = Timer::getElapsed(startTime, base);
+
+    if (binary)
+    {
+        /* The ring buffers have a single producer, so these workers, which
+         * may be fed from several threads, are serialized by a lock.
+         */
+        static boost::mutex externalMutex;
+        static std::map<std::string, boost::shared_ptr<detail::WorkerLog> > externalLogs;
+
+        boost::lock_guard<boost::mutex> lock(externalMutex);
+        boost::shared_ptr<detail::WorkerLog> &wlog = externalLogs[name];
+        if (!wlog)
+            wlog = detail::binaryWriter.addWorker(name);
+        detail::EventRecord record;
+        record.worker = wlog->id;
+        record.action = detail::binaryWriter.getId(action);
+        record.hasValue = 0;
+        record.pad = 0;
+        record.start = offset + start;
+        record.stop = offset + stop;
+        record.value = 0;
+        wlog->push(record);
+    }
+    else if (chrome)
+    {
+        boost::lock_guard<boost::mutex> lock(outputMutex);
+        detail::chromeWriter.event(
+            detail::ChromeWriter::PROCESS_DEVICE, name, action,
+            offset + start, offset + stop, boost::optional<std::size_t>());
+    }
+    else
+    {
+        boost::lock_guard<boost::mutex> lock(outputMutex);
+        log << "EVENT " << name << ' ' << action << ' '
+            << offset + start << ' '
+            << offset + stop << '\n';
+    }
+}
+
+void writeBottleneckReport(std::ostream &o, const Statistics::Registry &registry)
+{
+    boost::io::ios_all_saver saver(o);
+    const std::map<std::string, StageTotals> stages = getStageTotals(registry);
+
+    std::string limiting;
+    double limitingBusy = -1.0;
+    bool header = false;
+    for (std::map<std::string, StageTotals>::const_iterator i = stages.begin(); i != stages.end(); ++i)
+    {
+        const StageTotals &t = i->second;
+        if (!(t.lifetime > 0.0))
+            continue;
+        if (!header)
+        {
+            o << "Pipeline stages (percentage of worker lifetime):\n"
+                << std::setw(16) << std::left << "stage" << std::right
+                << std::setw(8) << "workers" << std::setw(9) << "busy"
+                << std::setw(9) << "starved" << std::setw(9) << "blocked" << '\n';
+            header = true;
+        }
+        o << std::setw(16) << std::left << i->first << std::right
+            << std::setw(8) << t.workers;
+        for (int j = 0; j < NUM_ACTION_CATEGORIES; j++)
+            o << std::setw(8) << std::fixed << std::setprecision(1)
+                << 100.0 * t.time[j] / t.lifetime << '%';
+        o << '\n';
+
+        const double busy = t.time[ACTION_BUSY] / t.lifetime;
+        if (busy > limitingBusy)
+        {
+            limitingBusy = busy;
+            limiting = i->first;
+        }
+    }
+    if (header)
+        o << "Limiting stage: " << limiting << " (busy "
+            << std::fixed << std::setprecision(1) << 100.0 * limitingBusy << "%)\n";
+}
+
 } // namespace Timeplot
@@ -32,7 +32,11 @@
 #endif
 #include <boost/noncopyable.hpp>
 #include <boost/optional.hpp>
+#include <boost/smart_ptr/shared_ptr.hpp>
 #include <string>
+#include <map>
+#include <ostream>
+#include "tr1_cstdint.h"
 #include "timer.h"
 #include "statistics.h"
 
@@ -54,23 +58,83 @@
  * not enforced), it is guaranteed that two events for the same worker will not
  * overlap in time. An action is something currently being undertaken by a
  * worker.
+ *
+ * There is also a binary format, intended for leaving timeplots enabled on
+ * production runs. Each worker writes fixed-size records into its own
+ * lock-free ring buffer, and a background thread drains the buffers to the
+ * file. Worker and action names are written once each and referred to by ID.
+ * The file consists of the 8-byte magic @c MLSGPUTP, a 32-bit version number
+ * (currently 1), and a sequence of records in native byte order, each
+ * starting with a 32-bit type:
+ *  - 1 (name): 32-bit ID, 32-bit length, and the bytes of the name;
+ *  - 2 (event): 32-bit worker ID, 32-bit action ID, 32-bit flag indicating
+ *    whether there is a value, 32 bits of padding, start and stop times as
+ *    doubles, and a 64-bit value.
+ *
+ * A name record may appear after events that refer to it. Events for a
+ * single worker appear in the same order as in the text format, but events
+ * from different workers are interleaved arbitrarily. @c utils/timeplot.py
+ * reads both formats.
+ *
+ * Finally, the data can be written in the Chrome trace event format (a JSON
+ * array of complete events), which can be loaded into @c chrome://tracing or
+ * Perfetto. Host workers appear as threads of a "host" process, and workers
+ * recorded with @ref recordInterval (such as the OpenCL commands recorded by
+ * @ref Statistics::timeEvent) as threads of a "device" process, so that host,
+ * device and I/O activity can be seen on one timeline. The closing bracket
+ * of the array is written at exit, but the format allows it to be missing.
+ *
+ * Independently of whether a file is written, each worker accumulates the
+ * time its leaf actions spend waiting on other stages of the pipeline. When
+ * the worker is destroyed, these are added to the @c timeplot.<em>stage</em>.*
+ * statistics, where the stage is the worker name without any numeric suffix.
+ * @ref writeBottleneckReport summarizes them.
  */
 namespace Timeplot
 {
 
+/**
+ * Classification of actions for the bottleneck report, based on the action
+ * name.
+ */
+enum ActionCategory
+{
+    ACTION_BUSY,       ///< Doing work (any action not listed below)
+    ACTION_STARVED,    ///< Waiting for input from upstream (@c pop, @c wait)
+    ACTION_BLOCKED,    ///< Waiting for resources from downstream (@c get, @c push)
+    NUM_ACTION_CATEGORIES
+};
+
+/// File formats for @ref init
+enum Format
+{
+    FORMAT_TEXT,      ///< Line-based text format
+    FORMAT_BINARY,    ///< Compact binary format
+    FORMAT_CHROME     ///< Chrome trace event JSON
+};
+
 /**
  * Initialize the timeplot subsystem. This function is optional; if it is
  * not called, no timeplot data will be written, but statistics will still
  * be updated as normal.
  *
  * @param filename          File to which the data are written.
+ * @param format            Format in which to write the file.
  * @throw std::ios::failure if the file could not be opened.
  * @pre @ref init has not already been called.
  */
-void init(const std::string &filename);
+void init(const std::string &filename, Format format = FORMAT_TEXT);
 
 class Action;
 
+namespace detail
+{
+
+/// Per-worker state for the binary format
+class WorkerLog;
+
+} // namespace detail
+
 /**
  * Encapsulates a worker. Workers perform actions, which must start and stop in
  * LIFO order i.e. it emulates a call stack. However, only the leaf action is
@@ -79,6 +143,7 @@ class Action;
 class Worker : public boost::noncopyable
 {
     friend class Action;
+    friend void recordEvent(const std::string &name, Worker &worker);
 private:
     /// Name of the worker
     const std::string name;
@@ -86,6 +151,26 @@ private:
     /// The top of the stack, or @c NULL if there is no current action
     Action *currentAction;
 
+    /// Ring buffer for the binary format, created on first use
+    boost::shared_ptr<detail::WorkerLog> log;
+
+    /// Time of construction
+    Timer::timestamp created;
+
+    /// Time spent in leaf actions of each category
+    double categoryTime[NUM_ACTION_CATEGORIES];
+
+    /// Shared constructor code
+    void init();
+
+    /**
+     * Write an event record in the binary format.
+     *
+     * @pre The binary format is in use.
+     */
+    void record(std::tr1::uint32_t action, Timer::timestamp start, Timer::timestamp stop,
+                const boost::optional<std::size_t> &value);
+
     /**
      * Called by @ref Action to push itself onto the stack. It returns the previous
      * action, which it must save and pass back to @ref stop. That is, the stack is
@@ -123,6 +208,13 @@ public:
      */
     Worker(const std::string &name, int idx);
 
+    /**
+     * Destructor. Any buffered binary records are still written out, and the
+     * time spent in each @ref ActionCategory is added to the statistics for
+     * the stage.
+     */
+    ~Worker();
+
     /// Get the name of the worker
     const std::string &getName() const;
 };
@@ -150,6 +242,8 @@ private:
     Timer::timestamp start;  ///< Time of the last resume, or of construction
 
     boost::optional<std::size_t> value;  ///< User-supplied value
+    std::tr1::uint32_t nameId;           ///< ID of @ref name in the binary format
+    ActionCategory category;             ///< Classification of @ref name
 
     /// Second-phase initialization, shared by several constructors
     void init();
@@ -213,6 +307,52 @@ public:
  */
 void recordEvent(const std::string &name, Worker &worker);
 
+/**
+ * Record an action on a worker that is not a host thread, such as an
+ * OpenCL command queue. Unlike @ref Action, the times are given explicitly
+ * and the worker is named rather than constructed, so it may be called from
+ * any thread (including OpenCL callback threads). The action may overlap
+ * others on the same worker. Nothing is recorded if @ref init has not been
+ * called, and the time is not included in the bottleneck statistics.
+ *
+ * @param worker  Name of the worker (spaces are replaced by underscores).
+ * @param action  Name of the action.
+ * @param base    Reference time.
+ * @param start   Start of the action in seconds after @a base.
+ * @param stop    End of the action in seconds after @a base.
+ */
+void recordInterval(const std::string &worker, const std::string &action,
+                    const Timer::timestamp &base, double start, double stop);
+
+/// Totals for one pipeline stage, summed over its destroyed workers
+struct StageTotals
+{
+    unsigned long long workers;                  ///< Number of workers
+    double lifetime;                             ///< Total lifetime of the workers
+    double time[NUM_ACTION_CATEGORIES];          ///< Total time in each @ref ActionCategory
+
+    StageTotals();
+
+    /// Fraction of the lifetime spent in @a category (zero if there is no lifetime)
+    double fraction(ActionCategory category) const;
+};
+
+/**
+ * Extract the @ref StageTotals of each pipeline stage recorded in @a
+ * registry, indexed by stage name. Since the statistics accumulate, the
+ * totals over an interval are the difference of two calls.
+ */
+std::map<std::string, StageTotals> getStageTotals(const Statistics::Registry &registry);
+
+/**
+ * Write a table of the pipeline stages recorded in @a registry, showing the
+ * fraction of worker time spent busy, starved of input and blocked on
+ * output, and name the stage that is most likely limiting throughput (the
+ * one with the highest busy fraction). Only workers that have been destroyed
+ * are included. Nothing is written if no stages have been recorded.
+ */
+void writeBottleneckReport(std::ostream &o, const Statistics::Registry &registry);
+
 } // namespace Timeplot
 
 #endif /* !TIMEPLOT_H */
@@ -0,0 +1,115 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Compact encoding of the triangle indices held in temporary files.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <ios>
+#include "tr1_cstdint.h"
+#include "triangle_codec.h"
+
+namespace TriangleCodec
+{
+
+namespace
+{
+
+/// Bit that distinguishes external from internal vertex indices
+const std::tr1::uint32_t externalBit = 0x80000000U;
+
+/// Map signed to unsigned so that values of small magnitude stay small
+inline std::tr1::uint64_t zigzag(std::tr1::int64_t x)
+{
+    return (std::tr1::uint64_t(x) << 1) ^ std::tr1::uint64_t(x >> 63);
+}
+
+/// Inverse of @ref zigzag
+inline std::tr1::int64_t unzigzag(std::tr1::uint64_t x)
+{
+    return std::tr1::int64_t(x >> 1) ^ -std::tr1::int64_t(x & 1);
+}
+
+} // anonymous namespace
+
+std::size_t maxEncodedSize(std::size_t numIndices)
+{
+    // Codes have at most 33 significant bits, which take 5 bytes at 7 bits each
+    return numIndices * 5;
+}
+
+std::size_t encode(std::size_t numIndices, const std::tr1::uint32_t *indices,
+                   std::tr1::uint8_t *out)
+{
+    std::tr1::uint8_t *p = out;
+    // Previous value of each kind: [0] for internal, [1] for external
+    std::tr1::int64_t prev[2] = {0, 0};
+    for (std::size_t i = 0; i < numIndices; i++)
+    {
+        const unsigned int external = (indices[i] & externalBit) ? 1 : 0;
+        const std::tr1::int64_t value = external ? ~indices[i] : indices[i];
+        std::tr1::uint64_t code = (zigzag(value - prev[external]) << 1) | external;
+        prev[external] = value;
+        while (code >= 0x80)
+        {
+            *p++ = std::tr1::uint8_t(code | 0x80);
+            code >>= 7;
+        }
+        *p++ = std::tr1::uint8_t(code);
+    }
+    return p - out;
+}
+
+void decode(std::size_t numIndices, const std::tr1::uint8_t *in, std::size_t bytes,
+            std::tr1::uint32_t *indices)
+{
+    const std::tr1::uint8_t *p = in;
+    const std::tr1::uint8_t *end = in + bytes;
+    std::tr1::int64_t prev[2] = {0, 0};
+    for (std::size_t i = 0; i < numIndices; i++)
+    {
+        std::tr1::uint64_t code = 0;
+        unsigned int shift = 0;
+        std::tr1::uint8_t b;
+        do
+        {
+            if (p == end || shift >= 35)
+                throw std::ios::failure("Corrupt encoded triangles");
+            b = *p++;
+            code |= std::tr1::uint64_t(b & 0x7f) << shift;
+            shift += 7;
+        } while (b & 0x80);
+
+        const unsigned int external = code & 1;
+        const std::tr1::int64_t value = prev[external] + unzigzag(code >> 1);
+        prev[external] = value;
+        indices[i] = external ? ~std::tr1::uint32_t(value) : std::tr1::uint32_t(value);
+    }
+    if (p != end)
+        throw std::ios::failure("Corrupt encoded triangles");
+}
+
+} // namespace TriangleCodec
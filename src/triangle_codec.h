@@ -0,0 +1,80 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Compact encoding of the triangle indices held in temporary files.
+ */
+
+#ifndef MLSGPU_TRIANGLE_CODEC_H
+#define MLSGPU_TRIANGLE_CODEC_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include "tr1_cstdint.h"
+
+/**
+ * Encoding of vertex indices for a clump of triangles. The input follows the
+ * conventions of the @ref OOCMesher temporary files: an index with the top
+ * bit clear refers to an internal vertex, relative to the first vertex of the
+ * clump, while one with the top bit set is the complement of an external
+ * vertex index. Each index is stored as a variable-length integer holding the
+ * difference from the previous index of the same kind, so that the typical
+ * triangle takes 3&ndash;4 bytes instead of 12.
+ *
+ * Any sequence of 32-bit values round-trips, so the encoding is lossless even
+ * if the conventions above are not followed.
+ */
+namespace TriangleCodec
+{
+
+/// Upper bound on the bytes produced by @ref encode for @a numIndices indices
+std::size_t maxEncodedSize(std::size_t numIndices);
+
+/**
+ * Encode vertex indices.
+ *
+ * @param numIndices   Number of indices (three per triangle).
+ * @param indices      The indices to encode.
+ * @param[out] out     Encoded data, with space for @ref maxEncodedSize(@a numIndices) bytes.
+ * @return The number of bytes written to @a out.
+ */
+std::size_t encode(std::size_t numIndices, const std::tr1::uint32_t *indices,
+                   std::tr1::uint8_t *out);
+
+/**
+ * Decode vertex indices produced by @ref encode.
+ *
+ * @param numIndices   Number of indices that were encoded.
+ * @param in           Encoded data.
+ * @param bytes        Size of @a in.
+ * @param[out] indices The decoded indices.
+ * @throw std::ios::failure if @a in is truncated or does not hold exactly
+ * @a numIndices indices.
+ */
+void decode(std::size_t numIndices, const std::tr1::uint8_t *in, std::size_t bytes,
+            std::tr1::uint32_t *indices);
+
+} // namespace TriangleCodec
+
+#endif /* !MLSGPU_TRIANGLE_CODEC_H */
@@ -207,6 +207,140 @@ bool merge(NodeVector &nodes,
     return merged;
 }
 
+/**
+ * Variant of the union-find structure that can be updated from several
+ * threads at once without locking. Components are linked with a
+ * compare-and-swap on the root, always making the root with the larger index
+ * a child of the one with the smaller index so that no cycles can form, and
+ * @ref findRoot uses path halving. Since a link cannot be made atomically with
+ * any other update, component sizes and other per-component data are not
+ * tracked; if needed they should be accumulated in a separate pass once all
+ * merges are complete.
+ */
+namespace Concurrent
+{
+
+/**
+ * A per-vertex element in the concurrent union-find data structure.
+ *
+ * @param Size A @b signed type with enough range to represent the number of
+ * elements in the graph.
+ */
+template<typename Size>
+class Node
+{
+public:
+    typedef Size size_type;     ///< Type used to store the parent index
+
+    /// Default constructor. Creates a root node.
+    Node() : parent_(-1)
+    {
+        BOOST_STATIC_ASSERT(boost::is_signed<size_type>::value);
+    }
+
+    /**
+     * Determines whether this node is currently a root. If other threads are
+     * merging, the result may be stale as soon as it is returned.
+     */
+    bool isRoot() const
+    {
+        return parent() < 0;
+    }
+
+private:
+    template<typename NodeVector>
+        friend typename NodeVector::iterator::value_type::size_type
+        findRoot(const NodeVector &nodes, typename NodeVector::iterator::value_type::size_type id);
+    template<typename NodeVector>
+        friend bool merge(NodeVector &nodes,
+                          typename NodeVector::iterator::value_type::size_type a,
+                          typename NodeVector::iterator::value_type::size_type b);
+#if UNIT_TESTS
+    friend class ::TestUnionFind;
+#endif
+
+    /**
+     * Parent index, or -1 for a root. This is mutable because path halving
+     * alters it without making semantic changes to the structure.
+     */
+    mutable size_type parent_;
+
+    /// Atomically read the parent index (-1 for a root)
+    size_type parent() const
+    {
+        return __atomic_load_n(&parent_, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * Replace the parent with @a desired if it is still @a expected.
+     * @return Whether the replacement happened.
+     */
+    bool replaceParent(size_type expected, size_type desired) const
+    {
+        return __atomic_compare_exchange_n(&parent_, &expected, desired, false,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+};
+
+/**
+ * Determines the root node of the component of a given node. This may be
+ * called concurrently with @ref merge, in which case the result is the root
+ * at some point during the call.
+ *
+ * @param nodes        Random access container of nodes giving a union-find structure.
+ * @param id           Index of the query node.
+ * @return Index of the root node of the component containing @a id.
+ */
+template<typename NodeVector>
+typename NodeVector::iterator::value_type::size_type
+findRoot(const NodeVector &nodes, typename NodeVector::iterator::value_type::size_type id)
+{
+    typedef typename NodeVector::iterator::value_type::size_type size_type;
+    while (true)
+    {
+        size_type p = nodes[id].parent();
+        if (p < 0)
+            return id;
+        size_type gp = nodes[p].parent();
+        if (gp < 0)
+            return p;
+        // Path halving. Failure just means another thread got there first.
+        nodes[id].replaceParent(p, gp);
+        id = gp;
+    }
+}
+
+/**
+ * Combine two components. This may be called concurrently with other calls
+ * to @ref merge and @ref findRoot on the same nodes. It is legal to call this
+ * function when the given nodes are already in the same component.
+ *
+ * @param nodes        Random access container of nodes giving a union-find structure.
+ * @param a, b         Two nodes (not necessarily roots) to combine.
+ * @retval @c true if this call merged two separate components.
+ * @retval @c false if @a a and @a b were already in the same component.
+ */
+template<typename NodeVector>
+bool merge(NodeVector &nodes,
+           typename NodeVector::iterator::value_type::size_type a,
+           typename NodeVector::iterator::value_type::size_type b)
+{
+    while (true)
+    {
+        a = findRoot(nodes, a);
+        b = findRoot(nodes, b);
+        if (a == b)
+            return false;
+        if (a < b)
+            std::swap(a, b);
+        // If a is no longer a root, another thread linked it: retry from there
+        if (nodes[a].replaceParent(-1, b))
+            return true;
+    }
+}
+
+} // namespace Concurrent
+
 } // namespace UnionFind
 
 #endif /* !UNION_FIND_H */
@@ -0,0 +1,210 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Reordering of triangles and vertices for post-transform vertex cache
+ * locality.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cassert>
+#include "tr1_cstdint.h"
+#include "vertex_cache.h"
+
+namespace VertexCache
+{
+
+namespace
+{
+
+/**
+ * Replace arbitrary vertex indices by dense ones in [0, @a numVertices).
+ *
+ * @param n                Number of indices.
+ * @param indices          Input indices.
+ * @param[out] dense       Dense indices, corresponding to @a indices.
+ * @return The number of distinct vertices.
+ */
+std::size_t makeDense(std::size_t n, const std::tr1::uint32_t *indices, std::vector<std::tr1::uint32_t> &dense)
+{
+    std::vector<std::tr1::uint32_t> values(indices, indices + n);
+    std::sort(values.begin(), values.end());
+    values.erase(std::unique(values.begin(), values.end()), values.end());
+    dense.resize(n);
+    for (std::size_t i = 0; i < n; i++)
+        dense[i] = std::lower_bound(values.begin(), values.end(), indices[i]) - values.begin();
+    return values.size();
+}
+
+} // anonymous namespace
+
+void tipsify(std::size_t numTriangles, std::tr1::uint32_t *indices, unsigned int cacheSize)
+{
+    if (numTriangles == 0)
+        return;
+
+    std::vector<std::tr1::uint32_t> tri;
+    const std::size_t numVertices = makeDense(3 * numTriangles, indices, tri);
+
+    // Vertex-to-triangle adjacency in compressed form, and live triangle counts
+    std::vector<std::size_t> live(numVertices, 0);
+    for (std::size_t i = 0; i < 3 * numTriangles; i++)
+        live[tri[i]]++;
+    std::vector<std::size_t> start(numVertices + 1);
+    start[0] = 0;
+    for (std::size_t v = 0; v < numVertices; v++)
+        start[v + 1] = start[v] + live[v];
+    std::vector<std::size_t> adj(3 * numTriangles);
+    {
+        std::vector<std::size_t> pos(start.begin(), start.end() - 1);
+        for (std::size_t i = 0; i < 3 * numTriangles; i++)
+            adj[pos[tri[i]]++] = i / 3;
+    }
+
+    // Time at which each vertex entered the cache
+    std::vector<std::tr1::int64_t> cacheTime(numVertices, 0);
+    std::tr1::int64_t now = cacheSize + 1;
+    std::vector<bool> emitted(numTriangles, false);
+    std::vector<std::tr1::uint32_t> deadEnd;
+    std::vector<std::tr1::uint32_t> candidates;
+    std::vector<std::tr1::uint32_t> out;
+    out.reserve(3 * numTriangles);
+    std::size_t cursor = 0;
+
+    std::tr1::int64_t fan = 0;
+    while (fan >= 0)
+    {
+        candidates.clear();
+        for (std::size_t j = start[fan]; j < start[fan + 1]; j++)
+        {
+            const std::size_t t = adj[j];
+            if (emitted[t])
+                continue;
+            for (int k = 0; k < 3; k++)
+            {
+                const std::tr1::uint32_t v = tri[3 * t + k];
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (now - cacheTime[v] > std::tr1::int64_t(cacheSize))
+                    cacheTime[v] = now++;
+                out.push_back(indices[3 * t + k]);
+            }
+            emitted[t] = true;
+        }
+
+        /* Choose the next fanning vertex: the candidate that will still be
+         * in the cache after its remaining triangles are emitted and has
+         * been there longest, otherwise any candidate with live triangles.
+         */
+        fan = -1;
+        std::tr1::int64_t best = -1;
+        for (std::size_t j = 0; j < candidates.size(); j++)
+        {
+            const std::tr1::uint32_t v = candidates[j];
+            if (live[v] > 0)
+            {
+                std::tr1::int64_t priority = 0;
+                if (now - cacheTime[v] + 2 * std::tr1::int64_t(live[v]) <= std::tr1::int64_t(cacheSize))
+                    priority = now - cacheTime[v];
+                if (priority > best)
+                {
+                    best = priority;
+                    fan = v;
+                }
+            }
+        }
+
+        if (fan < 0)
+        {
+            // Dead end: back up to a recently used vertex, or scan for any
+            while (!deadEnd.empty() && fan < 0)
+            {
+                const std::tr1::uint32_t v = deadEnd.back();
+                deadEnd.pop_back();
+                if (live[v] > 0)
+                    fan = v;
+            }
+            for (; fan < 0 && cursor < numVertices; cursor++)
+                if (live[cursor] > 0)
+                    fan = cursor;
+        }
+    }
+
+    assert(out.size() == 3 * numTriangles);
+    std::copy(out.begin(), out.end(), indices);
+}
+
+void renumberVertices(
+    std::size_t numTriangles, std::tr1::uint32_t *indices,
+    std::tr1::uint32_t first, std::tr1::uint32_t numVertices,
+    std::tr1::uint32_t *newIndex)
+{
+    const std::tr1::uint32_t unused = std::numeric_limits<std::tr1::uint32_t>::max();
+    std::fill(newIndex, newIndex + numVertices, unused);
+    std::tr1::uint32_t next = 0;
+    for (std::size_t i = 0; i < 3 * numTriangles; i++)
+    {
+        const std::tr1::uint32_t rel = indices[i] - first;
+        if (indices[i] >= first && rel < numVertices)
+        {
+            if (newIndex[rel] == unused)
+                newIndex[rel] = next++;
+            indices[i] = first + newIndex[rel];
+        }
+    }
+    for (std::tr1::uint32_t v = 0; v < numVertices; v++)
+        if (newIndex[v] == unused)
+            newIndex[v] = next++;
+}
+
+double averageMissRatio(std::size_t numTriangles, const std::tr1::uint32_t *indices, unsigned int cacheSize)
+{
+    if (numTriangles == 0)
+        return 0.0;
+
+    std::vector<std::tr1::uint32_t> dense;
+    const std::size_t numVertices = makeDense(3 * numTriangles, indices, dense);
+    /* In a FIFO cache, a vertex is still present if fewer than cacheSize
+     * misses have occurred since it was loaded.
+     */
+    std::vector<std::tr1::uint64_t> loaded(numVertices, 0);
+    std::tr1::uint64_t misses = 0;
+    for (std::size_t i = 0; i < 3 * numTriangles; i++)
+    {
+        std::tr1::uint64_t &l = loaded[dense[i]];
+        if (l == 0 || misses - l >= cacheSize)
+        {
+            misses++;
+            l = misses;
+        }
+    }
+    return double(misses) / numTriangles;
+}
+
+} // namespace VertexCache
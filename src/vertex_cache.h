@@ -0,0 +1,85 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Reordering of triangles and vertices for post-transform vertex cache
+ * locality.
+ */
+
+#ifndef MLSGPU_VERTEX_CACHE_H
+#define MLSGPU_VERTEX_CACHE_H
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cstddef>
+#include "tr1_cstdint.h"
+
+namespace VertexCache
+{
+
+/**
+ * Reorder triangles so that a FIFO vertex cache of @a cacheSize entries
+ * gets a high hit rate, using the Tipsify algorithm of Sander, Nehab and
+ * Barczak ("Fast triangle reordering for vertex locality and reduced
+ * overdraw", SIGGRAPH 2007). It runs in time linear in the number of
+ * triangles, apart from a sort to make the vertex indices dense.
+ *
+ * The indices may be arbitrary values: they need not be dense. The vertices
+ * of each triangle keep their order, so the winding is preserved.
+ *
+ * @param numTriangles     Number of triangles.
+ * @param[in,out] indices  The @a numTriangles * 3 vertex indices.
+ * @param cacheSize        Number of entries in the cache being targeted.
+ */
+void tipsify(std::size_t numTriangles, std::tr1::uint32_t *indices, unsigned int cacheSize = 16);
+
+/**
+ * Renumber the vertices in the range [@a first, @a first + @a numVertices)
+ * in order of first use by @a indices. Indices outside the range are left
+ * unchanged.
+ *
+ * @param numTriangles     Number of triangles.
+ * @param[in,out] indices  The @a numTriangles * 3 vertex indices.
+ * @param first, numVertices Range of vertex indices to renumber.
+ * @param[out] newIndex    For each vertex in the range, its new index (relative to
+ *                         @a first). It must have space for @a numVertices elements.
+ *                         Vertices that are not used are numbered after the used ones.
+ */
+void renumberVertices(
+    std::size_t numTriangles, std::tr1::uint32_t *indices,
+    std::tr1::uint32_t first, std::tr1::uint32_t numVertices,
+    std::tr1::uint32_t *newIndex);
+
+/**
+ * Compute the average cache miss ratio (vertices transformed per triangle)
+ * for a FIFO vertex cache.
+ *
+ * @param numTriangles     Number of triangles.
+ * @param indices          The @a numTriangles * 3 vertex indices.
+ * @param cacheSize        Number of entries in the cache.
+ */
+double averageMissRatio(std::size_t numTriangles, const std::tr1::uint32_t *indices, unsigned int cacheSize = 16);
+
+} // namespace VertexCache
+
+#endif /* !MLSGPU_VERTEX_CACHE_H */
@@ -21,7 +21,7 @@
 /**
  * @file
  *
- * Data structure for passing work between threads.
+ * Data structures for passing work between threads.
  */
 
 #ifndef WORK_QUEUE_H
@@ -34,12 +34,16 @@
 #include <cstddef>
 #include <stdexcept>
 #include <map>
-#include <queue>
+#include <deque>
+#include <algorithm>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/smart_ptr/scoped_array.hpp>
 #include <boost/noncopyable.hpp>
+#include <boost/function.hpp>
 #include "errors.h"
 
 /**
@@ -53,6 +57,10 @@
  * not throw. In particular, containers should not be used, or should be
  * passed by smart pointer.
  *
+ * Items are normally removed in the order they were added. If an ordering is
+ * set with @ref setPriority, they are instead removed in that order (and in
+ * the order they were added among equals).
+ *
  * @param ValueType   The type of data stored in the queue.
  */
 template<typename ValueType>
@@ -61,6 +69,8 @@ class WorkQueue : public boost::noncopyable
 public:
     typedef ValueType value_type;
     typedef std::size_t size_type;
+    /// Strict weak ordering in which items are removed (smallest first)
+    typedef boost::function<bool(const value_type &, const value_type &)> Compare;
 
     /**
      * Add an item to the queue. This will never block.
@@ -80,6 +90,35 @@ public:
      */
     value_type pop();
 
+    /**
+     * Variant of @ref pop with a timeout. If an item becomes available (or
+     * the queue is stopped and drained) within @a timeout, it is stored in @a
+     * item and the return value is @c true. Otherwise, @a item is not modified
+     * and the return value is @c false.
+     */
+    bool pop(value_type &item, const boost::posix_time::time_duration &timeout);
+
+    /**
+     * Non-blocking variant of @ref pop. If the queue contains an item, it is
+     * removed from the head and stored in @a item, and the return value is @c
+     * true. Otherwise, the return value is @c false (even if the queue is
+     * stopped).
+     */
+    bool tryPop(value_type &item);
+
+    /**
+     * Removes an item from the tail of the queue, for use by consumers
+     * that are not the intended recipients of the queue (work stealing).
+     * Items are taken from the tail since they are the ones that would
+     * otherwise wait longest. It does not block, and otherwise behaves like
+     * @ref tryPop.
+     *
+     * If an ordering has been set with @ref setPriority, the item taken is
+     * the same one that @ref tryPop would take, so that stealing does not
+     * undo the ordering.
+     */
+    bool steal(value_type &item);
+
     /**
      * Determine whether calling @ref pop will block. In a multithreaded
      * environment the result should of course be considered immediately stale.
@@ -87,6 +126,12 @@ public:
      */
     bool empty();
 
+    /**
+     * Number of items currently in the queue. Like @ref empty, the result is
+     * immediately stale; it is intended for monitoring.
+     */
+    size_type size();
+
     /**
      * Indicate that there will be no more data added. It is not safe to call
      * this simultaneously with @ref push.
@@ -100,14 +145,30 @@ public:
      */
     void start();
 
+    /**
+     * Remove items in the order given by @a compare rather than in the
+     * order they were added. An empty function restores the default. This
+     * is a linear search per item, so it is only suitable for short queues.
+     * It should only be called when there is only a single thread active.
+     */
+    void setPriority(const Compare &compare);
+
     /**
      * Constructor.
      */
     WorkQueue();
 
 private:
-    std::queue<value_type> queue;
+    std::deque<value_type> queue;
+    Compare compare;          ///< Priority order set by @ref setPriority, if any
     bool stopped;
+
+    /**
+     * Remove the next item (in priority order, or else from the head) and
+     * store it in @a item. The mutex must be held and the queue must be
+     * non-empty.
+     */
+    void take(value_type &item);
     boost::mutex mutex;
     boost::condition_variable dataCondition;
     // TODO account for the memory
@@ -125,7 +186,7 @@ void WorkQueue<ValueType>::push(const ValueType &value)
 {
     boost::lock_guard<boost::mutex> lock(mutex);
     MLSGPU_ASSERT(!stopped, state_error);
-    queue.push(value);
+    queue.push_back(value);
     dataCondition.notify_one();
 }
 
@@ -135,14 +196,53 @@ ValueType WorkQueue<ValueType>::pop()
     boost::unique_lock<boost::mutex> lock(mutex);
     while (!stopped && queue.empty())
         dataCondition.wait(lock);
+    value_type ans = value_type();
+    if (!queue.empty())
+        take(ans);
+    return ans;
+}
+
+template<typename ValueType>
+bool WorkQueue<ValueType>::pop(ValueType &item, const boost::posix_time::time_duration &timeout)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    const boost::system_time deadline = boost::get_system_time() + timeout;
+    while (!stopped && queue.empty())
+    {
+        if (!dataCondition.timed_wait(lock, deadline) && !stopped && queue.empty())
+            return false;
+    }
     if (queue.empty())
-        return value_type();
+        item = value_type();
+    else
+        take(item);
+    return true;
+}
+
+template<typename ValueType>
+bool WorkQueue<ValueType>::tryPop(ValueType &item)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (queue.empty())
+        return false;
+    take(item);
+    return true;
+}
+
+template<typename ValueType>
+bool WorkQueue<ValueType>::steal(ValueType &item)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (queue.empty())
+        return false;
+    if (compare)
+        take(item);
     else
     {
-        value_type ans = queue.front();
-        queue.pop();
-        return ans;
+        item = queue.back();
+        queue.pop_back();
     }
+    return true;
 }
 
 template<typename ValueType>
@@ -152,6 +252,30 @@ bool WorkQueue<ValueType>::empty()
     return !stopped && queue.empty();
 }
 
+template<typename ValueType>
+typename WorkQueue<ValueType>::size_type WorkQueue<ValueType>::size()
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    return queue.size();
+}
+
+template<typename ValueType>
+void WorkQueue<ValueType>::take(ValueType &item)
+{
+    typename std::deque<value_type>::iterator pos = queue.begin();
+    if (compare)
+        pos = std::min_element(queue.begin(), queue.end(), compare);
+    item = *pos;
+    queue.erase(pos);
+}
+
+template<typename ValueType>
+void WorkQueue<ValueType>::setPriority(const Compare &compare)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    this->compare = compare;
+}
+
 template<typename ValueType>
 void WorkQueue<ValueType>::start()
 {
@@ -167,4 +291,339 @@ void WorkQueue<ValueType>::stop()
     dataCondition.notify_all(); // wake up any consumers waiting on an empty queue
 }
 
+/**
+ * Bounded thread-safe queue, supporting multiple producers and multiple
+ * consumers, with the same interface and stop semantics as @ref WorkQueue
+ * (except for @ref WorkQueue::steal). Items are passed through a ring buffer
+ * without taking a lock, and a mutex is only used to sleep when the queue is
+ * empty (for consumers) or full (for producers). It is intended for queues
+ * that see heavy traffic from many threads.
+ *
+ * Unlike @ref WorkQueue, @ref push will block if the queue is full, so the
+ * capacity must be large enough that this does not lead to deadlock.
+ *
+ * The ring buffer follows Dmitry Vyukov's bounded MPMC queue: each slot has
+ * a sequence number indicating whether it is ready to be written or read
+ * for a given position.
+ *
+ * It is a requirement that the assignment operator for the value type does
+ * not throw.
+ *
+ * @param ValueType   The type of data stored in the queue.
+ */
+template<typename ValueType>
+class BoundedWorkQueue : public boost::noncopyable
+{
+public:
+    typedef ValueType value_type;
+    typedef std::size_t size_type;
+
+    /// Default value for the constructor argument
+    static const size_type DEFAULT_CAPACITY = 1024;
+
+    /**
+     * Add an item to the queue. This will block if the queue is full.
+     *
+     * @pre The queue is not stopped.
+     */
+    void push(const value_type &item);
+
+    /// @copydoc WorkQueue::pop()
+    value_type pop();
+
+    /// @copydoc WorkQueue::pop(value_type &, const boost::posix_time::time_duration &)
+    bool pop(value_type &item, const boost::posix_time::time_duration &timeout);
+
+    /// @copydoc WorkQueue::tryPop
+    bool tryPop(value_type &item);
+
+    /// @copydoc WorkQueue::empty
+    bool empty();
+
+    /// @copydoc WorkQueue::size
+    size_type size();
+
+    /// @copydoc WorkQueue::stop
+    void stop();
+
+    /// @copydoc WorkQueue::start
+    void start();
+
+    /// The maximum number of items the queue can hold
+    size_type capacity() const { return mask + 1; }
+
+    /**
+     * Constructor.
+     *
+     * @param capacity    Number of items that can be held. It is rounded up to a power of 2.
+     */
+    explicit BoundedWorkQueue(size_type capacity = DEFAULT_CAPACITY);
+
+private:
+    /// Size used to keep the positions in separate cache lines
+    static const size_type CACHE_LINE = 64;
+
+    struct Cell
+    {
+        size_type sequence;
+        value_type value;
+    };
+
+    boost::scoped_array<Cell> cells;
+    const size_type mask;
+
+    char pad0[CACHE_LINE];
+    size_type pushPos;           ///< Next position to write
+    char pad1[CACHE_LINE];
+    size_type popPos;            ///< Next position to read
+    char pad2[CACHE_LINE];
+
+    unsigned int popWaiters;     ///< Consumers sleeping on @ref dataCondition
+    unsigned int pushWaiters;    ///< Producers sleeping on @ref spaceCondition
+    bool stopped;                ///< Protected by @ref mutex
+    boost::mutex mutex;
+    boost::condition_variable dataCondition;
+    boost::condition_variable spaceCondition;
+
+    /// Non-blocking implementation of @ref push
+    bool tryPushRaw(const value_type &item);
+    /// Non-blocking implementation of @ref tryPop that does not wake producers
+    bool tryPopRaw(value_type &item);
+    /// Wake a sleeping consumer, if any
+    void notifyData();
+    /// Wake a sleeping producer, if any
+    void notifySpace();
+    /// Round up to a power of 2
+    static size_type roundCapacity(size_type capacity);
+};
+
+template<typename ValueType>
+typename BoundedWorkQueue<ValueType>::size_type
+BoundedWorkQueue<ValueType>::roundCapacity(size_type capacity)
+{
+    MLSGPU_ASSERT(capacity > 0, std::invalid_argument);
+    size_type ans = 1;
+    while (ans < capacity)
+        ans *= 2;
+    return ans;
+}
+
+template<typename ValueType>
+BoundedWorkQueue<ValueType>::BoundedWorkQueue(size_type capacity)
+    : cells(new Cell[roundCapacity(capacity)]),
+    mask(roundCapacity(capacity) - 1),
+    pushPos(0), popPos(0),
+    popWaiters(0), pushWaiters(0), stopped(false)
+{
+    for (size_type i = 0; i <= mask; i++)
+        cells[i].sequence = i;
+}
+
+template<typename ValueType>
+bool BoundedWorkQueue<ValueType>::tryPushRaw(const ValueType &item)
+{
+    size_type pos = __atomic_load_n(&pushPos, __ATOMIC_RELAXED);
+    Cell *cell;
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_type seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&pushPos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return false; // full
+        else
+            pos = __atomic_load_n(&pushPos, __ATOMIC_RELAXED);
+    }
+    cell->value = item;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+template<typename ValueType>
+bool BoundedWorkQueue<ValueType>::tryPopRaw(ValueType &item)
+{
+    size_type pos = __atomic_load_n(&popPos, __ATOMIC_RELAXED);
+    Cell *cell;
+    while (true)
+    {
+        cell = &cells[pos & mask];
+        size_type seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        std::ptrdiff_t diff = std::ptrdiff_t(seq - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&popPos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return false; // empty
+        else
+            pos = __atomic_load_n(&popPos, __ATOMIC_RELAXED);
+    }
+    item = cell->value;
+    cell->value = value_type(); // release any reference held by the slot
+    __atomic_store_n(&cell->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * The sleep/wake protocol: a sleeper increments its waiter count and then
+ * retries the operation with the mutex held, while the other side publishes
+ * its change and then checks the waiter count. The full fences ensure that at
+ * least one of them sees the other, and the mutex ensures that a notification
+ * sent after the sleeper retried is not lost.
+ */
+template<typename ValueType>
+void BoundedWorkQueue<ValueType>::notifyData()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&popWaiters, __ATOMIC_RELAXED) > 0)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        dataCondition.notify_one();
+    }
+}
+
+template<typename ValueType>
+void BoundedWorkQueue<ValueType>::notifySpace()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pushWaiters, __ATOMIC_RELAXED) > 0)
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        spaceCondition.notify_one();
+    }
+}
+
+template<typename ValueType>
+void BoundedWorkQueue<ValueType>::push(const ValueType &value)
+{
+    if (!tryPushRaw(value))
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        MLSGPU_ASSERT(!stopped, state_error);
+        __atomic_add_fetch(&pushWaiters, 1, __ATOMIC_SEQ_CST);
+        while (!tryPushRaw(value))
+            spaceCondition.wait(lock);
+        __atomic_sub_fetch(&pushWaiters, 1, __ATOMIC_SEQ_CST);
+    }
+    notifyData();
+}
+
+template<typename ValueType>
+ValueType BoundedWorkQueue<ValueType>::pop()
+{
+    value_type ans;
+    if (!tryPopRaw(ans))
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        __atomic_add_fetch(&popWaiters, 1, __ATOMIC_SEQ_CST);
+        while (!tryPopRaw(ans))
+        {
+            if (stopped)
+            {
+                __atomic_sub_fetch(&popWaiters, 1, __ATOMIC_SEQ_CST);
+                return value_type();
+            }
+            dataCondition.wait(lock);
+        }
+        __atomic_sub_fetch(&popWaiters, 1, __ATOMIC_SEQ_CST);
+    }
+    notifySpace();
+    return ans;
+}
+
+template<typename ValueType>
+bool BoundedWorkQueue<ValueType>::pop(ValueType &item, const boost::posix_time::time_duration &timeout)
+{
+    if (!tryPopRaw(item))
+    {
+        const boost::system_time deadline = boost::get_system_time() + timeout;
+        boost::unique_lock<boost::mutex> lock(mutex);
+        bool found = true;
+        __atomic_add_fetch(&popWaiters, 1, __ATOMIC_SEQ_CST);
+        while (!tryPopRaw(item))
+        {
+            if (stopped)
+            {
+                item = value_type();
+                break;
+            }
+            if (!dataCondition.timed_wait(lock, deadline))
+            {
+                // Make one last attempt before giving up
+                if (tryPopRaw(item))
+                    break;
+                if (stopped)
+                    item = value_type();
+                else
+                    found = false;
+                break;
+            }
+        }
+        __atomic_sub_fetch(&popWaiters, 1, __ATOMIC_SEQ_CST);
+        if (!found)
+            return false;
+    }
+    notifySpace();
+    return true;
+}
+
+template<typename ValueType>
+bool BoundedWorkQueue<ValueType>::tryPop(ValueType &item)
+{
+    if (!tryPopRaw(item))
+        return false;
+    notifySpace();
+    return true;
+}
+
+template<typename ValueType>
+bool BoundedWorkQueue<ValueType>::empty()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    if (stopped)
+        return false;
+    size_type pos = __atomic_load_n(&popPos, __ATOMIC_ACQUIRE);
+    size_type seq = __atomic_load_n(&cells[pos & mask].sequence, __ATOMIC_ACQUIRE);
+    return std::ptrdiff_t(seq - (pos + 1)) < 0;
+}
+
+template<typename ValueType>
+typename BoundedWorkQueue<ValueType>::size_type BoundedWorkQueue<ValueType>::size()
+{
+    // The two positions are read separately, so the difference may be
+    // transiently out of range.
+    size_type pop = __atomic_load_n(&popPos, __ATOMIC_ACQUIRE);
+    size_type push = __atomic_load_n(&pushPos, __ATOMIC_ACQUIRE);
+    std::ptrdiff_t n = push - pop;
+    if (n < 0)
+        return 0;
+    else if (size_type(n) > capacity())
+        return capacity();
+    else
+        return n;
+}
+
+template<typename ValueType>
+void BoundedWorkQueue<ValueType>::start()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    stopped = false;
+}
+
+template<typename ValueType>
+void BoundedWorkQueue<ValueType>::stop()
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    stopped = true;
+    dataCondition.notify_all(); // wake up any consumers waiting on an empty queue
+}
+
 #endif /* !WORK_QUEUE_H */
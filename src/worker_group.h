@@ -34,11 +34,14 @@
 #include <boost/noncopyable.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/ptr_container/ptr_map.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
 #include <boost/foreach.hpp>
+#include <boost/bind.hpp>
 #include <cstdlib>
 #include <cstddef>
 #include <stdexcept>
@@ -48,6 +51,10 @@
 #include "errors.h"
 #include "thread_name.h"
 #include "timeplot.h"
+#include "metrics.h"
+#include "numa.h"
+#include "cpu_budget.h"
+#include "timer.h"
 
 /**
  * Base class from which workers may derive. They are not required to do so,
@@ -96,6 +103,10 @@ public:
  * @param WorkItem     A POD type describing an item of work.
  * @param Worker       Function object class that is called to process elements.
  * @param Derived      The class that is being derived from the template.
+ * @param Queue        The queue class used to hold pending items. It must
+ *                     provide @c push, @c pop, @c start and @c stop with the
+ *                     semantics of @ref WorkQueue. @ref BoundedWorkQueue may
+ *                     be used for heavily contended queues.
  *
  * The @a Worker class must have an @c operator() that accepts a reference to a
  * @a WorkItem. The operator does not need to be @c const.  The worker class
@@ -114,13 +125,19 @@ public:
  * The @ref start and @ref stop functions are not thread-safe: they should
  * only be called by a single manager thread. The other functions are
  * thread-safe, allowing for multiple producers.
+ *
+ * A group may be made elastic with @ref setElastic, in which case only some
+ * of the threads take work at any time, and the rest wait to be woken when
+ * the queue backs up.
  */
-template<typename WorkItem, typename Worker, typename Derived>
+template<typename WorkItem, typename Worker, typename Derived,
+         typename Queue = WorkQueue<boost::shared_ptr<WorkItem> > >
 class WorkerGroup
 {
 public:
     typedef WorkItem work_item_type;
     typedef Worker worker_type;
+    typedef Queue queue_type;
 
     bool running() const
     {
@@ -148,6 +165,8 @@ public:
     {
         Timeplot::recordEvent("push", tworker);
         workQueue.push(item);
+        if (elasticMin < workers.size())
+            wakeIfBacklogged();
     }
 
     /**
@@ -161,11 +180,14 @@ public:
     {
         MLSGPU_ASSERT(!running(), state_error);
         workQueue.start();
+        elasticStopping = false;
+        elasticParked = workers.size() - elasticMin;
+        elasticWakes = 0;
         threads.reserve(workers.size());
         for (std::size_t i = 0; i < workers.size(); i++)
             workers[i].start();
         for (std::size_t i = 0; i < workers.size(); i++)
-            threads.push_back(new boost::thread(Thread(*static_cast<Derived *>(this), getWorker(i))));
+            threads.push_back(new boost::thread(Thread(*static_cast<Derived *>(this), getWorker(i), i)));
     }
 
     /**
@@ -182,6 +204,11 @@ public:
         MLSGPU_ASSERT(threads.size() == workers.size(), state_error);
 
         workQueue.stop();
+        {
+            boost::lock_guard<boost::mutex> lock(elasticMutex);
+            elasticStopping = true;
+        }
+        elasticCondition.notify_all();
         static_cast<Derived *>(this)->stopPreJoin();
         for (std::size_t i = 0; i < threads.size(); i++)
             threads[i].join();
@@ -189,6 +216,55 @@ public:
         static_cast<Derived *>(this)->stopPostJoin();
     }
 
+    /**
+     * Restrict the worker threads to the CPUs of a NUMA node, or -1 (the
+     * default) to leave them unrestricted. This takes effect the next time
+     * the threads are started.
+     */
+    void setNumaNode(int node)
+    {
+        numaNode = node;
+    }
+
+    /**
+     * Share a @ref CpuBudget with other groups, or @c NULL (the default) to
+     * process items without one. Each item is processed while holding a slot
+     * of the budget; see @ref CpuBudget for the restrictions this implies.
+     *
+     * @pre The worker threads are not running.
+     */
+    void setCpuBudget(CpuBudget *budget)
+    {
+        MLSGPU_ASSERT(!running(), state_error);
+        cpuBudget = budget;
+    }
+
+    /**
+     * Let the number of threads taking work vary between @a minActive and
+     * @ref numWorkers. Only the first @a minActive threads take work when the
+     * group starts. When an item is pushed and the queue holds more items
+     * than there are active threads, a waiting thread is woken. When an
+     * active thread has waited for more than @a idleTime seconds to pop an
+     * item, it goes back to waiting once that item is done (but never
+     * leaving fewer than @a minActive active). Passing @ref numWorkers as
+     * @a minActive (the default) keeps all the threads active.
+     *
+     * This only changes how many threads run, so a stage that is
+     * temporarily the bottleneck gets more of the CPU without the others
+     * competing for it the rest of the time. The threads and workers are
+     * all created up front.
+     *
+     * @pre The worker threads are not running, and 0 &lt; @a minActive &lt;=
+     * @ref numWorkers.
+     */
+    void setElastic(std::size_t minActive, double idleTime = 0.1)
+    {
+        MLSGPU_ASSERT(!running(), state_error);
+        MLSGPU_ASSERT(minActive > 0 && minActive <= workers.size(), std::invalid_argument);
+        elasticMin = minActive;
+        elasticIdle = idleTime;
+    }
+
     /// Returns the number of workers.
     std::size_t numWorkers() const
     {
@@ -204,13 +280,18 @@ public:
 protected:
 
     /**
-     * Register a worker during construction.
+     * Register a worker during construction. Subclasses may also add
+     * workers later while the threads are not running, for example to make
+     * room for an elastic group (see @ref setElastic). The added workers
+     * are active unless @ref setElastic is called again.
      *
      * @see @ref WorkerGroup::WorkerGroup.
      */
     void addWorker(Worker *worker)
     {
+        MLSGPU_ASSERT(!running(), state_error);
         workers.push_back(worker);
+        elasticMin = workers.size();
     }
 
     /// Retrieve a reference to a worker.
@@ -219,6 +300,12 @@ protected:
         return workers.at(index);
     }
 
+    /// Retrieve the queue of items waiting to be processed.
+    Queue &getWorkQueue()
+    {
+        return workQueue;
+    }
+
     /**
      * Constructor. The derived class must chain to this, and then
      * make exactly @a numWorkers calls to @ref addWorker to provide the
@@ -232,11 +319,20 @@ protected:
     WorkerGroup(const std::string &name,
                 std::size_t numWorkers)
         : threadName(name),
+        numaNode(-1),
+        cpuBudget(NULL),
+        elasticMin(0),
+        elasticIdle(0.0),
+        elasticParked(0),
+        elasticWakes(0),
+        elasticStopping(false),
         workQueue(),
         firstPopStat(Statistics::getStatistic<Statistics::Variable>(name + ".pop.first")),
-        popStat(Statistics::getStatistic<Statistics::Variable>(name + ".pop")),
-        getStat(Statistics::getStatistic<Statistics::Variable>(name + ".get")),
-        computeStat(Statistics::getStatistic<Statistics::Variable>(name + ".compute"))
+        popStat(Statistics::getStatistic<Statistics::Histogram>(name + ".pop")),
+        getStat(Statistics::getStatistic<Statistics::Histogram>(name + ".get")),
+        computeStat(Statistics::getStatistic<Statistics::Histogram>(name + ".compute")),
+        wakeStat(Statistics::getStatistic<Statistics::Counter>(name + ".wakes")),
+        queueGauge(name + ".queue", boost::bind(&Queue::size, &workQueue))
     {
         MLSGPU_ASSERT(numWorkers > 0, std::invalid_argument);
         workers.reserve(numWorkers);
@@ -254,10 +350,11 @@ private:
     {
         Derived &owner;
         Worker &worker;
+        std::size_t index;
 
     public:
-        Thread(Derived &owner, Worker &worker)
-            : owner(owner), worker(worker) {}
+        Thread(Derived &owner, Worker &worker, std::size_t index)
+            : owner(owner), worker(worker), index(index) {}
 
         void operator()()
         {
@@ -265,21 +362,34 @@ private:
             try
             {
                 thread_set_name(owner.threadName);
+                Numa::bindThread(owner.numaNode);
                 bool firstPop = true;
-                while (true)
+                // Threads beyond the elastic minimum start out waiting
+                bool active = index < owner.elasticMin || owner.park(tworker, false);
+                while (active)
                 {
                     boost::shared_ptr<WorkItem> item;
+                    Timer popTimer;
                     {
                         Timeplot::Action timer("pop", tworker, firstPop ? owner.firstPopStat : owner.popStat);
-                        item = owner.workQueue.pop();
+                        item = owner.popItem(worker);
                     }
                     if (!item)
                         break; // we have been asked to shut down
                     firstPop = false;
+                    const bool idle = popTimer.getElapsed() > owner.elasticIdle;
 
-                    worker(*item);
+                    if (owner.cpuBudget != NULL)
+                    {
+                        CpuBudget::Slot slot(*owner.cpuBudget, tworker);
+                        worker(*item);
+                    }
+                    else
+                        worker(*item);
 
                     owner.freeItem(item);
+                    if (idle && owner.elasticMin < owner.workers.size())
+                        active = owner.park(tworker, true);
                 }
                 worker.stop();
             }
@@ -294,6 +404,20 @@ private:
     /// Name to assign to threads
     const std::string threadName;
 
+    /// NUMA node for the threads, or -1 for no restriction
+    int numaNode;
+
+    /// Slots shared with other groups, or @c NULL
+    CpuBudget *cpuBudget;
+
+    std::size_t elasticMin;       ///< Minimum active threads (see @ref setElastic)
+    double elasticIdle;           ///< Pop time after which a thread may stop (see @ref setElastic)
+    std::size_t elasticParked;    ///< Threads waiting to be woken
+    std::size_t elasticWakes;     ///< Wakes granted but not yet taken by a waiting thread
+    bool elasticStopping;         ///< Set by @ref stop to release the waiting threads
+    boost::mutex elasticMutex;    ///< Protects the elastic state
+    boost::condition_variable elasticCondition; ///< Signalled to wake a waiting thread
+
     /**
      * Threads. This is empty when no threads are running and contains the
      * thread objects when it is running.
@@ -309,7 +433,7 @@ private:
     /**
      * Queue of items waiting to be processed.
      */
-    WorkQueue<boost::shared_ptr<WorkItem> > workQueue;
+    Queue workQueue;
 
     Statistics::Variable &firstPopStat;
     Statistics::Variable &popStat;
@@ -317,6 +441,52 @@ protected:
     Statistics::Variable &getStat;
 private:
     Statistics::Variable &computeStat;
+    Statistics::Counter &wakeStat;   ///< Number of times an elastic thread was woken
+
+    /// Reports the number of items in @ref workQueue
+    Metrics::Gauge queueGauge;
+
+    /**
+     * Wake a waiting thread if the queue holds more items than there are
+     * active threads.
+     */
+    void wakeIfBacklogged()
+    {
+        boost::lock_guard<boost::mutex> lock(elasticMutex);
+        const std::size_t active = workers.size() - elasticParked;
+        if (elasticParked > 0 && workQueue.size() > active)
+        {
+            elasticParked--;
+            elasticWakes++;
+            wakeStat.add(1);
+            elasticCondition.notify_one();
+        }
+    }
+
+    /**
+     * Make the calling thread wait until it is woken by @ref wakeIfBacklogged.
+     * If @a optional is true, it instead returns immediately if that would
+     * leave fewer than the minimum number of active threads.
+     *
+     * @return @c false if the group is stopping and the thread should exit.
+     */
+    bool park(Timeplot::Worker &tworker, bool optional)
+    {
+        boost::unique_lock<boost::mutex> lock(elasticMutex);
+        if (optional)
+        {
+            if (workers.size() - elasticParked <= elasticMin)
+                return true;
+            elasticParked++;
+        }
+        Timeplot::Action timer("wait", tworker);
+        while (elasticWakes == 0 && !elasticStopping)
+            elasticCondition.wait(lock);
+        if (elasticWakes == 0)
+            return false;
+        elasticWakes--;
+        return true;
+    }
 
     /**
      * Take shutdown actions prior to joining the worker threads. This is a hook
@@ -334,6 +504,18 @@ private:
     {
     }
 
+    /**
+     * Obtain the next item for a worker to process, blocking until one is
+     * available. A null pointer indicates that the worker should shut down.
+     * This is a hook that subclasses may override, for example to take work
+     * from elsewhere when the queue is empty.
+     */
+    boost::shared_ptr<WorkItem> popItem(Worker &worker)
+    {
+        (void) worker;
+        return workQueue.pop();
+    }
+
     /**
      * Release transient resources stored in an item. This is a hook that
      * subclasses may override.
@@ -32,6 +32,9 @@
 #endif
 #include <mpi.h>
 #include <cassert>
+#include <vector>
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <boost/function.hpp>
 #include "worker_group.h"
 #include "tags.h"
 #include "serialize.h"
@@ -68,20 +71,71 @@ std::size_t sizeItem(const Item &item)
     return item.size();
 }
 
+/// Maximum number of requests that @ref irecvItem may start for one item
+static const int MAX_IRECV_ITEM_REQUESTS = 4;
+
+/**
+ * Starts non-blocking receives for an item sent with @ref sendItem, for use by
+ * @ref ReceiverGatherNonBlocking. The default implementation is to call an
+ * @a irecv member. For items that do not have this member, this template can
+ * be specialized.
+ *
+ * @param item        Item to receive, obtained from @ref WorkerGroup::get.
+ * @param comm        Communicator for the receives.
+ * @param source      Sender of the item.
+ * @param size        Size of the item, as given by @ref sizeItem on the sender.
+ * @param[out] requests Storage for up to @ref MAX_IRECV_ITEM_REQUESTS requests.
+ * @return The number of requests started.
+ */
+template<typename Item>
+int irecvItem(Item &item, MPI_Comm comm, int source, std::size_t size, MPI_Request *requests)
+{
+    return item.irecv(comm, source, size, requests);
+}
+
+/**
+ * Called once all the requests started by @ref irecvItem have completed.
+ * The default implementation is to call an @a irecvComplete member. For
+ * items that do not have this member, this template can be specialized.
+ */
+template<typename Item>
+void irecvItemComplete(Item &item)
+{
+    item.irecvComplete();
+}
+
 
 /**
  * A worker that is suitable for use with @ref WorkerGroupGather. When it pulls
  * an item from the queue, it first informs the remote that it has some work,
  * then sends it. When the queue is drained, it instead tells the remote to
  * shut down.
+ *
+ * Items can either all go to a single root, or each be sent to a rank chosen
+ * by a routing function. In the latter case every rank in the communicator is
+ * told to shut down, so every rank must run a receiver.
  */
 template<typename WorkItem>
 class WorkerGather : public WorkerBase
 {
+public:
+    /// Function that chooses the destination rank for an item
+    typedef boost::function<int (const WorkItem &)> Router;
+
 private:
     MPI_Comm comm;
     int root;
+    Router router;
     Statistics::Variable &sendStat;
+
+    /// Tell @a dest that there is no more work
+    void sendStop(int dest)
+    {
+        std::size_t workSize = 0;
+        MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), dest,
+                 MLSGPU_TAG_GATHER_HAS_WORK, comm);
+    }
+
 public:
     /**
      * Constructor.
@@ -96,20 +150,40 @@ public:
     {
     }
 
+    /**
+     * Constructor for routed items.
+     *
+     * @param name      Name for the worker.
+     * @param comm      Communicator to communicate with the remote ends.
+     * @param router    Chooses the target rank for each item.
+     * @param sendStat  Statistic for time spent sending
+     */
+    WorkerGather(const std::string &name, MPI_Comm comm, const Router &router, Statistics::Variable &sendStat)
+        : WorkerBase(name, 0), comm(comm), root(-1), router(router), sendStat(sendStat)
+    {
+    }
+
     void operator()(WorkItem &item)
     {
         Timeplot::Action action("send", getTimeplotWorker(), sendStat);
+        const int dest = router ? router(item) : root;
         std::size_t workSize = sizeItem(item);
-        MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), root,
+        MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), dest,
                  MLSGPU_TAG_GATHER_HAS_WORK, comm);
-        sendItem(item, comm, root);
+        sendItem(item, comm, dest);
     }
 
     void stop()
     {
-        std::size_t workSize = 0;
-        MPI_Send(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(), root,
-                 MLSGPU_TAG_GATHER_HAS_WORK, comm);
+        if (router)
+        {
+            int size;
+            MPI_Comm_size(comm, &size);
+            for (int i = 0; i < size; i++)
+                sendStop(i);
+        }
+        else
+            sendStop(root);
     }
 };
 
@@ -164,9 +238,134 @@ public:
     }
 };
 
+/**
+ * Variant of @ref ReceiverGather that receives from several senders at once.
+ * When a sender announces an item, storage is taken from the group and
+ * non-blocking receives are started with @ref irecvItem, after which the next
+ * announcement is awaited immediately. Completions are collected in batches
+ * with @c MPI_Waitsome, so a sender transmitting a large item does not hold
+ * up the others.
+ *
+ * Since each @ref WorkerGather sends one item at a time, there is at most one
+ * item in flight per sender.
+ */
+template<typename WorkItem, typename Group>
+class ReceiverGatherNonBlocking : public boost::noncopyable
+{
+private:
+    /// An item whose receives have been started
+    struct Pending
+    {
+        boost::shared_ptr<WorkItem> item;
+        int remaining;          ///< Number of its requests not yet completed
+    };
+
+    Group &outGroup;
+    const MPI_Comm comm;
+    const std::size_t senders;
+    Timeplot::Worker tworker;
+
+public:
+    ReceiverGatherNonBlocking(const std::string &name, Group &outGroup, MPI_Comm comm, std::size_t senders)
+        : outGroup(outGroup), comm(comm), senders(senders), tworker(name)
+    {
+    }
+
+    void operator()()
+    {
+        Statistics::Variable &waitStat = Statistics::getStatistic<Statistics::Variable>("ReceiverGather.wait");
+        Statistics::Variable &recvStat = Statistics::getStatistic<Statistics::Variable>("ReceiverGather.recv");
+
+        /* requests[0] receives announcements. The requests for pending[i] are
+         * at 1 + i * MAX_IRECV_ITEM_REQUESTS.
+         */
+        std::vector<MPI_Request> requests(1, MPI_REQUEST_NULL);
+        std::vector<Pending> pending;
+        std::vector<std::size_t> freeSlots;
+        std::vector<int> indices;
+        std::vector<MPI_Status> statuses;
+
+        std::size_t rem = senders;
+        std::size_t active = 0;
+        std::size_t workSize;
+        if (rem > 0)
+            MPI_Irecv(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(),
+                      MPI_ANY_SOURCE, MLSGPU_TAG_GATHER_HAS_WORK, comm, &requests[0]);
+        while (rem > 0 || active > 0)
+        {
+            int outCount;
+            indices.resize(requests.size());
+            statuses.resize(requests.size());
+            {
+                Timeplot::Action action("wait", tworker, waitStat);
+                MPI_Waitsome(requests.size(), &requests[0], &outCount, &indices[0], &statuses[0]);
+            }
+            assert(outCount != MPI_UNDEFINED);
+
+            for (int i = 0; i < outCount; i++)
+            {
+                const int idx = indices[i];
+                if (idx == 0)
+                {
+                    if (workSize == 0)
+                        rem--;
+                    else
+                    {
+                        Timeplot::Action action("recv", tworker, recvStat);
+                        std::size_t slot;
+                        if (freeSlots.empty())
+                        {
+                            slot = pending.size();
+                            pending.push_back(Pending());
+                            requests.resize(requests.size() + MAX_IRECV_ITEM_REQUESTS, MPI_REQUEST_NULL);
+                        }
+                        else
+                        {
+                            slot = freeSlots.back();
+                            freeSlots.pop_back();
+                        }
+
+                        Pending &p = pending[slot];
+                        p.item = outGroup.get(tworker, workSize);
+                        p.remaining = irecvItem(*p.item, comm, statuses[i].MPI_SOURCE, workSize,
+                                                &requests[1 + slot * MAX_IRECV_ITEM_REQUESTS]);
+                        assert(p.remaining >= 0 && p.remaining <= MAX_IRECV_ITEM_REQUESTS);
+                        active++;
+                        if (p.remaining == 0)
+                        {
+                            irecvItemComplete(*p.item);
+                            outGroup.push(tworker, p.item);
+                            p.item.reset();
+                            freeSlots.push_back(slot);
+                            active--;
+                        }
+                    }
+                    if (rem > 0)
+                        MPI_Irecv(&workSize, 1, Serialize::mpi_type_traits<std::size_t>::type(),
+                                  MPI_ANY_SOURCE, MLSGPU_TAG_GATHER_HAS_WORK, comm, &requests[0]);
+                }
+                else
+                {
+                    const std::size_t slot = (idx - 1) / MAX_IRECV_ITEM_REQUESTS;
+                    Pending &p = pending[slot];
+                    if (--p.remaining == 0)
+                    {
+                        irecvItemComplete(*p.item);
+                        outGroup.push(tworker, p.item);
+                        p.item.reset();
+                        freeSlots.push_back(slot);
+                        active--;
+                    }
+                }
+            }
+        }
+    }
+};
+
 /**
  * Worker group that handles sending items from a queue to a @ref
- * ReceiverGather running on another MPI process.
+ * ReceiverGather running on another MPI process, or to one of several
+ * receivers chosen per item.
  */
 template<typename WorkItem, typename Derived>
 class WorkerGroupGather : public WorkerGroup<WorkItem, WorkerGather<WorkItem>, Derived>
@@ -184,6 +383,21 @@ protected:
     {
         this->addWorker(new WorkerGather<WorkItem>(name, comm, root, this->getComputeStat()));
     }
+
+    /**
+     * Constructor for sending each item to a rank chosen by @a router. Every
+     * rank of @a comm must run a receiver that counts this group as a sender.
+     *
+     * @param name      Name for the group (also for the worker).
+     * @param comm      Communicator to send the items.
+     * @param router    Chooses the destination for each item within @a comm.
+     */
+    WorkerGroupGather(const std::string &name, MPI_Comm comm,
+                      const typename WorkerGather<WorkItem>::Router &router)
+        : WorkerGroup<WorkItem, WorkerGather<WorkItem>, Derived>(name, 1)
+    {
+        this->addWorker(new WorkerGather<WorkItem>(name, comm, router, this->getComputeStat()));
+    }
 };
 
 #endif /* WORKER_GROUP_MPI_H */
@@ -33,7 +33,17 @@
 #endif
 
 #include <cstddef>
+#include <cstring>
 #include <vector>
+#include <limits>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <sstream>
+#include <fstream>
+#include <string>
+#include <map>
+#include <exception>
 #include <CL/cl.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
@@ -42,6 +52,7 @@
 #include <boost/ref.hpp>
 #include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/math/constants/constants.hpp>
 #include "grid.h"
 #include "workers.h"
 #include "work_queue.h"
@@ -54,35 +65,444 @@
 #include "statistics.h"
 #include "statistics_cl.h"
 #include "errors.h"
+#include "logging.h"
+#include "clh.h"
 #include "thread_name.h"
 #include "misc.h"
+#include "timer.h"
+#include "tr1_cstdint.h"
+#include "bucket_cache.h"
+#include "bucket_trace.h"
+#include "host_mls.h"
+#include "host_marching.h"
 
-MesherGroupBase::Worker::Worker(MesherGroup &owner)
-    : WorkerBase("mesher", 0), owner(owner) {}
+MesherGroupBase::Worker::Worker(MesherGroup &owner, int idx)
+    : WorkerBase("mesher", idx), owner(owner) {}
 
 void MesherGroupBase::Worker::operator()(WorkItem &item)
 {
     Timeplot::Action timer("compute", getTimeplotWorker(), owner.getComputeStat());
     owner.input(item.work, getTimeplotWorker());
     owner.meshBuffer.free(item.alloc);
+    if (owner.chunkTracker != NULL)
+        owner.chunkTracker->done(item.work.chunkId.gen);
+    if (owner.governor != NULL)
+        owner.governor->done();
 }
 
-MesherGroup::MesherGroup(std::size_t memMesh)
-    : WorkerGroup<MesherGroupBase::WorkItem, MesherGroupBase::Worker, MesherGroup>(
-        "mesher", 1),
-    meshBuffer("mem.MesherGroup.mesh", memMesh)
+MesherGroup::MesherGroup(std::size_t memMesh, std::size_t numThreads, char *memory)
+    : BaseType("mesher", numThreads),
+    chunkTracker(NULL),
+    governor(NULL),
+    meshBuffer("mem.MesherGroup.mesh", memMesh, 256, true, memory)
 {
-    addWorker(new Worker(*this));
+    for (std::size_t i = 0; i < numThreads; i++)
+        addWorker(new Worker(*this, i));
 }
 
 boost::shared_ptr<MesherGroup::WorkItem> MesherGroup::get(Timeplot::Worker &tworker, std::size_t size)
 {
-    boost::shared_ptr<WorkItem> item = WorkerGroup<WorkItem, Worker, MesherGroup>::get(tworker, size);
+    boost::shared_ptr<WorkItem> item = BaseType::get(tworker, size);
     std::size_t rounded = roundUp(size, sizeof(cl_ulong)); // to ensure alignment
     item->alloc = meshBuffer.allocate(tworker, rounded, &getStat);
     return item;
 }
 
+void MesherGroup::push(Timeplot::Worker &tworker, boost::shared_ptr<WorkItem> item)
+{
+    if (chunkTracker != NULL)
+        chunkTracker->add(item->work.chunkId.gen);
+    if (governor != NULL)
+        governor->add();
+    BaseType::push(tworker, item);
+}
+
+
+DeviceThroughput::DeviceThroughput(double smoothing)
+    : smoothing(smoothing), splatRate(0.0), cellRate(0.0), pendingSplats(0), pendingCells(0)
+{
+    MLSGPU_ASSERT(smoothing > 0.0 && smoothing <= 1.0, std::invalid_argument);
+}
+
+void DeviceThroughput::enqueue(std::size_t splats, std::tr1::uint64_t cells)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    pendingSplats += splats;
+    pendingCells += cells;
+}
+
+void DeviceThroughput::dequeue(std::size_t splats, std::tr1::uint64_t cells)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    assert(splats <= pendingSplats && cells <= pendingCells);
+    pendingSplats -= splats;
+    pendingCells -= cells;
+}
+
+void DeviceThroughput::complete(
+    std::size_t splats, std::tr1::uint64_t cells, double seconds, std::size_t concurrency)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    assert(splats <= pendingSplats && cells <= pendingCells);
+    pendingSplats -= splats;
+    pendingCells -= cells;
+    if (seconds <= 0.0)
+        return;
+
+    /* Workers run concurrently, so the device as a whole gets through work
+     * faster than a single item suggests.
+     */
+    double s = splats * double(concurrency) / seconds;
+    double c = cells * double(concurrency) / seconds;
+    if (splatRate == 0.0 || cellRate == 0.0)
+    {
+        splatRate = s;
+        cellRate = c;
+    }
+    else
+    {
+        splatRate += smoothing * (s - splatRate);
+        cellRate += smoothing * (c - cellRate);
+    }
+}
+
+bool DeviceThroughput::hasEstimate() const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return splatRate > 0.0 && cellRate > 0.0;
+}
+
+double DeviceThroughput::estimateUnlocked(std::size_t splats, std::tr1::uint64_t cells) const
+{
+    MLSGPU_ASSERT(splatRate > 0.0 && cellRate > 0.0, state_error);
+    // Each rate on its own gives an estimate; average them
+    return 0.5 * (splats / splatRate + cells / cellRate);
+}
+
+double DeviceThroughput::estimate(std::size_t splats, std::tr1::uint64_t cells) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return estimateUnlocked(splats, cells);
+}
+
+double DeviceThroughput::finishTime(std::size_t splats, std::tr1::uint64_t cells) const
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return estimateUnlocked(pendingSplats + splats, pendingCells + cells);
+}
+
+std::map<std::string, DistanceStorageChoice> DistanceStorageChoiceWrapper::getNameMap()
+{
+    std::map<std::string, DistanceStorageChoice> ans;
+    ans["auto"] = DISTANCE_STORAGE_AUTO;
+    ans["image"] = DISTANCE_STORAGE_IMAGE;
+    ans["buffer"] = DISTANCE_STORAGE_BUFFER;
+    return ans;
+}
+
+DeviceTuning::DeviceTuning() : swatheDivisor(1)
+{
+    std::copy(MlsFunctor::wgs, MlsFunctor::wgs + 3, wgs);
+}
+
+#ifndef CL_MEM_USE_PERSISTENT_MEM_AMD
+/// Memory flag from @c cl_amd_device_memory_flags, for host-visible device memory
+# define CL_MEM_USE_PERSISTENT_MEM_AMD (1 << 6)
+#endif
+
+namespace
+{
+
+/// Flag set by @ref DeviceWorkerGroup::setDirectUpload
+bool directUpload = false;
+
+/// Reduce a maximum swathe by @ref DeviceTuning::swatheDivisor, keeping it aligned
+Grid::size_type divideSwathe(Grid::size_type maxSwathe, Grid::size_type zAlign, unsigned int divisor)
+{
+    return std::max(zAlign, maxSwathe / divisor / zAlign * zAlign);
+}
+
+/// First line of an autotuning cache entry, identifying the format
+const char * const tuningCacheMagic = "mlsgpu-tune 1";
+
+/**
+ * Candidate work group sizes for @ref DeviceWorkerGroup::autotune. The
+ * Z size is not reduced, since @ref packBlock in @ref mls.cl limits the
+ * number of blocks in Z.
+ */
+const Grid::size_type tuningWgs[][3] =
+{
+    { 8, 8, 8 },
+    { 8, 4, 8 },
+    { 4, 8, 8 }
+};
+
+/// Candidate values for @ref DeviceTuning::swatheDivisor
+const unsigned int tuningDivisors[] = { 1, 2, 4 };
+
+/// Output functor used when benchmarking, which just discards the mesh
+void discardMesh(const cl::CommandQueue &queue, const DeviceKeyMesh &mesh,
+                 const std::vector<cl::Event> *events, cl::Event *event)
+{
+    (void) mesh;
+    if (event != NULL)
+        CLH::enqueueMarkerWithWaitList(queue, events, event);
+}
+
+/**
+ * Make a sample bucket for benchmarking: splats on a sphere that fills most
+ * of a cube with @a size cells on a side, in grid coordinates. The splats are
+ * spaced about one cell apart, unless that would need more than @a maxSplats.
+ */
+std::vector<Splat> makeSampleSplats(Grid::size_type size, std::size_t maxSplats)
+{
+    const float pi = boost::math::constants::pi<float>();
+    const float center = size * 0.5f;
+    const float r = size * 0.35f;
+    const float area = 4.0f * pi * r * r;
+    const std::size_t n = std::max(std::size_t(1), std::min(maxSplats, std::size_t(area)));
+    const float spacing = std::sqrt(area / n);
+    const float golden = pi * (3.0f - std::sqrt(5.0f));
+
+    std::vector<Splat> splats(n);
+    for (std::size_t i = 0; i < n; i++)
+    {
+        // Fibonacci sphere, which gives a roughly even distribution
+        const float z = 1.0f - (2.0f * i + 1.0f) / n;
+        const float rxy = std::sqrt(1.0f - z * z);
+        const float theta = golden * i;
+        Splat &s = splats[i];
+        s.normal[0] = rxy * std::cos(theta);
+        s.normal[1] = rxy * std::sin(theta);
+        s.normal[2] = z;
+        for (int j = 0; j < 3; j++)
+            s.position[j] = center + r * s.normal[j];
+        s.radius = 2.0f * spacing;
+        s.quality = 1.0f;
+    }
+    return splats;
+}
+
+/// Key identifying everything that can affect the result of @ref DeviceWorkerGroup::autotune
+std::string tuningKey(
+    const cl::Device &device,
+    std::size_t maxBucketSplats, Grid::size_type maxCells,
+    std::size_t meshMemory, int levels, int subsampling, MlsShape shape,
+    SplatLayout splatLayout, Marching::DistanceStorage distanceStorage)
+{
+    const cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+    std::ostringstream key;
+    key << platform.getInfo<CL_PLATFORM_NAME>() << '\n'
+        << platform.getInfo<CL_PLATFORM_VERSION>() << '\n'
+        << device.getInfo<CL_DEVICE_NAME>() << '\n'
+        << device.getInfo<CL_DEVICE_VENDOR>() << '\n'
+        << device.getInfo<CL_DEVICE_VERSION>() << '\n'
+        << device.getInfo<CL_DRIVER_VERSION>() << '\n'
+        << maxBucketSplats << ' ' << maxCells << ' ' << meshMemory << ' '
+        << levels << ' ' << subsampling << ' ' << int(shape) << ' ' << int(splatLayout) << ' '
+        << int(distanceStorage) << '\n';
+    return key.str();
+}
+
+/**
+ * Look up a tuning result in the cache. Returns @c false if it is not
+ * present or is not valid.
+ */
+bool loadTuning(const std::string &path, const std::string &key, DeviceTuning &tuning)
+{
+    std::ifstream in(path.c_str(), std::ios::binary);
+    if (!in)
+        return false;
+
+    std::string magic;
+    std::size_t keySize = 0;
+    std::getline(in, magic);
+    in >> keySize;
+    in.get();
+    if (!in || magic != tuningCacheMagic || keySize != key.size())
+        return false;
+    std::string storedKey(keySize, '\0');
+    in.read(&storedKey[0], keySize);
+    DeviceTuning ans;
+    in >> ans.wgs[0] >> ans.wgs[1] >> ans.wgs[2] >> ans.swatheDivisor;
+    if (!in || storedKey != key
+        || !MlsFunctor::validGroupSize(ans.wgs) || ans.swatheDivisor == 0)
+        return false;
+    tuning = ans;
+    return true;
+}
+
+/// Store a tuning result in the cache
+void saveTuning(const std::string &path, const std::string &key, const DeviceTuning &tuning)
+{
+    std::ostringstream out;
+    out << tuningCacheMagic << '\n' << key.size() << '\n' << key
+        << tuning.wgs[0] << ' ' << tuning.wgs[1] << ' ' << tuning.wgs[2] << ' '
+        << tuning.swatheDivisor << '\n';
+    CLH::writeCacheEntry(path, out.str());
+}
+
+/**
+ * Output functor that forwards meshes to another output functor, and also
+ * reads a copy back to the host to be stored in a @ref BucketCache.
+ */
+class CacheCapture
+{
+private:
+    Marching::OutputFunctor output;
+    boost::ptr_vector<BucketCache::Mesh> *meshes;
+    std::vector<cl::Event> *readEvents;   ///< Events for the reads into @ref meshes
+
+public:
+    typedef void result_type;
+
+    CacheCapture(const Marching::OutputFunctor &output,
+                 boost::ptr_vector<BucketCache::Mesh> &meshes,
+                 std::vector<cl::Event> &readEvents)
+        : output(output), meshes(&meshes), readEvents(&readEvents)
+    {
+    }
+
+    void operator()(
+        const cl::CommandQueue &queue,
+        const DeviceKeyMesh &mesh,
+        const std::vector<cl::Event> *events,
+        cl::Event *event) const
+    {
+        std::vector<cl::Event> wait(4);
+        output(queue, mesh, events, &wait[3]);
+
+        meshes->push_back(new BucketCache::Mesh(mesh));
+        HostKeyMesh hMesh = meshes->back().getHostMesh();
+        enqueueReadMesh(queue, mesh, hMesh, events, &wait[0], &wait[1], &wait[2]);
+        readEvents->insert(readEvents->end(), wait.begin(), wait.begin() + 3);
+        CLH::enqueueMarkerWithWaitList(queue, &wait, event);
+    }
+};
+
+} // anonymous namespace
+
+DeviceTuning DeviceWorkerGroup::autotune(
+    const cl::Context &context, const cl::Device &device,
+    std::size_t maxBucketSplats, Grid::size_type maxCells,
+    std::size_t meshMemory,
+    int levels, int subsampling, float boundaryLimit,
+    MlsShape shape, SplatLayout splatLayout,
+    DistanceStorageChoice distanceStorage)
+{
+    const std::string name = device.getInfo<CL_DEVICE_NAME>();
+    const Marching::DistanceStorage storage = distanceStorageFor(device, distanceStorage);
+    const std::string key = tuningKey(device, maxBucketSplats, maxCells, meshMemory,
+                                      levels, subsampling, shape, splatLayout, storage);
+    const std::string path = CLH::getCachePath(key, ".tune");
+
+    DeviceTuning best;
+    if (!path.empty() && loadTuning(path, key, best))
+    {
+        Log::log[Log::info] << "Using cached tuning for " << name << '\n';
+        return best;
+    }
+
+    const Grid::size_type block = maxCells + 1;
+    const Grid::size_type sampleSize = std::min(block, Grid::size_type(128));
+    const Grid::size_type size[3] = { sampleSize, sampleSize, sampleSize };
+    const Grid::difference_type offset[3] = { 0, 0, 0 };
+    const cl_uint3 keyOffset = {{ 0, 0, 0 }};
+
+    cl::CommandQueue queue(context, device);
+    std::vector<Splat> splats = makeSampleSplats(sampleSize - 1, maxBucketSplats);
+    std::vector<char> deviceSplats(splats.size() * splatDeviceSize(splatLayout));
+    storeSplats(splatLayout, &splats[0], splats.size(), &deviceSplats[0]);
+    cl::Buffer splatBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                           deviceSplats.size(), &deviceSplats[0]);
+    SplatTreeCL tree(context, device, levels, splats.size(), false, splatLayout);
+    /* The tree must cover the sample rounded up to the alignment of each
+     * candidate. The candidates are powers of 2 no larger than
+     * MlsFunctor::wgs, so rounding up to that covers all of them.
+     */
+    Grid::size_type expandedSize[3];
+    for (unsigned int i = 0; i < 3; i++)
+        expandedSize[i] = roundUp(size[i], MlsFunctor::wgs[i]);
+    tree.enqueueBuild(queue, splatBuffer, 0, splats.size(), expandedSize, offset, subsampling);
+    queue.finish();
+
+    double bestTime = std::numeric_limits<double>::infinity();
+    for (std::size_t i = 0; i < sizeof(tuningWgs) / sizeof(tuningWgs[0]); i++)
+    {
+        const Grid::size_type *wgs = tuningWgs[i];
+        const Grid::size_type maxSwathe = computeMaxSwathe(
+            maxDistanceRows(storage), block, wgs[1], wgs[2]);
+        Grid::size_type prevSwathe = 0;
+        for (std::size_t j = 0; j < sizeof(tuningDivisors) / sizeof(tuningDivisors[0]); j++)
+        {
+            const Grid::size_type swathe = divideSwathe(maxSwathe, wgs[2], tuningDivisors[j]);
+            if (swathe == prevSwathe)
+                continue;
+            prevSwathe = swathe;
+
+            double elapsed = std::numeric_limits<double>::infinity();
+            try
+            {
+                MlsFunctor input(context, shape, wgs, splatLayout, false, storage);
+                input.setBoundaryLimit(boundaryLimit);
+                input.set(offset, tree, subsampling);
+                Marching marching(context, device, block, block, block,
+                                  swathe, meshMemory, input.alignment(),
+                                  CL_FLOAT, false, true, storage);
+                // The first pass is a warm-up and is not timed
+                for (int pass = 0; pass < 3; pass++)
+                {
+                    Timer timer;
+                    marching.generate(queue, input, discardMesh, size, keyOffset);
+                    if (pass > 0)
+                        elapsed = std::min(elapsed, timer.getElapsed());
+                }
+            }
+            catch (cl::Error &e)
+            {
+                // e.g. if the work group is too large for the device
+                Log::log[Log::debug] << "Skipping tuning candidate on " << name << ": work group "
+                    << wgs[0] << 'x' << wgs[1] << 'x' << wgs[2]
+                    << ", swathe " << swathe << ": " << e.what() << " (" << e.err() << ")\n";
+                continue;
+            }
+            catch (std::exception &e)
+            {
+                // e.g. if the buffers for this swathe cannot be allocated
+                Log::log[Log::debug] << "Skipping tuning candidate on " << name << ": work group "
+                    << wgs[0] << 'x' << wgs[1] << 'x' << wgs[2]
+                    << ", swathe " << swathe << ": " << e.what() << '\n';
+                continue;
+            }
+
+            Log::log[Log::debug] << "Tuning " << name << ": work group "
+                << wgs[0] << 'x' << wgs[1] << 'x' << wgs[2]
+                << ", swathe " << swathe << ": " << elapsed << "s\n";
+            if (elapsed < bestTime)
+            {
+                bestTime = elapsed;
+                std::copy(wgs, wgs + 3, best.wgs);
+                best.swatheDivisor = tuningDivisors[j];
+            }
+        }
+    }
+
+    Log::log[Log::info] << "Tuned " << name << ": work group "
+        << best.wgs[0] << 'x' << best.wgs[1] << 'x' << best.wgs[2]
+        << ", swathe divisor " << best.swatheDivisor << '\n';
+    if (!path.empty() && bestTime < std::numeric_limits<double>::infinity())
+    {
+        try
+        {
+            saveTuning(path, key, best);
+        }
+        catch (std::exception &e)
+        {
+            Log::log[Log::warn] << "Could not save tuning to cache: " << e.what() << '\n';
+        }
+    }
+    return best;
+}
 
 DeviceWorkerGroup::DeviceWorkerGroup(
     std::size_t numWorkers, std::size_t spare,
@@ -91,37 +511,151 @@ DeviceWorkerGroup::DeviceWorkerGroup(
     std::size_t maxBucketSplats, Grid::size_type maxCells,
     std::size_t meshMemory,
     int levels, int subsampling, float boundaryLimit,
-    MlsShape shape)
+    MlsShape shape, cl_channel_type distanceType, SplatLayout splatLayout,
+    bool hashWeld, const DeviceTuning &tuning,
+    const NormalEstimation &normalEstimation,
+    float decimateCells,
+    bool sparseOctree,
+    std::size_t scratchSets,
+    DistanceStorageChoice distanceStorage,
+    MlsBoundary boundary)
 :
     Base("device", numWorkers),
-    progress(NULL), outputGenerator(outputGenerator),
+    progress(NULL), chunkTracker(NULL), governor(NULL), outputGenerator(outputGenerator), bucketCache(NULL),
     context(context), device(device),
     maxBucketSplats(maxBucketSplats), maxCells(maxCells), meshMemory(meshMemory),
+    levels(levels),
     subsampling(subsampling),
-    copyQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE),
+    adaptiveSubsampling(false),
+    distanceType(distanceType),
+    distanceStorage(distanceStorageFor(device, distanceStorage)),
+    splatLayout(splatLayout),
+    hashWeld(hashWeld),
+    sparseOctree(sparseOctree),
+    shareScratch(scratchSets > 0 && scratchSets < numWorkers),
+    zeroCopy(device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() || directUpload),
+    normalEstimation(normalEstimation),
+    decimateCells(decimateCells),
+    boundary(boundary),
+    batchTrees(false),
+    mergeTolerance(0.0f),
+    scatterDensity(0.0f),
+    tiledOccupancy(false),
+    carrySlices(false),
+    marchingCubes(false),
+    ownedEdges(false),
+    copyQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE
+              | (Statistics::isEventTimingEnabled() ? CL_QUEUE_PROFILING_ENABLE : 0)),
     itemPool(),
     popMutex(NULL),
-    popCondition(NULL)
+    popCondition(NULL),
+    stealStat(Statistics::getStatistic<Statistics::Counter>("device.steals")),
+    uploadStat(Statistics::getDeviceThroughput("upload", device))
 {
+    if (!Marching::distanceTypeSupported(context, distanceType, this->distanceStorage))
+    {
+        Log::log[Log::warn] << "Distance image format is not supported by "
+            << device.getInfo<CL_DEVICE_NAME>() << ", using full precision\n";
+        this->distanceType = CL_FLOAT;
+    }
+    if (this->distanceStorage == Marching::DISTANCE_BUFFER)
+        Log::log[Log::info] << "Distance field will be stored in a buffer on "
+            << device.getInfo<CL_DEVICE_NAME>() << '\n';
     for (std::size_t i = 0; i < numWorkers; i++)
     {
-        addWorker(new Worker(*this, context, device, levels, boundaryLimit, shape, i));
+        Worker *worker = new Worker(*this, context, device, levels, boundaryLimit, shape, tuning, i);
+        addWorker(worker);
+        if (i == 0 && shareScratch)
+        {
+            for (std::size_t j = 0; j < scratchSets; j++)
+                scratchPool.add(worker->makeScratch(context));
+        }
     }
     const std::size_t items = numWorkers + spare;
     const std::size_t maxItemSplats = maxBucketSplats; // the same thing for now
+    cl_mem_flags placement = 0;
+    if (device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>())
+        placement = CL_MEM_ALLOC_HOST_PTR;
+    else if (zeroCopy)
+    {
+        if (CLH::hasExtension(device, "cl_amd_device_memory_flags"))
+            placement = CL_MEM_USE_PERSISTENT_MEM_AMD;
+        else
+            placement = CL_MEM_ALLOC_HOST_PTR;
+        Log::log[Log::info] << "Splats will be mapped directly into buffers on "
+            << device.getInfo<CL_DEVICE_NAME>()
+            << (placement == CL_MEM_USE_PERSISTENT_MEM_AMD ? " (device memory)\n" : " (host memory)\n");
+    }
     for (std::size_t i = 0; i < items; i++)
     {
-        boost::shared_ptr<WorkItem> item = boost::make_shared<WorkItem>(context, maxItemSplats);
+        boost::shared_ptr<WorkItem> item = boost::make_shared<WorkItem>(context, maxItemSplats, splatLayout, placement);
         itemPool.push(item);
     }
     unallocated_ = maxItemSplats * items;
 
     CLH::ResourceUsage usage = resourceUsage(
         numWorkers, spare, device,
-        maxBucketSplats, maxCells, meshMemory, levels);
+        maxBucketSplats, maxCells, meshMemory, levels, this->distanceType, splatLayout, hashWeld,
+        sparseOctree, scratchSets,
+        this->distanceStorage == Marching::DISTANCE_BUFFER ? DISTANCE_STORAGE_BUFFER : DISTANCE_STORAGE_IMAGE);
     usage.addStatistics(Statistics::Registry::getInstance(), "mem.device.");
 }
 
+void DeviceWorkerGroup::setDirectUpload(bool direct)
+{
+    directUpload = direct;
+}
+
+const std::size_t DeviceWorkerGroup::ADAPTIVE_LEAF_SPLATS;
+const std::size_t DeviceWorkerGroup::SCATTER_PAIRS;
+
+unsigned int DeviceWorkerGroup::subsamplingFor(std::size_t numSplats, const Grid &grid) const
+{
+    unsigned int shift = subsampling;
+    if (!adaptiveSubsampling)
+        return shift;
+
+    Grid::size_type sizeMax = 0;
+    for (int i = 0; i < 3; i++)
+        sizeMax = std::max(sizeMax, grid.numVertices(i));
+    const double cells = std::max(grid.numCells(), std::tr1::uint64_t(1));
+    while (shift > (unsigned int) MlsFunctor::subsamplingMin)
+    {
+        const unsigned int next = shift - 1;
+        // The octree is sized for levels levels of leaves (see SplatTreeCL::canBuild)
+        if (sizeMax > Grid::size_type(1U) << (levels + next - 1))
+            break;
+        // Expected splats per leaf at the current shift
+        const double leafSplats = numSplats * double(std::tr1::uint64_t(1) << (3 * shift)) / cells;
+        if (leafSplats <= ADAPTIVE_LEAF_SPLATS)
+            break;
+        shift = next;
+    }
+    return shift;
+}
+
+/// Orders device work items by the generation of the oldest chunk they contain
+static bool deviceItemChunkLess(
+    const boost::shared_ptr<DeviceWorkerGroup::WorkItem> &a,
+    const boost::shared_ptr<DeviceWorkerGroup::WorkItem> &b)
+{
+    /* Bins are batched in the order they are loaded, so the first sub-item
+     * belongs to the oldest chunk.
+     */
+    return a->subItems.front().chunkId.gen < b->subItems.front().chunkId.gen;
+}
+
+void DeviceWorkerGroup::setChunkPriority(bool chunkPriority)
+{
+    if (chunkPriority)
+        getWorkQueue().setPriority(deviceItemChunkLess);
+    else
+        getWorkQueue().setPriority(Base::queue_type::Compare());
+}
+
+const boost::posix_time::time_duration DeviceWorkerGroup::stealInterval
+    = boost::posix_time::milliseconds(5);
+
 void DeviceWorkerGroup::start(const Grid &fullGrid)
 {
     this->fullGrid = fullGrid;
@@ -137,12 +671,16 @@ boost::shared_ptr<DeviceWorkerGroup::WorkItem> DeviceWorkerGroup::get(
     Timeplot::Worker &tworker, std::size_t numSplats)
 {
     Timeplot::Action timer("get", tworker, getStat);
-    timer.setValue(numSplats * sizeof(Splat));
+    timer.setValue(numSplats * splatDeviceSize(splatLayout));
     boost::shared_ptr<DeviceWorkerGroup::WorkItem> item = itemPool.pop();
+    reserve(numSplats);
+    return item;
+}
 
+void DeviceWorkerGroup::reserve(std::size_t numSplats)
+{
     boost::lock_guard<boost::mutex> unallocatedLock(unallocatedMutex);
     unallocated_ -= numSplats;
-    return item;
 }
 
 void DeviceWorkerGroup::freeItem(boost::shared_ptr<WorkItem> item)
@@ -154,12 +692,109 @@ void DeviceWorkerGroup::freeItem(boost::shared_ptr<WorkItem> item)
     {
         boost::lock_guard<boost::mutex> popLock(*popMutex);
         itemPool.push(item);
-        popCondition->notify_one();
+        /* Copy workers may hold back for a particular device, so they must
+         * all be woken to re-evaluate.
+         */
+        popCondition->notify_all();
     }
     else
         itemPool.push(item);
 }
 
+boost::shared_ptr<DeviceWorkerGroup::WorkItem> DeviceWorkerGroup::popItem(Worker &worker)
+{
+    WorkQueue<boost::shared_ptr<WorkItem> > &queue = getWorkQueue();
+    if (siblings.size() <= 1)
+        return queue.pop();
+
+    boost::shared_ptr<WorkItem> item;
+    while (!queue.pop(item, stealInterval))
+    {
+        item = steal(worker.getTimeplotWorker());
+        if (item)
+            break;
+    }
+    return item;
+}
+
+boost::shared_ptr<DeviceWorkerGroup::WorkItem> DeviceWorkerGroup::steal(Timeplot::Worker &tworker)
+{
+    BOOST_FOREACH(DeviceWorkerGroup *victim, siblings)
+    {
+        if (victim == this || victim->maxBucketSplats > maxBucketSplats
+            || victim->splatLayout != splatLayout)
+            continue;
+
+        boost::shared_ptr<WorkItem> item;
+        bool haveItem;
+        if (popMutex != NULL)
+        {
+            /* The copy worker takes an item it has seen with canGet while
+             * holding popMutex, so it must not be taken from under it.
+             */
+            boost::lock_guard<boost::mutex> popLock(*popMutex);
+            haveItem = itemPool.tryPop(item);
+        }
+        else
+            haveItem = itemPool.tryPop(item);
+        if (!haveItem)
+            return item; // nowhere to put stolen work
+        boost::shared_ptr<WorkItem> stolen;
+        if (!victim->getWorkQueue().steal(stolen))
+        {
+            freeItem(item);
+            continue;
+        }
+
+        Timeplot::Action timer("steal", tworker, getStat);
+        std::size_t numSplats = 0;
+        std::tr1::uint64_t numCells = 0;
+        BOOST_FOREACH(const SubItem &sub, stolen->subItems)
+        {
+            numSplats = std::max(numSplats, sub.firstSplat + sub.numSplats);
+            numCells += sub.grid.numCells();
+        }
+        const std::size_t bytes = numSplats * splatDeviceSize(splatLayout);
+        timer.setValue(bytes);
+
+        /* The devices do not share a context, so the splats are copied via
+         * host memory by mapping the victim's buffer.
+         */
+        std::vector<cl::Event> wait(1, stolen->copyEvent);
+        void *ptr = victim->copyQueue.enqueueMapBuffer(
+            stolen->splats, CL_TRUE, CL_MAP_READ,
+            0, bytes, &wait, NULL);
+        copyQueue.enqueueWriteBuffer(
+            item->splats, CL_TRUE, 0, bytes, ptr,
+            NULL, &item->copyEvent);
+        Statistics::timeTransfer(item->copyEvent, bytes, uploadStat);
+        cl::Event unmapEvent;
+        victim->copyQueue.enqueueUnmapMemObject(stolen->splats, ptr, NULL, &unmapEvent);
+        unmapEvent.wait();
+
+        std::size_t size = 0;
+        BOOST_FOREACH(const SubItem &sub, stolen->subItems)
+        {
+            item->subItems.push_back(sub);
+            size += sub.numSplats;
+        }
+        {
+            boost::lock_guard<boost::mutex> unallocatedLock(unallocatedMutex);
+            unallocated_ -= size;
+        }
+        {
+            boost::lock_guard<boost::mutex> unallocatedLock(victim->unallocatedMutex);
+            victim->unallocated_ += size;
+        }
+        victim->throughput.dequeue(size, numCells);
+        throughput.enqueue(size, numCells);
+        victim->freeItem(stolen);
+        stealStat.add(1);
+        return item;
+    }
+    return boost::shared_ptr<WorkItem>();
+}
+
 std::size_t DeviceWorkerGroup::unallocated()
 {
     boost::lock_guard<boost::mutex> unallocatedLock(unallocatedMutex);
@@ -181,59 +816,224 @@ Grid::size_type DeviceWorkerGroupBase::computeMaxSwathe(
     return chunks * zAlign;
 }
 
+Grid::size_type DeviceWorkerGroupBase::maxDistanceRows(Marching::DistanceStorage storage)
+{
+    return storage == Marching::DISTANCE_BUFFER ? MAX_BUFFER_ROWS : MAX_IMAGE_HEIGHT;
+}
+
+Marching::DistanceStorage DeviceWorkerGroup::distanceStorageFor(
+    const cl::Device &device, DistanceStorageChoice choice)
+{
+    switch (choice)
+    {
+    case DISTANCE_STORAGE_IMAGE:
+        return Marching::DISTANCE_IMAGE;
+    case DISTANCE_STORAGE_BUFFER:
+        return Marching::DISTANCE_BUFFER;
+    case DISTANCE_STORAGE_AUTO:
+    default:
+        // Buffers allow a larger swathe, so they are the conservative guess
+        if (device() == NULL)
+            return Marching::DISTANCE_BUFFER;
+        return Marching::preferredDistanceStorage(device);
+    }
+}
+
 CLH::ResourceUsage DeviceWorkerGroup::resourceUsage(
     std::size_t numWorkers, std::size_t spare,
     const cl::Device &device,
     std::size_t maxBucketSplats, Grid::size_type maxCells,
     std::size_t meshMemory,
-    int levels)
+    int levels, cl_channel_type distanceType, SplatLayout splatLayout,
+    bool hashWeld, bool sparseOctree,
+    std::size_t scratchSets,
+    DistanceStorageChoice distanceStorage,
+    bool scatter)
 {
+    const Marching::DistanceStorage storage = distanceStorageFor(device, distanceStorage);
     Grid::size_type block = maxCells + 1;
     Grid::size_type maxSwathe = computeMaxSwathe(
-        MAX_IMAGE_HEIGHT, block, MlsFunctor::wgs[1], MlsFunctor::wgs[2]);
+        maxDistanceRows(storage), block, MlsFunctor::wgs[1], MlsFunctor::wgs[2]);
+    const bool shareScratch = scratchSets > 0 && scratchSets < numWorkers;
 
     CLH::ResourceUsage workerUsage;
     workerUsage += Marching::resourceUsage(
         device, block, block, block,
-        maxSwathe, meshMemory, MlsFunctor::wgs);
-    workerUsage += SplatTreeCL::resourceUsage(device, levels, maxBucketSplats);
+        maxSwathe, meshMemory, MlsFunctor::wgs, distanceType, hashWeld, !shareScratch, storage);
+    workerUsage += SplatTreeCL::resourceUsage(device, levels, maxBucketSplats, false, sparseOctree);
+    if (scatter)
+        workerUsage += ScatterMlsFunctor::resourceUsage(
+            std::min(maxBucketSplats, ScatterMlsFunctor::maxSplats(SCATTER_PAIRS)), SCATTER_PAIRS);
 
     const std::size_t maxItemSplats = maxBucketSplats; // the same thing for now
     CLH::ResourceUsage itemUsage;
-    itemUsage.addBuffer("splats", maxItemSplats * sizeof(Splat));
-    return workerUsage * numWorkers + itemUsage * (numWorkers + spare);
+    itemUsage.addBuffer("splats", maxItemSplats * splatDeviceSize(splatLayout));
+    CLH::ResourceUsage ans = workerUsage * numWorkers + itemUsage * (numWorkers + spare);
+    if (shareScratch)
+        ans += Marching::scratchResourceUsage(block, block, block, meshMemory, hashWeld) * scratchSets;
+    return ans;
 }
 
 DeviceWorkerGroupBase::Worker::Worker(
     DeviceWorkerGroup &owner,
     const cl::Context &context, const cl::Device &device,
     int levels, float boundaryLimit,
-    MlsShape shape, int idx)
+    MlsShape shape, const DeviceTuning &tuning, int idx)
 :
     WorkerBase("device", idx),
     owner(owner),
     queue(context, device, Statistics::isEventTimingEnabled() ? CL_QUEUE_PROFILING_ENABLE : 0),
-    tree(context, device, levels, owner.maxBucketSplats),
-    input(context, shape),
+    outputQueue(context, device, Statistics::isEventTimingEnabled() ? CL_QUEUE_PROFILING_ENABLE : 0),
+    tree(context, device, levels, owner.maxBucketSplats, false, owner.splatLayout, owner.sparseOctree),
+    input(context, shape, tuning.wgs, owner.splatLayout, owner.sparseOctree,
+          owner.distanceStorage, owner.distanceType, owner.boundary),
     marching(context, device, owner.maxCells + 1, owner.maxCells + 1, owner.maxCells + 1,
-             computeMaxSwathe(MAX_IMAGE_HEIGHT, owner.maxCells + 1, input.alignment()[1], input.alignment()[2]),
-             owner.meshMemory, input.alignment()),
-    scaleBias(context)
+             divideSwathe(
+                 computeMaxSwathe(maxDistanceRows(owner.distanceStorage),
+                                  owner.maxCells + 1, input.alignment()[1], input.alignment()[2]),
+                 input.alignment()[2], tuning.swatheDivisor),
+             owner.meshMemory, input.alignment(), owner.distanceType, owner.hashWeld,
+             !owner.shareScratch, owner.distanceStorage),
+    scaleBias(context),
+    shape(shape),
+    boundaryLimit(boundaryLimit),
+    deviceName(device.getInfo<CL_DEVICE_NAME>()),
+    idx(idx)
 {
     input.setBoundaryLimit(boundaryLimit);
+    if (owner.decimateCells > 0.0f)
+    {
+        // Must precede scaleBias, as it works in grid coordinates
+        decimate.reset(new DecimateFilter(context, device, owner.decimateCells));
+        filterChain.addFilter(boost::ref(*decimate));
+    }
     filterChain.addFilter(boost::ref(scaleBias));
+    if (owner.normalEstimation.neighbours > 0)
+        estimator.reset(new NormalEstimator(context, owner.normalEstimation, owner.splatLayout));
 }
 
 void DeviceWorkerGroupBase::Worker::start()
 {
     scaleBias.setScaleBias(owner.fullGrid);
+    tree.setMergeTolerance(owner.mergeTolerance);
+    if (owner.scatterDensity > 0.0f && owner.mergeTolerance == 0.0f && !scatter)
+    {
+        scatter.reset(new ScatterMlsFunctor(
+                queue.getInfo<CL_QUEUE_CONTEXT>(), queue.getInfo<CL_QUEUE_DEVICE>(),
+                shape, input.alignment(), owner.splatLayout,
+                owner.distanceStorage, owner.distanceType, DeviceWorkerGroup::SCATTER_PAIRS,
+                owner.boundary));
+        scatter->setBoundaryLimit(boundaryLimit);
+    }
+    marching.setTiledOccupancy(owner.tiledOccupancy);
+    marching.setCarrySlices(owner.carrySlices);
+    marching.setMarchingCubes(owner.marchingCubes);
+    marching.setOwnedEdges(owner.ownedEdges);
+    if (estimator)
+    {
+        /* Without a scanner position, face normals away from the centre of
+         * the scene, which is right for a closed object.
+         */
+        if (owner.normalEstimation.haveViewpoint)
+            owner.fullGrid.worldToVertex(owner.normalEstimation.viewpoint, viewpoint);
+        else
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                const Grid::extent_type &extent = owner.fullGrid.getExtent(i);
+                viewpoint[i] = 0.5f * (extent.second - extent.first);
+            }
+        }
+    }
+}
+
+void DeviceWorkerGroupBase::Worker::finishSub(const SubItem &sub)
+{
+    if (owner.progress != NULL)
+        *owner.progress += sub.progressSplats;
+
+    {
+        boost::lock_guard<boost::mutex> unallocatedLock(owner.unallocatedMutex);
+        owner.unallocated_ += sub.numSplats;
+    }
+    if (owner.chunkTracker != NULL)
+        owner.chunkTracker->done(sub.chunkId.gen);
+}
+
+void DeviceWorkerGroupBase::Worker::generate(
+    Marching::Generator &generator,
+    const Grid::size_type size[3], const cl_uint3 &keyOffset,
+    const std::vector<cl::Event> &wait, unsigned int keyShift)
+{
+    if (!owner.shareScratch)
+    {
+        filterChain.generate(marching, queue, generator, size, keyOffset, &wait, &outputQueue, keyShift);
+        return;
+    }
+
+    Marching::ScratchPool::Lease lease(owner.scratchPool);
+    marching.setScratch(lease.get());
+    filterChain.generate(marching, queue, generator, size, keyOffset, &wait, &outputQueue, keyShift);
+    // The output may still be reading the buffers, so finish it before handing them on
+    outputQueue.finish();
 }
 
 void DeviceWorkerGroupBase::Worker::operator()(WorkItem &work)
 {
+    if (owner.governor != NULL)
+        owner.governor->wait(getTimeplotWorker());
     Timeplot::Action timer("compute", getTimeplotWorker(), owner.getComputeStat());
-    BOOST_FOREACH(const SubItem &sub, work.subItems)
+    Timer elapsed;
+    std::size_t workSplats = 0;
+    std::tr1::uint64_t workCells = 0;
+    const bool trace = BucketTrace::enabled();
+
+    /* In batched mode, one octree with a root per sub-item is built up
+     * front. Sub-items found in the bucket cache are still included, since
+     * the cache is only consulted inside the loop.
+     */
+    bool batched = false;
+    cl::Event batchBuildEvent;
+    double batchBuildTime = 0.0;  // charged to the first traced bucket
+    unsigned int batchSubsampling = 0;
+    if (owner.batchTrees && !estimator && work.subItems.size() > 1)
+    {
+        std::vector<SplatTreeCL::Root> roots(work.subItems.size());
+        for (std::size_t i = 0; i < roots.size(); i++)
+        {
+            const SubItem &sub = work.subItems[i];
+            // The roots share a start table, so use the coarsest shift of any of them
+            batchSubsampling = std::max(batchSubsampling, sub.subsampling);
+            roots[i].firstSplat = sub.firstSplat;
+            roots[i].numSplats = sub.numSplats;
+            for (int j = 0; j < 3; j++)
+            {
+                roots[i].offset[j] = sub.grid.getExtent(j).first;
+                roots[i].size[j] = roundUp(sub.grid.numVertices(j), input.alignment()[j]);
+            }
+        }
+        if (tree.canBuild(roots, batchSubsampling))
+        {
+            std::vector<cl::Event> wait(1, work.copyEvent);
+            if (trace)
+                work.copyEvent.wait();
+            Timer buildTimer;
+            tree.enqueueBuild(queue, work.splats, roots, batchSubsampling, &wait, &batchBuildEvent);
+            if (trace)
+            {
+                batchBuildEvent.wait();
+                batchBuildTime = buildTimer.getElapsed();
+            }
+            batched = true;
+        }
+    }
+
+    for (std::size_t subIdx = 0; subIdx < work.subItems.size(); subIdx++)
     {
+        const SubItem &sub = work.subItems[subIdx];
+        workSplats += sub.numSplats;
+        workCells += sub.grid.numCells();
+
         cl_uint3 keyOffset;
         for (int i = 0; i < 3; i++)
             keyOffset.s[i] = sub.grid.getExtent(i).first;
@@ -258,78 +1058,398 @@ void DeviceWorkerGroupBase::Worker::operator()(WorkItem &work)
         /* We need to round up the octree size to a multiple of the granularity used for MLS. */
         Grid::size_type expandedSize[3];
         for (int i = 0; i < 3; i++)
-            expandedSize[i] = roundUp(size[i], MlsFunctor::wgs[i]);
+            expandedSize[i] = roundUp(size[i], input.alignment()[i]);
 
-        filterChain.setOutput(owner.outputGenerator(sub.chunkId, getTimeplotWorker()));
+        const DeviceWorkerGroup::OutputGenerator &generator = sub.lod == 0 ? owner.outputGenerator : owner.lodOutputs.at(sub.lod - 1);
+        Marching::OutputFunctor output = generator(sub.chunkId, getTimeplotWorker());
+        boost::ptr_vector<BucketCache::Mesh> cached;
+        std::vector<cl::Event> cacheEvents;
+        if (owner.bucketCache != NULL)
+        {
+            if (owner.bucketCache->load(sub.cacheKey, cached))
+            {
+                BOOST_FOREACH(BucketCache::Mesh &mesh, cached)
+                    owner.hostOutput(sub.chunkId, getTimeplotWorker(), mesh.getHostMesh());
+                finishSub(sub);
+                continue;
+            }
+            output = CacheCapture(output, cached, cacheEvents);
+        }
+        filterChain.setOutput(output);
+        // Coarsened buckets (see BucketLoader::setAdaptive) are in coarse grid units
+        scaleBias.setScaleBias(owner.fullGrid, sub.level);
+        if (decimate)
+            decimate->setRegion(keyOffset, size, sub.level);
 
         cl::Event treeBuildEvent;
         std::vector<cl::Event> wait(1);
+        BucketTrace::Record record(sub.chunkId, sub.grid, sub.level, sub.numSplats);
 
         wait[0] = work.copyEvent;
-        tree.enqueueBuild(queue, work.splats, sub.firstSplat, sub.numSplats,
-                          expandedSize, offset, owner.subsampling, &wait, &treeBuildEvent);
-        wait[0] = treeBuildEvent;
+        if (batched)
+        {
+            wait[0] = batchBuildEvent;
+            input.set(offset, tree, batchSubsampling, subIdx);
+            record.buildTime = batchBuildTime;
+            batchBuildTime = 0.0;
+            Timer mlsTimer;
+            generate(input, size, keyOffset, wait, sub.level);
+            record.mlsTime = mlsTimer.getElapsed();
+        }
+        else
+        {
+            if (trace)
+                work.copyEvent.wait();
+            Timer buildTimer;
+            if (estimator)
+            {
+                /* Estimation needs an octree to find neighbours, and changes the
+                 * radii, so the octree is built a second time for fitting.
+                 */
+                cl::Event estimateEvent;
+                const float scale = 1.0f / (1U << sub.level);
+                const float subViewpoint[3] =
+                {
+                    viewpoint[0] * scale, viewpoint[1] * scale, viewpoint[2] * scale
+                };
+                estimator->setView(subViewpoint, owner.normalEstimation.haveViewpoint,
+                                   owner.fullGrid.getSpacing() / scale);
+                tree.enqueueBuild(queue, work.splats, sub.firstSplat, sub.numSplats,
+                                  expandedSize, offset, sub.subsampling, &wait, &treeBuildEvent);
+                wait[0] = treeBuildEvent;
+                estimator->enqueue(queue, tree, sub.firstSplat, sub.numSplats,
+                                   expandedSize, offset, sub.subsampling, &wait, &estimateEvent);
+                wait[0] = estimateEvent;
+            }
+            tree.enqueueBuild(queue, work.splats, sub.firstSplat, sub.numSplats,
+                              expandedSize, offset, sub.subsampling, &wait, &treeBuildEvent);
+            wait[0] = treeBuildEvent;
+            if (trace)
+            {
+                treeBuildEvent.wait();
+                record.buildTime = buildTimer.getElapsed();
+            }
 
-        input.set(offset, tree, owner.subsampling);
-        marching.generate(queue, input, filterChain, size, keyOffset, &wait);
+            input.set(offset, tree, sub.subsampling);
+            Marching::Generator *generator = &input;
+            if (scatter && !estimator
+                && sub.numSplats < owner.scatterDensity * sub.grid.numCells())
+            {
+                // The octree is kept for swathes with too many pairs
+                scatter->set(offset, work.splats, sub.firstSplat, sub.numSplats, input);
+                generator = scatter.get();
+            }
+            Timer mlsTimer;
+            generate(*generator, size, keyOffset, wait, sub.level);
+            record.mlsTime = mlsTimer.getElapsed();
+            tree.clearSplats();
+        }
+
+        if (trace)
+        {
+            Timer readbackTimer;
+            outputQueue.finish();
+            record.readbackTime = readbackTimer.getElapsed();
 
+            const Marching::Counts &counts = marching.getLastCounts();
+            record.occupiedCells = counts.occupiedCells;
+            record.vertices = counts.vertices;
+            record.triangles = counts.triangles;
+            record.device = deviceName;
+            record.worker = idx;
+            BucketTrace::write(record);
+        }
+
+        if (owner.bucketCache != NULL)
+        {
+            if (!cacheEvents.empty())
+                cl::Event::waitForEvents(cacheEvents);
+            owner.bucketCache->store(sub.cacheKey, cached);
+        }
+        finishSub(sub);
+    }
+    if (batched)
         tree.clearSplats();
+    owner.throughput.complete(workSplats, workCells, elapsed.getElapsed(), owner.numWorkers());
+}
 
-        if (owner.progress != NULL)
-            *owner.progress += sub.progressSplats;
+HostWorkerGroup::HostWorkerGroup(
+    std::size_t numWorkers, std::size_t spare,
+    const DeviceWorkerGroup::HostOutputFunctor &output,
+    std::size_t maxItemSplats,
+    int subsampling, float boundaryLimit, MlsShape shape,
+    SplatLayout splatLayout, MlsBoundary boundary)
+:
+    Base("host", numWorkers),
+    progress(NULL), chunkTracker(NULL), governor(NULL), output(output), bucketCache(NULL), marchingCubes(false),
+    subsampling(subsampling),
+    boundary(boundary),
+    splatLayout(splatLayout),
+    maxItemSplats(maxItemSplats),
+    itemPool(),
+    popMutex(NULL),
+    popCondition(NULL)
+{
+    for (std::size_t i = 0; i < numWorkers; i++)
+        addWorker(new Worker(*this, boundaryLimit, shape, i));
+    const std::size_t items = numWorkers + spare;
+    for (std::size_t i = 0; i < items; i++)
+        itemPool.push(boost::make_shared<WorkItem>(maxItemSplats, splatLayout));
+    unallocated_ = maxItemSplats * items;
+}
+
+void HostWorkerGroup::start(const Grid &fullGrid)
+{
+    this->fullGrid = fullGrid;
+    Base::start();
+}
+
+bool HostWorkerGroup::canGet()
+{
+    return !itemPool.empty();
+}
+
+boost::shared_ptr<HostWorkerGroup::WorkItem> HostWorkerGroup::get(
+    Timeplot::Worker &tworker, std::size_t numSplats)
+{
+    Timeplot::Action timer("get", tworker, getStat);
+    timer.setValue(numSplats * splatDeviceSize(splatLayout));
+    boost::shared_ptr<WorkItem> item = itemPool.pop();
+    reserve(numSplats);
+    return item;
+}
+
+void HostWorkerGroup::reserve(std::size_t numSplats)
+{
+    boost::lock_guard<boost::mutex> unallocatedLock(unallocatedMutex);
+    unallocated_ -= numSplats;
+}
+
+void HostWorkerGroup::freeItem(boost::shared_ptr<WorkItem> item)
+{
+    item->subItems.clear();
+    if (popCondition != NULL)
+    {
+        boost::lock_guard<boost::mutex> popLock(*popMutex);
+        itemPool.push(item);
+        popCondition->notify_all();
+    }
+    else
+        itemPool.push(item);
+}
+
+std::size_t HostWorkerGroup::unallocated()
+{
+    boost::lock_guard<boost::mutex> unallocatedLock(unallocatedMutex);
+    return unallocated_;
+}
+
+HostWorkerGroupBase::Worker::Worker(
+    HostWorkerGroup &owner, float boundaryLimit, MlsShape shape, int idx)
+:
+    WorkerBase("host", idx),
+    owner(owner),
+    mls(shape, boundaryLimit, owner.subsampling, owner.boundary)
+{
+}
+
+void HostWorkerGroupBase::Worker::start()
+{
+    marching.setMarchingCubes(owner.marchingCubes);
+}
 
+void HostWorkerGroupBase::Worker::finishSub(const SubItem &sub)
+{
+    if (owner.progress != NULL)
+        *owner.progress += sub.progressSplats;
+
+    {
+        boost::lock_guard<boost::mutex> unallocatedLock(owner.unallocatedMutex);
+        owner.unallocated_ += sub.numSplats;
+    }
+    if (owner.chunkTracker != NULL)
+        owner.chunkTracker->done(sub.chunkId.gen);
+}
+
+void HostWorkerGroupBase::Worker::operator()(WorkItem &work)
+{
+    if (owner.governor != NULL)
+        owner.governor->wait(getTimeplotWorker());
+    Timeplot::Action timer("compute", getTimeplotWorker(), owner.getComputeStat());
+    Timer elapsed;
+    std::size_t workSplats = 0;
+    std::tr1::uint64_t workCells = 0;
+    const std::size_t splatSize = splatDeviceSize(owner.splatLayout);
+
+    float bias[3];
+    owner.fullGrid.getVertex(0, 0, 0, bias);
+    BOOST_FOREACH(const SubItem &sub, work.subItems)
+    {
+        workSplats += sub.numSplats;
+        workCells += sub.grid.numCells();
+
+        boost::ptr_vector<BucketCache::Mesh> cached;
+        if (owner.bucketCache != NULL && owner.bucketCache->load(sub.cacheKey, cached))
         {
-            boost::lock_guard<boost::mutex> unallocatedLock(owner.unallocatedMutex);
-            owner.unallocated_ += sub.numSplats;
+            BOOST_FOREACH(BucketCache::Mesh &mesh, cached)
+                owner.output(sub.chunkId, getTimeplotWorker(), mesh.getHostMesh());
+            finishSub(sub);
+            continue;
+        }
+
+        cl_uint3 keyOffset;
+        Grid::difference_type offset[3];
+        Grid::size_type size[3];
+        for (int i = 0; i < 3; i++)
+        {
+            keyOffset.s[i] = sub.grid.getExtent(i).first;
+            offset[i] = sub.grid.getExtent(i).first;
+            size[i] = sub.grid.numVertices(i);
+        }
+
+        splats.resize(sub.numSplats);
+        if (sub.numSplats > 0)
+            loadSplats(owner.splatLayout, &work.splats[sub.firstSplat * splatSize],
+                       sub.numSplats, &splats[0]);
+        mls.evaluate(splats, size, offset, field);
+        HostKeyMesh mesh = marching.generate(field, size, keyOffset, sub.level);
+
+        // Coarsened buckets (see BucketLoader::setAdaptive) are in coarse grid units
+        const float scale = owner.fullGrid.getSpacing() * (1U << sub.level);
+        for (std::size_t i = 0; i < mesh.numVertices(); i++)
+            for (int j = 0; j < 3; j++)
+                mesh.vertices[i][j] = mesh.vertices[i][j] * scale + bias[j];
+
+        if (mesh.numVertices() > 0)
+        {
+            owner.output(sub.chunkId, getTimeplotWorker(), mesh);
+            if (owner.bucketCache != NULL)
+            {
+                cached.push_back(new BucketCache::Mesh(mesh));
+                HostKeyMesh copy = cached.back().getHostMesh();
+                std::copy(mesh.vertexKeys, mesh.vertexKeys + mesh.numExternalVertices(), copy.vertexKeys);
+                std::copy(mesh.vertices, mesh.vertices + mesh.numVertices(), copy.vertices);
+                std::copy(mesh.triangles, mesh.triangles + mesh.numTriangles(), copy.triangles);
+            }
         }
+        if (owner.bucketCache != NULL)
+            owner.bucketCache->store(sub.cacheKey, cached);
+        finishSub(sub);
     }
+    owner.throughput.complete(workSplats, workCells, elapsed.getElapsed(), owner.numWorkers());
 }
 
+const double CopyGroup::holdBackRatio = 1.25;
+
+namespace
+{
+
+/// Whether every group in @a groups shares memory with the host
+bool allZeroCopy(const std::vector<DeviceWorkerGroup *> &groups)
+{
+    BOOST_FOREACH(const DeviceWorkerGroup *g, groups)
+        if (!g->isZeroCopy())
+            return false;
+    return true;
+}
+
+} // anonymous namespace
+
 CopyGroup::CopyGroup(
     const std::vector<DeviceWorkerGroup *> &outGroups,
-    std::size_t maxQueueSplats)
+    std::size_t maxQueueSplats,
+    std::size_t numPinned)
 :
     WorkerGroup<CopyGroup::WorkItem, CopyGroup::Worker, CopyGroup>(
         "copy", 1),
     outGroups(outGroups),
+    hostGroup(NULL),
+    targets(outGroups.begin(), outGroups.end()),
     maxDeviceItemSplats(outGroups[0]->getMaxItemSplats()),
+    splatLayout(outGroups[0]->getSplatLayout()),
+    numPinned(numPinned),
+    zeroCopy(allZeroCopy(outGroups)),
+    bucketCache(NULL),
+    adaptivePacking(false),
     splatBuffer("mem.CopyGroup.splats", maxQueueSplats * sizeof(Splat)),
     writeStat(Statistics::getStatistic<Statistics::Variable>("copy.write")),
     splatsStat(Statistics::getStatistic<Statistics::Variable>("copy.splats")),
-    sizeStat(Statistics::getStatistic<Statistics::Variable>("copy.size"))
+    sizeStat(Statistics::getStatistic<Statistics::Variable>("copy.size")),
+    holdBackStat(Statistics::getStatistic<Statistics::Counter>("copy.holdback"))
 {
+    MLSGPU_ASSERT(numPinned >= 1, std::invalid_argument);
     addWorker(new Worker(*this, outGroups[0]->getContext(), outGroups[0]->getDevice()));
     BOOST_FOREACH(DeviceWorkerGroup *g, outGroups)
+    {
         g->setPopCondition(&popMutex, &popCondition);
+        g->setSiblings(outGroups);
+    }
+}
+
+/// Orders bins by the generation of their chunk
+static bool copyItemChunkLess(
+    const boost::shared_ptr<CopyGroup::WorkItem> &a,
+    const boost::shared_ptr<CopyGroup::WorkItem> &b)
+{
+    return a->chunkId.gen < b->chunkId.gen;
+}
+
+void CopyGroup::setChunkPriority(bool chunkPriority)
+{
+    if (chunkPriority)
+        getWorkQueue().setPriority(copyItemChunkLess);
+    else
+        getWorkQueue().setPriority(BaseType::queue_type::Compare());
+}
+
+void CopyGroup::setHostGroup(HostWorkerGroup *hostGroup)
+{
+    MLSGPU_ASSERT(this->hostGroup == NULL, state_error);
+    MLSGPU_ASSERT(hostGroup->getMaxItemSplats() >= maxDeviceItemSplats, std::invalid_argument);
+    MLSGPU_ASSERT(hostGroup->getSplatLayout() == splatLayout, std::invalid_argument);
+    this->hostGroup = hostGroup;
+    targets.push_back(hostGroup);
+    hostGroup->setPopCondition(&popMutex, &popCondition);
 }
 
 CopyGroupBase::Worker::Worker(
     CopyGroup &owner, const cl::Context &context, const cl::Device &device)
     : WorkerBase("copy", 0), owner(owner),
-    pinned("mem.CopyGroup.pinned", context, device, owner.maxDeviceItemSplats),
+    directGroup(NULL),
+    directPtr(NULL),
+    pinnedEvents(owner.zeroCopy ? 0 : owner.numPinned),
+    current(0),
     bufferedItems("mem.CopyGroup.bufferedItems"),
-    bufferedSplats(0)
+    bufferedSplats(0),
+    splatSize(splatDeviceSize(owner.splatLayout))
 {
+    if (owner.zeroCopy)
+    {
+        Log::log[Log::info] << "Devices are filled by mapping; splats will not be staged\n";
+        return;
+    }
+    for (std::size_t i = 0; i < owner.numPinned; i++)
+        pinned.push_back(new CLH::PinnedMemory<char>(
+                "mem.CopyGroup.pinned", context, device,
+                owner.maxDeviceItemSplats * splatSize));
 }
 
-void CopyGroupBase::Worker::flush()
+CopyTarget *CopyGroupBase::Worker::chooseDevice(
+    std::size_t numSplats, std::tr1::uint64_t numCells,
+    boost::unique_lock<boost::mutex> &popLock)
 {
-    if (bufferedItems.empty())
-        return;
-
-    boost::unique_lock<boost::mutex> popLock(owner.popMutex);
-    DeviceWorkerGroup *outGroup = NULL;
+    CopyTarget *outGroup = NULL;
+    bool heldBack = false;
     while (true)
     {
-        /* Try all devices for which we can pop immediately, and take the one that
-         * seems likely to run out the soonest. It's a poor guess, but does at
-         * least make sure that we always service totally idle devices before ones
-         * that still have work queued.
+        /* Devices that have not yet been measured are serviced first when
+         * free, so that every device gets a throughput estimate. Among those,
+         * take the one that seems likely to run out the soonest.
          */
         std::size_t best = 0;
-        BOOST_FOREACH(DeviceWorkerGroup *g, owner.outGroups)
+        BOOST_FOREACH(CopyTarget *g, owner.targets)
         {
-            if (g->canGet())
+            if (g->canGet() && !g->getThroughput().hasEstimate())
             {
                 std::size_t u = g->unallocated();
                 if (u >= best)
@@ -342,36 +1462,159 @@ void CopyGroupBase::Worker::flush()
         if (outGroup != NULL)
             break;
 
-        // No spare slots. Wait until there is one
+        /* Otherwise, find the free device and the overall device that are
+         * expected to finish this work first.
+         */
+        double bestFinish = std::numeric_limits<double>::infinity();
+        double bestFreeFinish = std::numeric_limits<double>::infinity();
+        BOOST_FOREACH(CopyTarget *g, owner.targets)
+        {
+            if (!g->getThroughput().hasEstimate())
+                continue;
+            double finish = g->getThroughput().finishTime(numSplats, numCells);
+            bestFinish = std::min(bestFinish, finish);
+            if (g->canGet() && finish < bestFreeFinish)
+            {
+                bestFreeFinish = finish;
+                outGroup = g;
+            }
+        }
+        if (outGroup != NULL && bestFreeFinish <= bestFinish * CopyGroup::holdBackRatio)
+            break;
+        outGroup = NULL;
+        if (!heldBack && bestFinish < bestFreeFinish)
+        {
+            owner.holdBackStat.add(1);
+            heldBack = true;
+        }
+
+        // No suitable spare slots. Wait until there is one
         {
             Timeplot::Action timer("get", getTimeplotWorker(), owner.outGroups[0]->getGetStat());
             owner.popCondition.wait(popLock);
         }
     }
-    popLock.release()->unlock();
+    return outGroup;
+}
 
-    // This should now never block
-    boost::shared_ptr<DeviceWorkerGroup::WorkItem> item = outGroup->get(getTimeplotWorker(), bufferedSplats);
+void CopyGroupBase::Worker::beginDirect(const WorkItem &work)
+{
+    /* chooseDevice only picks a target with a free item, and items are only
+     * taken from the pools while holding popMutex, so the get does not wait.
+     * The splats are accounted when the batch is flushed.
+     */
+    boost::unique_lock<boost::mutex> popLock(owner.popMutex);
+    CopyTarget *target = chooseDevice(work.numSplats, work.grid.numCells(), popLock);
+    if (target == owner.hostGroup)
+    {
+        hostItem = owner.hostGroup->get(getTimeplotWorker(), 0);
+        directPtr = &hostItem->splats[0];
+        return;
+    }
+    directGroup = static_cast<DeviceWorkerGroup *>(target);
+    directItem = directGroup->get(getTimeplotWorker(), 0);
+    popLock.unlock();
+    directPtr = static_cast<char *>(directGroup->getCopyQueue().enqueueMapBuffer(
+            directItem->splats, CL_TRUE, CL_MAP_WRITE,
+            0, directGroup->getMaxItemSplats() * splatSize));
+}
+
+void CopyGroupBase::Worker::flush()
+{
+    if (bufferedItems.empty())
+        return;
+
+    std::tr1::uint64_t bufferedCells = 0;
+    BOOST_FOREACH(const DeviceWorkerGroup::SubItem &sub, bufferedItems)
+        bufferedCells += sub.grid.numCells();
+
+    CopyTarget *target;
+    boost::unique_lock<boost::mutex> popLock(owner.popMutex, boost::defer_lock);
+    if (owner.zeroCopy)
+        target = hostItem ? static_cast<CopyTarget *>(owner.hostGroup) : directGroup;
+    else
+    {
+        popLock.lock();
+        target = chooseDevice(bufferedSplats, bufferedCells, popLock);
+    }
+
+    if (target == owner.hostGroup)
+    {
+        HostWorkerGroup *hostGroup = owner.hostGroup;
+        if (owner.zeroCopy)
+            hostGroup->reserve(bufferedSplats);
+        else
+        {
+            // Does not wait, since chooseDevice saw a free item (see beginDirect)
+            hostItem = hostGroup->get(getTimeplotWorker(), bufferedSplats);
+            popLock.unlock();
+            // Synchronous, so the staging buffer can be refilled straight away
+            std::memcpy(&hostItem->splats[0], pinned[current].get(), bufferedSplats * splatSize);
+        }
+        hostItem->subItems.swap(bufferedItems);
+        hostGroup->getThroughput().enqueue(bufferedSplats, bufferedCells);
+        hostGroup->push(getTimeplotWorker(), hostItem);
+        hostItem.reset();
+        directPtr = NULL;
+        bufferedSplats = 0;
+        return;
+    }
+
+    DeviceWorkerGroup *outGroup = static_cast<DeviceWorkerGroup *>(target);
+    BOOST_FOREACH(DeviceWorkerGroup::SubItem &sub, bufferedItems)
+        sub.subsampling = outGroup->subsamplingFor(sub.numSplats, sub.grid);
+    boost::shared_ptr<DeviceWorkerGroup::WorkItem> item;
+    if (owner.zeroCopy)
+    {
+        // The splats are already in place; releasing the mapping hands them to the device
+        item.swap(directItem);
+        outGroup->reserve(bufferedSplats);
+        outGroup->getCopyQueue().enqueueUnmapMemObject(item->splats, directPtr, NULL, &item->copyEvent);
+        directGroup = NULL;
+        directPtr = NULL;
+    }
+    else
+    {
+        // Does not wait, since chooseDevice saw a free item (see beginDirect)
+        item = outGroup->get(getTimeplotWorker(), bufferedSplats);
+        popLock.unlock();
+        outGroup->getCopyQueue().enqueueWriteBuffer(
+            item->splats,
+            CL_FALSE,
+            0, bufferedSplats * splatSize,
+            pinned[current].get(),
+            NULL, &item->copyEvent);
+        Statistics::timeTransfer(item->copyEvent, bufferedSplats * splatSize, outGroup->getUploadStat());
+        pinnedEvents[current] = item->copyEvent;
+
+        /* The transfer proceeds while the next staging buffer is filled. It is
+         * only waited for when its buffer comes around again (see waitPinned).
+         */
+        current = (current + 1) % pinned.size();
+    }
     item->subItems.swap(bufferedItems);
-    outGroup->getCopyQueue().enqueueWriteBuffer(
-        item->splats,
-        CL_FALSE,
-        0, bufferedSplats * sizeof(Splat),
-        pinned.get(),
-        NULL, &item->copyEvent);
-    cl::Event copyEvent = item->copyEvent;
+    outGroup->getThroughput().enqueue(bufferedSplats, bufferedCells);
     outGroup->push(getTimeplotWorker(), item);
+    bufferedSplats = 0;
+}
 
-    /* Ensures that we can start refilling the pinned memory right away. Note
-     * that this is not the same as doing a synchronous transfer, because we
-     * are still overlapping the transfer with enqueuing the item.
-     */
+void CopyGroupBase::Worker::waitPinned(std::size_t index)
+{
+    cl::Event &event = pinnedEvents[index];
+    if (event())
     {
         Timeplot::Action writeTimer("write", getTimeplotWorker(), owner.getWriteStat());
-        writeTimer.setValue(bufferedSplats * sizeof(Splat));
-        copyEvent.wait();
+        event.wait();
+        event = cl::Event();
     }
-    bufferedSplats = 0;
+}
+
+void CopyGroupBase::Worker::stop()
+{
+    flush();
+    // The staging buffers must not be freed while copies from them are in flight
+    for (std::size_t i = 0; i < pinnedEvents.size(); i++)
+        waitPinned(i);
 }
 
 void CopyGroupBase::Worker::operator()(WorkItem &work)
@@ -379,11 +1622,19 @@ void CopyGroupBase::Worker::operator()(WorkItem &work)
     Timeplot::Action timer("compute", getTimeplotWorker(), owner.getComputeStat());
     timer.setValue(work.numSplats * sizeof(Splat));
 
-    if (bufferedSplats + work.numSplats > owner.maxDeviceItemSplats)
+    // A large bin is sent on its own (see CopyGroup::setAdaptivePacking)
+    const bool solo = owner.adaptivePacking && work.numSplats * 2 >= owner.maxDeviceItemSplats;
+    if (solo || bufferedSplats + work.numSplats > owner.maxDeviceItemSplats)
         flush();
+    if (bufferedSplats == 0)
+    {
+        if (owner.zeroCopy)
+            beginDirect(work);
+        else
+            waitPinned(current);
+    }
 
     const Splat *in = work.getSplats();
-    Splat *out = pinned.get() + bufferedSplats;
     std::size_t progressSplats = 0;
     for (std::size_t i = 0; i < work.numSplats; i++)
     {
@@ -400,19 +1651,31 @@ void CopyGroupBase::Worker::operator()(WorkItem &work)
             inside = inside && p >= e.first && p < e.second;
         }
         progressSplats += inside;
-        out[i] = in[i];
     }
+    // Coarse levels of detail repeat splats already counted
+    if (work.lod > 0)
+        progressSplats = 0;
+    char *out = owner.zeroCopy ? directPtr : pinned[current].get();
+    storeSplats(owner.splatLayout, in, work.numSplats, out + bufferedSplats * splatSize);
     DeviceWorkerGroup::SubItem subItem;
     subItem.chunkId = work.chunkId;
     subItem.grid = work.grid;
     subItem.numSplats = work.numSplats;
     subItem.firstSplat = bufferedSplats;
     subItem.progressSplats = progressSplats;
+    subItem.level = work.level;
+    subItem.lod = work.lod;
+    subItem.subsampling = 0; // chosen by the device in flush
+    if (owner.bucketCache != NULL)
+        subItem.cacheKey = owner.bucketCache->makeKey(in, work.numSplats, work.grid, work.level);
     bufferedItems.push_back(subItem);
     bufferedSplats += work.numSplats;
 
     owner.splatsStat.add(work.numSplats);
     owner.sizeStat.add(work.grid.numCells());
+    // Keep the slabs of a split bucket apart, so they can go to different devices
+    if (work.split || solo)
+        flush();
 
     owner.splatBuffer.free(work.splats);
 }
@@ -43,16 +43,23 @@
 #include <boost/foreach.hpp>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/ptr_container/ptr_map.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
 #include <cstddef>
+#include <algorithm>
 #include <stdexcept>
 #include <utility>
 #include <vector>
+#include <map>
+#include <string>
 #include <iostream>
 #include <cstdlib>
 #include <CL/cl.hpp>
 #include "splat_tree_cl.h"
 #include "marching.h"
 #include "mls.h"
+#include "normal_estimator.h"
 #include "mesh.h"
 #include "mesher.h"
 #include "mesh_filter.h"
@@ -68,6 +75,12 @@
 #include "allocator.h"
 #include "worker_group.h"
 #include "timeplot.h"
+#include "tr1_cstdint.h"
+#include "bucket_cache.h"
+#include "host_mls.h"
+#include "host_marching.h"
+#include "chunk_tracker.h"
+#include "memory_governor.h"
 
 class MesherGroup;
 
@@ -77,7 +90,7 @@ public:
     struct WorkItem
     {
         MesherWork work;
-        CircularBuffer::Allocation alloc; ///< Allocation backing the mesh data
+        LockFreeCircularBuffer::Allocation alloc; ///< Allocation backing the mesh data
     };
 
     class Worker : public WorkerBase
@@ -88,18 +101,20 @@ public:
     public:
         typedef void result_type;
 
-        explicit Worker(MesherGroup &owner);
+        Worker(MesherGroup &owner, int idx);
         void operator()(WorkItem &work);
     };
 };
 
 /**
- * Object for handling asynchronous meshing. It always uses one consumer thread, since
- * the operation is fundamentally not thread-safe. However, there may be multiple
- * producers.
+ * Object for handling asynchronous meshing. There may be multiple producers.
+ * There is only one consumer thread unless the mesher supports concurrent
+ * input (see @ref MesherBase::concurrentInput), since the operation is
+ * otherwise not thread-safe.
  */
 class MesherGroup : protected MesherGroupBase,
-    public WorkerGroup<MesherGroupBase::WorkItem, MesherGroupBase::Worker, MesherGroup>
+    public WorkerGroup<MesherGroupBase::WorkItem, MesherGroupBase::Worker, MesherGroup,
+                       BoundedWorkQueue<boost::shared_ptr<MesherGroupBase::WorkItem> > >
 {
 public:
     typedef MesherGroupBase::WorkItem WorkItem;
@@ -107,17 +122,44 @@ public:
     /// Set the functor to use for processing data received from the output functor.
     void setInputFunctor(const MesherBase::InputFunctor &input) { this->input = input; }
 
+    /**
+     * Set a tracker that is told about each item pushed, and each item
+     * once it has been passed to the input functor. It may be @c NULL.
+     */
+    void setChunkTracker(ChunkTracker *chunkTracker) { this->chunkTracker = chunkTracker; }
+
+    /**
+     * Set a governor that is told about each item pushed, and each item once
+     * it has been passed to the input functor (see @ref MemoryGovernor). It
+     * may be @c NULL.
+     */
+    void setMemoryGovernor(MemoryGovernor *governor) { this->governor = governor; }
+
     boost::shared_ptr<WorkItem> get(Timeplot::Worker &tworker, std::size_t size);
 
+    /// Enqueue an item of work, recording it with the chunk tracker.
+    void push(Timeplot::Worker &tworker, boost::shared_ptr<WorkItem> item);
+
     /**
      * Constructor.
      *
-     * @param memMesh Memory (in bytes) to allocate for holding queued mesh data.
+     * @param memMesh    Memory (in bytes) to allocate for holding queued mesh data.
+     * @param numThreads Number of consumer threads. This must be 1 unless the input
+     *                   functor is thread-safe.
+     * @param memory     If non-@c NULL, storage of at least @a memMesh bytes to use
+     *                   instead of allocating it. Passing pinned memory lets the
+     *                   device readbacks transfer straight into it.
      */
-    explicit MesherGroup(const std::size_t memMesh);
+    explicit MesherGroup(const std::size_t memMesh, std::size_t numThreads = 1, char *memory = NULL);
 private:
+    typedef WorkerGroup<MesherGroupBase::WorkItem, MesherGroupBase::Worker, MesherGroup,
+                        BoundedWorkQueue<boost::shared_ptr<MesherGroupBase::WorkItem> > > BaseType;
+
     MesherBase::InputFunctor input;
-    CircularBuffer meshBuffer;
+    ChunkTracker *chunkTracker;       ///< Tracker set by @ref setChunkTracker, or @c NULL
+    MemoryGovernor *governor;         ///< Governor set by @ref setMemoryGovernor, or @c NULL
+    /// Filled by the device workers (hence multiple producers)
+    LockFreeCircularBuffer meshBuffer;
 
     friend class MesherGroupBase::Worker;
 
@@ -131,6 +173,116 @@ private:
 };
 
 
+/**
+ * Tracks the recent throughput of a device and the work queued on it, so that
+ * work can be given to the device expected to finish it soonest. Throughput
+ * is measured separately in splats/second and cells/second, each as an
+ * exponentially weighted moving average. It is thread-safe.
+ */
+class DeviceThroughput : public boost::noncopyable
+{
+public:
+    /**
+     * Constructor.
+     *
+     * @param smoothing   Weight given to each new measurement, in (0, 1].
+     */
+    explicit DeviceThroughput(double smoothing = 0.25);
+
+    /// Record that work has been queued on the device.
+    void enqueue(std::size_t splats, std::tr1::uint64_t cells);
+
+    /// Record that queued work has been removed without being processed.
+    void dequeue(std::size_t splats, std::tr1::uint64_t cells);
+
+    /**
+     * Record that queued work has been completed.
+     *
+     * @param splats, cells   Work done (must previously have been passed to @ref enqueue)
+     * @param seconds         Wall-clock time taken to do the work
+     * @param concurrency     Number of workers that process items concurrently
+     */
+    void complete(std::size_t splats, std::tr1::uint64_t cells, double seconds, std::size_t concurrency);
+
+    /// Returns true once at least one measurement has been made.
+    bool hasEstimate() const;
+
+    /**
+     * Estimated time in seconds to process the given work.
+     * @pre @ref hasEstimate() is true.
+     */
+    double estimate(std::size_t splats, std::tr1::uint64_t cells) const;
+
+    /**
+     * Estimated time in seconds for the device to finish its queued work and
+     * then the given work.
+     * @pre @ref hasEstimate() is true.
+     */
+    double finishTime(std::size_t splats, std::tr1::uint64_t cells) const;
+
+private:
+    const double smoothing;
+    mutable boost::mutex mutex;
+    double splatRate;                    ///< Splats per second (0 if not yet measured)
+    double cellRate;                     ///< Cells per second (0 if not yet measured)
+    std::size_t pendingSplats;           ///< Splats queued but not completed
+    std::tr1::uint64_t pendingCells;     ///< Cells queued but not completed
+
+    /// Implementation of @ref estimate, with the mutex held
+    double estimateUnlocked(std::size_t splats, std::tr1::uint64_t cells) const;
+};
+
+/**
+ * How @ref DeviceWorkerGroup chooses the @ref Marching::DistanceStorage for
+ * its device.
+ */
+enum DistanceStorageChoice
+{
+    DISTANCE_STORAGE_AUTO,    ///< Use @ref Marching::preferredDistanceStorage
+    DISTANCE_STORAGE_IMAGE,   ///< Always use @ref Marching::DISTANCE_IMAGE
+    DISTANCE_STORAGE_BUFFER   ///< Always use @ref Marching::DISTANCE_BUFFER
+};
+
+/// Wrapper around @ref DistanceStorageChoice for use with @ref Choice.
+class DistanceStorageChoiceWrapper
+{
+public:
+    typedef DistanceStorageChoice type;
+    static std::map<std::string, DistanceStorageChoice> getNameMap();
+};
+
+/**
+ * Per-device parameters that affect performance but not results, chosen by
+ * @ref DeviceWorkerGroup::autotune. The default-constructed values are the
+ * built-in defaults.
+ */
+struct DeviceTuning
+{
+    Grid::size_type wgs[3];      ///< Work group size for @ref MlsFunctor
+    unsigned int swatheDivisor;  ///< Factor by which to reduce the maximum swathe passed to @ref Marching
+
+    DeviceTuning();
+};
+
+/**
+ * A worker group to which @ref CopyGroup can send batches of buckets. It is
+ * implemented by @ref DeviceWorkerGroup and @ref HostWorkerGroup.
+ */
+class CopyTarget
+{
+public:
+    /// Determine whether obtaining an item from the group will block.
+    virtual bool canGet() = 0;
+
+    /// Estimate spare capacity, in splats (see @ref DeviceWorkerGroup::unallocated).
+    virtual std::size_t unallocated() = 0;
+
+    /// Return the throughput tracker, which must be informed of work pushed to the group
+    virtual DeviceThroughput &getThroughput() = 0;
+
+    virtual ~CopyTarget() {}
+};
+
 class DeviceWorkerGroup;
 
 class DeviceWorkerGroupBase
@@ -142,6 +294,17 @@ protected:
      */
     static const int MAX_IMAGE_HEIGHT = 8192;
 
+    /**
+     * Maximum number of rows we will use for a distance field held in a
+     * buffer. There is no hardware limit, so this just trades device memory
+     * (the scratch space for a swathe grows with it) against the number of
+     * swathes per bucket.
+     */
+    static const int MAX_BUFFER_ROWS = 16384;
+
+    /// The value of @a yMax to pass to @ref computeMaxSwathe for @a storage
+    static Grid::size_type maxDistanceRows(Marching::DistanceStorage storage);
+
     /**
      * Compute a @a maxSwath value to pass to @ref Marching. If the returned
      * value is @a N, then it is guaranteed that
@@ -163,6 +326,10 @@ public:
         std::size_t firstSplat;        ///< Index of first splat in device buffer
         std::size_t numSplats;         ///< Number of splats in the bucket
         std::size_t progressSplats;    ///< Splats to count towards the progress meter
+        unsigned int level;            ///< Grid coarsening level (see @ref BucketLoader::setAdaptive)
+        unsigned int lod;              ///< Level of detail, selecting the output (see @ref setLodOutputs)
+        unsigned int subsampling;      ///< Octree subsampling shift (see @ref DeviceWorkerGroup::subsamplingFor)
+        BucketCache::Key cacheKey;     ///< Key of the bucket in the @ref BucketCache, if any
     };
 
     /// Data about multiple buckets that share a single CL buffer.
@@ -173,9 +340,16 @@ public:
         cl::Buffer splats;             ///< Backing store for splats
         cl::Event copyEvent;           ///< Event signaled when the splats are ready to use on device
 
-        WorkItem(const cl::Context &context, std::size_t maxItemSplats)
+        /**
+         * Constructor. @a placement is added to the flags for allocating the
+         * splats, to place them in memory that can be filled by mapping
+         * the buffer rather than copying to it.
+         */
+        WorkItem(const cl::Context &context, std::size_t maxItemSplats, SplatLayout layout,
+                 cl_mem_flags placement = 0)
             : subItems("mem.DeviceWorkerGroup.subItems"),
-            splats(context, CL_MEM_READ_WRITE, maxItemSplats * sizeof(Splat))
+            splats(context, CL_MEM_READ_WRITE | placement,
+                   maxItemSplats * splatDeviceSize(layout))
         {
         }
     };
@@ -186,11 +360,37 @@ public:
         DeviceWorkerGroup &owner;
 
         const cl::CommandQueue queue;
+        /// Queue for the mesh output, so that its readback overlaps with the next bucket
+        const cl::CommandQueue outputQueue;
         SplatTreeCL tree;
         MlsFunctor input;
+        /// Scatter generator for sparse buckets, if enabled (see @ref DeviceWorkerGroup::setScatterDensity)
+        boost::scoped_ptr<ScatterMlsFunctor> scatter;
         Marching marching;
         ScaleBiasFilter scaleBias;
+        /// Decimates the mesh before output, if enabled
+        boost::scoped_ptr<DecimateFilter> decimate;
         MeshFilterChain filterChain;
+        /// Estimates missing normals before fitting, if enabled
+        boost::scoped_ptr<NormalEstimator> estimator;
+        /// Viewpoint for @ref estimator, in full grid coordinates
+        float viewpoint[3];
+        const MlsShape shape;           ///< Fitted shape, for creating @ref scatter
+        const float boundaryLimit;      ///< Boundary pruning factor, for creating @ref scatter
+        const std::string deviceName;   ///< Name of the device, for @ref BucketTrace
+        const unsigned int idx;         ///< Index of this worker within the group
+
+        /// Update the progress and free space once a bucket is done
+        void finishSub(const SubItem &sub);
+
+        /**
+         * Run @ref marching on a bucket, sampling @a generator. If the owner
+         * pools its scratch buffers, a set is leased for the duration, and
+         * returned once the output has finished reading from it.
+         */
+        void generate(Marching::Generator &generator,
+                      const Grid::size_type size[3], const cl_uint3 &keyOffset,
+                      const std::vector<cl::Event> &wait, unsigned int keyShift);
 
     public:
         typedef void result_type;
@@ -199,10 +399,16 @@ public:
             DeviceWorkerGroup &owner,
             const cl::Context &context, const cl::Device &device,
             int levels, float boundaryLimit,
-            MlsShape shape, int idx);
+            MlsShape shape, const DeviceTuning &tuning, int idx);
 
         void start();
         void operator()(WorkItem &work);
+
+        /// Allocate a set of scratch buffers for @ref marching.
+        Marching::Scratch makeScratch(const cl::Context &context) const
+        {
+            return marching.makeScratch(context);
+        }
     };
 };
 
@@ -213,7 +419,8 @@ public:
  */
 class DeviceWorkerGroup :
     protected DeviceWorkerGroupBase,
-    public WorkerGroup<DeviceWorkerGroupBase::WorkItem, DeviceWorkerGroupBase::Worker, DeviceWorkerGroup>
+    public WorkerGroup<DeviceWorkerGroupBase::WorkItem, DeviceWorkerGroupBase::Worker, DeviceWorkerGroup>,
+    public CopyTarget
 {
 public:
     /**
@@ -224,11 +431,22 @@ public:
      */
     typedef boost::function<Marching::OutputFunctor(const ChunkId &, Timeplot::Worker &)> OutputGenerator;
 
+    /**
+     * Functor that passes a mesh already in host memory downstream. It is
+     * used to output meshes found in the @ref BucketCache.
+     */
+    typedef boost::function<void(const ChunkId &, Timeplot::Worker &, const HostKeyMesh &)> HostOutputFunctor;
+
 private:
     typedef WorkerGroup<DeviceWorkerGroupBase::WorkItem, DeviceWorkerGroupBase::Worker, DeviceWorkerGroup> Base;
 
     ProgressMeter *progress;
+    ChunkTracker *chunkTracker;       ///< Told when each sub-item is done, or @c NULL
+    MemoryGovernor *governor;         ///< Waited on before each item, or @c NULL
     OutputGenerator outputGenerator;
+    std::vector<OutputGenerator> lodOutputs;  ///< Outputs for coarse levels of detail (see @ref setLodOutputs)
+    BucketCache *bucketCache;         ///< Cache of bucket meshes, or @c NULL
+    HostOutputFunctor hostOutput;     ///< Output for meshes found in @ref bucketCache
 
     Grid fullGrid;
     const cl::Context context;
@@ -236,13 +454,35 @@ private:
     const std::size_t maxBucketSplats;  ///< Maximum splats in a single bucket
     const Grid::size_type maxCells;
     const std::size_t meshMemory;
-    const int subsampling;
+    const int levels;                 ///< Levels allocated for the octree
+    const int subsampling;            ///< Coarsest octree subsampling shift
+    bool adaptiveSubsampling;         ///< Whether to refine @ref subsampling for dense buckets
+    cl_channel_type distanceType;     ///< Channel type for @ref Marching distances
+    const Marching::DistanceStorage distanceStorage; ///< Storage for @ref Marching distances
+    const SplatLayout splatLayout;    ///< Layout of splats in the device buffers
+    const bool hashWeld;              ///< Whether @ref Marching welds vertices with a hash table
+    const bool sparseOctree;          ///< Whether the octrees store only occupied cells
+    const bool shareScratch;          ///< Whether workers lease @ref Marching scratch from @ref scratchPool
+    const bool zeroCopy;              ///< Whether the device shares memory with the host
+    const NormalEstimation normalEstimation; ///< Parameters for estimating missing normals
+    const float decimateCells;        ///< Cube size for @ref DecimateFilter, or 0 to disable
+    const MlsBoundary boundary;       ///< Boundary test for @ref MlsFunctor
+    bool batchTrees;                  ///< Whether to build one octree for all sub-items of an item
+    float mergeTolerance;             ///< Tolerance for merging duplicate splats, or 0 to disable
+    float scatterDensity;             ///< Splats per cell below which @ref ScatterMlsFunctor is used, or 0 to disable
+    bool tiledOccupancy;              ///< Whether @ref Marching classifies cells coarse-to-fine
+    bool carrySlices;                 ///< Whether @ref Marching carries slices between buckets
+    bool marchingCubes;               ///< Whether @ref Marching triangulates whole cubes
+    bool ownedEdges;                  ///< Whether @ref Marching emits each vertex from the cell owning its edge
 
     cl::CommandQueue copyQueue;   ///< Queue for transferring data to the device
 
     /// Pool of unused buffers to be recycled
     WorkQueue<boost::shared_ptr<WorkItem> > itemPool;
 
+    /// Scratch buffers shared by the workers, if @ref shareScratch is set
+    Marching::ScratchPool scratchPool;
+
     /// Mutex held while signaling @ref popCondition
     boost::mutex *popMutex;
 
@@ -254,6 +494,28 @@ private:
     /// Mutex protecting @ref unallocated_.
     boost::mutex unallocatedMutex;
 
+    /// Measured performance, used by @ref CopyGroup to choose a device
+    DeviceThroughput throughput;
+
+    /// Groups for other devices, from which idle workers may steal work
+    std::vector<DeviceWorkerGroup *> siblings;
+
+    Statistics::Counter &stealStat;    ///< Number of items stolen from siblings
+    Statistics::Throughput &uploadStat; ///< Splat transfers to @ref device
+
+    /**
+     * Time an idle worker waits for its own queue before trying to steal
+     * from a sibling.
+     */
+    static const boost::posix_time::time_duration stealInterval;
+
+    /**
+     * Take an item queued on a sibling, and copy its splats to an item from
+     * our own pool. Returns a null pointer if there is nothing to steal or
+     * no free item to copy it into.
+     */
+    boost::shared_ptr<WorkItem> steal(Timeplot::Worker &tworker);
+
     friend class DeviceWorkerGroupBase::Worker;
 
 public:
@@ -277,6 +539,24 @@ public:
      * @param subsampling        Octree subsampling level.
      * @param boundaryLimit      Tuning factor for boundary pruning.
      * @param shape              The shape to fit to the data
+     * @param distanceType       Channel type for storing signed distances (see @ref Marching::Marching).
+     *                           If the device does not support it, a warning is given and @c CL_FLOAT is used.
+     * @param splatLayout        Layout of the splats copied to the device.
+     * @param hashWeld           Weld vertices with a hash table instead of sorting (see @ref Marching::Marching).
+     * @param tuning             Performance parameters (see @ref autotune)
+     * @param normalEstimation   Parameters for estimating normals of splats that lack them
+     *                           (see @ref NormalEstimator). Estimation is disabled by default.
+     * @param decimateCells      If positive, meshes are decimated by merging internal vertices
+     *                           within cubes of this many grid cells (see @ref DecimateFilter).
+     * @param sparseOctree       Store only the occupied cells of the octrees (see @ref SplatTreeCL).
+     *                           This cannot be combined with normal estimation.
+     * @param scratchSets        Number of sets of @ref Marching::Scratch buffers shared by
+     *                           the workers. If it is zero or at least @a numWorkers, each
+     *                           worker keeps its own; otherwise workers take turns to use
+     *                           them for the marching phase of each bucket, so that the
+     *                           device memory does not grow with the number of workers.
+     * @param distanceStorage    How to store the signed distances (see @ref distanceStorageFor).
+     * @param boundary           Test used to clip the surface at the boundary (see @ref MlsBoundary).
      */
     DeviceWorkerGroup(
         std::size_t numWorkers, std::size_t spare,
@@ -285,7 +565,42 @@ public:
         std::size_t maxBucketSplats, Grid::size_type maxCells,
         std::size_t meshMemory,
         int levels, int subsampling, float boundaryLimit,
-        MlsShape shape);
+        MlsShape shape, cl_channel_type distanceType = CL_FLOAT,
+        SplatLayout splatLayout = SPLAT_LAYOUT_FULL,
+        bool hashWeld = false,
+        const DeviceTuning &tuning = DeviceTuning(),
+        const NormalEstimation &normalEstimation = NormalEstimation(),
+        float decimateCells = 0.0f,
+        bool sparseOctree = false,
+        std::size_t scratchSets = 0,
+        DistanceStorageChoice distanceStorage = DISTANCE_STORAGE_AUTO,
+        MlsBoundary boundary = MLS_BOUNDARY_MOMENTS);
+
+    /**
+     * Resolve a @ref DistanceStorageChoice for a specific device. If @a device
+     * is a null device, @ref DISTANCE_STORAGE_AUTO resolves to the
+     * storage needing the most memory, so that resource estimates are
+     * conservative.
+     */
+    static Marching::DistanceStorage distanceStorageFor(
+        const cl::Device &device, DistanceStorageChoice choice);
+
+    /**
+     * Choose the fastest @ref DeviceTuning for a device by timing a synthetic
+     * bucket with each of a small set of candidates. The arguments have the
+     * same meaning as for the constructor.
+     *
+     * If a cache directory has been set with @ref CLH::setProgramCacheDir,
+     * the result is cached there, keyed by the device, driver and arguments,
+     * and subsequent calls return the cached result without benchmarking.
+     */
+    static DeviceTuning autotune(
+        const cl::Context &context, const cl::Device &device,
+        std::size_t maxBucketSplats, Grid::size_type maxCells,
+        std::size_t meshMemory,
+        int levels, int subsampling, float boundaryLimit,
+        MlsShape shape, SplatLayout splatLayout = SPLAT_LAYOUT_FULL,
+        DistanceStorageChoice distanceStorage = DISTANCE_STORAGE_AUTO);
 
     /// Returns total resources that would be used by all workers and workitems
     static CLH::ResourceUsage resourceUsage(
@@ -293,7 +608,13 @@ public:
         const cl::Device &device,
         std::size_t maxBucketSplats, Grid::size_type maxCells,
         std::size_t meshMemory,
-        int levels);
+        int levels, cl_channel_type distanceType = CL_FLOAT,
+        SplatLayout splatLayout = SPLAT_LAYOUT_FULL,
+        bool hashWeld = false,
+        bool sparseOctree = false,
+        std::size_t scratchSets = 0,
+        DistanceStorageChoice distanceStorage = DISTANCE_STORAGE_AUTO,
+        bool scatter = false);
 
     /**
      * @copydoc WorkerGroup::start
@@ -308,6 +629,124 @@ public:
      */
     void setProgress(ProgressMeter *progress) { this->progress = progress; }
 
+    /**
+     * Sets a tracker that is told when each sub-item is done, after its
+     * meshes have been passed to the output.
+     */
+    void setChunkTracker(ChunkTracker *chunkTracker) { this->chunkTracker = chunkTracker; }
+
+    /**
+     * Sets a governor that each worker waits on (see @ref MemoryGovernor::wait)
+     * before processing an item. It may be @c NULL.
+     */
+    void setMemoryGovernor(MemoryGovernor *governor) { this->governor = governor; }
+
+    /**
+     * Set a cache of bucket meshes. Buckets whose meshes are in the cache
+     * are passed to @a hostOutput without being processed, and the meshes
+     * of other buckets are added to it. The @ref SubItem::cacheKey of each
+     * bucket must be set (see @ref CopyGroup::setBucketCache).
+     */
+    void setBucketCache(BucketCache *bucketCache, const HostOutputFunctor &hostOutput)
+    {
+        this->bucketCache = bucketCache;
+        this->hostOutput = hostOutput;
+    }
+
+    /**
+     * Build a single multi-root octree for all the sub-items of each work
+     * item (see @ref SplatTreeCL::enqueueBuild), instead of one octree per
+     * sub-item. This reduces launch overhead when buckets are small. It is
+     * ignored when normals are estimated, and falls back to separate octrees
+     * for items that do not fit.
+     */
+    void setBatchTrees(bool batchTrees) { this->batchTrees = batchTrees; }
+
+    /**
+     * Choose the octree subsampling shift for each bucket from its splat
+     * density (see @ref subsamplingFor), instead of always using the value
+     * passed to the constructor. That value becomes the coarsest shift used.
+     */
+    void setAdaptiveSubsampling(bool adaptive) { adaptiveSubsampling = adaptive; }
+
+    /**
+     * Average number of splats per octree leaf above which @ref subsamplingFor
+     * halves the leaf size.
+     */
+    static const std::size_t ADAPTIVE_LEAF_SPLATS = 32;
+
+    /**
+     * Octree subsampling shift to use for a bucket. Without
+     * @ref setAdaptiveSubsampling this is the value passed to the constructor.
+     * Otherwise the leaves are made finer while they would hold more than
+     * @ref ADAPTIVE_LEAF_SPLATS splats on average, to shorten the command
+     * lists walked by the MLS kernel, but never finer than
+     * @ref MlsFunctor::subsamplingMin or than allows the bucket to fit in the
+     * octree memory reserved by @ref resourceUsage. Sparse buckets thus keep
+     * the coarse leaves, which need a smaller start table.
+     *
+     * @param numSplats   Splats in the bucket.
+     * @param grid        Grid of the bucket (see @ref SubItem::grid).
+     */
+    unsigned int subsamplingFor(std::size_t numSplats, const Grid &grid) const;
+
+    /**
+     * Merge duplicate splats while building the octrees (see
+     * @ref SplatTreeCL::setMergeTolerance). This must be called before
+     * @ref start.
+     *
+     * @param tolerance   Largest difference in position or radius, in cells (0 to disable).
+     */
+    void setMergeSplats(float tolerance) { mergeTolerance = tolerance; }
+
+    /**
+     * Sample buckets with fewer than @a density splats per cell using
+     * @ref ScatterMlsFunctor, which only visits the corners that splats
+     * cover, instead of walking the octree from every corner. The octree is
+     * still built, for swathes that overflow @ref SCATTER_PAIRS. It is not
+     * used for batched octrees, with estimated normals or together with
+     * @ref setMergeSplats. This must be called before @ref start.
+     *
+     * @param density   Threshold in splats per cell (0 to disable).
+     */
+    void setScatterDensity(float density) { scatterDensity = density; }
+
+    /// Splat-corner pairs that each worker's @ref ScatterMlsFunctor holds
+    static const std::size_t SCATTER_PAIRS = 4 * 1024 * 1024;
+
+    /**
+     * Classify cells coarse-to-fine in @ref Marching (see
+     * @ref Marching::setTiledOccupancy). This must be called before @ref start.
+     */
+    void setTiledOccupancy(bool tiledOccupancy) { this->tiledOccupancy = tiledOccupancy; }
+
+    /**
+     * Reuse the last slice of samples of a bucket for the next bucket on the
+     * same worker when they are adjacent along Z (see
+     * @ref Marching::setCarrySlices). This must be called before @ref start.
+     */
+    void setCarrySlices(bool carrySlices) { this->carrySlices = carrySlices; }
+
+    /**
+     * Triangulate whole cubes rather than tetrahedra (see
+     * @ref Marching::setMarchingCubes). This must be called before @ref start.
+     */
+    void setMarchingCubes(bool marchingCubes) { this->marchingCubes = marchingCubes; }
+
+    /**
+     * Emit each vertex only from the cell that owns its edge (see
+     * @ref Marching::setOwnedEdges). This must be called before @ref start.
+     */
+    void setOwnedEdges(bool ownedEdges) { this->ownedEdges = ownedEdges; }
+
+    /**
+     * Set the output generators for the coarser levels of detail (see @ref
+     * BucketLoader::setLodLevels). Element L - 1 receives the meshes of
+     * level L, while level 0 goes to the generator passed to the constructor.
+     * This must be called before @ref start.
+     */
+    void setLodOutputs(const std::vector<OutputGenerator> &lodOutputs) { this->lodOutputs = lodOutputs; }
+
     /**
      * Set a condition variable that will be signaled when space becomes
      * available in the item pool. The condition will be signaled with
@@ -319,11 +758,43 @@ public:
         popCondition = condition;
     }
 
+    /**
+     * Set the groups for other devices. When the workers in this group are
+     * idle they will take queued items from these groups (work stealing).
+     * The list may include this group, which is ignored.
+     */
+    void setSiblings(const std::vector<DeviceWorkerGroup *> &siblings)
+    {
+        this->siblings = siblings;
+    }
+
+    /**
+     * Process queued items in order of chunk generation rather than in
+     * the order they were queued, so that the oldest open chunk is
+     * completed first. This also applies to items stolen from this group.
+     * This must be called before @ref start.
+     */
+    void setChunkPriority(bool chunkPriority);
+
     /**
      * @copydoc WorkerGroup::get
      */
     boost::shared_ptr<WorkItem> get(Timeplot::Worker &tworker, std::size_t size);
 
+    /**
+     * Account for @a numSplats splats placed in an item after it was
+     * obtained from @ref get. The total passed to @ref get and this
+     * function must match the splats in the item when it is pushed.
+     */
+    void reserve(std::size_t numSplats);
+
+    /**
+     * Obtains the next item to process. If the queue is empty and siblings
+     * have been set, it periodically tries to steal from them while waiting.
+     * It is called by the base class.
+     */
+    boost::shared_ptr<WorkItem> popItem(Worker &worker);
+
     /**
      * Determine whether @ref get will block.
      */
@@ -343,10 +814,219 @@ public:
 
     /// Return the maximum number of splats that can be copied to a work item
     std::size_t getMaxItemSplats() const { return maxBucketSplats; }
+    /// Return the throughput tracker, which must be informed of work pushed to the group
+    DeviceThroughput &getThroughput() { return throughput; }
     const cl::Context &getContext() const { return context; }
     const cl::Device &getDevice() const { return device; }
+    /// Return the layout in which splats must be copied to the work items
+    SplatLayout getSplatLayout() const { return splatLayout; }
+    /**
+     * Whether the work items are filled by mapping them instead of copying
+     * to them. This is the case if the device reports @c
+     * CL_DEVICE_HOST_UNIFIED_MEMORY, or if @ref setDirectUpload was enabled
+     * when the group was constructed.
+     */
+    bool isZeroCopy() const { return zeroCopy; }
+
+    /**
+     * Set whether groups constructed afterwards fill the work items of
+     * discrete devices by mapping them, as for devices that share memory
+     * with the host. Where the device supports @c cl_amd_device_memory_flags
+     * the splats are kept in host-visible device memory, so that they are
+     * written across the bus as they are converted instead of being staged
+     * in host memory and then copied. Elsewhere they are placed in memory
+     * allocated by the driver for mapping, which at least removes the
+     * separate staging buffers of @ref CopyGroup.
+     */
+    static void setDirectUpload(bool direct);
     const cl::CommandQueue &getCopyQueue() const { return copyQueue; }
     Statistics::Variable &getGetStat() const { return getStat; }
+    Statistics::Throughput &getUploadStat() const { return uploadStat; }
+};
+
+class HostWorkerGroup;
+
+class HostWorkerGroupBase
+{
+public:
+    typedef DeviceWorkerGroupBase::SubItem SubItem;
+
+    /// Data about multiple buckets that share a single buffer.
+    struct WorkItem
+    {
+        /// Data for individual buckets
+        Statistics::Container::vector<SubItem> subItems;
+        /// Backing store for splats, in the layout used by the devices
+        Statistics::Container::vector<char> splats;
+
+        WorkItem(std::size_t maxItemSplats, SplatLayout layout)
+            : subItems("mem.HostWorkerGroup.subItems"),
+            splats("mem.HostWorkerGroup.splats", maxItemSplats * splatDeviceSize(layout))
+        {
+        }
+    };
+
+    class Worker : public WorkerBase
+    {
+    private:
+        HostWorkerGroup &owner;
+        HostMls mls;
+        HostMarching marching;
+        std::vector<Splat> splats;     ///< Splats of the current bucket
+        std::vector<float> field;      ///< Signed distances for the current bucket
+
+        /// Update the progress and free space once a bucket is done
+        void finishSub(const SubItem &sub);
+
+    public:
+        typedef void result_type;
+
+        Worker(HostWorkerGroup &owner, float boundaryLimit, MlsShape shape, int idx);
+
+        void start();
+
+        void operator()(WorkItem &work);
+    };
+};
+
+/**
+ * Computes meshes with the CPU rather than an OpenCL device, so that CPU
+ * cores add to the throughput of the devices. It receives batches from
+ * @ref CopyGroup in the same way as @ref DeviceWorkerGroup, and is scheduled
+ * alongside the devices by its measured throughput. Each worker thread
+ * processes one bucket at a time, using @ref HostMls and @ref HostMarching,
+ * and passes the meshes downstream through a
+ * @ref DeviceWorkerGroup::HostOutputFunctor.
+ *
+ * Normal estimation and decimation are not supported.
+ */
+class HostWorkerGroup :
+    protected HostWorkerGroupBase,
+    public WorkerGroup<HostWorkerGroupBase::WorkItem, HostWorkerGroupBase::Worker, HostWorkerGroup>,
+    public CopyTarget
+{
+private:
+    typedef WorkerGroup<HostWorkerGroupBase::WorkItem, HostWorkerGroupBase::Worker, HostWorkerGroup> Base;
+
+    ProgressMeter *progress;
+    ChunkTracker *chunkTracker;       ///< Told when each sub-item is done, or @c NULL
+    MemoryGovernor *governor;         ///< Waited on before each item, or @c NULL
+    DeviceWorkerGroup::HostOutputFunctor output;
+    BucketCache *bucketCache;         ///< Cache of bucket meshes, or @c NULL
+    bool marchingCubes;               ///< Whether @ref HostMarching triangulates whole cubes
+
+    Grid fullGrid;
+    const unsigned int subsampling;
+    const MlsBoundary boundary;       ///< Boundary test for @ref HostMls
+    const SplatLayout splatLayout;    ///< Layout of splats in the work items
+    const std::size_t maxItemSplats;
+
+    /// Pool of unused buffers to be recycled
+    WorkQueue<boost::shared_ptr<WorkItem> > itemPool;
+
+    /// Mutex held while signaling @ref popCondition
+    boost::mutex *popMutex;
+
+    /// Condition signaled when items are added to the pool (may be @c NULL)
+    boost::condition_variable *popCondition;
+
+    /// Number of spare splats in the work items.
+    std::size_t unallocated_;
+    /// Mutex protecting @ref unallocated_.
+    boost::mutex unallocatedMutex;
+
+    /// Measured performance, used by @ref CopyGroup to choose a target
+    DeviceThroughput throughput;
+
+    friend class HostWorkerGroupBase::Worker;
+
+public:
+    typedef HostWorkerGroupBase::WorkItem WorkItem;
+    typedef HostWorkerGroupBase::SubItem SubItem;
+
+    /**
+     * Constructor.
+     *
+     * @param numWorkers      Number of worker threads.
+     * @param spare           Number of extra slots (beyond @a numWorkers) for items.
+     * @param output          Receives the meshes.
+     * @param maxItemSplats   Space to allocate for the splats of one item.
+     * @param subsampling     Octree subsampling level (see @ref HostMls).
+     * @param boundaryLimit   Tuning factor for boundary pruning.
+     * @param shape           The shape to fit to the data.
+     * @param splatLayout     Layout in which @ref CopyGroup writes the splats.
+     * @param boundary        Test used to clip the surface at the boundary.
+     */
+    HostWorkerGroup(
+        std::size_t numWorkers, std::size_t spare,
+        const DeviceWorkerGroup::HostOutputFunctor &output,
+        std::size_t maxItemSplats,
+        int subsampling, float boundaryLimit, MlsShape shape,
+        SplatLayout splatLayout = SPLAT_LAYOUT_FULL,
+        MlsBoundary boundary = MLS_BOUNDARY_MOMENTS);
+
+    /**
+     * @copydoc WorkerGroup::start
+     *
+     * @param fullGrid  The bounding box grid.
+     */
+    void start(const Grid &fullGrid);
+
+    /**
+     * Sets a progress display that will be updated by the number of cells
+     * processed.
+     */
+    void setProgress(ProgressMeter *progress) { this->progress = progress; }
+
+    /**
+     * Sets a tracker that is told when each sub-item is done, after its
+     * meshes have been passed to the output.
+     */
+    void setChunkTracker(ChunkTracker *chunkTracker) { this->chunkTracker = chunkTracker; }
+
+    /// See @ref DeviceWorkerGroup::setMemoryGovernor.
+    void setMemoryGovernor(MemoryGovernor *governor) { this->governor = governor; }
+
+    /// Set a cache of bucket meshes (see @ref DeviceWorkerGroup::setBucketCache).
+    void setBucketCache(BucketCache *bucketCache) { this->bucketCache = bucketCache; }
+
+    /// See @ref DeviceWorkerGroup::setMarchingCubes.
+    void setMarchingCubes(bool marchingCubes) { this->marchingCubes = marchingCubes; }
+
+    /// See @ref DeviceWorkerGroup::setPopCondition.
+    void setPopCondition(boost::mutex *mutex, boost::condition_variable *condition)
+    {
+        popMutex = mutex;
+        popCondition = condition;
+    }
+
+    /**
+     * @copydoc WorkerGroup::get
+     */
+    boost::shared_ptr<WorkItem> get(Timeplot::Worker &tworker, std::size_t size);
+
+    /// See @ref DeviceWorkerGroup::reserve.
+    void reserve(std::size_t numSplats);
+
+    /**
+     * Determine whether @ref get will block.
+     */
+    virtual bool canGet();
+
+    /**
+     * Returns the item to the pool. It is called by the base class.
+     */
+    void freeItem(boost::shared_ptr<WorkItem> item);
+
+    /// See @ref DeviceWorkerGroup::unallocated.
+    virtual std::size_t unallocated();
+
+    /// Return the maximum number of splats that can be copied to a work item
+    std::size_t getMaxItemSplats() const { return maxItemSplats; }
+    /// Return the layout in which splats must be written to work items
+    SplatLayout getSplatLayout() const { return splatLayout; }
+    /// Return the throughput tracker, which must be informed of work pushed to the group
+    virtual DeviceThroughput &getThroughput() { return throughput; }
 };
 
 class CopyGroup;
@@ -359,8 +1039,16 @@ public:
     {
         ChunkId chunkId;
         Grid grid;
-        CircularBuffer::Allocation splats;  ///< Allocation from @ref CopyGroup::splatBuffer
+        LockFreeCircularBuffer::Allocation splats;  ///< Allocation from @ref CopyGroup::splatBuffer
         std::size_t numSplats;              ///< Number of splats in the bin
+        unsigned int level;                 ///< Grid coarsening level (see @ref BucketLoader::setAdaptive)
+        unsigned int lod;                   ///< Level of detail (see @ref BucketLoader::setLodLevels)
+        /**
+         * Whether the bin is a slab of a larger bucket (see @ref
+         * BucketLoader::setSplit). It is then sent to a device on its own,
+         * so that the slabs can be spread over several devices.
+         */
+        bool split;
 
         Splat *getSplats() const { return (Splat *) splats.get(); }
     };
@@ -369,12 +1057,56 @@ public:
     {
     private:
         CopyGroup &owner;
-        CLH::PinnedMemory<Splat> pinned;  ///< Staging area for copies
+        /**
+         * Staging areas for copies, in the device layout. They are filled in
+         * rotation, so that the copy from one runs while the next is filled.
+         */
+        boost::ptr_vector<CLH::PinnedMemory<char> > pinned;
+        /**
+         * When the devices share memory with the host, the item that is
+         * being filled in place. It is obtained when the first bin of a
+         * batch arrives and is mapped at @ref directPtr. Otherwise it is
+         * not used.
+         */
+        boost::shared_ptr<DeviceWorkerGroup::WorkItem> directItem;
+        DeviceWorkerGroup *directGroup;   ///< Group owning @ref directItem
+        /**
+         * When the batch being filled is for the @ref HostWorkerGroup, the
+         * item receiving it. In the shared-memory case it is filled in
+         * place and @ref directPtr points to it. Otherwise it is only used
+         * while flushing.
+         */
+        boost::shared_ptr<HostWorkerGroup::WorkItem> hostItem;
+        char *directPtr;                  ///< Host mapping of @ref directItem or @ref hostItem splats
+        /// Events signaled when the copy from the corresponding element of @ref pinned completes
+        std::vector<cl::Event> pinnedEvents;
+        std::size_t current;              ///< Element of @ref pinned currently being filled
         /**
          * Bins that have been saved up but not yet flushed to the device.
          */
         Statistics::Container::vector<DeviceWorkerGroup::SubItem> bufferedItems;
-        std::size_t bufferedSplats;       ///< Number of splats stored in @ref pinned
+        std::size_t bufferedSplats;       ///< Number of splats stored in @ref current
+        const std::size_t splatSize;      ///< Bytes per splat in @ref pinned
+
+        /// Wait until the copy (if any) from element @a index of @ref pinned is complete
+        void waitPinned(std::size_t index);
+
+        /**
+         * Choose the device or host group to receive a batch, waiting until
+         * one is free. See @ref CopyGroup for the policy.
+         *
+         * @a popLock must hold @ref CopyGroup::popMutex, and still holds
+         * it on return, so that the caller can take the free item before any
+         * other thread does.
+         */
+        CopyTarget *chooseDevice(std::size_t numSplats, std::tr1::uint64_t numCells,
+                                 boost::unique_lock<boost::mutex> &popLock);
+
+        /**
+         * Obtain and map @ref directItem (or obtain @ref hostItem), using
+         * @a work to choose the target.
+         */
+        void beginDirect(const WorkItem &work);
 
     public:
         typedef void result_type;
@@ -383,13 +1115,29 @@ public:
 
         void flush();   ///< Flush items in @ref bufferedItems to the output
         void operator()(WorkItem &work);
-        void stop() { flush(); }
+        void stop();
     };
 };
 
 /**
  * A worker object that copies bins of data to the GPU. It receives data from
- * @ref BucketLoader and sends it to the next available @ref DeviceWorkerGroup.
+ * @ref BucketLoader and sends it to one of the @ref DeviceWorkerGroup objects.
+ *
+ * The device is chosen by its measured throughput (see @ref DeviceThroughput):
+ * each batch goes to the device expected to finish it first, taking into
+ * account work already queued. If that device is busy, the batch is held back
+ * for it unless a free device is expected to finish it nearly as soon. This
+ * sends large buckets to faster devices and keeps the tail of the run off the
+ * slower ones.
+ *
+ * Normally the splats are converted into pinned staging buffers and then
+ * copied to the device. If every device is filled by mapping (see
+ * @ref DeviceWorkerGroup::isZeroCopy), the device is chosen when a batch
+ * starts and the splats are converted straight into its mapped work item,
+ * so that no staging buffers or copies are needed.
+ *
+ * A @ref HostWorkerGroup may also be added with @ref setHostGroup, in which
+ * case it competes for batches with the devices under the same policy.
  */
 class CopyGroup :
     protected CopyGroupBase,
@@ -403,10 +1151,15 @@ public:
      * Constructor.
      * @param outGroups       Target devices. The first is used for allocating pinned memory.
      * @param maxQueueSplats  Splats to store in the internal queue.
+     * @param numPinned       Number of pinned staging buffers. With more than one, the
+     *                        upload of one batch overlaps with filling the next.
+     *
+     * @pre @a numPinned is at least 1.
      */
     CopyGroup(
         const std::vector<DeviceWorkerGroup *> &outGroups,
-        std::size_t maxQueueSplats);
+        std::size_t maxQueueSplats,
+        std::size_t numPinned = 2);
 
     /**
      * @copydoc WorkerGroup::get
@@ -416,16 +1169,54 @@ public:
         boost::shared_ptr<WorkItem> item = BaseType::get(tworker, size);
         item->splats = splatBuffer.allocate(tworker, size * sizeof(Splat), &getStat);
         item->numSplats = size;
+        item->split = false;
         return item;
     }
 
     /// Statistic for timing @c clEnqueueWriteBuffer
     Statistics::Variable &getWriteStat() const { return writeStat; }
 
+    /**
+     * Set a cache used to compute @ref DeviceWorkerGroup::SubItem::cacheKey
+     * for each bucket. It should also be passed to
+     * @ref DeviceWorkerGroup::setBucketCache for each output group.
+     */
+    void setBucketCache(const BucketCache *bucketCache) { this->bucketCache = bucketCache; }
+
+    /**
+     * Add a group that computes meshes on the host. It must use the same
+     * splat layout as the devices, and hold at least as many splats per
+     * item. It is scheduled alongside the devices.
+     */
+    void setHostGroup(HostWorkerGroup *hostGroup);
+
+    /**
+     * Copy queued bins in order of chunk generation rather than in the
+     * order they were queued (see @ref DeviceWorkerGroup::setChunkPriority).
+     * This must be called before @ref start.
+     */
+    void setChunkPriority(bool chunkPriority);
+
+    /**
+     * Send bins that fill at least half of a work item to a device on their
+     * own, rather than packing them with smaller bins. A large bin then
+     * starts on whichever device is free first instead of waiting for the
+     * batch it would have closed, and small bins are not held up behind it.
+     * Small bins are still packed as tightly as the items allow.
+     */
+    void setAdaptivePacking(bool adaptivePacking) { this->adaptivePacking = adaptivePacking; }
+
 private:
     const std::vector<DeviceWorkerGroup *> outGroups;
+    HostWorkerGroup *hostGroup;                ///< Group computing on the host, or @c NULL
+    std::vector<CopyTarget *> targets;         ///< @ref outGroups and @ref hostGroup, if any
     const std::size_t maxDeviceItemSplats;     ///< Maximum splats to send to the device in one go
-    CircularBuffer splatBuffer;                ///< Buffer holding incoming splats
+    const SplatLayout splatLayout;             ///< Layout of splats on the devices
+    const std::size_t numPinned;               ///< Number of staging buffers per worker
+    const bool zeroCopy;                       ///< Whether splats are written directly to the devices
+    const BucketCache *bucketCache;            ///< Cache for which keys are computed, or @c NULL
+    bool adaptivePacking;                      ///< See @ref setAdaptivePacking
+    LockFreeCircularBuffer splatBuffer;        ///< Buffer holding incoming splats (filled only by the loader)
 
     boost::mutex popMutex;                     ///< Mutex held while checking for device to target
     boost::condition_variable popCondition;    ///< Condition signalled by devices when space available
@@ -433,6 +1224,13 @@ private:
     Statistics::Variable &writeStat;           ///< See @ref getWriteStat
     Statistics::Variable &splatsStat;          ///< Number of splats per bin
     Statistics::Variable &sizeStat;            ///< Size of bins
+    Statistics::Counter &holdBackStat;         ///< Times a batch was held back for a busy device
+
+    /**
+     * A free device is used in preference to waiting for a busy one unless
+     * its estimated finish time is more than this factor worse.
+     */
+    static const double holdBackRatio;
 
     friend class CopyGroupBase::Worker;
 };
@@ -514,4 +1312,28 @@ DeviceWorkerGroup::OutputGenerator makeOutputGenerator(T &outGroup)
     return OutputGeneratorBuilder<T>(outGroup);
 }
 
+/**
+ * Implementation of @ref DeviceWorkerGroup::HostOutputFunctor that copies
+ * the mesh into an item of the output group.
+ */
+template<typename OutGroup>
+void pushHostMesh(OutGroup &outGroup, const ChunkId &chunkId,
+                  Timeplot::Worker &tworker, const HostKeyMesh &mesh)
+{
+    boost::shared_ptr<typename OutGroup::WorkItem> item = outGroup.get(tworker, mesh.getHostBytes());
+    item->work.mesh = HostKeyMesh(item->alloc.get(), mesh);
+    std::copy(mesh.vertexKeys, mesh.vertexKeys + mesh.numExternalVertices(), item->work.mesh.vertexKeys);
+    std::copy(mesh.vertices, mesh.vertices + mesh.numVertices(), item->work.mesh.vertices);
+    std::copy(mesh.triangles, mesh.triangles + mesh.numTriangles(), item->work.mesh.triangles);
+    item->work.chunkId = chunkId;
+    item->work.hasEvents = false;
+    outGroup.push(tworker, item);
+}
+
+template<typename T>
+DeviceWorkerGroup::HostOutputFunctor makeHostOutput(T &outGroup)
+{
+    return boost::bind(&pushHostMesh<T>, boost::ref(outGroup), _1, _2, _3);
+}
+
 #endif /* !WORKERS_H */
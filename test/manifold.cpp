@@ -28,6 +28,14 @@
 # include <config.h>
 #endif
 
+#include <vector>
+#include <string>
+#include <sstream>
+#include <utility>
+#include <algorithm>
+#include <limits>
+#include "../src/tr1_cstdint.h"
+#include "../src/union_find.h"
 #include "manifold.h"
 
 namespace Manifold
@@ -37,4 +45,309 @@ Metadata::Metadata() : numVertices(0), numTriangles(0), numComponents(0), numBou
 {
 }
 
+namespace
+{
+
+typedef std::tr1::uint32_t index_type;
+typedef std::pair<index_type, index_type> Edge;
+
+/// Whether a triangle passes the checks of @ref triangleError
+inline bool validTriangle(const Triangle &triangle, std::size_t numVertices)
+{
+    return triangle[0] < numVertices && triangle[1] < numVertices && triangle[2] < numVertices
+        && triangle[0] != triangle[1] && triangle[1] != triangle[2] && triangle[2] != triangle[0];
+}
+
+/**
+ * Explain why a triangle is invalid, checking in the same order as @ref
+ * isManifold.
+ *
+ * @pre <code>!validTriangle(triangle, numVertices)</code>
+ */
+std::string triangleError(const Triangle &triangle, std::size_t id, std::size_t numVertices)
+{
+    std::ostringstream reason;
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        const index_type a = triangle[j];
+        const index_type b = triangle[(j + 1) % 3];
+        if (a >= numVertices)
+        {
+            reason << "Triangle " << id << " contains out-of-range index " << a << "\n";
+            break;
+        }
+        if (a == b)
+        {
+            reason << "Triangle " << id << " contains vertex " << a << " twice\n";
+            break;
+        }
+    }
+    return reason.str();
+}
+
+/// Compare edges by the first vertex only
+bool edgeFirstLess(const Edge &a, const Edge &b)
+{
+    return a.first < b.first;
+}
+
+/**
+ * Replace @a x by the end of the edge starting at @a x, if there is one.
+ *
+ * @param arrow  Edges sorted by first vertex, with no first vertex repeated
+ * @return Whether there was such an edge.
+ */
+bool followArrow(const std::vector<Edge> &arrow, index_type &x)
+{
+    std::vector<Edge>::const_iterator pos = std::lower_bound(
+        arrow.begin(), arrow.end(), Edge(x, 0), edgeFirstLess);
+    if (pos == arrow.end() || pos->first != x)
+        return false;
+    x = pos->second;
+    return true;
+}
+
+/**
+ * Check the edges opposite vertex @a i, in the same order as @ref isManifold.
+ *
+ * @param i            The vertex
+ * @param neigh        Opposite edges, in triangle order
+ * @param[out] ends    Endpoints of the boundary runs through @a i, to be
+ *                     merged with @a i to count boundary loops
+ * @return An explanation, or the empty string if the neighbourhood is valid.
+ */
+std::string checkVertex(std::size_t i, const std::vector<Edge> &neigh, std::vector<Edge> &ends)
+{
+    std::ostringstream reason;
+    if (neigh.empty())
+    {
+        reason << "Vertex " << i << " is isolated\n";
+        return reason.str();
+    }
+
+    // Sorted copies for lookups, so that large fans do not take quadratic time
+    std::vector<Edge> arrow(neigh);
+    std::sort(arrow.begin(), arrow.end(), edgeFirstLess);
+    std::vector<index_type> seen(neigh.size());
+    for (std::size_t j = 0; j < neigh.size(); j++)
+        seen[j] = neigh[j].second;
+    std::sort(seen.begin(), seen.end());
+
+    bool repeated = false;
+    for (std::size_t j = 1; j < neigh.size(); j++)
+        if (arrow[j - 1].first == arrow[j].first || seen[j - 1] == seen[j])
+            repeated = true;
+    if (repeated)
+    {
+        // Only on failure: find the first repeat in the original order
+        for (std::size_t j = 0; j < neigh.size(); j++)
+        {
+            for (std::size_t k = 0; k < j; k++)
+                if (neigh[k].first == neigh[j].first)
+                {
+                    reason << "Edge " << i << " - " << neigh[j].first << " occurs twice with same winding\n";
+                    return reason.str();
+                }
+            for (std::size_t k = 0; k < j; k++)
+                if (neigh[k].second == neigh[j].second)
+                {
+                    reason << "Edge " << neigh[j].second << " - " << i << " occurs twice with same winding\n";
+                    return reason.str();
+                }
+        }
+        assert(false);
+    }
+
+    std::size_t len = 0;
+    for (std::size_t j = 0; j < neigh.size(); j++)
+    {
+        if (!std::binary_search(seen.begin(), seen.end(), neigh[j].first))
+        {
+            const index_type first = neigh[j].first;
+            index_type cur = first;
+            while (followArrow(arrow, cur))
+                len++;
+            ends.push_back(Edge(first, i));
+            ends.push_back(Edge(cur, i));
+        }
+    }
+    if (len != 0 && len != neigh.size())
+    {
+        reason << "Vertex " << i << " is both in the interior and on the boundary\n";
+        return reason.str();
+    }
+    else if (len == 0)
+    {
+        /* Every target is also a source here (the in- and out-degrees are
+         * at most one and nothing starts a line), so the arrow always exists.
+         */
+        const index_type start = neigh[0].first;
+        index_type cur = start;
+        do
+        {
+            followArrow(arrow, cur);
+            len++;
+        } while (cur != start);
+        if (len != neigh.size())
+        {
+            reason << "Vertex " << i << " tunnels between interior regions\n";
+            return reason.str();
+        }
+    }
+    return "";
+}
+
+/**
+ * Implementation of @ref isManifoldParallel once the triangles are known to
+ * be valid. @a CornerId must be able to hold three times the number of
+ * triangles.
+ */
+template<typename CornerId>
+std::string checkVertices(std::size_t numVertices, const std::vector<Triangle> &triangles, Metadata &out)
+{
+    typedef std::tr1::int64_t signed_type;
+    const signed_type numTriangles = triangles.size();
+    const signed_type nv = numVertices;
+
+    // Counting sort of corners by vertex
+    std::vector<std::tr1::uint64_t> start(numVertices + 1, 0);
+#pragma omp parallel for schedule(static)
+    for (signed_type t = 0; t < numTriangles; t++)
+        for (unsigned int j = 0; j < 3; j++)
+            __atomic_fetch_add(&start[triangles[t][j] + 1], 1, __ATOMIC_RELAXED);
+    for (std::size_t i = 0; i < numVertices; i++)
+        start[i + 1] += start[i];
+
+    std::vector<CornerId> corners(3 * triangles.size());
+    {
+        std::vector<std::tr1::uint64_t> pos(start.begin(), start.end() - 1);
+#pragma omp parallel for schedule(static)
+        for (signed_type t = 0; t < numTriangles; t++)
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                std::tr1::uint64_t p = __atomic_fetch_add(&pos[triangles[t][j]], 1, __ATOMIC_RELAXED);
+                corners[p] = CornerId(3 * t + j);
+            }
+    }
+
+    // Components
+    {
+        std::vector<UnionFind::Concurrent::Node<signed_type> > components(numVertices);
+#pragma omp parallel for schedule(static)
+        for (signed_type t = 0; t < numTriangles; t++)
+        {
+            UnionFind::Concurrent::merge(components, triangles[t][0], triangles[t][1]);
+            UnionFind::Concurrent::merge(components, triangles[t][1], triangles[t][2]);
+        }
+        std::size_t numComponents = 0;
+#pragma omp parallel for schedule(static) reduction(+:numComponents)
+        for (signed_type i = 0; i < nv; i++)
+            if (components[i].isRoot())
+                numComponents++;
+        out.numComponents = numComponents;
+    }
+
+    // Vertex neighbourhoods. Only the first failure (by vertex) is reported.
+    signed_type firstBad = nv;
+    std::string firstReason;
+    std::vector<Edge> ends;
+#pragma omp parallel
+    {
+        std::vector<Edge> neigh, localEnds;
+        signed_type localBad = nv;
+        std::string localReason;
+#pragma omp for schedule(dynamic, 4096)
+        for (signed_type i = 0; i < nv; i++)
+        {
+            if (i > localBad)
+                continue;
+            // Corner IDs sort into triangle order, which is the order isManifold sees them
+            std::sort(corners.begin() + start[i], corners.begin() + start[i + 1]);
+            neigh.clear();
+            for (std::tr1::uint64_t k = start[i]; k < start[i + 1]; k++)
+            {
+                const Triangle &tri = triangles[corners[k] / 3];
+                const unsigned int j = corners[k] % 3;
+                neigh.push_back(Edge(tri[(j + 1) % 3], tri[(j + 2) % 3]));
+            }
+            std::string reason = checkVertex(i, neigh, localEnds);
+            if (!reason.empty())
+            {
+                localBad = i;
+                localReason = reason;
+            }
+        }
+#pragma omp critical
+        {
+            if (localBad < firstBad)
+            {
+                firstBad = localBad;
+                firstReason = localReason;
+            }
+            ends.insert(ends.end(), localEnds.begin(), localEnds.end());
+        }
+    }
+    if (firstBad < nv)
+        return firstReason;
+
+    // Count boundaries. There are few boundary vertices, so this is serial.
+    std::vector<UnionFind::Node<signed_type> > boundaries(numVertices);
+    std::vector<index_type> touched;
+    touched.reserve(2 * ends.size());
+    for (std::size_t i = 0; i < ends.size(); i++)
+    {
+        UnionFind::merge(boundaries, ends[i].first, ends[i].second);
+        touched.push_back(ends[i].first);
+        touched.push_back(ends[i].second);
+    }
+    // Only merged vertices can be roots of components larger than one
+    std::sort(touched.begin(), touched.end());
+    touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+    for (std::size_t i = 0; i < touched.size(); i++)
+        if (boundaries[touched[i]].isRoot() && boundaries[touched[i]].size() >= 3)
+            out.numBoundaries++;
+    return "";
+}
+
+} // anonymous namespace
+
+std::string isManifoldParallel(
+    std::size_t numVertices,
+    const std::vector<Triangle> &triangles,
+    Metadata *data)
+{
+    typedef std::tr1::int64_t signed_type;
+    const signed_type numTriangles = triangles.size();
+
+    if (data != NULL)
+        *data = Metadata();
+    Metadata out;
+    out.numVertices = numVertices;
+    out.numTriangles = triangles.size();
+
+    // Triangles: report the first invalid one
+    signed_type firstBad = numTriangles;
+#pragma omp parallel
+    {
+        signed_type localBad = numTriangles;
+#pragma omp for schedule(static)
+        for (signed_type t = 0; t < numTriangles; t++)
+            if (t < localBad && !validTriangle(triangles[t], numVertices))
+                localBad = t;
+#pragma omp critical
+        firstBad = std::min(firstBad, localBad);
+    }
+    if (firstBad < numTriangles)
+        return triangleError(triangles[firstBad], firstBad, numVertices);
+
+    std::string reason;
+    if (3 * triangles.size() <= std::numeric_limits<std::tr1::uint32_t>::max())
+        reason = checkVertices<std::tr1::uint32_t>(numVertices, triangles, out);
+    else
+        reason = checkVertices<std::tr1::uint64_t>(numVertices, triangles, out);
+    if (reason.empty() && data != NULL)
+        *data = out;
+    return reason;
+}
+
 } // namespace Manifold
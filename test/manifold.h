@@ -40,6 +40,7 @@
 #include <sstream>
 #include <cassert>
 #include "../src/tr1_cstdint.h"
+#include <boost/array.hpp>
 #include <boost/type_traits/make_signed.hpp>
 #include "../src/union_find.h"
 
@@ -231,6 +232,29 @@ std::string isManifold(std::size_t numVertices, InputIterator first, InputIterat
     return "";
 }
 
+/// A triangle as stored by @ref isManifoldParallel
+typedef boost::array<std::tr1::uint32_t, 3> Triangle;
+
+/**
+ * Multi-threaded equivalent of @ref isManifold for a mesh held in memory. It
+ * gives the same result and, if the mesh is not manifold, the same
+ * explanation (the one for the first offending triangle or vertex).
+ *
+ * The triangles around each vertex are found with a counting sort into a
+ * compressed vertex-to-corner table rather than a vector per vertex, and
+ * components are found with @ref UnionFind::Concurrent. This makes the
+ * working memory about 8&ndash;12 bytes per triangle corner plus 16 bytes per
+ * vertex, in addition to the triangles themselves.
+ *
+ * @param numVertices  The number of vertices referenced by the triangles.
+ * @param triangles    The triangles.
+ * @param[out] data    As for @ref isManifold.
+ */
+std::string isManifoldParallel(
+    std::size_t numVertices,
+    const std::vector<Triangle> &triangles,
+    Metadata *data = NULL);
+
 } // namespace Manifold
 
 #endif /* !MANIFOLD_H */
@@ -46,7 +46,8 @@ void MemoryWriter::openImpl(const boost::filesystem::path &filename)
 {
     curOutput = &outputs[filename.string()];
     // Clear any previous data that might have been written
-    curOutput->clear();
+    if (getTruncate())
+        curOutput->clear();
 }
 
 void MemoryWriter::closeImpl()
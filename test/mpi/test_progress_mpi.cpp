@@ -43,6 +43,7 @@ class TestProgressMPI : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestProgressMPI);
     CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testWindow);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -52,7 +53,11 @@ public:
 private:
     MPI_Comm comm;
 
-    void testSimple();
+    /// Report progress from every process, optionally through a window
+    void run(MPI_Win win);
+
+    void testSimple();   ///< Test updates sent as messages
+    void testWindow();   ///< Test updates sent through a @ref ProgressMPI::Window
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestProgressMPI, TestSet::perBuild());
 
@@ -68,7 +73,7 @@ void TestProgressMPI::tearDown()
     MPI_Barrier(MPI_COMM_WORLD);
 }
 
-void TestProgressMPI::testSimple()
+void TestProgressMPI::run(MPI_Win win)
 {
     int rank, size;
     const ProgressMeter::size_type total = UINT64_C(100000000000);
@@ -85,7 +90,7 @@ void TestProgressMPI::testSimple()
     if (rank == 0)
         parent.reset(new ProgressDisplay(total, output));
 
-    ProgressMPI progress(parent.get(), total, MPI_COMM_WORLD, 0);
+    ProgressMPI progress(parent.get(), total, comm, 0, win);
     if (rank == 0)
         thread.reset(new boost::thread(boost::ref(progress)));
 
@@ -112,3 +117,14 @@ void TestProgressMPI::testSimple()
             output.str());
     }
 }
+
+void TestProgressMPI::testSimple()
+{
+    run(MPI_WIN_NULL);
+}
+
+void TestProgressMPI::testWindow()
+{
+    ProgressMPI::Window window(comm, 0);
+    run(window.get());
+}
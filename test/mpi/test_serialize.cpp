@@ -62,6 +62,7 @@ class TestSerialize : public CppUnit::TestFixture
     SERIALIZE_TEST(testGrid);
     SERIALIZE_TEST(testChunkId);
     SERIALIZE_TEST(testSubset);
+    SERIALIZE_TEST(testBins);
     SERIALIZE_TEST(testMesherWork);
     CPPUNIT_TEST(testBroadcastString);
     CPPUNIT_TEST(testBroadcastPath);
@@ -81,6 +82,8 @@ private:
     void testChunkIdRecv(MPI_Comm comm, int source);
     void testSubsetSend(MPI_Comm comm, int dest);
     void testSubsetRecv(MPI_Comm comm, int source);
+    void testBinsSend(MPI_Comm comm, int dest);
+    void testBinsRecv(MPI_Comm comm, int source);
     void testMesherWorkSend(MPI_Comm comm, int dest);
     void testMesherWorkRecv(MPI_Comm comm, int source);
     void testBroadcastString();
@@ -180,6 +183,45 @@ void TestSerialize::testSubsetRecv(MPI_Comm comm, int source)
     MLSGPU_ASSERT_EQUAL(UINT64_C(1000000000000), ranges[2].second);
 }
 
+void TestSerialize::testBinsSend(MPI_Comm comm, int dest)
+{
+    const float ref[3] = {1.0f, 2.0f, 3.0f};
+    BucketCollector::Bin bins[3];
+    for (int i = 0; i < 3; i++)
+    {
+        bins[i].ranges.addRange(100 * i, 100 * i + 10 + i);
+        bins[i].ranges.flush();
+        bins[i].chunkId.gen = 10 + i;
+        bins[i].chunkId.coords[0] = i;
+        bins[i].grid = Grid(ref, 0.5f, i, 10 + i, 0, 1, -1 - i, 0);
+    }
+    // The middle bin has no splats, so that empty subsets are covered
+    bins[1].ranges = SplatSet::SubsetBase();
+
+    Serialize::send(bins, 3, comm, dest);
+}
+
+void TestSerialize::testBinsRecv(MPI_Comm comm, int source)
+{
+    BucketCollector::Bin bins[3];
+
+    Serialize::recv(bins, 3, comm, source);
+
+    MLSGPU_ASSERT_EQUAL(10, bins[0].chunkId.gen);
+    MLSGPU_ASSERT_EQUAL(12, bins[2].chunkId.gen);
+    MLSGPU_ASSERT_EQUAL(2, bins[2].chunkId.coords[0]);
+    MLSGPU_ASSERT_EQUAL(10, bins[0].ranges.numSplats());
+    MLSGPU_ASSERT_EQUAL(0, bins[1].ranges.numSplats());
+    MLSGPU_ASSERT_EQUAL(12, bins[2].ranges.numSplats());
+    MLSGPU_ASSERT_EQUAL(1, bins[2].ranges.numRanges());
+    MLSGPU_ASSERT_EQUAL(200, bins[2].ranges.begin()->first);
+    MLSGPU_ASSERT_EQUAL(0.5f, bins[1].grid.getSpacing());
+    MLSGPU_ASSERT_EQUAL(3.0f, bins[1].grid.getReference()[2]);
+    MLSGPU_ASSERT_EQUAL(1, bins[1].grid.getExtent(0).first);
+    MLSGPU_ASSERT_EQUAL(12, bins[2].grid.getExtent(0).second);
+    MLSGPU_ASSERT_EQUAL(-3, bins[2].grid.getExtent(2).first);
+}
+
 void TestSerialize::testMesherWorkSend(MPI_Comm comm, int dest)
 {
     // TODO: also need to test the interaction with events. But I'm not sure
@@ -30,6 +30,8 @@
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/ref.hpp>
 #include <boost/iostreams/device/null.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <memory>
@@ -41,6 +43,7 @@
 #include "../../src/grid.h"
 #include "../../src/splat.h"
 #include "../../src/splat_set_mpi.h"
+#include "../../src/file_stripe_mpi.h"
 
 using namespace SplatSet;
 
@@ -52,6 +55,7 @@ class TestFastFileSetMPI : public TestFastFileSet
     CPPUNIT_TEST(testEmpty);
 #endif
     CPPUNIT_TEST(testProgress);
+    CPPUNIT_TEST(testStriped);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -67,6 +71,7 @@ public:
 
     void testEmpty();            ///< Test error checking for an empty set
     void testProgress();         ///< Run with a progress stream (does not check output)
+    void testStriped();          ///< Test striped blob computation and remote reads
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestFastFileSetMPI, TestSet::perBuild());
 
@@ -111,3 +116,33 @@ void TestFastFileSetMPI::testProgress()
     boost::iostreams::stream<boost::iostreams::null_sink> nullStream(nullSink);
     set->computeBlobs(comm, 0, 2.5f, 5, &nullStream, false);
 }
+
+void TestFastFileSetMPI::testStriped()
+{
+    boost::scoped_ptr<FastBlobSetMPI<FileSet> > set(new FastBlobSetMPI<FileSet>());
+    TestFileSet::populate(*set, splatData, store);
+    set->computeBlobs(comm, 0, 2.5f, 5, NULL, false, true);
+    MLSGPU_ASSERT_EQUAL(flatSplats.size(), set->numSplats());
+
+    FileStripeMPI stripe(*set, comm);
+    set->setRemoteReader(&stripe);
+    boost::thread server(boost::ref(stripe));
+
+    boost::scoped_ptr<SplatStream> stream(set->makeSplatStream());
+    std::vector<Splat> actual;
+    std::vector<splat_id> ids;
+    Splat buffer[5];
+    splat_id bufferIds[5];
+    std::size_t n;
+    while ((n = stream->read(buffer, bufferIds, 5)) > 0)
+    {
+        actual.insert(actual.end(), buffer, buffer + n);
+        ids.insert(ids.end(), bufferIds, bufferIds + n);
+    }
+    stream.reset();
+
+    stripe.stop();
+    server.join();
+    set->setRemoteReader(NULL);
+    validateSplats(flatSplats, actual, ids);
+}
@@ -31,9 +31,11 @@
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <boost/thread.hpp>
+#include <boost/bind.hpp>
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <boost/smart_ptr/make_shared.hpp>
 #include <vector>
+#include <algorithm>
 #include "../testutil.h"
 #include "../../src/worker_group_mpi.h"
 #include <mpi.h>
@@ -55,6 +57,8 @@ public:
 
     void send(MPI_Comm comm, int dest) const;
     void recv(MPI_Comm comm, int source);
+    int irecv(MPI_Comm comm, int source, std::size_t size, MPI_Request *requests);
+    void irecvComplete() {}
     std::size_t size() const;
 };
 
@@ -68,6 +72,13 @@ void Item::recv(MPI_Comm comm, int source)
     MPI_Recv(&value, 1, MPI_INT, source, MLSGPU_TAG_WORK, comm, MPI_STATUS_IGNORE);
 }
 
+int Item::irecv(MPI_Comm comm, int source, std::size_t size, MPI_Request *requests)
+{
+    (void) size;
+    MPI_Irecv(&value, 1, MPI_INT, source, MLSGPU_TAG_WORK, comm, &requests[0]);
+    return 1;
+}
+
 std::size_t Item::size() const
 {
     return 1;
@@ -82,6 +93,23 @@ public:
     }
 };
 
+/// Gather group that sends each item @a x to rank <code>x % size</code>
+class RoutedGatherGroup : public WorkerGroupGather<Item, RoutedGatherGroup>
+{
+private:
+    static int route(int size, const Item &item)
+    {
+        return item.get() % size;
+    }
+
+public:
+    RoutedGatherGroup(MPI_Comm comm, int size)
+        : WorkerGroupGather<Item, RoutedGatherGroup>("RoutedGatherGroup", comm,
+                                                     boost::bind(&RoutedGatherGroup::route, size, _1))
+    {
+    }
+};
+
 class ConsumerWorker : public WorkerBase
 {
 private:
@@ -115,6 +143,7 @@ public:
  * It sends integer items back to the master. Each slave sends those @a x for which
  * <code>x % size == rank</code>.
  */
+template<typename Group = GatherGroup>
 class Slave
 {
 private:
@@ -123,6 +152,10 @@ private:
     std::size_t items;   ///< Total items to send across all slaves
 
 public:
+    /**
+     * Constructor. For @ref RoutedGatherGroup, @a root is instead the size of
+     * the communicator.
+     */
     Slave(MPI_Comm comm, int root, std::size_t items)
         : comm(comm), root(root), items(items)
     {
@@ -133,7 +166,7 @@ public:
     {
         Timeplot::Worker tworker("slave");
 
-        GatherGroup gatherGroup(comm, root);
+        Group gatherGroup(comm, root);
         gatherGroup.start();
 
         int rank, size;
@@ -156,11 +189,20 @@ class TestWorkerGroupGather : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestWorkerGroupGather);
     CPPUNIT_TEST(testStress);
+    CPPUNIT_TEST(testStressNonBlocking);
+    CPPUNIT_TEST(testRouted);
     CPPUNIT_TEST_SUITE_END();
 
 private:
     MPI_Comm comm;
+
+    /// Receive items with @a Receiver and check that all of them arrive
+    template<typename Receiver>
+    void stress();
+
     void testStress();    ///< Basic test with lots of items
+    void testStressNonBlocking(); ///< Test @ref ReceiverGatherNonBlocking with lots of items
+    void testRouted();    ///< Test sending items to different ranks
 
 public:
     virtual void setUp();
@@ -181,11 +223,12 @@ void TestWorkerGroupGather::tearDown()
     MPI_Barrier(MPI_COMM_WORLD);
 }
 
-void TestWorkerGroupGather::testStress()
+template<typename Receiver>
+void TestWorkerGroupGather::stress()
 {
     const std::size_t items = 100000;
     const int root = 0;
-    boost::thread slaveThread(Slave(comm, root, items));
+    boost::thread slaveThread(Slave<>(comm, root, items));
 
     int rank, size;
     MPI_Comm_rank(comm, &rank);
@@ -195,7 +238,7 @@ void TestWorkerGroupGather::testStress()
     {
 
         ConsumerGroup consumer(out);
-        ReceiverGather<Item, ConsumerGroup> receiver("ReceiverGather", consumer, comm, size);
+        Receiver receiver("ReceiverGather", consumer, comm, size);
 
         consumer.start();
         receiver();
@@ -215,3 +258,39 @@ void TestWorkerGroupGather::testStress()
         CPPUNIT_ASSERT_EQUAL(0, failed);
     }
 }
+
+void TestWorkerGroupGather::testStress()
+{
+    stress<ReceiverGather<Item, ConsumerGroup> >();
+}
+
+void TestWorkerGroupGather::testStressNonBlocking()
+{
+    stress<ReceiverGatherNonBlocking<Item, ConsumerGroup> >();
+}
+
+void TestWorkerGroupGather::testRouted()
+{
+    const std::size_t items = 10000;
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    boost::thread slaveThread(Slave<RoutedGatherGroup>(comm, size, items));
+
+    std::vector<int> out;
+    {
+        ConsumerGroup consumer(out);
+        ReceiverGatherNonBlocking<Item, ConsumerGroup> receiver("ReceiverGather", consumer, comm, size);
+
+        consumer.start();
+        receiver();
+        consumer.stop();
+    }
+    slaveThread.join();
+
+    std::sort(out.begin(), out.end());
+    std::vector<int> expected;
+    for (std::size_t i = rank; i < items; i += size)
+        expected.push_back(i);
+    CPPUNIT_ASSERT(expected == out);
+}
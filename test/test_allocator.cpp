@@ -30,9 +30,13 @@
 
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <map>
+#include <string>
 #include "testutil.h"
 #include "../src/statistics.h"
 #include "../src/allocator.h"
+#include "../src/large_pages.h"
 
 class TestAllocator : public CppUnit::TestFixture
 {
@@ -178,3 +182,128 @@ void TestContainers::testAll()
     size_type allDiff = allNew - allOld;
     CPPUNIT_ASSERT_EQUAL(vectorDiff + setDiff + mapDiff, allDiff);
 }
+
+class TestArena : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestArena);
+    CPPUNIT_TEST(testAllocate);
+    CPPUNIT_TEST(testReset);
+    CPPUNIT_TEST(testUsage);
+    CPPUNIT_TEST(testVector);
+    CPPUNIT_TEST(testPool);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testAllocate();        ///< Test that allocations are aligned and disjoint
+    void testReset();           ///< Test that reset coalesces blocks and reuses memory
+    void testUsage();           ///< Test that memory held is reported to the statistic
+    void testVector();          ///< Test a @c std::vector using @ref Statistics::ArenaAllocator
+    void testPool();            ///< Test that @ref Statistics::ArenaPool reuses arenas
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestArena, TestSet::perBuild());
+
+void TestArena::testAllocate()
+{
+    Statistics::Arena arena("mem.TestArena::testAllocate");
+    char *a = static_cast<char *>(arena.allocate(3, 1));
+    char *b = static_cast<char *>(arena.allocate(8, 8));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), std::size_t(b) % 8);
+    CPPUNIT_ASSERT(b >= a + 3);
+    // Larger than the minimum block size
+    char *c = static_cast<char *>(arena.allocate(1024 * 1024, 16));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), std::size_t(c) % 16);
+    CPPUNIT_ASSERT(arena.capacity() >= 1024 * 1024 + 11);
+}
+
+void TestArena::testReset()
+{
+    Statistics::Arena arena("mem.TestArena::testReset");
+    void *first = arena.allocate(1000, 8);
+    arena.allocate(1024 * 1024, 8);
+    std::size_t capacity = arena.capacity();
+    arena.reset();
+    CPPUNIT_ASSERT_EQUAL(capacity, arena.capacity());
+
+    // Everything should now fit in the single coalesced block
+    void *again = arena.allocate(1000, 8);
+    arena.allocate(1024 * 1024, 8);
+    CPPUNIT_ASSERT_EQUAL(capacity, arena.capacity());
+    arena.reset();
+    CPPUNIT_ASSERT_EQUAL(again, arena.allocate(1000, 8));
+    (void) first;
+}
+
+void TestArena::testUsage()
+{
+    Statistics::Peak &peak = Statistics::getStatistic<Statistics::Peak>("mem.TestArena::testUsage");
+    Statistics::Peak::value_type old = peak.get();
+    {
+        Statistics::Arena arena("mem.TestArena::testUsage");
+        arena.allocate(100, 1);
+        CPPUNIT_ASSERT_EQUAL(Statistics::Peak::value_type(old + arena.capacity()), peak.get());
+    }
+    CPPUNIT_ASSERT_EQUAL(old, peak.get());
+}
+
+void TestArena::testVector()
+{
+    Statistics::Arena arena("mem.TestArena::testVector");
+    std::vector<int, Statistics::ArenaAllocator<int> > v((Statistics::ArenaAllocator<int>(arena)));
+    for (int i = 0; i < 10000; i++)
+        v.push_back(i);
+    for (int i = 0; i < 10000; i++)
+        CPPUNIT_ASSERT_EQUAL(i, v[i]);
+    CPPUNIT_ASSERT(v.get_allocator() == Statistics::ArenaAllocator<char>(arena));
+}
+
+void TestArena::testPool()
+{
+    Statistics::ArenaPool pool("mem.TestArena::testPool");
+    Statistics::Arena *a;
+    {
+        Statistics::ArenaPool::Lease lease1(pool);
+        Statistics::ArenaPool::Lease lease2(pool);
+        CPPUNIT_ASSERT(&lease1.get() != &lease2.get());
+        a = &lease1.get();
+        a->allocate(100, 1);
+    }
+    Statistics::ArenaPool::Lease lease3(pool);
+    Statistics::ArenaPool::Lease lease4(pool);
+    CPPUNIT_ASSERT(&lease3.get() == a || &lease4.get() == a);
+}
+
+class TestLargePages : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestLargePages);
+    CPPUNIT_TEST(testModes);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testModes();           ///< Test allocation under every supported policy
+
+public:
+    virtual void tearDown();    ///< Restores the default policy
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestLargePages, TestSet::perBuild());
+
+void TestLargePages::tearDown()
+{
+    LargePages::setPolicy(HUGE_PAGES_NONE);
+}
+
+void TestLargePages::testModes()
+{
+    typedef std::map<std::string, HugePageMode> NameMap;
+    const NameMap modes = HugePageModeWrapper::getNameMap();
+    for (NameMap::const_iterator i = modes.begin(); i != modes.end(); ++i)
+    {
+        // Explicit huge pages may not be reserved, in which case this
+        // exercises the fallback path.
+        LargePages::setPolicy(i->second, i == modes.begin() ? -1 : 0);
+        std::vector<int, LargePageAllocator<int> > v(1024 * 1024);
+        for (std::size_t j = 0; j < v.size(); j++)
+            v[j] = j;
+        for (std::size_t j = 0; j < v.size(); j++)
+            CPPUNIT_ASSERT_EQUAL(int(j), v[j]);
+    }
+}
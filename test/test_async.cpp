@@ -28,6 +28,8 @@
 # include <config.h>
 #endif
 
+#include <vector>
+#include <algorithm>
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <boost/smart_ptr/shared_ptr.hpp>
@@ -46,6 +48,7 @@ class TestAsyncWriter : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestAsyncWriter);
     CPPUNIT_TEST(testStress);
+    CPPUNIT_TEST(testCoalesce);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -56,6 +59,7 @@ private:
     boost::filesystem::path filename;
 
     void testStress();   ///< Make lots of writes to file, check that they arrive
+    void testCoalesce(); ///< Coalesced, ordered writes with a gap, read back after @ref AsyncWriter::waitFor
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestAsyncWriter, TestSet::perNightly());
 
@@ -123,3 +127,56 @@ void TestAsyncWriter::testStress()
     CPPUNIT_ASSERT_EQUAL(size, pos);
     reader->close();
 }
+
+void TestAsyncWriter::testCoalesce()
+{
+    Timeplot::Worker tworker("test");
+    typedef std::tr1::uint32_t value_type;
+    const value_type size = 100000;
+    const value_type gapStart = 50000, gapEnd = 50100;
+
+    boost::shared_ptr<BinaryWriter> writer(createWriter(SYSCALL_WRITER));
+    writer->open(filename);
+    writer->resize(BinaryWriter::offset_type(size) * sizeof(value_type));
+
+    AsyncWriter async(3, 4096 * sizeof(value_type), 1000 * sizeof(value_type), true);
+    async.start();
+
+    std::tr1::mt19937 engine;
+    std::tr1::uniform_int<int> dist(1, 100);
+    value_type pos = 0;
+    while (pos < size)
+    {
+        if (pos == gapStart)
+            pos = gapEnd;
+        value_type chunk = dist(engine);
+        chunk = std::min(chunk, (pos < gapStart ? gapStart : size) - pos);
+        boost::shared_ptr<AsyncWriterItem> item = async.get(tworker, chunk * sizeof(value_type));
+        value_type *ptr = reinterpret_cast<value_type *>(item->get());
+        for (value_type i = 0; i < chunk; i++)
+            ptr[i] = i + pos;
+        async.push(tworker, item, writer,
+                   chunk * sizeof(value_type),
+                   BinaryWriter::offset_type(pos) * sizeof(value_type));
+        pos += chunk;
+    }
+
+    // Data must be readable once waitFor returns, without stopping the writer
+    async.waitFor(tworker, async.flush(tworker));
+    boost::scoped_ptr<BinaryReader> reader(createReader(SYSCALL_READER));
+    reader->open(filename);
+    std::vector<value_type> buffer(size);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(size) * sizeof(value_type),
+                         reader->read(&buffer[0], size * sizeof(value_type), 0));
+    for (value_type i = 0; i < size; i++)
+    {
+        if (i >= gapStart && i < gapEnd)
+            CPPUNIT_ASSERT_EQUAL(value_type(0), buffer[i]);
+        else
+            CPPUNIT_ASSERT_EQUAL(i, buffer[i]);
+    }
+    reader->close();
+
+    writer.reset();
+    async.stop();
+}
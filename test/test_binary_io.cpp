@@ -36,10 +36,15 @@
 #include <cctype>
 #include <locale>
 #include <iomanip>
+#include <vector>
+#include <algorithm>
 #include "testutil.h"
 #include "../src/binary_io.h"
 #include "../src/errors.h"
 #include "../src/misc.h"
+#if HAVE_ZSTD_H
+# include <zstd.h>
+#endif
 
 static const boost::filesystem::path badPath("/not_a_real_file/");
 #ifdef _WIN32
@@ -99,7 +104,9 @@ class TestBinaryReader : public TestBinaryIO
     CPPUNIT_TEST(testReadEnd);
     CPPUNIT_TEST(testReadPastEnd);
     CPPUNIT_TEST(testReadZero);
+    CPPUNIT_TEST(testReadLarge);
     CPPUNIT_TEST(testSize);
+    CPPUNIT_TEST(testData);
     CPPUNIT_TEST_SUITE_END_ABSTRACT();
 
 protected:
@@ -110,7 +117,9 @@ private:
     void testReadEnd();       ///< Test a read that crosses the end of file
     void testReadPastEnd();   ///< Test a read that does not intersect the file
     void testReadZero();      ///< Test reading zero bytes
+    void testReadLarge();     ///< Test a multi-megabyte read
     void testSize();          ///< Test @ref BinaryReader::size
+    void testData();          ///< Test @ref BinaryReader::data, where supported
 };
 
 /**
@@ -122,7 +131,9 @@ class TestBinaryWriter : public TestBinaryIO
     CPPUNIT_TEST(testWriteExtend);
     CPPUNIT_TEST(testWriteInside);
     CPPUNIT_TEST(testWriteZero);
+    CPPUNIT_TEST(testWriteLarge);
     CPPUNIT_TEST(testResize);
+    CPPUNIT_TEST(testNoTruncate);
     CPPUNIT_TEST_SUITE_END_ABSTRACT();
 
 protected:
@@ -138,7 +149,9 @@ private:
     void testWriteExtend();      ///< Write past the current end
     void testWriteInside();      ///< Write within the file
     void testWriteZero();        ///< Test a zero-byte write
+    void testWriteLarge();       ///< Test a multi-megabyte write
     void testResize();           ///< Test @ref BinaryWriter::resize
+    void testNoTruncate();       ///< Test @ref BinaryWriter::setTruncate
 };
 
 #define BINARY_READER_CLASS(name, readerType) \
@@ -154,6 +167,12 @@ private:
 BINARY_READER_CLASS(TestSyscallReader, SYSCALL_READER);
 BINARY_READER_CLASS(TestMmapReader, MMAP_READER);
 BINARY_READER_CLASS(TestStreamReader, STREAM_READER);
+#if HAVE_LINUX_IO_URING_H
+BINARY_READER_CLASS(TestUringReader, URING_READER);
+#endif
+#if HAVE_O_DIRECT
+BINARY_READER_CLASS(TestDirectReader, DIRECT_READER);
+#endif
 
 #define BINARY_WRITER_CLASS(name, writerType) \
     class name : public TestBinaryReader \
@@ -167,6 +186,39 @@ BINARY_READER_CLASS(TestStreamReader, STREAM_READER);
 
 BINARY_WRITER_CLASS(TestSyscallWriter, SYSCALL_WRITER);
 BINARY_WRITER_CLASS(TestStreamWriter, STREAM_WRITER);
+#if HAVE_MMAP && HAVE_MSYNC
+BINARY_WRITER_CLASS(TestMmapWriter, MMAP_WRITER);
+#endif
+#if HAVE_LINUX_IO_URING_H
+BINARY_WRITER_CLASS(TestUringWriter, URING_WRITER);
+#endif
+
+#if HAVE_ZSTD_H
+/**
+ * Tests for the @ref ZSTD_WRITER writer. It does not use @ref TestBinaryWriter
+ * because it only supports sequential writes, and the file must be
+ * decompressed before checking it.
+ */
+class TestZstdWriter : public TestBinaryIO
+{
+    CPPUNIT_TEST_SUB_SUITE(TestZstdWriter, TestBinaryIO);
+    CPPUNIT_TEST(testSequential);
+    CPPUNIT_TEST(testBackwards);
+    CPPUNIT_TEST(testWriteLarge);
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    virtual BinaryIO *factory() { return createWriter(ZSTD_WRITER); }
+
+private:
+    std::string decompress();    ///< Decompress the contents of the test file
+
+    void testSequential();       ///< Writes with gaps between them and a resize
+    void testBackwards();        ///< Test that writing before a previous write fails
+    void testWriteLarge();       ///< Test a multi-megabyte write
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestZstdWriter, TestSet::perBuild());
+#endif
 
 void TestBinaryIO::setUp()
 {
@@ -278,6 +330,24 @@ void TestBinaryReader::testReadZero()
     CPPUNIT_ASSERT_EQUAL('?', buffer[0]);
 }
 
+void TestBinaryReader::testReadLarge()
+{
+    /* Large enough to be split into several requests by the batched readers,
+     * but kept within the gap before "big offset", which is much smaller on
+     * Windows (see seekPos).
+     */
+    const std::size_t count = std::min(std::size_t(20 * 1024 * 1024 + 17), std::size_t(seekPos - 6));
+    std::vector<char> buffer(count + 1, '?');
+    boost::scoped_ptr<BinaryReader> b(factoryReader());
+
+    b->open(testPath);
+    std::size_t bytes = b->read(&buffer[0], count, 6);
+    MLSGPU_ASSERT_EQUAL(count, bytes);
+    CPPUNIT_ASSERT_EQUAL('?', buffer[count]);
+    CPPUNIT_ASSERT_EQUAL(std::string("world"), std::string(&buffer[0], 5));
+    CPPUNIT_ASSERT(std::count(buffer.begin() + 5, buffer.begin() + count, '\0') == std::ptrdiff_t(count - 5));
+}
+
 void TestBinaryReader::testSize()
 {
     boost::scoped_ptr<BinaryReader> b(factoryReader());
@@ -285,6 +355,21 @@ void TestBinaryReader::testSize()
     MLSGPU_ASSERT_EQUAL(seekPos + strlen("big offset"), b->size());
 }
 
+void TestBinaryReader::testData()
+{
+    boost::scoped_ptr<BinaryReader> b(factoryReader());
+    b->open(testPath);
+    const char *data = b->data();
+    if (data != NULL)
+    {
+        CPPUNIT_ASSERT_EQUAL(std::string("hello world"), std::string(data, 11));
+        CPPUNIT_ASSERT_EQUAL(std::string("big offset"), std::string(data + seekPos, 10));
+    }
+    // Hints must be harmless, even past the end of the file
+    b->prefetch(3, 100);
+    b->prefetch(seekPos + 100, 100);
+}
+
 
 BinaryWriter *TestBinaryWriter::factoryWriter()
 {
@@ -359,6 +444,26 @@ void TestBinaryWriter::testWriteZero()
     MLSGPU_ASSERT_EQUAL(0, file_size(testPath));
 }
 
+void TestBinaryWriter::testWriteLarge()
+{
+    const std::size_t count = 20 * 1024 * 1024 + 17;
+    std::string msg(count, '\0');
+    for (std::size_t i = 0; i < count; i++)
+        msg[i] = 'a' + i % 23;
+    const std::string expected = std::string(3, '\0') + msg;
+
+    boost::scoped_ptr<BinaryWriter> b(factoryWriter());
+    b->open(testPath);
+    std::size_t bytes = b->write(msg.data(), msg.size(), 3);
+    MLSGPU_ASSERT_EQUAL(msg.size(), bytes);
+    b->close();
+
+    std::ifstream in(testPath.c_str(), std::ios::in | std::ios::binary);
+    std::ostringstream out;
+    out << in.rdbuf();
+    CPPUNIT_ASSERT(expected == out.str());
+}
+
 void TestBinaryWriter::testResize()
 {
     boost::scoped_ptr<BinaryWriter> b(factoryWriter());
@@ -368,3 +473,99 @@ void TestBinaryWriter::testResize()
 
     MLSGPU_ASSERT_EQUAL(seekPos, file_size(testPath));
 }
+
+void TestBinaryWriter::testNoTruncate()
+{
+    const std::string msg = "HELLO";
+
+    boost::scoped_ptr<BinaryWriter> b(factoryWriter());
+    b->setTruncate(false);
+    b->open(testPath);
+    std::size_t bytes = b->write(msg.data(), msg.size(), 0);
+    MLSGPU_ASSERT_EQUAL(msg.size(), bytes);
+    CPPUNIT_ASSERT_THROW(b->setTruncate(true), state_error);
+    b->close();
+
+    MLSGPU_ASSERT_EQUAL(seekPos + 10, file_size(testPath));
+    std::ifstream in(testPath.c_str(), std::ios::in | std::ios::binary);
+    char head[11];
+    in.read(head, sizeof(head));
+    CPPUNIT_ASSERT(in);
+    CPPUNIT_ASSERT_EQUAL(std::string("HELLO world"), std::string(head, sizeof(head)));
+}
+
+#if HAVE_ZSTD_H
+
+std::string TestZstdWriter::decompress()
+{
+    std::ifstream in(testPath.c_str(), std::ios::in | std::ios::binary);
+    in.exceptions(std::ios::failbit | std::ios::badbit);
+    std::ostringstream raw;
+    raw << in.rdbuf();
+    const std::string compressed = raw.str();
+
+    std::string ans;
+    std::vector<char> buffer(ZSTD_DStreamOutSize());
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_initDStream(stream);
+    ZSTD_inBuffer input = { compressed.data(), compressed.size(), 0 };
+    bool full = false;
+    while (input.pos < input.size || full)
+    {
+        ZSTD_outBuffer output = { &buffer[0], buffer.size(), 0 };
+        std::size_t ret = ZSTD_decompressStream(stream, &output, &input);
+        CPPUNIT_ASSERT(!ZSTD_isError(ret));
+        ans.append(&buffer[0], output.pos);
+        full = output.pos == output.size;
+    }
+    ZSTD_freeDStream(stream);
+    return ans;
+}
+
+void TestZstdWriter::testSequential()
+{
+    const std::string msg1 = "hello";
+    const std::string msg2 = "goodbye world";
+    const std::string expected = msg1 + std::string(10, '\0') + msg2 + std::string(20, '\0');
+
+    boost::scoped_ptr<BinaryWriter> b(createWriter(ZSTD_WRITER));
+    b->open(testPath);
+    b->resize(expected.size());
+    MLSGPU_ASSERT_EQUAL(msg1.size(), b->write(msg1.data(), msg1.size(), 0));
+    MLSGPU_ASSERT_EQUAL(0, b->write(NULL, 0, 2));
+    MLSGPU_ASSERT_EQUAL(msg2.size(), b->write(msg2.data(), msg2.size(), msg1.size() + 10));
+    b->close();
+
+    CPPUNIT_ASSERT(expected == decompress());
+}
+
+void TestZstdWriter::testBackwards()
+{
+    const std::string msg = "goodbye world";
+
+    boost::scoped_ptr<BinaryWriter> b(createWriter(ZSTD_WRITER));
+    b->open(testPath);
+    b->write(msg.data(), msg.size(), 10);
+    CPPUNIT_ASSERT_THROW(b->write(msg.data(), msg.size(), 20), std::ios::failure);
+    CPPUNIT_ASSERT_THROW(b->resize(5), std::ios::failure);
+    b->close();
+}
+
+void TestZstdWriter::testWriteLarge()
+{
+    const std::size_t count = 20 * 1024 * 1024 + 17;
+    std::string msg(count, '\0');
+    for (std::size_t i = 0; i < count; i++)
+        msg[i] = 'a' + i % 23;
+    const std::string expected = std::string(3, '\0') + msg;
+
+    boost::scoped_ptr<BinaryWriter> b(createWriter(ZSTD_WRITER));
+    b->open(testPath);
+    std::size_t bytes = b->write(msg.data(), msg.size(), 3);
+    MLSGPU_ASSERT_EQUAL(msg.size(), bytes);
+    b->close();
+
+    CPPUNIT_ASSERT(expected == decompress());
+}
+
+#endif // HAVE_ZSTD_H
@@ -0,0 +1,140 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref BlobComputerCL.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <utility>
+#include <boost/array.hpp>
+#include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/tr1/random.hpp>
+#include "../src/tr1_cstdint.h"
+#include "testutil.h"
+#include "test_clh.h"
+#include "test_splat_set.h"
+#include "../src/blob_computer_cl.h"
+#include "../src/grid.h"
+#include "../src/splat_set.h"
+
+/// Tests for @ref BlobComputerCL
+class TestBlobComputerCL : public CLH::Test::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestBlobComputerCL);
+    CPPUNIT_TEST(testSameBlobs);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    typedef SplatSet::FastBlobSet<SplatSet::VectorsSet> Splats;
+
+    /// Bucket range of a single splat
+    typedef std::pair<boost::array<Grid::difference_type, 3>, boost::array<Grid::difference_type, 3> > Range;
+
+    /**
+     * Expand the blobs of @a splats into the range of each splat, so that
+     * the results do not depend on where the blobs were split.
+     */
+    static std::vector<std::pair<SplatSet::splat_id, Range> > expandBlobs(
+        const Splats &splats, Grid::size_type bucketSize);
+
+    void testSameBlobs();    ///< Computing on the device gives the same blobs as on the host
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBlobComputerCL, TestSet::perBuild());
+
+std::vector<std::pair<SplatSet::splat_id, TestBlobComputerCL::Range> > TestBlobComputerCL::expandBlobs(
+    const Splats &splats, Grid::size_type bucketSize)
+{
+    std::vector<std::pair<SplatSet::splat_id, Range> > out;
+    boost::scoped_ptr<SplatSet::BlobStream> blobs(splats.makeBlobStream(splats.getBoundingGrid(), bucketSize));
+    for (; !blobs->empty(); ++*blobs)
+    {
+        const SplatSet::BlobInfo blob = **blobs;
+        for (SplatSet::splat_id id = blob.firstSplat; id < blob.lastSplat; id++)
+            out.push_back(std::make_pair(id, Range(blob.lower, blob.upper)));
+    }
+    return out;
+}
+
+void TestBlobComputerCL::testSameBlobs()
+{
+    BlobComputerCL computer(context, device);
+
+    for (unsigned long seed = 0; seed < 10; seed++)
+    {
+        std::tr1::mt19937 engine(seed);
+        std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_real<float> >
+            genPos(engine, std::tr1::uniform_real<float>(-50.0f, 50.0f));
+        std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_real<float> >
+            genR(engine, std::tr1::uniform_real<float>(0.01f, 8.0f));
+
+        Splats expected, actual;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            expected.push_back(std::vector<Splat>());
+            for (unsigned int j = 0; j < 1000; j++)
+            {
+                Splat splat;
+                // Sorted along x so that neighbours often share buckets
+                splat.position[0] = -50.0f + 0.1f * j;
+                splat.position[1] = genPos();
+                splat.position[2] = genPos() * 0.1f;
+                splat.radius = genR();
+                splat.quality = 0.0f;
+                splat.normal[0] = splat.normal[1] = splat.normal[2] = 1.0f;
+                expected.back().push_back(splat);
+            }
+            actual.push_back(expected.back());
+        }
+        actual.setBlobComputer(&computer);
+
+        // Run twice to check that the computer can be reused
+        for (unsigned int pass = 0; pass < 2; pass++)
+        {
+            const float spacing = pass == 0 ? 0.5f : 1.25f;
+            const Grid::size_type bucketSize = pass == 0 ? 4 : 3;
+            expected.computeBlobs(spacing, bucketSize, NULL, false);
+            actual.computeBlobs(spacing, bucketSize, NULL, false);
+
+            MLSGPU_ASSERT_EQUAL(expected.numSplats(), actual.numSplats());
+            const Grid &expectedGrid = expected.getBoundingGrid();
+            const Grid &actualGrid = actual.getBoundingGrid();
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                CPPUNIT_ASSERT_EQUAL(expectedGrid.getReference()[j], actualGrid.getReference()[j]);
+                CPPUNIT_ASSERT_EQUAL(expectedGrid.getExtent(j).first, actualGrid.getExtent(j).first);
+                CPPUNIT_ASSERT_EQUAL(expectedGrid.getExtent(j).second, actualGrid.getExtent(j).second);
+            }
+            CPPUNIT_ASSERT(expandBlobs(expected, bucketSize) == expandBlobs(actual, bucketSize));
+        }
+    }
+}
@@ -263,10 +263,13 @@ class TestBucket : public CppUnit::TestFixture
     CPPUNIT_TEST_SUITE(TestBucket);
     CPPUNIT_TEST(testSimple);
     CPPUNIT_TEST(testDensityError);
+    CPPUNIT_TEST(testThin);
     CPPUNIT_TEST(testMultiLevel);
     CPPUNIT_TEST(testFlat);
     CPPUNIT_TEST(testEmpty);
     CPPUNIT_TEST(testChunkCells);
+    CPPUNIT_TEST(testCostModel);
+    CPPUNIT_TEST(testThreads);
     CPPUNIT_TEST_SUITE_ADD_CUSTOM_TESTS(addRandom);
     CPPUNIT_TEST_SUITE_END();
 
@@ -289,6 +292,9 @@ private:
                   const std::vector<Block> &blocks,
                   std::size_t maxSplats, Grid::size_type maxCells, Grid::size_type chunkCells);
 
+    /// Check that two bucketing runs produced the same blocks in the same order
+    static void checkSameBlocks(const std::vector<Block> &expected, const std::vector<Block> &actual);
+
     template<typename T>
     static void bucketFunc(
         std::vector<Block> &blocks,
@@ -302,10 +308,13 @@ private:
 public:
     void testSimple();            ///< Test basic usage
     void testDensityError();      ///< Test that @ref Bucket::DensityError is thrown correctly
+    void testThin();              ///< Test that overdense cells are thinned on request
     void testMultiLevel();        ///< Test recursion of @c bucketRecurse
     void testFlat();              ///< Top level already meets the requirements
     void testEmpty();             ///< Edge case with zero splats inside the grid
     void testChunkCells();        ///< Test non-zero @a chunkCells
+    void testCostModel();         ///< Test splitting buckets with a @ref Bucket::CostModel
+    void testThreads();           ///< Test that multiple threads give the serial result
     void testRandom(unsigned long seed); ///< Randomly-generated test case
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBucket, TestSet::perBuild());
@@ -345,6 +354,20 @@ void TestBucket::bucketFunc(
     }
 }
 
+void TestBucket::checkSameBlocks(const std::vector<Block> &expected, const std::vector<Block> &actual)
+{
+    MLSGPU_ASSERT_EQUAL(expected.size(), actual.size());
+    for (std::size_t i = 0; i < expected.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            CPPUNIT_ASSERT_EQUAL(expected[i].grid.getExtent(j).first, actual[i].grid.getExtent(j).first);
+            CPPUNIT_ASSERT_EQUAL(expected[i].grid.getExtent(j).second, actual[i].grid.getExtent(j).second);
+        }
+        CPPUNIT_ASSERT(expected[i].splatIds == actual[i].splatIds);
+    }
+}
+
 void TestBucket::validate(
     const Splats &splats,
     const Grid &fullGrid,
@@ -476,6 +499,51 @@ void TestBucket::testSimple()
     CPPUNIT_ASSERT_EQUAL(11, int(blocks.size()));
 }
 
+void TestBucket::testCostModel()
+{
+    setupSimple();
+
+    const float ref[3] = {-10.0f, 0.0f, 10.0f};
+    Grid grid(ref, 2.5f, 4, 20, 0, 20, -4, 4);
+    std::vector<Block> blocks;
+    const int maxSplats = 5;
+    const int maxCells = 8;
+    const int maxSplit = 1000000;
+    // With no weight on cells, the cost is just a tighter splat limit
+    const CostModel costModel(0.0, 3.0);
+    bucket(splats, grid, maxSplats, maxCells, 0, maxCells, maxSplit,
+           boost::bind(&TestBucket::bucketFunc<Splats>, boost::ref(blocks), _1, _2, _3),
+           Recursion(), costModel);
+    validate(splats, grid, blocks, maxSplats, maxCells, 0);
+
+    BOOST_FOREACH(const Block &block, blocks)
+    {
+        // Single cells cannot be split to reduce the cost
+        if (block.grid.numCells() > 1)
+            CPPUNIT_ASSERT(block.numSplats <= 3);
+    }
+    CPPUNIT_ASSERT(blocks.size() > 11); // testSimple gives 11
+}
+
+void TestBucket::testThreads()
+{
+    setupSimple();
+
+    const float ref[3] = {-10.0f, 0.0f, 10.0f};
+    Grid grid(ref, 2.5f, 4, 20, 0, 20, -4, 4);
+    std::vector<Block> serialBlocks, blocks;
+    const int maxSplats = 5;
+    const int maxCells = 4;
+    const int maxSplit = 8;
+    bucket(splats, grid, maxSplats, maxCells, 0, maxCells, maxSplit,
+           boost::bind(&TestBucket::bucketFunc<Splats>, boost::ref(serialBlocks), _1, _2, _3));
+    bucket(splats, grid, maxSplats, maxCells, 0, maxCells, maxSplit,
+           boost::bind(&TestBucket::bucketFunc<Splats>, boost::ref(blocks), _1, _2, _3),
+           Recursion(), CostModel(), 3);
+    validate(splats, grid, blocks, maxSplats, maxCells, 0);
+    checkSameBlocks(serialBlocks, blocks);
+}
+
 void TestBucket::testDensityError()
 {
     setupSimple();
@@ -492,6 +560,32 @@ void TestBucket::testDensityError()
         DensityError);
 }
 
+void TestBucket::testThin()
+{
+    setupSimple();
+
+    const float ref[3] = {-10.0f, 0.0f, 10.0f};
+    Grid grid(ref, 2.5f, 4, 20, 0, 20, -4, 4);
+    std::vector<Block> blocks;
+    const int maxSplats = 1;
+    const int maxCells = 8;
+    const int maxSplit = 1000000;
+    bucket(splats, grid, maxSplats, maxCells, 0, maxCells, maxSplit,
+           boost::bind(&TestBucket::bucketFunc<Splats>, boost::ref(blocks), _1, _2, _3),
+           Recursion(), CostModel(), 1, true);
+
+    CPPUNIT_ASSERT(!blocks.empty());
+    bool thinned = false;
+    for (std::size_t i = 0; i < blocks.size(); i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(1), blocks[i].numSplats);
+        CPPUNIT_ASSERT_EQUAL(std::size_t(1), blocks[i].splatIds.size());
+        if (blocks[i].grid.numCells() == 1)
+            thinned = true;
+    }
+    CPPUNIT_ASSERT(thinned);
+}
+
 void TestBucket::testFlat()
 {
     setupSimple();
@@ -656,6 +750,12 @@ void TestBucket::testRandom(unsigned long seed)
         bucket(splats, grid, maxSplats, maxCells, chunkCells, maxCells, maxSplit,
                boost::bind(&TestBucket::bucketFunc<Splats>, boost::ref(blocks), _1, _2, _3));
         validate(splats, grid, blocks, maxSplats, maxCells, 0);
+
+        std::vector<Block> parallelBlocks;
+        bucket(splats, grid, maxSplats, maxCells, chunkCells, maxCells, maxSplit,
+               boost::bind(&TestBucket::bucketFunc<Splats>, boost::ref(parallelBlocks), _1, _2, _3),
+               Recursion(), CostModel(), 4);
+        checkSameBlocks(blocks, parallelBlocks);
     }
     catch (DensityError &e)
     {
@@ -0,0 +1,197 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref bucket_cache.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/ptr_container/ptr_vector.hpp>
+#include "../src/bucket_cache.h"
+#include "../src/grid.h"
+#include "../src/mesh.h"
+#include "../src/splat.h"
+#include "testutil.h"
+
+class TestBucketCache : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestBucketCache);
+    CPPUNIT_TEST(testKey);
+    CPPUNIT_TEST(testStoreLoad);
+    CPPUNIT_TEST(testLoadMissing);
+    CPPUNIT_TEST(testLoadCorrupt);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    boost::filesystem::path dir;    ///< Temporary cache directory
+    std::vector<Splat> splats;      ///< Splats for a bucket
+    Grid grid;                      ///< Grid for the bucket
+
+    /// Build a small mesh with one internal and two external vertices
+    static BucketCache::Mesh *makeMesh();
+
+    void testKey();          ///< Test that keys depend on every input
+    void testStoreLoad();    ///< Test round trip through @ref BucketCache::store
+    void testLoadMissing();  ///< Test loading a key that was never stored
+    void testLoadCorrupt();  ///< Test loading a truncated entry
+
+public:
+    virtual void setUp();
+    virtual void tearDown();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBucketCache, TestSet::perBuild());
+
+void TestBucketCache::setUp()
+{
+    dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    splats.resize(3);
+    for (std::size_t i = 0; i < splats.size(); i++)
+    {
+        Splat &s = splats[i];
+        s.position[0] = i; s.position[1] = 2.0f * i; s.position[2] = -1.0f;
+        s.radius = 0.5f;
+        s.normal[0] = 0.0f; s.normal[1] = 0.0f; s.normal[2] = 1.0f;
+        s.quality = 1.0f;
+    }
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    grid = Grid(ref, 1.0f, 0, 8, 0, 8, -4, 4);
+}
+
+void TestBucketCache::tearDown()
+{
+    boost::filesystem::remove_all(dir);
+}
+
+BucketCache::Mesh *TestBucketCache::makeMesh()
+{
+    BucketCache::Mesh *m = new BucketCache::Mesh(MeshSizes(3, 1, 1));
+    HostKeyMesh mesh = m->getHostMesh();
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        mesh.vertices[i][0] = i;
+        mesh.vertices[i][1] = 0.5f * i;
+        mesh.vertices[i][2] = -2.0f;
+    }
+    mesh.vertexKeys[0] = 0x123456789ULL;
+    mesh.vertexKeys[1] = 42;
+    mesh.triangles[0][0] = 0;
+    mesh.triangles[0][1] = 2;
+    mesh.triangles[0][2] = 1;
+    return m;
+}
+
+void TestBucketCache::testKey()
+{
+    BucketCache cache(dir, "params");
+    cache.setFullGrid(grid);
+    const BucketCache::Key key = cache.makeKey(&splats[0], splats.size(), grid, 0);
+    CPPUNIT_ASSERT_EQUAL(std::string::size_type(32), key.str().size());
+
+    BucketCache::Key same = cache.makeKey(&splats[0], splats.size(), grid, 0);
+    CPPUNIT_ASSERT_EQUAL(key.str(), same.str());
+
+    // Fewer splats
+    CPPUNIT_ASSERT(key.str() != cache.makeKey(&splats[0], 2, grid, 0).str());
+    // Different level
+    CPPUNIT_ASSERT(key.str() != cache.makeKey(&splats[0], splats.size(), grid, 1).str());
+    // Different sub-grid
+    Grid sub = grid.subGrid(0, 4, 0, 8, -4, 4);
+    CPPUNIT_ASSERT(key.str() != cache.makeKey(&splats[0], splats.size(), sub, 0).str());
+    // Different splat contents
+    splats[1].radius = 0.25f;
+    CPPUNIT_ASSERT(key.str() != cache.makeKey(&splats[0], splats.size(), grid, 0).str());
+    splats[1].radius = 0.5f;
+
+    // Different parameters
+    BucketCache other(dir, "other params");
+    other.setFullGrid(grid);
+    CPPUNIT_ASSERT(key.str() != other.makeKey(&splats[0], splats.size(), grid, 0).str());
+}
+
+void TestBucketCache::testStoreLoad()
+{
+    BucketCache cache(dir, "params");
+    cache.setFullGrid(grid);
+    const BucketCache::Key key = cache.makeKey(&splats[0], splats.size(), grid, 0);
+
+    boost::ptr_vector<BucketCache::Mesh> meshes;
+    meshes.push_back(makeMesh());
+    meshes.push_back(new BucketCache::Mesh(MeshSizes(0, 0, 0)));
+    cache.store(key, meshes);
+
+    boost::ptr_vector<BucketCache::Mesh> loaded;
+    CPPUNIT_ASSERT(cache.load(key, loaded));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), loaded.size());
+    CPPUNIT_ASSERT(static_cast<const MeshSizes &>(meshes[0]) == loaded[0]);
+    CPPUNIT_ASSERT(static_cast<const MeshSizes &>(meshes[1]) == loaded[1]);
+
+    HostKeyMesh expected = meshes[0].getHostMesh();
+    HostKeyMesh actual = loaded[0].getHostMesh();
+    for (unsigned int i = 0; i < 3; i++)
+        for (unsigned int j = 0; j < 3; j++)
+            CPPUNIT_ASSERT_EQUAL(expected.vertices[i][j], actual.vertices[i][j]);
+    for (unsigned int i = 0; i < 2; i++)
+        CPPUNIT_ASSERT_EQUAL(expected.vertexKeys[i], actual.vertexKeys[i]);
+    for (unsigned int j = 0; j < 3; j++)
+        CPPUNIT_ASSERT_EQUAL(expected.triangles[0][j], actual.triangles[0][j]);
+}
+
+void TestBucketCache::testLoadMissing()
+{
+    BucketCache cache(dir, "params");
+    cache.setFullGrid(grid);
+    const BucketCache::Key key = cache.makeKey(&splats[0], splats.size(), grid, 0);
+
+    boost::ptr_vector<BucketCache::Mesh> loaded;
+    loaded.push_back(makeMesh());
+    CPPUNIT_ASSERT(!cache.load(key, loaded));
+    CPPUNIT_ASSERT(loaded.empty());
+}
+
+void TestBucketCache::testLoadCorrupt()
+{
+    BucketCache cache(dir, "params");
+    cache.setFullGrid(grid);
+    const BucketCache::Key key = cache.makeKey(&splats[0], splats.size(), grid, 0);
+
+    boost::ptr_vector<BucketCache::Mesh> meshes;
+    meshes.push_back(makeMesh());
+    cache.store(key, meshes);
+
+    const boost::filesystem::path path = dir / (key.str() + ".mesh");
+    CPPUNIT_ASSERT(boost::filesystem::exists(path));
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 4);
+
+    boost::ptr_vector<BucketCache::Mesh> loaded;
+    CPPUNIT_ASSERT(!cache.load(key, loaded));
+    CPPUNIT_ASSERT(loaded.empty());
+}
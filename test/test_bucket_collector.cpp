@@ -0,0 +1,155 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref bucket_collector.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include "../src/bucket_collector.h"
+#include "../src/statistics.h"
+#include "testutil.h"
+
+class TestBucketCollector : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestBucketCollector);
+    CPPUNIT_TEST(testOrder);
+    CPPUNIT_TEST(testLongestFirst);
+    CPPUNIT_TEST(testLongestFirstSkip);
+    CPPUNIT_TEST(testLimit);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Number of splats in each bin passed to the functor, in order
+    std::vector<SplatSet::splat_id> seen;
+    /// Chunk generation of each bin passed to the functor, in order
+    std::vector<ChunkId::gen_type> gens;
+
+    void collect(const Statistics::Container::vector<BucketCollector::Bin> &bins);
+
+    /// Pass a bin with @a numSplats splats in a 4x4x4 grid for chunk (@a chunk, 0, 0)
+    static void add(BucketCollector &collector, SplatSet::splat_id numSplats, Grid::size_type chunk);
+
+public:
+    virtual void setUp() { seen.clear(); gens.clear(); }
+
+    void testOrder();             ///< Bins are passed on in bucketing order by default
+    void testLongestFirst();      ///< Bins of each chunk are sorted by decreasing cost
+    void testLongestFirstSkip();  ///< @ref BucketCollector::setSkip counts bins in sorted order
+    void testLimit();             ///< @ref BucketCollector::setLimit discards bins beyond the limit
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBucketCollector, TestSet::perBuild());
+
+void TestBucketCollector::collect(const Statistics::Container::vector<BucketCollector::Bin> &bins)
+{
+    for (std::size_t i = 0; i < bins.size(); i++)
+    {
+        seen.push_back(bins[i].ranges.numSplats());
+        gens.push_back(bins[i].chunkId.gen);
+    }
+}
+
+void TestBucketCollector::add(BucketCollector &collector, SplatSet::splat_id numSplats, Grid::size_type chunk)
+{
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    SplatSet::SubsetBase ranges;
+    ranges.addRange(1000 * chunk, 1000 * chunk + numSplats);
+    Bucket::Recursion recursion;
+    recursion.chunk[0] = chunk;
+    collector(ranges, Grid(ref, 1.0f, 0, 4, 0, 4, 0, 4), recursion);
+}
+
+void TestBucketCollector::testOrder()
+{
+    BucketCollector collector(1000, boost::bind(&TestBucketCollector::collect, this, _1));
+    add(collector, 5, 1);
+    add(collector, 20, 1);
+    add(collector, 10, 2);
+    collector.flush();
+
+    CPPUNIT_ASSERT_EQUAL(std::size_t(3), seen.size());
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(5), seen[0]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(20), seen[1]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(10), seen[2]);
+}
+
+void TestBucketCollector::testLongestFirst()
+{
+    BucketCollector collector(1000, boost::bind(&TestBucketCollector::collect, this, _1));
+    collector.setLongestFirst(true, 0.0);
+    add(collector, 5, 1);
+    add(collector, 20, 1);
+    add(collector, 7, 1);
+    add(collector, 10, 2);
+    add(collector, 30, 2);
+    collector.flush();
+
+    CPPUNIT_ASSERT_EQUAL(std::size_t(5), seen.size());
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(20), seen[0]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(7), seen[1]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(5), seen[2]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(30), seen[3]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(10), seen[4]);
+    // Chunks are not interleaved
+    CPPUNIT_ASSERT(gens[2] < gens[3]);
+    CPPUNIT_ASSERT_EQUAL(gens[0], gens[2]);
+    CPPUNIT_ASSERT_EQUAL(gens[3], gens[4]);
+}
+
+void TestBucketCollector::testLongestFirstSkip()
+{
+    BucketCollector collector(1000, boost::bind(&TestBucketCollector::collect, this, _1));
+    collector.setLongestFirst(true, 0.0);
+    collector.setSkip(2);
+    add(collector, 5, 1);
+    add(collector, 20, 1);
+    add(collector, 7, 1);
+    add(collector, 10, 2);
+    collector.flush();
+
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), seen.size());
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(5), seen[0]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(10), seen[1]);
+}
+
+void TestBucketCollector::testLimit()
+{
+    BucketCollector collector(1000, boost::bind(&TestBucketCollector::collect, this, _1));
+    collector.setSkip(1);
+    collector.setLimit(2);
+    add(collector, 5, 1);
+    add(collector, 20, 1);
+    add(collector, 7, 1);
+    add(collector, 10, 2);
+    collector.flush();
+
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), seen.size());
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(20), seen[0]);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(7), seen[1]);
+}
@@ -0,0 +1,141 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref BucketCounterCL.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/tr1/random.hpp>
+#include "../src/tr1_cstdint.h"
+#include "testutil.h"
+#include "test_clh.h"
+#include "test_splat_set.h"
+#include "../src/bucket.h"
+#include "../src/bucket_counter_cl.h"
+#include "../src/splat_set.h"
+#include "../src/statistics.h"
+
+/// Tests for @ref BucketCounterCL
+class TestBucketCounterCL : public CLH::Test::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestBucketCounterCL);
+    CPPUNIT_TEST(testSameBuckets);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    typedef SplatSet::FastBlobSet<SplatSet::VectorsSet> Splats;
+
+    /// Summary of one bucket passed to the processing function
+    struct Block
+    {
+        Grid grid;
+        SplatSet::splat_id numSplats;
+    };
+
+    static void bucketFunc(std::vector<Block> &blocks,
+                           const SplatSet::Traits<Splats>::subset_type &splats,
+                           const Grid &grid, const Bucket::Recursion &);
+
+    void testSameBuckets();    ///< Counting on the device gives the same buckets as on the host
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBucketCounterCL, TestSet::perBuild());
+
+void TestBucketCounterCL::bucketFunc(
+    std::vector<Block> &blocks,
+    const SplatSet::Traits<Splats>::subset_type &splats,
+    const Grid &grid, const Bucket::Recursion &)
+{
+    Block block;
+    block.grid = grid;
+    block.numSplats = splats.numSplats();
+    blocks.push_back(block);
+}
+
+void TestBucketCounterCL::testSameBuckets()
+{
+    BucketCounterCL counter(context, device);
+    Statistics::Counter &stat = Statistics::getStatistic<Statistics::Counter>("bucket.countSplats.device");
+
+    for (unsigned long seed = 0; seed < 10; seed++)
+    {
+        std::tr1::mt19937 engine(seed);
+        std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_real<float> >
+            genPos(engine, std::tr1::uniform_real<float>(-50.0f, 50.0f));
+        std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_real<float> >
+            genR(engine, std::tr1::uniform_real<float>(0.01f, 8.0f));
+
+        Splats splats;
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            splats.push_back(std::vector<Splat>());
+            for (unsigned int j = 0; j < 1000; j++)
+            {
+                Splat splat;
+                splat.position[0] = genPos();
+                splat.position[1] = genPos();
+                // Mostly flat, so that the density varies across the region
+                splat.position[2] = genPos() * 0.1f;
+                splat.radius = genR();
+                splat.quality = 0.0f;
+                splat.normal[0] = splat.normal[1] = splat.normal[2] = 1.0f;
+                splats.back().push_back(splat);
+            }
+        }
+        splats.computeBlobs(0.5f, 4);
+        const Grid grid = splats.getBoundingGrid();
+
+        const unsigned int chunkCells = (seed & 1) ? 64 : 0;
+        std::vector<Block> expected, actual;
+        Bucket::bucket(splats, grid, 500, 64, chunkCells, 4, 4096,
+                       boost::bind(&TestBucketCounterCL::bucketFunc, boost::ref(expected), _1, _2, _3));
+
+        const unsigned long long before = stat.getTotal();
+        Bucket::bucket(splats, grid, 500, 64, chunkCells, 4, 4096,
+                       boost::bind(&TestBucketCounterCL::bucketFunc, boost::ref(actual), _1, _2, _3),
+                       Bucket::Recursion(), Bucket::CostModel(), 1, false, &counter);
+        CPPUNIT_ASSERT_EQUAL(before + 1ULL, stat.getTotal());
+
+        MLSGPU_ASSERT_EQUAL(expected.size(), actual.size());
+        for (std::size_t i = 0; i < expected.size(); i++)
+        {
+            for (unsigned int j = 0; j < 3; j++)
+            {
+                CPPUNIT_ASSERT_EQUAL(expected[i].grid.getExtent(j).first, actual[i].grid.getExtent(j).first);
+                CPPUNIT_ASSERT_EQUAL(expected[i].grid.getExtent(j).second, actual[i].grid.getExtent(j).second);
+            }
+            CPPUNIT_ASSERT_EQUAL(expected[i].numSplats, actual[i].numSplats);
+        }
+    }
+}
@@ -0,0 +1,137 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Tests for @ref BucketLoader.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include "testutil.h"
+#include "../src/bucket_loader.h"
+#include "../src/grid.h"
+
+class TestBucketLoader : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestBucketLoader);
+    CPPUNIT_TEST(testLodItems);
+    CPPUNIT_TEST(testLodItemsEmpty);
+    CPPUNIT_TEST(testPreview);
+    CPPUNIT_TEST(testPreviewEmpty);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    Grid grid;      ///< Bucket in base cells
+
+    /// Check that @a item has the given level, output and extents
+    static void checkItem(const BucketLoader::LodItem &item,
+                          unsigned int level, unsigned int lod,
+                          Grid::difference_type x0, Grid::difference_type x1,
+                          Grid::difference_type y0, Grid::difference_type y1,
+                          Grid::difference_type z0, Grid::difference_type z1);
+
+public:
+    virtual void setUp();
+
+    void testLodItems();        ///< Full-resolution item followed by each coarse level
+    void testLodItemsEmpty();   ///< Coarse levels with no cells are skipped
+    void testPreview();         ///< Only the coarsened item, sent to the first level of detail
+    void testPreviewEmpty();    ///< Nothing for a bucket with no cells at the preview level
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBucketLoader, TestSet::perBuild());
+
+void TestBucketLoader::setUp()
+{
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    grid = Grid(ref, 1.0f, 0, 10, 3, 17, -5, 8);
+}
+
+void TestBucketLoader::checkItem(
+    const BucketLoader::LodItem &item,
+    unsigned int level, unsigned int lod,
+    Grid::difference_type x0, Grid::difference_type x1,
+    Grid::difference_type y0, Grid::difference_type y1,
+    Grid::difference_type z0, Grid::difference_type z1)
+{
+    CPPUNIT_ASSERT_EQUAL(level, item.level);
+    CPPUNIT_ASSERT_EQUAL(lod, item.lod);
+    CPPUNIT_ASSERT_EQUAL(x0, item.grid.getExtent(0).first);
+    CPPUNIT_ASSERT_EQUAL(x1, item.grid.getExtent(0).second);
+    CPPUNIT_ASSERT_EQUAL(y0, item.grid.getExtent(1).first);
+    CPPUNIT_ASSERT_EQUAL(y1, item.grid.getExtent(1).second);
+    CPPUNIT_ASSERT_EQUAL(z0, item.grid.getExtent(2).first);
+    CPPUNIT_ASSERT_EQUAL(z1, item.grid.getExtent(2).second);
+}
+
+void TestBucketLoader::testLodItems()
+{
+    std::vector<BucketLoader::LodItem> items;
+    BucketLoader::lodItems(grid, 2, 0, items);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(3), items.size());
+    checkItem(items[0], 0, 0, 0, 10, 3, 17, -5, 8);
+    checkItem(items[1], 1, 1, 0, 5, 2, 9, -2, 4);
+    checkItem(items[2], 2, 2, 0, 3, 1, 5, -1, 2);
+
+    // No levels of detail: just the full-resolution item
+    BucketLoader::lodItems(grid, 0, 0, items);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), items.size());
+    checkItem(items[0], 0, 0, 0, 10, 3, 17, -5, 8);
+}
+
+void TestBucketLoader::testLodItemsEmpty()
+{
+    // Y has cells 5..7, which hold no coarse cell from level 2 on
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    Grid thin(ref, 1.0f, 0, 16, 5, 7, 0, 16);
+    std::vector<BucketLoader::LodItem> items;
+    BucketLoader::lodItems(thin, 3, 0, items);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), items.size());
+    checkItem(items[0], 0, 0, 0, 16, 5, 7, 0, 16);
+    checkItem(items[1], 1, 1, 0, 8, 3, 4, 0, 8);
+}
+
+void TestBucketLoader::testPreview()
+{
+    std::vector<BucketLoader::LodItem> items;
+    BucketLoader::lodItems(grid, 0, 2, items);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), items.size());
+    checkItem(items[0], 2, 1, 0, 3, 1, 5, -1, 2);
+
+    // The levels of detail are ignored
+    BucketLoader::lodItems(grid, 3, 2, items);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), items.size());
+    checkItem(items[0], 2, 1, 0, 3, 1, 5, -1, 2);
+}
+
+void TestBucketLoader::testPreviewEmpty()
+{
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    Grid thin(ref, 1.0f, 0, 16, 5, 7, 0, 16);
+    std::vector<BucketLoader::LodItem> items;
+    items.resize(1);
+    BucketLoader::lodItems(thin, 0, 2, items);
+    CPPUNIT_ASSERT(items.empty());
+}
@@ -0,0 +1,202 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref bucket_plan.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <boost/bind.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include "../src/bucket_plan.h"
+#include "../src/bucket.h"
+#include "../src/grid.h"
+#include "../src/splat_set.h"
+#include "testutil.h"
+
+class TestBucketPlan : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestBucketPlan);
+    CPPUNIT_TEST(testRoundTrip);
+    CPPUNIT_TEST(testKeyMismatch);
+    CPPUNIT_TEST(testMissing);
+    CPPUNIT_TEST(testUncommitted);
+    CPPUNIT_TEST(testTruncated);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// A bucket seen by @ref process
+    struct Entry
+    {
+        std::vector<std::pair<SplatSet::splat_id, SplatSet::splat_id> > ranges;
+        Grid grid;
+        Bucket::Recursion recursionState;
+    };
+
+    boost::filesystem::path dir;         ///< Temporary directory
+    boost::filesystem::path path;        ///< Plan file
+    BucketPlan::Splats splats;           ///< Empty superset for the subsets
+    std::vector<Entry> seen;             ///< Buckets passed to @ref process
+
+    /// Processor that records the buckets in @ref seen
+    void process(const BucketPlan::Subset &subset, const Grid &grid, const Bucket::Recursion &recursionState);
+
+    /// Pass some buckets to @a recorder
+    void record(BucketPlan::Recorder &recorder);
+
+    void testRoundTrip();      ///< Test that replaying gives the recorded buckets
+    void testKeyMismatch();    ///< Test replaying with a different key
+    void testMissing();        ///< Test replaying a plan that does not exist
+    void testUncommitted();    ///< Test that a plan is not written without @ref BucketPlan::Recorder::commit
+    void testTruncated();      ///< Test replaying a plan with the end missing
+
+public:
+    virtual void setUp();
+    virtual void tearDown();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestBucketPlan, TestSet::perBuild());
+
+void TestBucketPlan::setUp()
+{
+    dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directory(dir);
+    path = dir / "plan";
+    seen.clear();
+}
+
+void TestBucketPlan::tearDown()
+{
+    boost::filesystem::remove_all(dir);
+}
+
+void TestBucketPlan::process(
+    const BucketPlan::Subset &subset, const Grid &grid, const Bucket::Recursion &recursionState)
+{
+    Entry e;
+    for (SplatSet::SubsetBase::const_iterator i = subset.begin(); i != subset.end(); ++i)
+        e.ranges.push_back(*i);
+    e.grid = grid;
+    e.recursionState = recursionState;
+    seen.push_back(e);
+}
+
+void TestBucketPlan::record(BucketPlan::Recorder &recorder)
+{
+    const float ref[3] = {0.5f, -1.0f, 2.0f};
+    Bucket::Recursion recursionState;
+
+    BucketPlan::Subset a(splats);
+    a.addRange(3, 10);
+    a.addRange(200000, 200001);
+    a.addRange(UINT64_C(1) << 40, (UINT64_C(1) << 40) + 5);
+    a.flush();
+    recorder(a, Grid(ref, 0.25f, 0, 8, -4, 4, 16, 24), recursionState);
+
+    BucketPlan::Subset b(splats);
+    b.addRange(7, 8);
+    b.flush();
+    recursionState.chunk[0] = 1;
+    recursionState.chunk[2] = 3;
+    recursionState.depth = 2;
+    recorder(b, Grid(ref, 0.25f, 8, 16, -4, 4, 16, 24), recursionState);
+}
+
+void TestBucketPlan::testRoundTrip()
+{
+    {
+        BucketPlan::Recorder recorder(path, "key", boost::bind(&TestBucketPlan::process, this, _1, _2, _3));
+        record(recorder);
+        recorder.commit();
+    }
+    std::vector<Entry> expected;
+    expected.swap(seen);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), expected.size());
+
+    CPPUNIT_ASSERT(BucketPlan::replay(path, "key", splats,
+                                      boost::bind(&TestBucketPlan::process, this, _1, _2, _3)));
+    CPPUNIT_ASSERT_EQUAL(expected.size(), seen.size());
+    for (std::size_t i = 0; i < expected.size(); i++)
+    {
+        CPPUNIT_ASSERT(expected[i].ranges == seen[i].ranges);
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            CPPUNIT_ASSERT_EQUAL(expected[i].grid.getReference()[j], seen[i].grid.getReference()[j]);
+            CPPUNIT_ASSERT_EQUAL(expected[i].grid.getExtent(j).first, seen[i].grid.getExtent(j).first);
+            CPPUNIT_ASSERT_EQUAL(expected[i].grid.getExtent(j).second, seen[i].grid.getExtent(j).second);
+            CPPUNIT_ASSERT_EQUAL(expected[i].recursionState.chunk[j], seen[i].recursionState.chunk[j]);
+        }
+        CPPUNIT_ASSERT_EQUAL(expected[i].grid.getSpacing(), seen[i].grid.getSpacing());
+    }
+}
+
+void TestBucketPlan::testKeyMismatch()
+{
+    {
+        BucketPlan::Recorder recorder(path, "key", boost::bind(&TestBucketPlan::process, this, _1, _2, _3));
+        record(recorder);
+        recorder.commit();
+    }
+    seen.clear();
+    CPPUNIT_ASSERT(!BucketPlan::replay(path, "other key", splats,
+                                       boost::bind(&TestBucketPlan::process, this, _1, _2, _3)));
+    CPPUNIT_ASSERT(seen.empty());
+}
+
+void TestBucketPlan::testMissing()
+{
+    CPPUNIT_ASSERT(!BucketPlan::replay(path, "key", splats,
+                                       boost::bind(&TestBucketPlan::process, this, _1, _2, _3)));
+    CPPUNIT_ASSERT(seen.empty());
+}
+
+void TestBucketPlan::testUncommitted()
+{
+    {
+        BucketPlan::Recorder recorder(path, "key", boost::bind(&TestBucketPlan::process, this, _1, _2, _3));
+        record(recorder);
+    }
+    CPPUNIT_ASSERT(!boost::filesystem::exists(path));
+    CPPUNIT_ASSERT(boost::filesystem::is_empty(dir));
+}
+
+void TestBucketPlan::testTruncated()
+{
+    {
+        BucketPlan::Recorder recorder(path, "key", boost::bind(&TestBucketPlan::process, this, _1, _2, _3));
+        record(recorder);
+        recorder.commit();
+    }
+    seen.clear();
+    boost::filesystem::resize_file(path, boost::filesystem::file_size(path) - 8);
+    CPPUNIT_ASSERT(!BucketPlan::replay(path, "key", splats,
+                                       boost::bind(&TestBucketPlan::process, this, _1, _2, _3)));
+    CPPUNIT_ASSERT(seen.empty());
+}
@@ -0,0 +1,99 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref chunk_tracker.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <boost/bind.hpp>
+#include "../src/chunk_tracker.h"
+#include "testutil.h"
+
+class TestChunkTracker : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestChunkTracker);
+    CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testCloseFirst);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    std::vector<ChunkTracker::gen_type> completed;
+
+    void complete(ChunkTracker::gen_type gen) { completed.push_back(gen); }
+
+public:
+    virtual void setUp() { completed.clear(); }
+
+    void testSimple();          ///< Work finishes after the chunk is closed
+    void testCloseFirst();      ///< Work is handed on between stages after the chunk is closed
+    void testEmpty();           ///< A chunk closed without any work
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestChunkTracker, TestSet::perBuild());
+
+void TestChunkTracker::testSimple()
+{
+    ChunkTracker tracker(boost::bind(&TestChunkTracker::complete, this, _1));
+    tracker.add(3, 2);
+    tracker.add(4);
+    tracker.done(3);
+    tracker.close(3);
+    CPPUNIT_ASSERT(completed.empty());
+    tracker.done(4);
+    CPPUNIT_ASSERT(completed.empty());
+    tracker.done(3);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), completed.size());
+    CPPUNIT_ASSERT_EQUAL(ChunkTracker::gen_type(3), completed[0]);
+    tracker.close(4);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), completed.size());
+    CPPUNIT_ASSERT_EQUAL(ChunkTracker::gen_type(4), completed[1]);
+}
+
+void TestChunkTracker::testCloseFirst()
+{
+    ChunkTracker tracker(boost::bind(&TestChunkTracker::complete, this, _1));
+    tracker.add(0);
+    tracker.close(0);
+    // A downstream stage takes over the work before the first stage finishes it
+    tracker.add(0, 2);
+    tracker.done(0);
+    tracker.done(0);
+    CPPUNIT_ASSERT(completed.empty());
+    tracker.done(0);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), completed.size());
+    CPPUNIT_ASSERT_EQUAL(ChunkTracker::gen_type(0), completed[0]);
+}
+
+void TestChunkTracker::testEmpty()
+{
+    ChunkTracker tracker(boost::bind(&TestChunkTracker::complete, this, _1));
+    tracker.close(7);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), completed.size());
+    CPPUNIT_ASSERT_EQUAL(ChunkTracker::gen_type(7), completed[0]);
+}
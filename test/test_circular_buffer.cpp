@@ -30,11 +30,14 @@
 
 #include <cstddef>
 #include <algorithm>
+#include <vector>
+#include <cstring>
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <boost/bind.hpp>
 #include <boost/tr1/random.hpp>
 #include <boost/thread.hpp>
+#include <boost/scoped_ptr.hpp>
 #include "testutil.h"
 #include "../src/circular_buffer.h"
 #include "../src/work_queue.h"
@@ -140,22 +143,32 @@ void TestCircularBuffer::testZero()
     CPPUNIT_ASSERT_THROW(buffer.allocate(tworker, 0), std::invalid_argument);
 }
 
-/// Stress tests for @ref CircularBuffer
-class TestCircularBufferStress : public CppUnit::TestFixture
+/**
+ * Stress tests for @ref CircularBuffer and @ref LockFreeCircularBuffer. The
+ * subclasses provide the buffer.
+ */
+template<typename Buffer>
+class TestCircularBufferStressBase : public CppUnit::TestFixture
 {
-    CPPUNIT_TEST_SUITE(TestCircularBufferStress);
-    CPPUNIT_TEST(testStress);
-    CPPUNIT_TEST_SUITE_END();
-
 public:
-    TestCircularBufferStress()
-        : buffer("mem.TestCircularBufferStress", 123 * sizeof(std::tr1::uint64_t)), workQueue() {}
+    virtual void setUp();
+    virtual void tearDown();
+
+protected:
+    /// Create the buffer, with space for 123 uint64 values
+    virtual Buffer *makeBuffer() const = 0;
+
+    /**
+     * Pass a lot of numbers from @ref producerThread to the main thread,
+     * checking that they arrive correctly formed.
+     */
+    void testStress();
 
 private:
     struct Item
     {
         std::size_t start, end; // expected start and end values in the buffer
-        CircularBuffer::Allocation alloc;
+        typename Buffer::Allocation alloc;
 
         // Default-constructed item is an end-of-work sentinel
         Item() : start(0), end(0) {}
@@ -164,7 +177,7 @@ private:
     std::tr1::uint64_t badCount;
     boost::mutex badMutex;
 
-    CircularBuffer buffer;
+    boost::scoped_ptr<Buffer> buffer;
     WorkQueue<Item> workQueue;   ///< Ranges sent from producer to consumer
 
     /**
@@ -178,28 +191,70 @@ private:
      * the memory to the buffer.
      */
     void consumerThread();
+};
 
-    /**
-     * Pass a lot of numbers from @ref producerThread to the main thread,
-     * checking that they arrive correctly formed.
-     */
-    void testStress();
+/// Stress tests for @ref CircularBuffer
+class TestCircularBufferStress : public TestCircularBufferStressBase<CircularBuffer>
+{
+    CPPUNIT_TEST_SUITE(TestCircularBufferStress);
+    CPPUNIT_TEST(testStress);
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    virtual CircularBuffer *makeBuffer() const
+    {
+        return new CircularBuffer("mem.TestCircularBufferStress", 123 * sizeof(std::tr1::uint64_t));
+    }
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestCircularBufferStress, TestSet::perCommit());
 
-void TestCircularBufferStress::producerThread(std::tr1::uint64_t start, std::tr1::uint64_t end)
+/**
+ * Stress tests for @ref LockFreeCircularBuffer. The record ring is kept
+ * small so that running out of records is also exercised.
+ */
+class TestLockFreeCircularBufferStress : public TestCircularBufferStressBase<LockFreeCircularBuffer>
+{
+    CPPUNIT_TEST_SUITE(TestLockFreeCircularBufferStress);
+    CPPUNIT_TEST(testStress);
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    virtual LockFreeCircularBuffer *makeBuffer() const
+    {
+        return new LockFreeCircularBuffer("mem.TestLockFreeCircularBufferStress",
+                                          123 * sizeof(std::tr1::uint64_t), 8, true);
+    }
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestLockFreeCircularBufferStress, TestSet::perCommit());
+
+template<typename Buffer>
+void TestCircularBufferStressBase<Buffer>::setUp()
+{
+    CppUnit::TestFixture::setUp();
+    buffer.reset(makeBuffer());
+}
+
+template<typename Buffer>
+void TestCircularBufferStressBase<Buffer>::tearDown()
+{
+    buffer.reset();
+    CppUnit::TestFixture::tearDown();
+}
+
+template<typename Buffer>
+void TestCircularBufferStressBase<Buffer>::producerThread(std::tr1::uint64_t start, std::tr1::uint64_t end)
 {
     Timeplot::Worker tworker("producer");
 
     std::tr1::mt19937 engine;
     std::tr1::uint64_t cur = start;
-    std::tr1::uniform_int<std::tr1::uint32_t> chunkDist(1, buffer.size() / sizeof(cur));
+    std::tr1::uniform_int<std::tr1::uint32_t> chunkDist(1, buffer->size() / sizeof(cur));
 
     while (cur < end)
     {
         std::tr1::uint64_t elements = chunkDist(engine);
         elements = std::min(elements, end - cur);
-        CircularBuffer::Allocation alloc = buffer.allocate(tworker, sizeof(cur), elements);
+        typename Buffer::Allocation alloc = buffer->allocate(tworker, sizeof(cur), elements);
 
         std::tr1::uint64_t *ptr = static_cast<std::tr1::uint64_t *>(alloc.get());
         CPPUNIT_ASSERT(ptr != NULL);
@@ -216,14 +271,15 @@ void TestCircularBufferStress::producerThread(std::tr1::uint64_t start, std::tr1
     }
 }
 
-void TestCircularBufferStress::consumerThread()
+template<typename Buffer>
+void TestCircularBufferStressBase<Buffer>::consumerThread()
 {
     /* This generator doesn't do anything useful - it's just a way to
      * make sure that the producer and consumer run at about the same
      * rate and hence test both full and empty conditions.
      */
     std::tr1::mt19937 gen;
-    std::tr1::uniform_int<std::tr1::uint32_t> chunkDist(1, buffer.size() / sizeof(std::tr1::uint64_t));
+    std::tr1::uniform_int<std::tr1::uint32_t> chunkDist(1, buffer->size() / sizeof(std::tr1::uint64_t));
 
     std::tr1::uint64_t bad = 0;
     while (true)
@@ -242,14 +298,15 @@ void TestCircularBufferStress::consumerThread()
         }
 
         (void) chunkDist(gen);
-        buffer.free(item.alloc);
+        buffer->free(item.alloc);
     }
 
     boost::lock_guard<boost::mutex> lock(badMutex);
     badCount += bad;
 }
 
-void TestCircularBufferStress::testStress()
+template<typename Buffer>
+void TestCircularBufferStressBase<Buffer>::testStress()
 {
     const std::size_t perThread = 10000000;
     const std::size_t numProducers = 4;
@@ -259,10 +316,10 @@ void TestCircularBufferStress::testStress()
     badCount = 0;
 
     for (std::size_t i = 0; i < numProducers; i++)
-        producers.create_thread(boost::bind(&TestCircularBufferStress::producerThread, this,
+        producers.create_thread(boost::bind(&TestCircularBufferStressBase<Buffer>::producerThread, this,
                                             perThread * i, perThread * (i + 1)));
     for (std::size_t i = 0; i < numConsumers; i++)
-        consumers.create_thread(boost::bind(&TestCircularBufferStress::consumerThread, this));
+        consumers.create_thread(boost::bind(&TestCircularBufferStressBase<Buffer>::consumerThread, this));
 
     producers.join_all();
     workQueue.stop();
@@ -298,3 +355,108 @@ void TestCircularBuffer::testUnallocated()
     buffer.free(a4);
     MLSGPU_ASSERT_EQUAL(10, buffer.unallocated());
 }
+
+/**
+ * Functionality tests for @ref LockFreeCircularBuffer. Blocking is covered
+ * by @ref TestLockFreeCircularBufferStress.
+ */
+class TestLockFreeCircularBuffer : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestLockFreeCircularBuffer);
+    CPPUNIT_TEST(testAllocateFree);
+    CPPUNIT_TEST(testExternal);
+#if DEBUG
+    CPPUNIT_TEST(testCreateZero);
+    CPPUNIT_TEST(testTooLarge);
+#endif
+    CPPUNIT_TEST(testUnallocated);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testCreateZero();      ///< Test that an exception is thrown on creating a zero-size buffer
+    void testAllocateFree();    ///< Smoke test for @ref LockFreeCircularBuffer::allocate and @ref LockFreeCircularBuffer::free
+    void testExternal();        ///< Test a buffer backed by caller-supplied memory
+    void testTooLarge();        ///< Test exception handling when asking for too much memory
+    void testUnallocated();     ///< Test @ref LockFreeCircularBufferBase::unallocated
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestLockFreeCircularBuffer, TestSet::perBuild());
+
+void TestLockFreeCircularBuffer::testCreateZero()
+{
+    CPPUNIT_ASSERT_THROW(LockFreeCircularBuffer("zero", 0), std::invalid_argument);
+    CPPUNIT_ASSERT_THROW(LockFreeCircularBuffer("zero", 10, 0), std::invalid_argument);
+}
+
+void TestLockFreeCircularBuffer::testAllocateFree()
+{
+    Timeplot::Worker tworker("test");
+
+    LockFreeCircularBuffer buffer("test", 10);
+    LockFreeCircularBuffer::Allocation alloc = buffer.allocate(tworker, sizeof(short), 2);
+    short *values = reinterpret_cast<short *>(alloc.get());
+    CPPUNIT_ASSERT(values != NULL);
+    values[0] = 123;
+    values[1] = 456;
+    buffer.free(alloc);
+}
+
+void TestLockFreeCircularBuffer::testExternal()
+{
+    Timeplot::Worker tworker("test");
+    std::vector<char> memory(100);
+
+    {
+        LockFreeCircularBuffer buffer("test", memory.size(), 256, false, &memory[0]);
+        CPPUNIT_ASSERT_EQUAL(std::size_t(100), buffer.size());
+        LockFreeCircularBuffer::Allocation a = buffer.allocate(tworker, 40);
+        LockFreeCircularBuffer::Allocation b = buffer.allocate(tworker, 60);
+        CPPUNIT_ASSERT(a.get() >= (void *) &memory[0]);
+        CPPUNIT_ASSERT(b.get() >= (void *) &memory[0]);
+        CPPUNIT_ASSERT((char *) a.get() + 40 <= &memory[0] + 100);
+        CPPUNIT_ASSERT((char *) b.get() + 60 <= &memory[0] + 100);
+        std::memset(a.get(), 1, 40);
+        std::memset(b.get(), 2, 60);
+        buffer.free(a);
+        buffer.free(b);
+    }
+    // The memory is not freed by the buffer, and still holds the data
+    CPPUNIT_ASSERT_EQUAL(40, int(std::count(memory.begin(), memory.end(), 1)));
+    CPPUNIT_ASSERT_EQUAL(60, int(std::count(memory.begin(), memory.end(), 2)));
+}
+
+void TestLockFreeCircularBuffer::testTooLarge()
+{
+    Timeplot::Worker tworker("test");
+    LockFreeCircularBuffer buffer("test", 999);
+    CPPUNIT_ASSERT_THROW(buffer.allocate(tworker, 1000, 1, NULL), std::out_of_range);
+    CPPUNIT_ASSERT_THROW(buffer.allocate(tworker, 1000), std::out_of_range);
+}
+
+void TestLockFreeCircularBuffer::testUnallocated()
+{
+    Timeplot::Worker worker("test");
+    LockFreeCircularBuffer buffer("test", 10, 4);
+
+    MLSGPU_ASSERT_EQUAL(10, buffer.unallocated());
+
+    LockFreeCircularBuffer::Allocation a1 = buffer.allocate(worker, 3);
+    LockFreeCircularBuffer::Allocation a2 = buffer.allocate(worker, 1);
+
+    MLSGPU_ASSERT_EQUAL(6, buffer.unallocated());
+
+    buffer.free(a2); // does not make more space available until a1 freed
+    MLSGPU_ASSERT_EQUAL(6, buffer.unallocated());
+
+    LockFreeCircularBuffer::Allocation a3 = buffer.allocate(worker, 5);
+    MLSGPU_ASSERT_EQUAL(1, buffer.unallocated());
+
+    buffer.free(a1);
+    MLSGPU_ASSERT_EQUAL(5, buffer.unallocated());
+
+    LockFreeCircularBuffer::Allocation a4 = buffer.allocate(worker, 3); // wastes 1 slot at end
+    MLSGPU_ASSERT_EQUAL(1, buffer.unallocated());
+
+    buffer.free(a3);
+    buffer.free(a4);
+    MLSGPU_ASSERT_EQUAL(10, buffer.unallocated());
+}
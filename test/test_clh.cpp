@@ -37,16 +37,19 @@
 #include <CL/cl.hpp>
 #include <boost/program_options.hpp>
 #include <boost/smart_ptr/scoped_array.hpp>
+#include <boost/filesystem.hpp>
 #include <cstdlib>
 #include <algorithm>
 #include <locale>
 #include <sstream>
+#include <fstream>
 #include <string>
 #include "../src/tr1_cstdint.h"
 #include "testutil.h"
 #include "test_clh.h"
 #include "../src/clh.h"
 #include "../src/misc.h"
+#include "../src/statistics.h"
 
 using namespace std;
 namespace po = boost::program_options;
@@ -245,3 +248,76 @@ void TestResourceUsage::testMultiply()
     MLSGPU_ASSERT_EQUAL(15, prod.getImageWidth());
     MLSGPU_ASSERT_EQUAL(20, prod.getImageHeight());
 }
+
+/// Tests for the program binary cache in @ref CLH::build
+class TestProgramCache : public CLH::Test::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestProgramCache);
+    CPPUNIT_TEST(testHit);
+    CPPUNIT_TEST(testCorrupt);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    boost::filesystem::path dir;    ///< Temporary cache directory
+
+    /// Build a test program, returning the change in (hits, misses)
+    std::pair<unsigned long long, unsigned long long> build(const std::string &value);
+
+    void testHit();        ///< Rebuild the same program and get a cache hit
+    void testCorrupt();    ///< Corrupted entries are ignored
+
+public:
+    virtual void setUp();
+    virtual void tearDown();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestProgramCache, TestSet::perCommit());
+
+void TestProgramCache::setUp()
+{
+    CLH::Test::TestFixture::setUp();
+    dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("mlsgpu-cl-%%%%-%%%%");
+    CLH::setProgramCacheDir(dir.string());
+}
+
+void TestProgramCache::tearDown()
+{
+    CLH::setProgramCacheDir("");
+    boost::filesystem::remove_all(dir);
+    CLH::Test::TestFixture::tearDown();
+}
+
+std::pair<unsigned long long, unsigned long long> TestProgramCache::build(const std::string &value)
+{
+    Statistics::Counter &hits = Statistics::getStatistic<Statistics::Counter>("cl.cache.hits");
+    Statistics::Counter &misses = Statistics::getStatistic<Statistics::Counter>("cl.cache.misses");
+    unsigned long long oldHits = hits.getTotal();
+    unsigned long long oldMisses = misses.getTotal();
+
+    map<string, string> defines;
+    defines["TEST_VALUE"] = value;
+    cl::Program program = CLH::build(context, std::vector<cl::Device>(1, device),
+                                     "kernels/scale_bias.cl", defines);
+    CPPUNIT_ASSERT(program() != NULL);
+    return std::make_pair(hits.getTotal() - oldHits, misses.getTotal() - oldMisses);
+}
+
+void TestProgramCache::testHit()
+{
+    CPPUNIT_ASSERT(build("1") == std::make_pair(0ULL, 1ULL));
+    CPPUNIT_ASSERT(build("1") == std::make_pair(1ULL, 0ULL));
+    // Different defines must not use the same entry
+    CPPUNIT_ASSERT(build("2") == std::make_pair(0ULL, 1ULL));
+    CPPUNIT_ASSERT(build("2") == std::make_pair(1ULL, 0ULL));
+}
+
+void TestProgramCache::testCorrupt()
+{
+    CPPUNIT_ASSERT(build("1") == std::make_pair(0ULL, 1ULL));
+    for (boost::filesystem::directory_iterator i(dir); i != boost::filesystem::directory_iterator(); ++i)
+    {
+        std::ofstream out(i->path().string().c_str(), std::ios::binary | std::ios::trunc);
+        out << "mlsgpu-clbin 1\ngarbage";
+    }
+    CPPUNIT_ASSERT(build("1") == std::make_pair(0ULL, 1ULL));
+    CPPUNIT_ASSERT(build("1") == std::make_pair(1ULL, 0ULL));
+}
@@ -37,6 +37,7 @@
 #include <cppunit/extensions/ExceptionTestCaseDecorator.h>
 #include <string>
 #include <cstddef>
+#include <cstring>
 #include <algorithm>
 #include <vector>
 #include <iterator>
@@ -44,6 +45,7 @@
 #include <fstream>
 #include <sstream>
 #include <limits>
+#include <cmath>
 #include <boost/smart_ptr/scoped_array.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/bind.hpp>
@@ -52,6 +54,8 @@
 #include <boost/filesystem.hpp>
 #include "../src/fast_ply.h"
 #include "../src/splat.h"
+#include "../src/tr1_cstdint.h"
+#include "../src/statistics.h"
 #include "memory_reader.h"
 #include "memory_writer.h"
 #include "testutil.h"
@@ -90,12 +94,19 @@ class TestFastPlyReader : public CppUnit::TestFixture
     TEST_EXCEPTION_FILENAME(testNotFloat, FormatError, testFilename);
     TEST_EXCEPTION_FILENAME(testFormatAscii, FormatError, testFilename);
     TEST_EXCEPTION_FILENAME(testFormatMissing, FormatError, testFilename);
+    TEST_EXCEPTION_FILENAME(testLasCompressed, FormatError, testFilename);
 #endif
 
     CPPUNIT_TEST(testReadHeader);
     CPPUNIT_TEST(testRead);
     CPPUNIT_TEST(testReadZero);
     CPPUNIT_TEST(testReadIterator);
+    CPPUNIT_TEST(testReadCached);
+    CPPUNIT_TEST(testReadStream);
+    CPPUNIT_TEST(testReadPackedNormals);
+    CPPUNIT_TEST(testReadLas);
+    CPPUNIT_TEST(testDecodeStandard);
+    CPPUNIT_TEST(testPackNormal);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -171,6 +182,13 @@ public:
     void testRead();                   ///< Tests @ref FastPly::Reader::Handle::read with a pointer
     void testReadZero();               ///< Tests a zero-splat read
     void testReadIterator();           ///< Tests @ref FastPly::Reader::Handle::read with an output iterator
+    void testReadCached();             ///< Tests reading through handles that share a @ref FastPly::ReaderCache
+    void testReadStream();             ///< Tests decoding vertices that follow a header read from a stream
+    void testReadPackedNormals();      ///< Tests reading a file with @c normal_oct in place of @c nx, @c ny, @c nz
+    void testReadLas();                ///< Tests reading a LAS file with normals and radii in extra bytes
+    void testLasCompressed();          ///< LAS file with the LAZ compression bit set
+    void testDecodeStandard();         ///< Tests the specialised decoders for x, y, z, nx, ny, nz, radius layouts
+    void testPackNormal();             ///< Tests round trip through @ref FastPly::packNormal and @ref FastPly::unpackNormal
     /** @} */
 
     /**
@@ -491,6 +509,56 @@ void TestFastPlyReader::testRead()
 #endif
 }
 
+void TestFastPlyReader::testReadCached()
+{
+    setupRead(5);
+
+    boost::scoped_ptr<Reader> r(factory(content, testFilename, 2.0f, 250.0f));
+    ReaderCache cache(1);
+    r->setCache(&cache);
+    Statistics::Counter &hits = Statistics::getStatistic<Statistics::Counter>("files.cache.hits");
+    Statistics::Counter &misses = Statistics::getStatistic<Statistics::Counter>("files.cache.misses");
+    const unsigned long long hits0 = hits.getTotal();
+    const unsigned long long misses0 = misses.getTotal();
+
+    Splat out[3] = {};
+    {
+        Reader::Handle h(*r);
+        h.read(1, 4, out);
+        verify(1, out, out + 3);
+    }
+    {
+        // Two live handles cannot share a file, so one must be opened
+        Reader::Handle h1(*r);
+        Reader::Handle h2(*r);
+        h1.read(1, 4, out);
+        verify(1, out, out + 3);
+        h2.read(1, 4, out);
+        verify(1, out, out + 3);
+    }
+    {
+        Reader::Handle h(*r);
+        h.read(1, 4, out);
+        verify(1, out, out + 3);
+    }
+    CPPUNIT_ASSERT_EQUAL(2ULL, hits.getTotal() - hits0);
+    CPPUNIT_ASSERT_EQUAL(2ULL, misses.getTotal() - misses0);
+}
+
+void TestFastPlyReader::testReadStream()
+{
+    setupRead(5);
+    std::istringstream in(content);
+    Reader r(in, testFilename, 2.0f, 250.0f);
+    CPPUNIT_ASSERT_EQUAL(Reader::size_type(5), r.size());
+
+    std::vector<char> buffer(5 * r.getVertexSize());
+    CPPUNIT_ASSERT(in.read(&buffer[0], buffer.size()));
+    Splat out[5];
+    r.decode(&buffer[0], 0, 5, out);
+    verify(0, out, out + 5);
+}
+
 void TestFastPlyReader::testReadZero()
 {
     setupRead(5);
@@ -520,6 +588,202 @@ void TestFastPlyReader::testReadIterator()
 #endif
 }
 
+void TestFastPlyReader::testReadPackedNormals()
+{
+    const float normals[4][3] =
+    {
+        { 0.0f, 0.0f, 1.0f },
+        { 0.6f, -0.8f, 0.0f },
+        { -0.48f, 0.6f, -0.64f },
+        { 0.0f, 0.0f, -1.0f }
+    };
+    std::string header =
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "element vertex 4\n"
+        "property float32 x\n"
+        "property float32 y\n"
+        "property float32 z\n"
+        "property float32 radius\n"
+        "property uint32 normal_oct\n"
+        "end_header\n";
+    std::string payload;
+    for (int i = 0; i < 4; i++)
+    {
+        float values[4] = { float(i), float(i) + 0.5f, -float(i), 2.0f };
+        std::tr1::uint32_t packed = FastPly::packNormal(normals[i]);
+        payload.append(reinterpret_cast<const char *>(values), sizeof(values));
+        payload.append(reinterpret_cast<const char *>(&packed), sizeof(packed));
+    }
+
+    boost::scoped_ptr<Reader> r(factory(header + payload));
+    CPPUNIT_ASSERT_EQUAL(Reader::size_type(4), r->size());
+    Reader::Handle h(*r);
+    Splat out[4];
+    h.read(0, 4, out);
+    for (int i = 0; i < 4; i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(float(i), out[i].position[0]);
+        CPPUNIT_ASSERT_EQUAL(float(i) + 0.5f, out[i].position[1]);
+        CPPUNIT_ASSERT_EQUAL(-float(i), out[i].position[2]);
+        CPPUNIT_ASSERT_EQUAL(2.0f, out[i].radius);
+        for (int j = 0; j < 3; j++)
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(normals[i][j], out[i].normal[j], 1e-3);
+    }
+}
+
+/**
+ * Build a LAS 1.2 file with point data format 0 and the normal and radius
+ * of each point in extra bytes. Point @a i is at (i, i + 0.5, -i) and has
+ * normal (0, 0.6, 0.8) and radius 2.
+ */
+static std::string makeLas(int numPoints, std::tr1::uint8_t format = 0)
+{
+    const char * const names[4] = { "nx", "ny", "nz", "radius" };
+    const std::tr1::uint16_t headerSize = 227;
+    const std::tr1::uint16_t recordSize = 20 + 4 * sizeof(float);
+    const std::tr1::uint32_t pointOffset = headerSize + 54 + 4 * 192;
+
+    std::string header(headerSize, '\0');
+    header.replace(0, 4, "LASF");
+    header[24] = 1;
+    header[25] = 2;
+    const std::tr1::uint32_t numVLRs = 1, count = numPoints;
+    std::memcpy(&header[94], &headerSize, sizeof(headerSize));
+    std::memcpy(&header[96], &pointOffset, sizeof(pointOffset));
+    std::memcpy(&header[100], &numVLRs, sizeof(numVLRs));
+    header[104] = format;
+    std::memcpy(&header[105], &recordSize, sizeof(recordSize));
+    std::memcpy(&header[107], &count, sizeof(count));
+    const double scale[3] = { 0.5, 0.25, 1.0 };
+    const double offset[3] = { 0.0, 1000.0, 0.0 };
+    std::memcpy(&header[131], scale, sizeof(scale));
+    std::memcpy(&header[155], offset, sizeof(offset));
+
+    std::string vlr(54, '\0');
+    vlr.replace(2, 9, "LASF_Spec");
+    const std::tr1::uint16_t recordId = 4, length = 4 * 192;
+    std::memcpy(&vlr[18], &recordId, sizeof(recordId));
+    std::memcpy(&vlr[20], &length, sizeof(length));
+    for (int i = 0; i < 4; i++)
+    {
+        std::string desc(192, '\0');
+        desc[2] = 9; // float
+        desc.replace(4, std::strlen(names[i]), names[i]);
+        vlr += desc;
+    }
+
+    std::string points;
+    for (int i = 0; i < numPoints; i++)
+    {
+        std::string record(recordSize, '\0');
+        const std::tr1::int32_t xyz[3] = { 2 * i, (i - 1000) * 4 + 2, -i };
+        const float extra[4] = { 0.0f, 0.6f, 0.8f, 2.0f };
+        std::memcpy(&record[0], xyz, sizeof(xyz));
+        std::memcpy(&record[20], extra, sizeof(extra));
+        points += record;
+    }
+    return header + vlr + points;
+}
+
+void TestFastPlyReader::testReadLas()
+{
+    boost::scoped_ptr<Reader> r(factory(makeLas(4), testFilename, 1.5f));
+    CPPUNIT_ASSERT_EQUAL(Reader::size_type(4), r->size());
+    CPPUNIT_ASSERT(!r->isStandardLayout());
+    Reader::Handle h(*r);
+    Splat out[4];
+    h.read(0, 4, out);
+    for (int i = 0; i < 4; i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(float(i), out[i].position[0]);
+        CPPUNIT_ASSERT_EQUAL(float(i) + 0.5f, out[i].position[1]);
+        CPPUNIT_ASSERT_EQUAL(-float(i), out[i].position[2]);
+        CPPUNIT_ASSERT_EQUAL(0.0f, out[i].normal[0]);
+        CPPUNIT_ASSERT_EQUAL(0.6f, out[i].normal[1]);
+        CPPUNIT_ASSERT_EQUAL(0.8f, out[i].normal[2]);
+        CPPUNIT_ASSERT_EQUAL(3.0f, out[i].radius);
+    }
+}
+
+void TestFastPlyReader::testLasCompressed()
+{
+    boost::scoped_ptr<Reader> r(factory(makeLas(4, 0x80)));
+}
+
+void TestFastPlyReader::testDecodeStandard()
+{
+    // Number of extra float properties before and after the standard ones
+    const int padding[][2] = { {0, 0}, {0, 1}, {1, 0}, {2, 3} };
+    const int numVertices = 300;
+    for (std::size_t p = 0; p < sizeof(padding) / sizeof(padding[0]); p++)
+    {
+        const int before = padding[p][0];
+        const int after = padding[p][1];
+        const int stride = before + 7 + after;
+        std::string header =
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "element vertex " + boost::lexical_cast<std::string>(numVertices) + "\n";
+        for (int i = 0; i < before; i++)
+            header += "property float32 before" + boost::lexical_cast<std::string>(i) + "\n";
+        header +=
+            "property float32 x\n"
+            "property float32 y\n"
+            "property float32 z\n"
+            "property float32 nx\n"
+            "property float32 ny\n"
+            "property float32 nz\n"
+            "property float32 radius\n";
+        for (int i = 0; i < after; i++)
+            header += "property float32 after" + boost::lexical_cast<std::string>(i) + "\n";
+        header += "end_header\n";
+
+        std::vector<float> values(numVertices * stride);
+        for (int i = 0; i < numVertices; i++)
+            for (int j = 0; j < stride; j++)
+                values[i * stride + j] = i * 100.0f + (j - before);
+        std::string payload(reinterpret_cast<const char *>(&values[0]), values.size() * sizeof(float));
+
+        boost::scoped_ptr<Reader> r(factory(header + payload, testFilename, 2.0f, 250.0f));
+        CPPUNIT_ASSERT_EQUAL(Reader::size_type(stride * sizeof(float)), r->getVertexSize());
+        std::vector<Splat> out(numVertices - 7);
+        r->decode(payload.data(), 7, out.size(), &out[0]);
+        for (std::size_t i = 0; i < out.size(); i++)
+        {
+            const int pos = i + 7;
+            CPPUNIT_ASSERT_EQUAL(pos * 100.0f + 0.0f, out[i].position[0]);
+            CPPUNIT_ASSERT_EQUAL(pos * 100.0f + 1.0f, out[i].position[1]);
+            CPPUNIT_ASSERT_EQUAL(pos * 100.0f + 2.0f, out[i].position[2]);
+            CPPUNIT_ASSERT_EQUAL(pos * 100.0f + 3.0f, out[i].normal[0]);
+            CPPUNIT_ASSERT_EQUAL(pos * 100.0f + 4.0f, out[i].normal[1]);
+            CPPUNIT_ASSERT_EQUAL(pos * 100.0f + 5.0f, out[i].normal[2]);
+            CPPUNIT_ASSERT_EQUAL(2.0f * std::min(250.0f, pos * 100.0f + 6.0f), out[i].radius);
+
+            const Splat single = r->decode(payload.data(), pos);
+            CPPUNIT_ASSERT_EQUAL(single.radius, out[i].radius);
+            CPPUNIT_ASSERT_EQUAL(single.quality, out[i].quality);
+        }
+    }
+}
+
+void TestFastPlyReader::testPackNormal()
+{
+    for (int i = -10; i <= 10; i++)
+        for (int j = -10; j <= 10; j++)
+            for (int k = -10; k <= 10; k++)
+            {
+                if (i == 0 && j == 0 && k == 0)
+                    continue;
+                float len = std::sqrt(float(i * i + j * j + k * k));
+                float n[3] = { i / len, j / len, k / len };
+                float m[3];
+                FastPly::unpackNormal(FastPly::packNormal(n), m);
+                for (int l = 0; l < 3; l++)
+                    CPPUNIT_ASSERT_DOUBLES_EQUAL(n[l], m[l], 1e-3);
+            }
+}
+
 /**
  * Tests error handling for @ref FastPly::Reader when file errors occur
  */
@@ -560,16 +824,22 @@ class TestFastPlyWriter : public CppUnit::TestFixture
     CPPUNIT_TEST_SUITE(TestFastPlyWriter);
     TEST_EXCEPTION_FILENAME(testBadFilename, std::ios_base::failure, "/not_a_valid_filename/");
     CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testContainer);
+    CPPUNIT_TEST(testVertexNormals);
 #if DEBUG
     CPPUNIT_TEST(testState);
     CPPUNIT_TEST(testOverrun);
+    CPPUNIT_TEST(testVertexFormat);
 #endif
     CPPUNIT_TEST_SUITE_END();
 public:
     void testBadFilename();   ///< Try to write to an invalid filename, check for error
     void testSimple();        ///< Test normal operation
+    void testContainer();     ///< Test writing several files into one container
     void testState();         ///< Test assertions that the file is/is not open
     void testOverrun();       ///< Test writing beyond the end of the file
+    void testVertexFormat();  ///< Test the header and sizes for fixed-point vertices
+    void testVertexNormals(); ///< Test the header and data for vertices with normals
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestFastPlyWriter, TestSet::perBuild());
 
@@ -645,6 +915,47 @@ void TestFastPlyWriter::testSimple()
     CPPUNIT_ASSERT(0 == memcmp(data + headerSize + 75, indices + 6, 12));
 }
 
+void TestFastPlyWriter::testContainer()
+{
+    const float vertices[2 * 3] =
+    {
+        1.0f, 2.0f, 4.0f,
+        -1.0f, -2.0f, -4.0f
+    };
+    const std::tr1::uint32_t indices[3] = { 0, 1, 1 };
+
+    MemoryWriterPly w;
+    w.setNumVertices(2);
+    w.setNumTriangles(1);
+    const Writer::size_type first = w.getFileSize();
+    w.setNumVertices(1);
+    w.setNumTriangles(0);
+    const Writer::size_type second = w.getFileSize();
+    w.createContainer("container", first + second);
+    MLSGPU_ASSERT_EQUAL(first + second, w.getOutput("container").size());
+
+    // Write the second file first, to check that the first is not disturbed
+    w.open("container", first);
+    w.writeVertices(0, 1, vertices + 3);
+    w.close();
+    w.setNumVertices(2);
+    w.setNumTriangles(1);
+    w.open("container", 0);
+    w.writeVertices(0, 2, vertices);
+    w.writeTriangles(0, 1, indices);
+    w.close();
+
+    const std::string &data = w.getOutput("container");
+    MLSGPU_ASSERT_EQUAL(first + second, data.size());
+    const std::size_t headerSize = first - 2 * 12 - Writer::triangleSize;
+    CPPUNIT_ASSERT(0 == data.compare(0, 4, "ply\n"));
+    CPPUNIT_ASSERT(0 == memcmp(data.data() + headerSize, vertices, sizeof(vertices)));
+    MLSGPU_ASSERT_EQUAL(3, data[headerSize + 24]);
+    CPPUNIT_ASSERT(0 == memcmp(data.data() + headerSize + 25, indices, 12));
+    CPPUNIT_ASSERT(0 == data.compare(first, 4, "ply\n"));
+    CPPUNIT_ASSERT(0 == memcmp(data.data() + first + second - 12, vertices + 3, 12));
+}
+
 void TestFastPlyWriter::testState()
 {
     MemoryWriterPly w;
@@ -687,3 +998,88 @@ void TestFastPlyWriter::testOverrun()
     CPPUNIT_ASSERT_THROW(w.writeTriangles(2, Writer::size_type(-1), indices), std::out_of_range);
     CPPUNIT_ASSERT_THROW(w.writeTriangles(Writer::size_type(-1), 2, indices), std::out_of_range);
 }
+
+void TestFastPlyWriter::testVertexFormat()
+{
+    const std::string expectedHeader =
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "comment my comment\n"
+        "comment vertex_scale 0.5\n"
+        "comment vertex_bias 1 -2 3.25\n"
+        "element vertex 3\n"
+        "property uint16 x\n"
+        "property uint16 y\n"
+        "property uint16 z\n"
+        "element face 1\n"
+        "property list uint8 uint32 vertex_indices\n"
+        "comment padding:";
+    const double bias[3] = {1.0, -2.0, 3.25};
+    const std::tr1::uint32_t indices[3] = {0, 1, 2};
+
+    MLSGPU_ASSERT_EQUAL(12, vertexFormatSize(VERTEX_FORMAT_FLOAT32));
+    MLSGPU_ASSERT_EQUAL(6, vertexFormatSize(VERTEX_FORMAT_UINT16));
+    MLSGPU_ASSERT_EQUAL(12, vertexFormatSize(VERTEX_FORMAT_UINT32));
+
+    MemoryWriterPly w;
+    w.addComment("my comment");
+    w.setVertexFormat(VERTEX_FORMAT_UINT16);
+    w.setVertexTransform(0.5, bias);
+    w.setNumVertices(3);
+    w.setNumTriangles(1);
+    MLSGPU_ASSERT_EQUAL(6, w.getVertexSize());
+
+    w.open("file");
+    CPPUNIT_ASSERT_THROW(w.setVertexFormat(VERTEX_FORMAT_FLOAT32), state_error);
+    CPPUNIT_ASSERT_THROW(w.setVertexTransform(1.0, bias), state_error);
+    // Float vertices cannot be written to a fixed-point file
+    CPPUNIT_ASSERT_THROW(w.writeVertices(0, 1, NULL), state_error);
+    w.writeTriangles(0, 1, indices);
+    w.close();
+
+    const std::string &out = w.getOutput("file");
+    MLSGPU_ASSERT_EQUAL(expectedHeader, out.substr(0, expectedHeader.size()));
+    const std::string::size_type headerSize = out.find("end_header\n") + 11;
+    MLSGPU_ASSERT_EQUAL(0, headerSize % 4);
+    MLSGPU_ASSERT_EQUAL(headerSize + 3 * 6 + 13, out.size());
+}
+
+void TestFastPlyWriter::testVertexNormals()
+{
+    const std::string expectedHeader =
+        "ply\n"
+        "format binary_little_endian 1.0\n"
+        "element vertex 2\n"
+        "property float32 x\n"
+        "property float32 y\n"
+        "property float32 z\n"
+        "property float32 nx\n"
+        "property float32 ny\n"
+        "property float32 nz\n"
+        "element face 0\n"
+        "property list uint8 uint32 vertex_indices\n"
+        "comment padding:";
+    const float vertices[12] =
+    {
+        1.0f, 2.0f, 3.0f, 0.0f, 0.0f, 1.0f,
+        4.0f, 5.0f, 6.0f, 0.6f, 0.8f, 0.0f
+    };
+
+    MemoryWriterPly w;
+    w.setVertexNormals(true);
+    w.setNumVertices(2);
+    w.setNumTriangles(0);
+    MLSGPU_ASSERT_EQUAL(24, w.getVertexSize());
+    CPPUNIT_ASSERT(w.getVertexNormals());
+
+    w.open("file");
+    w.writeVertices(0, 2, vertices);
+    w.close();
+
+    const std::string &out = w.getOutput("file");
+    MLSGPU_ASSERT_EQUAL(expectedHeader, out.substr(0, expectedHeader.size()));
+    const std::string::size_type headerSize = out.find("end_header\n") + 11;
+    MLSGPU_ASSERT_EQUAL(0, headerSize % 4);
+    MLSGPU_ASSERT_EQUAL(headerSize + sizeof(vertices), out.size());
+    CPPUNIT_ASSERT(0 == std::memcmp(out.data() + headerSize, vertices, sizeof(vertices)));
+}
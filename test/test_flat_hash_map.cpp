@@ -0,0 +1,153 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref FlatHashMap.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <map>
+#include <cstddef>
+#include "../src/flat_hash_map.h"
+#include "../src/tr1_cstdint.h"
+#include "testutil.h"
+
+/// Tests for @ref FlatHashMap
+class TestFlatHashMap : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestFlatHashMap);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testInsert);
+    CPPUNIT_TEST(testGrow);
+    CPPUNIT_TEST(testClear);
+    CPPUNIT_TEST(testIterate);
+    CPPUNIT_TEST_SUITE_END();
+
+    typedef FlatHashMap<std::tr1::uint64_t, int> map_type;
+
+public:
+    void testEmpty();      ///< Test lookups in a map with no storage
+    void testInsert();     ///< Test insertion of new and existing keys
+    void testGrow();       ///< Test insertion past several reallocations, against @c std::map
+    void testClear();      ///< Test @ref FlatHashMap::clear
+    void testIterate();    ///< Test iteration, including over an empty map
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestFlatHashMap, TestSet::perBuild());
+
+void TestFlatHashMap::testEmpty()
+{
+    map_type m;
+    const map_type &cm = m;
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), m.size());
+    CPPUNIT_ASSERT(m.find(0) == NULL);
+    CPPUNIT_ASSERT(cm.find(123) == NULL);
+}
+
+void TestFlatHashMap::testInsert()
+{
+    map_type m;
+    std::pair<map_type::value_type *, bool> added;
+
+    added = m.insert(std::make_pair(std::tr1::uint64_t(5), 50));
+    CPPUNIT_ASSERT(added.second);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint64_t(5), added.first->first);
+    CPPUNIT_ASSERT_EQUAL(50, added.first->second);
+
+    added = m.insert(std::make_pair(~std::tr1::uint64_t(0), 60));
+    CPPUNIT_ASSERT(added.second);
+    CPPUNIT_ASSERT_EQUAL(60, added.first->second);
+
+    // Existing key: the old value must be kept
+    added = m.insert(std::make_pair(std::tr1::uint64_t(5), 70));
+    CPPUNIT_ASSERT(!added.second);
+    CPPUNIT_ASSERT_EQUAL(50, added.first->second);
+
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), m.size());
+    CPPUNIT_ASSERT(m.find(5) != NULL);
+    CPPUNIT_ASSERT_EQUAL(50, m.find(5)->second);
+    CPPUNIT_ASSERT(m.find(~std::tr1::uint64_t(0)) != NULL);
+    CPPUNIT_ASSERT(m.find(6) == NULL);
+}
+
+void TestFlatHashMap::testGrow()
+{
+    map_type m;
+    std::map<std::tr1::uint64_t, int> expected;
+
+    // Keys with a regular stride, similar to packed coordinates
+    for (int i = 0; i < 10000; i++)
+    {
+        std::tr1::uint64_t key = std::tr1::uint64_t(i % 7000) << 20;
+        bool isNew = expected.insert(std::make_pair(key, i)).second;
+        std::pair<map_type::value_type *, bool> added = m.insert(std::make_pair(key, i));
+        CPPUNIT_ASSERT_EQUAL(isNew, added.second);
+        CPPUNIT_ASSERT_EQUAL(expected[key], added.first->second);
+        CPPUNIT_ASSERT(m.size() <= m.capacity());
+    }
+    CPPUNIT_ASSERT_EQUAL(expected.size(), m.size());
+    for (std::map<std::tr1::uint64_t, int>::const_iterator i = expected.begin(); i != expected.end(); ++i)
+    {
+        const map_type::value_type *v = m.find(i->first);
+        CPPUNIT_ASSERT(v != NULL);
+        CPPUNIT_ASSERT_EQUAL(i->second, v->second);
+    }
+    CPPUNIT_ASSERT(m.find(1) == NULL);
+}
+
+void TestFlatHashMap::testClear()
+{
+    map_type m;
+    for (int i = 0; i < 100; i++)
+        m.insert(std::make_pair(std::tr1::uint64_t(i), i));
+    m.clear();
+    CPPUNIT_ASSERT(m.empty());
+    CPPUNIT_ASSERT(m.find(3) == NULL);
+    CPPUNIT_ASSERT(m.insert(std::make_pair(std::tr1::uint64_t(3), 4)).second);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), m.size());
+}
+
+void TestFlatHashMap::testIterate()
+{
+    map_type m;
+    CPPUNIT_ASSERT(m.begin() == m.end());
+
+    std::map<std::tr1::uint64_t, int> expected;
+    for (int i = 0; i < 1000; i++)
+    {
+        std::tr1::uint64_t key = std::tr1::uint64_t(i) * 12345;
+        m.insert(std::make_pair(key, i));
+        expected[key] = i;
+    }
+
+    std::map<std::tr1::uint64_t, int> actual;
+    for (map_type::const_iterator i = m.begin(); i != m.end(); ++i)
+    {
+        CPPUNIT_ASSERT(actual.insert(*i).second);
+    }
+    CPPUNIT_ASSERT(expected == actual);
+}
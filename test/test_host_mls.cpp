@@ -0,0 +1,208 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref host_mls.h and @ref host_marching.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <set>
+#include <CL/cl.hpp>
+#include <boost/tr1/cmath.hpp>
+#include "../src/host_mls.h"
+#include "../src/host_marching.h"
+#include "../src/mls.h"
+#include "../src/grid.h"
+#include "../src/mesh.h"
+#include "../src/splat.h"
+#include "testutil.h"
+
+class TestHostMls : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestHostMls);
+    CPPUNIT_TEST(testPlane);
+    CPPUNIT_TEST(testOffset);
+    CPPUNIT_TEST(testNearestBoundary);
+    CPPUNIT_TEST(testMarching);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Make a square of splats in the plane z = @a z, spanning [@a lo, @a hi] in x and y
+    static std::vector<Splat> makePlane(float lo, float hi, float z);
+
+    void testPlane();       ///< Fit to a plane, with undefined values away from it
+    void testOffset();      ///< Test that the offset of the region is respected
+    void testNearestBoundary(); ///< Clip the edge of a plane with @ref MLS_BOUNDARY_NEAREST
+    void testMarching();    ///< Extract a plane with @ref HostMarching
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestHostMls, TestSet::perBuild());
+
+std::vector<Splat> TestHostMls::makePlane(float lo, float hi, float z)
+{
+    std::vector<Splat> splats;
+    for (float y = lo; y <= hi; y += 0.5f)
+        for (float x = lo; x <= hi; x += 0.5f)
+        {
+            Splat s;
+            s.position[0] = x;
+            s.position[1] = y;
+            s.position[2] = z;
+            s.radius = 2.0f;
+            s.normal[0] = 0.0f;
+            s.normal[1] = 0.0f;
+            s.normal[2] = 1.0f;
+            s.quality = 1.0f;
+            splats.push_back(s);
+        }
+    return splats;
+}
+
+void TestHostMls::testPlane()
+{
+    const std::vector<Splat> splats = makePlane(0.0f, 16.0f, 4.25f);
+    const Grid::size_type size[3] = { 17, 17, 17 };
+    const Grid::difference_type offset[3] = { 0, 0, 0 };
+    std::vector<float> field;
+
+    HostMls mls(MLS_SHAPE_SPHERE, 1.0f, 2);
+    mls.evaluate(splats, size, offset, field);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(17 * 17 * 17), field.size());
+
+    for (Grid::size_type z = 0; z < size[2]; z++)
+    {
+        const float value = field[(z * size[1] + 8) * size[0] + 8];
+        if (z >= 3 && z <= 5)
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(z - 4.25, value, 1e-3);
+        else if (z > 7)
+            CPPUNIT_ASSERT((std::tr1::isnan)(value));
+    }
+}
+
+void TestHostMls::testOffset()
+{
+    const std::vector<Splat> splats = makePlane(-8.0f, 8.0f, 12.25f);
+    const Grid::size_type size[3] = { 17, 17, 9 };
+    const Grid::difference_type offset[3] = { -8, -8, 8 };
+    std::vector<float> field;
+
+    HostMls mls(MLS_SHAPE_PLANE, 1.0f, 3);
+    mls.evaluate(splats, size, offset, field);
+    for (Grid::size_type z = 3; z <= 5; z++)
+    {
+        const float value = field[(z * size[1] + 8) * size[0] + 8];
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(z + 8 - 12.25, value, 1e-3);
+    }
+}
+
+void TestHostMls::testNearestBoundary()
+{
+    const std::vector<Splat> splats = makePlane(0.0f, 8.0f, 4.25f);
+    const Grid::size_type size[3] = { 17, 17, 9 };
+    const Grid::difference_type offset[3] = { 0, 0, 0 };
+    std::vector<float> field;
+
+    HostMls mls(MLS_SHAPE_PLANE, 0.5f, 2, MLS_BOUNDARY_NEAREST);
+    mls.evaluate(splats, size, offset, field);
+    for (Grid::size_type z = 3; z <= 5; z++)
+    {
+        // Distance along the normal does not count towards the boundary test
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(z - 4.25, field[(z * size[1] + 4) * size[0] + 4], 1e-3);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(z - 4.25, field[(z * size[1] + 4) * size[0] + 8], 1e-3);
+    }
+    // One cell beyond the edge, there are enough hits but the nearest splat is too far
+    CPPUNIT_ASSERT((std::tr1::isnan)(field[(4 * size[1] + 4) * size[0] + 9]));
+}
+
+void TestHostMls::testMarching()
+{
+    const Grid::size_type size[3] = { 3, 3, 3 };
+    std::vector<float> field(27);
+    for (unsigned int z = 0; z < 3; z++)
+        for (unsigned int y = 0; y < 3; y++)
+            for (unsigned int x = 0; x < 3; x++)
+                field[(z * 3 + y) * 3 + x] = z - 1.5f;
+    // A missing value removes the cells that touch it
+    std::vector<float> holed = field;
+    holed[(1 * 3 + 2) * 3 + 2] = std::numeric_limits<float>::quiet_NaN();
+
+    cl_uint3 keyOffset;
+    keyOffset.s[0] = 10;
+    keyOffset.s[1] = 20;
+    keyOffset.s[2] = 30;
+
+    HostMarching marching;
+    HostKeyMesh mesh = marching.generate(field, size, keyOffset, 0);
+    CPPUNIT_ASSERT(mesh.numVertices() > 0);
+    CPPUNIT_ASSERT(mesh.numInternalVertices() > 0);
+    CPPUNIT_ASSERT(mesh.numExternalVertices() > 0);
+
+    std::set<cl_ulong> keys;
+    for (std::size_t i = 0; i < mesh.numVertices(); i++)
+    {
+        const float x = mesh.vertices[i][0] - 10.0f;
+        const float y = mesh.vertices[i][1] - 20.0f;
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(31.5, mesh.vertices[i][2], 1e-5);
+        const bool boundary = x == 0.0f || x == 2.0f || y == 0.0f || y == 2.0f;
+        CPPUNIT_ASSERT_EQUAL(i >= mesh.numInternalVertices(), boundary);
+        if (boundary)
+            CPPUNIT_ASSERT(keys.insert(mesh.vertexKeys[i - mesh.numInternalVertices()]).second);
+    }
+
+    // The triangles must tile the 2x2 square exactly once
+    double area = 0.0;
+    for (std::size_t i = 0; i < mesh.numTriangles(); i++)
+    {
+        const boost::array<cl_float, 3> *v[3];
+        for (int j = 0; j < 3; j++)
+        {
+            CPPUNIT_ASSERT(mesh.triangles[i][j] < mesh.numVertices());
+            v[j] = &mesh.vertices[mesh.triangles[i][j]];
+        }
+        const double ux = (*v[1])[0] - (*v[0])[0], uy = (*v[1])[1] - (*v[0])[1];
+        const double wx = (*v[2])[0] - (*v[0])[0], wy = (*v[2])[1] - (*v[0])[1];
+        area += 0.5 * std::fabs(ux * wy - uy * wx);
+    }
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(4.0, area, 1e-4);
+
+    HostKeyMesh holedMesh = marching.generate(holed, size, keyOffset, 0);
+    CPPUNIT_ASSERT(holedMesh.numTriangles() > 0);
+    for (std::size_t i = 0; i < holedMesh.numVertices(); i++)
+    {
+        // No vertex may lie in the cell touching the missing vertex
+        const float x = holedMesh.vertices[i][0] - 10.0f;
+        const float y = holedMesh.vertices[i][1] - 20.0f;
+        CPPUNIT_ASSERT(x <= 1.0f || y <= 1.0f);
+    }
+}
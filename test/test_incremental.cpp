@@ -0,0 +1,230 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref incremental.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "../src/incremental.h"
+#include "../src/grid.h"
+#include "../src/chunk_id.h"
+#include "../src/misc.h"
+#include "testutil.h"
+
+using namespace Incremental;
+
+namespace
+{
+
+/// Make a box from its low and high corners
+Box makeBox(int x0, int y0, int z0, int x1, int y1, int z1)
+{
+    Box box;
+    box.lower[0] = x0; box.lower[1] = y0; box.lower[2] = z0;
+    box.upper[0] = x1; box.upper[1] = y1; box.upper[2] = z1;
+    return box;
+}
+
+/// Make a file record with a box
+FileRecord makeFile(const std::string &path, std::tr1::uint64_t size, const Box &box)
+{
+    FileRecord f;
+    f.path = path;
+    f.size = size;
+    f.mtime = 1000;
+    f.hasBox = true;
+    f.box = box;
+    return f;
+}
+
+/// Make a chunk ID with the given coordinates
+ChunkId makeChunkId(Grid::size_type x, Grid::size_type y, Grid::size_type z)
+{
+    ChunkId id;
+    id.coords[0] = x;
+    id.coords[1] = y;
+    id.coords[2] = z;
+    return id;
+}
+
+/// Grids for a single bucket covering the box [lo, hi)
+std::vector<Grid> makeGrids(int lo, int hi)
+{
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    std::vector<Grid> grids(1, Grid(ref, 1.0f, lo, hi, lo, hi, lo, hi));
+    return grids;
+}
+
+} // anonymous namespace
+
+class TestIncremental : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestIncremental);
+    CPPUNIT_TEST(testBox);
+    CPPUNIT_TEST(testSaveLoad);
+    CPPUNIT_TEST(testLoadMissing);
+    CPPUNIT_TEST(testPlannerFull);
+    CPPUNIT_TEST(testPlanner);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    State previous;   ///< State with two files and two chunks
+
+    void testBox();          ///< Test @ref Incremental::Box
+    void testSaveLoad();     ///< Test round trip through @ref Incremental::State::save
+    void testLoadMissing();  ///< Test loading a file that does not exist
+    void testPlannerFull();  ///< Test planning with no usable previous state
+    void testPlanner();      ///< Test planning with changed, added and removed files
+
+public:
+    virtual void setUp();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestIncremental, TestSet::perBuild());
+
+void TestIncremental::setUp()
+{
+    previous = State();
+    previous.key = "key with\nnewline";
+    previous.files.push_back(makeFile("/data/a file.ply", 100, makeBox(0, 0, 0, 10, 10, 10)));
+    previous.files.push_back(makeFile("/data/b.ply", 200, makeBox(20, 0, 0, 30, 10, 10)));
+    previous.chunks[makeChunkId(0, 0, 0).coords] = makeBox(0, 0, 0, 15, 15, 15);
+    previous.chunks[makeChunkId(1, 0, 0).coords] = makeBox(15, 0, 0, 30, 15, 15);
+}
+
+void TestIncremental::testBox()
+{
+    Box a = makeBox(0, 0, 0, 10, 10, 10);
+    CPPUNIT_ASSERT(a.intersects(makeBox(10, 10, 10, 20, 20, 20)));
+    CPPUNIT_ASSERT(!a.intersects(makeBox(11, 0, 0, 20, 10, 10)));
+    CPPUNIT_ASSERT(!a.intersects(makeBox(0, -5, 0, 10, -1, 10)));
+
+    a += makeBox(-3, 2, 4, 5, 12, 6);
+    CPPUNIT_ASSERT(a == makeBox(-3, 0, 0, 10, 12, 10));
+
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    Grid grid(ref, 1.0f, -2, 3, 4, 5, 6, 7);
+    CPPUNIT_ASSERT(Box::fromGrid(grid) == makeBox(-2, 4, 6, 3, 5, 7));
+}
+
+void TestIncremental::testSaveLoad()
+{
+    boost::filesystem::path path;
+    {
+        boost::filesystem::ofstream dummy;
+        createTmpFile(path, dummy);
+    }
+    previous.files[1].hasBox = false;
+    previous.save(path);
+
+    State loaded;
+    CPPUNIT_ASSERT(loaded.load(path));
+    remove(path);
+
+    CPPUNIT_ASSERT_EQUAL(previous.key, loaded.key);
+    CPPUNIT_ASSERT_EQUAL(previous.files.size(), loaded.files.size());
+    for (std::size_t i = 0; i < previous.files.size(); i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(previous.files[i].path, loaded.files[i].path);
+        CPPUNIT_ASSERT(previous.files[i].sameContents(loaded.files[i]));
+        CPPUNIT_ASSERT_EQUAL(previous.files[i].hasBox, loaded.files[i].hasBox);
+    }
+    CPPUNIT_ASSERT(previous.files[0].box == loaded.files[0].box);
+    CPPUNIT_ASSERT(previous.chunks == loaded.chunks);
+}
+
+void TestIncremental::testLoadMissing()
+{
+    State s = previous;
+    CPPUNIT_ASSERT(!s.load("/this/path/does/not/exist"));
+    CPPUNIT_ASSERT_EQUAL(previous.key, s.key);
+}
+
+void TestIncremental::testPlannerFull()
+{
+    State current = previous;
+    current.key = "different";
+    Planner planner(&previous, current);
+    CPPUNIT_ASSERT(planner.isFull());
+    CPPUNIT_ASSERT(planner(makeChunkId(5, 0, 0), makeGrids(0, 4)));
+    // All chunks of the earlier run are stale, as well as the new one
+    CPPUNIT_ASSERT_EQUAL(std::size_t(3), planner.staleChunks().size());
+
+    Planner noPrevious(NULL, current);
+    CPPUNIT_ASSERT(noPrevious.isFull());
+    CPPUNIT_ASSERT(noPrevious.staleChunks().empty());
+}
+
+void TestIncremental::testPlanner()
+{
+    State current = previous;
+    current.files.erase(current.files.begin());   // a file.ply removed
+    current.files.push_back(makeFile("/data/c.ply", 50, makeBox(100, 100, 100, 110, 110, 110)));
+
+    {
+        Planner planner(&previous, current);
+        CPPUNIT_ASSERT(!planner.isFull());
+        CPPUNIT_ASSERT_EQUAL(std::size_t(2), planner.numChangedFiles());
+        // Chunk (0,0,0) covered the removed file
+        CPPUNIT_ASSERT(planner(makeChunkId(0, 0, 0), makeGrids(1, 2)));
+        // Chunk (1,0,0) is untouched
+        CPPUNIT_ASSERT(!planner(makeChunkId(1, 0, 0), makeGrids(20, 25)));
+        // A new chunk over the new file
+        CPPUNIT_ASSERT(planner(makeChunkId(6, 6, 6), makeGrids(100, 105)));
+        CPPUNIT_ASSERT_EQUAL(std::size_t(1), planner.numReusedChunks());
+        CPPUNIT_ASSERT_EQUAL(std::size_t(2), planner.staleChunks().size());
+        CPPUNIT_ASSERT_EQUAL(std::size_t(3), planner.getChunks().size());
+    }
+
+    {
+        // Same inputs: nothing to do, and a vanished chunk is not stale
+        Planner planner(&previous, previous);
+        CPPUNIT_ASSERT_EQUAL(std::size_t(0), planner.numChangedFiles());
+        CPPUNIT_ASSERT(!planner(makeChunkId(0, 0, 0), makeGrids(0, 15)));
+        CPPUNIT_ASSERT(planner.staleChunks().empty());
+    }
+
+    {
+        // Modified file (size change) dirties its old and new regions
+        current = previous;
+        current.files[1].size = 201;
+        current.files[1].box = makeBox(40, 0, 0, 50, 10, 10);
+        Planner planner(&previous, current);
+        CPPUNIT_ASSERT_EQUAL(std::size_t(1), planner.numChangedFiles());
+        CPPUNIT_ASSERT(!planner(makeChunkId(0, 0, 0), makeGrids(0, 14)));
+        CPPUNIT_ASSERT(planner(makeChunkId(2, 0, 0), makeGrids(45, 46)));
+        // Chunk (1,0,0) has vanished but its old file is stale
+        const std::vector<ChunkCoords> stale = planner.staleChunks();
+        CPPUNIT_ASSERT_EQUAL(std::size_t(2), stale.size());
+        CPPUNIT_ASSERT(stale[0] == makeChunkId(1, 0, 0).coords);
+    }
+}
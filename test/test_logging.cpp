@@ -0,0 +1,161 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref logging.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include "../src/logging.h"
+#include "../src/thread_name.h"
+#include "testutil.h"
+
+class TestLogging : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestLogging);
+    CPPUNIT_TEST(testAsync);
+    CPPUNIT_TEST(testPartial);
+    CPPUNIT_TEST(testRepeats);
+    CPPUNIT_TEST(testStop);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Split @a text into lines, without the newlines
+    static std::vector<std::string> lines(const std::string &text);
+
+    /// Strip the time and thread prefix from @a line, checking that it names @a thread
+    static std::string body(const std::string &line, const std::string &thread);
+
+    static void logFromThread();
+
+public:
+    virtual void tearDown() { Log::stopAsync(); }
+
+    void testAsync();      ///< Lines are prefixed and all written by @ref Log::stopAsync
+    void testPartial();    ///< Flushed pieces of a line are only prefixed once
+    void testRepeats();    ///< Repeated lines beyond the limit are counted instead
+    void testStop();       ///< Unfinished lines are written on stop, and kept streams stay usable
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestLogging, TestSet::perBuild());
+
+std::vector<std::string> TestLogging::lines(const std::string &text)
+{
+    std::vector<std::string> ans;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line))
+        ans.push_back(line);
+    return ans;
+}
+
+std::string TestLogging::body(const std::string &line, const std::string &thread)
+{
+    CPPUNIT_ASSERT(line.size() > 0 && line[0] == '[');
+    const std::string::size_type end = line.find("] ");
+    CPPUNIT_ASSERT(end != std::string::npos);
+    const std::string prefix = line.substr(0, end);
+    CPPUNIT_ASSERT(prefix.size() >= thread.size()
+                   && prefix.compare(prefix.size() - thread.size(), thread.size(), thread) == 0);
+    return line.substr(end + 2);
+}
+
+void TestLogging::logFromThread()
+{
+    thread_set_name("worker");
+    Log::log[Log::warn] << "from worker " << 2 << '\n';
+}
+
+void TestLogging::testAsync()
+{
+    std::ostringstream out;
+    Log::startAsync(out);
+    Log::log[Log::warn] << "from main " << 1 << '\n';
+    boost::thread t(&TestLogging::logFromThread);
+    t.join();
+    Log::stopAsync();
+
+    std::vector<std::string> l = lines(out.str());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), l.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("from main 1"), body(l[0], "main"));
+    CPPUNIT_ASSERT_EQUAL(std::string("from worker 2"), body(l[1], "worker"));
+}
+
+void TestLogging::testPartial()
+{
+    std::ostringstream out;
+    Log::startAsync(out);
+    std::ostream &s = Log::log[Log::warn];
+    s << "0%"; s.flush();
+    s << "**"; s.flush();
+    s << "100%\n";
+    Log::stopAsync();
+
+    std::vector<std::string> l = lines(out.str());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), l.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("0%**100%"), body(l[0], "main"));
+}
+
+void TestLogging::testRepeats()
+{
+    std::ostringstream out;
+    Log::startAsync(out, 2);
+    for (int i = 0; i < 5; i++)
+        Log::log[Log::warn] << "again\n";
+    Log::log[Log::warn] << "different\n";
+    Log::stopAsync();
+
+    std::vector<std::string> l = lines(out.str());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(5), l.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("again"), body(l[0], "main"));
+    CPPUNIT_ASSERT_EQUAL(std::string("again"), body(l[1], "main"));
+    CPPUNIT_ASSERT_EQUAL(std::string("again"), body(l[2], "main"));
+    CPPUNIT_ASSERT_EQUAL(std::string("(last message repeated 2 more times)"), body(l[3], "main"));
+    CPPUNIT_ASSERT_EQUAL(std::string("different"), body(l[4], "main"));
+}
+
+void TestLogging::testStop()
+{
+    std::ostringstream out;
+    Log::startAsync(out);
+    std::ostream &s = Log::log[Log::warn];
+    s << "unfinished";
+    Log::stopAsync();
+
+    const std::string written = out.str();
+    std::vector<std::string> l = lines(written);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), l.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("unfinished"), body(l[0], "main"));
+
+    // The stream no longer refers to the destroyed writer
+    s.flush();
+    CPPUNIT_ASSERT(s);
+    CPPUNIT_ASSERT_EQUAL(written, out.str());
+}
@@ -0,0 +1,162 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref manifold.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include "manifold.h"
+#include "testutil.h"
+
+class TestManifold : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestManifold);
+    CPPUNIT_TEST(testClosed);
+    CPPUNIT_TEST(testBoundary);
+    CPPUNIT_TEST(testDuplicate);
+    CPPUNIT_TEST(testIsolated);
+    CPPUNIT_TEST(testOutOfRange);
+    CPPUNIT_TEST(testTunnel);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    std::vector<Manifold::Triangle> triangles;
+
+    /// Add a triangle to @ref triangles
+    void add(std::tr1::uint32_t a, std::tr1::uint32_t b, std::tr1::uint32_t c);
+
+    /**
+     * Check that @ref Manifold::isManifoldParallel agrees with @ref
+     * Manifold::isManifold on @ref triangles, and return the explanation.
+     */
+    std::string check(std::size_t numVertices, Manifold::Metadata *data = NULL);
+
+    void testClosed();      ///< Closed mesh with two components
+    void testBoundary();    ///< Open mesh with two boundary loops
+    void testDuplicate();   ///< Repeated triangle
+    void testIsolated();    ///< Vertex not used by any triangle
+    void testOutOfRange();  ///< Index too large, and repeated index
+    void testTunnel();      ///< Two fans joined at a vertex
+
+public:
+    virtual void setUp() { triangles.clear(); }
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestManifold, TestSet::perBuild());
+
+void TestManifold::add(std::tr1::uint32_t a, std::tr1::uint32_t b, std::tr1::uint32_t c)
+{
+    Manifold::Triangle t = {{ a, b, c }};
+    triangles.push_back(t);
+}
+
+std::string TestManifold::check(std::size_t numVertices, Manifold::Metadata *data)
+{
+    Manifold::Metadata expected, actual;
+    std::string reason = Manifold::isManifold(numVertices, triangles.begin(), triangles.end(), &expected);
+    CPPUNIT_ASSERT_EQUAL(reason, Manifold::isManifoldParallel(numVertices, triangles, &actual));
+    CPPUNIT_ASSERT_EQUAL(expected.numVertices, actual.numVertices);
+    CPPUNIT_ASSERT_EQUAL(expected.numTriangles, actual.numTriangles);
+    CPPUNIT_ASSERT_EQUAL(expected.numComponents, actual.numComponents);
+    CPPUNIT_ASSERT_EQUAL(expected.numBoundaries, actual.numBoundaries);
+    if (data != NULL)
+        *data = actual;
+    return reason;
+}
+
+void TestManifold::testClosed()
+{
+    // Two tetrahedra
+    for (std::tr1::uint32_t base = 0; base < 8; base += 4)
+    {
+        add(base + 0, base + 1, base + 2);
+        add(base + 0, base + 3, base + 1);
+        add(base + 0, base + 2, base + 3);
+        add(base + 1, base + 3, base + 2);
+    }
+    Manifold::Metadata data;
+    CPPUNIT_ASSERT_EQUAL(std::string(), check(8, &data));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), data.numComponents);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), data.numBoundaries);
+}
+
+void TestManifold::testBoundary()
+{
+    // A 4x4 grid of vertices with the middle square removed
+    for (std::tr1::uint32_t y = 0; y < 3; y++)
+        for (std::tr1::uint32_t x = 0; x < 3; x++)
+            if (x != 1 || y != 1)
+            {
+                std::tr1::uint32_t a = y * 4 + x;
+                add(a, a + 1, a + 5);
+                add(a, a + 5, a + 4);
+            }
+    Manifold::Metadata data;
+    CPPUNIT_ASSERT_EQUAL(std::string(), check(16, &data));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), data.numComponents);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), data.numBoundaries);
+}
+
+void TestManifold::testDuplicate()
+{
+    add(0, 1, 2);
+    add(2, 3, 0);
+    add(0, 1, 2);
+    CPPUNIT_ASSERT(check(4) != "");
+}
+
+void TestManifold::testIsolated()
+{
+    add(0, 1, 2);
+    add(3, 4, 5);
+    CPPUNIT_ASSERT_EQUAL(std::string("Vertex 6 is isolated\n"), check(7));
+}
+
+void TestManifold::testOutOfRange()
+{
+    add(0, 1, 2);
+    add(1, 3, 3);
+    add(0, 2, 7);
+    CPPUNIT_ASSERT_EQUAL(std::string("Triangle 1 contains vertex 3 twice\n"), check(4));
+    triangles[1][2] = 2;
+    CPPUNIT_ASSERT_EQUAL(std::string("Triangle 2 contains out-of-range index 7\n"), check(4));
+}
+
+void TestManifold::testTunnel()
+{
+    // Two closed fans sharing vertex 0
+    for (std::tr1::uint32_t base = 1; base < 8; base += 3)
+    {
+        add(0, base, base + 1);
+        add(0, base + 1, base + 2);
+        add(0, base + 2, base);
+        add(base, base + 2, base + 1);
+    }
+    CPPUNIT_ASSERT(check(10) != "");
+}
@@ -49,12 +49,26 @@
 #include "manifold.h"
 #include "../src/clh.h"
 #include "../src/marching.h"
+#include "../src/splat_tree_cl.h"
 #include "../src/mesher.h"
+#include "../src/mesh_filter.h"
 #include "../src/fast_ply.h"
 #include "../src/misc.h"
 
 using namespace std;
 
+/**
+ * Wrap a memory object in a more specific class. The constructors taking a
+ * @c cl_mem do not retain it, so a reference is taken here for the new
+ * wrapper to release.
+ */
+template<typename T>
+static T retainAs(const cl::Memory &memory)
+{
+    clRetainMemObject(memory());
+    return T(memory());
+}
+
 /**
  * Helper class to simplify writing generators that just generate
  * data on the host.
@@ -65,6 +79,8 @@ private:
     cl::Context context;
     std::size_t maxWidth, maxHeight, maxDepth;
     vector<float> sliceData;
+    vector<cl_half> halfData;  ///< @ref sliceData converted for @c CL_HALF_FLOAT images
+    cl_channel_type bufferDistanceType;  ///< Element type of buffer distance fields
 
 protected:
     virtual cl_float generate(cl_uint x, cl_uint y, cl_uint z) const = 0;
@@ -74,7 +90,8 @@ protected:
         std::size_t maxWidth, std::size_t maxHeight, std::size_t maxDepth)
         : context(context),
         maxWidth(maxWidth), maxHeight(maxHeight), maxDepth(maxDepth),
-        sliceData(maxWidth * maxHeight)
+        sliceData(maxWidth * maxHeight), halfData(maxWidth * maxHeight),
+        bufferDistanceType(CL_FLOAT)
     {
     }
 
@@ -85,9 +102,19 @@ public:
         return ans;
     }
 
+    /**
+     * Set the element type used when the distance field is a buffer. Buffers
+     * do not record a format, so the test must say what the @ref Marching
+     * instance was constructed with.
+     */
+    void setBufferDistanceType(cl_channel_type type)
+    {
+        bufferDistanceType = type;
+    }
+
     virtual void enqueue(
         const cl::CommandQueue &queue,
-        const cl::Image2D &distance,
+        const cl::Memory &distance,
         const Marching::Swathe &swathe,
         const std::vector<cl::Event> *events,
         cl::Event *event)
@@ -98,8 +125,28 @@ public:
         CPPUNIT_ASSERT(swathe.width <= maxWidth);
         CPPUNIT_ASSERT(swathe.height <= maxHeight);
         CPPUNIT_ASSERT(swathe.zFirst <= swathe.zLast);
-        CPPUNIT_ASSERT(distance.getImageInfo<CL_IMAGE_WIDTH>() >= roundUp(swathe.width, alignment()[0]));
-        CPPUNIT_ASSERT(distance.getImageInfo<CL_IMAGE_HEIGHT>() >= swathe.zStride * roundUp(swathe.zLast + 1, alignment()[2]) + swathe.zBias);
+
+        const std::size_t rows = swathe.zStride * roundUp(swathe.zLast + 1, alignment()[2]) + swathe.zBias;
+        const bool isBuffer = distance.getInfo<CL_MEM_TYPE>() == CL_MEM_OBJECT_BUFFER;
+        bool half;
+        cl::Image2D image;
+        cl::Buffer buffer;
+        if (isBuffer)
+        {
+            half = bufferDistanceType == CL_HALF_FLOAT;
+            buffer = retainAs<cl::Buffer>(distance);
+            CPPUNIT_ASSERT(swathe.rowPitch >= roundUp(swathe.width, alignment()[0]));
+            CPPUNIT_ASSERT(buffer.getInfo<CL_MEM_SIZE>()
+                           >= rows * swathe.rowPitch * (half ? sizeof(cl_half) : sizeof(cl_float)));
+        }
+        else
+        {
+            image = retainAs<cl::Image2D>(distance);
+            half = image.getImageInfo<CL_IMAGE_FORMAT>().image_channel_data_type == CL_HALF_FLOAT;
+            CPPUNIT_ASSERT(image.getImageInfo<CL_IMAGE_WIDTH>() >= roundUp(swathe.width, alignment()[0]));
+            CPPUNIT_ASSERT(image.getImageInfo<CL_IMAGE_HEIGHT>() >= rows);
+        }
+        const std::size_t elementBytes = half ? sizeof(cl_half) : sizeof(cl_float);
 
         std::vector<cl::Event> wait;
         cl::Event last;
@@ -114,12 +161,33 @@ public:
                     sliceData[y * swathe.width + x] = generate(x, y, z);
                 }
 
-            cl::size_t<3> origin, region;
-            origin[0] = 0; origin[1] = z * swathe.zStride + swathe.zBias; origin[2] = 0;
-            region[0] = swathe.width; region[1] = swathe.height; region[2] = 1;
-            queue.enqueueWriteImage(distance, CL_TRUE, origin, region,
-                                    swathe.width * sizeof(float), 0, &sliceData[0],
-                                    &wait, &last);
+            void *ptr = &sliceData[0];
+            if (half)
+            {
+                for (std::size_t i = 0; i < swathe.width * swathe.height; i++)
+                    halfData[i] = floatToHalf(sliceData[i]);
+                ptr = &halfData[0];
+            }
+
+            cl::size_t<3> origin, hostOrigin, region;
+            hostOrigin[0] = 0; hostOrigin[1] = 0; hostOrigin[2] = 0;
+            if (isBuffer)
+            {
+                origin[0] = 0; origin[1] = z * swathe.zStride + swathe.zBias; origin[2] = 0;
+                region[0] = swathe.width * elementBytes; region[1] = swathe.height; region[2] = 1;
+                queue.enqueueWriteBufferRect(buffer, CL_TRUE, origin, hostOrigin, region,
+                                             swathe.rowPitch * elementBytes, 0,
+                                             swathe.width * elementBytes, 0, ptr,
+                                             &wait, &last);
+            }
+            else
+            {
+                origin[0] = 0; origin[1] = z * swathe.zStride + swathe.zBias; origin[2] = 0;
+                region[0] = swathe.width; region[1] = swathe.height; region[2] = 1;
+                queue.enqueueWriteImage(image, CL_TRUE, origin, region,
+                                        swathe.width * elementBytes, 0, ptr,
+                                        &wait, &last);
+            }
             wait.resize(1);
             wait[0] = last;
         }
@@ -176,6 +244,33 @@ public:
     }
 };
 
+/**
+ * Output functor that appends the vertices of each output mesh to a vector.
+ */
+class VertexCollector
+{
+private:
+    std::vector<cl_float> *vertices;
+public:
+    typedef void result_type;
+
+    explicit VertexCollector(std::vector<cl_float> *vertices) : vertices(vertices) {}
+
+    void operator()(
+        const cl::CommandQueue &queue,
+        const DeviceKeyMesh &mesh,
+        const std::vector<cl::Event> *events,
+        cl::Event *event) const
+    {
+        const std::size_t first = vertices->size();
+        vertices->resize(first + 3 * mesh.numVertices());
+        if (mesh.numVertices() > 0)
+            queue.enqueueReadBuffer(mesh.vertices, CL_TRUE, 0, 3 * mesh.numVertices() * sizeof(cl_float),
+                                    &(*vertices)[first], events, NULL);
+        CLH::enqueueMarkerWithWaitList(queue, NULL, event);
+    }
+};
+
 /**
  * Tests for @ref Marching.
  */
@@ -187,8 +282,18 @@ class TestMarching : public CLH::Test::TestFixture
     CPPUNIT_TEST(testCompactVertices);
     CPPUNIT_TEST(testCopySlice);
     CPPUNIT_TEST(testSphere);
+    CPPUNIT_TEST(testHalfSphere);
+    CPPUNIT_TEST(testBufferSphere);
+    CPPUNIT_TEST(testBufferHalfSphere);
     CPPUNIT_TEST(testTruncatedSphere);
     CPPUNIT_TEST(testAlternating);
+    CPPUNIT_TEST(testHashWeld);
+    CPPUNIT_TEST(testTiledOccupancy);
+    CPPUNIT_TEST(testCubeTables);
+    CPPUNIT_TEST(testMarchingCubes);
+    CPPUNIT_TEST(testOwnedEdges);
+    CPPUNIT_TEST(testFusedScaleBias);
+    CPPUNIT_TEST(testSharedScratch);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -200,8 +305,9 @@ private:
     template<typename T>
     cl::Buffer vectorToBuffer(cl_mem_flags flags, const vector<T> &v);
 
-    /// Build a vertex key
-    static cl_ulong makeKey(cl_uint x, cl_uint y, cl_uint z, bool external);
+    /// Build a vertex key, with @a axisBits bits per axis
+    static cl_ulong makeKey(cl_uint x, cl_uint y, cl_uint z, bool external,
+                            unsigned int axisBits = Marching::KEY_AXIS_BITS);
     /// Wrapper that calls @ref computeKey and returns result
     cl_ulong callComputeKey(cl::Kernel &kernel,
                             cl_uint cx, cl_uint cy, cl_uint cz,
@@ -212,13 +318,14 @@ private:
      * The output vectors are completely overwritten, so the incoming contents have
      * no effect.
      *
-     * @param kernel            The @ref compactVertices kernel.
+     * @param marching          The @ref Marching whose @ref compactVertices kernel is called.
+     *                          The input keys are narrowed to its local key size.
      * @param outSize           Entries to allocate for output vertices.
      * @param remapSize         Entries to allocate in the index remap table.
-     * @param outVertices, outKeys, indexRemap, firstExternal, vertexUnique, inVertices, inKeys, minExternalKey See @ref compactVertices.
+     * @param outVertices, outKeys, indexRemap, firstExternal, vertexUnique, inVertices, inKeys, minExternalKey, keyShift See @ref compactVertices.
      */
     void callCompactVertices(
-        cl::Kernel &kernel,
+        Marching &marching,
         size_t outSize, size_t remapSize,
         vector<cl_float> &outVertices,
         vector<cl_ulong> &outKeys,
@@ -227,7 +334,8 @@ private:
         const vector<cl_uint> &vertexUnique,
         const vector<cl_float4> &inVertices,
         const vector<cl_ulong> &inKeys,
-        cl_ulong minExternalKey);
+        cl_ulong minExternalKey,
+        cl_uint keyShift = 0);
 
     /**
      * Generate a mesh using an input functor, validate that it is manifold,
@@ -236,15 +344,31 @@ private:
     void testGenerate(
         Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
         Grid::size_type width, Grid::size_type height, Grid::size_type depth,
-        Marching::Generator &generator, const std::string &filename);
+        Marching::Generator &generator, const std::string &filename,
+        cl_channel_type distanceType = CL_FLOAT,
+        bool hashWeld = false,
+        bool tiledOccupancy = false,
+        bool marchingCubes = false,
+        Marching::DistanceStorage storage = Marching::DISTANCE_IMAGE,
+        bool ownedEdges = false);
 
     void testConstructor();     ///< Basic sanity tests on the tables
     void testComputeKey();      ///< Test @ref computeKey helper function
     void testCompactVertices(); ///< Test @ref compactVertices kernel
     void testCopySlice();       ///< Test @ref copySlice, both kernel and wrapper function
     void testSphere();          ///< Builds a sphere
+    void testHalfSphere();      ///< Builds a sphere with half-precision distances
+    void testBufferSphere();    ///< Builds a sphere with the distances in a buffer
+    void testBufferHalfSphere(); ///< Builds a sphere with half-precision distances in a buffer
     void testTruncatedSphere(); ///< Builds a sphere that is truncated by the bounding box
     void testAlternating();     ///< Build a structure with lots of geometry
+    void testHashWeld();        ///< Builds shapes with hash-based vertex welding
+    void testTiledOccupancy();  ///< Builds shapes with coarse-to-fine cell classification
+    void testCubeTables();      ///< Sanity tests on the marching cubes tables
+    void testMarchingCubes();   ///< Builds shapes with marching cubes
+    void testOwnedEdges();      ///< Builds shapes with each vertex emitted by the cell owning its edge
+    void testFusedScaleBias();  ///< Test that @ref MeshFilterChain::generate fuses a lone @ref ScaleBiasFilter
+    void testSharedScratch();   ///< Instances taking turns with scratch buffers from a @ref Marching::ScratchPool
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestMarching, TestSet::perCommit());
 
@@ -274,9 +398,11 @@ void TestMarching::testConstructor()
                       4096,
                       generator.alignment());
 
-    vector<cl_uchar2> countTable = bufferToVector<cl_uchar2>(marching.countTable);
-    vector<cl_ushort2> startTable = bufferToVector<cl_ushort2>(marching.startTable);
-    vector<cl_uchar> dataTable = bufferToVector<cl_uchar>(marching.dataTable);
+    Marching::HostTables tables;
+    Marching::makeHostTables(tables);
+    const vector<cl_uchar2> &countTable = tables.count;
+    const vector<cl_ushort2> &startTable = tables.start;
+    const vector<cl_uchar> &dataTable = tables.data;
 
     CPPUNIT_ASSERT_EQUAL(256, int(countTable.size()));
     CPPUNIT_ASSERT_EQUAL(257, int(startTable.size()));
@@ -304,11 +430,11 @@ void TestMarching::testConstructor()
     }
 }
 
-cl_ulong TestMarching::makeKey(cl_uint x, cl_uint y, cl_uint z, bool external)
+cl_ulong TestMarching::makeKey(cl_uint x, cl_uint y, cl_uint z, bool external, unsigned int axisBits)
 {
-    cl_ulong ans = (cl_ulong(z) << 42) | (cl_ulong(y) << 21) | (cl_ulong(x));
+    cl_ulong ans = (cl_ulong(z) << (2 * axisBits)) | (cl_ulong(y) << axisBits) | (cl_ulong(x));
     if (external)
-        ans |= cl_ulong(1) << 63;
+        ans |= cl_ulong(1) << (3 * axisBits);
     return ans;
 }
 
@@ -334,6 +460,7 @@ void TestMarching::testComputeKey()
 {
     map<string, string> defines;
     defines["UNIT_TESTS"] = "1";
+    Marching::addTableDefines(defines);
     cl::Program program = CLH::build(context, "kernels/marching.cl", defines);
     cl::Kernel kernel(program, "testComputeKey");
 
@@ -351,7 +478,7 @@ void TestMarching::testComputeKey()
 }
 
 void TestMarching::callCompactVertices(
-    cl::Kernel &kernel,
+    Marching &marching,
     size_t outSize, size_t remapSize,
     vector<cl_float> &outVertices,
     vector<cl_ulong> &outKeys,
@@ -360,7 +487,8 @@ void TestMarching::callCompactVertices(
     const vector<cl_uint> &vertexUnique,
     const vector<cl_float4> &inVertices,
     const vector<cl_ulong> &inKeys,
-    cl_ulong minExternalKey)
+    cl_ulong minExternalKey,
+    cl_uint keyShift)
 {
     const size_t inSize = inVertices.size();
     cl::Buffer dOutVertices   = createBuffer(CL_MEM_WRITE_ONLY, outSize * (3 * sizeof(cl_float)));
@@ -369,8 +497,13 @@ void TestMarching::callCompactVertices(
     cl::Buffer dFirstExternal = createBuffer(CL_MEM_WRITE_ONLY, sizeof(cl_uint));
     cl::Buffer dVertexUnique  = vectorToBuffer(CL_MEM_READ_ONLY, vertexUnique);
     cl::Buffer dInVertices    = vectorToBuffer(CL_MEM_READ_ONLY, inVertices);
-    cl::Buffer dInKeys        = vectorToBuffer(CL_MEM_READ_ONLY, inKeys);
+    cl::Buffer dInKeys;
+    if (Marching::localKeySize(marching.keyAxisBits) == sizeof(cl_uint))
+        dInKeys = vectorToBuffer(CL_MEM_READ_ONLY, vector<cl_uint>(inKeys.begin(), inKeys.end()));
+    else
+        dInKeys = vectorToBuffer(CL_MEM_READ_ONLY, inKeys);
 
+    cl::Kernel &kernel = marching.compactVerticesKernel;
     kernel.setArg(0, dOutVertices);
     kernel.setArg(1, dOutKeys);
     kernel.setArg(2, dIndexRemap);
@@ -380,6 +513,7 @@ void TestMarching::callCompactVertices(
     kernel.setArg(6, dInKeys);
     kernel.setArg(7, minExternalKey);
     kernel.setArg(8, cl_ulong(0));
+    kernel.setArg(9, keyShift);
     CLH::enqueueNDRangeKernel(queue,
                               kernel,
                               cl::NullRange,
@@ -400,8 +534,22 @@ static inline cl_float uintAsFloat(cl_uint x)
 
 void TestMarching::testCompactVertices()
 {
-    const cl_ulong externalBit = cl_ulong(1) << 63;
-    const cl_ulong hInKeys[6] = { 100, 100, 200, externalBit | 50, externalBit | 50, CL_ULONG_MAX };
+    AlternatingGenerator generator(context, 2, 2, 2);
+    Marching marching(context, device, 2, 2, 2,
+                      generator.alignment()[2], 4096, generator.alignment());
+    const unsigned int bits = marching.keyAxisBits;
+
+    // Keys in the local layout, and the corresponding global keys
+    const cl_ulong keyA = makeKey(1, 0, 0, false, bits);
+    const cl_ulong keyB = makeKey(0, 1, 0, false, bits);
+    const cl_ulong keyC = makeKey(2, 1, 1, true, bits);
+    const cl_ulong globalA = makeKey(1, 0, 0, false);
+    const cl_ulong globalB = makeKey(0, 1, 0, false);
+    const cl_ulong globalC = makeKey(2, 1, 1, false);
+    const cl_ulong externalBit = makeKey(0, 0, 0, true, bits);
+    const cl_ulong sentinel = externalBit | (externalBit - 1);
+
+    const cl_ulong hInKeys[6] = { keyA, keyA, keyB, keyC, keyC, sentinel };
     const cl_uint hVertexUnique[6] = { 0, 0, 1, 2, 2, 3 };
     const cl_uint ids[5] = { 4, 1, 2, 3, 0 };
 
@@ -421,19 +569,16 @@ void TestMarching::testCompactVertices()
         inVertices[i].s[3] = uintAsFloat(ids[i]);
     }
 
-    AlternatingGenerator generator(context, 2, 2, 2);
-    Marching marching(context, device, 2, 2, 2,
-                      generator.alignment()[2], 4096, generator.alignment());
-    callCompactVertices(marching.compactVerticesKernel, 3, 5,
+    callCompactVertices(marching, 3, 5,
                         outVertices, outKeys, indexRemap, firstExternal,
-                        vertexUnique, inVertices, inKeys, 200);
+                        vertexUnique, inVertices, inKeys, keyB);
 
     CPPUNIT_ASSERT_EQUAL(1.0f, outVertices[0]);
     CPPUNIT_ASSERT_EQUAL(2.0f, outVertices[3]);
     CPPUNIT_ASSERT_EQUAL(4.0f, outVertices[6]);
     CPPUNIT_ASSERT_EQUAL(cl_ulong(0xDEADBEEFDEADBEEFull), outKeys[0]); // should not be overwritten
-    CPPUNIT_ASSERT_EQUAL(cl_ulong(200), outKeys[1]);
-    CPPUNIT_ASSERT_EQUAL(cl_ulong(50), outKeys[2]);
+    CPPUNIT_ASSERT_EQUAL(globalB, outKeys[1]);
+    CPPUNIT_ASSERT_EQUAL(globalC, outKeys[2]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(2), indexRemap[0]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(0), indexRemap[1]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(1), indexRemap[2]);
@@ -442,16 +587,16 @@ void TestMarching::testCompactVertices()
     CPPUNIT_ASSERT_EQUAL(cl_uint(1), firstExternal);
 
     // Same thing, but with all vertices external
-    callCompactVertices(marching.compactVerticesKernel, 3, 5,
+    callCompactVertices(marching, 3, 5,
                         outVertices, outKeys, indexRemap, firstExternal,
-                        vertexUnique, inVertices, inKeys, 100);
+                        vertexUnique, inVertices, inKeys, keyA);
 
     CPPUNIT_ASSERT_EQUAL(1.0f, outVertices[0]);
     CPPUNIT_ASSERT_EQUAL(2.0f, outVertices[3]);
     CPPUNIT_ASSERT_EQUAL(4.0f, outVertices[6]);
-    CPPUNIT_ASSERT_EQUAL(cl_ulong(100), outKeys[0]);
-    CPPUNIT_ASSERT_EQUAL(cl_ulong(200), outKeys[1]);
-    CPPUNIT_ASSERT_EQUAL(cl_ulong(50), outKeys[2]);
+    CPPUNIT_ASSERT_EQUAL(globalA, outKeys[0]);
+    CPPUNIT_ASSERT_EQUAL(globalB, outKeys[1]);
+    CPPUNIT_ASSERT_EQUAL(globalC, outKeys[2]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(2), indexRemap[0]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(0), indexRemap[1]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(1), indexRemap[2]);
@@ -459,10 +604,20 @@ void TestMarching::testCompactVertices()
     CPPUNIT_ASSERT_EQUAL(cl_uint(0), indexRemap[4]);
     CPPUNIT_ASSERT_EQUAL(cl_uint(0), firstExternal);
 
+    // All vertices external, with keys from a grid coarsened by two levels
+    callCompactVertices(marching, 3, 5,
+                        outVertices, outKeys, indexRemap, firstExternal,
+                        vertexUnique, inVertices, inKeys, keyA, 2);
+
+    CPPUNIT_ASSERT_EQUAL(globalA << 2, outKeys[0]);
+    CPPUNIT_ASSERT_EQUAL(globalB << 2, outKeys[1]);
+    CPPUNIT_ASSERT_EQUAL(globalC << 2, outKeys[2]);
+    CPPUNIT_ASSERT_EQUAL(cl_uint(0), firstExternal);
+
     // Same again, but with all vertices internal
-    callCompactVertices(marching.compactVerticesKernel, 3, 5,
+    callCompactVertices(marching, 3, 5,
                         outVertices, outKeys, indexRemap, firstExternal,
-                        vertexUnique, inVertices, inKeys, externalBit | 60);
+                        vertexUnique, inVertices, inKeys, sentinel);
 
     CPPUNIT_ASSERT_EQUAL(1.0f, outVertices[0]);
     CPPUNIT_ASSERT_EQUAL(2.0f, outVertices[3]);
@@ -513,6 +668,7 @@ void TestMarching::testCopySlice()
     params.height = 2;
     params.zStride = 2;
     params.zBias = 1; // should not be used
+    params.rowPitch = 0;
 
     AlternatingGenerator generator(context, 2, 2, 4);
     Marching marching(context, device, 2, 2, 4,
@@ -551,7 +707,13 @@ void TestMarching::testGenerate(
     Grid::size_type maxWidth, Grid::size_type maxHeight, Grid::size_type maxDepth,
     Grid::size_type width, Grid::size_type height, Grid::size_type depth,
     Marching::Generator &generator,
-    const std::string &filename)
+    const std::string &filename,
+    cl_channel_type distanceType,
+    bool hashWeld,
+    bool tiledOccupancy,
+    bool marchingCubes,
+    Marching::DistanceStorage storage,
+    bool ownedEdges)
 {
     Timeplot::Worker tworker("test");
 
@@ -562,7 +724,10 @@ void TestMarching::testGenerate(
     Marching marching(context, device, maxWidth, maxHeight, maxDepth,
                       swathe,
                       (maxWidth - 1) * (maxHeight - 1) * Marching::MAX_CELL_BYTES,
-                      generator.alignment());
+                      generator.alignment(), distanceType, hashWeld, true, storage);
+    marching.setTiledOccupancy(tiledOccupancy);
+    marching.setMarchingCubes(marchingCubes);
+    marching.setOwnedEdges(ownedEdges);
 
     /*** Pass 1: write to file ***/
 
@@ -573,12 +738,14 @@ void TestMarching::testGenerate(
         mesher.write(tworker);
     }
 
-    /*** Pass 2: write to memory and validate ***/
+    /*** Pass 2: write to memory and validate, with the output on a separate queue ***/
 
     {
         MemoryWriterPly writer;
         OOCMesher mesher(writer, TrivialNamer(filename));
-        marching.generate(queue, generator, deviceMesher(mesher.functor(0), ChunkId(), tworker), size, keyOffset, NULL);
+        cl::CommandQueue outputQueue(context, device);
+        marching.generate(queue, generator, deviceMesher(mesher.functor(0), ChunkId(), tworker), size, keyOffset, NULL,
+                          &outputQueue);
         mesher.write(tworker);
 
         const std::string &output = writer.getOutput(filename);
@@ -588,6 +755,12 @@ void TestMarching::testGenerate(
 
         std::string reason = Manifold::isManifold(vertices.size(), triangles.begin(), triangles.end());
         CPPUNIT_ASSERT_EQUAL(string(""), reason);
+
+        // Vertices shared between shipouts are counted more than once
+        const Marching::Counts &counts = marching.getLastCounts();
+        CPPUNIT_ASSERT(counts.occupiedCells > 0);
+        CPPUNIT_ASSERT(counts.vertices >= vertices.size());
+        CPPUNIT_ASSERT(counts.triangles >= triangles.size());
     }
 }
 
@@ -605,6 +778,53 @@ void TestMarching::testSphere()
                  generator, "sphere.ply");
 }
 
+void TestMarching::testHalfSphere()
+{
+    if (!Marching::distanceTypeSupported(context, CL_HALF_FLOAT))
+        return; // optional feature, so not a failure
+
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    SphereGenerator generator(context, maxWidth, maxHeight, maxDepth, 30.0, 41.5, 27.75, 25.3);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 generator, "hsphere.ply", CL_HALF_FLOAT);
+}
+
+void TestMarching::testBufferSphere()
+{
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    SphereGenerator generator(context, maxWidth, maxHeight, maxDepth, 30.0, 41.5, 27.75, 25.3);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 generator, "bsphere.ply", CL_FLOAT, false, false, false, Marching::DISTANCE_BUFFER);
+}
+
+void TestMarching::testBufferHalfSphere()
+{
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    // vload_half is core, so unlike images this does not depend on the device
+    SphereGenerator generator(context, maxWidth, maxHeight, maxDepth, 30.0, 41.5, 27.75, 25.3);
+    generator.setBufferDistanceType(CL_HALF_FLOAT);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 generator, "bhsphere.ply", CL_HALF_FLOAT, false, false, false, Marching::DISTANCE_BUFFER);
+}
+
 void TestMarching::testTruncatedSphere()
 {
     const Grid::size_type maxWidth = 83;
@@ -630,3 +850,189 @@ void TestMarching::testAlternating()
     testGenerate(width, height, depth, width, height, depth,
                  generator, "alternating.ply");
 }
+
+void TestMarching::testHashWeld()
+{
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    SphereGenerator sphere(context, maxWidth, maxHeight, maxDepth,
+                           0.5f * width, 0.5f * height, 0.5f * depth, 42.0f);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 sphere, "hwsphere.ply", CL_FLOAT, true);
+
+    AlternatingGenerator alternating(context, 32, 32, 32);
+    testGenerate(32, 32, 32, 32, 32, 32,
+                 alternating, "hwalternating.ply", CL_FLOAT, true);
+}
+
+void TestMarching::testTiledOccupancy()
+{
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    SphereGenerator sphere(context, maxWidth, maxHeight, maxDepth,
+                           0.5f * width, 0.5f * height, 0.5f * depth, 42.0f);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 sphere, "tosphere.ply", CL_FLOAT, false, true);
+
+    AlternatingGenerator alternating(context, 32, 32, 32);
+    testGenerate(32, 32, 32, 32, 32, 32,
+                 alternating, "toalternating.ply", CL_FLOAT, false, true);
+}
+
+void TestMarching::testCubeTables()
+{
+    Marching::HostTables tetrahedra, cubes;
+    Marching::makeHostTables(tetrahedra);
+    Marching::makeHostTables(cubes, true);
+
+    unsigned int totalTetrahedra = 0, totalCubes = 0;
+    for (unsigned int i = 0; i < Marching::NUM_CUBES; i++)
+    {
+        const unsigned int sv = cubes.start[i].s[0];
+        const unsigned int ev = cubes.start[i + 1].s[0];
+        for (unsigned int j = sv; j < ev; j++)
+        {
+            // Only the 12 edges of the cube are used, so one key coordinate is odd
+            const cl_uint3 &key = cubes.keys[j];
+            CPPUNIT_ASSERT_EQUAL(1, int(key.s[0] % 2 + key.s[1] % 2 + key.s[2] % 2));
+        }
+        CPPUNIT_ASSERT(cubes.count[i].s[1] <= 15);
+        CPPUNIT_ASSERT((cubes.count[i].s[1] == 0) == (tetrahedra.count[i].s[1] == 0));
+        totalTetrahedra += tetrahedra.count[i].s[1];
+        totalCubes += cubes.count[i].s[1];
+    }
+    CPPUNIT_ASSERT(2 * totalCubes < totalTetrahedra);
+    CPPUNIT_ASSERT(cubes.data.size() * sizeof(cl_uchar) <= Marching::DATA_TABLE_BYTES);
+    CPPUNIT_ASSERT(cubes.keys.size() * sizeof(cl_uchar) <= Marching::KEY_TABLE_BYTES);
+}
+
+void TestMarching::testMarchingCubes()
+{
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    SphereGenerator sphere(context, maxWidth, maxHeight, maxDepth,
+                           0.5f * width, 0.5f * height, 0.5f * depth, 42.0f);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 sphere, "mcsphere.ply", CL_FLOAT, false, false, true);
+
+    // Every cell is ambiguous, which checks that neighbouring cells agree on faces
+    AlternatingGenerator alternating(context, 32, 32, 32);
+    testGenerate(32, 32, 32, 32, 32, 32,
+                 alternating, "mcalternating.ply", CL_FLOAT, false, false, true);
+}
+
+void TestMarching::testOwnedEdges()
+{
+    const Grid::size_type maxWidth = 83;
+    const Grid::size_type maxHeight = 78;
+    const Grid::size_type maxDepth = 66;
+    const Grid::size_type width = 71;
+    const Grid::size_type height = 75;
+    const Grid::size_type depth = 60;
+
+    // Truncated by the bounding box, so some owners lie outside the grid
+    SphereGenerator sphere(context, maxWidth, maxHeight, maxDepth,
+                           0.5f * width, 0.5f * height, 0.5f * depth, 42.0f);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 sphere, "oesphere.ply", CL_FLOAT, false, false, false,
+                 Marching::DISTANCE_IMAGE, true);
+    testGenerate(maxWidth, maxHeight, maxDepth, width, height, depth,
+                 sphere, "oetsphere.ply", CL_FLOAT, true, true, false,
+                 Marching::DISTANCE_BUFFER, true);
+
+    AlternatingGenerator alternating(context, 32, 32, 32);
+    testGenerate(32, 32, 32, 32, 32, 32,
+                 alternating, "oealternating.ply", CL_FLOAT, false, false, false,
+                 Marching::DISTANCE_IMAGE, true);
+    testGenerate(32, 32, 32, 32, 32, 32,
+                 alternating, "oemcalternating.ply", CL_FLOAT, false, false, true,
+                 Marching::DISTANCE_IMAGE, true);
+}
+
+void TestMarching::testFusedScaleBias()
+{
+    const Grid::size_type size[3] = { 32, 32, 32 };
+    const cl_uint3 keyOffset = {{ 0, 0, 0 }};
+    SphereGenerator generator(context, size[0], size[1], size[2], 15.5f, 15.5f, 15.5f, 11.3f);
+    Marching marching(context, device, size[0], size[1], size[2],
+                      generator.alignment()[2],
+                      (size[0] - 1) * (size[1] - 1) * Marching::MAX_CELL_BYTES,
+                      generator.alignment());
+
+    ScaleBiasFilter scaleBias(context);
+    scaleBias.setScaleBias(0.5f, 10.0f, -20.0f, 30.0f);
+    ScaleBiasFilter identity(context);
+
+    // Only a scale-bias filter, so it is fused into the vertex compaction
+    std::vector<cl_float> fused;
+    MeshFilterChain fusedChain;
+    fusedChain.addFilter(boost::ref(scaleBias));
+    fusedChain.setOutput(VertexCollector(&fused));
+    fusedChain.generate(marching, queue, generator, size, keyOffset);
+
+    // A second filter forces the generic path
+    std::vector<cl_float> chained;
+    MeshFilterChain genericChain;
+    genericChain.addFilter(boost::ref(scaleBias));
+    genericChain.addFilter(boost::ref(identity));
+    genericChain.setOutput(VertexCollector(&chained));
+    genericChain.generate(marching, queue, generator, size, keyOffset);
+
+    // Marching must be left with the identity transform
+    std::vector<cl_float> raw;
+    marching.generate(queue, generator, VertexCollector(&raw), size, keyOffset);
+
+    CPPUNIT_ASSERT(!fused.empty());
+    CPPUNIT_ASSERT_EQUAL(chained.size(), fused.size());
+    CPPUNIT_ASSERT_EQUAL(raw.size(), fused.size());
+    const float bias[3] = { 10.0f, -20.0f, 30.0f };
+    for (std::size_t i = 0; i < fused.size(); i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(chained[i], fused[i]);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(raw[i] * 0.5f + bias[i % 3], fused[i], 1e-4);
+    }
+}
+
+void TestMarching::testSharedScratch()
+{
+    const Grid::size_type size[3] = { 32, 32, 32 };
+    const cl_uint3 keyOffset = {{ 0, 0, 0 }};
+    const std::size_t meshMemory = (size[0] - 1) * (size[1] - 1) * Marching::MAX_CELL_BYTES;
+    SphereGenerator generator(context, size[0], size[1], size[2], 15.5f, 15.5f, 15.5f, 11.3f);
+    Marching owner(context, device, size[0], size[1], size[2],
+                   generator.alignment()[2], meshMemory, generator.alignment());
+    Marching borrower(context, device, size[0], size[1], size[2],
+                      generator.alignment()[2], meshMemory, generator.alignment(),
+                      CL_FLOAT, false, false);
+
+    std::vector<cl_float> expected;
+    owner.generate(queue, generator, VertexCollector(&expected), size, keyOffset);
+
+    Marching::ScratchPool pool;
+    pool.add(owner.makeScratch(context));
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), pool.size());
+    for (int pass = 0; pass < 2; pass++)
+    {
+        Marching &marching = pass == 0 ? borrower : owner;
+        Marching::ScratchPool::Lease lease(pool);
+        marching.setScratch(lease.get());
+        std::vector<cl_float> actual;
+        marching.generate(queue, generator, VertexCollector(&actual), size, keyOffset);
+        CPPUNIT_ASSERT(actual == expected);
+    }
+}
@@ -0,0 +1,123 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref memory_governor.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include "../src/memory_governor.h"
+#include "../src/statistics.h"
+#include "../src/timeplot.h"
+#include "testutil.h"
+
+class TestMemoryGovernor : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestMemoryGovernor);
+    CPPUNIT_TEST(testUnlimited);
+    CPPUNIT_TEST(testUnder);
+    CPPUNIT_TEST(testIdle);
+    CPPUNIT_TEST(testBlock);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Thread body for @ref testBlock
+    static void waiter(MemoryGovernor *governor, bool *finished);
+
+public:
+    void testUnlimited();     ///< A limit of 0 never blocks
+    void testUnder();         ///< Usage below the limit does not block
+    void testIdle();          ///< Usage over the limit with no work in flight does not block
+    void testBlock();         ///< Usage over the limit blocks until the usage drops
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestMemoryGovernor, TestSet::perBuild());
+
+void TestMemoryGovernor::waiter(MemoryGovernor *governor, bool *finished)
+{
+    Timeplot::Worker tworker("waiter");
+    governor->wait(tworker);
+    *finished = true;
+}
+
+void TestMemoryGovernor::testUnlimited()
+{
+    Timeplot::Worker tworker("test");
+    Statistics::Peak usage("usage");
+    usage = 1000;
+    MemoryGovernor governor(0, usage);
+    governor.add();
+    governor.wait(tworker);
+    governor.done();
+}
+
+void TestMemoryGovernor::testUnder()
+{
+    Timeplot::Worker tworker("test");
+    Statistics::Peak usage("usage");
+    usage = 99;
+    MemoryGovernor governor(100, usage);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(100), governor.getLimit());
+    governor.add();
+    governor.wait(tworker);
+    governor.done();
+}
+
+void TestMemoryGovernor::testIdle()
+{
+    Timeplot::Worker tworker("test");
+    Statistics::Peak usage("usage");
+    usage = 200;
+    MemoryGovernor governor(100, usage);
+    governor.add();
+    governor.done();
+    governor.wait(tworker);
+}
+
+void TestMemoryGovernor::testBlock()
+{
+    Statistics::Peak usage("usage");
+    usage = 200;
+    MemoryGovernor governor(100, usage);
+    governor.add();
+    governor.add();
+
+    bool finished = false;
+    boost::thread thread(boost::bind(&TestMemoryGovernor::waiter, &governor, &finished));
+
+    // The first item is consumed but the usage is still over the limit
+    governor.done();
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    // Not strictly guaranteed, but the thread should still be waiting
+    CPPUNIT_ASSERT(!finished);
+
+    usage -= 150;
+    governor.done();
+    thread.join();
+    CPPUNIT_ASSERT(finished);
+}
@@ -0,0 +1,171 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref memory_io.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/bind.hpp>
+#include "../src/memory_io.h"
+#include "../src/fast_ply.h"
+#include "../src/splat.h"
+#include "../src/tr1_unordered_map.h"
+#include "testutil.h"
+
+class TestMemoryIO : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestMemoryIO);
+    CPPUNIT_TEST(testSplatArray);
+    CPPUNIT_TEST(testSplatArrayEmpty);
+    CPPUNIT_TEST(testByteArray);
+    CPPUNIT_TEST(testCallbackWriter);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    std::tr1::unordered_map<std::string, std::string> outputs;
+
+    void receive(const std::string &filename, const void *data, std::size_t count,
+                 BinaryWriter::offset_type offset);
+
+public:
+    virtual void setUp() { outputs.clear(); }
+
+    void testSplatArray();        ///< Read splats back through @ref FastPly::Reader
+    void testSplatArrayEmpty();   ///< An empty array gives an empty file
+    void testByteArray();         ///< Read bytes back, directly and through @ref BinaryReader::data
+    void testCallbackWriter();    ///< Write a mesh through @ref FastPly::Writer
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestMemoryIO, TestSet::perBuild());
+
+void TestMemoryIO::receive(const std::string &filename, const void *data, std::size_t count,
+                           BinaryWriter::offset_type offset)
+{
+    std::string &out = outputs[filename];
+    if (out.size() < offset + count)
+        out.resize(offset + count);
+    if (count > 0)
+        std::memcpy(&out[offset], data, count);
+}
+
+void TestMemoryIO::testSplatArray()
+{
+    std::vector<Splat> splats(3);
+    for (std::size_t i = 0; i < splats.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            splats[i].position[j] = i * 10.0f + j;
+            splats[i].normal[j] = j == i ? 1.0f : 0.0f;
+        }
+        splats[i].radius = 0.5f + i;
+        splats[i].quality = 123.0f; // should be recomputed
+    }
+
+    FastPly::Reader reader(SplatArrayReaderFactory(&splats[0], splats.size()), "memory", 2.0f, 2.0f);
+    MLSGPU_ASSERT_EQUAL(FastPly::Reader::size_type(3), reader.size());
+    MLSGPU_ASSERT_EQUAL(FastPly::Reader::size_type(sizeof(Splat)), reader.getVertexSize());
+
+    std::vector<Splat> out;
+    FastPly::Reader::Handle handle(reader);
+    handle.read(0, 3, std::back_inserter(out));
+    MLSGPU_ASSERT_EQUAL(std::size_t(3), out.size());
+    for (std::size_t i = 0; i < out.size(); i++)
+    {
+        for (unsigned int j = 0; j < 3; j++)
+        {
+            MLSGPU_ASSERT_EQUAL(splats[i].position[j], out[i].position[j]);
+            MLSGPU_ASSERT_EQUAL(splats[i].normal[j], out[i].normal[j]);
+        }
+    }
+    // Radii are smoothed and clamped as for a file
+    MLSGPU_ASSERT_EQUAL(1.0f, out[0].radius);
+    MLSGPU_ASSERT_EQUAL(3.0f, out[1].radius);
+    MLSGPU_ASSERT_EQUAL(4.0f, out[2].radius);
+    MLSGPU_ASSERT_EQUAL(1.0f, out[0].quality);
+    MLSGPU_ASSERT_EQUAL(1.0f / 16.0f, out[2].quality);
+}
+
+void TestMemoryIO::testSplatArrayEmpty()
+{
+    FastPly::Reader reader(SplatArrayReaderFactory(NULL, 0), "memory", 1.0f, 1.0f);
+    MLSGPU_ASSERT_EQUAL(FastPly::Reader::size_type(0), reader.size());
+
+    SplatArrayReader raw(NULL, 0);
+    raw.open("memory");
+    MLSGPU_ASSERT_EQUAL(BinaryReader::offset_type(SplatArrayReader::makeHeader(0).size()), raw.size());
+    char buffer[4];
+    MLSGPU_ASSERT_EQUAL(std::size_t(0), raw.read(buffer, sizeof(buffer), raw.size()));
+}
+
+void TestMemoryIO::testByteArray()
+{
+    const char bytes[] = "hello world";
+    ByteArrayReader reader(bytes, 11);
+    reader.open("memory");
+    MLSGPU_ASSERT_EQUAL(BinaryReader::offset_type(11), reader.size());
+    CPPUNIT_ASSERT(reader.data() == bytes);
+
+    char buffer[8] = {};
+    MLSGPU_ASSERT_EQUAL(std::size_t(5), reader.read(buffer, 5, 6));
+    CPPUNIT_ASSERT_EQUAL(std::string("world"), std::string(buffer, 5));
+    // Reads are clipped to the end
+    MLSGPU_ASSERT_EQUAL(std::size_t(2), reader.read(buffer, 8, 9));
+    CPPUNIT_ASSERT_EQUAL(std::string("ld"), std::string(buffer, 2));
+    MLSGPU_ASSERT_EQUAL(std::size_t(0), reader.read(buffer, 8, 20));
+}
+
+void TestMemoryIO::testCallbackWriter()
+{
+    const float vertices[2 * 3] =
+    {
+        1.0f, 2.0f, 4.0f,
+        -1.0f, -2.0f, -4.0f
+    };
+    const std::tr1::uint32_t indices[3] = { 0, 1, 0 };
+
+    FastPly::Writer w(CallbackWriterFactory(boost::bind(&TestMemoryIO::receive, this, _1, _2, _3, _4)));
+    w.setNumVertices(2);
+    w.setNumTriangles(1);
+    w.open("mesh");
+    w.writeVertices(1, 1, vertices + 3);
+    w.writeTriangles(0, 1, indices);
+    w.writeVertices(0, 1, vertices);
+    w.close();
+
+    MLSGPU_ASSERT_EQUAL(std::size_t(1), outputs.size());
+    const std::string &out = outputs["mesh"];
+    const std::size_t headerSize = out.find("end_header\n") + 11;
+    CPPUNIT_ASSERT(headerSize > 11);
+    MLSGPU_ASSERT_EQUAL(headerSize + 24 + 13, out.size());
+    CPPUNIT_ASSERT(0 == std::memcmp(out.data() + headerSize, vertices, sizeof(vertices)));
+    MLSGPU_ASSERT_EQUAL(3, out[headerSize + 24]);
+    CPPUNIT_ASSERT(0 == std::memcmp(out.data() + headerSize + 25, indices, sizeof(indices)));
+}
@@ -21,7 +21,7 @@
 /**
  * @file
  *
- * Tests for @ref MeshFilterChain.
+ * Tests for @ref MeshFilterChain and the filters.
  */
 
 #ifndef __CL_ENABLE_EXCEPTIONS
@@ -359,3 +359,80 @@ void TestScaleBiasFilter::testEmpty()
     MLSGPU_ASSERT_EQUAL(0, outMesh.numInternalVertices());
     MLSGPU_ASSERT_EQUAL(0, outMesh.numTriangles());
 }
+
+class TestDecimateFilter : public CLH::Test::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestDecimateFilter);
+    CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testSimple();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestDecimateFilter, TestSet::perCommit());
+
+void TestDecimateFilter::testSimple()
+{
+    const cl_uint3 offset = {{ 0, 0, 0 }};
+    const Grid::size_type size[3] = {5, 5, 5};
+    DecimateFilter filter(context, device, 2.0f);
+    filter.setRegion(offset, size);
+
+    const unsigned int N = 5;
+    const unsigned int T = 3;
+    std::vector<boost::array<cl_float, 3> > inVertices(N);
+    std::vector<boost::array<cl_uint, 3> > inTriangles(T);
+    std::vector<cl_ulong> inVertexKeys(N);
+
+    // Vertices 0 and 1 share a cube, and vertex 4 is external
+    inVertices[0][0] = 0.2f; inVertices[0][1] = 0.2f; inVertices[0][2] = 0.2f;
+    inVertices[1][0] = 0.6f; inVertices[1][1] = 0.4f; inVertices[1][2] = 0.2f;
+    inVertices[2][0] = 3.0f; inVertices[2][1] = 0.5f; inVertices[2][2] = 0.5f;
+    inVertices[3][0] = 0.5f; inVertices[3][1] = 3.0f; inVertices[3][2] = 0.5f;
+    inVertices[4][0] = 3.0f; inVertices[4][1] = 3.0f; inVertices[4][2] = 0.5f;
+
+    inTriangles[0][0] = 0; inTriangles[0][1] = 1; inTriangles[0][2] = 2;
+    inTriangles[1][0] = 1; inTriangles[1][1] = 2; inTriangles[1][2] = 3;
+    inTriangles[2][0] = 2; inTriangles[2][1] = 3; inTriangles[2][2] = 4;
+
+    inVertexKeys[4] = 0xDEADBEEF;
+
+    DeviceKeyMesh inMesh;
+    inMesh.assign(N, T, N - 1);
+    inMesh.vertices = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, N * 3 * sizeof(cl_float),
+                                 &inVertices[0][0]);
+    inMesh.triangles = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, T * 3 * sizeof(cl_uint),
+                                  &inTriangles[0][0]);
+    inMesh.vertexKeys = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, N * sizeof(cl_ulong),
+                                   &inVertexKeys[0]);
+
+    DeviceKeyMesh outMesh;
+    std::vector<cl::Event> wait(1);
+    std::vector<cl::Event> readWait(3);
+    filter(queue, inMesh, NULL, &wait[0], outMesh);
+
+    MLSGPU_ASSERT_EQUAL(4, outMesh.numVertices());
+    MLSGPU_ASSERT_EQUAL(3, outMesh.numInternalVertices());
+    MLSGPU_ASSERT_EQUAL(2, outMesh.numTriangles());
+
+    boost::scoped_array<char> buffer(new char[outMesh.getHostBytes()]);
+    HostKeyMesh result(buffer.get(), outMesh);
+    enqueueReadMesh(queue, outMesh, result, &wait, &readWait[0], &readWait[1], &readWait[2]);
+    cl::Event::waitForEvents(readWait);
+
+    // Clusters are in order of cube code, which is x-major
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.4, result.vertices[0][0], 1e-5);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.3, result.vertices[0][1], 1e-5);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.2, result.vertices[0][2], 1e-5);
+    for (unsigned int i = 1; i < 4; i++)
+        for (unsigned int j = 0; j < 3; j++)
+            CPPUNIT_ASSERT_EQUAL(inVertices[i + 1][j], result.vertices[i][j]);
+    CPPUNIT_ASSERT_EQUAL(inVertexKeys[4], result.vertexKeys[3]);
+
+    MLSGPU_ASSERT_EQUAL(0, result.triangles[0][0]);
+    MLSGPU_ASSERT_EQUAL(1, result.triangles[0][1]);
+    MLSGPU_ASSERT_EQUAL(2, result.triangles[0][2]);
+    MLSGPU_ASSERT_EQUAL(1, result.triangles[1][0]);
+    MLSGPU_ASSERT_EQUAL(2, result.triangles[1][1]);
+    MLSGPU_ASSERT_EQUAL(3, result.triangles[1][2]);
+}
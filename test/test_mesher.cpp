@@ -39,6 +39,7 @@
 #include <utility>
 #include <stdexcept>
 #include <cstring>
+#include <cstdio>
 #include "../src/tr1_cstdint.h"
 #include <boost/tr1/random.hpp>
 #include "../src/tr1_unordered_map.h"
@@ -54,10 +55,17 @@
 #include <boost/foreach.hpp>
 #include <boost/array.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <CL/cl.hpp>
 #include "testutil.h"
 #include "../src/fast_ply.h"
 #include "../src/mesher.h"
+#include "../src/misc.h"
+#include "../src/triangle_codec.h"
 #include "test_clh.h"
 #include "memory_reader.h"
 #include "memory_writer.h"
@@ -120,6 +128,61 @@ void TestChunkNamer::testBig()
     CPPUNIT_ASSERT_EQUAL(string("foo_0100_123456_2345678.ply"), namer(chunkId));
 }
 
+/// Unit test for @ref VertexQuantizer
+class TestVertexQuantizer : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestVertexQuantizer);
+    CPPUNIT_TEST(testFloat);
+    CPPUNIT_TEST(testFixed);
+    CPPUNIT_TEST_SUITE_END();
+public:
+    void testFloat();    ///< Test that the default quantizer copies floats
+    void testFixed();    ///< Test 16-bit encoding, including clamping
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestVertexQuantizer, TestSet::perBuild());
+
+void TestVertexQuantizer::testFloat()
+{
+    const boost::array<float, 3> in[2] = {{{ 1.0f, 2.5f, -3.0f }}, {{ 4.0f, 5.0f, 6.0f }}};
+    float out[6];
+    VertexQuantizer q;
+    MLSGPU_ASSERT_EQUAL(FastPly::VERTEX_FORMAT_FLOAT32, q.getFormat());
+    q(in, 2, reinterpret_cast<char *>(out));
+    CPPUNIT_ASSERT(0 == std::memcmp(in, out, sizeof(out)));
+}
+
+void TestVertexQuantizer::testFixed()
+{
+    const float ref[3] = { 0.0f, 0.0f, 0.0f };
+    const Grid grid(ref, 0.5f, 10, 20, 0, 10, 0, 10);
+    const Grid::size_type lower[3] = { 0, 1, 0 };
+    const Grid::size_type upper[3] = { 4, 3, 2 };
+    VertexQuantizer q(FastPly::VERTEX_FORMAT_UINT16, grid, lower, upper);
+
+    MLSGPU_ASSERT_EQUAL(FastPly::VERTEX_FORMAT_UINT16, q.getFormat());
+    MLSGPU_ASSERT_DOUBLES_EQUAL(2.0 / 65535.0, q.getScale(), 1e-12);
+    MLSGPU_ASSERT_DOUBLES_EQUAL(5.0, q.getBias()[0], 1e-12);
+    MLSGPU_ASSERT_DOUBLES_EQUAL(0.5, q.getBias()[1], 1e-12);
+    MLSGPU_ASSERT_DOUBLES_EQUAL(0.0, q.getBias()[2], 1e-12);
+
+    const boost::array<float, 3> in[3] =
+    {
+        {{ 5.0f, 0.5f, 0.0f }},
+        {{ 7.0f, 1.0f, 0.25f }},
+        {{ 100.0f, -1.0f, 0.0f }}    // outside the box, so clamped
+    };
+    const std::tr1::uint16_t expected[9] =
+    {
+        0, 0, 0,
+        65535, 16384, 8192,
+        65535, 0, 0
+    };
+    std::tr1::uint16_t out[9];
+    q(in, 3, reinterpret_cast<char *>(out));
+    for (int i = 0; i < 9; i++)
+        MLSGPU_ASSERT_EQUAL(expected[i], out[i]);
+}
+
 /**
  * Tests that are shared across all the @ref MesherBase subclasses.
  */
@@ -132,6 +195,7 @@ class TestMesherBase : public CLH::Test::TestFixture
     CPPUNIT_TEST(testEmpty);
     CPPUNIT_TEST(testWeld);
     CPPUNIT_TEST(testPrune);
+    CPPUNIT_TEST(testPruneMinVertices);
     CPPUNIT_TEST(testChunk);
     // CPPUNIT_TEST(testRandom); // Moved to TestMesherBaseSlow
     CPPUNIT_TEST_SUITE_END_ABSTRACT();
@@ -181,6 +245,12 @@ protected:
         const cl_uint *expectedIndices,
         const std::string &actualRaw) const;
 
+    /**
+     * Run the pruning test case with the given thresholds, which must select
+     * components of at least 6 vertices.
+     */
+    void checkPrune(double pruneThreshold, std::tr1::uint64_t pruneMinVertices);
+
     /**
      * @name
      * @{
@@ -244,6 +314,7 @@ public:
     void testEmpty();           ///< Empty mesh
     void testWeld();            ///< Tests vertex welding
     void testPrune();           ///< Tests component pruning
+    void testPruneMinVertices(); ///< Tests component pruning with an absolute threshold
     void testChunk();           ///< Test chunking into multiple files
     void testRandom();          ///< Test with pseudo-random data
 };
@@ -743,6 +814,18 @@ void TestMesherBase::testWeld()
 }
 
 void TestMesherBase::testPrune()
+{
+    // There are 22 vertices total, and we want a threshold of 6
+    checkPrune(6.5 / 22.0, 0);
+}
+
+void TestMesherBase::testPruneMinVertices()
+{
+    // Component A is discarded early, and C only once it is complete
+    checkPrune(0.0, 6);
+}
+
+void TestMesherBase::checkPrune(double pruneThreshold, std::tr1::uint64_t pruneMinVertices)
 {
     Timeplot::Worker tworker("test");
 
@@ -890,8 +973,8 @@ void TestMesherBase::testPrune()
     MemoryWriterPly writer;
 
     boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer));
-    // There are 22 vertices total, and we want a threshold of 6
-    mesher->setPruneThreshold(6.5 / 22.0);
+    mesher->setPruneThreshold(pruneThreshold);
+    mesher->setPruneMinVertices(pruneMinVertices);
     unsigned int passes = mesher->numPasses();
     for (unsigned int i = 0; i < passes; i++)
     {
@@ -1007,6 +1090,29 @@ static int simpleRandomInt(std::tr1::mt19937 &engine, int min, int max)
     return int(gen()) + min;
 }
 
+/**
+ * Thread body that passes items from a shared list to a mesher functor,
+ * for testing meshers that support concurrent input.
+ */
+static void addConcurrent(
+    const MesherBase::InputFunctor &functor,
+    const std::vector<MesherWork *> &work,
+    std::size_t &next, boost::mutex &mutex, int idx)
+{
+    Timeplot::Worker tworker("test", idx);
+    while (true)
+    {
+        MesherWork *item;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (next == work.size())
+                return;
+            item = work[next++];
+        }
+        functor(*item, tworker);
+    }
+}
+
 void TestMesherBase::testRandom()
 {
     Timeplot::Worker tworker("test");
@@ -1173,6 +1279,7 @@ void TestMesherBase::testRandom()
     for (unsigned int pass = 0; pass < passes; pass++)
     {
         const MesherBase::InputFunctor functor = mesher->functor(pass);
+        std::vector<MesherWork *> work;
         BOOST_FOREACH(Chunk &chunk, chunks)
         {
             BOOST_FOREACH(Block &block, chunk.blocks)
@@ -1182,9 +1289,24 @@ void TestMesherBase::testRandom()
                 CLH::enqueueMarkerWithWaitList(queue, NULL, &block.work.trianglesEvent);
                 block.work.hasEvents = true;
                 queue.flush();
-                functor(block.work, tworker);
+                if (mesher->concurrentInput())
+                    work.push_back(&block.work);
+                else
+                    functor(block.work, tworker);
             }
         }
+
+        if (!work.empty())
+        {
+            std::size_t next = 0;
+            boost::mutex mutex;
+            boost::thread_group threads;
+            for (int i = 0; i < 4; i++)
+                threads.create_thread(boost::bind(
+                        addConcurrent, boost::cref(functor), boost::cref(work),
+                        boost::ref(next), boost::ref(mutex), i));
+            threads.join_all();
+        }
     }
     mesher->write(tworker);
 
@@ -1217,9 +1339,25 @@ class TestMesherBaseSlow : public TestMesherBase
 class TestOOCMesher : public TestMesherBase
 {
     CPPUNIT_TEST_SUB_SUITE(TestOOCMesher, TestMesherBase);
+    CPPUNIT_TEST(testSnapshot);
+    CPPUNIT_TEST(testContainer);
+    CPPUNIT_TEST(testKeyTiles);
+    CPPUNIT_TEST(testParallelWrite);
+    CPPUNIT_TEST(testStream);
+    CPPUNIT_TEST(testStreamDirect);
     CPPUNIT_TEST_SUITE_END();
 protected:
     virtual MesherBase *mesherFactory(FastPly::Writer &writer, const MesherBase::Namer &namer);
+
+    /// Implementation of @ref testStream and @ref testStreamDirect
+    void checkStream(bool direct);
+public:
+    void testSnapshot();      ///< Test continuing from a snapshot in a new mesher
+    void testContainer();     ///< Test writing chunks to a container, with an index
+    void testKeyTiles();      ///< Test that wrapped keys in different key tiles are kept apart
+    void testParallelWrite(); ///< Test writing the clumps of a single file from several threads
+    void testStream();        ///< Test writing released chunks before the rest of the input
+    void testStreamDirect();  ///< Test writing released chunks from memory (see @ref MesherBase::setStreamDirect)
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestOOCMesher, TestSet::perBuild());
 
@@ -1231,6 +1369,8 @@ class TestTmpWriterWorkerGroup : public CppUnit::TestFixture
     CPPUNIT_TEST_SUITE(TestTmpWriterWorkerGroup);
     CPPUNIT_TEST(testInitialState);
     CPPUNIT_TEST(testRandom);
+    CPPUNIT_TEST(testCompressed);
+    CPPUNIT_TEST(testSlots);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -1242,10 +1382,12 @@ private:
 public:
     void testInitialState();  ///< Tests that the paths are initially empty
     void testRandom();        ///< Throws in lots of random data, checks that it comes back
+    void testCompressed();    ///< Checks that compressed triangles can be found and decoded
+    void testSlots();         ///< Tests @ref OOCMesher::TmpWriterWorkerGroup::setSlots and pending bytes
 
     virtual void tearDown();  ///< Delete the temporary files
 
-    TestTmpWriterWorkerGroup() : group(3) {}
+    TestTmpWriterWorkerGroup() : group(2, 3) {}
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestTmpWriterWorkerGroup, TestSet::perCommit());
 
@@ -1255,12 +1397,14 @@ void TestTmpWriterWorkerGroup::checkEmpty(const OOCMesher::TmpWriterItem &item)
     CPPUNIT_ASSERT(item.triangles.empty());
     CPPUNIT_ASSERT(item.vertexRanges.empty());
     CPPUNIT_ASSERT(item.triangleRanges.empty());
+    CPPUNIT_ASSERT(item.clumps.empty());
 }
 
 void TestTmpWriterWorkerGroup::testInitialState()
 {
     CPPUNIT_ASSERT(group.getVerticesPath().empty());
     CPPUNIT_ASSERT(group.getTrianglesPath().empty());
+    CPPUNIT_ASSERT(group.getClumpsPath().empty());
 }
 
 void TestTmpWriterWorkerGroup::testRandom()
@@ -1271,6 +1415,7 @@ void TestTmpWriterWorkerGroup::testRandom()
     using std::tr1::variate_generator;
     typedef OOCMesher::triangle_type triangle_type;
     typedef OOCMesher::vertex_type vertex_type;
+    typedef OOCMesher::Chunk::Clump Clump;
 
     mt19937 engine;
     variate_generator<mt19937 &, uniform_int<mt19937::result_type> > genNum(engine, uniform_int<mt19937::result_type>(0, 50));
@@ -1282,11 +1427,15 @@ void TestTmpWriterWorkerGroup::testRandom()
 
     std::vector<vertex_type> expectedVertices;
     std::vector<triangle_type> expectedTriangles;
+    std::vector<Clump> expectedClumps;
 
     for (int i = 0; i < 100; i++)
     {
         boost::shared_ptr<OOCMesher::TmpWriterItem> item = group.get(tworker, 1);
         checkEmpty(*item);
+        item->verticesOffset = expectedVertices.size() * sizeof(vertex_type);
+        item->trianglesOffset = expectedTriangles.size() * sizeof(triangle_type);
+        item->clumpsOffset = expectedClumps.size() * sizeof(Clump);
 
         int numVertices = genNum();
         int numTriangles = genNum();
@@ -1330,16 +1479,25 @@ void TestTmpWriterWorkerGroup::testRandom()
             for (std::size_t k = a; k < b; k++)
                 expectedTriangles.push_back(triangles[k]);
         }
+        int numClumps = genNum();
+        for (int j = 0; j < numClumps; j++)
+        {
+            Clump c(genTriangle(), genNum(), genNum(), genTriangle(), genNum(), genTriangle());
+            item->clumps.push_back(c);
+            expectedClumps.push_back(c);
+        }
 
         group.push(tworker, item);
     }
 
     group.stop();
 
-    CPPUNIT_ASSERT(!group.verticesFile.is_open());
-    CPPUNIT_ASSERT(!group.trianglesFile.is_open());
+    CPPUNIT_ASSERT(!group.verticesFile);
+    CPPUNIT_ASSERT(!group.trianglesFile);
+    CPPUNIT_ASSERT(!group.clumpsFile);
     CPPUNIT_ASSERT(!group.getVerticesPath().empty());
     CPPUNIT_ASSERT(!group.getTrianglesPath().empty());
+    CPPUNIT_ASSERT(!group.getClumpsPath().empty());
 
     boost::filesystem::ifstream inVertices(group.getVerticesPath(), std::ios::in | std::ios::binary);
     boost::filesystem::ifstream inTriangles(group.getTrianglesPath(), std::ios::in | std::ios::binary);
@@ -1359,6 +1517,125 @@ void TestTmpWriterWorkerGroup::testRandom()
     for (std::size_t i = 0; i < expectedTriangles.size(); i++)
         for (int j = 0; j < 3; j++)
             CPPUNIT_ASSERT_EQUAL(expectedTriangles[i][j], actualTriangles[i][j]);
+
+    boost::filesystem::ifstream inClumps(group.getClumpsPath(), std::ios::in | std::ios::binary);
+    for (std::size_t i = 0; i < expectedClumps.size(); i++)
+    {
+        Clump c(0, 0, 0, 0, 0, 0);
+        inClumps.read(reinterpret_cast<char *>(&c), sizeof(c));
+        CPPUNIT_ASSERT(inClumps);
+        CPPUNIT_ASSERT_EQUAL(expectedClumps[i].firstVertex, c.firstVertex);
+        CPPUNIT_ASSERT_EQUAL(expectedClumps[i].numInternalVertices, c.numInternalVertices);
+        CPPUNIT_ASSERT_EQUAL(expectedClumps[i].numExternalVertices, c.numExternalVertices);
+        CPPUNIT_ASSERT_EQUAL(expectedClumps[i].firstTriangle, c.firstTriangle);
+        CPPUNIT_ASSERT_EQUAL(expectedClumps[i].numTriangles, c.numTriangles);
+        CPPUNIT_ASSERT_EQUAL(expectedClumps[i].globalId, c.globalId);
+    }
+}
+
+void TestTmpWriterWorkerGroup::testCompressed()
+{
+    using std::tr1::mt19937;
+    using std::tr1::uniform_int;
+    using std::tr1::variate_generator;
+    typedef OOCMesher::triangle_type triangle_type;
+    typedef std::pair<std::tr1::uint64_t, std::vector<triangle_type> > expected_range;
+
+    mt19937 engine;
+    variate_generator<mt19937 &, uniform_int<mt19937::result_type> > genNum(engine, uniform_int<mt19937::result_type>(0, 50));
+    variate_generator<mt19937 &, uniform_int<mt19937::result_type> > genIndex(engine, uniform_int<mt19937::result_type>(0, 1000));
+
+    Timeplot::Worker tworker("test");
+    group.setCompressTriangles(true);
+    group.start();
+
+    std::vector<expected_range> expected;
+    std::tr1::uint64_t nextTriangle = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        boost::shared_ptr<OOCMesher::TmpWriterItem> item = group.get(tworker, 1);
+        checkEmpty(*item);
+        item->trianglesOffset = nextTriangle * sizeof(triangle_type);
+        int numRanges = genNum();
+        for (int j = 0; j < numRanges; j++)
+        {
+            int numTriangles = genNum();
+            std::vector<triangle_type> triangles;
+            for (int k = 0; k < numTriangles; k++)
+            {
+                triangle_type t;
+                for (int l = 0; l < 3; l++)
+                {
+                    // Mix internal indices with complemented external ones
+                    t[l] = genIndex();
+                    if (t[l] & 1)
+                        t[l] = ~t[l];
+                }
+                triangles.push_back(t);
+            }
+            std::size_t first = item->triangles.size();
+            item->triangles.insert(item->triangles.end(), triangles.begin(), triangles.end());
+            item->triangleRanges.push_back(std::make_pair(first, item->triangles.size()));
+            if (numTriangles > 0)
+                expected.push_back(expected_range(nextTriangle, triangles));
+            nextTriangle += numTriangles;
+        }
+        group.push(tworker, item);
+    }
+    group.stop();
+
+    boost::filesystem::ifstream inTriangles(group.getTrianglesPath(), std::ios::in | std::ios::binary);
+    std::tr1::uint64_t totalBytes = 0;
+    BOOST_FOREACH(const expected_range &r, expected)
+    {
+        const OOCMesher::TriangleBlock &block = group.findTriangles(r.first);
+        std::vector<std::tr1::uint8_t> encoded(block.bytes);
+        inTriangles.seekg(block.offset);
+        inTriangles.read(reinterpret_cast<char *>(&encoded[0]), block.bytes);
+        CPPUNIT_ASSERT(inTriangles);
+
+        std::vector<triangle_type> actual(r.second.size());
+        TriangleCodec::decode(actual.size() * 3, &encoded[0], encoded.size(),
+                              reinterpret_cast<std::tr1::uint32_t *>(&actual[0]));
+        for (std::size_t i = 0; i < actual.size(); i++)
+            for (int j = 0; j < 3; j++)
+                CPPUNIT_ASSERT_EQUAL(r.second[i][j], actual[i][j]);
+        totalBytes += block.bytes;
+    }
+    CPPUNIT_ASSERT_EQUAL(totalBytes, group.getTrianglesBytes());
+    CPPUNIT_ASSERT(totalBytes < nextTriangle * sizeof(triangle_type));
+}
+
+void TestTmpWriterWorkerGroup::testSlots()
+{
+    typedef OOCMesher::vertex_type vertex_type;
+    typedef OOCMesher::triangle_type triangle_type;
+
+    CPPUNIT_ASSERT_THROW(group.setSlots(2), std::invalid_argument);
+    group.setSlots(5);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(5), group.numSlots());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), group.getPendingBytes());
+
+    Timeplot::Worker tworker("test");
+    group.start();
+    CPPUNIT_ASSERT_THROW(group.setSlots(4), state_error);
+
+    // Take every slot, so that none can be freed behind our back
+    std::vector<boost::shared_ptr<OOCMesher::TmpWriterItem> > items;
+    for (int i = 0; i < 5; i++)
+    {
+        items.push_back(group.get(tworker, 1));
+        checkEmpty(*items.back());
+    }
+    items[0]->vertices.resize(10);
+    items[0]->triangles.resize(7);
+    items[0]->vertexRanges.push_back(std::make_pair(0, 10));
+    items[0]->triangleRanges.push_back(std::make_pair(0, 7));
+    CPPUNIT_ASSERT_EQUAL(10 * sizeof(vertex_type) + 7 * sizeof(triangle_type), items[0]->dataBytes());
+    for (std::size_t i = 0; i < items.size(); i++)
+        group.push(tworker, items[i]);
+    group.stop();
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), group.getPendingBytes());
 }
 
 void TestTmpWriterWorkerGroup::tearDown()
@@ -1369,6 +1646,8 @@ void TestTmpWriterWorkerGroup::tearDown()
         boost::filesystem::remove(group.getVerticesPath());
     if (!group.getTrianglesPath().empty())
         boost::filesystem::remove(group.getTrianglesPath());
+    if (!group.getClumpsPath().empty())
+        boost::filesystem::remove(group.getClumpsPath());
 }
 
 class TestOOCMesherSlow : public TestOOCMesher
@@ -1382,3 +1661,427 @@ MesherBase *TestOOCMesher::mesherFactory(FastPly::Writer &writer, const MesherBa
 {
     return new OOCMesher(writer, namer);
 }
+
+void TestOOCMesher::testSnapshot()
+{
+    Timeplot::Worker tworker("test");
+
+    // Same as testWeld
+    const boost::array<cl_float, 3> expectedVertices[] =
+    {
+        {{ 0.0f, 0.0f, 1.0f }},
+        {{ 0.0f, 0.0f, 2.0f }},
+        {{ 0.0f, 0.0f, 3.0f }},
+        {{ 0.0f, 0.0f, 4.0f }},
+        {{ 0.0f, 0.0f, 5.0f }},
+        {{ 1.0f, 0.0f, 1.0f }},
+        {{ 1.0f, 0.0f, 2.0f }},
+        {{ 1.0f, 0.0f, 3.0f }},
+        {{ 1.0f, 0.0f, 4.0f }},
+        {{ 0.0f, 1.0f, 0.0f }},
+        {{ 0.0f, 2.0f, 0.0f }},
+        {{ 0.0f, 3.0f, 0.0f }},
+        {{ 2.0f, 0.0f, 1.0f }},
+        {{ 2.0f, 0.0f, 2.0f }},
+        {{ 3.0f, 3.0f, 3.0f }},
+        {{ 4.0f, 5.0f, 6.0f }}
+    };
+    const cl_uint expectedIndices[] =
+    {
+        0, 1, 3,
+        1, 2, 3,
+        3, 4, 0,
+        5, 6, 8,
+        6, 7, 8,
+        7, 5, 8,
+        9, 10, 12,
+        10, 13, 12,
+        11, 12, 13,
+        9, 11, 13,
+        9, 12, 11,
+        14, 6, 15,
+        15, 6, 13,
+        13, 6, 7
+    };
+
+    boost::filesystem::path path;
+    {
+        boost::filesystem::ofstream dummy;
+        createTmpFile(path, dummy);
+    }
+
+    MemoryWriterPly writer;
+    {
+        boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer, TrivialNamer("")));
+        const MesherBase::InputFunctor functor = mesher->functor(0);
+        add(ChunkId(), functor,
+            boost::size(internalVertices0), 0, boost::size(indices0),
+            internalVertices0, NULL, NULL, indices0);
+        add(ChunkId(), functor,
+            0, boost::size(externalVertices1), boost::size(indices1),
+            NULL, externalVertices1, externalKeys1, indices1);
+        add(ChunkId(), functor,
+            boost::size(internalVertices2),
+            boost::size(externalVertices2),
+            boost::size(indices2),
+            internalVertices2, externalVertices2, externalKeys2, indices2);
+        mesher->snapshot(tworker, path, 3);
+    }
+
+    boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer, TrivialNamer("")));
+    std::tr1::uint64_t progress = 0;
+    CPPUNIT_ASSERT(mesher->restore(tworker, path, progress));
+    boost::filesystem::remove(path);
+    MLSGPU_ASSERT_EQUAL(3, progress);
+
+    // This block must be welded to the ones before the snapshot
+    const MesherBase::InputFunctor functor = mesher->functor(0);
+    add(ChunkId(), functor,
+        boost::size(internalVertices3),
+        boost::size(externalVertices3),
+        boost::size(indices3),
+        internalVertices3, externalVertices3, externalKeys3, indices3);
+    mesher->write(tworker);
+
+    checkIsomorphic(boost::size(expectedVertices), boost::size(expectedIndices),
+                    expectedVertices, expectedIndices, writer.getOutput(""));
+}
+
+void TestOOCMesher::testParallelWrite()
+{
+    Timeplot::Worker tworker("test");
+
+    // Same as testSimple
+    const boost::array<cl_float, 3> expectedVertices[] =
+    {
+        {{ 0.0f, 0.0f, 1.0f }},
+        {{ 0.0f, 0.0f, 2.0f }},
+        {{ 0.0f, 0.0f, 3.0f }},
+        {{ 0.0f, 0.0f, 4.0f }},
+        {{ 0.0f, 0.0f, 5.0f }},
+        {{ 1.0f, 0.0f, 1.0f }},
+        {{ 1.0f, 0.0f, 2.0f }},
+        {{ 1.0f, 0.0f, 3.0f }},
+        {{ 1.0f, 0.0f, 4.0f }},
+        {{ 0.0f, 1.0f, 0.0f }},
+        {{ 0.0f, 2.0f, 0.0f }},
+        {{ 0.0f, 3.0f, 0.0f }},
+        {{ 2.0f, 0.0f, 1.0f }},
+        {{ 2.0f, 0.0f, 2.0f }}
+    };
+    const cl_uint expectedIndices[] =
+    {
+        0, 1, 3,
+        1, 2, 3,
+        3, 4, 0,
+        5, 6, 8,
+        6, 7, 8,
+        7, 5, 8,
+        9, 10, 12,
+        10, 13, 12,
+        11, 12, 13,
+        9, 11, 13,
+        9, 12, 11
+    };
+
+    MemoryWriterPly writer;
+    boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer, TrivialNamer("")));
+    mesher->setWriteThreads(3);
+    mesher->setParallelWrite(true);
+    unsigned int passes = mesher->numPasses();
+    for (unsigned int i = 0; i < passes; i++)
+    {
+        const MesherBase::InputFunctor functor = mesher->functor(i);
+        add(ChunkId(), functor,
+            boost::size(internalVertices0), 0, boost::size(indices0),
+            internalVertices0, NULL, NULL, indices0);
+        add(ChunkId(), functor,
+            0, boost::size(externalVertices1), boost::size(indices1),
+            NULL, externalVertices1, externalKeys1, indices1);
+        add(ChunkId(), functor,
+            boost::size(internalVertices2),
+            boost::size(externalVertices2),
+            boost::size(indices2),
+            internalVertices2, externalVertices2, externalKeys2, indices2);
+    }
+    mesher->write(tworker);
+
+    checkIsomorphic(boost::size(expectedVertices), boost::size(expectedIndices),
+                    expectedVertices, expectedIndices, writer.getOutput(""));
+}
+
+/// Chunk callback for @ref TestOOCMesher::checkStream
+static void countChunk(std::vector<std::string> &names, boost::mutex &mutex, const ChunkIndexEntry &entry)
+{
+    boost::lock_guard<boost::mutex> lock(mutex);
+    names.push_back(entry.filename);
+}
+
+void TestOOCMesher::testStream()
+{
+    checkStream(false);
+}
+
+void TestOOCMesher::testStreamDirect()
+{
+    checkStream(true);
+}
+
+void TestOOCMesher::checkStream(bool direct)
+{
+    Timeplot::Worker tworker("test");
+    Statistics::Counter &directStat = Statistics::getStatistic<Statistics::Counter>("mesher.chunks.direct");
+    const unsigned long long oldDirect = directStat.getTotal();
+
+    // Same as testChunk
+    const boost::array<cl_float, 3> expectedVertices2[] =
+    {
+        {{ 0.0f, 1.0f, 0.0f }},
+        {{ 0.0f, 2.0f, 0.0f }},
+        {{ 0.0f, 3.0f, 0.0f }},
+        {{ 2.0f, 0.0f, 1.0f }},
+        {{ 2.0f, 0.0f, 2.0f }}
+    };
+
+    const boost::array<cl_float, 3> expectedVertices3[] =
+    {
+        {{ 3.0f, 3.0f, 3.0f }},
+        {{ 4.0f, 5.0f, 6.0f }},
+        {{ 1.0f, 0.0f, 2.0f }},
+        {{ 1.0f, 0.0f, 3.0f }},
+        {{ 2.0f, 0.0f, 2.0f }}
+    };
+
+    ChunkNamer namer("chunk");
+    MemoryWriterPly writer;
+    boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer, namer));
+    std::vector<std::string> names;
+    boost::mutex namesMutex;
+    mesher->setStreamChunks(true);
+    mesher->setStreamDirect(direct);
+    mesher->setChunkCallback(boost::bind(countChunk, boost::ref(names), boost::ref(namesMutex), _1));
+
+    ChunkId chunkId[4];
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        chunkId[i].gen = i;
+        chunkId[i].coords[0] = i;
+        chunkId[i].coords[1] = i * i;
+        chunkId[i].coords[2] = 1;
+    }
+    const MesherBase::InputFunctor functor = mesher->functor(0);
+    add(chunkId[0], functor,
+        boost::size(internalVertices0), 0, boost::size(indices0),
+        internalVertices0, NULL, NULL, indices0);
+    add(chunkId[1], functor,
+        0, boost::size(externalVertices1), boost::size(indices1),
+        NULL, externalVertices1, externalKeys1, indices1);
+    // These two are written while the others are still arriving
+    mesher->releaseChunk(0);
+    mesher->releaseChunk(1);
+    add(chunkId[2], functor,
+        boost::size(internalVertices2),
+        boost::size(externalVertices2),
+        boost::size(indices2),
+        internalVertices2, externalVertices2, externalKeys2, indices2);
+    add(chunkId[3], functor,
+        boost::size(internalVertices3),
+        boost::size(externalVertices3),
+        boost::size(indices3),
+        internalVertices3, externalVertices3, externalKeys3, indices3);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(4), mesher->write(tworker));
+
+    // The released chunks are small enough to still be in the reorder buffer
+    CPPUNIT_ASSERT_EQUAL((unsigned long long) (direct ? 2 : 0), directStat.getTotal() - oldDirect);
+    // Each chunk is written exactly once
+    CPPUNIT_ASSERT_EQUAL(std::size_t(4), names.size());
+    std::sort(names.begin(), names.end());
+    CPPUNIT_ASSERT(std::adjacent_find(names.begin(), names.end()) == names.end());
+
+    checkIsomorphic(boost::size(internalVertices0),
+                    boost::size(indices0),
+                    internalVertices0, indices0, writer.getOutput("chunk_0000_0000_0001.ply"));
+    checkIsomorphic(boost::size(externalVertices1),
+                    boost::size(indices1),
+                    externalVertices1, indices1, writer.getOutput("chunk_0001_0001_0001.ply"));
+    checkIsomorphic(boost::size(expectedVertices2),
+                    boost::size(indices2),
+                    expectedVertices2, indices2, writer.getOutput("chunk_0002_0004_0001.ply"));
+    checkIsomorphic(boost::size(expectedVertices3),
+                    boost::size(indices3),
+                    expectedVertices3, indices3, writer.getOutput("chunk_0003_0009_0001.ply"));
+}
+
+void TestOOCMesher::testContainer()
+{
+    Timeplot::Worker tworker("test");
+
+    // Same as testChunk
+    const boost::array<cl_float, 3> expectedVertices2[] =
+    {
+        {{ 0.0f, 1.0f, 0.0f }},
+        {{ 0.0f, 2.0f, 0.0f }},
+        {{ 0.0f, 3.0f, 0.0f }},
+        {{ 2.0f, 0.0f, 1.0f }},
+        {{ 2.0f, 0.0f, 2.0f }}
+    };
+
+    const boost::array<cl_float, 3> expectedVertices3[] =
+    {
+        {{ 3.0f, 3.0f, 3.0f }},
+        {{ 4.0f, 5.0f, 6.0f }},
+        {{ 1.0f, 0.0f, 2.0f }},
+        {{ 1.0f, 0.0f, 3.0f }},
+        {{ 2.0f, 0.0f, 2.0f }}
+    };
+
+    boost::filesystem::path indexPath;
+    {
+        boost::filesystem::ofstream dummy;
+        createTmpFile(indexPath, dummy);
+    }
+
+    MemoryWriterPly writer;
+    boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer, ChunkNamer("chunk")));
+    mesher->setChunkIndex(indexPath.string());
+    mesher->setChunkContainer("container");
+    unsigned int passes = mesher->numPasses();
+
+    /* Generation order is deliberately not Morton order, which puts the chunks
+     * in the order 1, 0, 3, 2.
+     */
+    ChunkId chunkId[4];
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        chunkId[i].gen = i;
+        chunkId[i].coords[0] = i ^ 1;
+        chunkId[i].coords[1] = 0;
+        chunkId[i].coords[2] = 0;
+    }
+    for (unsigned int i = 0; i < passes; i++)
+    {
+        const MesherBase::InputFunctor functor = mesher->functor(i);
+        add(chunkId[0], functor,
+            boost::size(internalVertices0), 0, boost::size(indices0),
+            internalVertices0, NULL, NULL, indices0);
+        add(chunkId[1], functor,
+            0, boost::size(externalVertices1), boost::size(indices1),
+            NULL, externalVertices1, externalKeys1, indices1);
+        add(chunkId[2], functor,
+            boost::size(internalVertices2),
+            boost::size(externalVertices2),
+            boost::size(indices2),
+            internalVertices2, externalVertices2, externalKeys2, indices2);
+        add(chunkId[3], functor,
+            boost::size(internalVertices3),
+            boost::size(externalVertices3),
+            boost::size(indices3),
+            internalVertices3, externalVertices3, externalKeys3, indices3);
+    }
+    mesher->write(tworker);
+
+    // Each chunk is on one line of the index
+    std::vector<std::pair<std::size_t, std::size_t> > ranges;
+    std::vector<unsigned int> xs;
+    {
+        boost::filesystem::ifstream index(indexPath);
+        CPPUNIT_ASSERT(index);
+        std::string line;
+        while (getline(index, line))
+        {
+            if (line.find("\"coords\"") == std::string::npos)
+                continue;
+            unsigned int x, y, z;
+            unsigned long long offset, size;
+            CPPUNIT_ASSERT_EQUAL(3, sscanf(line.c_str(), " { \"coords\": [%u, %u, %u]", &x, &y, &z));
+            CPPUNIT_ASSERT(line.find("\"file\": \"container\"") != std::string::npos);
+            CPPUNIT_ASSERT_EQUAL(1, sscanf(line.c_str() + line.find("\"offset\""), "\"offset\": %llu", &offset));
+            CPPUNIT_ASSERT_EQUAL(1, sscanf(line.c_str() + line.find("\"size\""), "\"size\": %llu", &size));
+            xs.push_back(x);
+            ranges.push_back(std::make_pair(std::size_t(offset), std::size_t(size)));
+        }
+    }
+    boost::filesystem::remove(indexPath);
+
+    MLSGPU_ASSERT_EQUAL(4, xs.size());
+    const std::string &container = writer.getOutput("container");
+    std::size_t pos = 0;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        MLSGPU_ASSERT_EQUAL(i, xs[i]);
+        MLSGPU_ASSERT_EQUAL(pos, ranges[i].first);
+        pos += ranges[i].second;
+    }
+    MLSGPU_ASSERT_EQUAL(pos, container.size());
+
+    checkIsomorphic(boost::size(externalVertices1),
+                    boost::size(indices1),
+                    externalVertices1, indices1, container.substr(ranges[0].first, ranges[0].second));
+    checkIsomorphic(boost::size(internalVertices0),
+                    boost::size(indices0),
+                    internalVertices0, indices0, container.substr(ranges[1].first, ranges[1].second));
+    checkIsomorphic(boost::size(expectedVertices3),
+                    boost::size(indices3),
+                    expectedVertices3, indices3, container.substr(ranges[2].first, ranges[2].second));
+    checkIsomorphic(boost::size(expectedVertices2),
+                    boost::size(indices2),
+                    expectedVertices2, indices2, container.substr(ranges[3].first, ranges[3].second));
+}
+
+void TestOOCMesher::testKeyTiles()
+{
+    Timeplot::Worker tworker("test");
+
+    /* The grid is twice as wide as the key period, and the chunks are a
+     * quarter of it. The external keys of chunks 0 and 4 wrap around to the
+     * same values but are in different tiles, so the components must not be
+     * merged. If they were, pruning would keep both.
+     */
+    const float ref[3] = {0.0f, 0.0f, 0.0f};
+    const Grid grid(ref, 1.0f, 0, 1 << 21, 0, 1, 0, 1);
+
+    const boost::array<cl_float, 3> externalVertices0[] =
+    {
+        {{ 0.0f, 0.0f, 0.0f }},
+        {{ 1.0f, 0.0f, 0.0f }},
+        {{ 0.0f, 1.0f, 0.0f }}
+    };
+    const cl_ulong externalKeys0[] = { 2, 4, 6 };
+    const cl_uint indices0[] = { 0, 1, 2 };
+
+    const boost::array<cl_float, 3> externalVertices1[] =
+    {
+        {{ 0.0f, 1.0f, 5.0f }},
+        {{ 1.0f, 1.0f, 5.0f }},
+        {{ 0.0f, 2.0f, 5.0f }},
+        {{ 1.0f, 2.0f, 5.0f }}
+    };
+    const cl_ulong externalKeys1[] = { 2, 4, 6, 8 };
+    const cl_uint indices1[] = { 0, 1, 2, 2, 1, 3 };
+
+    MemoryWriterPly writer;
+    boost::scoped_ptr<MesherBase> mesher(mesherFactory(writer, ChunkNamer("chunk")));
+    mesher->setChunkGrid(grid, 1 << 18, grid);
+    mesher->setPruneThreshold(3.5 / 7.0);
+    unsigned int passes = mesher->numPasses();
+
+    ChunkId chunkId[2];
+    chunkId[0].gen = 0;
+    chunkId[1].gen = 1;
+    chunkId[1].coords[0] = 4;
+    for (unsigned int i = 0; i < passes; i++)
+    {
+        const MesherBase::InputFunctor functor = mesher->functor(i);
+        add(chunkId[0], functor,
+            0, boost::size(externalVertices0), boost::size(indices0),
+            NULL, externalVertices0, externalKeys0, indices0);
+        add(chunkId[1], functor,
+            0, boost::size(externalVertices1), boost::size(indices1),
+            NULL, externalVertices1, externalKeys1, indices1);
+    }
+    mesher->write(tworker);
+
+    CPPUNIT_ASSERT_THROW(writer.getOutput("chunk_0000_0000_0000.ply"), std::invalid_argument);
+    checkIsomorphic(boost::size(externalVertices1), boost::size(indices1),
+                    externalVertices1, indices1, writer.getOutput("chunk_0004_0000_0000.ply"));
+}
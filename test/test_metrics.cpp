@@ -0,0 +1,150 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref metrics.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <sstream>
+#include <string>
+#include <iterator>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lambda/lambda.hpp>
+#include "../src/metrics.h"
+#include "../src/statistics.h"
+#include "../src/misc.h"
+#include "testutil.h"
+
+namespace
+{
+
+/// Write metrics for @a registry to a string
+std::string metricsString(const Statistics::Registry &registry)
+{
+    std::ostringstream o;
+    Metrics::write(o, registry);
+    return o.str();
+}
+
+/// Whether @a needle occurs in @a haystack
+bool contains(const std::string &haystack, const std::string &needle)
+{
+    return haystack.find(needle) != std::string::npos;
+}
+
+} // anonymous namespace
+
+class TestMetrics : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestMetrics);
+    CPPUNIT_TEST(testStatistics);
+    CPPUNIT_TEST(testGauge);
+    CPPUNIT_TEST(testDuplicateGauge);
+    CPPUNIT_TEST(testExporter);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testStatistics();      ///< Test output of each type of statistic
+    void testGauge();           ///< Test that gauges are sampled while they exist
+    void testDuplicateGauge();  ///< Test gauges that share a name
+    void testExporter();        ///< Test that @ref Metrics::Exporter writes the file
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestMetrics, TestSet::perBuild());
+
+void TestMetrics::testStatistics()
+{
+    Statistics::Registry registry;
+    registry.getStatistic<Statistics::Counter>("a.counter").add(100);
+    Statistics::Variable &var = registry.getStatistic<Statistics::Variable>("b.var");
+    var.add(2.0);
+    var.add(4.0);
+    Statistics::Peak &peak = registry.getStatistic<Statistics::Peak>("c.peak");
+    peak += 5;
+    peak -= 3;
+
+    CPPUNIT_ASSERT_EQUAL(std::string(
+            "# TYPE mlsgpu_a_counter counter\n"
+            "mlsgpu_a_counter 100\n"
+            "# TYPE mlsgpu_b_var summary\n"
+            "mlsgpu_b_var_sum 6\n"
+            "mlsgpu_b_var_count 2\n"
+            "# TYPE mlsgpu_c_peak gauge\n"
+            "mlsgpu_c_peak 2\n"
+            "# TYPE mlsgpu_c_peak_max gauge\n"
+            "mlsgpu_c_peak_max 5\n"), metricsString(registry));
+}
+
+void TestMetrics::testGauge()
+{
+    Statistics::Registry registry;
+    int value = 3;
+    {
+        Metrics::Gauge gauge("test.gauge", boost::lambda::var(value));
+        CPPUNIT_ASSERT(contains(metricsString(registry), "mlsgpu_test_gauge 3\n"));
+        value = 7;
+        CPPUNIT_ASSERT(contains(metricsString(registry), "mlsgpu_test_gauge 7\n"));
+    }
+    CPPUNIT_ASSERT(!contains(metricsString(registry), "mlsgpu_test_gauge"));
+}
+
+void TestMetrics::testDuplicateGauge()
+{
+    Statistics::Registry registry;
+    int value0 = 1, value1 = 2;
+    Metrics::Gauge gauge0("test.dup", boost::lambda::var(value0));
+    Metrics::Gauge gauge1("test.dup", boost::lambda::var(value1));
+    const std::string out = metricsString(registry);
+    CPPUNIT_ASSERT(contains(out,
+                            "# TYPE mlsgpu_test_dup gauge\n"
+                            "mlsgpu_test_dup{instance=\"0\"} 1\n"
+                            "mlsgpu_test_dup{instance=\"1\"} 2\n"));
+}
+
+void TestMetrics::testExporter()
+{
+    boost::filesystem::path path;
+    {
+        boost::filesystem::ofstream dummy;
+        createTmpFile(path, dummy);
+    }
+
+    int value = 42;
+    Metrics::Gauge gauge("test.exporter", boost::lambda::var(value));
+    Metrics::Exporter exporter(path.string(), 0.01);
+    exporter.start();
+    value = 43;
+    exporter.stop();
+
+    boost::filesystem::ifstream in(path);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    boost::filesystem::remove(path);
+    CPPUNIT_ASSERT(contains(content, "mlsgpu_test_exporter 43\n"));
+}
@@ -322,6 +322,7 @@ class TestTmpFile : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestTmpFile);
     CPPUNIT_TEST(testCreate);
+    CPPUNIT_TEST(testStripe);
 #if DEBUG
     CPPUNIT_TEST(testBadPath);
 #endif
@@ -332,6 +333,7 @@ private:
 
 public:
     void testCreate();      ///< Test basic creation
+    void testStripe();      ///< Test cycling through several directories
     void testBadPath();     ///< Test exception handling when the path is wrong
 
     virtual void tearDown();
@@ -360,6 +362,28 @@ void TestTmpFile::testCreate()
     in.close();
 }
 
+void TestTmpFile::testStripe()
+{
+    std::vector<boost::filesystem::path> dirs;
+    dirs.push_back(boost::filesystem::path("."));
+    dirs.push_back(boost::filesystem::temp_directory_path());
+    setTmpFileDirs(dirs);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), getTmpFileDirCount());
+
+    for (int i = 0; i < 4; i++)
+    {
+        boost::filesystem::ofstream out;
+        createTmpFile(removePath, out);
+        out.close();
+        CPPUNIT_ASSERT_EQUAL(dirs[i % 2], removePath.parent_path());
+        boost::filesystem::remove(removePath);
+    }
+    removePath.clear();
+
+    setTmpFileDirs(std::vector<boost::filesystem::path>());
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), getTmpFileDirCount());
+}
+
 void TestTmpFile::testBadPath()
 {
     setTmpFileDir("//\\bad");
@@ -65,6 +65,10 @@ class TestMls : public CLH::Test::TestFixture
     CPPUNIT_TEST(testFitSphere);
     CPPUNIT_TEST(testProjectDistOriginSphere);
     CPPUNIT_TEST(testProcessCorners);
+    CPPUNIT_TEST(testProcessCornersBuffer);
+    CPPUNIT_TEST(testProcessCornersSpecialized);
+    CPPUNIT_TEST(testScatter);
+    CPPUNIT_TEST(testValidGroupSize);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -113,6 +117,18 @@ private:
      */
     std::vector<float> callFitSphere(const std::vector<Splat> &splats);
 
+    /// Run the @ref processCorners kernel on a sphere, storing the distances in @a storage
+    void checkProcessCorners(Marching::DistanceStorage storage);
+
+    /**
+     * Compare @ref ScatterMlsFunctor against @ref MlsFunctor with an octree
+     * that lists every splat in every cell.
+     *
+     * @param storage    Storage for the distances.
+     * @param maxPairs   Capacity of the scatter functor (small values force the fallback).
+     */
+    void checkScatter(Marching::DistanceStorage storage, std::size_t maxPairs);
+
 public:
     virtual void setUp();
     virtual void tearDown();
@@ -124,6 +140,10 @@ public:
     void testFitSphere();          ///< Test @ref fitSphere in @ref mls.cl.
 
     void testProcessCorners();     ///< Test the @ref processCorners kernel.
+    void testProcessCornersBuffer(); ///< Test the @ref processCorners kernel writing to a buffer.
+    void testProcessCornersSpecialized(); ///< Test the @ref processCorners kernel with constants baked in.
+    void testScatter();            ///< Test @ref ScatterMlsFunctor.
+    void testValidGroupSize();     ///< Test @ref MlsFunctor::validGroupSize.
 
     // TODO: test boundary handling
 };
@@ -145,6 +165,7 @@ void TestMls::setUp()
 void TestMls::tearDown()
 {
     mlsProgram = NULL;
+    CLH::setSpecializeKernels(false);
     CLH::Test::TestFixture::tearDown();
 }
 
@@ -413,7 +434,7 @@ static inline double sqr(double x)
     return x * x;
 }
 
-void TestMls::testProcessCorners()
+void TestMls::checkProcessCorners(Marching::DistanceStorage storage)
 {
     const std::size_t N = 50;
     const float center[3] = {10.0f, 20.0f, 35.0f};
@@ -427,7 +448,7 @@ void TestMls::testProcessCorners()
     const Grid::size_type size[3] = {sizeX, sizeY, sizeZ};
     const Grid::difference_type offset[3] = { 20, 15, 33 };
 
-    MlsFunctor generator(context, MLS_SHAPE_SPHERE);
+    MlsFunctor generator(context, MLS_SHAPE_SPHERE, NULL, SPLAT_LAYOUT_FULL, false, storage);
     Marching::Swathe swathe;
     swathe.width = sizeX;
     swathe.height = sizeY;
@@ -438,6 +459,9 @@ void TestMls::testProcessCorners()
     swathe.zLast = 26;
     swathe.zStride = imageHeight + 10;
     swathe.zBias = (2 - cl_int(swathe.zFirst)) * cl_int(swathe.zStride);
+    // Leave some padding at the end of each row, to check that the pitch is respected
+    swathe.rowPitch = storage == Marching::DISTANCE_BUFFER ? imageWidth + 3 : 0;
+    const std::size_t rows = imageDepth * swathe.zStride + swathe.zBias;
 
     unsigned int subsampling = MlsFunctor::subsamplingMin;
     while ((Grid::size_type(2) << subsampling) < *max_element(size, size + 3))
@@ -479,8 +503,14 @@ void TestMls::testProcessCorners()
     cl::Buffer dCommands(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
                          hCommands.size() * sizeof(SplatTreeCL::command_type), &hCommands[0]);
 
-    cl::Image2D dCorners = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT),
-                                       imageWidth, imageDepth * swathe.zStride + swathe.zBias);
+    cl::Buffer dBuffer;
+    cl::Image2D dImage;
+    cl::Memory dCorners;
+    if (storage == Marching::DISTANCE_BUFFER)
+        dCorners = dBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, rows * swathe.rowPitch * sizeof(cl_float));
+    else
+        dCorners = dImage = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT),
+                                        imageWidth, rows);
 
     generator.set(offset, dSplats, dCommands, dStart, subsampling);
     generator.enqueue(queue, dCorners, swathe, NULL, NULL);
@@ -490,10 +520,23 @@ void TestMls::testProcessCorners()
     for (Grid::size_type z = swathe.zFirst; z <= swathe.zLast; z++)
     {
         cl_float hCorners[sizeY][sizeX];
-        cl::size_t<3> origin, region;
+        cl::size_t<3> origin, hostOrigin, region;
         origin[0] = 0; origin[1] = z * swathe.zStride + swathe.zBias; origin[2] = 0;
-        region[0] = swathe.width; region[1] = swathe.height; region[2] = 1;
-        queue.enqueueReadImage(dCorners, CL_TRUE, origin, region, 0, 0, &hCorners[0][0]);
+        hostOrigin[0] = 0; hostOrigin[1] = 0; hostOrigin[2] = 0;
+        if (storage == Marching::DISTANCE_BUFFER)
+        {
+            region[0] = swathe.width * sizeof(cl_float); region[1] = swathe.height; region[2] = 1;
+            queue.enqueueReadBufferRect(dBuffer, CL_TRUE,
+                                        origin, hostOrigin, region,
+                                        swathe.rowPitch * sizeof(cl_float), 0,
+                                        sizeof(hCorners[0]), 0, &hCorners[0][0]);
+        }
+        else
+        {
+            region[0] = swathe.width; region[1] = swathe.height; region[2] = 1;
+            queue.enqueueReadImage(dImage, CL_TRUE,
+                                   origin, region, 0, 0, &hCorners[0][0]);
+        }
 
         for (unsigned int y = 0; y < swathe.height; y++)
             for (unsigned int x = 0; x < swathe.width; x++)
@@ -512,3 +555,153 @@ void TestMls::testProcessCorners()
             }
     }
 }
+
+void TestMls::testProcessCorners()
+{
+    checkProcessCorners(Marching::DISTANCE_IMAGE);
+}
+
+void TestMls::testProcessCornersBuffer()
+{
+    checkProcessCorners(Marching::DISTANCE_BUFFER);
+}
+
+void TestMls::testProcessCornersSpecialized()
+{
+    CLH::setSpecializeKernels(true);
+    checkProcessCorners(Marching::DISTANCE_IMAGE);
+    checkProcessCorners(Marching::DISTANCE_BUFFER);
+}
+
+void TestMls::checkScatter(Marching::DistanceStorage storage, std::size_t maxPairs)
+{
+    const std::size_t N = 50;
+    const float center[3] = {30.0f, 27.0f, 45.0f};
+    const float radius = 6.0f;
+
+    const Grid::size_type sizeX = 19;
+    const Grid::size_type sizeY = 24;
+    const Grid::size_type sizeZ = 28;
+    const Grid::size_type size[3] = {sizeX, sizeY, sizeZ};
+    const Grid::difference_type offset[3] = { 20, 15, 33 };
+
+    MlsFunctor reference(context, MLS_SHAPE_SPHERE, NULL, SPLAT_LAYOUT_FULL, false, storage);
+    ScatterMlsFunctor scatter(context, device, MLS_SHAPE_SPHERE, NULL, SPLAT_LAYOUT_FULL,
+                              storage, CL_FLOAT, maxPairs);
+    Marching::Swathe swathe;
+    swathe.width = sizeX;
+    swathe.height = sizeY;
+    Grid::size_type imageWidth = roundUp(sizeX, reference.alignment()[0]);
+    Grid::size_type imageHeight = roundUp(sizeY, reference.alignment()[1]);
+    Grid::size_type imageDepth = roundUp(sizeZ, reference.alignment()[2]);
+    swathe.zFirst = MlsFunctor::wgs[2];
+    swathe.zLast = 26;
+    swathe.zStride = imageHeight + 10;
+    swathe.zBias = (2 - cl_int(swathe.zFirst)) * cl_int(swathe.zStride);
+    swathe.rowPitch = storage == Marching::DISTANCE_BUFFER ? imageWidth + 3 : 0;
+    const std::size_t rows = imageDepth * swathe.zStride + swathe.zBias;
+
+    unsigned int subsampling = MlsFunctor::subsamplingMin;
+    while ((Grid::size_type(2) << subsampling) < *max_element(size, size + 3))
+        subsampling++;
+
+    std::vector<Splat> hSplats = sphereSplats(N, center, radius);
+    BOOST_FOREACH(Splat &splat, hSplats)
+    {
+        splat.radius = 1.0f / (splat.radius * splat.radius);
+    }
+
+    // Every cell lists every splat, in index order
+    std::vector<SplatTreeCL::command_type> hStart(8, 0);
+    std::vector<SplatTreeCL::command_type> hCommands;
+    hCommands.push_back(N + 1);
+    for (unsigned int i = 0; i < N; i++)
+        hCommands.push_back(i);
+    hCommands.push_back(-1);
+
+    cl::Buffer dSplats(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                       N * sizeof(Splat), &hSplats[0]);
+    cl::Buffer dStart(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                      hStart.size() * sizeof(SplatTreeCL::command_type), &hStart[0]);
+    cl::Buffer dCommands(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                         hCommands.size() * sizeof(SplatTreeCL::command_type), &hCommands[0]);
+
+    cl::Buffer dBuffer[2];
+    cl::Image2D dImage[2];
+    cl::Memory dCorners[2];
+    for (int i = 0; i < 2; i++)
+    {
+        if (storage == Marching::DISTANCE_BUFFER)
+            dCorners[i] = dBuffer[i] = cl::Buffer(context, CL_MEM_READ_WRITE, rows * swathe.rowPitch * sizeof(cl_float));
+        else
+            dCorners[i] = dImage[i] = cl::Image2D(context, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, CL_FLOAT),
+                                                  imageWidth, rows);
+    }
+
+    reference.set(offset, dSplats, dCommands, dStart, subsampling);
+    reference.enqueue(queue, dCorners[0], swathe, NULL, NULL);
+    queue.finish();
+    const std::size_t numSlices = swathe.zLast - swathe.zFirst + 1;
+    const std::vector<cl_uint> expectedSigns(reference.sliceSigns(), reference.sliceSigns() + numSlices);
+
+    scatter.set(offset, dSplats, 0, N, reference);
+    scatter.enqueue(queue, dCorners[1], swathe, NULL, NULL);
+    queue.finish();
+    const std::vector<cl_uint> actualSigns(scatter.sliceSigns(), scatter.sliceSigns() + numSlices);
+    CPPUNIT_ASSERT(expectedSigns == actualSigns);
+
+    for (Grid::size_type z = swathe.zFirst; z <= swathe.zLast; z++)
+    {
+        cl_float hCorners[2][sizeY][sizeX];
+        for (int i = 0; i < 2; i++)
+        {
+            cl::size_t<3> origin, hostOrigin, region;
+            origin[0] = 0; origin[1] = z * swathe.zStride + swathe.zBias; origin[2] = 0;
+            hostOrigin[0] = 0; hostOrigin[1] = 0; hostOrigin[2] = 0;
+            if (storage == Marching::DISTANCE_BUFFER)
+            {
+                region[0] = swathe.width * sizeof(cl_float); region[1] = swathe.height; region[2] = 1;
+                queue.enqueueReadBufferRect(dBuffer[i], CL_TRUE,
+                                            origin, hostOrigin, region,
+                                            swathe.rowPitch * sizeof(cl_float), 0,
+                                            sizeof(hCorners[i][0]), 0, &hCorners[i][0][0]);
+            }
+            else
+            {
+                region[0] = swathe.width; region[1] = swathe.height; region[2] = 1;
+                queue.enqueueReadImage(dImage[i], CL_TRUE,
+                                       origin, region, 0, 0, &hCorners[i][0][0]);
+            }
+        }
+
+        for (unsigned int y = 0; y < swathe.height; y++)
+            for (unsigned int x = 0; x < swathe.width; x++)
+                MLSGPU_ASSERT_DOUBLES_EQUAL(hCorners[0][y][x], hCorners[1][y][x], 1e-5);
+    }
+}
+
+void TestMls::testScatter()
+{
+    checkScatter(Marching::DISTANCE_IMAGE, 1024 * 1024);
+    checkScatter(Marching::DISTANCE_BUFFER, 1024 * 1024);
+    // Too small for the pairs, so it must fall back to the octree
+    checkScatter(Marching::DISTANCE_BUFFER, 16);
+}
+
+void TestMls::testValidGroupSize()
+{
+    const Grid::size_type good1[3] = {8, 8, 8};
+    const Grid::size_type good2[3] = {4, 8, 8};
+    const Grid::size_type tooBig[3] = {16, 8, 8};
+    const Grid::size_type tooSmall[3] = {4, 4, 8};
+    const Grid::size_type notPower[3] = {8, 6, 8};
+    const Grid::size_type zero[3] = {8, 0, 8};
+
+    CPPUNIT_ASSERT(MlsFunctor::validGroupSize(MlsFunctor::wgs));
+    CPPUNIT_ASSERT(MlsFunctor::validGroupSize(good1));
+    CPPUNIT_ASSERT(MlsFunctor::validGroupSize(good2));
+    CPPUNIT_ASSERT(!MlsFunctor::validGroupSize(tooBig));
+    CPPUNIT_ASSERT(!MlsFunctor::validGroupSize(tooSmall));
+    CPPUNIT_ASSERT(!MlsFunctor::validGroupSize(notPower));
+    CPPUNIT_ASSERT(!MlsFunctor::validGroupSize(zero));
+}
@@ -0,0 +1,151 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref NormalEstimator.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <cstddef>
+#include "testutil.h"
+#include "test_clh.h"
+#include "../src/normal_estimator.h"
+#include "../src/splat_tree_cl.h"
+#include "../src/splat.h"
+
+/// Tests for @ref NormalEstimator
+class TestNormalEstimator : public CLH::Test::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestNormalEstimator);
+    CPPUNIT_TEST(testTowards);
+    CPPUNIT_TEST(testAway);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /**
+     * Run the estimator over a 16×16 grid of points with spacing 0.5 in the
+     * plane z = 5.25, plus an isolated point and a point with a normal.
+     */
+    std::vector<Splat> estimate(bool towards);
+
+    void testTowards();   ///< Normals facing the viewpoint
+    void testAway();      ///< Normals facing away from the viewpoint
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestNormalEstimator, TestSet::perCommit());
+
+std::vector<Splat> TestNormalEstimator::estimate(bool towards)
+{
+    const float searchRadius = 1.2f;
+    std::vector<Splat> splats;
+    for (int y = 0; y < 16; y++)
+        for (int x = 0; x < 16; x++)
+        {
+            Splat s;
+            s.position[0] = 2.0f + 0.5f * x;
+            s.position[1] = 2.0f + 0.5f * y;
+            s.position[2] = 5.25f;
+            s.radius = searchRadius;
+            s.normal[0] = s.normal[1] = s.normal[2] = 0.0f;
+            s.quality = 1.0f;
+            splats.push_back(s);
+        }
+    // Isolated point
+    Splat isolated = splats[0];
+    isolated.position[0] = isolated.position[1] = isolated.position[2] = 14.0f;
+    splats.push_back(isolated);
+    // Point that already has a normal
+    Splat oriented = splats[0];
+    oriented.position[0] = 1.0f;
+    oriented.radius = 0.75f;
+    oriented.normal[1] = 1.0f;
+    oriented.quality = 3.0f;
+    splats.push_back(oriented);
+
+    const Grid::size_type size[3] = {16, 16, 16};
+    const Grid::difference_type offset[3] = {0, 0, 0};
+    const unsigned int subsampling = 2;
+    cl::Buffer buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                      splats.size() * sizeof(Splat), &splats[0]);
+    SplatTreeCL tree(context, device, 4, splats.size());
+
+    NormalEstimation params;
+    params.neighbours = 4;
+    params.smooth = 2.0f;
+    NormalEstimator estimator(context, params);
+    const float viewpoint[3] = {6.0f, 6.0f, 20.0f};
+    estimator.setView(viewpoint, towards, 0.1f);
+
+    cl::Event buildEvent, estimateEvent;
+    std::vector<cl::Event> wait(1);
+    tree.enqueueBuild(queue, buffer, 0, splats.size(), size, offset, subsampling, NULL, &buildEvent);
+    wait[0] = buildEvent;
+    estimator.enqueue(queue, tree, 0, splats.size(), size, offset, subsampling, &wait, &estimateEvent);
+    wait[0] = estimateEvent;
+    queue.enqueueReadBuffer(buffer, CL_TRUE, 0, splats.size() * sizeof(Splat), &splats[0], &wait);
+    return splats;
+}
+
+void TestNormalEstimator::testTowards()
+{
+    std::vector<Splat> splats = estimate(true);
+    for (int y = 0; y < 16; y++)
+        for (int x = 0; x < 16; x++)
+        {
+            const Splat &s = splats[y * 16 + x];
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0, s.normal[0], 1e-4);
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0, s.normal[1], 1e-4);
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, s.normal[2], 1e-4);
+            CPPUNIT_ASSERT(s.radius > 0.0f && s.radius <= 1.2f);
+            if (x > 0 && x < 15 && y > 0 && y < 15)
+            {
+                // Four nearest neighbours are at distance 0.5, scaled by the smoothing
+                CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, s.radius, 1e-4);
+                CPPUNIT_ASSERT_DOUBLES_EQUAL(100.0, s.quality, 1e-2);
+            }
+        }
+
+    const Splat &isolated = splats[256];
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.2, isolated.radius, 1e-4);
+    CPPUNIT_ASSERT_EQUAL(0.0f, isolated.quality);
+
+    const Splat &oriented = splats[257];
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.75, oriented.radius, 1e-4);
+    CPPUNIT_ASSERT_EQUAL(1.0f, oriented.normal[1]);
+    CPPUNIT_ASSERT_EQUAL(3.0f, oriented.quality);
+}
+
+void TestNormalEstimator::testAway()
+{
+    std::vector<Splat> splats = estimate(false);
+    for (std::size_t i = 0; i < 256; i++)
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(-1.0, splats[i].normal[2], 1e-4);
+}
@@ -0,0 +1,128 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref ScanCL.
+ */
+
+#ifndef __CL_ENABLE_EXCEPTIONS
+# define __CL_ENABLE_EXCEPTIONS
+#endif
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <cstddef>
+#include "testutil.h"
+#include "test_clh.h"
+#include "../src/scan_cl.h"
+
+/// Tests for @ref ScanCL
+class TestScanCL : public CLH::Test::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestScanCL);
+    CPPUNIT_TEST(testUint);
+    CPPUNIT_TEST(testUint2);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testRepeat);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /**
+     * Scan pseudo-random values of @a components components on the device
+     * and compare to a scan on the host.
+     */
+    void check(ScanCL &scan, unsigned int components, std::size_t elements, bool useOffset);
+
+    void testUint();    ///< Scans of @c cl_uint spanning one and several work-groups
+    void testUint2();   ///< Scans of @c cl_uint2 spanning one and several work-groups
+    void testEmpty();   ///< A scan of zero elements leaves the buffer alone
+    void testRepeat();  ///< Many calls on one instance, so that stale look-back state is ignored
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestScanCL, TestSet::perCommit());
+
+void TestScanCL::check(ScanCL &scan, unsigned int components, std::size_t elements, bool useOffset)
+{
+    std::vector<cl_uint> values(elements * components + 1);
+    cl_uint seed = 12345;
+    for (std::size_t i = 0; i < values.size(); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        values[i] = (seed >> 16) & 0xFF;
+    }
+    const cl_uint offset[2] = { 7, 1000000 };
+
+    cl::Buffer buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                      values.size() * sizeof(cl_uint), &values[0]);
+    scan.enqueue(queue, buffer, elements, useOffset ? offset : NULL);
+    std::vector<cl_uint> out(values.size());
+    queue.enqueueReadBuffer(buffer, CL_TRUE, 0, out.size() * sizeof(cl_uint), &out[0]);
+
+    for (unsigned int c = 0; c < components; c++)
+    {
+        cl_uint sum = useOffset ? offset[c] : 0;
+        for (std::size_t i = 0; i < elements; i++)
+        {
+            CPPUNIT_ASSERT_EQUAL(sum, out[i * components + c]);
+            sum += values[i * components + c];
+        }
+    }
+    // The element after the end must not be touched
+    CPPUNIT_ASSERT_EQUAL(values.back(), out.back());
+}
+
+void TestScanCL::testUint()
+{
+    ScanCL scan(context, device, 1);
+    scan.reserve(100000);
+    check(scan, 1, 1, false);
+    check(scan, 1, 1000, true);
+    check(scan, 1, 1025, false);
+    check(scan, 1, 100000, true);
+}
+
+void TestScanCL::testUint2()
+{
+    ScanCL scan(context, device, 2);
+    scan.reserve(100000);
+    check(scan, 2, 3, true);
+    check(scan, 2, 4096, false);
+    check(scan, 2, 99999, true);
+}
+
+void TestScanCL::testEmpty()
+{
+    ScanCL scan(context, device, 1);
+    check(scan, 1, 0, true);
+}
+
+void TestScanCL::testRepeat()
+{
+    ScanCL scan(context, device, 2);
+    scan.reserve(20000);
+    for (int i = 0; i < 20; i++)
+        check(scan, 2, 20000 - i * 997, i % 2);
+}
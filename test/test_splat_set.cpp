@@ -38,6 +38,8 @@
 #include <boost/foreach.hpp>
 #include <boost/iostreams/device/null.hpp>
 #include <boost/iostreams/stream.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <vector>
 #include <utility>
 #include <limits>
@@ -55,6 +57,7 @@
 #include "../src/statistics.h"
 #include "../src/fast_ply.h"
 #include "../src/allocator.h"
+#include "../src/misc.h"
 #include "test_splat_set.h"
 #include "memory_reader.h"
 #include "testutil.h"
@@ -221,6 +224,38 @@ void TestSplatToBucketsClass::testIntRounding()
     MLSGPU_ASSERT_EQUAL(2, upper[2]);
 }
 
+void TestSplatToBucketsClass::testBatch()
+{
+    const Grid::size_type bucketSizes[] = {1, 10, 64, 80, 3000017};
+    std::tr1::mt19937 engine;
+    std::tr1::uniform_real<float> posDist(-10000.0f, 10000.0f);
+    std::tr1::uniform_real<float> radiusDist(0.0f, 100.0f);
+    std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_real<float> > genPos(engine, posDist);
+    std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_real<float> > genRadius(engine, radiusDist);
+
+    // Use an odd number of splats so that the tail handling is exercised
+    std::vector<Splat> splats(37);
+    for (std::size_t i = 0; i < splats.size(); i++)
+        splats[i] = makeSplat(genPos(), genPos(), genPos(), genRadius());
+
+    for (std::size_t i = 0; i < sizeof(bucketSizes) / sizeof(bucketSizes[0]); i++)
+    {
+        SplatSet::detail::SplatToBuckets s2b(0.37f, bucketSizes[i]);
+        for (std::size_t n = 0; n <= splats.size(); n++)
+        {
+            std::vector<boost::array<Grid::difference_type, 3> > lower(n + 1), upper(n + 1);
+            s2b(&splats[0], n, &lower[0], &upper[0]);
+            for (std::size_t j = 0; j < n; j++)
+            {
+                boost::array<Grid::difference_type, 3> l, u;
+                s2b(splats[j], l, u);
+                CPPUNIT_ASSERT(l == lower[j]);
+                CPPUNIT_ASSERT(u == upper[j]);
+            }
+        }
+    }
+}
+
 void TestFileSet::populate(
     SplatSet::FileSet &set,
     const std::vector<std::vector<Splat> > &splatData,
@@ -269,6 +304,19 @@ SplatSet::FileSet *TestFileSet::setFactory(
     return set.release();
 }
 
+SplatSet::FileSet *TestFileSetThreaded::setFactory(
+    const std::vector<std::vector<Splat> > &splatData,
+    float spacing, Grid::size_type bucketSize)
+{
+    (void) spacing;
+    (void) bucketSize;
+    std::auto_ptr<Set> set(new Set);
+    TestFileSet::populate(*set, splatData, store);
+    set->setBufferSize(16384);
+    set->setReaderThreads(3);
+    return set.release();
+}
+
 void TestSequenceSet::populate(
     SplatSet::SequenceSet<const Splat *> &set,
     const std::vector<std::vector<Splat> > &splatData,
@@ -319,6 +367,153 @@ void TestFastFileSet::testProgress()
     set->computeBlobs(2.5f, 5, &nullStream, false);
 }
 
+void TestFastFileSet::testSaveLoad()
+{
+    boost::filesystem::path index;
+    {
+        boost::filesystem::ofstream dummy;
+        createTmpFile(index, dummy);
+    }
+
+    boost::scoped_ptr<Set> orig(new Set);
+    TestFileSet::populate(*orig, splatData, store);
+    orig->computeBlobs(2.5f, 5, NULL, false);
+    orig->saveBlobs(index, "key");
+
+    boost::scoped_ptr<Set> other(new Set);
+    TestFileSet::populate(*other, splatData, store);
+    CPPUNIT_ASSERT(!other->loadBlobs(index, "other key"));
+    CPPUNIT_ASSERT(other->loadBlobs(index, "key"));
+    orig.reset();  // ensure that the loaded set does not depend on the original blob files
+
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(flatSplats.size()), other->numSplats());
+    const Grid &grid = other->getBoundingGrid();
+    CPPUNIT_ASSERT_EQUAL(2.5f, grid.getSpacing());
+
+    boost::scoped_ptr<Set> ref(new Set);
+    TestFileSet::populate(*ref, splatData, store);
+    ref->computeBlobs(2.5f, 5, NULL, false);
+    for (unsigned int i = 0; i < 3; i++)
+        CPPUNIT_ASSERT(ref->getBoundingGrid().getExtent(i) == grid.getExtent(i));
+
+    boost::scoped_ptr<SplatSet::BlobStream> expected(ref->makeBlobStream(grid, 5));
+    boost::scoped_ptr<SplatSet::BlobStream> actual(other->makeBlobStream(grid, 5));
+    while (!expected->empty())
+    {
+        CPPUNIT_ASSERT(!actual->empty());
+        const SplatSet::BlobInfo e = **expected;
+        const SplatSet::BlobInfo a = **actual;
+        CPPUNIT_ASSERT_EQUAL(e.firstSplat, a.firstSplat);
+        CPPUNIT_ASSERT_EQUAL(e.lastSplat, a.lastSplat);
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            CPPUNIT_ASSERT_EQUAL(e.lower[i], a.lower[i]);
+            CPPUNIT_ASSERT_EQUAL(e.upper[i], a.upper[i]);
+        }
+        ++*expected;
+        ++*actual;
+    }
+    CPPUNIT_ASSERT(actual->empty());
+
+    other.reset();
+    boost::filesystem::remove(index);
+    boost::filesystem::remove(index.string() + ".0");
+}
+
+void TestFastFileSet::testCacheBlobs()
+{
+    boost::scoped_ptr<Set> ref(new Set);
+    TestFileSet::populate(*ref, splatData, store);
+    ref->computeBlobs(2.5f, 5, NULL, false);
+
+    std::vector<std::string> cachedStore;
+    boost::scoped_ptr<Set> cached(new Set);
+    TestFileSet::populate(*cached, splatData, cachedStore);
+    cached->setComputeThreads(2);
+    cached->computeBlobs(2.5f, 5, NULL, false);
+    cached->cacheBlobs(std::numeric_limits<std::size_t>::max());
+
+    const Grid &grid = ref->getBoundingGrid();
+    boost::scoped_ptr<SplatSet::BlobStream> expected(ref->makeBlobStream(grid, 10));
+    boost::scoped_ptr<SplatSet::BlobStream> actual(cached->makeBlobStream(grid, 10));
+    while (!expected->empty())
+    {
+        CPPUNIT_ASSERT(!actual->empty());
+        const SplatSet::BlobInfo e = **expected;
+        const SplatSet::BlobInfo a = **actual;
+        CPPUNIT_ASSERT_EQUAL(e.firstSplat, a.firstSplat);
+        CPPUNIT_ASSERT_EQUAL(e.lastSplat, a.lastSplat);
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            CPPUNIT_ASSERT_EQUAL(e.lower[i], a.lower[i]);
+            CPPUNIT_ASSERT_EQUAL(e.upper[i], a.upper[i]);
+        }
+        ++*expected;
+        ++*actual;
+    }
+    CPPUNIT_ASSERT(actual->empty());
+}
+
+void TestFastFileSet::testIngest()
+{
+    boost::scoped_ptr<Set> ref(new Set);
+    TestFileSet::populate(*ref, splatData, store);
+    ref->computeBlobs(2.5f, 5, NULL, false);
+
+    std::vector<std::string> ingestStore;
+    boost::scoped_ptr<Set> ingested(new Set);
+    ingested->startIngest(2.5f, 5);
+    for (std::size_t i = 0; i < splatData.size(); i++)
+        if (!splatData[i].empty())
+        {
+            // Split each file in two, to check that the blobs join up
+            const std::size_t half = splatData[i].size() / 2;
+            const SplatSet::splat_id first = SplatSet::splat_id(i) << SplatSet::FileSet::scanIdShift;
+            ingested->ingest(&splatData[i][0], first, half);
+            ingested->ingest(&splatData[i][0] + half, first + half, splatData[i].size() - half);
+        }
+    TestFileSet::populate(*ingested, splatData, ingestStore);
+    ingested->finishIngest(false);
+
+    CPPUNIT_ASSERT_EQUAL(ref->numSplats(), ingested->numSplats());
+    const Grid &grid = ref->getBoundingGrid();
+    for (unsigned int i = 0; i < 3; i++)
+        CPPUNIT_ASSERT(grid.getExtent(i) == ingested->getBoundingGrid().getExtent(i));
+
+    // Blob boundaries may differ, so compare the range of each splat
+    boost::scoped_ptr<SplatSet::BlobStream> expected(ref->makeBlobStream(grid, 5));
+    boost::scoped_ptr<SplatSet::BlobStream> actual(ingested->makeBlobStream(grid, 5));
+    SplatSet::BlobInfo e, a;
+    e.firstSplat = e.lastSplat = 0;
+    a.firstSplat = a.lastSplat = 0;
+    while (true)
+    {
+        if (e.firstSplat == e.lastSplat && !expected->empty())
+        {
+            e = **expected;
+            ++*expected;
+        }
+        if (a.firstSplat == a.lastSplat && !actual->empty())
+        {
+            a = **actual;
+            ++*actual;
+        }
+        if (e.firstSplat == e.lastSplat)
+            break;
+        CPPUNIT_ASSERT(a.firstSplat < a.lastSplat);
+        CPPUNIT_ASSERT_EQUAL(e.firstSplat, a.firstSplat);
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            CPPUNIT_ASSERT_EQUAL(e.lower[i], a.lower[i]);
+            CPPUNIT_ASSERT_EQUAL(e.upper[i], a.upper[i]);
+        }
+        e.firstSplat++;
+        a.firstSplat++;
+    }
+    CPPUNIT_ASSERT(a.firstSplat == a.lastSplat);
+    CPPUNIT_ASSERT(actual->empty());
+}
+
 SplatSet::FastBlobSet<SplatSet::SequenceSet<const Splat *> > *TestFastSequenceSet::setFactory(
     const std::vector<std::vector<Splat> > &splatData,
     float spacing, Grid::size_type bucketSize)
@@ -450,3 +645,35 @@ void TestMerge::testMergeGeneral()
     };
     testMergeHelper(3, rangesA, 4, rangesB, 2, rangesExpected);
 }
+
+void TestMerge::testMergeEncodings()
+{
+    const SplatSet::splat_id rangesA[][2] =
+    {
+        { 5, 10 },                                     // single word
+        { 100000, 100010 },                            // two words: large gap
+        { 200000, 250000 },                            // two words: long range
+        { 250000 + (1 << 28) - 1, 250000 + (1 << 28) - 1 + (1 << 20) - 1 }, // two words: limits
+        { UINT64_C(1) << 30, (UINT64_C(1) << 30) + 3 }, // full: gap too large
+        { (UINT64_C(1) << 30) + 100, (UINT64_C(1) << 30) + 100 + (1 << 20) }, // full: range too long
+        { UINT64_C(1) << 40, (UINT64_C(1) << 40) + 1 },
+        { (UINT64_C(1) << 40) + 2, (UINT64_C(1) << 40) + 3 }
+    };
+    const SplatSet::splat_id rangesB[][2] =
+    {
+        { 10, 20 }
+    };
+    const SplatSet::splat_id rangesExpected[][2] =
+    {
+        { 5, 20 },
+        { 100000, 100010 },
+        { 200000, 250000 },
+        { 250000 + (1 << 28) - 1, 250000 + (1 << 28) - 1 + (1 << 20) - 1 },
+        { UINT64_C(1) << 30, (UINT64_C(1) << 30) + 3 },
+        { (UINT64_C(1) << 30) + 100, (UINT64_C(1) << 30) + 100 + (1 << 20) },
+        { UINT64_C(1) << 40, (UINT64_C(1) << 40) + 1 },
+        { (UINT64_C(1) << 40) + 2, (UINT64_C(1) << 40) + 3 }
+    };
+    testMergeHelper(8, rangesA, 1, rangesB, 8, rangesExpected);
+    testMergeHelper(1, rangesB, 8, rangesA, 8, rangesExpected);
+}
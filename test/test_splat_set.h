@@ -31,6 +31,8 @@
 # include <config.h>
 #endif
 #include <vector>
+#include <map>
+#include <utility>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include "../src/splat.h"
 #include "../src/splat_set.h"
@@ -78,6 +80,14 @@ public:
         return new MySplatStream<RangeIterator>(*this, firstRange, lastRange);
     }
 
+    std::pair<splat_id, splat_id> partition(int rank, int size) const
+    {
+        // Split on scan boundaries, which is sufficient for testing
+        splat_id first = splat_id(mulDiv(std::size_t(this->size()), rank, size)) << scanIdShift;
+        splat_id last = splat_id(mulDiv(std::size_t(this->size()), rank + 1, size)) << scanIdShift;
+        return std::make_pair(first, last);
+    }
+
 private:
     template<typename RangeIterator>
     class MySplatStream : public SplatStream
@@ -220,12 +230,14 @@ class TestSplatToBucketsClass : public CppUnit::TestFixture
     CPPUNIT_TEST(testSimple);
     CPPUNIT_TEST(testFloatRounding);
     CPPUNIT_TEST(testIntRounding);
+    CPPUNIT_TEST(testBatch);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void testSimple();          ///< Test case that tests a bit of everything
     void testFloatRounding();   ///< Test the rounding on the float operations
     void testIntRounding();     ///< Test the rounding on the integer division
+    void testBatch();           ///< Test that the batch version matches the single-splat version
 };
 
 /// Base class for testing models of @ref SplatSet::SetConcept.
@@ -275,6 +287,14 @@ protected:
     std::vector<std::vector<Splat> > splatData;
     Grid grid;                     ///< Grid for hitting the fast path
 
+    /**
+     * Check that retrieved splats match what is expected.  The @a splatIds can
+     * have any values provided that they're strictly increasing.
+     */
+    void validateSplats(const std::vector<Splat> &expected,
+                        const std::vector<Splat> &actual,
+                        const std::vector<SplatSet::splat_id> &ids);
+
 private:
     /// Captures the parameters given to the function object
     struct Entry
@@ -286,14 +306,6 @@ private:
         boost::array<Grid::difference_type, 3> upper;
     };
 
-    /**
-     * Check that retrieved splats match what is expected.  The @a splatIds can
-     * have any values provided that they're strictly increasing.
-     */
-    void validateSplats(const std::vector<Splat> &expected,
-                        const std::vector<Splat> &actual,
-                        const std::vector<SplatSet::splat_id> &ids);
-
     /// Check that retrieved blobs match what is expected
     void validateBlobs(const std::vector<Splat> &expected,
                        const std::vector<SplatSet::BlobInfo> &actual,
@@ -378,12 +390,14 @@ class TestFastBlobSet : public TestSplatSubsettable<SplatSet::FastBlobSet<BaseTy
     CPPUNIT_TEST_SUB_SUITE(TestFastBlobSet<BaseType>, BaseFixture);
     CPPUNIT_TEST(testBoundingGrid);
     CPPUNIT_TEST(testAddBlob);
+    CPPUNIT_TEST(testComputeThreads);
     CPPUNIT_TEST_SUITE_END_ABSTRACT();
 public:
     typedef typename BaseFixture::Set Set;
 
     void testBoundingGrid();         ///< Tests that the extracted bounding box is correct
     void testAddBlob();              ///< Tests the encoding of blobs
+    void testComputeThreads();       ///< Tests that splitting into ranges gives the same blobs
 };
 
 /// Tests for @ref SplatSet::FastBlobSet<SplatSet::SequenceSet<const Splat *> >.
@@ -406,6 +420,7 @@ class TestMerge : public CppUnit::TestFixture
     CPPUNIT_TEST(testMergeEmpty);
     CPPUNIT_TEST(testMergeTail);
     CPPUNIT_TEST(testMergeGeneral);
+    CPPUNIT_TEST(testMergeEncodings);
     CPPUNIT_TEST_SUITE_END();
 protected:
     void testMergeHelper(
@@ -419,6 +434,7 @@ public:
     void testMergeEmpty();     ///< Test @ref SplatSet::merge with two empty subsets
     void testMergeTail();      ///< Test @ref SplatSet::merge with tail elements in one set
     void testMergeGeneral();   ///< Miscellaneous tests for @ref SplatSet::merge.
+    void testMergeEncodings(); ///< Ranges that need each of the @ref SplatSet::SubsetBase encodings
 };
 
 /// Tests for @ref SplatSet::Subset
@@ -460,6 +476,21 @@ public:
                          std::vector<std::string> &store);
 };
 
+/// Tests for @ref SplatSet::FileSet with several reader threads
+class TestFileSetThreaded : public TestSplatSubsettable<SplatSet::FileSet>
+{
+    CPPUNIT_TEST_SUB_SUITE(TestFileSetThreaded, TestSplatSubsettable<SplatSet::FileSet>);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Backing store for PLY "files"
+    std::vector<std::string> store;
+
+protected:
+    virtual Set *setFactory(const std::vector<std::vector<Splat> > &splatData,
+                            float spacing, Grid::size_type bucketSize);
+};
+
 /// Tests for @ref SplatSet::FastBlobSet <SplatSet::FileSet>.
 class TestFastFileSet : public TestFastBlobSet<SplatSet::FileSet>
 {
@@ -469,6 +500,9 @@ class TestFastFileSet : public TestFastBlobSet<SplatSet::FileSet>
     CPPUNIT_TEST(testEmpty);
 #endif
     CPPUNIT_TEST(testProgress);
+    CPPUNIT_TEST(testSaveLoad);
+    CPPUNIT_TEST(testCacheBlobs);
+    CPPUNIT_TEST(testIngest);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -480,6 +514,9 @@ protected:
 public:
     void testEmpty();            ///< Test error checking for an empty set
     void testProgress();         ///< Run with a progress stream (does not check output)
+    void testSaveLoad();         ///< Test @ref SplatSet::FastBlobSet::saveBlobs and @ref SplatSet::FastBlobSet::loadBlobs
+    void testCacheBlobs();       ///< Test @ref SplatSet::FastBlobSet::cacheBlobs
+    void testIngest();           ///< Test @ref SplatSet::FastBlobSet::ingest against @ref SplatSet::FastBlobSet::computeBlobs
 };
 
 template<typename SetType>
@@ -606,6 +643,23 @@ void TestSplatSet<SetType>::testBlobStreamHelper(
             ++*stream;
         }
         validateBlobs(flatSplats, actual, grid, bucketSize);
+
+        // The batch interface must give the same blobs, whatever the batch size
+        for (std::size_t batchSize = 1; batchSize <= 7; batchSize += 3)
+        {
+            stream.reset(set->makeBlobStream(grid, bucketSize));
+            std::vector<SplatSet::BlobInfo> batched;
+            std::vector<SplatSet::BlobInfo> buffer(batchSize);
+            std::size_t n;
+            do
+            {
+                n = stream->read(&buffer[0], batchSize);
+                CPPUNIT_ASSERT(n <= batchSize);
+                batched.insert(batched.end(), buffer.begin(), buffer.begin() + n);
+            } while (n == batchSize);
+            CPPUNIT_ASSERT(stream->empty());
+            CPPUNIT_ASSERT(actual == batched);
+        }
     }
     else
         CPPUNIT_ASSERT(flatSplats.empty()); // some classes don't allow empty sets
@@ -811,6 +865,41 @@ void TestFastBlobSet<BaseType>::testBoundingGrid()
     CPPUNIT_ASSERT_EQUAL(40, bbox.getExtent(2).second);
 }
 
+template<typename BaseType>
+void TestFastBlobSet<BaseType>::testComputeThreads()
+{
+    const unsigned int bucketSize = 5;
+    boost::scoped_ptr<Set> set(this->setFactory(this->splatData, 2.5f, bucketSize));
+
+    /* The blobs will not be identical, since blobs cannot span ranges. Instead,
+     * compare the buckets assigned to each splat.
+     */
+    typedef std::map<SplatSet::splat_id, std::pair<boost::array<Grid::difference_type, 3>, boost::array<Grid::difference_type, 3> > > Buckets;
+    Buckets expected, actual;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1)
+        {
+            set->setComputeThreads(3);
+            set->computeBlobs(2.5f, bucketSize, NULL, false);
+        }
+        Buckets &buckets = (pass == 0) ? expected : actual;
+        boost::scoped_ptr<SplatSet::BlobStream> blobs(set->makeBlobStream(set->getBoundingGrid(), bucketSize));
+        while (!blobs->empty())
+        {
+            const SplatSet::BlobInfo blob = **blobs;
+            for (SplatSet::splat_id id = blob.firstSplat; id < blob.lastSplat; id++)
+            {
+                CPPUNIT_ASSERT(buckets.count(id) == 0);
+                buckets[id] = std::make_pair(blob.lower, blob.upper);
+            }
+            ++*blobs;
+        }
+    }
+    CPPUNIT_ASSERT(expected == actual);
+    CPPUNIT_ASSERT_EQUAL(SplatSet::splat_id(this->flatSplats.size()), set->numSplats());
+}
+
 template<typename BaseType>
 void TestFastBlobSet<BaseType>::testAddBlob()
 {
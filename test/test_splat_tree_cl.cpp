@@ -37,6 +37,8 @@
 #include <cstddef>
 #include <vector>
 #include <cmath>
+#include <limits>
+#include <algorithm>
 #include "testutil.h"
 #include "test_clh.h"
 #include "test_splat_tree.h"
@@ -51,6 +53,9 @@ class TestSplatTreeCL : public TestSplatTree, public CLH::Test::Mixin
     CPPUNIT_TEST(testLevelShift);
     CPPUNIT_TEST(testPointBoxDist2);
     CPPUNIT_TEST(testMakeCode);
+    CPPUNIT_TEST(testBatch);
+    CPPUNIT_TEST(testSparse);
+    CPPUNIT_TEST(testMerge);
     CPPUNIT_TEST_SUITE_END();
 
 protected:
@@ -62,6 +67,12 @@ protected:
         int maxLevels, int subsamplingShift, std::size_t maxSplats,
         const Grid::size_type size[3], const Grid::difference_type offset[3]);
 
+    /// Whether to force the use of 64-bit codes in @ref build
+    virtual bool forceWide() const { return false; }
+
+    /// Layout in which splats are passed to the device in @ref build
+    virtual SplatLayout layout() const { return SPLAT_LAYOUT_FULL; }
+
 private:
     cl::Program octreeProgram;  ///< Program compiled from @ref octree.cl.
 
@@ -69,15 +80,56 @@ private:
     float callPointBoxDist2(float px, float py, float pz, float lx, float ly, float lz, float hx, float hy, float hz);
     int callMakeCode(cl_int x, cl_int y, cl_int z);
 
+    /// Read back the start array and commands of a tree
+    void readTree(const SplatTreeCL &tree, std::size_t root,
+                  std::vector<SplatTree::command_type> &commands,
+                  std::vector<SplatTree::command_type> &start);
+
+    /// Sorted list of splats reachable from position @a pos in @a commands
+    static std::vector<SplatTree::command_type> cellSplats(
+        const std::vector<SplatTree::command_type> &commands,
+        SplatTree::command_type pos);
+
     void testLevelShift();     ///< Test @ref levelShift in @ref octree.cl.
     void testPointBoxDist2();  ///< Test @ref pointBoxDist2 in @ref octree.cl.
     void testMakeCode();       ///< Test @ref makeCode in @ref octree.cl.
+    void testBatch();          ///< Test building several roots at once.
+    void testSparse();         ///< Test that a sparse tree matches a dense one.
+    void testMerge();          ///< Test merging of duplicate splats.
 public:
     virtual void setUp();
     virtual void tearDown();
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestSplatTreeCL, TestSet::perCommit());
 
+/// Tests for @ref SplatTreeCL using 64-bit codes
+class TestSplatTreeCLWide : public TestSplatTreeCL
+{
+    CPPUNIT_TEST_SUB_SUITE(TestSplatTreeCLWide, TestSplatTreeCL);
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    virtual bool forceWide() const { return true; }
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestSplatTreeCLWide, TestSet::perCommit());
+
+/// Tests for @ref SplatTreeCL using @ref SPLAT_LAYOUT_PACKED
+class TestSplatTreeCLPacked : public TestSplatTreeCL
+{
+    CPPUNIT_TEST_SUB_SUITE(TestSplatTreeCLPacked, TestSplatTreeCL);
+    CPPUNIT_TEST(testFloatToHalf);
+    CPPUNIT_TEST(testStoreSplats);
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    virtual SplatLayout layout() const { return SPLAT_LAYOUT_PACKED; }
+
+private:
+    void testFloatToHalf();    ///< Test @ref floatToHalf
+    void testStoreSplats();    ///< Test @ref storeSplats with @ref SPLAT_LAYOUT_PACKED
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestSplatTreeCLPacked, TestSet::perCommit());
+
 void TestSplatTreeCL::setUp()
 {
     TestSplatTree::setUp();
@@ -105,10 +157,12 @@ void TestSplatTreeCL::build(
     int maxLevels, int subsamplingShift, std::size_t maxSplats,
     const Grid::size_type size[3], const Grid::difference_type offset[3])
 {
-    SplatTreeCL tree(context, device, maxLevels, maxSplats);
+    SplatTreeCL tree(context, device, maxLevels, maxSplats, forceWide(), layout());
     std::vector<cl::Event> events(1);
+    std::vector<char> deviceSplats(splats.size() * splatDeviceSize(layout()));
+    storeSplats(layout(), &splats[0], splats.size(), &deviceSplats[0]);
     cl::Buffer splatBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                           splats.size() * sizeof(Splat), (void *) &splats[0]);
+                           deviceSplats.size(), &deviceSplats[0]);
     tree.enqueueBuild(queue, splatBuffer, 0, splats.size(), size, offset, subsamplingShift, NULL, &events[0]);
 
     std::size_t commandsSize = tree.getCommands().getInfo<CL_MEM_SIZE>();
@@ -202,3 +256,287 @@ void TestSplatTreeCL::testMakeCode()
     CPPUNIT_ASSERT_EQUAL(174, callMakeCode(2, 5, 3));
     CPPUNIT_ASSERT_EQUAL(511, callMakeCode(7, 7, 7));
 }
+
+void TestSplatTreeCL::readTree(
+    const SplatTreeCL &tree, std::size_t root,
+    std::vector<SplatTree::command_type> &commands,
+    std::vector<SplatTree::command_type> &start)
+{
+    const cl::Buffer &startBuffer = tree.getStart(root);
+    std::size_t commandsSize = tree.getCommands().getInfo<CL_MEM_SIZE>();
+    std::size_t startSize = startBuffer.getInfo<CL_MEM_SIZE>();
+    commands.resize(commandsSize / sizeof(SplatTree::command_type));
+    start.resize(startSize / sizeof(SplatTree::command_type));
+    queue.enqueueReadBuffer(tree.getCommands(), CL_TRUE, 0, commandsSize, &commands[0]);
+    queue.enqueueReadBuffer(startBuffer, CL_TRUE, 0, startSize, &start[0]);
+}
+
+std::vector<SplatTree::command_type> TestSplatTreeCL::cellSplats(
+    const std::vector<SplatTree::command_type> &commands,
+    SplatTree::command_type pos)
+{
+    std::vector<SplatTree::command_type> ans;
+    while (pos >= 0)
+    {
+        SplatTree::command_type end = commands[pos++];
+        while (pos < end)
+            ans.push_back(commands[pos++]);
+        pos = commands[end];
+    }
+    std::sort(ans.begin(), ans.end());
+    return ans;
+}
+
+void TestSplatTreeCL::testBatch()
+{
+    std::vector<Splat> splats;
+    for (int i = 0; i < 5; i++)
+    {
+        Splat s;
+        s.position[0] = 1.5f + i;
+        s.position[1] = 2.0f + 0.5f * i;
+        s.position[2] = 3.0f - 0.25f * i;
+        s.radius = 0.75f + 0.125f * i;
+        s.normal[0] = 1.0f; s.normal[1] = 0.0f; s.normal[2] = 0.0f;
+        s.quality = 1.0f;
+        splats.push_back(s);
+    }
+    // The second root uses the same splats shifted into its region
+    for (int i = 0; i < 5; i++)
+    {
+        Splat s = splats[i];
+        s.position[0] += 20.0f;
+        splats.push_back(s);
+    }
+    std::vector<char> deviceSplats(splats.size() * splatDeviceSize(layout()));
+    storeSplats(layout(), &splats[0], splats.size(), &deviceSplats[0]);
+
+    std::vector<SplatTreeCL::Root> roots(2);
+    roots[0].firstSplat = 0;
+    roots[0].numSplats = 5;
+    roots[1].firstSplat = 5;
+    roots[1].numSplats = 5;
+    for (int i = 0; i < 3; i++)
+    {
+        roots[0].size[i] = 8;
+        roots[0].offset[i] = 0;
+        roots[1].size[i] = 4;
+        roots[1].offset[i] = 0;
+    }
+    roots[1].offset[0] = 20;
+
+    SplatTreeCL tree(context, device, 4, splats.size(), forceWide(), layout());
+    CPPUNIT_ASSERT(tree.canBuild(roots, 0));
+    std::vector<cl::Event> events(1);
+    cl::Buffer splatBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                           deviceSplats.size(), &deviceSplats[0]);
+    tree.enqueueBuild(queue, splatBuffer, roots, 0, NULL, &events[0]);
+    queue.finish();
+
+    for (std::size_t r = 0; r < roots.size(); r++)
+    {
+        std::vector<SplatTree::command_type> commands, start;
+        readTree(tree, r, commands, start);
+
+        // Build the same root on its own, and compare the splats for each cell
+        SplatTreeCL single(context, device, 4, splats.size(), forceWide(), layout());
+        cl::Buffer singleBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                deviceSplats.size(), &deviceSplats[0]);
+        single.enqueueBuild(queue, singleBuffer, roots[r].firstSplat, roots[r].numSplats,
+                            roots[r].size, roots[r].offset, 0);
+        queue.finish();
+        std::vector<SplatTree::command_type> singleCommands, singleStart;
+        readTree(single, 0, singleCommands, singleStart);
+
+        for (Grid::size_type z = 0; z < roots[r].size[2]; z++)
+            for (Grid::size_type y = 0; y < roots[r].size[1]; y++)
+                for (Grid::size_type x = 0; x < roots[r].size[0]; x++)
+                {
+                    SplatTree::code_type code = SplatTree::makeCode(x, y, z);
+                    CPPUNIT_ASSERT(cellSplats(singleCommands, singleStart[code])
+                                   == cellSplats(commands, start[code]));
+                }
+    }
+}
+
+void TestSplatTreeCL::testSparse()
+{
+    std::vector<Splat> splats;
+    for (int i = 0; i < 20; i++)
+    {
+        Splat s;
+        s.position[0] = 1.5f + 0.625f * i;
+        s.position[1] = 14.0f - 0.5f * i;
+        s.position[2] = 3.0f + 0.125f * (i % 7);
+        s.radius = 0.5f + 0.75f * (i % 5);
+        s.normal[0] = 1.0f; s.normal[1] = 0.0f; s.normal[2] = 0.0f;
+        s.quality = 1.0f;
+        splats.push_back(s);
+    }
+    std::vector<char> deviceSplats(splats.size() * splatDeviceSize(layout()));
+    storeSplats(layout(), &splats[0], splats.size(), &deviceSplats[0]);
+
+    std::vector<SplatTreeCL::Root> roots(2);
+    roots[0].firstSplat = 0;
+    roots[0].numSplats = 12;
+    roots[1].firstSplat = 12;
+    roots[1].numSplats = 8;
+    for (int i = 0; i < 3; i++)
+    {
+        roots[0].size[i] = 16;
+        roots[0].offset[i] = 0;
+        roots[1].size[i] = 16;
+        roots[1].offset[i] = 0;
+    }
+    roots[1].offset[0] = 4;
+
+    SplatTreeCL tree(context, device, 6, splats.size(), forceWide(), layout(), true);
+    CPPUNIT_ASSERT(tree.isSparse());
+    cl::Buffer splatBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                           deviceSplats.size(), &deviceSplats[0]);
+    tree.enqueueBuild(queue, splatBuffer, roots, 0);
+    queue.finish();
+    CPPUNIT_ASSERT_EQUAL(std::size_t(5), tree.getNumStartLevels());
+
+    std::vector<SplatTree::command_type> commands, start;
+    readTree(tree, 0, commands, start);
+    cl_uint numCells;
+    queue.enqueueReadBuffer(tree.getNumCells(), CL_TRUE, 0, sizeof(cl_uint), &numCells);
+    CPPUNIT_ASSERT(numCells > 0 && numCells <= start.size());
+    std::vector<cl_ulong> cellKeys(numCells);
+    queue.enqueueReadBuffer(tree.getCellKeys(), CL_TRUE, 0, numCells * sizeof(cl_ulong), &cellKeys[0]);
+    for (cl_uint i = 1; i < numCells; i++)
+        CPPUNIT_ASSERT(cellKeys[i - 1] < cellKeys[i]);
+
+    for (std::size_t r = 0; r < roots.size(); r++)
+    {
+        SplatTreeCL dense(context, device, 5, splats.size(), forceWide(), layout());
+        cl::Buffer denseBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                               deviceSplats.size(), &deviceSplats[0]);
+        dense.enqueueBuild(queue, denseBuffer, roots[r].firstSplat, roots[r].numSplats,
+                           roots[r].size, roots[r].offset, 0);
+        queue.finish();
+        std::vector<SplatTree::command_type> denseCommands, denseStart;
+        readTree(dense, 0, denseCommands, denseStart);
+
+        for (Grid::size_type z = 0; z < roots[r].size[2]; z++)
+            for (Grid::size_type y = 0; y < roots[r].size[1]; y++)
+                for (Grid::size_type x = 0; x < roots[r].size[0]; x++)
+                {
+                    // Walk up the levels until an occupied cell is found
+                    SplatTree::code_type code = SplatTree::makeCode(x, y, z);
+                    cl_ulong levelOffset = tree.getRootOffset(r);
+                    SplatTree::command_type pos = -1;
+                    for (std::size_t l = 0; l < tree.getNumStartLevels(); l++)
+                    {
+                        std::vector<cl_ulong>::const_iterator p = std::lower_bound(
+                            cellKeys.begin(), cellKeys.end(), levelOffset + code);
+                        if (p != cellKeys.end() && *p == levelOffset + code)
+                        {
+                            pos = start[p - cellKeys.begin()];
+                            break;
+                        }
+                        levelOffset += cl_ulong(1) << (3 * (tree.getNumStartLevels() - 1 - l));
+                        code >>= 3;
+                    }
+                    CPPUNIT_ASSERT(cellSplats(denseCommands, denseStart[SplatTree::makeCode(x, y, z)])
+                                   == cellSplats(commands, pos));
+                }
+    }
+}
+
+void TestSplatTreeCLPacked::testFloatToHalf()
+{
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x0000), floatToHalf(0.0f));
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x8000), floatToHalf(-0.0f));
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x3C00), floatToHalf(1.0f));
+    CPPUNIT_ASSERT_EQUAL(cl_half(0xC000), floatToHalf(-2.0f));
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x3555), floatToHalf(1.0f / 3.0f));
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x7BFF), floatToHalf(65504.0f));     // largest finite
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x7C00), floatToHalf(65520.0f));     // rounds up to infinity
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x0001), floatToHalf(std::ldexp(1.0f, -24))); // smallest denormal
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x0000), floatToHalf(std::ldexp(1.0f, -25))); // ties to even
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x3C00), floatToHalf(1.0f + std::ldexp(1.0f, -11))); // ties to even
+    CPPUNIT_ASSERT_EQUAL(cl_half(0x3C02), floatToHalf(1.0f + 3 * std::ldexp(1.0f, -11))); // ties to even
+    CPPUNIT_ASSERT_EQUAL(cl_half(0xFC00), floatToHalf(-std::numeric_limits<float>::infinity()));
+    CPPUNIT_ASSERT((floatToHalf(std::numeric_limits<float>::quiet_NaN()) & 0x7FFF) > 0x7C00);
+}
+
+void TestSplatTreeCLPacked::testStoreSplats()
+{
+    Splat splat;
+    splat.position[0] = 1.0f;
+    splat.position[1] = -2.5f;
+    splat.position[2] = 1.0f / 3.0f;
+    splat.radius = 0.75f;
+    splat.normal[0] = 0.0f;
+    splat.normal[1] = 0.6f;
+    splat.normal[2] = -0.8f;
+    splat.quality = 2.0f;
+
+    PackedSplat packed[2];
+    std::vector<Splat> in(2, splat);
+    storeSplats(SPLAT_LAYOUT_PACKED, &in[0], in.size(), packed);
+    for (int i = 0; i < 2; i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(1.0f, packed[i].positionRadius[0]);
+        CPPUNIT_ASSERT_EQUAL(-2.5f, packed[i].positionRadius[1]);
+        CPPUNIT_ASSERT_EQUAL(1.0f / 3.0f, packed[i].positionRadius[2]);
+        CPPUNIT_ASSERT_EQUAL(0.75f, packed[i].positionRadius[3]);
+        CPPUNIT_ASSERT_EQUAL(floatToHalf(0.0f), packed[i].normalQuality[0]);
+        CPPUNIT_ASSERT_EQUAL(floatToHalf(0.6f), packed[i].normalQuality[1]);
+        CPPUNIT_ASSERT_EQUAL(floatToHalf(-0.8f), packed[i].normalQuality[2]);
+        CPPUNIT_ASSERT_EQUAL(floatToHalf(2.0f), packed[i].normalQuality[3]);
+    }
+}
+
+void TestSplatTreeCL::testMerge()
+{
+    std::vector<Splat> splats(4);
+    for (int i = 0; i < 4; i++)
+    {
+        Splat &s = splats[i];
+        s.position[0] = 3.5f; s.position[1] = 4.25f; s.position[2] = 2.75f;
+        s.radius = 1.25f;
+        s.normal[0] = 0.0f; s.normal[1] = 0.0f; s.normal[2] = 1.0f;
+        s.quality = 1.0f;
+    }
+    splats[1].position[0] = 5.5f;      // too far away
+    splats[2].position[1] += 0.001f;   // duplicate of splat 0
+    splats[3].normal[2] = -1.0f;       // faces the other way
+    std::vector<char> deviceSplats(splats.size() * splatDeviceSize(layout()));
+    storeSplats(layout(), &splats[0], splats.size(), &deviceSplats[0]);
+
+    const Grid::size_type size[3] = {8, 8, 8};
+    const Grid::difference_type offset[3] = {0, 0, 0};
+    SplatTreeCL tree(context, device, 4, splats.size(), forceWide(), layout());
+    tree.setMergeTolerance(0.01f);
+    cl::Buffer splatBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                           deviceSplats.size(), &deviceSplats[0]);
+    tree.enqueueBuild(queue, splatBuffer, 0, splats.size(), size, offset, 0);
+    queue.finish();
+
+    std::vector<SplatTree::command_type> commands, start;
+    readTree(tree, 0, commands, start);
+    bool found[4] = {false, false, false, false};
+    for (Grid::size_type z = 0; z < size[2]; z++)
+        for (Grid::size_type y = 0; y < size[1]; y++)
+            for (Grid::size_type x = 0; x < size[0]; x++)
+            {
+                std::vector<SplatTree::command_type> ids = cellSplats(commands, start[SplatTree::makeCode(x, y, z)]);
+                for (std::size_t i = 0; i < ids.size(); i++)
+                    found[ids[i]] = true;
+            }
+    CPPUNIT_ASSERT(found[0]);
+    CPPUNIT_ASSERT(found[1]);
+    CPPUNIT_ASSERT(!found[2]);
+    CPPUNIT_ASSERT(found[3]);
+
+    queue.enqueueReadBuffer(splatBuffer, CL_TRUE, 0, deviceSplats.size(), &deviceSplats[0]);
+    std::vector<Splat> out(splats.size());
+    loadSplats(layout(), &deviceSplats[0], splats.size(), &out[0]);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0, out[0].quality, 1e-3);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, out[1].quality, 1e-3);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0, out[2].quality, 1e-3);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, out[3].quality, 1e-3);
+}
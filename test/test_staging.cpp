@@ -0,0 +1,171 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref staging.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include "../src/staging.h"
+#include "../src/statistics.h"
+#include "testutil.h"
+
+class TestStaging : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestStaging);
+    CPPUNIT_TEST(testRead);
+    CPPUNIT_TEST(testEvict);
+    CPPUNIT_TEST(testPrefetch);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    boost::filesystem::path dir;         ///< Temporary directory
+    boost::filesystem::path input;       ///< Input file
+    std::vector<char> content;           ///< Contents of @ref input
+
+    /// Number of staged blocks in the staging directory
+    std::size_t countStaged() const;
+
+    /// Read @a count bytes at @a offset through @a reader and compare to @ref content
+    void checkRead(const BinaryReader &reader, std::size_t offset, std::size_t count);
+
+    void testRead();        ///< Reads are correct and repeated reads hit the cache
+    void testEvict();       ///< The cache stays within its capacity
+    void testPrefetch();    ///< Hinted blocks are staged in the background
+
+public:
+    virtual void setUp();
+    virtual void tearDown();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestStaging, TestSet::perBuild());
+
+void TestStaging::setUp()
+{
+    dir = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    boost::filesystem::create_directory(dir);
+    input = dir / "input";
+    // Two and a half blocks
+    content.resize(StagingCache::blockSize * 5 / 2);
+    for (std::size_t i = 0; i < content.size(); i++)
+        content[i] = char(i * 7 + i / 4096);
+    std::ofstream out(input.string().c_str(), std::ios::binary);
+    out.write(&content[0], content.size());
+}
+
+void TestStaging::tearDown()
+{
+    boost::filesystem::remove_all(dir);
+}
+
+std::size_t TestStaging::countStaged() const
+{
+    std::size_t n = 0;
+    for (boost::filesystem::directory_iterator i(dir / "stage"); i != boost::filesystem::directory_iterator(); ++i)
+        n++;
+    return n;
+}
+
+void TestStaging::checkRead(const BinaryReader &reader, std::size_t offset, std::size_t count)
+{
+    std::vector<char> buffer(count);
+    MLSGPU_ASSERT_EQUAL(count, reader.read(&buffer[0], count, offset));
+    CPPUNIT_ASSERT(std::equal(buffer.begin(), buffer.end(), content.begin() + offset));
+}
+
+void TestStaging::testRead()
+{
+    Statistics::Counter &hits = Statistics::getStatistic<Statistics::Counter>("staging.hits");
+    Statistics::Counter &misses = Statistics::getStatistic<Statistics::Counter>("staging.misses");
+    const std::tr1::uint64_t oldHits = hits.getTotal();
+    const std::tr1::uint64_t oldMisses = misses.getTotal();
+
+    StagingCache cache(dir / "stage", StagingCache::blockSize * 4, SYSCALL_READER);
+    boost::scoped_ptr<BinaryReader> reader(cache.createReader());
+    reader->open(input);
+    MLSGPU_ASSERT_EQUAL(BinaryReader::offset_type(content.size()), reader->size());
+
+    // Spans the first two blocks
+    checkRead(*reader, StagingCache::blockSize - 100, 200);
+    MLSGPU_ASSERT_EQUAL(oldMisses + 2, misses.getTotal());
+    MLSGPU_ASSERT_EQUAL(std::size_t(2), countStaged());
+
+    checkRead(*reader, 10, 1000);
+    checkRead(*reader, StagingCache::blockSize + 5, 5);
+    MLSGPU_ASSERT_EQUAL(oldMisses + 2, misses.getTotal());
+    MLSGPU_ASSERT_EQUAL(oldHits + 2, hits.getTotal());
+
+    // The partial final block, and a read past the end
+    checkRead(*reader, content.size() - 10, 10);
+    std::vector<char> buffer(20);
+    MLSGPU_ASSERT_EQUAL(std::size_t(10), reader->read(&buffer[0], 20, content.size() - 10));
+    MLSGPU_ASSERT_EQUAL(std::size_t(0), reader->read(&buffer[0], 20, content.size()));
+    reader->close();
+}
+
+void TestStaging::testEvict()
+{
+    {
+        StagingCache cache(dir / "stage", StagingCache::blockSize, SYSCALL_READER);
+        boost::scoped_ptr<BinaryReader> reader(cache.createReader());
+        reader->open(input);
+        checkRead(*reader, 0, content.size());
+        MLSGPU_ASSERT_EQUAL(std::size_t(1), countStaged());
+        // The evicted first block is read correctly from the source
+        checkRead(*reader, 0, 100);
+        reader->close();
+    }
+    // The cache removes its blocks when it is destroyed
+    MLSGPU_ASSERT_EQUAL(std::size_t(0), countStaged());
+}
+
+void TestStaging::testPrefetch()
+{
+    Statistics::Counter &prefetched = Statistics::getStatistic<Statistics::Counter>("staging.prefetched");
+    Statistics::Counter &misses = Statistics::getStatistic<Statistics::Counter>("staging.misses");
+    const std::tr1::uint64_t oldPrefetched = prefetched.getTotal();
+
+    StagingCache cache(dir / "stage", StagingCache::blockSize * 4, SYSCALL_READER);
+    boost::scoped_ptr<BinaryReader> reader(cache.createReader());
+    reader->open(input);
+    reader->prefetch(0, content.size());
+    for (int i = 0; i < 1000 && prefetched.getTotal() < oldPrefetched + 3; i++)
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    MLSGPU_ASSERT_EQUAL(oldPrefetched + 3, prefetched.getTotal());
+
+    const std::tr1::uint64_t oldMisses = misses.getTotal();
+    checkRead(*reader, 0, content.size());
+    MLSGPU_ASSERT_EQUAL(oldMisses, misses.getTotal());
+    reader->close();
+}
@@ -36,12 +36,45 @@
 #include <typeinfo>
 #include <boost/foreach.hpp>
 #include <boost/smart_ptr/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/serialization/scoped_ptr.hpp>
 #include "../src/statistics.h"
 #include "testutil.h"
 
+namespace
+{
+
+/// Number of threads used by the threading tests
+const int NUM_THREADS = 8;
+/// Number of updates made by each thread in the threading tests
+const int THREAD_UPDATES = 10000;
+
+void addCounter(Statistics::Counter *counter)
+{
+    for (int i = 0; i < THREAD_UPDATES; i++)
+        counter->add(2);
+}
+
+void addVariable(Statistics::Variable *variable)
+{
+    for (int i = 0; i < THREAD_UPDATES; i++)
+        variable->add(1.0);
+}
+
+void addPeak(Statistics::Peak *peak)
+{
+    for (int i = 0; i < THREAD_UPDATES; i++)
+    {
+        *peak += 3;
+        *peak -= 2;
+    }
+}
+
+} // anonymous namespace
+
 /**
  * Test for the @ref Statistics::Statistic base class.
  */
@@ -77,6 +110,7 @@ class TestVariable : public TestStatistic
     CPPUNIT_TEST(testGetNumSamples);
     CPPUNIT_TEST(testStream);
     CPPUNIT_TEST(testSerialize);
+    CPPUNIT_TEST(testThreads);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -92,6 +126,7 @@ private:
     void testGetNumSamples();  ///< Test @ref Statistics::Variable::getNumSamples
     void testStream();         ///< Test stream output of @ref Statistics::Variable
     void testSerialize();      ///< Test that serialization and deserialization works
+    void testThreads();        ///< Test concurrent calls to @ref Statistics::Variable::add
 
 protected:
     virtual Statistics::Statistic *createStatistic(const std::string &name) const;
@@ -109,6 +144,7 @@ class TestCounter : public TestStatistic
     CPPUNIT_TEST(testGetTotal);
     CPPUNIT_TEST(testStream);
     CPPUNIT_TEST(testSerialize);
+    CPPUNIT_TEST(testThreads);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -118,6 +154,7 @@ private:
     void testGetTotal();       ///< Test @ref Statistics::Counter::getTotal
     void testStream();         ///< Test stream output of @ref Statistics::Counter
     void testSerialize();      ///< Test that serialization works
+    void testThreads();        ///< Test concurrent calls to @ref Statistics::Counter::add
 
 protected:
     virtual Statistics::Statistic *createStatistic(const std::string &name) const;
@@ -139,6 +176,7 @@ class TestPeak : public TestStatistic
     CPPUNIT_TEST(testStream);
     CPPUNIT_TEST(testEmpty);
     CPPUNIT_TEST(testSerialize);
+    CPPUNIT_TEST(testThreads);
     CPPUNIT_TEST_SUITE_END();
 
 private:
@@ -156,6 +194,7 @@ private:
     void testStream();   ///< Test streaming a @ref Statistics::Peak to an @c ostream
     void testEmpty();    ///< Test initial state
     void testSerialize(); ///< Test that serialization works
+    void testThreads();  ///< Test concurrent updates
 
 protected:
     virtual Statistics::Statistic *createStatistic(const std::string &name) const;
@@ -165,6 +204,65 @@ public:
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestPeak, TestSet::perBuild());
 
+class TestThroughput : public TestStatistic
+{
+    CPPUNIT_TEST_SUB_SUITE(TestThroughput, TestStatistic);
+    CPPUNIT_TEST(testAdd);
+    CPPUNIT_TEST(testRate);
+    CPPUNIT_TEST(testStream);
+    CPPUNIT_TEST(testSerialize);
+    CPPUNIT_TEST(testMerge);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Throughput fixture, with 3000 bytes transferred in 2 seconds.
+    boost::scoped_ptr<Statistics::Throughput> throughput;
+
+    void testAdd();      ///< Test @ref Statistics::Throughput::add
+    void testRate();     ///< Test @ref Statistics::Throughput::getRate
+    void testStream();   ///< Test streaming a @ref Statistics::Throughput to an @c ostream
+    void testSerialize(); ///< Test that serialization works
+    void testMerge();    ///< Test @ref Statistics::Throughput::merge
+
+protected:
+    virtual Statistics::Statistic *createStatistic(const std::string &name) const;
+
+public:
+    virtual void setUp();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestThroughput, TestSet::perBuild());
+
+/// Tests for @ref Statistics::Histogram
+class TestHistogram : public TestStatistic
+{
+    CPPUNIT_TEST_SUB_SUITE(TestHistogram, TestStatistic);
+    CPPUNIT_TEST(testAdd);
+    CPPUNIT_TEST(testPercentile);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testStream);
+    CPPUNIT_TEST(testSerialize);
+    CPPUNIT_TEST(testMerge);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Histogram fixture, with samples 1, 2, ..., 100
+    boost::scoped_ptr<Statistics::Histogram> hist;
+
+    void testAdd();        ///< Test that @ref Statistics::Histogram::add also updates the mean
+    void testPercentile(); ///< Test @ref Statistics::Histogram::getPercentile
+    void testEmpty();      ///< Test that an empty histogram throws
+    void testStream();     ///< Test streaming a @ref Statistics::Histogram to an @c ostream
+    void testSerialize();  ///< Test that serialization works
+    void testMerge();      ///< Test @ref Statistics::Histogram::merge
+
+protected:
+    virtual Statistics::Statistic *createStatistic(const std::string &name) const;
+
+public:
+    virtual void setUp();
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestHistogram, TestSet::perBuild());
+
 void TestVariable::setUp()
 {
     stat0.reset(new Statistics::Variable("stat0"));
@@ -182,6 +280,9 @@ void TestVariable::setUp()
 void TestVariable::testAdd()
 {
     // We test the add function by looking at the internal state of the fixtures
+    stat1->fold();
+    stat2->fold();
+    stat2s->fold();
     CPPUNIT_ASSERT_EQUAL(1.0, stat1->sum);
     CPPUNIT_ASSERT_EQUAL(1.0, stat1->sum2);
     CPPUNIT_ASSERT_EQUAL(1ULL, stat1->n);
@@ -278,6 +379,17 @@ void TestVariable::testSerialize()
     CPPUNIT_ASSERT_EQUAL(stat2->n, newStat->n);
 }
 
+void TestVariable::testThreads()
+{
+    boost::thread_group threads;
+    for (int i = 0; i < NUM_THREADS; i++)
+        threads.create_thread(boost::bind(addVariable, stat0.get()));
+    threads.join_all();
+    MLSGPU_ASSERT_EQUAL(NUM_THREADS * THREAD_UPDATES, stat0->getNumSamples());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, stat0->getMean(), 1e-12);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0, stat0->getVariance(), 1e-12);
+}
+
 Statistics::Statistic *TestVariable::createStatistic(const std::string &name) const
 {
     return new Statistics::Variable(name);
@@ -291,8 +403,10 @@ void TestCounter::setUp()
 
 void TestCounter::testAdd()
 {
+    counter->fold();
     MLSGPU_ASSERT_EQUAL(100, counter->total);
     counter->add(50);
+    counter->fold();
     MLSGPU_ASSERT_EQUAL(150, counter->total);
 }
 
@@ -325,6 +439,15 @@ void TestCounter::testSerialize()
     CPPUNIT_ASSERT_EQUAL(counter->total, newStat->total);
 }
 
+void TestCounter::testThreads()
+{
+    boost::thread_group threads;
+    for (int i = 0; i < NUM_THREADS; i++)
+        threads.create_thread(boost::bind(addCounter, counter.get()));
+    threads.join_all();
+    MLSGPU_ASSERT_EQUAL(100 + 2 * NUM_THREADS * THREAD_UPDATES, counter->getTotal());
+}
+
 Statistics::Statistic *TestCounter::createStatistic(const std::string &name) const
 {
     return new Statistics::Counter(name);
@@ -434,11 +557,194 @@ void TestPeak::testSerialize()
     CPPUNIT_ASSERT_EQUAL(peak->peak, newStat->peak);
 }
 
+void TestPeak::testThreads()
+{
+    boost::thread_group threads;
+    for (int i = 0; i < NUM_THREADS; i++)
+        threads.create_thread(boost::bind(addPeak, peak.get()));
+    threads.join_all();
+    MLSGPU_ASSERT_EQUAL(-100 + NUM_THREADS * THREAD_UPDATES, peak->get());
+    // The peak can exceed the final value by at most 2 per thread
+    CPPUNIT_ASSERT(peak->getMax() >= peak->get());
+    CPPUNIT_ASSERT(peak->getMax() <= peak->get() + 2 * NUM_THREADS);
+}
+
 Statistics::Statistic *TestPeak::createStatistic(const std::string &name) const
 {
     return new Statistics::Peak(name);
 }
 
+void TestThroughput::setUp()
+{
+    throughput.reset(new Statistics::Throughput("throughput"));
+    throughput->add(1000, 0.5);
+    throughput->add(2000, 1.5);
+}
+
+void TestThroughput::testAdd()
+{
+    MLSGPU_ASSERT_EQUAL(3000ULL, throughput->getBytes());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0, throughput->getTime(), 1e-12);
+}
+
+void TestThroughput::testRate()
+{
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1500.0, throughput->getRate(), 1e-9);
+
+    Statistics::Throughput empty("empty");
+    CPPUNIT_ASSERT_EQUAL(0.0, empty.getRate());
+    empty.add(100, 0.0);
+    CPPUNIT_ASSERT_EQUAL(0.0, empty.getRate());
+}
+
+void TestThroughput::testStream()
+{
+    std::ostringstream o;
+    Statistics::Throughput fast("fast");
+    fast.add(3000000000ULL, 2.0);
+    o << fast;
+    CPPUNIT_ASSERT_EQUAL(std::string("fast: 3000000000 bytes in 2 s (1.5 GB/s)"), o.str());
+
+    Statistics::Throughput empty("empty");
+    o.str("");
+    o << empty;
+    CPPUNIT_ASSERT_EQUAL(std::string("empty: 0 bytes in 0 s"), o.str());
+}
+
+void TestThroughput::testSerialize()
+{
+    std::stringstream s;
+    boost::archive::text_oarchive oa(s);
+    Statistics::Statistic *oldPtr = throughput.get();
+    oa << oldPtr;
+
+    boost::archive::text_iarchive ia(s);
+    Statistics::Statistic *newPtr;
+    ia >> newPtr;
+    boost::scoped_ptr<Statistics::Statistic> save(newPtr);
+
+    Statistics::Throughput *newStat = dynamic_cast<Statistics::Throughput *>(newPtr);
+    CPPUNIT_ASSERT(newStat != NULL);
+    MLSGPU_ASSERT_EQUAL(throughput->bytes, newStat->bytes);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(throughput->time, newStat->time, 1e-12);
+}
+
+void TestThroughput::testMerge()
+{
+    Statistics::Throughput other("throughput");
+    other.add(500, 0.5);
+    throughput->merge(other);
+    MLSGPU_ASSERT_EQUAL(3500ULL, throughput->getBytes());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.5, throughput->getTime(), 1e-12);
+}
+
+Statistics::Statistic *TestThroughput::createStatistic(const std::string &name) const
+{
+    return new Statistics::Throughput(name);
+}
+
+void TestHistogram::setUp()
+{
+    hist.reset(new Statistics::Histogram("hist"));
+    for (int i = 1; i <= 100; i++)
+        hist->add(i);
+}
+
+void TestHistogram::testAdd()
+{
+    MLSGPU_ASSERT_EQUAL(100ULL, hist->getNumSamples());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(50.5, hist->getMean(), 1e-12);
+
+    // Samples added through the base class must also be binned
+    Statistics::Variable &var = *hist;
+    var.add(1000.0);
+    CPPUNIT_ASSERT_EQUAL(1000.0, hist->getMax());
+}
+
+void TestHistogram::testPercentile()
+{
+    // Bins are about 9% wide, so the estimates are within 5%
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(50.0, hist->getPercentile(0.5), 2.5);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(90.0, hist->getPercentile(0.9), 4.5);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(99.0, hist->getPercentile(0.99), 5.0);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, hist->getPercentile(0.0), 0.05);
+    CPPUNIT_ASSERT_EQUAL(100.0, hist->getPercentile(1.0));
+    CPPUNIT_ASSERT_EQUAL(100.0, hist->getMax());
+
+    // Very small and non-positive values
+    Statistics::Histogram small("small");
+    small.add(0.0);
+    small.add(-1.0);
+    small.add(1e-6);
+    CPPUNIT_ASSERT_EQUAL(0.0, small.getPercentile(0.5));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1e-6, small.getPercentile(1.0), 5e-8);
+    CPPUNIT_ASSERT_THROW(small.getPercentile(1.5), std::invalid_argument);
+}
+
+void TestHistogram::testEmpty()
+{
+    Statistics::Histogram empty("empty");
+    CPPUNIT_ASSERT_THROW(empty.getPercentile(0.5), std::length_error);
+    CPPUNIT_ASSERT_THROW(empty.getMax(), std::length_error);
+
+    std::ostringstream o;
+    o << empty;
+    CPPUNIT_ASSERT_EQUAL(std::string("empty: [0]"), o.str());
+}
+
+void TestHistogram::testStream()
+{
+    Statistics::Histogram h("h");
+    h.add(4.0);
+    h.add(4.0);
+    std::ostringstream o;
+    o << h;
+    std::ostringstream expected;
+    expected << "h: 8 : 4 +/- 0 [2] p50 4 p90 4 p99 4 max 4";
+    CPPUNIT_ASSERT_EQUAL(expected.str(), o.str());
+}
+
+void TestHistogram::testSerialize()
+{
+    std::stringstream s;
+    boost::archive::text_oarchive oa(s);
+    Statistics::Statistic *oldPtr = hist.get();
+    oa << oldPtr;
+
+    boost::archive::text_iarchive ia(s);
+    Statistics::Statistic *newPtr;
+    ia >> newPtr;
+    boost::scoped_ptr<Statistics::Statistic> save(newPtr);
+
+    Statistics::Histogram *newStat = dynamic_cast<Statistics::Histogram *>(newPtr);
+    CPPUNIT_ASSERT(newStat != NULL);
+    MLSGPU_ASSERT_EQUAL(100ULL, newStat->getNumSamples());
+    CPPUNIT_ASSERT(hist->bins == newStat->bins);
+    MLSGPU_ASSERT_EQUAL(hist->total, newStat->total);
+    CPPUNIT_ASSERT_EQUAL(100.0, newStat->getMax());
+    CPPUNIT_ASSERT_EQUAL(hist->getPercentile(0.9), newStat->getPercentile(0.9));
+}
+
+void TestHistogram::testMerge()
+{
+    Statistics::Histogram other("hist");
+    for (int i = 0; i < 100; i++)
+        other.add(1000.0);
+    hist->merge(other);
+    MLSGPU_ASSERT_EQUAL(200ULL, hist->getNumSamples());
+    CPPUNIT_ASSERT_EQUAL(1000.0, hist->getMax());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(100.0, hist->getPercentile(0.5), 5.0);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1000.0, hist->getPercentile(0.9), 50.0);
+
+    Statistics::Variable var("var");
+    CPPUNIT_ASSERT_THROW(hist->merge(var), std::bad_cast);
+}
+
+Statistics::Statistic *TestHistogram::createStatistic(const std::string &name) const
+{
+    return new Statistics::Histogram(name);
+}
+
 class TestStatisticsRegistry : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestStatisticsRegistry);
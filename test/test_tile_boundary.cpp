@@ -0,0 +1,201 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref tile_boundary.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <string>
+#include <vector>
+#include <ios>
+#include <stdexcept>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include "../src/tile_boundary.h"
+#include "../src/misc.h"
+#include "testutil.h"
+
+using namespace TileBoundary;
+
+namespace
+{
+
+/// Make a boundary vertex
+Vertex makeVertex(std::tr1::int64_t x, std::tr1::int64_t y, std::tr1::int64_t z,
+                  std::tr1::uint32_t file, std::tr1::uint32_t index)
+{
+    Vertex v;
+    v.key[0] = x;
+    v.key[1] = y;
+    v.key[2] = z;
+    v.file = file;
+    v.index = index;
+    return v;
+}
+
+/// Make a tile with one output file per name
+Record makeTile(const std::string &name1, const std::string &name2 = "")
+{
+    Record r;
+    r.reference[0] = 1.5f;
+    r.reference[1] = -2.25f;
+    r.reference[2] = 1e-7f;
+    r.spacing = 0.1f;
+    r.files.push_back(OutputFile(name1, 0));
+    if (!name2.empty())
+        r.files.push_back(OutputFile(name2, 1234));
+    return r;
+}
+
+} // anonymous namespace
+
+class TestTileBoundary : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestTileBoundary);
+    CPPUNIT_TEST(testSaveLoad);
+    CPPUNIT_TEST(testLoadBad);
+    CPPUNIT_TEST(testStitch);
+    CPPUNIT_TEST(testStitchGrid);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testSaveLoad();      ///< Test round trip through @ref TileBoundary::Record::save
+    void testLoadBad();       ///< Test loading a file that is missing or invalid
+    void testStitch();        ///< Test matching of keys between three tiles
+    void testStitchGrid();    ///< Test that tiles on different grids are rejected
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestTileBoundary, TestSet::perBuild());
+
+void TestTileBoundary::testSaveLoad()
+{
+    boost::filesystem::path path;
+    {
+        boost::filesystem::ofstream dummy;
+        createTmpFile(path, dummy);
+    }
+    Record saved = makeTile("a file.ply", "container\n.plyc");
+    saved.vertices.push_back(makeVertex(-4, 6, 8000000000LL, 0, 5));
+    saved.vertices.push_back(makeVertex(3, 0, 1, 1, 4000000000U));
+    saved.save(path);
+
+    Record loaded;
+    loaded.load(path);
+    remove(path);
+
+    for (unsigned int i = 0; i < 3; i++)
+        CPPUNIT_ASSERT_EQUAL(saved.reference[i], loaded.reference[i]);
+    CPPUNIT_ASSERT_EQUAL(saved.spacing, loaded.spacing);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), loaded.files.size());
+    CPPUNIT_ASSERT_EQUAL(saved.files[1].filename, loaded.files[1].filename);
+    CPPUNIT_ASSERT_EQUAL(saved.files[1].offset, loaded.files[1].offset);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), loaded.vertices.size());
+    for (std::size_t i = 0; i < saved.vertices.size(); i++)
+    {
+        CPPUNIT_ASSERT(saved.vertices[i].key == loaded.vertices[i].key);
+        CPPUNIT_ASSERT_EQUAL(saved.vertices[i].file, loaded.vertices[i].file);
+        CPPUNIT_ASSERT_EQUAL(saved.vertices[i].index, loaded.vertices[i].index);
+    }
+}
+
+void TestTileBoundary::testLoadBad()
+{
+    Record r;
+    CPPUNIT_ASSERT_THROW(r.load("/this/path/does/not/exist"), std::ios::failure);
+
+    boost::filesystem::path path;
+    {
+        boost::filesystem::ofstream out;
+        createTmpFile(path, out);
+        // Refers to a file that is not listed
+        out << "mlsgpu-tile-boundary 1\n0 0 0 1\n0\n1\n0 0 0 0 0\n";
+    }
+    CPPUNIT_ASSERT_THROW(r.load(path), std::ios::failure);
+    remove(path);
+}
+
+void TestTileBoundary::testStitch()
+{
+    std::vector<Record> tiles;
+    tiles.push_back(makeTile("t0.ply"));
+    tiles.push_back(makeTile("t1_0.ply", "t1_1.ply"));
+    tiles.push_back(makeTile("t2.ply"));
+
+    // Shared by tiles 0 and 1
+    tiles[0].vertices.push_back(makeVertex(10, 3, 4, 0, 7));
+    tiles[1].vertices.push_back(makeVertex(10, 3, 4, 1, 2));
+    // Shared by all three (a corner), and by two files of tile 1
+    tiles[2].vertices.push_back(makeVertex(10, 10, 5, 0, 9));
+    tiles[1].vertices.push_back(makeVertex(10, 10, 5, 0, 1));
+    tiles[1].vertices.push_back(makeVertex(10, 10, 5, 1, 6));
+    tiles[0].vertices.push_back(makeVertex(10, 10, 5, 0, 8));
+    // Only in tile 1, although in both of its files
+    tiles[1].vertices.push_back(makeVertex(10, 7, 7, 0, 3));
+    tiles[1].vertices.push_back(makeVertex(10, 7, 7, 1, 4));
+    // Only in tile 2
+    tiles[2].vertices.push_back(makeVertex(20, 1, 1, 0, 0));
+
+    const std::vector<Weld> welds = stitch(tiles);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(4), welds.size());
+
+    // Sorted by key, so the edge vertex comes first
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), welds[0].tile[0]);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(7), welds[0].vertex[0].index);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), welds[0].tile[1]);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(1), welds[0].vertex[1].file);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(2), welds[0].vertex[1].index);
+
+    // The corner is welded to its occurrence in tile 0
+    for (std::size_t i = 1; i < 4; i++)
+    {
+        CPPUNIT_ASSERT_EQUAL(std::size_t(0), welds[i].tile[0]);
+        CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(8), welds[i].vertex[0].index);
+    }
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), welds[1].tile[1]);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(1), welds[1].vertex[1].index);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(1), welds[2].tile[1]);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(6), welds[2].vertex[1].index);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(2), welds[3].tile[1]);
+    CPPUNIT_ASSERT_EQUAL(std::tr1::uint32_t(9), welds[3].vertex[1].index);
+}
+
+void TestTileBoundary::testStitchGrid()
+{
+    std::vector<Record> tiles;
+    tiles.push_back(makeTile("t0.ply"));
+    tiles.push_back(makeTile("t1.ply"));
+    tiles[1].spacing = 0.2f;
+    CPPUNIT_ASSERT_THROW(stitch(tiles), std::runtime_error);
+
+    tiles[1] = makeTile("t1.ply");
+    tiles[1].reference[2] = 0.0f;
+    CPPUNIT_ASSERT_THROW(stitch(tiles), std::runtime_error);
+
+    tiles[1] = makeTile("t1.ply");
+    CPPUNIT_ASSERT(stitch(tiles).empty());
+}
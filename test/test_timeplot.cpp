@@ -0,0 +1,127 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref timeplot.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <sstream>
+#include <string>
+#include "../src/timeplot.h"
+#include "../src/statistics.h"
+#include "testutil.h"
+
+class TestTimeplot : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestTimeplot);
+    CPPUNIT_TEST(testCategories);
+    CPPUNIT_TEST(testIdle);
+    CPPUNIT_TEST(testReport);
+    CPPUNIT_TEST(testReportEmpty);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    void testCategories();   ///< Test that leaf action times are attributed to the stage statistics
+    void testIdle();         ///< Test that a worker with no actions records nothing
+    void testReport();       ///< Test @ref Timeplot::writeBottleneckReport
+    void testReportEmpty();  ///< Test @ref Timeplot::writeBottleneckReport with no stages
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestTimeplot, TestSet::perBuild());
+
+void TestTimeplot::testCategories()
+{
+    {
+        Timeplot::Worker worker("testcategories", 3);
+        {
+            Timeplot::Action compute("compute", worker);
+            Timeplot::Action get("get", worker);
+        }
+        Timeplot::Action pop("pop", worker);
+    }
+
+    Statistics::Registry &registry = Statistics::Registry::getInstance();
+    const char * const names[] = { "lifetime", "busy", "starved", "blocked" };
+    for (int i = 0; i < 4; i++)
+    {
+        const Statistics::Variable &stat = registry.getStatistic<Statistics::Variable>(
+            std::string("timeplot.testcategories.") + names[i]);
+        CPPUNIT_ASSERT_EQUAL(1ULL, stat.getNumSamples());
+        CPPUNIT_ASSERT(stat.getMean() >= 0.0);
+    }
+    const double lifetime = registry.getStatistic<Statistics::Variable>("timeplot.testcategories.lifetime").getMean();
+    double total = 0.0;
+    for (int i = 1; i < 4; i++)
+        total += registry.getStatistic<Statistics::Variable>(
+            std::string("timeplot.testcategories.") + names[i]).getMean();
+    CPPUNIT_ASSERT(total <= lifetime);
+}
+
+void TestTimeplot::testIdle()
+{
+    {
+        Timeplot::Worker worker("testidle");
+    }
+    Statistics::Registry &registry = Statistics::Registry::getInstance();
+    const Statistics::Variable &stat = registry.getStatistic<Statistics::Variable>("timeplot.testidle.lifetime");
+    CPPUNIT_ASSERT_EQUAL(0ULL, stat.getNumSamples());
+}
+
+void TestTimeplot::testReport()
+{
+    Statistics::Registry registry;
+    registry.getStatistic<Statistics::Variable>("timeplot.copy.lifetime").add(10.0);
+    registry.getStatistic<Statistics::Variable>("timeplot.copy.busy").add(2.5);
+    registry.getStatistic<Statistics::Variable>("timeplot.copy.starved").add(7.0);
+    registry.getStatistic<Statistics::Variable>("timeplot.copy.blocked").add(0.5);
+    for (int i = 0; i < 2; i++)
+    {
+        registry.getStatistic<Statistics::Variable>("timeplot.device.lifetime").add(10.0);
+        registry.getStatistic<Statistics::Variable>("timeplot.device.busy").add(9.0);
+        registry.getStatistic<Statistics::Variable>("timeplot.device.starved").add(1.0);
+        registry.getStatistic<Statistics::Variable>("timeplot.device.blocked").add(0.0);
+    }
+    registry.getStatistic<Statistics::Variable>("other.stat").add(1.0);
+
+    std::ostringstream out;
+    Timeplot::writeBottleneckReport(out, registry);
+    CPPUNIT_ASSERT_EQUAL(std::string(
+            "Pipeline stages (percentage of worker lifetime):\n"
+            "stage            workers     busy  starved  blocked\n"
+            "copy                   1    25.0%    70.0%     5.0%\n"
+            "device                 2    90.0%     5.0%     0.0%\n"
+            "Limiting stage: device (busy 90.0%)\n"), out.str());
+}
+
+void TestTimeplot::testReportEmpty()
+{
+    Statistics::Registry registry;
+    registry.getStatistic<Statistics::Variable>("other.stat").add(1.0);
+    std::ostringstream out;
+    Timeplot::writeBottleneckReport(out, registry);
+    CPPUNIT_ASSERT_EQUAL(std::string(), out.str());
+}
@@ -0,0 +1,134 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref triangle_codec.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <ios>
+#include "../src/tr1_cstdint.h"
+#include <boost/tr1/random.hpp>
+#include "../src/triangle_codec.h"
+#include "testutil.h"
+
+class TestTriangleCodec : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestTriangleCodec);
+    CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testExtremes);
+    CPPUNIT_TEST(testRandom);
+    CPPUNIT_TEST(testTruncated);
+    CPPUNIT_TEST(testTrailing);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    /// Encodes and decodes @a indices, checking that they come back unchanged
+    std::size_t roundTrip(const std::vector<std::tr1::uint32_t> &indices);
+
+public:
+    void testEmpty();           ///< No indices at all
+    void testExtremes();        ///< Largest jumps between and within the two kinds of index
+    void testRandom();          ///< Typical clump-relative indices
+    void testTruncated();       ///< Decoding from too few bytes throws
+    void testTrailing();        ///< Decoding with bytes left over throws
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestTriangleCodec, TestSet::perBuild());
+
+std::size_t TestTriangleCodec::roundTrip(const std::vector<std::tr1::uint32_t> &indices)
+{
+    const std::size_t n = indices.size();
+    std::vector<std::tr1::uint8_t> encoded(TriangleCodec::maxEncodedSize(n) + 1);
+    std::size_t bytes = TriangleCodec::encode(n, n ? &indices[0] : NULL, &encoded[0]);
+    CPPUNIT_ASSERT(bytes <= TriangleCodec::maxEncodedSize(n));
+
+    std::vector<std::tr1::uint32_t> decoded(n + 1);
+    TriangleCodec::decode(n, &encoded[0], bytes, &decoded[0]);
+    for (std::size_t i = 0; i < n; i++)
+        CPPUNIT_ASSERT_EQUAL(indices[i], decoded[i]);
+    return bytes;
+}
+
+void TestTriangleCodec::testEmpty()
+{
+    CPPUNIT_ASSERT_EQUAL(std::size_t(0), roundTrip(std::vector<std::tr1::uint32_t>()));
+}
+
+void TestTriangleCodec::testExtremes()
+{
+    std::vector<std::tr1::uint32_t> indices;
+    indices.push_back(0);
+    indices.push_back(0x7FFFFFFFU);
+    indices.push_back(0);
+    indices.push_back(0x80000000U);
+    indices.push_back(0xFFFFFFFFU);
+    indices.push_back(0x80000000U);
+    indices.push_back(0x7FFFFFFFU);
+    indices.push_back(0xFFFFFFFFU);
+    indices.push_back(1);
+    roundTrip(indices);
+}
+
+void TestTriangleCodec::testRandom()
+{
+    std::tr1::mt19937 engine;
+    std::tr1::uniform_int<std::tr1::uint32_t> genInternal(0, 2000);
+    std::tr1::uniform_int<std::tr1::uint32_t> genExternal(0, 200);
+    std::tr1::uniform_int<int> genKind(0, 9);
+
+    std::vector<std::tr1::uint32_t> indices;
+    for (int i = 0; i < 30000; i++)
+    {
+        if (genKind(engine) == 0)
+            indices.push_back(~genExternal(engine));
+        else
+            indices.push_back(genInternal(engine));
+    }
+    std::size_t bytes = roundTrip(indices);
+    // Small indices should take no more than two bytes each
+    CPPUNIT_ASSERT(bytes <= 2 * indices.size());
+}
+
+void TestTriangleCodec::testTruncated()
+{
+    std::vector<std::tr1::uint32_t> indices(3, 100000);
+    std::vector<std::tr1::uint8_t> encoded(TriangleCodec::maxEncodedSize(3));
+    std::size_t bytes = TriangleCodec::encode(3, &indices[0], &encoded[0]);
+    std::vector<std::tr1::uint32_t> decoded(4);
+    CPPUNIT_ASSERT_THROW(TriangleCodec::decode(3, &encoded[0], bytes - 1, &decoded[0]), std::ios::failure);
+    CPPUNIT_ASSERT_THROW(TriangleCodec::decode(4, &encoded[0], bytes, &decoded[0]), std::ios::failure);
+}
+
+void TestTriangleCodec::testTrailing()
+{
+    std::vector<std::tr1::uint32_t> indices(3, 5);
+    std::vector<std::tr1::uint8_t> encoded(TriangleCodec::maxEncodedSize(3));
+    std::size_t bytes = TriangleCodec::encode(3, &indices[0], &encoded[0]);
+    std::vector<std::tr1::uint32_t> decoded(3);
+    CPPUNIT_ASSERT_THROW(TriangleCodec::decode(2, &encoded[0], bytes, &decoded[0]), std::ios::failure);
+}
@@ -31,6 +31,11 @@
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <vector>
+#include <utility>
+#include <boost/bind/bind.hpp>
+#include <boost/ref.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/tr1/random.hpp>
 #include "../src/union_find.h"
 #include "testutil.h"
 
@@ -149,3 +154,98 @@ void TestUnionFind::testSize()
     CPPUNIT_ASSERT_EQUAL(1, nodes[roots[2]].size());
     CPPUNIT_ASSERT_EQUAL(1, nodes[roots[3]].size());
 }
+
+/// Tests for @ref UnionFind::Concurrent
+class TestConcurrentUnionFind : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestConcurrentUnionFind);
+    CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testThreads);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    typedef UnionFind::Concurrent::Node<int> Node;
+
+    /// Thread body for @ref testThreads that merges every <code>stride</code>th edge
+    static void mergeEdges(
+        std::vector<Node> &nodes,
+        const std::vector<std::pair<int, int> > &edges,
+        std::size_t first, std::size_t stride);
+
+public:
+    void testSimple();       ///< Test single-threaded merging and finding
+    void testThreads();      ///< Test merging from several threads against @ref UnionFind::merge
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestConcurrentUnionFind, TestSet::perBuild());
+
+void TestConcurrentUnionFind::mergeEdges(
+    std::vector<Node> &nodes,
+    const std::vector<std::pair<int, int> > &edges,
+    std::size_t first, std::size_t stride)
+{
+    for (std::size_t i = first; i < edges.size(); i += stride)
+        UnionFind::Concurrent::merge(nodes, edges[i].first, edges[i].second);
+}
+
+void TestConcurrentUnionFind::testSimple()
+{
+    std::vector<Node> nodes(9);
+    CPPUNIT_ASSERT(UnionFind::Concurrent::merge(nodes, 0, 1));
+    CPPUNIT_ASSERT(UnionFind::Concurrent::merge(nodes, 3, 2));
+    CPPUNIT_ASSERT(UnionFind::Concurrent::merge(nodes, 4, 6));
+    CPPUNIT_ASSERT(UnionFind::Concurrent::merge(nodes, 1, 3));
+    CPPUNIT_ASSERT(UnionFind::Concurrent::merge(nodes, 7, 6));
+    CPPUNIT_ASSERT(!UnionFind::Concurrent::merge(nodes, 2, 0));
+    // Components are (0, 1, 2, 3), (4, 6, 7), (5), (8)
+
+    int roots = 0;
+    for (int i = 0; i < 9; i++)
+        roots += nodes[i].isRoot();
+    CPPUNIT_ASSERT_EQUAL(4, roots);
+
+    // Roots are always the smallest index in the component
+    CPPUNIT_ASSERT_EQUAL(0, UnionFind::Concurrent::findRoot(nodes, 3));
+    CPPUNIT_ASSERT_EQUAL(0, UnionFind::Concurrent::findRoot(nodes, 2));
+    CPPUNIT_ASSERT_EQUAL(4, UnionFind::Concurrent::findRoot(nodes, 7));
+    CPPUNIT_ASSERT_EQUAL(5, UnionFind::Concurrent::findRoot(nodes, 5));
+    CPPUNIT_ASSERT_EQUAL(8, UnionFind::Concurrent::findRoot(nodes, 8));
+}
+
+void TestConcurrentUnionFind::testThreads()
+{
+    const int numNodes = 20000;
+    const int numEdges = 15000;
+    const int numThreads = 4;
+
+    std::tr1::mt19937 engine;
+    std::tr1::uniform_int<int> dist(0, numNodes - 1);
+    std::tr1::variate_generator<std::tr1::mt19937 &, std::tr1::uniform_int<int> > gen(engine, dist);
+    std::vector<std::pair<int, int> > edges;
+    for (int i = 0; i < numEdges; i++)
+        edges.push_back(std::make_pair(gen(), gen()));
+
+    std::vector<UnionFind::Node<int> > expected(numNodes);
+    for (int i = 0; i < numEdges; i++)
+        UnionFind::merge(expected, edges[i].first, edges[i].second);
+
+    std::vector<Node> nodes(numNodes);
+    boost::thread_group threads;
+    for (int i = 0; i < numThreads; i++)
+        threads.create_thread(boost::bind(mergeEdges, boost::ref(nodes), boost::cref(edges), i, numThreads));
+    threads.join_all();
+
+    for (int i = 0; i < numNodes; i++)
+    {
+        int e = UnionFind::findRoot(expected, i);
+        int r = UnionFind::Concurrent::findRoot(nodes, i);
+        CPPUNIT_ASSERT_EQUAL(r, UnionFind::Concurrent::findRoot(nodes, e));
+        CPPUNIT_ASSERT(r <= i);
+    }
+    int expectedRoots = 0, roots = 0;
+    for (int i = 0; i < numNodes; i++)
+    {
+        expectedRoots += expected[i].isRoot();
+        roots += nodes[i].isRoot();
+    }
+    CPPUNIT_ASSERT_EQUAL(expectedRoots, roots);
+}
@@ -0,0 +1,153 @@
+/*
+ * mlsgpu: surface reconstruction from point clouds
+ * Copyright (C) 2013  University of Cape Town
+ *
+ * This file is part of mlsgpu.
+ *
+ * mlsgpu is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file
+ *
+ * Test code for @ref vertex_cache.h.
+ */
+
+#if HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/extensions/HelperMacros.h>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <boost/array.hpp>
+#include "../src/tr1_cstdint.h"
+#include "../src/vertex_cache.h"
+#include "testutil.h"
+
+class TestVertexCache : public CppUnit::TestFixture
+{
+    CPPUNIT_TEST_SUITE(TestVertexCache);
+    CPPUNIT_TEST(testMissRatio);
+    CPPUNIT_TEST(testTipsify);
+    CPPUNIT_TEST(testTipsifySparse);
+    CPPUNIT_TEST(testRenumber);
+    CPPUNIT_TEST_SUITE_END();
+
+private:
+    typedef boost::array<std::tr1::uint32_t, 3> Triangle;
+
+    /// Triangulate an @a n by @a n grid of quads, with the triangles in a scrambled order
+    static std::vector<std::tr1::uint32_t> makeGrid(std::tr1::uint32_t n);
+
+    /// Sort the triangles, after rotating each to start at its smallest index
+    static std::vector<Triangle> canonical(const std::vector<std::tr1::uint32_t> &indices);
+
+    void testMissRatio();       ///< Test @ref VertexCache::averageMissRatio on simple cases
+    void testTipsify();         ///< Test that @ref VertexCache::tipsify permutes triangles and helps the cache
+    void testTipsifySparse();   ///< Test @ref VertexCache::tipsify with non-dense indices
+    void testRenumber();        ///< Test @ref VertexCache::renumberVertices
+};
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestVertexCache, TestSet::perBuild());
+
+std::vector<std::tr1::uint32_t> TestVertexCache::makeGrid(std::tr1::uint32_t n)
+{
+    std::vector<Triangle> tris;
+    for (std::tr1::uint32_t y = 0; y < n; y++)
+        for (std::tr1::uint32_t x = 0; x < n; x++)
+        {
+            const std::tr1::uint32_t v = y * (n + 1) + x;
+            Triangle a = {{ v, v + 1, v + n + 2 }};
+            Triangle b = {{ v, v + n + 2, v + n + 1 }};
+            tris.push_back(a);
+            tris.push_back(b);
+        }
+    // Deterministic scramble: a stride coprime to the count
+    std::vector<std::tr1::uint32_t> out;
+    const std::size_t stride = 7919;
+    for (std::size_t i = 0; i < tris.size(); i++)
+    {
+        const Triangle &t = tris[(i * stride) % tris.size()];
+        out.insert(out.end(), t.begin(), t.end());
+    }
+    return out;
+}
+
+std::vector<TestVertexCache::Triangle> TestVertexCache::canonical(const std::vector<std::tr1::uint32_t> &indices)
+{
+    std::vector<Triangle> out;
+    for (std::size_t i = 0; i < indices.size(); i += 3)
+    {
+        Triangle t = {{ indices[i], indices[i + 1], indices[i + 2] }};
+        std::rotate(t.begin(), std::min_element(t.begin(), t.end()), t.end());
+        out.push_back(t);
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
+
+void TestVertexCache::testMissRatio()
+{
+    // Two triangles sharing an edge: 4 distinct vertices
+    const std::tr1::uint32_t quad[] = { 0, 1, 2, 2, 1, 3 };
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0, VertexCache::averageMissRatio(2, quad, 16), 1e-12);
+    // With a single entry, only the repeated vertex 2 hits
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.5, VertexCache::averageMissRatio(2, quad, 1), 1e-12);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0, VertexCache::averageMissRatio(0, quad, 16), 1e-12);
+}
+
+void TestVertexCache::testTipsify()
+{
+    std::vector<std::tr1::uint32_t> indices = makeGrid(40);
+    const std::size_t numTriangles = indices.size() / 3;
+    const std::vector<Triangle> expected = canonical(indices);
+    const double before = VertexCache::averageMissRatio(numTriangles, &indices[0], 16);
+
+    VertexCache::tipsify(numTriangles, &indices[0], 16);
+    CPPUNIT_ASSERT(expected == canonical(indices));
+    const double after = VertexCache::averageMissRatio(numTriangles, &indices[0], 16);
+    CPPUNIT_ASSERT(after < before);
+    // A regular grid has 0.5 vertices per triangle; Tipsify should be well under 1
+    CPPUNIT_ASSERT(after < 1.0);
+}
+
+void TestVertexCache::testTipsifySparse()
+{
+    // Same mesh, but with external-style indices near the top of the range
+    std::vector<std::tr1::uint32_t> indices = makeGrid(10);
+    for (std::size_t i = 0; i < indices.size(); i++)
+        if (indices[i] % 3 == 0)
+            indices[i] = ~indices[i];
+    const std::vector<Triangle> expected = canonical(indices);
+    VertexCache::tipsify(indices.size() / 3, &indices[0]);
+    CPPUNIT_ASSERT(expected == canonical(indices));
+}
+
+void TestVertexCache::testRenumber()
+{
+    // Indices 10..14 are renumbered; 100 is outside the range
+    std::tr1::uint32_t indices[] = { 13, 11, 100, 11, 13, 10 };
+    std::tr1::uint32_t newIndex[5];
+    VertexCache::renumberVertices(2, indices, 10, 5, newIndex);
+
+    const std::tr1::uint32_t expectedIndices[] = { 10, 11, 100, 11, 10, 12 };
+    for (int i = 0; i < 6; i++)
+        CPPUNIT_ASSERT_EQUAL(expectedIndices[i], indices[i]);
+    // 13 -> 0, 11 -> 1, 10 -> 2, then the unused 12 and 14
+    const std::tr1::uint32_t expectedNew[] = { 2, 1, 3, 0, 4 };
+    for (int i = 0; i < 5; i++)
+        CPPUNIT_ASSERT_EQUAL(expectedNew[i], newIndex[i]);
+}
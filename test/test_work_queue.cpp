@@ -49,24 +49,47 @@ class TestWorkQueue : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestWorkQueue);
     CPPUNIT_TEST(testEmpty);
+    CPPUNIT_TEST(testTryPop);
+    CPPUNIT_TEST(testSteal);
+    CPPUNIT_TEST(testTimedPop);
+    CPPUNIT_TEST(testPriority);
     CPPUNIT_TEST(testStress);
+    CPPUNIT_TEST(testBoundedEmpty);
+    CPPUNIT_TEST(testBoundedTimedPop);
+    CPPUNIT_TEST(testBoundedStress);
     CPPUNIT_TEST_SUITE_END();
 private:
     /**
      * Adds a sequence of consecutive integers to the work queue.
      */
-    static void producerThread(WorkQueue<int> &queue, int start, int count);
+    template<typename Queue>
+    static void producerThread(Queue &queue, int start, int count);
 
     /**
      * Pulls integers from a work queue and appends them to a vector. The
      * vector is locked while adding to it. A negative value in the queue is
      * used to signal shutdown.
      */
-    static void consumerThread(WorkQueue<int> &queue, vector<int> &out, boost::mutex &mutex);
+    template<typename Queue>
+    static void consumerThread(Queue &queue, vector<int> &out, boost::mutex &mutex);
+
+    /**
+     * Pushes consecutive integers through a queue with multiple consumers and
+     * producers, and checks that each is received exactly once.
+     */
+    template<typename Queue>
+    static void stress(Queue &queue);
 
 public:
     void testEmpty();            ///< Test WorkQueue::empty
+    void testTryPop();           ///< Test WorkQueue::tryPop
+    void testSteal();            ///< Test WorkQueue::steal
+    void testTimedPop();         ///< Test WorkQueue::pop with a timeout
+    void testPriority();         ///< Test WorkQueue::setPriority
     void testStress();           ///< Stress test with multiple consumers and producers
+    void testBoundedEmpty();     ///< Test BoundedWorkQueue::empty and BoundedWorkQueue::tryPop
+    void testBoundedTimedPop();  ///< Test BoundedWorkQueue::pop with a timeout
+    void testBoundedStress();    ///< Stress test of BoundedWorkQueue, with a small capacity
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestWorkQueue, TestSet::perCommit());
 
@@ -84,13 +107,91 @@ void TestWorkQueue::testEmpty()
     CPPUNIT_ASSERT(queue.empty());
 }
 
-void TestWorkQueue::producerThread(WorkQueue<int> &queue, int start, int end)
+void TestWorkQueue::testTryPop()
+{
+    WorkQueue<int> queue;
+    int item = -1;
+    CPPUNIT_ASSERT(!queue.tryPop(item));
+    CPPUNIT_ASSERT_EQUAL(-1, item);
+    queue.push(3);
+    queue.push(4);
+    CPPUNIT_ASSERT(queue.tryPop(item));
+    CPPUNIT_ASSERT_EQUAL(3, item);
+    queue.stop();
+    CPPUNIT_ASSERT(queue.tryPop(item));
+    CPPUNIT_ASSERT_EQUAL(4, item);
+    CPPUNIT_ASSERT(!queue.tryPop(item));
+}
+
+void TestWorkQueue::testSteal()
+{
+    WorkQueue<int> queue;
+    int item = -1;
+    CPPUNIT_ASSERT(!queue.steal(item));
+    queue.push(3);
+    queue.push(4);
+    queue.push(5);
+    CPPUNIT_ASSERT(queue.steal(item));
+    CPPUNIT_ASSERT_EQUAL(5, item);
+    CPPUNIT_ASSERT_EQUAL(3, queue.pop());
+    CPPUNIT_ASSERT(queue.steal(item));
+    CPPUNIT_ASSERT_EQUAL(4, item);
+    CPPUNIT_ASSERT(queue.empty());
+}
+
+static bool lessTens(int a, int b)
+{
+    return a / 10 < b / 10;
+}
+
+void TestWorkQueue::testPriority()
+{
+    WorkQueue<int> queue;
+    int item = -1;
+    queue.setPriority(lessTens);
+    queue.push(31);
+    queue.push(12);
+    queue.push(35);
+    queue.push(17);
+    queue.push(20);
+    CPPUNIT_ASSERT_EQUAL(12, queue.pop());
+    CPPUNIT_ASSERT(queue.steal(item));
+    CPPUNIT_ASSERT_EQUAL(17, item);
+    CPPUNIT_ASSERT(queue.tryPop(item));
+    CPPUNIT_ASSERT_EQUAL(20, item);
+    CPPUNIT_ASSERT(queue.pop(item, boost::posix_time::milliseconds(10)));
+    CPPUNIT_ASSERT_EQUAL(31, item);
+
+    queue.setPriority(WorkQueue<int>::Compare());
+    queue.push(1);
+    CPPUNIT_ASSERT_EQUAL(35, queue.pop());
+    CPPUNIT_ASSERT_EQUAL(1, queue.pop());
+}
+
+void TestWorkQueue::testTimedPop()
+{
+    const boost::posix_time::time_duration timeout = boost::posix_time::milliseconds(10);
+    WorkQueue<int> queue;
+    int item = -1;
+    CPPUNIT_ASSERT(!queue.pop(item, timeout));
+    CPPUNIT_ASSERT_EQUAL(-1, item);
+    queue.push(3);
+    CPPUNIT_ASSERT(queue.pop(item, timeout));
+    CPPUNIT_ASSERT_EQUAL(3, item);
+    queue.stop();
+    CPPUNIT_ASSERT(queue.pop(item, timeout));
+    CPPUNIT_ASSERT_EQUAL(0, item);
+}
+
+template<typename Queue>
+void TestWorkQueue::producerThread(Queue &queue, int start, int end)
 {
     for (int i = start; i < end; i++)
         queue.push(i);
 }
 
-void TestWorkQueue::consumerThread(WorkQueue<int> &queue, vector<int> &out, boost::mutex &mutex)
+template<typename Queue>
+void TestWorkQueue::consumerThread(Queue &queue, vector<int> &out, boost::mutex &mutex)
 {
     int next;
     while ((next = queue.pop()) > 0)
@@ -100,7 +201,8 @@ void TestWorkQueue::consumerThread(WorkQueue<int> &queue, vector<int> &out, boos
     }
 }
 
-void TestWorkQueue::testStress()
+template<typename Queue>
+void TestWorkQueue::stress(Queue &queue)
 {
     const int numProducers = 8;
     const int numConsumers = 8;
@@ -109,19 +211,18 @@ void TestWorkQueue::testStress()
     boost::ptr_vector<boost::thread> consumers;
     vector<int> out;
     boost::mutex outMutex;
-    WorkQueue<int> queue;
 
     for (int i = 0; i < numProducers; i++)
     {
         int start = 1 + elements * i / numProducers;
         int end = 1 + elements * (i + 1) / numProducers;
         producers.push_back(new boost::thread(
-                boost::bind(&TestWorkQueue::producerThread, boost::ref(queue), start, end)));
+                boost::bind(&TestWorkQueue::producerThread<Queue>, boost::ref(queue), start, end)));
     }
     for (int i = 0; i < numConsumers; i++)
     {
         consumers.push_back(new boost::thread(
-                boost::bind(&TestWorkQueue::consumerThread,
+                boost::bind(&TestWorkQueue::consumerThread<Queue>,
                             boost::ref(queue), boost::ref(out), boost::ref(outMutex))));
     }
 
@@ -136,3 +237,54 @@ void TestWorkQueue::testStress()
     for (int i = 0; i < elements; i++)
         CPPUNIT_ASSERT_EQUAL(i + 1, out[i]);
 }
+
+void TestWorkQueue::testStress()
+{
+    WorkQueue<int> queue;
+    stress(queue);
+}
+
+void TestWorkQueue::testBoundedEmpty()
+{
+    BoundedWorkQueue<int> queue(3);
+    CPPUNIT_ASSERT_EQUAL(std::size_t(4), queue.capacity());
+    CPPUNIT_ASSERT(queue.empty());
+    for (int i = 1; i <= 4; i++)
+        queue.push(i);
+    CPPUNIT_ASSERT(!queue.empty());
+    int item = -1;
+    CPPUNIT_ASSERT(queue.tryPop(item));
+    CPPUNIT_ASSERT_EQUAL(1, item);
+    queue.push(5);
+    for (int i = 2; i <= 5; i++)
+        CPPUNIT_ASSERT_EQUAL(i, queue.pop());
+    CPPUNIT_ASSERT(queue.empty());
+    CPPUNIT_ASSERT(!queue.tryPop(item));
+    queue.stop();
+    CPPUNIT_ASSERT(!queue.empty());
+    CPPUNIT_ASSERT_EQUAL(0, queue.pop());
+    queue.start();
+    CPPUNIT_ASSERT(queue.empty());
+}
+
+void TestWorkQueue::testBoundedTimedPop()
+{
+    const boost::posix_time::time_duration timeout = boost::posix_time::milliseconds(10);
+    BoundedWorkQueue<int> queue;
+    int item = -1;
+    CPPUNIT_ASSERT(!queue.pop(item, timeout));
+    CPPUNIT_ASSERT_EQUAL(-1, item);
+    queue.push(3);
+    CPPUNIT_ASSERT(queue.pop(item, timeout));
+    CPPUNIT_ASSERT_EQUAL(3, item);
+    queue.stop();
+    CPPUNIT_ASSERT(queue.pop(item, timeout));
+    CPPUNIT_ASSERT_EQUAL(0, item);
+}
+
+void TestWorkQueue::testBoundedStress()
+{
+    // A small capacity ensures that producers also have to block
+    BoundedWorkQueue<int> queue(16);
+    stress(queue);
+}
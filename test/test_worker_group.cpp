@@ -48,6 +48,11 @@ struct Sink
 {
     boost::mutex mutex;
     std::vector<int> values;
+    bool slow;             ///< If true, workers sleep briefly so that their items overlap
+    int active;            ///< Workers currently processing an item
+    int maxActive;         ///< Largest value seen in @ref active
+
+    Sink() : slow(false), active(0), maxActive(0) {}
 };
 
 /**
@@ -114,6 +119,17 @@ void Worker::operator()(Item &item)
 {
     CPPUNIT_ASSERT(running);
     int out = item.value * 2;
+    if (sink.slow)
+    {
+        {
+            boost::lock_guard<boost::mutex> lock(sink.mutex);
+            sink.active++;
+            sink.maxActive = std::max(sink.maxActive, sink.active);
+        }
+        boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+        boost::lock_guard<boost::mutex> lock(sink.mutex);
+        sink.active--;
+    }
     boost::lock_guard<boost::mutex> lock(sink.mutex);
     sink.values.push_back(out);
 }
@@ -143,10 +159,14 @@ class TestWorkerGroup : public CppUnit::TestFixture
 {
     CPPUNIT_TEST_SUITE(TestWorkerGroup);
     CPPUNIT_TEST(testStress);
+    CPPUNIT_TEST(testCpuBudget);
+    CPPUNIT_TEST(testElastic);
     CPPUNIT_TEST_SUITE_END();
 
 private:
     void testStress();
+    void testCpuBudget();   ///< Groups sharing a @ref CpuBudget stay within it
+    void testElastic();     ///< Waiting threads are woken by a burst, and not before
 };
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TestWorkerGroup, TestSet::perCommit());
 
@@ -171,3 +191,71 @@ void TestWorkerGroup::testStress()
         CPPUNIT_ASSERT_EQUAL(2 * i, sink.values[i]);
     }
 }
+
+void TestWorkerGroup::testCpuBudget()
+{
+    const int numbers = 40;
+    Sink sink;
+    sink.slow = true;
+    CpuBudget budget(3);
+    Group group1(sink, 4);
+    Group group2(sink, 4);
+    group1.setCpuBudget(&budget);
+    group2.setCpuBudget(&budget);
+    group1.start();
+    group2.start();
+    boost::thread producer1(Producer<Group>(0, numbers, 2, group1, 0));
+    boost::thread producer2(Producer<Group>(1, numbers, 2, group2, 1));
+    producer1.join();
+    producer2.join();
+    group1.stop();
+    group2.stop();
+
+    CPPUNIT_ASSERT_EQUAL(numbers, int(sink.values.size()));
+    CPPUNIT_ASSERT(sink.maxActive <= 3);
+    CPPUNIT_ASSERT_EQUAL(0, sink.active);
+}
+
+void TestWorkerGroup::testElastic()
+{
+    Sink sink;
+    sink.slow = true;
+    Group group(sink, 4);
+    group.setElastic(1);
+    Timeplot::Worker tworker("test.producer", 0);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        sink.values.clear();
+        sink.maxActive = 0;
+        group.start();
+        // One item at a time never backs up the queue
+        for (int i = 0; i < 5; i++)
+        {
+            boost::shared_ptr<Item> item = group.get(tworker, 1);
+            item->value = i;
+            group.push(tworker, item);
+            while (true)
+            {
+                boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+                boost::lock_guard<boost::mutex> lock(sink.mutex);
+                if (int(sink.values.size()) == i + 1)
+                    break;
+            }
+        }
+        CPPUNIT_ASSERT_EQUAL(1, sink.maxActive);
+
+        // A burst does
+        for (int i = 5; i < 45; i++)
+        {
+            boost::shared_ptr<Item> item = group.get(tworker, 1);
+            item->value = i;
+            group.push(tworker, item);
+        }
+        group.stop();
+
+        CPPUNIT_ASSERT_EQUAL(45, int(sink.values.size()));
+        CPPUNIT_ASSERT(sink.maxActive > 1);
+        CPPUNIT_ASSERT_EQUAL(0, sink.active);
+    }
+}
@@ -77,8 +77,7 @@ def main():
     groups = []
     if len(sys.argv) > 1:
         for fname in sys.argv[1:]:
-            with open(fname, 'r') as f:
-                groups.append(timeplot.load_data(f))
+            groups.append(timeplot.load_file(fname))
     else:
         groups.append(timeplot.load_data(sys.stdin))
     draw(groups)
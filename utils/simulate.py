@@ -392,8 +392,7 @@ def main():
     groups = []
     if args:
         for fname in args:
-            with open(fname, 'r') as f:
-                groups.append(timeplot.load_data(f))
+            groups.append(timeplot.load_file(fname))
     else:
         groups.append(timeplot.load_data(sys.stdin))
     if len(groups) != 1:
@@ -20,6 +20,7 @@
 
 from __future__ import division, print_function
 import re
+import struct
 
 class Action(object):
     def __init__(self, name, start, stop):
@@ -60,3 +61,48 @@ def load_data(f):
             worker.actions[-1].value = int(m.group(1))
     workers = sorted(list(workers.values()), key = lambda x: x.sort_key())
     return workers
+
+BINARY_MAGIC = b'MLSGPUTP'
+
+def load_binary_data(f):
+    """Load data written with --timeplot-binary. The magic number must
+    already have been consumed."""
+    (version,) = struct.unpack('<I', f.read(4))
+    if version != 1:
+        raise ValueError('Unsupported timeplot version {0}'.format(version))
+    names = {}
+    events = []
+    event_struct = struct.Struct('<IIIIddQ')
+    while True:
+        header = f.read(4)
+        if len(header) < 4:
+            break
+        (record_type,) = struct.unpack('<I', header)
+        if record_type == 1:
+            name_id, length = struct.unpack('<II', f.read(8))
+            names[name_id] = f.read(length).decode('utf-8')
+        elif record_type == 2:
+            events.append(event_struct.unpack(f.read(event_struct.size)))
+        else:
+            raise ValueError('Unknown record type {0}'.format(record_type))
+
+    workers = {}
+    # Names may be written after the events that use them, so resolve at the end
+    for (worker_id, action_id, has_value, pad, start_time, stop_time, value) in events:
+        worker_name = names[worker_id]
+        if worker_name not in workers:
+            workers[worker_name] = Worker(worker_name)
+        action = Action(names[action_id], start_time, stop_time)
+        if has_value:
+            action.value = value
+        workers[worker_name].actions.append(action)
+    workers = sorted(list(workers.values()), key = lambda x: x.sort_key())
+    return workers
+
+def load_file(fname):
+    """Load a timeplot file in either the text or the binary format."""
+    with open(fname, 'rb') as f:
+        if f.read(len(BINARY_MAGIC)) == BINARY_MAGIC:
+            return load_binary_data(f)
+    with open(fname, 'r') as f:
+        return load_data(f)